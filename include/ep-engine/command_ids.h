@@ -25,6 +25,11 @@
 
 /**
  * Retrieve data corresponding to a set of keys from a replica vbucket
+ *
+ * It may have 4 bytes of extras: the max staleness in milliseconds, in
+ * network byte order.  A replica further behind its active than that
+ * fails the read with PROTOCOL_BINARY_RESPONSE_ETMPFAIL, and the client
+ * can read from another replica or the active.
  */
 #define CMD_GET_REPLICA 0x83
 
@@ -44,6 +49,12 @@
 #define OBS_STATE_NOT_FOUND     0x80
 #define OBS_STATE_LOGICAL_DEL   0x81
 
+/**
+ * Flag of the one byte of extras an observe may have: don't answer while
+ * an observed key is still being persisted, up to a timeout.
+ */
+#define OBS_WAIT_PERSISTED      0x01
+
 
 #define CMD_OBSERVE           0x92
 #define CMD_EVICT_KEY         0x93
@@ -159,6 +170,92 @@
 #define ADD_RET_META 2
 #define DEL_RET_META 3
 
+/**
+ * Command to wait for a key's mutation, given by its cas, to be persisted
+ * and/or acked by a replica.  The optional extras are one byte of the
+ * flags below; without them the wait is for persistence.
+ */
+#define CMD_KEY_DURABILITY 0xb3
+
+#define KEY_DURABILITY_PERSIST   0x01
+#define KEY_DURABILITY_REPLICATE 0x02
+
+/**
+ * Command to apply a batch of setWithMeta and delWithMeta mutations of the
+ * request's vbucket, with no key or extras.  The body is the mutations, each
+ * a record of the op, its options, the key length, the flags, the
+ * expiration, the seqno, the cas and the value length followed by the key
+ * and the value.  The response is a bitmap of the mutations applied and one
+ * of those to be sent again.
+ */
+#define CMD_WITH_META_BATCH 0xb4
+
+#define WITH_META_BATCH_SET 0
+#define WITH_META_BATCH_DEL 1
+
+/**
+ * Command to ask which revisions of a batch of the request's vbucket's keys
+ * another cluster has would win their conflict resolution here, so only
+ * those need to be sent.  The body is records of CMD_WITH_META_BATCH, whose
+ * options and values are ignored.  The response is a bitmap of the
+ * revisions that would win and one of the keys to be asked about again,
+ * whose metadata is being fetched from disk.
+ */
+#define CMD_GET_META_BATCH 0xb5
+
+/**
+ * Command to apply a mutation to a part of a key's value on the server,
+ * with the request's cas if it's not 0.  The extras are the op, a reserved
+ * byte, the length of the path and the offset of a SUBDOC_PATCH, all in
+ * network byte order; the body after the key is the path and then the
+ * op's value.  The response has the new cas and, for a SUBDOC_COUNTER,
+ * the counter's value in decimal as its body.
+ */
+#define CMD_SUBDOC 0xb6
+
+//! Overwrite the bytes of the value at the offset with the op's value
+#define SUBDOC_PATCH 1
+//! Replace the JSON value at the path with the op's value
+#define SUBDOC_REPLACE 2
+//! Add the op's value, a decimal integer, to the integer at the path
+#define SUBDOC_COUNTER 3
+//! Append the op's value, a JSON value, to the array at the path
+#define SUBDOC_ARRAY_APPEND 4
+
+/**
+ * Command to read a page of the request's vbucket's keys in key order, from
+ * the request's key up to but not including an end key.  The extras are the
+ * most keys to return (0 for the server's limit) and the flags below, both
+ * in network byte order; the body after the key is the end key, empty for
+ * the end of the vbucket.  The response's body is a record of each key, of
+ * the key length, the flags, the expiration, the cas and the value length,
+ * followed by the key and, unless RANGE_SCAN_KEYS_ONLY, the value.  The
+ * response's key is the key to start the next page from, empty once the
+ * whole range was returned.
+ */
+#define CMD_RANGE_SCAN 0xb7
+
+//! Return only the keys and their metadata, not their values
+#define RANGE_SCAN_KEYS_ONLY 0x01
+
+/**
+ * Command to set the states of many vbuckets at once, with no key or
+ * extras.  The body is a record of each vbucket, of its id and its state,
+ * both in network byte order.  If a vbucket id is out of range, none of
+ * the states are changed.
+ */
+#define CMD_SET_VBUCKETS 0xb8
+
+/**
+ * Command to get a batch of keys at once, with no key or extras.  The body
+ * is a record of each key, of its vbucket and its length, both in network
+ * byte order, followed by the key.  The response's body is a record of each
+ * key in the same order, of its status, the flags, the cas and the value
+ * length, followed by the value.  A key whose value is being read from disk
+ * has the status PROTOCOL_BINARY_RESPONSE_ETMPFAIL, to be asked for again.
+ */
+#define CMD_GET_BATCH 0xb9
+
 /**
  * TAP OPAQUE command list
  */
@@ -169,6 +266,40 @@
 #define TAP_OPAQUE_COMPLETE_VB_FILTER_CHANGE 4
 #define TAP_OPAQUE_CLOSE_TAP_STREAM 7
 #define TAP_OPAQUE_CLOSE_BACKFILL 8
+#define TAP_OPAQUE_MUTATION_BATCH 9
+
+/**
+ * TAP connect flag asking the producer to pack runs of mutations and
+ * deletions of the same vbucket into TAP_OPAQUE_MUTATION_BATCH messages.
+ */
+#define TAP_CONNECT_MUTATION_BATCH 0x200
+
+/**
+ * TAP connect flag asking the producer to send only the items matching
+ * a filter on their keys, flags and expiry.  The filter follows the
+ * checkpoint ids in the userdata: the number of key prefixes (2 bytes),
+ * each prefix as its length (2) and bytes, then a flags mask (4) and the
+ * value the masked flags must have (4), and an options byte (1) where
+ * TAP_KEY_FILTER_NO_EXPIRY leaves out the items that expire.  All the
+ * numbers are in network byte order.  No prefixes means any key.
+ */
+#define TAP_CONNECT_KEY_FILTER 0x400
+
+#define TAP_KEY_FILTER_NO_EXPIRY 0x01
+
+/**
+ * TAP connect flag asking the producer to stream the changes of some
+ * vbuckets since a disk seqno, rather than backfilling them: what was
+ * persisted after the seqno is read from the vbucket file in seqno
+ * order, and the rest comes from the checkpoints in memory.  The list
+ * follows the key filter in the userdata: the number of vbuckets (2
+ * bytes), then each vbucket id (2) and seqno (8), in network byte order.
+ * The seqnos are those of the vbucket file.  If compaction may have
+ * purged deletions after a vbucket's seqno from its file, streaming it
+ * would miss them, so the producer disconnects instead, and the client
+ * has to backfill the vbucket.
+ */
+#define TAP_CONNECT_SEQNO_STREAM 0x800
 
 
 /*
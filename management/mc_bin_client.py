@@ -265,6 +265,12 @@ class MemcachedClient(object):
                             memcacheConstants.VB_STATE_NAMES[stateName])
         return self._doCmd(memcacheConstants.CMD_SET_VBUCKET_STATE, '', '', state)
 
+    def set_vbucket_states(self, vbuckets, stateName):
+        state = memcacheConstants.VB_STATE_NAMES[stateName]
+        body = ''.join(struct.pack('>HI', vb, state) for vb in vbuckets)
+        self.vbucketId = 0
+        return self._doCmd(memcacheConstants.CMD_SET_VBUCKETS, '', body)
+
     def get_vbucket_state(self, vbucket):
         assert isinstance(vbucket, int)
         self.vbucketId = vbucket
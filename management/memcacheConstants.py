@@ -80,6 +80,9 @@ CMD_TAP_CHECKPOINT_END = 0x47
 CMD_SET_VBUCKET_STATE = 0x3d
 CMD_GET_VBUCKET_STATE = 0x3e
 CMD_DELETE_VBUCKET = 0x3f
+CMD_SET_VBUCKETS = 0xb8
+
+CMD_GET_BATCH = 0xb9
 
 CMD_GET_LOCKED = 0x94
 
@@ -17,48 +17,93 @@
 
 #include "config.h"
 
+#include <sys/stat.h>
+
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include "access_scanner.h"
 #include "ep_engine.h"
+#include "kvshard.h"
+
+/**
+ * The access log of one shard's vbuckets, as a run of the scanner
+ * writes it.
+ */
+struct ShardAccessLog {
+    ShardAccessLog() : log(NULL) { }
+
+    std::string name;
+    std::string prev;
+    std::string next;
+    MutationLog *log;
+};
 
 class ItemAccessVisitor : public VBucketVisitor {
 public:
     ItemAccessVisitor(EventuallyPersistentStore &_store, EPStats &_stats,
-                      bool *sfin) :
+                      AccessScanner &as, bool append) :
         store(_store), stats(_stats), startTime(ep_real_time()),
-        stateFinalizer(sfin)
+        logs(_store.getVBuckets().getNumShards()), currentLog(NULL),
+        openFailed(false), scanner(as), delta(append)
     {
         Configuration &conf = store.getEPEngine().getConfiguration();
-        name = conf.getAlogPath();
-        prev = name + ".old";
-        next = name + ".next";
-
-        log = new MutationLog(next, conf.getAlogBlockSize());
-        assert(log != NULL);
-        log->open();
-        if (!log->isOpen()) {
-            LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to open access log: %s",
-                next.c_str());
-            delete log;
-            log = NULL;
+        for (size_t i = 0; i < logs.size(); ++i) {
+            ShardAccessLog &sl = logs[i];
+            sl.name = store.getAccessLogPath(static_cast<uint16_t>(i));
+            sl.prev = sl.name + ".old";
+            sl.next = sl.name + ".next";
+
+            // The changes go on the end of the current log; a rewrite goes
+            // to one of its own, which replaces it once it's complete.
+            const std::string &path = delta ? sl.name : sl.next;
+            sl.log = new MutationLog(path, conf.getAlogBlockSize());
+            assert(sl.log != NULL);
+            // The visit holds the hash table's locks, so it's kept clear of
+            // the writes and fsyncs of the log.
+            sl.log->setWriteBatch(conf.getAlogWriteBatch());
+            try {
+                sl.log->open();
+            } catch (MutationLog::ReadException &e) {
+                LOG(EXTENSION_LOG_WARNING, "Failed to open access log %s: %s",
+                    path.c_str(), e.what());
+            }
+            if (!sl.log->isOpen()) {
+                LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to open access log: %s",
+                    path.c_str());
+                delete sl.log;
+                sl.log = NULL;
+                openFailed = true;
+            }
         }
     }
 
     void visit(StoredValue *v) {
-        if (log != NULL && v->isResident()) {
-            if (v->isExpired(startTime) || v->isDeleted()) {
+        bool live = v->isResident() && !v->isTempItem() &&
+            !v->isDeleted() && !v->isExpired(startTime);
+        if (live) {
+            if (!delta || !v->isInAccessLog()) {
+                currentLog->newItem(currentBucket->getId(), v->getKey(),
+                                    v->getBySeqno(), v->getNRUValue());
+                v->setInAccessLog(true);
+            }
+        } else {
+            if (v->isResident() && !v->isTempItem()) {
                 LOG(EXTENSION_LOG_INFO, "INFO: Skipping expired/deleted item: %s",
                     v->getKey().c_str());
-            } else {
-                log->newItem(currentBucket->getId(), v->getKey(),
-                             v->getBySeqno());
             }
+            if (delta && v->isInAccessLog()) {
+                currentLog->delItem(currentBucket->getId(), v->getKey());
+            }
+            v->setInAccessLog(false);
         }
     }
 
     bool visitBucket(RCPtr<VBucket> &vb) {
-        if (log == NULL) {
+        KVShard *shard = store.getVBuckets().getShard(vb->getId());
+        currentLog = logs[shard->getId()].log;
+        if (currentLog == NULL) {
             return false;
         }
 
@@ -66,64 +111,165 @@ public:
     }
 
     virtual void complete() {
-        if (stateFinalizer) {
-            *stateFinalizer = true;
+        size_t added = 0;
+        size_t removed = 0;
+        for (size_t i = 0; i < logs.size(); ++i) {
+            MutationLog *log = logs[i].log;
+            if (log == NULL) {
+                continue;
+            }
+            added += log->itemsLogged[ML_NEW];
+            removed += log->itemsLogged[ML_DEL];
+            {
+                IOSlot slot(store.getIOScheduler(), IO_CLASS_BACKGROUND);
+                log->commit1();
+                log->commit2();
+            }
+            delete log;
+            logs[i].log = NULL;
         }
+        ++stats.alogRuns;
+        stats.alogRuntime.set(ep_real_time() - startTime);
 
-        if (log != NULL) {
-            size_t num_items = log->itemsLogged[ML_NEW];
-            log->commit1();
-            log->commit2();
-            delete log;
-            log = NULL;
-            ++stats.alogRuns;
-            stats.alogRuntime.set(ep_real_time() - startTime);
-            stats.alogNumItems.set(num_items);
-
-            if (num_items == 0) {
-                LOG(EXTENSION_LOG_INFO, "The new access log is empty. "
-                    "Delete it without replacing the current access log...\n");
-                remove(next.c_str());
-                return;
+        if (delta) {
+            if (openFailed) {
+                // Start over with logs of its own next time.
+                scanner.logWritten = false;
             }
+            scanner.liveEntries += added;
+            scanner.liveEntries -= std::min(removed, scanner.liveEntries);
+            scanner.logEntries += added + removed;
+            stats.alogNumItems.set(scanner.liveEntries);
+            scanner.available = true;
+            return;
+        }
 
-            if (access(prev.c_str(), F_OK) == 0 && remove(prev.c_str()) == -1) {
-                LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to remove '%s': %s",
-                    prev.c_str(), strerror(errno));
-                remove(next.c_str());
-            } else if (access(name.c_str(), F_OK) == 0 && rename(name.c_str(), prev.c_str()) == -1) {
-                LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to rename '%s' to '%s': %s",
-                    name.c_str(), prev.c_str(), strerror(errno));
-                remove(next.c_str());
-            } else if (rename(next.c_str(), name.c_str()) == -1) {
-                LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to rename '%s' to '%s': %s",
-                    next.c_str(), name.c_str(), strerror(errno));
-                remove(next.c_str());
+        stats.alogNumItems.set(added);
+        if (added == 0) {
+            LOG(EXTENSION_LOG_INFO, "The new access logs are empty. "
+                "Delete them without replacing the current access logs...\n");
+            for (size_t i = 0; i < logs.size(); ++i) {
+                remove(logs[i].next.c_str());
+            }
+        } else {
+            bool replaced = !openFailed;
+            for (size_t i = 0; i < logs.size(); ++i) {
+                replaced = replaceLog(logs[i]) && replaced;
+            }
+            if (replaced) {
+                // The next runs can append what changes to them.
+                scanner.logWritten = true;
+                scanner.liveEntries = added;
+                scanner.logEntries = added;
+                removeUnshardedLog();
             }
         }
+        scanner.available = true;
     }
 
 private:
+
+    /**
+     * Replace a shard's access log with the one this run wrote for it.
+     *
+     * @return false if it wasn't replaced
+     */
+    bool replaceLog(const ShardAccessLog &sl) {
+        const char *name = sl.name.c_str();
+        const char *prev = sl.prev.c_str();
+        const char *next = sl.next.c_str();
+        if (access(next, F_OK) != 0) {
+            // It couldn't be opened.
+            return false;
+        } else if (access(prev, F_OK) == 0 && remove(prev) == -1) {
+            LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to remove '%s': %s",
+                prev, strerror(errno));
+            remove(next);
+            return false;
+        } else if (access(name, F_OK) == 0 && rename(name, prev) == -1) {
+            LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to rename '%s' to '%s': %s",
+                name, prev, strerror(errno));
+            remove(next);
+            return false;
+        } else if (rename(next, name) == -1) {
+            LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to rename '%s' to '%s': %s",
+                next, name, strerror(errno));
+            remove(next);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Remove the single access log of all of the vbuckets that earlier
+     * versions wrote, which warmup reads only while there are no shard
+     * logs.
+     */
+    void removeUnshardedLog() {
+        Configuration &conf = store.getEPEngine().getConfiguration();
+        std::string name = conf.getAlogPath();
+        std::string prev = name + ".old";
+        remove(name.c_str());
+        remove(prev.c_str());
+    }
+
     EventuallyPersistentStore &store;
     EPStats &stats;
     rel_time_t startTime;
-    std::string prev;
-    std::string next;
-    std::string name;
 
-    MutationLog *log;
-    bool *stateFinalizer;
+    //! The logs of the shards, by shard id
+    std::vector<ShardAccessLog> logs;
+    //! The log of the vbucket being visited
+    MutationLog *currentLog;
+    //! Whether any of the logs couldn't be opened
+    bool openFailed;
+    AccessScanner &scanner;
+    bool delta;
 };
 
 AccessScanner::AccessScanner(EventuallyPersistentStore &_store, EPStats &st,
                              size_t sleeptime) :
-    store(_store), stats(st), sleepTime(sleeptime), available(true)
-{ }
+    store(_store), stats(st), sleepTime(sleeptime), available(true),
+    logWritten(false), liveEntries(0), logEntries(0)
+{
+    Configuration &conf = store.getEPEngine().getConfiguration();
+    compactorConfig.setMaxLogSize(conf.getAlogMaxSize());
+    compactorConfig.setMaxEntryRatio(conf.getAlogMaxEntryRatio());
+}
+
+bool AccessScanner::needsRewrite() {
+    Configuration &conf = store.getEPEngine().getConfiguration();
+    // Only a log this scanner wrote matches what's marked in memory as
+    // logged, which a restart or a new scanner starts over from.
+    if (!conf.isAlogIncremental() || !logWritten) {
+        return true;
+    }
+    // The shards' logs are held to the limits together.
+    size_t logSize = 0;
+    for (size_t i = 0; i < store.getVBuckets().getNumShards(); ++i) {
+        struct stat st;
+        std::string path = store.getAccessLogPath(static_cast<uint16_t>(i));
+        if (stat(path.c_str(), &st) != 0) {
+            return true;
+        }
+        logSize += st.st_size;
+    }
+    if (logSize > compactorConfig.getMaxLogSize()) {
+        return true;
+    }
+    return logEntries > compactorConfig.getMaxEntryRatio() *
+        std::max(liveEntries, static_cast<size_t>(1));
+}
 
 bool AccessScanner::callback(Dispatcher &d, TaskId &t) {
     if (available) {
         available = false;
-        shared_ptr<ItemAccessVisitor> pv(new ItemAccessVisitor(store, stats, &available));
+        bool rewrite = needsRewrite();
+        if (rewrite) {
+            logWritten = false;
+        }
+        shared_ptr<ItemAccessVisitor> pv(new ItemAccessVisitor(store, stats, *this,
+                                                               !rewrite));
         store.resetAccessScannerTasktime();
         store.visit(pv, "Item access scanner", &d, Priority::AccessScannerPriority);
     }
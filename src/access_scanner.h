@@ -25,13 +25,24 @@
 #include "common.h"
 #include "dispatcher.h"
 #include "ep_engine.h"
+#include "mutation_log.h"
 
 // Forward declaration.
 class EventuallyPersistentStore;
 class AccessScannerValueChangeListener;
+class ItemAccessVisitor;
 
+/**
+ * Writes the access logs, one of each shard's vbuckets, so that warmup
+ * can load the shards from them at the same time.  With alog_incremental
+ * set, each run after the first only appends the items that became
+ * resident or were evicted since the run before, and the logs are
+ * rewritten from scratch once they've grown past the limits of the
+ * compactor config.
+ */
 class AccessScanner : public DispatcherCallback {
     friend class AccessScannerValueChangeListener;
+    friend class ItemAccessVisitor;
 public:
     AccessScanner(EventuallyPersistentStore &_store, EPStats &st,
                   size_t sleetime);
@@ -42,8 +53,20 @@ public:
 private:
     EventuallyPersistentStore &store;
     EPStats &stats;
+    /**
+     * True if the next run has to rewrite the access log rather than
+     * append to it.
+     */
+    bool needsRewrite();
+
     size_t sleepTime;
     bool available;
+    MutationLogCompactorConfig compactorConfig;
+    //! Whether this scanner has written the log that's appended to
+    bool logWritten;
+    //! The items the log has as resident, and the entries it has
+    size_t liveEntries;
+    size_t logEntries;
 };
 
 #endif  // SRC_ACCESS_SCANNER_H_
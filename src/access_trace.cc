@@ -0,0 +1,175 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "access_trace.h"
+#include "locks.h"
+
+//! The file starts with it, padded to a record's size
+static const char TRACE_MAGIC[AccessTrace::RECORD_SIZE] = "ep_access_trace";
+
+const char *AccessTrace::magic() {
+    return TRACE_MAGIC;
+}
+
+uint64_t AccessTrace::hashKey(const std::string &key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.size(); ++i) {
+        h ^= static_cast<uint8_t>(key[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void AccessTrace::encode(const AccessTraceRecord &rec, uint8_t *buf) {
+    uint64_t hash = htonll(rec.keyHash);
+    uint32_t nbytes = htonl(rec.nbytes);
+    uint16_t vbucket = htons(rec.vbucket);
+    memcpy(buf, &hash, 8);
+    memcpy(buf + 8, &nbytes, 4);
+    memcpy(buf + 12, &vbucket, 2);
+    buf[14] = rec.op;
+    buf[15] = rec.nkey;
+}
+
+void AccessTrace::decode(const uint8_t *buf, AccessTraceRecord &rec) {
+    uint64_t hash;
+    uint32_t nbytes;
+    uint16_t vbucket;
+    memcpy(&hash, buf, 8);
+    memcpy(&nbytes, buf + 8, 4);
+    memcpy(&vbucket, buf + 12, 2);
+    rec.keyHash = ntohll(hash);
+    rec.nbytes = ntohl(nbytes);
+    rec.vbucket = ntohs(vbucket);
+    rec.op = buf[14];
+    rec.nkey = buf[15];
+}
+
+bool AccessTrace::start(const std::string &path) {
+    stop();
+    LockHolder lh(mutex);
+    int newFd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (newFd < 0) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to create the access trace %s: %s",
+            path.c_str(), strerror(errno));
+        return false;
+    }
+    fd = newFd;
+    buffer.reserve(BUFFER_RECORDS * RECORD_SIZE);
+    buffer.assign(TRACE_MAGIC, TRACE_MAGIC + RECORD_SIZE);
+    recorded.set(0);
+    enabled.set(true);
+    LOG(EXTENSION_LOG_INFO, "Recording an access trace to %s", path.c_str());
+    return true;
+}
+
+void AccessTrace::stop() {
+    LockHolder lh(mutex);
+    if (fd < 0) {
+        return;
+    }
+    enabled.set(false);
+    flushBuffer();
+    ::close(fd);
+    fd = -1;
+    LOG(EXTENSION_LOG_INFO, "Stopped the access trace after %ld ops",
+        static_cast<long>(recorded.get()));
+}
+
+void AccessTrace::doRecord(access_trace_op_t op, const std::string &key,
+                           uint16_t vbucket, size_t nbytes) {
+    AccessTraceRecord rec;
+    rec.keyHash = hashKey(key);
+    rec.nbytes = static_cast<uint32_t>(nbytes);
+    rec.vbucket = vbucket;
+    rec.op = static_cast<uint8_t>(op);
+    rec.nkey = static_cast<uint8_t>(std::min(key.size(),
+                                             static_cast<size_t>(255)));
+    uint8_t buf[RECORD_SIZE];
+    encode(rec, buf);
+
+    LockHolder lh(mutex);
+    if (fd < 0) {
+        return;
+    }
+    buffer.insert(buffer.end(), buf, buf + RECORD_SIZE);
+    ++recorded;
+    if (buffer.size() >= BUFFER_RECORDS * RECORD_SIZE) {
+        flushBuffer();
+    }
+}
+
+void AccessTrace::flushBuffer() {
+    size_t offset = 0;
+    while (offset < buffer.size()) {
+        ssize_t n = write(fd, &buffer[offset], buffer.size() - offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(EXTENSION_LOG_WARNING,
+                "Failed to write the access trace, stopping it: %s",
+                strerror(errno));
+            enabled.set(false);
+            ::close(fd);
+            fd = -1;
+            break;
+        }
+        offset += n;
+    }
+    buffer.clear();
+}
+
+bool AccessTraceReader::open(const std::string &path) {
+    close();
+    file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char head[AccessTrace::RECORD_SIZE];
+    if (fread(head, sizeof(head), 1, file) != 1 ||
+        memcmp(head, AccessTrace::magic(), sizeof(head)) != 0) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool AccessTraceReader::next(AccessTraceRecord &rec) {
+    uint8_t buf[AccessTrace::RECORD_SIZE];
+    if (file == NULL || fread(buf, sizeof(buf), 1, file) != 1) {
+        return false;
+    }
+    AccessTrace::decode(buf, rec);
+    return true;
+}
+
+void AccessTraceReader::close() {
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+}
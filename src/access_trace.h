@@ -0,0 +1,164 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_ACCESS_TRACE_H_
+#define SRC_ACCESS_TRACE_H_ 1
+
+#include "config.h"
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "mutex.h"
+
+//! The kinds of op an access trace records
+enum access_trace_op_t {
+    ACCESS_TRACE_GET = 1,
+    ACCESS_TRACE_SET = 2,
+    ACCESS_TRACE_DEL = 3
+};
+
+/**
+ * One op of an access trace.  The key is kept as a hash and a length,
+ * which is all a replay needs to tell the keys apart and to size them.
+ */
+struct AccessTraceRecord {
+    AccessTraceRecord() : keyHash(0), nbytes(0), vbucket(0), op(0), nkey(0) { }
+
+    uint64_t keyHash;
+    //! The value's size: the one stored, or the one a get found
+    uint32_t nbytes;
+    uint16_t vbucket;
+    uint8_t op;
+    //! The key's length, up to 255
+    uint8_t nkey;
+};
+
+/**
+ * Records the gets, stores and deletes of a bucket's clients to a file,
+ * sixteen bytes an op, for eviction_sim to replay offline against a hash
+ * table and the item pager's policies.
+ *
+ * The records are buffered and written out by the op that fills the
+ * buffer, so capturing costs the ops a lock and the occasional write;
+ * with no trace being written, it costs a load.
+ */
+class AccessTrace {
+public:
+    //! The records buffered before they're written out
+    static const size_t BUFFER_RECORDS = 4096;
+    //! The size of a record in the file
+    static const size_t RECORD_SIZE = 16;
+
+    AccessTrace() : fd(-1), enabled(false), recorded(0) { }
+
+    ~AccessTrace() {
+        stop();
+    }
+
+    /**
+     * Start writing a trace to a file, replacing it and any trace
+     * already being written.
+     *
+     * @return false if the file couldn't be created
+     */
+    bool start(const std::string &path);
+
+    //! Write out what's buffered and close the trace.
+    void stop();
+
+    bool isEnabled() const {
+        return enabled.get();
+    }
+
+    //! The ops recorded since the trace started
+    size_t getRecorded() const {
+        return recorded.get();
+    }
+
+    /**
+     * Record an op, if a trace is being written.
+     */
+    void record(access_trace_op_t op, const std::string &key,
+                uint16_t vbucket, size_t nbytes) {
+        if (enabled.get()) {
+            doRecord(op, key, vbucket, nbytes);
+        }
+    }
+
+    //! The 64 bit FNV-1a hash a trace keeps of a key
+    static uint64_t hashKey(const std::string &key);
+
+    //! Pack a record into RECORD_SIZE bytes in network order.
+    static void encode(const AccessTraceRecord &rec, uint8_t *buf);
+
+    //! Unpack a record packed by encode().
+    static void decode(const uint8_t *buf, AccessTraceRecord &rec);
+
+    //! The magic at the start of a trace file
+    static const char *magic();
+
+private:
+    void doRecord(access_trace_op_t op, const std::string &key,
+                  uint16_t vbucket, size_t nbytes);
+
+    //! Write out the buffer, with the mutex held.
+    void flushBuffer();
+
+    Mutex mutex;
+    int fd;
+    std::vector<uint8_t> buffer;
+    Atomic<bool> enabled;
+    Atomic<size_t> recorded;
+
+    DISALLOW_COPY_AND_ASSIGN(AccessTrace);
+};
+
+/**
+ * Reads back the records of a trace file.
+ */
+class AccessTraceReader {
+public:
+    AccessTraceReader() : file(NULL) { }
+
+    ~AccessTraceReader() {
+        close();
+    }
+
+    /**
+     * Open a trace file.
+     *
+     * @return false if it couldn't be read or isn't a trace
+     */
+    bool open(const std::string &path);
+
+    //! Read the next record, false at the end of the trace.
+    bool next(AccessTraceRecord &rec);
+
+    void close();
+
+private:
+    FILE *file;
+
+    DISALLOW_COPY_AND_ASSIGN(AccessTraceReader);
+};
+
+#endif  // SRC_ACCESS_TRACE_H_
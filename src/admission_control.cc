@@ -0,0 +1,136 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "admission_control.h"
+
+//! gethrtime() ticks in nanoseconds
+static const double NANOS_PER_SECOND = 1000000000.0;
+
+void TokenBucket::setRate(size_t r, size_t burstMs, hrtime_t now) {
+    SpinLockHolder lh(&lock);
+    capacity = static_cast<double>(r) * burstMs / 1000;
+    if (capacity < 1) {
+        capacity = 1;
+    }
+    tokens = capacity;
+    lastRefill = now;
+    rate.set(r);
+}
+
+bool TokenBucket::take(hrtime_t now) {
+    SpinLockHolder lh(&lock);
+    size_t r = rate.get();
+    if (r == 0) {
+        return true;
+    }
+    if (now > lastRefill) {
+        tokens += static_cast<double>(now - lastRefill) * r / NANOS_PER_SECOND;
+        if (tokens > capacity) {
+            tokens = capacity;
+        }
+        lastRefill = now;
+    }
+    if (tokens < 1) {
+        return false;
+    }
+    tokens -= 1;
+    return true;
+}
+
+void TokenBucket::giveBack() {
+    SpinLockHolder lh(&lock);
+    if (tokens + 1 <= capacity) {
+        tokens += 1;
+    }
+}
+
+void AdmissionControl::initialize(size_t nvbuckets) {
+    assert(vbBuckets == NULL);
+    numVBuckets = nvbuckets;
+    vbBuckets = new TokenBucket[nvbuckets];
+    setVBucketRate(vbRate.get());
+}
+
+void AdmissionControl::setOpRate(admission_op_t op, size_t rate) {
+    assert(op < ADMISSION_NUM_OPS);
+    ops[op].setRate(rate, burstMs.get(), gethrtime());
+}
+
+void AdmissionControl::setVBucketRate(size_t rate) {
+    vbRate.set(rate);
+    hrtime_t now = gethrtime();
+    for (size_t i = 0; i < numVBuckets; ++i) {
+        vbBuckets[i].setRate(rate, burstMs.get(), now);
+    }
+}
+
+void AdmissionControl::setBurst(size_t ms) {
+    burstMs.set(ms);
+    for (int i = 0; i < ADMISSION_NUM_OPS; ++i) {
+        admission_op_t op = static_cast<admission_op_t>(i);
+        setOpRate(op, ops[op].getRate());
+    }
+    setVBucketRate(vbRate.get());
+}
+
+bool AdmissionControl::admit(admission_op_t op, uint16_t vbucket) {
+    TokenBucket &opBucket = ops[op];
+    bool opLimited = opBucket.getRate() > 0;
+    bool vbLimited = vbRate.get() > 0 && vbucket < numVBuckets;
+    if (!opLimited && !vbLimited) {
+        return true;
+    }
+
+    hrtime_t now = gethrtime();
+    if (opLimited && !opBucket.take(now)) {
+        ++rejected[op];
+        return false;
+    }
+    if (vbLimited && !vbBuckets[vbucket].take(now)) {
+        if (opLimited) {
+            opBucket.giveBack();
+        }
+        ++rejected[op];
+        ++vbRejected;
+        return false;
+    }
+    ++admitted[op];
+    return true;
+}
+
+void AdmissionControl::reset() {
+    for (int i = 0; i < ADMISSION_NUM_OPS; ++i) {
+        admitted[i].set(0);
+        rejected[i].set(0);
+    }
+    vbRejected.set(0);
+}
+
+const char *AdmissionControl::opName(admission_op_t op) {
+    switch (op) {
+    case ADMISSION_GET:
+        return "get";
+    case ADMISSION_SET:
+        return "set";
+    case ADMISSION_DEL:
+        return "del";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,150 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_ADMISSION_CONTROL_H_
+#define SRC_ADMISSION_CONTROL_H_ 1
+
+#include "config.h"
+
+#include "atomic.h"
+#include "common.h"
+
+//! The kinds of client ops admission control limits separately
+enum admission_op_t {
+    ADMISSION_GET,              //!< gets
+    ADMISSION_SET,              //!< stores and incr/decr
+    ADMISSION_DEL,              //!< deletes
+    ADMISSION_NUM_OPS
+};
+
+/**
+ * A token bucket: it fills up at a rate of tokens per second, up to a
+ * burst of them, and every op admitted takes one.
+ */
+class TokenBucket {
+public:
+    TokenBucket() : rate(0), capacity(0), tokens(0), lastRefill(0) { }
+
+    /**
+     * Set the rate, and fill the bucket.
+     *
+     * @param r the tokens added per second, 0 to admit everything
+     * @param burstMs how many milliseconds' worth of tokens it holds, at
+     *                least one
+     * @param now the current time
+     */
+    void setRate(size_t r, size_t burstMs, hrtime_t now);
+
+    size_t getRate() const {
+        return rate.get();
+    }
+
+    /**
+     * Take a token.
+     *
+     * @param now the current time
+     * @return false if there are none left until it fills up again
+     */
+    bool take(hrtime_t now);
+
+    //! Give back a token taken for an op that was rejected after all.
+    void giveBack();
+
+private:
+    Atomic<size_t> rate;
+    SpinLock lock;
+    double capacity;
+    double tokens;
+    hrtime_t lastRefill;
+
+    DISALLOW_COPY_AND_ASSIGN(TokenBucket);
+};
+
+/**
+ * Limits the rates of the clients' gets, stores and deletes of a bucket,
+ * and of all the ops of any single vbucket, so a burst of one tenant's
+ * ops is turned away with ENGINE_TMPFAIL up front instead of filling the
+ * queues and the memory other tenants need.
+ *
+ * Nothing is limited by default, and an op nothing limits costs a couple
+ * of atomic reads.
+ */
+class AdmissionControl {
+public:
+    AdmissionControl() : burstMs(100), vbRate(0), numVBuckets(0),
+                         vbBuckets(NULL) { }
+
+    ~AdmissionControl() {
+        delete []vbBuckets;
+    }
+
+    //! Set the number of vbuckets the per vbucket rate applies to.
+    void initialize(size_t nvbuckets);
+
+    //! Set the ops per second of a kind admitted, 0 for unlimited.
+    void setOpRate(admission_op_t op, size_t rate);
+
+    //! Set the ops per second of every vbucket admitted, 0 for unlimited.
+    void setVBucketRate(size_t rate);
+
+    //! Set how many milliseconds' worth of ops may come in a burst.
+    void setBurst(size_t ms);
+
+    /**
+     * Admit an op, or not.
+     *
+     * @param op the kind of op
+     * @param vbucket its vbucket
+     * @return false if it's over its kind's or its vbucket's rate
+     */
+    bool admit(admission_op_t op, uint16_t vbucket);
+
+    //! The ops of a kind admitted while it or their vbucket was limited
+    size_t getAdmitted(admission_op_t op) const {
+        return admitted[op].get();
+    }
+
+    //! The ops of a kind rejected
+    size_t getRejected(admission_op_t op) const {
+        return rejected[op].get();
+    }
+
+    //! The ops rejected for their vbucket's rate
+    size_t getVBucketRejected() const {
+        return vbRejected.get();
+    }
+
+    void reset();
+
+    //! The name of a kind of op in the stats
+    static const char *opName(admission_op_t op);
+
+private:
+    TokenBucket ops[ADMISSION_NUM_OPS];
+    Atomic<size_t> admitted[ADMISSION_NUM_OPS];
+    Atomic<size_t> rejected[ADMISSION_NUM_OPS];
+    Atomic<size_t> vbRejected;
+
+    Atomic<size_t> burstMs;
+    Atomic<size_t> vbRate;
+    size_t numVBuckets;
+    TokenBucket *vbBuckets;
+
+    DISALLOW_COPY_AND_ASSIGN(AdmissionControl);
+};
+
+#endif  // SRC_ADMISSION_CONTROL_H_
@@ -19,7 +19,8 @@
 
 #include "atomic.h"
 
-SpinLock::SpinLock() : lock(0) {
+SpinLock::SpinLock() : lock(0), profile(NULL), heldSince(0),
+                       profiledHold(false) {
 }
 
 SpinLock::~SpinLock() {
@@ -27,6 +28,10 @@ SpinLock::~SpinLock() {
 }
 
 void SpinLock::acquire(void) {
+   if (profile != NULL && LockProfile::isEnabled()) {
+       profiledAcquire();
+       return;
+   }
    int spin = 0;
    while (!tryAcquire()) {
       ++spin;
@@ -36,6 +41,29 @@ void SpinLock::acquire(void) {
    }
 }
 
+void SpinLock::profiledAcquire() {
+    bool contended = false;
+    hrtime_t start = 0;
+    int spin = 0;
+    while (!tryAcquire()) {
+        if (!contended) {
+            contended = true;
+            start = gethrtime();
+        }
+        ++spin;
+        if (spin > 64) {
+            sched_yield();
+        }
+    }
+    heldSince = gethrtime();
+    profiledHold = true;
+    profile->acquired(contended, contended ? heldSince - start : 0);
+}
+
 void SpinLock::release(void) {
+    if (profiledHold) {
+        profiledHold = false;
+        profile->released(gethrtime() - heldSince);
+    }
     ep_sync_lock_release(&lock);
 }
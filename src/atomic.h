@@ -40,8 +40,6 @@
 #include "callbacks.h"
 #include "locks.h"
 
-#define MAX_THREADS 100
-
 extern "C" {
    typedef void (*ThreadLocalDestructor)(void *);
 }
@@ -232,6 +230,98 @@ private:
     volatile T value;
 };
 
+//! The slots a ShardedCounter spreads its increments over
+#define COUNTER_SLOTS 16
+//! The bytes each slot takes, so no two slots share a cache line
+#define COUNTER_SLOT_SIZE 64
+
+/**
+ * The slot of the calling thread's increments in every ShardedCounter,
+ * handed out to the threads in turn the first time each counts anything.
+ */
+inline size_t getCounterSlot() {
+    static ThreadLocal<char*> slot;
+    static Atomic<size_t> nextSlot;
+    char *p = slot.get();
+    if (p == NULL) {
+        size_t s = nextSlot++ % COUNTER_SLOTS;
+        p = reinterpret_cast<char*>(s + 1);
+        slot.set(p);
+    }
+    return reinterpret_cast<size_t>(p) - 1;
+}
+
+/**
+ * A counter whose increments are spread over slots of their own cache
+ * lines, picked by the thread making them, so that the threads counting
+ * the same thing don't all write the one line.  Reading it adds the slots
+ * up, so it's for things that are counted far more often than read.
+ *
+ * The increments don't return the count the way Atomic's do, as there's
+ * no single value to return.
+ */
+template <typename T>
+class ShardedCounter {
+public:
+
+    ShardedCounter(const T &initial = 0) {
+        set(initial);
+    }
+
+    T get() const {
+        T total = 0;
+        for (size_t i = 0; i < COUNTER_SLOTS; ++i) {
+            total += slots[i].value.get();
+        }
+        return total;
+    }
+
+    /**
+     * Set the count.  Increments made at the same time may be lost, as
+     * they may be to Atomic::set().
+     */
+    void set(const T &newValue) {
+        slots[0].value.set(newValue);
+        for (size_t i = 1; i < COUNTER_SLOTS; ++i) {
+            slots[i].value.set(0);
+        }
+    }
+
+    operator T() const {
+        return get();
+    }
+
+    void operator =(const T &newValue) {
+        set(newValue);
+    }
+
+    void operator ++() {
+        ++slots[getCounterSlot()].value;
+    }
+
+    void operator ++(int) {
+        ++slots[getCounterSlot()].value;
+    }
+
+    void operator +=(const T &increment) {
+        slots[getCounterSlot()].value += increment;
+    }
+
+    void incr(const T &increment) {
+        slots[getCounterSlot()].value += increment;
+    }
+
+private:
+    struct Slot {
+        Atomic<T> value;
+        char pad[COUNTER_SLOT_SIZE - sizeof(Atomic<T>)];
+    };
+
+    Slot slots[COUNTER_SLOTS];
+
+    DISALLOW_COPY_AND_ASSIGN(ShardedCounter);
+};
+
 /**
  * Atomic pointer.
  *
@@ -276,12 +366,25 @@ public:
     void acquire(void);
     void release(void);
 
+    /**
+     * Count this lock's acquisitions and holds in the given profile
+     * while lock profiling is on (see Mutex::setProfile()).
+     */
+    void setProfile(LockProfile *p) {
+        profile = p;
+    }
+
 private:
     bool tryAcquire() {
        return ep_sync_lock_test_and_set(&lock, 1) == 0;
     }
 
+    void profiledAcquire();
+
     volatile int lock;
+    LockProfile *profile;
+    hrtime_t heldSince;
+    bool profiledHold;
     DISALLOW_COPY_AND_ASSIGN(SpinLock);
 };
 
@@ -315,7 +418,8 @@ private:
 };
 
 template <class T> class RCPtr;
-template <class S> class SingleThreadedRCPtr;
+class RCValueRefs;
+template <class S, class Refs = RCValueRefs> class SingleThreadedRCPtr;
 
 /**
  * A reference counted value (used by RCPtr and SingleThreadedRCPtr).
@@ -327,7 +431,7 @@ public:
     ~RCValue() {}
 private:
     template <class MyTT> friend class RCPtr;
-    template <class MySS> friend class SingleThreadedRCPtr;
+    friend class RCValueRefs;
     int _rc_incref() const {
         return ++_rc_refcount;
     }
@@ -339,6 +443,35 @@ private:
     mutable Atomic<int> _rc_refcount;
 };
 
+/**
+ * The default way SingleThreadedRCPtr takes and drops references:
+ * straight on the value's own count.
+ */
+class RCValueRefs {
+public:
+    static void acquire(const RCValue *v) {
+        v->_rc_incref();
+    }
+
+    /**
+     * Drop a reference.
+     *
+     * @return true if that was the last one and the caller should
+     *         delete the value
+     */
+    static bool release(const RCValue *v) {
+        return v->_rc_decref() == 0;
+    }
+
+    /**
+     * Free a value whose last reference was dropped.
+     */
+    template <class T>
+    static void destroy(T *v) {
+        delete v;
+    }
+};
+
 /**
  * Concurrent reference counted pointer.
  */
@@ -438,32 +571,35 @@ private:
  * "Single-threaded" means that the reference counted pointer should be accessed
  * by only one thread at any time or accesses to the reference counted pointer
  * by multiple threads should be synchronized by the external lock.
+ *
+ * Refs decides how references are taken and dropped; see RCValueRefs.
  */
-template <class T>
+template <class T, class Refs>
 class SingleThreadedRCPtr {
 public:
     SingleThreadedRCPtr(T *init = NULL) : value(init) {
         if (init != NULL) {
-            static_cast<RCValue*>(value)->_rc_incref();
+            Refs::acquire(value);
         }
     }
 
-    SingleThreadedRCPtr(const SingleThreadedRCPtr<T> &other) : value(other.gimme()) {}
+    SingleThreadedRCPtr(const SingleThreadedRCPtr<T, Refs> &other) :
+        value(other.gimme()) {}
 
     ~SingleThreadedRCPtr() {
-        if (value && static_cast<RCValue *>(value)->_rc_decref() == 0) {
-            delete value;
+        if (value && Refs::release(value)) {
+            Refs::destroy(value);
         }
     }
 
     void reset(T *newValue = NULL) {
         if (newValue != NULL) {
-            static_cast<RCValue *>(newValue)->_rc_incref();
+            Refs::acquire(newValue);
         }
         swap(newValue);
     }
 
-    void reset(const SingleThreadedRCPtr<T> &other) {
+    void reset(const SingleThreadedRCPtr<T, Refs> &other) {
         swap(other.gimme());
     }
 
@@ -472,7 +608,8 @@ public:
         return value;
     }
 
-    SingleThreadedRCPtr<T> & operator =(const SingleThreadedRCPtr<T> &other) {
+    SingleThreadedRCPtr<T, Refs> &
+    operator =(const SingleThreadedRCPtr<T, Refs> &other) {
         reset(other);
         return *this;
     }
@@ -496,7 +633,7 @@ public:
 private:
     T *gimme() const {
         if (value) {
-            static_cast<RCValue *>(value)->_rc_incref();
+            Refs::acquire(value);
         }
         return value;
     }
@@ -504,112 +641,106 @@ private:
     void swap(T *newValue) {
         T *old = value;
         value = newValue;
-        if (old != NULL && static_cast<RCValue *>(old)->_rc_decref() == 0) {
-            delete old;
+        if (old != NULL && Refs::release(old)) {
+            Refs::destroy(old);
         }
     }
 
     T *value;
 };
 
+template <typename T> class MPSCQueue;
+
 /**
- * Efficient approximate-FIFO queue optimize for concurrent writers.
+ * The link an item embeds to be queued on an MPSCQueue, so that queueing
+ * it never allocates.  An item is on one queue at a time.
  */
 template <typename T>
-class AtomicQueue {
+class MPSCQueueNode {
 public:
-    AtomicQueue() : counter(0), numItems(0) {}
+    MPSCQueueNode() : mpscNext(NULL) {}
 
-    ~AtomicQueue() {
-        size_t i;
-        for (i = 0; i < counter; ++i) {
-            delete queues[i];
-        }
-    }
+private:
+    template <typename Q> friend class MPSCQueue;
+    T *mpscNext;
+};
+
+/**
+ * A lock-free FIFO queue for many threads pushing and one draining, of
+ * items derived from MPSCQueueNode.
+ *
+ * A push is a compare-and-swap onto a stack, and the consumer takes the
+ * whole stack with one swap and reverses it back into the order it was
+ * pushed in.  As nothing is taken off the stack alone, a push can't see
+ * an item leave and come back to the top in between its read and its
+ * swap (the ABA problem).
+ */
+template <typename T>
+class MPSCQueue {
+public:
+    MPSCQueue() : head(NULL), numItems(0) {}
 
     /**
-     * Place an item in the queue.
+     * Place an item in the queue.  It mustn't already be in one.
      */
-    void push(T &value) {
-        std::queue<T> *q = swapQueue(); // steal our queue
-        q->push(value);
+    void push(T *item) {
+        T *top;
+        do {
+            top = head.get();
+            item->mpscNext = top;
+        } while (!head.cas(top, item));
         ++numItems;
-        q = swapQueue(q);
-    }
-
-    void pushQueue(std::queue<T> &inQueue) {
-        std::queue<T> *q = swapQueue(); // steal our queue
-        numItems.incr(inQueue.size());
-        while (!inQueue.empty()) {
-            q->push(inQueue.front());
-            inQueue.pop();
-        }
-        q = swapQueue(q);
     }
 
     /**
-     * Grab all items from this queue an place them into the provided
-     * output queue.
-     *
-     * @param outQueue a destination queue to fill
+     * Place a counted item in the queue, which holds a reference to it
+     * until it's drained.
      */
-    void getAll(std::queue<T> &outQueue) {
-        std::queue<T> *q(swapQueue()); // Grab my own queue
-        std::queue<T> *newQueue(NULL);
-        int count(0);
-
-        // Will start empty unless this thread is adding stuff
-        while (!q->empty()) {
-            outQueue.push(q->front());
-            q->pop();
-            ++count;
-        }
-
-        size_t c(counter);
-        for (size_t i = 0; i < c; ++i) {
-            // Swap with another thread
-            newQueue = queues[i].swapIfNot(NULL, q);
-            // Empty the queue
-            if (newQueue != NULL) {
-                q = newQueue;
-                while (!q->empty()) {
-                    outQueue.push(q->front());
-                    q->pop();
-                    ++count;
-                }
-            }
-        }
-
-        q = swapQueue(q);
-        numItems -= count;
+    void push(const RCPtr<T> &item) {
+        RCValueRefs::acquire(item.get());
+        push(item.get());
     }
 
     /**
-     * Pop all the items from this queue and put them into the output vector instance.
+     * Take all the items queued, appending them to a vector in the order
+     * they were pushed.  Only one thread may drain the queue at a time.
      *
-     * @param outVector a destination vector to fill
+     * @return the number of items taken
      */
-    void toArray(std::vector<T> &outVector) {
-        std::queue<T> q;
-        getAll(q);
-        while (!q.empty()) {
-            outVector.push_back(q.front());
-            q.pop();
+    size_t drain(std::vector<T*> &out) {
+        size_t count(0);
+        T *item = takeAll(count);
+        while (item != NULL) {
+            T *next = item->mpscNext;
+            item->mpscNext = NULL;
+            out.push_back(item);
+            item = next;
         }
+        return count;
     }
 
     /**
-     * Get the number of queues internally maintained.
+     * Take all the counted items queued, in the order they were pushed,
+     * with the references the queue held.
      */
-    size_t getNumQueues() const {
-        return counter;
+    size_t drain(std::vector<RCPtr<T> > &out) {
+        size_t count(0);
+        T *item = takeAll(count);
+        while (item != NULL) {
+            T *next = item->mpscNext;
+            item->mpscNext = NULL;
+            out.push_back(RCPtr<T>(item));
+            RCValueRefs::release(item);
+            item = next;
+        }
+        return count;
     }
 
     /**
      * True if this queue is empty.
      */
     bool empty() const {
-        return size() == 0;
+        return head.get() == NULL;
     }
 
     /**
@@ -618,28 +749,26 @@ public:
     size_t size() const {
         return numItems;
     }
+
 private:
-    AtomicPtr<std::queue<T> > *initialize() {
-        std::queue<T> *q = new std::queue<T>;
-        size_t i(counter++);
-        queues[i] = q;
-        threadQueue = &queues[i];
-        return &queues[i];
-    }
-
-    std::queue<T> *swapQueue(std::queue<T> *newQueue = NULL) {
-        AtomicPtr<std::queue<T> > *qPtr(threadQueue);
-        if (qPtr == NULL) {
-            qPtr = initialize();
+    //! Swap the stack out, and reverse it to the order it was pushed in
+    T *takeAll(size_t &count) {
+        T *item = head.swap(NULL);
+        T *reversed = NULL;
+        while (item != NULL) {
+            T *next = item->mpscNext;
+            item->mpscNext = reversed;
+            reversed = item;
+            item = next;
+            ++count;
         }
-        return qPtr->swap(newQueue);
+        numItems -= count;
+        return reversed;
     }
 
-    ThreadLocalPtr<AtomicPtr<std::queue<T> > > threadQueue;
-    AtomicPtr<std::queue<T> > queues[MAX_THREADS];
-    Atomic<size_t> counter;
+    AtomicPtr<T> head;
     Atomic<size_t> numItems;
-    DISALLOW_COPY_AND_ASSIGN(AtomicQueue);
+    DISALLOW_COPY_AND_ASSIGN(MPSCQueue);
 };
 
 #endif  // SRC_ATOMIC_H_
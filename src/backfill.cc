@@ -70,15 +70,35 @@ bool BackfillDiskLoad::callback(Dispatcher &d, TaskId &t) {
         return true;
     }
 
+    if (!connMap.getBackfillController().startDiskLoad()) {
+        LOG(EXTENSION_LOG_INFO, "VBucket %d backfill task from disk is "
+            "waiting for the backfill controller", vbucket);
+        d.snooze(t, 1);
+        return true;
+    }
+
     if (connMap.checkConnectivity(name) && !engine->getEpStore()->isFlushAllScheduled()) {
         shared_ptr<Callback<GetValue> > backfill_cb(new BackfillDiskCallback(connToken,
                                                                              name, connMap,
                                                                              engine));
+        IOSlot slot(engine->getEpStore()->getIOScheduler(), IO_CLASS_BACKFILL);
         if (backfillType == ALL_MUTATIONS) {
             store->dump(vbucket, backfill_cb);
         } else if (store->getStorageProperties().hasPersistedDeletions() &&
                    backfillType == DELETIONS_ONLY) {
             store->dumpDeleted(vbucket, backfill_cb);
+        } else if (store->isSeqnoDumpSupported() && backfillType == SINCE_SEQNO) {
+            store->dumpSince(vbucket, since, backfill_cb);
+            RCPtr<VBucket> vb = engine->getVBucket(vbucket);
+            if (vb && vb->isPurgedSince(since)) {
+                // A compaction may have purged deletions from the file
+                // before the dump read it; the client has to start over.
+                LOG(EXTENSION_LOG_WARNING, "Deletions after seqno %llu of "
+                    "vbucket %d may have been purged while streaming it; "
+                    "disconnecting %s", since, vbucket, name.c_str());
+                DisconnectTapOperation op;
+                connMap.performTapOp(name, op, static_cast<void*>(NULL));
+            }
         } else {
             LOG(EXTENSION_LOG_WARNING,
                 "Underlying KVStore doesn't support this kind of backfill");
@@ -124,9 +144,10 @@ bool BackFillVisitor::visitBucket(RCPtr<VBucket> &vb) {
             ((num_items - num_non_resident) / num_items) < resident_threshold ? true : false;
 
         if (efficientVBDump && residentRatioBelowThreshold) {
-            // disk backfill for persisted items + memory backfill for resident items
+            // disk backfill for persisted items + memory backfill for the
+            // items that aren't persisted yet
             num_backfill_items = (vb->opsCreate - vb->opsDelete) +
-                static_cast<size_t>(num_items - num_non_resident);
+                vb->dirtyQueueSize.get();
             vbuckets[vb->getId()] = ALL_MUTATIONS;
             ScheduleDiskBackfillTapOperation tapop;
             engine->tapConnMap->performTapOp(name, tapop, static_cast<void*>(NULL));
@@ -146,9 +167,11 @@ bool BackFillVisitor::visitBucket(RCPtr<VBucket> &vb) {
 }
 
 void BackFillVisitor::visit(StoredValue *v) {
-    // If efficient VBdump is supported and an item is not resident,
-    // skip the item as it will be fetched by the disk backfill.
-    if (efficientVBDump && residentRatioBelowThreshold && !v->isResident()) {
+    // The disk backfill streams the whole vbucket file in seqno order,
+    // and each item read from it goes out with its in-memory version if
+    // there's one.  Only the items that aren't on disk yet have to come
+    // from memory; sending the others too would send them twice.
+    if (efficientVBDump && residentRatioBelowThreshold && !v->isDirty()) {
         return;
     }
 
@@ -156,6 +179,12 @@ void BackFillVisitor::visit(StoredValue *v) {
         return;
     }
 
+    // Items the consumer filtered out are never queued, so non-resident
+    // ones among them are never fetched from disk either.
+    if (!keyFilter.accepts(v->getKey(), v->getFlags(), v->getExptime())) {
+        return;
+    }
+
     queued_item qi(new QueuedItem(v->getKey(), currentBucket->getId(), queue_op_set));
     queue->push_back(qi);
 }
@@ -166,7 +195,7 @@ void BackFillVisitor::apply(void) {
         std::map<uint16_t, backfill_t>::iterator it = vbuckets.begin();
         for (; it != vbuckets.end(); ++it) {
             Dispatcher *d(engine->epstore->getAuxIODispatcher());
-            KVStore *underlying(engine->epstore->getAuxUnderlying());
+            KVStore *underlying(engine->epstore->getAuxUnderlying(it->first));
             assert(d);
             LOG(EXTENSION_LOG_INFO,
                 "Schedule a full backfill from disk for vbucket %d.\n",
@@ -205,7 +234,8 @@ bool BackFillVisitor::pauseVisitor() {
         return false;
     }
 
-    ssize_t maxBackfillSize = engine->getTapConfig().getBackfillBacklogLimit();
+    ssize_t maxBackfillSize =
+        engine->tapConnMap->getBackfillController().getBacklogLimit();
     pause = theSize > maxBackfillSize;
 
     if (pause) {
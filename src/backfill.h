@@ -38,7 +38,8 @@
 
 typedef enum backfill_t {
     ALL_MUTATIONS = 1,
-    DELETIONS_ONLY
+    DELETIONS_ONLY,
+    SINCE_SEQNO
 } backfill_t;
 
 /**
@@ -46,16 +47,17 @@ typedef enum backfill_t {
  * from a KVStore.
  *
  * Note that this is only used if the KVStore reports that it has
- * efficient vbucket ops.
+ * efficient vbucket ops.  It waits for the BackfillController to let it
+ * start before reading the vbucket.
  */
 class BackfillDiskLoad : public DispatcherCallback {
 public:
 
     BackfillDiskLoad(const std::string &n, EventuallyPersistentEngine* e,
                      TapConnMap &tcm, KVStore *s, uint16_t vbid, backfill_t type,
-                     hrtime_t token)
+                     hrtime_t token, uint64_t sinceSeqno = 0)
         : name(n), engine(e), connMap(tcm), store(s), vbucket(vbid), backfillType(type),
-       connToken(token) { }
+       connToken(token), since(sinceSeqno) { }
 
     void callback(GetValue &gv);
 
@@ -71,12 +73,13 @@ private:
     uint16_t                    vbucket;
     backfill_t                  backfillType;
     hrtime_t                    connToken;
+    uint64_t                    since;
 };
 
 /**
  * VBucketVisitor to backfill a TapProducer. This visitor basically performs backfill from memory
- * for only resident items if it needs to schedule a separate disk backfill task because of
- * low resident ratio.
+ * for only the items not persisted yet if it needs to schedule a separate disk backfill task
+ * because of low resident ratio.
  */
 class BackFillVisitor : public VBucketVisitor {
 public:
@@ -86,7 +89,8 @@ public:
         queue(new std::list<queued_item>),
         connToken(tc->getConnectionToken()), valid(true),
         efficientVBDump(e->epstore->getStorageProperties().hasEfficientVBDump()),
-        residentRatioBelowThreshold(false) { }
+        residentRatioBelowThreshold(false),
+        keyFilter(tc->getKeyFilter()) { }
 
     virtual ~BackFillVisitor() {
         delete queue;
@@ -120,13 +124,15 @@ private:
     bool valid;
     bool efficientVBDump;
     bool residentRatioBelowThreshold;
+    TapKeyFilter keyFilter;
 };
 
 /**
  * Backfill task scheduled by non-IO dispatcher. Each backfill task performs backfill from
  * memory or disk depending on the resident ratio. Each backfill task can backfill more than one
  * vbucket, but will snooze for 1 sec if the current backfill backlog for the corresponding TAP
- * producer is greater than the threshold (5000 by default).
+ * producer is greater than the BackfillController's backlog limit (tap_backlog_limit, 5000
+ * by default).
  */
 class BackfillTask : public DispatcherCallback {
 public:
@@ -17,6 +17,8 @@
 
 #include "config.h"
 
+#include <ctype.h>
+
 #include <algorithm>
 #include <vector>
 
@@ -32,8 +34,7 @@ void BgFetcher::start() {
     pendingFetch.cas(false, true);
     IOManager* iom = IOManager::get();
     iom->scheduleMultiBGFetcher(&(store->getEPEngine()), this,
-                                Priority::BgFetcherPriority,
-                                shard->getId());
+                                Priority::BgFetcherPriority, taskShard);
     assert(taskId > 0);
 }
 
@@ -44,30 +45,263 @@ void BgFetcher::stop() {
     IOManager::get()->cancel(taskId);
 }
 
-void BgFetcher::notifyBGEvent(void) {
-    ++stats.numRemainingBgJobs;
-    if (pendingFetch.cas(false, true)) {
+void BgFetcher::notifyBGEvent(size_t nitems) {
+    stats.numRemainingBgJobs.incr(nitems);
+    batchStart.cas(0, gethrtime());
+    size_t pending = pendingItems.incr(nitems);
+    size_t batchSize = store->getBGFetchBatchSize();
+    // A batch held back for more fetches goes as soon as it's big enough.
+    bool full = pending >= batchSize && pending - nitems < batchSize;
+    if (pendingFetch.cas(false, true) || full) {
         LockHolder lh(taskMutex);
         assert(taskId > 0);
-        IOManager::get()->wake(taskId);
+        IOManager::get()->wake(taskId, true);
+    }
+}
+
+/**
+ * Hold back a small batch until its oldest fetch has waited for the
+ * latency budget, so more fetches are read from disk with it.  While the
+ * disk is slow to read the last batch, more fetches are gathered into the
+ * next one before adding to its load.
+ */
+bool BgFetcher::holdBatch() {
+    hrtime_t budget = store->getBGFetchLatencyBudget() * 1000000;
+    hrtime_t start = batchStart.get();
+    if (budget == 0 || start == 0 ||
+        pendingItems.get() >= store->getBGFetchBatchSize()) {
+        return false;
+    }
+    if (lastFetchTime > budget) {
+        budget *= 2;
+    }
+    hrtime_t now = gethrtime();
+    if (now < start || now - start >= budget) {
+        return false;
+    }
+    IOManager::get()->snooze(taskId, (double)(budget - (now - start)) / 1e9);
+    return true;
+}
+
+/**
+ * The part of a key that keys of the same range share: all of it up to
+ * and including its last separator, as in "user::1234::" of
+ * "user::1234::7".  Empty if it has no separator.
+ */
+static std::string rangePrefix(const std::string &key) {
+    for (size_t i = key.size(); i > 0; --i) {
+        if (!isalnum(static_cast<unsigned char>(key[i - 1]))) {
+            return key.substr(0, i);
+        }
+    }
+    return std::string();
+}
+
+/**
+ * Add the docs after the end of each run of keys of a range to the batch,
+ * where a run is at least two keys of the batch, or one of it that goes
+ * on from the last batch of the vbucket.  The docs next to them by key
+ * are likely to be read next and to be in the same blocks of the file.
+ * Only those whose values were evicted are read, and only while the
+ * bucket is below its low water mark.
+ */
+void BgFetcher::addReadahead(uint16_t vbId, vb_bgfetch_queue_t &items,
+                             size_t count) {
+    std::vector<std::string> keys;
+    vb_bgfetch_queue_t::iterator itr = items.begin();
+    for (; itr != items.end(); ++itr) {
+        keys.push_back(itr->second.front()->key);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::string &lastKey = lastKeys[vbId];
+    std::string prefix = rangePrefix(lastKey);
+    size_t runLength = lastKey.empty() ? 0 : 1;
+    std::vector<std::string> runEnds;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (rangePrefix(keys[i]) == prefix) {
+            ++runLength;
+        } else {
+            prefix = rangePrefix(keys[i]);
+            runLength = 1;
+        }
+        bool endsRun = i + 1 == keys.size() ||
+            rangePrefix(keys[i + 1]) != prefix;
+        if (endsRun && runLength > 1 && !prefix.empty()) {
+            runEnds.push_back(keys[i]);
+        }
+    }
+    if (!keys.empty()) {
+        lastKey = keys.back();
+    }
+
+    RCPtr<VBucket> vb = shard->getBucket(vbId);
+    if (runEnds.empty() || !vb ||
+        stats.getTotalMemoryUsed() >= stats.mem_low_wat) {
+        return;
+    }
+
+    std::vector<std::string>::iterator it = runEnds.begin();
+    for (; it != runEnds.end(); ++it) {
+        std::vector<std::string> next;
+        if (!reader->getKeysAfter(vbId, *it, rangePrefix(*it), count, next)) {
+            return;
+        }
+        std::vector<std::string>::iterator nit = next.begin();
+        for (; nit != next.end(); ++nit) {
+            int bucket = 0;
+            LockHolder lh = vb->ht.getLockedBucket(*nit, &bucket);
+            StoredValue *v = vb->ht.unlocked_find(*nit, bucket, false, false);
+            if (!v || v->isResident() || v->isTempItem()) {
+                continue;
+            }
+            uint64_t seqno = v->getBySeqno();
+            lh.unlock();
+            if (items.find(seqno) == items.end()) {
+                items[seqno].push_back(
+                    new VBucketBGFetchItem(*nit, seqno, NULL, true));
+            }
+        }
     }
 }
 
 void BgFetcher::doFetch(uint16_t vbId) {
     hrtime_t startTime(gethrtime());
+    beginFetch(vbId, items2fetch, startTime);
+    {
+        IOSlot slot(store->getIOScheduler(), IO_CLASS_BGFETCH);
+        reader->getMulti(vbId, items2fetch);
+    }
+    lastFetchTime = gethrtime() - startTime;
+    completeFetch(vbId, items2fetch, startTime);
+}
+
+/**
+ * A vbucket's fetches read on the store's threads.
+ */
+struct AsyncBatch {
+    AsyncBatch() : startTime(0) { }
+
+    vb_bgfetch_queue_t items;
+    vb_bgmeta_queue_t metas;
+    hrtime_t startTime;
+};
+
+/**
+ * Collects the vbuckets whose batches the store's threads have read.
+ */
+class FetchCompletion : public Callback<uint16_t> {
+public:
+    void callback(uint16_t &vb) {
+        LockHolder lh(sync);
+        done.push_back(vb);
+        sync.notify();
+    }
+
+    //! Wait for the next batch to be read
+    uint16_t wait() {
+        LockHolder lh(sync);
+        while (done.empty()) {
+            sync.wait();
+        }
+        uint16_t vb = done.front();
+        done.pop_front();
+        return vb;
+    }
+
+private:
+    SyncObject sync;
+    std::list<uint16_t> done;
+};
+
+/**
+ * Gets the vbuckets' batches read, as they're handed over, by the threads of
+ * the store, and completes each as soon as it's read rather than after the
+ * slowest.  The metadata fetches are read once the batches are done, as a
+ * thread only holds one IO slot at a time.
+ */
+size_t BgFetcher::doFetchAsync(const std::vector<uint16_t> &vbIds) {
+    std::map<uint16_t, AsyncBatch> batches;
+    FetchCompletion done;
+    size_t inFlight = 0;
+    size_t numFetched = 0;
+    hrtime_t roundStart(gethrtime());
+
+    {
+        IOSlot slot(store->getIOScheduler(), IO_CLASS_BGFETCH);
+        std::vector<uint16_t>::const_iterator it = vbIds.begin();
+        for (; it != vbIds.end(); ++it) {
+            RCPtr<VBucket> vb = shard->getBucket(*it);
+            AsyncBatch &b = batches[*it];
+            if (!vb || !vb->getBGFetchItems(b.items, b.metas) ||
+                b.items.empty()) {
+                continue;
+            }
+            b.startTime = gethrtime();
+            beginFetch(*it, b.items, b.startTime);
+            reader->getMultiAsync(*it, b.items, done);
+            ++inFlight;
+        }
+        for (; inFlight > 0; --inFlight) {
+            uint16_t vbId = done.wait();
+            AsyncBatch &b = batches[vbId];
+            completeFetch(vbId, b.items, b.startTime);
+            numFetched += b.items.size();
+        }
+    }
+    lastFetchTime = gethrtime() - roundStart;
+
+    std::map<uint16_t, AsyncBatch>::iterator bit = batches.begin();
+    for (; bit != batches.end(); ++bit) {
+        if (!bit->second.metas.empty()) {
+            meta2fetch.swap(bit->second.metas);
+            doFetchMeta(bit->first);
+            numFetched += meta2fetch.size();
+            meta2fetch.clear();
+        }
+    }
+    return numFetched;
+}
+
+void BgFetcher::beginFetch(uint16_t vbId, vb_bgfetch_queue_t &items,
+                           hrtime_t startTime) {
     LOG(EXTENSION_LOG_DEBUG, "BgFetcher is fetching data, vBucket = %d "
-        "numDocs = %d, startTime = %lld\n", vbId, items2fetch.size(),
+        "numDocs = %d, startTime = %lld\n", vbId, items.size(),
         startTime/1000000);
 
-    shard->getROUnderlying()->getMulti(vbId, items2fetch);
+    vb_bgfetch_queue_t::iterator itr = items.begin();
+    for (; itr != items.end(); ++itr) {
+        std::list<VBucketBGFetchItem *> &requestedItems = (*itr).second;
+        std::list<VBucketBGFetchItem *>::iterator itm = requestedItems.begin();
+        for (; itm != requestedItems.end(); ++itm) {
+            if (startTime > (*itm)->initTime) {
+                stats.bgBatchWaitHisto.add((startTime - (*itm)->initTime) / 1000);
+            }
+        }
+    }
 
+    size_t readahead = store->getBGFetchReadahead();
+    if (readahead > 0) {
+        addReadahead(vbId, items, readahead);
+    }
+}
+
+void BgFetcher::completeFetch(uint16_t vbId, vb_bgfetch_queue_t &items,
+                              hrtime_t startTime) {
     int totalfetches = 0;
     std::vector<VBucketBGFetchItem *> fetchedItems;
-    vb_bgfetch_queue_t::iterator itr = items2fetch.begin();
-    for (; itr != items2fetch.end(); ++itr) {
+    std::vector<VBucketBGFetchItem *> readaheadItems;
+    vb_bgfetch_queue_t::iterator itr = items.begin();
+    for (; itr != items.end(); ++itr) {
         std::list<VBucketBGFetchItem *> &requestedItems = (*itr).second;
         std::list<VBucketBGFetchItem *>::iterator itm = requestedItems.begin();
         for(; itm != requestedItems.end(); ++itm) {
+            if ((*itm)->readahead) {
+                if ((*itm)->value.getStatus() == ENGINE_SUCCESS) {
+                    readaheadItems.push_back(*itm);
+                }
+                continue;
+            }
             if ((*itm)->value.getStatus() != ENGINE_SUCCESS &&
                 (*itm)->canRetry()) {
                 // underlying kvstore failed to fetch requested data
@@ -87,16 +321,80 @@ void BgFetcher::doFetch(uint16_t vbId) {
         store->completeBGFetchMulti(vbId, fetchedItems, startTime);
         stats.getMultiHisto.add((gethrtime()-startTime)/1000, totalfetches);
     }
+    if (!readaheadItems.empty()) {
+        store->completeReadahead(vbId, readaheadItems);
+    }
 
     // failed requests will get requeued for retry within clearItems()
-    clearItems(vbId);
+    clearItems(vbId, items);
 }
 
-void BgFetcher::clearItems(uint16_t vbId) {
-    vb_bgfetch_queue_t::iterator itr = items2fetch.begin();
+/**
+ * Read the metadata of the keys of a vbucket that aren't in memory, for
+ * get_meta and the conflict resolution of the *_with_meta commands, in one
+ * walk of its by-id tree.  A key that isn't on disk is an answer too, not a
+ * failure to be retried.
+ */
+void BgFetcher::doFetchMeta(uint16_t vbId) {
+    hrtime_t startTime(gethrtime());
+    {
+        IOSlot slot(store->getIOScheduler(), IO_CLASS_BGFETCH);
+        reader->getMultiMeta(vbId, meta2fetch);
+    }
+
+    std::vector<VBucketBGFetchItem *> fetchedItems;
+    std::vector<VBucketBGFetchItem *> retryItems;
+    vb_bgmeta_queue_t::iterator itr = meta2fetch.begin();
+    for (; itr != meta2fetch.end(); ++itr) {
+        std::list<VBucketBGFetchItem *> &requestedItems = itr->second;
+        std::list<VBucketBGFetchItem *>::iterator itm = requestedItems.begin();
+        for (; itm != requestedItems.end(); ++itm) {
+            ENGINE_ERROR_CODE status = (*itm)->value.getStatus();
+            if (status != ENGINE_SUCCESS && status != ENGINE_KEY_ENOENT &&
+                (*itm)->canRetry()) {
+                LOG(EXTENSION_LOG_WARNING, "Warning: bgfetcher failed to fetch "
+                    "metadata for vb = %d key = %s retry = %d\n", vbId,
+                    (*itm)->key.c_str(), (*itm)->getRetryCount());
+                retryItems.push_back(*itm);
+            } else {
+                fetchedItems.push_back(*itm);
+            }
+        }
+    }
+
+    if (!fetchedItems.empty()) {
+        store->completeBGFetchMulti(vbId, fetchedItems, startTime);
+        stats.getMultiHisto.add((gethrtime() - startTime) / 1000,
+                                fetchedItems.size());
+    }
+
+    // Every fetch of a key shares the item read for it.
+    for (itr = meta2fetch.begin(); itr != meta2fetch.end(); ++itr) {
+        itr->second.front()->delValue();
+    }
+    std::vector<VBucketBGFetchItem *>::iterator fit = fetchedItems.begin();
+    for (; fit != fetchedItems.end(); ++fit) {
+        delete *fit;
+    }
+
+    if (!retryItems.empty()) {
+        RCPtr<VBucket> vb = store->getVBuckets().getBucket(vbId);
+        assert(vb);
+        for (fit = retryItems.begin(); fit != retryItems.end(); ++fit) {
+            (*fit)->incrRetryCount();
+            (*fit)->value = GetValue();
+            vb->queueBGFetchItem(*fit, this, false);
+        }
+        stats.numRemainingBgJobs.incr(retryItems.size());
+    }
+}
+
+void BgFetcher::clearItems(uint16_t vbId, vb_bgfetch_queue_t &items) {
+    vb_bgfetch_queue_t::iterator itr = items.begin();
     size_t numRequeuedItems = 0;
+    std::vector<uint64_t> readaheadSeqnos;
 
-    for(; itr != items2fetch.end(); ++itr) {
+    for(; itr != items.end(); ++itr) {
         // every fetched item belonging to the same seq_id shares
         // a single data buffer, just delete it from the first fetched item
         std::list<VBucketBGFetchItem *> &doneItems = (*itr).second;
@@ -105,7 +403,11 @@ void BgFetcher::clearItems(uint16_t vbId) {
 
         std::list<VBucketBGFetchItem *>::iterator dItr = doneItems.begin();
         for (; dItr != doneItems.end(); ++dItr) {
-            if ((*dItr)->value.getStatus() == ENGINE_SUCCESS ||
+            if ((*dItr)->readahead) {
+                // Not counted in the remaining jobs, nor retried
+                readaheadSeqnos.push_back(itr->first);
+                delete *dItr;
+            } else if ((*dItr)->value.getStatus() == ENGINE_SUCCESS ||
                 !(*dItr)->canRetry()) {
                 delete *dItr;
             } else {
@@ -122,6 +424,11 @@ void BgFetcher::clearItems(uint16_t vbId) {
         }
     }
 
+    std::vector<uint64_t>::iterator sit = readaheadSeqnos.begin();
+    for (; sit != readaheadSeqnos.end(); ++sit) {
+        items.erase(*sit);
+    }
+
     if (numRequeuedItems) {
         stats.numRemainingBgJobs.incr(numRequeuedItems);
     }
@@ -131,7 +438,13 @@ bool BgFetcher::run(size_t tid) {
     assert(tid > 0);
     size_t num_fetched_items = 0;
 
+    if (holdBatch()) {
+        return true;
+    }
+
     pendingFetch.cas(true, false);
+    pendingItems.set(0);
+    batchStart.set(0);
 
     std::vector<uint16_t> bg_vbs;
     LockHolder lh(queueMutex);
@@ -142,16 +455,28 @@ bool BgFetcher::run(size_t tid) {
     pendingVbs.clear();
     lh.unlock();
 
+    fetching.set(true);
+    if (reader->isAsyncGetSupported()) {
+        num_fetched_items = doFetchAsync(bg_vbs);
+        bg_vbs.clear();
+    }
     std::vector<uint16_t>::iterator ita = bg_vbs.begin();
     for (; ita != bg_vbs.end(); ++ita) {
         uint16_t vbId = *ita;
         RCPtr<VBucket> vb = shard->getBucket(vbId);
-        if (vb && vb->getBGFetchItems(items2fetch)) {
-            doFetch(vbId);
-            num_fetched_items += items2fetch.size();
+        if (vb && vb->getBGFetchItems(items2fetch, meta2fetch)) {
+            if (!items2fetch.empty()) {
+                doFetch(vbId);
+            }
+            if (!meta2fetch.empty()) {
+                doFetchMeta(vbId);
+            }
+            num_fetched_items += items2fetch.size() + meta2fetch.size();
             items2fetch.clear();
+            meta2fetch.clear();
         }
     }
+    fetching.set(false);
 
     stats.numRemainingBgJobs.decr(num_fetched_items);
 
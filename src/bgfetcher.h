@@ -21,8 +21,10 @@
 #include "config.h"
 
 #include <list>
+#include <map>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "common.h"
 #include "dispatcher.h"
@@ -33,8 +35,10 @@ const uint16_t MAX_BGFETCH_RETRY=5;
 
 class VBucketBGFetchItem {
 public:
-    VBucketBGFetchItem(const std::string &k, uint64_t s, const void *c) :
-                       key(k), cookie(c), retryCount(0), initTime(gethrtime()) {
+    VBucketBGFetchItem(const std::string &k, uint64_t s, const void *c,
+                       bool ra = false, bool meta = false) :
+                       key(k), cookie(c), readahead(ra), metaOnly(meta),
+                       retryCount(0), initTime(gethrtime()) {
         value.setId(s);
     }
     ~VBucketBGFetchItem() {}
@@ -55,17 +59,24 @@ public:
 
     const std::string key;
     const void * cookie;
+    //! Read ahead of the fetches, with no client waiting on it
+    const bool readahead;
+    //! Fetch only the metadata of a key that isn't in memory, by its key
+    const bool metaOnly;
     GetValue value;
     uint16_t retryCount;
     hrtime_t initTime;
 };
 
 typedef unordered_map<uint64_t, std::list<VBucketBGFetchItem *> > vb_bgfetch_queue_t;
+//! The metadata fetches of a vbucket by key, in the order of its by-id tree
+typedef std::map<std::string, std::list<VBucketBGFetchItem *> > vb_bgmeta_queue_t;
 
 // Forward declaration.
 class EventuallyPersistentStore;
 
 class KVShard;
+class KVStore;
 
 /**
  * Dispatcher job responsible for batching data reads and push to
@@ -78,10 +89,15 @@ public:
      * Construct a BgFetcher task.
      *
      * @param s the store
-     * @param d the dispatcher
+     * @param k the shard whose vbuckets it reads
+     * @param r the read-only store it reads them with
+     * @param sid the shard id its task is scheduled with
+     * @param st the engine stats
      */
-    BgFetcher(EventuallyPersistentStore *s, KVShard *k, EPStats &st) :
-        store(s), shard(k), taskId(0), stats(st) {}
+    BgFetcher(EventuallyPersistentStore *s, KVShard *k, KVStore *r,
+              int sid, EPStats &st) :
+        store(s), shard(k), reader(r), taskShard(sid), taskId(0), stats(st),
+        fetching(false), pendingItems(0), batchStart(0), lastFetchTime(0) {}
     ~BgFetcher() {
         LockHolder lh(queueMutex);
         if (!pendingVbs.empty()) {
@@ -96,8 +112,11 @@ public:
     void stop(void);
     bool run(size_t tid);
     bool pendingJob(void);
-    void notifyBGEvent(void);
+    void notifyBGEvent(size_t nitems = 1);
     void setTaskId(size_t newId) { taskId = newId; }
+    KVStore *getReader() { return reader; }
+    //! True while a batch is being read
+    bool isFetching() { return fetching.get(); }
     void addPendingVB(uint16_t vbId) {
         LockHolder lh(queueMutex);
         pendingVbs.insert(vbId);
@@ -105,18 +124,40 @@ public:
 
 private:
     void doFetch(uint16_t vbId);
-    void clearItems(uint16_t vbId);
+    //! @return the number of fetches read
+    size_t doFetchAsync(const std::vector<uint16_t> &vbIds);
+    void beginFetch(uint16_t vbId, vb_bgfetch_queue_t &items,
+                    hrtime_t startTime);
+    void completeFetch(uint16_t vbId, vb_bgfetch_queue_t &items,
+                       hrtime_t startTime);
+    void doFetchMeta(uint16_t vbId);
+    void clearItems(uint16_t vbId, vb_bgfetch_queue_t &items);
+    bool holdBatch(void);
+    void addReadahead(uint16_t vbId, vb_bgfetch_queue_t &items, size_t count);
 
     EventuallyPersistentStore *store;
     KVShard *shard;
+    KVStore *reader;
+    int taskShard;
     vb_bgfetch_queue_t items2fetch;
+    vb_bgmeta_queue_t meta2fetch;
     size_t taskId;
     Mutex taskMutex;
     Mutex queueMutex;
     EPStats &stats;
 
     Atomic<bool> pendingFetch;
+    Atomic<bool> fetching;
     std::set<uint16_t> pendingVbs;
+
+    //! Fetches notified since the last batch was taken
+    Atomic<size_t> pendingItems;
+    //! When the first of those was notified, 0 if none
+    Atomic<hrtime_t> batchStart;
+    //! How long the last batch took to be read
+    hrtime_t lastFetchTime;
+    //! The greatest key of the last batch of each vbucket
+    std::map<uint16_t, std::string> lastKeys;
 };
 
 #endif  // SRC_BGFETCHER_H_
@@ -0,0 +1,153 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_BLOOMFILTER_H_
+#define SRC_BLOOMFILTER_H_ 1
+
+#include "config.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+/**
+ * A Bloom filter over keys.
+ *
+ * It answers "might this key have been added?" with no false
+ * negatives.  Keys can't be removed; as more keys than the filter was
+ * sized for are added, false positives get more likely.
+ *
+ * A filter doesn't lock; its owner serializes access to it.
+ */
+class BloomFilter {
+public:
+
+    /**
+     * Construct a filter sized for the given number of keys.
+     *
+     * @param keys the number of keys expected
+     * @param fpProb the false positive probability wanted at that many
+     */
+    BloomFilter(size_t keys, double fpProb) : bitsSet(0), numKeys(0) {
+        keys = std::max(keys, static_cast<size_t>(1));
+        double ln2 = std::log(2.0);
+        double bits = -(static_cast<double>(keys) * std::log(fpProb)) /
+            (ln2 * ln2);
+        numBits = std::max(static_cast<size_t>(std::ceil(bits)),
+                           static_cast<size_t>(8));
+        numHashes = std::max(static_cast<size_t>(
+                                 (bits / static_cast<double>(keys)) * ln2 + 0.5),
+                             static_cast<size_t>(1));
+        filter.resize((numBits + 7) / 8, 0);
+    }
+
+    /**
+     * Add a key.
+     */
+    void add(const std::string &key) {
+        uint32_t h1, h2;
+        hashes(key, h1, h2);
+        for (size_t i = 0; i < numHashes; ++i) {
+            size_t bit = (h1 + i * h2) % numBits;
+            uint8_t mask = static_cast<uint8_t>(1 << (bit % 8));
+            if (!(filter[bit / 8] & mask)) {
+                filter[bit / 8] |= mask;
+                ++bitsSet;
+            }
+        }
+        ++numKeys;
+    }
+
+    /**
+     * True if the key may have been added.
+     */
+    bool maybeContains(const std::string &key) const {
+        uint32_t h1, h2;
+        hashes(key, h1, h2);
+        for (size_t i = 0; i < numHashes; ++i) {
+            size_t bit = (h1 + i * h2) % numBits;
+            if (!(filter[bit / 8] & (1 << (bit % 8)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Get the number of keys added, counting a key once per add.
+     */
+    size_t getNumKeys() const { return numKeys; }
+
+    /**
+     * Estimate the number of distinct keys added from how many bits
+     * are set.
+     */
+    size_t estimateDistinctKeys() const {
+        if (bitsSet >= numBits) {
+            return numKeys;
+        }
+        double m = static_cast<double>(numBits);
+        double n = -(m / static_cast<double>(numHashes)) *
+            std::log(1.0 - static_cast<double>(bitsSet) / m);
+        return std::min(static_cast<size_t>(n + 0.5), numKeys);
+    }
+
+    /**
+     * Estimate the chance that a key that was never added is reported
+     * as maybe present, from how full the filter is.
+     */
+    double getFalsePositiveRate() const {
+        double fill = static_cast<double>(bitsSet) /
+            static_cast<double>(numBits);
+        return std::pow(fill, static_cast<double>(numHashes));
+    }
+
+    /**
+     * Get the number of bytes used by the filter's bits.
+     */
+    size_t getSize() const { return filter.size(); }
+
+private:
+
+    /**
+     * Two independent hashes of the key (64-bit FNV-1a, split), combined
+     * to get the rest.
+     */
+    static void hashes(const std::string &key, uint32_t &h1, uint32_t &h2) {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < key.length(); ++i) {
+            h ^= static_cast<uint8_t>(key[i]);
+            h *= 1099511628211ULL;
+        }
+        h1 = static_cast<uint32_t>(h);
+        // An odd step reaches every bit position.
+        h2 = static_cast<uint32_t>(h >> 32) | 1;
+    }
+
+    std::vector<uint8_t> filter;
+    size_t numBits;
+    size_t numHashes;
+    size_t bitsSet;
+    size_t numKeys;
+
+    DISALLOW_COPY_AND_ASSIGN(BloomFilter);
+};
+
+#endif  // SRC_BLOOMFILTER_H_
@@ -17,6 +17,8 @@
 
 #include "config.h"
 
+#include <algorithm>
+#include <limits>
 #include <string>
 #include <utility>
 #include <vector>
@@ -28,6 +30,8 @@
 #undef STATWRITER_NAMESPACE
 #include "vbucket.h"
 
+Atomic<uint64_t> CheckpointManager::nextCursorEpoch;
+
 /**
  * A listener class to update checkpoint related configs at runtime.
  */
@@ -43,6 +47,10 @@ public:
             config.setCheckpointMaxItems(value);
         } else if (key.compare("max_checkpoints") == 0) {
             config.setMaxCheckpoints(value);
+        } else if (key.compare("chk_queue_batch_size") == 0) {
+            config.setQueueBatchSize(value);
+        } else if (key.compare("max_chk_mem_percent") == 0) {
+            config.setMaxMemPercent(value);
         }
     }
 
@@ -51,6 +59,8 @@ public:
             config.allowItemNumBasedNewCheckpoint(value);
         } else if (key.compare("keep_closed_chks") == 0) {
             config.allowKeepClosedCheckpoints(value);
+        } else if (key.compare("adaptive_chk") == 0) {
+            config.allowAdaptive(value);
         }
     }
 
@@ -64,6 +74,7 @@ Checkpoint::~Checkpoint() {
         checkpointId, vbucketId);
     stats.memOverhead.decr(memorySize());
     assert(stats.memOverhead.get() < GIGANTOR);
+    stats.checkpointMemory.decr(getMemoryUsage());
 }
 
 void Checkpoint::setState(checkpoint_state state) {
@@ -72,13 +83,16 @@ void Checkpoint::setState(checkpoint_state state) {
 
 void Checkpoint::popBackCheckpointEndItem() {
     if (!toWrite.empty() && toWrite.back()->getOperation() == queue_op_checkpoint_end) {
+        size_t oldUsage = getMemoryUsage();
         keyIndex.erase(toWrite.back()->getKey());
+        itemsSize -= toWrite.back()->size();
         toWrite.pop_back();
+        updateMemStats(oldUsage);
     }
 }
 
 bool Checkpoint::keyExists(const std::string &key) {
-    return keyIndex.find(key) != keyIndex.end();
+    return keyIndex.find(key) != NULL;
 }
 
 queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *checkpointManager) {
@@ -86,22 +100,23 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *c
 
     uint64_t newMutationId = checkpointManager->nextMutationId();
     queue_dirty_t rv;
+    size_t oldUsage = getMemoryUsage();
 
-    checkpoint_index::iterator it = keyIndex.find(qi->getKey());
+    index_entry *existing = keyIndex.find(qi->getKey());
     // Check if this checkpoint already had an item for the same key.
-    if (it != keyIndex.end()) {
+    if (existing) {
         rv = EXISTING_ITEM;
-        std::list<queued_item>::iterator currPos = it->second.position;
-        uint64_t currMutationId = it->second.mutation_id;
+        CheckpointQueue::iterator currPos = existing->position;
+        uint64_t currMutationId = existing->mutation_id;
         CheckpointCursor &pcursor = checkpointManager->persistenceCursor;
 
         if (*(pcursor.currentCheckpoint) == this) {
             // If the existing item is in the left-hand side of the item pointed by the
             // persistence cursor, decrease the persistence cursor's offset by 1.
             const std::string &key = (*(pcursor.currentPos))->getKey();
-            checkpoint_index::iterator ita = keyIndex.find(key);
-            if (ita != keyIndex.end()) {
-                uint64_t mutationId = ita->second.mutation_id;
+            index_entry *ita = keyIndex.find(key);
+            if (ita) {
+                uint64_t mutationId = ita->mutation_id;
                 if (currMutationId <= mutationId) {
                     checkpointManager->decrCursorOffset_UNLOCKED(pcursor, 1);
                     rv = PERSIST_AGAIN;
@@ -120,9 +135,9 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *c
 
             if (*(map_it->second.currentCheckpoint) == this) {
                 const std::string &key = (*(map_it->second.currentPos))->getKey();
-                checkpoint_index::iterator ita = keyIndex.find(key);
-                if (ita != keyIndex.end()) {
-                    uint64_t mutationId = ita->second.mutation_id;
+                index_entry *ita = keyIndex.find(key);
+                if (ita) {
+                    uint64_t mutationId = ita->mutation_id;
                     if (currMutationId <= mutationId) {
                         checkpointManager->decrCursorOffset_UNLOCKED(map_it->second, 1);
                     }
@@ -137,81 +152,109 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *c
         queued_item &existing_itm = *currPos;
         existing_itm->setOperation(qi->getOperation());
         existing_itm->setQueuedTime(qi->getQueuedTime());
+        existing_itm->setMutationId(newMutationId);
         toWrite.push_back(existing_itm);
         // Remove the existing item for the same key from the list.
         toWrite.erase(currPos);
+        // Point the index at the item that was just pushed back.
+        existing->position = --toWrite.end();
+        existing->mutation_id = newMutationId;
     } else {
         if (qi->getOperation() == queue_op_set || qi->getOperation() == queue_op_del) {
             ++numItems;
         }
         rv = NEW_ITEM;
+        qi->setMutationId(newMutationId);
         // Push the new item into the list
         toWrite.push_back(qi);
-    }
+        itemsSize += qi->size();
 
-    if (qi->getKey().size() > 0) {
-        std::list<queued_item>::iterator last = toWrite.end();
-        // --last is okay as the list is not empty now.
-        index_entry entry = {--last, newMutationId};
-        // Set the index of the key to the new item that is pushed back into the list.
-        keyIndex[qi->getKey()] = entry;
-        if (rv == NEW_ITEM) {
-            size_t newEntrySize = qi->getKey().size() + sizeof(index_entry) + sizeof(queued_item);
-            memOverhead += newEntrySize;
-            stats.memOverhead.incr(newEntrySize);
-            assert(stats.memOverhead.get() < GIGANTOR);
+        if (qi->getKey().size() > 0) {
+            // --end() is okay as the list is not empty now.
+            index_entry entry = {--toWrite.end(), newMutationId};
+            keyIndex.set(qi->getKey(), entry);
         }
     }
+    updateMemStats(oldUsage);
     return rv;
 }
 
 size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
     size_t numNewItems = 0;
-    size_t newEntryMemOverhead = 0;
-    std::list<queued_item>::reverse_iterator rit = pPrevCheckpoint->rbegin();
+    size_t oldUsage = getMemoryUsage();
+    CheckpointQueue::reverse_iterator rit = pPrevCheckpoint->rbegin();
 
     LOG(EXTENSION_LOG_INFO,
         "Collapse the checkpoint %llu into the checkpoint %llu for vbucket %d",
         pPrevCheckpoint->getId(), checkpointId, vbucketId);
 
-    keyIndex["dummy_key"].mutation_id =
-        pPrevCheckpoint->getMutationIdForKey("dummy_key");
-    keyIndex["checkpoint_start"].mutation_id =
-        pPrevCheckpoint->getMutationIdForKey("checkpoint_start");
+    index_entry *meta = keyIndex.find("dummy_key");
+    if (meta) {
+        meta->mutation_id = pPrevCheckpoint->getMutationIdForKey("dummy_key");
+    }
+    meta = keyIndex.find("checkpoint_start");
+    if (meta) {
+        meta->mutation_id = pPrevCheckpoint->getMutationIdForKey("checkpoint_start");
+    }
     for (; rit != pPrevCheckpoint->rend(); ++rit) {
         const std::string &key = (*rit)->getKey();
         if ((*rit)->getOperation() != queue_op_del &&
             (*rit)->getOperation() != queue_op_set) {
             continue;
         }
-        checkpoint_index::iterator it = keyIndex.find(key);
-        if (it == keyIndex.end()) {
-            std::list<queued_item>::iterator pos = toWrite.begin();
+        if (keyIndex.find(key) == NULL) {
+            CheckpointQueue::iterator pos = toWrite.begin();
             // Skip the first two meta items
             ++pos; ++pos;
-            toWrite.insert(pos, *rit);
-            index_entry entry = {--pos, pPrevCheckpoint->getMutationIdForKey(key)};
-            keyIndex[key] = entry;
-            newEntryMemOverhead += key.size() + sizeof(index_entry);
+            index_entry entry = {toWrite.insert(pos, *rit),
+                                 pPrevCheckpoint->getMutationIdForKey(key)};
+            keyIndex.set(key, entry);
+            itemsSize += (*rit)->size();
             ++numItems;
             ++numNewItems;
         }
     }
-    memOverhead += newEntryMemOverhead;
-    stats.memOverhead.incr(newEntryMemOverhead);
-    assert(stats.memOverhead.get() < GIGANTOR);
+    updateMemStats(oldUsage);
     return numNewItems;
 }
 
 uint64_t Checkpoint::getMutationIdForKey(const std::string &key) {
     uint64_t mid = 0;
-    checkpoint_index::iterator it = keyIndex.find(key);
-    if (it != keyIndex.end()) {
-        mid = it->second.mutation_id;
+    index_entry *it = keyIndex.find(key);
+    if (it) {
+        mid = it->mutation_id;
     }
     return mid;
 }
 
+void Checkpoint::updateMemStats(size_t oldUsage) {
+    size_t newOverhead = toWrite.getMemorySize() + keyIndex.getMemorySize();
+    if (newOverhead > memOverhead) {
+        stats.memOverhead.incr(newOverhead - memOverhead);
+    } else {
+        stats.memOverhead.decr(memOverhead - newOverhead);
+    }
+    memOverhead = newOverhead;
+    assert(stats.memOverhead.get() < GIGANTOR);
+
+    size_t newUsage = getMemoryUsage();
+    if (newUsage > oldUsage) {
+        stats.checkpointMemory.incr(newUsage - oldUsage);
+    } else {
+        stats.checkpointMemory.decr(oldUsage - newUsage);
+    }
+}
+
+void PersistenceRange::getItems(std::vector<queued_item> &items) const {
+    std::vector<segment>::const_iterator it = segments.begin();
+    for (; it != segments.end(); ++it) {
+        CheckpointQueue::iterator pos = it->first;
+        for (; pos != it->second; ++pos) {
+            items.push_back(*pos);
+        }
+    }
+}
+
 CheckpointManager::~CheckpointManager() {
     LockHolder lh(queueLock);
     std::list<Checkpoint*>::iterator it = checkpointList.begin();
@@ -219,6 +262,10 @@ CheckpointManager::~CheckpointManager() {
         delete *it;
         ++it;
     }
+    it = retiredCheckpoints.begin();
+    for (; it != retiredCheckpoints.end(); ++it) {
+        delete *it;
+    }
 }
 
 uint64_t CheckpointManager::getOpenCheckpointId_UNLOCKED() {
@@ -232,6 +279,7 @@ uint64_t CheckpointManager::getOpenCheckpointId_UNLOCKED() {
 
 uint64_t CheckpointManager::getOpenCheckpointId() {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     return getOpenCheckpointId_UNLOCKED();
 }
 
@@ -245,6 +293,7 @@ uint64_t CheckpointManager::getLastClosedCheckpointId_UNLOCKED() {
 
 uint64_t CheckpointManager::getLastClosedCheckpointId() {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     return getLastClosedCheckpointId_UNLOCKED();
 }
 
@@ -252,10 +301,21 @@ void CheckpointManager::setOpenCheckpointId_UNLOCKED(uint64_t id) {
     if (!checkpointList.empty()) {
         LOG(EXTENSION_LOG_INFO, "Set the current open checkpoint id to %llu "
             "for vbucket %d", id, vbucketId);
+        uint64_t oldId = checkpointList.back()->getId();
+        std::map<uint64_t, uint64_t>::iterator sit = checkpointSeqnos.find(oldId);
+        if (sit != checkpointSeqnos.end()) {
+            uint64_t seqno = sit->second;
+            checkpointSeqnos.erase(sit);
+            if (!checkpointSeqnos.empty() &&
+                checkpointSeqnos.rbegin()->first >= id) {
+                checkpointSeqnos.clear();
+            }
+            checkpointSeqnos[id] = seqno;
+        }
         checkpointList.back()->setId(id);
         // Update the checkpoint_start item with the new Id.
         queued_item qi = createCheckpointItem(id, vbucketId, queue_op_checkpoint_start);
-        std::list<queued_item>::iterator it = ++(checkpointList.back()->begin());
+        CheckpointQueue::iterator it = ++(checkpointList.back()->begin());
         *it = qi;
     }
 }
@@ -270,6 +330,24 @@ bool CheckpointManager::addNewCheckpoint_UNLOCKED(uint64_t id) {
     LOG(EXTENSION_LOG_INFO, "Create a new open checkpoint %llu for vbucket %d",
         id, vbucketId);
 
+    if (!checkpointSeqnos.empty() && checkpointSeqnos.rbegin()->first >= id) {
+        checkpointSeqnos.clear();
+    }
+    if (checkpointSeqnos.size() >= CHECKPOINT_SEQNO_HISTORY) {
+        // Drop every other one, keeping the newest.
+        bool drop = checkpointSeqnos.size() % 2 == 0;
+        std::map<uint64_t, uint64_t>::iterator sit = checkpointSeqnos.begin();
+        while (sit != checkpointSeqnos.end()) {
+            if (drop) {
+                checkpointSeqnos.erase(sit++);
+            } else {
+                ++sit;
+            }
+            drop = !drop;
+        }
+    }
+    checkpointSeqnos[id] = persistedSeqno.get();
+
     bool empty = checkpointList.empty() ? true : false;
     Checkpoint *checkpoint = new Checkpoint(stats, id, vbucketId, CHECKPOINT_OPEN);
     // Add a dummy item into the new checkpoint, so that any cursor referring to the actual first
@@ -284,7 +362,18 @@ bool CheckpointManager::addNewCheckpoint_UNLOCKED(uint64_t id) {
     ++numItems;
     checkpointList.push_back(checkpoint);
 
-    if (empty) {
+    if (empty || persistenceRangePending) {
+        // A pending persistence range moves the cursor when it's committed.
+        return true;
+    }
+    if (!checkpointConfig.isPersistent()) {
+        // Nothing is flushed, so the cursor skips the closed checkpoint.
+        (*(persistenceCursor.currentCheckpoint))->removeCursorName(persistenceCursor.name);
+        persistenceCursor.currentCheckpoint = --checkpointList.end();
+        persistenceCursor.currentPos = checkpoint->begin();
+        checkpoint->registerCursorName(persistenceCursor.name);
+        persistenceCursor.offset = numItems - 1;
+        pCursorPreCheckpointId = getLastClosedCheckpointId_UNLOCKED();
         return true;
     }
     // Move the persistence cursor to the next checkpoint if it already reached to
@@ -318,6 +407,7 @@ bool CheckpointManager::addNewCheckpoint_UNLOCKED(uint64_t id) {
 
 bool CheckpointManager::addNewCheckpoint(uint64_t id) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     return addNewCheckpoint_UNLOCKED(id);
 }
 
@@ -343,11 +433,13 @@ bool CheckpointManager::closeOpenCheckpoint_UNLOCKED(uint64_t id) {
 
 bool CheckpointManager::closeOpenCheckpoint(uint64_t id) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     return closeOpenCheckpoint_UNLOCKED(id);
 }
 
 void CheckpointManager::registerPersistenceCursor() {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     assert(!checkpointList.empty());
     persistenceCursor.currentCheckpoint = checkpointList.begin();
     persistenceCursor.currentPos = checkpointList.front()->begin();
@@ -358,11 +450,43 @@ bool CheckpointManager::registerTAPCursor(const std::string &name,
                                           uint64_t checkpointId,
                                           bool alwaysFromBeginning) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     return registerTAPCursor_UNLOCKED(name,
                                       checkpointId,
                                       alwaysFromBeginning);
 }
 
+bool CheckpointManager::registerTAPCursorForResume(const std::string &name,
+                                                   uint64_t checkpointId,
+                                                   uint64_t &seqno) {
+    LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
+    assert(!checkpointList.empty());
+
+    if (checkpointId > getOpenCheckpointId_UNLOCKED()) {
+        return false;
+    }
+    // Every item of a later checkpoint was queued after the seqno of an
+    // earlier one was taken, so it was persisted with a higher seqno.
+    std::map<uint64_t, uint64_t>::iterator it =
+        checkpointSeqnos.upper_bound(checkpointId);
+    if (it == checkpointSeqnos.begin()) {
+        return false;
+    }
+    seqno = (--it)->second;
+
+    // The items that aren't persisted yet are all in memory.
+    registerTAPCursor_UNLOCKED(name, checkpointList.front()->getId(), true);
+    return true;
+}
+
+void CheckpointManager::registerTAPCursorAtOldest(const std::string &name) {
+    LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
+    assert(!checkpointList.empty());
+    registerTAPCursor_UNLOCKED(name, checkpointList.front()->getId(), true);
+}
+
 bool CheckpointManager::registerTAPCursor_UNLOCKED(const std::string &name,
                                                    uint64_t checkpointId,
                                                    bool alwaysFromBeginning) {
@@ -400,7 +524,7 @@ bool CheckpointManager::registerTAPCursor_UNLOCKED(const std::string &name,
         (*it)->registerCursorName(name);
     } else {
         size_t offset = 0;
-        std::list<queued_item>::iterator curr;
+        CheckpointQueue::iterator curr;
 
         LOG(EXTENSION_LOG_DEBUG,
             "Checkpoint %llu for vbucket %d exists in memory. "
@@ -434,6 +558,7 @@ bool CheckpointManager::registerTAPCursor_UNLOCKED(const std::string &name,
 
 bool CheckpointManager::removeTAPCursor(const std::string &name) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
 
     LOG(EXTENSION_LOG_INFO,
         "Remove the checkpoint cursor with the name \"%s\" from vbucket %d",
@@ -460,6 +585,7 @@ bool CheckpointManager::removeTAPCursor(const std::string &name) {
 
 uint64_t CheckpointManager::getCheckpointIdForTAPCursor(const std::string &name) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it == tapCursors.end()) {
         return 0;
@@ -470,16 +596,19 @@ uint64_t CheckpointManager::getCheckpointIdForTAPCursor(const std::string &name)
 
 size_t CheckpointManager::getNumOfTAPCursors() {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     return tapCursors.size();
 }
 
 size_t CheckpointManager::getNumCheckpoints() {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     return checkpointList.size();
 }
 
 std::list<std::string> CheckpointManager::getTAPCursorNames() {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     std::list<std::string> cursor_names;
     std::map<const std::string, CheckpointCursor>::iterator tap_it = tapCursors.begin();
         for (; tap_it != tapCursors.end(); ++tap_it) {
@@ -508,12 +637,107 @@ bool CheckpointManager::isCheckpointCreationForHighMemUsage(const RCPtr<VBucket>
     return forceCreation;
 }
 
+void CheckpointManager::adjustCheckpointBounds_UNLOCKED() {
+    if (!checkpointConfig.isAdaptive()) {
+        return;
+    }
+
+    // Once checkpoints use more than half their memory budget, shrink them down to a
+    // tenth of the configured bounds as the budget runs out.
+    size_t budget = checkpointConfig.getMemoryBudget(stats);
+    double pressure = budget > 0 ?
+        static_cast<double>(stats.checkpointMemory.get()) / static_cast<double>(budget) : 1.0;
+    double scale = 1.0;
+    if (pressure > 0.5) {
+        scale = std::max(0.1, 2.0 * (1.0 - pressure));
+    }
+
+    // An open checkpoint absorbing many updates to the same keys saves the cursors
+    // more than it costs, so let it grow again.
+    Checkpoint *openCheckpoint = checkpointList.back();
+    size_t distinctItems = openCheckpoint->getNumItems();
+    if (distinctItems > 0) {
+        uint64_t startId = openCheckpoint->getMutationIdForKey("checkpoint_start");
+        double dedupRatio = static_cast<double>(mutationCounter - startId) /
+            static_cast<double>(distinctItems);
+        scale *= std::max(1.0, std::min(dedupRatio, 4.0));
+    }
+
+    // A cursor lagging by more than a checkpoint keeps everything from its checkpoint on
+    // in memory; smaller checkpoints can be freed one at a time as it catches up.
+    size_t maxItems = checkpointConfig.getCheckpointMaxItems();
+    size_t slowestLag = numItems > persistenceCursor.offset ?
+        numItems - persistenceCursor.offset : 0;
+    std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.begin();
+    for (; it != tapCursors.end(); ++it) {
+        if (numItems > it->second.offset) {
+            slowestLag = std::max(slowestLag, numItems - it->second.offset);
+        }
+    }
+    if (static_cast<double>(slowestLag) > static_cast<double>(maxItems) * scale) {
+        scale /= 2;
+    }
+
+    scale = std::min(scale, 1.0);
+    adaptiveMaxItems = std::max(static_cast<size_t>(static_cast<double>(maxItems) * scale),
+                                static_cast<size_t>(MIN_CHECKPOINT_ITEMS));
+    rel_time_t period = checkpointConfig.getCheckpointPeriod();
+    adaptivePeriod = std::max(static_cast<rel_time_t>(static_cast<double>(period) * scale),
+                              static_cast<rel_time_t>(MIN_CHECKPOINT_PERIOD));
+}
+
+size_t CheckpointManager::getCheckpointMaxItems_UNLOCKED() {
+    if (checkpointConfig.isAdaptive() && adaptiveMaxItems > 0) {
+        return adaptiveMaxItems;
+    }
+    return checkpointConfig.getCheckpointMaxItems();
+}
+
+rel_time_t CheckpointManager::getCheckpointPeriod_UNLOCKED() {
+    if (checkpointConfig.isAdaptive() && adaptivePeriod > 0) {
+        return adaptivePeriod;
+    }
+    return checkpointConfig.getCheckpointPeriod();
+}
+
+size_t CheckpointManager::getMemoryUsage() {
+    LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
+    size_t usage = 0;
+    std::list<Checkpoint*>::iterator it = checkpointList.begin();
+    for (; it != checkpointList.end(); ++it) {
+        usage += (*it)->getMemoryUsage();
+    }
+    return usage;
+}
+
+void CheckpointManager::getLaggingTAPCursors(std::list<std::string> &cursors) {
+    if (!checkpointConfig.isAdaptive() ||
+        stats.checkpointMemory.get() < checkpointConfig.getMemoryBudget(stats)) {
+        return;
+    }
+
+    LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
+    uint64_t persistenceCheckpointId = (*(persistenceCursor.currentCheckpoint))->getId();
+    std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.begin();
+    for (; it != tapCursors.end(); ++it) {
+        Checkpoint *checkpoint = *(it->second.currentCheckpoint);
+        if (checkpoint->getState() == CHECKPOINT_CLOSED &&
+            checkpoint->getId() < persistenceCheckpointId) {
+            cursors.push_back(it->first);
+        }
+    }
+}
+
 size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbucket,
                                                        bool &newOpenCheckpointCreated) {
 
     // This function is executed periodically by the non-IO dispatcher.
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     assert(vbucket);
+    adjustCheckpointBounds_UNLOCKED();
     uint64_t oldCheckpointId = 0;
     bool canCreateNewCheckpoint = false;
     if (checkpointList.size() < checkpointConfig.getMaxCheckpoints() ||
@@ -598,7 +822,8 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbu
     // If any cursor on a replica vbucket or downstream active vbucket receiving checkpoints from
     // the upstream master is very slow and causes more closed checkpoints in memory,
     // collapse those closed checkpoints into a single one to reduce the memory overhead.
-    if (!checkpointConfig.canKeepClosedCheckpoints() &&
+    // Closed checkpoints the flusher may be reading are left alone until it's done.
+    if (!checkpointConfig.canKeepClosedCheckpoints() && !persistenceRangeInUse &&
         (vbucket->getState() == vbucket_state_replica ||
          (vbucket->getState() == vbucket_state_active)))
     {
@@ -615,6 +840,9 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbu
             vbucket->dirtyQueueSize.incr(diff);
         }
     }
+    if (persistenceRangeInUse) {
+        retiredCheckpoints.splice(retiredCheckpoints.end(), unrefCheckpointList);
+    }
     lh.unlock();
 
     std::list<Checkpoint*>::iterator chkpoint_it = unrefCheckpointList.begin();
@@ -704,8 +932,33 @@ void CheckpointManager::collapseClosedCheckpoints(std::list<Checkpoint*> &collap
     }
 }
 
-bool CheckpointManager::queueDirty(const queued_item &qi, const RCPtr<VBucket> &vbucket) {
+bool CheckpointManager::queueDirty(const queued_item &qi, VBucket *vbucket) {
+    assert(vbucket);
+    size_t batchSize = checkpointConfig.getQueueBatchSize();
+    if (stagingScopes > 0) {
+        batchSize = MAX_CHECKPOINT_QUEUE_BATCH_SIZE;
+    }
+    if (batchSize > 1) {
+        SpinLockHolder slh(&stagingLock);
+        stagedItems.push_back(qi);
+        stagedVBucket = vbucket;
+        if (stagedItems.size() < batchSize) {
+            return true;
+        }
+        slh.unlock();
+
+        LockHolder lh(queueLock);
+        queueStagedItems_UNLOCKED();
+        return true;
+    }
+
     LockHolder lh(queueLock);
+    // Items may still be staged if batching was just turned off.
+    queueStagedItems_UNLOCKED();
+    return queueDirty_UNLOCKED(qi, vbucket);
+}
+
+bool CheckpointManager::queueDirty_UNLOCKED(const queued_item &qi, VBucket *vbucket) {
     if (vbucket->getState() != vbucket_state_active &&
         checkpointList.back()->getState() == CHECKPOINT_CLOSED) {
         // Replica vbucket might receive items from the master even if the current open checkpoint
@@ -714,7 +967,6 @@ bool CheckpointManager::queueDirty(const queued_item &qi, const RCPtr<VBucket> &
         return false;
     }
 
-    assert(vbucket);
     bool canCreateNewCheckpoint = false;
     if (checkpointList.size() < checkpointConfig.getMaxCheckpoints() ||
         (checkpointList.size() == checkpointConfig.getMaxCheckpoints() &&
@@ -737,6 +989,54 @@ bool CheckpointManager::queueDirty(const queued_item &qi, const RCPtr<VBucket> &
     return result != EXISTING_ITEM;
 }
 
+size_t CheckpointManager::queueDirtyBatch(const std::vector<queued_item> &items,
+                                          VBucket *vbucket) {
+    assert(vbucket);
+    size_t queued = 0;
+    LockHolder lh(queueLock);
+    // Anything staged before goes in first.
+    queueStagedItems_UNLOCKED();
+    std::vector<queued_item>::const_iterator it = items.begin();
+    for (; it != items.end(); ++it) {
+        if (queueDirty_UNLOCKED(*it, vbucket)) {
+            ++queued;
+        } else if (checkpointConfig.isPersistent()) {
+            stats.decrDiskQueueSize(1);
+            vbucket->doStatsForFlushing(**it, (*it)->size());
+        }
+    }
+    return queued;
+}
+
+void CheckpointManager::endStaging() {
+    assert(stagingScopes > 0);
+    --stagingScopes;
+    LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
+}
+
+void CheckpointManager::queueStagedItems_UNLOCKED() {
+    std::vector<queued_item> items;
+    VBucket *vbucket;
+    {
+        SpinLockHolder slh(&stagingLock);
+        if (stagedItems.empty()) {
+            return;
+        }
+        items.swap(stagedItems);
+        vbucket = stagedVBucket;
+    }
+
+    std::vector<queued_item>::iterator it = items.begin();
+    for (; it != items.end(); ++it) {
+        if (!queueDirty_UNLOCKED(*it, vbucket) && checkpointConfig.isPersistent()) {
+            // The caller counted this item as queued when it was staged.
+            stats.decrDiskQueueSize(1);
+            vbucket->doStatsForFlushing(**it, (*it)->size());
+        }
+    }
+}
+
 void CheckpointManager::getAllItemsFromCurrentPosition(CheckpointCursor &cursor,
                                                        uint64_t barrier,
                                                        std::vector<queued_item> &items) {
@@ -764,6 +1064,11 @@ void CheckpointManager::getAllItemsFromCurrentPosition(CheckpointCursor &cursor,
 
 void CheckpointManager::getAllItemsForPersistence(std::vector<queued_item> &items) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
+    getAllItemsForPersistence_UNLOCKED(items);
+}
+
+void CheckpointManager::getAllItemsForPersistence_UNLOCKED(std::vector<queued_item> &items) {
     // Get all the items up to the end of the current open checkpoint.
     getAllItemsFromCurrentPosition(persistenceCursor, 0, items);
     persistenceCursor.offset = numItems;
@@ -774,9 +1079,86 @@ void CheckpointManager::getAllItemsForPersistence(std::vector<queued_item> &item
         items.size(), vbucketId);
 }
 
+void CheckpointManager::getItemsForPersistence(PersistenceRange &range,
+                                               std::vector<queued_item> &items) {
+    LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
+    range.segments.clear();
+    persistenceRangePending = false;
+
+    std::list<Checkpoint*>::iterator last = --checkpointList.end();
+    if (persistenceCursor.currentCheckpoint == last) {
+        // The last checkpoint may still change, so its items are copied.
+        getAllItemsForPersistence_UNLOCKED(items);
+        return;
+    }
+
+    std::list<Checkpoint*>::iterator it = persistenceCursor.currentCheckpoint;
+    CheckpointQueue::iterator pos = persistenceCursor.currentPos;
+    range.segments.push_back(std::make_pair(++pos, (*it)->end()));
+    for (++it; it != last; ++it) {
+        pos = (*it)->begin();
+        range.segments.push_back(std::make_pair(++pos, (*it)->end()));
+    }
+    range.nextCheckpoint = last;
+    range.lastCheckpointId = (*(--it))->getId();
+    pendingRange = range;
+    persistenceRangePending = true;
+    persistenceRangeInUse = true;
+
+    LOG(EXTENSION_LOG_DEBUG,
+        "Grab %ld closed checkpoints through the persistence cursor from vbucket %d",
+        range.segments.size(), vbucketId);
+}
+
+void CheckpointManager::commitPersistenceRange(PersistenceRange &range) {
+    std::list<Checkpoint*> retired;
+    LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
+    if (persistenceRangePending && !range.empty()) {
+        commitPersistenceRange_UNLOCKED(range);
+    }
+    range.segments.clear();
+    persistenceRangeInUse = false;
+    retired.swap(retiredCheckpoints);
+    lh.unlock();
+
+    std::list<Checkpoint*>::iterator it = retired.begin();
+    for (; it != retired.end(); ++it) {
+        delete *it;
+    }
+}
+
+void CheckpointManager::commitPersistenceRange_UNLOCKED(PersistenceRange &range) {
+    (*(persistenceCursor.currentCheckpoint))->removeCursorName(persistenceCursor.name);
+    persistenceCursor.currentCheckpoint = range.nextCheckpoint;
+    persistenceCursor.currentPos = (*(range.nextCheckpoint))->begin();
+    (*(range.nextCheckpoint))->registerCursorName(persistenceCursor.name);
+
+    // The cursor has visited all the items except for the ones from its new checkpoint on.
+    size_t remains = 0;
+    std::list<Checkpoint*>::iterator it = range.nextCheckpoint;
+    for (; it != checkpointList.end(); ++it) {
+        // Add checkpoint start and, if closed, end meta items.
+        remains += (*it)->getNumItems() + ((*it)->getState() == CHECKPOINT_CLOSED ? 2 : 1);
+    }
+    persistenceCursor.offset = numItems > remains ? numItems - remains : 0;
+    pCursorPreCheckpointId = range.lastCheckpointId;
+    persistenceRangePending = false;
+}
+
+void CheckpointManager::retireCheckpoint_UNLOCKED(Checkpoint *checkpoint) {
+    if (persistenceRangeInUse) {
+        retiredCheckpoints.push_back(checkpoint);
+    } else {
+        delete checkpoint;
+    }
+}
+
 void CheckpointManager::getAllItemsForTAPConnection(const std::string &name,
                                                     std::vector<queued_item> &items) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it == tapCursors.end()) {
         LOG(EXTENSION_LOG_DEBUG,
@@ -793,7 +1175,18 @@ void CheckpointManager::getAllItemsForTAPConnection(const std::string &name,
 }
 
 queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMutationItem) {
+    std::list<std::string> others, moved;
+    uint64_t epoch;
+    return nextItem(name, isLastMutationItem, others, moved, epoch);
+}
+
+queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMutationItem,
+                                        const std::list<std::string> &others,
+                                        std::list<std::string> &moved,
+                                        uint64_t &epoch) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
+    epoch = cursorEpoch.get();
     isLastMutationItem = false;
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it == tapCursors.end()) {
@@ -812,7 +1205,37 @@ queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMut
     }
 
     CheckpointCursor &cursor = it->second;
-    if ((*(it->second.currentCheckpoint))->getState() == CHECKPOINT_CLOSED) {
+    std::list<CheckpointCursor*> along;
+    if ((*(cursor.currentPos))->getOperation() != queue_op_checkpoint_end) {
+        std::list<std::string>::const_iterator nit = others.begin();
+        for (; nit != others.end(); ++nit) {
+            std::map<const std::string, CheckpointCursor>::iterator oit =
+                tapCursors.find(*nit);
+            if (oit != tapCursors.end() &&
+                oit->second.currentCheckpoint == cursor.currentCheckpoint &&
+                oit->second.currentPos == cursor.currentPos) {
+                along.push_back(&(oit->second));
+            }
+        }
+    }
+
+    queued_item qi = nextItemFromCursor(cursor, isLastMutationItem);
+    enum queue_operation op = qi->getOperation();
+    if (op != queue_op_empty && op != queue_op_checkpoint_end) {
+        std::list<CheckpointCursor*>::iterator cit = along.begin();
+        for (; cit != along.end(); ++cit) {
+            bool isLastItem = false;
+            // Same position, so the same item.
+            nextItemFromCursor(**cit, isLastItem);
+            moved.push_back((*cit)->name);
+        }
+    }
+    return qi;
+}
+
+queued_item CheckpointManager::nextItemFromCursor(CheckpointCursor &cursor,
+                                                  bool &isLastMutationItem) {
+    if ((*(cursor.currentCheckpoint))->getState() == CHECKPOINT_CLOSED) {
         return nextItemFromClosedCheckpoint(cursor, isLastMutationItem);
     } else {
         return nextItemFromOpenCheckpoint(cursor, isLastMutationItem);
@@ -859,20 +1282,28 @@ queued_item CheckpointManager::nextItemFromOpenCheckpoint(CheckpointCursor &curs
 
 void CheckpointManager::clear(vbucket_state_t vbState) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     std::list<Checkpoint*>::iterator it = checkpointList.begin();
     // Remove all the checkpoints.
     while(it != checkpointList.end()) {
-        delete *it;
+        retireCheckpoint_UNLOCKED(*it);
         ++it;
     }
     checkpointList.clear();
+    // The persistence cursor is reset below, so a pending range has nothing left to commit.
+    persistenceRangePending = false;
     numItems = 0;
     mutationCounter = 0;
+    checkpointSeqnos.clear();
+    persistedSeqno.set(0);
 
     uint64_t checkpointId = vbState == vbucket_state_active ? 1 : 0;
     // Add a new open checkpoint.
     addNewCheckpoint_UNLOCKED(checkpointId);
     resetCursors();
+    // Nothing queued so far is left to persist or replicate.
+    persistedMutationId.set(mutationCounter);
+    replicatedMutationId.set(mutationCounter);
 }
 
 void CheckpointManager::resetCursors(bool resetPersistenceCursor) {
@@ -892,14 +1323,17 @@ void CheckpointManager::resetCursors(bool resetPersistenceCursor) {
         cit->second.offset = 0;
         checkpointList.front()->registerCursorName(cit->second.name);
     }
+    cursorEpoch.set(++nextCursorEpoch);
 }
 
 void CheckpointManager::resetTAPCursors(const std::list<std::string> &cursors) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     std::list<std::string>::const_iterator it = cursors.begin();
     for (; it != cursors.end(); ++it) {
         registerTAPCursor_UNLOCKED(*it, getOpenCheckpointId_UNLOCKED(), true);
     }
+    cursorEpoch.set(++nextCursorEpoch);
 }
 
 bool CheckpointManager::moveCursorToNextCheckpoint(CheckpointCursor &cursor) {
@@ -924,6 +1358,7 @@ bool CheckpointManager::moveCursorToNextCheckpoint(CheckpointCursor &cursor) {
 
 size_t CheckpointManager::getNumOpenChkItems() {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     if (checkpointList.empty()) {
         return 0;
     }
@@ -939,14 +1374,14 @@ uint64_t CheckpointManager::checkOpenCheckpoint_UNLOCKED(bool forceCreation, boo
 
     timeBound = timeBound &&
                 (ep_real_time() - checkpointList.back()->getCreationTime()) >=
-                checkpointConfig.getCheckpointPeriod();
+                getCheckpointPeriod_UNLOCKED();
     // Create the new open checkpoint if any of the following conditions is satisfied:
     // (1) force creation due to online update or high memory usage
     // (2) current checkpoint is reached to the max number of items allowed.
     // (3) time elapsed since the creation of the current checkpoint is greater than the threshold
     if (forceCreation ||
-        (checkpointConfig.isItemNumBasedNewCheckpoint() &&
-         checkpointList.back()->getNumItems() >= checkpointConfig.getCheckpointMaxItems()) ||
+        ((checkpointConfig.isItemNumBasedNewCheckpoint() || checkpointConfig.isAdaptive()) &&
+         checkpointList.back()->getNumItems() >= getCheckpointMaxItems_UNLOCKED()) ||
         (checkpointList.back()->getNumItems() > 0 && timeBound)) {
 
         checkpoint_id = checkpointList.back()->getId();
@@ -958,13 +1393,19 @@ uint64_t CheckpointManager::checkOpenCheckpoint_UNLOCKED(bool forceCreation, boo
 
 bool CheckpointManager::eligibleForEviction(const std::string &key) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     uint64_t smallest_mid;
 
     // Get the mutation id of the item pointed by the slowest cursor.
     // This won't cause much overhead as the number of cursors per vbucket is
     // usually bounded to 3 (persistence cursor + 2 replicas).
-    const std::string &pkey = (*(persistenceCursor.currentPos))->getKey();
-    smallest_mid = (*(persistenceCursor.currentCheckpoint))->getMutationIdForKey(pkey);
+    if (checkpointConfig.isPersistent()) {
+        const std::string &pkey = (*(persistenceCursor.currentPos))->getKey();
+        smallest_mid = (*(persistenceCursor.currentCheckpoint))->getMutationIdForKey(pkey);
+    } else {
+        // Only the TAP cursors read the items of an ephemeral bucket.
+        smallest_mid = std::numeric_limits<uint64_t>::max();
+    }
     std::map<const std::string, CheckpointCursor>::iterator mit = tapCursors.begin();
     for (; mit != tapCursors.end(); ++mit) {
         const std::string &tkey = (*(mit->second.currentPos))->getKey();
@@ -992,6 +1433,7 @@ bool CheckpointManager::eligibleForEviction(const std::string &key) {
 
 size_t CheckpointManager::getNumItemsForTAPConnection(const std::string &name) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     size_t remains = 0;
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it != tapCursors.end()) {
@@ -1001,6 +1443,9 @@ size_t CheckpointManager::getNumItemsForTAPConnection(const std::string &name) {
 }
 
 size_t CheckpointManager::getNumItemsForPersistence_UNLOCKED() {
+    if (!checkpointConfig.isPersistent()) {
+        return 0;
+    }
     size_t num_items = numItems;
     size_t offset = persistenceCursor.offset;
 
@@ -1009,7 +1454,7 @@ size_t CheckpointManager::getNumItemsForPersistence_UNLOCKED() {
     std::list<Checkpoint*>::iterator curr_chk = persistenceCursor.currentCheckpoint;
     for (; curr_chk != checkpointList.end(); ++curr_chk) {
         if (curr_chk == persistenceCursor.currentCheckpoint) {
-            std::list<queued_item>::iterator curr_pos = persistenceCursor.currentPos;
+            CheckpointQueue::iterator curr_pos = persistenceCursor.currentPos;
             ++curr_pos;
             if (curr_pos == (*curr_chk)->end()) {
                 continue;
@@ -1040,6 +1485,7 @@ size_t CheckpointManager::getNumItemsForPersistence_UNLOCKED() {
 
 void CheckpointManager::decrTapCursorFromCheckpointEnd(const std::string &name) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it != tapCursors.end() &&
         (*(it->second.currentPos))->getOperation() == queue_op_checkpoint_end) {
@@ -1059,7 +1505,7 @@ uint64_t CheckpointManager::getMutationIdForKey(uint64_t chk_id, std::string key
 }
 
 bool CheckpointManager::isLastMutationItemInCheckpoint(CheckpointCursor &cursor) {
-    std::list<queued_item>::iterator it = cursor.currentPos;
+    CheckpointQueue::iterator it = cursor.currentPos;
     ++it;
     if (it == (*(cursor.currentCheckpoint))->end() ||
         (*it)->getOperation() == queue_op_checkpoint_end) {
@@ -1071,6 +1517,7 @@ bool CheckpointManager::isLastMutationItemInCheckpoint(CheckpointCursor &cursor)
 void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id,
                                                  const RCPtr<VBucket> &vbucket) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
 
     // Ignore CHECKPOINT_START message with ID 0 as 0 is reserved for representing backfill.
     if (id == 0) {
@@ -1142,6 +1589,12 @@ void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id,
 void CheckpointManager::collapseCheckpoints(uint64_t id) {
     assert(!checkpointList.empty());
 
+    // The cursors are repositioned in the collapsed checkpoint by the mutation ids of the items
+    // they point to, so move the persistence cursor past a pending range first.
+    if (persistenceRangePending) {
+        commitPersistenceRange_UNLOCKED(pendingRange);
+    }
+
     std::map<std::string, uint64_t> cursorMap;
     std::map<const std::string, CheckpointCursor>::iterator itr;
     for (itr = tapCursors.begin(); itr != tapCursors.end(); itr++) {
@@ -1162,7 +1615,7 @@ void CheckpointManager::collapseCheckpoints(uint64_t id) {
         size_t numAddedItems = checkpointList.back()->mergePrevCheckpoint(*rit);
         numDuplicatedItems += ((*rit)->getNumItems() - numAddedItems);
         numMetaItems += 2; // checkpoint start and end meta items
-        delete *rit;
+        retireCheckpoint_UNLOCKED(*rit);
     }
     numItems -= (numDuplicatedItems + numMetaItems);
 
@@ -1184,8 +1637,8 @@ void CheckpointManager::putCursorsInChk(std::map<std::string, uint64_t> &cursors
                                         std::list<Checkpoint*>::iterator chkItr) {
     int i;
     Checkpoint *chk = *chkItr;
-    std::list<queued_item>::iterator cit = chk->begin();
-    std::list<queued_item>::iterator last = chk->begin();
+    CheckpointQueue::iterator cit = chk->begin();
+    CheckpointQueue::iterator last = chk->begin();
     for (i = 0; cit != chk->end(); ++i, ++cit) {
         uint64_t id = chk->getMutationIdForKey((*cit)->getKey());
         std::map<std::string, uint64_t>::iterator mit = cursors.begin();
@@ -1232,13 +1685,14 @@ void CheckpointManager::putCursorsInChk(std::map<std::string, uint64_t> &cursors
 
 bool CheckpointManager::hasNext(const std::string &name) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it == tapCursors.end() || getOpenCheckpointId_UNLOCKED() == 0) {
         return false;
     }
 
     bool hasMore = true;
-    std::list<queued_item>::iterator curr = it->second.currentPos;
+    CheckpointQueue::iterator curr = it->second.currentPos;
     ++curr;
     if (curr == (*(it->second.currentCheckpoint))->end() &&
         (*(it->second.currentCheckpoint)) == checkpointList.back()) {
@@ -1263,8 +1717,9 @@ queued_item CheckpointManager::createCheckpointItem(uint64_t id,
 
 bool CheckpointManager::hasNextForPersistence() {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     bool hasMore = true;
-    std::list<queued_item>::iterator curr = persistenceCursor.currentPos;
+    CheckpointQueue::iterator curr = persistenceCursor.currentPos;
     ++curr;
     if (curr == (*(persistenceCursor.currentCheckpoint))->end() &&
         (*(persistenceCursor.currentCheckpoint)) == checkpointList.back()) {
@@ -1275,6 +1730,7 @@ bool CheckpointManager::hasNextForPersistence() {
 
 uint64_t CheckpointManager::createNewCheckpoint() {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     if (checkpointList.back()->getNumItems() > 0) {
         uint64_t chk_id = checkpointList.back()->getId();
         closeOpenCheckpoint_UNLOCKED(chk_id);
@@ -1302,6 +1758,7 @@ void CheckpointManager::decrCursorPos_UNLOCKED(CheckpointCursor &cursor) {
 
 uint64_t CheckpointManager::getPersistenceCursorPreChkId() {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     return pCursorPreCheckpointId;
 }
 
@@ -1313,12 +1770,18 @@ void CheckpointConfig::addConfigChangeListener(EventuallyPersistentEngine &engin
                               new CheckpointConfigChangeListener(engine.getCheckpointConfig()));
     configuration.addValueChangedListener("max_checkpoints",
                               new CheckpointConfigChangeListener(engine.getCheckpointConfig()));
+    configuration.addValueChangedListener("chk_queue_batch_size",
+                              new CheckpointConfigChangeListener(engine.getCheckpointConfig()));
     configuration.addValueChangedListener("inconsistent_slave_chk",
                               new CheckpointConfigChangeListener(engine.getCheckpointConfig()));
     configuration.addValueChangedListener("item_num_based_new_chk",
                               new CheckpointConfigChangeListener(engine.getCheckpointConfig()));
     configuration.addValueChangedListener("keep_closed_chks",
                               new CheckpointConfigChangeListener(engine.getCheckpointConfig()));
+    configuration.addValueChangedListener("adaptive_chk",
+                              new CheckpointConfigChangeListener(engine.getCheckpointConfig()));
+    configuration.addValueChangedListener("max_chk_mem_percent",
+                              new CheckpointConfigChangeListener(engine.getCheckpointConfig()));
 }
 
 CheckpointConfig::CheckpointConfig(EventuallyPersistentEngine &e) {
@@ -1328,6 +1791,10 @@ CheckpointConfig::CheckpointConfig(EventuallyPersistentEngine &e) {
     maxCheckpoints = config.getMaxCheckpoints();
     itemNumBasedNewCheckpoint = config.isItemNumBasedNewChk();
     keepClosedCheckpoints = config.isKeepClosedChks();
+    setQueueBatchSize(config.getChkQueueBatchSize());
+    adaptive = config.isAdaptiveChk();
+    setMaxMemPercent(config.getMaxChkMemPercent());
+    persistent = config.getBucketType().compare("ephemeral") != 0;
 }
 
 bool CheckpointConfig::validateCheckpointMaxItemsParam(size_t checkpoint_max_items) {
@@ -1390,8 +1857,29 @@ void CheckpointConfig::setMaxCheckpoints(size_t value) {
     maxCheckpoints = value;
 }
 
+void CheckpointConfig::setQueueBatchSize(size_t value) {
+    if (value < 1 || value > MAX_CHECKPOINT_QUEUE_BATCH_SIZE) {
+        LOG(EXTENSION_LOG_WARNING,
+            "New chk_queue_batch_size param value %ld is not ranged between "
+            "1 and %d; not batching", value, MAX_CHECKPOINT_QUEUE_BATCH_SIZE);
+        value = DEFAULT_CHECKPOINT_QUEUE_BATCH_SIZE;
+    }
+    queueBatchSize = value;
+}
+
+void CheckpointConfig::setMaxMemPercent(size_t value) {
+    if (value < 1 || value > MAX_CHECKPOINT_MEM_PERCENT) {
+        LOG(EXTENSION_LOG_WARNING,
+            "New max_chk_mem_percent param value %ld is not ranged between "
+            "1 and %d", value, MAX_CHECKPOINT_MEM_PERCENT);
+        value = DEFAULT_MAX_CHECKPOINT_MEM_PERCENT;
+    }
+    maxMemPercent = value;
+}
+
 void CheckpointManager::addStats(ADD_STAT add_stat, const void *cookie) {
     LockHolder lh(queueLock);
+    queueStagedItems_UNLOCKED();
     char buf[256];
 
     snprintf(buf, sizeof(buf), "vb_%d:open_checkpoint_id", vbucketId);
@@ -1409,15 +1897,66 @@ void CheckpointManager::addStats(ADD_STAT add_stat, const void *cookie) {
     add_casted_stat(buf, checkpointList.size(), add_stat, cookie);
     snprintf(buf, sizeof(buf), "vb_%d:num_items_for_persistence", vbucketId);
     add_casted_stat(buf, getNumItemsForPersistence_UNLOCKED(), add_stat, cookie);
+    snprintf(buf, sizeof(buf), "vb_%d:mem_usage", vbucketId);
+    size_t memUsage = 0;
+    std::list<Checkpoint*>::iterator chk_it = checkpointList.begin();
+    for (; chk_it != checkpointList.end(); ++chk_it) {
+        memUsage += (*chk_it)->getMemoryUsage();
+    }
+    add_casted_stat(buf, memUsage, add_stat, cookie);
+    if (checkpointConfig.isAdaptive()) {
+        snprintf(buf, sizeof(buf), "vb_%d:adaptive_max_items", vbucketId);
+        add_casted_stat(buf, getCheckpointMaxItems_UNLOCKED(), add_stat, cookie);
+        snprintf(buf, sizeof(buf), "vb_%d:adaptive_period", vbucketId);
+        add_casted_stat(buf, getCheckpointPeriod_UNLOCKED(), add_stat, cookie);
+    }
     snprintf(buf, sizeof(buf), "vb_%d:checkpoint_extension", vbucketId);
     add_casted_stat(buf, isCheckpointExtension() ? "true" : "false",
                     add_stat, cookie);
 
+    addCursorStats_UNLOCKED(persistenceCursor, add_stat, cookie);
     std::map<const std::string, CheckpointCursor>::iterator tap_it = tapCursors.begin();
     for (; tap_it != tapCursors.end(); ++tap_it) {
         snprintf(buf, sizeof(buf),
                  "vb_%d:%s:cursor_checkpoint_id", vbucketId, tap_it->first.c_str());
         add_casted_stat(buf, (*(tap_it->second.currentCheckpoint))->getId(),
                         add_stat, cookie);
+        addCursorStats_UNLOCKED(tap_it->second, add_stat, cookie);
     }
 }
+
+void CheckpointManager::addCursorStats_UNLOCKED(CheckpointCursor &cursor,
+                                                ADD_STAT add_stat, const void *cookie) {
+    // The closed checkpoints from the cursor's one on can't be removed until it moves past
+    // them.
+    size_t memPinned = 0;
+    size_t numPinned = 0;
+    std::list<Checkpoint*>::iterator it = cursor.currentCheckpoint;
+    for (; it != checkpointList.end(); ++it) {
+        if ((*it)->getState() == CHECKPOINT_CLOSED) {
+            memPinned += (*it)->getMemoryUsage();
+            ++numPinned;
+        }
+    }
+
+    // The age of the oldest item the cursor has yet to visit.
+    rel_time_t oldestAge = 0;
+    it = cursor.currentCheckpoint;
+    CheckpointQueue::iterator pos = cursor.currentPos;
+    while (++pos == (*it)->end() && ++it != checkpointList.end()) {
+        pos = (*it)->begin();
+    }
+    if (it != checkpointList.end()) {
+        rel_time_t now = ep_current_time();
+        rel_time_t queued = (*pos)->getQueuedTime();
+        oldestAge = now > queued ? now - queued : 0;
+    }
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "vb_%d:%s:cursor_mem_pinned", vbucketId, cursor.name.c_str());
+    add_casted_stat(buf, memPinned, add_stat, cookie);
+    snprintf(buf, sizeof(buf), "vb_%d:%s:cursor_chks_pinned", vbucketId, cursor.name.c_str());
+    add_casted_stat(buf, numPinned, add_stat, cookie);
+    snprintf(buf, sizeof(buf), "vb_%d:%s:cursor_oldest_age", vbucketId, cursor.name.c_str());
+    add_casted_stat(buf, oldestAge, add_stat, cookie);
+}
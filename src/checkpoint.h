@@ -26,10 +26,13 @@
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "atomic.h"
+#include "checkpoint_queue.h"
 #include "common.h"
+#include "lock_profiler.h"
 #include "locks.h"
 #include "queueditem.h"
 #include "stats.h"
@@ -45,6 +48,15 @@
 #define DEFAULT_MAX_CHECKPOINTS 2
 #define MAX_CHECKPOINTS_UPPER_BOUND 5
 
+#define DEFAULT_MAX_CHECKPOINT_MEM_PERCENT 10
+#define MAX_CHECKPOINT_MEM_PERCENT 50
+
+#define DEFAULT_CHECKPOINT_QUEUE_BATCH_SIZE 1 // Don't batch.
+#define MAX_CHECKPOINT_QUEUE_BATCH_SIZE 1000
+
+// The checkpoints whose persisted seqno is kept for resuming TAP streams.
+#define CHECKPOINT_SEQNO_HISTORY 64
+
 /**
  * The state of a given checkpoint.
  */
@@ -53,19 +65,6 @@ typedef enum {
     CHECKPOINT_CLOSED  //!< The checkpoint is not open.
 } checkpoint_state;
 
-/**
- * A checkpoint index entry.
- */
-struct index_entry {
-    std::list<queued_item>::iterator position;
-    uint64_t mutation_id;
-};
-
-/**
- * The checkpoint index maps a key to a checkpoint index_entry.
- */
-typedef unordered_map<std::string, index_entry> checkpoint_index;
-
 class Checkpoint;
 class CheckpointManager;
 class CheckpointConfig;
@@ -87,14 +86,14 @@ public:
 
     CheckpointCursor(const std::string &n,
                      std::list<Checkpoint*>::iterator checkpoint,
-                     std::list<queued_item>::iterator pos,
+                     CheckpointQueue::iterator pos,
                      size_t os = 0, bool isClosedCheckpointOnly = false ) :
         name(n), currentCheckpoint(checkpoint), currentPos(pos), offset(os) { }
 
 private:
     std::string                      name;
     std::list<Checkpoint*>::iterator currentCheckpoint;
-    std::list<queued_item>::iterator currentPos;
+    CheckpointQueue::iterator currentPos;
     Atomic<size_t>                   offset;
 };
 
@@ -130,9 +129,11 @@ public:
     Checkpoint(EPStats &st, uint64_t id, uint16_t vbid,
                checkpoint_state state = CHECKPOINT_OPEN) :
         stats(st), checkpointId(id), vbucketId(vbid), creationTime(ep_real_time()),
-        checkpointState(state), numItems(0), memOverhead(0) {
+        checkpointState(state), numItems(0),
+        memOverhead(toWrite.getMemorySize() + keyIndex.getMemorySize()), itemsSize(0) {
         stats.memOverhead.incr(memorySize());
         assert(stats.memOverhead.get() < GIGANTOR);
+        stats.checkpointMemory.incr(memorySize());
     }
 
     ~Checkpoint();
@@ -225,34 +226,42 @@ public:
     queue_dirty_t queueDirty(const queued_item &qi, CheckpointManager *checkpointManager);
 
 
-    std::list<queued_item>::iterator begin() {
+    CheckpointQueue::iterator begin() {
         return toWrite.begin();
     }
 
-    std::list<queued_item>::iterator end() {
+    CheckpointQueue::iterator end() {
         return toWrite.end();
     }
 
-    std::list<queued_item>::reverse_iterator rbegin() {
+    CheckpointQueue::reverse_iterator rbegin() {
         return toWrite.rbegin();
     }
 
-    std::list<queued_item>::reverse_iterator rend() {
+    CheckpointQueue::reverse_iterator rend() {
         return toWrite.rend();
     }
 
     bool keyExists(const std::string &key);
 
     /**
-     * Return the memory overhead of this checkpoint instance, except for the memory used by
-     * all the items belonging to this checkpoint. The memory overhead of those items is
-     * accounted separately in "ep_kv_size" stat.
+     * Return the memory overhead of this checkpoint instance, including its queue nodes and
+     * key index but not the memory used by all the items belonging to this checkpoint. The
+     * memory overhead of those items is accounted separately in "ep_kv_size" stat.
      * @return memory overhead of this checkpoint instance.
      */
     size_t memorySize() {
         return sizeof(Checkpoint) + memOverhead;
     }
 
+    /**
+     * Return all the memory this checkpoint holds on to: its overhead plus the items
+     * belonging to it.
+     */
+    size_t getMemoryUsage() {
+        return memorySize() + itemsSize;
+    }
+
     /**
      * Merge the previous checkpoint into the this checkpoint by adding the items from
      * the previous checkpoint, which don't exist in this checkpoint.
@@ -269,6 +278,12 @@ public:
     uint64_t getMutationIdForKey(const std::string &key);
 
 private:
+    /**
+     * Bring memOverhead and the memory stats up to date with what the
+     * queue and the index have allocated, given the old memory usage.
+     */
+    void updateMemStats(size_t oldUsage);
+
     EPStats                       &stats;
     uint64_t                       checkpointId;
     uint16_t                       vbucketId;
@@ -276,10 +291,44 @@ private:
     checkpoint_state               checkpointState;
     size_t                         numItems;
     std::set<std::string>          cursors; // List of cursors with their unique names.
-    // List is used for queueing mutations as vector incurs shift operations for deduplication.
-    std::list<queued_item>         toWrite;
-    checkpoint_index               keyIndex;
+    // Not a vector, as deduplication removes items from the middle.
+    CheckpointQueue                toWrite;
+    CheckpointIndex                keyIndex;
     size_t                         memOverhead;
+    // Memory used by the items in toWrite.
+    size_t                         itemsSize;
+};
+
+/**
+ * The items the persistence cursor has yet to visit in the closed checkpoints ahead of it.
+ *
+ * A closed checkpoint that isn't the last one in the list doesn't change while the
+ * persistence cursor is in front of it, so the flusher can read the range without holding
+ * the checkpoint lock. The cursor only moves past the range once the flusher commits it.
+ */
+class PersistenceRange {
+    friend class CheckpointManager;
+public:
+
+    PersistenceRange() { }
+
+    bool empty() const {
+        return segments.empty();
+    }
+
+    /**
+     * Append the items in the range to the given list. The checkpoint lock doesn't need to
+     * be held.
+     */
+    void getItems(std::vector<queued_item> &items) const;
+
+private:
+    typedef std::pair<CheckpointQueue::iterator, CheckpointQueue::iterator> segment;
+
+    std::vector<segment>             segments;
+    // The checkpoint that follows the range, where the cursor moves on commit.
+    std::list<Checkpoint*>::iterator nextCheckpoint;
+    uint64_t                         lastCheckpointId;
 };
 
 /**
@@ -298,8 +347,20 @@ public:
         mutationCounter(0), persistenceCursor("persistence"),
         isCollapsedCheckpoint(false),
         checkpointExtension(false),
-        pCursorPreCheckpointId(0)
+        pCursorPreCheckpointId(0),
+        persistenceRangePending(false),
+        persistenceRangeInUse(false),
+        adaptiveMaxItems(0),
+        adaptivePeriod(0),
+        stagedVBucket(NULL),
+        stagingScopes(0),
+        persistedSeqno(0),
+        persistedMutationId(0),
+        replicatedMutationId(0),
+        cursorEpoch(++nextCursorEpoch)
     {
+        queueLock.setProfile(LockProfiler::get("checkpoint_queue"));
+        stagingLock.setProfile(LockProfiler::get("checkpoint_staging"));
         addNewCheckpoint(checkpointId);
         registerPersistenceCursor();
     }
@@ -316,6 +377,7 @@ public:
 
     void setOpenCheckpointId(uint64_t id) {
         LockHolder lh(queueLock);
+        queueStagedItems_UNLOCKED();
         setOpenCheckpointId_UNLOCKED(id);
     }
 
@@ -355,19 +417,134 @@ public:
      */
     uint64_t getCheckpointIdForTAPCursor(const std::string &name);
 
+    /**
+     * Register the cursor of a TAP connection that has every checkpoint
+     * before a given one, but whose checkpoint isn't in memory any more.
+     * The cursor is set to the oldest checkpoint in memory, and the items
+     * the connection lacks from the checkpoints dropped before it were
+     * all persisted with a disk seqno above the one returned.
+     * @param name the name of a given TAP connection
+     * @param checkpointId the first checkpoint the connection lacks
+     * @param seqno set to the disk seqno the vbucket file is to be
+     * streamed after
+     * @return false if the cursor isn't registered, as no such seqno is
+     * known for the checkpoint
+     */
+    bool registerTAPCursorForResume(const std::string &name,
+                                    uint64_t checkpointId, uint64_t &seqno);
+
+    /**
+     * Register the cursor of a TAP connection at the beginning of the
+     * oldest checkpoint in memory, which holds every item that isn't
+     * persisted yet.
+     * @param name the name of a given TAP connection
+     */
+    void registerTAPCursorAtOldest(const std::string &name);
+
+    /**
+     * Note that an item of this vbucket was persisted with a given seqno.
+     */
+    void notePersistedSeqno(uint64_t seqno) {
+        persistedSeqno.setIfBigger(seqno);
+    }
+
+    uint64_t getPersistedSeqno() {
+        return persistedSeqno.get();
+    }
+
+    /**
+     * Note that the mutations of this vbucket were persisted, up to the one
+     * with a given mutation id.
+     */
+    void notePersistedMutation(uint64_t id) {
+        persistedMutationId.setIfBigger(id);
+    }
+
+    /**
+     * Note that a replica acked the mutation with a given mutation id, and
+     * so those sent before it.
+     */
+    void noteReplicatedMutation(uint64_t id) {
+        replicatedMutationId.setIfBigger(id);
+    }
+
+    /**
+     * The number of mutations queued since the last one known persisted,
+     * without taking the queue lock.
+     */
+    uint64_t getUnpersistedMutations() {
+        return watermarkLag(persistedMutationId.get());
+    }
+
+    /**
+     * The number of mutations queued since the last one a replica acked.
+     */
+    uint64_t getUnreplicatedMutations() {
+        return watermarkLag(replicatedMutationId.get());
+    }
+
     size_t getNumOfTAPCursors();
 
     std::list<std::string> getTAPCursorNames();
 
+    /**
+     * Return a value that changes whenever the TAP cursors are all moved
+     * back or re-registered at once, and that no other checkpoint manager
+     * ever had.  Whatever was read through the cursors before it changed is
+     * stale.
+     */
+    uint64_t getCursorEpoch() const {
+        return cursorEpoch.get();
+    }
+
     bool tapCursorExists(const std::string &name);
 
     /**
      * Queue an item to be written to persistent layer.
+     *
+     * If the checkpoint queue batch size is more than one, the item is
+     * appended to a staging buffer and the whole buffer is queued into
+     * the open checkpoint once it's full, so that writers take the queue
+     * lock once per batch.  Every method that looks at the checkpoints
+     * queues the staged items first, so cursors still see the items in
+     * the order they were queued, de-duplicated as before.  The vbucket
+     * stats of a staged item that turns out to be a duplicate are fixed
+     * up when it's queued.
+     *
      * @param item the item to be persisted.
      * @param vbucket the vbucket that a new item is pushed into.
-     * @return true if an item queued increases the size of persistence queue by 1.
+     * @return true if an item queued increases the size of persistence queue by 1,
+     *         which a staged item is assumed to do.
+     */
+    bool queueDirty(const queued_item &qi, VBucket *vbucket);
+
+    bool queueDirty(const queued_item &qi, const RCPtr<VBucket> &vbucket) {
+        return queueDirty(qi, vbucket.get());
+    }
+
+    /**
+     * Queue a run of items into the open checkpoint in order, taking the
+     * queue lock once for all of them.  As with staged items, the caller
+     * counts them all as queued, and the stats of those that turn out to
+     * be duplicates (or that a closed replica checkpoint drops) are fixed
+     * up here.
+     *
+     * @return the number of items that increased the persistence queue
      */
-    bool queueDirty(const queued_item &qi, const RCPtr<VBucket> &vbucket);
+    size_t queueDirtyBatch(const std::vector<queued_item> &items,
+                           VBucket *vbucket);
+
+    /**
+     * Stage the items queued from now on, whatever the queue batch size,
+     * until the matching endStaging() call queues them all at once.  At
+     * most MAX_CHECKPOINT_QUEUE_BATCH_SIZE items are staged before they're
+     * queued anyway.  Scopes may nest and overlap between threads.
+     */
+    void beginStaging() {
+        ++stagingScopes;
+    }
+
+    void endStaging();
 
     /**
      * Return the next item to be sent to a given TAP connection
@@ -378,6 +555,24 @@ public:
      */
     queued_item nextItem(const std::string &name, bool &isLastMutationItem);
 
+    /**
+     * Return the next item to be sent to a given TAP connection, and move the
+     * cursors of the other given TAP connections that are at the same position
+     * past it too, so that a group of connections walks the checkpoints once.
+     * Cursors are never taken past a checkpoint end, as each connection has to
+     * wait there for its own acks.
+     * @param name the name of a given TAP connection
+     * @param isLastMutationItem flag indicating if the item to be returned is the last mutation one
+     * in the closed checkpoint.
+     * @param others the names of the TAP connections to take along
+     * @param moved the list the names of the TAP connections taken along are added to
+     * @param epoch set to the cursor epoch the item was read in
+     * @return the next item to be sent to a given TAP connection.
+     */
+    queued_item nextItem(const std::string &name, bool &isLastMutationItem,
+                         const std::list<std::string> &others,
+                         std::list<std::string> &moved, uint64_t &epoch);
+
     /**
      * Return the list of items, which needs to be persisted, to the flusher.
      * @param items the array that will contain the list of items to be persisted and
@@ -385,6 +580,23 @@ public:
      */
     void getAllItemsForPersistence(std::vector<queued_item> &items);
 
+    /**
+     * Return the items to be persisted without copying the closed checkpoints under the lock.
+     * If the persistence cursor is in a closed checkpoint, the closed checkpoints from there
+     * up to the last one are returned as a range and the cursor stays where it is until the
+     * range is committed. Otherwise the items of the open checkpoint are copied into the
+     * array and the cursor moves past them, as with getAllItemsForPersistence.
+     * @param range the range of closed checkpoint items to be persisted
+     * @param items the array that will contain the items copied from the open checkpoint
+     */
+    void getItemsForPersistence(PersistenceRange &range, std::vector<queued_item> &items);
+
+    /**
+     * Move the persistence cursor past a range returned by getItemsForPersistence once its
+     * items are persisted.
+     */
+    void commitPersistenceRange(PersistenceRange &range);
+
     /**
      * Return the list of all the items to a given TAP cursor since its current position.
      * @param name the name of a given TAP connection.
@@ -411,6 +623,7 @@ public:
 
     size_t getNumItemsForPersistence() {
         LockHolder lh(queueLock);
+        queueStagedItems_UNLOCKED();
         return getNumItemsForPersistence_UNLOCKED();
     }
 
@@ -445,6 +658,21 @@ public:
 
     void addStats(ADD_STAT add_stat, const void *cookie);
 
+    /**
+     * Return the memory held by all the checkpoints of this vbucket, including their items.
+     */
+    size_t getMemoryUsage();
+
+    /**
+     * Get the TAP cursors that are so far behind that dropping them (and backfilling their
+     * connections from disk instead) is the only way to free the closed checkpoints they
+     * hold.  Only reported in adaptive mode while checkpoints are over their memory budget:
+     * a TAP cursor lags too far once it's still in a closed checkpoint the persistence
+     * cursor has left.
+     * @param cursors the list to add the cursor names to
+     */
+    void getLaggingTAPCursors(std::list<std::string> &cursors);
+
     /**
      * Create a new open checkpoint by force.
      * @return the new open checkpoint id
@@ -505,12 +733,28 @@ private:
 
     void removeInvalidCursorsOnCheckpoint(Checkpoint *pCheckpoint);
 
+    /**
+     * Queue an item into the open checkpoint.
+     * The lock should be acquired before calling this function.
+     * @return true if the item increases the size of persistence queue by 1.
+     */
+    bool queueDirty_UNLOCKED(const queued_item &qi, VBucket *vbucket);
+
+    /**
+     * Queue the staged items into the open checkpoint in the order they
+     * were staged.
+     * The lock should be acquired before calling this function.
+     */
+    void queueStagedItems_UNLOCKED();
+
     /**
      * Create a new open checkpoint and add it to the checkpoint list.
      * @param id the id of a checkpoint to be created.
      */
     bool addNewCheckpoint(uint64_t id);
 
+    queued_item nextItemFromCursor(CheckpointCursor &cursor, bool &isLastMutationItem);
+
     queued_item nextItemFromClosedCheckpoint(CheckpointCursor &cursor, bool &isLastMutationItem);
 
     queued_item nextItemFromOpenCheckpoint(CheckpointCursor &cursor, bool &isLastMutationItem);
@@ -534,6 +778,7 @@ private:
 
     uint64_t checkOpenCheckpoint(bool forceCreation, bool timeBound) {
         LockHolder lh(queueLock);
+        queueStagedItems_UNLOCKED();
         return checkOpenCheckpoint_UNLOCKED(forceCreation, timeBound);
     }
 
@@ -544,6 +789,11 @@ private:
         return ++mutationCounter;
     }
 
+    uint64_t watermarkLag(uint64_t watermark) {
+        uint64_t last = mutationCounter.get();
+        return last > watermark ? last - watermark : 0;
+    }
+
     void decrCursorOffset_UNLOCKED(CheckpointCursor &cursor, size_t decr);
 
     void decrCursorPos_UNLOCKED(CheckpointCursor &cursor);
@@ -552,6 +802,48 @@ private:
 
     bool isCheckpointCreationForHighMemUsage(const RCPtr<VBucket> &vbucket);
 
+    /**
+     * In adaptive mode, pick the size and lifetime of the open checkpoint from how full
+     * the checkpoint memory budget is, how much the open checkpoint is deduplicating,
+     * and how far behind the slowest cursor is.
+     * The lock should be acquired before calling this function.
+     */
+    void adjustCheckpointBounds_UNLOCKED();
+
+    /**
+     * Return the number of items that close the open checkpoint, as picked in adaptive
+     * mode or as configured.
+     */
+    size_t getCheckpointMaxItems_UNLOCKED();
+
+    /**
+     * Return the lifetime of the open checkpoint, as picked in adaptive mode or as
+     * configured.
+     */
+    rel_time_t getCheckpointPeriod_UNLOCKED();
+
+    /**
+     * Move the persistence cursor to the checkpoint that follows a persistence range.
+     * The lock should be acquired before calling this function.
+     */
+    void commitPersistenceRange_UNLOCKED(PersistenceRange &range);
+
+    /**
+     * Delete a checkpoint, or keep it until the pending persistence range is committed if the
+     * flusher may still be reading it.
+     * The lock should be acquired before calling this function.
+     */
+    void retireCheckpoint_UNLOCKED(Checkpoint *checkpoint);
+
+    void getAllItemsForPersistence_UNLOCKED(std::vector<queued_item> &items);
+
+    /**
+     * Add the stats for the memory a given cursor keeps in checkpoints.
+     * The lock should be acquired before calling this function.
+     */
+    void addCursorStats_UNLOCKED(CheckpointCursor &cursor, ADD_STAT add_stat,
+                                 const void *cookie);
+
     void collapseClosedCheckpoints(std::list<Checkpoint*> &collapsedChks);
 
     void collapseCheckpoints(uint64_t id);
@@ -570,14 +862,47 @@ private:
     Mutex                    queueLock;
     uint16_t                 vbucketId;
     Atomic<size_t>           numItems;
-    uint64_t                 mutationCounter;
+    // Read without the queue lock by the watermark lags.
+    Atomic<uint64_t>         mutationCounter;
     std::list<Checkpoint*>   checkpointList;
     CheckpointCursor         persistenceCursor;
     bool                     isCollapsedCheckpoint;
     bool                     checkpointExtension;
     uint64_t                 lastClosedCheckpointId;
     uint64_t                 pCursorPreCheckpointId;
+    // The flusher holds a persistence range that hasn't been committed yet, so the
+    // persistence cursor and the closed checkpoints in the range must stay as they are.
+    bool                     persistenceRangePending;
+    PersistenceRange         pendingRange;
+    // The flusher may be reading a range, even if the cursor was already moved past it.
+    bool                     persistenceRangeInUse;
+    // Checkpoints removed while the flusher may be reading them.
+    std::list<Checkpoint*>   retiredCheckpoints;
     std::map<const std::string, CheckpointCursor> tapCursors;
+    // Checkpoint bounds picked in adaptive mode (0 until they're first picked).
+    size_t                   adaptiveMaxItems;
+    rel_time_t               adaptivePeriod;
+    // Items waiting to be queued, in order, and the vbucket they were
+    // queued for.  Guarded by stagingLock, which may be taken while
+    // holding queueLock but not the other way around.
+    SpinLock                 stagingLock;
+    std::vector<queued_item> stagedItems;
+    VBucket                 *stagedVBucket;
+    // Number of beginStaging() calls not yet ended.
+    Atomic<size_t>           stagingScopes;
+    // Highest disk seqno persisted for this vbucket since it was created.
+    Atomic<uint64_t>         persistedSeqno;
+    // Mutation ids of the last mutation persisted, and of the last one a
+    // replica acked.  Mutations are flushed and sent in mutation id order.
+    Atomic<uint64_t>         persistedMutationId;
+    Atomic<uint64_t>         replicatedMutationId;
+    // The persisted seqno as of the creation of recent checkpoints, by
+    // checkpoint id.  Thinned out as it grows, as any older checkpoint's
+    // seqno is a safe, if less precise, place to resume a later one from.
+    std::map<uint64_t, uint64_t> checkpointSeqnos;
+    // See getCursorEpoch().
+    Atomic<uint64_t>         cursorEpoch;
+    static Atomic<uint64_t>  nextCursorEpoch;
 };
 
 /**
@@ -591,7 +916,11 @@ public:
           checkpointMaxItems(DEFAULT_CHECKPOINT_ITEMS),
           maxCheckpoints(DEFAULT_MAX_CHECKPOINTS),
           itemNumBasedNewCheckpoint(true),
-          keepClosedCheckpoints(false)
+          keepClosedCheckpoints(false),
+          queueBatchSize(DEFAULT_CHECKPOINT_QUEUE_BATCH_SIZE),
+          adaptive(false),
+          maxMemPercent(DEFAULT_MAX_CHECKPOINT_MEM_PERCENT),
+          persistent(true)
     { /* empty */ }
 
     CheckpointConfig(EventuallyPersistentEngine &e);
@@ -616,6 +945,30 @@ public:
         return keepClosedCheckpoints;
     }
 
+    size_t getQueueBatchSize() const {
+        return queueBatchSize;
+    }
+
+    bool isAdaptive() const {
+        return adaptive;
+    }
+
+    /**
+     * Whether the items are persisted; the persistence cursor of an ephemeral
+     * bucket skips to each new open checkpoint so it never holds on to the
+     * closed ones.
+     */
+    bool isPersistent() const {
+        return persistent;
+    }
+
+    /**
+     * Get the number of bytes all the checkpoints together may hold in adaptive mode.
+     */
+    size_t getMemoryBudget(EPStats &st) const {
+        return st.getMaxDataSize() / 100 * maxMemPercent;
+    }
+
 protected:
     friend class CheckpointConfigChangeListener;
     friend class EventuallyPersistentEngine;
@@ -627,6 +980,12 @@ protected:
     void setCheckpointPeriod(size_t value);
     void setCheckpointMaxItems(size_t value);
     void setMaxCheckpoints(size_t value);
+    void setQueueBatchSize(size_t value);
+    void setMaxMemPercent(size_t value);
+
+    void allowAdaptive(bool value) {
+        adaptive = value;
+    }
 
     void allowItemNumBasedNewCheckpoint(bool value) {
         itemNumBasedNewCheckpoint = value;
@@ -651,6 +1010,15 @@ private:
     // Flag indicating if closed checkpoints should be kept in memory if the current memory usage
     // below the high water mark.
     bool keepClosedCheckpoints;
+    // Number of items staged before they're queued into the open checkpoint
+    // together.
+    size_t queueBatchSize;
+    // Flag indicating if checkpoint bounds adapt to memory use, deduplication and cursor lag.
+    bool adaptive;
+    // Percentage of the bucket quota all the checkpoints may use in adaptive mode.
+    size_t maxMemPercent;
+    // Flag indicating if the items are read by a flusher through the persistence cursor.
+    bool persistent;
 };
 
 #endif  // SRC_CHECKPOINT_H_
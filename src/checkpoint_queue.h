@@ -0,0 +1,352 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_CHECKPOINT_QUEUE_H_
+#define SRC_CHECKPOINT_QUEUE_H_ 1
+
+#include "config.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "queueditem.h"
+
+// The first chunk of a checkpoint queue holds this many items; each
+// one after that is twice the size of the last, up to the max.
+const size_t CHECKPOINT_QUEUE_MIN_CHUNK = 16;
+const size_t CHECKPOINT_QUEUE_MAX_CHUNK = 4096;
+
+// Initial number of slots in a checkpoint index (a power of two).
+const size_t CHECKPOINT_INDEX_MIN_SLOTS = 16;
+
+/**
+ * The ordered queue of items in a checkpoint.
+ *
+ * It behaves like the std::list it replaces: iterators stay valid until
+ * the item they point to is erased, and items can be erased from or
+ * inserted in the middle, which de-duplication needs.  The nodes are
+ * carved out of chunks owned by the queue instead of being allocated
+ * one by one, and erased nodes are reused by later pushes, so a
+ * checkpoint's memory only depends on how many items it holds at once.
+ */
+class CheckpointQueue {
+    struct Node {
+        Node() : prev(NULL), next(NULL) { }
+
+        queued_item item;
+        Node *prev;
+        Node *next; // Next free node when on the free list.
+    };
+
+public:
+
+    class iterator : public std::iterator<std::bidirectional_iterator_tag,
+                                          queued_item> {
+    public:
+        iterator() : node(NULL) { }
+
+        queued_item &operator*() const { return node->item; }
+        queued_item *operator->() const { return &node->item; }
+
+        iterator &operator++() {
+            node = node->next;
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator rv(*this);
+            node = node->next;
+            return rv;
+        }
+
+        iterator &operator--() {
+            node = node->prev;
+            return *this;
+        }
+
+        iterator operator--(int) {
+            iterator rv(*this);
+            node = node->prev;
+            return rv;
+        }
+
+        bool operator==(const iterator &other) const {
+            return node == other.node;
+        }
+
+        bool operator!=(const iterator &other) const {
+            return node != other.node;
+        }
+
+    private:
+        friend class CheckpointQueue;
+        explicit iterator(Node *n) : node(n) { }
+
+        Node *node;
+    };
+
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    CheckpointQueue() : freeList(NULL), nextChunkSize(CHECKPOINT_QUEUE_MIN_CHUNK),
+                        numNodes(0), memSize(0) {
+        head.prev = head.next = &head;
+    }
+
+    ~CheckpointQueue() {
+        std::vector<Node*>::iterator it = chunks.begin();
+        for (; it != chunks.end(); ++it) {
+            delete []*it;
+        }
+    }
+
+    iterator begin() { return iterator(head.next); }
+    iterator end() { return iterator(&head); }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+
+    bool empty() const { return numNodes == 0; }
+    size_t size() const { return numNodes; }
+
+    queued_item &back() {
+        assert(!empty());
+        return head.prev->item;
+    }
+
+    void push_back(const queued_item &qi) {
+        insert(end(), qi);
+    }
+
+    void pop_back() {
+        assert(!empty());
+        erase(iterator(head.prev));
+    }
+
+    /**
+     * Insert an item before the given position.
+     * @return the position of the new item
+     */
+    iterator insert(iterator pos, const queued_item &qi) {
+        Node *n = allocNode();
+        n->item = qi;
+        n->next = pos.node;
+        n->prev = pos.node->prev;
+        n->prev->next = n;
+        pos.node->prev = n;
+        ++numNodes;
+        return iterator(n);
+    }
+
+    void erase(iterator pos) {
+        Node *n = pos.node;
+        assert(n != &head);
+        n->prev->next = n->next;
+        n->next->prev = n->prev;
+        n->item.reset();
+        n->prev = NULL;
+        n->next = freeList;
+        freeList = n;
+        --numNodes;
+    }
+
+    /**
+     * Get the number of bytes allocated for the queue's nodes.
+     */
+    size_t getMemorySize() const {
+        return memSize;
+    }
+
+private:
+
+    Node *allocNode() {
+        if (freeList == NULL) {
+            Node *chunk = new Node[nextChunkSize];
+            chunks.push_back(chunk);
+            memSize += nextChunkSize * sizeof(Node);
+            for (size_t i = 0; i < nextChunkSize; ++i) {
+                chunk[i].next = freeList;
+                freeList = &chunk[i];
+            }
+            nextChunkSize = std::min(nextChunkSize * 2, CHECKPOINT_QUEUE_MAX_CHUNK);
+        }
+        Node *n = freeList;
+        freeList = n->next;
+        return n;
+    }
+
+    Node                head; // Sentinel; end() points here.
+    Node               *freeList;
+    std::vector<Node*>  chunks;
+    size_t              nextChunkSize;
+    size_t              numNodes;
+    size_t              memSize;
+
+    DISALLOW_COPY_AND_ASSIGN(CheckpointQueue);
+};
+
+/**
+ * A checkpoint index entry.
+ */
+struct index_entry {
+    CheckpointQueue::iterator position;
+    uint64_t mutation_id;
+};
+
+/**
+ * The checkpoint index maps a key to a checkpoint index_entry.
+ *
+ * It's an open addressing (linear probing) table of the keys' hashes
+ * and entries.  The key itself isn't copied: an entry's position points
+ * at the queued item for the key, which is compared on a hash match.
+ * It's up to the checkpoint to keep every entry pointing at an item
+ * with the entry's key.
+ */
+class CheckpointIndex {
+    struct Slot {
+        Slot() : hash(0) {
+            entry.mutation_id = 0;
+        }
+
+        bool isEmpty() const {
+            return entry.position == CheckpointQueue::iterator();
+        }
+
+        uint32_t    hash;
+        index_entry entry;
+    };
+
+public:
+
+    CheckpointIndex() : slots(CHECKPOINT_INDEX_MIN_SLOTS), numEntries(0) { }
+
+    /**
+     * Find the entry for a key.
+     * @return the entry, or NULL if the key isn't in the index.  It's
+     *         valid until the next insert or erase.
+     */
+    index_entry *find(const std::string &key) {
+        size_t i = findSlot(key, hash(key));
+        return slots[i].isEmpty() ? NULL : &slots[i].entry;
+    }
+
+    /**
+     * Set the entry for a key, adding the key if it isn't there.
+     */
+    void set(const std::string &key, const index_entry &entry) {
+        assert((*entry.position)->getKey() == key);
+        uint32_t h = hash(key);
+        size_t i = findSlot(key, h);
+        if (slots[i].isEmpty()) {
+            if ((numEntries + 1) * 2 > slots.size()) {
+                grow();
+                i = findSlot(key, h);
+            }
+            ++numEntries;
+            slots[i].hash = h;
+        }
+        slots[i].entry = entry;
+    }
+
+    void erase(const std::string &key) {
+        size_t i = findSlot(key, hash(key));
+        if (slots[i].isEmpty()) {
+            return;
+        }
+        // Shift back the entries that probed past this slot so lookups
+        // never have to step over a hole.
+        size_t mask = slots.size() - 1;
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (slots[j].isEmpty()) {
+                break;
+            }
+            size_t home = slots[j].hash & mask;
+            bool movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+            if (movable) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = Slot();
+        --numEntries;
+    }
+
+    size_t size() const {
+        return numEntries;
+    }
+
+    /**
+     * Get the number of bytes used by the index's slots.
+     */
+    size_t getMemorySize() const {
+        return slots.size() * sizeof(Slot);
+    }
+
+private:
+
+    static uint32_t hash(const std::string &key) {
+        uint32_t h = 2166136261U;
+        for (size_t i = 0; i < key.length(); ++i) {
+            h ^= static_cast<uint8_t>(key[i]);
+            h *= 16777619U;
+        }
+        return h;
+    }
+
+    /**
+     * Find the slot holding the key, or the empty slot it would go in.
+     */
+    size_t findSlot(const std::string &key, uint32_t h) const {
+        size_t mask = slots.size() - 1;
+        size_t i = h & mask;
+        while (!slots[i].isEmpty()) {
+            if (slots[i].hash == h && (*slots[i].entry.position)->getKey() == key) {
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void grow() {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        std::vector<Slot>::iterator it = old.begin();
+        for (; it != old.end(); ++it) {
+            if (!it->isEmpty()) {
+                size_t i = it->hash & mask;
+                while (!slots[i].isEmpty()) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = *it;
+            }
+        }
+    }
+
+    std::vector<Slot> slots;
+    size_t            numEntries;
+
+    DISALLOW_COPY_AND_ASSIGN(CheckpointIndex);
+};
+
+#endif  // SRC_CHECKPOINT_QUEUE_H_
@@ -20,6 +20,7 @@
 #include "checkpoint_remover.h"
 #include "ep.h"
 #include "ep_engine.h"
+#include "queueditem.h"
 #include "vbucket.h"
 
 /**
@@ -37,13 +38,23 @@ public:
 
     bool visitBucket(RCPtr<VBucket> &vb) {
         currentBucket = vb;
+        dropLaggingCursors(vb);
         bool newCheckpointCreated = false;
         removed = vb->checkpointManager.removeClosedUnrefCheckpoints(vb, newCheckpointCreated);
+        // This thread only frees queued items, so pass the ones it just
+        // freed on to the threads queueing mutations in one go.
+        if (removed > 0) {
+            QueuedItemPool::releaseThreadCache();
+        }
         // If the new checkpoint is created, notify this event to the tap notify IO thread
         // so that it can then signal all paused TAP connections.
         if (newCheckpointCreated) {
             store->getEPEngine().notifyNotificationThread();
         }
+        // Time out the connections waiting on keys of a vbucket that's not
+        // being flushed or replicated.
+        vb->notifyKeyWaitTimeouts(store->getEPEngine());
+        vb->notifyPersistenceWaitTimeouts(store->getEPEngine());
         update();
         return false;
     }
@@ -58,6 +69,29 @@ public:
         removed = 0;
     }
 
+    /**
+     * Backfill the TAP connections whose cursors hold closed checkpoints in memory
+     * while checkpoints are over their budget, which drops the cursors.
+     */
+    void dropLaggingCursors(RCPtr<VBucket> &vb) {
+        std::list<std::string> cursors;
+        vb->checkpointManager.getLaggingTAPCursors(cursors);
+        if (cursors.empty()) {
+            return;
+        }
+        store->getEPEngine().getTapConnMap().backfillConnections(cursors, vb->getId());
+        std::list<std::string>::iterator it = cursors.begin();
+        for (; it != cursors.end(); ++it) {
+            if (!vb->checkpointManager.tapCursorExists(*it)) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Dropped the lagging TAP cursor \"%s\" from vbucket %d to "
+                    "keep checkpoints within their memory budget",
+                    it->c_str(), vb->getId());
+                ++stats.numCursorsDropped;
+            }
+        }
+    }
+
     void complete() {
         if (stateFinalizer) {
             *stateFinalizer = true;
@@ -77,6 +111,13 @@ bool ClosedUnrefCheckpointRemover::callback(Dispatcher &d, TaskId &t) {
         shared_ptr<CheckpointVisitor> pv(new CheckpointVisitor(store, stats, &available));
         store->visit(pv, "Checkpoint Remover", &d, Priority::CheckpointRemoverPriority);
     }
-    d.snooze(t, sleepTime);
+    // Come back sooner while adaptive checkpoints are over their memory budget.
+    CheckpointConfig &config = store->getEPEngine().getCheckpointConfig();
+    if (config.isAdaptive() && sleepTime > 1 &&
+        stats.checkpointMemory.get() > config.getMemoryBudget(stats)) {
+        d.snooze(t, 1);
+    } else {
+        d.snooze(t, sleepTime);
+    }
     return true;
 }
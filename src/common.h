@@ -61,6 +61,7 @@ static inline int my_pthread_cond_timedwait(pthread_cond_t *restrict cond,
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 
 #if defined(HAVE_TR1_MEMORY)
 # include <tr1/memory>
@@ -135,6 +136,32 @@ inline bool less_tv(const struct timeval &tv1, const struct timeval &tv2) {
     }
 }
 
+/**
+ * Get the number of microseconds tv is in the past, 0 if it isn't.
+ */
+inline hrtime_t usec_since_tv(const struct timeval &tv,
+                              const struct timeval &now) {
+    if (!less_tv(tv, now)) {
+        return 0;
+    }
+    return (hrtime_t)(now.tv_sec - tv.tv_sec) * 1000000 +
+        now.tv_usec - tv.tv_usec;
+}
+
+/**
+ * Get the CPU time (in nanoseconds) used by the calling thread, or 0 if the
+ * platform has no per-thread CPU clock.
+ */
+inline hrtime_t gethrcputime() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec tm;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tm) == 0) {
+        return (((hrtime_t)tm.tv_sec) * 1000000000) + tm.tv_nsec;
+    }
+#endif
+    return 0;
+}
+
 inline bool parseUint16(const char *in, uint16_t *out) {
     assert(out != NULL);
     errno = 0;
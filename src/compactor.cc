@@ -0,0 +1,192 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "compactor.h"
+#include "ep.h"
+#include "ep_engine.h"
+#include "iomanager/iomanager.h"
+#include "kvshard.h"
+
+//! Steps a second a rate limited compaction is split in
+static const size_t STEPS_PER_SEC = 4;
+//! The bytes a step copies when the rate isn't limited
+static const size_t UNLIMITED_STEP_SIZE = 4 * 1024 * 1024;
+//! The fewest bytes a step copies, however low the rate
+static const size_t MIN_STEP_SIZE = 64 * 1024;
+
+void Compactor::start() {
+    LockHolder lh(taskMutex);
+    IOManager::get()->scheduleCompactor(&(store->getEPEngine()), this,
+                                        Priority::CompactorPriority,
+                                        shard->getId());
+    assert(taskId > 0);
+}
+
+void Compactor::stop() {
+    LockHolder lh(taskMutex);
+    if (taskId > 0) {
+        IOManager::get()->cancel(taskId);
+    }
+}
+
+bool Compactor::run(size_t tid) {
+    assert(tid > 0);
+    double sleep = step();
+    IOManager::get()->snooze(taskId, sleep);
+    return true;
+}
+
+/**
+ * A file is compacted for the space no longer in use, or for its
+ * deletions once they may be purged.  The deletions aren't known to be
+ * old enough until the file is read, so a file isn't compacted for them
+ * more than once every purge age.
+ */
+void Compactor::findCandidates(size_t threshold, size_t minFileSize,
+                               size_t purgeAge) {
+    KVStore *rw = shard->getRWUnderlying();
+    rel_time_t now = ep_current_time();
+    std::vector<int> vbs = shard->getVBuckets();
+    std::vector<int>::iterator it = vbs.begin();
+    for (; it != vbs.end(); ++it) {
+        uint16_t vbid = static_cast<uint16_t>(*it);
+        vbucket_file_info info;
+        if (!rw->getDbFileInfo(vbid, info) || info.fileSize < minFileSize) {
+            continue;
+        }
+        size_t unused = 0;
+        if (info.spaceUsed < info.fileSize) {
+            unused = info.fileSize - info.spaceUsed;
+        }
+        if (info.fileSize > 0 && unused * 100 / info.fileSize >= threshold) {
+            candidates.push_back(vbid);
+            continue;
+        }
+
+        size_t docs = info.itemCount + info.deletedCount;
+        if (purgeAge == 0 || docs == 0 ||
+            info.deletedCount * 100 / docs < threshold) {
+            continue;
+        }
+        std::map<uint16_t, rel_time_t>::iterator lit = lastCompacted.find(vbid);
+        if (lit == lastCompacted.end() || now - lit->second >= purgeAge) {
+            candidates.push_back(vbid);
+        }
+    }
+}
+
+void Compactor::giveUp() {
+    shard->getRWUnderlying()->abortCompaction(current->vbid);
+    delete current;
+    current = NULL;
+}
+
+double Compactor::step() {
+    Configuration &config = store->getEPEngine().getConfiguration();
+    double interval = static_cast<double>(config.getCompactionCheckInterval());
+    size_t threshold = config.getCompactionThreshold();
+    size_t purgeAge = config.getCompactionPurgeAge();
+
+    if (threshold == 0 || store->isFlushAllScheduled()) {
+        candidates.clear();
+        if (current) {
+            giveUp();
+        }
+        return interval;
+    }
+
+    if (!current) {
+        if (candidates.empty()) {
+            rel_time_t now = ep_current_time();
+            if (now < nextCheck) {
+                return static_cast<double>(nextCheck - now);
+            }
+            nextCheck = now + static_cast<rel_time_t>(interval);
+            findCandidates(threshold, config.getCompactionMinFileSize(),
+                           purgeAge);
+            if (candidates.empty()) {
+                return interval;
+            }
+        }
+        time_t purgeBefore = 0;
+        if (purgeAge > 0) {
+            purgeBefore = ep_real_time() - static_cast<time_t>(purgeAge);
+        }
+        current = new compaction_ctx(candidates.front(), purgeBefore);
+        candidates.pop_front();
+    }
+
+    RCPtr<VBucket> vb = shard->getBucket(current->vbid);
+    if (!vb) {
+        giveUp();
+        return 0;
+    }
+
+    size_t rate = config.getCompactionRate();
+    if (rate > 0) {
+        current->maxBytes = std::max(rate / STEPS_PER_SEC, MIN_STEP_SIZE);
+    } else {
+        current->maxBytes = UNLIMITED_STEP_SIZE;
+    }
+
+    hrtime_t start = gethrtime();
+    bool ok;
+    {
+        IOSlot slot(store->getIOScheduler(), IO_CLASS_BACKGROUND);
+        ok = shard->getRWUnderlying()->compactVBucket(*current);
+    }
+    double spent = static_cast<double>(gethrtime() - start) / 1e9;
+    size_t copied = current->bytesCopied;
+    stats.compactionBytesCopied.incr(copied);
+
+    if (!ok) {
+        ++stats.compactionFailed;
+        delete current;
+        current = NULL;
+    } else if (current->done) {
+        completed(*vb, *current);
+        delete current;
+        current = NULL;
+    }
+
+    if (rate == 0) {
+        return 0;
+    }
+    double wait = static_cast<double>(copied) / rate - spent;
+    return wait > 0 ? wait : 0;
+}
+
+void Compactor::completed(VBucket &vb, compaction_ctx &ctx) {
+    // A key created again must get a higher seqno than its purged
+    // deletion, for other clusters to take it over that deletion.
+    vb.ht.updateMaxDeletedRevSeqno(ctx.purgeSeqno);
+    vb.purgeSeqno.set(ctx.purgeSeqno);
+    // Streams from disk seqnos before the deletions dropped would miss them.
+    vb.purgedBySeqno.setIfBigger(ctx.purgedBySeqno);
+    lastCompacted[ctx.vbid] = ep_current_time();
+
+    ++stats.compactionRuns;
+    stats.compactionPurged.incr(ctx.tombstonesPurged);
+    if (ctx.oldFileSize > ctx.newFileSize) {
+        stats.compactionBytesReclaimed.incr(ctx.oldFileSize - ctx.newFileSize);
+    }
+}
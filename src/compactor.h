@@ -0,0 +1,86 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_COMPACTOR_H_
+#define SRC_COMPACTOR_H_ 1
+
+#include "config.h"
+
+#include <list>
+#include <map>
+
+#include "common.h"
+#include "kvstore.h"
+#include "stats.h"
+
+class EventuallyPersistentStore;
+class KVShard;
+class VBucket;
+
+/**
+ * Compacts the files of a shard's vbuckets a step at a time.  Its task
+ * is scheduled with the shard's id, so a step never runs at the same time
+ * as the shard's flusher, and persistence goes on between steps.
+ *
+ * A vbucket's file is compacted once the part of it no longer in use, or
+ * the share of its docs that are deletions, reaches compaction_threshold
+ * percent, copying no more than compaction_rate bytes a second.
+ * Deletions older than compaction_purge_age seconds are dropped from the
+ * new file.
+ */
+class Compactor {
+public:
+    Compactor(EventuallyPersistentStore *s, KVShard *k, EPStats &st) :
+        store(s), shard(k), stats(st), taskId(0), current(NULL),
+        nextCheck(0) { }
+
+    ~Compactor() {
+        delete current;
+    }
+
+    void start(void);
+    void stop(void);
+    bool run(size_t tid);
+    void setTaskId(size_t newId) { taskId = newId; }
+
+private:
+    //! Run a step, return how long to wait before the next one
+    double step(void);
+    void findCandidates(size_t threshold, size_t minFileSize,
+                        size_t purgeAge);
+    void completed(VBucket &vb, compaction_ctx &ctx);
+    void giveUp(void);
+
+    EventuallyPersistentStore *store;
+    KVShard *shard;
+    EPStats &stats;
+    size_t taskId;
+    Mutex taskMutex;
+
+    //! The vbuckets found to be fragmented and not compacted yet
+    std::list<uint16_t> candidates;
+    //! The compaction in progress, if any
+    compaction_ctx *current;
+    //! When to look for fragmented files again
+    rel_time_t nextCheck;
+    //! When each vbucket's file was last compacted
+    std::map<uint16_t, rel_time_t> lastCompacted;
+
+    DISALLOW_COPY_AND_ASSIGN(Compactor);
+};
+
+#endif  // SRC_COMPACTOR_H_
@@ -168,10 +168,12 @@ void Configuration::setParameter(const std::string &key, size_t value) {
     }
     attributes[key].datatype = DT_SIZE;
     if (key.compare("cache_size") == 0) {
-        attributes["max_size"].val.v_size = value;
-    } else {
-        attributes[key].val.v_size = value;
+        lh.unlock();
+        // The alias sets max_size, along with its getter's copy.
+        setParameter("max_size", value);
+        return;
     }
+    attributes[key].val.v_size = value;
 
     std::vector<ValueChangedListener*> copy(attributes[key].changeListener);
     lh.unlock();
@@ -93,6 +93,37 @@ public:
     virtual ~ValueChangedListener() { /* EMPTY */}
 };
 
+/**
+ * Keeps a copy of a parameter up to date for its generated getter to
+ * read, so reading it costs a load instead of the mutex and a lookup.
+ * The copy's listener is added before any other, so the others already
+ * see the new value.
+ */
+template <typename T>
+class CachedValueListener : public ValueChangedListener {
+public:
+    CachedValueListener(volatile T &c) : cache(c) { }
+
+    void booleanValueChanged(const std::string &, bool value) {
+        cache = static_cast<T>(value);
+    }
+
+    void sizeValueChanged(const std::string &, size_t value) {
+        cache = static_cast<T>(value);
+    }
+
+    void ssizeValueChanged(const std::string &, ssize_t value) {
+        cache = static_cast<T>(value);
+    }
+
+    void floatValueChanged(const std::string &, float value) {
+        cache = static_cast<T>(value);
+    }
+
+private:
+    volatile T &cache;
+};
+
 /**
  * The validator for the values runs with the mutex held
  * for the configuration class, so you can't try to access
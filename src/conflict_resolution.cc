@@ -19,6 +19,7 @@
 
 #include "conflict_resolution.h"
 #include "item.h"
+#include "stats.h"
 #include "stored-value.h"
 
 bool SeqBasedResolution::resolve(StoredValue *v, const ItemMetaData &meta, bool deletion) {
@@ -41,3 +42,25 @@ bool SeqBasedResolution::resolve(StoredValue *v, const ItemMetaData &meta, bool
     }
     return true;
 }
+
+bool LWWResolution::resolve(StoredValue *v, const ItemMetaData &meta, bool deletion) {
+    if (HybridLogicalClock::isTooFarAhead(meta.cas)) {
+        ++stats.numCasDriftRejections;
+        return false;
+    }
+    if (v->isTempNonExistentItem()) {
+        return true;
+    }
+    if (v->getCas() != meta.cas) {
+        return v->getCas() < meta.cas;
+    }
+    if (v->getRevSeqno() != meta.seqno) {
+        return v->getRevSeqno() < meta.seqno;
+    }
+    if (deletion || v->getExptime() > meta.exptime) {
+        return false;
+    } else if (v->getExptime() == meta.exptime) {
+        return v->getFlags() < meta.flags;
+    }
+    return true;
+}
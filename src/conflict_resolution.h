@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+class EPStats;
 class ItemMetaData;
 class StoredValue;
 
@@ -64,4 +65,29 @@ public:
                  bool isDelete = false);
 };
 
+/**
+ * A last write wins conflict resolution strategy.  The casses are given out
+ * by each vbucket's hybrid logical clock (see HybridLogicalClock), so the
+ * document with the larger cas was written later.  The fields are compared
+ * in the order cas, seqno, expiration, flags, and if they're all equal the
+ * local document wins.  Every remote cas stored moves the vbucket's clock
+ * past it, so a local write after a remote one wins over it.
+ *
+ * A remote document whose cas is further ahead of the wall clock than the
+ * max drift always loses, or a cluster with a clock running ahead would
+ * win every conflict until ours caught up.
+ */
+class LWWResolution : public ConflictResolution {
+public:
+    LWWResolution(EPStats &st) : stats(st) {}
+
+    ~LWWResolution() {}
+
+    bool resolve(StoredValue *v, const ItemMetaData &meta,
+                 bool isDelete = false);
+
+private:
+    EPStats &stats;
+};
+
 #endif  // SRC_CONFLICT_RESOLUTION_H_
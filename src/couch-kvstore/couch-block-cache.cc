@@ -0,0 +1,132 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "couch-kvstore/couch-block-cache.h"
+#include "locks.h"
+
+//! File ids take the top 24 bits of a block's key
+static const uint32_t MAX_FILE_ID = 1 << 24;
+
+CouchBlockCache::CouchBlockCache(size_t cap) :
+    numEvictions(0), capacity(cap), nextFileId(1)
+{
+    blocksPerPartition = capacity / BLOCK_SIZE / NUM_PARTITIONS;
+    if (blocksPerPartition == 0) {
+        blocksPerPartition = 1;
+    }
+}
+
+CouchBlockCache::~CouchBlockCache() {
+    for (size_t i = 0; i < NUM_PARTITIONS; ++i) {
+        lru_t::iterator it = partitions[i].lru.begin();
+        for (; it != partitions[i].lru.end(); ++it) {
+            delete *it;
+        }
+    }
+}
+
+uint32_t CouchBlockCache::getFileId(const std::string &path, ino_t inode) {
+    LockHolder lh(filesMutex);
+    std::pair<std::string, ino_t> file(path, inode);
+    std::map<std::pair<std::string, ino_t>, uint32_t>::iterator it =
+        files.find(file);
+    if (it != files.end()) {
+        return it->second;
+    }
+
+    if (nextFileId == MAX_FILE_ID) {
+        // Ids are about to be reused; drop every block cached with them.
+        for (size_t i = 0; i < NUM_PARTITIONS; ++i) {
+            Partition &p = partitions[i];
+            LockHolder plh(p.mutex);
+            lru_t::iterator bit = p.lru.begin();
+            for (; bit != p.lru.end(); ++bit) {
+                delete *bit;
+            }
+            p.lru.clear();
+            p.index.clear();
+            p.numBlocks = 0;
+        }
+        files.clear();
+        nextFileId = 1;
+    }
+    uint32_t id = nextFileId++;
+    files[file] = id;
+    return id;
+}
+
+void CouchBlockCache::invalidate(const std::string &path) {
+    LockHolder lh(filesMutex);
+    std::map<std::pair<std::string, ino_t>, uint32_t>::iterator it =
+        files.lower_bound(std::make_pair(path, static_cast<ino_t>(0)));
+    while (it != files.end() && it->first.first == path) {
+        files.erase(it++);
+    }
+}
+
+bool CouchBlockCache::get(uint32_t fileId, uint64_t block, char *buf) {
+    uint64_t key = makeKey(fileId, block);
+    Partition &p = partitionOf(key);
+    LockHolder lh(p.mutex);
+    unordered_map<uint64_t, lru_t::iterator>::iterator it = p.index.find(key);
+    if (it == p.index.end()) {
+        return false;
+    }
+    Block *b = *(it->second);
+    p.lru.splice(p.lru.begin(), p.lru, it->second);
+    memcpy(buf, b->data, BLOCK_SIZE);
+    return true;
+}
+
+void CouchBlockCache::put(uint32_t fileId, uint64_t block, const char *buf) {
+    uint64_t key = makeKey(fileId, block);
+    Partition &p = partitionOf(key);
+    LockHolder lh(p.mutex);
+    if (p.index.find(key) != p.index.end()) {
+        // Read by another thread in the meantime.
+        return;
+    }
+
+    Block *b;
+    if (p.numBlocks >= blocksPerPartition) {
+        // Reuse the least recently used block.
+        b = p.lru.back();
+        p.lru.pop_back();
+        p.index.erase(b->key);
+        --p.numBlocks;
+        ++numEvictions;
+    } else {
+        b = new Block;
+    }
+    b->key = key;
+    memcpy(b->data, buf, BLOCK_SIZE);
+    p.lru.push_front(b);
+    p.index[key] = p.lru.begin();
+    ++p.numBlocks;
+}
+
+size_t CouchBlockCache::getMemUsed() const {
+    size_t blocks = 0;
+    for (size_t i = 0; i < NUM_PARTITIONS; ++i) {
+        blocks += partitions[i].numBlocks;
+    }
+    return blocks * sizeof(Block);
+}
@@ -0,0 +1,129 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_COUCH_KVSTORE_COUCH_BLOCK_CACHE_H_
+#define SRC_COUCH_KVSTORE_COUCH_BLOCK_CACHE_H_ 1
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "atomic.h"
+#include "common.h"
+#include "mutex.h"
+
+/**
+ * A cache of the blocks of couch files read with O_DIRECT, so the reads
+ * are cached within the bucket's own memory rather than the OS page
+ * cache.
+ *
+ * Only whole blocks are cached.  A couch file is only ever appended to,
+ * so a whole block never changes; the partial block at the end of a file
+ * isn't cached as it does.  A file is known by its path and inode, and a
+ * path that's created again gets a new id so the blocks of the file it
+ * replaces aren't read for it; they age out of the cache.
+ *
+ * The cache is split in partitions, each with a lock and an LRU list of
+ * its own.
+ */
+class CouchBlockCache {
+public:
+    static const size_t BLOCK_SIZE = 4096;
+
+    /**
+     * @param capacity the max number of bytes of blocks to keep
+     */
+    explicit CouchBlockCache(size_t capacity);
+
+    ~CouchBlockCache();
+
+    /**
+     * Get the id the blocks of a file are cached with.
+     */
+    uint32_t getFileId(const std::string &path, ino_t inode);
+
+    /**
+     * Forget the files found at a path, as it's being created again.
+     */
+    void invalidate(const std::string &path);
+
+    /**
+     * Copy a block into buf if it's cached.
+     *
+     * @return true if it was
+     */
+    bool get(uint32_t fileId, uint64_t block, char *buf);
+
+    /**
+     * Cache a whole block, evicting the least recently used blocks of its
+     * partition to make room.
+     */
+    void put(uint32_t fileId, uint64_t block, const char *buf);
+
+    //! Get the number of bytes of blocks cached
+    size_t getMemUsed() const;
+
+    size_t getCapacity() const { return capacity; }
+
+    Atomic<size_t> numEvictions;
+
+private:
+
+    static const size_t NUM_PARTITIONS = 16;
+
+    struct Block {
+        uint64_t key;
+        char data[BLOCK_SIZE];
+    };
+
+    typedef std::list<Block *> lru_t;
+
+    struct Partition {
+        Partition() : numBlocks(0) { }
+
+        Mutex mutex;
+        //! The most recently used first
+        lru_t lru;
+        unordered_map<uint64_t, lru_t::iterator> index;
+        size_t numBlocks;
+    };
+
+    static uint64_t makeKey(uint32_t fileId, uint64_t block) {
+        return (static_cast<uint64_t>(fileId) << 40) | block;
+    }
+
+    Partition &partitionOf(uint64_t key) {
+        return partitions[(key ^ (key >> 40)) % NUM_PARTITIONS];
+    }
+
+    const size_t capacity;
+    size_t blocksPerPartition;
+    Partition partitions[NUM_PARTITIONS];
+
+    Mutex filesMutex;
+    std::map<std::pair<std::string, ino_t>, uint32_t> files;
+    uint32_t nextFileId;
+
+    DISALLOW_COPY_AND_ASSIGN(CouchBlockCache);
+};
+
+#endif  // SRC_COUCH_KVSTORE_COUCH_BLOCK_CACHE_H_
@@ -17,7 +17,17 @@
 
 #include "config.h"
 
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
 #include "common.h"
+#include "couch-kvstore/couch-block-cache.h"
 #include "couch-kvstore/couch-fs-stats.h"
 #include "histo.h"
 
@@ -33,7 +43,7 @@ static couchstore_error_t cfs_advise(couch_file_handle, cs_off_t, cs_off_t, couc
 static void cfs_destroy(couch_file_handle);
 }
 
-couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats) {
+couch_file_ops getCouchstoreStatsOps(CouchstoreFileContext* ctx) {
     couch_file_ops ops = {
         4,
         cfs_construct,
@@ -45,7 +55,7 @@ couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats) {
         cfs_sync,
         cfs_advise,
         cfs_destroy,
-        stats
+        ctx
     };
     return ops;
 }
@@ -54,55 +64,191 @@ struct StatFile {
     const couch_file_ops* orig_ops;
     couch_file_handle orig_handle;
     CouchstoreStats* stats;
+    // The stats of the class of vbucket the file is of
+    CouchstoreStats* class_stats;
     cs_off_t last_offs;
+    CouchBlockCache* cache;
+    // The file opened with O_DIRECT for reads through the cache, or -1
+    int direct_fd;
+    uint32_t file_id;
+    // A block aligned for O_DIRECT
+    char* block;
 };
 
+/**
+ * Times a file op into a histogram of the totals and the same histogram of
+ * the file's vbucket class.
+ */
+class FileOpTimer {
+public:
+    FileOpTimer(StatFile* sf, Histogram<hrtime_t> CouchstoreStats::*h) :
+        sf_(sf), histo_(h), start_(gethrtime()) { }
+
+    ~FileOpTimer() {
+        hrtime_t spent = (gethrtime() - start_) / 1000;
+        (sf_->stats->*histo_).add(spent);
+        (sf_->class_stats->*histo_).add(spent);
+    }
+
+private:
+    StatFile* sf_;
+    Histogram<hrtime_t> CouchstoreStats::*histo_;
+    hrtime_t start_;
+};
+
+static void addSize(StatFile* sf, Histogram<size_t> CouchstoreStats::*h,
+                    size_t sz) {
+    (sf->stats->*h).add(sz);
+    (sf->class_stats->*h).add(sz);
+}
+
+static void closeDirect(StatFile* sf) {
+    if (sf->direct_fd >= 0) {
+        ::close(sf->direct_fd);
+        sf->direct_fd = -1;
+    }
+    free(sf->block);
+    sf->block = NULL;
+}
+
+/**
+ * Set up the direct reads of a file opened read-only.  Any failure, such
+ * as a file system that doesn't take O_DIRECT, leaves the file to be read
+ * through the OS page cache.
+ */
+static void openDirect(StatFile* sf, const char* path) {
+#ifdef O_DIRECT
+    sf->direct_fd = ::open(path, O_RDONLY | O_DIRECT);
+    if (sf->direct_fd < 0) {
+        return;
+    }
+    struct stat st;
+    void* block = NULL;
+    if (fstat(sf->direct_fd, &st) != 0 ||
+        posix_memalign(&block, CouchBlockCache::BLOCK_SIZE,
+                       CouchBlockCache::BLOCK_SIZE) != 0) {
+        closeDirect(sf);
+        return;
+    }
+    sf->block = static_cast<char*>(block);
+    sf->file_id = sf->cache->getFileId(path, st.st_ino);
+#else
+    (void)sf;
+    (void)path;
+#endif
+}
+
+/**
+ * Read through the block cache, reading the blocks it doesn't have with
+ * O_DIRECT.
+ *
+ * @return the bytes read, or -1 if a direct read failed
+ */
+static ssize_t directPread(StatFile* sf, char* buf, size_t sz, cs_off_t off) {
+    const size_t bsize = CouchBlockCache::BLOCK_SIZE;
+    size_t done = 0;
+    while (done < sz) {
+        uint64_t pos = static_cast<uint64_t>(off) + done;
+        uint64_t blk = pos / bsize;
+        size_t inblock = static_cast<size_t>(pos % bsize);
+        size_t avail = bsize;
+        if (sf->cache->get(sf->file_id, blk, sf->block)) {
+            sf->stats->blockCacheHits++;
+        } else {
+            sf->stats->blockCacheMisses++;
+            ssize_t got = pread(sf->direct_fd, sf->block, bsize, blk * bsize);
+            if (got < 0) {
+                return -1;
+            }
+            avail = static_cast<size_t>(got);
+            if (avail == bsize) {
+                sf->cache->put(sf->file_id, blk, sf->block);
+            }
+        }
+        if (avail <= inblock) {
+            break; // the end of the file
+        }
+        size_t n = std::min(avail - inblock, sz - done);
+        memcpy(buf + done, sf->block + inblock, n);
+        done += n;
+        if (avail < bsize) {
+            break;
+        }
+    }
+    return static_cast<ssize_t>(done);
+}
+
 extern "C" {
 static couch_file_handle cfs_construct(void* cookie) {
     StatFile* sf = new StatFile;
-    sf->stats = static_cast<CouchstoreStats*>(cookie);
+    CouchstoreFileContext* ctx = static_cast<CouchstoreFileContext*>(cookie);
+    sf->stats = ctx->stats;
+    sf->class_stats = ctx->classStats;
     sf->orig_ops = couchstore_get_default_file_ops();
     sf->orig_handle = sf->orig_ops->constructor(sf->orig_ops->cookie);
     sf->last_offs = 0;
+    sf->cache = ctx->blockCache;
+    sf->direct_fd = -1;
+    sf->file_id = 0;
+    sf->block = NULL;
     return reinterpret_cast<couch_file_handle>(sf);
 }
 
 static couchstore_error_t cfs_open(couch_file_handle* h, const char* path, int flags) {
     StatFile* sf = reinterpret_cast<StatFile*>(*h);
-    return sf->orig_ops->open(&sf->orig_handle, path, flags);
+    if (sf->cache && (flags & O_CREAT)) {
+        // A file that's new at this path isn't the one cached for it.
+        sf->cache->invalidate(path);
+    }
+    couchstore_error_t rv = sf->orig_ops->open(&sf->orig_handle, path, flags);
+    if (rv == COUCHSTORE_SUCCESS && sf->cache &&
+        (flags & O_ACCMODE) == O_RDONLY) {
+        openDirect(sf, path);
+    }
+    return rv;
 }
 
 static void cfs_close(couch_file_handle h) {
     StatFile* sf = reinterpret_cast<StatFile*>(h);
+    closeDirect(sf);
     sf->orig_ops->close(sf->orig_handle);
 }
 
 static ssize_t cfs_pread(couch_file_handle h, void* buf, size_t sz, cs_off_t off) {
     StatFile* sf = reinterpret_cast<StatFile*>(h);
-    sf->stats->readSizeHisto.add(sz);
+    addSize(sf, &CouchstoreStats::readSizeHisto, sz);
     if(sf->last_offs) {
-        sf->stats->readSeekHisto.add(abs(off - sf->last_offs));
+        addSize(sf, &CouchstoreStats::readSeekHisto, abs(off - sf->last_offs));
     }
     sf->last_offs = off;
-    BlockTimer bt(&sf->stats->readTimeHisto);
+    FileOpTimer ft(sf, &CouchstoreStats::readTimeHisto);
+    if (sf->direct_fd >= 0) {
+        ssize_t rv = directPread(sf, static_cast<char*>(buf), sz, off);
+        if (rv >= 0) {
+            return rv;
+        }
+        // Fall back to the page cache from now on.
+        closeDirect(sf);
+    }
     return sf->orig_ops->pread(sf->orig_handle, buf, sz, off);
 }
 
 static ssize_t cfs_pwrite(couch_file_handle h, const void* buf, size_t sz, cs_off_t off) {
     StatFile* sf = reinterpret_cast<StatFile*>(h);
-    sf->stats->writeSizeHisto.add(sz);
-    BlockTimer bt(&sf->stats->writeTimeHisto);
+    addSize(sf, &CouchstoreStats::writeSizeHisto, sz);
+    FileOpTimer ft(sf, &CouchstoreStats::writeTimeHisto);
     return sf->orig_ops->pwrite(sf->orig_handle, buf, sz, off);
 }
 
 static cs_off_t cfs_goto_eof(couch_file_handle h) {
     StatFile* sf = reinterpret_cast<StatFile*>(h);
+    FileOpTimer ft(sf, &CouchstoreStats::seekTimeHisto);
     return sf->orig_ops->goto_eof(sf->orig_handle);
 }
 
 static couchstore_error_t cfs_sync(couch_file_handle h) {
     StatFile* sf = reinterpret_cast<StatFile*>(h);
-    BlockTimer bt(&sf->stats->syncTimeHisto);
+    FileOpTimer ft(sf, &CouchstoreStats::syncTimeHisto);
     return sf->orig_ops->sync(sf->orig_handle);
 }
 
@@ -114,6 +260,7 @@ static couchstore_error_t cfs_advise(couch_file_handle h, cs_off_t offs, cs_off_
 
 static void cfs_destroy(couch_file_handle h) {
     StatFile* sf = reinterpret_cast<StatFile*>(h);
+    closeDirect(sf);
     sf->orig_ops->destructor(sf->orig_handle);
     delete sf;
 }
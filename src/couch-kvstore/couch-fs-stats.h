@@ -22,15 +22,23 @@
 
 #include <libcouchstore/couch_db.h>
 
+#include "atomic.h"
 #include "histo.h"
 
+class CouchBlockCache;
+
 struct CouchstoreStats {
 public:
     CouchstoreStats() :
+        blockCacheHits(0), blockCacheMisses(0),
         readSeekHisto(ExponentialGenerator<size_t>(1, 2), 50),
         readSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
         writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) { }
 
+    //Blocks of direct reads found in the block cache
+    Atomic<size_t> blockCacheHits;
+    //Blocks of direct reads read from disk
+    Atomic<size_t> blockCacheMisses;
     //Read time length
     Histogram<hrtime_t> readTimeHisto;
     //Distance from last read
@@ -43,17 +51,38 @@ public:
     Histogram<size_t> writeSizeHisto;
     //Time spent in sync
     Histogram<hrtime_t> syncTimeHisto;
+    //Time spent seeking to the end of the file
+    Histogram<hrtime_t> seekTimeHisto;
 
     void reset() {
+        blockCacheHits.set(0);
+        blockCacheMisses.set(0);
         readTimeHisto.reset();
         readSeekHisto.reset();
         readSizeHisto.reset();
         writeTimeHisto.reset();
         writeSizeHisto.reset();
         syncTimeHisto.reset();
+        seekTimeHisto.reset();
     }
 };
 
-couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats);
+/**
+ * What the file ops of a couch store work with.
+ */
+struct CouchstoreFileContext {
+    CouchstoreFileContext(CouchstoreStats *s, CouchstoreStats *cs,
+                          CouchBlockCache *c) :
+        stats(s), classStats(cs), blockCache(c) { }
+
+    //! The totals of all the files of the store
+    CouchstoreStats *stats;
+    //! Of the files of the vbuckets of one class (active or replica)
+    CouchstoreStats *classStats;
+    //! Files opened read-only are read with O_DIRECT through it, if set
+    CouchBlockCache *blockCache;
+};
+
+couch_file_ops getCouchstoreStatsOps(CouchstoreFileContext* ctx);
 
 #endif  // SRC_COUCH_KVSTORE_COUCH_FS_STATS_H_
@@ -30,12 +30,16 @@
 #include <iostream>
 #include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "common.h"
+#include "couch-kvstore/couch-block-cache.h"
 #include "couch-kvstore/couch-kvstore.h"
+#include "couch-kvstore/couch-read-pool.h"
+#include "couch-kvstore/couch-vbstate-journal.h"
 #include "couch-kvstore/dirutils.h"
 #define STATWRITER_NAMESPACE couchstore_engine
 #include "statwriter.h"
@@ -66,6 +70,34 @@ extern "C" {
     }
 }
 
+extern "C" {
+    static int getMultiMetaCbC(Db *db, DocInfo *docinfo, void *ctx)
+    {
+        return CouchKVStore::getMultiMetaCb(db, docinfo, ctx);
+    }
+}
+
+extern "C" {
+    static int keysAfterCbC(Db *db, DocInfo *docinfo, void *ctx)
+    {
+        return CouchKVStore::keysAfterCb(db, docinfo, ctx);
+    }
+}
+
+extern "C" {
+    static int rangeScanCbC(Db *db, DocInfo *docinfo, void *ctx)
+    {
+        return CouchKVStore::rangeScanCb(db, docinfo, ctx);
+    }
+}
+
+extern "C" {
+    static int compactCopyCbC(Db *db, DocInfo *docinfo, void *ctx)
+    {
+        return CouchKVStore::compactCopyCb(db, docinfo, ctx);
+    }
+}
+
 extern "C" {
     static std::string getStrError() {
         const size_t max_msg_len = 256;
@@ -169,8 +201,59 @@ struct GetMultiCbCtx {
     CouchKVStore &cks;
     uint16_t vbId;
     vb_bgfetch_queue_t &fetches;
+    //! The docs found, read once they're all known
+    std::vector<DocInfo *> docinfos;
+};
+
+struct GetMultiMetaCbCtx {
+    GetMultiMetaCbCtx(CouchKVStore &c, uint16_t v, vb_bgmeta_queue_t &f) :
+        cks(c), vbId(v), fetches(f) {}
+
+    CouchKVStore &cks;
+    uint16_t vbId;
+    vb_bgmeta_queue_t &fetches;
+};
+
+struct KeysAfterCtx {
+    KeysAfterCtx(const std::string &k, const std::string &p, size_t c,
+                 std::vector<std::string> &ks) :
+        key(k), prefix(p), count(c), keys(ks) {}
+
+    const std::string &key;
+    const std::string &prefix;
+    size_t count;
+    std::vector<std::string> &keys;
+};
+
+struct RangeScanCtx {
+    RangeScanCtx(CouchKVStore &c, uint16_t v, const std::string &e, size_t l,
+                 bool k, Callback<GetValue> &cb) :
+        cks(c), vbId(v), end(e), limit(l), keysOnly(k), callback(cb),
+        count(0), errCode(COUCHSTORE_SUCCESS) {}
+
+    CouchKVStore &cks;
+    uint16_t vbId;
+    const std::string &end;
+    size_t limit;
+    bool keysOnly;
+    Callback<GetValue> &callback;
+    size_t count;
+    couchstore_error_t errCode;
+};
+
+struct CompactCopyCtx {
+    CompactCopyCtx(size_t max) : maxBytes(max), bytes(0) {}
+
+    size_t maxBytes;
+    size_t bytes;
+    //! The docs to copy in this step, in seqno order
+    std::vector<DocInfo *> docinfos;
 };
 
+static bool docInfoOffsetLess(const DocInfo *a, const DocInfo *b) {
+    return a->bp < b->bp;
+}
+
 struct StatResponseCtx {
 public:
     StatResponseCtx(std::map<std::pair<uint16_t, uint16_t>, vbucket_state> &sm,
@@ -186,13 +269,37 @@ struct LoadResponseCtx {
     shared_ptr<Callback<GetValue> > callback;
     uint16_t vbucketId;
     bool keysonly;
+    bool keepCompressed;
     EPStats *stats;
+    CouchKVStore *store;
 };
 
-CouchRequest::CouchRequest(const Item &it, uint64_t rev, CouchRequestCallback &cb, bool del) :
-    value(it.getValue()), vbucketId(it.getVBucketId()), fileRevNum(rev),
-    key(it.getKey()), deleteItem(del)
+/**
+ * Get the options to read a document body with, and the datatype it
+ * will be read as.
+ */
+static int docReadOptions(const DocInfo *docinfo, bool keepCompressed,
+                          uint8_t &datatype)
+{
+    if (keepCompressed && (docinfo->content_meta & COUCH_DOC_IS_COMPRESSED)) {
+        datatype = BLOB_DATATYPE_SNAPPY;
+        return 0;
+    }
+    datatype = BLOB_DATATYPE_RAW;
+    return DECOMPRESS_DOC_BODIES;
+}
+
+void CouchRequest::init(const Item &it, uint64_t rev, CouchRequestCallback &cb,
+                        bool del, bool compress, size_t keyOff)
 {
+    value = it.getValue();
+    vbucketId = it.getVBucketId();
+    fileRevNum = rev;
+    keyOffset = keyOff;
+    keyLen = it.getNKey();
+    deleteItem = del;
+    logged = false;
+
     bool isjson = false;
     uint64_t cas = htonll(it.getCas());
     uint32_t flags = it.getFlags();
@@ -205,10 +312,20 @@ CouchRequest::CouchRequest(const Item &it, uint64_t rev, CouchRequestCallback &c
     }
     exptime = htonl(exptime);
 
-    dbDoc.id.buf = const_cast<char *>(key.c_str());
-    dbDoc.id.size = it.getNKey();
-    if (vlen) {
+    if (vlen && value->isCompressed()) {
+        value_t raw(value->uncompress());
+        isjson = raw.get() && isJSON(raw);
+    } else if (vlen) {
         isjson = isJSON(value);
+        if (compress && !del) {
+            Blob *compressed = Blob::NewCompressed(value->getData(), vlen);
+            if (compressed) {
+                value.reset(compressed);
+                vlen = static_cast<uint32_t>(value->length());
+            }
+        }
+    }
+    if (vlen) {
         dbDoc.data.buf = const_cast<char *>(value->getData());
         dbDoc.data.size = vlen;
     } else {
@@ -219,8 +336,6 @@ CouchRequest::CouchRequest(const Item &it, uint64_t rev, CouchRequestCallback &c
     memcpy(meta, &cas, 8);
     memcpy(meta + 8, &exptime, 4);
     memcpy(meta + 12, &flags, 4);
-    dbDocInfo.rev_meta.buf = reinterpret_cast<char *>(meta);
-    dbDocInfo.rev_meta.size = COUCHSTORE_METADATA_SIZE;
     dbDocInfo.rev_seq = it.getSeqno();
     dbDocInfo.size = dbDoc.data.size;
     if (del) {
@@ -230,28 +345,78 @@ CouchRequest::CouchRequest(const Item &it, uint64_t rev, CouchRequestCallback &c
         dbDocInfo.deleted = 0;
         callback.setCb = cb.setCb;
     }
-    dbDocInfo.id = dbDoc.id;
     dbDocInfo.content_meta = isjson ? COUCH_DOC_IS_JSON : COUCH_DOC_NON_JSON_MODE;
     //Compress everything. Snappy is fast. Don't attempt to compress empty bodies.
-    if(dbDoc.data.size > 0 && !deleteItem) {
+    //When compressing here, bodies that wouldn't shrink are written as they are.
+    if (compress) {
+        if (dbDoc.data.size > 0 && value->isCompressed()) {
+            dbDocInfo.content_meta |= COUCH_DOC_IS_COMPRESSED;
+        }
+    } else if(dbDoc.data.size > 0 && !deleteItem) {
         dbDocInfo.content_meta |= COUCH_DOC_IS_COMPRESSED;
     }
     start = gethrtime();
 }
 
+bool CouchRequest::logValue(CouchValueLog &log)
+{
+    if (deleteItem || dbDoc.data.size == 0) {
+        return false;
+    }
+    ValueLogPointer ptr;
+    if (!log.append(vbucketId, value->getData(), value->length(),
+                    value->isCompressed(), ptr)) {
+        return false;
+    }
+    ptr.encode(logPointer);
+    logged = true;
+    meta[COUCHSTORE_METADATA_SIZE] = COUCHSTORE_META_VALUE_LOGGED;
+    dbDocInfo.size = sizeof(logPointer);
+    // The pointer is neither JSON nor to be compressed; whether the value
+    // is compressed is in the pointer.
+    dbDocInfo.content_meta = COUCH_DOC_NON_JSON_MODE;
+    return true;
+}
+
+/**
+ * True if the body of a doc is a pointer to its value in the value log.
+ */
+static bool isValueLogged(const DocInfo *docinfo)
+{
+    return docinfo->rev_meta.size > COUCHSTORE_METADATA_SIZE &&
+        (docinfo->rev_meta.buf[COUCHSTORE_METADATA_SIZE] &
+         COUCHSTORE_META_VALUE_LOGGED);
+}
+
 CouchKVStore::CouchKVStore(EPStats &stats, Configuration &config, bool read_only) :
     KVStore(read_only), epStats(stats), configuration(config),
-    dbname(configuration.getDbname()), couchNotifier(NULL), pendingCommitCnt(0),
-    intransaction(false), dbFileRevMapPopulated(false)
+    dbname(configuration.getDbname()), couchNotifier(NULL),
+    intransaction(false), dbFileRevMapPopulated(false),
+    compressValues(configuration.isValueCompression()),
+    dbCacheSize(read_only ? configuration.getCouchDbHandleCache() : 0),
+    blockCache(acquireBlockCache()),
+    activeFileContext(&st.fsStats, &st.activeFsStats, blockCache),
+    replicaFileContext(&st.fsStats, &st.replicaFsStats, blockCache),
+    vbStateJournal(NULL), fileCounts(NULL), valueLog(NULL),
+    valueLogThreshold(configuration.getValueLogThreshold()),
+    asyncReaders(read_only ? configuration.getCouchAsyncReaders() : 0),
+    readPool(NULL)
 {
     open();
-    statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+    if (!isReadOnly()) {
+        vbStateJournal = acquireVBStateJournal();
+    }
+    activeFileOps = getCouchstoreStatsOps(&activeFileContext);
+    replicaFileOps = getCouchstoreStatsOps(&replicaFileContext);
 
     // init db file map with default revision number, 1
     numDbFiles = static_cast<uint16_t>(configuration.getMaxVbuckets());
     for (uint16_t i = 0; i < numDbFiles; i++) {
         dbFileRevMap.push_back(1);
     }
+    activeVBuckets = new Atomic<bool>[numDbFiles];
+    fileCounts = acquireFileCounts();
+    valueLog = acquireValueLog();
 }
 
 CouchKVStore::CouchKVStore(const CouchKVStore &copyFrom) :
@@ -259,30 +424,57 @@ CouchKVStore::CouchKVStore(const CouchKVStore &copyFrom) :
     configuration(copyFrom.configuration),
     dbname(copyFrom.dbname),
     couchNotifier(NULL), dbFileRevMap(copyFrom.dbFileRevMap),
-    numDbFiles(copyFrom.numDbFiles), pendingCommitCnt(0),
-    intransaction(false), dbFileRevMapPopulated(true)
+    numDbFiles(copyFrom.numDbFiles),
+    intransaction(false), dbFileRevMapPopulated(true),
+    compressValues(copyFrom.compressValues),
+    dbCacheSize(copyFrom.dbCacheSize),
+    blockCache(acquireBlockCache()),
+    activeFileContext(&st.fsStats, &st.activeFsStats, blockCache),
+    replicaFileContext(&st.fsStats, &st.replicaFsStats, blockCache),
+    vbStateJournal(NULL), fileCounts(NULL), valueLog(NULL),
+    valueLogThreshold(copyFrom.valueLogThreshold),
+    // The copies are what a read pool reads with.
+    asyncReaders(0), readPool(NULL)
 {
     open();
-    statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+    if (!isReadOnly()) {
+        vbStateJournal = acquireVBStateJournal();
+    }
+    activeFileOps = getCouchstoreStatsOps(&activeFileContext);
+    replicaFileOps = getCouchstoreStatsOps(&replicaFileContext);
+    activeVBuckets = new Atomic<bool>[numDbFiles];
+    for (uint16_t i = 0; i < numDbFiles; i++) {
+        activeVBuckets[i].set(copyFrom.activeVBuckets[i].get());
+    }
+    fileCounts = acquireFileCounts();
+    valueLog = acquireValueLog();
 }
 
 void CouchKVStore::reset()
 {
     assert(!isReadOnly());
+    completeCommits();
     // TODO CouchKVStore::flush() when couchstore api ready
     RememberingCallback<bool> cb;
 
     couchNotifier->flush(cb);
     cb.waitForValue();
 
+    // The files are started over at their first revision.
+    closeCompactions();
+
     vbucket_map_t::iterator itor = cachedVBStates.begin();
     for (; itor != cachedVBStates.end(); ++itor) {
         uint16_t vbucket = itor->first;
         itor->second.checkpointId = 0;
         itor->second.maxDeletedSeqno = 0;
+        itor->second.purgeSeqno = 0;
         resetVBucket(vbucket, itor->second);
         updateDbFileMap(vbucket, 1);
+        fileCounts->forget(vbucket);
+        valueLog->remove(vbucket);
     }
+    journalVBStates(cachedVBStates);
 }
 
 void CouchKVStore::set(const Item &itm, Callback<mutation_result> &cb)
@@ -291,13 +483,19 @@ void CouchKVStore::set(const Item &itm, Callback<mutation_result> &cb)
     assert(intransaction);
     bool deleteItem = false;
     CouchRequestCallback requestcb;
-    std::string dbFile;
-    uint64_t fileRev = dbFileRevMap[itm.getVBucketId()];
+    uint16_t vbid = itm.getVBucketId();
+    uint64_t fileRev = dbFileRevMap[vbid];
 
-    // each req will be de-allocated after commit
     requestcb.setCb = &cb;
-    CouchRequest *req = new CouchRequest(itm, fileRev, requestcb, deleteItem);
-    queueItem(req);
+    CouchRequest &req = batchFor(vbid).add(itm, fileRev, requestcb,
+                                           deleteItem, compressValues);
+    // Compactions copy the docs left in the file, so the big values
+    // are kept out of it.
+    if (valueLogThreshold > 0 && req.getNBytes() >= valueLogThreshold) {
+        if (req.logValue(*valueLog)) {
+            ++st.numValuesLogged;
+        }
+    }
 }
 
 void CouchKVStore::get(const std::string &key, uint64_t, uint16_t vb,
@@ -402,10 +600,23 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms)
         item2fetch = (*itr).second.front();
         seqIds.push_back(item2fetch->value.getId());
     }
+    // Walk the by-sequence tree in order rather than by hash.
+    std::sort(seqIds.begin(), seqIds.end());
 
     GetMultiCbCtx ctx(*this, vb, itms);
     errCode = couchstore_docinfos_by_sequence(db, &seqIds[0], seqIds.size(),
                                               0, getMultiCbC, &ctx);
+
+    // Read the docs in the order they're laid out in the file, so the
+    // disk moves one way through it.
+    std::sort(ctx.docinfos.begin(), ctx.docinfos.end(), docInfoOffsetLess);
+    std::vector<DocInfo *>::iterator ditr = ctx.docinfos.begin();
+    for (; ditr != ctx.docinfos.end(); ++ditr) {
+        if (errCode == COUCHSTORE_SUCCESS) {
+            readMultiDoc(db, *ditr, vb, itms[(*ditr)->db_seq]);
+        }
+        couchstore_free_docinfo(*ditr);
+    }
     if (errCode != COUCHSTORE_SUCCESS) {
         st.numGetFailure += numItems;
         for (itr = itms.begin(); itr != itms.end(); ++itr) {
@@ -425,17 +636,135 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms)
     closeDatabaseHandle(db);
 }
 
+void CouchKVStore::getMultiMeta(uint16_t vb, vb_bgmeta_queue_t &itms)
+{
+    int numItems = itms.size();
+    Db *db = NULL;
+    couchstore_error_t errCode = openDB(vb, dbFileRevMap[vb], &db,
+                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    vb_bgmeta_queue_t::iterator itr;
+    if (errCode != COUCHSTORE_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to open database for metadata fetch, "
+            "vBucketId = %d numDocs = %d\n", vb, numItems);
+        st.numGetFailure += numItems;
+        for (itr = itms.begin(); itr != itms.end(); ++itr) {
+            std::list<VBucketBGFetchItem *> &fetches = itr->second;
+            std::list<VBucketBGFetchItem *>::iterator fitr = fetches.begin();
+            for (; fitr != fetches.end(); ++fitr) {
+                (*fitr)->value.setStatus(ENGINE_NOT_MY_VBUCKET);
+            }
+        }
+        return;
+    }
+
+    // The map keeps the ids sorted, as the walk of the tree wants them.
+    std::vector<sized_buf> ids;
+    ids.reserve(numItems);
+    for (itr = itms.begin(); itr != itms.end(); ++itr) {
+        sized_buf id;
+        id.buf = const_cast<char *>(itr->first.data());
+        id.size = itr->first.size();
+        ids.push_back(id);
+    }
+
+    GetMultiMetaCbCtx ctx(*this, vb, itms);
+    errCode = couchstore_docinfos_by_id(db, &ids[0], ids.size(), 0,
+                                        getMultiMetaCbC, &ctx);
+    if (errCode != COUCHSTORE_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to read the metadata of "
+            "%d docs, vBucketId = %d error = %s [%s]\n", numItems, vb,
+            couchstore_strerror(errCode),
+            couchkvstore_strerrno(errCode).c_str());
+        st.numGetFailure += numItems;
+        for (itr = itms.begin(); itr != itms.end(); ++itr) {
+            std::list<VBucketBGFetchItem *> &fetches = itr->second;
+            std::list<VBucketBGFetchItem *>::iterator fitr = fetches.begin();
+            for (; fitr != fetches.end(); ++fitr) {
+                if ((*fitr)->value.getStatus() != ENGINE_SUCCESS) {
+                    (*fitr)->value.setStatus(couchErr2EngineErr(errCode));
+                }
+            }
+        }
+    }
+    closeDatabaseHandle(db);
+}
+
+bool CouchKVStore::getKeysAfter(uint16_t vb, const std::string &key,
+                                const std::string &prefix, size_t count,
+                                std::vector<std::string> &keys)
+{
+    Db *db = NULL;
+    couchstore_error_t errCode = openDB(vb, dbFileRevMap[vb], &db,
+                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    if (errCode != COUCHSTORE_SUCCESS) {
+        return false;
+    }
+
+    sized_buf startKey;
+    startKey.buf = const_cast<char *>(key.data());
+    startKey.size = key.size();
+    KeysAfterCtx ctx(key, prefix, count, keys);
+    errCode = couchstore_all_docs(db, &startKey, COUCHSTORE_NO_DELETES,
+                                  keysAfterCbC, &ctx);
+    closeDatabaseHandle(db);
+    if (errCode != COUCHSTORE_SUCCESS && errCode != COUCHSTORE_ERROR_CANCEL) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to list the keys after %s in vBucketId = %d "
+            "error = %s [%s]\n", key.c_str(), vb,
+            couchstore_strerror(errCode),
+            couchkvstore_strerrno(errCode).c_str());
+        return false;
+    }
+    return true;
+}
+
+bool CouchKVStore::rangeScan(uint16_t vb, const std::string &start,
+                             const std::string &end, size_t limit,
+                             bool keysOnly, Callback<GetValue> &cb)
+{
+    if (limit == 0) {
+        return true;
+    }
+    Db *db = NULL;
+    couchstore_error_t errCode = openDB(vb, dbFileRevMap[vb], &db,
+                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    if (errCode != COUCHSTORE_SUCCESS) {
+        return false;
+    }
+
+    sized_buf startKey;
+    startKey.buf = const_cast<char *>(start.data());
+    startKey.size = start.size();
+    RangeScanCtx ctx(*this, vb, end, limit, keysOnly, cb);
+    errCode = couchstore_all_docs(db, &startKey, COUCHSTORE_NO_DELETES,
+                                  rangeScanCbC, &ctx);
+    closeDatabaseHandle(db);
+    if (errCode == COUCHSTORE_ERROR_CANCEL) {
+        errCode = ctx.errCode;
+    }
+    if (errCode != COUCHSTORE_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to scan the keys from %s in vBucketId = %d "
+            "error = %s [%s]\n", start.c_str(), vb,
+            couchstore_strerror(errCode),
+            couchkvstore_strerrno(errCode).c_str());
+        return false;
+    }
+    return true;
+}
+
 void CouchKVStore::del(const Item &itm,
                        uint64_t,
                        Callback<int> &cb)
 {
     assert(!isReadOnly());
     assert(intransaction);
-    uint16_t fileRev = dbFileRevMap[itm.getVBucketId()];
+    uint16_t vbid = itm.getVBucketId();
+    uint16_t fileRev = dbFileRevMap[vbid];
     CouchRequestCallback requestcb;
     requestcb.delCb = &cb;
-    CouchRequest *req = new CouchRequest(itm, fileRev, requestcb, true);
-    queueItem(req);
+    batchFor(vbid).add(itm, fileRev, requestcb, true, compressValues);
 }
 
 bool CouchKVStore::delVBucket(uint16_t vbucket, bool recreate)
@@ -444,6 +773,8 @@ bool CouchKVStore::delVBucket(uint16_t vbucket, bool recreate)
     assert(couchNotifier);
     RememberingCallback<bool> cb;
 
+    completeCommits();
+    abortCompaction(vbucket);
     couchNotifier->delVBucket(vbucket, cb);
     cb.waitForValue();
 
@@ -455,10 +786,18 @@ bool CouchKVStore::delVBucket(uint16_t vbucket, bool recreate)
         }
         cachedVBStates[vbucket] = vbstate;
         resetVBucket(vbucket, vbstate);
+        vbucket_map_t reset;
+        reset[vbucket] = vbstate;
+        journalVBStates(reset);
     } else {
         cachedVBStates.erase(vbucket);
+        if (vbStateJournal) {
+            vbStateJournal->remove(vbucket);
+        }
     }
     updateDbFileMap(vbucket, 1);
+    fileCounts->forget(vbucket);
+    valueLog->remove(vbucket);
     return cb.val;
 }
 
@@ -476,6 +815,10 @@ vbucket_map_t CouchKVStore::listPersistedVbuckets()
         cachedVBStates.clear();
     }
 
+    // The states journaled since they were last written to the files
+    vbucket_map_t journaled;
+    CouchVBStateJournal::read(dbname + "/vbstate.journal", journaled);
+
     Db *db = NULL;
     couchstore_error_t errorCode;
     for (uint16_t id = 0; id < numDbFiles; id++) {
@@ -491,13 +834,28 @@ vbucket_map_t CouchKVStore::listPersistedVbuckets()
                 "Warning: failed to open database file, name=%s\n",
                 fileName.c_str());
             remVBucketFromDbFileMap(id);
+            fileCounts->forget(id);
         } else {
             vbucket_state vb_state;
 
             /* read state of VBucket from db file */
             readVBState(db, id, vb_state);
+            vbucket_map_t::iterator jit = journaled.find(id);
+            if (jit != journaled.end()) {
+                // The seqnos are also saved with the docs and only go up
+                vb_state.state = jit->second.state;
+                vb_state.checkpointId = jit->second.checkpointId;
+                vb_state.maxDeletedSeqno = std::max(vb_state.maxDeletedSeqno,
+                                                    jit->second.maxDeletedSeqno);
+                vb_state.purgeSeqno = std::max(vb_state.purgeSeqno,
+                                               jit->second.purgeSeqno);
+            }
+            // The header is read anyway; the item count estimate and
+            // stats needn't open the file again.
+            cacheFileCounts(id, db);
             /* insert populated state to the array to return to the caller */
             cachedVBStates[id] = vb_state;
+            activeVBuckets[id].set(vb_state.state == vbucket_state_active);
             /* update stat */
             ++st.numLoadedVb;
             closeDatabaseHandle(db);
@@ -507,6 +865,18 @@ vbucket_map_t CouchKVStore::listPersistedVbuckets()
     return cachedVBStates;
 }
 
+void CouchKVStore::vbStateChanged(uint16_t vbid, vbucket_state_t state) {
+    if (vbid >= numDbFiles) {
+        return;
+    }
+    bool active = state == vbucket_state_active;
+    if (activeVBuckets[vbid].get() != active) {
+        activeVBuckets[vbid].set(active);
+        // The cached handles count their I/O for the class they had.
+        invalidateCachedDbs(vbid);
+    }
+}
+
 void CouchKVStore::getPersistedStats(std::map<std::string, std::string> &stats)
 {
     char *buffer = NULL;
@@ -567,6 +937,9 @@ bool CouchKVStore::snapshotVBuckets(const vbucket_map_t &vbstates)
 {
     assert(!isReadOnly());
     bool success = true;
+    vbucket_map_t changed;
+    std::map<uint16_t, uint32_t> changeTypes;
+    std::set<uint16_t> created;
 
     vbucket_map_t::const_reverse_iterator iter = vbstates.rbegin();
     for (; iter != vbstates.rend(); ++iter) {
@@ -586,18 +959,37 @@ bool CouchKVStore::snapshotVBuckets(const vbucket_map_t &vbstates)
             }
             it->second.state = vbstate.state;
             it->second.checkpointId = vbstate.checkpointId;
-            // Note that the max deleted seq number is maintained within CouchKVStore
+            // Note that the max deleted and purge seq numbers are maintained
+            // within CouchKVStore
             vbstate.maxDeletedSeqno = it->second.maxDeletedSeqno;
+            vbstate.purgeSeqno = it->second.purgeSeqno;
         } else {
             vb_change_type = VB_STATE_CHANGED;
             cachedVBStates[vbucketId] = vbstate;
+            created.insert(vbucketId);
         }
+        changed[vbucketId] = vbstate;
+        changeTypes[vbucketId] = vb_change_type;
+    }
 
-        success = setVBucketState(vbucketId, vbstate, vb_change_type);
+    // A change of states during a rebalance touches many vbuckets; making
+    // it durable with one sync of the journal rather than a commit of
+    // each file is what keeps it cheap.
+    bool journaled = vbStateJournal && vbStateJournal->append(changed);
+
+    vbucket_map_t::reverse_iterator cit = changed.rbegin();
+    for (; cit != changed.rend(); ++cit) {
+        uint16_t vbucketId = cit->first;
+        uint32_t vb_change_type = changeTypes[vbucketId];
+        if (!journaled || created.find(vbucketId) != created.end()) {
+            success = setVBucketState(vbucketId, cit->second, vb_change_type);
+        } else {
+            success = notifyVBState(vbucketId, cit->second, vb_change_type);
+        }
         if (!success) {
             LOG(EXTENSION_LOG_WARNING,
                 "Warning: failed to set new state, %s, for vbucket %d\n",
-                VBucket::toString(vbstate.state), vbucketId);
+                VBucket::toString(cit->second.state), vbucketId);
             break;
         }
     }
@@ -749,6 +1141,47 @@ bool CouchKVStore::setVBucketState(uint16_t vbucketId, vbucket_state &vbstate,
     return true;
 }
 
+/**
+ * Tell CouchDB of a new state already journaled; the vbucket's file is
+ * as it was.
+ */
+bool CouchKVStore::notifyVBState(uint16_t vbucketId, vbucket_state &vbstate,
+                                 uint32_t vb_change_type)
+{
+    while (true) {
+        Db *db = NULL;
+        uint64_t fileRev = dbFileRevMap[vbucketId];
+        couchstore_error_t errorCode = openDB(vbucketId, fileRev, &db,
+                                              COUCHSTORE_OPEN_FLAG_RDONLY);
+        if (errorCode != COUCHSTORE_SUCCESS) {
+            ++st.numVbSetFailure;
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to open database, vbid=%u rev=%llu",
+                vbucketId, fileRev);
+            return false;
+        }
+        uint64_t headerPos = couchstore_get_header_position(db);
+        closeDatabaseHandle(db);
+
+        RememberingCallback<uint16_t> lcb;
+        VBStateNotification vbs(vbstate.checkpointId, vbstate.state,
+                                vb_change_type, vbucketId);
+        couchNotifier->notify_update(vbs, fileRev, headerPos, lcb);
+        if (lcb.val == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            return true;
+        } else if (lcb.val == PROTOCOL_BINARY_RESPONSE_ETMPFAIL) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Retry notify CouchDB of update, vbid=%u rev=%llu\n",
+                vbucketId, fileRev);
+        } else {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to notify CouchDB of update, "
+                "vbid=%u rev=%llu error=0x%x\n", vbucketId, fileRev, lcb.val);
+            return epStats.shutdown.isShutdown;
+        }
+    }
+}
+
 void CouchKVStore::dump(shared_ptr<Callback<GetValue> > cb)
 {
     loadDB(cb, false, NULL, COUCHSTORE_NO_DELETES);
@@ -761,10 +1194,24 @@ void CouchKVStore::dump(uint16_t vb, shared_ptr<Callback<GetValue> > cb)
     loadDB(cb, false, &vbids);
 }
 
+void CouchKVStore::dump(const std::vector<uint16_t> &vbids,
+                        shared_ptr<Callback<GetValue> > cb)
+{
+    std::vector<uint16_t> ids(vbids);
+    loadDB(cb, false, &ids, COUCHSTORE_NO_DELETES);
+}
+
 void CouchKVStore::dumpKeys(const std::vector<uint16_t> &vbids,  shared_ptr<Callback<GetValue> > cb)
 {
-    (void)vbids;
-    loadDB(cb, true, NULL, COUCHSTORE_NO_DELETES);
+    std::vector<uint16_t> ids(vbids);
+    loadDB(cb, true, &ids, COUCHSTORE_NO_DELETES);
+}
+
+void CouchKVStore::dumpKeys(uint16_t vb, shared_ptr<Callback<GetValue> > cb)
+{
+    std::vector<uint16_t> vbids;
+    vbids.push_back(vb);
+    loadDB(cb, true, &vbids, COUCHSTORE_NO_DELETES);
 }
 
 void CouchKVStore::dumpDeleted(uint16_t vb,  shared_ptr<Callback<GetValue> > cb)
@@ -774,6 +1221,15 @@ void CouchKVStore::dumpDeleted(uint16_t vb,  shared_ptr<Callback<GetValue> > cb)
     loadDB(cb, true, &vbids, COUCHSTORE_DELETES_ONLY);
 }
 
+void CouchKVStore::dumpSince(uint16_t vb, uint64_t since,
+                             shared_ptr<Callback<GetValue> > cb)
+{
+    std::vector<uint16_t> vbids;
+    vbids.push_back(vb);
+    // couchstore_changes_since() starts at the seqno it's given.
+    loadDB(cb, false, &vbids, COUCHSTORE_NO_OPTIONS, since + 1);
+}
+
 StorageProperties CouchKVStore::getStorageProperties()
 {
     StorageProperties rv(true, true, true, true);
@@ -781,13 +1237,19 @@ StorageProperties CouchKVStore::getStorageProperties()
 }
 
 bool CouchKVStore::commit(void)
+{
+    bool rv = commitNoWait();
+    completeCommits();
+    return rv;
+}
+
+bool CouchKVStore::commitNoWait(void)
 {
     assert(!isReadOnly());
     if (intransaction) {
         intransaction = commit2couchstore() ? false : true;
     }
     return !intransaction;
-
 }
 
 void CouchKVStore::addStats(const std::string &prefix,
@@ -800,9 +1262,27 @@ void CouchKVStore::addStats(const std::string &prefix,
     addStat(prefix_str, "backend_type",   "couchstore",       add_stat, c);
     addStat(prefix_str, "open",           st.numOpen,         add_stat, c);
     addStat(prefix_str, "close",          st.numClose,        add_stat, c);
+    if (isReadOnly()) {
+        addStat(prefix_str, "db_cache_hits",   st.numDbCacheHits,   add_stat, c);
+        addStat(prefix_str, "db_cache_misses", st.numDbCacheMisses, add_stat, c);
+    }
+    if (readPool) {
+        size_t reads = readPool->getNumReads();
+        size_t inFlight = readPool->getNumInFlight();
+        addStat(prefix_str, "async_reads",          reads,    add_stat, c);
+        addStat(prefix_str, "async_reads_inflight", inFlight, add_stat, c);
+    }
     addStat(prefix_str, "readTime",       st.readTimeHisto,   add_stat, c);
     addStat(prefix_str, "readSize",       st.readSizeHisto,   add_stat, c);
     addStat(prefix_str, "numLoadedVb",    st.numLoadedVb,     add_stat, c);
+    if (blockCache) {
+        addStat(prefix_str, "blockCacheHits",   st.fsStats.blockCacheHits,
+                add_stat, c);
+        addStat(prefix_str, "blockCacheMisses", st.fsStats.blockCacheMisses,
+                add_stat, c);
+        size_t memUsed = blockCache->getMemUsed();
+        addStat(prefix_str, "blockCacheMemUsed", memUsed, add_stat, c);
+    }
 
     // failure stats
     addStat(prefix_str, "failure_open",   st.numOpenFailure, add_stat, c);
@@ -814,6 +1294,9 @@ void CouchKVStore::addStats(const std::string &prefix,
         addStat(prefix_str, "failure_vbset", st.numVbSetFailure, add_stat, c);
         addStat(prefix_str, "lastCommDocs",  st.docsCommitted,   add_stat, c);
         addStat(prefix_str, "numCommitRetry", st.numCommitRetry, add_stat, c);
+        addStat(prefix_str, "numCommitWaits", st.numCommitWaits, add_stat, c);
+        addStat(prefix_str, "valuesLogged", st.numValuesLogged, add_stat, c);
+        addStat(prefix_str, "valueLogSize", valueLog->getSize(), add_stat, c);
 
         // stats for CouchNotifier
         couchNotifier->addStats(prefix, add_stat, c);
@@ -822,25 +1305,48 @@ void CouchKVStore::addStats(const std::string &prefix,
 
 void CouchKVStore::addTimingStats(const std::string &prefix,
                                   ADD_STAT add_stat, const void *c) {
-    if (isReadOnly()) {
-        return;
-    }
     const char *prefix_str = prefix.c_str();
-    addStat(prefix_str, "commit",      st.commitHisto,      add_stat, c);
-    addStat(prefix_str, "commitRetry", st.commitRetryHisto, add_stat, c);
-    addStat(prefix_str, "delete",      st.delTimeHisto,     add_stat, c);
-    addStat(prefix_str, "save_documents", st.saveDocsHisto, add_stat, c);
-    addStat(prefix_str, "writeTime",   st.writeTimeHisto,   add_stat, c);
-    addStat(prefix_str, "writeSize",   st.writeSizeHisto,   add_stat, c);
-    addStat(prefix_str, "bulkSize",    st.batchSize,        add_stat, c);
-
-    // Couchstore file ops stats
+    if (!isReadOnly()) {
+        addStat(prefix_str, "commit",      st.commitHisto,      add_stat, c);
+        addStat(prefix_str, "commitRetry", st.commitRetryHisto, add_stat, c);
+        addStat(prefix_str, "delete",      st.delTimeHisto,     add_stat, c);
+        addStat(prefix_str, "save_documents", st.saveDocsHisto, add_stat, c);
+        addStat(prefix_str, "writeTime",   st.writeTimeHisto,   add_stat, c);
+        addStat(prefix_str, "writeSize",   st.writeSizeHisto,   add_stat, c);
+        addStat(prefix_str, "bulkSize",    st.batchSize,        add_stat, c);
+    }
+
+    // Couchstore file ops stats, of the reads of bg fetches on the
+    // read-only stores
     addStat(prefix_str, "fsReadTime",  st.fsStats.readTimeHisto,  add_stat, c);
     addStat(prefix_str, "fsWriteTime", st.fsStats.writeTimeHisto, add_stat, c);
     addStat(prefix_str, "fsSyncTime",  st.fsStats.syncTimeHisto,  add_stat, c);
     addStat(prefix_str, "fsReadSize",  st.fsStats.readSizeHisto,  add_stat, c);
     addStat(prefix_str, "fsWriteSize", st.fsStats.writeSizeHisto, add_stat, c);
     addStat(prefix_str, "fsReadSeek",  st.fsStats.readSeekHisto,  add_stat, c);
+    addStat(prefix_str, "fsSeekTime",  st.fsStats.seekTimeHisto,  add_stat, c);
+    addFsStats(prefix_str, "fsActive", st.activeFsStats, add_stat, c);
+    addFsStats(prefix_str, "fsReplica", st.replicaFsStats, add_stat, c);
+}
+
+void CouchKVStore::addFsStats(const std::string &prefix, const char *nm,
+                              CouchstoreStats &fsStats,
+                              ADD_STAT add_stat, const void *c) {
+    std::string name(nm);
+    addStat(prefix, (name + "ReadTime").c_str(),  fsStats.readTimeHisto,
+            add_stat, c);
+    addStat(prefix, (name + "WriteTime").c_str(), fsStats.writeTimeHisto,
+            add_stat, c);
+    addStat(prefix, (name + "SyncTime").c_str(),  fsStats.syncTimeHisto,
+            add_stat, c);
+    addStat(prefix, (name + "SeekTime").c_str(),  fsStats.seekTimeHisto,
+            add_stat, c);
+    addStat(prefix, (name + "ReadSize").c_str(),  fsStats.readSizeHisto,
+            add_stat, c);
+    addStat(prefix, (name + "WriteSize").c_str(), fsStats.writeSizeHisto,
+            add_stat, c);
+    addStat(prefix, (name + "ReadSeek").c_str(),  fsStats.readSeekHisto,
+            add_stat, c);
 }
 
 template <typename T>
@@ -864,7 +1370,8 @@ void CouchKVStore::optimizeWrites(std::vector<queued_item> &items)
 
 void CouchKVStore::loadDB(shared_ptr<Callback<GetValue> > cb, bool keysOnly,
                           std::vector<uint16_t> *vbids,
-                          couchstore_docinfos_options options)
+                          couchstore_docinfos_options options,
+                          uint64_t since)
 {
     std::vector<std::string> files;
     std::map<uint16_t, uint64_t> vbmap;
@@ -941,9 +1448,11 @@ void CouchKVStore::loadDB(shared_ptr<Callback<GetValue> > cb, bool keysOnly,
             LoadResponseCtx ctx;
             ctx.vbucketId = itr->first;
             ctx.keysonly = keysOnly;
+            ctx.keepCompressed = compressValues;
             ctx.callback = cb;
             ctx.stats = &epStats;
-            errorCode = couchstore_changes_since(db, 0, options, recordDbDumpC,
+            ctx.store = this;
+            errorCode = couchstore_changes_since(db, since, options, recordDbDumpC,
                                                  static_cast<void *>(&ctx));
             if (errorCode != COUCHSTORE_SUCCESS) {
                 if (errorCode == COUCHSTORE_ERROR_CANCEL) {
@@ -1043,6 +1552,9 @@ void CouchKVStore::updateDbFileMap(uint16_t vbucketId, uint64_t newFileRev)
         return;
     }
 
+    if (dbFileRevMap[vbucketId] != newFileRev) {
+        invalidateCachedDbs(vbucketId);
+    }
     dbFileRevMap[vbucketId] = newFileRev;
 }
 
@@ -1062,11 +1574,27 @@ couchstore_error_t CouchKVStore::openDB(uint16_t vbucketId,
                                         uint64_t *newFileRev)
 {
     std::string dbFileName = getDBFileName(dbname, vbucketId, fileRev);
-    couch_file_ops* ops = &statCollectingFileOps;
+    couch_file_ops* ops = activeVBuckets[vbucketId].get() ?
+        &activeFileOps : &replicaFileOps;
 
     uint64_t newRevNum = fileRev;
     couchstore_error_t errorCode = COUCHSTORE_SUCCESS;
 
+    bool cacheable = options == COUCHSTORE_OPEN_FLAG_RDONLY && dbCacheSize > 0;
+    struct stat dbstat;
+    if (cacheable) {
+        if (getCachedDb(vbucketId, fileRev, db)) {
+            ++st.numDbCacheHits;
+            if (newFileRev != NULL) {
+                *newFileRev = fileRev;
+            }
+            return COUCHSTORE_SUCCESS;
+        }
+        ++st.numDbCacheMisses;
+        // Taken before opening, so the handle never sees less of the file.
+        cacheable = stat(dbFileName.c_str(), &dbstat) == 0;
+    }
+
     if (options == COUCHSTORE_OPEN_FLAG_CREATE) {
         // first try to open the requested file without the create option
         // in case it does already exist
@@ -1107,6 +1635,12 @@ couchstore_error_t CouchKVStore::openDB(uint16_t vbucketId,
         if (newRevNum > fileRev) {
             // new revision number found, update it
             updateDbFileMap(vbucketId, newRevNum);
+        } else if (cacheable) {
+            CachedDb cached(vbucketId, fileRev, *db);
+            cached.inode = dbstat.st_ino;
+            cached.size = dbstat.st_size;
+            LockHolder lh(dbCacheMutex);
+            dbsInUse.insert(std::make_pair(*db, cached));
         }
     }
 
@@ -1179,7 +1713,7 @@ couchstore_error_t CouchKVStore::fetchDoc(Db *db, DocInfo *docinfo,
     uint64_t cas;
     time_t exptime;
 
-    assert(metadata.size == 16);
+    assert(metadata.size >= COUCHSTORE_METADATA_SIZE);
     memcpy(&cas, (metadata.buf), 8);
     cas = ntohll(cas);
     memcpy(&exptime, (metadata.buf) + 8, 4);
@@ -1198,7 +1732,9 @@ couchstore_error_t CouchKVStore::fetchDoc(Db *db, DocInfo *docinfo,
         epStats.io_read_bytes += docinfo->id.size;
     } else {
         Doc *doc = NULL;
-        errCode = couchstore_open_doc_with_docinfo(db, docinfo, &doc, DECOMPRESS_DOC_BODIES);
+        uint8_t datatype;
+        int options = docReadOptions(docinfo, compressValues, datatype);
+        errCode = couchstore_open_doc_with_docinfo(db, docinfo, &doc, options);
         if (errCode == COUCHSTORE_SUCCESS) {
             if (docinfo->deleted) {
                 // do not read a doc that is marked deleted, just return the
@@ -1206,16 +1742,27 @@ couchstore_error_t CouchKVStore::fetchDoc(Db *db, DocInfo *docinfo,
                 errCode = COUCHSTORE_ERROR_DOC_NOT_FOUND;
             } else {
                 assert(doc && (doc->id.size <= UINT16_MAX));
-                size_t valuelen = doc->data.size;
-                void *valuePtr = doc->data.buf;
-                Item *it = new Item(docinfo->id.buf, (size_t)docinfo->id.size,
-                                    itemFlags, (time_t)exptime, valuePtr, valuelen,
-                                    cas, -1, vbId);
-                docValue = GetValue(it);
-
-                // update ep-engine IO stats
-                ++epStats.io_num_read;
-                epStats.io_read_bytes += docinfo->id.size + valuelen;
+                value_t value;
+                if (isValueLogged(docinfo)) {
+                    errCode = readLoggedValue(vbId, doc, compressValues,
+                                              value);
+                } else {
+                    value.reset(Blob::New(doc->data.buf, doc->data.size,
+                                          datatype));
+                }
+                if (errCode == COUCHSTORE_SUCCESS) {
+                    Item *it = new Item(std::string(docinfo->id.buf,
+                                                    docinfo->id.size),
+                                        itemFlags, (time_t)exptime, value,
+                                        cas, -1, vbId);
+                    it->setSeqno(docinfo->rev_seq);
+                    docValue = GetValue(it);
+
+                    // update ep-engine IO stats
+                    ++epStats.io_num_read;
+                    epStats.io_read_bytes += docinfo->id.size +
+                        value->length();
+                }
             }
             couchstore_free_document(doc);
         }
@@ -1242,7 +1789,7 @@ int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx)
     uint32_t exptime;
 
     assert(key.size <= UINT16_MAX);
-    assert(metadata.size == 16);
+    assert(metadata.size >= COUCHSTORE_METADATA_SIZE);
 
     if (warmup) {
         // skip items already loaded during earlier warmup stage
@@ -1260,9 +1807,20 @@ int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx)
     exptime = ntohl(exptime);
     cas = ntohll(cas);
 
+    uint8_t datatype = BLOB_DATATYPE_RAW;
+    value_t logged;
     if (!loadCtx->keysonly && !docinfo->deleted) {
         couchstore_error_t errCode ;
-        errCode = couchstore_open_doc_with_docinfo(db, docinfo, &doc, DECOMPRESS_DOC_BODIES);
+        int options = docReadOptions(docinfo, loadCtx->keepCompressed, datatype);
+        errCode = couchstore_open_doc_with_docinfo(db, docinfo, &doc, options);
+        if (errCode == COUCHSTORE_SUCCESS && isValueLogged(docinfo)) {
+            errCode = loadCtx->store->readLoggedValue(vbucketId, doc,
+                                                      loadCtx->keepCompressed,
+                                                      logged);
+            if (errCode != COUCHSTORE_SUCCESS) {
+                couchstore_free_document(doc);
+            }
+        }
 
         if (errCode == COUCHSTORE_SUCCESS) {
             if (doc->data.size) {
@@ -1279,15 +1837,34 @@ int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx)
         }
     }
 
-    Item *it = new Item((void *)key.buf,
-                        key.size,
-                        itemflags,
-                        (time_t)exptime,
-                        valuePtr, valuelen,
-                        cas,
-                        docinfo->db_seq, // return seq number being persisted on disk
-                        vbucketId,
-                        docinfo->rev_seq);
+    Item *it;
+    if (loadCtx->keysonly && !docinfo->deleted) {
+        // There's no value to give a blob to, and the item is only turned
+        // into a non-resident StoredValue.
+        it = new Item(key.buf, static_cast<uint16_t>(key.size), itemflags,
+                      (time_t)exptime, value_t(), cas, docinfo->db_seq,
+                      vbucketId, docinfo->rev_seq);
+    } else if (logged.get()) {
+        it = new Item(key.buf, static_cast<uint16_t>(key.size), itemflags,
+                      (time_t)exptime, logged, cas, docinfo->db_seq,
+                      vbucketId, docinfo->rev_seq);
+    } else if (datatype == BLOB_DATATYPE_RAW) {
+        it = new Item((void *)key.buf,
+                      key.size,
+                      itemflags,
+                      (time_t)exptime,
+                      valuePtr, valuelen,
+                      cas,
+                      docinfo->db_seq, // return seq number being persisted on disk
+                      vbucketId,
+                      docinfo->rev_seq);
+    } else {
+        value_t value(Blob::New(static_cast<const char *>(valuePtr), valuelen,
+                                datatype));
+        it = new Item(key.buf, static_cast<uint16_t>(key.size), itemflags,
+                      (time_t)exptime, value, cas, docinfo->db_seq, vbucketId,
+                      docinfo->rev_seq);
+    }
 
     GetValue rv(it, ENGINE_SUCCESS, -1, loadCtx->keysonly);
     cb->callback(rv);
@@ -1312,50 +1889,53 @@ bool CouchKVStore::commit2couchstore(void)
 {
     bool success = true;
 
-    if (pendingCommitCnt == 0) {
+    if (pendingReqs.empty()) {
         return success;
     }
 
-    CouchRequest **committedReqs = new CouchRequest *[pendingCommitCnt];
-    Doc **docs = new Doc *[pendingCommitCnt];
-    DocInfo **docinfos = new DocInfo *[pendingCommitCnt];
+    uint16_t vbucket2flush = pendingReqs[0].getVBucketId();
+    uint64_t fileRev = pendingReqs[0].getRevNum();
+    pendingReqs.prepare();
 
-    assert(pendingReqsQ[0]);
-    uint16_t vbucket2flush = pendingReqsQ[0]->getVBucketId();
-    uint64_t fileRev = pendingReqsQ[0]->getRevNum();
-    int reqIndex = 0;
-    for (; pendingCommitCnt > 0; ++reqIndex, --pendingCommitCnt) {
-        CouchRequest *req = pendingReqsQ[reqIndex];
-        assert(req);
-        committedReqs[reqIndex] = req;
-        docs[reqIndex] = req->getDbDoc();
-        docinfos[reqIndex] = req->getDbDocInfo();
-        assert(vbucket2flush == req->getVBucketId());
+    // The flusher goes on to the next vbucket without waiting for mccouch
+    // to answer the notification of this commit.
+    if (spareCommits.empty()) {
+        spareCommits.push_back(DeferredCommit());
     }
+    deferredCommits.splice(deferredCommits.end(), spareCommits,
+                           spareCommits.begin());
+    DeferredCommit &deferred = deferredCommits.back();
+    deferred.vbId = vbucket2flush;
+    deferred.sent = false;
+    deferred.status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
 
     // flush all
-    couchstore_error_t errCode = saveDocs(vbucket2flush, fileRev, docs, docinfos, reqIndex);
+    couchstore_error_t errCode = saveDocs(vbucket2flush, fileRev,
+                                          pendingReqs.getDocs(),
+                                          pendingReqs.getDocInfos(),
+                                          pendingReqs.size(), &deferred);
     if (errCode) {
         LOG(EXTENSION_LOG_WARNING,
             "Warning: commit failed, cannot save CouchDB docs "
             "for vbucket = %d rev = %llu\n", vbucket2flush, fileRev);
         ++epStats.commitFailed;
+    } else if (deferred.sent) {
+        // pendingReqs takes over the spare batch's storage
+        deferred.batch.swap(pendingReqs);
+        return success;
     }
-    commitCallback(committedReqs, reqIndex, errCode);
+    spareCommits.splice(spareCommits.begin(), deferredCommits,
+                        --deferredCommits.end());
+    commitCallback(pendingReqs, errCode);
 
-    // clean up
-    pendingReqsQ.clear();
-    while (reqIndex--) {
-        delete committedReqs[reqIndex];
-    }
-    delete [] committedReqs;
-    delete [] docs;
-    delete [] docinfos;
+    // The requests' storage is kept for the next commit.
+    pendingReqs.clear();
     return success;
 }
 
 couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **docs,
-                                          DocInfo **docinfos, int docCount)
+                                          DocInfo **docinfos, int docCount,
+                                          DeferredCommit *deferred)
 {
     couchstore_error_t errCode;
     bool retry_save_docs = false;
@@ -1395,9 +1975,19 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
                 }
             }
 
+            // The values in the log must be there before the docs that
+            // point at them.
+            if (!valueLog->sync(vbid)) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: failed to sync the value log of vBucket %d",
+                    vbid);
+                closeDatabaseHandle(db);
+                return COUCHSTORE_ERROR_WRITE;
+            }
+
             hrtime_t cs_begin = gethrtime();
             errCode = couchstore_save_documents(db, docs, docinfos, docCount,
-                                                COMPRESS_DOC_BODIES);
+                                                compressValues ? 0 : COMPRESS_DOC_BODIES);
             st.saveDocsHisto.add((gethrtime() - cs_begin) / 1000);
             if (errCode != COUCHSTORE_SUCCESS) {
                 LOG(EXTENSION_LOG_WARNING,
@@ -1429,8 +2019,18 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
 
             RememberingCallback<uint16_t> cb;
             uint64_t newHeaderPos = couchstore_get_header_position(db);
-            couchNotifier->notify_headerpos_update(vbid, newFileRev, newHeaderPos, cb);
-            if (cb.val != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            if (deferred) {
+                // Answered once the transaction's commits are done
+                deferred->fileRev = newFileRev;
+                deferred->sent = true;
+                couchNotifier->notify_headerpos_update_async(vbid, newFileRev,
+                                                             newHeaderPos,
+                                                             deferred);
+            } else {
+                couchNotifier->notify_headerpos_update(vbid, newFileRev,
+                                                       newHeaderPos, cb);
+            }
+            if (!deferred && cb.val != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
                 if (cb.val == PROTOCOL_BINARY_RESPONSE_ETMPFAIL) {
                     LOG(EXTENSION_LOG_WARNING,
                         "Retry notify CouchDB of update, vbucket=%d rev=%llu\n",
@@ -1451,9 +2051,7 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
             st.batchSize.add(docCount);
 
             if (db && !retry_save_docs) {
-                DbInfo info;
-                couchstore_db_info(db, &info);
-                cachedDeleteCount[vbid] = info.deleted_count;
+                cacheFileCounts(vbid, db);
             }
             closeDatabaseHandle(db);
         }
@@ -1470,16 +2068,14 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
     return errCode;
 }
 
-void CouchKVStore::queueItem(CouchRequest *req)
+CouchRequestBatch &CouchKVStore::batchFor(uint16_t vbid)
 {
-    if (pendingCommitCnt &&
-        pendingReqsQ.front()->getVBucketId() != req->getVBucketId()) {
+    if (!pendingReqs.empty() && pendingReqs[0].getVBucketId() != vbid) {
         // got new request for a different vb, commit pending
         // pending requests of the current vb firt
         commit2couchstore();
     }
-    pendingReqsQ.push_back(req);
-    pendingCommitCnt++;
+    return pendingReqs;
 }
 
 void CouchKVStore::remVBucketFromDbFileMap(uint16_t vbucketId)
@@ -1492,39 +2088,82 @@ void CouchKVStore::remVBucketFromDbFileMap(uint16_t vbucketId)
     }
 
     // just reset revision number of the requested vbucket
+    invalidateCachedDbs(vbucketId);
     dbFileRevMap[vbucketId] = 1;
 }
 
-void CouchKVStore::commitCallback(CouchRequest **committedReqs, int numReqs,
+/**
+ * A commit refused by mccouch, or not answered before the connection was
+ * reset, is saved again to the vbucket's current file.
+ */
+void CouchKVStore::completeCommits()
+{
+    if (deferredCommits.empty()) {
+        return;
+    }
+    ++st.numCommitWaits;
+    couchNotifier->waitForPending();
+
+    while (!deferredCommits.empty()) {
+        DeferredCommit &dc = deferredCommits.front();
+        couchstore_error_t errCode = COUCHSTORE_SUCCESS;
+        if (dc.status == PROTOCOL_BINARY_RESPONSE_ETMPFAIL) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Retry notify CouchDB of update, vbucket=%d rev=%llu\n",
+                dc.vbId, dc.fileRev);
+            ++st.numCommitRetry;
+            errCode = saveDocs(dc.vbId, dc.fileRev, dc.batch.getDocs(),
+                               dc.batch.getDocInfos(), dc.batch.size());
+            if (errCode) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: commit failed, cannot save CouchDB docs "
+                    "for vbucket = %d rev = %llu\n", dc.vbId, dc.fileRev);
+                ++epStats.commitFailed;
+            }
+        } else if (dc.status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to notify "
+                "CouchDB of update for vbucket=%d, error=0x%x\n",
+                dc.vbId, dc.status);
+        }
+        commitCallback(dc.batch, errCode);
+        dc.batch.clear();
+        spareCommits.splice(spareCommits.end(), deferredCommits,
+                            deferredCommits.begin());
+    }
+}
+
+void CouchKVStore::commitCallback(CouchRequestBatch &batch,
                                   couchstore_error_t errCode)
 {
-    for (int index = 0; index < numReqs; index++) {
-        size_t dataSize = committedReqs[index]->getNBytes();
-        size_t keySize = committedReqs[index]->getKey().length();
+    size_t numReqs = batch.size();
+    for (size_t index = 0; index < numReqs; index++) {
+        CouchRequest &req = batch[index];
+        size_t dataSize = req.getNBytes();
+        size_t keySize = req.getKeyLength();
         /* update ep stats */
         ++epStats.io_num_write;
         epStats.io_write_bytes += keySize + dataSize;
 
-        if (committedReqs[index]->isDelete()) {
+        if (req.isDelete()) {
             int rv = getMutationStatus(errCode);
             if (errCode) {
                 ++st.numDelFailure;
             } else {
-                st.delTimeHisto.add(committedReqs[index]->getDelta() / 1000);
+                st.delTimeHisto.add(req.getDelta() / 1000);
             }
-            committedReqs[index]->getDelCallback()->callback(rv);
+            req.getDelCallback()->callback(rv);
         } else {
             int rv = getMutationStatus(errCode);
-            int64_t newItemId = committedReqs[index]->getDbDocInfo()->db_seq;
+            int64_t newItemId = req.getDbDocInfo()->db_seq;
             if (errCode) {
                 ++st.numSetFailure;
                 newItemId = 0;
             } else {
-                st.writeTimeHisto.add(committedReqs[index]->getDelta() / 1000);
+                st.writeTimeHisto.add(req.getDelta() / 1000);
                 st.writeSizeHisto.add(dataSize + keySize);
             }
             mutation_result p(rv, newItemId);
-            committedReqs[index]->getSetCallback()->callback(p);
+            req.getSetCallback()->callback(p);
         }
     }
 }
@@ -1538,6 +2177,7 @@ void CouchKVStore::readVBState(Db *db, uint16_t vbId, vbucket_state &vbState)
     vbState.state = vbucket_state_dead;
     vbState.checkpointId = 0;
     vbState.maxDeletedSeqno = 0;
+    vbState.purgeSeqno = 0;
 
     id.buf = (char *)"_local/vbstate";
     id.size = sizeof("_local/vbstate") - 1;
@@ -1565,6 +2205,12 @@ void CouchKVStore::readVBState(Db *db, uint16_t vbId, vbucket_state &vbState)
             vbState.state = VBucket::fromString(state.c_str());
             parseUint64(max_deleted_seqno.c_str(), &vbState.maxDeletedSeqno);
             parseUint64(checkpoint_id.c_str(), &vbState.checkpointId);
+            // Not there in the files of older versions.
+            const std::string purge_seqno =
+                getJSONObjString(cJSON_GetObjectItem(jsonObj, "purge_seqno"));
+            if (!purge_seqno.empty()) {
+                parseUint64(purge_seqno.c_str(), &vbState.purgeSeqno);
+            }
         }
         cJSON_Delete(jsonObj);
         couchstore_free_local_document(ldoc);
@@ -1578,6 +2224,7 @@ couchstore_error_t CouchKVStore::saveVBState(Db *db, vbucket_state &vbState)
     jsonState << "{\"state\": \"" << VBucket::toString(vbState.state)
               << "\", \"checkpoint_id\": \"" << vbState.checkpointId
               << "\", \"max_deleted_seqno\": \"" << vbState.maxDeletedSeqno
+              << "\", \"purge_seqno\": \"" << vbState.purgeSeqno
               << "\"}";
 
     LocalDoc lDoc;
@@ -1598,19 +2245,17 @@ couchstore_error_t CouchKVStore::saveVBState(Db *db, vbucket_state &vbState)
     return errCode;
 }
 
-int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx)
+int CouchKVStore::getMultiCb(Db *, DocInfo *docinfo, void *ctx)
 {
     assert(docinfo);
-    std::string keyStr(docinfo->id.buf, docinfo->id.size);
     assert(ctx);
     GetMultiCbCtx *cbCtx = static_cast<GetMultiCbCtx *>(ctx);
-    CouchKVStoreStats &st = cbCtx->cks.getCKVStoreStat();
-
 
     vb_bgfetch_queue_t::iterator qitr = cbCtx->fetches.find(docinfo->db_seq);
     if (qitr == cbCtx->fetches.end()) {
         // this could be a serious race condition in couchstore,
         // log a warning message and continue
+        std::string keyStr(docinfo->id.buf, docinfo->id.size);
         LOG(EXTENSION_LOG_WARNING,
             "Warning: couchstore returned invalid docinfo, "
             "no pending bgfetch has been issued for db_seq=%lld "
@@ -1618,20 +2263,95 @@ int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx)
         return 0;
     }
 
-    std::list<VBucketBGFetchItem *> &fetches = (*qitr).second;
-    GetValue returnVal;
-    couchstore_error_t errCode = cbCtx->cks.fetchDoc(db, docinfo, returnVal,
-                                                     cbCtx->vbId, false);
-    if (errCode != COUCHSTORE_SUCCESS) {
-        LOG(EXTENSION_LOG_WARNING, "Warning: failed to fetch data from database, "
-            "vBucket=%d key=%s error=%s [%s]", cbCtx->vbId,
-            keyStr.c_str(), couchstore_strerror(errCode),
-                         couchkvstore_strerrno(errCode).c_str());
-        st.numGetFailure++;
+    // Keep the docinfo; getMulti reads and frees it
+    cbCtx->docinfos.push_back(docinfo);
+    return 1;
+}
+
+int CouchKVStore::getMultiMetaCb(Db *db, DocInfo *docinfo, void *ctx)
+{
+    assert(docinfo);
+    assert(ctx);
+    GetMultiMetaCbCtx *cbCtx = static_cast<GetMultiMetaCbCtx *>(ctx);
+
+    std::string keyStr(docinfo->id.buf, docinfo->id.size);
+    vb_bgmeta_queue_t::iterator qitr = cbCtx->fetches.find(keyStr);
+    if (qitr == cbCtx->fetches.end()) {
+        return 0;
     }
 
-    returnVal.setStatus(cbCtx->cks.couchErr2EngineErr(errCode));
-    std::list<VBucketBGFetchItem *>::iterator itr = fetches.begin();
+    GetValue returnVal;
+    cbCtx->cks.fetchDoc(db, docinfo, returnVal, cbCtx->vbId, true);
+    std::list<VBucketBGFetchItem *>::iterator itr = qitr->second.begin();
+    for (; itr != qitr->second.end(); ++itr) {
+        (*itr)->value = returnVal;
+        cbCtx->cks.st.readTimeHisto.add((gethrtime() - (*itr)->initTime) / 1000);
+    }
+    return 0;
+}
+
+int CouchKVStore::keysAfterCb(Db *, DocInfo *docinfo, void *ctx)
+{
+    assert(docinfo);
+    assert(ctx);
+    KeysAfterCtx *cbCtx = static_cast<KeysAfterCtx *>(ctx);
+
+    std::string keyStr(docinfo->id.buf, docinfo->id.size);
+    if (keyStr == cbCtx->key) {
+        return 0;
+    }
+    if (keyStr.compare(0, cbCtx->prefix.size(), cbCtx->prefix) != 0) {
+        // Past the keys with the prefix
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+    cbCtx->keys.push_back(keyStr);
+    return cbCtx->keys.size() < cbCtx->count ? 0 : COUCHSTORE_ERROR_CANCEL;
+}
+
+int CouchKVStore::rangeScanCb(Db *db, DocInfo *docinfo, void *ctx)
+{
+    assert(docinfo);
+    assert(ctx);
+    RangeScanCtx *cbCtx = static_cast<RangeScanCtx *>(ctx);
+
+    if (!cbCtx->end.empty() &&
+        cbCtx->end.compare(0, std::string::npos, docinfo->id.buf,
+                           docinfo->id.size) <= 0) {
+        // Past the end of the range
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+
+    GetValue rv;
+    couchstore_error_t errCode = cbCtx->cks.fetchDoc(db, docinfo, rv,
+                                                     cbCtx->vbId,
+                                                     cbCtx->keysOnly);
+    if (errCode == COUCHSTORE_ERROR_DOC_NOT_FOUND) {
+        return 0;
+    } else if (errCode != COUCHSTORE_SUCCESS) {
+        cbCtx->errCode = errCode;
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+    cbCtx->callback.callback(rv);
+    return ++cbCtx->count < cbCtx->limit ? 0 : COUCHSTORE_ERROR_CANCEL;
+}
+
+void CouchKVStore::readMultiDoc(Db *db, DocInfo *docinfo, uint16_t vbId,
+                                std::list<VBucketBGFetchItem *> &fetches)
+{
+    std::string keyStr(docinfo->id.buf, docinfo->id.size);
+    GetValue returnVal;
+    couchstore_error_t errCode = fetchDoc(db, docinfo, returnVal,
+                                          vbId, false);
+    if (errCode != COUCHSTORE_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to fetch data from database, "
+            "vBucket=%d key=%s error=%s [%s]", vbId,
+            keyStr.c_str(), couchstore_strerror(errCode),
+                         couchkvstore_strerrno(errCode).c_str());
+        st.numGetFailure++;
+    }
+
+    returnVal.setStatus(couchErr2EngineErr(errCode));
+    std::list<VBucketBGFetchItem *>::iterator itr = fetches.begin();
     for (; itr != fetches.end(); ++itr) {
         // populate return value for remaining fetch items with the
         // same seqid
@@ -1642,11 +2362,297 @@ int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx)
                                  returnVal.getValue()->getNBytes());
         }
     }
-    return 0;
 }
 
 
+bool CouchKVStore::getCachedDb(uint16_t vbucketId, uint64_t fileRev, Db **db)
+{
+    LockHolder lh(dbCacheMutex);
+    std::list<CachedDb>::iterator it = dbCache.begin();
+    while (it != dbCache.end() &&
+           (it->vbId != vbucketId || it->fileRev != fileRev)) {
+        ++it;
+    }
+    if (it == dbCache.end()) {
+        return false;
+    }
+    CachedDb cached = *it;
+    dbCache.erase(it);
+    lh.unlock();
+
+    struct stat dbstat;
+    std::string dbFileName = getDBFileName(dbname, vbucketId, fileRev);
+    if (stat(dbFileName.c_str(), &dbstat) != 0 ||
+        dbstat.st_ino != cached.inode || dbstat.st_size != cached.size) {
+        // The file was written to or replaced since the handle was opened.
+        closeDatabaseHandle(cached.db);
+        return false;
+    }
+
+    lh.lock();
+    dbsInUse.insert(std::make_pair(cached.db, cached));
+    *db = cached.db;
+    return true;
+}
+
+void CouchKVStore::invalidateCachedDbs(uint16_t vbucketId)
+{
+    std::vector<Db *> stale;
+    LockHolder lh(dbCacheMutex);
+    std::list<CachedDb>::iterator it = dbCache.begin();
+    while (it != dbCache.end()) {
+        if (it->vbId == vbucketId) {
+            stale.push_back(it->db);
+            dbCache.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    lh.unlock();
+
+    std::vector<Db *>::iterator sit = stale.begin();
+    for (; sit != stale.end(); ++sit) {
+        closeDatabaseHandle(*sit);
+    }
+}
+
+void CouchKVStore::closeCachedDbs()
+{
+    LockHolder lh(dbCacheMutex);
+    std::list<CachedDb> cached;
+    cached.swap(dbCache);
+    lh.unlock();
+
+    std::list<CachedDb>::iterator it = cached.begin();
+    for (; it != cached.end(); ++it) {
+        closeDatabaseHandle(it->db);
+    }
+}
+
+/* the block caches of the buckets, by db dir, and their users */
+static Mutex blockCachesMutex;
+static std::map<std::string, std::pair<CouchBlockCache *, size_t> > blockCaches;
+
+CouchBlockCache *CouchKVStore::acquireBlockCache()
+{
+    if (!configuration.isCouchDirectReads()) {
+        return NULL;
+    }
+    LockHolder lh(blockCachesMutex);
+    std::pair<CouchBlockCache *, size_t> &entry = blockCaches[dbname];
+    if (entry.first == NULL) {
+        size_t capacity = configuration.getMaxSize() / 100 *
+                          configuration.getCouchBlockCachePercent();
+        entry.first = new CouchBlockCache(capacity);
+        LOG(EXTENSION_LOG_INFO, "Reading %s with O_DIRECT through a %llu byte "
+            "block cache", dbname.c_str(), (unsigned long long)capacity);
+    }
+    ++entry.second;
+    return entry.first;
+}
+
+void CouchKVStore::releaseBlockCache()
+{
+    if (blockCache == NULL) {
+        return;
+    }
+    LockHolder lh(blockCachesMutex);
+    std::map<std::string, std::pair<CouchBlockCache *, size_t> >::iterator it =
+        blockCaches.find(dbname);
+    assert(it != blockCaches.end() && it->second.first == blockCache);
+    if (--it->second.second == 0) {
+        delete it->second.first;
+        blockCaches.erase(it);
+    }
+    blockCache = NULL;
+}
+
+/* the vbucket state journals of the buckets, by db dir, and their users */
+static Mutex vbStateJournalsMutex;
+static std::map<std::string,
+                std::pair<CouchVBStateJournal *, size_t> > vbStateJournals;
+
+CouchVBStateJournal *CouchKVStore::acquireVBStateJournal()
+{
+    LockHolder lh(vbStateJournalsMutex);
+    std::pair<CouchVBStateJournal *, size_t> &entry = vbStateJournals[dbname];
+    if (entry.first == NULL) {
+        entry.first = new CouchVBStateJournal(dbname + "/vbstate.journal");
+    }
+    ++entry.second;
+    return entry.first;
+}
+
+void CouchKVStore::releaseVBStateJournal()
+{
+    if (vbStateJournal == NULL) {
+        return;
+    }
+    LockHolder lh(vbStateJournalsMutex);
+    std::map<std::string, std::pair<CouchVBStateJournal *, size_t> >::iterator
+        it = vbStateJournals.find(dbname);
+    assert(it != vbStateJournals.end() && it->second.first == vbStateJournal);
+    if (--it->second.second == 0) {
+        delete it->second.first;
+        vbStateJournals.erase(it);
+    }
+    vbStateJournal = NULL;
+}
+
+/* the doc counts of the buckets' files, by db dir, and their users */
+static Mutex fileCountsMutex;
+static std::map<std::string,
+                std::pair<CouchFileCounts *, size_t> > fileCountsByDb;
+
+CouchFileCounts *CouchKVStore::acquireFileCounts()
+{
+    LockHolder lh(fileCountsMutex);
+    std::pair<CouchFileCounts *, size_t> &entry = fileCountsByDb[dbname];
+    if (entry.first == NULL) {
+        entry.first = new CouchFileCounts(numDbFiles);
+    }
+    ++entry.second;
+    return entry.first;
+}
+
+void CouchKVStore::releaseFileCounts()
+{
+    if (fileCounts == NULL) {
+        return;
+    }
+    LockHolder lh(fileCountsMutex);
+    std::map<std::string, std::pair<CouchFileCounts *, size_t> >::iterator
+        it = fileCountsByDb.find(dbname);
+    assert(it != fileCountsByDb.end() && it->second.first == fileCounts);
+    if (--it->second.second == 0) {
+        delete it->second.first;
+        fileCountsByDb.erase(it);
+    }
+    fileCounts = NULL;
+}
+
+/* the value logs of the buckets, by db dir, and their users */
+static Mutex valueLogMutex;
+static std::map<std::string,
+                std::pair<CouchValueLog *, size_t> > valueLogByDb;
+
+CouchValueLog *CouchKVStore::acquireValueLog()
+{
+    LockHolder lh(valueLogMutex);
+    std::pair<CouchValueLog *, size_t> &entry = valueLogByDb[dbname];
+    if (entry.first == NULL) {
+        entry.first = new CouchValueLog(dbname);
+    }
+    ++entry.second;
+    return entry.first;
+}
+
+void CouchKVStore::releaseValueLog()
+{
+    if (valueLog == NULL) {
+        return;
+    }
+    LockHolder lh(valueLogMutex);
+    std::map<std::string, std::pair<CouchValueLog *, size_t> >::iterator
+        it = valueLogByDb.find(dbname);
+    assert(it != valueLogByDb.end() && it->second.first == valueLog);
+    if (--it->second.second == 0) {
+        delete it->second.first;
+        valueLogByDb.erase(it);
+    }
+    valueLog = NULL;
+}
+
+void CouchKVStore::getMultiAsync(uint16_t vb, vb_bgfetch_queue_t &itms,
+                                 Callback<uint16_t> &cb)
+{
+    if (readPool == NULL && asyncReaders > 0) {
+        readPool = new CouchReadPool(*this, asyncReaders);
+        if (readPool->getNumReaders() == 0) {
+            asyncReaders = 0;
+        }
+    }
+    if (asyncReaders == 0) {
+        getMulti(vb, itms);
+        cb.callback(vb);
+        return;
+    }
+    readPool->submit(vb, itms, cb);
+}
+
+void CouchKVStore::releaseReadPool()
+{
+    // Waits for the reads in flight.
+    delete readPool;
+    readPool = NULL;
+}
+
+couchstore_error_t CouchKVStore::readLoggedValue(uint16_t vbid,
+                                                 const Doc *doc,
+                                                 bool keepCompressed,
+                                                 value_t &value)
+{
+    ValueLogPointer ptr;
+    std::string data;
+    if (!ptr.decode(doc->data.buf, doc->data.size) ||
+        !valueLog->read(vbid, ptr, data)) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to read the value of key %.*s from the value "
+            "log of vBucket %d", (int)doc->id.size, doc->id.buf, vbid);
+        return COUCHSTORE_ERROR_READ;
+    }
+    value.reset(Blob::New(data.data(), data.size(),
+                          ptr.compressed ? BLOB_DATATYPE_SNAPPY :
+                                           BLOB_DATATYPE_RAW));
+    if (ptr.compressed && !keepCompressed) {
+        value_t raw(value->uncompress());
+        if (!raw.get()) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        value = raw;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+void CouchKVStore::cacheFileCounts(uint16_t vbid, Db *db)
+{
+    DbInfo info;
+    if (couchstore_db_info(db, &info) == COUCHSTORE_SUCCESS) {
+        fileCounts->set(vbid, info.doc_count, info.deleted_count);
+    } else {
+        fileCounts->forget(vbid);
+    }
+}
+
+/**
+ * Journal states just written to the files, so the ones journaled before
+ * don't override them.
+ */
+void CouchKVStore::journalVBStates(const vbucket_map_t &vbstates)
+{
+    if (vbStateJournal) {
+        vbStateJournal->append(vbstates);
+    }
+}
+
 void CouchKVStore::closeDatabaseHandle(Db *db) {
+    if (dbCacheSize > 0) {
+        LockHolder lh(dbCacheMutex);
+        std::map<Db *, CachedDb>::iterator it = dbsInUse.find(db);
+        if (it != dbsInUse.end()) {
+            CachedDb cached = it->second;
+            dbsInUse.erase(it);
+            if (cached.fileRev == dbFileRevMap[cached.vbId]) {
+                dbCache.push_front(cached);
+                if (dbCache.size() <= dbCacheSize) {
+                    return;
+                }
+                db = dbCache.back().db;
+                dbCache.pop_back();
+            }
+        }
+    }
+
     couchstore_error_t ret = couchstore_close_db(db);
     if (ret != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
@@ -1686,6 +2692,11 @@ bool CouchKVStore::getEstimatedItemCount(size_t &items)
     }
 
     for (uint16_t id = 0; id < numDbFiles; id++) {
+        size_t docs, deleted;
+        if (fileCounts->get(id, docs, deleted)) {
+            items += docs;
+            continue;
+        }
         Db *db = NULL;
         uint64_t rev = dbFileRevMap[id];
         couchstore_error_t errCode = openDB(id, rev, &db,
@@ -1695,6 +2706,7 @@ bool CouchKVStore::getEstimatedItemCount(size_t &items)
             errCode = couchstore_db_info(db, &info);
             if (errCode == COUCHSTORE_SUCCESS) {
                 items += info.doc_count;
+                fileCounts->set(id, info.doc_count, info.deleted_count);
             } else {
                 LOG(EXTENSION_LOG_WARNING,
                     "Warning: failed to read database info for "
@@ -1711,11 +2723,400 @@ bool CouchKVStore::getEstimatedItemCount(size_t &items)
 }
 
 size_t CouchKVStore::getNumPersistedDeletes(uint16_t vbid) {
-    std::map<uint16_t, size_t>::iterator itr = cachedDeleteCount.find(vbid);
-    if (itr != cachedDeleteCount.end()) {
-        return itr->second;
-    }
-    return 0;
+    size_t docs = 0, deleted = 0;
+    fileCounts->get(vbid, docs, deleted);
+    return deleted;
 }
 
 /* end of couch-kvstore.cc */
+
+bool CouchKVStore::getDbFileInfo(uint16_t vbid, vbucket_file_info &info)
+{
+    if (vbid >= numDbFiles) {
+        return false;
+    }
+    uint64_t rev = dbFileRevMap[vbid];
+    struct stat dbstat;
+    if (stat(getDBFileName(dbname, vbid, rev).c_str(), &dbstat) != 0) {
+        // Not created yet, or being switched to a new revision.
+        return false;
+    }
+
+    Db *db = NULL;
+    if (openDB(vbid, rev, &db, COUCHSTORE_OPEN_FLAG_RDONLY) !=
+        COUCHSTORE_SUCCESS) {
+        return false;
+    }
+    DbInfo dbinfo;
+    couchstore_error_t errCode = couchstore_db_info(db, &dbinfo);
+    closeDatabaseHandle(db);
+    if (errCode != COUCHSTORE_SUCCESS) {
+        return false;
+    }
+    info.fileSize = dbstat.st_size;
+    info.spaceUsed = dbinfo.space_used;
+    info.itemCount = dbinfo.doc_count;
+    info.deletedCount = dbinfo.deleted_count;
+    info.fileRev = rev;
+    info.headerPosition = dbinfo.header_position;
+    info.highSeqno = dbinfo.last_sequence;
+    return true;
+}
+
+int CouchKVStore::compactCopyCb(Db *, DocInfo *docinfo, void *ctx)
+{
+    CompactCopyCtx *cctx = static_cast<CompactCopyCtx *>(ctx);
+    if (cctx->bytes >= cctx->maxBytes) {
+        // Enough for this step; the next one starts from this doc.
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+    cctx->bytes += docinfo->id.size + docinfo->rev_meta.size + docinfo->size;
+    cctx->docinfos.push_back(docinfo);
+    return 1;
+}
+
+/**
+ * Get the time a deletion was persisted at, which is kept in its expiry
+ * time.
+ */
+static time_t getDeletionTime(const DocInfo *docinfo)
+{
+    uint32_t deleted = 0;
+    if (docinfo->rev_meta.size >= 12) {
+        memcpy(&deleted, docinfo->rev_meta.buf + 8, 4);
+        deleted = ntohl(deleted);
+    }
+    return static_cast<time_t>(deleted);
+}
+
+couchstore_error_t CouchKVStore::copyCompactedDocs(CouchCompaction &cc,
+                                                   Db *source,
+                                                   compaction_ctx &ctx,
+                                                   bool &more)
+{
+    CompactCopyCtx copyCtx(ctx.maxBytes);
+    couchstore_error_t errCode = couchstore_changes_since(source,
+                                                          cc.lastSeq + 1, 0,
+                                                          compactCopyCbC,
+                                                          &copyCtx);
+    more = errCode == COUCHSTORE_ERROR_CANCEL;
+    if (more) {
+        errCode = COUCHSTORE_SUCCESS;
+    }
+
+    // The new file's update seqno is that of its last doc, so the doc
+    // with the old file's last seqno is never purged: the seqnos given
+    // out after the swap must still go up.
+    uint64_t lastSeq = 0;
+    DbInfo sourceInfo;
+    if (errCode == COUCHSTORE_SUCCESS) {
+        errCode = couchstore_db_info(source, &sourceInfo);
+        lastSeq = sourceInfo.last_sequence;
+    }
+
+    size_t numDocs = copyCtx.docinfos.size();
+    std::vector<Doc *> docs;
+    std::vector<DocInfo *> infos;
+    // The bodies of the deletions; reserved so the pointers stay valid.
+    std::vector<Doc> tombstones;
+    tombstones.reserve(numDocs);
+    for (size_t i = 0; i < numDocs && errCode == COUCHSTORE_SUCCESS; ++i) {
+        DocInfo *docinfo = copyCtx.docinfos[i];
+        cc.lastSeq = std::max(cc.lastSeq, docinfo->db_seq);
+        Doc *doc = NULL;
+        if (docinfo->deleted) {
+            // A doc already copied by an earlier step needs its deletion
+            // copied, or it would come back.
+            bool copied = cc.copied.erase(std::string(docinfo->id.buf,
+                                                      docinfo->id.size)) > 0;
+            if (!copied && docinfo->db_seq < lastSeq && ctx.purgeBefore > 0 &&
+                getDeletionTime(docinfo) < ctx.purgeBefore) {
+                cc.maxPurgedSeqno = std::max(cc.maxPurgedSeqno,
+                                             docinfo->rev_seq);
+                cc.maxPurgedDbSeq = std::max(cc.maxPurgedDbSeq,
+                                             docinfo->db_seq);
+                ++cc.purged;
+                continue;
+            }
+            Doc tombstone;
+            tombstone.id = docinfo->id;
+            tombstone.data.buf = NULL;
+            tombstone.data.size = 0;
+            tombstones.push_back(tombstone);
+            doc = &tombstones.back();
+        } else {
+            // As stored: compressed bodies stay compressed.
+            errCode = couchstore_open_doc_with_docinfo(source, docinfo, &doc,
+                                                       0);
+            if (errCode != COUCHSTORE_SUCCESS) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: failed to read a doc to compact vbucket %d, "
+                    "error=%s [%s]", cc.vbId, couchstore_strerror(errCode),
+                    couchkvstore_strerrno(errCode).c_str());
+                break;
+            }
+            if (isValueLogged(docinfo)) {
+                errCode = moveLoggedValue(cc, doc);
+                if (errCode != COUCHSTORE_SUCCESS) {
+                    couchstore_free_document(doc);
+                    break;
+                }
+            }
+        }
+        docs.push_back(doc);
+        infos.push_back(docinfo);
+    }
+
+    if (errCode == COUCHSTORE_SUCCESS && !infos.empty()) {
+        // The docs keep their seqnos, so the items in memory, bg fetches
+        // and TAP streams by seqno still find them in the new file.
+        errCode = couchstore_save_documents(cc.target, &docs[0], &infos[0],
+                                            infos.size(),
+                                            COUCHSTORE_SEQUENCE_AS_IS);
+        if (errCode == COUCHSTORE_SUCCESS) {
+            for (size_t i = 0; i < infos.size(); ++i) {
+                if (!infos[i]->deleted) {
+                    cc.copied.insert(std::string(infos[i]->id.buf,
+                                                 infos[i]->id.size));
+                }
+            }
+        } else {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to save docs to compact vbucket %d, "
+                "error=%s [%s]", cc.vbId, couchstore_strerror(errCode),
+                couchkvstore_strerrno(errCode).c_str());
+        }
+    }
+    ctx.bytesCopied = copyCtx.bytes;
+
+    for (size_t i = 0; i < docs.size(); ++i) {
+        if (!infos[i]->deleted) {
+            couchstore_free_document(docs[i]);
+        }
+    }
+    std::vector<DocInfo *>::iterator it = copyCtx.docinfos.begin();
+    for (; it != copyCtx.docinfos.end(); ++it) {
+        couchstore_free_docinfo(*it);
+    }
+    return errCode;
+}
+
+couchstore_error_t CouchKVStore::moveLoggedValue(CouchCompaction &cc,
+                                                 Doc *doc)
+{
+    ValueLogPointer ptr;
+    if (!ptr.decode(doc->data.buf, doc->data.size)) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    if (cc.logGeneration > 0 && ptr.generation < cc.logGeneration) {
+        std::string value;
+        ValueLogPointer moved;
+        if (!valueLog->read(cc.vbId, ptr, value) ||
+            !valueLog->append(cc.vbId, value.data(), value.size(),
+                              ptr.compressed, moved)) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to move a value in the value log to "
+                "compact vbucket %d", cc.vbId);
+            return COUCHSTORE_ERROR_WRITE;
+        }
+        // Same size, so the doc's body is rewritten in place.
+        moved.encode(doc->data.buf);
+        ptr = moved;
+    }
+    cc.liveLogBytes += ptr.length;
+    return COUCHSTORE_SUCCESS;
+}
+
+bool CouchKVStore::finishCompaction(CouchCompaction &cc, Db *source,
+                                    compaction_ctx &ctx)
+{
+    vbucket_state vbstate;
+    vbucket_map_t::iterator it = cachedVBStates.find(cc.vbId);
+    if (it != cachedVBStates.end()) {
+        vbstate = it->second;
+    } else {
+        readVBState(source, cc.vbId, vbstate);
+    }
+    // A key deleted and purged may be created again; its seqnos must
+    // still go up.
+    if (cc.maxPurgedSeqno > vbstate.maxDeletedSeqno) {
+        vbstate.maxDeletedSeqno = cc.maxPurgedSeqno;
+    }
+    if (cc.maxPurgedSeqno > vbstate.purgeSeqno) {
+        vbstate.purgeSeqno = cc.maxPurgedSeqno;
+    }
+    if (it != cachedVBStates.end()) {
+        it->second.maxDeletedSeqno = vbstate.maxDeletedSeqno;
+        it->second.purgeSeqno = vbstate.purgeSeqno;
+    }
+    ctx.purgeSeqno = vbstate.purgeSeqno;
+    ctx.purgedBySeqno = cc.maxPurgedDbSeq;
+
+    couchstore_error_t errCode = saveVBState(cc.target, vbstate);
+    if (errCode == COUCHSTORE_SUCCESS && !valueLog->sync(cc.vbId)) {
+        errCode = COUCHSTORE_ERROR_WRITE;
+    }
+    if (errCode == COUCHSTORE_SUCCESS) {
+        errCode = couchstore_commit(cc.target);
+    }
+    if (errCode != COUCHSTORE_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to commit the compacted file of vbucket %d, "
+            "error=%s [%s]", cc.vbId, couchstore_strerror(errCode),
+            couchkvstore_strerrno(errCode).c_str());
+        return false;
+    }
+    uint64_t headerPos = couchstore_get_header_position(cc.target);
+    DbInfo info;
+    bool haveInfo = couchstore_db_info(cc.target, &info) == COUCHSTORE_SUCCESS;
+    couchstore_close_db(cc.target);
+    cc.target = NULL;
+
+    uint64_t newRev = cc.fileRev + 1;
+    std::string oldFile = getDBFileName(dbname, cc.vbId, cc.fileRev);
+    std::string newFile = getDBFileName(dbname, cc.vbId, newRev);
+    struct stat dbstat;
+    if (stat(oldFile.c_str(), &dbstat) == 0) {
+        ctx.oldFileSize = dbstat.st_size;
+    }
+    if (stat(cc.targetFile.c_str(), &dbstat) == 0) {
+        ctx.newFileSize = dbstat.st_size;
+    }
+    if (rename(cc.targetFile.c_str(), newFile.c_str()) != 0) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to rename '%s' to '%s': %s",
+            cc.targetFile.c_str(), newFile.c_str(), strerror(errno));
+        return false;
+    }
+    updateDbFileMap(cc.vbId, newRev);
+    if (haveInfo) {
+        fileCounts->set(cc.vbId, info.doc_count, info.deleted_count);
+    } else {
+        fileCounts->forget(cc.vbId);
+    }
+
+    if (!epStats.shutdown.isShutdown) {
+        RememberingCallback<uint16_t> cb;
+        couchNotifier->notify_headerpos_update(cc.vbId, newRev, headerPos, cb);
+        if (cb.val != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to notify CouchDB of "
+                "the compacted file of vbucket=%d, error=0x%x",
+                cc.vbId, cb.val);
+        }
+    }
+    // The readers find the new revision once the old file is gone.
+    if (remove(oldFile.c_str()) != 0) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to remove '%s': %s",
+            oldFile.c_str(), strerror(errno));
+    }
+    // No file points at the generations the values were moved from.
+    valueLog->finishCompaction(cc.vbId, cc.logGeneration, cc.liveLogBytes);
+
+    LOG(EXTENSION_LOG_INFO,
+        "Compacted vbucket %d to rev %llu, %llu bytes to %llu, "
+        "%llu deletions purged", cc.vbId, newRev,
+        (unsigned long long)ctx.oldFileSize,
+        (unsigned long long)ctx.newFileSize, (unsigned long long)cc.purged);
+    ctx.done = true;
+    return true;
+}
+
+bool CouchKVStore::compactVBucket(compaction_ctx &ctx)
+{
+    assert(!isReadOnly());
+    uint16_t vbid = ctx.vbid;
+    if (vbid >= numDbFiles) {
+        return false;
+    }
+    // A refused commit is saved again to the file it was made to, which
+    // must not be swapped out from under it.
+    completeCommits();
+    uint64_t rev = dbFileRevMap[vbid];
+    std::map<uint16_t, CouchCompaction *>::iterator it = compactions.find(vbid);
+    if (it != compactions.end() && it->second->fileRev != rev) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: the file of vbucket %d changed while compacting it",
+            vbid);
+        abortCompaction(vbid);
+        return false;
+    }
+
+    Db *source = NULL;
+    uint64_t newRev = rev;
+    couchstore_error_t errCode = openDB(vbid, rev, &source,
+                                        COUCHSTORE_OPEN_FLAG_RDONLY, &newRev);
+    if (errCode != COUCHSTORE_SUCCESS || newRev != rev) {
+        if (errCode == COUCHSTORE_SUCCESS) {
+            closeDatabaseHandle(source);
+        }
+        abortCompaction(vbid);
+        return false;
+    }
+
+    CouchCompaction *cc;
+    if (it == compactions.end()) {
+        cc = new CouchCompaction(vbid, rev,
+                                 getDBFileName(dbname, vbid, rev) + ".compact");
+        cc->logGeneration = valueLog->startCompaction(vbid);
+        // Left behind by a compaction that didn't finish.
+        remove(cc->targetFile.c_str());
+        couch_file_ops *ops = activeVBuckets[vbid].get() ?
+            &activeFileOps : &replicaFileOps;
+        errCode = couchstore_open_db_ex(cc->targetFile.c_str(),
+                                        COUCHSTORE_OPEN_FLAG_CREATE, ops,
+                                        &cc->target);
+        if (errCode != COUCHSTORE_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to create '%s', error=%s [%s]",
+                cc->targetFile.c_str(), couchstore_strerror(errCode),
+                couchkvstore_strerrno(errCode).c_str());
+            closeDatabaseHandle(source);
+            delete cc;
+            return false;
+        }
+        compactions[vbid] = cc;
+    } else {
+        cc = it->second;
+    }
+
+    bool more = false;
+    bool ok = copyCompactedDocs(*cc, source, ctx, more) == COUCHSTORE_SUCCESS;
+    if (ok && !more) {
+        // Nothing was written since the last doc copied; the flusher
+        // doesn't run during a step.
+        ok = finishCompaction(*cc, source, ctx);
+    }
+    closeDatabaseHandle(source);
+    ctx.tombstonesPurged = cc->purged;
+    if (!ok) {
+        abortCompaction(vbid);
+        return false;
+    }
+    if (ctx.done) {
+        compactions.erase(vbid);
+        delete cc;
+    }
+    return true;
+}
+
+void CouchKVStore::abortCompaction(uint16_t vbid)
+{
+    std::map<uint16_t, CouchCompaction *>::iterator it = compactions.find(vbid);
+    if (it == compactions.end()) {
+        return;
+    }
+    CouchCompaction *cc = it->second;
+    if (cc->target) {
+        couchstore_close_db(cc->target);
+    }
+    remove(cc->targetFile.c_str());
+    compactions.erase(it);
+    delete cc;
+}
+
+void CouchKVStore::closeCompactions()
+{
+    while (!compactions.empty()) {
+        abortCompaction(compactions.begin()->first);
+    }
+}
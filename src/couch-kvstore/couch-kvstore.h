@@ -22,18 +22,84 @@
 
 #include "libcouchstore/couch_db.h"
 
+#include <sys/types.h>
+
+#include <algorithm>
+#include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "configuration.h"
 #include "couch-kvstore/couch-fs-stats.h"
 #include "couch-kvstore/couch-notifier.h"
+#include "couch-kvstore/couch-value-log.h"
 #include "histo.h"
 #include "item.h"
 #include "kvstore.h"
+#include "mutex.h"
 #include "stats.h"
 
+class CouchReadPool;
+class CouchVBStateJournal;
+
+/**
+ * The doc counts of the vbucket files of a bucket, as of their last
+ * commits, so the counts don't take opening every file to read its
+ * header.  Shared by the bucket's stores: the writers set them as they
+ * commit, and any store that had to read a header sets what it found.
+ */
+class CouchFileCounts {
+public:
+    CouchFileCounts(size_t n) : numFiles(n), known(new Atomic<bool>[n]),
+                                docs(new Atomic<size_t>[n]),
+                                deleted(new Atomic<size_t>[n]) { }
+
+    ~CouchFileCounts() {
+        delete []known;
+        delete []docs;
+        delete []deleted;
+    }
+
+    void set(uint16_t vbid, size_t docCount, size_t deletedCount) {
+        if (vbid < numFiles) {
+            docs[vbid].set(docCount);
+            deleted[vbid].set(deletedCount);
+            known[vbid].set(true);
+        }
+    }
+
+    //! Forget the counts of a file deleted or started over
+    void forget(uint16_t vbid) {
+        if (vbid < numFiles) {
+            known[vbid].set(false);
+        }
+    }
+
+    /**
+     * Get the counts of a file.
+     *
+     * @return false if they aren't known
+     */
+    bool get(uint16_t vbid, size_t &docCount, size_t &deletedCount) {
+        if (vbid >= numFiles || !known[vbid].get()) {
+            return false;
+        }
+        docCount = docs[vbid].get();
+        deletedCount = deleted[vbid].get();
+        return true;
+    }
+
+private:
+    const size_t numFiles;
+    Atomic<bool> *known;
+    Atomic<size_t> *docs;
+    Atomic<size_t> *deleted;
+
+    DISALLOW_COPY_AND_ASSIGN(CouchFileCounts);
+};
+
 
 #define COUCHSTORE_NO_OPTIONS 0
 
@@ -47,8 +113,8 @@ public:
      * Default constructor
      */
     CouchKVStoreStats() :
-      docsCommitted(0), numOpen(0), numClose(0),
-      numLoadedVb(0), numGetFailure(0), numSetFailure(0),
+      docsCommitted(0), numOpen(0), numClose(0), numDbCacheHits(0),
+      numDbCacheMisses(0), numLoadedVb(0), numGetFailure(0), numSetFailure(0),
       numDelFailure(0), numOpenFailure(0), numVbSetFailure(0),
       readSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
       writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) {
@@ -58,6 +124,8 @@ public:
         docsCommitted.set(0);
         numOpen.set(0);
         numClose.set(0);
+        numDbCacheHits.set(0);
+        numDbCacheMisses.set(0);
         numLoadedVb.set(0);
         numGetFailure.set(0);
         numSetFailure.set(0);
@@ -65,6 +133,8 @@ public:
         numOpenFailure.set(0);
         numVbSetFailure.set(0);
         numCommitRetry.set(0);
+        numCommitWaits.set(0);
+        numValuesLogged.set(0);
 
         readTimeHisto.reset();
         readSizeHisto.reset();
@@ -76,6 +146,8 @@ public:
         saveDocsHisto.reset();
         batchSize.reset();
         fsStats.reset();
+        activeFsStats.reset();
+        replicaFsStats.reset();
     }
 
     // the number of docs committed
@@ -84,6 +156,10 @@ public:
     Atomic<size_t> numOpen;
     // the number of close() calls
     Atomic<size_t> numClose;
+    // the number of read-only opens served by a cached file handle
+    Atomic<size_t> numDbCacheHits;
+    // the number of read-only opens that had to open the file
+    Atomic<size_t> numDbCacheMisses;
     // the number of vbuckets loaded
     Atomic<size_t> numLoadedVb;
 
@@ -94,6 +170,10 @@ public:
     Atomic<size_t> numOpenFailure;
     Atomic<size_t> numVbSetFailure;
     Atomic<size_t> numCommitRetry;
+    // the number of waits for mccouch to answer the outstanding commits
+    Atomic<size_t> numCommitWaits;
+    // the number of values written to the value log
+    Atomic<size_t> numValuesLogged;
 
     /* for flush and vb delete, no error handling in CouchKVStore, such
      * failure should be tracked in MC-engine  */
@@ -119,10 +199,16 @@ public:
 
     // Stats from the underlying OS file operations done by couchstore.
     CouchstoreStats fsStats;
+    // The same, of the files of active vbuckets only
+    CouchstoreStats activeFsStats;
+    // The same, of the files of all the other vbuckets
+    CouchstoreStats replicaFsStats;
 };
 
 class EventuallyPersistentEngine;
 class EPStats;
+struct GetMultiCbCtx;
+struct GetMultiMetaCbCtx;
 
 typedef union {
     Callback <mutation_result> *setCb;
@@ -131,21 +217,70 @@ typedef union {
 
 const size_t COUCHSTORE_METADATA_SIZE(2 * sizeof(uint32_t) + sizeof(uint64_t));
 
+/**
+ * The flags byte after the metadata of a doc whose body is a pointer to
+ * its value in the value log, rather than the value.  The docs without it
+ * have only the metadata.
+ */
+const uint8_t COUCHSTORE_META_VALUE_LOGGED(0x01);
+
 /**
  * Class representing a document to be persisted in couchstore.
+ *
+ * The requests of a commit are kept by a CouchRequestBatch, which has
+ * their keys and reuses them from one commit to the next.
  */
 class CouchRequest
 {
 public:
+    CouchRequest() :
+        vbucketId(0), fileRevNum(0), keyOffset(0), keyLen(0),
+        deleteItem(false), logged(false), start(0) { }
+
     /**
-     * Constructor
+     * Set up the request for an item.
      *
      * @param it Item instance to be persisted
      * @param rev vbucket database revision number
      * @param cb persistence callback
      * @param del flag indicating if it is an item deletion or not
+     * @param compress true to compress the document body here rather
+     *                 than have couchstore do it
+     * @param keyOff where the batch keeps the item's key
      */
-    CouchRequest(const Item &it, uint64_t rev, CouchRequestCallback &cb, bool del);
+    void init(const Item &it, uint64_t rev, CouchRequestCallback &cb,
+              bool del, bool compress, size_t keyOff);
+
+    /**
+     * Append the value to the value log, and save a pointer to it as the
+     * doc's body instead.
+     *
+     * @return false if the value couldn't be appended; the doc still has
+     *         the value
+     */
+    bool logValue(CouchValueLog &log);
+
+    /**
+     * Point the doc and its info at the key and metadata, once the
+     * batch's storage no longer moves.
+     */
+    void bind(char *keys) {
+        dbDoc.id.buf = keys + keyOffset;
+        dbDoc.id.size = keyLen;
+        dbDocInfo.id = dbDoc.id;
+        dbDocInfo.rev_meta.buf = reinterpret_cast<char *>(meta);
+        dbDocInfo.rev_meta.size = COUCHSTORE_METADATA_SIZE;
+        if (logged) {
+            dbDocInfo.rev_meta.size += 1;
+            dbDoc.data.buf = logPointer;
+            dbDoc.data.size = sizeof(logPointer);
+        }
+    }
+
+    //! Let go of the value once the request is done
+    void clear(void) {
+        value.reset();
+    }
 
     /**
      * Get the vbucket id of a document to be persisted
@@ -234,29 +369,104 @@ public:
     };
 
     /**
-     * Get the key of a document to be persisted
-     *
-     * @return key of a document to be persisted
+     * Get the length of the key of a document to be persisted
      */
-    const std::string& getKey(void) const {
-        return key;
+    size_t getKeyLength(void) const {
+        return keyLen;
     }
 
 private :
     value_t value;
-    size_t valuelen;
-    uint8_t meta[COUCHSTORE_METADATA_SIZE];
+    uint8_t meta[COUCHSTORE_METADATA_SIZE + 1];
     uint16_t vbucketId;
     uint64_t fileRevNum;
-    std::string key;
+    size_t keyOffset;
+    size_t keyLen;
     Doc dbDoc;
     DocInfo dbDocInfo;
     bool deleteItem;
+    //! True if the body is the pointer to the value in the value log
+    bool logged;
+    char logPointer[ValueLogPointer::SIZE];
     CouchRequestCallback callback;
 
     hrtime_t start;
 };
 
+/**
+ * The requests of a commit, with their keys in one buffer.  The requests,
+ * the buffer and the arrays handed to couchstore are kept from one commit
+ * to the next, so once they've grown to the size of the commits, queueing
+ * a mutation allocates nothing.
+ */
+class CouchRequestBatch
+{
+public:
+    CouchRequestBatch() : numReqs(0) { }
+
+    /**
+     * Add the request for an item.
+     */
+    CouchRequest &add(const Item &it, uint64_t rev, CouchRequestCallback &cb,
+                      bool del, bool compress) {
+        if (numReqs == reqs.size()) {
+            reqs.push_back(CouchRequest());
+        }
+        CouchRequest &req = reqs[numReqs++];
+        req.init(it, rev, cb, del, compress, keys.size());
+        const std::string &key = it.getKey();
+        keys.insert(keys.end(), key.begin(), key.end());
+        return req;
+    }
+
+    /**
+     * Point the requests at their keys and fill in the arrays of docs
+     * and infos to save; nothing may be added after this until clear().
+     */
+    void prepare(void) {
+        docs.resize(numReqs);
+        docinfos.resize(numReqs);
+        char *keyBuf = keys.empty() ? NULL : &keys[0];
+        for (size_t i = 0; i < numReqs; ++i) {
+            reqs[i].bind(keyBuf);
+            docs[i] = reqs[i].getDbDoc();
+            docinfos[i] = reqs[i].getDbDocInfo();
+        }
+    }
+
+    Doc **getDocs(void) { return &docs[0]; }
+    DocInfo **getDocInfos(void) { return &docinfos[0]; }
+
+    void swap(CouchRequestBatch &other) {
+        reqs.swap(other.reqs);
+        std::swap(numReqs, other.numReqs);
+        keys.swap(other.keys);
+        docs.swap(other.docs);
+        docinfos.swap(other.docinfos);
+    }
+
+    //! Drop the requests, keeping their storage for the next commit
+    void clear(void) {
+        for (size_t i = 0; i < numReqs; ++i) {
+            reqs[i].clear();
+        }
+        numReqs = 0;
+        keys.clear();
+    }
+
+    size_t size(void) const { return numReqs; }
+    bool empty(void) const { return numReqs == 0; }
+    CouchRequest &operator[](size_t i) { return reqs[i]; }
+
+private:
+    //! The requests in use come first
+    std::vector<CouchRequest> reqs;
+    size_t numReqs;
+    std::vector<char> keys;
+    std::vector<Doc *> docs;
+    std::vector<DocInfo *> docinfos;
+};
+
 /**
  * KVStore with couchstore as the underlying storage system
  */
@@ -282,7 +492,15 @@ public:
      * Deconstructor
      */
     virtual ~CouchKVStore() {
+        releaseReadPool();
+        closeCompactions();
         close();
+        closeCachedDbs();
+        releaseBlockCache();
+        releaseVBStateJournal();
+        releaseFileCounts();
+        releaseValueLog();
+        delete []activeVBuckets;
     }
 
     /**
@@ -308,6 +526,20 @@ public:
      */
     bool commit(void);
 
+    /**
+     * Commit a transaction without waiting for mccouch to answer the
+     * notification of its new file header.  The callbacks of its mutations
+     * are called by completeCommits().
+     */
+    bool commitNoWait(void);
+
+    /**
+     * Wait for mccouch to answer the notifications of the commits made,
+     * saving the docs of those it refused again, and call the callbacks of
+     * their mutations.
+     */
+    void completeCommits(void);
+
     /**
      * Rollback a transaction (unless not currently in one).
      */
@@ -315,6 +547,8 @@ public:
         assert(!isReadOnly());
         if (intransaction) {
             intransaction = false;
+            // The commits made are on disk; their callbacks are still due
+            completeCommits();
         }
     }
 
@@ -352,6 +586,49 @@ public:
      */
     void getMulti(uint16_t vb, vb_bgfetch_queue_t &itms);
 
+    /**
+     * Whether the batches of a read-only store are read on threads of
+     * their own (couch_async_readers).
+     */
+    bool isAsyncGetSupported() {
+        return asyncReaders > 0;
+    }
+
+    /**
+     * Hand the read of multiple documents to the store's reader threads,
+     * started with the first of them.
+     *
+     * @param vb vbucket id of the documents
+     * @param itms list of items whose documents are going to be retrieved
+     * @param cb called with the vbucket once they're read
+     */
+    void getMultiAsync(uint16_t vb, vb_bgfetch_queue_t &itms,
+                       Callback<uint16_t> &cb);
+
+    /**
+     * Retrieve the metadata of multiple documents at once, walking the
+     * by-id tree once for all of them.
+     *
+     * @param vb vbucket id of the documents
+     * @param itms the fetches by key, each given the metadata found
+     */
+    void getMultiMeta(uint16_t vb, vb_bgmeta_queue_t &itms);
+
+    /**
+     * Walk the by-id tree of a vbucket from a key for the keys after it
+     * with the same prefix.
+     */
+    bool getKeysAfter(uint16_t vb, const std::string &key,
+                      const std::string &prefix, size_t count,
+                      std::vector<std::string> &keys);
+
+    /**
+     * Walk the by-id tree of a vbucket through a range of keys.
+     */
+    bool rangeScan(uint16_t vb, const std::string &start,
+                   const std::string &end, size_t limit, bool keysOnly,
+                   Callback<GetValue> &cb);
+
     /**
      * Delete a given document from the underlying storage system.
      *
@@ -397,11 +674,24 @@ public:
     /**
      * Persist a snapshot of the vbucket states in the underlying storage system.
      *
+     * The states that changed are appended to the bucket's vbucket state
+     * journal in one sync; only the file of a vbucket new to the store is
+     * committed to, creating it.
+     *
      * @param vb_stats map instance that contains all the vbucket states
      * @return true if the snapshot is done successfully
      */
     bool snapshotVBuckets(const vbucket_map_t &vb_states);
 
+    /**
+     * Note whether the files of a vbucket are those of an active vbucket
+     * or not from now on.
+     *
+     * @param vbid the vbucket id
+     * @param state the state the vbucket is now in
+     */
+    void vbStateChanged(uint16_t vbid, vbucket_state_t state);
+
     /**
      * Retrieve all the documents from the underlying storage system.
      *
@@ -417,6 +707,16 @@ public:
      */
     void dump(uint16_t vb, shared_ptr<Callback<GetValue> > cb);
 
+    /**
+     * Retrieve the live documents of a given set of vbuckets from the
+     * storage system, in the order the vbuckets are given.
+     *
+     * @param vbids list of vbucket ids whose documents are going to be retrieved
+     * @param cb callback instance to process each document retrieved
+     */
+    void dump(const std::vector<uint16_t> &vbids,
+              shared_ptr<Callback<GetValue> > cb);
+
     /**
      * Retrieve all the keys from the underlying storage system.
      *
@@ -425,6 +725,14 @@ public:
      */
     void dumpKeys(const std::vector<uint16_t> &vbids,  shared_ptr<Callback<GetValue> > cb);
 
+    /**
+     * Retrieve all the keys of a given vbucket from the storage system.
+     *
+     * @param vb vbucket id
+     * @param cb callback instance to process each key retrieved
+     */
+    void dumpKeys(uint16_t vb, shared_ptr<Callback<GetValue> > cb);
+
     /**
      * Retrieve the list of keys and their meta data for a given
      * vbucket, which were deleted.
@@ -433,6 +741,20 @@ public:
      */
     void dumpDeleted(uint16_t vb,  shared_ptr<Callback<GetValue> > cb);
 
+    /**
+     * Retrieve the documents of a given vbucket, deleted ones included,
+     * written after a given disk seqno.
+     * @param vb vbucket id
+     * @param since the seqno to start after
+     * @param cb callback instance to process each document retrieved
+     */
+    void dumpSince(uint16_t vb, uint64_t since,
+                   shared_ptr<Callback<GetValue> > cb);
+
+    bool isSeqnoDumpSupported() {
+        return true;
+    }
+
     /**
      * Does the underlying storage system support key-only retrieval operations?
      *
@@ -457,6 +779,30 @@ public:
      */
     size_t getNumPersistedDeletes(uint16_t vbid);
 
+    /**
+     * Get the size of a vbucket's file, the space its live data takes and
+     * its doc counts.
+     */
+    bool getDbFileInfo(uint16_t vbid, vbucket_file_info &info);
+
+    /**
+     * Copy the next docs of a vbucket's file into its .compact file, and
+     * switch to that file as the next revision once they're all in.  The
+     * flusher writes to the old file between the steps; each step starts
+     * from the last seqno it copied, so the docs written since are copied
+     * as well.  Deletions persisted before ctx.purgeBefore aren't copied,
+     * and the vbucket's max deleted seqno is raised past them.
+     *
+     * @param ctx the vbucket, the limits of the step and what it did
+     * @return false if the compaction failed and was given up
+     */
+    bool compactVBucket(compaction_ctx &ctx);
+
+    /**
+     * Give up the compaction of a vbucket and remove its .compact file.
+     */
+    void abortCompaction(uint16_t vbid);
+
     /**
      * Perform the pre-optimizations before persisting dirty items
      *
@@ -493,6 +839,12 @@ public:
     static int recordDbDump(Db *db, DocInfo *docinfo, void *ctx);
     static int recordDbStat(Db *db, DocInfo *docinfo, void *ctx);
     static int getMultiCb(Db *db, DocInfo *docinfo, void *ctx);
+    static int getMultiMetaCb(Db *db, DocInfo *docinfo, void *ctx);
+    static int keysAfterCb(Db *db, DocInfo *docinfo, void *ctx);
+    static int rangeScanCb(Db *db, DocInfo *docinfo, void *ctx);
+    void readMultiDoc(Db *db, DocInfo *docinfo, uint16_t vbId,
+                      std::list<VBucketBGFetchItem *> &fetches);
+    static int compactCopyCb(Db *db, DocInfo *docinfo, void *ctx);
     static void readVBState(Db *db, uint16_t vbId, vbucket_state &vbState);
 
     couchstore_error_t fetchDoc(Db *db, DocInfo *docinfo,
@@ -505,16 +857,22 @@ public:
 protected:
     void loadDB(shared_ptr<Callback<GetValue> > cb, bool keysOnly,
                 std::vector<uint16_t> *vbids,
-                couchstore_docinfos_options options=COUCHSTORE_NO_OPTIONS);
+                couchstore_docinfos_options options=COUCHSTORE_NO_OPTIONS,
+                uint64_t since=0);
     bool setVBucketState(uint16_t vbucketId, vbucket_state &vbstate,
                          uint32_t vb_change_type, bool notify = true);
     bool resetVBucket(uint16_t vbucketId, vbucket_state &vbstate) {
         return setVBucketState(vbucketId, vbstate, VB_STATE_CHANGED, true);
     }
+    bool notifyVBState(uint16_t vbucketId, vbucket_state &vbstate,
+                       uint32_t vb_change_type);
 
     template <typename T>
     void addStat(const std::string &prefix, const char *nm, T &val,
                  ADD_STAT add_stat, const void *c);
+    void addFsStats(const std::string &prefix, const char *nm,
+                    CouchstoreStats &fsStats, ADD_STAT add_stat,
+                    const void *c);
 
 private:
     void operator=(const CouchKVStore &from);
@@ -522,7 +880,7 @@ private:
     void open();
     void close();
     bool commit2couchstore(void);
-    void queueItem(CouchRequest *req);
+    CouchRequestBatch &batchFor(uint16_t vbid);
 
     uint64_t checkNewRevNum(std::string &dbname, bool newFile = false);
     void populateFileNameMap(std::vector<std::string> &filenames);
@@ -533,13 +891,104 @@ private:
     couchstore_error_t openDB_retry(std::string &dbfile, uint64_t options,
                                     const couch_file_ops *ops,
                                     Db **db, uint64_t *newFileRev);
+    class DeferredCommit;
     couchstore_error_t saveDocs(uint16_t vbid, uint64_t rev, Doc **docs,
-                                DocInfo **docinfos, int docCount);
-    void commitCallback(CouchRequest **committedReqs, int numReqs,
-                        couchstore_error_t errCode);
+                                DocInfo **docinfos, int docCount,
+                                DeferredCommit *deferred = NULL);
+    void commitCallback(CouchRequestBatch &batch, couchstore_error_t errCode);
     couchstore_error_t saveVBState(Db *db, vbucket_state &vbState);
     void setDocsCommitted(uint16_t docs);
     void closeDatabaseHandle(Db *db);
+    bool getCachedDb(uint16_t vbucketId, uint64_t fileRev, Db **db);
+    void invalidateCachedDbs(uint16_t vbucketId);
+    void closeCachedDbs();
+    CouchBlockCache *acquireBlockCache();
+    void releaseBlockCache();
+    CouchVBStateJournal *acquireVBStateJournal();
+    void releaseVBStateJournal();
+    void journalVBStates(const vbucket_map_t &vbstates);
+    CouchFileCounts *acquireFileCounts();
+    void releaseFileCounts();
+    void cacheFileCounts(uint16_t vbid, Db *db);
+    CouchValueLog *acquireValueLog();
+    void releaseValueLog();
+    void releaseReadPool();
+    couchstore_error_t readLoggedValue(uint16_t vbid, const Doc *doc,
+                                       bool keepCompressed, value_t &value);
+    struct CouchCompaction;
+    couchstore_error_t copyCompactedDocs(CouchCompaction &cc, Db *source,
+                                         compaction_ctx &ctx, bool &more);
+    couchstore_error_t moveLoggedValue(CouchCompaction &cc, Doc *doc);
+    bool finishCompaction(CouchCompaction &cc, Db *source,
+                          compaction_ctx &ctx);
+    void closeCompactions();
+
+    /**
+     * A read-only file handle kept open for reuse.  It's only reused while
+     * the file is the same one of the same size: a couch file only grows,
+     * and a handle doesn't see the headers written after it was opened.
+     */
+    struct CachedDb {
+        CachedDb(uint16_t vb, uint64_t rev, Db *d) :
+            vbId(vb), fileRev(rev), db(d), inode(0), size(0) { }
+
+        uint16_t vbId;
+        uint64_t fileRev;
+        Db *db;
+        ino_t inode;
+        off_t size;
+    };
+
+    /**
+     * A vbucket's compaction in progress: the .compact file the docs of
+     * a revision of its file are copied to.
+     */
+    struct CouchCompaction {
+        CouchCompaction(uint16_t vb, uint64_t rev, const std::string &file) :
+            vbId(vb), fileRev(rev), targetFile(file), target(NULL),
+            lastSeq(0), maxPurgedSeqno(0), maxPurgedDbSeq(0), purged(0),
+            logGeneration(0), liveLogBytes(0) { }
+
+        uint16_t vbId;
+        uint64_t fileRev;
+        std::string targetFile;
+        Db *target;
+        //! The last seqno of the old file copied
+        uint64_t lastSeq;
+        //! The highest rev seqno of the deletions dropped
+        uint64_t maxPurgedSeqno;
+        //! The highest seqno in the old file of the deletions dropped
+        uint64_t maxPurgedDbSeq;
+        size_t purged;
+        //! The keys of the live docs copied so far
+        std::set<std::string> copied;
+        //! The generation of the value log the values are moved to, or 0
+        uint32_t logGeneration;
+        //! The bytes of the values in the log the copied docs point at
+        uint64_t liveLogBytes;
+    };
+
+    /**
+     * A commit whose notification mccouch is still to answer.  Its
+     * requests are kept to be saved again if it's refused, and their
+     * callbacks wait for the answer.
+     */
+    class DeferredCommit : public Callback<uint16_t> {
+    public:
+        DeferredCommit() :
+            vbId(0), fileRev(0), sent(false),
+            status(PROTOCOL_BINARY_RESPONSE_SUCCESS) { }
+
+        void callback(uint16_t &rcode) {
+            status = rcode;
+        }
+
+        uint16_t vbId;
+        uint64_t fileRev;
+        bool sent;
+        uint16_t status;
+        CouchRequestBatch batch;
+    };
 
     EPStats &epStats;
     Configuration &configuration;
@@ -547,18 +996,52 @@ private:
     CouchNotifier *couchNotifier;
     std::vector<uint64_t>dbFileRevMap;
     uint16_t numDbFiles;
-    std::vector<CouchRequest *> pendingReqsQ;
-    size_t pendingCommitCnt;
+    //! The requests of the commit being built, all of one vbucket
+    CouchRequestBatch pendingReqs;
+    //! The commits of the transaction waiting for mccouch, oldest first
+    std::list<DeferredCommit> deferredCommits;
+    //! Done with, kept for the storage of their batches
+    std::list<DeferredCommit> spareCommits;
     bool intransaction;
     bool dbFileRevMapPopulated;
+    //! Values are kept compressed in memory and written as they are
+    bool compressValues;
 
     /* all stats */
     CouchKVStoreStats   st;
-    couch_file_ops statCollectingFileOps;
+    couch_file_ops activeFileOps;
+    couch_file_ops replicaFileOps;
+    /* which vbuckets are active, to pick the file ops their stats go to */
+    Atomic<bool> *activeVBuckets;
     /* vbucket state cache*/
     vbucket_map_t cachedVBStates;
-    /* deleted docs in each file*/
-    std::map<uint16_t, size_t> cachedDeleteCount;
+
+    /* read-only file handles, the most recently used first */
+    std::list<CachedDb> dbCache;
+    /* read-only file handles handed out, to be cached when closed */
+    std::map<Db *, CachedDb> dbsInUse;
+    size_t dbCacheSize;
+    Mutex dbCacheMutex;
+
+    /* compactions in progress, by vbucket */
+    std::map<uint16_t, CouchCompaction *> compactions;
+
+    /* the bucket's cache of blocks read with O_DIRECT, if enabled */
+    CouchBlockCache *blockCache;
+    CouchstoreFileContext activeFileContext;
+    CouchstoreFileContext replicaFileContext;
+
+    /* the bucket's journal of vbucket states, shared by its writers */
+    CouchVBStateJournal *vbStateJournal;
+    /* the doc counts of the bucket's files, shared by its stores */
+    CouchFileCounts *fileCounts;
+    /* the log of the bucket's big values, shared by its stores */
+    CouchValueLog *valueLog;
+    /* the size from which a value goes to the value log, 0 for none */
+    size_t valueLogThreshold;
+    /* the threads reading batches for getMultiAsync(), if any */
+    size_t asyncReaders;
+    CouchReadPool *readPool;
 };
 
 #endif  // SRC_COUCH_KVSTORE_COUCH_KVSTORE_H_
@@ -170,6 +170,50 @@ private:
     Callback<uint16_t> &callback;
 };
 
+/**
+ * The response to a notification sent without waiting, handed to the
+ * callbacks waiting for it.
+ */
+class AsyncNotifyResponseHandler: public BinaryPacketHandler {
+public:
+    AsyncNotifyResponseHandler(uint32_t sno,
+                               std::list<Callback<uint16_t> *> &cbs,
+                               size_t &inFlight) :
+        BinaryPacketHandler(sno), numInFlight(inFlight), done(false) {
+        callbacks.swap(cbs);
+        ++numInFlight;
+    }
+
+    ~AsyncNotifyResponseHandler() {
+        // Dropped without a response, as when it couldn't be sent
+        if (!done) {
+            complete(PROTOCOL_BINARY_RESPONSE_ETMPFAIL);
+        }
+    }
+
+    virtual void response(protocol_binary_response_header *res) {
+        complete(ntohs(res->response.status));
+    }
+
+    virtual void connectionReset() {
+        complete(PROTOCOL_BINARY_RESPONSE_ETMPFAIL);
+    }
+
+private:
+    void complete(uint16_t rcode) {
+        done = true;
+        --numInFlight;
+        std::list<Callback<uint16_t> *>::iterator it = callbacks.begin();
+        for (; it != callbacks.end(); ++it) {
+            (*it)->callback(rcode);
+        }
+    }
+
+    std::list<Callback<uint16_t> *> callbacks;
+    size_t &numInFlight;
+    bool done;
+};
+
 Mutex CouchNotifier::initMutex;
 std::map<std::string, CouchNotifier *> CouchNotifier::instances;
 uint16_t CouchNotifier::refCount = 0;
@@ -180,15 +224,26 @@ CouchNotifier::CouchNotifier(EPStats &st, Configuration &config) :
     sock(INVALID_SOCKET), stats(st), bucketName(config.getCouchBucket()),
     responseTimeOut(config.getCouchResponseTimeout()),
     reconnectSleepTime(config.getCouchReconnectSleeptime()),
-    port(config.getCouchPort()), host(config.getCouchHost()),
+    port(config.getCouchPort()), host(config.getCouchHost()), shm(NULL),
     allowDataLoss(config.isAllowDataLossDuringShutdown()),
     configurationError(true), seqno(0),
     currentCommand(0xff), lastSentCommand(0xff), lastReceivedCommand(0xff),
+    notifyWindow(config.getCouchNotifyWindow()), numNotifyInFlight(0),
     connected(false), inSelectBucket(false)
 {
     memset(&sendMsg, 0, sizeof(sendMsg));
     sendMsg.msg_iov = sendIov;
 
+    std::stringstream ss;
+    std::string shmPath = config.getCouchShmPath();
+    if (!shmPath.empty()) {
+        shm = new CouchShmChannel(shmPath);
+        ss << "unix:" << shmPath;
+    } else {
+        ss << host << ":" << port;
+    }
+    peer = ss.str();
+
     // Select the bucket (will be sent immediately when we connect)
     selectBucket();
 }
@@ -203,7 +258,11 @@ void CouchNotifier::resetConnection() {
     lastSentCommand = 0xff;
     currentCommand = 0xff;
 
-    EVUTIL_CLOSESOCKET(sock);
+    if (shm) {
+        shm->close();
+    } else {
+        EVUTIL_CLOSESOCKET(sock);
+    }
     sock = INVALID_SOCKET;
     connected = false;
     input.avail = 0;
@@ -258,6 +317,16 @@ void CouchNotifier::handleResponse(protocol_binary_response_header *res) {
 }
 
 bool CouchNotifier::connect() {
+    if (shm) {
+        if (!shm->connect()) {
+            return false;
+        }
+        // Polled like the socket; the doorbell rings for input and room.
+        sock = shm->getDoorbellFd();
+        connected = true;
+        return true;
+    }
+
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
     hints.ai_flags = AI_PASSIVE;
@@ -327,8 +396,7 @@ void CouchNotifier::ensureConnection()
         // I need to connect!!!
         std::stringstream rv;
         rv << "Trying to connect to mccouch: \""
-           << host.c_str() << ":"
-           << port << "\"";
+           << peer << "\"";
 
         LOG(EXTENSION_LOG_WARNING, "%s\n", rv.str().c_str());
         while (!connect()) {
@@ -345,8 +413,7 @@ void CouchNotifier::ensureConnection()
             if (configurationError) {
                 rv.str(std::string());
                 rv << "Failed to connect to: \""
-                   << host.c_str() << ":"
-                   << port << "\"";
+                   << peer << "\"";
                 LOG(EXTENSION_LOG_WARNING, "%s", rv.str().c_str());
 
                 usleep(5000);
@@ -355,16 +422,14 @@ void CouchNotifier::ensureConnection()
             } else {
                 rv.str(std::string());
                 rv << "Connection refused: \""
-                   << host.c_str() << ":"
-                   << port << "\"";
+                   << peer << "\"";
                 LOG(EXTENSION_LOG_WARNING, "%s", rv.str().c_str());
                 usleep(reconnectSleepTime);
             }
         }
         rv.str(std::string());
         rv << "Connected to mccouch: \""
-           << host.c_str() << ":"
-           << port << "\"";
+           << peer << "\"";
         LOG(EXTENSION_LOG_WARNING, "%s", rv.str().c_str());
     }
 }
@@ -375,19 +440,16 @@ bool CouchNotifier::waitForWritable()
     size_t waitTime = 0;
 
     while (connected) {
-        struct pollfd fds;
-        fds.fd = sock;
-        fds.events = POLLIN | POLLOUT;
-        fds.revents = 0;
+        short revents;
 
         // @todo do not block forever.. but allow shutdown..
-        int ret = poll(&fds, 1, timeout);
+        int ret = pollConnection(POLLIN | POLLOUT, timeout, revents);
         if (ret > 0) {
-            if (fds.revents & POLLIN) {
+            if (revents & POLLIN) {
                 maybeProcessInput();
             }
 
-            if (fds.revents & POLLOUT) {
+            if (revents & POLLOUT) {
                 return true;
             }
         } else if (ret < 0) {
@@ -406,6 +468,37 @@ bool CouchNotifier::waitForWritable()
     return false;
 }
 
+int CouchNotifier::pollConnection(short events, int timeout, short &revents)
+{
+    struct pollfd fds[2];
+    int nfds = 1;
+    fds[0].fd = sock;
+    fds[0].events = events;
+    fds[0].revents = 0;
+    if (shm) {
+        // The doorbell rings both for input and for room in the ring, and
+        // the control socket is readable once couchdb is gone.
+        fds[0].events = POLLIN;
+        fds[1].fd = shm->getControlFd();
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        nfds = 2;
+    }
+
+    int ret = poll(fds, nfds, timeout);
+    revents = fds[0].revents;
+    if (shm && ret > 0) {
+        if (fds[0].revents & POLLIN) {
+            revents |= events & POLLOUT;
+        }
+        if (fds[1].revents != 0) {
+            // Reading tells it's gone.
+            revents |= POLLIN;
+        }
+    }
+    return ret;
+}
+
 void CouchNotifier::sendSingleChunk(const char *ptr, size_t nb)
 {
     while (nb > 0) {
@@ -464,7 +557,8 @@ void CouchNotifier::sendCommand(BinaryPacketHandler *rh)
 
     do {
         sendMsg.msg_iovlen = numiovec;
-        ssize_t nw = sendmsg(sock, &sendMsg, 0);
+        ssize_t nw = shm ? shm->sendmsg(sendIov, numiovec) :
+            sendmsg(sock, &sendMsg, 0);
         if (nw == -1) {
             switch (errno) {
             case EMSGSIZE:
@@ -550,15 +644,12 @@ void CouchNotifier::sendCommand(BinaryPacketHandler *rh)
 
 void CouchNotifier::maybeProcessInput()
 {
-    struct pollfd fds;
-    fds.fd = sock;
-    fds.events = POLLIN;
-    fds.revents = 0;
+    short revents;
 
     // @todo check for the #msg sent to avoid a shitload
     // extra syscalls
-    int ret= poll(&fds, 1, 0);
-    if (ret > 0 && (fds.revents & POLLIN) == POLLIN) {
+    int ret = pollConnection(POLLIN, 0, revents);
+    if (ret > 0 && (revents & POLLIN) == POLLIN) {
         processInput();
     }
 }
@@ -600,7 +691,12 @@ bool CouchNotifier::processInput() {
             input.grow();
         }
 
-        nr = recv(sock, input.data + input.avail, input.size - input.avail, 0);
+        if (shm) {
+            nr = shm->recv(input.data + input.avail, input.size - input.avail);
+        } else {
+            nr = recv(sock, input.data + input.avail,
+                      input.size - input.avail, 0);
+        }
         if (nr == -1) {
             switch (errno) {
             case EINTR:
@@ -636,15 +732,12 @@ bool CouchNotifier::waitForReadable(bool tryOnce)
 
     while (connected) {
         bool reconnect = false;
-        struct pollfd fds;
-        fds.fd = sock;
-        fds.events = POLLIN;
-        fds.revents = 0;
+        short revents;
 
         // @todo do not block forever.. but allow shutdown..
-        int ret = poll(&fds, 1, timeout);
+        int ret = pollConnection(POLLIN, timeout, revents);
         if (ret > 0) {
-            if (fds.revents & POLLIN) {
+            if (revents & POLLIN) {
                 return true;
             }
         } else if (ret < 0) {
@@ -696,6 +789,8 @@ bool CouchNotifier::waitOnce()
 void CouchNotifier::delVBucket(uint16_t vb, Callback<bool> &cb) {
     protocol_binary_request_del_vbucket req;
     LockHolder lh(mutex);
+    // The notifications sent without waiting go first
+    sendPending(true);
     // delete vbucket must wait for a response
     do {
         memset(req.bytes, 0, sizeof(req.bytes));
@@ -717,6 +812,8 @@ void CouchNotifier::flush(Callback<bool> &cb) {
     protocol_binary_request_flush req;
     // flush must wait for a response
     LockHolder lh(mutex);
+    // The notifications sent without waiting go first
+    sendPending(true);
     do {
         memset(req.bytes, 0, sizeof(req.bytes));
         req.message.header.request.magic = PROTOCOL_BINARY_REQ;
@@ -765,6 +862,8 @@ void CouchNotifier::notify_update(const VBStateNotification &vbs,
 {
     protocol_binary_request_notify_vbucket_update req;
     LockHolder lh(mutex);
+    // The notifications sent without waiting go first
+    sendPending(true);
     // notify_bucket must wait for a response
     do {
         memset(req.bytes, 0, sizeof(req.bytes));
@@ -789,6 +888,82 @@ void CouchNotifier::notify_update(const VBStateNotification &vbs,
     } while(!waitOnce());
 }
 
+void CouchNotifier::sendPending(bool all)
+{
+    protocol_binary_request_notify_vbucket_update req;
+    while (!pendingNotifications.empty() &&
+           (all || numNotifyInFlight < notifyWindow)) {
+        PendingNotification &pn = pendingNotifications.front();
+        memset(req.bytes, 0, sizeof(req.bytes));
+        req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+        req.message.header.request.opcode = CMD_NOTIFY_VBUCKET_UPDATE;
+        req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+        req.message.header.request.vbucket = ntohs(pn.vbucket);
+        req.message.header.request.opaque = seqno;
+        req.message.header.request.bodylen = ntohl(32);
+
+        req.message.body.file_version = ntohll(pn.fileVersion);
+        req.message.body.header_offset = ntohll(pn.headerOffset);
+        req.message.body.vbucket_state_updated = ntohl(VB_NO_CHANGE);
+
+        sendIov[0].iov_base = (char*)req.bytes;
+        sendIov[0].iov_len = sizeof(req.bytes);
+        numiovec = 1;
+
+        // A connection reset while sending calls the callbacks with
+        // ETMPFAIL; the caller saves its docs again and notifies anew.
+        BinaryPacketHandler *rh =
+            new AsyncNotifyResponseHandler(seqno++, pn.callbacks,
+                                           numNotifyInFlight);
+        pendingNotifications.pop_front();
+        sendCommand(rh);
+    }
+}
+
+void CouchNotifier::notify_headerpos_update_async(uint16_t vbucket,
+                                                  uint64_t file_version,
+                                                  uint64_t header_offset,
+                                                  Callback<uint16_t> *cb)
+{
+    LockHolder lh(mutex);
+    if (connected) {
+        // Read the responses already in, making room in the window
+        maybeProcessInput();
+    }
+
+    std::list<PendingNotification>::iterator it = pendingNotifications.begin();
+    while (it != pendingNotifications.end() && it->vbucket != vbucket) {
+        ++it;
+    }
+    if (it != pendingNotifications.end()) {
+        // Only the latest header of a file matters to couchdb
+        it->fileVersion = file_version;
+        it->headerOffset = header_offset;
+    } else {
+        it = pendingNotifications.insert(pendingNotifications.end(),
+                                         PendingNotification(vbucket,
+                                                             file_version,
+                                                             header_offset));
+    }
+    it->callbacks.push_back(cb);
+    sendPending(false);
+}
+
+void CouchNotifier::waitForPending()
+{
+    LockHolder lh(mutex);
+    while (true) {
+        sendPending(false);
+        if (numNotifyInFlight == 0 && pendingNotifications.empty()) {
+            break;
+        }
+        // A reset answers all those in flight with ETMPFAIL
+        if (waitForReadable(true)) {
+            processInput();
+        }
+    }
+}
+
 void CouchNotifier::addStats(const std::string &prefix,
                              ADD_STAT add_stat,
                              const void *c)
@@ -800,6 +975,8 @@ void CouchNotifier::addStats(const std::string &prefix,
     add_prefixed_stat(prefix, "last_sent_command", cmd2str(lastSentCommand), add_stat, c);
     add_prefixed_stat(prefix, "last_received_command", cmd2str(lastReceivedCommand),
             add_stat, c);
+    add_prefixed_stat(prefix, "notify_in_flight", numNotifyInFlight, add_stat, c);
+    add_prefixed_stat(prefix, "transport", shm ? "shm" : "tcp", add_stat, c);
 }
 
 const char *CouchNotifier::cmd2str(uint8_t cmd)
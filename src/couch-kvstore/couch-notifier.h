@@ -30,6 +30,7 @@
 
 #include "callbacks.h"
 #include "configuration.h"
+#include "couch-kvstore/couch-shm-channel.h"
 #include "kvstore.h"
 #include "mutex.h"
 
@@ -169,6 +170,27 @@ public:
         notify_update(vbs, file_version, header_offset, cb);
     }
 
+    /**
+     * Notify mccouch of a new header of a vbucket's file without waiting
+     * for the response.  The callback is called with the response's
+     * status once it's read, by whichever thread reads it, or with
+     * ETMPFAIL if the connection is reset first.
+     *
+     * No more than couch_notify_window notifications are sent before
+     * their responses are read; one waiting for room takes in a later one
+     * of the same vbucket, calling both callbacks with its response.
+     */
+    void notify_headerpos_update_async(uint16_t vbucket,
+                                       uint64_t file_version,
+                                       uint64_t header_offset,
+                                       Callback<uint16_t> *cb);
+
+    /**
+     * Wait for the responses of all the notifications sent without
+     * waiting.
+     */
+    void waitForPending(void);
+
     void addStats(const std::string &prefix,
                   ADD_STAT add_stat,
                   const void *c);
@@ -178,9 +200,12 @@ protected:
 
 private:
     CouchNotifier(EPStats &st, Configuration &config);
-    ~CouchNotifier() { }
+    ~CouchNotifier() {
+        delete shm;
+    }
     void selectBucket(void);
     void reschedule(std::list<BinaryPacketHandler*> &packets);
+    void sendPending(bool all);
     void resetConnection();
 
     void sendSingleChunk(const char *ptr, size_t nb);
@@ -194,6 +219,7 @@ private:
 
     bool waitForWritable();
     bool waitForReadable(bool tryOnce = false);
+    int pollConnection(short events, int timeout, short &revents);
 
     bool connect();
     void ensureConnection(void);
@@ -208,6 +234,10 @@ private:
     size_t reconnectSleepTime;
     size_t port;
     std::string host;
+    //! Where couchdb is, for the logs
+    std::string peer;
+    //! The shared memory channel used instead of TCP, if any
+    CouchShmChannel *shm;
     bool allowDataLoss;
     bool configurationError;
 
@@ -274,8 +304,26 @@ private:
         }
     } commandStats[MAX_NUM_NOTIFIER_CMD];
 
+    /**
+     * A notification of a new file header not sent yet, and the callbacks
+     * waiting for its response.
+     */
+    struct PendingNotification {
+        PendingNotification(uint16_t vb, uint64_t version, uint64_t offset) :
+            vbucket(vb), fileVersion(version), headerOffset(offset) { }
+
+        uint16_t vbucket;
+        uint64_t fileVersion;
+        uint64_t headerOffset;
+        std::list<Callback<uint16_t> *> callbacks;
+    };
+
     Mutex mutex;
     std::list<BinaryPacketHandler*> responseHandler;
+    std::list<PendingNotification> pendingNotifications;
+    size_t notifyWindow;
+    //! The notifications sent without waiting, still to be answered
+    size_t numNotifyInFlight;
     bool connected;
     bool inSelectBucket;
 
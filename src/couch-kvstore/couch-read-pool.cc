@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "couch-kvstore/couch-kvstore.h"
+#include "couch-kvstore/couch-read-pool.h"
+#include "objectregistry.h"
+
+extern "C" {
+    static void *launch_couch_reader(void *arg) {
+        CouchReadPool::Reader *r = static_cast<CouchReadPool::Reader*>(arg);
+        r->pool->run(r->store);
+        return NULL;
+    }
+}
+
+CouchReadPool::CouchReadPool(const CouchKVStore &store, size_t numReaders) :
+    engine(ObjectRegistry::getCurrentEngine()), stopping(false)
+{
+    assert(store.isReadOnly());
+    for (size_t i = 0; i < numReaders; ++i) {
+        Reader *r = new Reader(this, new CouchKVStore(store));
+        if (pthread_create(&r->thread, NULL, launch_couch_reader, r) != 0) {
+            LOG(EXTENSION_LOG_WARNING, "Failed to start a couch reader "
+                "thread, running %d", static_cast<int>(readers.size()));
+            delete r->store;
+            delete r;
+            break;
+        }
+        readers.push_back(r);
+    }
+}
+
+CouchReadPool::~CouchReadPool() {
+    {
+        LockHolder lh(sync);
+        stopping = true;
+        sync.notify();
+    }
+    std::vector<Reader*>::iterator it = readers.begin();
+    for (; it != readers.end(); ++it) {
+        pthread_join((*it)->thread, NULL);
+        delete (*it)->store;
+        delete *it;
+    }
+}
+
+void CouchReadPool::submit(uint16_t vb, vb_bgfetch_queue_t &itms,
+                           Callback<uint16_t> &cb) {
+    ++numReads;
+    ++inFlight;
+    LockHolder lh(sync);
+    queue.push_back(Read(vb, &itms, &cb));
+    sync.notify();
+}
+
+void CouchReadPool::run(CouchKVStore *reader) {
+    ObjectRegistry::onSwitchThread(engine);
+    LockHolder lh(sync);
+    while (true) {
+        if (queue.empty()) {
+            if (stopping) {
+                break;
+            }
+            sync.wait();
+            continue;
+        }
+        Read r = queue.front();
+        queue.pop_front();
+        lh.unlock();
+        reader->getMulti(r.vb, *r.itms);
+        --inFlight;
+        r.cb->callback(r.vb);
+        lh.lock();
+    }
+}
@@ -0,0 +1,116 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_COUCH_KVSTORE_COUCH_READ_POOL_H_
+#define SRC_COUCH_KVSTORE_COUCH_READ_POOL_H_ 1
+
+#include "config.h"
+
+#include <pthread.h>
+
+#include <list>
+#include <vector>
+
+#include "atomic.h"
+#include "bgfetcher.h"
+#include "callbacks.h"
+#include "common.h"
+#include "syncobject.h"
+
+class CouchKVStore;
+class EventuallyPersistentEngine;
+
+/**
+ * Threads reading the batches of background fetches a read-only
+ * CouchKVStore is handed, each with a copy of the store and so with file
+ * handles of its own, so the bg fetcher keeps a batch per vbucket in
+ * flight instead of reading them one after another.  The reads are taken
+ * in the order they're submitted.
+ */
+class CouchReadPool {
+public:
+    /**
+     * Start the threads.
+     *
+     * @param store the store the readers are copies of
+     * @param numReaders the number of threads
+     */
+    CouchReadPool(const CouchKVStore &store, size_t numReaders);
+
+    /**
+     * Finish the reads submitted and stop the threads.
+     */
+    ~CouchReadPool();
+
+    /**
+     * Queue the read of a vbucket's batch.  The callback is called with
+     * the vbucket by the thread that read it.  There must be readers.
+     */
+    void submit(uint16_t vb, vb_bgfetch_queue_t &itms,
+                Callback<uint16_t> &cb);
+
+    size_t getNumReaders() const {
+        return readers.size();
+    }
+
+    //! The number of batches submitted
+    size_t getNumReads() const {
+        return numReads.get();
+    }
+
+    //! The number of batches submitted and not yet read
+    size_t getNumInFlight() const {
+        return inFlight.get();
+    }
+
+    /**
+     * Body of a reader thread.
+     */
+    void run(CouchKVStore *reader);
+
+    //! A reader thread and its copy of the store
+    struct Reader {
+        Reader(CouchReadPool *p, CouchKVStore *s) : pool(p), store(s) { }
+
+        CouchReadPool *pool;
+        CouchKVStore *store;
+        pthread_t thread;
+    };
+
+private:
+
+    struct Read {
+        Read(uint16_t v, vb_bgfetch_queue_t *i, Callback<uint16_t> *c) :
+            vb(v), itms(i), cb(c) { }
+
+        uint16_t vb;
+        vb_bgfetch_queue_t *itms;
+        Callback<uint16_t> *cb;
+    };
+
+    EventuallyPersistentEngine *engine;
+    std::vector<Reader*> readers;
+    std::list<Read> queue;
+    SyncObject sync;
+    bool stopping;
+    Atomic<size_t> numReads;
+    Atomic<size_t> inFlight;
+
+    DISALLOW_COPY_AND_ASSIGN(CouchReadPool);
+};
+
+#endif  // SRC_COUCH_KVSTORE_COUCH_READ_POOL_H_
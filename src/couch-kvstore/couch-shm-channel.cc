@@ -0,0 +1,317 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include <algorithm>
+#include <sstream>
+
+#include "couch-kvstore/couch-shm-channel.h"
+
+// The descriptors passed to the peer: the segment, its doorbell and ours.
+static const int NUM_PASSED_FDS = 3;
+
+static void closeFd(int &fd) {
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool CouchShmChannel::map(int fd, size_t len, bool peerSide) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to map the notification channel's "
+            "segment: %s", strerror(errno));
+        return false;
+    }
+    segment = static_cast<ShmSegmentHeader*>(p);
+    segmentSize = len;
+    char *data = static_cast<char*>(p) + sizeof(ShmSegmentHeader);
+    // Kept here, as the peer can write anything to the segment.
+    ringSize = (len - sizeof(ShmSegmentHeader)) / 2;
+    if (peerSide) {
+        out = &segment->fromPeer;
+        in = &segment->toPeer;
+        outData = data + ringSize;
+        inData = data;
+    } else {
+        out = &segment->toPeer;
+        in = &segment->fromPeer;
+        outData = data;
+        inData = data + ringSize;
+    }
+    return true;
+}
+
+bool CouchShmChannel::connect() {
+#ifdef HAVE_SYS_EVENTFD_H
+    close();
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(addr.sun_path)) {
+        LOG(EXTENSION_LOG_WARNING, "The notification channel's path is too "
+            "long: \"%s\"", path.c_str());
+        return false;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    controlSock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (controlSock == -1 ||
+        ::connect(controlSock, reinterpret_cast<struct sockaddr*>(&addr),
+                  sizeof(addr)) == -1) {
+        closeFd(controlSock);
+        return false;
+    }
+
+    // The segment is only reachable through the descriptors passed around,
+    // so it goes away with the last process to close it.
+    static uint32_t counter;
+    std::stringstream name;
+    name << "/ep-couch-notifier." << getpid() << "."
+         << __sync_add_and_fetch(&counter, 1);
+    int segmentFd = shm_open(name.str().c_str(), O_CREAT | O_EXCL | O_RDWR,
+                             S_IRUSR | S_IWUSR);
+    if (segmentFd == -1) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to create the notification "
+            "channel's segment: %s", strerror(errno));
+        closeFd(controlSock);
+        return false;
+    }
+    shm_unlink(name.str().c_str());
+
+    size_t len = sizeof(ShmSegmentHeader) + 2 * RING_SIZE;
+    toPeerFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fromPeerFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ftruncate(segmentFd, len) == -1 || toPeerFd == -1 ||
+        fromPeerFd == -1 || !map(segmentFd, len, false)) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to set up the notification "
+            "channel: %s", strerror(errno));
+        ::close(segmentFd);
+        close();
+        return false;
+    }
+    memcpy(segment->magic, SHM_CHANNEL_MAGIC, sizeof(segment->magic));
+    segment->ringSize = RING_SIZE;
+
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(NUM_PASSED_FDS * sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = segment;
+    iov.iov_len = sizeof(segment->magic) + sizeof(segment->ringSize);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(NUM_PASSED_FDS * sizeof(int));
+    int fds[NUM_PASSED_FDS] = { segmentFd, toPeerFd, fromPeerFd };
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t nw = ::sendmsg(controlSock, &msg, 0);
+    ::close(segmentFd);
+    if (nw != static_cast<ssize_t>(iov.iov_len)) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to hand the notification channel "
+            "to couchdb: %s", strerror(errno));
+        close();
+        return false;
+    }
+    fcntl(controlSock, F_SETFL, fcntl(controlSock, F_GETFL) | O_NONBLOCK);
+    return true;
+#else
+    LOG(EXTENSION_LOG_WARNING, "The shared memory notification channel "
+        "needs eventfd, which isn't supported here");
+    return false;
+#endif
+}
+
+CouchShmChannel *CouchShmChannel::accept(int sock) {
+    char data[sizeof(SHM_CHANNEL_MAGIC) - 1 + sizeof(uint64_t)];
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(NUM_PASSED_FDS * sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (::recvmsg(sock, &msg, MSG_WAITALL) != static_cast<ssize_t>(sizeof(data))) {
+        return NULL;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(NUM_PASSED_FDS * sizeof(int))) {
+        return NULL;
+    }
+    int fds[NUM_PASSED_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    uint64_t ringSize;
+    memcpy(&ringSize, data + sizeof(SHM_CHANNEL_MAGIC) - 1, sizeof(ringSize));
+    // Don't map past the end of the segment.
+    struct stat st;
+    bool sized = ringSize > 0 && ringSize <= MAX_RING_SIZE &&
+        fstat(fds[0], &st) == 0 &&
+        static_cast<uint64_t>(st.st_size) >= sizeof(ShmSegmentHeader) + 2 * ringSize;
+    CouchShmChannel *channel = new CouchShmChannel("");
+    channel->controlSock = sock;
+    // The peer's doorbell is the one we ring, and the other way around.
+    channel->toPeerFd = fds[2];
+    channel->fromPeerFd = fds[1];
+    bool mapped = sized &&
+        memcmp(data, SHM_CHANNEL_MAGIC, sizeof(SHM_CHANNEL_MAGIC) - 1) == 0 &&
+        channel->map(fds[0], sizeof(ShmSegmentHeader) + 2 * ringSize, true);
+    ::close(fds[0]);
+    if (!mapped) {
+        channel->controlSock = -1;
+        delete channel;
+        return NULL;
+    }
+    return channel;
+}
+
+void CouchShmChannel::close() {
+    if (segment != NULL) {
+        munmap(segment, segmentSize);
+        segment = NULL;
+        out = in = NULL;
+        outData = inData = NULL;
+        ringSize = 0;
+    }
+    closeFd(toPeerFd);
+    closeFd(fromPeerFd);
+    closeFd(controlSock);
+}
+
+void CouchShmChannel::ring() {
+    uint64_t one = 1;
+    // Only fails if the peer hasn't looked in 2^64 rings.
+    ssize_t nw = write(toPeerFd, &one, sizeof(one));
+    (void)nw;
+}
+
+bool CouchShmChannel::peerGone() {
+    char c;
+    ssize_t nr = ::recv(controlSock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return nr == 0 || (nr == -1 && errno != EAGAIN &&
+                       errno != EWOULDBLOCK && errno != EINTR);
+}
+
+ssize_t CouchShmChannel::sendmsg(const struct iovec *iov, int iovcnt) {
+    if (!isOpen()) {
+        errno = EPIPE;
+        return -1;
+    }
+    uint64_t head = out->head;
+    uint64_t tail = out->tail;
+    __sync_synchronize();
+    uint64_t used = head - tail;
+    if (used > ringSize) {
+        // The peer read bytes we never wrote.
+        LOG(EXTENSION_LOG_WARNING, "The notification channel is broken: "
+            "%llu bytes in a ring of %llu", (unsigned long long)used,
+            (unsigned long long)ringSize);
+        errno = EPIPE;
+        return -1;
+    }
+    uint64_t room = ringSize - used;
+    if (room == 0) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    size_t written = 0;
+    for (int ii = 0; ii < iovcnt && room > 0; ++ii) {
+        const char *src = static_cast<const char*>(iov[ii].iov_base);
+        size_t len = std::min(static_cast<uint64_t>(iov[ii].iov_len), room);
+        size_t pos = head % ringSize;
+        size_t first = std::min(len, ringSize - pos);
+        memcpy(outData + pos, src, first);
+        memcpy(outData, src + first, len - first);
+        head += len;
+        room -= len;
+        written += len;
+    }
+    // The bytes go out before the head that shows them.
+    __sync_synchronize();
+    out->head = head;
+    ring();
+    return written;
+}
+
+ssize_t CouchShmChannel::recv(char *buf, size_t len) {
+    if (!isOpen()) {
+        return 0;
+    }
+    // Clear the doorbell before looking, so a ring after this is not lost.
+    uint64_t rings;
+    ssize_t nr = read(fromPeerFd, &rings, sizeof(rings));
+    (void)nr;
+
+    uint64_t tail = in->tail;
+    uint64_t head = in->head;
+    __sync_synchronize();
+    uint64_t avail = head - tail;
+    if (avail == 0) {
+        if (peerGone()) {
+            return 0;
+        }
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    if (avail > ringSize) {
+        // The peer wrote more than the ring holds; what's in it is garbage.
+        LOG(EXTENSION_LOG_WARNING, "The notification channel is broken: "
+            "%llu bytes in a ring of %llu", (unsigned long long)avail,
+            (unsigned long long)ringSize);
+        errno = EPROTO;
+        return -1;
+    }
+
+    size_t n = std::min(static_cast<uint64_t>(len), avail);
+    size_t pos = tail % ringSize;
+    size_t first = std::min(n, ringSize - pos);
+    memcpy(buf, inData + pos, first);
+    memcpy(buf + first, inData, n - first);
+    // The bytes are copied out before the room is given back.
+    __sync_synchronize();
+    in->tail = tail + n;
+    if (avail > ringSize / 2) {
+        // The peer may be waiting for room.
+        ring();
+    }
+    return n;
+}
@@ -0,0 +1,163 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_COUCH_KVSTORE_COUCH_SHM_CHANNEL_H_
+#define SRC_COUCH_KVSTORE_COUCH_SHM_CHANNEL_H_ 1
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <string>
+
+#include "common.h"
+
+/**
+ * One direction of a CouchShmChannel: a byte ring in the shared segment,
+ * written by one process and read by the other.  The positions only
+ * grow, each written by one side only, on cache lines of their own.
+ */
+struct ShmRing {
+    //! Bytes written, by the producer
+    volatile uint64_t head;
+    char pad1[56];
+    //! Bytes read, by the consumer
+    volatile uint64_t tail;
+    char pad2[56];
+};
+
+/**
+ * The start of the shared segment.  It's followed by the data of the ring
+ * to the peer and then by that of the ring from the peer, ringSize bytes
+ * each.
+ */
+struct ShmSegmentHeader {
+    char magic[8];
+    uint64_t ringSize;
+    char pad[48];
+    ShmRing toPeer;
+    ShmRing fromPeer;
+};
+
+#define SHM_CHANNEL_MAGIC "EPSHMCH1"
+
+/**
+ * A channel to a co-located couchdb carrying the same binary packets as
+ * the TCP connection to it, through a pair of rings in shared memory with
+ * eventfd doorbells, so that a notification costs no syscall beyond the
+ * doorbells and the peer never waits on the network stack.
+ *
+ * The channel is set up over a unix socket the peer listens on: the
+ * segment and the two eventfds are created here and passed along with
+ * SCM_RIGHTS, in a message whose data is the segment header.  The socket
+ * then stays open only to tell either side that the other is gone.  Each
+ * side rings the other's doorbell once it's written to a ring or read
+ * from one, so a doorbell means "look at the rings again".
+ */
+class CouchShmChannel {
+public:
+    //! The size of each ring
+    static const size_t RING_SIZE = 1024 * 1024;
+    //! The biggest rings a peer's segment may have
+    static const size_t MAX_RING_SIZE = 64 * RING_SIZE;
+
+    CouchShmChannel(const std::string &p) :
+        path(p), controlSock(-1), toPeerFd(-1), fromPeerFd(-1),
+        segment(NULL), segmentSize(0), ringSize(0), out(NULL), in(NULL),
+        outData(NULL), inData(NULL) { }
+
+    ~CouchShmChannel() {
+        close();
+    }
+
+    /**
+     * Set up the segment and hand it to the peer.
+     *
+     * @return false if the peer isn't there or it couldn't be set up
+     */
+    bool connect();
+
+    void close();
+
+    bool isOpen() const {
+        return segment != NULL;
+    }
+
+    /**
+     * The descriptor to poll for the peer ringing; readable once there may
+     * be something to read or room to write.
+     */
+    int getDoorbellFd() const {
+        return fromPeerFd;
+    }
+
+    /**
+     * The descriptor to poll for the peer going away; readable once it has.
+     */
+    int getControlFd() const {
+        return controlSock;
+    }
+
+    /**
+     * Copy as much of the iovecs as fits into the ring to the peer, and
+     * ring it, like a nonblocking sendmsg().
+     *
+     * @return the bytes copied, or -1 with errno EWOULDBLOCK if the ring is
+     *         full or EPIPE if the channel is closed or broken
+     */
+    ssize_t sendmsg(const struct iovec *iov, int iovcnt);
+
+    /**
+     * Read up to len bytes of what the peer wrote, like a nonblocking
+     * recv().
+     *
+     * @return the bytes read, 0 if the peer is gone, or -1 with errno
+     *         EWOULDBLOCK if there's nothing to read or EPROTO if the
+     *         peer's positions in the ring make no sense
+     */
+    ssize_t recv(char *buf, size_t len);
+
+    /**
+     * The peer's side of the channel, set up from the descriptors passed
+     * over the unix socket it accepted.  Only used by tests standing in for
+     * couchdb.
+     */
+    static CouchShmChannel *accept(int sock);
+
+private:
+    bool map(int fd, size_t len, bool peerSide);
+    void ring();
+    bool peerGone();
+
+    std::string path;
+    int controlSock;
+    int toPeerFd;
+    int fromPeerFd;
+    ShmSegmentHeader *segment;
+    size_t segmentSize;
+    //! The size of each ring, as mapped
+    size_t ringSize;
+    ShmRing *out;
+    ShmRing *in;
+    char *outData;
+    char *inData;
+
+    DISALLOW_COPY_AND_ASSIGN(CouchShmChannel);
+};
+
+#endif  // SRC_COUCH_KVSTORE_COUCH_SHM_CHANNEL_H_
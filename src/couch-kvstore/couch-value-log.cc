@@ -0,0 +1,381 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <sstream>
+
+extern "C" {
+#include "crc32.h"
+}
+#include "couch-kvstore/couch-value-log.h"
+#include "locks.h"
+
+static const uint32_t POINTER_MAGIC = 0x766c67; // "vlg"
+static const uint8_t POINTER_COMPRESSED = 0x01;
+static const char LOG_SUFFIX[] = ".vlog.";
+
+static void putInt(char *buf, uint64_t val, size_t len) {
+    for (size_t i = len; i > 0; --i) {
+        buf[i - 1] = static_cast<char>(val & 0xff);
+        val >>= 8;
+    }
+}
+
+static uint64_t getInt(const char *buf, size_t len) {
+    uint64_t val = 0;
+    for (size_t i = 0; i < len; ++i) {
+        val = (val << 8) | static_cast<uint8_t>(buf[i]);
+    }
+    return val;
+}
+
+void ValueLogPointer::encode(char *buf) const {
+    putInt(buf, POINTER_MAGIC, 3);
+    buf[3] = static_cast<char>(compressed ? POINTER_COMPRESSED : 0);
+    putInt(buf + 4, generation, 4);
+    putInt(buf + 8, offset, 8);
+    putInt(buf + 16, length, 4);
+    putInt(buf + 20, crc, 4);
+}
+
+bool ValueLogPointer::decode(const char *buf, size_t len) {
+    if (len != SIZE || getInt(buf, 3) != POINTER_MAGIC) {
+        return false;
+    }
+    compressed = (buf[3] & POINTER_COMPRESSED) != 0;
+    generation = static_cast<uint32_t>(getInt(buf + 4, 4));
+    offset = getInt(buf + 8, 8);
+    length = static_cast<uint32_t>(getInt(buf + 16, 4));
+    crc = static_cast<uint32_t>(getInt(buf + 20, 4));
+    return true;
+}
+
+static inline int doFsync(int fd) {
+    int ret;
+    while ((ret = fsync(fd)) == -1 && (errno == EINTR)) {
+        /* Retry */
+    }
+    return ret;
+}
+
+static bool pwriteFully(int fd, const char *buf, size_t nbytes, off_t off) {
+    while (nbytes > 0) {
+        ssize_t written = ::pwrite(fd, buf, nbytes, off);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        nbytes -= written;
+        buf += written;
+        off += written;
+    }
+    return true;
+}
+
+static bool preadFully(int fd, char *buf, size_t nbytes, off_t off) {
+    while (nbytes > 0) {
+        ssize_t got = ::pread(fd, buf, nbytes, off);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            return false;
+        }
+        nbytes -= got;
+        buf += got;
+        off += got;
+    }
+    return true;
+}
+
+std::string CouchValueLog::getPath(const std::string &dir, uint16_t vbid,
+                                   uint32_t generation) {
+    std::stringstream ss;
+    ss << dir << "/" << vbid << LOG_SUFFIX << generation;
+    return ss.str();
+}
+
+CouchValueLog::CouchValueLog(const std::string &d) : dir(d)
+{
+    DIR *dp = opendir(dir.c_str());
+    if (dp == NULL) {
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        const char *suffix = strstr(de->d_name, LOG_SUFFIX);
+        if (suffix == NULL || suffix == de->d_name) {
+            continue;
+        }
+        char *end;
+        unsigned long vbid = strtoul(de->d_name, &end, 10);
+        if (end != suffix) {
+            continue;
+        }
+        unsigned long generation = strtoul(suffix + strlen(LOG_SUFFIX),
+                                           &end, 10);
+        if (*end != '\0' || generation == 0) {
+            continue;
+        }
+        struct stat st;
+        std::string path = dir + "/" + de->d_name;
+        if (stat(path.c_str(), &st) != 0) {
+            continue;
+        }
+        VBLog &log = logs[static_cast<uint16_t>(vbid)];
+        uint32_t gen = static_cast<uint32_t>(generation);
+        log.generations[gen] = st.st_size;
+        log.totalSize += st.st_size;
+        log.liveBytes += st.st_size;
+        if (gen >= log.generation) {
+            log.generation = gen;
+            log.size = st.st_size;
+        }
+    }
+    closedir(dp);
+}
+
+CouchValueLog::~CouchValueLog() {
+    std::map<uint16_t, VBLog>::iterator it;
+    for (it = logs.begin(); it != logs.end(); ++it) {
+        if (it->second.fd != -1) {
+            ::close(it->second.fd);
+        }
+        std::map<uint32_t, int>::iterator rit;
+        for (rit = it->second.readFds.begin();
+             rit != it->second.readFds.end(); ++rit) {
+            ::close(rit->second);
+        }
+    }
+    closeRetired();
+    closeRetired();
+}
+
+CouchValueLog::VBLog &CouchValueLog::getLog(uint16_t vbid) {
+    return logs[vbid];
+}
+
+bool CouchValueLog::openForAppend(uint16_t vbid, VBLog &log) {
+    std::string path = getPath(dir, vbid, log.generation);
+    log.fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0666);
+    if (log.fd == -1) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to open the value log "
+            "%s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    // A new generation, or the end of one a restart left behind.
+    log.generations.insert(std::make_pair(log.generation, log.size));
+    return true;
+}
+
+bool CouchValueLog::append(uint16_t vbid, const char *data, size_t len,
+                           bool compressed, ValueLogPointer &ptr) {
+    LockHolder lh(mutex);
+    VBLog &log = getLog(vbid);
+    if (log.fd == -1 && !openForAppend(vbid, log)) {
+        return false;
+    }
+    // The space is taken before writing to it, so a failed write leaves
+    // a hole rather than a value that another one overwrites.
+    int fd = log.fd;
+    ptr.generation = log.generation;
+    ptr.offset = log.size;
+    ptr.length = static_cast<uint32_t>(len);
+    ptr.compressed = compressed;
+    log.size += len;
+    log.generations[log.generation] = log.size;
+    log.totalSize += len;
+    log.liveBytes += len;
+    log.dirty = true;
+    lh.unlock();
+
+    ptr.crc = crc32buf(reinterpret_cast<uint8_t *>(const_cast<char *>(data)),
+                       len);
+    if (!pwriteFully(fd, data, len, static_cast<off_t>(ptr.offset))) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to append to the value "
+            "log of vbucket %d: %s", vbid, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool CouchValueLog::sync(uint16_t vbid) {
+    LockHolder lh(mutex);
+    std::map<uint16_t, VBLog>::iterator it = logs.find(vbid);
+    if (it == logs.end() || !it->second.dirty || it->second.fd == -1) {
+        return true;
+    }
+    int fd = it->second.fd;
+    it->second.dirty = false;
+    lh.unlock();
+
+    if (doFsync(fd) != 0) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to sync the value log of "
+            "vbucket %d: %s", vbid, strerror(errno));
+        LockHolder lh2(mutex);
+        logs[vbid].dirty = true;
+        return false;
+    }
+    return true;
+}
+
+bool CouchValueLog::read(uint16_t vbid, const ValueLogPointer &ptr,
+                         std::string &value) {
+    LockHolder lh(mutex);
+    VBLog &log = getLog(vbid);
+    int fd;
+    std::map<uint32_t, int>::iterator it = log.readFds.find(ptr.generation);
+    if (it != log.readFds.end()) {
+        fd = it->second;
+    } else {
+        std::string path = getPath(dir, vbid, ptr.generation);
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to open the value "
+                "log %s: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+        log.readFds[ptr.generation] = fd;
+    }
+    lh.unlock();
+
+    value.resize(ptr.length);
+    if (ptr.length > 0 &&
+        !preadFully(fd, &value[0], ptr.length,
+                    static_cast<off_t>(ptr.offset))) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to read %u bytes at "
+            "%llu of the value log of vbucket %d, generation %u",
+            ptr.length, (unsigned long long)ptr.offset, vbid,
+            ptr.generation);
+        return false;
+    }
+    uint32_t crc = crc32buf(reinterpret_cast<uint8_t *>(
+                                const_cast<char *>(value.data())),
+                            value.size());
+    if (crc != ptr.crc) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: the value at %llu of the value "
+            "log of vbucket %d, generation %u, is corrupt",
+            (unsigned long long)ptr.offset, vbid, ptr.generation);
+        return false;
+    }
+    return true;
+}
+
+void CouchValueLog::newGeneration(VBLog &log) {
+    if (log.fd != -1) {
+        retiring.push_back(log.fd);
+        log.fd = -1;
+    }
+    ++log.generation;
+    log.size = 0;
+    log.dirty = false;
+}
+
+uint32_t CouchValueLog::startCompaction(uint16_t vbid) {
+    LockHolder lh(mutex);
+    VBLog &log = getLog(vbid);
+    if (!log.measured || log.totalSize < REWRITE_MIN_SIZE ||
+        log.totalSize <= 2 * log.liveBytes) {
+        return 0;
+    }
+    // The writes from here on go to the new generation, so the older
+    // ones are only read from.
+    if (log.dirty && log.fd != -1) {
+        doFsync(log.fd);
+    }
+    newGeneration(log);
+    return log.generation;
+}
+
+void CouchValueLog::removeGeneration(uint16_t vbid, VBLog &log,
+                                     uint32_t generation) {
+    std::string path = getPath(dir, vbid, generation);
+    if (::remove(path.c_str()) != 0 && errno != ENOENT) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to remove the value log "
+            "%s: %s", path.c_str(), strerror(errno));
+    }
+    std::map<uint32_t, uint64_t>::iterator git =
+        log.generations.find(generation);
+    if (git != log.generations.end()) {
+        log.totalSize -= git->second;
+        log.generations.erase(git);
+    }
+    std::map<uint32_t, int>::iterator rit = log.readFds.find(generation);
+    if (rit != log.readFds.end()) {
+        retiring.push_back(rit->second);
+        log.readFds.erase(rit);
+    }
+}
+
+void CouchValueLog::closeRetired(void) {
+    std::vector<int>::iterator it;
+    for (it = retired.begin(); it != retired.end(); ++it) {
+        ::close(*it);
+    }
+    retired.clear();
+    retired.swap(retiring);
+}
+
+void CouchValueLog::finishCompaction(uint16_t vbid, uint32_t generation,
+                                     uint64_t liveBytes) {
+    LockHolder lh(mutex);
+    closeRetired();
+    VBLog &log = getLog(vbid);
+    if (generation > 0) {
+        while (!log.generations.empty() &&
+               log.generations.begin()->first < generation) {
+            removeGeneration(vbid, log, log.generations.begin()->first);
+        }
+    }
+    log.liveBytes = liveBytes;
+    log.measured = true;
+}
+
+void CouchValueLog::remove(uint16_t vbid) {
+    LockHolder lh(mutex);
+    closeRetired();
+    VBLog &log = getLog(vbid);
+    newGeneration(log);
+    while (!log.generations.empty()) {
+        removeGeneration(vbid, log, log.generations.begin()->first);
+    }
+    log.totalSize = 0;
+    log.liveBytes = 0;
+    log.measured = true;
+}
+
+uint64_t CouchValueLog::getSize(void) {
+    LockHolder lh(mutex);
+    uint64_t size = 0;
+    std::map<uint16_t, VBLog>::iterator it;
+    for (it = logs.begin(); it != logs.end(); ++it) {
+        size += it->second.totalSize;
+    }
+    return size;
+}
@@ -0,0 +1,191 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_COUCH_KVSTORE_COUCH_VALUE_LOG_H_
+#define SRC_COUCH_KVSTORE_COUCH_VALUE_LOG_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "mutex.h"
+
+/**
+ * Where a value kept out of its vbucket file is in the value log.  The
+ * doc in the file has the pointer as its body.
+ */
+struct ValueLogPointer {
+    //! The size of an encoded pointer
+    static const size_t SIZE = 24;
+
+    ValueLogPointer() :
+        generation(0), offset(0), length(0), crc(0), compressed(false) { }
+
+    /**
+     * Write the pointer to SIZE bytes: a magic, the flags, and the
+     * generation, offset, length and crc of the value, in network byte
+     * order.
+     */
+    void encode(char *buf) const;
+
+    /**
+     * Read a pointer written by encode().
+     *
+     * @return false if the bytes aren't a pointer
+     */
+    bool decode(const char *buf, size_t len);
+
+    uint32_t generation;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t crc;
+    //! True if the value is snappy compressed
+    bool compressed;
+};
+
+/**
+ * The values of a bucket that are too big to be worth copying at every
+ * compaction of their vbucket files, appended to a log of each vbucket
+ * instead.
+ *
+ * A vbucket's log is a series of generation files, <vbid>.vlog.<gen> in
+ * the bucket's db dir, and the values are only ever appended to the last
+ * one.  The garbage of the values overwritten and deleted is collected
+ * lazily, by the compactions of the vbucket's file: a compaction that
+ * starts while more than half of the log is garbage moves the values its
+ * docs point at to a new generation, and the older generations are
+ * removed once the compacted file has replaced the old one.  Otherwise
+ * the docs are copied with their pointers and the values stay put.
+ *
+ * All the stores of a bucket share the log: the writers append to it and
+ * the readers of every shard read from it.
+ */
+class CouchValueLog {
+public:
+    //! The size below which a log isn't worth rewriting
+    static const uint64_t REWRITE_MIN_SIZE = 1024 * 1024;
+
+    /**
+     * Open the logs in a bucket's db dir, taking over their generations.
+     */
+    explicit CouchValueLog(const std::string &dir);
+
+    ~CouchValueLog();
+
+    /**
+     * Append a value to the last generation of a vbucket's log.  It's not
+     * durable until sync().
+     *
+     * @param ptr set to where the value is
+     * @return false if the value couldn't be written
+     */
+    bool append(uint16_t vbid, const char *data, size_t len, bool compressed,
+                ValueLogPointer &ptr);
+
+    /**
+     * Make the values appended to a vbucket's log durable, before the docs
+     * that point at them are committed.
+     */
+    bool sync(uint16_t vbid);
+
+    /**
+     * Read a value from a vbucket's log.
+     *
+     * @return false if it couldn't be read or its crc doesn't match
+     */
+    bool read(uint16_t vbid, const ValueLogPointer &ptr, std::string &value);
+
+    /**
+     * Start a compaction of a vbucket's file.  If enough of the log is
+     * garbage, the values go to a new generation from now on, and the
+     * compaction is to move the values of the generations before it.
+     *
+     * @return the generation to move the values to, or 0 to leave them
+     */
+    uint32_t startCompaction(uint16_t vbid);
+
+    /**
+     * Finish a compaction of a vbucket's file, once the compacted file
+     * has replaced the old one.
+     *
+     * @param generation what startCompaction() returned; the generations
+     *                   before it are removed
+     * @param liveBytes the bytes of the values the compacted file points at
+     */
+    void finishCompaction(uint16_t vbid, uint32_t generation,
+                          uint64_t liveBytes);
+
+    /**
+     * Remove all of a vbucket's log, when its file is.
+     */
+    void remove(uint16_t vbid);
+
+    //! The bytes in all of the logs
+    uint64_t getSize(void);
+
+    /**
+     * The path of a generation of a vbucket's log.
+     */
+    static std::string getPath(const std::string &dir, uint16_t vbid,
+                               uint32_t generation);
+
+private:
+    struct VBLog {
+        VBLog() : generation(1), fd(-1), size(0), dirty(false),
+                  totalSize(0), liveBytes(0), measured(false) { }
+
+        //! The generation appended to
+        uint32_t generation;
+        //! The file of the generation appended to, once opened
+        int fd;
+        //! The size of the generation appended to
+        uint64_t size;
+        //! True if it was appended to since it was synced
+        bool dirty;
+        //! The sizes of the generations
+        std::map<uint32_t, uint64_t> generations;
+        uint64_t totalSize;
+        //! The bytes of the live values, as of the last compaction plus
+        //! those appended since
+        uint64_t liveBytes;
+        //! True once a compaction measured the live values
+        bool measured;
+        //! The files of the generations opened for reading
+        std::map<uint32_t, int> readFds;
+    };
+
+    VBLog &getLog(uint16_t vbid);
+    bool openForAppend(uint16_t vbid, VBLog &log);
+    void newGeneration(VBLog &log);
+    void removeGeneration(uint16_t vbid, VBLog &log, uint32_t generation);
+    void closeRetired(void);
+
+    const std::string dir;
+    Mutex mutex;
+    std::map<uint16_t, VBLog> logs;
+    //! Files let go of, closed once the reads that may be using them
+    //! are surely done: at the next removal of a generation
+    std::vector<int> retired;
+    std::vector<int> retiring;
+
+    DISALLOW_COPY_AND_ASSIGN(CouchValueLog);
+};
+
+#endif  // SRC_COUCH_KVSTORE_COUCH_VALUE_LOG_H_
@@ -0,0 +1,244 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fstream>
+
+extern "C" {
+#include "crc32.h"
+}
+#include "couch-kvstore/couch-vbstate-journal.h"
+#include "locks.h"
+
+static const uint32_t RECORD_MAGIC = 0x76627331; // "vbs1"
+//! The records past the last state of each vbucket before it's rewritten
+static const size_t REWRITE_SLACK = 1024;
+
+static void putInt(char *buf, uint64_t val, size_t len) {
+    for (size_t i = len; i > 0; --i) {
+        buf[i - 1] = static_cast<char>(val & 0xff);
+        val >>= 8;
+    }
+}
+
+static uint64_t getInt(const char *buf, size_t len) {
+    uint64_t val = 0;
+    for (size_t i = 0; i < len; ++i) {
+        val = (val << 8) | static_cast<uint8_t>(buf[i]);
+    }
+    return val;
+}
+
+/**
+ * A record is the magic, the crc of the rest of it, the vbucket id, its
+ * state (0 if it's gone), four reserved bytes and the checkpoint id, max
+ * deleted seqno and purge seqno, all in network byte order.
+ */
+static void encodeRecord(std::string &buf, uint16_t vbid,
+                         const vbucket_state *vbstate) {
+    char rec[CouchVBStateJournal::RECORD_SIZE];
+    memset(rec, 0, sizeof(rec));
+    putInt(rec, RECORD_MAGIC, 4);
+    putInt(rec + 8, vbid, 2);
+    if (vbstate) {
+        putInt(rec + 10, static_cast<uint16_t>(vbstate->state), 2);
+        putInt(rec + 16, vbstate->checkpointId, 8);
+        putInt(rec + 24, vbstate->maxDeletedSeqno, 8);
+        putInt(rec + 32, vbstate->purgeSeqno, 8);
+    }
+    putInt(rec + 4, crc32buf(reinterpret_cast<uint8_t *>(rec + 8),
+                             sizeof(rec) - 8), 4);
+    buf.append(rec, sizeof(rec));
+}
+
+static inline int doFsync(int fd) {
+    int ret;
+    while ((ret = fsync(fd)) == -1 && (errno == EINTR)) {
+        /* Retry */
+    }
+    return ret;
+}
+
+static bool writeFully(int fd, const char *buf, size_t nbytes) {
+    while (nbytes > 0) {
+        ssize_t written = ::write(fd, buf, nbytes);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        nbytes -= written;
+        buf += written;
+    }
+    return true;
+}
+
+CouchVBStateJournal::CouchVBStateJournal(const std::string &p) :
+    path(p), fd(-1), numRecords(0)
+{
+    read(path, states);
+    // Drop the records left behind, and a tail cut short, before
+    // appending to it.
+    rewrite();
+}
+
+CouchVBStateJournal::~CouchVBStateJournal() {
+    if (fd != -1) {
+        ::close(fd);
+    }
+}
+
+bool CouchVBStateJournal::read(const std::string &path, vbucket_map_t &m) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+
+    char rec[RECORD_SIZE];
+    size_t offset = 0;
+    while (in.read(rec, sizeof(rec))) {
+        uint32_t crc = crc32buf(reinterpret_cast<uint8_t *>(rec + 8),
+                                sizeof(rec) - 8);
+        if (getInt(rec, 4) != RECORD_MAGIC || getInt(rec + 4, 4) != crc) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: the vbucket state journal "
+                "%s is corrupt at offset %llu, ignoring the rest of it",
+                path.c_str(), (unsigned long long)offset);
+            break;
+        }
+        uint16_t vbid = static_cast<uint16_t>(getInt(rec + 8, 2));
+        uint16_t state = static_cast<uint16_t>(getInt(rec + 10, 2));
+        if (state == 0) {
+            m.erase(vbid);
+        } else {
+            vbucket_state &vbstate = m[vbid];
+            vbstate.state = static_cast<vbucket_state_t>(state);
+            vbstate.checkpointId = getInt(rec + 16, 8);
+            vbstate.maxDeletedSeqno = getInt(rec + 24, 8);
+            vbstate.purgeSeqno = getInt(rec + 32, 8);
+        }
+        offset += sizeof(rec);
+    }
+    return true;
+}
+
+bool CouchVBStateJournal::rewrite() {
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+
+    std::string buf;
+    vbucket_map_t::iterator it = states.begin();
+    for (; it != states.end(); ++it) {
+        encodeRecord(buf, it->first, &it->second);
+    }
+
+    std::string tmp = path + ".new";
+    int tfd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (tfd == -1) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to create %s: %s",
+            tmp.c_str(), strerror(errno));
+        return false;
+    }
+    bool ok = writeFully(tfd, buf.data(), buf.size()) && doFsync(tfd) == 0;
+    ::close(tfd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to rewrite the vbucket "
+            "state journal %s: %s", path.c_str(), strerror(errno));
+        ::remove(tmp.c_str());
+        return false;
+    }
+
+    fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+    if (fd == -1) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to open %s: %s",
+            path.c_str(), strerror(errno));
+        return false;
+    }
+    numRecords = states.size();
+    return true;
+}
+
+bool CouchVBStateJournal::write(const std::string &buf) {
+    if (fd == -1 && !rewrite()) {
+        return false;
+    }
+    if (!writeFully(fd, buf.data(), buf.size()) || doFsync(fd) != 0) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to append to the vbucket "
+            "state journal %s: %s", path.c_str(), strerror(errno));
+        // What was written of it may be cut short; start it over.
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    numRecords += buf.size() / RECORD_SIZE;
+    return true;
+}
+
+bool CouchVBStateJournal::append(const vbucket_map_t &m) {
+    if (m.empty()) {
+        return true;
+    }
+    std::string buf;
+    vbucket_map_t::const_iterator it = m.begin();
+    for (; it != m.end(); ++it) {
+        encodeRecord(buf, it->first, &it->second);
+    }
+
+    LockHolder lh(mutex);
+    if (!write(buf)) {
+        // Their states are written to their files instead, which the
+        // records already in the journal mustn't override.
+        for (it = m.begin(); it != m.end(); ++it) {
+            states.erase(it->first);
+        }
+        rewrite();
+        return false;
+    }
+    for (it = m.begin(); it != m.end(); ++it) {
+        states[it->first] = it->second;
+    }
+    if (numRecords > 2 * states.size() + REWRITE_SLACK) {
+        rewrite();
+    }
+    return true;
+}
+
+bool CouchVBStateJournal::remove(uint16_t vbid) {
+    std::string buf;
+    encodeRecord(buf, vbid, NULL);
+
+    LockHolder lh(mutex);
+    if (states.find(vbid) == states.end()) {
+        return true;
+    }
+    bool rv = write(buf);
+    states.erase(vbid);
+    if (!rv) {
+        rewrite();
+    }
+    return rv;
+}
@@ -0,0 +1,94 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_COUCH_KVSTORE_COUCH_VBSTATE_JOURNAL_H_
+#define SRC_COUCH_KVSTORE_COUCH_VBSTATE_JOURNAL_H_ 1
+
+#include "config.h"
+
+#include <string>
+
+#include "common.h"
+#include "kvstore.h"
+#include "mutex.h"
+
+/**
+ * A journal of the states of a bucket's vbuckets, so a change of states
+ * is made durable by appending it to one small file and syncing it once,
+ * rather than by a commit of every vbucket file it touches.
+ *
+ * Each record is a vbucket's whole state with a crc of its own, and the
+ * last record of a vbucket is its state.  A record cut short by a crash
+ * ends the journal.  The journal is rewritten with the last record of
+ * each vbucket when it's opened and once it has grown to many times that
+ * size, to a new file that's synced and renamed over it.
+ *
+ * All the writers of a bucket share the journal, whatever shard they
+ * write for, as the number of shards may change between restarts.
+ */
+class CouchVBStateJournal {
+public:
+    //! The size of a record
+    static const size_t RECORD_SIZE = 40;
+
+    /**
+     * Open the journal at a path, taking over the states it already has.
+     */
+    explicit CouchVBStateJournal(const std::string &path);
+
+    ~CouchVBStateJournal();
+
+    /**
+     * Append the new states of some vbuckets and sync them.
+     *
+     * @return true if they were made durable; if not, the journal no
+     *         longer has a state for them
+     */
+    bool append(const vbucket_map_t &states);
+
+    /**
+     * Record that a vbucket is gone: its state is no longer journaled.
+     */
+    bool remove(uint16_t vbid);
+
+    //! The number of records in the file
+    size_t getNumRecords() {
+        LockHolder lh(mutex);
+        return numRecords;
+    }
+
+    /**
+     * Read the states journaled at a path.
+     *
+     * @return false if there's no journal there
+     */
+    static bool read(const std::string &path, vbucket_map_t &states);
+
+private:
+    bool write(const std::string &buf);
+    bool rewrite(void);
+
+    const std::string path;
+    Mutex mutex;
+    int fd;
+    vbucket_map_t states;
+    size_t numRecords;
+
+    DISALLOW_COPY_AND_ASSIGN(CouchVBStateJournal);
+};
+
+#endif  // SRC_COUCH_KVSTORE_COUCH_VBSTATE_JOURNAL_H_
@@ -1,6 +1,7 @@
 /* Crc - 32 BIT ANSI X3.66 CRC checksum files */
 
 #include "config.h"
+#include <pthread.h>
 #include <stdio.h>
 #include "crc32.h"
 
@@ -112,11 +113,46 @@ static uint32_t crc_32_tab[] = { /* CRC polynomial 0xedb88320 */
 
 #define UPDC32(octet, crc) (crc_32_tab[((crc) ^ (octet)) & 0xff] ^ ((crc) >> 8))
 
+/* crc_slice_tab[k][n] is the crc of the byte n followed by k zero bytes,  */
+/* which lets eight bytes be folded into the crc with eight independent  */
+/* lookups ("slicing-by-8") rather than eight dependent ones.  The bytes  */
+/* are still assembled one at a time, so the result is the same on any  */
+/* byte order and at any alignment.                                      */
+
+static uint32_t crc_slice_tab[8][256];
+static pthread_once_t crc_slice_once = PTHREAD_ONCE_INIT;
+
+static void init_slice_tab(void) {
+    int n, k;
+    for (n = 0; n < 256; ++n) {
+        uint32_t crc = crc_32_tab[n];
+        crc_slice_tab[0][n] = crc;
+        for (k = 1; k < 8; ++k) {
+            crc = crc_32_tab[crc & 0xff] ^ (crc >> 8);
+            crc_slice_tab[k][n] = crc;
+        }
+    }
+}
+
 uint32_t crc32buf(uint8_t *buf, size_t len) {
     register uint32_t oldcrc32;
 
+    pthread_once(&crc_slice_once, init_slice_tab);
     oldcrc32 = 0xFFFFFFFF;
 
+    for ( ; len >= 8; len -= 8, buf += 8) {
+        oldcrc32 ^= (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+            ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+        oldcrc32 = crc_slice_tab[7][oldcrc32 & 0xff] ^
+            crc_slice_tab[6][(oldcrc32 >> 8) & 0xff] ^
+            crc_slice_tab[5][(oldcrc32 >> 16) & 0xff] ^
+            crc_slice_tab[4][oldcrc32 >> 24] ^
+            crc_slice_tab[3][buf[4]] ^
+            crc_slice_tab[2][buf[5]] ^
+            crc_slice_tab[1][buf[6]] ^
+            crc_slice_tab[0][buf[7]];
+    }
+
     for ( ; len; --len, ++buf) {
         oldcrc32 = UPDC32(*buf, oldcrc32);
     }
@@ -0,0 +1,78 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include "defragmenter.h"
+#include "ep.h"
+#include "ep_engine.h"
+#include "memory_tracker.h"
+#include "stored-value.h"
+
+static const double STEP_FREQUENCY(0.5);
+
+class DefragmentingVisitor : public VBucketVisitor {
+public:
+
+    DefragmentingVisitor(size_t n) : maxBuckets(n), defragmenting(false) { }
+
+    bool visitBucket(RCPtr<VBucket> &vb) {
+        if (vb->ht.defragment(maxBuckets)) {
+            defragmenting = true;
+        }
+        return false;
+    }
+
+    bool isDefragmenting() { return defragmenting; }
+
+private:
+    size_t maxBuckets;
+    bool defragmenting;
+};
+
+bool Defragmenter::callback(Dispatcher &d, TaskId &t) {
+    EventuallyPersistentEngine &engine = store->getEPEngine();
+    Configuration &config = engine.getConfiguration();
+    EPStats &stats = engine.getEpStats();
+
+    size_t heap = 0;
+    size_t fragmentation = 0;
+    if (MemoryTracker::trackingMemoryAllocations()) {
+        MemoryTracker *tracker = MemoryTracker::getInstance();
+        heap = tracker->getTotalHeapBytes();
+        fragmentation = tracker->getFragmentation();
+        stats.allocatorHeapSize.set(heap);
+        stats.allocatorAllocatedSize.set(tracker->getTotalBytesAllocated());
+        stats.allocatorFragmentation.set(fragmentation);
+    }
+
+    // Keep going while a pass is under way, until it's done or the heap
+    // is back under the threshold.
+    bool fragmented = heap > 0 &&
+        fragmentation * 100 >= heap * config.getDefragmenterThreshold();
+    if (config.isDefragmenterEnabled() && fragmented &&
+        stats.warmupComplete.get()) {
+        DefragmentingVisitor dv(config.getDefragmenterChunkSize());
+        store->visit(dv);
+        if (dv.isDefragmenting()) {
+            d.snooze(t, STEP_FREQUENCY);
+            return true;
+        }
+    }
+
+    d.snooze(t, static_cast<double>(config.getDefragmenterInterval()));
+    return true;
+}
@@ -0,0 +1,50 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_DEFRAGMENTER_H_
+#define SRC_DEFRAGMENTER_H_ 1
+
+#include "config.h"
+
+#include <string>
+
+#include "dispatcher.h"
+
+class EventuallyPersistentStore;
+
+/**
+ * Sample the allocator's heap, allocated and fragmented bytes into the
+ * stats, and while too much of the heap is fragmented, move the items
+ * that have been around a while to new allocations so the allocator can
+ * give back the spans they were keeping mostly empty.
+ */
+class Defragmenter : public DispatcherCallback {
+public:
+
+    Defragmenter(EventuallyPersistentStore *s) : store(s) {}
+
+    bool callback(Dispatcher &d, TaskId &t);
+
+    std::string description() {
+        return std::string("Defragmenting the allocator's heap.");
+    }
+
+private:
+    EventuallyPersistentStore *store;
+};
+
+#endif  // SRC_DEFRAGMENTER_H_
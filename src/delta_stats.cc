@@ -0,0 +1,75 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "delta_stats.h"
+#include "locks.h"
+
+uint64_t DeltaStats::update(uint64_t cursor, const std::string &group,
+                            stat_map_t &current, stat_list_t &changed) {
+    LockHolder lh(mutex);
+    std::list<Cursor>::iterator it = cursors.end();
+    if (cursor != 0) {
+        for (it = cursors.begin(); it != cursors.end(); ++it) {
+            if (it->id == cursor) {
+                break;
+            }
+        }
+    }
+
+    if (it == cursors.end() || it->group != group) {
+        changed.assign(current.begin(), current.end());
+    } else {
+        // Both are sorted, so walk them side by side.
+        stat_map_t::const_iterator was = it->stats.begin();
+        stat_map_t::const_iterator now = current.begin();
+        while (was != it->stats.end() || now != current.end()) {
+            if (now == current.end() ||
+                (was != it->stats.end() && was->first < now->first)) {
+                changed.push_back(std::make_pair(was->first, std::string()));
+                ++was;
+            } else if (was == it->stats.end() || now->first < was->first) {
+                changed.push_back(*now);
+                ++now;
+            } else {
+                if (was->second != now->second) {
+                    changed.push_back(*now);
+                }
+                ++was;
+                ++now;
+            }
+        }
+    }
+
+    cursors.push_front(Cursor());
+    Cursor &latest(cursors.front());
+    latest.id = nextCursor++;
+    latest.group = group;
+    latest.stats.swap(current);
+    if (cursors.size() > MAX_CURSORS) {
+        cursors.pop_back();
+    }
+    return latest.id;
+}
+
+void DeltaStats::collect(const char *key, const uint16_t klen,
+                         const char *val, const uint32_t vlen,
+                         const void *cookie) {
+    stat_map_t *stats = static_cast<stat_map_t*>(const_cast<void*>(cookie));
+    (*stats)[std::string(key, klen)] = std::string(val, vlen);
+}
@@ -0,0 +1,87 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_DELTA_STATS_H_
+#define SRC_DELTA_STATS_H_ 1
+
+#include "config.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "mutex.h"
+
+typedef std::map<std::string, std::string> stat_map_t;
+typedef std::vector<std::pair<std::string, std::string> > stat_list_t;
+
+/**
+ * The stats last sent to the clients polling a group of stats for what
+ * changed, each kept under a cursor handed to the client with them.
+ *
+ * Only the last MAX_CURSORS are kept, so a client whose cursor has been
+ * dropped, or that polls another group with it, gets the whole group
+ * again with a new cursor.
+ */
+class DeltaStats {
+public:
+    //! The cursors kept
+    static const size_t MAX_CURSORS = 8;
+
+    DeltaStats() : nextCursor(1) { }
+
+    /**
+     * Get the stats that changed since a cursor, and become the cursor's
+     * next poll.
+     *
+     * @param cursor the cursor the client was given, or 0 for all stats
+     * @param group the group of stats they are
+     * @param current the stats now, which are taken
+     * @param changed where to put the stats that are new or changed since
+     *        the cursor, and those that went away with an empty value
+     * @return the cursor of the stats now
+     */
+    uint64_t update(uint64_t cursor, const std::string &group,
+                    stat_map_t &current, stat_list_t &changed);
+
+    /**
+     * An ADD_STAT that puts the stats it's given in the stat_map_t that's
+     * its cookie.
+     */
+    static void collect(const char *key, const uint16_t klen,
+                        const char *val, const uint32_t vlen,
+                        const void *cookie);
+
+private:
+    struct Cursor {
+        uint64_t id;
+        std::string group;
+        stat_map_t stats;
+    };
+
+    Mutex mutex;
+    //! The cursors, the latest first
+    std::list<Cursor> cursors;
+    uint64_t nextCursor;
+
+    DISALLOW_COPY_AND_ASSIGN(DeltaStats);
+};
+
+#endif  // SRC_DELTA_STATS_H_
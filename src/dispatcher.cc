@@ -87,6 +87,9 @@ void Task::snooze(const double secs, bool first) {
 
 void Dispatcher::start() {
     assert(state == dispatcher_running);
+    if (executor) {
+        return;
+    }
     if(pthread_create(&thread, NULL, launch_dispatcher_thread, this) != 0) {
         std::stringstream ss;
         ss << getName().c_str() << ": Initialization error!!!";
@@ -166,7 +169,8 @@ void Dispatcher::run() {
                 continue;
             }
 
-            if (less_tv(tv, task->waketime)) {
+            bool idle = less_tv(tv, task->waketime);
+            if (idle) {
                 idleTask->setWaketime(task->waketime);
                 idleTask->setDispatcherNotifications(notifications.get());
                 task = static_cast<Task *>(idleTask.get());
@@ -175,10 +179,12 @@ void Dispatcher::run() {
                 // Otherwise, do the normal thing.
                 popNext();
                 taskDesc = task->getName();
+                waitHisto.add(usec_since_tv(task->waketime, tv));
             }
             tlh.unlock();
 
             taskStart = gethrtime();
+            hrtime_t cpuStart = gethrcputime();
             lh.unlock();
             rel_time_t startReltime = ep_current_time();
             try {
@@ -198,6 +204,10 @@ void Dispatcher::run() {
             running_task = false;
 
             hrtime_t runtime((gethrtime() - taskStart) / 1000);
+            if (!idle) {
+                runHisto.add(runtime);
+                cpuTime.incr((gethrcputime() - cpuStart) / 1000);
+            }
             JobLogEntry jle(taskDesc, runtime, startReltime);
             joblog.add(jle);
             if (runtime > task->maxExpectedDuration()) {
@@ -222,10 +232,110 @@ void Dispatcher::stop(bool force) {
     state = dispatcher_stopping;
     notify();
     lh.unlock();
-    pthread_join(thread, NULL);
+    if (executor) {
+        stopExecutorTasks();
+    } else {
+        pthread_join(thread, NULL);
+    }
     LOG(EXTENSION_LOG_INFO, "%s: Stopped", getName().c_str());
 }
 
+void Dispatcher::runOnExecutor(DispatcherExecutor *ex, task_type_t group) {
+    LockHolder lh(mutex);
+    assert(ex && empty() && executorTasks.empty());
+    executor = ex;
+    executorGroup = group;
+}
+
+void Dispatcher::stopExecutorTasks() {
+    LockHolder lh(mutex);
+    while (runningTasks > 0) {
+        mutex.wait();
+    }
+    std::map<size_t, TaskId> tasks;
+    tasks.swap(executorTasks);
+    lh.unlock();
+
+    // Take the tasks back from the pool and finish them off like our own
+    // thread would when exiting.
+    std::map<size_t, TaskId>::iterator it = tasks.begin();
+    for (; it != tasks.end(); ++it) {
+        executor->cancelDispatcherTask(it->first);
+    }
+    lh.lock();
+    for (it = tasks.begin(); it != tasks.end(); ++it) {
+        futureQueue.push(it->second);
+    }
+    lh.unlock();
+
+    completeNonDaemonTasks();
+    lh.lock();
+    state = dispatcher_stopped;
+    notify();
+}
+
+bool Dispatcher::runTask(TaskId &task, struct timeval &waketime) {
+    LockHolder lh(mutex);
+    LockHolder tlh(task->mutex);
+    if (state != dispatcher_running || task->state == task_dead) {
+        tlh.unlock();
+        if (state == dispatcher_running) {
+            executorTasks.erase(task->executorTaskId);
+        }
+        return false;
+    }
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    waitHisto.add(usec_since_tv(task->waketime, now));
+    tlh.unlock();
+    taskDesc = task->getName();
+    taskStart = gethrtime();
+    hrtime_t cpuStart = gethrcputime();
+    running_task = true;
+    ++runningTasks;
+    lh.unlock();
+
+    rel_time_t startReltime = ep_current_time();
+    bool again = false;
+    try {
+        again = task->run(*this, task);
+    } catch (std::exception& e) {
+        LOG(EXTENSION_LOG_WARNING,
+            "%s: Exception caught in task \"%s\": %s",
+            getName().c_str(), task->getName().c_str(), e.what());
+    } catch(...) {
+        LOG(EXTENSION_LOG_WARNING,
+            "%s: Fatal exception caught in task \"%s\"\n",
+            getName().c_str(), task->getName().c_str());
+    }
+    hrtime_t runtime((gethrtime() - taskStart) / 1000);
+    runHisto.add(runtime);
+    cpuTime.incr((gethrcputime() - cpuStart) / 1000);
+
+    lh.lock();
+    JobLogEntry jle(task->getName(), runtime, startReltime);
+    joblog.add(jle);
+    if (runtime > task->maxExpectedDuration()) {
+        slowjobs.add(jle);
+    }
+    if (--runningTasks == 0) {
+        running_task = false;
+        noTask();
+    }
+    if (state != dispatcher_running) {
+        // stop() waits for the running tasks, it takes the rest back.
+        notify();
+        return false;
+    }
+    if (!again) {
+        executorTasks.erase(task->executorTaskId);
+        return false;
+    }
+    LockHolder wlh(task->mutex);
+    waketime = task->waketime;
+    return true;
+}
+
 void Dispatcher::schedule(shared_ptr<DispatcherCallback> callback,
                           TaskId *outtid,
                           const Priority &priority,
@@ -250,6 +360,15 @@ void Dispatcher::schedule(shared_ptr<DispatcherCallback> callback,
     LOG(EXTENSION_LOG_DEBUG, "%s: Schedule a task \"%s\"",
         getName().c_str(), task->getName().c_str());
 
+    if (executor) {
+        // Still under our lock, so the task can't run before it's known.
+        task->executorTaskId = executor->scheduleDispatcherTask(&engine, *this,
+                                                                task, priority,
+                                                                executorGroup);
+        executorTasks[task->executorTaskId] = task;
+        return;
+    }
+
     futureQueue.push(task);
     notify();
 }
@@ -261,18 +380,37 @@ void Dispatcher::wake(TaskId &task) {
     LOG(EXTENSION_LOG_DEBUG, "%s: Wake a task \"%s\"",
         getName().c_str(), task->getName().c_str());
     notify();
+    if (executor) {
+        lh.unlock();
+        executor->wakeDispatcherTask(task->executorTaskId);
+    }
 }
 
 void Dispatcher::snooze(TaskId &t, double sleeptime) {
     LOG(EXTENSION_LOG_DEBUG, "%s: Snooze a task \"%s\"",
         getName().c_str(), t->getName().c_str());
     t->snooze(sleeptime);
+    if (executor) {
+        // A running task picks its waketime up once done; a waiting one
+        // has to be moved in the pool's queue.
+        if (sleeptime == 0) {
+            executor->wakeDispatcherTask(t->executorTaskId);
+        } else {
+            executor->snoozeDispatcherTask(t->executorTaskId, sleeptime);
+        }
+    }
 }
 
 void Dispatcher::cancel(TaskId &t) {
     LOG(EXTENSION_LOG_DEBUG, "%s: Cancel a task \"%s\"",
         getName().c_str(), t->getName().c_str());
     t->cancel();
+    if (executor) {
+        LockHolder lh(mutex);
+        executorTasks.erase(t->executorTaskId);
+        lh.unlock();
+        executor->cancelDispatcherTask(t->executorTaskId);
+    }
 }
 
 void Dispatcher::reschedule(TaskId &task) {
@@ -21,6 +21,7 @@
 #include "config.h"
 
 #include <deque>
+#include <map>
 #include <queue>
 #include <stdexcept>
 #include <string>
@@ -28,9 +29,11 @@
 
 #include "atomic.h"
 #include "common.h"
+#include "histo.h"
 #include "locks.h"
 #include "priority.h"
 #include "ringbuffer.h"
+#include "tasks.h"
 
 #define JOB_LOG_SIZE 20
 
@@ -146,7 +149,7 @@ protected:
          bool isDaemon = true, bool completeBeforeShutdown = false) :
         RCValue(), callback(cb), priority(p),
         state(task_running), isDaemonTask(isDaemon),
-        blockShutdown(completeBeforeShutdown)
+        blockShutdown(completeBeforeShutdown), executorTaskId(0)
     {
         snooze(sleeptime, true);
     }
@@ -171,6 +174,7 @@ protected:
     }
 
     friend class Dispatcher;
+    friend class DispatcherTask;
     struct timeval waketime;
     shared_ptr<DispatcherCallback> callback;
     int priority;
@@ -180,6 +184,8 @@ protected:
 
     // Some of the tasks must complete during shutdown
     bool blockShutdown;
+    // The task running it on the ExecutorPool, if its dispatcher uses one
+    size_t executorTaskId;
 
 private:
     DISALLOW_COPY_AND_ASSIGN(Task);
@@ -307,6 +313,33 @@ private:
     const bool running_task;
 };
 
+/**
+ * Runs the tasks of the dispatchers that don't have a thread of their own.
+ * Each dispatcher task is run by calling Dispatcher::runTask() until that
+ * returns false.
+ */
+class DispatcherExecutor {
+public:
+    virtual ~DispatcherExecutor() { }
+
+    /**
+     * Schedule a task of a dispatcher on a group of threads.  All the
+     * tasks of a dispatcher must go to the same thread of the group.
+     *
+     * @return the id to wake, snooze or cancel the task with
+     */
+    virtual size_t scheduleDispatcherTask(EventuallyPersistentEngine *e,
+                                          Dispatcher &d, TaskId &task,
+                                          const Priority &p,
+                                          task_type_t group) = 0;
+
+    virtual void wakeDispatcherTask(size_t id) = 0;
+
+    virtual void snoozeDispatcherTask(size_t id, double secs) = 0;
+
+    virtual void cancelDispatcherTask(size_t id) = 0;
+};
+
 /**
  * Schedule and run tasks in another thread.
  */
@@ -316,7 +349,8 @@ public:
         notifications(0), joblog(JOB_LOG_SIZE), slowjobs(JOB_LOG_SIZE),
         idleTask(new IdleTask), state(dispatcher_running), running_task(false),
         hasWokenTask(false), forceTermination(false), engine(e),
-        name(desc ? desc : "Dispatcher")
+        name(desc ? desc : "Dispatcher"), executor(NULL),
+        executorGroup(AUXIO_TASK_IDX), runningTasks(0), cpuTime(0)
     {
         noTask();
     }
@@ -354,6 +388,22 @@ public:
      * Start this dispatcher's thread.
      */
     void start();
+
+    /**
+     * Run the tasks on the threads of a group of an executor instead of on
+     * a thread of our own.  The tasks still run one at a time; must be
+     * called before anything is scheduled.
+     */
+    void runOnExecutor(DispatcherExecutor *ex, task_type_t group);
+
+    /**
+     * Run a task on behalf of its DispatcherTask.
+     *
+     * @param task the task to run
+     * @param waketime set to when the task wants to run again
+     * @return true if the task should run again
+     */
+    bool runTask(TaskId &task, struct timeval &waketime);
     /**
      * Stop this dispatcher.
      * @param force the flag indicating the force termination or not.
@@ -396,6 +446,21 @@ public:
 
     const std::string &getName() { return name; }
 
+    /**
+     * Get the histogram of how long (usec) due tasks waited to be run.
+     */
+    const Histogram<hrtime_t> &getWaitHisto() const { return waitHisto; }
+
+    /**
+     * Get the histogram of task run times (usec).
+     */
+    const Histogram<hrtime_t> &getRunHisto() const { return runHisto; }
+
+    /**
+     * Get the CPU time (usec) the tasks have used.
+     */
+    hrtime_t getCPUTime() const { return cpuTime.get(); }
+
 private:
 
     friend class IdleTask;
@@ -411,6 +476,8 @@ private:
         mutex.notify();
     }
 
+    void stopExecutorTasks();
+
     /**
      * Complete all the non-daemon tasks before stopping the dispatcher
      */
@@ -450,6 +517,16 @@ private:
 
     EventuallyPersistentEngine &engine;
     std::string name;
+
+    DispatcherExecutor *executor;
+    task_type_t executorGroup;
+    //! The tasks scheduled on the ExecutorPool, by executor task id
+    std::map<size_t, TaskId> executorTasks;
+    size_t runningTasks;
+
+    Histogram<hrtime_t> waitHisto;
+    Histogram<hrtime_t> runHisto;
+    Atomic<hrtime_t> cpuTime;
 };
 
 #endif  // SRC_DISPATCHER_H_
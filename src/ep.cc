@@ -31,6 +31,8 @@
 
 #include "access_scanner.h"
 #include "checkpoint_remover.h"
+#include "compactor.h"
+#include "defragmenter.h"
 #include "dispatcher.h"
 #include "ep.h"
 #include "ep_engine.h"
@@ -40,7 +42,11 @@
 #include "kvshard.h"
 #include "kvstore.h"
 #include "locks.h"
+#include "memory_snapshot.h"
+#include "range_scan.h"
+#include "tapfanout.h"
 #include "warmup.h"
+#include "workload_monitor.h"
 
 class StatsValueChangeListener : public ValueChangedListener {
 public:
@@ -59,6 +65,10 @@ public:
             stats.mem_low_wat.set(value);
         } else if (key.compare("mem_high_wat") == 0) {
             stats.mem_high_wat.set(value);
+        } else if (key.compare("pending_ops_limit") == 0) {
+            stats.pendingOpsLimit.set(value);
+        } else if (key.compare("pending_ops_wake_batch") == 0) {
+            stats.pendingOpsWakeBatch.set(value);
         } else if (key.compare("tap_throttle_threshold") == 0) {
             stats.tapThrottleThreshold.set(static_cast<double>(value) / 100.0);
         } else if (key.compare("warmup_min_memory_threshold") == 0) {
@@ -93,6 +103,16 @@ public:
             store.setItemExpiryWindow(value);
         } else if (key.compare("max_txn_size") == 0) {
             store.setTransactionSize(value);
+        } else if (key.compare("group_commit_window") == 0) {
+            store.setGroupCommitWindow(value);
+        } else if (key.compare("hlc_max_drift") == 0) {
+            HybridLogicalClock::setMaxDrift(value);
+        } else if (key.compare("bg_fetch_batch_size") == 0) {
+            store.setBGFetchBatchSize(value);
+        } else if (key.compare("bg_fetch_latency_budget") == 0) {
+            store.setBGFetchLatencyBudget(value);
+        } else if (key.compare("bg_fetch_readahead") == 0) {
+            store.setBGFetchReadahead(value);
         } else if (key.compare("exp_pager_stime") == 0) {
             store.setExpiryPagerSleeptime(value);
         } else if (key.compare("alog_sleep_time") == 0) {
@@ -106,6 +126,24 @@ public:
             store.getEPEngine().getTapThrottle().setQueueCap(value);
         } else if (key.compare("tap_throttle_cap_pcnt") == 0) {
             store.getEPEngine().getTapThrottle().setCapPercent(value);
+        } else if (key.compare("tap_apply_queue_cap") == 0) {
+            store.getEPEngine().getTapThrottle().setApplyQueueCap(value);
+        } else if (key.compare("getl_max_waiters") == 0) {
+            store.getGetlWaitQueue().setMaxWaiters(value);
+        } else if (key.compare("max_size") == 0) {
+            store.memoryQuotaChanged(value);
+        } else if (key.compare("vb_mem_quota") == 0) {
+            VBucket::setMemQuota(value);
+        } else {
+            LOG(EXTENSION_LOG_WARNING,
+                "Failed to change value for unknown variable, %s\n",
+                key.c_str());
+        }
+    }
+
+    virtual void booleanValueChanged(const std::string &key, bool value) {
+        if (key.compare("tap_throttle_pacing") == 0) {
+            store.getEPEngine().getTapThrottle().setPacing(value);
         } else {
             LOG(EXTENSION_LOG_WARNING,
                 "Failed to change value for unknown variable, %s\n",
@@ -117,49 +155,202 @@ private:
     EventuallyPersistentStore &store;
 };
 
+//! The seconds between the checks for expired getl locks
+static const double GETL_WAIT_INTERVAL = 1;
+
+/**
+ * Wakes the getl requests parked on locks that expired, every
+ * GETL_WAIT_INTERVAL.
+ */
+class GetlWaitNotifier : public DispatcherCallback {
+public:
+    GetlWaitNotifier(EventuallyPersistentStore *s) : store(s) { }
+
+    bool callback(Dispatcher &d, TaskId &t) {
+        store->notifyGetlExpiries();
+        d.snooze(t, GETL_WAIT_INTERVAL);
+        return true;
+    }
+
+    std::string description() {
+        return std::string("Waking getl requests on expired locks.");
+    }
+
+private:
+    EventuallyPersistentStore *store;
+};
+
+//! The seconds between the epoch reclaimer's runs
+static const double EPOCH_RECLAIMER_INTERVAL = 1;
+
+/**
+ * Moves the epoch along every EPOCH_RECLAIMER_INTERVAL, so the vbuckets
+ * unmapped are freed once the ops that peeked at them are done, even
+ * on a bucket that hardly retires anything else.
+ */
+class EpochReclaimer : public DispatcherCallback {
+public:
+    bool callback(Dispatcher &d, TaskId &t) {
+        EpochManager::reclaim();
+        d.snooze(t, EPOCH_RECLAIMER_INTERVAL);
+        return true;
+    }
+
+    std::string description() {
+        return std::string("Reclaiming retired objects.");
+    }
+};
+
+/**
+ * Adds the keys dumped from disk to a bloom filter.
+ */
+class FilterRebuildCallback : public Callback<GetValue> {
+public:
+    FilterRebuildCallback(BloomFilter &bf) : filter(bf) {}
+
+    void callback(GetValue &val) {
+        Item *i = val.getValue();
+        if (i != NULL) {
+            filter.add(i->getKey());
+            delete i;
+            val.setValue(NULL);
+        }
+    }
+
+private:
+    BloomFilter &filter;
+};
+
+/**
+ * Free the items of a deleted vbucket a chunk at a time, letting the
+ * dispatcher's other tasks run between the chunks.
+ */
 class VBucketMemoryDeletionCallback : public DispatcherCallback {
 public:
-    VBucketMemoryDeletionCallback(EventuallyPersistentStore *e, RCPtr<VBucket> &vb) :
-    ep(e), vbucket(vb) {}
+    VBucketMemoryDeletionCallback(EventuallyPersistentStore *e, RCPtr<VBucket> &vb,
+                                  size_t chunk) :
+    ep(e), vbucket(vb), vbid(vb->getId()), chunkSize(chunk), start(0) {
+        ++ep->getEPEngine().getEpStats().vbucketMemDeletionsPending;
+    }
 
     bool callback(Dispatcher &, TaskId &) {
-        vbucket->ht.clear();
+        if (start == 0) {
+            start = gethrtime();
+        }
+        if (!vbucket->ht.clearSome(chunkSize)) {
+            return true;
+        }
         vbucket.reset();
+        EPStats &stats = ep->getEPEngine().getEpStats();
+        stats.memVBDelHisto.add((gethrtime() - start) / 1000);
+        --stats.vbucketMemDeletionsPending;
         return false;
     }
 
     std::string description() {
         std::stringstream ss;
-        ss << "Removing (dead) vbucket " << vbucket->getId() << " from memory";
+        ss << "Removing (dead) vbucket " << vbid << " from memory";
         return ss.str();
     }
 
 private:
     EventuallyPersistentStore *ep;
     RCPtr<VBucket> vbucket;
+    uint16_t vbid;
+    size_t chunkSize;
+    hrtime_t start;
+};
+
+/**
+ * Free the items a flush took out of a vbucket's hash table, a chunk at
+ * a time like VBucketMemoryDeletionCallback.
+ */
+class FlushAllMemoryCallback : public DispatcherCallback {
+public:
+    FlushAllMemoryCallback(EPStats &st, HashTable *h, uint16_t vb,
+                           size_t chunk) :
+        stats(st), ht(h), vbid(vb), chunkSize(chunk) {
+        ++stats.flushAllMemPending;
+    }
+
+    ~FlushAllMemoryCallback() {
+        // Shut down before it was done.
+        delete ht;
+    }
+
+    bool callback(Dispatcher &, TaskId &) {
+        if (!ht->clearSome(chunkSize)) {
+            return true;
+        }
+        delete ht;
+        ht = NULL;
+        --stats.flushAllMemPending;
+        return false;
+    }
+
+    std::string description() {
+        std::stringstream ss;
+        ss << "Removing flushed items of vbucket " << vbid << " from memory";
+        return ss.str();
+    }
+
+private:
+    EPStats &stats;
+    HashTable *ht;
+    uint16_t vbid;
+    size_t chunkSize;
 };
 
 EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine &theEngine) :
     engine(theEngine), stats(engine.getEpStats()),
     vbMap(theEngine.getConfiguration(), *this),
-    accessLog(engine.getConfiguration().getAlogPath(),
-              engine.getConfiguration().getAlogBlockSize()),
-    diskFlushAll(false), bgFetchDelay(0), statsSnapshotTaskId(0),
+    diskFlushAll(false), flushAllCount(0),
+    uncompletedFlushes(vbMap.getNumShards()), bgFetchDelay(0),
+    fullEviction(theEngine.getConfiguration().getItemEvictionPolicy()
+                 .compare("full_eviction") == 0),
+    ephemeral(theEngine.getConfiguration().getBucketType()
+              .compare("ephemeral") == 0),
+    replicaValuePolicy(REPLICA_VALUES_RESIDENT),
+    statsSnapshotTaskId(0),
     lastTransTimePerItem(0),snapshotVBState(false)
 {
     Configuration &config = engine.getConfiguration();
-    storageProperties = new StorageProperties(true, true, true, true);
+    if (config.getReplicaValuePolicy().compare("eject") == 0) {
+        replicaValuePolicy = REPLICA_VALUES_EJECTED;
+    } else if (config.getReplicaValuePolicy().compare("compress") == 0) {
+        replicaValuePolicy = REPLICA_VALUES_COMPRESSED;
+    }
+    // Without a store, vbuckets are only ever backfilled from memory.
+    storageProperties = new StorageProperties(!ephemeral, !ephemeral,
+                                              !ephemeral, !ephemeral);
 
     IOManager::get()->registerBucket(ObjectRegistry::getCurrentEngine());
 
-    auxUnderlying = KVStoreFactory::create(stats, config, true);
-    assert(auxUnderlying);
+    if (ephemeral) {
+        // Evicted items are gone, so misses never go to disk, and there's
+        // nothing to warm up from.
+        fullEviction = false;
+        config.setWarmup(false);
+    }
     auxIODispatcher = new Dispatcher(theEngine, "AUXIO_Dispatcher");
     nonIODispatcher = new Dispatcher(theEngine, "NONIO_Dispatcher");
+    if (config.isDispatchersOnExecutor()) {
+        auxIODispatcher->runOnExecutor(IOManager::get(), AUXIO_TASK_IDX);
+        nonIODispatcher->runOnExecutor(IOManager::get(), NONIO_TASK_IDX);
+    }
 
     stats.memOverhead = sizeof(EventuallyPersistentStore);
 
-    if (config.getConflictResolutionType().compare("seqno") == 0) {
+    size_t ioWeights[NUM_IO_CLASSES];
+    ioWeights[IO_CLASS_BGFETCH] = config.getIoSchedBgfetchWeight();
+    ioWeights[IO_CLASS_FLUSHER] = config.getIoSchedFlusherWeight();
+    ioWeights[IO_CLASS_BACKFILL] = config.getIoSchedBackfillWeight();
+    ioWeights[IO_CLASS_BACKGROUND] = config.getIoSchedBackgroundWeight();
+    ioScheduler.configure(config.getIoSchedSlots(), ioWeights);
+
+    if (config.getConflictResolutionType().compare("lww") == 0) {
+        conflictResolver = new LWWResolution(stats);
+    } else {
         conflictResolver = new SeqBasedResolution();
     }
 
@@ -171,9 +362,23 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
     config.addValueChangedListener("max_txn_size",
                                    new EPStoreValueChangeListener(*this));
 
+    setGroupCommitWindow(config.getGroupCommitWindow());
+    config.addValueChangedListener("group_commit_window",
+                                   new EPStoreValueChangeListener(*this));
+
+    HybridLogicalClock::setMaxDrift(config.getHlcMaxDrift());
+    config.addValueChangedListener("hlc_max_drift",
+                                   new EPStoreValueChangeListener(*this));
+
     stats.setMaxDataSize(config.getMaxSize());
     config.addValueChangedListener("max_size",
                                    new StatsValueChangeListener(stats));
+    config.addValueChangedListener("max_size",
+                                   new EPStoreValueChangeListener(*this));
+
+    VBucket::setMemQuota(config.getVbMemQuota());
+    config.addValueChangedListener("vb_mem_quota",
+                                   new EPStoreValueChangeListener(*this));
 
     stats.mem_low_wat.set(config.getMemLowWat());
     config.addValueChangedListener("mem_low_wat",
@@ -183,6 +388,14 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
     config.addValueChangedListener("mem_high_wat",
                                    new StatsValueChangeListener(stats));
 
+    stats.pendingOpsLimit.set(config.getPendingOpsLimit());
+    config.addValueChangedListener("pending_ops_limit",
+                                   new StatsValueChangeListener(stats));
+
+    stats.pendingOpsWakeBatch.set(config.getPendingOpsWakeBatch());
+    config.addValueChangedListener("pending_ops_wake_batch",
+                                   new StatsValueChangeListener(stats));
+
     stats.tapThrottleThreshold.set(static_cast<double>(config.getTapThrottleThreshold())
                                    / 100.0);
     config.addValueChangedListener("tap_throttle_threshold",
@@ -193,11 +406,31 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
                                    new EPStoreValueChangeListener(*this));
     config.addValueChangedListener("tap_throttle_cap_pcnt",
                                    new EPStoreValueChangeListener(*this));
+    config.addValueChangedListener("tap_apply_queue_cap",
+                                   new EPStoreValueChangeListener(*this));
+    config.addValueChangedListener("tap_throttle_pacing",
+                                   new EPStoreValueChangeListener(*this));
+
+    getlWaiters.setMaxWaiters(config.getGetlMaxWaiters());
+    config.addValueChangedListener("getl_max_waiters",
+                                   new EPStoreValueChangeListener(*this));
 
     setBGFetchDelay(config.getBgFetchDelay());
     config.addValueChangedListener("bg_fetch_delay",
                                    new EPStoreValueChangeListener(*this));
 
+    setBGFetchBatchSize(config.getBgFetchBatchSize());
+    config.addValueChangedListener("bg_fetch_batch_size",
+                                   new EPStoreValueChangeListener(*this));
+
+    setBGFetchLatencyBudget(config.getBgFetchLatencyBudget());
+    config.addValueChangedListener("bg_fetch_latency_budget",
+                                   new EPStoreValueChangeListener(*this));
+
+    setBGFetchReadahead(config.getBgFetchReadahead());
+    config.addValueChangedListener("bg_fetch_readahead",
+                                   new EPStoreValueChangeListener(*this));
+
     stats.warmupMemUsedCap.set(static_cast<double>(config.getWarmupMinMemoryThreshold()) / 100.0);
     config.addValueChangedListener("warmup_min_memory_threshold",
                                    new StatsValueChangeListener(stats));
@@ -214,6 +447,7 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
         RCPtr<VBucket> vb(new VBucket(0, vbucket_state_active, stats,
                                       engine.getCheckpointConfig(), vbMap.getShard(0)));
         vbMap.addBucket(vb);
+        vbMap.getShard(0)->vbStateChanged(0, vbucket_state_active);
     }
 
     // @todo - Ideally we should run the warmup thread in it's own
@@ -225,12 +459,13 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
 
 class WarmupWaitListener : public WarmupStateListener {
 public:
-    WarmupWaitListener(Warmup &f, bool wfw) :
-        warmup(f), waitForWarmup(wfw) { }
+    WarmupWaitListener(Warmup &f, bool wfw, EPStats &st) :
+        warmup(f), waitForWarmup(wfw), stats(st) { }
 
     virtual void stateChanged(const int, const int to) {
         if (waitForWarmup) {
-            if (to == WarmupState::Done) {
+            // Traffic let in after the keys doesn't wait for the values.
+            if (to == WarmupState::Done || stats.warmupTraffic.get()) {
                 LockHolder lh(syncobject);
                 syncobject.notify();
             }
@@ -246,7 +481,7 @@ public:
         int currstate = warmup.getState().getState();
 
         if (waitForWarmup) {
-            if (currstate == WarmupState::Done) {
+            if (currstate == WarmupState::Done || stats.warmupTraffic.get()) {
                 return;
             }
         } else if (currstate != WarmupState::Initialize) {
@@ -259,6 +494,7 @@ public:
 private:
     Warmup &warmup;
     bool waitForWarmup;
+    EPStats &stats;
     SyncObject syncobject;
 };
 
@@ -282,11 +518,16 @@ bool EventuallyPersistentStore::initialize() {
     }
     startNonIODispatcher();
 
-    WarmupWaitListener warmupListener(*warmupTask, config.isWaitforwarmup());
-    warmupTask->addWarmupStateListener(&warmupListener);
-    warmupTask->start();
-    warmupListener.wait();
-    warmupTask->removeWarmupStateListener(&warmupListener);
+    if (ephemeral) {
+        warmupCompleted();
+    } else {
+        WarmupWaitListener warmupListener(*warmupTask, config.isWaitforwarmup(),
+                                          stats);
+        warmupTask->addWarmupStateListener(&warmupListener);
+        warmupTask->start();
+        warmupListener.wait();
+        warmupTask->removeWarmupStateListener(&warmupListener);
+    }
 
     if (config.isFailpartialwarmup() && stats.warmOOM > 0) {
         LOG(EXTENSION_LOG_WARNING,
@@ -297,8 +538,10 @@ bool EventuallyPersistentStore::initialize() {
 
     size_t expiryPagerSleeptime = config.getExpPagerStime();
 
-    shared_ptr<DispatcherCallback> cb(new ItemPager(this, stats));
-    nonIODispatcher->schedule(cb, NULL, Priority::ItemPagerPriority, 10);
+    itemPager.reset(new ItemPager(this, stats));
+    shared_ptr<DispatcherCallback> cb(itemPager);
+    nonIODispatcher->schedule(cb, &itemPagerTask, Priority::ItemPagerPriority,
+                              10);
 
     setExpiryPagerSleeptime(expiryPagerSleeptime);
     config.addValueChangedListener("exp_pager_stime",
@@ -307,6 +550,26 @@ bool EventuallyPersistentStore::initialize() {
     shared_ptr<DispatcherCallback> htr(new HashtableResizer(this));
     nonIODispatcher->schedule(htr, NULL, Priority::HTResizePriority, 10);
 
+    if (engine.getWorkLoadPolicy().isAuto()) {
+        double interval = config.getWorkloadAutoInterval();
+        shared_ptr<DispatcherCallback> wlm(new WorkLoadMonitor(engine,
+                                                               interval));
+        nonIODispatcher->schedule(wlm, NULL, Priority::WorkLoadMonitorPriority,
+                                  interval);
+    }
+
+    shared_ptr<DispatcherCallback> defrag(new Defragmenter(this));
+    nonIODispatcher->schedule(defrag, NULL, Priority::DefragmenterPriority,
+                              config.getDefragmenterInterval());
+
+    shared_ptr<DispatcherCallback> gwn(new GetlWaitNotifier(this));
+    nonIODispatcher->schedule(gwn, NULL, Priority::GetlWaitPriority,
+                              GETL_WAIT_INTERVAL);
+
+    shared_ptr<DispatcherCallback> reclaimer(new EpochReclaimer());
+    nonIODispatcher->schedule(reclaimer, NULL, Priority::EpochReclaimerPriority,
+                              EPOCH_RECLAIMER_INTERVAL);
+
     size_t checkpointRemoverInterval = config.getChkRemoverStime();
     shared_ptr<DispatcherCallback> chk_cb(new ClosedUnrefCheckpointRemover(this,
                                                                            stats,
@@ -321,19 +584,24 @@ EventuallyPersistentStore::~EventuallyPersistentStore() {
     stopWarmup();
     stopFlusher();
     stopBgFetcher();
+    stopCompactor();
+    if (!stats.forceShutdown) {
+        writeMemorySnapshots();
+    }
 
     IOManager::get()->cancel(statsSnapshotTaskId);
     IOManager::get()->cancel(mLogCompactorTaskId);
-    IOManager::get()->unregisterBucket(ObjectRegistry::getCurrentEngine());
 
+    // The dispatchers may run their tasks on the bucket's worker threads.
     auxIODispatcher->stop(stats.forceShutdown);
     nonIODispatcher->stop(stats.forceShutdown);
 
+    IOManager::get()->unregisterBucket(ObjectRegistry::getCurrentEngine());
+
     delete conflictResolver;
     delete warmupTask;
     delete auxIODispatcher;
     delete nonIODispatcher;
-    delete auxUnderlying;
     delete storageProperties;
 }
 
@@ -354,6 +622,9 @@ Warmup* EventuallyPersistentStore::getWarmup(void) const {
 }
 
 bool EventuallyPersistentStore::startFlusher() {
+    if (ephemeral) {
+        return true;
+    }
     for (uint16_t i = 0; i < vbMap.numShards; ++i) {
         Flusher *flusher = vbMap.shards[i]->getFlusher();
         flusher->start();
@@ -362,6 +633,9 @@ bool EventuallyPersistentStore::startFlusher() {
 }
 
 void EventuallyPersistentStore::stopFlusher() {
+    if (ephemeral) {
+        return;
+    }
     for (uint16_t i = 0; i < vbMap.numShards; i++) {
         Flusher *flusher = vbMap.shards[i]->getFlusher();
         bool rv = flusher->stop(stats.forceShutdown);
@@ -373,6 +647,9 @@ void EventuallyPersistentStore::stopFlusher() {
 
 bool EventuallyPersistentStore::pauseFlusher() {
     bool rv = true;
+    if (ephemeral) {
+        return rv;
+    }
     for (uint16_t i = 0; i < vbMap.numShards; i++) {
         Flusher *flusher = vbMap.shards[i]->getFlusher();
         if (!flusher->pause()) {
@@ -386,6 +663,9 @@ bool EventuallyPersistentStore::pauseFlusher() {
 
 bool EventuallyPersistentStore::resumeFlusher() {
     bool rv = true;
+    if (ephemeral) {
+        return rv;
+    }
     for (uint16_t i = 0; i < vbMap.numShards; i++) {
         Flusher *flusher = vbMap.shards[i]->getFlusher();
         if (!flusher->resume()) {
@@ -399,7 +679,7 @@ bool EventuallyPersistentStore::resumeFlusher() {
 }
 
 void EventuallyPersistentStore::wakeUpFlusher() {
-    if (stats.diskQueueSize.get() == 0) {
+    if (!ephemeral && stats.diskQueueSize.get() == 0) {
         for (uint16_t i = 0; i < vbMap.numShards; i++) {
             Flusher *flusher = vbMap.shards[i]->getFlusher();
             flusher->wake();
@@ -408,29 +688,100 @@ void EventuallyPersistentStore::wakeUpFlusher() {
 }
 
 bool EventuallyPersistentStore::startBgFetcher() {
+    if (ephemeral) {
+        return true;
+    }
     for (uint16_t i = 0; i < vbMap.numShards; i++) {
-        BgFetcher *bgfetcher = vbMap.shards[i]->getBgFetcher();
-        if (bgfetcher == NULL) {
+        const std::vector<BgFetcher *> &bgfetchers =
+            vbMap.shards[i]->getBgFetchers();
+        if (bgfetchers.empty()) {
             LOG(EXTENSION_LOG_WARNING,
                 "Falied to start bg fetcher for shard %d", i);
             return false;
         }
-        bgfetcher->start();
+        std::vector<BgFetcher *>::const_iterator it = bgfetchers.begin();
+        for (; it != bgfetchers.end(); ++it) {
+            (*it)->start();
+        }
     }
     return true;
 }
 
 void EventuallyPersistentStore::stopBgFetcher() {
+    if (ephemeral) {
+        return;
+    }
     for (uint16_t i = 0; i < vbMap.numShards; i++) {
-        BgFetcher *bgfetcher = vbMap.shards[i]->getBgFetcher();
-        if (multiBGFetchEnabled() && bgfetcher->pendingJob()) {
+        const std::vector<BgFetcher *> &bgfetchers =
+            vbMap.shards[i]->getBgFetchers();
+        if (multiBGFetchEnabled() && bgfetchers.front()->pendingJob()) {
             LOG(EXTENSION_LOG_WARNING,
                 "Shutting down engine while there are still pending data "
                 "read for shard %d from database storage", i);
         }
         LOG(EXTENSION_LOG_INFO, "Stopping bg fetcher for underlying storage");
-        bgfetcher->stop();
+        std::vector<BgFetcher *>::const_iterator it = bgfetchers.begin();
+        for (; it != bgfetchers.end(); ++it) {
+            (*it)->stop();
+        }
+    }
+}
+
+void EventuallyPersistentStore::startCompactor() {
+    if (ephemeral) {
+        return;
     }
+    for (uint16_t i = 0; i < vbMap.numShards; i++) {
+        vbMap.shards[i]->getCompactor()->start();
+    }
+}
+
+void EventuallyPersistentStore::stopCompactor() {
+    if (ephemeral) {
+        return;
+    }
+    for (uint16_t i = 0; i < vbMap.numShards; i++) {
+        vbMap.shards[i]->getCompactor()->stop();
+    }
+}
+
+void EventuallyPersistentStore::writeMemorySnapshots() {
+    Configuration &config = engine.getConfiguration();
+    // Without every key in memory, or before warmup loaded them all, the
+    // snapshot wouldn't hold all that's in the file.
+    if (ephemeral || fullEviction || !config.isWarmupSnapshot() ||
+        !stats.warmupComplete) {
+        return;
+    }
+
+    hrtime_t start = gethrtime();
+    size_t written = 0;
+    std::string dir = MemorySnapshot::getDir(config);
+    size_t maxSize = vbMap.getSize();
+    assert(maxSize <= std::numeric_limits<uint16_t>::max());
+    for (size_t i = 0; i < maxSize; ++i) {
+        uint16_t vbid = static_cast<uint16_t>(i);
+        RCPtr<VBucket> vb = vbMap.getBucket(vbid);
+        if (!vb) {
+            continue;
+        }
+        std::string path = MemorySnapshot::getPath(dir, vbid);
+        vbucket_file_info info;
+        // Only a vbucket whose items are all persisted matches its file.
+        if ((vb->getState() != vbucket_state_active &&
+             vb->getState() != vbucket_state_replica) ||
+            vb->dirtyQueueSize.get() != 0 ||
+            vb->checkpointManager.getNumItemsForPersistence() != 0 ||
+            !getRWUnderlying(vbid)->getDbFileInfo(vbid, info) ||
+            !MemorySnapshot::write(path, vb, info)) {
+            remove(path.c_str());
+            continue;
+        }
+        ++written;
+    }
+    LOG(EXTENSION_LOG_WARNING, "Wrote the memory snapshots of %llu vbuckets "
+        "in %s", (unsigned long long)written,
+        hrtime2text(gethrtime() - start).c_str());
 }
 
 RCPtr<VBucket> EventuallyPersistentStore::getVBucket(uint16_t vbid,
@@ -445,14 +796,16 @@ RCPtr<VBucket> EventuallyPersistentStore::getVBucket(uint16_t vbid,
     }
 }
 
-void EventuallyPersistentStore::firePendingVBucketOps() {
+bool EventuallyPersistentStore::firePendingVBucketOps() {
+    bool more = false;
     uint16_t i;
     for (i = 0; i < vbMap.getSize(); i++) {
-        RCPtr<VBucket> vb = getVBucket(i, vbucket_state_active);
-        if (vb) {
-            vb->fireAllOps(engine);
+        RCPtr<VBucket> vb = getVBucket(i);
+        if (vb && vb->hasPendingOps() && vb->fireAllOps(engine)) {
+            more = true;
         }
     }
+    return more;
 }
 
 /// @cond DETAILS
@@ -496,7 +849,7 @@ EventuallyPersistentStore::deleteExpiredItems(std::list<std::pair<uint16_t, std:
     std::for_each(keys.begin(), keys.end(), Deleter(this));
 }
 
-StoredValue *EventuallyPersistentStore::fetchValidValue(RCPtr<VBucket> &vb,
+StoredValue *EventuallyPersistentStore::fetchValidValue(VBucket *vb,
                                                         const std::string &key,
                                                         int bucket_num,
                                                         bool wantDeleted,
@@ -536,7 +889,15 @@ protocol_binary_response_status EventuallyPersistentStore::evictKey(const std::s
     protocol_binary_response_status rv(PROTOCOL_BINARY_RESPONSE_SUCCESS);
 
     *msg_size = 0;
-    if (v) {
+    if (v && ephemeral) {
+        // There's no disk copy to fetch the value back from.
+        if (vb->ht.unlocked_evict(key, bucket_num, true)) {
+            *msg = "Deleted.";
+        } else {
+            *msg = "Can't delete: Locked.";
+            rv = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+        }
+    } else if (v) {
         if (force)  {
             v->markClean();
         }
@@ -563,7 +924,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &itm,
                                                  bool force,
                                                  uint8_t nru) {
 
-    RCPtr<VBucket> vb = getVBucket(itm.getVBucketId());
+    EpochGuard eg;
+    VBucket *vb = peekVBucket(itm.getVBucketId());
     if (!vb || vb->getState() == vbucket_state_dead) {
         ++stats.numNotMyVBuckets;
         return ENGINE_NOT_MY_VBUCKET;
@@ -571,11 +933,13 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &itm,
         ++stats.numNotMyVBuckets;
         return ENGINE_NOT_MY_VBUCKET;
     } else if (vb->getState() == vbucket_state_pending && !force) {
-        if (vb->addPendingOp(cookie)) {
-            return ENGINE_EWOULDBLOCK;
+        ENGINE_ERROR_CODE ec = vb->addPendingOp(cookie);
+        if (ec != ENGINE_SUCCESS) {
+            return ec;
         }
     }
 
+    OpTracer::mark(TRACE_VB_LOOKUP);
     bool cas_op = (itm.getCas() != 0);
 
     mutation_type_t mtype = vb->ht.set(itm, nru);
@@ -592,6 +956,15 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &itm,
     case NOT_FOUND:
         if (cas_op) {
             ret = ENGINE_KEY_ENOENT;
+            if (fullEviction) {
+                int bucket_num(0);
+                LockHolder lh = vb->ht.getLockedBucket(itm.getKey(),
+                                                       &bucket_num);
+                if (unlocked_fetchIfEvicted(vb, itm.getKey(), bucket_num,
+                                            cookie) == ENGINE_EWOULDBLOCK) {
+                    ret = ENGINE_EWOULDBLOCK;
+                }
+            }
             break;
         }
         // FALLTHROUGH
@@ -599,6 +972,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &itm,
         // Even if the item was dirty, push it into the vbucket's open checkpoint.
     case WAS_CLEAN:
         queueDirty(vb, itm.getKey(), queue_op_set, itm.getSeqno());
+        // A cas matching the lock's released it.
+        notifyGetlWaiters(itm.getVBucketId(), itm.getKey());
         break;
     case INVALID_VBUCKET:
         ret = ENGINE_NOT_MY_VBUCKET;
@@ -616,8 +991,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::add(const Item &itm,
         ++stats.numNotMyVBuckets;
         return ENGINE_NOT_MY_VBUCKET;
     } else if(vb->getState() == vbucket_state_pending) {
-        if (vb->addPendingOp(cookie)) {
-            return ENGINE_EWOULDBLOCK;
+        ENGINE_ERROR_CODE ec = vb->addPendingOp(cookie);
+        if (ec != ENGINE_SUCCESS) {
+            return ec;
         }
     }
 
@@ -626,13 +1002,22 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::add(const Item &itm,
         return ENGINE_NOT_STORED;
     }
 
-    switch (vb->ht.add(itm)) {
+    int bucket_num(0);
+    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
+    ENGINE_ERROR_CODE rv = unlocked_fetchIfEvicted(vb, itm.getKey(),
+                                                   bucket_num, cookie);
+    if (rv != ENGINE_SUCCESS) {
+        return rv;
+    }
+
+    switch (vb->ht.unlocked_add(bucket_num, itm)) {
     case ADD_NOMEM:
         return ENGINE_ENOMEM;
     case ADD_EXISTS:
         return ENGINE_NOT_STORED;
     case ADD_SUCCESS:
     case ADD_UNDEL:
+        lh.unlock();
         queueDirty(vb, itm.getKey(), queue_op_set, itm.getSeqno());
     }
     return ENGINE_SUCCESS;
@@ -696,6 +1081,7 @@ void EventuallyPersistentStore::snapshotVBuckets(const Priority &priority,
                 vb_state.state = vb->getState();
                 vb_state.checkpointId = vbuckets.getPersistenceCheckpointId(vb->getId());
                 vb_state.maxDeletedSeqno = 0;
+                vb_state.purgeSeqno = 0;
                 states[vb->getId()] = vb_state;
             }
             return false;
@@ -742,41 +1128,79 @@ void EventuallyPersistentStore::snapshotVBuckets(const Priority &priority,
 
 ENGINE_ERROR_CODE EventuallyPersistentStore::setVBucketState(uint16_t vbid,
                                                              vbucket_state_t to) {
+    std::vector<std::pair<uint16_t, vbucket_state_t> > states;
+    states.push_back(std::make_pair(vbid, to));
+    return setVBucketStates(states);
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentStore::setVBucketStates(
+              const std::vector<std::pair<uint16_t, vbucket_state_t> > &states) {
     // Lock to prevent a race condition between a failed update and add.
     LockHolder lh(vbsetMutex);
-    RCPtr<VBucket> vb = vbMap.getBucket(vbid);
-    if (vb && to == vb->getState()) {
-        return ENGINE_SUCCESS;
+    std::vector<std::pair<uint16_t, vbucket_state_t> >::const_iterator it;
+    for (it = states.begin(); it != states.end(); ++it) {
+        if (static_cast<size_t>(it->first) >= vbMap.getSize()) {
+            LOG(EXTENSION_LOG_WARNING, "Cannot create vb %d, max vbuckets "
+                "is %d", it->first, static_cast<int>(vbMap.getSize()));
+            return ENGINE_ERANGE;
+        }
     }
 
-    uint16_t shardId = vbMap.getShard(vbid)->getId();
-    if (vb) {
-        vb->setState(to, engine.getServerApi());
-        lh.unlock();
-        if (vb->getState() == vbucket_state_pending && to == vbucket_state_active) {
-            engine.notifyNotificationThread();
+    // The snapshot of each shard is only scheduled once, with the
+    // priority of its most urgent change.
+    std::vector<bool> changed(vbMap.getNumShards(), false);
+    std::vector<bool> created(vbMap.getNumShards(), false);
+    bool wasPending = false;
+    for (it = states.begin(); it != states.end(); ++it) {
+        uint16_t vbid = it->first;
+        vbucket_state_t to = it->second;
+        RCPtr<VBucket> vb = vbMap.getBucket(vbid);
+        if (vb && to == vb->getState()) {
+            continue;
         }
-        scheduleVBSnapshot(Priority::VBucketPersistLowPriority, shardId);
-    } else {
-        RCPtr<VBucket> newvb(new VBucket(vbid, to, stats, engine.getCheckpointConfig(),
-                                         vbMap.getShard(vbid)));
-        // The first checkpoint for active vbucket should start with id 2.
-        uint64_t start_chk_id = (to == vbucket_state_active) ? 2 : 0;
-        newvb->checkpointManager.setOpenCheckpointId(start_chk_id);
-        if (vbMap.addBucket(newvb) == ENGINE_ERANGE) {
-            lh.unlock();
-            return ENGINE_ERANGE;
+
+        uint16_t shardId = vbMap.getShard(vbid)->getId();
+        if (vb) {
+            if (vb->getState() == vbucket_state_pending) {
+                wasPending = true;
+            }
+            vb->setState(to, engine.getServerApi());
+            changed[shardId] = true;
+        } else {
+            RCPtr<VBucket> newvb(new VBucket(vbid, to, stats,
+                                             engine.getCheckpointConfig(),
+                                             vbMap.getShard(vbid)));
+            // The first checkpoint for active vbucket should start with id 2.
+            uint64_t start_chk_id = (to == vbucket_state_active) ? 2 : 0;
+            newvb->checkpointManager.setOpenCheckpointId(start_chk_id);
+            vbMap.addBucket(newvb);
+            vbMap.setPersistenceCheckpointId(vbid, 0);
+            vbMap.setBucketCreation(vbid, true);
+            created[shardId] = true;
+        }
+        vbMap.getShard(vbid)->vbStateChanged(vbid, to);
+    }
+    lh.unlock();
+
+    if (wasPending) {
+        // Get the ops blocked on them going right away.
+        engine.notifyNotificationThread();
+    }
+    for (size_t i = 0; i < created.size(); ++i) {
+        if (created[i]) {
+            scheduleVBSnapshot(Priority::VBucketPersistHighPriority, i);
+        } else if (changed[i]) {
+            scheduleVBSnapshot(Priority::VBucketPersistLowPriority, i);
         }
-        vbMap.setPersistenceCheckpointId(vbid, 0);
-        vbMap.setBucketCreation(vbid, true);
-        lh.unlock();
-        scheduleVBSnapshot(Priority::VBucketPersistHighPriority, shardId);
     }
     return ENGINE_SUCCESS;
 }
 
 void EventuallyPersistentStore::scheduleVBSnapshot(const Priority &p) {
     snapshotVBState = false;
+    if (ephemeral) {
+        return;
+    }
     KVShard *shard = NULL;
     if (p == Priority::VBucketPersistHighPriority) {
         for (size_t i = 0; i < vbMap.numShards; ++i) {
@@ -798,6 +1222,9 @@ void EventuallyPersistentStore::scheduleVBSnapshot(const Priority &p) {
 void EventuallyPersistentStore::scheduleVBSnapshot(const Priority &p,
                                                    uint16_t shardId) {
     snapshotVBState = false;
+    if (ephemeral) {
+        return;
+    }
     KVShard *shard = vbMap.shards[shardId];
     if (p == Priority::VBucketPersistHighPriority) {
         if (shard->setHighPriorityVbSnapshotFlag(true)) {
@@ -851,11 +1278,13 @@ void EventuallyPersistentStore::scheduleVBDeletion(RCPtr<VBucket> &vb,
                                                    const void* cookie,
                                                    double delay,
                                                    bool recreate) {
-    shared_ptr<DispatcherCallback> mem_cb(new VBucketMemoryDeletionCallback(this, vb));
+    size_t chunkSize = engine.getConfiguration().getVbDelChunkSize();
+    shared_ptr<DispatcherCallback> mem_cb(new VBucketMemoryDeletionCallback(this, vb,
+                                                                            chunkSize));
     nonIODispatcher->schedule(mem_cb, NULL, Priority::VBMemoryDeletionPriority, delay, false);
 
     uint16_t vbid = vb->getId();
-    if (vbMap.setBucketDeletion(vbid, true)) {
+    if (!ephemeral && vbMap.setBucketDeletion(vbid, true)) {
         IOManager::get()->scheduleVBDelete(&engine, cookie, vbid,
                                            Priority::VBucketDeletionPriority,
                                            vbMap.getShard(vbid)->getId(),
@@ -877,7 +1306,7 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteVBucket(uint16_t vbid, const
     scheduleVBDeletion(vb, c);
     scheduleVBSnapshot(Priority::VBucketPersistHighPriority,
                        vbMap.getShard(vbid)->getId());
-    if (c) {
+    if (c && !ephemeral) {
         return ENGINE_EWOULDBLOCK;
     }
     return ENGINE_SUCCESS;
@@ -904,7 +1333,7 @@ bool EventuallyPersistentStore::resetVBucket(uint16_t vbid) {
 
         // Copy the all cursors from the old vbucket into the new vbucket
         RCPtr<VBucket> newvb = vbMap.getBucket(vbid);
-        newvb->checkpointManager.resetTAPCursors(tap_cursors);
+        engine.getTapConnMap().getTapFanout().resetCursors(newvb, tap_cursors);
 
         rv = true;
     }
@@ -933,6 +1362,9 @@ extern "C" {
 }
 
 void EventuallyPersistentStore::snapshotStats() {
+    if (ephemeral) {
+        return;
+    }
     snapshot_stats_t snap;
     snap.engine = &engine;
     std::map<std::string, std::string>  smap;
@@ -984,8 +1416,11 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
     } else {
         ++stats.bg_fetched;
     }
-    getROUnderlying(vbucket)->get(key, rowid, vbucket, gcb);
-    gcb.waitForValue();
+    {
+        IOSlot slot(ioScheduler, IO_CLASS_BGFETCH);
+        getROUnderlying(vbucket)->get(key, rowid, vbucket, gcb);
+        gcb.waitForValue();
+    }
     assert(gcb.fired);
     ENGINE_ERROR_CODE status = gcb.val.getStatus();
 
@@ -999,9 +1434,13 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
         StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
         if (isMeta) {
             if (v && !v->isResident()) {
+                bool settling = v->isTempInitialItem();
                 if (v->unlocked_restoreMeta(gcb.val.getValue(),
                                             gcb.val.getStatus())) {
                     status = ENGINE_SUCCESS;
+                    if (settling) {
+                        vb->ht.unlocked_queueTempItem(v);
+                    }
                 }
             }
         } else {
@@ -1016,6 +1455,16 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
                         hlh.unlock(); 
                         queueDirty(vb, key, queue_op_set, revSeqno);
                     }
+                } else if (v->isTempItem() &&
+                           gcb.val.getStatus() == ENGINE_KEY_ENOENT) {
+                    // An evicted key that isn't on disk either.
+                    if (v->isTempInitialItem()) {
+                        if (fullEviction) {
+                            ++stats.numBloomFilterFalsePositives;
+                        }
+                        vb->ht.unlocked_queueTempItem(v);
+                    }
+                    v->setStoredValueState(StoredValue::state_non_existent_key);
                 } else {
                     // underlying kvstore couldn't fetch requested data
                     // log returned error and notify TMPFAIL to client
@@ -1029,20 +1478,39 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
     }
 
     lh.unlock();
+    if (vb) {
+        // Keep the negative lookups from crowding out the items.
+        vb->ht.reclaimTempItems();
+    }
 
     hrtime_t stop = gethrtime();
     updateBGStats(init, start, stop);
     bgFetchQueue--;
+    if (engine.getOpTracer().isEnabled()) {
+        engine.getOpTracer().bgFetched(cookie, init, start, stop);
+    }
 
     delete gcb.val.getValue();
-    engine.notifyIOComplete(cookie, status);
+    // The fetches of a withMetaBatch() or a CMD_GET_BATCH have nobody
+    // waiting on them.
+    if (cookie != NULL) {
+        engine.notifyIOComplete(cookie, status);
+    }
 }
 
 void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
                                  std::vector<VBucketBGFetchItem *> &fetchedItems,
                                  hrtime_t startTime)
 {
-    stats.bg_fetched += fetchedItems.size();
+    std::vector<VBucketBGFetchItem *>::iterator itemItr = fetchedItems.begin();
+    for (; itemItr != fetchedItems.end(); ++itemItr) {
+        if ((*itemItr)->metaOnly) {
+            ++stats.bg_meta_fetched;
+        } else {
+            ++stats.bg_fetched;
+        }
+    }
+
     RCPtr<VBucket> vb = getVBucket(vbId);
     if (!vb) {
         LOG(EXTENSION_LOG_WARNING,
@@ -1052,15 +1520,33 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
         return;
     }
 
-    std::vector<VBucketBGFetchItem *>::iterator itemItr = fetchedItems.begin();
-    for (; itemItr != fetchedItems.end(); ++itemItr) {
+    // The cookies are notified together once the batch is done, rather
+    // than one at a time in between the hash table work.
+    std::vector<IOCompletion> completions;
+    completions.reserve(fetchedItems.size());
+    for (itemItr = fetchedItems.begin(); itemItr != fetchedItems.end();
+         ++itemItr) {
         GetValue &value = (*itemItr)->value;
         ENGINE_ERROR_CODE status = value.getStatus();
         Item *fetchedValue = value.getValue();
         const std::string &key = (*itemItr)->key;
 
-        if (vb->getState() == vbucket_state_active ||
-            vb->getState() == vbucket_state_replica) {
+        if ((*itemItr)->metaOnly) {
+            if (vb->getState() == vbucket_state_active) {
+                int bucket = 0;
+                LockHolder blh = vb->ht.getLockedBucket(key, &bucket);
+                StoredValue *v = fetchValidValue(vb, key, bucket, true);
+                bool settling = v && v->isTempInitialItem();
+                if (v && !v->isResident() &&
+                    v->unlocked_restoreMeta(fetchedValue, status)) {
+                    status = ENGINE_SUCCESS;
+                    if (settling) {
+                        vb->ht.unlocked_queueTempItem(v);
+                    }
+                }
+            }
+        } else if (vb->getState() == vbucket_state_active ||
+                   vb->getState() == vbucket_state_replica) {
             int bucket = 0;
             LockHolder blh = vb->ht.getLockedBucket(key, &bucket);
             StoredValue *v = fetchValidValue(vb, key, bucket, true);
@@ -1075,6 +1561,15 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
                         blh.unlock();
                         queueDirty(vb, key, queue_op_set, revSeqno);
                     }
+                } else if (v->isTempItem() && status == ENGINE_KEY_ENOENT) {
+                    // An evicted key that isn't on disk either.
+                    if (v->isTempInitialItem()) {
+                        if (fullEviction) {
+                            ++stats.numBloomFilterFalsePositives;
+                        }
+                        vb->ht.unlocked_queueTempItem(v);
+                    }
+                    v->setStoredValueState(StoredValue::state_non_existent_key);
                 } else {
                     // underlying kvstore couldn't fetch requested data
                     // log returned error and notify TMPFAIL to client
@@ -1088,12 +1583,21 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
 
         hrtime_t endTime = gethrtime();
         updateBGStats((*itemItr)->initTime, startTime, endTime);
-        engine.notifyIOComplete((*itemItr)->cookie, status);
+        if (engine.getOpTracer().isEnabled()) {
+            engine.getOpTracer().bgFetched((*itemItr)->cookie,
+                                           (*itemItr)->initTime, startTime,
+                                           endTime);
+        }
+        if ((*itemItr)->cookie != NULL) {
+            completions.push_back(IOCompletion((*itemItr)->cookie, status));
+        }
         std::stringstream ss;
         ss << "Completed a background fetch, now at "
            << vb->numPendingBGFetchItems() << std::endl;
         LOG(EXTENSION_LOG_DEBUG, "%s", ss.str().c_str());
     }
+    engine.notifyIOComplete(completions);
+    vb->ht.reclaimTempItems();
 
     LOG(EXTENSION_LOG_DEBUG,
         "EP Store completes %d of batched background fetch "
@@ -1101,6 +1605,32 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
         fetchedItems.size(), vbId, gethrtime()/1000000);
 }
 
+void EventuallyPersistentStore::completeReadahead(uint16_t vbId,
+                                 std::vector<VBucketBGFetchItem *> &fetchedItems)
+{
+    RCPtr<VBucket> vb = getVBucket(vbId);
+    if (!vb) {
+        return;
+    }
+
+    std::vector<VBucketBGFetchItem *>::iterator itemItr = fetchedItems.begin();
+    for (; itemItr != fetchedItems.end(); ++itemItr) {
+        Item *fetchedValue = (*itemItr)->value.getValue();
+        const std::string &key = (*itemItr)->key;
+        int bucket = 0;
+        LockHolder blh = vb->ht.getLockedBucket(key, &bucket);
+        StoredValue *v = fetchValidValue(vb, key, bucket, false, false);
+        // Unless it's been changed since its key was listed
+        if (v && !v->isResident() && !v->isTempItem() && !v->isDirty() &&
+            v->getBySeqno() == fetchedValue->getId()) {
+            v->unlocked_restoreValue(fetchedValue, vb->ht);
+            // Only a guess; the first to go if it's not read.
+            v->setNRUValue(MAX_NRU_VALUE);
+            ++stats.bg_readahead_fetched;
+        }
+    }
+}
+
 void EventuallyPersistentStore::bgFetch(const std::string &key,
                                         uint16_t vbucket,
                                         uint64_t rowid,
@@ -1108,15 +1638,16 @@ void EventuallyPersistentStore::bgFetch(const std::string &key,
                                         bool isMeta) {
     std::stringstream ss;
 
-    // NOTE: mutil-fetch feature will be disabled for metadata
-    // read until MB-5808 is fixed
-    if (multiBGFetchEnabled() && !isMeta) {
+    if (multiBGFetchEnabled()) {
         RCPtr<VBucket> vb = getVBucket(vbucket);
         assert(vb);
         KVShard *myShard = vbMap.getShard(vbucket);
 
-        // schedule to the current batch of background fetch of the given vbucket
-        VBucketBGFetchItem * fetchThis = new VBucketBGFetchItem(key, rowid, cookie);
+        // schedule to the current batch of background fetch of the given
+        // vbucket; metadata fetches are batched by key as they've no seqno
+        VBucketBGFetchItem * fetchThis = new VBucketBGFetchItem(key, rowid,
+                                                                cookie, false,
+                                                                isMeta);
         vb->queueBGFetchItem(fetchThis, myShard->getBgFetcher());
         ss << "Queued a background fetch, now at "
            << vb->numPendingBGFetchItems() << std::endl;
@@ -1145,7 +1676,8 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
 
     vbucket_state_t disallowedState = (allowedState == vbucket_state_active) ?
         vbucket_state_replica : vbucket_state_active;
-    RCPtr<VBucket> vb = getVBucket(vbucket);
+    EpochGuard eg;
+    VBucket *vb = peekVBucket(vbucket);
     if (!vb) {
         ++stats.numNotMyVBuckets;
         return GetValue(NULL, ENGINE_NOT_MY_VBUCKET);
@@ -1156,12 +1688,40 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
         ++stats.numNotMyVBuckets;
         return GetValue(NULL, ENGINE_NOT_MY_VBUCKET);
     } else if (honorStates && vb->getState() == vbucket_state_pending) {
-        if (vb->addPendingOp(cookie)) {
-            return GetValue(NULL, ENGINE_EWOULDBLOCK);
+        ENGINE_ERROR_CODE ec = vb->addPendingOp(cookie, true);
+        if (ec != ENGINE_SUCCESS) {
+            return GetValue(NULL, ec);
+        }
+    }
+    OpTracer::mark(TRACE_VB_LOOKUP);
+
+    if (vb->ht.hasLockFreeReads()) {
+        int64_t bySeqno;
+        uint8_t nru;
+        Item *itm = vb->ht.lockFreeFind(key, vbucket, trackReference,
+                                        bySeqno, nru);
+        if (itm) {
+            return GetValue(itm, ENGINE_SUCCESS, bySeqno, false, nru);
         }
     }
 
     int bucket_num(0);
+    {
+        // Resident, unexpired items can be served under a read hold.
+        BucketReaderHolder rlh = vb->ht.getReadLockedBucket(key, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, false, false);
+        if (!v && !fullEviction) {
+            return GetValue();
+        }
+        // Bumping the NRU bits writes to the item, which needs the lock.
+        if (v && v->isResident() && !v->isExpired(ep_real_time()) &&
+            (!trackReference || v->getNRUValue() == MIN_NRU_VALUE)) {
+            return GetValue(v->toItem(v->isLocked(ep_current_time()), vbucket),
+                            ENGINE_SUCCESS, v->getBySeqno(), false,
+                            v->getNRUValue());
+        }
+    }
+
     LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
     StoredValue *v = fetchValidValue(vb, key, bucket_num, false, trackReference);
 
@@ -1179,47 +1739,218 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
                     ENGINE_SUCCESS, v->getBySeqno(), false, v->getNRUValue());
         return rv;
     } else {
+        ENGINE_ERROR_CODE ec = unlocked_fetchIfEvicted(vb, key, bucket_num,
+                                                       cookie, queueBG);
+        if (ec != ENGINE_SUCCESS) {
+            return GetValue(NULL, ec);
+        }
         GetValue rv;
         return rv;
     }
 }
 
-ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(const std::string &key,
-                                                         uint16_t vbucket,
-                                                         const void *cookie,
-                                                         ItemMetaData &metadata,
-                                                         uint32_t &deleted,
-                                                         bool trackReferenced)
-{
-    (void) cookie;
-    RCPtr<VBucket> vb = getVBucket(vbucket);
-    if (!vb || vb->getState() == vbucket_state_dead ||
-        vb->getState() == vbucket_state_replica) {
-        ++stats.numNotMyVBuckets;
-        return ENGINE_NOT_MY_VBUCKET;
+ENGINE_ERROR_CODE
+EventuallyPersistentStore::unlocked_fetchIfEvicted(VBucket *vb,
+                                                   const std::string &key,
+                                                   int bucket_num,
+                                                   const void *cookie,
+                                                   bool queueBG) {
+    // Until a flush reaches the disk, what's there is already gone.
+    if (!fullEviction || diskFlushAll) {
+        return ENGINE_SUCCESS;
+    }
+
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+    if (v) {
+        // Only a temp item that has yet to find the key on disk (or
+        // only knows its metadata) can't answer.
+        if (!v->isTempInitialItem() && !v->isTempDeletedItem()) {
+            return ENGINE_SUCCESS;
+        }
+    } else if (!vb->maybeKeyExists(key)) {
+        ++stats.numBloomFilterSkips;
+        return ENGINE_SUCCESS;
+    } else {
+        switch (vb->ht.unlocked_addTempDeletedItem(bucket_num, key)) {
+        case ADD_NOMEM:
+            return ENGINE_ENOMEM;
+        case ADD_EXISTS:
+        case ADD_UNDEL:
+            // Since the hashtable bucket is locked, we should never get here
+            abort();
+        case ADD_SUCCESS:
+            break;
+        }
+    }
+
+    if (queueBG) {
+        bgFetch(key, vb->getId(), -1, cookie);
+    }
+    return ENGINE_EWOULDBLOCK;
+}
+
+void EventuallyPersistentStore::getMulti(std::vector<MultiGetItem> &items,
+                                         const void *cookie,
+                                         bool queueBG,
+                                         bool trackReference) {
+    std::map<uint16_t, std::vector<size_t> > byVBucket;
+    for (size_t i = 0; i < items.size(); ++i) {
+        byVBucket[items[i].vbucket].push_back(i);
+    }
+
+    std::map<uint16_t, std::vector<size_t> >::iterator it;
+    for (it = byVBucket.begin(); it != byVBucket.end(); ++it) {
+        std::vector<size_t> &indices = it->second;
+        RCPtr<VBucket> vb = getVBucket(it->first);
+        ENGINE_ERROR_CODE rv(ENGINE_SUCCESS);
+        if (!vb || vb->getState() == vbucket_state_dead ||
+            vb->getState() == vbucket_state_replica) {
+            stats.numNotMyVBuckets.incr(indices.size());
+            rv = ENGINE_NOT_MY_VBUCKET;
+        } else if (vb->getState() == vbucket_state_pending) {
+            // Without a connection to wake, the keys are asked for again.
+            rv = cookie ? vb->addPendingOp(cookie, true) : ENGINE_TMPFAIL;
+        }
+
+        if (rv != ENGINE_SUCCESS) {
+            std::vector<size_t>::iterator iit;
+            for (iit = indices.begin(); iit != indices.end(); ++iit) {
+                items[*iit].value = GetValue(NULL, rv);
+            }
+            continue;
+        }
+        getMultiInVBucket(vb, items, indices, cookie, queueBG, trackReference);
+    }
+}
+
+void EventuallyPersistentStore::getMultiInVBucket(RCPtr<VBucket> &vb,
+                                                  std::vector<MultiGetItem> &items,
+                                                  std::vector<size_t> &indices,
+                                                  const void *cookie,
+                                                  bool queueBG,
+                                                  bool trackReference) {
+    uint16_t vbucket = vb->getId();
+    std::vector<std::pair<int, size_t> > byLock;
+    byLock.reserve(indices.size());
+    std::vector<size_t>::iterator iit;
+    for (iit = indices.begin(); iit != indices.end(); ++iit) {
+        byLock.push_back(std::make_pair(vb->ht.getLockForKey(items[*iit].key),
+                                        *iit));
+    }
+    std::sort(byLock.begin(), byLock.end());
+
+    bool batchFetch = queueBG && multiBGFetchEnabled();
+    std::list<VBucketBGFetchItem *> fetches;
+    std::vector<size_t> moved;
+    size_t i = 0;
+    while (i < byLock.size()) {
+        int lock_num = byLock[i].first;
+        LockHolder lh = vb->ht.getLockedStripe(lock_num);
+        for (; i < byLock.size() && byLock[i].first == lock_num; ++i) {
+            MultiGetItem &item = items[byLock[i].second];
+            int bucket_num(0);
+            if (!vb->ht.unlocked_getBucketInStripe(item.key, lock_num,
+                                                   &bucket_num)) {
+                // A resize moved it to another lock since we sorted.
+                moved.push_back(byLock[i].second);
+                continue;
+            }
+
+            StoredValue *v = fetchValidValue(vb, item.key, bucket_num, false,
+                                             trackReference);
+            if (!v) {
+                ENGINE_ERROR_CODE ec = unlocked_fetchIfEvicted(vb, item.key,
+                                                               bucket_num,
+                                                               cookie, queueBG);
+                item.value = ec == ENGINE_SUCCESS ? GetValue() :
+                    GetValue(NULL, ec);
+            } else if (!v->isResident()) {
+                if (batchFetch) {
+                    fetches.push_back(new VBucketBGFetchItem(item.key,
+                                                             v->getBySeqno(),
+                                                             cookie));
+                } else if (queueBG) {
+                    bgFetch(item.key, vbucket, v->getBySeqno(), cookie);
+                }
+                item.value = GetValue(NULL, ENGINE_EWOULDBLOCK,
+                                      v->getBySeqno(), true, v->getNRUValue());
+            } else {
+                item.value = GetValue(v->toItem(v->isLocked(ep_current_time()),
+                                                vbucket),
+                                      ENGINE_SUCCESS, v->getBySeqno(), false,
+                                      v->getNRUValue());
+            }
+        }
+    }
+
+    if (!fetches.empty()) {
+        size_t nfetches = fetches.size();
+        vb->queueBGFetchItems(fetches, vbMap.getShard(vbucket)->getBgFetcher());
+        LOG(EXTENSION_LOG_DEBUG,
+            "Queued %d background fetches of a multi-get for vBucket = %d",
+            static_cast<int>(nfetches), vbucket);
+    }
+
+    for (iit = moved.begin(); iit != moved.end(); ++iit) {
+        MultiGetItem &item = items[*iit];
+        item.value = getInternal(item.key, vbucket, cookie, queueBG, true,
+                                 vbucket_state_active, trackReference);
+    }
+}
+
+static ENGINE_ERROR_CODE copyMetaData(EPStats &stats, StoredValue *v,
+                                      ItemMetaData &metadata,
+                                      uint32_t &deleted) {
+    stats.numOpsGetMeta++;
+
+    if (v->isTempNonExistentItem()) {
+        metadata.cas = v->getCas();
+        return ENGINE_KEY_ENOENT;
+    }
+    if (v->isDeleted() || v->isExpired(ep_real_time())) {
+        deleted |= GET_META_ITEM_DELETED_FLAG;
+    }
+    metadata.cas = v->getCas();
+    metadata.flags = v->getFlags();
+    metadata.exptime = v->getExptime();
+    metadata.seqno = v->getRevSeqno();
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(const std::string &key,
+                                                         uint16_t vbucket,
+                                                         const void *cookie,
+                                                         ItemMetaData &metadata,
+                                                         uint32_t &deleted,
+                                                         bool trackReferenced)
+{
+    (void) cookie;
+    EpochGuard eg;
+    VBucket *vb = peekVBucket(vbucket);
+    if (!vb || vb->getState() == vbucket_state_dead ||
+        vb->getState() == vbucket_state_replica) {
+        ++stats.numNotMyVBuckets;
+        return ENGINE_NOT_MY_VBUCKET;
     }
 
     int bucket_num(0);
     deleted = 0;
+    {
+        // Existing items only need a read hold.
+        BucketReaderHolder rlh = vb->ht.getReadLockedBucket(key, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+        // Bumping the NRU bits writes to the item, which needs the lock.
+        if (v && (!trackReferenced || v->isDeleted() ||
+                  v->getNRUValue() == MIN_NRU_VALUE)) {
+            return copyMetaData(stats, v, metadata, deleted);
+        }
+    }
+
     LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
     StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, trackReferenced);
 
     if (v) {
-        stats.numOpsGetMeta++;
-
-        if (v->isTempNonExistentItem()) {
-            metadata.cas = v->getCas();
-            return ENGINE_KEY_ENOENT;
-        } else {
-            if (v->isDeleted() || v->isExpired(ep_real_time())) {
-                deleted |= GET_META_ITEM_DELETED_FLAG;
-            }
-            metadata.cas = v->getCas();
-            metadata.flags = v->getFlags();
-            metadata.exptime = v->getExptime();
-            metadata.seqno = v->getRevSeqno();
-            return ENGINE_SUCCESS;
-        }
+        return copyMetaData(stats, v, metadata, deleted);
     } else {
         // The key wasn't found. However, this may be because it was previously
         // deleted. So, add a temporary item corresponding to the key to the
@@ -1257,8 +1988,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::setWithMeta(const Item &itm,
         ++stats.numNotMyVBuckets;
         return ENGINE_NOT_MY_VBUCKET;
     } else if (vb->getState() == vbucket_state_pending && !force) {
-        if (vb->addPendingOp(cookie)) {
-            return ENGINE_EWOULDBLOCK;
+        ENGINE_ERROR_CODE ec = vb->addPendingOp(cookie);
+        if (ec != ENGINE_SUCCESS) {
+            return ec;
         }
     }
 
@@ -1317,10 +2049,529 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::setWithMeta(const Item &itm,
     return ret;
 }
 
+bool EventuallyPersistentStore::rejectsWithMeta(const std::string &key,
+                                                uint16_t vbucket,
+                                                const ItemMetaData &meta,
+                                                bool isDelete) {
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    if (!vb) {
+        return false;
+    }
+    int bucket_num(0);
+    BucketReaderHolder rlh = vb->ht.getReadLockedBucket(key, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+    // A temp item still waiting for its metadata knows nothing yet.
+    return v && !v->isTempInitialItem() &&
+        !conflictResolver->resolve(v, meta, isDelete);
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaMulti(uint16_t vbucket,
+                                                 std::vector<MultiGetMetaItem> &items)
+{
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    if (!vb || vb->getState() == vbucket_state_dead ||
+        vb->getState() == vbucket_state_replica) {
+        ++stats.numNotMyVBuckets;
+        return ENGINE_NOT_MY_VBUCKET;
+    }
+
+    std::vector<std::pair<int, size_t> > byLock;
+    byLock.reserve(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        byLock.push_back(std::make_pair(vb->ht.getLockForKey(items[i].key), i));
+    }
+    std::sort(byLock.begin(), byLock.end());
+
+    bool batchFetch = multiBGFetchEnabled();
+    std::list<VBucketBGFetchItem *> fetches;
+    std::vector<size_t> toFetch;
+    std::vector<size_t> moved;
+    size_t i = 0;
+    while (i < byLock.size()) {
+        int lock_num = byLock[i].first;
+        LockHolder lh = vb->ht.getLockedStripe(lock_num);
+        for (; i < byLock.size() && byLock[i].first == lock_num; ++i) {
+            MultiGetMetaItem &item = items[byLock[i].second];
+            int bucket_num(0);
+            if (!vb->ht.unlocked_getBucketInStripe(item.key, lock_num,
+                                                   &bucket_num)) {
+                // A resize moved it to another lock since we sorted.
+                moved.push_back(byLock[i].second);
+                continue;
+            }
+            bool fetch(false);
+            item.status = unlocked_resolveRemoteMeta(vb, item, bucket_num,
+                                                     fetch);
+            if (fetch && batchFetch) {
+                fetches.push_back(new VBucketBGFetchItem(item.key, -1, NULL,
+                                                         false, true));
+            } else if (fetch) {
+                toFetch.push_back(byLock[i].second);
+            }
+        }
+    }
+
+    std::vector<size_t>::iterator iit;
+    for (iit = moved.begin(); iit != moved.end(); ++iit) {
+        MultiGetMetaItem &item = items[*iit];
+        int bucket_num(0);
+        LockHolder lh = vb->ht.getLockedBucket(item.key, &bucket_num);
+        bool fetch(false);
+        item.status = unlocked_resolveRemoteMeta(vb, item, bucket_num, fetch);
+        if (fetch && batchFetch) {
+            fetches.push_back(new VBucketBGFetchItem(item.key, -1, NULL, false,
+                                                     true));
+        } else if (fetch) {
+            toFetch.push_back(*iit);
+        }
+    }
+
+    if (!fetches.empty()) {
+        size_t nfetches = fetches.size();
+        vb->queueBGFetchItems(fetches, vbMap.getShard(vbucket)->getBgFetcher());
+        LOG(EXTENSION_LOG_DEBUG,
+            "Queued %d metadata fetches of a multi-get_meta for vBucket = %d",
+            static_cast<int>(nfetches), vbucket);
+    }
+    for (iit = toFetch.begin(); iit != toFetch.end(); ++iit) {
+        bgFetch(items[*iit].key, vbucket, -1, NULL, true);
+    }
+
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE
+EventuallyPersistentStore::unlocked_resolveRemoteMeta(RCPtr<VBucket> &vb,
+                                                      const MultiGetMetaItem &item,
+                                                      int bucket_num,
+                                                      bool &fetch) {
+    StoredValue *v = vb->ht.unlocked_find(item.key, bucket_num, true, false);
+    if (!v) {
+        switch (vb->ht.unlocked_addTempDeletedItem(bucket_num, item.key)) {
+        case ADD_NOMEM:
+            return ENGINE_ENOMEM;
+        case ADD_EXISTS:
+        case ADD_UNDEL:
+            // Since the hashtable bucket is locked, we shouldn't get here
+            abort();
+        case ADD_SUCCESS:
+            fetch = true;
+        }
+        return ENGINE_EWOULDBLOCK;
+    } else if (v->isTempInitialItem()) {
+        // Its metadata is already on the way.
+        return ENGINE_EWOULDBLOCK;
+    }
+
+    ++stats.numOpsGetMeta;
+    if (!conflictResolver->resolve(v, item.meta, item.isDelete)) {
+        return ENGINE_KEY_EEXISTS;
+    }
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentStore::withMetaBatch(uint16_t vbucket,
+                                                    std::vector<WithMetaItem> &items,
+                                                    const void *cookie)
+{
+    bool force = true;
+    std::vector<WithMetaItem>::iterator wit;
+    for (wit = items.begin(); wit != items.end(); ++wit) {
+        force = force && wit->force;
+    }
+
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    if (!vb || vb->getState() == vbucket_state_dead) {
+        ++stats.numNotMyVBuckets;
+        return ENGINE_NOT_MY_VBUCKET;
+    } else if (vb->getState() == vbucket_state_replica && !force) {
+        ++stats.numNotMyVBuckets;
+        return ENGINE_NOT_MY_VBUCKET;
+    } else if (vb->getState() == vbucket_state_pending && !force) {
+        ENGINE_ERROR_CODE ec = vb->addPendingOp(cookie);
+        if (ec != ENGINE_SUCCESS) {
+            return ec;
+        }
+    }
+
+    std::vector<std::pair<int, size_t> > byLock;
+    byLock.reserve(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (items[i].status == ENGINE_SUCCESS) {
+            const std::string &key = items[i].item->getKey();
+            byLock.push_back(std::make_pair(vb->ht.getLockForKey(key), i));
+        }
+    }
+    // The mutations of a key stay in the order they came in.
+    std::sort(byLock.begin(), byLock.end());
+
+    std::vector<size_t> moved;
+    std::vector<queued_item> dirty;
+    size_t i = 0;
+    while (i < byLock.size()) {
+        int lock_num = byLock[i].first;
+        LockHolder lh = vb->ht.getLockedStripe(lock_num);
+        for (; i < byLock.size() && byLock[i].first == lock_num; ++i) {
+            WithMetaItem &wm = items[byLock[i].second];
+            int bucket_num(0);
+            if (!vb->ht.unlocked_getBucketInStripe(wm.item->getKey(), lock_num,
+                                                   &bucket_num)) {
+                // A resize moved it to another lock since we sorted.
+                moved.push_back(byLock[i].second);
+                continue;
+            }
+            bool queue(false);
+            uint64_t seqno(0);
+            wm.status = unlocked_applyWithMeta(vb, wm, bucket_num, queue,
+                                               seqno);
+            if (queue) {
+                dirty.push_back(queued_item(new QueuedItem(wm.item->getKey(),
+                    vbucket, wm.isDelete ? queue_op_del : queue_op_set,
+                    seqno)));
+            }
+        }
+    }
+
+    std::vector<size_t>::iterator mit;
+    for (mit = moved.begin(); mit != moved.end(); ++mit) {
+        WithMetaItem &wm = items[*mit];
+        int bucket_num(0);
+        LockHolder lh = vb->ht.getLockedBucket(wm.item->getKey(), &bucket_num);
+        bool queue(false);
+        uint64_t seqno(0);
+        wm.status = unlocked_applyWithMeta(vb, wm, bucket_num, queue, seqno);
+        lh.unlock();
+        if (queue) {
+            dirty.push_back(queued_item(new QueuedItem(wm.item->getKey(),
+                vbucket, wm.isDelete ? queue_op_del : queue_op_set, seqno)));
+        }
+    }
+
+    // The checkpoint takes the whole batch under one lock.
+    queueDirtyBatch(vb, dirty);
+    return ENGINE_SUCCESS;
+}
+
+/**
+ * Collects the keys of a range whose values in memory may be newer than
+ * the vbucket's file, or all of them when nothing is on disk.
+ */
+class RangeScanVisitor : public HashTableVisitor {
+public:
+    RangeScanVisitor(const RangeScan &s, bool all) : scan(s), allKeys(all) {}
+
+    void visit(StoredValue *v) {
+        if (v->isTempItem() || (!allKeys && v->isClean())) {
+            return;
+        }
+        std::string key(v->getKey());
+        if (key >= scan.start && (scan.end.empty() || key < scan.end)) {
+            keys.insert(key);
+        }
+    }
+
+    std::set<std::string> keys;
+
+private:
+    const RangeScan &scan;
+    bool allKeys;
+};
+
+/**
+ * Keeps the items a range scan read from a vbucket's file.
+ */
+class RangeScanDiskCallback : public Callback<GetValue> {
+public:
+    void callback(GetValue &val) {
+        if (val.getValue() != NULL) {
+            items.push_back(val.getValue());
+        }
+    }
+
+    std::vector<Item *> items;
+};
+
+ENGINE_ERROR_CODE EventuallyPersistentStore::startRangeScan(RangeScan *scan,
+                                                            const void *cookie) {
+    RCPtr<VBucket> vb = getVBucket(scan->vbucket);
+    if (!vb || vb->getState() != vbucket_state_active) {
+        ++stats.numNotMyVBuckets;
+        return ENGINE_NOT_MY_VBUCKET;
+    }
+    IOManager::get()->scheduleRangeScan(&engine, scan, cookie,
+                                        Priority::RangeScanPriority,
+                                        vbMap.getShard(scan->vbucket)->getId());
+    return ENGINE_EWOULDBLOCK;
+}
+
+void EventuallyPersistentStore::rangeScan(RangeScan &scan) {
+    RCPtr<VBucket> vb = getVBucket(scan.vbucket);
+    if (!vb || vb->getState() != vbucket_state_active) {
+        ++stats.numNotMyVBuckets;
+        scan.status = ENGINE_NOT_MY_VBUCKET;
+        return;
+    }
+
+    // The file has the keys that were persisted, and only the dirty
+    // values in memory can have keys or values it doesn't.  A vbucket
+    // with nothing waiting to be flushed has none of them to look for.
+    RangeScanVisitor dirty(scan, ephemeral);
+    if (ephemeral || vb->dirtyQueueSize.get() != 0 ||
+        vb->checkpointManager.getNumItemsForPersistence() != 0) {
+        vb->ht.visitInline(dirty);
+    }
+
+    // One more key than the page holds tells where the file's part of
+    // the page stops.
+    RangeScanDiskCallback disk;
+    if (!ephemeral) {
+        IOSlot slot(ioScheduler, IO_CLASS_BACKFILL);
+        if (!getROUnderlying(scan.vbucket)->rangeScan(scan.vbucket,
+                                                      scan.start, scan.end,
+                                                      scan.limit + 1,
+                                                      scan.keysOnly, disk)) {
+            std::vector<Item *>::iterator it;
+            for (it = disk.items.begin(); it != disk.items.end(); ++it) {
+                delete *it;
+            }
+            scan.status = ENGINE_TMPFAIL;
+            return;
+        }
+    }
+
+    // When the file had more keys than the page, the keys in memory from
+    // its extra key on wait for the next page.
+    std::string bound(scan.end);
+    if (disk.items.size() > scan.limit) {
+        bound = disk.items.back()->getKey();
+        delete disk.items.back();
+        disk.items.pop_back();
+        scan.next = bound;
+    }
+
+    time_t now = ep_real_time();
+    std::vector<Item *>::iterator dit = disk.items.begin();
+    std::set<std::string>::iterator mit = dirty.keys.begin();
+    while (true) {
+        bool fromDisk = dit != disk.items.end() &&
+            (mit == dirty.keys.end() || (*dit)->getKey() <= *mit);
+        if (!fromDisk && (mit == dirty.keys.end() ||
+                          (!bound.empty() && *mit >= bound))) {
+            break;
+        }
+        std::string key(fromDisk ? (*dit)->getKey() : *mit);
+        if (scan.items.size() == scan.limit) {
+            scan.next = key;
+            break;
+        }
+
+        Item *diskItem = NULL;
+        if (fromDisk) {
+            diskItem = *dit;
+            ++dit;
+        }
+        if (mit != dirty.keys.end() && *mit == key) {
+            ++mit;
+        }
+
+        Item *itm = diskItem;
+        int bucket_num(0);
+        BucketReaderHolder rlh = vb->ht.getReadLockedBucket(key, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+        if (v && !v->isTempItem()) {
+            if (v->isDeleted() || v->isExpired(now)) {
+                itm = NULL;
+            } else if (scan.keysOnly || v->isResident()) {
+                itm = v->toItem(false, scan.vbucket);
+            }
+        }
+        rlh.unlock();
+
+        if (itm != diskItem) {
+            delete diskItem;
+        }
+        if (itm != NULL) {
+            scan.items.push_back(itm);
+        }
+    }
+    for (; dit != disk.items.end(); ++dit) {
+        delete *dit;
+    }
+
+    ++stats.numRangeScans;
+    stats.numRangeScanItems.incr(scan.items.size());
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentStore::subdocMutate(const std::string &key,
+                                                         uint16_t vbucket,
+                                                         uint64_t cas,
+                                                         SubdocOp &op,
+                                                         subdoc_status_t &status,
+                                                         uint64_t *newCas,
+                                                         const void *cookie) {
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    if (!vb || vb->getState() == vbucket_state_dead ||
+        vb->getState() == vbucket_state_replica) {
+        ++stats.numNotMyVBuckets;
+        return ENGINE_NOT_MY_VBUCKET;
+    } else if (vb->getState() == vbucket_state_pending) {
+        ENGINE_ERROR_CODE ec = vb->addPendingOp(cookie);
+        if (ec != ENGINE_SUCCESS) {
+            return ec;
+        }
+    }
+
+    int bucket_num(0);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num);
+    if (!v) {
+        if (unlocked_fetchIfEvicted(vb, key, bucket_num, cookie) ==
+            ENGINE_EWOULDBLOCK) {
+            return ENGINE_EWOULDBLOCK;
+        }
+        return ENGINE_KEY_ENOENT;
+    }
+    if (!v->isResident()) {
+        bgFetch(key, vbucket, v->getBySeqno(), cookie);
+        return ENGINE_EWOULDBLOCK;
+    }
+    if (v->isLocked(ep_current_time()) && v->getCas() != cas) {
+        return ENGINE_KEY_EEXISTS;
+    }
+    if (cas != 0 && cas != v->getCas()) {
+        return ENGINE_KEY_EEXISTS;
+    }
+
+    value_t val = v->getValue();
+    if (val.get() && val->isCompressed()) {
+        val.reset(val->uncompress());
+        if (val.get() == NULL) {
+            return ENGINE_FAILED;
+        }
+    }
+    std::string result;
+    status = val.get() ? op.apply(val->getData(), val->length(), result) :
+        op.apply("", 0, result);
+    if (status != SUBDOC_SUCCESS) {
+        return ENGINE_EINVAL;
+    }
+    if (result.length() > engine.getMaxItemSize()) {
+        return ENGINE_E2BIG;
+    }
+
+    Item itm(key, v->getFlags(), v->getExptime(), result.data(),
+             result.length(), 0, -1, vbucket);
+    engine.maybeCompress(&itm);
+    switch (vb->ht.unlocked_set(v, itm, cas, true, false)) {
+    case NOMEM:
+        return ENGINE_ENOMEM;
+    case INVALID_CAS:
+    case IS_LOCKED:
+        return ENGINE_KEY_EEXISTS;
+    case NOT_FOUND:
+        return ENGINE_KEY_ENOENT;
+    case INVALID_VBUCKET:
+        return ENGINE_NOT_MY_VBUCKET;
+    case WAS_CLEAN:
+    case WAS_DIRTY:
+        break;
+    }
+    *newCas = itm.getCas();
+    lh.unlock();
+
+    ++stats.numOpsSubdoc;
+    queueDirty(vb, key, queue_op_set, itm.getSeqno());
+    notifyGetlWaiters(vbucket, key);
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE
+EventuallyPersistentStore::unlocked_applyWithMeta(RCPtr<VBucket> &vb,
+                                                  const WithMetaItem &wm,
+                                                  int bucket_num, bool &queue,
+                                                  uint64_t &seqno) {
+    const Item &itm = *wm.item;
+    const std::string &key = itm.getKey();
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+
+    if (!wm.force) {
+        if (!v) {
+            switch (vb->ht.unlocked_addTempDeletedItem(bucket_num, key)) {
+            case ADD_NOMEM:
+                return ENGINE_ENOMEM;
+            case ADD_EXISTS:
+            case ADD_UNDEL:
+                // Since the hashtable bucket is locked, we shouldn't get here
+                abort();
+            case ADD_SUCCESS:
+                // The mutation is sent again once the metadata is in.
+                bgFetch(key, vb->getId(), -1, NULL, true);
+            }
+            return ENGINE_EWOULDBLOCK;
+        }
+        if (!conflictResolver->resolve(v, itm.getMetaData(), wm.isDelete)) {
+            if (wm.isDelete) {
+                ++stats.numOpsDelMetaResolutionFailed;
+            } else {
+                ++stats.numOpsSetMetaResolutionFailed;
+            }
+            return ENGINE_KEY_EEXISTS;
+        }
+    }
+
+    if (!wm.isDelete) {
+        switch (vb->ht.unlocked_set(v, itm, 0, true, true, wm.nru)) {
+        case NOMEM:
+            return ENGINE_ENOMEM;
+        case INVALID_CAS:
+        case IS_LOCKED:
+            return ENGINE_KEY_EEXISTS;
+        case INVALID_VBUCKET:
+            return ENGINE_NOT_MY_VBUCKET;
+        case NOT_FOUND:
+            return ENGINE_KEY_ENOENT;
+        case WAS_DIRTY:
+        case WAS_CLEAN:
+            break;
+        }
+        queue = true;
+        seqno = itm.getSeqno();
+        return ENGINE_SUCCESS;
+    }
+
+    if (!v) {
+        // Only a forced delete gets here.
+        if (vb->getState() != vbucket_state_active) {
+            queue = true;
+            seqno = itm.getSeqno();
+        } else {
+            ENGINE_ERROR_CODE ec = unlocked_fetchIfEvicted(vb, key, bucket_num,
+                                                           NULL);
+            if (ec != ENGINE_SUCCESS) {
+                return ec;
+            }
+        }
+        return ENGINE_KEY_ENOENT;
+    }
+
+    const ItemMetaData meta = itm.getMetaData();
+    mutation_type_t delrv = vb->ht.unlocked_softDelete(v, 0, meta.seqno, true,
+                                                       meta.cas, meta.flags,
+                                                       meta.exptime);
+    if (delrv == IS_LOCKED) {
+        return ENGINE_TMPFAIL;
+    } else if (delrv == INVALID_CAS) {
+        return ENGINE_KEY_EEXISTS;
+    }
+    queue = true;
+    seqno = v->getRevSeqno();
+    return delrv == NOT_FOUND ? ENGINE_KEY_ENOENT : ENGINE_SUCCESS;
+}
+
 GetValue EventuallyPersistentStore::getAndUpdateTtl(const std::string &key,
                                                     uint16_t vbucket,
                                                     const void *cookie,
-                                                    bool queueBG,
+                                                    bool wantValue,
                                                     time_t exptime)
 {
     RCPtr<VBucket> vb = getVBucket(vbucket);
@@ -1334,8 +2585,9 @@ GetValue EventuallyPersistentStore::getAndUpdateTtl(const std::string &key,
         ++stats.numNotMyVBuckets;
         return GetValue(NULL, ENGINE_NOT_MY_VBUCKET);
     } else if (vb->getState() == vbucket_state_pending) {
-        if (vb->addPendingOp(cookie)) {
-            return GetValue(NULL, ENGINE_EWOULDBLOCK);
+        ENGINE_ERROR_CODE ec = vb->addPendingOp(cookie);
+        if (ec != ENGINE_SUCCESS) {
+            return GetValue(NULL, ec);
         }
     }
 
@@ -1353,32 +2605,35 @@ GetValue EventuallyPersistentStore::getAndUpdateTtl(const std::string &key,
            v->markDirty();
         }
         v->setExptime(exptime);
+        vb->ht.unlocked_indexExpiry(v);
 
-        GetValue rv(v->toItem(v->isLocked(ep_current_time()), vbucket),
-                    ENGINE_SUCCESS, v->getBySeqno());
-
-        if (v->isResident()) {
-            if (exptime_mutated) {
-                // persist the itme in the underlying storage for
-                // mutated exptime
-                uint64_t revSeqno = v->getRevSeqno();
-                lh.unlock();
-                queueDirty(vb, key, queue_op_set, revSeqno);
-            }
-        } else {
-            if (queueBG || exptime_mutated) {
-                // in case exptime_mutated, first do bgFetch then
-                // persist mutated exptime in the underlying storage
-                bgFetch(key, vbucket, v->getBySeqno(), cookie);
-                return GetValue(NULL, ENGINE_EWOULDBLOCK, v->getBySeqno());
-            } else {
-                // You didn't want the item anyway...
-                return GetValue(NULL, ENGINE_SUCCESS, v->getBySeqno());
-            }
+        if (!v->isResident() && wantValue) {
+            // in case exptime_mutated, the fetch's completion persists
+            // the mutated exptime once the value is back
+            bgFetch(key, vbucket, v->getBySeqno(), cookie);
+            return GetValue(NULL, ENGINE_EWOULDBLOCK, v->getBySeqno());
         }
 
+        // Without the value wanted nothing's copied, and nothing's
+        // fetched, either: the flusher reads the value of an ejected
+        // item back itself when it writes the new exptime.
+        GetValue rv(wantValue ?
+                    v->toItem(v->isLocked(ep_current_time()), vbucket) : NULL,
+                    ENGINE_SUCCESS, v->getBySeqno());
+        if (exptime_mutated) {
+            // persist the item in the underlying storage for
+            // mutated exptime
+            uint64_t revSeqno = v->getRevSeqno();
+            lh.unlock();
+            queueDirty(vb, key, queue_op_set, revSeqno);
+        }
         return rv;
     } else {
+        ENGINE_ERROR_CODE ec = unlocked_fetchIfEvicted(vb, key, bucket_num,
+                                                       cookie);
+        if (ec != ENGINE_SUCCESS) {
+            return GetValue(NULL, ec);
+        }
         GetValue rv;
         return rv;
     }
@@ -1453,6 +2708,14 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
 
         // if v is locked return error
         if (v->isLocked(currentTime)) {
+            if (cookie && getlWaiters.add(vbucket, key, cookie,
+                                          v->getLockExpiry())) {
+                // Parked until the lock's released or expires.
+                ++stats.numGetlWaits;
+                GetValue rv(NULL, ENGINE_EWOULDBLOCK);
+                cb.callback(rv);
+                return false;
+            }
             GetValue rv;
             cb.callback(rv);
             return false;
@@ -1473,13 +2736,19 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
         v->lock(currentTime + lockTimeout);
 
         Item *it = v->toItem(false, vbucket);
-        it->setCas();
+        it->setCas(vb->ht.nextCas());
         v->setCas(it->getCas());
 
         GetValue rv(it);
         cb.callback(rv);
 
     } else {
+        if (cookie && unlocked_fetchIfEvicted(vb, key, bucket_num, cookie) ==
+            ENGINE_EWOULDBLOCK) {
+            GetValue rv(NULL, ENGINE_EWOULDBLOCK);
+            cb.callback(rv);
+            return false;
+        }
         GetValue rv;
         cb.callback(rv);
     }
@@ -1529,6 +2798,8 @@ EventuallyPersistentStore::unlockKey(const std::string &key,
         if (v->isLocked(currentTime)) {
             if (v->getCas() == cas) {
                 v->unlock();
+                lh.unlock();
+                notifyGetlWaiters(vbucket, key);
                 return ENGINE_SUCCESS;
             }
         }
@@ -1538,6 +2809,24 @@ EventuallyPersistentStore::unlockKey(const std::string &key,
     return ENGINE_KEY_ENOENT;
 }
 
+void EventuallyPersistentStore::notifyGetlExpiries() {
+    if (!getlWaiters.empty()) {
+        std::vector<const void*> cookies;
+        getlWaiters.expire(ep_current_time(), cookies);
+        notifyGetlCookies(cookies);
+    }
+}
+
+void EventuallyPersistentStore::notifyGetlCookies(
+                                   const std::vector<const void*> &cookies) {
+    // Each one runs its getl again, and is parked again if it lost the
+    // race for the lock.
+    std::vector<const void*>::const_iterator it;
+    for (it = cookies.begin(); it != cookies.end(); ++it) {
+        engine.notifyIOComplete(*it, ENGINE_SUCCESS);
+    }
+}
+
 
 ENGINE_ERROR_CODE EventuallyPersistentStore::getKeyStats(const std::string &key,
                                             uint16_t vbucket,
@@ -1565,6 +2854,74 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getKeyStats(const std::string &key,
     return ENGINE_KEY_ENOENT;
 }
 
+ENGINE_ERROR_CODE EventuallyPersistentStore::addKeyDurabilityWait(const std::string &key,
+                                                                uint16_t vbucket,
+                                                                uint64_t cas,
+                                                                bool persist,
+                                                                bool replicate,
+                                                                const void *cookie)
+{
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    if (!vb) {
+        ++stats.numNotMyVBuckets;
+        return ENGINE_NOT_MY_VBUCKET;
+    }
+
+    // Under the hash bucket lock, so that the persistence callback either
+    // marks the item clean before we look or finds the wait.
+    int bucket_num(0);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    if (!v) {
+        return ENGINE_KEY_ENOENT;
+    }
+    if (cas != 0 && v->getCas() != cas) {
+        return ENGINE_KEY_EEXISTS;
+    }
+    if (persist && ephemeral) {
+        return ENGINE_ENOTSUP;
+    }
+    persist = persist && v->isDirty();
+    if (!persist && !replicate) {
+        return ENGINE_SUCCESS;
+    }
+    vb->addHighPriorityVBEntry(key, v->getRevSeqno(), persist, replicate,
+                               cookie);
+    return ENGINE_EWOULDBLOCK;
+}
+
+void EventuallyPersistentStore::notifyItemsReplicated(const std::vector<queued_item> &items) {
+    std::vector<queued_item>::const_iterator it = items.begin();
+    for (; it != items.end(); ++it) {
+        RCPtr<VBucket> vb = getVBucket((*it)->getVBucketId());
+        if (!vb) {
+            continue;
+        }
+        vb->checkpointManager.noteReplicatedMutation((*it)->getMutationId());
+        if (vb->hasKeyWaiters()) {
+            vb->notifyKeyReplicated(engine, (*it)->getKey(),
+                                    (*it)->getRevSeqno());
+        }
+    }
+}
+
+/**
+ * True if two values hold the same bytes once uncompressed.
+ */
+static bool sameContents(value_t a, value_t b) {
+    if (a.get() && a->isCompressed()) {
+        a.reset(a->uncompress());
+    }
+    if (b.get() && b->isCompressed()) {
+        b.reset(b->uncompress());
+    }
+    if (a.get() == NULL || b.get() == NULL) {
+        return a.get() == b.get();
+    }
+    return a->length() == b->length() &&
+        memcmp(a->getData(), b->getData(), a->length()) == 0;
+}
+
 std::string EventuallyPersistentStore::validateKey(const std::string &key,
                                                    uint16_t vbucket,
                                                    Item &diskItem) {
@@ -1577,9 +2934,8 @@ std::string EventuallyPersistentStore::validateKey(const std::string &key,
     if (v) {
         if (diskItem.getFlags() != v->getFlags()) {
             return "flags_mismatch";
-        } else if (v->isResident() && memcmp(diskItem.getData(),
-                                             v->getValue()->getData(),
-                                             diskItem.getNBytes())) {
+        } else if (v->isResident() && !sameContents(diskItem.getValue(),
+                                                    v->getValue())) {
             return "data_mismatch";
         } else {
             return "valid";
@@ -1605,7 +2961,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
     uint32_t newFlags = itemMeta->flags;
     time_t newExptime = itemMeta->exptime;
 
-    RCPtr<VBucket> vb = getVBucket(vbucket);
+    EpochGuard eg;
+    VBucket *vb = peekVBucket(vbucket);
     if (!vb || (vb->getState() == vbucket_state_dead && !force)) {
         ++stats.numNotMyVBuckets;
         return ENGINE_NOT_MY_VBUCKET;
@@ -1613,8 +2970,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
         ++stats.numNotMyVBuckets;
         return ENGINE_NOT_MY_VBUCKET;
     } else if(vb->getState() == vbucket_state_pending && !force) {
-        if (vb->addPendingOp(cookie)) {
-            return ENGINE_EWOULDBLOCK;
+        ENGINE_ERROR_CODE ec = vb->addPendingOp(cookie);
+        if (ec != ENGINE_SUCCESS) {
+            return ec;
         }
     }
 
@@ -1648,6 +3006,12 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
         if (vb->getState() != vbucket_state_active && force) {
             lh.unlock();
             queueDirty(vb, key, queue_op_del, newSeqno, tapBackfill);
+        } else {
+            ENGINE_ERROR_CODE ec = unlocked_fetchIfEvicted(vb, key, bucket_num,
+                                                           cookie);
+            if (ec != ENGINE_SUCCESS) {
+                return ec;
+            }
         }
         return ENGINE_KEY_ENOENT;
     }
@@ -1682,22 +3046,32 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
         uint64_t seqnum = v ? v->getRevSeqno() : 1;
         lh.unlock();
         queueDirty(vb, key, queue_op_del, seqnum, tapBackfill);
+        notifyGetlWaiters(vbucket, key);
     }
     return rv;
 }
 
 void EventuallyPersistentStore::reset() {
+    // The items are swapped out of the hash tables and freed in the
+    // background, so the flush doesn't wait on the size of the bucket.
+    size_t chunkSize = engine.getConfiguration().getVbDelChunkSize();
+    ++flushAllCount;
     std::vector<int> buckets = vbMap.getBuckets();
     std::vector<int>::iterator it;
     for (it = buckets.begin(); it != buckets.end(); ++it) {
         RCPtr<VBucket> vb = getVBucket(*it);
         if (vb) {
-            vb->ht.clear();
+            shared_ptr<DispatcherCallback> cb(
+                new FlushAllMemoryCallback(stats, vb->ht.detach(),
+                                           vb->getId(), chunkSize));
+            nonIODispatcher->schedule(cb, NULL,
+                                      Priority::VBMemoryDeletionPriority,
+                                      0, false);
             vb->checkpointManager.clear(vb->getState());
             vb->resetStats();
         }
     }
-    if (diskFlushAll.cas(false, true)) {
+    if (!ephemeral && diskFlushAll.cas(false, true)) {
         ++stats.diskQueueSize;
         // wake up (notify) one flusher is good enough for diskFlushAll
         vbMap.shards[EP_PRIMARY_SHARD]->getFlusher()->notifyFlushEvent();
@@ -1735,15 +3109,26 @@ public:
                 }
                 v->setBySeqno(value.second);
             }
+            if (value.second > 0) {
+                vbucket->checkpointManager.notePersistedSeqno(
+                    static_cast<uint64_t>(value.second));
+            }
             if (v && v->getCas() == cas) {
                 // mark this item clean only if current and stored cas
                 // value match
                 v->markClean();
+                if (vbucket->getState() == vbucket_state_replica) {
+                    store->tierReplicaValue(vbucket, v);
+                }
             }
+            vbucket->notifyKeyPersisted(store->getEPEngine(),
+                                        queuedItem->getKey(),
+                                        queuedItem->getRevSeqno());
 
             vbucket->doStatsForFlushing(*queuedItem, queuedItem->size());
             stats->decrDiskQueueSize(1);
             stats->totalPersisted++;
+            addPersistLatency();
         } else {
             // If the return was 0 here, we're in a bad state because
             // we do not know the rowid of this object.
@@ -1800,6 +3185,9 @@ public:
             } else if (v) {
                 v->clearBySeqno();
             }
+            vbucket->notifyKeyPersisted(store->getEPEngine(),
+                                        queuedItem->getKey(),
+                                        queuedItem->getRevSeqno());
 
             if (value > 0) {
                 ++stats->totalPersisted;
@@ -1809,6 +3197,7 @@ public:
 
             vbucket->doStatsForFlushing(*queuedItem, queuedItem->size());
             stats->decrDiskQueueSize(1);
+            addPersistLatency();
         } else {
             std::stringstream ss;
             ss << "Fatal error in persisting DELETE ``" << queuedItem->getKey() << "'' on vb "
@@ -1818,8 +3207,22 @@ public:
         }
     }
 
+    //! Account for the write being dropped along with its vbucket
+    void dropped() {
+        vbucket->doStatsForFlushing(*queuedItem, queuedItem->size());
+        stats->decrDiskQueueSize(1);
+    }
+
 private:
 
+    void addPersistLatency() {
+        rel_time_t now = ep_current_time();
+        rel_time_t queued = queuedItem->getQueuedTime();
+        hrtime_t latency = now > queued ? (now - queued) * ONE_SECOND : 0;
+        stats->persistLatencyHisto.add(latency);
+        vbucket->persistLatencyHisto.add(latency);
+    }
+
     void redirty() {
         if (store->vbMap.isBucketDeletion(vbucket->getId())) {
             vbucket->doStatsForFlushing(*queuedItem, queuedItem->size());
@@ -1849,7 +3252,7 @@ void EventuallyPersistentStore::flushOneDeleteAll() {
     stats.decrDiskQueueSize(1);
 }
 
-int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
+int EventuallyPersistentStore::flushVBucket(uint16_t vbid, bool wait) {
     if (diskFlushAll) {
         if (vbMap.getShard(vbid)->getId() == EP_PRIMARY_SHARD) {
             flushOneDeleteAll();
@@ -1858,85 +3261,203 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
             return 0;
         }
     }
+    return commitFlush(prepareFlush(vbid), wait);
+}
 
-    int items_flushed = 0;
-    bool schedule_vb_snapshot = false;
-    rel_time_t flush_start = ep_current_time();
+FlushBatch *EventuallyPersistentStore::prepareFlush(uint16_t vbid) {
+    FlushBatch *batch = new FlushBatch(vbid);
+    batch->flushAllCount = flushAllCount.get();
     RCPtr<VBucket> vb = vbMap.getBucket(vbid);
-    if (vb && !vbMap.isBucketCreation(vbid)) {
-        std::vector<queued_item> items;
-        KVStore *rwUnderlying = getRWUnderlying(vbid);
-
-        while (!vb->rejectQueue.empty()) {
-            items.push_back(vb->rejectQueue.front());
-            vb->rejectQueue.pop();
+    if (!vb || vbMap.isBucketCreation(vbid)) {
+        return batch;
+    }
+    batch->vb = vb;
+
+    std::vector<queued_item> items;
+    while (!vb->rejectQueue.empty()) {
+        items.push_back(vb->rejectQueue.front());
+        vb->rejectQueue.pop();
+    }
+
+    vb->getBackfillItems(items);
+    // Closed checkpoints are read without holding the checkpoint lock.
+    vb->checkpointManager.getItemsForPersistence(batch->range, items);
+    batch->range.getItems(items);
+    if (items.empty()) {
+        return batch;
+    }
+
+    batch->dirty = true;
+    getRWUnderlying(vbid)->optimizeWrites(items);
+
+    // The batch spans every closed checkpoint not yet persisted, so a key
+    // updated in several of them is queued several times.  Only one write
+    // goes out per key, with the hash table's current value; the others
+    // are drained as if written, the commit satisfying their waiters.
+    QueuedItem *prev = NULL;
+    std::vector<queued_item>::iterator it = items.begin();
+    for(; it != items.end(); ++it) {
+        batch->oldest = std::min(batch->oldest, (*it)->getQueuedTime());
+        batch->lastMutationId = std::max(batch->lastMutationId,
+                                         (*it)->getMutationId());
+        if ((*it)->getOperation() != queue_op_set &&
+            (*it)->getOperation() != queue_op_del) {
+            continue;
+        } else if (!prev || prev->getKey() != (*it)->getKey()) {
+            prev = (*it).get();
+            ++batch->itemsFlushed;
+            // The callbacks hold on to the vbucket by reference, so it has
+            // to be the batch's, which outlives this call.
+            flushOneDelOrSet(*it, batch->vb, *batch);
+            ++stats.flusher_todo;
+        } else {
+            ++stats.flushCoalesced;
+            stats.decrDiskQueueSize(1);
+            vb->doStatsForFlushing(*(*it), (*it)->size());
         }
+    }
+    return batch;
+}
 
-        vb->getBackfillItems(items);
-        vb->checkpointManager.getAllItemsForPersistence(items);
+int EventuallyPersistentStore::commitFlush(FlushBatch *batch, bool wait) {
+    uint16_t vbid = batch->vbid;
+    RCPtr<VBucket> vb = batch->vb;
+    int items_flushed = batch->itemsFlushed;
 
-        if (!items.empty()) {
+    // The batch may have been prepared before its vbucket was deleted or
+    // the bucket was flushed. Its writes must not reach the file after it
+    // is removed or reset.
+    bool flushedAll = diskFlushAll || batch->flushAllCount != flushAllCount;
+    if (vb && batch->dirty && (flushedAll || vbMap.isBucketDeletion(vbid))) {
+        std::vector<FlushBatch::Write>::iterator wit = batch->writes.begin();
+        for (; wit != batch->writes.end(); ++wit) {
+            // A flush_all already took the vbucket's dirty items off the
+            // disk queue stats.
+            if (!flushedAll) {
+                wit->cb->dropped();
+            }
+            delete wit->cb;
+        }
+        delete batch;
+        return 0;
+    }
+    if (vb) {
+        KVStore *rwUnderlying = getRWUnderlying(vbid);
+        if (batch->dirty) {
+            IOSlot slot(ioScheduler, IO_CLASS_FLUSHER);
+            hrtime_t flushBegin = gethrtime();
             while (!rwUnderlying->begin()) {
                 ++stats.beginFailed;
                 LOG(EXTENSION_LOG_WARNING, "Failed to start a transaction!!! "
                     "Retry in 1 sec ...");
                 sleep(1);
             }
-            rwUnderlying->optimizeWrites(items);
-
-            QueuedItem *prev = NULL;
-            std::list<PersistenceCallback*> pcbs;
-            std::vector<queued_item>::iterator it = items.begin();
-            for(; it != items.end(); ++it) {
-                if ((*it)->getOperation() != queue_op_set &&
-                    (*it)->getOperation() != queue_op_del) {
-                    continue;
-                } else if (!prev || prev->getKey() != (*it)->getKey()) {
-                    prev = (*it).get();
-                    ++items_flushed;
-                    PersistenceCallback *cb = flushOneDelOrSet(*it, vb);
-                    if (cb) {
-                        pcbs.push_back(cb);
-                    }
-                    ++stats.flusher_todo;
+
+            std::vector<FlushBatch::Write>::iterator wit =
+                batch->writes.begin();
+            for (; wit != batch->writes.end(); ++wit) {
+                if (wit->del) {
+                    BlockTimer timer(&stats.diskDelHisto, "disk_delete",
+                                     stats.timingLog);
+                    rwUnderlying->del(*wit->itm, wit->rowid, *wit->cb);
                 } else {
-                    stats.decrDiskQueueSize(1);
-                    vb->doStatsForFlushing(*(*it), (*it)->size());
+                    BlockTimer timer(wit->rowid == -1 ?
+                                     &stats.diskInsertHisto :
+                                     &stats.diskUpdateHisto,
+                                     wit->rowid == -1 ?
+                                     "disk_insert" : "disk_update",
+                                     stats.timingLog);
+                    rwUnderlying->set(*wit->itm, *wit->cb);
                 }
+                wit->itm.reset();
             }
 
             BlockTimer timer(&stats.diskCommitHisto, "disk_commit",
                              stats.timingLog);
             hrtime_t start = gethrtime();
 
-            while (!rwUnderlying->commit()) {
+            while (!rwUnderlying->commitNoWait()) {
                 ++stats.commitFailed;
                 LOG(EXTENSION_LOG_WARNING, "Flusher commit failed!!! Retry in "
                     "1 sec...\n");
                 sleep(1);
             }
 
-            while (!pcbs.empty()) {
-                delete pcbs.front();
-                pcbs.pop_front();
-            }
-
             ++stats.flusherCommits;
             hrtime_t end = gethrtime();
             uint64_t commit_time = (end - start) / 1000000;
-            uint64_t trans_time = (end - flush_start) / 1000000;
+            uint64_t trans_time = (end - batch->flushStart) / 1000000;
 
             lastTransTimePerItem = (items_flushed == 0) ? 0 :
                 static_cast<double>(trans_time) /
                 static_cast<double>(items_flushed);
             stats.commit_time.set(commit_time);
             stats.cumulativeCommitTime.incr(commit_time);
-            stats.cumulativeFlushTime.incr(ep_current_time() - flush_start);
+            stats.cumulativeFlushTime.incr(ep_current_time() -
+                                           batch->flushStart);
             stats.flusher_todo.set(0);
+
+            uint64_t latency = (ep_current_time() - batch->oldest) * 1000;
+            vb->flushLatency.set(latency);
+            vb->flushLatencyMax.setIfBigger(latency);
+            vb->flushDuration.set((end - flushBegin) / 1000);
+        }
+    }
+
+    uint16_t shardId = vbMap.getShard(vbid)->getId();
+    uncompletedFlushes[shardId].push_back(batch);
+    if (wait) {
+        completeFlushes(shardId);
+    }
+    return items_flushed;
+}
+
+void EventuallyPersistentStore::completeFlushes(uint16_t shardId) {
+    std::list<FlushBatch *> &batches = uncompletedFlushes[shardId];
+    if (batches.empty()) {
+        return;
+    }
+    vbMap.shards[shardId]->getRWUnderlying()->completeCommits();
+    while (!batches.empty()) {
+        FlushBatch *batch = batches.front();
+        batches.pop_front();
+        finishFlush(batch);
+    }
+}
+
+void EventuallyPersistentStore::finishFlush(FlushBatch *batch) {
+    uint16_t vbid = batch->vbid;
+    RCPtr<VBucket> vb = batch->vb;
+    bool schedule_vb_snapshot = false;
+    if (vb) {
+        if (batch->dirty) {
+            std::vector<FlushBatch::Write>::iterator wit =
+                batch->writes.begin();
+            for (; wit != batch->writes.end(); ++wit) {
+                delete wit->cb;
+            }
+            batch->writes.clear();
+            vb->notifyPersistenceWaiters(engine);
+        }
+
+        // The persistence cursor only moves past the closed checkpoints once
+        // their items are committed.
+        bool closedFlushed = !batch->range.empty();
+        vb->checkpointManager.commitPersistenceRange(batch->range);
+        if (closedFlushed && vb->checkpointManager.hasNextForPersistence()) {
+            // Get back to the items in the open checkpoint.
+            vbMap.getShard(vbid)->getFlusher()->notifyFlushEvent();
+        }
+
+        // Only this thread writes the vbucket, so nothing gets to disk
+        // between the rebuild's key dump and the swap.
+        if (stats.warmupComplete.get() && vb->needsFilterRebuild()) {
+            rebuildFilter(vb);
         }
 
         uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
         if (vb->rejectQueue.empty()) {
+            vb->checkpointManager.notePersistedMutation(batch->lastMutationId);
             vb->notifyCheckpointPersisted(engine, chkid);
         }
 
@@ -1945,25 +3466,41 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
             schedule_vb_snapshot = true;
         }
     }
+    delete batch;
 
     if (schedule_vb_snapshot || snapshotVBState) {
         scheduleVBSnapshot(Priority::VBucketPersistHighPriority,
                            vbMap.getShard(vbid)->getId());
     }
+}
 
-    return items_flushed;
+void EventuallyPersistentStore::rebuildFilter(RCPtr<VBucket> &vb) {
+    KVStore *rwUnderlying = getRWUnderlying(vb->getId());
+    if (!rwUnderlying->isKeyDumpSupported()) {
+        return;
+    }
+    BloomFilter *rebuilt = vb->createRebuildFilter();
+    if (!rebuilt) {
+        return;
+    }
+    shared_ptr<Callback<GetValue> > cb(new FilterRebuildCallback(*rebuilt));
+    rwUnderlying->dumpKeys(vb->getId(), cb);
+    vb->swapFilter(rebuilt);
+    ++stats.numBloomFilterRebuilds;
+    LOG(EXTENSION_LOG_INFO, "Rebuilt the bloom filter of vbucket %d",
+        vb->getId());
 }
 
 // While I actually know whether a delete or set was intended, I'm
 // still a bit better off running the older code that figures it out
 // based on what's in memory.
-PersistenceCallback*
-EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
-                                            RCPtr<VBucket> &vb) {
+void EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
+                                                 RCPtr<VBucket> &vb,
+                                                 FlushBatch &batch) {
 
     if (!vb) {
         stats.decrDiskQueueSize(1);
-        return NULL;
+        return;
     }
 
     int bucket_num(0);
@@ -1978,14 +3515,14 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
     bool isDirty = found && v->isDirty();
     rel_time_t queued(qi->getQueuedTime());
 
-    Item itm(qi->getKey(),
-             found ? v->getFlags() : 0,
-             found ? v->getExptime() : 0,
-             found ? v->getValue() : value_t(NULL),
-             found ? v->getCas() : Item::nextCas(),
-             rowid,
-             qi->getVBucketId(),
-             found ? v->getRevSeqno() : qi->getRevSeqno());
+    shared_ptr<Item> itm(new Item(qi->getKey(),
+                         found ? v->getFlags() : 0,
+                         found ? v->getExptime() : 0,
+                         found ? v->getValue() : value_t(NULL),
+                         found ? v->getCas() : vb->ht.nextCas(),
+                         rowid,
+                         qi->getVBucketId(),
+                         found ? v->getRevSeqno() : qi->getRevSeqno()));
 
     if (!deleted && isDirty && v->isExpired(ep_real_time() + itemExpiryWindow)) {
         ++stats.flushExpired;
@@ -1993,7 +3530,7 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
         vb->doStatsForFlushing(*qi, itemBytes);
         v->markClean();
         v->clearBySeqno();
-        return NULL;
+        return;
     }
 
     if (isDirty) {
@@ -2008,16 +3545,15 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
             v->reDirty();
             vb->rejectQueue.push(qi);
             ++vb->opsReject;
-            return NULL;
+            return;
         }
     }
 
-    KVStore *rwUnderlying = getRWUnderlying(qi->getVBucketId());
     if (isDirty && !deleted) {
         if (vbMap.isBucketDeletion(qi->getVBucketId())) {
             stats.decrDiskQueueSize(1);
             vb->doStatsForFlushing(*qi, itemBytes);
-            return NULL;
+            return;
         }
         // Wait until the vbucket database is created by the vbucket state
         // snapshot task.
@@ -2031,27 +3567,32 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
             if (rowid == -1) {
                 v->setPendingBySeqno();
             }
+            // Before the item can be marked clean and evicted.
+            vb->addToFilter(qi->getKey());
+            // Only the metadata of an ejected item changed.
+            bool metaOnly = !v->isResident();
 
             lh.unlock();
-            BlockTimer timer(rowid == -1 ?
-                             &stats.diskInsertHisto : &stats.diskUpdateHisto,
-                             rowid == -1 ? "disk_insert" : "disk_update",
-                             stats.timingLog);
+            if (metaOnly && !readBackValue(*itm, rowid)) {
+                vb->rejectQueue.push(qi);
+                ++vb->opsReject;
+                return;
+            }
             PersistenceCallback *cb;
-            cb = new PersistenceCallback(qi, vb, this, &stats, itm.getCas());
-            rwUnderlying->set(itm, *cb);
+            cb = new PersistenceCallback(qi, vb, this, &stats, itm->getCas());
+            batch.writes.push_back(FlushBatch::Write(itm, rowid, false, cb));
             if (rowid == -1)  {
                 ++vb->opsCreate;
             } else {
                 ++vb->opsUpdate;
             }
-            return cb;
+            return;
         }
     } else if (deleted || !found) {
         if (vbMap.isBucketDeletion(qi->getVBucketId())) {
             stats.decrDiskQueueSize(1);
             vb->doStatsForFlushing(*qi, itemBytes);
-            return NULL;
+            return;
         }
 
         if (vbMap.isBucketCreation(qi->getVBucketId())) {
@@ -2063,21 +3604,39 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
             ++vb->opsReject;
         } else {
             lh.unlock();
-            BlockTimer timer(&stats.diskDelHisto, "disk_delete", stats.timingLog);
             PersistenceCallback *cb;
             cb = new PersistenceCallback(qi, vb, this, &stats, 0);
-            rwUnderlying->del(itm, rowid, *cb);
-            return cb;
+            batch.writes.push_back(FlushBatch::Write(itm, rowid, true, cb));
+            return;
         }
     } else {
         stats.decrDiskQueueSize(1);
         vb->doStatsForFlushing(*qi, itemBytes);
     }
+}
 
-    return NULL;
+bool EventuallyPersistentStore::readBackValue(Item &itm, int64_t rowid) {
+    RememberingCallback<GetValue> gcb;
+    getRWUnderlying(itm.getVBucketId())->get(itm.getKey(), rowid,
+                                             itm.getVBucketId(), gcb);
+    gcb.waitForValue();
+    assert(gcb.fired);
+    Item *disk = gcb.val.getValue();
+    if (gcb.val.getStatus() != ENGINE_SUCCESS || disk == NULL) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to read back the value of vb=%d key=%s to "
+            "write its metadata, will retry", itm.getVBucketId(),
+            itm.getKey().c_str());
+        delete disk;
+        return false;
+    }
+    itm.setValue(disk->getValue());
+    delete disk;
+    ++stats.flushMetaOnly;
+    return true;
 }
 
-void EventuallyPersistentStore::queueDirty(RCPtr<VBucket> &vb,
+void EventuallyPersistentStore::queueDirty(VBucket *vb,
                                            const std::string &key,
                                            enum queue_operation op,
                                            uint64_t seqno,
@@ -2085,8 +3644,18 @@ void EventuallyPersistentStore::queueDirty(RCPtr<VBucket> &vb,
                                            bool notifyReplicator) {
     if (vb) {
         uint16_t vbid = vb->getId();
-        ++stats.diskQueueSize;
         queued_item itm(new QueuedItem(key, vbid, op, seqno));
+        if (ephemeral) {
+            // Only the TAP cursors read the checkpoints.
+            if (!tapBackfill) {
+                vb->checkpointManager.queueDirty(itm, vb);
+                if (notifyReplicator) {
+                    engine.getTapConnMap().notifyVBConnections(vbid);
+                }
+            }
+            return;
+        }
+        ++stats.diskQueueSize;
         vb->doStatsForQueueing(*itm, itm->size());
 
         bool rv = tapBackfill ? vb->queueBackfillItem(itm) :
@@ -2105,6 +3674,27 @@ void EventuallyPersistentStore::queueDirty(RCPtr<VBucket> &vb,
     }
 }
 
+void EventuallyPersistentStore::queueDirtyBatch(RCPtr<VBucket> &vb,
+                                                const std::vector<queued_item> &items) {
+    if (items.empty()) {
+        return;
+    }
+    uint16_t vbid = vb->getId();
+    if (!ephemeral) {
+        stats.diskQueueSize.incr(items.size());
+        std::vector<queued_item>::const_iterator it = items.begin();
+        for (; it != items.end(); ++it) {
+            vb->doStatsForQueueing(**it, (*it)->size());
+        }
+    }
+    size_t queued = vb->checkpointManager.queueDirtyBatch(items, vb.get());
+    if (!ephemeral && queued > 0) {
+        vbMap.getShard(vbid)->getFlusher()->notifyFlushEvent();
+        stats.totalEnqueued += queued;
+    }
+    engine.getTapConnMap().notifyVBConnections(vbid);
+}
+
 std::map<uint16_t, vbucket_state> EventuallyPersistentStore::loadVBucketState() {
     return getOneROUnderlying()->listPersistedVbuckets();
 }
@@ -2118,6 +3708,11 @@ void EventuallyPersistentStore::loadSessionStats() {
 void EventuallyPersistentStore::warmupCompleted() {
     stats.warmupComplete.set(true);
 
+    if (ephemeral) {
+        // No state, stats or access log is written.
+        return;
+    }
+
     // Run the vbucket state snapshot job once after the warmup
     scheduleVBSnapshot(Priority::VBucketPersistHighPriority);
 
@@ -2132,11 +3727,14 @@ void EventuallyPersistentStore::warmupCompleted() {
     }
 
     // "0" sleep_time means that the first snapshot task will be executed right after
-    // warmup. Subsequent snapshot tasks will be scheduled every 60 sec by default.
+    // warmup. Subsequent ones are stats_snapshot_interval apart.
     IOManager *iom = IOManager::get();
     statsSnapshotTaskId =
         iom->scheduleStatsSnapshot(&engine, Priority::StatSnapPriority, 0,
                                    false, 0);
+
+    // Compactions only begin once the files are no longer being loaded.
+    startCompactor();
 }
 
 void EventuallyPersistentStore::maybeEnableTraffic()
@@ -2174,6 +3772,13 @@ void EventuallyPersistentStore::stopWarmup(void)
     }
 }
 
+void EventuallyPersistentStore::memoryQuotaChanged(size_t quota) {
+    if (itemPager) {
+        itemPager->quotaChanged(quota);
+        nonIODispatcher->wake(itemPagerTask);
+    }
+}
+
 void EventuallyPersistentStore::setExpiryPagerSleeptime(size_t val) {
     LockHolder lh(expiryPager.mutex);
 
@@ -2211,6 +3816,29 @@ void EventuallyPersistentStore::setAccessScannerSleeptime(size_t val) {
     }
 }
 
+void EventuallyPersistentStore::tierReplicaValue(RCPtr<VBucket> &vb,
+                                                 StoredValue *v) {
+    if (replicaValuePolicy == REPLICA_VALUES_EJECTED) {
+        size_t len = v->valuelen();
+        if (v->eligibleForEviction() && v->ejectValue(stats, vb->ht)) {
+            ++stats.replicaValuesEjected;
+            stats.replicaBytesReclaimed.incr(len);
+        }
+    } else if (replicaValuePolicy == REPLICA_VALUES_COMPRESSED) {
+        size_t saved = v->compressValue(vb->ht);
+        if (saved > 0) {
+            ++stats.replicaValuesCompressed;
+            stats.replicaBytesReclaimed.incr(saved);
+        }
+    }
+}
+
+std::string EventuallyPersistentStore::getAccessLogPath(uint16_t shardId) {
+    std::stringstream ss;
+    ss << engine.getConfiguration().getAlogPath() << "." << shardId;
+    return ss.str();
+}
+
 void EventuallyPersistentStore::resetAccessScannerStartTime() {
     LockHolder lh(accessScanner.mutex);
 
@@ -2244,10 +3872,54 @@ void EventuallyPersistentStore::visit(VBucketVisitor &visitor)
     visitor.complete();
 }
 
+/**
+ * Stops the visit of a hash table once its time slice is used up.
+ */
+class TimeSlicedVisitor : public HashTableVisitor {
+public:
+    /**
+     * @param v the visitor to pass the items on to
+     * @param slice the time slice (ms), 0 for no limit
+     */
+    TimeSlicedVisitor(HashTableVisitor &v, size_t slice) :
+        visitor(v), deadline(0), expired(false)
+    {
+        if (slice > 0) {
+            deadline = gethrtime() + static_cast<hrtime_t>(slice) * 1000000;
+        }
+    }
+
+    void visit(StoredValue *v) {
+        visitor.visit(v);
+    }
+
+    bool shouldContinue() {
+        if (!visitor.shouldContinue()) {
+            return false;
+        }
+        if (deadline != 0 && gethrtime() >= deadline) {
+            expired = true;
+            return false;
+        }
+        return true;
+    }
+
+    //! True if the visit stopped because the time slice was up.
+    bool timedOut() const {
+        return expired;
+    }
+
+private:
+    HashTableVisitor &visitor;
+    hrtime_t          deadline;
+    bool              expired;
+};
+
 VBCBAdaptor::VBCBAdaptor(EventuallyPersistentStore *s,
                          shared_ptr<VBucketVisitor> v,
-                         const char *l, double sleep) :
-    store(s), visitor(v), label(l), sleepTime(sleep), currentvb(0)
+                         const char *l, double sleep, int shard) :
+    store(s), visitor(v), label(l), sleepTime(sleep), currentvb(0),
+    resuming(false)
 {
     const VBucketFilter &vbFilter = visitor->getVBucketFilter();
     size_t maxSize = store->vbMap.getSize();
@@ -2255,26 +3927,47 @@ VBCBAdaptor::VBCBAdaptor(EventuallyPersistentStore *s,
     for (size_t i = 0; i < maxSize; ++i) {
         uint16_t vbid = static_cast<uint16_t>(i);
         RCPtr<VBucket> vb = store->vbMap.getBucket(vbid);
-        if (vb && vbFilter(vbid)) {
+        if (vb && vbFilter(vbid) &&
+            (shard < 0 || store->vbMap.getShard(vbid)->getId() == shard)) {
             vbList.push(vbid);
         }
     }
 }
 
 bool VBCBAdaptor::callback(Dispatcher & d, TaskId &t) {
+    double snoozeTime = 0;
+    bool again = visitNext(snoozeTime);
+    if (again) {
+        d.snooze(t, snoozeTime);
+    }
+    return again;
+}
+
+bool VBCBAdaptor::visitNext(double &snoozeTime) {
+    snoozeTime = 0;
     if (!vbList.empty()) {
         currentvb = vbList.front();
         RCPtr<VBucket> vb = store->vbMap.getBucket(currentvb);
         if (vb) {
             if (visitor->pauseVisitor()) {
-                d.snooze(t, sleepTime);
+                snoozeTime = sleepTime;
                 return true;
             }
-            if (visitor->visitBucket(vb)) {
-                vb->ht.visit(*visitor);
+            if (resuming || visitor->visitBucket(vb)) {
+                Configuration &config = store->getEPEngine().getConfiguration();
+                TimeSlicedVisitor sliced(*visitor,
+                                         config.getVisitorTimeSlice());
+                position = vb->ht.pauseResumeVisit(sliced, position);
+                if (sliced.timedOut() && position != vb->ht.endPosition()) {
+                    // Let the other tasks run before we carry on.
+                    resuming = true;
+                    return true;
+                }
             }
         }
         vbList.pop();
+        position = HashTable::Position();
+        resuming = false;
     }
 
     bool isdone = vbList.empty();
@@ -2284,43 +3977,91 @@ bool VBCBAdaptor::callback(Dispatcher & d, TaskId &t) {
     return !isdone;
 }
 
+void EventuallyPersistentStore::visitShard(shared_ptr<VBucketVisitor> visitor,
+                                           const char *lbl, uint16_t shard,
+                                           const Priority &prio,
+                                           double sleepTime) {
+    shared_ptr<VBCBAdaptor> adaptor(new VBCBAdaptor(this, visitor, lbl,
+                                                    sleepTime, shard));
+    IOManager::get()->scheduleShardVisit(&engine, adaptor, prio, shard);
+}
+
 void EventuallyPersistentStore::resetUnderlyingStats(void)
 {
+    if (ephemeral) {
+        return;
+    }
     for (size_t i = 0; i < vbMap.numShards; i++) {
         KVShard *shard = vbMap.shards[i];
         shard->getRWUnderlying()->resetStats();
         shard->getROUnderlying()->resetStats();
+        shard->getAuxUnderlying()->resetStats();
+        const std::vector<BgFetcher *> &bgfetchers = shard->getBgFetchers();
+        for (size_t j = 1; j < bgfetchers.size(); ++j) {
+            bgfetchers[j]->getReader()->resetStats();
+        }
     }
-    auxUnderlying->resetStats();
 }
 
 void EventuallyPersistentStore::addKVStoreStats(ADD_STAT add_stat,
                                                 const void* cookie) {
+    if (ephemeral) {
+        return;
+    }
     for (size_t i = 0; i < vbMap.numShards; i++) {
         std::stringstream rwPrefix;
         std::stringstream roPrefix;
+        std::stringstream auxPrefix;
         rwPrefix << "rw_" << i;
         roPrefix << "ro_" << i;
+        auxPrefix << "aux_" << i;
         vbMap.shards[i]->getRWUnderlying()->addStats(rwPrefix.str(), add_stat,
                                                      cookie);
         vbMap.shards[i]->getROUnderlying()->addStats(roPrefix.str(), add_stat,
                                                      cookie);
+        vbMap.shards[i]->getAuxUnderlying()->addStats(auxPrefix.str(),
+                                                      add_stat, cookie);
+        // The readers of the shard's other bg fetchers
+        const std::vector<BgFetcher *> &bgfetchers =
+            vbMap.shards[i]->getBgFetchers();
+        for (size_t j = 1; j < bgfetchers.size(); ++j) {
+            std::stringstream prefix;
+            prefix << roPrefix.str() << "_" << j;
+            bgfetchers[j]->getReader()->addStats(prefix.str(), add_stat,
+                                                 cookie);
+        }
     }
 }
 
 void EventuallyPersistentStore::addKVStoreTimingStats(ADD_STAT add_stat,
                                                       const void* cookie) {
+    if (ephemeral) {
+        return;
+    }
     for (size_t i = 0; i < vbMap.numShards; i++) {
         std::stringstream rwPrefix;
         std::stringstream roPrefix;
+        std::stringstream auxPrefix;
         rwPrefix << "rw_" << i;
         roPrefix << "ro_" << i;
+        auxPrefix << "aux_" << i;
         vbMap.shards[i]->getRWUnderlying()->addTimingStats(rwPrefix.str(),
                                                            add_stat,
                                                            cookie);
         vbMap.shards[i]->getROUnderlying()->addTimingStats(roPrefix.str(),
                                                            add_stat,
                                                            cookie);
+        vbMap.shards[i]->getAuxUnderlying()->addTimingStats(auxPrefix.str(),
+                                                            add_stat,
+                                                            cookie);
+        const std::vector<BgFetcher *> &bgfetchers =
+            vbMap.shards[i]->getBgFetchers();
+        for (size_t j = 1; j < bgfetchers.size(); ++j) {
+            std::stringstream prefix;
+            prefix << roPrefix.str() << "_" << j;
+            bgfetchers[j]->getReader()->addTimingStats(prefix.str(), add_stat,
+                                                       cookie);
+        }
     }
 }
 
@@ -44,6 +44,8 @@
 #include "bgfetcher.h"
 #include "conflict_resolution.h"
 #include "dispatcher.h"
+#include "getl_wait_queue.h"
+#include "io_scheduler.h"
 #include "item_pager.h"
 #include "kvstore.h"
 #include "locks.h"
@@ -51,6 +53,7 @@
 #include "queueditem.h"
 #include "stats.h"
 #include "stored-value.h"
+#include "subdoc.h"
 #include "vbucket.h"
 #include "vbucketmap.h"
 
@@ -112,6 +115,7 @@ protected:
 // Forward declaration
 class Flusher;
 class Warmup;
+class RangeScan;
 class TapBGFetchCallback;
 class EventuallyPersistentStore;
 
@@ -119,12 +123,21 @@ class PersistenceCallback;
 
 /**
  * VBucket visitor callback adaptor.
+ *
+ * Visits one vbucket per run.  With a visitor_time_slice set, a run that
+ * has scanned the vbucket's hash table for that long snoozes the task and
+ * carries on from the same position on its next run, so the other tasks
+ * of the thread get their turn in between.
  */
 class VBCBAdaptor : public DispatcherCallback {
 public:
 
+    /**
+     * @param shard only visit the vbuckets of this shard (-1 for all)
+     */
     VBCBAdaptor(EventuallyPersistentStore *s,
-                shared_ptr<VBucketVisitor> v, const char *l, double sleep=0);
+                shared_ptr<VBucketVisitor> v, const char *l, double sleep=0,
+                int shard=-1);
 
     std::string description() {
         std::stringstream rv;
@@ -134,6 +147,14 @@ public:
 
     bool callback(Dispatcher &d, TaskId &t);
 
+    /**
+     * Do one run's worth of the visit, whichever task runs it.
+     *
+     * @param snoozeTime set to how long to wait before the next run
+     * @return true if there's more to visit
+     */
+    bool visitNext(double &snoozeTime);
+
 private:
     std::queue<uint16_t>        vbList;
     EventuallyPersistentStore  *store;
@@ -141,6 +162,10 @@ private:
     const char                 *label;
     double                      sleepTime;
     uint16_t                    currentvb;
+    //! Where the visit of the current vbucket's hash table yielded
+    HashTable::Position         position;
+    //! True if we're part way through the current vbucket
+    bool                        resuming;
 
     DISALLOW_COPY_AND_ASSIGN(VBCBAdaptor);
 };
@@ -148,6 +173,102 @@ private:
 const uint16_t EP_PRIMARY_SHARD = 0;
 class KVShard;
 
+/**
+ * One key of a batched get, and what was found for it.
+ */
+struct MultiGetItem {
+    MultiGetItem(const std::string &k, uint16_t vb) : key(k), vbucket(vb) { }
+
+    std::string key;
+    uint16_t vbucket;
+    GetValue value;
+};
+
+/**
+ * One key of a batched get_meta, with the metadata of the revision another
+ * cluster has of it, and whether that revision would win.
+ */
+struct MultiGetMetaItem {
+    MultiGetMetaItem(const std::string &k, const ItemMetaData &m, bool del)
+        : key(k), meta(m), isDelete(del), status(ENGINE_SUCCESS) { }
+
+    std::string key;
+    ItemMetaData meta;
+    //! The remote revision is a deletion
+    bool isDelete;
+    //! ENGINE_SUCCESS if the remote revision would win, ENGINE_KEY_EEXISTS
+    //! if it would lose, or ENGINE_EWOULDBLOCK if the key's metadata is
+    //! being fetched
+    ENGINE_ERROR_CODE status;
+};
+
+/**
+ * One mutation of a batch of setWithMeta and deleteWithMeta, and how it
+ * went.
+ */
+struct WithMetaItem {
+    WithMetaItem(Item *i, bool del, bool f, uint8_t n = 0xff)
+        : item(i), isDelete(del), force(f), nru(n), status(ENGINE_SUCCESS) { }
+
+    //! The key and metadata of the mutation, and a set's value
+    Item *item;
+    bool isDelete;
+    //! Skip the conflict resolution
+    bool force;
+    //! The nru value to store a set with (0xff to leave it be)
+    uint8_t nru;
+    ENGINE_ERROR_CODE status;
+};
+
+/**
+ * A vbucket's dirty items taken for a flush and looked up in its hash
+ * table, with the writes they make.  A flusher may prepare the batch of its
+ * next vbucket while the one before is written and committed.
+ */
+struct FlushBatch {
+    //! A set or delete to issue to the KVStore
+    struct Write {
+        Write(const shared_ptr<Item> &i, int64_t r, bool d,
+              PersistenceCallback *c) : itm(i), rowid(r), del(d), cb(c) { }
+
+        shared_ptr<Item> itm;
+        int64_t rowid;
+        bool del;
+        PersistenceCallback *cb;
+    };
+
+    FlushBatch(uint16_t id) :
+        vbid(id), dirty(false), itemsFlushed(0), lastMutationId(0),
+        flushAllCount(0), oldest(ep_current_time()),
+        flushStart(ep_current_time()) { }
+
+    uint16_t vbid;
+    //! NULL if there's no vbucket to flush
+    RCPtr<VBucket> vb;
+    PersistenceRange range;
+    std::vector<Write> writes;
+    //! True if any items were taken, even if none of them is written
+    bool dirty;
+    int itemsFlushed;
+    //! The mutation id of the last mutation taken
+    uint64_t lastMutationId;
+    //! How many flush_alls the bucket had seen when the batch was prepared
+    size_t flushAllCount;
+    //! When the oldest item taken was queued
+    rel_time_t oldest;
+    rel_time_t flushStart;
+};
+
+/**
+ * What's kept in memory of a replica vbucket's values once they're
+ * persisted.
+ */
+enum replica_value_policy_t {
+    REPLICA_VALUES_RESIDENT,    //!< the values, as for active vbuckets
+    REPLICA_VALUES_EJECTED,     //!< none of them, only their metadata
+    REPLICA_VALUES_COMPRESSED   //!< compressed copies of them
+};
+
 /**
  * Manager of all interaction with the persistence.
  */
@@ -204,6 +325,25 @@ public:
                            vbucket_state_active, trackReference);
     }
 
+    /**
+     * Retrieve several values at once.
+     *
+     * Keys are grouped by vbucket and by hash table lock, so each
+     * vbucket is looked up once and each lock is taken once for all
+     * the keys under it.  Non-resident keys are queued for background
+     * fetching in one submission per vbucket; each of them completes
+     * (and notifies the cookie) on its own as with get().
+     *
+     * @param items the keys to fetch; each one's value is filled in
+     * @param cookie the connection cookie, or NULL if nothing waits on the
+     *               fetches, when the keys of a pending vbucket get
+     *               ENGINE_TMPFAIL
+     * @param queueBG if true, queue background fetches for non-resident keys
+     * @param trackReference true if we want to set the nru bit for the items
+     */
+    void getMulti(std::vector<MultiGetItem> &items, const void *cookie,
+                  bool queueBG=true, bool trackReference=true);
+
     /**
      * Retrieve a value from a vbucket in replica state.
      *
@@ -256,19 +396,107 @@ public:
                                   bool allowReplace,
                                   uint8_t nru = 0xff);
 
+    /**
+     * Tell if a setWithMeta() or deleteWithMeta mutation would lose its
+     * conflict resolution against the key's metadata in memory, taking
+     * only a read lock, so it can be rejected before its item is built.
+     * False if it can't tell; the mutation is resolved again when it's
+     * applied.
+     */
+    bool rejectsWithMeta(const std::string &key, uint16_t vbucket,
+                         const ItemMetaData &meta, bool isDelete);
+
+    /**
+     * Resolve the conflicts of a batch of remote revisions of a vbucket's
+     * keys against those the vbucket has, without applying them, taking
+     * each hash table lock once for all of the batch's keys under it.
+     *
+     * The metadata of the keys that aren't in memory is fetched in one
+     * batch by key, and they're left with ENGINE_EWOULDBLOCK to be asked
+     * about again.  Nobody is notified of the fetch.
+     *
+     * @param vbucket the vbucket of all the keys
+     * @param items the keys, each given its own status
+     * @return ENGINE_SUCCESS if the keys were resolved, or the status of
+     *         the whole batch if the vbucket can't answer
+     */
+    ENGINE_ERROR_CODE getMetaMulti(uint16_t vbucket,
+                                   std::vector<MultiGetMetaItem> &items);
+
+    /**
+     * Apply a batch of setWithMeta() and deleteWithMeta mutations of a
+     * vbucket in one pass over its hash table, taking each lock once for
+     * all of the batch's keys under it.  The mutations applied are queued
+     * into the open checkpoint together once they're all in.
+     *
+     * A key whose metadata isn't in memory to resolve a conflict against
+     * has it fetched, and its mutation is left with ENGINE_EWOULDBLOCK to
+     * be sent again.  Nobody is notified of the fetch.  The items that
+     * already have a status other than ENGINE_SUCCESS are skipped.
+     *
+     * @param vbucket the vbucket of all the items
+     * @param items the mutations, each given its own status
+     * @param cookie the connection cookie
+     * @return ENGINE_SUCCESS if the items were applied, or the status of
+     *         the whole batch if the vbucket can't take them
+     */
+    ENGINE_ERROR_CODE withMetaBatch(uint16_t vbucket,
+                                    std::vector<WithMetaItem> &items,
+                                    const void *cookie);
+
+    /**
+     * Schedule a page of a key range scan on a reader, which notifies the
+     * connection once it has filled the scan in.
+     *
+     * @param scan the page to read, owned by the caller
+     * @param cookie the connection cookie
+     * @return ENGINE_EWOULDBLOCK once the read is scheduled
+     */
+    ENGINE_ERROR_CODE startRangeScan(RangeScan *scan, const void *cookie);
+
+    /**
+     * Read a page of a key range scan: the keys of the range from the
+     * vbucket's file, with the values in memory that are newer than
+     * theirs overlaid on them, in key order.  The scan gets its items,
+     * where its next page starts and its status.
+     */
+    void rangeScan(RangeScan &scan);
+
+    /**
+     * Apply a sub-document mutation to a key's value under its hash table
+     * lock, and store the result as a set of the key with its flags and
+     * expiration would.
+     *
+     * @param key the key of the document
+     * @param vbucket its vbucket
+     * @param cas the cas the key must have, or 0 for any
+     * @param op the mutation
+     * @param status why op couldn't be applied, when ENGINE_EINVAL is
+     *               returned for it
+     * @param newCas the cas of the stored result
+     * @param cookie the connection cookie
+     * @return ENGINE_SUCCESS if the result was stored
+     */
+    ENGINE_ERROR_CODE subdocMutate(const std::string &key, uint16_t vbucket,
+                                   uint64_t cas, SubdocOp &op,
+                                   subdoc_status_t &status, uint64_t *newCas,
+                                   const void *cookie);
+
     /**
      * Retrieve a value, but update its TTL first
      *
      * @param key the key to fetch
      * @param vbucket the vbucket from which to retrieve the key
      * @param cookie the connection cookie
-     * @param queueBG if true, automatically queue a background fetch if necessary
+     * @param wantValue false if only the TTL is to be updated, so the
+     *                  value isn't copied nor fetched from disk
      * @param exptime the new expiry time for the object
      *
-     * @return a GetValue representing the result of the request
+     * @return a GetValue representing the result of the request, without
+     *         an item unless wantValue
      */
     GetValue getAndUpdateTtl(const std::string &key, uint16_t vbucket,
-                             const void *cookie, bool queueBG, time_t exptime);
+                             const void *cookie, bool wantValue, time_t exptime);
 
     /**
      * Retrieve an item from the disk for vkey stats
@@ -369,6 +597,15 @@ public:
     bool startBgFetcher(void);
     void stopBgFetcher(void);
 
+    void startCompactor(void);
+    void stopCompactor(void);
+
+    /**
+     * Write the items of each vbucket that's all persisted to a snapshot
+     * for the next warmup to load, if warmup_snapshot is set.
+     */
+    void writeMemorySnapshots(void);
+
     /**
      * Takes a snapshot of the current stats and persists them to disk.
      */
@@ -420,6 +657,16 @@ public:
                               std::vector<VBucketBGFetchItem *> &fetchedItems,
                               hrtime_t start);
 
+    /**
+     * Load the docs a bg fetcher read ahead of its fetches into the values
+     * they're still the revision of, as the coldest of the hash table.
+     *
+     * @param vbId the vbucket the docs are of
+     * @param fetchedItems the docs read
+     */
+    void completeReadahead(uint16_t vbId,
+                           std::vector<VBucketBGFetchItem *> &fetchedItems);
+
     /**
      * Helper function to update stats after completion of a background fetch
      * for either the value of metadata of a key.
@@ -436,6 +683,15 @@ public:
         return vbMap.getBucket(vbid);
     }
 
+    /**
+     * Get a vbucket without the reference counting, which every front
+     * end op would otherwise contend on.  Only hold on to it under an
+     * EpochGuard.
+     */
+    VBucket *peekVBucket(uint16_t vbid) {
+        return vbMap.peekBucket(vbid);
+    }
+
     uint64_t getLastPersistedCheckpointId(uint16_t vb) {
         return vbMap.getPersistenceCheckpointId(vb);
     }
@@ -443,6 +699,16 @@ public:
     void snapshotVBuckets(const Priority &priority, uint16_t shardId);
     ENGINE_ERROR_CODE setVBucketState(uint16_t vbid, vbucket_state_t state);
 
+    /**
+     * Set the states of many vbuckets at once, creating those that don't
+     * exist, with one snapshot of the vbucket states per shard.
+     *
+     * @return ENGINE_ERANGE, with none of them changed, if a vbucket id is
+     *         out of range
+     */
+    ENGINE_ERROR_CODE setVBucketStates(
+              const std::vector<std::pair<uint16_t, vbucket_state_t> > &states);
+
     /**
      * Physically deletes a VBucket from disk. This function should only
      * be called on a VBucket that has already been logically deleted.
@@ -463,7 +729,13 @@ public:
      */
     ENGINE_ERROR_CODE deleteVBucket(uint16_t vbid, const void* c = NULL);
 
-    void firePendingVBucketOps();
+    /**
+     * Wake a batch of the ops blocked on each vbucket that's no longer
+     * pending.
+     *
+     * @return true if some vbuckets have more to wake
+     */
+    bool firePendingVBucketOps();
 
     /**
      * Reset a given vbucket from memory and disk. This differs from vbucket deletion in that
@@ -484,20 +756,66 @@ public:
                     NULL, prio, 0, isDaemon);
     }
 
+    /**
+     * Visit the vbuckets of one shard on a non-IO thread.  The visits of
+     * different shards run side by side, each on its shard's thread.
+     *
+     * Note that this is asynchronous.
+     */
+    void visitShard(shared_ptr<VBucketVisitor> visitor, const char *lbl,
+                    uint16_t shard, const Priority &prio, double sleepTime=0);
+
+    size_t getNumShards() const {
+        return vbMap.getNumShards();
+    }
+
     const Flusher* getFlusher(uint16_t shardId);
     Warmup* getWarmup(void) const;
 
     ENGINE_ERROR_CODE getKeyStats(const std::string &key, uint16_t vbucket,
                                   key_stats &kstats, bool wantsDeleted=false);
 
+    /**
+     * Have a connection notified once a key's mutation is persisted
+     * and/or acked by a replica.
+     *
+     * @param cas the mutation's cas, 0 for the key's current one
+     * @return ENGINE_EWOULDBLOCK if the connection waits,
+     *         ENGINE_SUCCESS if there's nothing to wait for,
+     *         ENGINE_KEY_EEXISTS if the key has a later mutation,
+     *         ENGINE_ENOTSUP if persistence is waited for in an
+     *         ephemeral bucket, ENGINE_KEY_ENOENT or
+     *         ENGINE_NOT_MY_VBUCKET
+     */
+    ENGINE_ERROR_CODE addKeyDurabilityWait(const std::string &key,
+                                           uint16_t vbucket, uint64_t cas,
+                                           bool persist, bool replicate,
+                                           const void *cookie);
+
+    //! Notify the connections waiting on replication of the given items,
+    //! and move their vbuckets' replicated watermarks past them.
+    void notifyItemsReplicated(const std::vector<queued_item> &items);
+
     std::string validateKey(const std::string &key,  uint16_t vbucket,
                             Item &diskItem);
 
+    /**
+     * Lock a key for a getl.  A key locked by another getl calls back an
+     * empty value, unless the request is parked until the lock's released
+     * and given ENGINE_EWOULDBLOCK.
+     */
     bool getLocked(const std::string &key, uint16_t vbucket,
                    Callback<GetValue> &cb,
                    rel_time_t currentTime, uint32_t lockTimeout,
                    const void *cookie);
 
+    //! Wake the getl requests parked on the locks expired by now.
+    void notifyGetlExpiries();
+
+    GetlWaitQueue &getGetlWaitQueue() {
+        return getlWaiters;
+    }
+
     /**
      * Retrieve the StoredValue associated with a key/vbucket pair.
      *
@@ -526,9 +844,9 @@ public:
         return vbMap.getShard(vbId)->getROUnderlying();
     }
 
-    KVStore* getAuxUnderlying() {
+    KVStore* getAuxUnderlying(uint16_t vbId) {
         // This method might also be called leakAbstraction()
-        return auxUnderlying;
+        return vbMap.getShard(vbId)->getAuxUnderlying();
     }
 
     void deleteExpiredItems(std::list<std::pair<uint16_t, std::string> > &);
@@ -575,10 +893,61 @@ public:
         transactionSize = value;
     }
 
+    size_t getTransactionSize() {
+        return transactionSize;
+    }
+
+    void setGroupCommitWindow(size_t value) {
+        groupCommitWindow = value;
+    }
+
+    //! Get the max time (ms) a flusher holds back a vbucket's commit
+    size_t getGroupCommitWindow() {
+        return groupCommitWindow;
+    }
+
+    void setBGFetchBatchSize(size_t value) {
+        bgFetchBatchSize = value;
+    }
+
+    //! Get the pending bg fetches of a shard at which they're read at once
+    size_t getBGFetchBatchSize() {
+        return bgFetchBatchSize;
+    }
+
+    void setBGFetchLatencyBudget(size_t value) {
+        bgFetchLatencyBudget = value;
+    }
+
+    //! Get the max time (ms) bg fetches wait to be read together
+    size_t getBGFetchLatencyBudget() {
+        return bgFetchLatencyBudget;
+    }
+
+    void setBGFetchReadahead(size_t value) {
+        bgFetchReadahead = value;
+    }
+
+    //! Get the docs read ahead of a run of bg fetches with the same prefix
+    size_t getBGFetchReadahead() {
+        return bgFetchReadahead;
+    }
+
+    //! The scheduler the bucket's classes of disk IO take turns through
+    IOScheduler &getIOScheduler() {
+        return ioScheduler;
+    }
+
     void setItemExpiryWindow(size_t value) {
         itemExpiryWindow = value;
     }
 
+    /**
+     * Have the item pager react to a change of the bucket's memory
+     * quota right away (see ItemPager::quotaChanged).
+     */
+    void memoryQuotaChanged(size_t quota);
+
     void setExpiryPagerSleeptime(size_t val);
     void setAccessScannerSleeptime(size_t val);
     void resetAccessScannerStartTime();
@@ -587,7 +956,17 @@ public:
         accessScanner.lastTaskRuntime = gethrtime();
     }
 
+    /**
+     * The path of the access log of a shard's vbuckets: alog_path with
+     * the shard's id appended.
+     */
+    std::string getAccessLogPath(uint16_t shardId);
+
     void incExpirationStat(RCPtr<VBucket> &vb, bool byPager = true) {
+        incExpirationStat(vb.get(), byPager);
+    }
+
+    void incExpirationStat(VBucket *vb, bool byPager = true) {
         if (byPager) {
             ++stats.expired_pager;
         } else {
@@ -600,6 +979,30 @@ public:
         return storageProperties->hasEfficientGet();
     }
 
+    /**
+     * True if the item pager removes whole items rather than just
+     * their values, so a miss in memory may still be a hit on disk.
+     */
+    bool isFullEviction() const {
+        return fullEviction;
+    }
+
+    /**
+     * True if the bucket is a cache kept in memory only: it has no
+     * underlying stores, flushers or warmup, and the item pager deletes
+     * the items it evicts.
+     */
+    bool isEphemeral() const {
+        return ephemeral;
+    }
+
+    /**
+     * Apply replica_value_policy to a replica's value that's just been
+     * persisted: eject it or compress it, leaving its metadata resident.
+     * The caller holds the lock of the value's hash bucket.
+     */
+    void tierReplicaValue(RCPtr<VBucket> &vb, StoredValue *v);
+
     void updateCachedResidentRatio(size_t activePerc, size_t replicaPerc) {
         cachedResidentRatio.activeRatio.set(activePerc);
         cachedResidentRatio.replicaRatio.set(replicaPerc);
@@ -608,15 +1011,50 @@ public:
     /**
      * Flushes all items waiting for persistence in a given vbucket
      * @param vbid The id of the vbucket to flush
+     * @param wait false to leave the commit to completeFlushes()
      * @return The amount of items flushed
      */
-    int flushVBucket(uint16_t vbid);
+    int flushVBucket(uint16_t vbid, bool wait = true);
+
+    /**
+     * Take the items waiting for persistence in a vbucket and look them up,
+     * without touching its KVStore's transaction.
+     *
+     * @param vbid The id of the vbucket to flush
+     * @return the batch to give to commitFlush()
+     */
+    FlushBatch *prepareFlush(uint16_t vbid);
+
+    /**
+     * Write and commit a batch made by prepareFlush(), and delete it.
+     *
+     * Unless told to wait, the KVStore may leave the commit outstanding,
+     * and the batch is kept until completeFlushes() is called for its
+     * shard.  The commits of several vbuckets then wait for the KVStore
+     * together.  A vbucket's commit must be completed before its next
+     * batch is prepared.
+     *
+     * @return The amount of items flushed
+     */
+    int commitFlush(FlushBatch *batch, bool wait = true);
+
+    /**
+     * Complete the commits of a shard left outstanding by commitFlush().
+     */
+    void completeFlushes(uint16_t shardId);
 
     void addKVStoreStats(ADD_STAT add_stat, const void* cookie);
 
     void addKVStoreTimingStats(ADD_STAT add_stat, const void* cookie);
 
     void resetUnderlyingStats(void);
+
+    /**
+     * Get a store of the primary shard, for the files that are the
+     * bucket's rather than a vbucket's: the vbucket states listing and
+     * the stats snapshot.  Everything else goes to the store of the
+     * vbucket's own shard.
+     */
     KVStore *getOneROUnderlying(void);
     KVStore *getOneRWUnderlying(void);
 
@@ -643,14 +1081,44 @@ private:
 
     RCPtr<VBucket> getVBucket(uint16_t vbid, vbucket_state_t wanted_state);
 
+    /**
+     * Wake the getl requests parked on a key whose lock may have been
+     * released.  Called without the key's hash table lock held.
+     */
+    void notifyGetlWaiters(uint16_t vbucket, const std::string &key) {
+        if (!getlWaiters.empty()) {
+            std::vector<const void*> cookies;
+            getlWaiters.release(vbucket, key, cookies);
+            notifyGetlCookies(cookies);
+        }
+    }
+
+    void notifyGetlCookies(const std::vector<const void*> &cookies);
+
     /* Queue an item to be written to persistent layer. */
-    void queueDirty(RCPtr<VBucket> &vb,
+    void queueDirty(VBucket *vb,
                     const std::string &key,
                     enum queue_operation op,
                     uint64_t seqno,
                     bool tapBackfill = false,
                     bool notifyReplicator = true);
 
+    void queueDirty(RCPtr<VBucket> &vb,
+                    const std::string &key,
+                    enum queue_operation op,
+                    uint64_t seqno,
+                    bool tapBackfill = false,
+                    bool notifyReplicator = true) {
+        queueDirty(vb.get(), key, op, seqno, tapBackfill, notifyReplicator);
+    }
+
+    /**
+     * Queue a run of items of a vbucket into its open checkpoint in one
+     * go, waking the flusher and the replicators once for all of them.
+     */
+    void queueDirtyBatch(RCPtr<VBucket> &vb,
+                         const std::vector<queued_item> &items);
+
     /**
      * Retrieve a StoredValue and invoke a method on it.
      *
@@ -683,19 +1151,102 @@ private:
     }
 
     void flushOneDeleteAll(void);
-    PersistenceCallback* flushOneDelOrSet(const queued_item &qi,
-                                          RCPtr<VBucket> &vb);
 
-    StoredValue *fetchValidValue(RCPtr<VBucket> &vb, const std::string &key,
+    /**
+     * Put the value on disk back into an item whose value was ejected,
+     * so only its new metadata is written.  Called by the flusher.
+     *
+     * @return false if it couldn't be read
+     */
+    bool readBackValue(Item &itm, int64_t rowid);
+    void flushOneDelOrSet(const queued_item &qi, RCPtr<VBucket> &vb,
+                          FlushBatch &batch);
+
+    /**
+     * Finish a batch whose commit is completed: notify the waiters of its
+     * items and move the vbucket's persistence cursor past them.
+     */
+    void finishFlush(FlushBatch *batch);
+
+    /**
+     * Rebuild a vbucket's bloom filter from the keys on disk, dropping
+     * the keys deleted since it was built.
+     */
+    void rebuildFilter(RCPtr<VBucket> &vb);
+
+    StoredValue *fetchValidValue(VBucket *vb, const std::string &key,
                                  int bucket_num, bool wantsDeleted=false,
                                  bool trackReference=true, bool queueExpired=true);
 
+    StoredValue *fetchValidValue(RCPtr<VBucket> &vb, const std::string &key,
+                                 int bucket_num, bool wantsDeleted=false,
+                                 bool trackReference=true, bool queueExpired=true) {
+        return fetchValidValue(vb.get(), key, bucket_num, wantsDeleted,
+                               trackReference, queueExpired);
+    }
+
+    /**
+     * In full eviction mode, find out from disk whether a key that
+     * isn't in memory exists, before answering for it.
+     *
+     * A temp item stands in for the key until the fetch completes and
+     * turns it into the item, or marks it as nonexistent.  The caller
+     * holds the key's bucket lock.
+     *
+     * @return ENGINE_SUCCESS if the hash table already knows whether
+     *         the key exists, ENGINE_EWOULDBLOCK if it's being fetched
+     */
+    ENGINE_ERROR_CODE unlocked_fetchIfEvicted(VBucket *vb,
+                                              const std::string &key,
+                                              int bucket_num,
+                                              const void *cookie,
+                                              bool queueBG = true);
+
+    ENGINE_ERROR_CODE unlocked_fetchIfEvicted(RCPtr<VBucket> &vb,
+                                              const std::string &key,
+                                              int bucket_num,
+                                              const void *cookie,
+                                              bool queueBG = true) {
+        return unlocked_fetchIfEvicted(vb.get(), key, bucket_num, cookie,
+                                       queueBG);
+    }
+
     GetValue getInternal(const std::string &key, uint16_t vbucket,
                          const void *cookie, bool queueBG,
                          bool honorStates,
                          vbucket_state_t allowedState,
                          bool trackReference=true);
 
+    /**
+     * Resolve one key of getMetaMulti() under its bucket's lock.
+     *
+     * @param fetch set if the key's metadata is to be fetched
+     */
+    ENGINE_ERROR_CODE unlocked_resolveRemoteMeta(RCPtr<VBucket> &vb,
+                                                 const MultiGetMetaItem &item,
+                                                 int bucket_num, bool &fetch);
+
+    /**
+     * Apply one mutation of withMetaBatch() under its bucket's lock.
+     *
+     * @param queue set if the mutation is to be queued for persistence
+     *              once the lock is released
+     * @param seqno the rev seqno to queue it with
+     */
+    ENGINE_ERROR_CODE unlocked_applyWithMeta(RCPtr<VBucket> &vb,
+                                             const WithMetaItem &wm,
+                                             int bucket_num, bool &queue,
+                                             uint64_t &seqno);
+
+    /**
+     * getMulti() for the given items, all of which are in vb.
+     */
+    void getMultiInVBucket(RCPtr<VBucket> &vb,
+                           std::vector<MultiGetItem> &items,
+                           std::vector<size_t> &indices,
+                           const void *cookie, bool queueBG,
+                           bool trackReference);
+
     friend class Warmup;
     friend class Flusher;
     friend class BGFetchCallback;
@@ -710,7 +1261,6 @@ private:
 
     EventuallyPersistentEngine     &engine;
     EPStats                        &stats;
-    KVStore                        *auxUnderlying;
     StorageProperties              *storageProperties;
     Dispatcher                     *auxIODispatcher;
     Dispatcher                     *nonIODispatcher;
@@ -718,12 +1268,21 @@ private:
     ConflictResolution             *conflictResolver;
     VBucketMap                      vbMap;
     SyncObject                      mutex;
-    MutationLog                     accessLog;
+    GetlWaitQueue                   getlWaiters;
 
     Atomic<size_t> bgFetchQueue;
     Atomic<bool> diskFlushAll;
+    //! Bumped by every flush_all, so stale flush batches can be told apart
+    Atomic<size_t> flushAllCount;
+    //! The batches of each shard whose commits are still to be completed
+    std::vector<std::list<FlushBatch *> > uncompletedFlushes;
     Mutex vbsetMutex;
     uint32_t bgFetchDelay;
+    bool fullEviction;
+    bool ephemeral;
+    replica_value_policy_t replicaValuePolicy;
+    shared_ptr<ItemPager> itemPager;
+    TaskId itemPagerTask;
     struct ExpiryPagerDelta {
         ExpiryPagerDelta() : sleeptime(0) {}
         Mutex mutex;
@@ -744,9 +1303,14 @@ private:
     size_t statsSnapshotTaskId;
     size_t mLogCompactorTaskId;
     size_t transactionSize;
+    size_t groupCommitWindow;
+    size_t bgFetchBatchSize;
+    size_t bgFetchLatencyBudget;
+    size_t bgFetchReadahead;
     size_t lastTransTimePerItem;
     size_t itemExpiryWindow;
     Atomic<bool> snapshotVBState;
+    IOScheduler ioScheduler;
 
     DISALLOW_COPY_AND_ASSIGN(EventuallyPersistentStore);
 };
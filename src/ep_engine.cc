@@ -35,18 +35,27 @@
 #include "backfill.h"
 #include "ep_engine.h"
 #include "htresizer.h"
+#include "huge_pages.h"
 #include "iomanager/iomanager.h"
+#include "key_prefix_table.h"
+#include "lock_profiler.h"
 #include "memory_tracker.h"
+#include "range_scan.h"
+#include "slab_allocator.h"
 #include "stats-info.h"
 #define STATWRITER_NAMESPACE core_engine
 #include "statwriter.h"
 #undef STATWRITER_NAMESPACE
+#include "tapfanout.h"
 #include "tapthrottle.h"
 #include "warmup.h"
 
 static ALLOCATOR_HOOKS_API *hooksApi;
 static SERVER_LOG_API *loggerApi;
 
+//! The engine specific of the connections waiting in CMD_KEY_DURABILITY
+static char keyDurabilityWait;
+
 static size_t percentOf(size_t val, double percent) {
     return static_cast<size_t>(static_cast<double>(val) * percent);
 }
@@ -158,8 +167,21 @@ extern "C" {
                                            uint64_t* cas,
                                            uint16_t vbucket)
     {
-        ENGINE_ERROR_CODE err_code = getHandle(handle)->itemDelete(cookie, key, nkey,
-                                                                   cas, vbucket);
+        EventuallyPersistentEngine *e = getHandle(handle);
+        ENGINE_ERROR_CODE err_code = ENGINE_TMPFAIL;
+        VBucketOwners *owners = e->getVBucketOwners();
+        if (owners && owners->takeResult(cookie, vbucket, err_code, NULL, cas)) {
+            // Done by the owner of the vbucket.
+        } else if (e->getAdmissionControl().admit(ADMISSION_DEL, vbucket)) {
+            if (owners) {
+                OwnedOp *op = new OwnedOp(OwnedOp::DELETE, cookie, key, nkey,
+                                          vbucket);
+                op->cas = *cas;
+                err_code = owners->forward(op);
+            } else {
+                err_code = e->itemDelete(cookie, key, nkey, cas, vbucket);
+            }
+        }
         releaseHandle(handle);
         return err_code;
     }
@@ -179,7 +201,19 @@ extern "C" {
                                     const int nkey,
                                     uint16_t vbucket)
     {
-        ENGINE_ERROR_CODE err_code = getHandle(handle)->get(cookie, itm, key, nkey, vbucket);
+        EventuallyPersistentEngine *e = getHandle(handle);
+        ENGINE_ERROR_CODE err_code = ENGINE_TMPFAIL;
+        VBucketOwners *owners = e->getVBucketOwners();
+        if (owners && owners->takeResult(cookie, vbucket, err_code, itm)) {
+            // Done by the owner of the vbucket.
+        } else if (e->getAdmissionControl().admit(ADMISSION_GET, vbucket)) {
+            if (owners) {
+                err_code = owners->forward(new OwnedOp(OwnedOp::GET, cookie,
+                                                       key, nkey, vbucket));
+            } else {
+                err_code = e->get(cookie, itm, key, nkey, vbucket);
+            }
+        }
         releaseHandle(handle);
         return err_code;
     }
@@ -203,8 +237,23 @@ extern "C" {
                                       ENGINE_STORE_OPERATION operation,
                                       uint16_t vbucket)
     {
-        ENGINE_ERROR_CODE err_code = getHandle(handle)->store(cookie, itm, cas, operation,
-                                                              vbucket);
+        EventuallyPersistentEngine *e = getHandle(handle);
+        ENGINE_ERROR_CODE err_code = ENGINE_TMPFAIL;
+        VBucketOwners *owners = e->getVBucketOwners();
+        if (owners && owners->takeResult(cookie, vbucket, err_code, NULL, cas)) {
+            // Done by the owner of the vbucket.
+        } else if (e->getAdmissionControl().admit(ADMISSION_SET, vbucket)) {
+            if (owners) {
+                const std::string &key = static_cast<Item*>(itm)->getKey();
+                OwnedOp *op = new OwnedOp(OwnedOp::STORE, cookie, key.data(),
+                                          key.length(), vbucket);
+                op->itm = itm;
+                op->operation = operation;
+                err_code = owners->forward(op);
+            } else {
+                err_code = e->store(cookie, itm, cas, operation, vbucket);
+            }
+        }
         releaseHandle(handle);
         return err_code;
     }
@@ -222,9 +271,12 @@ extern "C" {
                                            uint64_t *result,
                                            uint16_t vbucket)
     {
-        ENGINE_ERROR_CODE ecode = getHandle(handle)->arithmetic(cookie, key, nkey, increment,
-                                                                create, delta, initial,
-                                                                exptime, cas, result, vbucket);
+        EventuallyPersistentEngine *e = getHandle(handle);
+        ENGINE_ERROR_CODE ecode = ENGINE_TMPFAIL;
+        if (e->getAdmissionControl().admit(ADMISSION_SET, vbucket)) {
+            ecode = e->arithmetic(cookie, key, nkey, increment, create, delta,
+                                  initial, exptime, cas, result, vbucket);
+        }
         releaseHandle(handle);
         return ecode;
     }
@@ -275,6 +327,57 @@ extern "C" {
             } else if (strcmp(keyz, "tap_throttle_cap_pcnt") == 0) {
                 checkNumeric(valz);
                 e->getConfiguration().setTapThrottleCapPcnt(v);
+            } else if (strcmp(keyz, "tap_throttle_pacing") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setTapThrottlePacing(true);
+                } else {
+                    e->getConfiguration().setTapThrottlePacing(false);
+                }
+            } else if (strcmp(keyz, "tap_mutation_batch_size") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setTapMutationBatchSize(v);
+            } else if (strcmp(keyz, "tap_mutation_batch_max_value") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setTapMutationBatchMaxValue(v);
+            } else if (strcmp(keyz, "tap_apply_parallel") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setTapApplyParallel(true);
+                } else {
+                    e->getConfiguration().setTapApplyParallel(false);
+                }
+            } else if (strcmp(keyz, "tap_apply_batch_size") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setTapApplyBatchSize(v);
+            } else if (strcmp(keyz, "tap_apply_queue_cap") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setTapApplyQueueCap(v);
+            } else if (strcmp(keyz, "tap_fanout") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setTapFanout(true);
+                } else {
+                    e->getConfiguration().setTapFanout(false);
+                }
+            } else if (strcmp(keyz, "tap_fanout_max_inbox") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setTapFanoutMaxInbox(v);
+            } else if (strcmp(keyz, "tap_ack_window_max") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setTapAckWindowMax(v);
+            } else if (strcmp(keyz, "tap_backfill_bg_slo") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setTapBackfillBgSlo(v);
+            } else if (strcmp(keyz, "tap_backfill_ack_slo") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setTapBackfillAckSlo(v);
+            } else if (strcmp(keyz, "tap_backfill_max_disk_loads") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setTapBackfillMaxDiskLoads(v);
+            } else if (strcmp(keyz, "tap_takeover_delta") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setTapTakeoverDelta(v);
+            } else if (strcmp(keyz, "tap_takeover_max_pause") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setTapTakeoverMaxPause(v);
             } else {
                 *msg = "Unknown config param";
                 rv = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
@@ -308,6 +411,20 @@ extern "C" {
                 checkNumeric(valz);
                 validate(v, DEFAULT_MAX_CHECKPOINTS, MAX_CHECKPOINTS_UPPER_BOUND);
                 e->getConfiguration().setMaxCheckpoints(v);
+            } else if (strcmp(keyz, "chk_queue_batch_size") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, MAX_CHECKPOINT_QUEUE_BATCH_SIZE);
+                e->getConfiguration().setChkQueueBatchSize(v);
+            } else if (strcmp(keyz, "max_chk_mem_percent") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, MAX_CHECKPOINT_MEM_PERCENT);
+                e->getConfiguration().setMaxChkMemPercent(v);
+            } else if (strcmp(keyz, "adaptive_chk") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setAdaptiveChk(true);
+                } else {
+                    e->getConfiguration().setAdaptiveChk(false);
+                }
             } else if (strcmp(keyz, "item_num_based_new_chk") == 0) {
                 if (strcmp(valz, "true") == 0) {
                     e->getConfiguration().setItemNumBasedNewChk(true);
@@ -402,6 +519,13 @@ extern "C" {
                         delete tmp;
                     }
                 }
+            } else if (strcmp(keyz, "access_trace") == 0) {
+                AccessTrace &trace = e->getAccessTrace();
+                if (strcmp(valz, "off") == 0) {
+                    trace.stop();
+                } else if (!trace.start(valz)) {
+                    throw std::runtime_error("Failed to create the access trace.");
+                }
             } else if (strcmp(keyz, "exp_pager_stime") == 0) {
                 char *ptr = NULL;
                 checkNumeric(valz);
@@ -418,9 +542,153 @@ extern "C" {
             } else if (strcmp(keyz, "alog_task_time") == 0) {
                 checkNumeric(valz);
                 e->getConfiguration().setAlogTaskTime(v);
+            } else if (strcmp(keyz, "defragmenter_enabled") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setDefragmenterEnabled(true);
+                } else {
+                    e->getConfiguration().setDefragmenterEnabled(false);
+                }
+            } else if (strcmp(keyz, "defragmenter_interval") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, std::numeric_limits<int>::max());
+                e->getConfiguration().setDefragmenterInterval(v);
+            } else if (strcmp(keyz, "defragmenter_threshold") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, 100);
+                e->getConfiguration().setDefragmenterThreshold(v);
+            } else if (strcmp(keyz, "defragmenter_chunk_size") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, std::numeric_limits<int>::max());
+                e->getConfiguration().setDefragmenterChunkSize(v);
+            } else if (strcmp(keyz, "large_value_cache_size") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setLargeValueCacheSize(v);
+            } else if (strcmp(keyz, "lock_profiling") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setLockProfiling(true);
+                } else {
+                    e->getConfiguration().setLockProfiling(false);
+                }
+            } else if (strcmp(keyz, "op_trace_threshold") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setOpTraceThreshold(v);
+            } else if (strcmp(keyz, "pending_ops_limit") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setPendingOpsLimit(v);
+            } else if (strcmp(keyz, "pending_ops_wake_batch") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setPendingOpsWakeBatch(v);
+            } else if (strcmp(keyz, "getl_max_waiters") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setGetlMaxWaiters(v);
+            } else if (strcmp(keyz, "admission_get_rate") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setAdmissionGetRate(v);
+            } else if (strcmp(keyz, "admission_set_rate") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setAdmissionSetRate(v);
+            } else if (strcmp(keyz, "admission_del_rate") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setAdmissionDelRate(v);
+            } else if (strcmp(keyz, "admission_vb_rate") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setAdmissionVbRate(v);
+            } else if (strcmp(keyz, "admission_burst_ms") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setAdmissionBurstMs(v);
+            } else if (strcmp(keyz, "hotkeys_sample_rate") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setHotkeysSampleRate(v);
+            } else if (strcmp(keyz, "agg_stats_max_age") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setAggStatsMaxAge(v);
+            } else if (strcmp(keyz, "bg_fetch_batch_size") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, std::numeric_limits<int>::max());
+                e->getConfiguration().setBgFetchBatchSize(v);
+            } else if (strcmp(keyz, "bg_fetch_latency_budget") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setBgFetchLatencyBudget(v);
+            } else if (strcmp(keyz, "bg_fetch_readahead") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setBgFetchReadahead(v);
+            } else if (strcmp(keyz, "group_commit_window") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, 10000);
+                e->getConfiguration().setGroupCommitWindow(v);
+            } else if (strcmp(keyz, "hlc_max_drift") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setHlcMaxDrift(v);
+            } else if (strcmp(keyz, "compaction_check_interval") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, 86400);
+                e->getConfiguration().setCompactionCheckInterval(v);
+            } else if (strcmp(keyz, "compaction_min_file_size") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setCompactionMinFileSize(v);
+            } else if (strcmp(keyz, "compaction_purge_age") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setCompactionPurgeAge(v);
+            } else if (strcmp(keyz, "compaction_rate") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setCompactionRate(v);
+            } else if (strcmp(keyz, "compaction_threshold") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, 100);
+                e->getConfiguration().setCompactionThreshold(v);
             } else if (strcmp(keyz, "pager_active_vb_pcnt") == 0) {
                 checkNumeric(valz);
                 e->getConfiguration().setPagerActiveVbPcnt(v);
+            } else if (strcmp(keyz, "quota_shrink_rate") == 0) {
+                char *ptr = NULL;
+                checkNumeric(valz);
+                uint64_t vsize = strtoull(valz, &ptr, 10);
+                validate(vsize, static_cast<uint64_t>(0),
+                         std::numeric_limits<uint64_t>::max());
+                e->getConfiguration().setQuotaShrinkRate(vsize);
+            } else if (strcmp(keyz, "quota_warm_on_grow") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setQuotaWarmOnGrow(true);
+                } else {
+                    e->getConfiguration().setQuotaWarmOnGrow(false);
+                }
+            } else if (strcmp(keyz, "range_scan_max_keys") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, 100000);
+                e->getConfiguration().setRangeScanMaxKeys(v);
+            } else if (strcmp(keyz, "stats_snapshot_interval") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, 86400);
+                e->getConfiguration().setStatsSnapshotInterval(v);
+            } else if (strcmp(keyz, "vb_mem_quota") == 0) {
+                char *ptr = NULL;
+                checkNumeric(valz);
+                uint64_t vsize = strtoull(valz, &ptr, 10);
+                validate(vsize, static_cast<uint64_t>(0),
+                         std::numeric_limits<uint64_t>::max());
+                e->getConfiguration().setVbMemQuota(vsize);
+            } else if (strcmp(keyz, "visitor_time_slice") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setVisitorTimeSlice(v);
             } else if (strcmp(keyz, "warmup_min_memory_threshold") == 0) {
                 checkNumeric(valz);
                 validate(v, 0, std::numeric_limits<int>::max());
@@ -726,6 +994,50 @@ extern "C" {
                             PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
     }
 
+    static ENGINE_ERROR_CODE setVBuckets(EventuallyPersistentEngine *e,
+                                         const void *cookie,
+                                         protocol_binary_request_header *request,
+                                         ADD_RESPONSE response)
+    {
+        const size_t recordlen = sizeof(uint16_t) + sizeof(vbucket_state_t);
+        uint32_t bodylen = ntohl(request->request.bodylen);
+        const uint8_t *body = request->bytes + sizeof(request->bytes);
+        if (request->request.extlen != 0 || request->request.keylen != 0 ||
+            bodylen % recordlen != 0) {
+            const std::string msg("Incorrect packet format");
+            return sendResponse(response, NULL, 0, NULL, 0, msg.c_str(),
+                                msg.length(), PROTOCOL_BINARY_RAW_BYTES,
+                                PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+        }
+
+        std::vector<std::pair<uint16_t, vbucket_state_t> > states;
+        states.reserve(bodylen / recordlen);
+        for (uint32_t offset = 0; offset < bodylen; offset += recordlen) {
+            uint16_t vb;
+            uint32_t state;
+            memcpy(&vb, body + offset, sizeof(vb));
+            memcpy(&state, body + offset + sizeof(vb), sizeof(state));
+            vbucket_state_t to = static_cast<vbucket_state_t>(ntohl(state));
+            if (!is_valid_vbucket_state_t(to)) {
+                const std::string msg("Invalid vbucket state");
+                return sendResponse(response, NULL, 0, NULL, 0, msg.c_str(),
+                                    msg.length(), PROTOCOL_BINARY_RAW_BYTES,
+                                    PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+            }
+            states.push_back(std::make_pair(ntohs(vb), to));
+        }
+
+        if (e->setVBucketStates(states) == ENGINE_ERANGE) {
+            const std::string msg("VBucket number too big");
+            return sendResponse(response, NULL, 0, NULL, 0, msg.c_str(),
+                                msg.length(), PROTOCOL_BINARY_RAW_BYTES,
+                                PROTOCOL_BINARY_RESPONSE_ERANGE, 0, cookie);
+        }
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+    }
+
     static ENGINE_ERROR_CODE delVBucket(EventuallyPersistentEngine *e,
                                         const void *cookie,
                                         protocol_binary_request_header *req,
@@ -809,9 +1121,30 @@ extern "C" {
         protocol_binary_request_no_extras *req =
             (protocol_binary_request_no_extras*)request;
         int keylen = ntohs(req->message.header.request.keylen);
+        uint8_t extlen = req->message.header.request.extlen;
         uint16_t vbucket = ntohs(req->message.header.request.vbucket);
         ENGINE_ERROR_CODE error_code;
-        std::string keystr(((char *)request) + sizeof(req->message.header), keylen);
+        const char *ext = ((char *)request) + sizeof(req->message.header);
+        std::string keystr(ext + extlen, keylen);
+
+        if (extlen == sizeof(uint32_t)) {
+            // The client won't take a value staler than this many ms.
+            uint32_t maxStaleness;
+            memcpy(&maxStaleness, ext, sizeof(maxStaleness));
+            maxStaleness = ntohl(maxStaleness);
+            RCPtr<VBucket> vb = eps->getVBucket(vbucket);
+            if (vb && vb->getState() == vbucket_state_replica &&
+                vb->getReplicaLag() > maxStaleness) {
+                ++e->getEpStats().numStaleReplicaReads;
+                *msg = "Replica is too stale";
+                *res = PROTOCOL_BINARY_RESPONSE_ETMPFAIL;
+                return ENGINE_SUCCESS;
+            }
+        } else if (extlen != 0) {
+            *msg = "Invalid extras";
+            *res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+            return ENGINE_SUCCESS;
+        }
 
         GetValue rv(eps->getReplica(keystr, vbucket, cookie, true));
 
@@ -864,6 +1197,12 @@ extern "C" {
                 rv = setVBucket(h, cookie, request, response);
                 return rv;
             }
+        case CMD_SET_VBUCKETS:
+            {
+                BlockTimer timer(&stats.setVbucketCmdHisto);
+                rv = setVBuckets(h, cookie, request, response);
+                return rv;
+            }
         case PROTOCOL_BINARY_CMD_TOUCH:
         case PROTOCOL_BINARY_CMD_GAT:
         case PROTOCOL_BINARY_CMD_GATQ:
@@ -919,6 +1258,11 @@ extern "C" {
                 rv = h->handleCheckpointCmds(cookie, request, response);
                 return rv;
             }
+        case CMD_KEY_DURABILITY:
+            {
+                rv = h->keyDurability(cookie, request, response);
+                return rv;
+            }
         case CMD_GET_META:
         case CMD_GETQ_META:
             {
@@ -945,6 +1289,31 @@ extern "C" {
                                        response);
                 return rv;
             }
+        case CMD_GET_META_BATCH:
+            {
+                rv = h->getMetaBatch(cookie, request, response);
+                return rv;
+            }
+        case CMD_GET_BATCH:
+            {
+                rv = h->getBatch(cookie, request, response);
+                return rv;
+            }
+        case CMD_WITH_META_BATCH:
+            {
+                rv = h->withMetaBatch(cookie, request, response);
+                return rv;
+            }
+        case CMD_SUBDOC:
+            {
+                rv = h->subdoc(cookie, request, response);
+                return rv;
+            }
+        case CMD_RANGE_SCAN:
+            {
+                rv = h->rangeScan(cookie, request, response);
+                return rv;
+            }
         case CMD_RETURN_META:
             {
                 return h->returnMeta(cookie,
@@ -965,6 +1334,11 @@ extern "C" {
             }
         }
 
+        if (itm && !h->decompressForClient(itm)) {
+            delete itm;
+            return ENGINE_FAILED;
+        }
+
         // Send a special response for getl since we don't want to send the key
         if (itm && request->request.opcode == CMD_GET_LOCKED) {
             uint32_t flags = itm->getFlags();
@@ -1140,13 +1514,21 @@ extern "C" {
         return NULL;
     }
 
-    static bool EvpGetItemInfo(ENGINE_HANDLE *, const void *,
+    static bool EvpGetItemInfo(ENGINE_HANDLE *handle, const void *,
                                const item* itm, item_info *itm_info)
     {
         const Item *it = reinterpret_cast<const Item*>(itm);
         if (itm_info->nvalue < 1) {
             return false;
         }
+        // Values leave for clients (and TAP) uncompressed.
+        if (it->getValue().get() && it->getValue()->isCompressed()) {
+            bool ok = getHandle(handle)->decompressForClient(const_cast<Item*>(it));
+            releaseHandle(handle);
+            if (!ok) {
+                return false;
+            }
+        }
         itm_info->cas = it->getCas();
         itm_info->exptime = it->getExptime();
         itm_info->nbytes = it->getNBytes();
@@ -1188,10 +1570,12 @@ ALLOCATOR_HOOKS_API *getHooksApi(void) {
 }
 
 EventuallyPersistentEngine::EventuallyPersistentEngine(GET_SERVER_API get_server_api) :
-    epstore(NULL), workload(NULL), tapThrottle(NULL),
-    startedEngineThreads(false), getServerApiFunc(get_server_api),
+    epstore(NULL), workload(NULL), tapThrottle(NULL), tapApplier(NULL),
+    vbOwners(NULL), slabs(new SlabAllocator()), startedEngineThreads(false),
+    getServerApiFunc(get_server_api),
     tapConnMap(NULL), tapConfig(NULL), checkpointConfig(NULL),
-    flushAllEnabled(false), startupTime(0)
+    offloadNotify(false), flushAllEnabled(false), compressValues(false),
+    startupTime(0)
 {
     interface.interface = 1;
     ENGINE_HANDLE_V1::get_info = EvpGetInfo;
@@ -1279,12 +1663,32 @@ public:
             engine.setGetlDefaultTimeout(value);
         } else if (key.compare("max_item_size") == 0) {
             engine.setMaxItemSize(value);
+        } else if (key.compare("large_value_cache_size") == 0) {
+            engine.getSlabAllocator()->setLargeCacheSize(value);
+        } else if (key.compare("hotkeys_sample_rate") == 0) {
+            engine.getHotKeys().setSampleRate(value);
+        } else if (key.compare("op_trace_threshold") == 0) {
+            engine.getOpTracer().setThreshold(value);
+        } else if (key.compare("admission_get_rate") == 0) {
+            engine.getAdmissionControl().setOpRate(ADMISSION_GET, value);
+        } else if (key.compare("admission_set_rate") == 0) {
+            engine.getAdmissionControl().setOpRate(ADMISSION_SET, value);
+        } else if (key.compare("admission_del_rate") == 0) {
+            engine.getAdmissionControl().setOpRate(ADMISSION_DEL, value);
+        } else if (key.compare("admission_vb_rate") == 0) {
+            engine.getAdmissionControl().setVBucketRate(value);
+        } else if (key.compare("admission_burst_ms") == 0) {
+            engine.getAdmissionControl().setBurst(value);
         }
     }
 
     virtual void booleanValueChanged(const std::string &key, bool value) {
         if (key.compare("flushall_enabled") == 0) {
             engine.setFlushAll(value);
+        } else if (key.compare("lock_profiling") == 0) {
+            LockProfile::setEnabled(value);
+        } else if (key.compare("slab_allocator") == 0) {
+            engine.getSlabAllocator()->setEnabled(value);
         }
     }
 private:
@@ -1293,6 +1697,71 @@ private:
 
 
 
+/// @cond DETAILS
+/**
+ * The EPStats timing histograms kept in log-linear buckets, by the names
+ * they have in the timings stats.
+ */
+static const struct {
+    const char *name;
+    HdrHistogram<hrtime_t> EPStats::*histo;
+} hdrTimings[] = {
+    { "bg_wait", &EPStats::bgWaitHisto },
+    { "bg_load", &EPStats::bgLoadHisto },
+    { "bg_tap_wait", &EPStats::tapBgWaitHisto },
+    { "bg_tap_load", &EPStats::tapBgLoadHisto },
+    { "pending_ops", &EPStats::pendingOpsHisto },
+    { "pending_op_wait", &EPStats::pendingOpWaitHisto },
+    { "get_cmd", &EPStats::getCmdHisto },
+    { "store_cmd", &EPStats::storeCmdHisto },
+    { "arith_cmd", &EPStats::arithCmdHisto },
+    { "get_stats_cmd", &EPStats::getStatsCmdHisto },
+    { "get_vb_cmd", &EPStats::getVbucketCmdHisto },
+    { "set_vb_cmd", &EPStats::setVbucketCmdHisto },
+    { "del_vb_cmd", &EPStats::delVbucketCmdHisto },
+    { "chk_persistence_cmd", &EPStats::chkPersistenceHisto },
+    { "key_durability_cmd", &EPStats::keyDurabilityHisto },
+    { "tap_vb_set", &EPStats::tapVbucketSetHisto },
+    { "tap_vb_reset", &EPStats::tapVbucketResetHisto },
+    { "tap_mutation", &EPStats::tapMutationHisto },
+    { "notify_io", &EPStats::notifyIOHisto },
+    { "batch_read", &EPStats::getMultiHisto },
+    { "bg_batch_wait", &EPStats::bgBatchWaitHisto },
+    { "disk_insert", &EPStats::diskInsertHisto },
+    { "disk_update", &EPStats::diskUpdateHisto },
+    { "disk_del", &EPStats::diskDelHisto },
+    { "disk_vb_del", &EPStats::diskVBDelHisto },
+    { "mem_vb_del", &EPStats::memVBDelHisto },
+    { "disk_vbstate_snapshot", &EPStats::snapshotVbucketHisto },
+    { "ht_lock_wait", &EPStats::htLockWaitHisto },
+    { "ht_lock_hold", &EPStats::htLockHoldHisto }
+};
+
+//! The seconds between the snapshots of the timing windows
+static const double TIMING_WINDOW_INTERVAL = 10;
+
+/**
+ * Ends an interval of the timing windows every TIMING_WINDOW_INTERVAL.
+ */
+class TimingWindowRotator : public DispatcherCallback {
+public:
+    TimingWindowRotator(EventuallyPersistentEngine *e) : engine(e) { }
+
+    bool callback(Dispatcher &d, TaskId &t) {
+        engine->rotateTimingWindows();
+        d.snooze(t, TIMING_WINDOW_INTERVAL);
+        return true;
+    }
+
+    std::string description() {
+        return std::string("Rotating the timing windows.");
+    }
+
+private:
+    EventuallyPersistentEngine *engine;
+};
+/// @endcond
+
 ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     resetStats();
     if (config != NULL) {
@@ -1306,6 +1775,29 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     // Start updating the variables from the config!
     HashTable::setDefaultNumBuckets(configuration.getHtSize());
     HashTable::setDefaultNumLocks(configuration.getHtLocks());
+    HashTable::setDefaultRWLocks(configuration.isHtLocksRw());
+    if (configuration.isHtLockFreeReads()) {
+        EpochManager::enable();
+    }
+    HashTable::setDefaultLockFreeReads(configuration.isHtLockFreeReads());
+    HashTable::setDefaultExpiryIndex(configuration.isHtExpiryIndex());
+    if (configuration.getItemEvictionPolicy().compare("full_eviction") == 0) {
+        VBucket::setBloomFilterDefaults(configuration.getBfilterKeyCount(),
+                                        configuration.getBfilterFpProb());
+    }
+    HashTable::setDefaultInlineValueSize(configuration.getMaxInlineValueSize());
+    HashTable::setDefaultKeyPrefixMinLen(configuration.getHtKeyPrefixMinLen());
+    HashTable::setDefaultPowerOfTwo(configuration.isHtPowerOfTwo());
+    HashTable::setDefaultIdleSize(configuration.getHtIdleSize());
+    HashTable::setDefaultMaxTempItems(configuration.getHtMaxTempItems());
+    HugePages::setMode(configuration.getHugePages());
+    slabs->setEnabled(configuration.isSlabAllocator());
+    configuration.addValueChangedListener("slab_allocator",
+                                          new EpEngineValueChangeListener(*this));
+    slabs->setLargeCacheSize(configuration.getLargeValueCacheSize());
+    configuration.addValueChangedListener("large_value_cache_size",
+                                          new EpEngineValueChangeListener(*this));
+    DeferredBlobRefs::setEnabled(configuration.isDeferredValueRefs());
     StoredValue::setMutationMemoryThreshold(configuration.getMutationMemThreshold());
 
     if (configuration.getMaxSize() == 0) {
@@ -1331,12 +1823,54 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     configuration.addValueChangedListener("getl_max_timeout",
                                           new EpEngineValueChangeListener(*this));
 
+    // Lock profiling is of the locks of every bucket.
+    if (configuration.isLockProfiling()) {
+        LockProfile::setEnabled(true);
+    }
+    configuration.addValueChangedListener("lock_profiling",
+                                          new EpEngineValueChangeListener(*this));
+
+    hotKeys.setSampleRate(configuration.getHotkeysSampleRate());
+    configuration.addValueChangedListener("hotkeys_sample_rate",
+                                          new EpEngineValueChangeListener(*this));
+
+    opTracer.setThreshold(configuration.getOpTraceThreshold());
+    configuration.addValueChangedListener("op_trace_threshold",
+                                          new EpEngineValueChangeListener(*this));
+
+    admission.setBurst(configuration.getAdmissionBurstMs());
+    admission.setOpRate(ADMISSION_GET, configuration.getAdmissionGetRate());
+    admission.setOpRate(ADMISSION_SET, configuration.getAdmissionSetRate());
+    admission.setOpRate(ADMISSION_DEL, configuration.getAdmissionDelRate());
+    admission.setVBucketRate(configuration.getAdmissionVbRate());
+    admission.initialize(configuration.getMaxVbuckets());
+    configuration.addValueChangedListener("admission_burst_ms",
+                                          new EpEngineValueChangeListener(*this));
+    configuration.addValueChangedListener("admission_get_rate",
+                                          new EpEngineValueChangeListener(*this));
+    configuration.addValueChangedListener("admission_set_rate",
+                                          new EpEngineValueChangeListener(*this));
+    configuration.addValueChangedListener("admission_del_rate",
+                                          new EpEngineValueChangeListener(*this));
+    configuration.addValueChangedListener("admission_vb_rate",
+                                          new EpEngineValueChangeListener(*this));
+
     flushAllEnabled = configuration.isFlushallEnabled();
     configuration.addValueChangedListener("flushall_enabled",
                                           new EpEngineValueChangeListener(*this));
 
+    if (configuration.isValueCompression() && !Blob::isCompressionAvailable()) {
+        LOG(EXTENSION_LOG_WARNING, "Value compression was asked for, but "
+            "this build has no compression library; storing values raw");
+        configuration.setValueCompression(false);
+    }
+    compressValues = configuration.isValueCompression();
+    offloadNotify = configuration.isBgFetchNotifyOffload();
+
     workload = new WorkLoadPolicy(configuration.getMaxNumWorkers(),
-                                  configuration.getWorkloadOptimization());
+                                  configuration.getWorkloadOptimization(),
+                                  configuration.getMaxNumAuxio(),
+                                  configuration.getMaxNumNonio());
     if ((unsigned int)workload->getNumShards() > configuration.getMaxVbuckets()) {
         LOG(EXTENSION_LOG_WARNING, "Invalid configuration: Shards must be "
             "equal or less than max number of vbuckets");
@@ -1365,6 +1899,23 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
         return ENGINE_FAILED;
     }
 
+    tapApplier = new TapApplier(*this, workload->getNumShards());
+    tapApplier->start();
+
+    if (configuration.isVbucketOwnerTasks()) {
+        vbOwners = new VBucketOwners(*this, workload->getNumShards());
+        vbOwners->start();
+    }
+
+    for (size_t i = 0; i < sizeof(hdrTimings) / sizeof(hdrTimings[0]); ++i) {
+        timingWindows.push_back(
+            new HdrHistogramWindows<hrtime_t>(stats.*hdrTimings[i].histo));
+    }
+    shared_ptr<DispatcherCallback> twr(new TimingWindowRotator(this));
+    epstore->getNonIODispatcher()->schedule(twr, NULL,
+                                            Priority::TimingWindowPriority,
+                                            TIMING_WINDOW_INTERVAL);
+
     if(configuration.isDataTrafficEnabled()) {
         enableTraffic(true);
     }
@@ -1381,6 +1932,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
 
 void EventuallyPersistentEngine::destroy(bool force) {
     stats.forceShutdown = force;
+    if (vbOwners) {
+        // The connections it fails come back in for their results.
+        vbOwners->stop();
+    }
     stopEngineThreads();
     if (epstore) {
         epstore->snapshotStats();
@@ -1437,18 +1992,79 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::flush(const void *, time_t when) {
     return ENGINE_SUCCESS;
 }
 
+bool EventuallyPersistentEngine::decompressForClient(Item *itm) {
+    if (itm->getValue().get() == NULL || !itm->getValue()->isCompressed()) {
+        return true;
+    }
+    if (!itm->decompressValue()) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to uncompress the value of %s",
+            itm->getKey().c_str());
+        return false;
+    }
+    ++stats.numValuesDecompressed;
+    return true;
+}
+
+void EventuallyPersistentEngine::maybeCompress(Item *itm) {
+    if (compressValues && itm->compressValue()) {
+        ++stats.numValuesCompressed;
+    }
+}
+
+static const char *storeOpName(ENGINE_STORE_OPERATION operation) {
+    switch (operation) {
+    case OPERATION_ADD:
+        return "add";
+    case OPERATION_SET:
+        return "set";
+    case OPERATION_REPLACE:
+        return "replace";
+    case OPERATION_APPEND:
+        return "append";
+    case OPERATION_PREPEND:
+        return "prepend";
+    case OPERATION_CAS:
+        return "cas";
+    default:
+        return "store";
+    }
+}
+
 ENGINE_ERROR_CODE  EventuallyPersistentEngine::store(const void *cookie,
                                                      item* itm,
                                                      uint64_t *cas,
                                                      ENGINE_STORE_OPERATION operation,
                                                      uint16_t vbucket)
+{
+    Item *it = static_cast<Item*>(itm);
+    OpTraceScope trace(opTracer, storeOpName(operation), it->getKey(),
+                       vbucket, cookie);
+    ENGINE_ERROR_CODE ret = doStore(cookie, it, cas, operation, vbucket);
+    trace.setStatus(ret);
+    return ret;
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::doStore(const void *cookie,
+                                                      Item *it,
+                                                      uint64_t *cas,
+                                                      ENGINE_STORE_OPERATION operation,
+                                                      uint16_t vbucket)
 {
     BlockTimer timer(&stats.storeCmdHisto);
     ENGINE_ERROR_CODE ret;
-    Item *it = static_cast<Item*>(itm);
     item *i = NULL;
 
     it->setVBucketId(vbucket);
+    if (hotKeys.shouldSample()) {
+        hotKeys.record(it->getKey(), vbucket, it->getNBytes(), true);
+    }
+    accessTrace.record(ACCESS_TRACE_SET, it->getKey(), vbucket,
+                       it->getNBytes());
+
+    // Appended and prepended pieces are joined to the raw old value.
+    if (operation != OPERATION_APPEND && operation != OPERATION_PREPEND) {
+        maybeCompress(it);
+    }
 
     switch (operation) {
     case OPERATION_CAS:
@@ -1595,6 +2211,10 @@ inline tap_event_t EventuallyPersistentEngine::doWalkTapQueue(const void *cookie
         return TAP_NOOP;
     }
 
+    if (connection->doTakeOver) {
+        connection->checkTakeoverDelta();
+    }
+
     if (connection->isSuspended() || connection->windowIsFull()) {
         LOG(EXTENSION_LOG_INFO, "%s Connection in pause state because it is in"
             " suspended state or its ack windows is full.\n",
@@ -1644,6 +2264,13 @@ inline tap_event_t EventuallyPersistentEngine::doWalkTapQueue(const void *cookie
 
     uint8_t nru = INITIAL_NRU_VALUE;
     Item *it = connection->getNextItem(cookie, vbucket, ret, nru);
+    if ((ret == TAP_MUTATION || ret == TAP_DELETION) &&
+        fillMutationBatch(cookie, connection, it, ret, *vbucket, nru)) {
+        *es = connection->mutationBatch.getData();
+        *nes = connection->mutationBatch.getSize();
+        return TAP_OPAQUE;
+    }
+
     switch (ret) {
     case TAP_CHECKPOINT_START:
     case TAP_CHECKPOINT_END:
@@ -1691,25 +2318,82 @@ inline tap_event_t EventuallyPersistentEngine::doWalkTapQueue(const void *cookie
     return ret;
 }
 
-tap_event_t EventuallyPersistentEngine::walkTapQueue(const void *cookie,
-                                                     item **itm,
-                                                     void **es,
-                                                     uint16_t *nes,
-                                                     uint8_t *ttl,
-                                                     uint16_t *flags,
-                                                     uint32_t *seqno,
-                                                     uint16_t *vbucket) {
-    TapProducer *connection = getTapProducer(cookie);
-    if (!connection) {
-        LOG(EXTENSION_LOG_WARNING,
-            "Failed to lookup TAP connection.. Disconnecting\n");
-        return TAP_DISCONNECT;
+bool EventuallyPersistentEngine::fillMutationBatch(const void *cookie,
+                                                   TapProducer *connection,
+                                                   Item *itm,
+                                                   tap_event_t event,
+                                                   uint16_t vbucket,
+                                                   uint8_t nru) {
+    size_t maxItems = tapConfig->getMutationBatchSize();
+    if (!connection->supportsMutationBatch() || maxItems < 2) {
+        return false;
     }
 
-    connection->paused.set(false);
+    // A big value goes out on its own, so memcached sends it straight
+    // from the stored blob instead of us copying it into the batch.
+    size_t maxValue = tapConfig->getMutationBatchMaxValue();
+    if (event == TAP_MUTATION && itm->getNBytes() > maxValue) {
+        ++connection->largeValuesUnbatched;
+        return false;
+    }
 
-    bool retry = false;
-    tap_event_t ret;
+    TapMutationBatch &batch = connection->mutationBatch;
+    batch.reset();
+    if (!decompressForClient(itm) || !batch.add(event, *itm, nru)) {
+        return false;
+    }
+
+    while (batch.getCount() < maxItems) {
+        uint16_t vb = vbucket;
+        tap_event_t ev = TAP_PAUSE;
+        uint8_t n = INITIAL_NRU_VALUE;
+        Item *next = connection->getNextItem(cookie, &vb, ev, n);
+        if (ev == TAP_PAUSE || ev == TAP_NOOP) {
+            // Nothing was taken off the queues.
+            assert(next == NULL);
+            break;
+        }
+        if ((ev == TAP_DELETION ||
+             (ev == TAP_MUTATION && next->getNBytes() <= maxValue)) &&
+            vb == vbucket && decompressForClient(next) &&
+            batch.add(ev, *next, n)) {
+            delete next;
+            continue;
+        }
+        connection->stashNextItem(next, ev, vb, n);
+        break;
+    }
+
+    if (batch.getCount() == 1) {
+        // Send it the usual way.
+        return false;
+    }
+
+    ++connection->mutationBatchesSent;
+    connection->mutationsBatched.incr(batch.getCount());
+    delete itm;
+    return true;
+}
+
+tap_event_t EventuallyPersistentEngine::walkTapQueue(const void *cookie,
+                                                     item **itm,
+                                                     void **es,
+                                                     uint16_t *nes,
+                                                     uint8_t *ttl,
+                                                     uint16_t *flags,
+                                                     uint32_t *seqno,
+                                                     uint16_t *vbucket) {
+    TapProducer *connection = getTapProducer(cookie);
+    if (!connection) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Failed to lookup TAP connection.. Disconnecting\n");
+        return TAP_DISCONNECT;
+    }
+
+    connection->paused.set(false);
+
+    bool retry = false;
+    tap_event_t ret;
 
     connection->lastWalkTime = ep_current_time();
     do {
@@ -1724,9 +2408,19 @@ tap_event_t EventuallyPersistentEngine::walkTapQueue(const void *cookie,
         } else {
             ++stats.numTapFetched;
             *seqno = connection->getSeqno();
-            if (connection->requestAck(ret, *vbucket)) {
+            // A mutation batch is acked like the mutations in it.
+            tap_event_t ackEvent = ret;
+            if (ret == TAP_OPAQUE && connection->isMutationBatch(*es)) {
+                ackEvent = TAP_MUTATION;
+            }
+            if (connection->requestAck(ackEvent, *vbucket)) {
                 *flags = TAP_FLAG_ACK;
                 connection->seqnoAckRequested = *seqno;
+                if (connection->ackRequestedAt == 0) {
+                    // Time one ack at a time for the BackfillController.
+                    connection->ackRequestedAt = gethrtime();
+                    connection->seqnoAckTimed = *seqno;
+                }
             }
 
             if (ret == TAP_MUTATION) {
@@ -1836,11 +2530,48 @@ bool EventuallyPersistentEngine::createTapQueue(const void *cookie,
         }
     }
 
+    TapKeyFilter keyFilter;
+    if (flags & TAP_CONNECT_KEY_FILTER) {
+        if (!keyFilter.decode(ptr, nuserdata)) {
+            LOG(EXTENSION_LOG_WARNING, "Malformed key filter. "
+                "Reject connection request from %s\n", tapName.c_str());
+            return false;
+        }
+    }
+
+    std::map<uint16_t, uint64_t> sinceSeqnos;
+    if (flags & TAP_CONNECT_SEQNO_STREAM) {
+        uint16_t nSeqnos = 0;
+        if (nuserdata >= sizeof(nSeqnos)) {
+            memcpy(&nSeqnos, ptr, sizeof(nSeqnos));
+            nuserdata -= sizeof(nSeqnos);
+            ptr += sizeof(nSeqnos);
+            nSeqnos = ntohs(nSeqnos);
+        }
+        if (nuserdata < ((sizeof(uint16_t) + sizeof(uint64_t)) * nSeqnos)) {
+            LOG(EXTENSION_LOG_WARNING, "# of seqnos not matched. "
+                "Reject connection request from %s\n", tapName.c_str());
+            return false;
+        }
+        for (uint16_t j = 0; j < nSeqnos; ++j) {
+            uint16_t vbid;
+            uint64_t seqno;
+            memcpy(&vbid, ptr, sizeof(vbid));
+            ptr += sizeof(uint16_t);
+            memcpy(&seqno, ptr, sizeof(seqno));
+            ptr += sizeof(uint64_t);
+            sinceSeqnos[ntohs(vbid)] = ntohll(seqno);
+        }
+        nuserdata -= ((sizeof(uint16_t) + sizeof(uint64_t)) * nSeqnos);
+    }
+
     tapConnMap->newProducer(cookie, tapName, flags,
                             backfillAge,
                             static_cast<int>(configuration.getTapKeepalive()),
                             vbuckets,
-                            lastCheckpointIds);
+                            lastCheckpointIds,
+                            keyFilter,
+                            sinceSeqnos);
 
     tapConnMap->notify();
     return true;
@@ -1887,6 +2618,19 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
     std::string k(static_cast<const char*>(key), nkey);
     ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
 
+    TapConsumer *consumer = dynamic_cast<TapConsumer*>(connection);
+    if (consumer && tap_event != TAP_ACK) {
+        if (consumer->takeAckResult(tap_seqno, ret)) {
+            // Back after waiting for the applier to ack this event.
+            return ret;
+        }
+        if (consumer->checkApplyFailure() == ENGINE_DISCONNECT) {
+            LOG(EXTENSION_LOG_WARNING, "%s Failed to apply a queued tap "
+                "event. Force disconnect\n", connection->logHeader());
+            return ENGINE_DISCONNECT;
+        }
+    }
+
     if (tap_event == TAP_MUTATION || tap_event == TAP_DELETION) {
         if (!tapThrottle->shouldProcess()) {
             ++stats.tapThrottled;
@@ -1902,6 +2646,23 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
         }
     }
 
+    if (tap_event != TAP_ACK && stats.tapApplyQueueSize.get() > 0 &&
+        !(tapConfig->isApplyParallel() &&
+          (tap_event == TAP_MUTATION || tap_event == TAP_DELETION))) {
+        // Nothing may overtake the mutations already handed to the applier.
+        bool drained = (tap_event == TAP_FLUSH) ? tapApplier->drainAll() :
+            tapApplier->drain(vbucket);
+        if (!drained) {
+            if (connection->supportsAck()) {
+                return ENGINE_TMPFAIL;
+            }
+            LOG(EXTENSION_LOG_WARNING, "%s Can't wait for the pending "
+                "mutations without ack support. Force disconnect...\n",
+                connection->logHeader());
+            return ENGINE_DISCONNECT;
+        }
+    }
+
     switch (tap_event) {
     case TAP_ACK:
         ret = processTapAck(cookie, tap_seqno, tap_flags, k);
@@ -1928,19 +2689,25 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
                                                     &itemMeta.seqno);
                 meta = true;
                 if (itemMeta.cas == 0) {
-                    itemMeta.cas = Item::nextCas();
+                    RCPtr<VBucket> vb = getVBucket(vbucket);
+                    itemMeta.cas = vb ? vb->ht.nextCas() : Item::nextCas();
                 }
                 if (itemMeta.seqno == 0) {
                     itemMeta.seqno = DEFAULT_REV_SEQ_NUM;
                 }
             }
-            uint64_t delCas = 0;
-            ret = epstore->deleteItem(k, &delCas, vbucket, cookie, true, meta,
-                                      false, &itemMeta,
-                                      tc->isBackfillPhase(vbucket));
-            if (ret == ENGINE_KEY_ENOENT) {
-                ret = ENGINE_SUCCESS;
+            if (tapConfig->isApplyParallel()) {
+                Item *itm = new Item(k, flags, exptime, NULL, 0, itemMeta.cas,
+                                     -1, vbucket);
+                itm->setSeqno(itemMeta.seqno);
+                tc->queuedApply();
+                tapApplier->queue(new TapApplyOp(connection, tap_event, itm,
+                                                 meta, 0));
+                // The applier counts the event once it's applied.
+                return ackAfterApplies(cookie, tc, tap_flags, tap_seqno,
+                                       ENGINE_SUCCESS);
             }
+            ret = applyTapDeletion(cookie, tc, k, vbucket, itemMeta, meta);
             if (!tc->supportsCheckpointSync()) {
                 // If the checkpoint synchronization is not supported,
                 // check if a new checkpoint should be created or not.
@@ -1971,8 +2738,17 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
                     uint64_t checkpointId;
                     memcpy(&checkpointId, data, sizeof(checkpointId));
                     checkpointId = ntohll(checkpointId);
+                    // Newer actives add when they closed the checkpoint.
+                    uint64_t activeTime = 0;
+                    if (ndata >= 2 * sizeof(uint64_t)) {
+                        memcpy(&activeTime,
+                               static_cast<const char*>(data) + sizeof(uint64_t),
+                               sizeof(activeTime));
+                        activeTime = ntohll(activeTime);
+                    }
 
-                    if (tc->processCheckpointCommand(tap_event, vbucket, checkpointId)) {
+                    if (tc->processCheckpointCommand(tap_event, vbucket, checkpointId,
+                                                     activeTime)) {
                         getEpStore()->wakeUpFlusher();
                         ret = ENGINE_SUCCESS;
                     } else {
@@ -2002,6 +2778,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
             value_t vblob(Blob::New(static_cast<const char*>(data), ndata));
             Item *itm = new Item(k, flags, exptime, vblob);
             itm->setVBucketId(vbucket);
+            maybeCompress(itm);
 
             if (tc) {
                 bool meta = false;
@@ -2015,15 +2792,14 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
                     meta = true;
                 }
 
-                if (tc->isBackfillPhase(vbucket)) {
-                    ret = epstore->addTAPBackfillItem(*itm, meta, nru);
-                } else {
-                    if (meta) {
-                        ret = epstore->setWithMeta(*itm, 0, cookie, true, true, nru);
-                    } else {
-                        ret = epstore->set(*itm, cookie, true, nru);
-                    }
+                if (tapConfig->isApplyParallel()) {
+                    tc->queuedApply();
+                    tapApplier->queue(new TapApplyOp(connection, tap_event, itm,
+                                                     meta, nru));
+                    return ackAfterApplies(cookie, tc, tap_flags, tap_seqno,
+                                           ENGINE_SUCCESS);
                 }
+                ret = applyTapMutation(cookie, tc, *itm, meta, nru);
             } else {
                 LOG(EXTENSION_LOG_WARNING,
                     "%s not a consumer! Force disconnect\n",
@@ -2150,6 +2926,9 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
                     "%s Received an unknown opaque command\n",
                     connection->logHeader());
             }
+        } else if (TapMutationBatch::isMutationBatch(engine_specific, nengine)) {
+            ret = applyMutationBatch(cookie, connection, engine_specific, nengine,
+                                     vbucket);
         } else {
             LOG(EXTENSION_LOG_WARNING,
                 "%s Received tap opaque with unknown size %d\n",
@@ -2198,9 +2977,211 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
     }
 
     connection->processedEvent(tap_event, ret);
+    return ackAfterApplies(cookie, consumer, tap_flags, tap_seqno, ret);
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::ackAfterApplies(const void *cookie,
+                                                              TapConsumer *tc,
+                                                              uint16_t tap_flags,
+                                                              uint32_t tap_seqno,
+                                                              ENGINE_ERROR_CODE ret) {
+    if (tc == NULL || !(tap_flags & TAP_FLAG_ACK) ||
+        ret == ENGINE_DISCONNECT) {
+        return ret;
+    }
+    // The producer takes the ack for everything it sent so far.
+    return tc->ackAfterApplies(cookie, tap_seqno, ret);
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::applyMutationBatch(const void *cookie,
+                                                                 TapConnection *connection,
+                                                                 const void *es,
+                                                                 uint16_t nes,
+                                                                 uint16_t vbucket) {
+    TapConsumer *tc = dynamic_cast<TapConsumer*>(connection);
+    if (!tc) {
+        LOG(EXTENSION_LOG_WARNING, "%s not a consumer! Force disconnect\n",
+            connection->logHeader());
+        return ENGINE_DISCONNECT;
+    }
+
+    std::vector<TapMutationBatch::Record> records;
+    if (!TapMutationBatch::decode(es, nes, records)) {
+        LOG(EXTENSION_LOG_WARNING, "%s Received a malformed mutation batch. "
+            "Force disconnect\n", connection->logHeader());
+        return ENGINE_DISCONNECT;
+    }
+
+    if (!tapThrottle->shouldProcess(records.size())) {
+        ++stats.tapThrottled;
+        if (connection->supportsAck()) {
+            return ENGINE_TMPFAIL;
+        }
+        LOG(EXTENSION_LOG_WARNING, "%s Can't throttle streams without "
+            "ack support. Force disconnect...\n", connection->logHeader());
+        return ENGINE_DISCONNECT;
+    }
+
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    std::vector<WithMetaItem> items;
+    items.reserve(records.size());
+    std::vector<TapMutationBatch::Record>::iterator it = records.begin();
+    for (; it != records.end(); ++it) {
+        std::string key(it->key, it->nkey);
+        Item *itm;
+        if (it->event == TAP_DELETION) {
+            uint64_t cas = it->cas;
+            if (cas == 0) {
+                cas = vb ? vb->ht.nextCas() : Item::nextCas();
+            }
+            itm = new Item(key, it->flags, it->exptime, NULL, 0, cas, -1,
+                           vbucket);
+            itm->setSeqno(it->seqno != 0 ? it->seqno : DEFAULT_REV_SEQ_NUM);
+        } else {
+            value_t vblob(Blob::New(it->value, it->nvalue));
+            itm = new Item(key, it->flags, it->exptime, vblob);
+            itm->setVBucketId(vbucket);
+            maybeCompress(itm);
+            itm->setCas(it->cas);
+            itm->setSeqno(it->seqno);
+        }
+        items.push_back(WithMetaItem(itm, it->event == TAP_DELETION, true,
+                                     it->nru));
+    }
+
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    if (vb && !tc->isBackfillPhase(vbucket)) {
+        // A batch never spans a checkpoint message, so the whole of it is
+        // applied in one pass and queued into the open checkpoint at once.
+        ret = applyTapBatch(vbucket, items);
+        for (size_t i = 0; i < items.size(); ++i) {
+            ENGINE_ERROR_CODE status = ret;
+            if (ret == ENGINE_SUCCESS) {
+                status = items[i].status;
+            }
+            tc->processedEvent(records[i].event, status);
+            if (status != ENGINE_SUCCESS && ret == ENGINE_SUCCESS) {
+                ret = status;
+            }
+        }
+    } else {
+        // The backfilled records go through the same paths as single
+        // mutations, but the checkpoint queueing is done for all of them
+        // under one lock.
+        if (vb) {
+            vb->checkpointManager.beginStaging();
+        }
+        for (size_t i = 0; i < items.size() && ret == ENGINE_SUCCESS; ++i) {
+            Item &itm = *items[i].item;
+            if (items[i].isDelete) {
+                ItemMetaData itemMeta(itm.getCas(), itm.getSeqno(),
+                                      itm.getFlags(), itm.getExptime());
+                ret = applyTapDeletion(cookie, tc, itm.getKey(), vbucket,
+                                       itemMeta, true);
+            } else {
+                BlockTimer timer(&stats.tapMutationHisto);
+                ret = applyTapMutation(cookie, tc, itm, true, items[i].nru);
+            }
+            tc->processedEvent(records[i].event, ret);
+        }
+        if (vb) {
+            vb->checkpointManager.endStaging();
+        }
+    }
+
+    std::vector<WithMetaItem>::iterator iit;
+    for (iit = items.begin(); iit != items.end(); ++iit) {
+        delete iit->item;
+    }
+    if (!tc->supportsCheckpointSync()) {
+        tc->checkVBOpenCheckpoint(vbucket);
+    }
+
+    if (ret == ENGINE_ENOMEM) {
+        if (connection->supportsAck()) {
+            ret = ENGINE_TMPFAIL;
+        } else {
+            LOG(EXTENSION_LOG_WARNING, "%s Connection does not support "
+                "tap ack'ing.. Force disconnect\n", connection->logHeader());
+            ret = ENGINE_DISCONNECT;
+        }
+    }
+    if (ret == ENGINE_DISCONNECT) {
+        LOG(EXTENSION_LOG_WARNING, "%s Failed to apply a mutation batch. "
+            "Force disconnect\n", connection->logHeader());
+    }
+    return ret;
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::applyTapMutation(const void *cookie,
+                                                               TapConsumer *tc,
+                                                               const Item &itm,
+                                                               bool meta,
+                                                               uint8_t nru) {
+    if (tc->isBackfillPhase(itm.getVBucketId())) {
+        return epstore->addTAPBackfillItem(itm, meta, nru);
+    } else if (meta) {
+        ENGINE_ERROR_CODE ret = epstore->setWithMeta(itm, 0, cookie, true,
+                                                     true, nru);
+        if (ret == ENGINE_SUCCESS) {
+            noteReplicated(itm.getVBucketId(), itm.getCas());
+        }
+        return ret;
+    }
+    return epstore->set(itm, cookie, true, nru);
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::applyTapDeletion(const void *cookie,
+                                                               TapConsumer *tc,
+                                                               const std::string &key,
+                                                               uint16_t vbucket,
+                                                               ItemMetaData &itemMeta,
+                                                               bool meta) {
+    uint64_t delCas = 0;
+    ENGINE_ERROR_CODE ret = epstore->deleteItem(key, &delCas, vbucket, cookie,
+                                                true, meta, false, &itemMeta,
+                                                tc->isBackfillPhase(vbucket));
+    if (ret == ENGINE_KEY_ENOENT) {
+        ret = ENGINE_SUCCESS;
+    }
+    if (ret == ENGINE_SUCCESS && meta) {
+        noteReplicated(vbucket, itemMeta.cas);
+    }
     return ret;
 }
 
+ENGINE_ERROR_CODE EventuallyPersistentEngine::applyTapBatch(uint16_t vbucket,
+                                                            std::vector<WithMetaItem> &items) {
+    ENGINE_ERROR_CODE ret = epstore->withMetaBatch(vbucket, items, NULL);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+    uint64_t maxCas = 0;
+    std::vector<WithMetaItem>::iterator it;
+    for (it = items.begin(); it != items.end(); ++it) {
+        if (it->isDelete && it->status == ENGINE_KEY_ENOENT) {
+            it->status = ENGINE_SUCCESS;
+        }
+        if (it->status == ENGINE_SUCCESS) {
+            maxCas = std::max(maxCas, it->item->getCas());
+        }
+    }
+    if (maxCas != 0) {
+        noteReplicated(vbucket, maxCas);
+    }
+    return ENGINE_SUCCESS;
+}
+
+void EventuallyPersistentEngine::noteReplicated(uint16_t vbucket,
+                                                uint64_t cas) {
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    if (vb && vb->getState() == vbucket_state_replica) {
+        // The active made the mutation at its cas' time, and sent it after
+        // everything it had before.
+        vb->setReplicaSyncTime(Item::casTime(cas));
+    }
+}
+
 TapProducer* EventuallyPersistentEngine::getTapProducer(const void *cookie) {
     TapProducer *rv =
         reinterpret_cast<TapProducer*>(getEngineSpecific(cookie));
@@ -2255,6 +3236,7 @@ bool VBucketCountVisitor::visitBucket(RCPtr<VBucket> &vb) {
     ++numVbucket;
     numItems += vb->ht.getNumItems();
     numTempItems += vb->ht.getNumTempItems();
+    tempItemMemory += vb->ht.getTempItemMemory();
     nonResident += vb->ht.getNumNonResidentItems();
 
     if (vb->getHighPriorityChkSize() > 0) {
@@ -2262,7 +3244,7 @@ bool VBucketCountVisitor::visitBucket(RCPtr<VBucket> &vb) {
     }
 
     if (desired_state != vbucket_state_dead) {
-        htMemory += vb->ht.memorySize();
+        htMemory += vb->ht.memorySize() + vb->ht.getExpiryIndexMemory();
         htItemMemory += vb->ht.getItemMemory();
         htCacheSize += vb->ht.cacheSize;
         numEjects += vb->ht.getNumEjects();
@@ -2307,29 +3289,47 @@ private:
     std::map<vbucket_state_t, VBucketCountVisitor*> visitorMap;
 };
 
-ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
-                                                            ADD_STAT add_stat) {
-    VBucketCountAggregator aggregator;
-
-    VBucketCountVisitor activeCountVisitor(vbucket_state_active);
-    aggregator.addVisitor(&activeCountVisitor);
-
-    VBucketCountVisitor replicaCountVisitor(vbucket_state_replica);
-    aggregator.addVisitor(&replicaCountVisitor);
-
-    VBucketCountVisitor pendingCountVisitor(vbucket_state_pending);
-    aggregator.addVisitor(&pendingCountVisitor);
-
-    VBucketCountVisitor deadCountVisitor(vbucket_state_dead);
-    aggregator.addVisitor(&deadCountVisitor);
+void EventuallyPersistentEngine::getVBucketCounts(VBucketCounts &counts) {
+    hrtime_t maxAge = configuration.getAggStatsMaxAge() * 1000000;
+    hrtime_t now = gethrtime();
+    if (maxAge > 0) {
+        LockHolder lh(vbCountsMutex);
+        if (vbCounts.taken != 0 && now - vbCounts.taken < maxAge) {
+            counts = vbCounts;
+            return;
+        }
+    }
 
+    VBucketCounts fresh;
+    VBucketCountAggregator aggregator;
+    aggregator.addVisitor(&fresh.active);
+    aggregator.addVisitor(&fresh.replica);
+    aggregator.addVisitor(&fresh.pending);
+    aggregator.addVisitor(&fresh.dead);
     epstore->visit(aggregator);
+    fresh.taken = now;
+
+    epstore->updateCachedResidentRatio(fresh.active.getMemResidentPer(),
+                                       fresh.replica.getMemResidentPer());
+    tapThrottle->adjustWriteQueueCap(fresh.active.getNumItems() +
+                                     fresh.replica.getNumItems() +
+                                     fresh.pending.getNumItems());
+    if (maxAge > 0) {
+        LockHolder lh(vbCountsMutex);
+        vbCounts = fresh;
+    }
+    counts = fresh;
+}
 
-    epstore->updateCachedResidentRatio(activeCountVisitor.getMemResidentPer(),
-                                       replicaCountVisitor.getMemResidentPer());
-    tapThrottle->adjustWriteQueueCap(activeCountVisitor.getNumItems() +
-                                     replicaCountVisitor.getNumItems() +
-                                     pendingCountVisitor.getNumItems());
+ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
+                                                            ADD_STAT add_stat) {
+    VBucketCounts counts;
+    getVBucketCounts(counts);
+    VBucketCountVisitor &activeCountVisitor(counts.active);
+    VBucketCountVisitor &replicaCountVisitor(counts.replica);
+    VBucketCountVisitor &pendingCountVisitor(counts.pending);
+    VBucketCountVisitor &deadCountVisitor(counts.dead);
+    ObjectRegistry::flushStats(this);
 
     configuration.addStats(add_stat, cookie);
 
@@ -2357,6 +3357,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_item_flush_expired",
                     epstats.flushExpired, add_stat, cookie);
+    add_casted_stat("ep_item_flush_meta_only",
+                    epstats.flushMetaOnly, add_stat, cookie);
+    add_casted_stat("ep_item_flush_coalesced",
+                    epstats.flushCoalesced, add_stat, cookie);
     add_casted_stat("ep_queue_size",
                     epstats.diskQueueSize, add_stat, cookie);
     add_casted_stat("ep_flusher_todo",
@@ -2365,9 +3369,11 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     epstats.flusher_todo, add_stat, cookie);
     add_casted_stat("ep_diskqueue_items",
                     epstats.diskQueueSize, add_stat, cookie);
-    add_casted_stat("ep_flusher_state",
-                    epstore->getFlusher(0)->stateName(),
-                    add_stat, cookie);
+    if (!epstore->isEphemeral()) {
+        add_casted_stat("ep_flusher_state",
+                        epstore->getFlusher(0)->stateName(),
+                        add_stat, cookie);
+    }
     add_casted_stat("ep_commit_num", epstats.flusherCommits,
                     add_stat, cookie);
     add_casted_stat("ep_commit_time",
@@ -2378,12 +3384,30 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     epstats.vbucketDeletions, add_stat, cookie);
     add_casted_stat("ep_vbucket_del_fail",
                     epstats.vbucketDeletionFail, add_stat, cookie);
+    add_casted_stat("ep_vbucket_del_mem_pending",
+                    epstats.vbucketMemDeletionsPending, add_stat, cookie);
+    add_casted_stat("ep_flush_all_mem_pending",
+                    epstats.flushAllMemPending, add_stat, cookie);
+    add_casted_stat("ep_compaction_runs",
+                    epstats.compactionRuns, add_stat, cookie);
+    add_casted_stat("ep_compaction_failed",
+                    epstats.compactionFailed, add_stat, cookie);
+    add_casted_stat("ep_compaction_purged",
+                    epstats.compactionPurged, add_stat, cookie);
+    add_casted_stat("ep_compaction_bytes_copied",
+                    epstats.compactionBytesCopied, add_stat, cookie);
+    add_casted_stat("ep_compaction_bytes_reclaimed",
+                    epstats.compactionBytesReclaimed, add_stat, cookie);
     add_casted_stat("ep_flush_duration_total",
                     epstats.cumulativeFlushTime, add_stat, cookie);
     add_casted_stat("ep_flush_all",
                     epstore->isFlushAllScheduled() ? "true" : "false", add_stat, cookie);
     add_casted_stat("curr_items", activeCountVisitor.getNumItems(), add_stat, cookie);
     add_casted_stat("curr_temp_items", activeCountVisitor.getNumTempItems(), add_stat, cookie);
+    add_casted_stat("curr_temp_items_memory",
+                    activeCountVisitor.getTempItemMemory(), add_stat, cookie);
+    add_casted_stat("ep_temp_items_reclaimed", epstats.tempItemsReclaimed,
+                    add_stat, cookie);
     add_casted_stat("curr_items_tot",
                    activeCountVisitor.getNumItems() +
                    replicaCountVisitor.getNumItems() +
@@ -2528,6 +3552,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     cookie);
     add_casted_stat("ep_bg_meta_fetched", epstats.bg_meta_fetched, add_stat,
                     cookie);
+    add_casted_stat("ep_bg_readahead_fetched", epstats.bg_readahead_fetched,
+                    add_stat, cookie);
     add_casted_stat("ep_bg_remaining_jobs", epstats.numRemainingBgJobs,
                     add_stat, cookie);
     add_casted_stat("ep_max_bg_remaining_jobs", epstats.maxRemainingBgJobs,
@@ -2541,12 +3567,84 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     cookie);
     add_casted_stat("ep_items_rm_from_checkpoints", epstats.itemsRemovedFromCheckpoints,
                     add_stat, cookie);
+    add_casted_stat("ep_checkpoint_memory", epstats.checkpointMemory,
+                    add_stat, cookie);
+    add_casted_stat("ep_cursors_dropped", epstats.numCursorsDropped,
+                    add_stat, cookie);
     add_casted_stat("ep_num_value_ejects", epstats.numValueEjects, add_stat,
                     cookie);
     add_casted_stat("ep_num_eject_failures", epstats.numFailedEjects, add_stat,
                     cookie);
+    add_casted_stat("ep_num_ghost_hits", epstats.numGhostHits, add_stat,
+                    cookie);
+    add_casted_stat("ep_num_full_evictions", epstats.numFullEvictions,
+                    add_stat, cookie);
+    add_casted_stat("ep_quota_shrink_steps", epstats.quotaShrinkSteps,
+                    add_stat, cookie);
+    add_casted_stat("ep_quota_shrink_ejects", epstats.numQuotaShrinkEjects,
+                    add_stat, cookie);
+    add_casted_stat("ep_quota_warm_fetches", epstats.numQuotaWarmFetches,
+                    add_stat, cookie);
+    add_casted_stat("ep_vb_quota_pager_runs", epstats.vbQuotaPagerRuns,
+                    add_stat, cookie);
+    add_casted_stat("ep_vb_quota_ejects", epstats.numVBQuotaEjects,
+                    add_stat, cookie);
+    add_casted_stat("ep_bfilter_skips", epstats.numBloomFilterSkips,
+                    add_stat, cookie);
+    size_t bfSkips = epstats.numBloomFilterSkips.get();
+    size_t bfFalsePositives = epstats.numBloomFilterFalsePositives.get();
+    add_casted_stat("ep_bfilter_false_positives", bfFalsePositives,
+                    add_stat, cookie);
+    add_casted_stat("ep_bfilter_fp_rate",
+                    bfSkips + bfFalsePositives == 0 ? 0.0 :
+                    static_cast<double>(bfFalsePositives) /
+                    static_cast<double>(bfSkips + bfFalsePositives),
+                    add_stat, cookie);
+    add_casted_stat("ep_bfilter_rebuilds", epstats.numBloomFilterRebuilds,
+                    add_stat, cookie);
+    add_casted_stat("ep_values_compressed", epstats.numValuesCompressed,
+                    add_stat, cookie);
+    add_casted_stat("ep_values_decompressed", epstats.numValuesDecompressed,
+                    add_stat, cookie);
+    add_casted_stat("ep_replica_values_ejected", epstats.replicaValuesEjected,
+                    add_stat, cookie);
+    add_casted_stat("ep_replica_values_compressed",
+                    epstats.replicaValuesCompressed, add_stat, cookie);
+    add_casted_stat("ep_replica_bytes_reclaimed",
+                    epstats.replicaBytesReclaimed, add_stat, cookie);
+    add_casted_stat("ep_vbucket_owner_ops", epstats.vbOwnerOps,
+                    add_stat, cookie);
+    add_casted_stat("ep_vbucket_owner_blocked_ops",
+                    epstats.vbOwnerBlockedOps, add_stat, cookie);
+    add_casted_stat("ep_allocator_heap_bytes", epstats.allocatorHeapSize,
+                    add_stat, cookie);
+    add_casted_stat("ep_allocator_allocated_bytes",
+                    epstats.allocatorAllocatedSize, add_stat, cookie);
+    add_casted_stat("ep_allocator_fragmentation_bytes",
+                    epstats.allocatorFragmentation, add_stat, cookie);
+    add_casted_stat("ep_defrag_num_moved", epstats.defragNumMoved,
+                    add_stat, cookie);
+    add_casted_stat("ep_defrag_num_values_moved", epstats.defragNumValuesMoved,
+                    add_stat, cookie);
     add_casted_stat("ep_num_not_my_vbuckets", epstats.numNotMyVBuckets, add_stat,
                     cookie);
+    add_casted_stat("ep_num_stale_replica_reads", epstats.numStaleReplicaReads,
+                    add_stat, cookie);
+    add_casted_stat("ep_num_cas_drift_rejections",
+                    epstats.numCasDriftRejections, add_stat, cookie);
+    add_casted_stat("ep_epoch_pending", EpochManager::getNumPending(),
+                    add_stat, cookie);
+    for (int i = 0; i < ADMISSION_NUM_OPS; ++i) {
+        admission_op_t op = static_cast<admission_op_t>(i);
+        std::stringstream name;
+        name << "ep_admission_" << AdmissionControl::opName(op);
+        add_casted_stat((name.str() + "_admitted").c_str(),
+                        admission.getAdmitted(op), add_stat, cookie);
+        add_casted_stat((name.str() + "_rejected").c_str(),
+                        admission.getRejected(op), add_stat, cookie);
+    }
+    add_casted_stat("ep_admission_vb_rejected", admission.getVBucketRejected(),
+                    add_stat, cookie);
 
     add_casted_stat("ep_io_num_read", epstats.io_num_read, add_stat, cookie);
     add_casted_stat("ep_io_num_write", epstats.io_num_write, add_stat, cookie);
@@ -2560,6 +3658,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
     add_casted_stat("ep_pending_ops_max_duration",
                     epstats.pendingOpsMaxDuration,
                     add_stat, cookie);
+    add_casted_stat("ep_pending_ops_rejected", epstats.pendingOpsRejected,
+                    add_stat, cookie);
+    add_casted_stat("ep_getl_waiters", epstore->getGetlWaitQueue().size(),
+                    add_stat, cookie);
+    add_casted_stat("ep_num_getl_waits", epstats.numGetlWaits,
+                    add_stat, cookie);
 
     size_t vbDeletions = epstats.vbucketDeletions.get();
     if (vbDeletions > 0) {
@@ -2623,6 +3727,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
     struct tm alogTim = *gmtime((time_t *)&epstats.alogTime);
     strftime(timestr, 20, "%Y-%m-%d %H:%M:%S", &alogTim);
     add_casted_stat("ep_access_scanner_task_time", timestr, add_stat, cookie);
+    add_casted_stat("ep_access_trace",
+                    accessTrace.isEnabled() ? "on" : "off", add_stat, cookie);
+    add_casted_stat("ep_access_trace_ops", accessTrace.getRecorded(),
+                    add_stat, cookie);
 
     add_casted_stat("ep_startup_time", startupTime, add_stat, cookie);
 
@@ -2655,6 +3763,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_num_ops_del_ret_meta", epstats.numOpsDelRetMeta,
                     add_stat, cookie);
+    add_casted_stat("ep_num_ops_subdoc", epstats.numOpsSubdoc,
+                    add_stat, cookie);
+    add_casted_stat("ep_num_range_scans", epstats.numRangeScans,
+                    add_stat, cookie);
+    add_casted_stat("ep_num_range_scan_items", epstats.numRangeScanItems,
+                    add_stat, cookie);
     add_casted_stat("ep_chk_persistence_timeout",
                     VBucket::getCheckpointFlushTimeout(),
                     add_stat, cookie);
@@ -2668,6 +3782,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
 
 ENGINE_ERROR_CODE EventuallyPersistentEngine::doMemoryStats(const void *cookie,
                                                            ADD_STAT add_stat) {
+    ObjectRegistry::flushStats(this);
     add_casted_stat("bytes", stats.getTotalMemoryUsed(), add_stat, cookie);
     add_casted_stat("mem_used", stats.getTotalMemoryUsed(), add_stat, cookie);
     add_casted_stat("ep_kv_size", stats.currentSize, add_stat, cookie);
@@ -2689,6 +3804,28 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doMemoryStats(const void *cookie,
         add_casted_stat(it->first.c_str(), it->second, add_stat, cookie);
     }
 
+    std::map<std::string, size_t> slab_stats;
+    slabs->getStats(slab_stats);
+    for (it = slab_stats.begin(); it != slab_stats.end(); ++it) {
+        std::string name("ep_slab_" + it->first);
+        add_casted_stat(name.c_str(), it->second, add_stat, cookie);
+    }
+    add_casted_stat("ep_queued_item_pool_bytes",
+                    QueuedItemPool::getPooledBytes(), add_stat, cookie);
+    add_casted_stat("ep_key_prefixes", KeyPrefixTable::getNumPrefixes(),
+                    add_stat, cookie);
+    add_casted_stat("ep_key_prefix_bytes_saved",
+                    KeyPrefixTable::getBytesSaved(), add_stat, cookie);
+    add_casted_stat("ep_key_prefix_table_bytes",
+                    KeyPrefixTable::getMemoryUsed(), add_stat, cookie);
+
+    std::map<std::string, size_t> huge_stats;
+    HugePages::getStats(huge_stats);
+    for (it = huge_stats.begin(); it != huge_stats.end(); ++it) {
+        std::string name("ep_huge_pages_" + it->first);
+        add_casted_stat(name.c_str(), it->second, add_stat, cookie);
+    }
+
     return ENGINE_SUCCESS;
 }
 
@@ -2764,6 +3901,14 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
             add_casted_stat(buf, vb->ht.memSize, add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:mem_size_counted", vbid);
             add_casted_stat(buf, depthVisitor.memUsed, add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:max_chain_walked", vbid);
+            add_casted_stat(buf, vb->ht.getMaxChainWalked(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:lock_hold_max", vbid);
+            add_casted_stat(buf, vb->ht.getMaxLockHold() / 1000,
+                            add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:lock_hold_avg", vbid);
+            add_casted_stat(buf, vb->ht.getAvgLockHold() / 1000,
+                            add_stat, cookie);
 
             return false;
         }
@@ -2953,6 +4098,21 @@ static void showTapAggStat(const std::string &prefix,
     snprintf(statname, sl, "%s:total_backlog_size", prefix.c_str());
     add_casted_stat(statname, counter->tap_totalBacklogSize,
                     add_stat, cookie);
+
+    snprintf(statname, sl, "%s:bytes_sent", prefix.c_str());
+    add_casted_stat(statname, counter->tap_bytesSent, add_stat, cookie);
+
+    snprintf(statname, sl, "%s:bytes_per_sec", prefix.c_str());
+    add_casted_stat(statname, counter->tap_bytesPerSec, add_stat, cookie);
+
+    snprintf(statname, sl, "%s:replication_age", prefix.c_str());
+    add_casted_stat(statname, counter->tap_replicationAge, add_stat, cookie);
+
+    snprintf(statname, sl, "%s:ack_wait", prefix.c_str());
+    add_casted_stat(statname, counter->tap_ackWait, add_stat, cookie);
+
+    snprintf(statname, sl, "%s:backfill_item_age", prefix.c_str());
+    add_casted_stat(statname, counter->tap_backfillItemAge, add_stat, cookie);
 }
 
 ENGINE_ERROR_CODE EventuallyPersistentEngine::doTapAggStats(const void *cookie,
@@ -2996,6 +4156,30 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTapStats(const void *cookie,
     add_casted_stat("ep_tap_fg_fetched", stats.numTapFGFetched, add_stat, cookie);
     add_casted_stat("ep_tap_deletes", stats.numTapDeletes, add_stat, cookie);
     add_casted_stat("ep_tap_throttled", stats.tapThrottled, add_stat, cookie);
+    add_casted_stat("ep_tap_apply_queue_size", stats.tapApplyQueueSize,
+                    add_stat, cookie);
+    add_casted_stat("ep_tap_apply_retries", stats.tapApplyRetries,
+                    add_stat, cookie);
+    add_casted_stat("ep_tap_apply_batches", stats.tapApplyBatches,
+                    add_stat, cookie);
+    add_casted_stat("ep_tap_apply_batched", stats.tapApplyBatchedOps,
+                    add_stat, cookie);
+    BackfillController &controller = tapConnMap->getBackfillController();
+    add_casted_stat("ep_tap_backfill_bg_window", controller.getBgWindow(),
+                    add_stat, cookie);
+    add_casted_stat("ep_tap_backfill_backlog_limit",
+                    controller.getBacklogLimit(), add_stat, cookie);
+    add_casted_stat("ep_tap_backfill_disk_load_rate",
+                    controller.getDiskLoadRate(), add_stat, cookie);
+    add_casted_stat("ep_tap_backfill_backoffs", stats.tapBackfillBackoffs,
+                    add_stat, cookie);
+    add_casted_stat("ep_tap_fanout_items", stats.tapFanoutItems,
+                    add_stat, cookie);
+    size_t numAcks = stats.tapAckNumSamples.get();
+    if (numAcks > 0) {
+        add_casted_stat("ep_tap_ack_wait_avg", stats.tapAckWait / numAcks,
+                        add_stat, cookie);
+    }
     add_casted_stat("ep_tap_noop_interval", tapConnMap->getTapNoopInterval(), add_stat, cookie);
     add_casted_stat("ep_tap_count", aggregator.totalTaps, add_stat, cookie);
     add_casted_stat("ep_tap_total_queue", aggregator.tap_queue, add_stat, cookie);
@@ -3009,6 +4193,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTapStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_tap_total_backlog_size", aggregator.tap_totalBacklogSize,
                     add_stat, cookie);
+    add_casted_stat("ep_tap_bytes_sent", aggregator.tap_bytesSent,
+                    add_stat, cookie);
+    add_casted_stat("ep_tap_bytes_per_sec", aggregator.tap_bytesPerSec,
+                    add_stat, cookie);
     add_casted_stat("ep_tap_ack_window_size", tapConfig->getAckWindowSize(),
                     add_stat, cookie);
     add_casted_stat("ep_tap_ack_interval", tapConfig->getAckInterval(),
@@ -3023,6 +4211,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTapStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_tap_throttle_queue_cap",
                     stats.tapThrottleWriteQueueCap, add_stat, cookie);
+    if (tapThrottle->isPacing()) {
+        add_casted_stat("ep_tap_throttle_paced_rate",
+                        tapThrottle->getPacedRate(), add_stat, cookie);
+        add_casted_stat("ep_tap_throttle_drain_rate",
+                        tapThrottle->getDrainRate(), add_stat, cookie);
+    }
 
     if (stats.tapBgNumOperations > 0) {
         add_casted_stat("ep_tap_bg_num_samples", stats.tapBgNumOperations,
@@ -3069,7 +4263,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doKeyStats(const void *cookie,
                 "stat call. Would have leaked\n");
             diskItem.reset();
         }
-    } else if (validate) {
+    } else if (validate && !epstore->isEphemeral()) {
         rv = epstore->statsVKey(key, vbid, cookie);
         if (rv == ENGINE_NOT_MY_VBUCKET || rv == ENGINE_KEY_ENOENT) {
             if (isDegradedMode()) {
@@ -3114,8 +4308,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     add_casted_stat("bg_tap_wait", stats.tapBgWaitHisto, add_stat, cookie);
     add_casted_stat("bg_tap_load", stats.tapBgLoadHisto, add_stat, cookie);
     add_casted_stat("pending_ops", stats.pendingOpsHisto, add_stat, cookie);
+    add_casted_stat("pending_op_wait", stats.pendingOpWaitHisto, add_stat,
+                    cookie);
 
     add_casted_stat("storage_age", stats.dirtyAgeHisto, add_stat, cookie);
+    add_casted_stat("persistence_latency", stats.persistLatencyHisto,
+                    add_stat, cookie);
 
     // Regular commands
     add_casted_stat("get_cmd", stats.getCmdHisto, add_stat, cookie);
@@ -3128,6 +4326,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     add_casted_stat("del_vb_cmd", stats.delVbucketCmdHisto, add_stat, cookie);
     add_casted_stat("chk_persistence_cmd", stats.chkPersistenceHisto,
                     add_stat, cookie);
+    add_casted_stat("key_durability_cmd", stats.keyDurabilityHisto,
+                    add_stat, cookie);
     // Tap commands
     add_casted_stat("tap_vb_set", stats.tapVbucketSetHisto, add_stat, cookie);
     add_casted_stat("tap_vb_reset", stats.tapVbucketResetHisto, add_stat, cookie);
@@ -3135,12 +4335,14 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     // Misc
     add_casted_stat("notify_io", stats.notifyIOHisto, add_stat, cookie);
     add_casted_stat("batch_read", stats.getMultiHisto, add_stat, cookie);
+    add_casted_stat("bg_batch_wait", stats.bgBatchWaitHisto, add_stat, cookie);
 
     // Disk stats
     add_casted_stat("disk_insert", stats.diskInsertHisto, add_stat, cookie);
     add_casted_stat("disk_update", stats.diskUpdateHisto, add_stat, cookie);
     add_casted_stat("disk_del", stats.diskDelHisto, add_stat, cookie);
     add_casted_stat("disk_vb_del", stats.diskVBDelHisto, add_stat, cookie);
+    add_casted_stat("mem_vb_del", stats.memVBDelHisto, add_stat, cookie);
     add_casted_stat("disk_commit", stats.diskCommitHisto, add_stat, cookie);
     add_casted_stat("disk_vbstate_snapshot", stats.snapshotVbucketHisto,
                     add_stat, cookie);
@@ -3148,6 +4350,98 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     add_casted_stat("item_alloc_sizes", stats.itemAllocSizeHisto,
                     add_stat, cookie);
 
+    // Hash table stats
+    add_casted_stat("ht_lock_wait", stats.htLockWaitHisto, add_stat, cookie);
+    add_casted_stat("ht_lock_hold", stats.htLockHoldHisto, add_stat, cookie);
+    add_casted_stat("ht_chain_length", stats.htChainLengthHisto,
+                    add_stat, cookie);
+
+    return ENGINE_SUCCESS;
+}
+
+/// @cond DETAILS
+/**
+ * The percentiles of a set of HdrHistogram bucket counts.
+ */
+struct HdrCountsPercentile {
+    HdrCountsPercentile(const size_t *c, hrtime_t h) : counts(c), highest(h) {}
+    hrtime_t operator() (double pct) const {
+        return HdrHistogram<hrtime_t>::percentileOf(counts, highest, pct);
+    }
+    const size_t *counts;
+    hrtime_t highest;
+};
+
+/**
+ * The percentiles of a Histogram.
+ */
+template <typename T>
+struct HistogramPercentile {
+    HistogramPercentile(const Histogram<T> &h) : histo(h) {}
+    T operator() (double pct) const {
+        return histo.percentile(pct);
+    }
+    const Histogram<T> &histo;
+};
+/// @endcond
+
+template <typename P>
+static void addTimingSummary(const std::string &prefix, size_t count,
+                             const P &pct, const void *cookie,
+                             ADD_STAT add_stat) {
+    add_casted_stat((prefix + ":count").c_str(), count, add_stat, cookie);
+    add_casted_stat((prefix + ":p50").c_str(), pct(50.0), add_stat, cookie);
+    add_casted_stat((prefix + ":p90").c_str(), pct(90.0), add_stat, cookie);
+    add_casted_stat((prefix + ":p99").c_str(), pct(99.0), add_stat, cookie);
+    add_casted_stat((prefix + ":p999").c_str(), pct(99.9), add_stat, cookie);
+    add_casted_stat((prefix + ":max").c_str(), pct(100.0), add_stat, cookie);
+}
+
+template <typename T>
+static void addTimingSummary(const char *name, const Histogram<T> &histo,
+                             const void *cookie, ADD_STAT add_stat) {
+    HistogramPercentile<T> pct(histo);
+    addTimingSummary(name, const_cast<Histogram<T>&>(histo).total(), pct,
+                     cookie, add_stat);
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingSummaryStats(
+                                                        const void *cookie,
+                                                        ADD_STAT add_stat) {
+    static const struct {
+        const char *name;
+        size_t steps;
+    } windows[] = {
+        { "10s", 1 },
+        { "60s", 6 }
+    };
+
+    std::vector<size_t> counts(HdrHistogram<hrtime_t>::NUM_BUCKETS);
+    for (size_t i = 0; i < timingWindows.size(); ++i) {
+        const HdrHistogram<hrtime_t> &histo(timingWindows[i]->getHistogram());
+        hrtime_t highest = histo.getMax();
+        size_t n = histo.getCounts(&counts[0]);
+        HdrCountsPercentile pct(&counts[0], highest);
+        addTimingSummary(hdrTimings[i].name, n, pct, cookie, add_stat);
+
+        for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); ++w) {
+            n = timingWindows[i]->getWindow(windows[w].steps, &counts[0]);
+            std::string prefix(hdrTimings[i].name);
+            prefix.append(":").append(windows[w].name);
+            addTimingSummary(prefix, n, pct, cookie, add_stat);
+        }
+    }
+
+    // These aren't kept in log-linear buckets, so have no windows.
+    addTimingSummary("storage_age", stats.dirtyAgeHisto, cookie, add_stat);
+    addTimingSummary("persistence_latency", stats.persistLatencyHisto,
+                     cookie, add_stat);
+    addTimingSummary("disk_commit", stats.diskCommitHisto, cookie, add_stat);
+    addTimingSummary("item_alloc_sizes", stats.itemAllocSizeHisto,
+                     cookie, add_stat);
+    addTimingSummary("ht_chain_length", stats.htChainLengthHisto,
+                     cookie, add_stat);
+
     return ENGINE_SUCCESS;
 }
 
@@ -3171,8 +4465,9 @@ static void showJobLog(const char *prefix, const char *logname,
     }
 }
 
-static void doDispatcherStat(const char *prefix, const DispatcherState &ds,
+static void doDispatcherStat(const char *prefix, Dispatcher *d,
                              const void *cookie, ADD_STAT add_stat) {
+    DispatcherState ds(d->getDispatcherState());
     char statname[80] = {0};
     snprintf(statname, sizeof(statname), "%s:state", prefix);
     add_casted_stat(statname, ds.getStateName(), add_stat, cookie);
@@ -3191,20 +4486,51 @@ static void doDispatcherStat(const char *prefix, const DispatcherState &ds,
                         add_stat, cookie);
     }
 
+    snprintf(statname, sizeof(statname), "%s:cpu_time", prefix);
+    add_casted_stat(statname, d->getCPUTime(), add_stat, cookie);
+    snprintf(statname, sizeof(statname), "%s:schedule_delay", prefix);
+    add_casted_stat(statname, d->getWaitHisto(), add_stat, cookie);
+    snprintf(statname, sizeof(statname), "%s:task_runtime", prefix);
+    add_casted_stat(statname, d->getRunHisto(), add_stat, cookie);
+
     showJobLog(prefix, "log", ds.getLog(), cookie, add_stat);
     showJobLog(prefix, "slow", ds.getSlowLog(), cookie, add_stat);
 }
 
 ENGINE_ERROR_CODE EventuallyPersistentEngine::doDispatcherStats(const void *cookie,
                                                                 ADD_STAT add_stat) {
-    DispatcherState tapds(epstore->getAuxIODispatcher()->getDispatcherState());
-    doDispatcherStat("auxio_dispatcher", tapds, cookie, add_stat);
-
-    DispatcherState nds(epstore->getNonIODispatcher()->getDispatcherState());
-    doDispatcherStat("nio_dispatcher", nds, cookie, add_stat);
+    doDispatcherStat("auxio_dispatcher", epstore->getAuxIODispatcher(),
+                     cookie, add_stat);
+    doDispatcherStat("nio_dispatcher", epstore->getNonIODispatcher(),
+                     cookie, add_stat);
 
     IOManager::get()->doWorkerStat(ObjectRegistry::getCurrentEngine(), cookie,
                                    add_stat);
+
+    IOScheduler &sched = epstore->getIOScheduler();
+    size_t slots = sched.getSlots();
+    if (slots > 0) {
+        char statname[80] = {0};
+        add_casted_stat("io_sched:slots", slots, add_stat, cookie);
+        for (int c = 0; c < NUM_IO_CLASSES; ++c) {
+            io_class_t ioClass = static_cast<io_class_t>(c);
+            const char *name = IOScheduler::getClassName(ioClass);
+            IOShare::Bucket share = sched.getClass(ioClass);
+            snprintf(statname, sizeof(statname), "io_sched:%s:weight", name);
+            add_casted_stat(statname, share.weight, add_stat, cookie);
+            snprintf(statname, sizeof(statname), "io_sched:%s:waiting", name);
+            add_casted_stat(statname, share.waiting, add_stat, cookie);
+            snprintf(statname, sizeof(statname), "io_sched:%s:running", name);
+            add_casted_stat(statname, share.running, add_stat, cookie);
+            snprintf(statname, sizeof(statname), "io_sched:%s:granted", name);
+            add_casted_stat(statname, share.granted, add_stat, cookie);
+            snprintf(statname, sizeof(statname), "io_sched:%s:wait_time",
+                     name);
+            add_casted_stat(statname, share.waitTime, add_stat, cookie);
+            snprintf(statname, sizeof(statname), "io_sched:%s:io_time", name);
+            add_casted_stat(statname, share.ioTime, add_stat, cookie);
+        }
+    }
     return ENGINE_SUCCESS;
 }
 
@@ -3222,10 +4548,28 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doWorkloadStats(const void *cookie
     snprintf(statname, sizeof(statname), "ep_workload:num_writers");
     add_casted_stat(statname, writers, add_stat, cookie);
 
+    if (workload->isAuto()) {
+        int active = workload->getActiveReaders();
+        snprintf(statname, sizeof(statname), "ep_workload:active_readers");
+        add_casted_stat(statname, active, add_stat, cookie);
+
+        active = workload->getActiveWriters();
+        snprintf(statname, sizeof(statname), "ep_workload:active_writers");
+        add_casted_stat(statname, active, add_stat, cookie);
+    }
+
     int shards = workload->getNumShards();
     snprintf(statname, sizeof(statname), "ep_workload:num_shards");
     add_casted_stat(statname, shards, add_stat, cookie);
 
+    int auxio = workload->calculateNumAuxIO();
+    snprintf(statname, sizeof(statname), "ep_workload:num_auxio");
+    add_casted_stat(statname, auxio, add_stat, cookie);
+
+    int nonio = workload->calculateNumNonIO();
+    snprintf(statname, sizeof(statname), "ep_workload:num_nonio");
+    add_casted_stat(statname, nonio, add_stat, cookie);
+
     return ENGINE_SUCCESS;
 }
 
@@ -3259,6 +4603,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::getStats(const void* cookie,
         rv = doCheckpointStats(cookie, add_stat, stat_key, nkey);
     } else if (nkey == 7 && strncmp(stat_key, "timings", 7) == 0) {
         rv = doTimingStats(cookie, add_stat);
+    } else if (nkey == 15 && strncmp(stat_key, "timings_summary", 15) == 0) {
+        rv = doTimingSummaryStats(cookie, add_stat);
     } else if (nkey == 10 && strncmp(stat_key, "dispatcher", 10) == 0) {
         rv = doDispatcherStats(cookie, add_stat);
     } else if (nkey == 6 && strncmp(stat_key, "memory", 6) == 0) {
@@ -3330,23 +4676,206 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::getStats(const void* cookie,
         rv = doTapVbTakeoverStats(cookie, add_stat, tStream, vbucket_id);
     } else if (nkey == 8 && strncmp(stat_key, "workload", 8) == 0) {
         return doWorkloadStats(cookie, add_stat);
+    } else if (nkey >= 5 && strncmp(stat_key, "delta", 5) == 0 &&
+               (nkey == 5 || stat_key[5] == ' ')) {
+        rv = doDeltaStats(cookie, add_stat, stat_key + 5, nkey - 5);
+    } else if (nkey == 7 && strncmp(stat_key, "hotkeys", 7) == 0) {
+        rv = doHotKeysStats(cookie, add_stat);
+    } else if (nkey == 5 && strncmp(stat_key, "locks", 5) == 0) {
+        rv = doLockStats(cookie, add_stat);
+    } else if (nkey == 7 && strncmp(stat_key, "optrace", 7) == 0) {
+        rv = doOpTraceStats(cookie, add_stat);
     }
 
     return rv;
 }
 
-void EventuallyPersistentEngine::notifyPendingConnections(void) {
-    uint32_t blurb = tapConnMap->prepareWait();
-    // No need to aquire shutdown lock
-    while (!stats.shutdown.isShutdown) {
-        tapConnMap->notifyIOThreadMain();
-        epstore->firePendingVBucketOps();
+ENGINE_ERROR_CODE EventuallyPersistentEngine::doDeltaStats(const void *cookie,
+                                                           ADD_STAT add_stat,
+                                                           const char *args,
+                                                           size_t nargs) {
+    std::stringstream ss(std::string(args, nargs));
+    std::string cursorStr;
+    std::string group;
+    ss >> cursorStr;
+    std::getline(ss >> std::ws, group);
+
+    uint64_t cursor = 0;
+    if (!cursorStr.empty() && !parseUint64(cursorStr.c_str(), &cursor)) {
+        return ENGINE_EINVAL;
+    }
+    // A vkey waits for a bg fetch, which would be of the wrong cookie.
+    if (group.compare(0, 5, "delta") == 0 || group.compare(0, 5, "vkey ") == 0) {
+        return ENGINE_EINVAL;
+    }
+
+    stat_map_t current;
+    ENGINE_ERROR_CODE rv = getStats(&current,
+                                    group.empty() ? NULL : group.c_str(),
+                                    static_cast<int>(group.length()),
+                                    DeltaStats::collect);
+    if (rv != ENGINE_SUCCESS) {
+        return rv;
+    }
+
+    stat_list_t changed;
+    uint64_t next = deltaStats.update(cursor, group, current, changed);
+    for (stat_list_t::iterator it = changed.begin(); it != changed.end(); ++it) {
+        add_stat(it->first.data(), static_cast<uint16_t>(it->first.length()),
+                 it->second.data(), static_cast<uint32_t>(it->second.length()),
+                 cookie);
+    }
+    add_casted_stat("delta_cursor", next, add_stat, cookie);
+    return ENGINE_SUCCESS;
+}
+
+static void addHotKeysStats(const char *prefix, const char *countName,
+                            const std::vector<HotKeys::Entry> &entries,
+                            bool withError, ADD_STAT add_stat,
+                            const void *cookie) {
+    char statname[80];
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const HotKeys::Entry &e = entries[i];
+        snprintf(statname, sizeof(statname), "%s_%d:%s", prefix,
+                 static_cast<int>(i), withError ? "key" : "vbucket");
+        add_casted_stat(statname, e.key, add_stat, cookie);
+        snprintf(statname, sizeof(statname), "%s_%d:%s", prefix,
+                 static_cast<int>(i), countName);
+        add_casted_stat(statname, e.count, add_stat, cookie);
+        if (withError) {
+            snprintf(statname, sizeof(statname), "%s_%d:error", prefix,
+                     static_cast<int>(i));
+            add_casted_stat(statname, e.error, add_stat, cookie);
+        }
+        snprintf(statname, sizeof(statname), "%s_%d:gets", prefix,
+                 static_cast<int>(i));
+        add_casted_stat(statname, e.gets, add_stat, cookie);
+        snprintf(statname, sizeof(statname), "%s_%d:sets", prefix,
+                 static_cast<int>(i));
+        add_casted_stat(statname, e.sets, add_stat, cookie);
+    }
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::doHotKeysStats(const void *cookie,
+                                                             ADD_STAT add_stat) {
+    add_casted_stat("sample_rate", hotKeys.getSampleRate(), add_stat, cookie);
+
+    std::vector<HotKeys::Entry> entries;
+    hotKeys.getTopByOps(entries);
+    addHotKeysStats("key_ops", "ops", entries, true, add_stat, cookie);
+    hotKeys.getTopByBytes(entries);
+    addHotKeysStats("key_bytes", "bytes", entries, true, add_stat, cookie);
+    hotKeys.getTopVBucketsByOps(entries);
+    addHotKeysStats("vb_ops", "ops", entries, false, add_stat, cookie);
+    hotKeys.getTopVBucketsByBytes(entries);
+    addHotKeysStats("vb_bytes", "bytes", entries, false, add_stat, cookie);
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::doLockStats(const void *cookie,
+                                                          ADD_STAT add_stat) {
+    add_casted_stat("enabled", LockProfile::isEnabled() ? "true" : "false",
+                    add_stat, cookie);
+
+    std::vector<LockProfiler*> profiles;
+    LockProfiler::getAll(profiles);
+    std::vector<LockProfiler*>::iterator it;
+    for (it = profiles.begin(); it != profiles.end(); ++it) {
+        LockProfiler *p = *it;
+        const char *name = p->getName().c_str();
+        add_prefixed_stat(name, "acquisitions", p->acquisitions.get(),
+                          add_stat, cookie);
+        add_prefixed_stat(name, "contended", p->contentions.get(), add_stat,
+                          cookie);
+        add_prefixed_stat(name, "max_hold", p->maxHold.get(), add_stat,
+                          cookie);
+        std::string wait(p->getName() + ":wait");
+        add_casted_stat(wait.c_str(), p->waitHisto, add_stat, cookie);
+    }
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::doOpTraceStats(const void *cookie,
+                                                             ADD_STAT add_stat) {
+    add_casted_stat("threshold", opTracer.getThreshold(), add_stat, cookie);
+
+    std::vector<OpTrace> slowOps(opTracer.getSlowOps());
+    for (size_t i = 0; i < slowOps.size(); ++i) {
+        const OpTrace &t = slowOps[i];
+        std::stringstream prefix;
+        prefix << "op_" << i;
+        std::string p(prefix.str());
+        add_prefixed_stat(p, "op", t.op, add_stat, cookie);
+        add_prefixed_stat(p, "key", t.key, add_stat, cookie);
+        add_prefixed_stat(p, "vbucket", t.vbucket, add_stat, cookie);
+        add_prefixed_stat(p, "when", t.when, add_stat, cookie);
+        add_prefixed_stat(p, "status", static_cast<int>(t.status), add_stat,
+                          cookie);
+        add_prefixed_stat(p, "total", t.total / 1000, add_stat, cookie);
+        for (int ph = 0; ph < TRACE_NUM_PHASES; ++ph) {
+            add_prefixed_stat(p,
+                              OpTracer::phaseName(static_cast<trace_phase_t>(ph)),
+                              t.phases[ph] / 1000, add_stat, cookie);
+        }
+    }
+    return ENGINE_SUCCESS;
+}
+
+//! The seconds between the batches of pending ops woken
+static const double PENDING_OPS_WAKE_INTERVAL = 0.001;
+
+void EventuallyPersistentEngine::notifyIOComplete(
+                                    std::vector<IOCompletion> &completions) {
+    if (completions.empty()) {
+        return;
+    }
+    if (offloadNotify && !stats.shutdown.isShutdown) {
+        {
+            LockHolder lh(pendingCompletionsMutex);
+            pendingCompletions.insert(pendingCompletions.end(),
+                                      completions.begin(), completions.end());
+        }
+        completions.clear();
+        notifyNotificationThread();
+        return;
+    }
+    notifyCompletions(completions);
+}
+
+void EventuallyPersistentEngine::notifyCompletions(
+                                    std::vector<IOCompletion> &completions) {
+    if (completions.empty()) {
+        return;
+    }
+    BlockTimer bt(&stats.notifyIOHisto);
+    EventuallyPersistentEngine *epe = ObjectRegistry::onSwitchThread(NULL, true);
+    std::vector<IOCompletion>::iterator it;
+    for (it = completions.begin(); it != completions.end(); ++it) {
+        serverApi->cookie->notify_io_complete(it->first, it->second);
+    }
+    ObjectRegistry::onSwitchThread(epe);
+    completions.clear();
+}
+
+void EventuallyPersistentEngine::notifyPendingConnections(void) {
+    uint32_t blurb = tapConnMap->prepareWait();
+    // No need to aquire shutdown lock
+    while (!stats.shutdown.isShutdown) {
+        std::vector<IOCompletion> completions;
+        {
+            LockHolder lh(pendingCompletionsMutex);
+            completions.swap(pendingCompletions);
+        }
+        notifyCompletions(completions);
+        tapConnMap->notifyIOThreadMain();
+        bool morePendingOps = epstore->firePendingVBucketOps();
 
         if (stats.shutdown.isShutdown) {
             return;
         }
 
-        blurb = tapConnMap->wait(1.0, blurb);
+        blurb = tapConnMap->wait(morePendingOps ? PENDING_OPS_WAKE_INTERVAL : 1.0,
+                                 blurb);
     }
 }
 
@@ -3363,11 +4892,30 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::observe(const void* cookie,
     protocol_binary_request_no_extras *req =
         (protocol_binary_request_no_extras*)request;
 
-    size_t offset = 0;
     const char* data = reinterpret_cast<const char*>(req->bytes) + sizeof(req->bytes);
     uint32_t data_len = ntohl(req->message.header.request.bodylen);
+    uint8_t extlen = req->message.header.request.extlen;
+    size_t offset = extlen;
     std::stringstream result;
 
+    if (extlen > data_len) {
+        std::string msg("Invalid packet structure");
+        return sendResponse(response, NULL, 0, 0, 0, msg.c_str(), msg.length(),
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_EINVAL, 0,
+                            cookie);
+    }
+    // Nothing an ephemeral bucket holds is ever persisted.
+    bool waitForPersistence = extlen > 0 && (data[0] & OBS_WAIT_PERSISTED) &&
+        !epstore->isEphemeral();
+    // Non-zero if the connection was waiting for its keys to be persisted.
+    hrtime_t waitStart = fetchObserveWait(cookie);
+    RCPtr<VBucket> waitVb;
+    uint64_t waitCommits = 0;
+    // Mutations queued ahead of the last one persisted, in the vbuckets
+    // with keys that aren't yet.
+    uint64_t unpersisted = 0;
+
     while (offset < data_len) {
         uint16_t vb_id;
         uint16_t keylen;
@@ -3403,6 +4951,11 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::observe(const void* cookie,
         LOG(EXTENSION_LOG_DEBUG, "Observing key: %s, in vbucket %d.",
             key.c_str(), vb_id);
 
+        // Read before the key's state, so that a commit in between is not
+        // missed by a wait on it.
+        RCPtr<VBucket> vb = epstore->getVBucket(vb_id);
+        uint64_t commits = vb ? vb->getCommitCount() : 0;
+
         // Get key stats
         uint16_t keystatus = 0;
         struct key_stats kstats;
@@ -3415,6 +4968,14 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::observe(const void* cookie,
                 keystatus = OBS_STATE_PERSISTED;
             } else {
                 keystatus = OBS_STATE_NOT_PERSISTED;
+                if (vb) {
+                    unpersisted = std::max(unpersisted,
+                        vb->checkpointManager.getUnpersistedMutations());
+                }
+                if (waitForPersistence && !waitVb && vb) {
+                    waitVb = vb;
+                    waitCommits = commits;
+                }
             }
         } else if (rv == ENGINE_KEY_ENOENT) {
             keystatus = OBS_STATE_NOT_FOUND;
@@ -3443,8 +5004,26 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::observe(const void* cookie,
         result.write((char*) &cas, sizeof(uint64_t));
     }
 
+    if (waitVb) {
+        // Rather than have the client poll, look again on the vbucket's next
+        // commit, for up to the checkpoint persistence timeout.  If there's
+        // been a commit already, the client gets what we found.
+        hrtime_t now = gethrtime();
+        if (waitStart == 0) {
+            waitStart = now;
+        }
+        size_t waited = (now - waitStart) / 1000000000;
+        if (waited < VBucket::getCheckpointFlushTimeout() &&
+            waitVb->addPersistenceWaiter(cookie, waitCommits)) {
+            addObserveWait(cookie, waitStart);
+            return ENGINE_EWOULDBLOCK;
+        }
+    }
+
+    // The vbucket watermarks tell how far behind the flusher is for the
+    // keys asked about, where the disk queue is that of the whole bucket.
     uint64_t persist_time = 0;
-    double queue_size = static_cast<double>(stats.diskQueueSize);
+    double queue_size = static_cast<double>(unpersisted);
     double item_trans_time = epstore->getTransactionTimePerItem();
 
     if (item_trans_time > 0 && queue_size > 0) {
@@ -3484,6 +5063,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::touch(const void *cookie,
                                          request->request.opcode != PROTOCOL_BINARY_CMD_TOUCH,
                                          (time_t)exptime));
     ENGINE_ERROR_CODE rv = gv.getStatus();
+    // A touch gets no item back, as it doesn't return the value.
+    if (rv == ENGINE_SUCCESS && gv.getValue() &&
+        !decompressForClient(gv.getValue())) {
+        delete gv.getValue();
+        rv = ENGINE_FAILED;
+    }
     if (rv == ENGINE_SUCCESS) {
         Item *it = gv.getValue();
         if (request->request.opcode == PROTOCOL_BINARY_CMD_TOUCH) {
@@ -3565,7 +5150,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::deregisterTapClient(const void *co
             if (!vb) {
                 continue;
             }
-            vb->checkpointManager.removeTAPCursor(tap_name);
+            tapConnMap->getTapFanout().removeCursor(vb, tap_name);
         }
     }
 
@@ -3648,6 +5233,9 @@ EventuallyPersistentEngine::handleCheckpointCmds(const void *cookie,
             if ((bodylen - keylen) == 0) {
                 msg << "No checkpoint id is given for CMD_CHECKPOINT_PERSISTENCE!!!";
                 status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+            } else if (epstore->isEphemeral()) {
+                msg << "Checkpoints of an ephemeral bucket are never persisted";
+                status = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
             } else {
                 uint64_t chk_id;
                 memcpy(&chk_id, req->bytes + sizeof(req->bytes) + keylen,
@@ -3684,6 +5272,69 @@ EventuallyPersistentEngine::handleCheckpointCmds(const void *cookie,
                         status, 0, cookie);
 }
 
+ENGINE_ERROR_CODE
+EventuallyPersistentEngine::keyDurability(const void *cookie,
+                                          protocol_binary_request_header *req,
+                                          ADD_RESPONSE response)
+{
+    if (getEngineSpecific(cookie) == &keyDurabilityWait) {
+        // Woken up by the flusher or a replica's ack.
+        storeEngineSpecific(cookie, NULL);
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+    }
+
+    uint8_t extlen = req->request.extlen;
+    uint16_t keylen = ntohs(req->request.keylen);
+    uint32_t bodylen = ntohl(req->request.bodylen);
+    if (keylen == 0 || extlen > 1 || extlen + keylen > bodylen) {
+        std::string msg("Invalid packet structure");
+        return sendResponse(response, NULL, 0, NULL, 0, msg.c_str(),
+                            msg.length(), PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    const char *body = reinterpret_cast<const char*>(req->bytes) +
+        sizeof(req->bytes);
+    uint8_t flags = extlen == 1 ? body[0] : KEY_DURABILITY_PERSIST;
+    std::string key(body + extlen, keylen);
+    uint16_t vbucket = ntohs(req->request.vbucket);
+    uint64_t cas = ntohll(req->request.cas);
+
+    // Set before the wait is added, so that a notification can't beat it.
+    storeEngineSpecific(cookie, &keyDurabilityWait);
+    ENGINE_ERROR_CODE rv =
+        epstore->addKeyDurabilityWait(key, vbucket, cas,
+                                      flags & KEY_DURABILITY_PERSIST,
+                                      flags & KEY_DURABILITY_REPLICATE,
+                                      cookie);
+    if (rv == ENGINE_EWOULDBLOCK) {
+        return rv;
+    }
+    storeEngineSpecific(cookie, NULL);
+
+    protocol_binary_response_status status;
+    switch (rv) {
+    case ENGINE_SUCCESS:
+        status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+        break;
+    case ENGINE_KEY_EEXISTS:
+        status = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+        break;
+    case ENGINE_KEY_ENOENT:
+        status = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+        break;
+    case ENGINE_NOT_MY_VBUCKET:
+        status = PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET;
+        break;
+    default:
+        status = PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+    }
+    return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                        PROTOCOL_BINARY_RAW_BYTES, status, 0, cookie);
+}
+
 ENGINE_ERROR_CODE
 EventuallyPersistentEngine::resetReplicationChain(const void *cookie,
                                                   protocol_binary_request_header *req,
@@ -3831,6 +5482,23 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::setWithMeta(const void* cookie,
     }
     uint8_t *dta = key + keylen;
 
+    if (!force) {
+        ItemMetaData meta;
+        meta.cas = cas;
+        meta.seqno = seqno;
+        meta.flags = flags;
+        meta.exptime = expiration;
+        if (epstore->rejectsWithMeta(std::string((char*)key, keylen), vbucket,
+                                     meta, false)) {
+            // Not worth copying and compressing the value of a loser.
+            stats.numOpsSetMetaResolutionFailed++;
+            return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                                PROTOCOL_BINARY_RAW_BYTES,
+                                PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, 0,
+                                cookie);
+        }
+    }
+
     Item *itm = new Item(key, keylen, vallen, flags, expiration, cas, -1, vbucket);
     itm->setSeqno(seqno);
     memcpy((char*)itm->getData(), dta, vallen);
@@ -3840,6 +5508,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::setWithMeta(const void* cookie,
                             PROTOCOL_BINARY_RAW_BYTES,
                             PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
     }
+    maybeCompress(itm);
 
     bool allowExisting = (opcode == CMD_SET_WITH_META ||
                           opcode == CMD_SETQ_WITH_META);
@@ -3876,6 +5545,499 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::setWithMeta(const void* cookie,
                         rc, cas, cookie);
 }
 
+static const size_t WITH_META_RECORD_SIZE = 32;
+
+static uint64_t getBatchInt(const uint8_t *buf, size_t len) {
+    uint64_t val = 0;
+    for (size_t i = 0; i < len; ++i) {
+        val = (val << 8) | buf[i];
+    }
+    return val;
+}
+
+/**
+ * A record of the body of CMD_WITH_META_BATCH or CMD_GET_META_BATCH.
+ */
+struct WithMetaRecord {
+    bool isDelete;
+    uint8_t options;
+    const uint8_t *key;
+    uint16_t keylen;
+    uint32_t flags;
+    uint32_t expiration;
+    uint64_t seqno;
+    uint64_t cas;
+    const uint8_t *value;
+    size_t vallen;
+};
+
+/**
+ * Parse the record at p, moving p past it.
+ *
+ * @return false if the record is cut short or malformed
+ */
+static bool nextWithMetaRecord(const uint8_t *&p, const uint8_t *end,
+                               WithMetaRecord &rec) {
+    if (static_cast<size_t>(end - p) < WITH_META_RECORD_SIZE) {
+        return false;
+    }
+    uint8_t op = p[0];
+    rec.isDelete = op == WITH_META_BATCH_DEL;
+    rec.options = p[1];
+    rec.keylen = static_cast<uint16_t>(getBatchInt(p + 2, 2));
+    memcpy(&rec.flags, p + 4, sizeof(rec.flags));
+    rec.expiration = static_cast<uint32_t>(getBatchInt(p + 8, 4));
+    rec.seqno = getBatchInt(p + 12, 8);
+    rec.cas = getBatchInt(p + 20, 8);
+    rec.vallen = getBatchInt(p + 28, 4);
+    p += WITH_META_RECORD_SIZE;
+    if (rec.keylen == 0 ||
+        static_cast<size_t>(end - p) < rec.keylen + rec.vallen ||
+        (op != WITH_META_BATCH_SET && op != WITH_META_BATCH_DEL) ||
+        (rec.isDelete && rec.vallen != 0)) {
+        return false;
+    }
+    rec.expiration = rec.expiration == 0 ?
+        0 : ep_abs_time(ep_reltime(rec.expiration));
+    rec.key = p;
+    rec.value = p + rec.keylen;
+    p += rec.keylen + rec.vallen;
+    return true;
+}
+
+/**
+ * Set the bit of the i-th record in a bitmap of a batch's response that
+ * starts at offset.
+ */
+static void setBatchBit(std::vector<uint8_t> &bitmaps, size_t offset,
+                        size_t i) {
+    bitmaps[offset + i / 8] |= static_cast<uint8_t>(1 << (i % 8));
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::withMetaBatch(const void* cookie,
+                                                            protocol_binary_request_header *request,
+                                                            ADD_RESPONSE response) {
+    uint16_t nkey = ntohs(request->request.keylen);
+    uint8_t extlen = request->request.extlen;
+    uint32_t bodylen = ntohl(request->request.bodylen);
+    if (nkey != 0 || extlen != 0 || bodylen == 0) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    if (isDegradedMode()) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_ETMPFAIL,
+                            0, cookie);
+    }
+
+    uint16_t vbucket = ntohs(request->request.vbucket);
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(request) +
+                       sizeof(request->bytes);
+    const uint8_t *end = p + bodylen;
+
+    std::vector<WithMetaItem> items;
+    bool valid = true;
+    WithMetaRecord rec;
+    while (p < end) {
+        if (!nextWithMetaRecord(p, end, rec)) {
+            valid = false;
+            break;
+        }
+        bool tooBig = rec.vallen > maxItemSize;
+        Item *itm = new Item(rec.key, rec.keylen, rec.flags, rec.expiration,
+                             rec.value, tooBig ? 0 : rec.vallen, rec.cas, -1,
+                             vbucket, rec.seqno);
+        WithMetaItem wm(itm, rec.isDelete,
+                        (rec.options & SKIP_CONFLICT_RESOLUTION_FLAG) != 0);
+        if (tooBig) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Item value size %ld for withMetaBatch is bigger "
+                "than the max size %ld allowed!!!\n", rec.vallen, maxItemSize);
+            wm.status = ENGINE_E2BIG;
+        } else if (!rec.isDelete) {
+            maybeCompress(itm);
+        }
+        items.push_back(wm);
+    }
+
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    if (valid) {
+        ret = epstore->withMetaBatch(vbucket, items, cookie);
+    }
+
+    std::vector<uint8_t> bitmaps;
+    if (valid && ret == ENGINE_SUCCESS) {
+        size_t nbytes = (items.size() + 7) / 8;
+        bitmaps.resize(nbytes * 2);
+        bool nomem = false;
+        for (size_t i = 0; i < items.size(); ++i) {
+            switch (items[i].status) {
+            case ENGINE_SUCCESS:
+                setBatchBit(bitmaps, 0, i);
+                if (items[i].isDelete) {
+                    stats.numOpsDelMeta++;
+                } else {
+                    stats.numOpsSetMeta++;
+                }
+                break;
+            case ENGINE_ENOMEM:
+                nomem = true;
+                // FALLTHROUGH
+            case ENGINE_EWOULDBLOCK:
+            case ENGINE_TMPFAIL:
+                setBatchBit(bitmaps, nbytes, i);
+                break;
+            default:
+                break;
+            }
+        }
+        if (nomem) {
+            memoryCondition();
+        }
+    }
+
+    std::vector<WithMetaItem>::iterator it;
+    for (it = items.begin(); it != items.end(); ++it) {
+        delete it->item;
+    }
+
+    if (!valid) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    } else if (ret == ENGINE_EWOULDBLOCK) {
+        return ret;
+    } else if (ret != ENGINE_SUCCESS) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            engine_error_2_protocol_error(ret), 0, cookie);
+    }
+
+    return sendResponse(response, NULL, 0, NULL, 0,
+                        bitmaps.empty() ? NULL : &bitmaps[0], bitmaps.size(),
+                        PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::getMetaBatch(const void* cookie,
+                                                           protocol_binary_request_header *request,
+                                                           ADD_RESPONSE response) {
+    uint16_t nkey = ntohs(request->request.keylen);
+    uint8_t extlen = request->request.extlen;
+    uint32_t bodylen = ntohl(request->request.bodylen);
+    if (nkey != 0 || extlen != 0 || bodylen == 0) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    uint16_t vbucket = ntohs(request->request.vbucket);
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(request) +
+                       sizeof(request->bytes);
+    const uint8_t *end = p + bodylen;
+
+    std::vector<MultiGetMetaItem> items;
+    WithMetaRecord rec;
+    while (p < end) {
+        if (!nextWithMetaRecord(p, end, rec)) {
+            return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                                PROTOCOL_BINARY_RAW_BYTES,
+                                PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+        }
+        ItemMetaData meta;
+        meta.cas = rec.cas;
+        meta.seqno = rec.seqno;
+        meta.flags = rec.flags;
+        meta.exptime = rec.expiration;
+        items.push_back(MultiGetMetaItem(std::string((const char*)rec.key,
+                                                     rec.keylen),
+                                         meta, rec.isDelete));
+    }
+
+    ENGINE_ERROR_CODE ret = epstore->getMetaMulti(vbucket, items);
+    if (ret != ENGINE_SUCCESS) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            engine_error_2_protocol_error(ret), 0, cookie);
+    }
+
+    size_t nbytes = (items.size() + 7) / 8;
+    std::vector<uint8_t> bitmaps(nbytes * 2);
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (items[i].status == ENGINE_SUCCESS) {
+            setBatchBit(bitmaps, 0, i);
+        } else if (items[i].status == ENGINE_EWOULDBLOCK ||
+                   items[i].status == ENGINE_ENOMEM) {
+            setBatchBit(bitmaps, nbytes, i);
+        }
+    }
+
+    return sendResponse(response, NULL, 0, NULL, 0,
+                        &bitmaps[0], bitmaps.size(),
+                        PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::getBatch(const void* cookie,
+                                                       protocol_binary_request_header *request,
+                                                       ADD_RESPONSE response) {
+    uint16_t nkey = ntohs(request->request.keylen);
+    uint8_t extlen = request->request.extlen;
+    uint32_t bodylen = ntohl(request->request.bodylen);
+    if (nkey != 0 || extlen != 0 || bodylen == 0) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(request) +
+                       sizeof(request->bytes);
+    const uint8_t *end = p + bodylen;
+    std::vector<MultiGetItem> items;
+    while (p < end) {
+        uint16_t vbucket;
+        uint16_t keylen;
+        if (end - p < 4) {
+            return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                                PROTOCOL_BINARY_RAW_BYTES,
+                                PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+        }
+        memcpy(&vbucket, p, sizeof(vbucket));
+        memcpy(&keylen, p + 2, sizeof(keylen));
+        vbucket = ntohs(vbucket);
+        keylen = ntohs(keylen);
+        p += 4;
+        if (keylen == 0 || end - p < keylen) {
+            return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                                PROTOCOL_BINARY_RAW_BYTES,
+                                PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+        }
+        items.push_back(MultiGetItem(std::string((const char*)p, keylen),
+                                     vbucket));
+        p += keylen;
+    }
+
+    // Nobody waits on the fetches this starts; the keys whose values
+    // are being read are asked for again.
+    getMulti(NULL, items);
+
+    std::string body;
+    std::vector<MultiGetItem>::iterator it;
+    for (it = items.begin(); it != items.end(); ++it) {
+        ENGINE_ERROR_CODE ret = it->value.getStatus();
+        Item *itm = it->value.getValue();
+        uint16_t status;
+        if (ret == ENGINE_EWOULDBLOCK) {
+            status = PROTOCOL_BINARY_RESPONSE_ETMPFAIL;
+        } else {
+            status = engine_error_2_protocol_error(ret);
+        }
+        uint32_t flags = 0;
+        uint64_t cas = 0;
+        uint32_t nvalue = 0;
+        if (ret == ENGINE_SUCCESS) {
+            flags = itm->getFlags();
+            cas = itm->getCas();
+            nvalue = itm->getNBytes();
+        }
+        status = htons(status);
+        cas = htonll(cas);
+        uint32_t vallen = htonl(nvalue);
+        body.append(reinterpret_cast<const char*>(&status), sizeof(status));
+        body.append(reinterpret_cast<const char*>(&flags), sizeof(flags));
+        body.append(reinterpret_cast<const char*>(&cas), sizeof(cas));
+        body.append(reinterpret_cast<const char*>(&vallen), sizeof(vallen));
+        if (nvalue > 0) {
+            body.append(itm->getData(), nvalue);
+        }
+        delete itm;
+    }
+
+    return sendResponse(response, NULL, 0, NULL, 0,
+                        body.data(), body.length(),
+                        PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::subdoc(const void* cookie,
+                                                     protocol_binary_request_header *request,
+                                                     ADD_RESPONSE response) {
+    uint16_t nkey = ntohs(request->request.keylen);
+    uint8_t extlen = request->request.extlen;
+    uint32_t bodylen = ntohl(request->request.bodylen);
+    const uint8_t *ext = reinterpret_cast<const uint8_t*>(request) +
+                         sizeof(request->bytes);
+    uint16_t npath = 0;
+    if (extlen == 8) {
+        memcpy(&npath, ext + 2, sizeof(npath));
+        npath = ntohs(npath);
+    }
+    if (extlen != 8 || nkey == 0 ||
+        static_cast<uint64_t>(extlen) + nkey + npath > bodylen) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    if (isDegradedMode()) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_ETMPFAIL,
+                            0, cookie);
+    }
+
+    uint32_t offset;
+    memcpy(&offset, ext + 4, sizeof(offset));
+    offset = ntohl(offset);
+    const char *key_ptr = reinterpret_cast<const char*>(ext + extlen);
+    std::string key(key_ptr, nkey);
+    std::string path(key_ptr + nkey, npath);
+    std::string value(key_ptr + nkey + npath,
+                      bodylen - extlen - nkey - npath);
+    SubdocOp op(ext[0], path, value, offset);
+
+    uint16_t vbucket = ntohs(request->request.vbucket);
+    uint64_t cas = ntohll(request->request.cas);
+    uint64_t newCas = 0;
+    subdoc_status_t status = SUBDOC_SUCCESS;
+    ENGINE_ERROR_CODE ret = epstore->subdocMutate(key, vbucket, cas, op,
+                                                  status, &newCas, cookie);
+    if (ret == ENGINE_EWOULDBLOCK) {
+        return ENGINE_EWOULDBLOCK;
+    } else if (ret == ENGINE_ENOMEM) {
+        ret = memoryCondition();
+    }
+
+    if (ret == ENGINE_EINVAL && status != SUBDOC_SUCCESS) {
+        const char *msg = SubdocOp::statusMessage(status);
+        return sendResponse(response, NULL, 0, NULL, 0, msg, strlen(msg),
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    } else if (ret != ENGINE_SUCCESS) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            engine_error_2_protocol_error(ret), 0, cookie);
+    }
+
+    std::string body;
+    if (op.getOp() == SUBDOC_COUNTER) {
+        std::stringstream ss;
+        ss << op.getCounter();
+        body = ss.str();
+    }
+    return sendResponse(response, NULL, 0, NULL, 0,
+                        body.empty() ? NULL : body.data(), body.length(),
+                        PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_SUCCESS, newCas, cookie);
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::rangeScan(const void* cookie,
+                                                        protocol_binary_request_header *request,
+                                                        ADD_RESPONSE response) {
+    RangeScan *scan = static_cast<RangeScan*>(getEngineSpecific(cookie));
+    if (scan != NULL) {
+        // A reader has filled the scan in.
+        storeEngineSpecific(cookie, NULL);
+        if (scan->status != ENGINE_SUCCESS) {
+            ENGINE_ERROR_CODE ret = scan->status;
+            delete scan;
+            return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                                PROTOCOL_BINARY_RAW_BYTES,
+                                engine_error_2_protocol_error(ret), 0, cookie);
+        }
+
+        std::string body;
+        std::vector<Item *>::iterator it;
+        for (it = scan->items.begin(); it != scan->items.end(); ++it) {
+            Item *itm = *it;
+            uint32_t nvalue = 0;
+            if (!scan->keysOnly && decompressForClient(itm)) {
+                nvalue = itm->getNBytes();
+            }
+            const std::string &key = itm->getKey();
+            uint16_t keylen = htons(static_cast<uint16_t>(key.length()));
+            uint32_t flags = itm->getFlags();
+            uint32_t exptime = htonl(static_cast<uint32_t>(itm->getExptime()));
+            uint64_t cas = htonll(itm->getCas());
+            uint32_t vallen = htonl(nvalue);
+            body.append(reinterpret_cast<const char*>(&keylen), sizeof(keylen));
+            body.append(reinterpret_cast<const char*>(&flags), sizeof(flags));
+            body.append(reinterpret_cast<const char*>(&exptime),
+                        sizeof(exptime));
+            body.append(reinterpret_cast<const char*>(&cas), sizeof(cas));
+            body.append(reinterpret_cast<const char*>(&vallen), sizeof(vallen));
+            body.append(key);
+            if (nvalue > 0) {
+                body.append(itm->getData(), nvalue);
+            }
+        }
+
+        ENGINE_ERROR_CODE ret = sendResponse(response,
+                                             scan->next.empty() ? NULL :
+                                             scan->next.data(),
+                                             scan->next.length(), NULL, 0,
+                                             body.empty() ? NULL : body.data(),
+                                             body.length(),
+                                             PROTOCOL_BINARY_RAW_BYTES,
+                                             PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                                             0, cookie);
+        delete scan;
+        return ret;
+    }
+
+    uint16_t nkey = ntohs(request->request.keylen);
+    uint8_t extlen = request->request.extlen;
+    uint32_t bodylen = ntohl(request->request.bodylen);
+    if (extlen != 8 || static_cast<uint64_t>(extlen) + nkey > bodylen) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    if (isDegradedMode()) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_ETMPFAIL,
+                            0, cookie);
+    }
+
+    const uint8_t *ext = reinterpret_cast<const uint8_t*>(request) +
+                         sizeof(request->bytes);
+    uint32_t limit;
+    uint32_t flags;
+    memcpy(&limit, ext, sizeof(limit));
+    memcpy(&flags, ext + 4, sizeof(flags));
+    limit = ntohl(limit);
+    flags = ntohl(flags);
+    size_t maxKeys = configuration.getRangeScanMaxKeys();
+    if (limit == 0 || limit > maxKeys) {
+        limit = maxKeys;
+    }
+
+    const char *key_ptr = reinterpret_cast<const char*>(ext + extlen);
+    std::string start(key_ptr, nkey);
+    std::string end(key_ptr + nkey, bodylen - extlen - nkey);
+    uint16_t vbucket = ntohs(request->request.vbucket);
+    scan = new RangeScan(vbucket, start, end, limit,
+                         (flags & RANGE_SCAN_KEYS_ONLY) != 0);
+
+    // The reader may finish before the schedule returns, so the scan
+    // has to be where the connection finds it first.
+    storeEngineSpecific(cookie, scan);
+    ENGINE_ERROR_CODE ret = epstore->startRangeScan(scan, cookie);
+    if (ret == ENGINE_EWOULDBLOCK) {
+        return ret;
+    }
+    storeEngineSpecific(cookie, NULL);
+    delete scan;
+    return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                        PROTOCOL_BINARY_RAW_BYTES,
+                        engine_error_2_protocol_error(ret), 0, cookie);
+}
+
 ENGINE_ERROR_CODE EventuallyPersistentEngine::deleteWithMeta(const void* cookie,
                                                              protocol_binary_request_delete_with_meta *request,
                                                              ADD_RESPONSE response) {
@@ -4011,7 +6173,7 @@ EventuallyPersistentEngine::handleTrafficControlCmd(const void *cookie,
 
     switch (request->request.opcode) {
     case CMD_ENABLE_TRAFFIC:
-        if (stillWarmingUp()) {
+        if (stillWarmingUp() && !stats.warmupTraffic.get()) {
             // engine is still warming up, do not turn on data traffic yet
             msg << "Persistent engine is still warming up!";
             status = PROTOCOL_BINARY_RESPONSE_ETMPFAIL;
@@ -4053,7 +6215,10 @@ EventuallyPersistentEngine::doTapVbTakeoverStats(const void *cookie,
     std::string tapName("eq_tapq:");
     tapName.append(key);
     size_t vb_items = vb->ht.getNumItems();
-    size_t del_items = epstore->getRWUnderlying(vbid)->getNumPersistedDeletes(vbid);
+    size_t del_items = 0;
+    if (!epstore->isEphemeral()) {
+        del_items = epstore->getRWUnderlying(vbid)->getNumPersistedDeletes(vbid);
+    }
 
     add_casted_stat("name", tapName, add_stat, cookie);
 
@@ -4127,6 +6292,7 @@ EventuallyPersistentEngine::returnMeta(const void* cookie,
         }
 
         memcpy((char*)itm->getData(), dta, vallen);
+        maybeCompress(itm);
         if (mutate_type == SET_RET_META) {
             ret = epstore->set(*itm, cookie);
         } else {
@@ -29,15 +29,23 @@
 #include <map>
 #include <sstream>
 #include <string>
+#include <vector>
 
+#include "access_trace.h"
+#include "admission_control.h"
 #include "configuration.h"
+#include "delta_stats.h"
 #include "dispatcher.h"
 #include "ep.h"
 #include "ep-engine/command_ids.h"
+#include "hotkeys.h"
 #include "flusher.h"
 #include "item_pager.h"
 #include "kvstore.h"
 #include "locks.h"
+#include "optrace.h"
+#include "tapapplier.h"
+#include "vbucket_owners.h"
 #include "tapconnection.h"
 #include "tapconnmap.h"
 #include "tapthrottle.h"
@@ -67,6 +75,9 @@ extern "C" {
 typedef void (*NOTIFY_IO_COMPLETE_T)(const void *cookie,
                                      ENGINE_ERROR_CODE status);
 
+//! A cookie to notify, with the status of its completed io
+typedef std::pair<const void*, ENGINE_ERROR_CODE> IOCompletion;
+
 
 // Forward decl
 class EventuallyPersistentEngine;
@@ -78,7 +89,9 @@ class TapConnMap;
 class VBucketCountVisitor : public VBucketVisitor {
 public:
     VBucketCountVisitor(vbucket_state_t state) : desired_state(state), numItems(0),
-                                                 numTempItems(0),nonResident(0),
+                                                 numTempItems(0),
+                                                 tempItemMemory(0),
+                                                 nonResident(0),
                                                  numVbucket(0), htMemory(0),
                                                  htItemMemory(0), htCacheSize(0),
                                                  numEjects(0), numExpiredItems(0),
@@ -104,6 +117,8 @@ public:
 
     size_t getNumTempItems() { return numTempItems; }
 
+    size_t getTempItemMemory() { return tempItemMemory; }
+
     size_t getNonResident() { return nonResident; }
 
     size_t getVBucketNumber() { return numVbucket; }
@@ -142,6 +157,7 @@ private:
 
     size_t numItems;
     size_t numTempItems;
+    size_t tempItemMemory;
     size_t nonResident;
     size_t numVbucket;
     size_t htMemory;
@@ -165,6 +181,22 @@ private:
     size_t chkPersistRemaining;
 };
 
+/**
+ * The counts of the vbuckets of each state, and when they were taken.
+ */
+struct VBucketCounts {
+    VBucketCounts() : active(vbucket_state_active),
+                      replica(vbucket_state_replica),
+                      pending(vbucket_state_pending),
+                      dead(vbucket_state_dead), taken(0) { }
+
+    VBucketCountVisitor active;
+    VBucketCountVisitor replica;
+    VBucketCountVisitor pending;
+    VBucketCountVisitor dead;
+    hrtime_t taken;
+};
+
 /**
  * memcached engine interface to the EventuallyPersistentStore.
  */
@@ -220,6 +252,7 @@ public:
                                                     false, // not use metadata
                                                     false,
                                                     &itemMeta);
+        accessTrace.record(ACCESS_TRACE_DEL, key, vbucket, 0);
 
         if (ret == ENGINE_KEY_ENOENT || ret == ENGINE_NOT_MY_VBUCKET) {
             if (isDegradedMode()) {
@@ -244,11 +277,17 @@ public:
     {
         BlockTimer timer(&stats.getCmdHisto);
         std::string k(static_cast<const char*>(key), nkey);
+        OpTraceScope trace(opTracer, "get", k, vbucket, cookie);
 
         GetValue gv(epstore->get(k, vbucket, cookie, serverApi->core));
         ENGINE_ERROR_CODE ret = gv.getStatus();
+        trace.setStatus(ret);
 
         if (ret == ENGINE_SUCCESS) {
+            if (!decompressForClient(gv.getValue())) {
+                delete gv.getValue();
+                return ENGINE_FAILED;
+            }
             *itm = gv.getValue();
         } else if (ret == ENGINE_KEY_ENOENT || ret == ENGINE_NOT_MY_VBUCKET) {
             if (isDegradedMode()) {
@@ -256,9 +295,47 @@ public:
             }
         }
 
+        if (hotKeys.shouldSample()) {
+            size_t bytes = 0;
+            if (ret == ENGINE_SUCCESS) {
+                bytes = gv.getValue()->getNBytes();
+            }
+            hotKeys.record(k, vbucket, bytes, false);
+        }
+
+        // A get that waits for a fetch is recorded when it comes back.
+        if (accessTrace.isEnabled() && ret != ENGINE_EWOULDBLOCK) {
+            size_t bytes = 0;
+            if (ret == ENGINE_SUCCESS) {
+                bytes = gv.getValue()->getNBytes();
+            }
+            accessTrace.record(ACCESS_TRACE_GET, k, vbucket, bytes);
+        }
+
         return ret;
     }
 
+    /**
+     * Get several keys at once (see EventuallyPersistentStore::getMulti()).
+     */
+    void getMulti(const void* cookie, std::vector<MultiGetItem> &items) {
+        epstore->getMulti(items, cookie, serverApi->core);
+        std::vector<MultiGetItem>::iterator it;
+        for (it = items.begin(); it != items.end(); ++it) {
+            ENGINE_ERROR_CODE ret = it->value.getStatus();
+            if (ret == ENGINE_SUCCESS &&
+                !decompressForClient(it->value.getValue())) {
+                delete it->value.getValue();
+                it->value.setValue(NULL);
+                it->value.setStatus(ENGINE_FAILED);
+            } else if (isDegradedMode() &&
+                       (ret == ENGINE_KEY_ENOENT ||
+                        ret == ENGINE_NOT_MY_VBUCKET)) {
+                it->value.setStatus(ENGINE_TMPFAIL);
+            }
+        }
+    }
+
     const char* getName() {
         return name.c_str();
     }
@@ -270,6 +347,9 @@ public:
 
     void resetStats() {
         stats.reset();
+        hotKeys.reset();
+        admission.reset();
+        opTracer.reset();
         if (epstore) {
             epstore->resetUnderlyingStats();
         }
@@ -411,6 +491,21 @@ public:
     ENGINE_ERROR_CODE deleteWithMeta(const void* cookie,
                                      protocol_binary_request_delete_with_meta *request,
                                      ADD_RESPONSE response);
+    ENGINE_ERROR_CODE withMetaBatch(const void* cookie,
+                                    protocol_binary_request_header *request,
+                                    ADD_RESPONSE response);
+    ENGINE_ERROR_CODE getMetaBatch(const void* cookie,
+                                   protocol_binary_request_header *request,
+                                   ADD_RESPONSE response);
+    ENGINE_ERROR_CODE getBatch(const void* cookie,
+                               protocol_binary_request_header *request,
+                               ADD_RESPONSE response);
+    ENGINE_ERROR_CODE subdoc(const void* cookie,
+                             protocol_binary_request_header *request,
+                             ADD_RESPONSE response);
+    ENGINE_ERROR_CODE rangeScan(const void* cookie,
+                                protocol_binary_request_header *request,
+                                ADD_RESPONSE response);
 
     ENGINE_ERROR_CODE returnMeta(const void* cookie,
                                  protocol_binary_request_return_meta *request,
@@ -433,6 +528,19 @@ public:
         }
     }
 
+    /**
+     * Notify a connection waiting in CMD_KEY_DURABILITY.  The command isn't
+     * called again for an error, so its engine specific is cleared here.
+     */
+    void notifyKeyDurability(const void *cookie, ENGINE_ERROR_CODE status) {
+        if (status != ENGINE_SUCCESS) {
+            EventuallyPersistentEngine *epe = ObjectRegistry::onSwitchThread(NULL, true);
+            serverApi->cookie->store_engine_specific(cookie, NULL);
+            ObjectRegistry::onSwitchThread(epe);
+        }
+        notifyIOComplete(cookie, status);
+    }
+
     ENGINE_ERROR_CODE reserveCookie(const void *cookie);
     ENGINE_ERROR_CODE releaseCookie(const void *cookie);
 
@@ -442,6 +550,16 @@ public:
     void registerEngineCallback(ENGINE_EVENT_TYPE type,
                                 EVENT_CALLBACK cb, const void *cb_data);
 
+    /**
+     * Notify the cookies of a batch of completed ios at once, such as
+     * the bg fetches of a batch.  With bg_fetch_notify_offload on they
+     * are handed to the notification thread instead, so the thread that
+     * completed them gets back to its own work right away.
+     *
+     * @param completions the cookies to notify; emptied
+     */
+    void notifyIOComplete(std::vector<IOCompletion> &completions);
+
     template <typename T>
     void notifyIOComplete(T cookies, ENGINE_ERROR_CODE status) {
         EventuallyPersistentEngine *epe = ObjectRegistry::onSwitchThread(NULL, true);
@@ -453,6 +571,10 @@ public:
 
     void handleDisconnect(const void *cookie) {
         tapConnMap->disconnect(cookie, static_cast<int>(configuration.getTapKeepalive()));
+        fetchObserveWait(cookie);
+        if (vbOwners) {
+            vbOwners->dropResult(cookie);
+        }
     }
 
     protocol_binary_response_status stopFlusher(const char **msg, size_t *msg_size) {
@@ -530,13 +652,33 @@ public:
         return epstore->setVBucketState(vbid, to);
     }
 
+    ENGINE_ERROR_CODE setVBucketStates(
+              const std::vector<std::pair<uint16_t, vbucket_state_t> > &states) {
+        return epstore->setVBucketStates(states);
+    }
+
     ~EventuallyPersistentEngine() {
+        if (tapApplier) {
+            tapApplier->stop();
+        }
         delete epstore;
+        delete tapApplier;
+        delete vbOwners;
+        for (size_t i = 0; i < timingWindows.size(); ++i) {
+            delete timingWindows[i];
+        }
         delete workload;
         delete tapConnMap;
         delete tapConfig;
         delete checkpointConfig;
         delete tapThrottle;
+        // Values dropped under this engine may still be parked on
+        // other threads; free them while our stats are still around.
+        EpochManager::flush(this);
+        DeferredBlobRefs::flush(this);
+        ObjectRegistry::flushStats(this);
+        SlabAllocator::setCurrent(NULL);
+        SlabAllocator::destroy(slabs);
     }
 
     engine_info *getInfo() {
@@ -549,6 +691,30 @@ public:
 
     EventuallyPersistentStore* getEpStore() { return epstore; }
 
+    //! The arena this engine's items are allocated from
+    SlabAllocator *getSlabAllocator() { return slabs; }
+
+    /**
+     * Take a snapshot of each of the timing histograms, ending an interval
+     * of the windows in the timings_summary stats.
+     */
+    void rotateTimingWindows() {
+        for (size_t i = 0; i < timingWindows.size(); ++i) {
+            timingWindows[i]->rotate();
+        }
+    }
+
+    HotKeys &getHotKeys() { return hotKeys; }
+
+    AdmissionControl &getAdmissionControl() { return admission; }
+
+    //! NULL unless vbucket_owner_tasks is on
+    VBucketOwners *getVBucketOwners() { return vbOwners; }
+
+    OpTracer &getOpTracer() { return opTracer; }
+
+    AccessTrace &getAccessTrace() { return accessTrace; }
+
     TapConnMap &getTapConnMap() { return *tapConnMap; }
 
     TapConfig &getTapConfig() { return *tapConfig; }
@@ -573,6 +739,10 @@ public:
                                            protocol_binary_request_header *request,
                                            ADD_RESPONSE response);
 
+    ENGINE_ERROR_CODE keyDurability(const void* cookie,
+                                    protocol_binary_request_header *request,
+                                    ADD_RESPONSE response);
+
     ENGINE_ERROR_CODE resetReplicationChain(const void* cookie,
                                             protocol_binary_request_header *request,
                                             ADD_RESPONSE response);
@@ -593,21 +763,78 @@ public:
         return getlMaxTimeout;
     }
 
+    size_t getMaxItemSize() const {
+        return maxItemSize;
+    }
+
     bool isDegradedMode() const {
-        return !stats.warmupComplete.get() || !trafficEnabled.get();
+        return (!stats.warmupComplete.get() && !stats.warmupTraffic.get()) ||
+            !trafficEnabled.get();
     }
 
     bool stillWarmingUp() const {
         return !stats.warmupComplete.get();
     }
 
+    /**
+     * Uncompress an item's value on its way out to a client.
+     *
+     * @return false (having logged why) if the value is corrupt
+     */
+    bool decompressForClient(Item *itm);
+
     WorkLoadPolicy &getWorkLoadPolicy(void) {
         return *workload;
     }
 
+    /**
+     * Store a mutation received by a TAP consumer.
+     *
+     * @param cookie the consumer's cookie, or NULL off its worker thread
+     * @param meta true if the item's cas and seqno came from the source
+     */
+    ENGINE_ERROR_CODE applyTapMutation(const void *cookie, TapConsumer *tc,
+                                       const Item &itm, bool meta, uint8_t nru);
+
+    /**
+     * Apply a deletion received by a TAP consumer.  Deleting a key we
+     * don't have is not an error.
+     */
+    ENGINE_ERROR_CODE applyTapDeletion(const void *cookie, TapConsumer *tc,
+                                       const std::string &key, uint16_t vbucket,
+                                       ItemMetaData &itemMeta, bool meta);
+
+    /**
+     * Apply a run of mutations and deletions a TAP consumer received for a
+     * vbucket, with their source's meta data, outside of a backfill.  The
+     * run is applied in one pass over the hash table, and queued into the
+     * open checkpoint at once.  It mustn't span a checkpoint message.
+     *
+     * @param items the mutations, each given the status applyTapMutation()
+     *              or applyTapDeletion() would have given it
+     * @return ENGINE_SUCCESS, or the status of the whole run if the vbucket
+     *         can't take it
+     */
+    ENGINE_ERROR_CODE applyTapBatch(uint16_t vbucket,
+                                    std::vector<WithMetaItem> &items);
+
 protected:
     friend class EpEngineValueChangeListener;
 
+    /**
+     * Compress an item's value before it's stored, if this bucket
+     * compresses values.
+     */
+    void maybeCompress(Item *itm);
+
+    //! Note that a replica vbucket applied its active's mutation of a cas.
+    void noteReplicated(uint16_t vbucket, uint64_t cas);
+
+    //! The untraced body of store()
+    ENGINE_ERROR_CODE doStore(const void *cookie, Item *it, uint64_t *cas,
+                              ENGINE_STORE_OPERATION operation,
+                              uint16_t vbucket);
+
     void setMaxItemSize(size_t value) {
         maxItemSize = value;
     }
@@ -630,6 +857,34 @@ private:
                                uint32_t *seqno, uint16_t *vbucket,
                                TapProducer *c, bool &retry);
 
+    //! Notify the given cookies from this thread, and empty the batch.
+    void notifyCompletions(std::vector<IOCompletion> &completions);
+
+    /**
+     * Pack the given mutation or deletion and the ones that follow it for
+     * the same vbucket into the connection's mutation batch.
+     *
+     * @return true if a batch of more than one item was built, in which
+     *         case the given item was deleted
+     */
+    bool fillMutationBatch(const void *cookie, TapProducer *c, Item *itm,
+                           tap_event_t event, uint16_t vbucket, uint8_t nru);
+
+    /**
+     * Apply the records of a TAP_OPAQUE_MUTATION_BATCH message.
+     */
+    ENGINE_ERROR_CODE applyMutationBatch(const void *cookie, TapConnection *c,
+                                         const void *es, uint16_t nes,
+                                         uint16_t vbucket);
+
+    /**
+     * Hold back the ack an event asks for until the events the consumer
+     * handed to the TapApplier before it were applied.
+     */
+    ENGINE_ERROR_CODE ackAfterApplies(const void *cookie, TapConsumer *tc,
+                                      uint16_t tap_flags, uint32_t tap_seqno,
+                                      ENGINE_ERROR_CODE ret);
+
     ENGINE_ERROR_CODE processTapAck(const void *cookie,
                                     uint32_t seqno,
                                     uint16_t status,
@@ -646,11 +901,11 @@ private:
         bool haveEvidenceWeCanFreeMemory(stats.getMaxDataSize() > stats.memOverhead);
         if (haveEvidenceWeCanFreeMemory) {
             // Look for more evidence by seeing if we have resident items.
-            VBucketCountVisitor countVisitor(vbucket_state_active);
-            epstore->visit(countVisitor);
+            VBucketCounts counts;
+            getVBucketCounts(counts);
 
-            haveEvidenceWeCanFreeMemory = countVisitor.getNonResident() <
-                                          countVisitor.getNumItems();
+            haveEvidenceWeCanFreeMemory = counts.active.getNonResident() <
+                                          counts.active.getNumItems();
         }
         if (haveEvidenceWeCanFreeMemory) {
             ++stats.tmp_oom_errors;
@@ -705,6 +960,12 @@ private:
         return ret;
     }
 
+    /**
+     * Get the counts of the vbuckets, walking them only if the last counts
+     * are older than agg_stats_max_age.
+     */
+    void getVBucketCounts(VBucketCounts &counts);
+
     ENGINE_ERROR_CODE doEngineStats(const void *cookie, ADD_STAT add_stat);
     ENGINE_ERROR_CODE doKlogStats(const void *cookie, ADD_STAT add_stat);
     ENGINE_ERROR_CODE doMemoryStats(const void *cookie, ADD_STAT add_stat);
@@ -718,6 +979,8 @@ private:
     ENGINE_ERROR_CODE doTapAggStats(const void *cookie, ADD_STAT add_stat,
                                     const char *sep, size_t nsep);
     ENGINE_ERROR_CODE doTimingStats(const void *cookie, ADD_STAT add_stat);
+    ENGINE_ERROR_CODE doTimingSummaryStats(const void *cookie,
+                                           ADD_STAT add_stat);
     ENGINE_ERROR_CODE doDispatcherStats(const void *cookie, ADD_STAT add_stat);
     ENGINE_ERROR_CODE doKeyStats(const void *cookie, ADD_STAT add_stat,
                                  uint16_t vbid, std::string &key, bool validate=false);
@@ -726,6 +989,17 @@ private:
                                            std::string& key,
                                            uint16_t vbid);
     ENGINE_ERROR_CODE doWorkloadStats(const void *cookie, ADD_STAT add_stat);
+    /**
+     * The stats of a group that changed since the cursor the client got
+     * with its last poll of the group, and the cursor of this one.
+     *
+     * @param args the cursor, or none for the whole group, then the group
+     */
+    ENGINE_ERROR_CODE doDeltaStats(const void *cookie, ADD_STAT add_stat,
+                                   const char *args, size_t nargs);
+    ENGINE_ERROR_CODE doHotKeysStats(const void *cookie, ADD_STAT add_stat);
+    ENGINE_ERROR_CODE doLockStats(const void *cookie, ADD_STAT add_stat);
+    ENGINE_ERROR_CODE doOpTraceStats(const void *cookie, ADD_STAT add_stat);
 
     void addLookupResult(const void *cookie, Item *result) {
         LockHolder lh(lookupMutex);
@@ -758,6 +1032,24 @@ private:
         }
     }
 
+    void addObserveWait(const void *cookie, hrtime_t start) {
+        LockHolder lh(observeWaitsMutex);
+        observeWaits[cookie] = start;
+    }
+
+    // Return *and erase* when a connection started waiting in observe for
+    // its keys to be persisted, 0 if it isn't waiting.
+    hrtime_t fetchObserveWait(const void *cookie) {
+        LockHolder lh(observeWaitsMutex);
+        std::map<const void*, hrtime_t>::iterator it = observeWaits.find(cookie);
+        if (it == observeWaits.end()) {
+            return 0;
+        }
+        hrtime_t start = it->second;
+        observeWaits.erase(it);
+        return start;
+    }
+
     // Get the current tap connection for this cookie.
     // If this method returns NULL, you should return TAP_DISCONNECT
     TapProducer* getTapProducer(const void *cookie);
@@ -766,9 +1058,18 @@ private:
     EventuallyPersistentStore *epstore;
     WorkLoadPolicy *workload;
     TapThrottle *tapThrottle;
+    TapApplier *tapApplier;
+    VBucketOwners *vbOwners;
+    SlabAllocator *slabs;
     std::map<const void*, Item*> lookups;
     Mutex lookupMutex;
+    std::map<const void*, hrtime_t> observeWaits;
+    Mutex observeWaitsMutex;
     pthread_t notifyThreadId;
+    //! The completions handed to the notification thread
+    std::vector<IOCompletion> pendingCompletions;
+    Mutex pendingCompletionsMutex;
+    bool offloadNotify;
     bool startedEngineThreads;
     GET_SERVER_API getServerApiFunc;
     union {
@@ -785,10 +1086,26 @@ private:
     size_t getlDefaultTimeout;
     size_t getlMaxTimeout;
     EPStats stats;
+    //! The last counts of the vbuckets, reused by the stats for a while
+    VBucketCounts vbCounts;
+    Mutex vbCountsMutex;
+    //! The stats last sent to the clients polling for their changes
+    DeltaStats deltaStats;
+    //! The hottest keys and vbuckets of a sample of the gets and sets
+    HotKeys hotKeys;
+    //! The traces of the slowest recent ops
+    OpTracer opTracer;
+    //! The trace of the clients' ops being recorded, if any
+    AccessTrace accessTrace;
+    //! The rate limits of the clients' ops
+    AdmissionControl admission;
+    //! The windows of recent samples of the EPStats timing histograms
+    std::vector<HdrHistogramWindows<hrtime_t>*> timingWindows;
     Configuration configuration;
     Atomic<bool> trafficEnabled;
 
     bool flushAllEnabled;
+    bool compressValues;
     // a unique system generated token initialized at each time
     // ep_engine starts up.
     time_t startupTime;
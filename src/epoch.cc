@@ -0,0 +1,271 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "epoch.h"
+#include "locks.h"
+#include "objectregistry.h"
+
+// Each thread tries to free its retired objects this often.
+static const size_t EPOCH_RECLAIM_INTERVAL = 64;
+
+bool EpochManager::enabled = false;
+
+/**
+ * Something retired, and the epoch and engine it was retired under.
+ */
+struct RetiredObject {
+    EpochFreeFunc fn;
+    void *p;
+    EventuallyPersistentEngine *engine;
+    size_t epoch;
+};
+
+/**
+ * A thread's pin (0 when it isn't pinned), how many times it's pinned,
+ * and the objects it retired.
+ */
+struct EpochParticipant {
+    EpochParticipant() : active(0), depth(0), sinceReclaim(0) { }
+
+    volatile size_t active;
+    size_t depth;
+    SpinLock lock;
+    std::vector<RetiredObject> retired;
+    size_t sinceReclaim;
+};
+
+extern "C" {
+    static void releaseParticipant(void *arg);
+}
+
+static Atomic<size_t> globalEpoch(1);
+static ThreadLocal<EpochParticipant*> *participants;
+static Mutex *registryLock;
+static std::vector<EpochParticipant*> *registry;
+//! Objects left behind by threads that have exited, and deferred ones.
+static std::vector<RetiredObject> *orphans;
+
+/**
+ * Link hook for getting the registry set up before anything can be
+ * retired.
+ */
+class EpochInstaller {
+public:
+    EpochInstaller() {
+        if (participants == NULL) {
+            participants = new ThreadLocal<EpochParticipant*>(releaseParticipant);
+            registryLock = new Mutex();
+            registry = new std::vector<EpochParticipant*>();
+            orphans = new std::vector<RetiredObject>();
+        }
+    }
+} epochInstaller;
+
+static EpochParticipant *participant() {
+    EpochParticipant *p = participants->get();
+    if (p == NULL) {
+        p = new EpochParticipant();
+        participants->set(p);
+        LockHolder lh(*registryLock);
+        registry->push_back(p);
+    }
+    return p;
+}
+
+static void freeRetired(const RetiredObject &r) {
+    EventuallyPersistentEngine *old = ObjectRegistry::onSwitchThread(r.engine,
+                                                                     true);
+    r.fn(r.p);
+    ObjectRegistry::onSwitchThread(old);
+}
+
+static void freeAll(const std::vector<RetiredObject> &objs) {
+    std::vector<RetiredObject>::const_iterator it;
+    for (it = objs.begin(); it != objs.end(); ++it) {
+        freeRetired(*it);
+    }
+}
+
+/**
+ * Move the entries of from matching the predicate over to to.
+ */
+template <typename Pred>
+static void extract(std::vector<RetiredObject> &from,
+                    std::vector<RetiredObject> &to, Pred pred) {
+    size_t kept = 0;
+    for (size_t i = 0; i < from.size(); ++i) {
+        if (pred(from[i])) {
+            to.push_back(from[i]);
+        } else {
+            from[kept++] = from[i];
+        }
+    }
+    from.resize(kept);
+}
+
+/**
+ * Matches objects nobody can see once the epoch has reached current.
+ */
+class RetiredBefore {
+public:
+    RetiredBefore(size_t current) : epoch(current) { }
+    bool operator()(const RetiredObject &r) const {
+        return r.epoch + 2 <= epoch;
+    }
+private:
+    size_t epoch;
+};
+
+/**
+ * Matches objects retired under a given engine.
+ */
+class RetiredUnder {
+public:
+    RetiredUnder(EventuallyPersistentEngine *e) : engine(e) { }
+    bool operator()(const RetiredObject &r) const {
+        return r.engine == engine;
+    }
+private:
+    EventuallyPersistentEngine *engine;
+};
+
+static void releaseParticipant(void *arg) {
+    EpochParticipant *p = static_cast<EpochParticipant*>(arg);
+    LockHolder lh(*registryLock);
+    registry->erase(std::remove(registry->begin(), registry->end(), p),
+                    registry->end());
+    orphans->insert(orphans->end(), p->retired.begin(), p->retired.end());
+    delete p;
+}
+
+void EpochManager::enter() {
+    EpochParticipant *p = participant();
+    if (p->depth++ > 0) {
+        return;
+    }
+    assert(p->active == 0);
+    p->active = globalEpoch.get();
+    // The pin has to be visible before we look at anything.
+    ep_sync_synchronize();
+}
+
+void EpochManager::exit() {
+    EpochParticipant *p = participants->get();
+    assert(p && p->active != 0 && p->depth > 0);
+    if (--p->depth > 0) {
+        return;
+    }
+    ep_sync_synchronize();
+    p->active = 0;
+}
+
+void EpochManager::retire(EpochFreeFunc fn, void *ptr) {
+    if (!enabled) {
+        fn(ptr);
+        return;
+    }
+
+    EpochParticipant *p = participant();
+    // Whatever unlinked this has to be visible before we read the epoch.
+    ep_sync_synchronize();
+    RetiredObject r;
+    r.fn = fn;
+    r.p = ptr;
+    r.engine = ObjectRegistry::getCurrentEngine();
+    r.epoch = globalEpoch.get();
+    {
+        SpinLockHolder sl(&p->lock);
+        p->retired.push_back(r);
+    }
+    if (++p->sinceReclaim >= EPOCH_RECLAIM_INTERVAL) {
+        reclaim();
+    }
+}
+
+void EpochManager::defer(EpochFreeFunc fn, void *ptr) {
+    // Whatever unlinked this has to be visible before we read the epoch.
+    ep_sync_synchronize();
+    RetiredObject r;
+    r.fn = fn;
+    r.p = ptr;
+    r.engine = ObjectRegistry::getCurrentEngine();
+    r.epoch = globalEpoch.get();
+    LockHolder lh(*registryLock);
+    orphans->push_back(r);
+}
+
+void EpochManager::reclaim() {
+    EpochParticipant *p = participant();
+    p->sinceReclaim = 0;
+
+    std::vector<RetiredObject> ready;
+    {
+        LockHolder lh(*registryLock);
+        // The epoch can only move on once every pinned thread has
+        // seen the current one.
+        size_t current = globalEpoch.get();
+        bool advance = true;
+        std::vector<EpochParticipant*>::iterator it;
+        for (it = registry->begin(); it != registry->end(); ++it) {
+            size_t a = (*it)->active;
+            if (a != 0 && a != current) {
+                advance = false;
+                break;
+            }
+        }
+        if (advance && globalEpoch.cas(current, current + 1)) {
+            ++current;
+        }
+
+        RetiredBefore pred(current);
+        extract(*orphans, ready, pred);
+        SpinLockHolder sl(&p->lock);
+        extract(p->retired, ready, pred);
+    }
+    freeAll(ready);
+}
+
+void EpochManager::flush(EventuallyPersistentEngine *engine) {
+    std::vector<RetiredObject> ready;
+    {
+        LockHolder lh(*registryLock);
+        RetiredUnder pred(engine);
+        extract(*orphans, ready, pred);
+        std::vector<EpochParticipant*>::iterator it;
+        for (it = registry->begin(); it != registry->end(); ++it) {
+            SpinLockHolder sl(&(*it)->lock);
+            extract((*it)->retired, ready, pred);
+        }
+    }
+    freeAll(ready);
+}
+
+size_t EpochManager::getNumPending() {
+    LockHolder lh(*registryLock);
+    size_t rv = orphans->size();
+    std::vector<EpochParticipant*>::iterator it;
+    for (it = registry->begin(); it != registry->end(); ++it) {
+        SpinLockHolder sl(&(*it)->lock);
+        rv += (*it)->retired.size();
+    }
+    return rv;
+}
@@ -0,0 +1,129 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_EPOCH_H_
+#define SRC_EPOCH_H_ 1
+
+#include "config.h"
+
+#include "atomic.h"
+#include "common.h"
+
+// Forward declaration
+class EventuallyPersistentEngine;
+
+extern "C" {
+    typedef void (*EpochFreeFunc)(void *);
+}
+
+/**
+ * Epoch based reclamation for memory that lock-free readers may be
+ * looking at.
+ *
+ * Readers pin the current epoch for the duration of a lookup (see
+ * EpochGuard).  Writers unlink things as usual, under their locks, and
+ * then retire() them instead of freeing them; a retired object is only
+ * freed once every reader that was pinned when it was retired has gone
+ * away.
+ *
+ * Reclamation is off until enable() is called, and stays on from then
+ * on, so anything a reader can find was either retired or allocated
+ * after the reader could have started looking.  Things every reader
+ * pins the epoch for, whether or not it's enabled, are defer()red.
+ *
+ * A thread may pin the epoch again while it's pinned; it stays pinned
+ * until the outermost exit().
+ */
+class EpochManager {
+public:
+
+    /**
+     * Start retiring instead of freeing.
+     */
+    static void enable() {
+        enabled = true;
+    }
+
+    static bool isEnabled() {
+        return enabled;
+    }
+
+    /**
+     * Pin the current epoch on this thread.
+     */
+    static void enter();
+
+    /**
+     * Unpin this thread.
+     */
+    static void exit();
+
+    /**
+     * Free p with fn once no reader can be looking at it anymore.
+     *
+     * It's freed under the engine that's current now.  If reclamation
+     * isn't enabled it's freed right away.
+     */
+    static void retire(EpochFreeFunc fn, void *p);
+
+    /**
+     * Like retire(), but never freed right away, for things readers
+     * always pin the epoch to look at.  Any thread's reclaim() may free
+     * it.
+     */
+    static void defer(EpochFreeFunc fn, void *p);
+
+    /**
+     * Free everything retired under the given engine, regardless of
+     * readers.  Only for when the engine is going away and nothing can
+     * be reading its data anymore.
+     */
+    static void flush(EventuallyPersistentEngine *engine);
+
+    /**
+     * Try to move the epoch along and free what this thread retired,
+     * and what was deferred, that's no longer visible to anyone.
+     */
+    static void reclaim();
+
+    /**
+     * Number of retired objects not yet freed on all threads.
+     */
+    static size_t getNumPending();
+
+private:
+    static bool enabled;
+};
+
+/**
+ * Pins the current epoch for as long as it's in scope.
+ */
+class EpochGuard {
+public:
+    EpochGuard() {
+        EpochManager::enter();
+    }
+
+    ~EpochGuard() {
+        EpochManager::exit();
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(EpochGuard);
+};
+
+#endif  // SRC_EPOCH_H_
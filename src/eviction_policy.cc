@@ -0,0 +1,90 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "eviction_policy.h"
+
+static double randomFraction(unsigned int &seed) {
+    return static_cast<double>(rand_r(&seed)) / static_cast<double>(RAND_MAX);
+}
+
+EvictionPolicy *EvictionPolicy::create(const std::string &name) {
+    if (name.compare("clock_pro") == 0) {
+        return new ClockProEvictionPolicy();
+    }
+    return new NRUEvictionPolicy();
+}
+
+bool NRUEvictionPolicy::shouldEvict(StoredValue *v, double percent,
+                                    unsigned int &seed) {
+    // always evict unreferenced items, or randomly evict referenced item
+    if (phase == PAGING_UNREFERENCED) {
+        return v->getNRUValue() == MAX_NRU_VALUE;
+    }
+    double r = randomFraction(seed);
+    return v->incrNRUValue() == MAX_NRU_VALUE && r <= percent;
+}
+
+void NRUEvictionPolicy::runComplete(bool reachedEnd) {
+    if (reachedEnd) {
+        phase = phase == PAGING_UNREFERENCED ? PAGING_RANDOM : PAGING_UNREFERENCED;
+    }
+}
+
+bool ClockProEvictionPolicy::shouldEvict(StoredValue *v, double percent,
+                                         unsigned int &seed) {
+    if (!v->isResident()) {
+        // It's been a whole sweep; fetching it back now is no longer
+        // a sign it was evicted too early.
+        v->setGhost(false);
+        return false;
+    }
+
+    uint8_t nru = v->getNRUValue();
+    if (v->isHot()) {
+        if (nru == MAX_NRU_VALUE ||
+            (underPressure && nru >= INITIAL_NRU_VALUE)) {
+            v->setHot(false);
+            v->setNRUValue(INITIAL_NRU_VALUE);
+        } else {
+            v->incrNRUValue();
+        }
+        return false;
+    }
+
+    if (nru == MIN_NRU_VALUE) {
+        v->setHot(true);
+        v->setNRUValue(INITIAL_NRU_VALUE);
+        return false;
+    }
+
+    if (v->incrNRUValue() == MAX_NRU_VALUE) {
+        return true;
+    }
+    return underPressure && randomFraction(seed) <= percent;
+}
+
+void ClockProEvictionPolicy::evicted(StoredValue *v) {
+    v->setGhost(true);
+}
+
+void ClockProEvictionPolicy::runComplete(bool reachedEnd) {
+    underPressure = reachedEnd;
+}
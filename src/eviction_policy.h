@@ -0,0 +1,153 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_EVICTION_POLICY_H_
+#define SRC_EVICTION_POLICY_H_ 1
+
+#include "config.h"
+
+#include <string>
+
+#include "common.h"
+#include "stored-value.h"
+
+/**
+ * The item pager phase
+ */
+typedef enum {
+    PAGING_UNREFERENCED,
+    PAGING_RANDOM
+} item_pager_phase;
+
+/**
+ * Decides which values the item pager ejects.
+ *
+ * The pager hands every unexpired item it visits to the policy with
+ * the item's bucket locked, and ejects the value if the policy says
+ * so.  A policy lives as long as the pager, so it may carry state from
+ * one run to the next.
+ */
+class EvictionPolicy {
+public:
+    virtual ~EvictionPolicy() {}
+
+    /**
+     * Create the policy with the given name ("nru" or "clock_pro").
+     */
+    static EvictionPolicy *create(const std::string &name);
+
+    /**
+     * Decide whether to eject an item's value.
+     *
+     * @param v the item, which may or may not be resident
+     * @param percent the chance (0-1) an item picked at random is
+     *                ejected; the pager's sweeps stop at a byte target,
+     *                so it passes 1
+     * @param seed the caller's rand_r() state for random ejections, as
+     *             visitors of several shards share the policy
+     * @return true if the value should be ejected
+     */
+    virtual bool shouldEvict(StoredValue *v, double percent,
+                             unsigned int &seed) = 0;
+
+    /**
+     * Called after the value of an item shouldEvict() picked was
+     * ejected.
+     */
+    virtual void evicted(StoredValue *v) {
+        (void)v;
+    }
+
+    /**
+     * Called at the end of each pager run.
+     *
+     * @param reachedEnd true if the run went through every vbucket
+     *                   without getting memory below the low watermark
+     */
+    virtual void runComplete(bool reachedEnd) {
+        (void)reachedEnd;
+    }
+
+    virtual const char *getName() const = 0;
+};
+
+/**
+ * The original two-phase not-recently-used policy.
+ *
+ * The first run of a cycle only ejects items that haven't been
+ * referenced for a while; if that wasn't enough, the next one ages
+ * every item and ejects old ones at random.
+ */
+class NRUEvictionPolicy : public EvictionPolicy {
+public:
+    NRUEvictionPolicy() : phase(PAGING_UNREFERENCED) { }
+
+    bool shouldEvict(StoredValue *v, double percent, unsigned int &seed);
+
+    void runComplete(bool reachedEnd);
+
+    const char *getName() const {
+        return "nru";
+    }
+
+    item_pager_phase getPhase() const {
+        return phase;
+    }
+
+private:
+    item_pager_phase phase;
+};
+
+/**
+ * A CLOCK-Pro style policy that keeps the working set out of reach of
+ * one-off scans.
+ *
+ * Each pager run is a sweep of the clock: the NRU bits count the
+ * sweeps since an item was last referenced.  Items come in cold.  A
+ * cold item referenced twice between sweeps, or one whose value is
+ * fetched back from disk while it's still marked as a ghost (ejected
+ * since its last sweep), has shown it's reused and becomes hot.  Only
+ * cold items are ejected; hot ones turn cold again once a sweep finds
+ * them unreferenced.  A scan touches its items once, so they stay cold
+ * and go first.
+ *
+ * The ghost marks live on the non-resident items themselves, so the
+ * ghost list costs no memory and needs no key lookups.
+ *
+ * If a run got all the way through without freeing enough, the next
+ * one also ejects cold items at random and demotes hot items that
+ * weren't referenced since the last sweep.
+ */
+class ClockProEvictionPolicy : public EvictionPolicy {
+public:
+    ClockProEvictionPolicy() : underPressure(false) { }
+
+    bool shouldEvict(StoredValue *v, double percent, unsigned int &seed);
+
+    void evicted(StoredValue *v);
+
+    void runComplete(bool reachedEnd);
+
+    const char *getName() const {
+        return "clock_pro";
+    }
+
+private:
+    bool underPressure;
+};
+
+#endif  // SRC_EVICTION_POLICY_H_
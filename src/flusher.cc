@@ -24,6 +24,7 @@
 #include <map>
 #include <vector>
 
+#include "ep_engine.h"
 #include "flusher.h"
 #include "iomanager/iomanager.h"
 
@@ -133,10 +134,103 @@ void Flusher::schedule_UNLOCKED() {
 }
 
 void Flusher::start() {
+    if (store->getEPEngine().getConfiguration().isFlusherPipeline()) {
+        startPipeline();
+    }
     LockHolder lh(taskMutex);
     schedule_UNLOCKED();
 }
 
+extern "C" {
+    static void* launch_flush_pipeline(void *arg) {
+        static_cast<Flusher*>(arg)->runPipeline();
+        return NULL;
+    }
+}
+
+void Flusher::startPipeline() {
+    if (pipelined) {
+        return;
+    }
+    pipelineStop = false;
+    if (pthread_create(&pipelineThread, NULL, launch_flush_pipeline,
+                       this) != 0) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to start the flusher pipeline "
+            "thread of shard %d, flushing sequentially", shard->getId());
+        return;
+    }
+    pipelined = true;
+}
+
+void Flusher::stopPipeline() {
+    if (!pipelined) {
+        return;
+    }
+    commitPrepared();
+    {
+        LockHolder lh(pipelineSync);
+        pipelineStop = true;
+        pipelineSync.notify();
+    }
+    pthread_join(pipelineThread, NULL);
+    pipelined = false;
+}
+
+void Flusher::runPipeline() {
+    ObjectRegistry::onSwitchThread(&store->getEPEngine());
+    LockHolder lh(pipelineSync);
+    while (!pipelineStop) {
+        if (toPrepare == NO_VBUCKETS_INSTANTIATED) {
+            pipelineSync.wait();
+            continue;
+        }
+        uint16_t vbid = toPrepare;
+        lh.unlock();
+        FlushBatch *batch = store->prepareFlush(vbid);
+        lh.lock();
+        prepared = batch;
+        toPrepare = NO_VBUCKETS_INSTANTIATED;
+        pipelineSync.notify();
+    }
+}
+
+FlushBatch *Flusher::takePrepared() {
+    LockHolder lh(pipelineSync);
+    while (toPrepare != NO_VBUCKETS_INSTANTIATED) {
+        pipelineSync.wait();
+    }
+    FlushBatch *batch = prepared;
+    prepared = NULL;
+    return batch;
+}
+
+void Flusher::startPrepare(uint16_t vbid) {
+    LockHolder lh(pipelineSync);
+    assert(prepared == NULL && toPrepare == NO_VBUCKETS_INSTANTIATED);
+    toPrepare = vbid;
+    pipelineSync.notify();
+}
+
+void Flusher::commitPrepared() {
+    FlushBatch *batch = takePrepared();
+    if (batch) {
+        commitBatch(batch);
+    }
+    completeCommits();
+}
+
+void Flusher::commitBatch(FlushBatch *batch) {
+    uncompletedVbs.insert(batch->vbid);
+    store->commitFlush(batch, false);
+}
+
+void Flusher::completeCommits() {
+    if (!uncompletedVbs.empty()) {
+        store->completeFlushes(shard->getId());
+        uncompletedVbs.clear();
+    }
+}
+
 void Flusher::wake(void) {
     LockHolder lh(taskMutex);
     assert(taskId > 0);
@@ -152,6 +246,9 @@ bool Flusher::step(size_t tid) {
         case paused:
             return false;
         case pausing:
+            // A prepared batch has drained its items out of the checkpoints,
+            // so it's committed rather than left sitting out the pause.
+            commitPrepared();
             transition_state(paused);
             return false;
         case running:
@@ -175,10 +272,12 @@ bool Flusher::step(size_t tid) {
                 LOG(EXTENSION_LOG_DEBUG, "%s", ss.str().c_str());
             }
             completeFlush();
+            stopPipeline();
             LOG(EXTENSION_LOG_DEBUG, "Flusher stopped");
             transition_state(stopped);
             return false;
         case stopped:
+            stopPipeline();
             IOManager::get()->cancel(taskId);
             return false;
         default:
@@ -203,6 +302,7 @@ void Flusher::completeFlush() {
     while(!canSnooze()) {
         doFlush();
     }
+    commitPrepared();
 }
 
 double Flusher::computeMinSleepTime() {
@@ -210,13 +310,33 @@ double Flusher::computeMinSleepTime() {
         minSleepTime = DEFAULT_MIN_SLEEP_TIME;
         return 0;
     }
+    if (!heldVbs.empty()) {
+        // Come back for the first vbucket whose window is up.
+        minSleepTime = DEFAULT_MIN_SLEEP_TIME;
+        hrtime_t window = store->getGroupCommitWindow() * 1000000ULL;
+        hrtime_t now = gethrtime();
+        hrtime_t wait = window;
+        std::map<uint16_t, hrtime_t>::iterator it = heldVbs.begin();
+        for (; it != heldVbs.end(); ++it) {
+            hrtime_t held = now - it->second;
+            wait = std::min(wait, held < window ? window - held : 0);
+        }
+        return std::min(static_cast<double>(wait) / 1000000000, 1.0);
+    }
     minSleepTime *= 2;
     return std::min(minSleepTime, 1.0);
 }
 
 void Flusher::doFlush() {
+    // Whatever the pipeline thread prepared last time goes to disk in this
+    // step, while it prepares the next vbucket if there's one to flush.
+    FlushBatch *current = takePrepared();
     uint16_t nextVb = getNextVb();
     if (store->diskFlushAll) {
+        if (current) {
+            commitBatch(current);
+        }
+        completeCommits();
         if (shard->getId() == EP_PRIMARY_SHARD) {
             store->flushVBucket(nextVb);
         } else {
@@ -225,21 +345,136 @@ void Flusher::doFlush() {
         }
         return;
     }
-    if (nextVb != NO_VBUCKETS_INSTANTIATED) {
-        store->flushVBucket(nextVb);
+    if (nextVb == NO_VBUCKETS_INSTANTIATED || !isReadyToFlush(nextVb)) {
+        if (current) {
+            commitBatch(current);
+        }
+    } else {
+        if (current && current->vbid == nextVb) {
+            commitBatch(current);
+            current = NULL;
+        }
+        if (uncompletedVbs.find(nextVb) != uncompletedVbs.end()) {
+            // Its items have to be on disk, and the persistence cursor
+            // moved past them, before more of them are drained.
+            completeCommits();
+        }
+        if (!pipelined || _state != running) {
+            if (current) {
+                commitBatch(current);
+            }
+            uncompletedVbs.insert(nextVb);
+            store->flushVBucket(nextVb, false);
+        } else {
+            startPrepare(nextVb);
+            if (current) {
+                commitBatch(current);
+            }
+            if (canSnooze()) {
+                // Nothing comes after it to overlap with.
+                commitPrepared();
+            }
+        }
+    }
+
+    // The commits of a pass over the vbuckets are completed together,
+    // those of vbuckets with persistence waiters right away.
+    if (doHighPriority || (lpVbs.empty() && hpVbs.empty())) {
+        completeCommits();
+    }
+}
+
+bool Flusher::isReadyToFlush(uint16_t vbid) {
+    size_t window = store->getGroupCommitWindow();
+    if (heldVbs.empty() && window == 0) {
+        return true;
+    }
+
+    // Dirty items can't be ejected, so don't sit on them once memory is
+    // over the high water mark.
+    EPStats &stats = store->getEPEngine().getEpStats();
+    bool memHigh = stats.getTotalMemoryUsed() > stats.mem_high_wat.get();
+
+    RCPtr<VBucket> vb = store->getVBucket(vbid);
+    bool now = window == 0 || memHigh || _state != running ||
+        doHighPriority || !vb ||
+        !vb->rejectQueue.empty() || vb->getBackfillSize() > 0 ||
+        vb->getHighPriorityChkSize() > 0;
+    if (!now) {
+        size_t dirty = vb->checkpointManager.getNumItemsForPersistence();
+        now = dirty == 0 || dirty >= store->getTransactionSize();
+    }
+
+    std::map<uint16_t, hrtime_t>::iterator it = heldVbs.find(vbid);
+    if (now) {
+        if (it != heldVbs.end()) {
+            heldVbs.erase(it);
+        }
+        return true;
     }
+    if (it == heldVbs.end()) {
+        heldVbs[vbid] = gethrtime();
+        return false;
+    }
+    if ((gethrtime() - it->second) / 1000000 >= window) {
+        heldVbs.erase(it);
+        return true;
+    }
+    return false;
 }
 
+/**
+ * A vbucket with something to flush, ranked by how long its dirty items
+ * have been waiting in all and then by how many there are.
+ */
+class DirtyVBucket {
+public:
+    DirtyVBucket(uint16_t id, uint64_t a, size_t s) :
+        vbid(id), age(a), size(s) { }
+
+    bool operator<(const DirtyVBucket &other) const {
+        if (age != other.age) {
+            return age > other.age;
+        }
+        return size > other.size;
+    }
+
+    uint16_t vbid;
+    uint64_t age;
+    size_t size;
+};
+
 uint16_t Flusher::getNextVb() {
+    bool haveVbs = true;
     if (lpVbs.empty()) {
         if (hpVbs.empty()) {
             doHighPriority = false;
         }
         pendingMutation.cas(true, false);
         std::vector<int> vbs = shard->getVBucketsSortedByState();
+        haveVbs = !vbs.empty();
+        std::vector<DirtyVBucket> dirty;
         std::vector<int>::iterator itr = vbs.begin();
         for (; itr != vbs.end(); ++itr) {
-            lpVbs.push(static_cast<uint16_t>(*itr));
+            RCPtr<VBucket> vb = shard->getBucket(*itr);
+            if (!vb) {
+                continue;
+            }
+            size_t size = vb->dirtyQueueSize.get();
+            if (size == 0 && !store->diskFlushAll &&
+                vb->checkpointManager.getNumItemsForPersistence() == 0 &&
+                vb->getBackfillSize() == 0 && vb->rejectQueue.empty() &&
+                !vb->needsFilterRebuild()) {
+                // Nothing to flush, don't spend a step on it.
+                continue;
+            }
+            dirty.push_back(DirtyVBucket(*itr, vb->getQueueAge(), size));
+        }
+        // The active vbuckets still go first among equals.
+        std::stable_sort(dirty.begin(), dirty.end());
+        std::vector<DirtyVBucket>::iterator it = dirty.begin();
+        for (; it != dirty.end(); ++it) {
+            lpVbs.push(it->vbid);
         }
     }
 
@@ -259,7 +494,9 @@ uint16_t Flusher::getNextVb() {
     }
 
     if (hpVbs.empty() && lpVbs.empty()) {
-        LOG(EXTENSION_LOG_INFO, "Trying to flush but no vbucket exist");
+        if (!haveVbs) {
+            LOG(EXTENSION_LOG_INFO, "Trying to flush but no vbucket exist");
+        }
         return NO_VBUCKETS_INSTANTIATED;
     } else if (!hpVbs.empty()) {
         uint16_t vbid = hpVbs.front();
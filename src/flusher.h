@@ -23,6 +23,7 @@
 #include <list>
 #include <map>
 #include <queue>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -56,7 +57,9 @@ public:
     Flusher(EventuallyPersistentStore *st, KVShard *k) :
         store(st), _state(initializing), taskId(0), minSleepTime(0.1),
         forceShutdownReceived(false), doHighPriority(false),
-        numHighPriority(0), shard(k) { }
+        numHighPriority(0), pipelined(false),
+        toPrepare(NO_VBUCKETS_INSTANTIATED), prepared(NULL),
+        pipelineStop(false), shard(k) { }
 
     ~Flusher() {
         if (_state != stopped) {
@@ -64,6 +67,7 @@ public:
                 stateName(_state));
 
         }
+        stopPipeline();
     }
 
     bool stop(bool isForceShutdown = false);
@@ -88,6 +92,11 @@ public:
     }
     void setTaskId(size_t newId) { taskId = newId; }
 
+    /**
+     * Body of the thread preparing the pipelined flusher's next batch.
+     */
+    void runPipeline();
+
 private:
     bool transition_state(enum flusher_state to);
     void doFlush();
@@ -98,6 +107,36 @@ private:
     const char * stateName(enum flusher_state st) const;
 
     uint16_t getNextVb();
+
+    /**
+     * Tell whether to commit a vbucket's dirty items now or to hold a small
+     * commit back for up to the group_commit_window, so that fewer and
+     * bigger commits (and fsyncs) are made.
+     */
+    bool isReadyToFlush(uint16_t vbid);
+
+    void startPipeline();
+    void stopPipeline();
+
+    /**
+     * Get the batch the pipeline thread prepared, if any, waiting for the
+     * one it's working on to be done.
+     */
+    FlushBatch *takePrepared();
+
+    //! Have the pipeline thread prepare the given vbucket's batch.
+    void startPrepare(uint16_t vbid);
+
+    //! Commit the batch the pipeline thread prepared, if any, and
+    //! complete the commits still outstanding.
+    void commitPrepared();
+
+    //! Commit a batch, leaving the commit to completeCommits().
+    void commitBatch(FlushBatch *batch);
+
+    //! Complete the commits of the vbuckets flushed since the last call.
+    void completeCommits();
+
     bool canSnooze(void) {
         return lpVbs.empty() && hpVbs.empty() && !pendingMutation.get();
     }
@@ -115,6 +154,19 @@ private:
     bool doHighPriority;
     size_t numHighPriority;
     Atomic<bool> pendingMutation;
+    //! The vbuckets held back for a group commit, and since when
+    std::map<uint16_t, hrtime_t> heldVbs;
+    //! The vbuckets whose commits are still to be completed
+    std::set<uint16_t> uncompletedVbs;
+
+    //! Whether the next vbucket's batch is prepared on pipelineThread
+    bool pipelined;
+    pthread_t pipelineThread;
+    SyncObject pipelineSync;
+    //! The vbucket being prepared, NO_VBUCKETS_INSTANTIATED if none
+    uint16_t toPrepare;
+    FlushBatch *prepared;
+    bool pipelineStop;
 
     KVShard *shard;
 
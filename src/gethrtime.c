@@ -16,7 +16,9 @@
  */
 
 #include "config.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include <assert.h>
@@ -71,7 +73,7 @@ static int clock_gettime(int which, struct timespec *tp) {
 #define HAVE_CLOCK_GETTIME 1
 #endif
 
-hrtime_t gethrtime(void) {
+static hrtime_t os_hrtime(void) {
 #ifdef HAVE_CLOCK_GETTIME
     struct timespec tm;
     if (clock_gettime(CLOCK_MONOTONIC, &tm) == -1) {
@@ -127,6 +129,109 @@ hrtime_t gethrtime(void) {
 #endif
 }
 
+#if defined(HAVE_CPUID_H) && defined(__linux__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define HAVE_TSC_CLOCK 1
+#endif
+
+#ifdef HAVE_TSC_CLOCK
+/*
+ * Timing an op reads the clock a few times, and clock_gettime is a
+ * syscall wherever the vDSO can't read the clocksource itself (as on
+ * some hypervisors), so the clock is read from the TSC when it can be.
+ * It's only used when it ticks at the same rate in every power state
+ * (an invariant TSC) and the kernel still offers it as a clocksource,
+ * which it stops doing once it finds the cores' TSCs out of step.  Its
+ * rate is calibrated against the OS's clock when the library is loaded.
+ * Setting EP_HRTIME_NO_TSC in the environment keeps to the OS's clock.
+ */
+#define TSC_CALIBRATION_NS 5000000
+
+static int tsc_usable = 0;
+static uint64_t tsc_base;
+static hrtime_t tsc_base_ns;
+static double tsc_ns_per_tick;
+
+static inline uint64_t read_tsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static int tsc_invariant(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 ||
+        eax < 0x80000007) {
+        return 0;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx & (1 << 8)) != 0;
+}
+
+static int tsc_trusted(void) {
+    char buf[256];
+    char *tok, *save;
+    int found = 0;
+    FILE *fp = fopen("/sys/devices/system/clocksource/clocksource0/"
+                     "available_clocksource", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    if (fgets(buf, sizeof(buf), fp) != NULL) {
+        for (tok = strtok_r(buf, " \n", &save); tok != NULL;
+             tok = strtok_r(NULL, " \n", &save)) {
+            if (strcmp(tok, "tsc") == 0) {
+                found = 1;
+            }
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+__attribute__((constructor))
+static void init_tsc_clock(void) {
+    hrtime_t start_ns, now_ns;
+    uint64_t start, now;
+
+    if (getenv("EP_HRTIME_NO_TSC") != NULL ||
+        !tsc_invariant() || !tsc_trusted()) {
+        return;
+    }
+
+    start_ns = os_hrtime();
+    start = read_tsc();
+    do {
+        now_ns = os_hrtime();
+        now = read_tsc();
+    } while (now_ns - start_ns < TSC_CALIBRATION_NS);
+    if (now <= start) {
+        return;
+    }
+
+    tsc_ns_per_tick = (double)(now_ns - start_ns) / (double)(now - start);
+    tsc_base = now;
+    tsc_base_ns = now_ns;
+    tsc_usable = 1;
+}
+#endif
+
+hrtime_t gethrtime(void) {
+#ifdef HAVE_TSC_CLOCK
+    if (tsc_usable) {
+        uint64_t now = read_tsc();
+        // The TSCs of the cores may differ by a few ticks.
+        if (now < tsc_base) {
+            now = tsc_base;
+        }
+        return tsc_base_ns + (hrtime_t)((double)(now - tsc_base) *
+                                        tsc_ns_per_tick);
+    }
+#endif
+    return os_hrtime();
+}
+
 #ifdef HAVE_QUERYPERFORMANCECOUNTER
 __attribute__((constructor))
 static void init_clock_win32(void) {
@@ -0,0 +1,75 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include "getl_wait_queue.h"
+#include "locks.h"
+
+bool GetlWaitQueue::add(uint16_t vbucket, const std::string &key,
+                        const void *cookie, rel_time_t expiry) {
+    LockHolder lh(mutex);
+    if (numWaiters.get() >= maxWaiters.get()) {
+        return false;
+    }
+    waiters[wait_key_t(vbucket, key)].push_back(Waiter(cookie, expiry));
+    ++numWaiters;
+    return true;
+}
+
+void GetlWaitQueue::release(uint16_t vbucket, const std::string &key,
+                            std::vector<const void*> &cookies) {
+    if (empty()) {
+        return;
+    }
+    LockHolder lh(mutex);
+    wait_map_t::iterator it = waiters.find(wait_key_t(vbucket, key));
+    if (it == waiters.end()) {
+        return;
+    }
+    std::list<Waiter>::iterator w;
+    for (w = it->second.begin(); w != it->second.end(); ++w) {
+        cookies.push_back(w->cookie);
+    }
+    numWaiters.decr(it->second.size());
+    waiters.erase(it);
+}
+
+void GetlWaitQueue::expire(rel_time_t now, std::vector<const void*> &cookies) {
+    if (empty()) {
+        return;
+    }
+    LockHolder lh(mutex);
+    wait_map_t::iterator it = waiters.begin();
+    while (it != waiters.end()) {
+        std::list<Waiter>::iterator w = it->second.begin();
+        while (w != it->second.end()) {
+            // As in StoredValue::isLocked, a lock holds through its expiry.
+            if (now > w->expiry) {
+                cookies.push_back(w->cookie);
+                w = it->second.erase(w);
+                --numWaiters;
+            } else {
+                ++w;
+            }
+        }
+        if (it->second.empty()) {
+            waiters.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
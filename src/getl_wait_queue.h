@@ -0,0 +1,104 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_GETL_WAIT_QUEUE_H_
+#define SRC_GETL_WAIT_QUEUE_H_ 1
+
+#include "config.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "mutex.h"
+
+/**
+ * The getl requests parked on keys locked by another getl, until the
+ * lock's released by an unlock or a mutation with its cas, or expires.
+ *
+ * The queue only hands back the cookies to notify; the store notifies
+ * them once it's let go of the hash table lock, and each one's getl is
+ * run again from the start.  With nobody waiting, a check costs one load.
+ */
+class GetlWaitQueue {
+public:
+    GetlWaitQueue() : maxWaiters(0), numWaiters(0) { }
+
+    //! Park at most the given number of requests, or none for 0.
+    void setMaxWaiters(size_t n) {
+        maxWaiters.set(n);
+    }
+
+    size_t getMaxWaiters() {
+        return maxWaiters.get();
+    }
+
+    //! The number of requests parked
+    size_t size() {
+        return numWaiters.get();
+    }
+
+    bool empty() {
+        return numWaiters.get() == 0;
+    }
+
+    /**
+     * Park a request on a locked key.
+     *
+     * @param expiry when the key's lock expires
+     * @return false if the queue's full, in which case the request
+     *         isn't parked
+     */
+    bool add(uint16_t vbucket, const std::string &key, const void *cookie,
+             rel_time_t expiry);
+
+    /**
+     * Take the requests parked on a key that was just unlocked.
+     */
+    void release(uint16_t vbucket, const std::string &key,
+                 std::vector<const void*> &cookies);
+
+    /**
+     * Take the requests parked on the locks expired by the given time.
+     */
+    void expire(rel_time_t now, std::vector<const void*> &cookies);
+
+private:
+    struct Waiter {
+        Waiter(const void *c, rel_time_t e) : cookie(c), expiry(e) { }
+
+        const void *cookie;
+        rel_time_t expiry;
+    };
+
+    typedef std::pair<uint16_t, std::string> wait_key_t;
+    typedef std::map<wait_key_t, std::list<Waiter> > wait_map_t;
+
+    Atomic<size_t> maxWaiters;
+    Atomic<size_t> numWaiters;
+
+    Mutex mutex;
+    wait_map_t waiters;
+
+    DISALLOW_COPY_AND_ASSIGN(GetlWaitQueue);
+};
+
+#endif  // SRC_GETL_WAIT_QUEUE_H_
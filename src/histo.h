@@ -21,7 +21,9 @@
 #include "config.h"
 
 #include <algorithm>
+#include <cassert>
 #include <cmath>
+#include <cstring>
 #include <functional>
 #include <iterator>
 #include <limits>
@@ -267,6 +269,17 @@ public:
                       std::bind2nd(std::mem_fun(&HistogramBin<T>::set), 0));
     }
 
+    /**
+     * Add the counts of another histogram with the same bins.
+     */
+    void merge(const Histogram<T> &other) {
+        assert(bins.size() == other.bins.size());
+        for (size_t i = 0; i < bins.size(); ++i) {
+            assert(bins[i]->start() == other.bins[i]->start());
+            bins[i]->incr(other.bins[i]->count());
+        }
+    }
+
     /**
      * Get the total number of samples counted.
      *
@@ -277,6 +290,35 @@ public:
         return std::accumulate(begin(), end(), 0, a);
     }
 
+    /**
+     * The value no more than the given percentage of the samples are
+     * above, which is the highest value of the bin it's in, or the start
+     * of the last bin if it's there.
+     *
+     * @param pct a percentage from 0 to 100
+     * @return the value, or 0 if nothing's been counted
+     */
+    T percentile(double pct) const {
+        size_t n = const_cast<Histogram<T>*>(this)->total();
+        if (n == 0) {
+            return 0;
+        }
+        pct = std::min(std::max(pct, 0.0), 100.0);
+        size_t rank = static_cast<size_t>(std::ceil(pct * n / 100.0));
+        rank = std::max(rank, static_cast<size_t>(1));
+        size_t seen = 0;
+        for (size_t i = 0; i < bins.size(); ++i) {
+            seen += bins[i]->count();
+            if (seen >= rank) {
+                if (i == bins.size() - 1) {
+                    return bins[i]->start();
+                }
+                return bins[i]->end() - 1;
+            }
+        }
+        return bins.back()->start();
+    }
+
     /**
      * A HistogramBin iterator.
      */
@@ -374,6 +416,300 @@ private:
     DISALLOW_COPY_AND_ASSIGN(Histogram);
 };
 
+/**
+ * The shards of a HdrHistogram, each taken by the threads feeding it in
+ * turn so they don't all increment the same counts.
+ */
+#define HDR_HISTOGRAM_SHARDS 4
+
+/**
+ * A histogram of log-linear buckets, where each power of two is split
+ * into SUB_BUCKETS buckets of the same width, so any value is counted
+ * in a bucket no wider than 1/SUB_BUCKETS of it.
+ *
+ * The bucket of a value is found by its highest bit rather than a
+ * search, and the counts are in fixed arrays of a few shards that are
+ * only summed when the histogram's read, so adding a value takes no
+ * lock or allocation.  Values from 2^MAX_BITS up are all counted in the
+ * last bucket.
+ */
+template <typename T>
+class HdrHistogram {
+public:
+    //! The log2 of the buckets each power of two is split into
+    static const size_t SUB_BITS = 4;
+    static const size_t SUB_BUCKETS = 1 << SUB_BITS;
+    //! The log2 of the smallest value counted in the last bucket
+    static const size_t MAX_BITS = 40;
+    static const size_t NUM_BUCKETS = SUB_BUCKETS * (MAX_BITS - SUB_BITS + 1);
+
+    HdrHistogram() {}
+
+    /**
+     * Add a value to this histogram.
+     *
+     * @param amount the size of the thing being added
+     * @param count the quantity at this size being added
+     */
+    void add(T amount, size_t count=1) {
+        Shard &s(shards[getCounterSlot() % HDR_HISTOGRAM_SHARDS]);
+        s.counts[indexOf(amount)].incr(count);
+        s.max.setIfBigger(amount);
+    }
+
+    /**
+     * Set all counts to 0.
+     */
+    void reset() {
+        for (size_t i = 0; i < HDR_HISTOGRAM_SHARDS; ++i) {
+            for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+                shards[i].counts[b].set(0);
+            }
+            shards[i].max.set(0);
+        }
+    }
+
+    /**
+     * Add the counts of another histogram.
+     */
+    void merge(const HdrHistogram<T> &other) {
+        for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+            shards[0].counts[b].incr(other.count(b));
+        }
+        shards[0].max.setIfBigger(other.getMax());
+    }
+
+    /**
+     * The count of a bucket, summed over the shards.
+     */
+    size_t count(size_t bucket) const {
+        size_t rv = 0;
+        for (size_t i = 0; i < HDR_HISTOGRAM_SHARDS; ++i) {
+            rv += shards[i].counts[bucket].get();
+        }
+        return rv;
+    }
+
+    /**
+     * Get the total number of samples counted.
+     */
+    size_t total() const {
+        size_t rv = 0;
+        for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+            rv += count(b);
+        }
+        return rv;
+    }
+
+    /**
+     * The largest value added since the histogram was last reset.
+     */
+    T getMax() const {
+        T rv = 0;
+        for (size_t i = 0; i < HDR_HISTOGRAM_SHARDS; ++i) {
+            rv = std::max(rv, shards[i].max.get());
+        }
+        return rv;
+    }
+
+    /**
+     * The value no more than the given percentage of the samples are
+     * above, which is the highest value of the bucket it's in, and never
+     * more than the largest value added.
+     *
+     * @param pct a percentage from 0 to 100
+     * @return the value, or 0 if nothing's been counted
+     */
+    T percentile(double pct) const {
+        size_t counts[NUM_BUCKETS];
+        getCounts(counts);
+        return percentileOf(counts, getMax(), pct);
+    }
+
+    /**
+     * Get the counts of every bucket, summed over the shards.
+     *
+     * @param counts where to put the NUM_BUCKETS counts
+     * @return the total number of samples
+     */
+    size_t getCounts(size_t *counts) const {
+        size_t n = 0;
+        for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+            counts[b] = count(b);
+            n += counts[b];
+        }
+        return n;
+    }
+
+    /**
+     * The percentile of a set of bucket counts, as percentile() gives it.
+     *
+     * @param counts the NUM_BUCKETS counts
+     * @param highest the largest value the counts may include
+     * @param pct a percentage from 0 to 100
+     */
+    static T percentileOf(const size_t *counts, T highest, double pct) {
+        size_t n = 0;
+        for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+            n += counts[b];
+        }
+        if (n == 0) {
+            return 0;
+        }
+
+        pct = std::min(std::max(pct, 0.0), 100.0);
+        size_t rank = static_cast<size_t>(std::ceil(pct * n / 100.0));
+        rank = std::max(rank, static_cast<size_t>(1));
+        size_t seen = 0;
+        for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+            seen += counts[b];
+            if (seen >= rank) {
+                if (b == NUM_BUCKETS - 1) {
+                    return highest;
+                }
+                return std::min(static_cast<T>(bucketEnd(b) - 1), highest);
+            }
+        }
+        return highest;
+    }
+
+    /**
+     * The bucket a value is counted in.
+     */
+    static size_t indexOf(T amount) {
+        uint64_t v = static_cast<uint64_t>(amount);
+        if (v < SUB_BUCKETS) {
+            return static_cast<size_t>(v);
+        }
+        size_t bits = highestBit(v);
+        if (bits >= MAX_BITS) {
+            return NUM_BUCKETS - 1;
+        }
+        return SUB_BUCKETS * (bits - SUB_BITS + 1) +
+            static_cast<size_t>((v >> (bits - SUB_BITS)) & (SUB_BUCKETS - 1));
+    }
+
+    /**
+     * The smallest value counted in a bucket.
+     */
+    static T bucketStart(size_t bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return static_cast<T>(bucket);
+        }
+        size_t shift = bucket / SUB_BUCKETS - 1;
+        uint64_t sub = SUB_BUCKETS + bucket % SUB_BUCKETS;
+        return static_cast<T>(sub << shift);
+    }
+
+    /**
+     * The value a bucket's counts end before, or the largest value of T
+     * for the last bucket.
+     */
+    static T bucketEnd(size_t bucket) {
+        if (bucket == NUM_BUCKETS - 1) {
+            return std::numeric_limits<T>::max();
+        }
+        return bucketStart(bucket + 1);
+    }
+
+private:
+
+    //! The position of the highest bit set in a value that isn't 0
+    static size_t highestBit(uint64_t v) {
+#ifdef __GNUC__
+        return 63 - __builtin_clzll(v);
+#else
+        size_t rv = 0;
+        while (v >>= 1) {
+            ++rv;
+        }
+        return rv;
+#endif
+    }
+
+    struct Shard {
+        Atomic<size_t> counts[NUM_BUCKETS];
+        Atomic<T>      max;
+    };
+
+    Shard shards[HDR_HISTOGRAM_SHARDS];
+
+    DISALLOW_COPY_AND_ASSIGN(HdrHistogram);
+};
+
+/**
+ * Snapshots of the counts of a HdrHistogram, taken once an interval into
+ * a ring, so the samples added over the last few intervals can be told
+ * from the ones before.
+ *
+ * The ring has a slot more than the longest window reads, so a snapshot
+ * is never taken into a slot being read unless the read takes longer
+ * than an interval.
+ */
+template <typename T>
+class HdrHistogramWindows {
+public:
+    //! The most intervals a window can cover
+    static const size_t MAX_STEPS = 6;
+
+    HdrHistogramWindows(const HdrHistogram<T> &h) : histo(h) {
+        memset(snapshots, 0, sizeof(snapshots));
+    }
+
+    /**
+     * Take a snapshot of the histogram, ending an interval.
+     */
+    void rotate() {
+        size_t r = rotations.get();
+        histo.getCounts(snapshots[r % NUM_SNAPSHOTS]);
+        rotations.set(r + 1);
+    }
+
+    /**
+     * Get the counts of the samples added over the last whole intervals,
+     * or since the first snapshot if there haven't been that many.
+     *
+     * @param steps the intervals to cover, at most MAX_STEPS
+     * @param counts where to put the counts of the histogram's buckets
+     * @return the number of samples
+     */
+    size_t getWindow(size_t steps, size_t *counts) const {
+        assert(steps <= MAX_STEPS);
+        size_t r = rotations.get();
+        size_t n = 0;
+        if (r < 2) {
+            memset(counts, 0, HdrHistogram<T>::NUM_BUCKETS * sizeof(size_t));
+            return n;
+        }
+        size_t latest = r - 1;
+        size_t earliest = latest > steps ? latest - steps : 0;
+        const size_t *to = snapshots[latest % NUM_SNAPSHOTS];
+        const size_t *from = snapshots[earliest % NUM_SNAPSHOTS];
+        for (size_t b = 0; b < HdrHistogram<T>::NUM_BUCKETS; ++b) {
+            // The histogram was reset in the window if it's gone down.
+            counts[b] = to[b] >= from[b] ? to[b] - from[b] : to[b];
+            n += counts[b];
+        }
+        return n;
+    }
+
+    /**
+     * The histogram the snapshots are of.
+     */
+    const HdrHistogram<T> &getHistogram() const {
+        return histo;
+    }
+
+private:
+    static const size_t NUM_SNAPSHOTS = MAX_STEPS + 2;
+
+    const HdrHistogram<T> &histo;
+    Atomic<size_t>         rotations;
+    size_t                 snapshots[NUM_SNAPSHOTS][HdrHistogram<T>::NUM_BUCKETS];
+
+    DISALLOW_COPY_AND_ASSIGN(HdrHistogramWindows);
+};
+
 /**
  * Times blocks automatically and records the values in a histogram.
  */
@@ -387,11 +723,23 @@ public:
      * @param d the histogram that will hold the result
      */
     BlockTimer(Histogram<hrtime_t> *d, const char *n=NULL, std::ostream *o=NULL)
-        : dest(d), start(gethrtime()), name(n), out(o) {}
+        : dest(d), hdrDest(NULL), start(gethrtime()), name(n), out(o) {}
+
+    /**
+     * Get a BlockTimer that will store its values in the given
+     * log-linear histogram.
+     */
+    BlockTimer(HdrHistogram<hrtime_t> *d, const char *n=NULL,
+               std::ostream *o=NULL)
+        : dest(NULL), hdrDest(d), start(gethrtime()), name(n), out(o) {}
 
     ~BlockTimer() {
         hrtime_t spent(gethrtime() - start);
-        dest->add(spent / 1000);
+        if (hdrDest) {
+            hdrDest->add(spent / 1000);
+        } else {
+            dest->add(spent / 1000);
+        }
         log(spent, name, out);
     }
 
@@ -402,10 +750,11 @@ public:
     }
 
 private:
-    Histogram<hrtime_t> *dest;
-    hrtime_t             start;
-    const char          *name;
-    std::ostream        *out;
+    Histogram<hrtime_t>    *dest;
+    HdrHistogram<hrtime_t> *hdrDest;
+    hrtime_t                start;
+    const char             *name;
+    std::ostream           *out;
 };
 
 // How to print a bin.
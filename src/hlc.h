@@ -0,0 +1,118 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef SRC_HLC_H_
+#define SRC_HLC_H_ 1
+
+#include "config.h"
+
+#include <sys/time.h>
+
+#include "atomic.h"
+#include "ep_time.h"
+
+/**
+ * A hybrid logical clock giving out casses: the wall clock time in
+ * nanoseconds with its low 16 bits kept for a counter, and never less
+ * than one more than the last cas given out or observed.  The casses of
+ * a key's mutations then grow with time even across clusters, so the
+ * last write can win.
+ *
+ * Each vbucket has its own, so mutations of different vbuckets don't
+ * contend on one counter.  The wall clock is only read every
+ * READ_INTERVAL casses and whenever the server's coarse clock ticks, so
+ * a cas is never more than a tick behind the wall clock and most of them
+ * are the last plus one.
+ *
+ * A cas from another clock, like another cluster's, that's further ahead
+ * of the wall clock than the max drift is too far in the future to be
+ * trusted: it only moves the clock up to the max drift ahead.
+ */
+class HybridLogicalClock {
+public:
+    //! The casses given out between reads of the wall clock
+    static const uint64_t READ_INTERVAL = 256;
+    //! The bits of a cas that count the casses of the same clock reading
+    static const uint64_t LOGICAL_MASK = 0xffff;
+
+    HybridLogicalClock() : last(wallClock()), lastTick(0) { }
+
+    uint64_t nextCas() {
+        for (;;) {
+            uint64_t prev = last.get();
+            uint64_t next = prev + 1;
+            rel_time_t tick = ep_current_time();
+            if (next % READ_INTERVAL == 0 || tick != lastTick.get()) {
+                lastTick.set(tick);
+                uint64_t now = wallClock();
+                if (now > next) {
+                    next = now;
+                }
+            }
+            if (last.cas(prev, next)) {
+                return next;
+            }
+        }
+    }
+
+    /**
+     * Have the casses given out from now on be greater than one from
+     * elsewhere, like another cluster, or than the max drift ahead of the
+     * wall clock if that's less.
+     */
+    void observe(uint64_t cas) {
+        uint64_t drift = maxDrift.get();
+        if (drift != 0) {
+            uint64_t limit = wallClock() + drift;
+            if (cas > limit) {
+                cas = limit;
+            }
+        }
+        last.setIfBigger(cas);
+    }
+
+    //! True if a cas is further ahead of the wall clock than the max drift
+    static bool isTooFarAhead(uint64_t cas) {
+        uint64_t drift = maxDrift.get();
+        return drift != 0 && cas > wallClock() + drift;
+    }
+
+    //! Set how far (ms) a cas may be ahead of the wall clock, 0 for no limit
+    static void setMaxDrift(uint64_t ms) {
+        maxDrift.set(ms * 1000000);
+    }
+
+    //! The wall clock time as a cas with no count
+    static uint64_t wallClock() {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        uint64_t now = (static_cast<uint64_t>(tv.tv_sec) * 1000000 +
+                        tv.tv_usec) * 1000;
+        return now & ~LOGICAL_MASK;
+    }
+
+private:
+    //! The last cas given out or observed
+    Atomic<uint64_t> last;
+    //! The coarse clock's time when the wall clock was last read
+    Atomic<rel_time_t> lastTick;
+    //! How far (ns, like a cas) a cas may be ahead of the wall clock
+    static Atomic<uint64_t> maxDrift;
+
+    DISALLOW_COPY_AND_ASSIGN(HybridLogicalClock);
+};
+
+#endif  // SRC_HLC_H_
@@ -0,0 +1,141 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include "hotkeys.h"
+#include "locks.h"
+
+static bool hotterThan(const HotKeys::Entry &a, const HotKeys::Entry &b) {
+    return a.count > b.count;
+}
+
+void HotKeys::Ranking::add(const std::string &key, uint64_t weight,
+                           uint64_t rate, bool isSet) {
+    size_t i;
+    std::map<std::string, size_t>::iterator it = index.find(key);
+    if (it != index.end()) {
+        i = it->second;
+    } else if (entries.size() < CAPACITY) {
+        i = entries.size();
+        entries.push_back(Entry());
+        entries[i].key = key;
+        index[key] = i;
+    } else {
+        i = 0;
+        for (size_t j = 1; j < entries.size(); ++j) {
+            if (entries[j].count < entries[i].count) {
+                i = j;
+            }
+        }
+        index.erase(entries[i].key);
+        Entry e;
+        e.key = key;
+        e.count = entries[i].count;
+        e.error = entries[i].count;
+        entries[i] = e;
+        index[key] = i;
+    }
+
+    Entry &e = entries[i];
+    e.count += weight;
+    if (isSet) {
+        e.sets += rate;
+    } else {
+        e.gets += rate;
+    }
+}
+
+void HotKeys::Ranking::top(std::vector<Entry> &out, size_t n) const {
+    out = entries;
+    std::sort(out.begin(), out.end(), hotterThan);
+    if (out.size() > n) {
+        out.resize(n);
+    }
+}
+
+void HotKeys::record(const std::string &key, uint16_t vbucket,
+                     size_t bytes, bool isSet) {
+    uint64_t rate = sampleRate.get();
+    if (rate == 0) {
+        return;
+    }
+
+    LockHolder lh(mutex);
+    byOps.add(key, rate, rate, isSet);
+    if (bytes > 0) {
+        byBytes.add(key, bytes * rate, rate, isSet);
+    }
+
+    VBLoad &vb = vbuckets[vbucket];
+    vb.ops += rate;
+    vb.bytes += bytes * rate;
+    if (isSet) {
+        vb.sets += rate;
+    } else {
+        vb.gets += rate;
+    }
+}
+
+void HotKeys::reset() {
+    LockHolder lh(mutex);
+    byOps.clear();
+    byBytes.clear();
+    vbuckets.clear();
+}
+
+void HotKeys::getTopByOps(std::vector<Entry> &out) {
+    LockHolder lh(mutex);
+    byOps.top(out, TOP);
+}
+
+void HotKeys::getTopByBytes(std::vector<Entry> &out) {
+    LockHolder lh(mutex);
+    byBytes.top(out, TOP);
+}
+
+void HotKeys::getTopVBucketsByOps(std::vector<Entry> &out) {
+    getTopVBuckets(out, false);
+}
+
+void HotKeys::getTopVBucketsByBytes(std::vector<Entry> &out) {
+    getTopVBuckets(out, true);
+}
+
+void HotKeys::getTopVBuckets(std::vector<Entry> &out, bool byBytes) {
+    out.clear();
+    LockHolder lh(mutex);
+    std::map<uint16_t, VBLoad>::const_iterator it;
+    for (it = vbuckets.begin(); it != vbuckets.end(); ++it) {
+        std::stringstream ss;
+        ss << it->first;
+        Entry e;
+        e.key = ss.str();
+        e.count = byBytes ? it->second.bytes : it->second.ops;
+        e.gets = it->second.gets;
+        e.sets = it->second.sets;
+        out.push_back(e);
+    }
+    lh.unlock();
+
+    std::sort(out.begin(), out.end(), hotterThan);
+    if (out.size() > TOP) {
+        out.resize(TOP);
+    }
+}
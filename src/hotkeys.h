@@ -0,0 +1,156 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_HOTKEYS_H_
+#define SRC_HOTKEYS_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "mutex.h"
+
+/**
+ * The keys and vbuckets taking the most gets and sets, and the most bytes,
+ * found from a sample of one in every sampleRate of the operations.
+ *
+ * The keys are ranked with the space-saving algorithm: CAPACITY keys are
+ * counted, and a key that's not among them replaces the one with the least
+ * count, taking over its count as the error of its own.  A key whose count
+ * is more than its error is certain to have been that hot, and any key
+ * with more than 1/CAPACITY of the sampled load is among them.  The counts
+ * are scaled by the sample rate back to estimates of all the operations.
+ *
+ * The operations not sampled only count towards the next sample, in a
+ * slot of the calling thread's, so the tracker costs next to nothing.
+ */
+class HotKeys {
+public:
+    //! The keys counted in each ranking
+    static const size_t CAPACITY = 64;
+    //! The keys and vbuckets reported of each ranking
+    static const size_t TOP = 10;
+
+    /**
+     * One key or vbucket of a ranking.
+     */
+    struct Entry {
+        Entry() : count(0), error(0), gets(0), sets(0) { }
+
+        std::string key;
+        //! The estimated count of what it's ranked by
+        uint64_t count;
+        //! How much of the count may be of the keys it replaced
+        uint64_t error;
+        uint64_t gets;
+        uint64_t sets;
+    };
+
+    HotKeys(size_t rate = 0) : sampleRate(rate) { }
+
+    //! Sample one operation in every rate, or none for 0
+    void setSampleRate(size_t rate) {
+        sampleRate.set(rate);
+    }
+
+    size_t getSampleRate() {
+        return sampleRate.get();
+    }
+
+    /**
+     * Whether the calling operation is one of those sampled, to be passed
+     * to record() if so.
+     */
+    bool shouldSample() {
+        size_t rate = sampleRate.get();
+        if (rate == 0) {
+            return false;
+        }
+        return ++ticks[getCounterSlot()].value % rate == 0;
+    }
+
+    /**
+     * Count a sampled get or set of a key.
+     *
+     * @param bytes the bytes of the value got or set
+     */
+    void record(const std::string &key, uint16_t vbucket, size_t bytes,
+                bool isSet);
+
+    //! Forget what's been counted
+    void reset();
+
+    //! The keys with the most gets and sets, the hottest first
+    void getTopByOps(std::vector<Entry> &out);
+    //! The keys with the most bytes got and set, the heaviest first
+    void getTopByBytes(std::vector<Entry> &out);
+    //! The vbuckets with the most gets and sets, the hottest first
+    void getTopVBucketsByOps(std::vector<Entry> &out);
+    //! The vbuckets with the most bytes got and set, the heaviest first
+    void getTopVBucketsByBytes(std::vector<Entry> &out);
+
+private:
+    /**
+     * A space-saving ranking of CAPACITY keys.
+     */
+    class Ranking {
+    public:
+        void add(const std::string &key, uint64_t weight, uint64_t rate,
+                 bool isSet);
+        void top(std::vector<Entry> &out, size_t n) const;
+        void clear() {
+            entries.clear();
+            index.clear();
+        }
+
+    private:
+        std::vector<Entry> entries;
+        std::map<std::string, size_t> index;
+    };
+
+    struct VBLoad {
+        VBLoad() : ops(0), bytes(0), gets(0), sets(0) { }
+
+        uint64_t ops;
+        uint64_t bytes;
+        uint64_t gets;
+        uint64_t sets;
+    };
+
+    void getTopVBuckets(std::vector<Entry> &out, bool byBytes);
+
+    struct Tick {
+        Atomic<size_t> value;
+        char pad[COUNTER_SLOT_SIZE - sizeof(Atomic<size_t>)];
+    };
+
+    Atomic<size_t> sampleRate;
+    Tick ticks[COUNTER_SLOTS];
+
+    Mutex mutex;
+    Ranking byOps;
+    Ranking byBytes;
+    std::map<uint16_t, VBLoad> vbuckets;
+
+    DISALLOW_COPY_AND_ASSIGN(HotKeys);
+};
+
+#endif  // SRC_HOTKEYS_H_
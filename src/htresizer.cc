@@ -17,31 +17,68 @@
 
 #include "config.h"
 
+#include <algorithm>
+
 #include "ep.h"
+#include "ep_engine.h"
 #include "htresizer.h"
 #include "stored-value.h"
 
 static const double FREQUENCY(60.0);
+static const double STEP_FREQUENCY(0.5);
+//! How often to look for idle tables that outgrew their size
+static const double IDLE_POLL_FREQUENCY(1.0);
 
-/**
- * Look at all the hash tables and make sure they're sized appropriately.
- */
 class ResizingVisitor : public VBucketVisitor {
 public:
 
-    ResizingVisitor() { }
+    ResizingVisitor(size_t n, bool w) :
+        maxBuckets(n), warmingUp(w), resizing(false) { }
 
     bool visitBucket(RCPtr<VBucket> &vb) {
-        vb->ht.resize();
+        if (!vb->ht.isResizing()) {
+            if (warmingUp) {
+                // Don't shrink a table sized for the keys still loading.
+                vb->ht.reserve(vb->ht.getNumItems());
+            } else {
+                vb->ht.resize();
+            }
+        }
+        if (vb->ht.resizeStep(maxBuckets)) {
+            resizing = true;
+        }
         return false;
     }
 
+    bool isResizing() { return resizing; }
+
+private:
+    size_t maxBuckets;
+    bool warmingUp;
+    bool resizing;
 };
 
 bool HashtableResizer::callback(Dispatcher &d, TaskId &t) {
-    shared_ptr<ResizingVisitor> pv(new ResizingVisitor);
-    store->visit(pv, "Hashtable resizer", &d, Priority::ItemPagerPriority);
+    Configuration &config = store->getEPEngine().getConfiguration();
+    EPStats &stats = store->getEPEngine().getEpStats();
+    hrtime_t now = gethrtime();
+    if (now < nextPass && !stats.htGrowPending.get()) {
+        // An idle table that fills up can't wait for the next pass.
+        d.snooze(t, IDLE_POLL_FREQUENCY);
+        return true;
+    }
+    stats.htGrowPending.set(false);
+
+    // Every vbucket only does a bounded amount of work here, so walk
+    // them inline and come back soon if any still has buckets to move.
+    ResizingVisitor rv(config.getHtResizeStep(), !stats.warmupComplete.get());
+    store->visit(rv);
 
-    d.snooze(t, FREQUENCY);
+    double sleeptime = rv.isResizing() ? STEP_FREQUENCY : FREQUENCY;
+    nextPass = now + static_cast<hrtime_t>(sleeptime * 1000000000);
+    if (config.getHtIdleSize() > 0) {
+        sleeptime = std::min(sleeptime, IDLE_POLL_FREQUENCY);
+    }
+    d.snooze(t, sleeptime);
     return true;
 }
@@ -33,7 +33,7 @@ class EventuallyPersistentStore;
 class HashtableResizer : public DispatcherCallback {
 public:
 
-    HashtableResizer(EventuallyPersistentStore *s) : store(s) {}
+    HashtableResizer(EventuallyPersistentStore *s) : store(s), nextPass(0) {}
 
     bool callback(Dispatcher &d, TaskId &t);
 
@@ -43,6 +43,8 @@ public:
 
 private:
     EventuallyPersistentStore *store;
+    //! When the vbuckets are due to be walked again
+    hrtime_t nextPass;
 };
 
 #endif  // SRC_HTRESIZER_H_
@@ -0,0 +1,168 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "huge_pages.h"
+#include "locks.h"
+
+HugePages::Mode HugePages::mode = HugePages::OFF;
+Mutex HugePages::mutex;
+std::map<void*, HugePages::Mapping> HugePages::mappings;
+Atomic<size_t> HugePages::mappedBytes;
+Atomic<size_t> HugePages::explicitBytes;
+Atomic<size_t> HugePages::fallbacks;
+
+void HugePages::setMode(const std::string &to) {
+    if (to == "transparent") {
+        mode = TRANSPARENT;
+    } else if (to == "explicit") {
+        mode = EXPLICIT;
+    } else {
+        mode = OFF;
+    }
+}
+
+void *HugePages::map(size_t len, bool &explicitPages) {
+    explicitPages = false;
+#ifdef MAP_HUGETLB
+    if (mode == EXPLICIT) {
+        void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            explicitPages = true;
+            return p;
+        }
+        // The pool is empty or was never reserved.
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    // Map a huge page more than needed, and trim it to an aligned
+    // range, so the kernel can back all of it with huge pages.
+    size_t padded = len + HUGE_PAGE_SIZE;
+    void *raw = mmap(NULL, padded, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *start = static_cast<char*>(raw);
+    char *aligned = reinterpret_cast<char*>(
+        (reinterpret_cast<uintptr_t>(start) + HUGE_PAGE_SIZE - 1) &
+        ~(static_cast<uintptr_t>(HUGE_PAGE_SIZE) - 1));
+    if (aligned > start) {
+        munmap(start, aligned - start);
+    }
+    size_t tail = (start + padded) - (aligned + len);
+    if (tail > 0) {
+        munmap(aligned + len, tail);
+    }
+    // Only advice: the memory is good either way.
+    madvise(aligned, len, MADV_HUGEPAGE);
+    return aligned;
+#else
+    (void)len;
+    return NULL;
+#endif
+}
+
+void *HugePages::allocate(size_t len) {
+    if (mode == OFF || len < HUGE_PAGE_SIZE) {
+        return calloc(1, len);
+    }
+    size_t mapped = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    bool explicitPages;
+    void *p = map(mapped, explicitPages);
+    if (p == NULL) {
+        ++fallbacks;
+        return calloc(1, len);
+    }
+    if (mode == EXPLICIT && !explicitPages) {
+        ++fallbacks;
+    }
+
+    Mapping m;
+    m.size = mapped;
+    m.explicitPages = explicitPages;
+    {
+        LockHolder lh(mutex);
+        mappings[p] = m;
+    }
+    mappedBytes.incr(mapped);
+    if (explicitPages) {
+        explicitBytes.incr(mapped);
+    }
+    return p;
+}
+
+void HugePages::release(void *p) {
+    if (p == NULL) {
+        return;
+    }
+    Mapping m;
+    {
+        LockHolder lh(mutex);
+        std::map<void*, Mapping>::iterator it = mappings.find(p);
+        if (it == mappings.end()) {
+            lh.unlock();
+            free(p);
+            return;
+        }
+        m = it->second;
+        mappings.erase(it);
+    }
+    munmap(p, m.size);
+    mappedBytes.decr(m.size);
+    if (m.explicitPages) {
+        explicitBytes.decr(m.size);
+    }
+}
+
+/**
+ * The bytes of the process backed by transparent huge pages, as the
+ * kernel reports them; 0 where it doesn't.
+ */
+static size_t getAnonHugePageBytes() {
+    size_t rv = 0;
+#ifdef __linux__
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long kb;
+        if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+            rv = static_cast<size_t>(kb) * 1024;
+            break;
+        }
+    }
+    fclose(fp);
+#endif
+    return rv;
+}
+
+void HugePages::getStats(std::map<std::string, size_t> &huge_stats) {
+    huge_stats["mapped_bytes"] = mappedBytes.get();
+    huge_stats["explicit_bytes"] = explicitBytes.get();
+    huge_stats["fallbacks"] = fallbacks.get();
+    huge_stats["anon_bytes"] = getAnonHugePageBytes();
+}
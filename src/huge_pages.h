@@ -0,0 +1,105 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_HUGE_PAGES_H_
+#define SRC_HUGE_PAGES_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <string>
+
+#include "atomic.h"
+#include "common.h"
+#include "mutex.h"
+
+// The huge page size the mappings are rounded and aligned to.
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/**
+ * Huge page backing for the big, randomly accessed allocations: the
+ * bucket arrays of large hash tables and the slab arenas.  A get of a
+ * random key touches a bucket and an item on pages nobody touched in a
+ * while, so with 4KB pages across a big heap, most gets miss the TLB
+ * twice.
+ *
+ * In "transparent" mode the memory is mapped huge page aligned and
+ * advised with MADV_HUGEPAGE, so the kernel backs it with huge pages
+ * when it has them, even if transparent huge pages are only enabled on
+ * madvise.  In "explicit" mode it's mapped from the reserved huge page
+ * pool (MAP_HUGETLB) first, falling back to transparent.  Allocations
+ * smaller than a huge page, and those that couldn't be mapped, come
+ * from the heap as before.
+ */
+class HugePages {
+public:
+    enum Mode {
+        OFF,
+        TRANSPARENT,
+        EXPLICIT
+    };
+
+    /**
+     * Set how new allocations are backed: "off", "transparent" or
+     * "explicit".  Memory allocated before is released the way it was
+     * allocated.
+     */
+    static void setMode(const std::string &to);
+
+    static Mode getMode() {
+        return mode;
+    }
+
+    /**
+     * Allocate len zeroed bytes.
+     *
+     * @return the memory, or NULL if there's none
+     */
+    static void *allocate(size_t len);
+
+    /**
+     * Release memory obtained through allocate().
+     */
+    static void release(void *p);
+
+    /**
+     * Add the huge page stats to the given map: the bytes mapped by
+     * either mode, those from the reserved pool, the allocations that
+     * fell back to smaller pages, and the bytes of the process the
+     * kernel actually backs with transparent huge pages.
+     */
+    static void getStats(std::map<std::string, size_t> &huge_stats);
+
+private:
+    struct Mapping {
+        size_t size;
+        bool explicitPages;
+    };
+
+    static void *map(size_t len, bool &explicitPages);
+
+    static Mode mode;
+    static Mutex mutex;
+    static std::map<void*, Mapping> mappings;
+    static Atomic<size_t> mappedBytes;
+    static Atomic<size_t> explicitBytes;
+    static Atomic<size_t> fallbacks;
+
+    DISALLOW_COPY_AND_ASSIGN(HugePages);
+};
+
+#endif  // SRC_HUGE_PAGES_H_
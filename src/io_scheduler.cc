@@ -0,0 +1,42 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "io_scheduler.h"
+
+void IOScheduler::configure(size_t slots,
+                            const size_t weights[NUM_IO_CLASSES]) {
+    for (int c = 0; c < NUM_IO_CLASSES; ++c) {
+        share.addBucket(&tags[c], weights[c], slots);
+    }
+}
+
+const char *IOScheduler::getClassName(io_class_t c) {
+    switch (c) {
+    case IO_CLASS_BGFETCH:
+        return "bgfetch";
+    case IO_CLASS_FLUSHER:
+        return "flusher";
+    case IO_CLASS_BACKFILL:
+        return "backfill";
+    case IO_CLASS_BACKGROUND:
+        return "background";
+    default:
+        return "unknown";
+    }
+}
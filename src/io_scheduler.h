@@ -0,0 +1,117 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_IO_SCHEDULER_H_
+#define SRC_IO_SCHEDULER_H_ 1
+
+#include "config.h"
+
+#include "common.h"
+#include "io_share.h"
+
+/**
+ * The classes of disk IO of a bucket.
+ */
+typedef enum {
+    IO_CLASS_BGFETCH = 0, //!< front-end bg fetches and warmup loads
+    IO_CLASS_FLUSHER,     //!< flush commits
+    IO_CLASS_BACKFILL,    //!< tap backfills from disk
+    IO_CLASS_BACKGROUND,  //!< compaction and access log commits
+    NUM_IO_CLASSES
+} io_class_t;
+
+/**
+ * Shares a bucket's disk IO slots between its classes of IO by weighted
+ * deficit round robin, the way the executor pool's IOShare shares the
+ * process' between the buckets, so the class with the most to do can't
+ * keep the others off the disk.  Each class is charged the time it
+ * holds a slot.
+ *
+ * A thread holds at most one slot of a bucket at a time, and takes it
+ * after the process' slot of the task it runs, if any.
+ */
+class IOScheduler {
+public:
+    IOScheduler() : share(IOShare::defaultQuantum) { }
+
+    /**
+     * Set the number of slots (0 not to share them) and the weight of
+     * each class.
+     */
+    void configure(size_t slots, const size_t weights[NUM_IO_CLASSES]);
+
+    /**
+     * Wait for a slot for IO of the given class.
+     *
+     * @return false if the slots aren't shared, so there's none to release
+     */
+    bool acquire(io_class_t c) {
+        return share.acquire(&tags[c]);
+    }
+
+    /**
+     * Give back a slot of the class.
+     *
+     * @param usec how long it was held
+     */
+    void release(io_class_t c, hrtime_t usec) {
+        share.release(&tags[c], usec);
+    }
+
+    size_t getSlots() {
+        return share.getSlots();
+    }
+
+    //! Get a copy of the share of a class
+    IOShare::Bucket getClass(io_class_t c) {
+        return share.getBucket(&tags[c]);
+    }
+
+    static const char *getClassName(io_class_t c);
+
+private:
+    IOShare share;
+    //! Their addresses stand for the classes in the share
+    char tags[NUM_IO_CLASSES];
+
+    DISALLOW_COPY_AND_ASSIGN(IOScheduler);
+};
+
+/**
+ * Holds a slot of a class of IO while in scope.
+ */
+class IOSlot {
+public:
+    IOSlot(IOScheduler &s, io_class_t c) :
+        scheduler(s), ioClass(c), held(s.acquire(c)), start(gethrtime()) { }
+
+    ~IOSlot() {
+        if (held) {
+            scheduler.release(ioClass, (gethrtime() - start) / 1000);
+        }
+    }
+
+private:
+    IOScheduler &scheduler;
+    io_class_t ioClass;
+    bool held;
+    hrtime_t start;
+
+    DISALLOW_COPY_AND_ASSIGN(IOSlot);
+};
+
+#endif  // SRC_IO_SCHEDULER_H_
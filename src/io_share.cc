@@ -0,0 +1,165 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+
+#include "io_share.h"
+
+const hrtime_t IOShare::defaultQuantum = 10000;
+
+void IOShare::addBucket(const void *bucket, size_t weight, size_t nslots) {
+    LockHolder lh(mutex);
+    std::map<const void*, Bucket>::iterator it = buckets.find(bucket);
+    if (it == buckets.end()) {
+        it = buckets.insert(std::make_pair(bucket, Bucket())).first;
+        order.push_back(bucket);
+    }
+    it->second.weight = std::max(weight, static_cast<size_t>(1));
+    it->second.slots = nslots;
+    updateSlots();
+    grantSlots();
+}
+
+void IOShare::removeBucket(const void *bucket) {
+    LockHolder lh(mutex);
+    std::map<const void*, Bucket>::iterator it = buckets.find(bucket);
+    if (it == buckets.end()) {
+        return;
+    }
+    // Its threads are gone, but anything granted to them goes back.
+    busy -= it->second.running + it->second.tickets;
+    buckets.erase(it);
+    std::vector<const void*>::iterator oit =
+        std::find(order.begin(), order.end(), bucket);
+    size_t idx = oit - order.begin();
+    order.erase(oit);
+    if (turn > idx || turn >= order.size()) {
+        turn = turn > 0 ? turn - 1 : 0;
+    }
+    updateSlots();
+    grantSlots();
+}
+
+void IOShare::updateSlots() {
+    slots = 0;
+    std::map<const void*, Bucket>::iterator it = buckets.begin();
+    for (; it != buckets.end(); ++it) {
+        slots = std::max(slots, it->second.slots);
+    }
+}
+
+void IOShare::grantSlots() {
+    bool granted = false;
+    while (slots > 0 && busy < slots) {
+        bool waiting = false;
+        std::map<const void*, Bucket>::iterator it = buckets.begin();
+        for (; it != buckets.end() && !waiting; ++it) {
+            waiting = it->second.waiting > it->second.tickets;
+        }
+        if (!waiting) {
+            break;
+        }
+
+        Bucket &b = buckets[order[turn]];
+        if (b.waiting > b.tickets && b.deficit > 0) {
+            ++b.tickets;
+            ++b.granted;
+            ++busy;
+            granted = true;
+            continue;
+        }
+        if (b.waiting == b.tickets && b.deficit > 0) {
+            // Credit isn't kept for later.
+            b.deficit = 0;
+        }
+        // Every pass round adds credit to a waiting bucket, so one of
+        // them gets out of debt sooner or later.
+        turn = (turn + 1) % order.size();
+        Bucket &next = buckets[order[turn]];
+        if (next.waiting > next.tickets) {
+            next.deficit += static_cast<int64_t>(quantum * next.weight);
+        }
+    }
+    if (granted) {
+        mutex.notify();
+    }
+}
+
+bool IOShare::claimSlot(Bucket &b) {
+    if (b.tickets == 0) {
+        return false;
+    }
+    --b.tickets;
+    --b.waiting;
+    ++b.running;
+    return true;
+}
+
+bool IOShare::request(const void *bucket) {
+    LockHolder lh(mutex);
+    std::map<const void*, Bucket>::iterator it = buckets.find(bucket);
+    if (slots == 0 || it == buckets.end()) {
+        return false;
+    }
+    ++it->second.waiting;
+    grantSlots();
+    return true;
+}
+
+bool IOShare::claim(const void *bucket) {
+    LockHolder lh(mutex);
+    std::map<const void*, Bucket>::iterator it = buckets.find(bucket);
+    return it != buckets.end() && claimSlot(it->second);
+}
+
+bool IOShare::acquire(const void *bucket) {
+    hrtime_t start = gethrtime();
+    LockHolder lh(mutex);
+    std::map<const void*, Bucket>::iterator it = buckets.find(bucket);
+    if (slots == 0 || it == buckets.end()) {
+        return false;
+    }
+    ++it->second.waiting;
+    grantSlots();
+    while (!claimSlot(it->second)) {
+        mutex.wait();
+    }
+    it->second.waitTime += (gethrtime() - start) / 1000;
+    return true;
+}
+
+void IOShare::release(const void *bucket, hrtime_t usec) {
+    LockHolder lh(mutex);
+    std::map<const void*, Bucket>::iterator it = buckets.find(bucket);
+    if (it == buckets.end() || it->second.running == 0) {
+        return;
+    }
+    Bucket &b = it->second;
+    --b.running;
+    --busy;
+    b.deficit -= static_cast<int64_t>(usec);
+    b.ioTime += usec;
+    grantSlots();
+}
+
+IOShare::Bucket IOShare::getBucket(const void *bucket) {
+    LockHolder lh(mutex);
+    std::map<const void*, Bucket>::iterator it = buckets.find(bucket);
+    return it == buckets.end() ? Bucket() : it->second;
+}
@@ -0,0 +1,148 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_IO_SHARE_H_
+#define SRC_IO_SHARE_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <vector>
+
+#include "common.h"
+#include "locks.h"
+
+/**
+ * Shares a number of slots for running background IO tasks between the
+ * buckets of the process by weighted deficit round robin.
+ *
+ * A bucket's turn lasts as long as it's in credit; each turn adds a
+ * quantum of IO time times its weight to its credit, and the time each of
+ * its tasks took is charged to it once the task is done.  A bucket that
+ * wants no slots gives up the credit it has left, but not its debt, so a
+ * long task is paid for over the turns that follow.
+ */
+class IOShare {
+public:
+    //! The IO time (usec) a turn gives a bucket of weight 1
+    static const hrtime_t defaultQuantum;
+
+    /**
+     * The share of one bucket.
+     */
+    struct Bucket {
+        Bucket() : weight(1), slots(0), deficit(0), waiting(0), tickets(0),
+                   running(0), granted(0), waitTime(0), ioTime(0) {}
+
+        size_t weight;
+        //! The slots the bucket asked for the process to have
+        size_t slots;
+        //! Its IO time credit (usec) for the current turn
+        int64_t deficit;
+        //! Number of its tasks waiting for a slot, granted ones included
+        size_t waiting;
+        //! Number of slots granted to its waiting tasks not claimed yet
+        size_t tickets;
+        //! Number of slots its tasks hold
+        size_t running;
+        //! Number of slots it was ever granted
+        uint64_t granted;
+        //! Total time (usec) its tasks waited for a slot
+        hrtime_t waitTime;
+        //! Total time (usec) its tasks held a slot
+        hrtime_t ioTime;
+    };
+
+    IOShare(hrtime_t q = defaultQuantum) : quantum(q), slots(0), busy(0),
+                                           turn(0) {}
+
+    /**
+     * Add a bucket, or change its share.
+     *
+     * @param bucket the bucket
+     * @param weight its share relative to the others', at least 1
+     * @param nslots the slots it wants the process to have; the process
+     *               has as many as the bucket wanting most wants, and
+     *               none, letting every task run, if none wants any
+     */
+    void addBucket(const void *bucket, size_t weight, size_t nslots);
+
+    void removeBucket(const void *bucket);
+
+    /**
+     * Queue a task of a bucket for a slot.
+     *
+     * @return false if the slots aren't shared, and the task needn't wait
+     */
+    bool request(const void *bucket);
+
+    /**
+     * Claim a slot granted to a task of the bucket queued with request().
+     *
+     * @return false if none is granted yet
+     */
+    bool claim(const void *bucket);
+
+    /**
+     * Wait for a slot for a task of the bucket.
+     *
+     * @return false if the slots aren't shared, so there's none to release
+     */
+    bool acquire(const void *bucket);
+
+    /**
+     * Give back a slot of the bucket.
+     *
+     * @param usec the IO time the task holding it took
+     */
+    void release(const void *bucket, hrtime_t usec);
+
+    /**
+     * Get a copy of a bucket's share.
+     */
+    Bucket getBucket(const void *bucket);
+
+    size_t getSlots() {
+        LockHolder lh(mutex);
+        return slots;
+    }
+
+private:
+
+    //! Grant the free slots to the waiting tasks; mutex must be held
+    void grantSlots();
+
+    //! Take a granted slot if there is one; mutex must be held
+    bool claimSlot(Bucket &b);
+
+    void updateSlots();
+
+    SyncObject mutex;
+    const hrtime_t quantum;
+    std::map<const void*, Bucket> buckets;
+    //! The buckets in the order they take turns
+    std::vector<const void*> order;
+    size_t slots;
+    //! Number of slots granted, claimed or not
+    size_t busy;
+    //! Index in order of the bucket whose turn it is
+    size_t turn;
+
+    DISALLOW_COPY_AND_ASSIGN(IOShare);
+};
+
+#endif  // SRC_IO_SHARE_H_
@@ -20,9 +20,12 @@
 #include <string>
 
 #include "bgfetcher.h"
+#include "compactor.h"
 #include "ep_engine.h"
 #include "flusher.h"
 #include "iomanager/iomanager.h"
+#include "tapapplier.h"
+#include "vbucket_owners.h"
 
 Mutex IOManager::initGuard;
 IOManager *IOManager::instance = NULL;
@@ -40,18 +43,24 @@ IOManager *IOManager::get() {
 size_t IOManager::scheduleFlusherTask(EventuallyPersistentEngine *engine,
                                       Flusher* flusher,
                                       const Priority &priority, int sid) {
-    int writers = engine->getWorkLoadPolicy().calculateNumWriters();
     ExTask task = new FlusherTask(engine, flusher, priority);
     flusher->setTaskId(task->getId());
-    return schedule(task, (sid % writers));
+    return schedule(task, WRITER_TASK_IDX, sid);
+}
+
+size_t IOManager::scheduleCompactor(EventuallyPersistentEngine *engine,
+                                    Compactor *compactor,
+                                    const Priority &priority, int sid) {
+    ExTask task = new CompactorTask(engine, compactor, priority);
+    compactor->setTaskId(task->getId());
+    return schedule(task, WRITER_TASK_IDX, sid);
 }
 
 size_t IOManager::scheduleVBSnapshot(EventuallyPersistentEngine *engine,
                                      const Priority &priority, int sid,
                                      int, bool isDaemon) {
-    int writers = engine->getWorkLoadPolicy().calculateNumWriters();
     ExTask task = new VBSnapshotTask(engine, priority, sid, isDaemon);
-    return schedule(task, (sid % writers));
+    return schedule(task, WRITER_TASK_IDX, sid);
 }
 
 size_t IOManager::scheduleVBDelete(EventuallyPersistentEngine *engine,
@@ -59,32 +68,55 @@ size_t IOManager::scheduleVBDelete(EventuallyPersistentEngine *engine,
                                    const Priority &priority, int sid,
                                    bool recreate, int sleeptime,
                                    bool isDaemon) {
-    int writers = engine->getWorkLoadPolicy().calculateNumWriters();
     ExTask task = new VBDeleteTask(engine, vbucket, cookie, priority, recreate,
                                    sleeptime, isDaemon);
-    return schedule(task, (sid % writers));
+    return schedule(task, WRITER_TASK_IDX, sid);
 }
 
 size_t IOManager::scheduleStatsSnapshot(EventuallyPersistentEngine *engine,
                                         const Priority &priority, int sid,
                                         bool runOnce, int sleeptime,
                                         bool isDaemon, bool blockShutdown) {
-    int writers = engine->getWorkLoadPolicy().calculateNumWriters();
     ExTask task = new StatSnap(engine, priority, runOnce, sleeptime,
                                isDaemon, blockShutdown);
-    return schedule(task, (sid % writers));
+    return schedule(task, AUXIO_TASK_IDX, sid);
 }
 
 size_t IOManager::scheduleMultiBGFetcher(EventuallyPersistentEngine *engine,
                                          BgFetcher *b, const Priority &priority,
                                          int sid, int sleeptime, bool isDaemon,
                                          bool blockShutdown) {
-    int writers = engine->getWorkLoadPolicy().calculateNumWriters();
-    int readers = engine->getWorkLoadPolicy().calculateNumReaders();
     ExTask task = new BgFetcherTask(engine, b, priority, sleeptime,
                                     isDaemon, blockShutdown);
     b->setTaskId(task->getId());
-    return schedule(task, writers + (sid % readers));
+    return schedule(task, READER_TASK_IDX, sid);
+}
+
+size_t IOManager::scheduleTapApply(EventuallyPersistentEngine *engine,
+                                   TapApplier *applier,
+                                   const Priority &priority, int sid,
+                                   bool isDaemon, bool blockShutdown) {
+    ExTask task = new TapApplyTask(engine, applier, sid, priority,
+                                   isDaemon, blockShutdown);
+    applier->setTaskId(sid, task->getId());
+    return schedule(task, NONIO_TASK_IDX, sid);
+}
+
+size_t IOManager::scheduleVBucketOwner(EventuallyPersistentEngine *engine,
+                                       VBucketOwners *owners,
+                                       const Priority &priority, int sid,
+                                       bool isDaemon, bool blockShutdown) {
+    ExTask task = new VBucketOwnerTask(engine, owners, sid, priority,
+                                       isDaemon, blockShutdown);
+    owners->setTaskId(sid, task->getId());
+    return schedule(task, NONIO_TASK_IDX, sid);
+}
+
+size_t IOManager::scheduleShardVisit(EventuallyPersistentEngine *engine,
+                                     shared_ptr<VBCBAdaptor> adaptor,
+                                     const Priority &priority, int sid) {
+    ExTask task = new VBCBShardTask(engine, adaptor, sid, priority);
+    return schedule(task, NONIO_TASK_IDX, sid);
 }
 
 size_t IOManager::scheduleVKeyFetch(EventuallyPersistentEngine *engine,
@@ -93,12 +125,19 @@ size_t IOManager::scheduleVKeyFetch(EventuallyPersistentEngine *engine,
                                     const Priority &priority, int sid,
                                     int sleeptime, size_t delay, bool isDaemon,
                                     bool blockShutdown) {
-    int writers = engine->getWorkLoadPolicy().calculateNumWriters();
-    int readers = engine->getWorkLoadPolicy().calculateNumReaders();
     ExTask task = new VKeyStatBGFetchTask(engine, key, vbid, seqNum, cookie,
                                           priority, sleeptime, delay, isDaemon,
                                           blockShutdown);
-    return schedule(task, writers + (sid % readers));
+    return schedule(task, READER_TASK_IDX, sid);
+}
+
+size_t IOManager::scheduleRangeScan(EventuallyPersistentEngine *engine,
+                                    RangeScan *scan, const void *cookie,
+                                    const Priority &priority, int sid,
+                                    bool isDaemon, bool blockShutdown) {
+    ExTask task = new RangeScanTask(engine, scan, cookie, priority, isDaemon,
+                                    blockShutdown);
+    return schedule(task, READER_TASK_IDX, sid);
 }
 
 size_t IOManager::scheduleBGFetch(EventuallyPersistentEngine *engine,
@@ -107,10 +146,16 @@ size_t IOManager::scheduleBGFetch(EventuallyPersistentEngine *engine,
                                   bool isMeta, const Priority &priority,
                                   int sid, int sleeptime, size_t delay,
                                   bool isDaemon, bool blockShutdown) {
-    int writers = engine->getWorkLoadPolicy().calculateNumWriters();
-    int readers = engine->getWorkLoadPolicy().calculateNumReaders();
     ExTask task = new BGFetchTask(engine, key, vbid, seqNum, cookie, isMeta,
                                   priority, sleeptime, delay, isDaemon,
                                   blockShutdown);
-    return schedule(task, writers + (sid % readers));
+    return schedule(task, READER_TASK_IDX, sid);
+}
+
+size_t IOManager::scheduleDispatcherTask(EventuallyPersistentEngine *engine,
+                                         Dispatcher &d, TaskId &task,
+                                         const Priority &priority,
+                                         task_type_t group) {
+    ExTask etask = new DispatcherTask(engine, d, task, priority);
+    return schedule(etask, group, 0);
 }
@@ -22,10 +22,11 @@
 
 #include <string>
 
+#include "dispatcher.h"
 #include "scheduler.h"
 #include "tasks.h"
 
-class IOManager : public ExecutorPool {
+class IOManager : public ExecutorPool, public DispatcherExecutor {
 public:
     static IOManager *get();
 
@@ -33,6 +34,10 @@ public:
                                Flusher* flusher, const Priority &priority,
                                int sid);
 
+    size_t scheduleCompactor(EventuallyPersistentEngine *engine,
+                             Compactor *compactor, const Priority &priority,
+                             int sid);
+
     size_t scheduleVBSnapshot(EventuallyPersistentEngine *engine,
                               const Priority &priority, int sid,
                               int sleeptime = 0, bool isDaemon = false);
@@ -69,6 +74,56 @@ public:
                            size_t delay = 0, bool isDaemon = false,
                            bool blockShutdown = false);
 
+    size_t scheduleRangeScan(EventuallyPersistentEngine *engine,
+                             RangeScan *scan, const void *cookie,
+                             const Priority &priority, int sid,
+                             bool isDaemon = false,
+                             bool blockShutdown = false);
+
+    size_t scheduleTapApply(EventuallyPersistentEngine *engine,
+                            TapApplier *applier, const Priority &priority,
+                            int sid, bool isDaemon = false,
+                            bool blockShutdown = false);
+
+    /**
+     * Schedule the task running a shard's front-end ops.  It always runs
+     * on the same non-IO thread.
+     */
+    size_t scheduleVBucketOwner(EventuallyPersistentEngine *engine,
+                                VBucketOwners *owners,
+                                const Priority &priority, int sid,
+                                bool isDaemon = false,
+                                bool blockShutdown = false);
+
+    /**
+     * Schedule the visit of a shard's vbuckets on the non-IO threads.
+     */
+    size_t scheduleShardVisit(EventuallyPersistentEngine *engine,
+                              shared_ptr<VBCBAdaptor> adaptor,
+                              const Priority &priority, int sid);
+
+    /**
+     * Schedule a Dispatcher's task on a group of threads.  A dispatcher's
+     * tasks all go to the first thread of the group, so they keep running
+     * one at a time.
+     */
+    size_t scheduleDispatcherTask(EventuallyPersistentEngine *engine,
+                                  Dispatcher &d, TaskId &task,
+                                  const Priority &priority,
+                                  task_type_t group);
+
+    void wakeDispatcherTask(size_t id) {
+        wake(id);
+    }
+
+    void snoozeDispatcherTask(size_t id, double secs) {
+        snooze(id, secs);
+    }
+
+    void cancelDispatcherTask(size_t id) {
+        cancel(id);
+    }
+
     IOManager(int ro = 0, int wo = 0)
         : ExecutorPool(ro, wo) {}
 
@@ -17,12 +17,87 @@
 
 #include "config.h"
 
+
+#include <vector>
+
+#ifdef HAVE_LIBSNAPPY
+#include <snappy-c.h>
+#endif
+
 #include "item.h"
 #include "tools/cJSON.h"
 
-Atomic<uint64_t> Item::casCounter(1);
+HybridLogicalClock Item::clock;
+Atomic<uint64_t> HybridLogicalClock::maxDrift(0);
 const uint32_t Item::metaDataSize(2 * sizeof(uint32_t) + 2 * sizeof(uint64_t) + 2);
 
+#ifdef HAVE_LIBSNAPPY
+Blob *Blob::NewCompressed(const char *start, const size_t len) {
+    size_t clen = snappy_max_compressed_length(len);
+    std::vector<char> buf(clen);
+    if (snappy_compress(start, len, &buf[0], &clen) != SNAPPY_OK ||
+        clen >= len) {
+        return NULL;
+    }
+    return New(&buf[0], clen, BLOB_DATATYPE_SNAPPY);
+}
+
+Blob *Blob::uncompress() const {
+    size_t len;
+    if (snappy_uncompressed_length(data, size, &len) != SNAPPY_OK) {
+        return NULL;
+    }
+    Blob *b = New(len);
+    if (snappy_uncompress(data, size, const_cast<char*>(b->getData()),
+                          &len) != SNAPPY_OK) {
+        destroy(b);
+        return NULL;
+    }
+    return b;
+}
+
+bool Blob::isCompressionAvailable() {
+    return true;
+}
+#else
+Blob *Blob::NewCompressed(const char *, const size_t) {
+    return NULL;
+}
+
+Blob *Blob::uncompress() const {
+    return NULL;
+}
+
+bool Blob::isCompressionAvailable() {
+    return false;
+}
+#endif
+
+bool Item::compressValue() {
+    if (value.get() == NULL || value->isCompressed() ||
+        value->length() < MIN_COMPRESSIBLE_VALUE_SIZE) {
+        return false;
+    }
+    Blob *compressed = Blob::NewCompressed(value->getData(), value->length());
+    if (compressed == NULL) {
+        return false;
+    }
+    value.reset(compressed);
+    return true;
+}
+
+bool Item::decompressValue() {
+    if (value.get() == NULL || !value->isCompressed()) {
+        return true;
+    }
+    Blob *raw = value->uncompress();
+    if (raw == NULL) {
+        return false;
+    }
+    value.reset(raw);
+    return true;
+}
+
 bool Item::append(const Item &i) {
     assert(value.get() != NULL);
     assert(i.getValue().get() != NULL);
@@ -52,3 +127,142 @@ bool Item::prepend(const Item &i) {
     value.reset(newData);
     return true;
 }
+
+bool DeferredBlobRefs::enabled = false;
+
+/**
+ * The references one thread has dropped but not yet given back, along
+ * with the engine each one was dropped under.
+ */
+struct DeferredRefCache {
+    DeferredRefCache() : used(0), nextVictim(0) { }
+
+    SpinLock lock;
+    size_t used;
+    size_t nextVictim;
+    const Blob *blobs[DEFERRED_BLOB_REFS];
+    EventuallyPersistentEngine *engines[DEFERRED_BLOB_REFS];
+};
+
+extern "C" {
+    static void releaseThreadCache(void *arg);
+}
+
+static ThreadLocal<DeferredRefCache*> *threadCaches;
+static Mutex *registryLock;
+static std::vector<DeferredRefCache*> *registry;
+
+/**
+ * Link hook for getting the deferred reference caches set up before
+ * anything can drop a value.
+ */
+class DeferredRefsInstaller {
+public:
+    DeferredRefsInstaller() {
+        if (threadCaches == NULL) {
+            threadCaches = new ThreadLocal<DeferredRefCache*>(releaseThreadCache);
+            registryLock = new Mutex();
+            registry = new std::vector<DeferredRefCache*>();
+        }
+    }
+} deferredRefsInstaller;
+
+/**
+ * Really drop a reference, freeing the value under the engine it was
+ * dropped under if that was the last one.
+ */
+static void giveBack(const Blob *b, EventuallyPersistentEngine *engine) {
+    if (RCValueRefs::release(b)) {
+        EventuallyPersistentEngine *old =
+            ObjectRegistry::onSwitchThread(engine, true);
+        Blob::destroy(const_cast<Blob*>(b));
+        ObjectRegistry::onSwitchThread(old);
+    }
+}
+
+static void releaseThreadCache(void *arg) {
+    DeferredRefCache *cache = static_cast<DeferredRefCache*>(arg);
+    {
+        LockHolder lh(*registryLock);
+        registry->erase(std::remove(registry->begin(), registry->end(), cache),
+                        registry->end());
+    }
+    for (size_t i = 0; i < cache->used; ++i) {
+        giveBack(cache->blobs[i], cache->engines[i]);
+    }
+    delete cache;
+}
+
+bool DeferredBlobRefs::reclaim(const Blob *b) {
+    DeferredRefCache *cache = threadCaches->get();
+    if (cache == NULL) {
+        return false;
+    }
+    SpinLockHolder lh(&cache->lock);
+    for (size_t i = cache->used; i > 0; --i) {
+        if (cache->blobs[i - 1] == b) {
+            --cache->used;
+            cache->blobs[i - 1] = cache->blobs[cache->used];
+            cache->engines[i - 1] = cache->engines[cache->used];
+            return true;
+        }
+    }
+    return false;
+}
+
+void DeferredBlobRefs::defer(const Blob *b) {
+    DeferredRefCache *cache = threadCaches->get();
+    if (cache == NULL) {
+        cache = new DeferredRefCache();
+        threadCaches->set(cache);
+        LockHolder lh(*registryLock);
+        registry->push_back(cache);
+    }
+
+    EventuallyPersistentEngine *engine = ObjectRegistry::getCurrentEngine();
+    SpinLockHolder lh(&cache->lock);
+    if (cache->used < DEFERRED_BLOB_REFS) {
+        cache->blobs[cache->used] = b;
+        cache->engines[cache->used] = engine;
+        ++cache->used;
+        return;
+    }
+
+    // Full; make room by giving back one of the older references.
+    size_t victim = cache->nextVictim;
+    cache->nextVictim = (victim + 1) % DEFERRED_BLOB_REFS;
+    const Blob *old = cache->blobs[victim];
+    EventuallyPersistentEngine *oldEngine = cache->engines[victim];
+    cache->blobs[victim] = b;
+    cache->engines[victim] = engine;
+    lh.unlock();
+    giveBack(old, oldEngine);
+}
+
+void DeferredBlobRefs::flush(EventuallyPersistentEngine *engine) {
+    std::vector<const Blob*> blobs;
+    {
+        LockHolder lh(*registryLock);
+        std::vector<DeferredRefCache*>::iterator it;
+        for (it = registry->begin(); it != registry->end(); ++it) {
+            DeferredRefCache *cache = *it;
+            SpinLockHolder sl(&cache->lock);
+            size_t kept = 0;
+            for (size_t i = 0; i < cache->used; ++i) {
+                if (cache->engines[i] == engine) {
+                    blobs.push_back(cache->blobs[i]);
+                } else {
+                    cache->blobs[kept] = cache->blobs[i];
+                    cache->engines[kept] = cache->engines[i];
+                    ++kept;
+                }
+            }
+            cache->used = kept;
+        }
+    }
+
+    std::vector<const Blob*>::iterator it;
+    for (it = blobs.begin(); it != blobs.end(); ++it) {
+        giveBack(*it, engine);
+    }
+}
@@ -27,11 +27,21 @@
 #include <string>
 
 #include "atomic.h"
+#include "hlc.h"
 #include "locks.h"
 #include "mutex.h"
 #include "objectregistry.h"
+#include "slab_allocator.h"
 #include "stats.h"
 
+//! A value holding the bytes as they were stored
+const uint8_t BLOB_DATATYPE_RAW = 0x00;
+//! A Snappy-compressed value
+const uint8_t BLOB_DATATYPE_SNAPPY = 0x01;
+
+// Values shorter than this aren't worth compressing
+const size_t MIN_COMPRESSIBLE_VALUE_SIZE = 128;
+
 /**
  * A blob is a minimal sized storage for data up to 2^32 bytes long.
  */
@@ -48,13 +58,29 @@ public:
      *
      * @return the new Blob instance
      */
-    static Blob* New(const char *start, const size_t len) {
+    static Blob* New(const char *start, const size_t len,
+                     uint8_t datatype = BLOB_DATATYPE_RAW) {
         size_t total_len = len + sizeof(Blob);
-        Blob *t = new (::operator new(total_len)) Blob(start, len);
+        uint8_t slabClass;
+        void *mem = SlabAllocator::allocate(total_len, slabClass);
+        Blob *t = new (mem) Blob(start, len, slabClass, datatype);
         assert(t->length() == len);
         return t;
     }
 
+    /**
+     * Create a new Snappy-compressed Blob of the given data.
+     *
+     * @return the new Blob, or NULL if compression isn't available or
+     *         wouldn't make the value any smaller
+     */
+    static Blob* NewCompressed(const char *start, const size_t len);
+
+    /**
+     * True if Blobs can be compressed at all in this build.
+     */
+    static bool isCompressionAvailable();
+
     /**
      * Create a new Blob holding the contents of the given string.
      *
@@ -75,7 +101,9 @@ public:
      */
     static Blob* New(const size_t len) {
         size_t total_len = len + sizeof(Blob);
-        Blob *t = new (::operator new(total_len)) Blob(len);
+        uint8_t slabClass;
+        void *mem = SlabAllocator::allocate(total_len, slabClass);
+        Blob *t = new (mem) Blob(len, slabClass);
         assert(t->length() == len);
         return t;
     }
@@ -110,10 +138,38 @@ public:
         return std::string(data, size);
     }
 
-    // This is necessary for making C++ happy when I'm doing a
-    // placement new on fairly "normal" c++ heap allocations, just
-    // with variable-sized objects.
-    void operator delete(void* p) { ::operator delete(p); }
+    /**
+     * Get the format the data is in (a BLOB_DATATYPE_* value).
+     */
+    uint8_t getDataType() const {
+        return datatype;
+    }
+
+    bool isCompressed() const {
+        return datatype == BLOB_DATATYPE_SNAPPY;
+    }
+
+    /**
+     * Create a new raw Blob holding this one's data uncompressed.
+     *
+     * @return the new Blob, or NULL if the data can't be uncompressed
+     */
+    Blob* uncompress() const;
+
+    /**
+     * Free a Blob made by one of the New()s.
+     *
+     * Its slab class and size are read before it's destroyed, as its
+     * members can't be read once it is.
+     */
+    static void destroy(Blob *b) {
+        if (b != NULL) {
+            uint8_t slab = b->slabClass;
+            size_t len = b->getSize();
+            b->~Blob();
+            SlabAllocator::release(b, slab, len);
+        }
+    }
 
     ~Blob() {
         ObjectRegistry::onDeleteBlob(this);
@@ -121,15 +177,21 @@ public:
 
 private:
 
-    explicit Blob(const char *start, const size_t len) :
-        size(static_cast<uint32_t>(len))
+    // Blobs are variable-sized, so they're freed with destroy(); this is
+    // never defined, so a plain delete of one doesn't build.
+    void operator delete(void*);
+
+    explicit Blob(const char *start, const size_t len, uint8_t slab,
+                  uint8_t dtype) :
+        size(static_cast<uint32_t>(len)), slabClass(slab), datatype(dtype)
     {
         std::memcpy(data, start, len);
         ObjectRegistry::onCreateBlob(this);
     }
 
-    explicit Blob(const size_t len) :
-        size(static_cast<uint32_t>(len))
+    explicit Blob(const size_t len, uint8_t slab) :
+        size(static_cast<uint32_t>(len)), slabClass(slab),
+        datatype(BLOB_DATATYPE_RAW)
     {
 #ifdef VALGRIND
         memset(data, 0, len);
@@ -138,12 +200,78 @@ private:
     }
 
     const uint32_t size;
+    const uint8_t slabClass;   //!< Where the memory came from (0 = heap)
+    const uint8_t datatype;
     char data[1];
 
     DISALLOW_COPY_AND_ASSIGN(Blob);
 };
 
-typedef SingleThreadedRCPtr<Blob> value_t;
+// Number of dropped Blob references each thread may hold on to.
+const size_t DEFERRED_BLOB_REFS = 16;
+
+/**
+ * Reference policy for values that lets each thread sit on the last
+ * few Blob references it dropped instead of decrementing the shared
+ * count right away.
+ *
+ * Hot values are copied in and out of Items on every get and on every
+ * TAP send, so without this each of those touches the Blob's count
+ * from whatever core happens to be serving it.  With it, a thread that
+ * takes a reference to a value it recently dropped simply reclaims the
+ * deferred one and the count isn't touched at all.
+ *
+ * Deferred references are real references, so nothing is freed early;
+ * values are just freed a little later.  They're given back when the
+ * thread's cache overflows, when the thread exits and when the engine
+ * they were dropped under goes away.
+ */
+class DeferredBlobRefs {
+public:
+    static void acquire(const Blob *b) {
+        if (!enabled || !reclaim(b)) {
+            RCValueRefs::acquire(b);
+        }
+    }
+
+    static bool release(const Blob *b) {
+        if (!enabled) {
+            return RCValueRefs::release(b);
+        }
+        defer(b);
+        return false;
+    }
+
+    static void destroy(Blob *b) {
+        Blob::destroy(b);
+    }
+
+    /**
+     * Turn deferral on or off.  Already deferred references are kept
+     * until they'd have been given back anyway.
+     */
+    static void setEnabled(bool to) {
+        enabled = to;
+    }
+
+    static bool isEnabled() {
+        return enabled;
+    }
+
+    /**
+     * Give back every deferred reference dropped under the given
+     * engine, on all threads.
+     */
+    static void flush(EventuallyPersistentEngine *engine);
+
+private:
+    static bool reclaim(const Blob *b);
+    static void defer(const Blob *b);
+
+    static bool enabled;
+};
+
+typedef SingleThreadedRCPtr<Blob, DeferredBlobRefs> value_t;
 
 const uint64_t DEFAULT_REV_SEQ_NUM = 1;
 
@@ -172,7 +300,7 @@ public:
  * core and the backend. Please note that the kvstore don't store these
  * objects, so we do have an extra layer of memory copying :(
  */
-class Item {
+class Item : public SlabObject {
 public:
     Item(const void* k, const size_t nk, const size_t nb,
          const uint32_t fl, const time_t exp, uint64_t theCas = 0,
@@ -217,6 +345,16 @@ public:
         ObjectRegistry::onCreateItem(this);
     }
 
+    Item(const void *k, uint16_t nk, const uint32_t fl, const time_t exp,
+         const value_t &val, uint64_t theCas = 0, int64_t i = -1,
+         uint16_t vbid = 0, uint64_t sno = 1) :
+         metaData(theCas, sno, fl, exp), value(val), id(i), vbucketId(vbid)
+    {
+        assert(id != 0);
+        key.assign(static_cast<const char*>(k), nk);
+        ObjectRegistry::onCreateItem(this);
+    }
+
     ~Item() {
         ObjectRegistry::onDeleteItem(this);
     }
@@ -265,10 +403,6 @@ public:
         return metaData.cas;
     }
 
-    void setCas() {
-        metaData.cas = nextCas();
-    }
-
     void setCas(uint64_t ncas) {
         metaData.cas = ncas;
     }
@@ -285,6 +419,21 @@ public:
         metaData.exptime = exp_time;
     }
 
+    /**
+     * Replace this item's value with a compressed copy if that makes
+     * it smaller.
+     *
+     * @return true if the value is now compressed
+     */
+    bool compressValue();
+
+    /**
+     * Make sure this item's value isn't compressed.
+     *
+     * @return false if the value couldn't be uncompressed
+     */
+    bool decompressValue();
+
     /**
      * Append another item to this item
      *
@@ -345,17 +494,17 @@ public:
         return metaData;
     }
 
+    /**
+     * Get a cas for a mutation that has no vbucket at hand to get one
+     * from (see HashTable::nextCas()).
+     */
     static uint64_t nextCas(void) {
-        uint64_t ret = gethrtime();
-        if ((ret & 1000) == 0) {
-            // we don't have a good enough resolution on the clock
-            ret |= casCounter++;
-            if (casCounter > 1000) {
-                casCounter = 1;
-            }
-        }
+        return clock.nextCas();
+    }
 
-        return ret;
+    //! The wall clock time of an hlc cas, in microseconds
+    static uint64_t casTime(uint64_t cas) {
+        return cas / 1000;
     }
 
 private:
@@ -381,7 +530,7 @@ private:
     int64_t id;
     uint16_t vbucketId;
 
-    static Atomic<uint64_t> casCounter;
+    static HybridLogicalClock clock;
     static const uint32_t metaDataSize;
     DISALLOW_COPY_AND_ASSIGN(Item);
 };
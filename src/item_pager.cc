@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <limits>
@@ -30,10 +31,81 @@
 #include "item_pager.h"
 
 static const size_t MAX_PERSISTENCE_QUEUE_SIZE = 1000000;
+//! Seconds between the steps of a quota shrink
+static const double SHRINK_STEP_INTERVAL = 0.1;
+//! Steps of a quota shrink that may free nothing before it gives up
+static const size_t MAX_STALLED_SHRINK_STEPS = 50;
+
+/**
+ * Get the share of the memory that ejecting items can free which has to go
+ * to get memory usage down to the low watermark.  Checkpoints hold their
+ * memory until their cursors move on, however many values are ejected.
+ */
+static double getEvictionRatio(EPStats &stats, double current) {
+    double lower = static_cast<double>(stats.mem_low_wat);
+    double checkpoints = static_cast<double>(stats.checkpointMemory.get());
+    double evictable = current - checkpoints;
+    if (evictable <= 0) {
+        return 1.0;
+    }
+    return std::min((current - lower) / evictable, 1.0);
+}
+
+//! What a PagingVisitor is freeing memory for
+enum paging_mode_t {
+    //! To get memory use down to the low watermark
+    PAGE_FOR_WATERMARKS,
+    //! A step of shrinking to a smaller quota (see ItemPager::quotaChanged)
+    PAGE_FOR_QUOTA_SHRINK,
+    //! To get the vbuckets over VBucket::getMemQuota() back under it
+    PAGE_FOR_VB_QUOTA
+};
+
+/**
+ * A pager run: one PagingVisitor per shard, the shards visited at the
+ * same time on the non-IO threads.  The run is over once the last of
+ * them completes, and once one of them finds memory below the low
+ * watermark the others stop freeing too.
+ */
+class PagingRun {
+public:
+    PagingRun(Atomic<bool> &avail, EvictionPolicy *pol, size_t n) :
+        available(avail), policy(pol), remaining(n), belowLowWat(false) { }
+
+    void reachedLowWatermark() {
+        belowLowWat.set(true);
+    }
+
+    bool isBelowLowWatermark() {
+        return belowLowWat.get();
+    }
+
+    //! Called as each of the run's visitors completes.
+    void visitorComplete() {
+        if (remaining.decr(1) == 0) {
+            if (policy) {
+                policy->runComplete(!belowLowWat.get());
+            }
+            available.set(true);
+        }
+    }
+
+private:
+    Atomic<bool> &available;
+    EvictionPolicy *policy;
+    Atomic<size_t> remaining;
+    Atomic<bool> belowLowWat;
+
+    DISALLOW_COPY_AND_ASSIGN(PagingRun);
+};
 
 /**
  * As part of the ItemPager, visit all of the objects in memory and
  * eject some within a constrained probability
+ *
+ * The item pager sweeps each vbucket's hash table only until that
+ * vbucket's share of the memory to free has been ejected; the next run
+ * carries on from there.
  */
 class PagingVisitor : public VBucketVisitor {
 public:
@@ -45,18 +117,26 @@ public:
      * @param s the store that will handle the bulk removal
      * @param st the stats where we'll track what we've done
      * @param pcnt percentage of objects to attempt to evict (0-1)
-     * @param sfin pointer to a bool to be set to true after run completes
+     * @param r the run the visitor is part of
      * @param pause flag indicating if PagingVisitor can pause between vbucket visits
      * @param bias active vbuckets eviction probability bias multiplier (0-1)
-     * @param phase pointer to an item_pager_phase to be set
+     * @param pol the policy choosing what to evict (NULL to only expire)
+     * @param recent where to remember the hot values ejected (or NULL)
+     * @param m what the memory is freed for; a quota shrink ejects the
+     *          given share of every vbucket as it is, and a vbucket quota
+     *          run only ejects from the vbuckets over it, what's over
      */
     PagingVisitor(EventuallyPersistentStore &s, EPStats &st, double pcnt,
-                  bool *sfin, bool pause = false,
-                  double bias = 1, item_pager_phase *phase = NULL)
+                  shared_ptr<PagingRun> r, bool pause = false,
+                  double bias = 1, EvictionPolicy *pol = NULL,
+                  RecentEvictions *recent = NULL,
+                  paging_mode_t m = PAGE_FOR_WATERMARKS)
       : store(s), stats(st), percent(pcnt),
         activeBias(bias), ejected(0), totalEjected(0), totalEjectionAttempts(0),
-        startTime(ep_real_time()), stateFinalizer(sfin), canPause(pause),
-        completePhase(true), pager_phase(phase) {}
+        startTime(ep_real_time()), run(r), canPause(pause),
+        policy(pol), recentEvictions(recent),
+        mode(m), bucketTarget(0), freedInBucket(0),
+        seed(static_cast<unsigned int>(gethrtime())) {}
 
     void visit(StoredValue *v) {
         // Remember expired objects -- we're going to delete them.
@@ -66,19 +146,18 @@ public:
         }
 
         // return if not ItemPager, which uses valid eviction percentage
-        if (percent <= 0 || !pager_phase) {
+        if (percent <= 0 || !policy) {
             return;
         }
 
-        // always evict unreferenced items, or randomly evict referenced item
-        double r = *pager_phase == PAGING_UNREFERENCED ?
-            1 : static_cast<double>(std::rand()) / static_cast<double>(RAND_MAX);
-
-        if (*pager_phase == PAGING_UNREFERENCED && v->getNRUValue() == MAX_NRU_VALUE) {
-            doEviction(v);
-        } else if (*pager_phase == PAGING_RANDOM && v->incrNRUValue() == MAX_NRU_VALUE &&
-                   r <= percent) {
-            doEviction(v);
+        // A value taken before it aged out was still in use.
+        bool hot = v->isHot() || v->getNRUValue() < MAX_NRU_VALUE;
+        // The sweep stops once the vbucket's share is freed, so whatever
+        // the policy would eject goes.  Ejecting only a random percent of
+        // those would leave the sweep short of the share, walking on
+        // through the whole table.
+        if (policy->shouldEvict(v, 1.0, seed)) {
+            doEviction(v, hot);
         }
     }
 
@@ -86,26 +165,54 @@ public:
         update();
 
         // fast path for expiry item pager
-        if (percent <= 0 || !pager_phase) {
-            return VBucketVisitor::visitBucket(vb);
+        if (percent <= 0 || !policy) {
+            if (!vb->ht.hasExpiryIndex()) {
+                return VBucketVisitor::visitBucket(vb);
+            }
+            // Only look at the items the index has due by now.
+            if (VBucketVisitor::visitBucket(vb)) {
+                vb->ht.visitExpiring(*this, startTime);
+            }
+            return false;
+        }
+
+        if (mode == PAGE_FOR_VB_QUOTA) {
+            return visitOverQuota(vb);
+        }
+
+        if (run->isBelowLowWatermark()) {
+            return false;
         }
 
         // skip active vbuckets if active resident ratio is lower than replica
         double current = static_cast<double>(stats.getTotalMemoryUsed());
         double lower = static_cast<double>(stats.mem_low_wat);
         double high = static_cast<double>(stats.mem_high_wat);
-        if (vb->getState() == vbucket_state_active && current < high &&
+        if (mode != PAGE_FOR_QUOTA_SHRINK &&
+            vb->getState() == vbucket_state_active &&
+            current < high &&
             store.cachedResidentRatio.activeRatio < store.cachedResidentRatio.replicaRatio)
         {
             return false;
         }
 
         if (current > lower) {
-            double p = (current - static_cast<double>(lower)) / current;
-            adjustPercent(p, vb->getState());
-            return VBucketVisitor::visitBucket(vb);
+            if (mode != PAGE_FOR_QUOTA_SHRINK) {
+                adjustPercent(getEvictionRatio(stats, current), vb->getState());
+            }
+            if (!VBucketVisitor::visitBucket(vb)) {
+                return false;
+            }
+            // Free this vbucket's share, picking up the sweep where the
+            // last run left it, rather than walking the whole table.
+            double cached = static_cast<double>(vb->ht.cacheSize.get());
+            bucketTarget = static_cast<size_t>(cached * percent);
+            freedInBucket = 0;
+            vb->ht.sweepInline(*this, vb->ht.getSize());
+            evictItems(vb);
+            return false;
         } else { // stop eviction whenever memory usage is below low watermark
-            completePhase = false;
+            run->reachedLowWatermark();
             return false;
         }
     }
@@ -127,6 +234,10 @@ public:
         expired.clear();
     }
 
+    bool shouldContinue() {
+        return !policy || freedInBucket < bucketTarget;
+    }
+
     bool pauseVisitor() {
         size_t queueSize = stats.diskQueueSize.get();
         return canPause && queueSize >= MAX_PERSISTENCE_QUEUE_SIZE;
@@ -134,17 +245,7 @@ public:
 
     void complete() {
         update();
-        if (stateFinalizer) {
-            *stateFinalizer = true;
-        }
-
-        if (pager_phase && completePhase) {
-            if (*pager_phase == PAGING_UNREFERENCED) {
-                *pager_phase = PAGING_RANDOM;
-            } else {
-                *pager_phase = PAGING_UNREFERENCED;
-            }
-        }
+        run->visitorComplete();
     }
 
     /**
@@ -164,6 +265,32 @@ public:
     size_t getTotalEjectionAttempts() { return totalEjectionAttempts; }
 
 private:
+    //! Eject what a vbucket holds over its quota, if it's over.
+    bool visitOverQuota(RCPtr<VBucket> &vb) {
+        size_t used = vb->getMemoryUsage();
+        size_t quota = VBucket::getMemQuota();
+        double cached = static_cast<double>(vb->ht.cacheSize.get());
+        if (used <= quota || cached <= 0 || !VBucketVisitor::visitBucket(vb)) {
+            return false;
+        }
+        bucketTarget = used - quota;
+        percent = std::min(static_cast<double>(bucketTarget) / cached, 1.0);
+        freedInBucket = 0;
+        vb->ht.sweepInline(*this, vb->ht.getSize());
+        evictItems(vb);
+        return false;
+    }
+
+    //! Count an ejection against what it was made for.
+    void countEjected() {
+        ++ejected;
+        if (mode == PAGE_FOR_QUOTA_SHRINK) {
+            ++stats.numQuotaShrinkEjects;
+        } else if (mode == PAGE_FOR_VB_QUOTA) {
+            ++stats.numVBQuotaEjects;
+        }
+    }
+
     void adjustPercent(double prob, vbucket_state_t state) {
         if (state == vbucket_state_replica ||
             state == vbucket_state_dead)
@@ -177,20 +304,59 @@ private:
         }
     }
 
-    void doEviction(StoredValue *v) {
+    /**
+     * Remove the items the sweep picked in full eviction or ephemeral
+     * mode, unless they changed since.
+     */
+    void evictItems(RCPtr<VBucket> &vb) {
+        std::list<std::string>::iterator it;
+        for (it = toEvict.begin(); it != toEvict.end(); ++it) {
+            int bucket_num(0);
+            LockHolder lh = vb->ht.getLockedBucket(*it, &bucket_num);
+            if (vb->ht.unlocked_evict(*it, bucket_num, store.isEphemeral())) {
+                ++stats.numFullEvictions;
+                countEjected();
+            }
+        }
+        toEvict.clear();
+    }
+
+    void doEviction(StoredValue *v, bool hot) {
         ++totalEjectionAttempts;
-        if (!v->eligibleForEviction()) {
+        // An ephemeral bucket's items are never clean; evicting one
+        // deletes it.
+        bool ephemeral = store.isEphemeral();
+        bool full = ephemeral || store.isFullEviction();
+        if (!ephemeral &&
+            (full ? (v->isDirty() || v->isDeleted()) : !v->eligibleForEviction())) {
             ++stats.numFailedEjects;
             return;
         }
         // Check if the key was already visited by all the cursors.
         bool can_evict = currentBucket->checkpointManager.eligibleForEviction(v->getKey());
+        if (full) {
+            // We're in the middle of walking its chain; remove it once
+            // the sweep is done.
+            if (can_evict) {
+                toEvict.push_back(v->getKey());
+                freedInBucket += v->size();
+            }
+            return;
+        }
+        size_t len = v->valuelen();
         if (can_evict && v->ejectValue(stats, currentBucket->ht)) {
-            ++ejected;
+            countEjected();
+            freedInBucket += len;
+            policy->evicted(v);
+            if (hot && recentEvictions) {
+                recentEvictions->add(currentBucket->getId(), v->getKey(), len);
+            }
         }
     }
 
     std::list<std::pair<uint16_t, std::string> > expired;
+    //! Keys to remove from the vbucket being swept (full eviction or ephemeral).
+    std::list<std::string> toEvict;
 
     EventuallyPersistentStore &store;
     EPStats &stats;
@@ -200,25 +366,189 @@ private:
     size_t totalEjected;
     size_t totalEjectionAttempts;
     time_t startTime;
-    bool *stateFinalizer;
+    shared_ptr<PagingRun> run;
     bool canPause;
-    bool completePhase;
-    item_pager_phase *pager_phase;
+    EvictionPolicy *policy;
+    RecentEvictions *recentEvictions;
+    paging_mode_t mode;
+    //! Value bytes to free from the vbucket being swept.
+    size_t bucketTarget;
+    size_t freedInBucket;
+    //! The rand_r() state of the policy's random ejections
+    unsigned int seed;
 };
 
+/**
+ * Start a pager run, a PagingVisitor per shard.
+ */
+static void startPagingRun(EventuallyPersistentStore &store, EPStats &stats,
+                           Atomic<bool> &available, const char *label,
+                           double pcnt, bool pause, double bias,
+                           EvictionPolicy *pol, RecentEvictions *recent,
+                           paging_mode_t mode, double sleepTime = 0) {
+    size_t shards = store.getNumShards();
+    available.set(false);
+    shared_ptr<PagingRun> run(new PagingRun(available, pol, shards));
+    for (size_t i = 0; i < shards; ++i) {
+        shared_ptr<PagingVisitor> pv(new PagingVisitor(store, stats, pcnt,
+                                                       run, pause, bias, pol,
+                                                       recent, mode));
+        store.visitShard(pv, label, static_cast<uint16_t>(i),
+                         Priority::ItemPagerPriority, sleepTime);
+    }
+}
+
+ItemPager::ItemPager(EventuallyPersistentStore *s, EPStats &st) :
+    store(*s), stats(st), available(true),
+    policy(EvictionPolicy::create(
+               s->getEPEngine().getConfiguration().getPagerEvictionPolicy())),
+    quota(st.getMaxDataSize()), shrinking(false), warming(false),
+    shrinkLastMemory(0), shrinkStalledSteps(0) {
+}
+
+ItemPager::~ItemPager() {
+    delete policy;
+}
+
+void ItemPager::quotaChanged(size_t newQuota) {
+    size_t oldQuota = quota.get();
+    quota.set(newQuota);
+    if (newQuota < oldQuota) {
+        warming.set(false);
+        shrinkLastMemory.set(std::numeric_limits<size_t>::max());
+        shrinking.set(true);
+    } else if (newQuota > oldQuota) {
+        shrinking.set(false);
+        warming.set(true);
+    }
+}
+
+double ItemPager::shrinkStep() {
+    if (!available.get()) {
+        // The last step is still being visited.
+        return SHRINK_STEP_INTERVAL;
+    }
+
+    size_t current = stats.getTotalMemoryUsed();
+    size_t lower = stats.mem_low_wat.get();
+    if (current <= lower) {
+        LOG(EXTENSION_LOG_INFO, "Shrunk memory use to %llu bytes for the "
+            "new quota", static_cast<unsigned long long>(current));
+        shrinking.set(false);
+        return SHRINK_STEP_INTERVAL;
+    }
+
+    // Memory held by checkpoints, or values that can't be ejected yet,
+    // may keep usage up; leave it to the regular runs.
+    if (current < shrinkLastMemory.get()) {
+        shrinkStalledSteps = 0;
+    } else if (++shrinkStalledSteps >= MAX_STALLED_SHRINK_STEPS) {
+        LOG(EXTENSION_LOG_WARNING, "Couldn't shrink memory use below %llu "
+            "bytes for the new quota", static_cast<unsigned long long>(current));
+        shrinking.set(false);
+        return SHRINK_STEP_INTERVAL;
+    }
+    shrinkLastMemory.set(current);
+
+    size_t toFree = current - lower;
+    Configuration &cfg = store.getEPEngine().getConfiguration();
+    size_t rate = cfg.getQuotaShrinkRate();
+    if (rate > 0) {
+        toFree = std::min(toFree, static_cast<size_t>(rate *
+                                                      SHRINK_STEP_INTERVAL));
+    }
+
+    // Each vbucket frees the same share of its resident values, so the
+    // bytes come from the vbuckets in proportion to their residency.
+    size_t cached = 0;
+    for (size_t i = 0; i < store.vbMap.getSize(); ++i) {
+        RCPtr<VBucket> vb = store.getVBucket(static_cast<uint16_t>(i));
+        if (vb) {
+            cached += vb->ht.cacheSize.get();
+        }
+    }
+    if (cached == 0) {
+        shrinking.set(false);
+        return SHRINK_STEP_INTERVAL;
+    }
+    double share = std::min(static_cast<double>(toFree) /
+                            static_cast<double>(cached), 1.0);
+
+    ++stats.quotaShrinkSteps;
+    startPagingRun(store, stats, available, "Item pager", share, false, 1,
+                   policy, &recentEvictions, PAGE_FOR_QUOTA_SHRINK);
+    return SHRINK_STEP_INTERVAL;
+}
+
+void ItemPager::warmEvicted() {
+    std::vector<RecentEvictions::Entry> entries(recentEvictions.take());
+    Configuration &cfg = store.getEPEngine().getConfiguration();
+    size_t current = stats.getTotalMemoryUsed();
+    size_t lower = stats.mem_low_wat.get();
+    if (!cfg.isQuotaWarmOnGrow() || current >= lower) {
+        return;
+    }
+
+    size_t room = lower - current;
+    size_t fetched = 0;
+    std::vector<RecentEvictions::Entry>::reverse_iterator it;
+    for (it = entries.rbegin(); it != entries.rend() && room > 0; ++it) {
+        RCPtr<VBucket> vb = store.getVBucket(it->vbucket);
+        if (!vb || (vb->getState() != vbucket_state_active &&
+                    vb->getState() != vbucket_state_replica)) {
+            continue;
+        }
+        int bucket_num(0);
+        LockHolder lh = vb->ht.getLockedBucket(it->key, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(it->key, bucket_num, false,
+                                              false);
+        if (!v || v->isResident() || v->isDeleted() || v->isTempItem()) {
+            continue;
+        }
+        uint64_t rowid = v->getBySeqno();
+        lh.unlock();
+
+        store.bgFetch(it->key, it->vbucket, rowid, NULL);
+        ++stats.numQuotaWarmFetches;
+        ++fetched;
+        room -= std::min(room, it->bytes);
+    }
+
+    if (fetched > 0) {
+        LOG(EXTENSION_LOG_INFO, "Fetching back %ld values ejected before "
+            "the quota grew", fetched);
+    }
+}
+
 bool ItemPager::callback(Dispatcher &d, TaskId &t) {
+    if (shrinking.get()) {
+        d.snooze(t, shrinkStep());
+        return true;
+    }
+    if (warming.get()) {
+        warming.set(false);
+        warmEvicted();
+    }
+
     double current = static_cast<double>(stats.getTotalMemoryUsed());
     double upper = static_cast<double>(stats.mem_high_wat);
-    double lower = static_cast<double>(stats.mem_low_wat);
     double sleepTime = 5;
-    if (available && current > upper) {
+    if (available.get() && vbucketsOverQuota()) {
+        // The vbuckets over their quota give up memory before the rest;
+        // the watermarks get their turn right after.
+        ++stats.vbQuotaPagerRuns;
+        startPagingRun(store, stats, available, "Item pager", 1, false, 1,
+                       policy, &recentEvictions, PAGE_FOR_VB_QUOTA);
+        sleepTime = 1;
+    } else if (available.get() && current > upper) {
         ++stats.pagerRuns;
 
-        double toKill = (current - static_cast<double>(lower)) / current;
+        double toKill = getEvictionRatio(stats, current);
 
         std::stringstream ss;
         ss << "Using " << stats.getTotalMemoryUsed()
-           << " bytes of memory, paging out %0f%% of items." << std::endl;
+           << " bytes of memory (" << stats.checkpointMemory.get()
+           << " in checkpoints), paging out %0f%% of items." << std::endl;
         LOG(EXTENSION_LOG_INFO, ss.str().c_str(), (toKill*100.0));
 
         // compute active vbuckets evicition bias factor
@@ -226,27 +556,33 @@ bool ItemPager::callback(Dispatcher &d, TaskId &t) {
         size_t activeEvictPerc = cfg.getPagerActiveVbPcnt();
         double bias = static_cast<double>(activeEvictPerc) / 50;
 
-        available = false;
-        shared_ptr<PagingVisitor> pv(new PagingVisitor(store, stats, toKill,
-                                                       &available,
-                                                       false, bias, &phase));
-        store.visit(pv, "Item pager", &d, Priority::ItemPagerPriority);
+        startPagingRun(store, stats, available, "Item pager", toKill, false,
+                       bias, policy, &recentEvictions, PAGE_FOR_WATERMARKS);
     }
 
     d.snooze(t, sleepTime);
     return true;
 }
 
+bool ItemPager::vbucketsOverQuota() {
+    size_t quota = VBucket::getMemQuota();
+    if (quota == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < store.vbMap.getSize(); ++i) {
+        RCPtr<VBucket> vb = store.getVBucket(static_cast<uint16_t>(i));
+        if (vb && vb->getMemoryUsage() > quota) {
+            return true;
+        }
+    }
+    return false;
+}
+
 bool ExpiredItemPager::callback(Dispatcher &d, TaskId &t) {
-    if (available) {
+    if (available.get()) {
         ++stats.expiryPagerRuns;
-
-        available = false;
-        shared_ptr<PagingVisitor> pv(new PagingVisitor(store, stats, -1,
-                                                       &available,
-                                                       true, 1, NULL));
-        store.visit(pv, "Expired item remover", &d, Priority::ItemPagerPriority,
-                    true, 10);
+        startPagingRun(store, stats, available, "Expired item remover", -1,
+                       true, 1, NULL, NULL, PAGE_FOR_WATERMARKS, 10);
     }
     d.snooze(t, sleepTime);
     return true;
@@ -28,6 +28,9 @@
 
 #include "common.h"
 #include "dispatcher.h"
+#include "eviction_policy.h"
+#include "locks.h"
+#include "ringbuffer.h"
 #include "stats.h"
 
 typedef std::pair<int64_t, int64_t> row_range_t;
@@ -36,16 +39,52 @@ typedef std::pair<int64_t, int64_t> row_range_t;
 class EventuallyPersistentStore;
 
 /**
- * The item pager phase
+ * The hot items whose values the item pager ejected most recently, for
+ * it to fetch back once the memory quota grows again.
  */
-typedef enum {
-    PAGING_UNREFERENCED,
-    PAGING_RANDOM
-} item_pager_phase;
+class RecentEvictions {
+public:
+    //! The ejections remembered, the oldest making way for new ones
+    static const size_t CAPACITY = 10000;
+
+    struct Entry {
+        Entry() : vbucket(0), bytes(0) { }
+
+        uint16_t vbucket;
+        std::string key;
+        size_t bytes;
+    };
+
+    RecentEvictions() : ring(CAPACITY) { }
+
+    void add(uint16_t vbucket, const std::string &key, size_t bytes) {
+        Entry e;
+        e.vbucket = vbucket;
+        e.key = key;
+        e.bytes = bytes;
+        LockHolder lh(mutex);
+        ring.add(e);
+    }
+
+    //! Take the ejections remembered, oldest first, forgetting them.
+    std::vector<Entry> take() {
+        LockHolder lh(mutex);
+        std::vector<Entry> rv(ring.contents());
+        ring.reset();
+        return rv;
+    }
+
+private:
+    Mutex mutex;
+    RingBuffer<Entry> ring;
+
+    DISALLOW_COPY_AND_ASSIGN(RecentEvictions);
+};
 
 /**
  * Dispatcher job responsible for periodically pushing data out of
- * memory.
+ * memory.  Each run visits the shards at the same time, one visitor per
+ * shard on the non-IO threads.
  */
 class ItemPager : public DispatcherCallback {
 public:
@@ -56,27 +95,59 @@ public:
      * @param s the store (where we'll visit)
      * @param st the stats
      */
-    ItemPager(EventuallyPersistentStore *s, EPStats &st) :
-        store(*s), stats(st), available(true), phase(PAGING_UNREFERENCED) {}
+    ItemPager(EventuallyPersistentStore *s, EPStats &st);
 
-    bool callback(Dispatcher &d, TaskId &t);
+    ~ItemPager();
 
-    item_pager_phase getPhase() const {
-        return phase;
-    }
+    bool callback(Dispatcher &d, TaskId &t);
 
-    void setPhase(item_pager_phase item_phase) {
-        phase = item_phase;
+    const EvictionPolicy &getPolicy() const {
+        return *policy;
     }
 
     std::string description() { return std::string("Paging out items."); }
 
+    /**
+     * Tell the pager the memory quota changed.  A smaller quota has it
+     * free memory down to the new low watermark right away, a step at a
+     * time at quota_shrink_rate, rather than waiting for usage to cross
+     * the high watermark; a bigger one has it fetch back the hot values
+     * it ejected lately, while there's room below the low watermark.
+     * The pager's task should be woken after.
+     */
+    void quotaChanged(size_t newQuota);
+
 private:
 
+    /**
+     * Start a visit to free the next step's share of the memory above
+     * the low watermark, spread over the vbuckets by how much of each
+     * is resident.
+     *
+     * @return the time to snooze before the next step
+     */
+    double shrinkStep();
+
+    //! Fetch back recently ejected hot values, newest first, while they fit.
+    void warmEvicted();
+
+    //! Whether any vbucket is over VBucket::getMemQuota()
+    bool vbucketsOverQuota();
+
     EventuallyPersistentStore &store;
     EPStats &stats;
-    bool available;
-    item_pager_phase phase;
+    //! No run is being visited
+    Atomic<bool> available;
+    EvictionPolicy *policy;
+    RecentEvictions recentEvictions;
+    Atomic<size_t> quota;
+    Atomic<bool> shrinking;
+    Atomic<bool> warming;
+    //! Memory used at the last shrink step, and the steps since it fell
+    Atomic<size_t> shrinkLastMemory;
+    size_t shrinkStalledSteps;
+
+    DISALLOW_COPY_AND_ASSIGN(ItemPager);
 };
 
 /**
@@ -106,7 +177,7 @@ private:
     EventuallyPersistentStore &store;
     EPStats                   &stats;
     double                     sleepTime;
-    bool                       available;
+    Atomic<bool>               available;
 };
 
 #endif  // SRC_ITEM_PAGER_H_
@@ -0,0 +1,140 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+
+#include "key_prefix_table.h"
+#include "locks.h"
+#include "objectregistry.h"
+
+KeyPrefixTable::Stripe KeyPrefixTable::stripes[KeyPrefixTable::NUM_STRIPES];
+KeyPrefixTable::Entry * volatile
+    KeyPrefixTable::chunks[(KeyPrefixTable::MAX_PREFIXES + 1) /
+                           KeyPrefixTable::CHUNK_SIZE];
+Mutex KeyPrefixTable::idMutex;
+std::vector<uint16_t> KeyPrefixTable::freeIds;
+size_t KeyPrefixTable::nextId = 1;
+Atomic<size_t> KeyPrefixTable::numPrefixes;
+Atomic<size_t> KeyPrefixTable::bytesSaved;
+Atomic<size_t> KeyPrefixTable::memoryUsed;
+
+size_t KeyPrefixTable::prefixLength(const char *key, size_t len) {
+    for (size_t i = len; i > 0; --i) {
+        if (!isalnum(static_cast<unsigned char>(key[i - 1]))) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+KeyPrefixTable::Stripe &KeyPrefixTable::stripeOf(const char *prefix,
+                                                 size_t len) {
+    uint32_t h = 5381;
+    for (size_t i = 0; i < len; ++i) {
+        h = ((h << 5) + h) ^ static_cast<unsigned char>(prefix[i]);
+    }
+    return stripes[h % NUM_STRIPES];
+}
+
+uint16_t KeyPrefixTable::newId() {
+    LockHolder lh(idMutex);
+    if (!freeIds.empty()) {
+        uint16_t id = freeIds.back();
+        freeIds.pop_back();
+        return id;
+    }
+    if (nextId > MAX_PREFIXES) {
+        return 0;
+    }
+    uint16_t id = static_cast<uint16_t>(nextId++);
+    if (chunks[id / CHUNK_SIZE] == NULL) {
+        chunks[id / CHUNK_SIZE] = new Entry[CHUNK_SIZE];
+        memoryUsed += CHUNK_SIZE * sizeof(Entry);
+    }
+    return id;
+}
+
+void KeyPrefixTable::freeId(uint16_t id) {
+    LockHolder lh(idMutex);
+    freeIds.push_back(id);
+}
+
+uint16_t KeyPrefixTable::acquire(const char *prefix, size_t len) {
+    // The table is shared by all the buckets, so none of them pays for it.
+    EventuallyPersistentEngine *e = ObjectRegistry::onSwitchThread(NULL, true);
+    Stripe &s = stripeOf(prefix, len);
+    uint16_t id;
+    {
+        LockHolder lh(s.mutex);
+        std::string key(prefix, len);
+        std::map<std::string, uint16_t>::iterator it = s.ids.find(key);
+        if (it != s.ids.end()) {
+            id = it->second;
+            ++chunks[id / CHUNK_SIZE][id % CHUNK_SIZE].refs;
+        } else if ((id = newId()) != 0) {
+            it = s.ids.insert(std::make_pair(key, id)).first;
+            Entry &entry = chunks[id / CHUNK_SIZE][id % CHUNK_SIZE];
+            entry.refs = 1;
+            entry.prefix = &it->first;
+            ++numPrefixes;
+            memoryUsed += len;
+        }
+    }
+    ObjectRegistry::onSwitchThread(e);
+    if (id != 0) {
+        bytesSaved += len;
+    }
+    return id;
+}
+
+void KeyPrefixTable::addRef(uint16_t id) {
+    Entry &entry = chunks[id / CHUNK_SIZE][id % CHUNK_SIZE];
+    ++entry.refs;
+    bytesSaved += entry.prefix->length();
+}
+
+void KeyPrefixTable::release(uint16_t id) {
+    Entry &entry = chunks[id / CHUNK_SIZE][id % CHUNK_SIZE];
+    const std::string *prefix = entry.prefix;
+    size_t len = prefix->length();
+    bytesSaved -= len;
+    // Unless it's the last reference, it's dropped without a lock.
+    size_t refs;
+    while ((refs = entry.refs) > 1) {
+        if (entry.refs.cas(refs, refs - 1)) {
+            return;
+        }
+    }
+
+    // The last one is dropped under the stripe's lock, which an acquire
+    // takes the prefix up again under.
+    EventuallyPersistentEngine *e = ObjectRegistry::onSwitchThread(NULL, true);
+    Stripe &s = stripeOf(prefix->data(), len);
+    {
+        LockHolder lh(s.mutex);
+        if (--entry.refs == 0) {
+            entry.prefix = NULL;
+            s.ids.erase(s.ids.find(*prefix));
+            --numPrefixes;
+            memoryUsed -= len;
+            freeId(id);
+        }
+    }
+    ObjectRegistry::onSwitchThread(e);
+}
@@ -0,0 +1,128 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_KEY_PREFIX_TABLE_H_
+#define SRC_KEY_PREFIX_TABLE_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "mutex.h"
+
+/**
+ * Process wide dictionary of the key prefixes resident items share, so
+ * an item keeps a two byte id in place of its prefix.  Keys like
+ * "user::1234" and "session:abcd" mostly differ in the last few bytes,
+ * and with millions of them resident the prefixes repeated in each item
+ * are a good part of the metadata.
+ *
+ * A prefix is the key up to and including its last character that isn't
+ * a letter or a digit.  Each is reference counted by the items holding
+ * its id, and dropped with the last of them; its id is then reused.
+ * Looking a prefix up by id takes no lock, so hash table lookups don't
+ * contend on the table.  The memory of the table isn't charged to any
+ * bucket, as it's shared by all of them.
+ */
+class KeyPrefixTable {
+public:
+    //! The most prefixes held at a time; ids go from 1 to this
+    static const size_t MAX_PREFIXES = 65535;
+
+    /**
+     * The length of the prefix of the given key, 0 if it has none.
+     */
+    static size_t prefixLength(const char *key, size_t len);
+
+    /**
+     * Take a reference to the given prefix, adding it if it's new.
+     *
+     * @return its id, or 0 if the table is full
+     */
+    static uint16_t acquire(const char *prefix, size_t len);
+
+    /**
+     * Take another reference to a prefix already referenced.
+     */
+    static void addRef(uint16_t id);
+
+    /**
+     * Drop a reference to a prefix, dropping the prefix with the last.
+     */
+    static void release(uint16_t id);
+
+    /**
+     * Get the prefix of the given id, which must be referenced.
+     */
+    static const std::string &get(uint16_t id) {
+        return *chunks[id / CHUNK_SIZE][id % CHUNK_SIZE].prefix;
+    }
+
+    //! Number of distinct prefixes held
+    static size_t getNumPrefixes() {
+        return numPrefixes;
+    }
+
+    //! Key bytes items don't keep, as they're in the table instead
+    static size_t getBytesSaved() {
+        return bytesSaved;
+    }
+
+    //! Bytes held by the table itself
+    static size_t getMemoryUsed() {
+        return memoryUsed;
+    }
+
+private:
+    static const size_t CHUNK_SIZE = 256;
+    static const size_t NUM_STRIPES = 16;
+
+    struct Entry {
+        Entry() : prefix(NULL), refs(0) { }
+
+        //! The key of the prefix in its stripe's map
+        const std::string *prefix;
+        Atomic<size_t>     refs;
+    };
+
+    struct Stripe {
+        Mutex mutex;
+        std::map<std::string, uint16_t> ids;
+    };
+
+    static Stripe &stripeOf(const char *prefix, size_t len);
+    static uint16_t newId();
+    static void freeId(uint16_t id);
+
+    static Stripe stripes[NUM_STRIPES];
+    //! Entries by id, allocated a chunk at a time and never freed
+    static Entry * volatile chunks[(MAX_PREFIXES + 1) / CHUNK_SIZE];
+    static Mutex idMutex;
+    static std::vector<uint16_t> freeIds;
+    static size_t nextId;
+    static Atomic<size_t> numPrefixes;
+    static Atomic<size_t> bytesSaved;
+    static Atomic<size_t> memoryUsed;
+
+    DISALLOW_COPY_AND_ASSIGN(KeyPrefixTable);
+};
+
+#endif  // SRC_KEY_PREFIX_TABLE_H_
@@ -19,13 +19,15 @@
 
 #include <functional>
 
+#include "compactor.h"
 #include "ep_engine.h"
+#include "epoch.h"
 #include "flusher.h"
 #include "kvshard.h"
 
 KVShard::KVShard(uint16_t id, EventuallyPersistentStore &store) :
-    shardId(id), highPrioritySnapshot(false), lowPrioritySnapshot(false),
-    highPriorityCount(0)
+    nextBgFetcher(0), shardId(id), highPrioritySnapshot(false),
+    lowPrioritySnapshot(false), highPriorityCount(0)
 {
     EPStats &stats = store.getEPEngine().getEpStats();
     Configuration &config = store.getEPEngine().getConfiguration();
@@ -33,28 +35,67 @@ KVShard::KVShard(uint16_t id, EventuallyPersistentStore &store) :
 
     vbuckets = new RCPtr<VBucket>[maxVbuckets];
 
+    if (config.getBucketType().compare("ephemeral") == 0) {
+        // Nothing is persisted or read back.
+        rwUnderlying = roUnderlying = auxUnderlying = NULL;
+        flusher = NULL;
+        compactor = NULL;
+        return;
+    }
+
     rwUnderlying = KVStoreFactory::create(stats, config, false);
     roUnderlying = KVStoreFactory::create(stats, config, true);
+    auxUnderlying = KVStoreFactory::create(stats, config, true);
 
     flusher = new Flusher(&store, this);
-    bgFetcher = new BgFetcher(&store, this, stats);
+    compactor = new Compactor(&store, this, stats);
+
+    // The fetchers' tasks get shard ids of their own so they're spread
+    // over the reader threads and may read at the same time.
+    int numFetchers = static_cast<int>(config.getBgFetchersPerShard());
+    for (int i = 0; i < numFetchers; ++i) {
+        KVStore *reader = roUnderlying;
+        if (i > 0) {
+            reader = KVStoreFactory::create(stats, config, true);
+        }
+        bgFetchers.push_back(new BgFetcher(&store, this, reader,
+                                           shardId * numFetchers + i, stats));
+    }
 }
 
 KVShard::~KVShard() {
-    if (flusher->state() != stopped) {
+    if (flusher && flusher->state() != stopped) {
         flusher->stop(true);
         LOG(EXTENSION_LOG_WARNING, "Terminating flusher while it is in %s",
             flusher->stateName());
     }
     delete flusher;
-    delete bgFetcher;
+    delete compactor;
+    std::vector<BgFetcher *>::iterator it = bgFetchers.begin();
+    for (; it != bgFetchers.end(); ++it) {
+        if ((*it)->getReader() != roUnderlying) {
+            delete (*it)->getReader();
+        }
+        delete *it;
+    }
 
     delete rwUnderlying;
     delete roUnderlying;
+    delete auxUnderlying;
 
     delete[] vbuckets;
 }
 
+void KVShard::vbStateChanged(uint16_t vbid, vbucket_state_t state) {
+    if (rwUnderlying) {
+        rwUnderlying->vbStateChanged(vbid, state);
+    }
+    std::vector<BgFetcher *>::iterator it = bgFetchers.begin();
+    for (; it != bgFetchers.end(); ++it) {
+        (*it)->getReader()->vbStateChanged(vbid, state);
+    }
+}
+
 KVStore *KVShard::getRWUnderlying() {
     return rwUnderlying;
 }
@@ -68,19 +109,46 @@ Flusher *KVShard::getFlusher() {
 }
 
 BgFetcher *KVShard::getBgFetcher() {
-    return bgFetcher;
+    size_t numFetchers = bgFetchers.size();
+    if (numFetchers == 1) {
+        return bgFetchers[0];
+    }
+    size_t start = nextBgFetcher++;
+    for (size_t i = 0; i < numFetchers; ++i) {
+        BgFetcher *fetcher = bgFetchers[(start + i) % numFetchers];
+        if (!fetcher->isFetching()) {
+            return fetcher;
+        }
+    }
+    return bgFetchers[start % numFetchers];
 }
 
 RCPtr<VBucket> KVShard::getBucket(uint16_t id) const {
     return vbuckets[id];
 }
 
+extern "C" {
+    static void releaseVBucketRef(void *p) {
+        delete static_cast<RCPtr<VBucket>*>(p);
+    }
+}
+
+static void deferRelease(const RCPtr<VBucket> &vb) {
+    if (vb) {
+        EpochManager::defer(releaseVBucketRef, new RCPtr<VBucket>(vb));
+    }
+}
+
 void KVShard::setBucket(const RCPtr<VBucket> &vb) {
+    RCPtr<VBucket> old(vbuckets[vb->getId()]);
     vbuckets[vb->getId()].reset(vb);
+    deferRelease(old);
 }
 
 void KVShard::resetBucket(uint16_t id) {
+    RCPtr<VBucket> old(vbuckets[id]);
     vbuckets[id].reset();
+    deferRelease(old);
 }
 
 std::vector<int> KVShard::getVBucketsSortedByState() {
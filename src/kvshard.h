@@ -54,13 +54,23 @@
  *   | vbuckets: VBucket[] (partitions)|----> [(VBucket),(VBucket)..]
  *   |                                 |
  *   | flusher: Flusher                |
- *   | BGFetcher: bgFetcher            |
+ *   | compactor: Compactor            |
+ *   | BGFetcher: bgFetchers[]         |----> [(BgFetcher),(BgFetcher)..]
  *   |                                 |
  *   | rwUnderlying: KVStore (write)   |----> (CouchKVStore)
  *   | roUnderlying: KVStore (read)    |----> (CouchKVStore)
+ *   | auxUnderlying: KVStore (read)   |----> (CouchKVStore)
  *   -----------------------------------
  *
+ * The aux store reads the shard's vbuckets in bulk, for warmup and disk
+ * backfills, so those don't share a handle with the bg fetchers or with
+ * the other shards.
+ *
+ * The shards of an ephemeral bucket have none of the storage parts: their
+ * underlying stores, flusher and compactor are NULL and they have no bg
+ * fetchers.
  */
+class Compactor;
 class Flusher;
 class KVShard {
     friend class VBucketMap;
@@ -70,11 +80,39 @@ public:
 
     KVStore *getRWUnderlying();
     KVStore *getROUnderlying();
+    KVStore *getAuxUnderlying() { return auxUnderlying; }
 
     Flusher *getFlusher();
+    Compactor *getCompactor() { return compactor; }
+
+    /**
+     * Get the bg fetcher to queue a fetch onto: the first one found
+     * that's not reading a batch, or the next one in turn if they all
+     * are.
+     */
     BgFetcher *getBgFetcher();
+    const std::vector<BgFetcher *> &getBgFetchers() { return bgFetchers; }
+
+    /**
+     * Tell the shard's stores the state a vbucket is now in.
+     */
+    void vbStateChanged(uint16_t vbid, vbucket_state_t state);
 
     RCPtr<VBucket> getBucket(uint16_t id) const;
+
+    /**
+     * Get a vbucket without taking a reference to it.  It's only good
+     * for as long as the caller holds an EpochGuard.
+     */
+    VBucket *peekBucket(uint16_t id) const {
+        return vbuckets[id].get();
+    }
+
+    /**
+     * Map a vbucket, or unmap it.  The map's reference to the vbucket
+     * it replaces is only dropped once nobody can still be peeking at
+     * it.
+     */
     void setBucket(const RCPtr<VBucket> &b);
     void resetBucket(uint16_t id);
 
@@ -133,9 +171,13 @@ private:
 
     KVStore    *rwUnderlying;
     KVStore    *roUnderlying;
+    KVStore    *auxUnderlying;
 
     Flusher    *flusher;
-    BgFetcher  *bgFetcher;
+    Compactor  *compactor;
+    //! Each with a read-only store of its own, the first is roUnderlying
+    std::vector<BgFetcher *> bgFetchers;
+    Atomic<size_t> nextBgFetcher;
 
     size_t maxVbuckets;
     uint16_t shardId;
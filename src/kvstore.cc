@@ -28,6 +28,9 @@
 #endif
 #include "ep_engine.h"
 #include "kvstore.h"
+#ifdef HAVE_LEVELDB
+#include "leveldb-kvstore/leveldb-kvstore.h"
+#endif
 #include "stats.h"
 #include "warmup.h"
 
@@ -39,6 +42,10 @@ KVStore *KVStoreFactory::create(EPStats &stats, Configuration &config,
     std::string backend = config.getBackend();
     if (backend.compare("couchdb") == 0) {
         ret = new CouchKVStore(stats, config, read_only);
+#ifdef HAVE_LEVELDB
+    } else if (backend.compare("leveldb") == 0) {
+        ret = new LevelDBKVStore(stats, config, read_only);
+#endif
     } else {
         LOG(EXTENSION_LOG_WARNING, "Unknown backend: [%s]", backend.c_str());
     }
@@ -47,12 +47,37 @@ typedef std::pair<int, int64_t> mutation_result;
 
 struct vbucket_state {
     vbucket_state() { }
-    vbucket_state(vbucket_state_t _state, uint64_t _chkid, uint64_t _maxDelSeqNum) :
-        state(_state), checkpointId(_chkid), maxDeletedSeqno(_maxDelSeqNum) { }
+    vbucket_state(vbucket_state_t _state, uint64_t _chkid, uint64_t _maxDelSeqNum,
+                  uint64_t _purgeSeqNum = 0) :
+        state(_state), checkpointId(_chkid), maxDeletedSeqno(_maxDelSeqNum),
+        purgeSeqno(_purgeSeqNum) { }
 
     vbucket_state_t state;
     uint64_t checkpointId;
     uint64_t maxDeletedSeqno;
+    //! The highest rev seqno of the deletions purged from the file
+    uint64_t purgeSeqno;
+};
+
+/**
+ * What a vbucket's file holds.
+ */
+struct vbucket_file_info {
+    vbucket_file_info() :
+        fileSize(0), spaceUsed(0), itemCount(0), deletedCount(0),
+        fileRev(0), headerPosition(0), highSeqno(0) { }
+
+    size_t fileSize;
+    //! The bytes of the file still in use
+    size_t spaceUsed;
+    size_t itemCount;
+    size_t deletedCount;
+    //! The revision of the file, 0 if the store has none
+    uint64_t fileRev;
+    //! Where the file's last header is, 0 if the store has none
+    uint64_t headerPosition;
+    //! The seqno of the last doc persisted, 0 if the store has none
+    uint64_t highSeqno;
 };
 
 /**
@@ -64,6 +89,35 @@ struct vbucket_state {
  */
 typedef std::map<uint16_t, vbucket_state> vbucket_map_t;
 
+/**
+ * A step of the compaction of a vbucket's file: what it may do and what
+ * it did.
+ */
+struct compaction_ctx {
+    compaction_ctx(uint16_t vb, time_t purge) :
+        vbid(vb), purgeBefore(purge), maxBytes(0), bytesCopied(0),
+        tombstonesPurged(0), purgeSeqno(0), purgedBySeqno(0), oldFileSize(0),
+        newFileSize(0), done(false) { }
+
+    uint16_t vbid;
+    //! Deletions persisted before this time are dropped, 0 keeps them all
+    time_t purgeBefore;
+    //! The most bytes of docs a step copies
+    size_t maxBytes;
+
+    //! The bytes of docs the last step copied
+    size_t bytesCopied;
+    size_t tombstonesPurged;
+    //! The purge seqno the new file was given
+    uint64_t purgeSeqno;
+    //! The highest disk seqno of the deletions dropped, 0 if the store has none
+    uint64_t purgedBySeqno;
+    size_t oldFileSize;
+    size_t newFileSize;
+    //! Set once the new file has replaced the old one
+    bool done;
+};
+
 /**
  * Properites of the storage layer.
  *
@@ -168,6 +222,23 @@ public:
      */
     virtual bool commit() = 0;
 
+    /**
+     * Commit a transaction, possibly leaving the callbacks of its
+     * mutations to be called by a later completeCommits(), so that the
+     * commits of several vbuckets may be outstanding at once.
+     *
+     * @return false if the commit fails
+     */
+    virtual bool commitNoWait() {
+        return commit();
+    }
+
+    /**
+     * Wait for the commits left outstanding by commitNoWait() and call the
+     * callbacks of their mutations.
+     */
+    virtual void completeCommits() { }
+
     /**
      * Rollback the current transaction.
      */
@@ -199,6 +270,66 @@ public:
         throw std::runtime_error("Backend does not support getMulti()");
     }
 
+    /**
+     * Check if the kv-store reads multiple items on threads of its own
+     * @return true if getMultiAsync() returns before the items are read,
+     *              so more than one read can be in flight at a time
+     */
+    virtual bool isAsyncGetSupported() {
+        return false;
+    }
+
+    /**
+     * Start reading multiple items.  Once they're read, the callback is
+     * called with the vbucket, on whatever thread read them; the items
+     * and the callback must be kept until then.  Stores that don't read
+     * on threads of their own read them before returning.
+     */
+    virtual void getMultiAsync(uint16_t vb, vb_bgfetch_queue_t &itms,
+                               Callback<uint16_t> &cb) {
+        getMulti(vb, itms);
+        cb.callback(vb);
+    }
+
+    /**
+     * Get the metadata of multiple keys, by key, if supported by the kv
+     * store.  The keys that aren't there are left with ENGINE_KEY_ENOENT.
+     */
+    virtual void getMultiMeta(uint16_t vb, vb_bgmeta_queue_t &itms) {
+        (void) itms; (void) vb;
+        throw std::runtime_error("Backend does not support getMultiMeta()");
+    }
+
+    /**
+     * Get the keys of up to count live docs of a vbucket that follow a key
+     * in key order and start with a prefix, so the bg fetcher can read the
+     * docs next to those being fetched along with them.
+     *
+     * @return false if the store can't list its keys in order
+     */
+    virtual bool getKeysAfter(uint16_t vb, const std::string &key,
+                              const std::string &prefix, size_t count,
+                              std::vector<std::string> &keys) {
+        (void) vb; (void) key; (void) prefix; (void) count; (void) keys;
+        return false;
+    }
+
+    /**
+     * Pass up to limit of the live docs of a vbucket, from the start key up
+     * to but not including the end key (empty for no end), to a callback in
+     * key order.  Only their metadata is read if keysOnly.
+     *
+     * @return false if the store can't list its keys in order, or failed to
+     *         read them
+     */
+    virtual bool rangeScan(uint16_t vb, const std::string &start,
+                           const std::string &end, size_t limit,
+                           bool keysOnly, Callback<GetValue> &cb) {
+        (void) vb; (void) start; (void) end; (void) limit; (void) keysOnly;
+        (void) cb;
+        return false;
+    }
+
     /**
      * Delete an item from the kv store.
      */
@@ -236,6 +367,15 @@ public:
      */
     virtual bool snapshotVBuckets(const vbucket_map_t &m) = 0;
 
+    /**
+     * Tell the store the state a vbucket is now in, for the stats it
+     * breaks out by the class of vbucket.
+     */
+    virtual void vbStateChanged(uint16_t vbid, vbucket_state_t state) {
+        (void) vbid;
+        (void) state;
+    }
+
     /**
      * Pass all stored data through the given callback.
      */
@@ -247,6 +387,19 @@ public:
      */
     virtual void dump(uint16_t vbid, shared_ptr<Callback<GetValue> > cb) = 0;
 
+    /**
+     * Pass the live documents of a given set of vbuckets through the
+     * given callback, one vbucket after another in the order given.
+     * @param vbids the vbuckets to dump
+     * @param cb the callback to fire for each document
+     */
+    virtual void dump(const std::vector<uint16_t> &vbids,
+                      shared_ptr<Callback<GetValue> > cb) {
+        (void)vbids; (void)cb;
+        throw std::runtime_error("Backend does not support dump() of a set "
+                                 "of vbuckets");
+    }
+
     /**
      * Check if the kv-store supports a dumping all of the keys
      * @return true you may call dumpKeys() to do a prefetch
@@ -266,18 +419,84 @@ public:
         throw std::runtime_error("Backed does not support dumpKeys()");
     }
 
+    /**
+     * Dump the keys of a given vbucket
+     * @param vbid the vbucket to dump
+     * @param cb the callback to fire for each document
+     */
+    virtual void dumpKeys(uint16_t vbid, shared_ptr<Callback<GetValue> > cb) {
+        (void)vbid; (void)cb;
+        throw std::runtime_error("Backed does not support dumpKeys()");
+    }
+
     virtual void dumpDeleted(uint16_t vbid, shared_ptr<Callback<GetValue> > cb) {
         (void) vbid; (void) cb;
         throw std::runtime_error("Backend does not support dumpDeleted()");
     }
 
+    /**
+     * Check if the kv-store can dump a vbucket from a given disk seqno on
+     * @return true you may call dumpSince()
+     */
+    virtual bool isSeqnoDumpSupported() {
+        return false;
+    }
+
+    /**
+     * Pass the documents of a given vbucket, deleted ones included,
+     * that were written with a disk seqno above the given one through
+     * the given callback, in seqno order.
+     * @param vbid the vbucket to dump
+     * @param since the disk seqno to start after
+     * @param cb the callback to fire for each document
+     */
+    virtual void dumpSince(uint16_t vbid, uint64_t since,
+                           shared_ptr<Callback<GetValue> > cb) {
+        (void) vbid; (void) since; (void) cb;
+        throw std::runtime_error("Backend does not support dumpSince()");
+    }
+
     virtual size_t getNumPersistedDeletes(uint16_t) {
         return 0;
     }
 
+    /**
+     * Get the size of a vbucket's file, how much of it is in use and the
+     * docs it holds.
+     *
+     * @return false if there's no file to tell about
+     */
+    virtual bool getDbFileInfo(uint16_t vbid, vbucket_file_info &info) {
+        (void) vbid; (void) info;
+        return false;
+    }
+
+    /**
+     * Copy the next docs of a vbucket's file into a new, compacted one,
+     * up to ctx.maxBytes.  Once all the docs are copied, the new file
+     * replaces the old in the same step.  The writes of the vbucket must
+     * not run at the same time as a step.
+     *
+     * @return false if the compaction failed and was given up
+     */
+    virtual bool compactVBucket(compaction_ctx &ctx) {
+        (void) ctx;
+        return false;
+    }
+
+    /**
+     * Give up the compaction of a vbucket, if one is in progress.
+     */
+    virtual void abortCompaction(uint16_t vbid) {
+        (void) vbid;
+    }
+
     /**
      * This method is called before persisting a batch of data if you'd like to
      * do stuff to them that might improve performance at the IO layer.
+     *
+     * The items of a key have to end up next to each other: the flusher
+     * writes only the first of them, with the key's current value.
      */
     virtual void optimizeWrites(std::vector<queued_item> &items) {
         (void)items;
@@ -0,0 +1,1201 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
+#include <leveldb/write_batch.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bgfetcher.h"
+#include "common.h"
+#include "leveldb-kvstore/leveldb-kvstore.h"
+#include "locks.h"
+#define STATWRITER_NAMESPACE leveldb_engine
+#include "statwriter.h"
+#undef STATWRITER_NAMESPACE
+#include "warmup.h"
+
+static const int MUTATION_FAILED = -1;
+static const int MUTATION_SUCCESS = 1;
+
+/*
+ * The kinds of records, each key starting with one.  Those of a vbucket
+ * go on with its id in network order so they sort by vbucket.
+ */
+//! A doc: vbucket id, then the doc's key
+static const char DOC_PREFIX = 'd';
+//! The counts of a vbucket: vbucket id
+static const char COUNTS_PREFIX = 'c';
+//! The state of a vbucket: vbucket id
+static const char VBSTATE_PREFIX = 'v';
+//! An engine stat of the last snapshot: the stat's name
+static const char STAT_PREFIX = 's';
+
+/*
+ * A doc is its cas (8), exptime (4), flags (4), rev seqno (8) and seqno
+ * (8) in network order but for the flags, kept as the client gave them,
+ * a byte that's 1 for a deletion and the datatype of the value, then the
+ * value.
+ */
+static const size_t DOC_META_SIZE = 34;
+static const size_t DOC_DELETED_OFFSET = 32;
+static const size_t COUNTS_SIZE = 40;
+static const size_t VBSTATE_SIZE = 12;
+
+//! The max number of docs of a vbucket removed by each batch of a wipe
+static const size_t WIPE_BATCH_SIZE = 4096;
+//! Bits of the bloom filter of each table per key, so reads of missing
+//! keys rarely go to disk
+static const int BLOOM_BITS_PER_KEY = 10;
+
+static void putUint64(char *buf, uint64_t val) {
+    val = htonll(val);
+    memcpy(buf, &val, sizeof(val));
+}
+
+static uint64_t getUint64(const char *buf) {
+    uint64_t val;
+    memcpy(&val, buf, sizeof(val));
+    return ntohll(val);
+}
+
+static void putUint32(char *buf, uint32_t val) {
+    val = htonl(val);
+    memcpy(buf, &val, sizeof(val));
+}
+
+static uint32_t getUint32(const char *buf) {
+    uint32_t val;
+    memcpy(&val, buf, sizeof(val));
+    return ntohl(val);
+}
+
+static std::string vbKey(char prefix, uint16_t vbid) {
+    uint16_t id = htons(vbid);
+    std::string key(1, prefix);
+    key.append(reinterpret_cast<const char *>(&id), sizeof(id));
+    return key;
+}
+
+static std::string docKey(uint16_t vbid, const std::string &key) {
+    return vbKey(DOC_PREFIX, vbid) + key;
+}
+
+static uint16_t vbOfKey(const leveldb::Slice &key) {
+    uint16_t id;
+    memcpy(&id, key.data() + 1, sizeof(id));
+    return ntohs(id);
+}
+
+/**
+ * Get the first key after all of those starting with a prefix.
+ */
+static std::string prefixEnd(const std::string &prefix) {
+    std::string end(prefix);
+    while (!end.empty() &&
+           static_cast<unsigned char>(end[end.size() - 1]) == 0xff) {
+        end.erase(end.size() - 1);
+    }
+    if (!end.empty()) {
+        end[end.size() - 1] = static_cast<char>(end[end.size() - 1] + 1);
+    }
+    return end;
+}
+
+static std::string encodeDoc(const LevelDBRequest &req) {
+    char meta[DOC_META_SIZE];
+    putUint64(meta, req.cas);
+    putUint32(meta + 8, static_cast<uint32_t>(req.exptime));
+    memcpy(meta + 12, &req.flags, sizeof(req.flags));
+    putUint64(meta + 16, req.revSeqno);
+    putUint64(meta + 24, static_cast<uint64_t>(req.seqno));
+    meta[DOC_DELETED_OFFSET] = req.deleted ? 1 : 0;
+    meta[DOC_DELETED_OFFSET + 1] = req.value.get() ?
+        static_cast<char>(req.value->getDataType()) : BLOB_DATATYPE_RAW;
+
+    std::string doc(meta, sizeof(meta));
+    if (!req.deleted && req.getNBytes() > 0) {
+        doc.append(req.value->getData(), req.getNBytes());
+    }
+    return doc;
+}
+
+static bool isDeletedDoc(const leveldb::Slice &doc) {
+    return doc.size() >= DOC_META_SIZE && doc[DOC_DELETED_OFFSET] != 0;
+}
+
+/**
+ * Get the time a deletion was persisted at, which is kept in its expiry
+ * time.
+ */
+static time_t getDeletionTime(const leveldb::Slice &doc) {
+    return static_cast<time_t>(getUint32(doc.data() + 8));
+}
+
+static std::string encodeCounts(const leveldb_vb_counts &counts) {
+    char buf[COUNTS_SIZE];
+    putUint64(buf, counts.lastSeqno);
+    putUint64(buf + 8, counts.itemCount);
+    putUint64(buf + 16, counts.deletedCount);
+    putUint64(buf + 24, counts.maxDeletedSeqno);
+    putUint64(buf + 32, counts.purgeSeqno);
+    return std::string(buf, sizeof(buf));
+}
+
+static bool decodeCounts(const std::string &buf, leveldb_vb_counts &counts) {
+    if (buf.size() != COUNTS_SIZE) {
+        return false;
+    }
+    counts.lastSeqno = getUint64(buf.data());
+    counts.itemCount = getUint64(buf.data() + 8);
+    counts.deletedCount = getUint64(buf.data() + 16);
+    counts.maxDeletedSeqno = getUint64(buf.data() + 24);
+    counts.purgeSeqno = getUint64(buf.data() + 32);
+    return true;
+}
+
+static std::string encodeVBState(const vbucket_state &vbstate) {
+    char buf[VBSTATE_SIZE];
+    putUint32(buf, static_cast<uint32_t>(vbstate.state));
+    putUint64(buf + 4, vbstate.checkpointId);
+    return std::string(buf, sizeof(buf));
+}
+
+/**
+ * A database opened by the stores of a bucket, and the cache and bloom
+ * filter policy it was opened with.
+ */
+class LevelDBHandle {
+public:
+    LevelDBHandle() : db(NULL), cache(NULL), filter(NULL), refs(0) { }
+
+    ~LevelDBHandle() {
+        // The database must go before what it was opened with.
+        delete db;
+        delete cache;
+        delete filter;
+    }
+
+    leveldb::DB *db;
+    leveldb::Cache *cache;
+    const leveldb::FilterPolicy *filter;
+    size_t refs;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LevelDBHandle);
+};
+
+static Mutex handlesMutex;
+static std::map<std::string, LevelDBHandle *> handles;
+
+static LevelDBHandle *acquireHandle(Configuration &config,
+                                    const std::string &dbname) {
+    LockHolder lh(handlesMutex);
+    std::map<std::string, LevelDBHandle *>::iterator it = handles.find(dbname);
+    if (it != handles.end()) {
+        ++it->second->refs;
+        return it->second;
+    }
+
+    struct stat dbstat;
+    if (stat(dbname.c_str(), &dbstat) != 0 &&
+        mkdir(dbname.c_str(), S_IRWXU) == -1) {
+        std::stringstream ss;
+        ss << "Warning: Failed to create data directory ["
+           << dbname << "]: " << strerror(errno);
+        throw std::runtime_error(ss.str());
+    }
+
+    LevelDBHandle *handle = new LevelDBHandle;
+    handle->cache = leveldb::NewLRUCache(config.getLeveldbCacheSize());
+    handle->filter = leveldb::NewBloomFilterPolicy(BLOOM_BITS_PER_KEY);
+
+    leveldb::Options options;
+    options.create_if_missing = true;
+    options.write_buffer_size = config.getLeveldbWriteBufferSize();
+    options.block_cache = handle->cache;
+    options.filter_policy = handle->filter;
+
+    std::string path = dbname + "/leveldb";
+    leveldb::Status s = leveldb::DB::Open(options, path, &handle->db);
+    if (!s.ok()) {
+        delete handle;
+        std::stringstream ss;
+        ss << "Warning: Failed to open the leveldb database [" << path
+           << "]: " << s.ToString();
+        throw std::runtime_error(ss.str());
+    }
+    LOG(EXTENSION_LOG_INFO, "Opened the leveldb database %s", path.c_str());
+
+    handle->refs = 1;
+    handles[dbname] = handle;
+    return handle;
+}
+
+static void releaseHandle(const std::string &dbname, LevelDBHandle *handle) {
+    LockHolder lh(handlesMutex);
+    std::map<std::string, LevelDBHandle *>::iterator it = handles.find(dbname);
+    assert(it != handles.end() && it->second == handle);
+    if (--handle->refs == 0) {
+        delete handle;
+        handles.erase(it);
+    }
+}
+
+LevelDBKVStore::LevelDBKVStore(EPStats &stats, Configuration &config,
+                               bool read_only) :
+    KVStore(read_only), epStats(stats), configuration(config),
+    dbname(configuration.getDbname()),
+    handle(acquireHandle(configuration, dbname)), db(handle->db),
+    intransaction(false)
+{
+}
+
+LevelDBKVStore::~LevelDBKVStore() {
+    releaseHandle(dbname, handle);
+}
+
+void LevelDBKVStore::reset()
+{
+    assert(!isReadOnly());
+    vbucket_map_t::iterator itor = cachedVBStates.begin();
+    for (; itor != cachedVBStates.end(); ++itor) {
+        itor->second.checkpointId = 0;
+        itor->second.maxDeletedSeqno = 0;
+        itor->second.purgeSeqno = 0;
+        wipeVBucket(itor->first, &itor->second);
+    }
+}
+
+bool LevelDBKVStore::commit()
+{
+    assert(!isReadOnly());
+    if (intransaction) {
+        intransaction = commitBatch() ? false : true;
+    }
+    return !intransaction;
+}
+
+StorageProperties LevelDBKVStore::getStorageProperties()
+{
+    // A vbucket is deleted doc by doc, though in batches.
+    StorageProperties rv(true, false, true, true);
+    return rv;
+}
+
+void LevelDBKVStore::set(const Item &itm, Callback<mutation_result> &cb)
+{
+    assert(!isReadOnly());
+    assert(intransaction);
+    pendingReqs.push_back(LevelDBRequest(itm, &cb));
+}
+
+void LevelDBKVStore::del(const Item &itm, uint64_t, Callback<int> &cb)
+{
+    assert(!isReadOnly());
+    assert(intransaction);
+    pendingReqs.push_back(LevelDBRequest(itm, &cb));
+}
+
+void LevelDBKVStore::get(const std::string &key, uint64_t, uint16_t vb,
+                         Callback<GetValue> &cb)
+{
+    hrtime_t start = gethrtime();
+    RememberingCallback<GetValue> *rc =
+        dynamic_cast<RememberingCallback<GetValue> *>(&cb);
+    bool getMetaOnly = rc && rc->val.isPartial();
+
+    GetValue rv;
+    if (readDoc(vb, key, rv, getMetaOnly) &&
+        rv.getStatus() == ENGINE_SUCCESS) {
+        st.readTimeHisto.add((gethrtime() - start) / 1000);
+        st.readSizeHisto.add(key.length() + rv.getValue()->getNBytes());
+    }
+    cb.callback(rv);
+}
+
+void LevelDBKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms)
+{
+    // Read the keys in order, as the docs of neighbouring keys are in the
+    // same blocks.
+    std::vector<std::pair<std::string, std::list<VBucketBGFetchItem *> *> > keys;
+    vb_bgfetch_queue_t::iterator itr = itms.begin();
+    for (; itr != itms.end(); ++itr) {
+        keys.push_back(std::make_pair(itr->second.front()->key, &itr->second));
+    }
+    std::sort(keys.begin(), keys.end());
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        GetValue rv;
+        bool success = readDoc(vb, keys[i].first, rv, false) &&
+                       rv.getStatus() == ENGINE_SUCCESS;
+        std::list<VBucketBGFetchItem *> &fetches = *(keys[i].second);
+        std::list<VBucketBGFetchItem *>::iterator fitr = fetches.begin();
+        for (; fitr != fetches.end(); ++fitr) {
+            // populate return value for remaining fetch items with the
+            // same seqid
+            (*fitr)->value = rv;
+            st.readTimeHisto.add((gethrtime() - (*fitr)->initTime) / 1000);
+            if (success) {
+                st.readSizeHisto.add(keys[i].first.length() +
+                                     rv.getValue()->getNBytes());
+            }
+        }
+    }
+}
+
+bool LevelDBKVStore::getKeysAfter(uint16_t vb, const std::string &key,
+                                  const std::string &prefix, size_t count,
+                                  std::vector<std::string> &keys)
+{
+    std::string vbPrefix = vbKey(DOC_PREFIX, vb);
+    std::string start = vbPrefix + key;
+    std::string first = vbPrefix + prefix;
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = false;
+
+    leveldb::Iterator *it = db->NewIterator(ropts);
+    for (it->Seek(start);
+         keys.size() < count && it->Valid() && it->key().starts_with(first);
+         it->Next()) {
+        if (it->key() == leveldb::Slice(start) || isDeletedDoc(it->value())) {
+            continue;
+        }
+        keys.push_back(std::string(it->key().data() + vbPrefix.size(),
+                                   it->key().size() - vbPrefix.size()));
+    }
+    bool rv = it->status().ok();
+    delete it;
+    return rv;
+}
+
+bool LevelDBKVStore::rangeScan(uint16_t vb, const std::string &start,
+                               const std::string &end, size_t limit,
+                               bool keysOnly, Callback<GetValue> &cb)
+{
+    std::string vbPrefix = vbKey(DOC_PREFIX, vb);
+    std::string first = vbPrefix + start;
+    std::string last = vbPrefix + end;
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = false;
+
+    size_t count = 0;
+    leveldb::Iterator *it = db->NewIterator(ropts);
+    for (it->Seek(first);
+         count < limit && it->Valid() && it->key().starts_with(vbPrefix) &&
+         (end.empty() || it->key().compare(leveldb::Slice(last)) < 0);
+         it->Next()) {
+        leveldb::Slice key(it->key().data() + vbPrefix.size(),
+                           it->key().size() - vbPrefix.size());
+        if (isDeletedDoc(it->value())) {
+            continue;
+        }
+        bool deleted = false;
+        Item *itm = decodeDoc(vb, key, it->value(), keysOnly, deleted);
+        if (itm == NULL) {
+            delete it;
+            return false;
+        }
+        GetValue rv(itm, ENGINE_SUCCESS, -1, keysOnly);
+        cb.callback(rv);
+        ++count;
+    }
+    bool rv = it->status().ok();
+    delete it;
+    return rv;
+}
+
+bool LevelDBKVStore::readDoc(uint16_t vbid, const std::string &key,
+                             GetValue &rv, bool metaOnly)
+{
+    std::string doc;
+    leveldb::Status s = db->Get(leveldb::ReadOptions(), docKey(vbid, key),
+                                &doc);
+    if (s.IsNotFound()) {
+        rv.setStatus(ENGINE_KEY_ENOENT);
+        return true;
+    }
+
+    bool deleted = false;
+    Item *it = NULL;
+    if (s.ok()) {
+        it = decodeDoc(vbid, key, doc, metaOnly, deleted);
+    }
+    if (it == NULL) {
+        ++st.numGetFailure;
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to retrieve key value from database, "
+            "vBucket=%d key=%s error=%s", vbid, key.c_str(),
+            s.ok() ? "bad doc" : s.ToString().c_str());
+        rv.setStatus(ENGINE_TMPFAIL);
+        return false;
+    }
+
+    if (deleted && !metaOnly) {
+        // The deletion is only there for its meta data.
+        delete it;
+        rv.setStatus(ENGINE_KEY_ENOENT);
+        return true;
+    }
+
+    // update ep-engine IO stats
+    ++epStats.io_num_read;
+    epStats.io_read_bytes += key.length() + it->getNBytes();
+    rv = GetValue(it);
+    return true;
+}
+
+Item *LevelDBKVStore::decodeDoc(uint16_t vbid, const leveldb::Slice &key,
+                                const leveldb::Slice &doc, bool keysOnly,
+                                bool &deleted)
+{
+    if (doc.size() < DOC_META_SIZE || key.size() > UINT16_MAX) {
+        return NULL;
+    }
+    const char *meta = doc.data();
+    uint64_t cas = getUint64(meta);
+    time_t exptime = static_cast<time_t>(getUint32(meta + 8));
+    uint32_t flags;
+    memcpy(&flags, meta + 12, sizeof(flags));
+    uint64_t revSeqno = getUint64(meta + 16);
+    int64_t seqno = static_cast<int64_t>(getUint64(meta + 24));
+    deleted = meta[DOC_DELETED_OFFSET] != 0;
+    uint8_t datatype = static_cast<uint8_t>(meta[DOC_DELETED_OFFSET + 1]);
+
+    if (keysOnly || deleted) {
+        return new Item(key.data(), static_cast<uint16_t>(key.size()), flags,
+                        exptime, NULL, 0, cas, seqno, vbid, revSeqno);
+    }
+    value_t value(Blob::New(meta + DOC_META_SIZE, doc.size() - DOC_META_SIZE,
+                            datatype));
+    return new Item(key.ToString(), flags, exptime, value, cas, seqno, vbid,
+                    revSeqno);
+}
+
+bool LevelDBKVStore::commitBatch(void)
+{
+    if (pendingReqs.empty()) {
+        return true;
+    }
+
+    hrtime_t start = gethrtime();
+    leveldb::WriteBatch batch;
+    std::map<uint16_t, leveldb_vb_counts> counts;
+    // Whether the doc written last for each key of the batch is a deletion
+    std::map<std::string, bool> written;
+    bool success = true;
+
+    size_t numReqs = pendingReqs.size();
+    for (size_t i = 0; i < numReqs && success; ++i) {
+        LevelDBRequest &req = pendingReqs[i];
+        uint16_t vbid = req.vbid;
+        std::map<uint16_t, leveldb_vb_counts>::iterator cit = counts.find(vbid);
+        if (cit == counts.end()) {
+            cit = counts.insert(std::make_pair(vbid, getCounts(vbid))).first;
+        }
+        leveldb_vb_counts &c = cit->second;
+        std::string key = docKey(vbid, req.key);
+
+        // The doc replaces the one the key has on disk in the counts.  The
+        // bloom filters make the read cheap for a key that's new.
+        bool hadDoc = false;
+        bool wasDeleted = false;
+        std::map<std::string, bool>::iterator wit = written.find(key);
+        if (wit != written.end()) {
+            hadDoc = true;
+            wasDeleted = wit->second;
+        } else {
+            std::string old;
+            leveldb::Status s = db->Get(leveldb::ReadOptions(), key, &old);
+            if (s.ok()) {
+                hadDoc = true;
+                wasDeleted = isDeletedDoc(old);
+            } else if (!s.IsNotFound()) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: failed to read the doc being replaced, "
+                    "vBucket=%d key=%s error=%s", vbid,
+                    req.key.c_str(), s.ToString().c_str());
+                success = false;
+                break;
+            }
+        }
+        if (hadDoc && wasDeleted && c.deletedCount > 0) {
+            --c.deletedCount;
+        } else if (hadDoc && !wasDeleted && c.itemCount > 0) {
+            --c.itemCount;
+        }
+        if (req.deleted) {
+            ++c.deletedCount;
+            c.maxDeletedSeqno = std::max(c.maxDeletedSeqno, req.revSeqno);
+        } else {
+            ++c.itemCount;
+        }
+        written[key] = req.deleted;
+
+        req.seqno = static_cast<int64_t>(++c.lastSeqno);
+        batch.Put(key, encodeDoc(req));
+    }
+
+    if (success) {
+        std::map<uint16_t, leveldb_vb_counts>::iterator cit = counts.begin();
+        for (; cit != counts.end(); ++cit) {
+            batch.Put(vbKey(COUNTS_PREFIX, cit->first),
+                      encodeCounts(cit->second));
+        }
+
+        leveldb::WriteOptions options;
+        options.sync = true;
+        leveldb::Status s = db->Write(options, &batch);
+        if (s.ok()) {
+            for (cit = counts.begin(); cit != counts.end(); ++cit) {
+                cachedCounts[cit->first] = cit->second;
+            }
+        } else {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: commit failed, cannot write the batch of %llu "
+                "docs: %s", static_cast<unsigned long long>(numReqs),
+                s.ToString().c_str());
+            success = false;
+        }
+    }
+
+    if (success) {
+        st.commitHisto.add((gethrtime() - start) / 1000);
+        st.batchSize.add(numReqs);
+        st.docsCommitted.set(numReqs);
+    } else {
+        ++epStats.commitFailed;
+    }
+    commitCallback(success);
+    pendingReqs.clear();
+    return true;
+}
+
+void LevelDBKVStore::commitCallback(bool success)
+{
+    hrtime_t now = gethrtime();
+    int rv = success ? MUTATION_SUCCESS : MUTATION_FAILED;
+    size_t numReqs = pendingReqs.size();
+    for (size_t index = 0; index < numReqs; index++) {
+        LevelDBRequest &req = pendingReqs[index];
+        size_t dataSize = req.getNBytes();
+        size_t keySize = req.key.length();
+        /* update ep stats */
+        ++epStats.io_num_write;
+        epStats.io_write_bytes += keySize + dataSize;
+
+        if (req.deleted) {
+            if (success) {
+                st.delTimeHisto.add((now - req.start) / 1000);
+            } else {
+                ++st.numDelFailure;
+            }
+            req.delCb->callback(rv);
+        } else {
+            int64_t newItemId = req.seqno;
+            if (success) {
+                st.writeTimeHisto.add((now - req.start) / 1000);
+                st.writeSizeHisto.add(dataSize + keySize);
+            } else {
+                ++st.numSetFailure;
+                newItemId = 0;
+            }
+            mutation_result p(rv, newItemId);
+            req.setCb->callback(p);
+        }
+    }
+}
+
+leveldb_vb_counts &LevelDBKVStore::getCounts(uint16_t vbid)
+{
+    std::map<uint16_t, leveldb_vb_counts>::iterator it =
+        cachedCounts.find(vbid);
+    if (it == cachedCounts.end()) {
+        it = cachedCounts.insert(std::make_pair(vbid,
+                                                leveldb_vb_counts())).first;
+        readCounts(vbid, it->second);
+    }
+    return it->second;
+}
+
+bool LevelDBKVStore::readCounts(uint16_t vbid, leveldb_vb_counts &counts)
+{
+    std::string buf;
+    leveldb::Status s = db->Get(leveldb::ReadOptions(),
+                                vbKey(COUNTS_PREFIX, vbid), &buf);
+    if (s.ok() && decodeCounts(buf, counts)) {
+        return true;
+    }
+    if (!s.IsNotFound()) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to read the counts of vBucket=%d: %s",
+            vbid, s.ok() ? "bad record" : s.ToString().c_str());
+    }
+    counts = leveldb_vb_counts();
+    return false;
+}
+
+bool LevelDBKVStore::wipeVBucket(uint16_t vbid, const vbucket_state *vbstate)
+{
+    std::string prefix = vbKey(DOC_PREFIX, vbid);
+    leveldb::WriteOptions options;
+    options.sync = true;
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = false;
+
+    // The docs are removed in batches, as there may be too many of them
+    // for one.  The vbucket's other records go with the last.
+    leveldb::Iterator *it = db->NewIterator(ropts);
+    leveldb::Status s;
+    bool more = true;
+    it->Seek(prefix);
+    while (more && s.ok()) {
+        leveldb::WriteBatch batch;
+        size_t n = 0;
+        for (; it->Valid() && it->key().starts_with(prefix) &&
+               n < WIPE_BATCH_SIZE; it->Next(), ++n) {
+            batch.Delete(it->key());
+        }
+        more = it->Valid() && it->key().starts_with(prefix);
+        if (!more) {
+            batch.Delete(vbKey(COUNTS_PREFIX, vbid));
+            if (vbstate) {
+                batch.Put(vbKey(VBSTATE_PREFIX, vbid),
+                          encodeVBState(*vbstate));
+            } else {
+                batch.Delete(vbKey(VBSTATE_PREFIX, vbid));
+            }
+        }
+        s = db->Write(options, &batch);
+    }
+    if (s.ok()) {
+        s = it->status();
+    }
+    delete it;
+    cachedCounts.erase(vbid);
+    compactions.erase(vbid);
+
+    if (!s.ok()) {
+        ++st.numVbSetFailure;
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to delete the docs of vBucket=%d: %s",
+            vbid, s.ToString().c_str());
+        return false;
+    }
+
+    // Drop the deletions of the docs, and the docs, from the tables now
+    // rather than whenever they're next merged.
+    std::string end = prefixEnd(prefix);
+    leveldb::Slice begin(prefix), limit(end);
+    db->CompactRange(&begin, &limit);
+    return true;
+}
+
+bool LevelDBKVStore::delVBucket(uint16_t vbucket, bool recreate)
+{
+    assert(!isReadOnly());
+    if (recreate) {
+        vbucket_state vbstate(vbucket_state_dead, 0, 0);
+        vbucket_map_t::iterator it = cachedVBStates.find(vbucket);
+        if (it != cachedVBStates.end()) {
+            vbstate.state = it->second.state;
+        }
+        cachedVBStates[vbucket] = vbstate;
+        return wipeVBucket(vbucket, &vbstate);
+    }
+    cachedVBStates.erase(vbucket);
+    return wipeVBucket(vbucket, NULL);
+}
+
+vbucket_map_t LevelDBKVStore::listPersistedVbuckets()
+{
+    cachedVBStates.clear();
+
+    std::string prefix(1, VBSTATE_PREFIX);
+    leveldb::Iterator *it = db->NewIterator(leveldb::ReadOptions());
+    for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+         it->Next()) {
+        leveldb::Slice val = it->value();
+        if (it->key().size() != prefix.size() + sizeof(uint16_t) ||
+            val.size() != VBSTATE_SIZE) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: a vbucket state is in the wrong format");
+            continue;
+        }
+        uint16_t vbid = vbOfKey(it->key());
+        vbucket_state vbstate;
+        vbstate.state = static_cast<vbucket_state_t>(getUint32(val.data()));
+        vbstate.checkpointId = getUint64(val.data() + 4);
+        leveldb_vb_counts counts;
+        readCounts(vbid, counts);
+        vbstate.maxDeletedSeqno = counts.maxDeletedSeqno;
+        vbstate.purgeSeqno = counts.purgeSeqno;
+
+        cachedVBStates[vbid] = vbstate;
+        ++st.numLoadedVb;
+    }
+    if (!it->status().ok()) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to read the vbucket states: %s",
+            it->status().ToString().c_str());
+    }
+    delete it;
+    return cachedVBStates;
+}
+
+bool LevelDBKVStore::snapshotVBuckets(const vbucket_map_t &vbstates)
+{
+    assert(!isReadOnly());
+    leveldb::WriteBatch batch;
+    size_t changed = 0;
+
+    vbucket_map_t::const_iterator iter = vbstates.begin();
+    for (; iter != vbstates.end(); ++iter) {
+        uint16_t vbucketId = iter->first;
+        const vbucket_state &vbstate = iter->second;
+        vbucket_map_t::iterator it = cachedVBStates.find(vbucketId);
+        if (it != cachedVBStates.end()) {
+            if (it->second.state == vbstate.state &&
+                it->second.checkpointId == vbstate.checkpointId) {
+                continue; // no changes
+            }
+            it->second.state = vbstate.state;
+            it->second.checkpointId = vbstate.checkpointId;
+        } else {
+            cachedVBStates[vbucketId] = vbstate;
+        }
+        batch.Put(vbKey(VBSTATE_PREFIX, vbucketId), encodeVBState(vbstate));
+        ++changed;
+    }
+
+    if (changed == 0) {
+        return true;
+    }
+    leveldb::WriteOptions options;
+    options.sync = true;
+    leveldb::Status s = db->Write(options, &batch);
+    if (!s.ok()) {
+        ++st.numVbSetFailure;
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to set the new states of %llu vbuckets: %s",
+            static_cast<unsigned long long>(changed), s.ToString().c_str());
+        // Have them written again by the next snapshot.
+        cachedVBStates.clear();
+        return false;
+    }
+    return true;
+}
+
+void LevelDBKVStore::getPersistedStats(std::map<std::string,
+                                       std::string> &stats)
+{
+    std::string prefix(1, STAT_PREFIX);
+    leveldb::Iterator *it = db->NewIterator(leveldb::ReadOptions());
+    for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+         it->Next()) {
+        std::string name(it->key().data() + 1, it->key().size() - 1);
+        stats[name] = it->value().ToString();
+    }
+    if (!it->status().ok()) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to load the engine session stats: %s",
+            it->status().ToString().c_str());
+    }
+    delete it;
+}
+
+bool LevelDBKVStore::snapshotStats(const std::map<std::string,
+                                   std::string> &stats)
+{
+    assert(!isReadOnly());
+    leveldb::WriteBatch batch;
+
+    // Replace the stats of the last snapshot, those no longer there too.
+    std::string prefix(1, STAT_PREFIX);
+    leveldb::Iterator *it = db->NewIterator(leveldb::ReadOptions());
+    for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+         it->Next()) {
+        std::string name(it->key().data() + 1, it->key().size() - 1);
+        if (stats.find(name) == stats.end()) {
+            batch.Delete(it->key());
+        }
+    }
+    delete it;
+
+    std::map<std::string, std::string>::const_iterator sit = stats.begin();
+    for (; sit != stats.end(); ++sit) {
+        batch.Put(prefix + sit->first, sit->second);
+    }
+
+    leveldb::WriteOptions options;
+    options.sync = true;
+    leveldb::Status s = db->Write(options, &batch);
+    if (!s.ok()) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to log the engine stats: %s",
+            s.ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+void LevelDBKVStore::dump(shared_ptr<Callback<GetValue> > cb)
+{
+    loadDB(cb, false, NULL, DUMP_NO_DELETES);
+}
+
+void LevelDBKVStore::dump(uint16_t vb, shared_ptr<Callback<GetValue> > cb)
+{
+    std::vector<uint16_t> vbids;
+    vbids.push_back(vb);
+    loadDB(cb, false, &vbids, DUMP_ALL);
+}
+
+void LevelDBKVStore::dump(const std::vector<uint16_t> &vbids,
+                          shared_ptr<Callback<GetValue> > cb)
+{
+    loadDB(cb, false, &vbids, DUMP_NO_DELETES);
+}
+
+void LevelDBKVStore::dumpKeys(const std::vector<uint16_t> &vbids,
+                              shared_ptr<Callback<GetValue> > cb)
+{
+    loadDB(cb, true, &vbids, DUMP_NO_DELETES);
+}
+
+void LevelDBKVStore::dumpKeys(uint16_t vb, shared_ptr<Callback<GetValue> > cb)
+{
+    std::vector<uint16_t> vbids;
+    vbids.push_back(vb);
+    loadDB(cb, true, &vbids, DUMP_NO_DELETES);
+}
+
+void LevelDBKVStore::dumpDeleted(uint16_t vb,
+                                 shared_ptr<Callback<GetValue> > cb)
+{
+    std::vector<uint16_t> vbids;
+    vbids.push_back(vb);
+    loadDB(cb, true, &vbids, DUMP_DELETES_ONLY);
+}
+
+void LevelDBKVStore::loadDB(shared_ptr<Callback<GetValue> > cb,
+                            bool keysOnly,
+                            const std::vector<uint16_t> *vbids,
+                            dump_options options)
+{
+    std::vector<uint16_t> vbuckets;
+    if (vbids) {
+        vbuckets = *vbids;
+    } else {
+        // Load the active vbuckets first, then the replicas; dead ones
+        // aren't loaded.
+        if (cachedVBStates.empty()) {
+            listPersistedVbuckets();
+        }
+        std::vector<uint16_t> replicas;
+        vbucket_map_t::const_iterator it = cachedVBStates.begin();
+        for (; it != cachedVBStates.end(); ++it) {
+            if (it->second.state == vbucket_state_active) {
+                vbuckets.push_back(it->first);
+            } else if (it->second.state == vbucket_state_replica) {
+                replicas.push_back(it->first);
+            }
+        }
+        vbuckets.insert(vbuckets.end(), replicas.begin(), replicas.end());
+    }
+
+    std::vector<uint16_t>::iterator itr = vbuckets.begin();
+    for (; itr != vbuckets.end(); ++itr) {
+        if (!loadVBucket(*itr, cb, keysOnly, options)) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Canceling loading database, warmup has completed\n");
+            break;
+        }
+    }
+}
+
+bool LevelDBKVStore::loadVBucket(uint16_t vbid,
+                                 shared_ptr<Callback<GetValue> > cb,
+                                 bool keysOnly, dump_options options)
+{
+    bool warmup = !epStats.warmupComplete.get();
+    std::string prefix = vbKey(DOC_PREFIX, vbid);
+    leveldb::ReadOptions ropts;
+    // Don't have a dump push the hot blocks out of the cache.
+    ropts.fill_cache = false;
+
+    bool cancelled = false;
+    leveldb::Iterator *it = db->NewIterator(ropts);
+    for (it->Seek(prefix);
+         !cancelled && it->Valid() && it->key().starts_with(prefix);
+         it->Next()) {
+        leveldb::Slice key(it->key().data() + prefix.size(),
+                           it->key().size() - prefix.size());
+        if (warmup) {
+            // skip items already loaded during earlier warmup stage
+            LoadStorageKVPairCallback *lscb =
+                static_cast<LoadStorageKVPairCallback *>(cb.get());
+            if (lscb->isLoaded(key.data(), key.size(), vbid)) {
+                continue;
+            }
+        }
+
+        bool deleted = false;
+        Item *itm = decodeDoc(vbid, key, it->value(), keysOnly, deleted);
+        if (itm == NULL) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to retrieve key value from database, "
+                "vBucket=%d key=%s error=bad doc", vbid,
+                key.ToString().c_str());
+            continue;
+        }
+        if ((deleted && options == DUMP_NO_DELETES) ||
+            (!deleted && options == DUMP_DELETES_ONLY)) {
+            delete itm;
+            continue;
+        }
+
+        GetValue rv(itm, ENGINE_SUCCESS, -1, keysOnly);
+        cb->callback(rv);
+
+        if (warmup && epStats.warmupComplete.get()) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Engine warmup is complete, request to stop "
+                "loading remaining database");
+            cancelled = true;
+        }
+    }
+    if (!it->status().ok()) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to dump the docs of vBucket=%d: %s",
+            vbid, it->status().ToString().c_str());
+    }
+    delete it;
+    return !cancelled;
+}
+
+bool LevelDBKVStore::getEstimatedItemCount(size_t &items)
+{
+    items = 0;
+    std::string prefix(1, COUNTS_PREFIX);
+    leveldb::Iterator *it = db->NewIterator(leveldb::ReadOptions());
+    for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+         it->Next()) {
+        leveldb_vb_counts counts;
+        if (decodeCounts(it->value().ToString(), counts)) {
+            items += counts.itemCount;
+        }
+    }
+    bool success = it->status().ok();
+    if (!success) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to read the counts of the vbuckets: %s",
+            it->status().ToString().c_str());
+    }
+    delete it;
+    return success;
+}
+
+size_t LevelDBKVStore::getNumPersistedDeletes(uint16_t vbid)
+{
+    if (!isReadOnly()) {
+        return getCounts(vbid).deletedCount;
+    }
+    leveldb_vb_counts counts;
+    readCounts(vbid, counts);
+    return counts.deletedCount;
+}
+
+bool LevelDBKVStore::getDbFileInfo(uint16_t vbid, vbucket_file_info &info)
+{
+    leveldb_vb_counts counts;
+    if (!readCounts(vbid, counts)) {
+        return false;
+    }
+    std::string prefix = vbKey(DOC_PREFIX, vbid);
+    std::string end = prefixEnd(prefix);
+    leveldb::Range range(prefix, end);
+    uint64_t size = 0;
+    db->GetApproximateSizes(&range, 1, &size);
+
+    // The merges reclaim the space of replaced docs on their own; it's
+    // only the deletions that need compacting.
+    info.fileSize = size;
+    info.spaceUsed = size;
+    info.itemCount = counts.itemCount;
+    info.deletedCount = counts.deletedCount;
+    return true;
+}
+
+bool LevelDBKVStore::compactVBucket(compaction_ctx &ctx)
+{
+    assert(!isReadOnly());
+    uint16_t vbid = ctx.vbid;
+    std::string prefix = vbKey(DOC_PREFIX, vbid);
+    std::string end = prefixEnd(prefix);
+    std::map<uint16_t, std::string>::iterator cit = compactions.find(vbid);
+    if (cit == compactions.end()) {
+        leveldb::Range range(prefix, end);
+        uint64_t size = 0;
+        db->GetApproximateSizes(&range, 1, &size);
+        ctx.oldFileSize = size;
+        cit = compactions.insert(std::make_pair(vbid, prefix)).first;
+    }
+
+    leveldb_vb_counts counts = getCounts(vbid);
+    leveldb::WriteBatch batch;
+    size_t bytes = 0;
+    size_t purged = 0;
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = false;
+    leveldb::Iterator *it = db->NewIterator(ropts);
+    for (it->Seek(cit->second);
+         it->Valid() && it->key().starts_with(prefix) && bytes < ctx.maxBytes;
+         it->Next()) {
+        bytes += it->key().size() + it->value().size();
+        leveldb::Slice doc = it->value();
+        if (ctx.purgeBefore > 0 && isDeletedDoc(doc) &&
+            getDeletionTime(doc) < ctx.purgeBefore) {
+            batch.Delete(it->key());
+            counts.purgeSeqno = std::max(counts.purgeSeqno,
+                                         getUint64(doc.data() + 16));
+            ++purged;
+        }
+    }
+    bool more = it->Valid() && it->key().starts_with(prefix);
+    if (more) {
+        cit->second = it->key().ToString();
+    }
+    leveldb::Status s = it->status();
+    delete it;
+    ctx.bytesCopied = bytes;
+
+    if (s.ok() && purged > 0) {
+        counts.deletedCount -= std::min(counts.deletedCount,
+                                        static_cast<uint64_t>(purged));
+        batch.Put(vbKey(COUNTS_PREFIX, vbid), encodeCounts(counts));
+        leveldb::WriteOptions options;
+        options.sync = true;
+        s = db->Write(options, &batch);
+        if (s.ok()) {
+            cachedCounts[vbid] = counts;
+            ctx.tombstonesPurged += purged;
+        }
+    }
+    if (!s.ok()) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to purge the deletions of vBucket=%d: %s",
+            vbid, s.ToString().c_str());
+        compactions.erase(cit);
+        return false;
+    }
+    if (more) {
+        return true;
+    }
+
+    compactions.erase(cit);
+    leveldb::Slice begin(prefix), limit(end);
+    db->CompactRange(&begin, &limit);
+    leveldb::Range range(prefix, end);
+    uint64_t size = 0;
+    db->GetApproximateSizes(&range, 1, &size);
+    ctx.newFileSize = size;
+    ctx.purgeSeqno = counts.purgeSeqno;
+    ctx.done = true;
+    return true;
+}
+
+void LevelDBKVStore::abortCompaction(uint16_t vbid)
+{
+    compactions.erase(vbid);
+}
+
+void LevelDBKVStore::optimizeWrites(std::vector<queued_item> &items)
+{
+    assert(!isReadOnly());
+    if (items.empty()) {
+        return;
+    }
+    // The batch's docs are then written in the order of their keys.
+    CompareQueuedItemsByVBAndKey cq;
+    std::sort(items.begin(), items.end(), cq);
+}
+
+void LevelDBKVStore::addStats(const std::string &prefix,
+                              ADD_STAT add_stat,
+                              const void *c)
+{
+    const char *prefix_str = prefix.c_str();
+
+    /* stats for both read-only and read-write threads */
+    addStat(prefix_str, "backend_type",   "leveldb",          add_stat, c);
+    addStat(prefix_str, "readTime",       st.readTimeHisto,   add_stat, c);
+    addStat(prefix_str, "readSize",       st.readSizeHisto,   add_stat, c);
+    addStat(prefix_str, "numLoadedVb",    st.numLoadedVb,     add_stat, c);
+    size_t cacheMemUsed = handle->cache->TotalCharge();
+    addStat(prefix_str, "blockCacheMemUsed", cacheMemUsed,    add_stat, c);
+    std::string level0;
+    if (db->GetProperty("leveldb.num-files-at-level0", &level0)) {
+        addStat(prefix_str, "numFilesAtLevel0", level0, add_stat, c);
+    }
+
+    // failure stats
+    addStat(prefix_str, "failure_get",    st.numGetFailure,  add_stat, c);
+
+    if (!isReadOnly()) {
+        addStat(prefix_str, "failure_set",   st.numSetFailure,   add_stat, c);
+        addStat(prefix_str, "failure_del",   st.numDelFailure,   add_stat, c);
+        addStat(prefix_str, "failure_vbset", st.numVbSetFailure, add_stat, c);
+        addStat(prefix_str, "lastCommDocs",  st.docsCommitted,   add_stat, c);
+    }
+}
+
+void LevelDBKVStore::addTimingStats(const std::string &prefix,
+                                    ADD_STAT add_stat, const void *c)
+{
+    const char *prefix_str = prefix.c_str();
+    if (!isReadOnly()) {
+        addStat(prefix_str, "commit",      st.commitHisto,      add_stat, c);
+        addStat(prefix_str, "delete",      st.delTimeHisto,     add_stat, c);
+        addStat(prefix_str, "writeTime",   st.writeTimeHisto,   add_stat, c);
+        addStat(prefix_str, "writeSize",   st.writeSizeHisto,   add_stat, c);
+        addStat(prefix_str, "bulkSize",    st.batchSize,        add_stat, c);
+    }
+}
+
+template <typename T>
+void LevelDBKVStore::addStat(const std::string &prefix, const char *stat,
+                             T &val, ADD_STAT add_stat, const void *c)
+{
+    std::stringstream fullstat;
+    fullstat << prefix << ":" << stat;
+    add_casted_stat(fullstat.str().c_str(), val, add_stat, c);
+}
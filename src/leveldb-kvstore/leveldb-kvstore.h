@@ -0,0 +1,290 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_LEVELDB_KVSTORE_LEVELDB_KVSTORE_H_
+#define SRC_LEVELDB_KVSTORE_LEVELDB_KVSTORE_H_ 1
+
+#include "config.h"
+
+#include <leveldb/db.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "configuration.h"
+#include "histo.h"
+#include "item.h"
+#include "kvstore.h"
+#include "stats.h"
+
+/**
+ * Stats and timings for LevelDBKVStore
+ */
+class LevelDBKVStoreStats {
+public:
+    LevelDBKVStoreStats() :
+        readSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
+        writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) {
+    }
+
+    void reset() {
+        docsCommitted.set(0);
+        numLoadedVb.set(0);
+        numGetFailure.set(0);
+        numSetFailure.set(0);
+        numDelFailure.set(0);
+        numVbSetFailure.set(0);
+
+        readTimeHisto.reset();
+        readSizeHisto.reset();
+        writeTimeHisto.reset();
+        writeSizeHisto.reset();
+        delTimeHisto.reset();
+        commitHisto.reset();
+        batchSize.reset();
+    }
+
+    // the number of docs committed
+    Atomic<size_t> docsCommitted;
+    // the number of vbuckets loaded
+    Atomic<size_t> numLoadedVb;
+
+    //stats tracking failures
+    Atomic<size_t> numGetFailure;
+    Atomic<size_t> numSetFailure;
+    Atomic<size_t> numDelFailure;
+    Atomic<size_t> numVbSetFailure;
+
+    // How long it takes us to complete a read
+    Histogram<hrtime_t> readTimeHisto;
+    // How big are our reads?
+    Histogram<size_t> readSizeHisto;
+    // How long it takes us to complete a write
+    Histogram<hrtime_t> writeTimeHisto;
+    // How big are our writes?
+    Histogram<size_t> writeSizeHisto;
+    // Time spent in delete() calls.
+    Histogram<hrtime_t> delTimeHisto;
+    // Time spent writing the batch of a commit
+    Histogram<hrtime_t> commitHisto;
+    // Number of mutations in the batch of a commit
+    Histogram<size_t> batchSize;
+};
+
+/**
+ * The count of the docs of a vbucket and the last seqno given to one, kept
+ * in the database along with the docs so they're written in the same batch.
+ */
+struct leveldb_vb_counts {
+    leveldb_vb_counts() : lastSeqno(0), itemCount(0), deletedCount(0),
+                          maxDeletedSeqno(0), purgeSeqno(0) { }
+
+    uint64_t lastSeqno;
+    uint64_t itemCount;
+    uint64_t deletedCount;
+    uint64_t maxDeletedSeqno;
+    //! The highest rev seqno of the deletions purged by compactions
+    uint64_t purgeSeqno;
+};
+
+/**
+ * A mutation of the transaction, written in the batch of its commit.
+ */
+struct LevelDBRequest {
+    LevelDBRequest(const Item &it, Callback<mutation_result> *cb) :
+        key(it.getKey()), value(it.getValue()), vbid(it.getVBucketId()),
+        cas(it.getCas()), exptime(it.getExptime()), flags(it.getFlags()),
+        revSeqno(it.getSeqno()), deleted(false), setCb(cb), delCb(NULL),
+        start(gethrtime()), seqno(0) { }
+
+    // A deletion keeps the time it was persisted at in its expiry time,
+    // for compactions to tell when it may be purged.
+    LevelDBRequest(const Item &it, Callback<int> *cb) :
+        key(it.getKey()), vbid(it.getVBucketId()), cas(it.getCas()),
+        exptime(ep_real_time()), flags(it.getFlags()),
+        revSeqno(it.getSeqno()), deleted(true), setCb(NULL), delCb(cb),
+        start(gethrtime()), seqno(0) { }
+
+    size_t getNBytes() const {
+        return value.get() ? value->length() : 0;
+    }
+
+    std::string key;
+    value_t value;
+    uint16_t vbid;
+    uint64_t cas;
+    time_t exptime;
+    uint32_t flags;
+    uint64_t revSeqno;
+    bool deleted;
+    Callback<mutation_result> *setCb;
+    Callback<int> *delCb;
+    hrtime_t start;
+    //! The seqno the doc is written with
+    int64_t seqno;
+};
+
+class LevelDBHandle;
+
+/**
+ * A KVStore of a LevelDB database, a log-structured merge tree that's
+ * written in sequential batches and merged in the background, for buckets
+ * that take more writes than couchstore's append-only B-trees keep up with.
+ *
+ * All the vbuckets of a bucket are kept in one database under the data
+ * directory, each key prefixed by its vbucket id so a vbucket is a range
+ * of it.  A database may be opened once per process, so all the stores of
+ * a bucket share the handle.  A mutation's rowid is a seqno of its
+ * vbucket; a doc is found by its key rather than by it.
+ */
+class LevelDBKVStore : public KVStore
+{
+public:
+    LevelDBKVStore(EPStats &stats, Configuration &config,
+                   bool read_only = false);
+
+    ~LevelDBKVStore();
+
+    void reset();
+
+    bool begin() {
+        assert(!isReadOnly());
+        intransaction = true;
+        return intransaction;
+    }
+
+    bool commit();
+
+    void rollback() {
+        assert(!isReadOnly());
+        if (intransaction) {
+            intransaction = false;
+            pendingReqs.clear();
+        }
+    }
+
+    StorageProperties getStorageProperties();
+
+    void set(const Item &item, Callback<mutation_result> &cb);
+    void get(const std::string &key, uint64_t rowid, uint16_t vb,
+             Callback<GetValue> &cb);
+    void getMulti(uint16_t vb, vb_bgfetch_queue_t &itms);
+    bool getKeysAfter(uint16_t vb, const std::string &key,
+                      const std::string &prefix, size_t count,
+                      std::vector<std::string> &keys);
+    bool rangeScan(uint16_t vb, const std::string &start,
+                   const std::string &end, size_t limit, bool keysOnly,
+                   Callback<GetValue> &cb);
+    void del(const Item &itm, uint64_t rowid, Callback<int> &cb);
+    bool delVBucket(uint16_t vbucket, bool recreate = false);
+
+    vbucket_map_t listPersistedVbuckets(void);
+    void getPersistedStats(std::map<std::string, std::string> &stats);
+    bool snapshotStats(const std::map<std::string, std::string> &m);
+    bool snapshotVBuckets(const vbucket_map_t &m);
+
+    void dump(shared_ptr<Callback<GetValue> > cb);
+    void dump(uint16_t vbid, shared_ptr<Callback<GetValue> > cb);
+    void dump(const std::vector<uint16_t> &vbids,
+              shared_ptr<Callback<GetValue> > cb);
+
+    bool isKeyDumpSupported() {
+        return true;
+    }
+
+    void dumpKeys(const std::vector<uint16_t> &vbids,
+                  shared_ptr<Callback<GetValue> > cb);
+    void dumpKeys(uint16_t vbid, shared_ptr<Callback<GetValue> > cb);
+    void dumpDeleted(uint16_t vbid, shared_ptr<Callback<GetValue> > cb);
+
+    bool getEstimatedItemCount(size_t &items);
+    size_t getNumPersistedDeletes(uint16_t vbid);
+
+    bool getDbFileInfo(uint16_t vbid, vbucket_file_info &info);
+
+    /**
+     * Purge the next deletions of a vbucket older than ctx.purgeBefore,
+     * reading up to ctx.maxBytes of its docs.  Once all of them are read,
+     * the vbucket's range of the tables is merged to reclaim the space.
+     */
+    bool compactVBucket(compaction_ctx &ctx);
+    void abortCompaction(uint16_t vbid);
+
+    void addStats(const std::string &prefix, ADD_STAT add_stat,
+                  const void *c);
+    void addTimingStats(const std::string &prefix, ADD_STAT add_stat,
+                        const void *c);
+
+    void resetStats() {
+        st.reset();
+    }
+
+    void optimizeWrites(std::vector<queued_item> &items);
+
+private:
+    enum dump_options {
+        DUMP_ALL,
+        DUMP_NO_DELETES,
+        DUMP_DELETES_ONLY
+    };
+
+    bool commitBatch(void);
+    void commitCallback(bool success);
+
+    bool readDoc(uint16_t vbid, const std::string &key, GetValue &rv,
+                 bool metaOnly);
+    Item *decodeDoc(uint16_t vbid, const leveldb::Slice &key,
+                    const leveldb::Slice &doc, bool keysOnly,
+                    bool &deleted);
+
+    void loadDB(shared_ptr<Callback<GetValue> > cb, bool keysOnly,
+                const std::vector<uint16_t> *vbids, dump_options options);
+    bool loadVBucket(uint16_t vbid, shared_ptr<Callback<GetValue> > cb,
+                     bool keysOnly, dump_options options);
+
+    bool wipeVBucket(uint16_t vbid, const vbucket_state *vbstate);
+    leveldb_vb_counts &getCounts(uint16_t vbid);
+    bool readCounts(uint16_t vbid, leveldb_vb_counts &counts);
+
+    template <typename T>
+    void addStat(const std::string &prefix, const char *nm, T &val,
+                 ADD_STAT add_stat, const void *c);
+
+    EPStats &epStats;
+    Configuration &configuration;
+    const std::string dbname;
+    LevelDBHandle *handle;
+    leveldb::DB *db;
+
+    bool intransaction;
+    std::vector<LevelDBRequest> pendingReqs;
+
+    //! The vbucket states of the last listPersistedVbuckets or snapshot
+    vbucket_map_t cachedVBStates;
+    //! The counts of the vbuckets this store has written
+    std::map<uint16_t, leveldb_vb_counts> cachedCounts;
+    //! Where the compactions in progress go on from, by vbucket
+    std::map<uint16_t, std::string> compactions;
+
+    LevelDBKVStoreStats st;
+
+    DISALLOW_COPY_AND_ASSIGN(LevelDBKVStore);
+};
+
+#endif  // SRC_LEVELDB_KVSTORE_LEVELDB_KVSTORE_H_
@@ -0,0 +1,66 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <map>
+
+#include "lock_profiler.h"
+#include "locks.h"
+
+typedef std::map<std::string, LockProfiler*> profiler_map_t;
+
+/*
+ * Made on first use, and never freed, so no lock made before or kept
+ * after can outlive its profile.
+ */
+static Mutex &registryMutex() {
+    static Mutex *m = new Mutex();
+    return *m;
+}
+
+static profiler_map_t &registry() {
+    static profiler_map_t *r = new profiler_map_t();
+    return *r;
+}
+
+LockProfiler *LockProfiler::get(const std::string &name) {
+    LockHolder lh(registryMutex());
+    profiler_map_t &r = registry();
+    profiler_map_t::iterator it = r.find(name);
+    if (it != r.end()) {
+        return it->second;
+    }
+    LockProfiler *p = new LockProfiler(name);
+    r[name] = p;
+    return p;
+}
+
+void LockProfiler::getAll(std::vector<LockProfiler*> &out) {
+    LockHolder lh(registryMutex());
+    profiler_map_t &r = registry();
+    for (profiler_map_t::iterator it = r.begin(); it != r.end(); ++it) {
+        out.push_back(it->second);
+    }
+}
+
+void LockProfiler::resetAll() {
+    std::vector<LockProfiler*> all;
+    getAll(all);
+    for (size_t i = 0; i < all.size(); ++i) {
+        all[i]->reset();
+    }
+}
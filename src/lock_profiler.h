@@ -0,0 +1,95 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_LOCK_PROFILER_H_
+#define SRC_LOCK_PROFILER_H_ 1
+
+#include "config.h"
+
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "histo.h"
+#include "mutex.h"
+
+/**
+ * The contention of the locks that go by a name, such as all the hash
+ * table locks, counted while lock profiling is on: how often they were
+ * acquired and had to be waited for, how long the waits were, and the
+ * longest any of them was held.
+ *
+ * A profile of a name is shared by every lock of that name in the
+ * process, and lives as long as the process, so the locks can keep a
+ * pointer to it for as long as they're around.
+ */
+class LockProfiler : public LockProfile {
+public:
+    /**
+     * The profile of the locks of a name, which is created the first
+     * time it's asked for.
+     */
+    static LockProfiler *get(const std::string &name);
+
+    //! Every profile there is, by name
+    static void getAll(std::vector<LockProfiler*> &out);
+
+    //! Forget what every profile counted
+    static void resetAll();
+
+    void acquired(bool contended, hrtime_t waited) {
+        ++acquisitions;
+        if (contended) {
+            ++contentions;
+            waitHisto.add(waited / 1000);
+        }
+    }
+
+    void released(hrtime_t held) {
+        maxHold.setIfBigger(held / 1000);
+    }
+
+    void reset() {
+        acquisitions.set(0);
+        contentions.set(0);
+        waitHisto.reset();
+        maxHold.set(0);
+    }
+
+    const std::string &getName() const {
+        return name;
+    }
+
+    //! The acquisitions of all the locks of the name
+    ShardedCounter<size_t> acquisitions;
+    //! The acquisitions that had to wait for another holder
+    ShardedCounter<size_t> contentions;
+    //! How long the contended acquisitions waited (us)
+    HdrHistogram<hrtime_t> waitHisto;
+    //! The longest hold (us)
+    Atomic<hrtime_t> maxHold;
+
+private:
+    LockProfiler(const std::string &n) : name(n) { }
+
+    const std::string name;
+
+    DISALLOW_COPY_AND_ASSIGN(LockProfiler);
+};
+
+#endif  // SRC_LOCK_PROFILER_H_
@@ -48,7 +48,8 @@ public:
      * Copy constructor hands this lock to the new copy and then
      * consider it released locally (i.e. renders unlock() a noop).
      */
-    LockHolder(const LockHolder& from) : mutex(from.mutex), locked(true) {
+    LockHolder(const LockHolder& from) : mutex(from.mutex),
+                                         locked(from.locked) {
         const_cast<LockHolder*>(&from)->locked = false;
     }
 
@@ -0,0 +1,343 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <vector>
+
+extern "C" {
+#include "crc32.h"
+}
+#include "memory_snapshot.h"
+
+static const uint32_t SNAPSHOT_MAGIC = 0x6d736e31; // "msn1"
+static const uint16_t SNAPSHOT_VERSION = 1;
+static const size_t HEADER_SIZE = 32;
+static const size_t BLOCK_HEADER_SIZE = 12;
+static const size_t RECORD_HEADER_SIZE = 40;
+
+static void putInt(char *buf, uint64_t val, size_t len) {
+    for (size_t i = len; i > 0; --i) {
+        buf[i - 1] = static_cast<char>(val & 0xff);
+        val >>= 8;
+    }
+}
+
+static uint64_t getInt(const char *buf, size_t len) {
+    uint64_t val = 0;
+    for (size_t i = 0; i < len; ++i) {
+        val = (val << 8) | static_cast<uint8_t>(buf[i]);
+    }
+    return val;
+}
+
+static uint32_t crcOf(const char *buf, size_t len) {
+    return crc32buf(reinterpret_cast<uint8_t *>(const_cast<char *>(buf)),
+                    len);
+}
+
+static inline int doFsync(int fd) {
+    int ret;
+    while ((ret = fsync(fd)) == -1 && (errno == EINTR)) {
+        /* Retry */
+    }
+    return ret;
+}
+
+static bool writeFully(int fd, const char *buf, size_t nbytes) {
+    while (nbytes > 0) {
+        ssize_t written = ::write(fd, buf, nbytes);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        nbytes -= written;
+        buf += written;
+    }
+    return true;
+}
+
+/**
+ * Appends the records of the items it visits to blocks written to a file.
+ *
+ * A record is the key length, the value's datatype, whether the value's
+ * there, the flags, the expiry time, the value length, the cas, the rev
+ * seqno and the by seqno, all in network byte order, followed by the key
+ * and the value.
+ */
+class SnapshotWriter : public HashTableVisitor {
+public:
+    SnapshotWriter(int f) : fd(f), numRecords(0), failed(false) {
+        block.reserve(MemorySnapshot::BLOCK_SIZE + BLOCK_HEADER_SIZE);
+        block.resize(BLOCK_HEADER_SIZE);
+    }
+
+    void visit(StoredValue *v) {
+        // Deletions and temp items are all still on disk to be found.
+        if (failed || v->isDeleted() || v->isTempItem()) {
+            return;
+        }
+
+        const std::string key = v->getKey();
+        value_t value = v->getValue();
+        bool resident = v->isResident() && value.get();
+
+        char rec[RECORD_HEADER_SIZE];
+        putInt(rec, key.length(), 2);
+        putInt(rec + 2, resident ? value->getDataType() : 0, 1);
+        putInt(rec + 3, resident ? 1 : 0, 1);
+        putInt(rec + 4, v->getFlags(), 4);
+        putInt(rec + 8, static_cast<uint32_t>(v->getExptime()), 4);
+        putInt(rec + 12, resident ? value->length() : 0, 4);
+        putInt(rec + 16, v->getCas(), 8);
+        putInt(rec + 24, v->getRevSeqno(), 8);
+        putInt(rec + 32, static_cast<uint64_t>(v->getBySeqno()), 8);
+        block.append(rec, sizeof(rec));
+        block.append(key);
+        if (resident) {
+            block.append(value->getData(), value->length());
+        }
+        ++numRecords;
+
+        if (block.size() - BLOCK_HEADER_SIZE >= MemorySnapshot::BLOCK_SIZE) {
+            flush();
+        }
+    }
+
+    bool shouldContinue() {
+        return !failed;
+    }
+
+    //! Write the records left, and the empty block that ends the file
+    bool finish() {
+        if (numRecords > 0) {
+            flush();
+        }
+        flush();
+        return !failed;
+    }
+
+private:
+    void flush() {
+        size_t len = block.size() - BLOCK_HEADER_SIZE;
+        char hdr[BLOCK_HEADER_SIZE];
+        putInt(hdr, len, 4);
+        putInt(hdr + 4, numRecords, 4);
+        putInt(hdr + 8, crcOf(block.data() + BLOCK_HEADER_SIZE, len), 4);
+        block.replace(0, BLOCK_HEADER_SIZE, hdr, BLOCK_HEADER_SIZE);
+        if (!failed && !writeFully(fd, block.data(), block.size())) {
+            failed = true;
+        }
+        block.resize(BLOCK_HEADER_SIZE);
+        numRecords = 0;
+    }
+
+    int fd;
+    std::string block;
+    size_t numRecords;
+    bool failed;
+};
+
+std::string MemorySnapshot::getDir(Configuration &config) {
+    std::string dir = config.getWarmupSnapshotDir();
+    return dir.empty() ? config.getDbname() : dir;
+}
+
+std::string MemorySnapshot::getPath(const std::string &dir, uint16_t vbid) {
+    std::stringstream ss;
+    ss << dir << "/" << vbid << ".snapshot";
+    return ss.str();
+}
+
+bool MemorySnapshot::write(const std::string &path, RCPtr<VBucket> &vb,
+                           const vbucket_file_info &info) {
+    if (info.fileRev == 0 || info.headerPosition == 0) {
+        // The store doesn't say which header the items were persisted to.
+        return false;
+    }
+
+    std::string tmp = path + ".new";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to open the memory "
+            "snapshot %s: %s", tmp.c_str(), strerror(errno));
+        return false;
+    }
+
+    char hdr[HEADER_SIZE];
+    memset(hdr, 0, sizeof(hdr));
+    putInt(hdr, SNAPSHOT_MAGIC, 4);
+    putInt(hdr + 8, vb->getId(), 2);
+    putInt(hdr + 10, SNAPSHOT_VERSION, 2);
+    putInt(hdr + 16, info.fileRev, 8);
+    putInt(hdr + 24, info.headerPosition, 8);
+    putInt(hdr + 4, crcOf(hdr + 8, sizeof(hdr) - 8), 4);
+
+    SnapshotWriter writer(fd);
+    bool ok = writeFully(fd, hdr, sizeof(hdr));
+    if (ok) {
+        vb->ht.visitInline(writer);
+        ok = writer.finish() && doFsync(fd) == 0;
+    }
+    ::close(fd);
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to write the memory "
+            "snapshot %s: %s", path.c_str(), strerror(errno));
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Pass the items of the snapshot in a buffer to a callback.
+ */
+static bool loadBuffer(const std::string &path, uint16_t vbid,
+                       const vbucket_file_info &info,
+                       const char *data, size_t size,
+                       Callback<GetValue> &cb) {
+    const char *hdr = data;
+    if (size < HEADER_SIZE ||
+        getInt(hdr, 4) != SNAPSHOT_MAGIC ||
+        getInt(hdr + 4, 4) != crcOf(hdr + 8, HEADER_SIZE - 8) ||
+        getInt(hdr + 8, 2) != vbid ||
+        getInt(hdr + 10, 2) != SNAPSHOT_VERSION) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: the memory snapshot %s is "
+            "corrupt, ignoring it", path.c_str());
+        return false;
+    }
+    if (info.fileRev == 0 || getInt(hdr + 16, 8) != info.fileRev ||
+        getInt(hdr + 24, 8) != info.headerPosition) {
+        LOG(EXTENSION_LOG_INFO, "The memory snapshot %s is of an older "
+            "header of vbucket %d, ignoring it", path.c_str(), vbid);
+        return false;
+    }
+
+    size_t offset = HEADER_SIZE;
+    while (size - offset >= BLOCK_HEADER_SIZE) {
+        const char *bhdr = data + offset;
+        size_t len = getInt(bhdr, 4);
+        size_t count = getInt(bhdr + 4, 4);
+        if (len == 0) {
+            return count == 0;
+        }
+        if (size - offset - BLOCK_HEADER_SIZE < len) {
+            break;
+        }
+        const char *p = bhdr + BLOCK_HEADER_SIZE;
+        if (getInt(bhdr + 8, 4) != crcOf(p, len)) {
+            break;
+        }
+
+        const char *end = p + len;
+        for (size_t i = 0; i < count; ++i) {
+            if (end - p < static_cast<ssize_t>(RECORD_HEADER_SIZE)) {
+                break;
+            }
+            size_t keylen = getInt(p, 2);
+            uint8_t datatype = static_cast<uint8_t>(getInt(p + 2, 1));
+            bool resident = getInt(p + 3, 1) != 0;
+            uint32_t flags = static_cast<uint32_t>(getInt(p + 4, 4));
+            time_t exptime = static_cast<time_t>(getInt(p + 8, 4));
+            size_t valuelen = getInt(p + 12, 4);
+            uint64_t cas = getInt(p + 16, 8);
+            uint64_t revSeqno = getInt(p + 24, 8);
+            int64_t bySeqno = static_cast<int64_t>(getInt(p + 32, 8));
+            p += RECORD_HEADER_SIZE;
+            if (static_cast<size_t>(end - p) < keylen + valuelen) {
+                break;
+            }
+
+            value_t value;
+            if (resident) {
+                value.reset(Blob::New(p + keylen, valuelen, datatype));
+            }
+            Item *it = new Item(p, static_cast<uint16_t>(keylen), flags,
+                                exptime, value, cas, bySeqno, vbid, revSeqno);
+            p += keylen + valuelen;
+
+            GetValue rv(it, ENGINE_SUCCESS, -1, !resident);
+            cb.callback(rv);
+        }
+        if (p != end) {
+            break;
+        }
+        offset += BLOCK_HEADER_SIZE + len;
+    }
+
+    LOG(EXTENSION_LOG_WARNING, "Warning: the memory snapshot %s is corrupt "
+        "past offset %llu", path.c_str(), (unsigned long long)offset);
+    return false;
+}
+
+bool MemorySnapshot::load(const std::string &path, uint16_t vbid,
+                          const vbucket_file_info &info,
+                          Callback<GetValue> &cb) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+
+    // The records are decoded straight out of the page cache (or out of
+    // memory when the snapshots are kept on a tmpfs), so a snapshot costs
+    // no more than the items built from it.
+    void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m != MAP_FAILED) {
+        ::close(fd);
+        (void)madvise(m, size, MADV_SEQUENTIAL);
+        bool ret = loadBuffer(path, vbid, info, static_cast<const char *>(m),
+                              size, cb);
+        int munmap_result = munmap(m, size);
+        assert(munmap_result == 0);
+        return ret;
+    }
+
+    LOG(EXTENSION_LOG_INFO, "Failed to map the memory snapshot %s, reading "
+        "it instead: %s", path.c_str(), strerror(errno));
+    std::vector<char> buf(size);
+    size_t nread = 0;
+    while (nread < size) {
+        ssize_t n = ::read(fd, &buf[nread], size - nread);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        nread += n;
+    }
+    ::close(fd);
+    return loadBuffer(path, vbid, info, &buf[0], nread, cb);
+}
@@ -0,0 +1,78 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_MEMORY_SNAPSHOT_H_
+#define SRC_MEMORY_SNAPSHOT_H_ 1
+
+#include "config.h"
+
+#include <string>
+
+#include "callbacks.h"
+#include "common.h"
+#include "configuration.h"
+#include "kvstore.h"
+#include "vbucket.h"
+
+/**
+ * A snapshot of the items of a vbucket held in memory, written at a clean
+ * shutdown so the next warmup can load them with a few large sequential
+ * reads rather than a doc at a time from the vbucket's file.  The values
+ * that were evicted are only in it as their keys and metadata.
+ *
+ * It's marked with the revision of the vbucket's file and the position
+ * of the header it was taken at, and is only loaded while the file is
+ * still at that header, so it never differs from what's persisted.  It
+ * is a header and blocks of records with a crc of their own, ended by an
+ * empty block.
+ *
+ * The snapshots can be kept apart from the vbuckets' files, on a tmpfs or
+ * a faster local device, and are mapped rather than read when loaded so
+ * restarting a node costs little more than building its items again.
+ */
+class MemorySnapshot {
+public:
+    //! The bytes of records a block is filled with before it's written
+    static const size_t BLOCK_SIZE = 1024 * 1024;
+
+    //! The directory a bucket's snapshots are kept in
+    static std::string getDir(Configuration &config);
+
+    //! The path of the snapshot of a vbucket in a snapshot directory
+    static std::string getPath(const std::string &dir, uint16_t vbid);
+
+    /**
+     * Write the items of a vbucket to its snapshot, marked with the file
+     * they were all persisted to.
+     *
+     * @return false if it couldn't be written, in which case none is left
+     */
+    static bool write(const std::string &path, RCPtr<VBucket> &vb,
+                      const vbucket_file_info &info);
+
+    /**
+     * Pass the items of a vbucket's snapshot to a callback, if it was taken
+     * at the header its file is at.
+     *
+     * @return false if there's no snapshot of that header, or it's corrupt
+     *         after some of its items were passed
+     */
+    static bool load(const std::string &path, uint16_t vbid,
+                     const vbucket_file_info &info, Callback<GetValue> &cb);
+};
+
+#endif  // SRC_MEMORY_SNAPSHOT_H_
@@ -24,6 +24,7 @@
 
 #include "memory_tracker.h"
 #include "objectregistry.h"
+#include "slab_allocator.h"
 
 bool MemoryTracker::tracking = false;
 MemoryTracker *MemoryTracker::instance = NULL;
@@ -116,7 +117,7 @@ void MemoryTracker::getAllocatorStats(std::map<std::string, size_t> &alloc_stats
     alloc_stats.insert(std::pair<std::string, size_t>("total_free_bytes",
                                                       stats.free_size));
     alloc_stats.insert(std::pair<std::string, size_t>("total_fragmentation_bytes",
-                                                      stats.fragmentation_size));
+                                                      getFragmentation()));
 }
 
 void MemoryTracker::getDetailedStats(char* buffer, int size) {
@@ -128,7 +129,9 @@ void MemoryTracker::updateStats() {
 }
 
 size_t MemoryTracker::getFragmentation() {
-    return stats.fragmentation_size;
+    // The allocator counts slab pages as in use, even the parts of
+    // them that aren't holding any data.
+    return stats.fragmentation_size + SlabAllocator::getTotalFragmentation();
 }
 
 size_t MemoryTracker::getTotalBytesAllocated() {
@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <algorithm>
@@ -82,7 +83,17 @@ MutationLog::MutationLog(const std::string &path,
     entryBuffer(static_cast<uint8_t*>(calloc(MutationLogEntry::len(256), 1))),
     blockBuffer(static_cast<uint8_t*>(calloc(bs, 1))),
     syncConfig(DEFAULT_SYNC_CONF),
-    readOnly(false)
+    readOnly(false),
+    mapping(NULL),
+    mappedLen(0),
+    writeBatch(0),
+    batchBuffer(NULL),
+    writeBuffer(NULL),
+    batchPos(0),
+    writeLen(0),
+    syncPending(false),
+    writerStop(false),
+    writerRunning(false)
 {
     assert(entryBuffer);
     assert(blockBuffer);
@@ -105,10 +116,12 @@ void MutationLog::disable() {
     }
 }
 
-void MutationLog::newItem(uint16_t vbucket, const std::string &key, uint64_t rowid) {
+void MutationLog::newItem(uint16_t vbucket, const std::string &key,
+                          uint64_t rowid, uint8_t nru) {
     if (isEnabled()) {
         MutationLogEntry *mle = MutationLogEntry::newEntry(entryBuffer,
-                                                           rowid, ML_NEW, vbucket, key);
+                                                           rowid, ML_NEW, vbucket,
+                                                           key, nru);
         writeEntry(mle);
     }
 }
@@ -131,6 +144,12 @@ void MutationLog::deleteAll(uint16_t vbucket) {
 
 void MutationLog::sync() {
     assert(isOpen());
+    if (writerRunning) {
+        // It's done once the blocks before it are written, by the time
+        // the log is closed at the latest.
+        handOff(true);
+        return;
+    }
     BlockTimer timer(&syncTimeHisto);
     int fsyncResult = doFsync(file);
     assert(fsyncResult != -1);
@@ -305,6 +324,39 @@ void MutationLog::open(bool _readOnly) {
 
     prepareWrites();
     assert(isOpen());
+    if (!readOnly && writeBatch > 0) {
+        startWriter();
+    }
+    if (readOnly) {
+        mapFile(st.st_size);
+    }
+}
+
+void MutationLog::mapFile(size_t size) {
+    size_t start = headerBlock.blockSize() * headerBlock.blockCount();
+    if (size <= start) {
+        return;
+    }
+    void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, file, 0);
+    if (m == MAP_FAILED) {
+        LOG(EXTENSION_LOG_INFO, "Failed to map %s, reading it instead: %s",
+            logPath.c_str(), strerror(errno));
+        return;
+    }
+    // The blocks are read through once, so the pages can be read ahead
+    // and dropped soon after.
+    (void)madvise(m, size, MADV_SEQUENTIAL);
+    mapping = static_cast<uint8_t*>(m);
+    mappedLen = size;
+}
+
+void MutationLog::unmapFile() {
+    if (mapping != NULL) {
+        int munmap_result = munmap(mapping, mappedLen);
+        assert(munmap_result == 0);
+        mapping = NULL;
+        mappedLen = 0;
+    }
 }
 
 void MutationLog::close() {
@@ -314,11 +366,16 @@ void MutationLog::close() {
 
     if (!readOnly) {
         flush();
-        sync();
+        if (writerRunning) {
+            stopWriter();
+        } else {
+            sync();
+        }
         headerBlock.setRdwr(0);
         updateInitialBlock();
     }
 
+    unmapFile();
     int close_result = doClose(file);
     assert(close_result != -1);
     file = -1;
@@ -391,7 +448,15 @@ void MutationLog::flush() {
         uint16_t crc16(htons(crc32 & 0xffff));
         memcpy(blockBuffer, &crc16, sizeof(crc16));
 
-        writeFully(file, blockBuffer, blockSize);
+        if (writerRunning) {
+            memcpy(batchBuffer + batchPos, blockBuffer, blockSize);
+            batchPos += blockSize;
+            if (batchPos == writeBatch * blockSize) {
+                handOff(false);
+            }
+        } else {
+            writeFully(file, blockBuffer, blockSize);
+        }
         logSize += blockSize;
 
         blockPos = HEADER_RESERVED;
@@ -399,6 +464,93 @@ void MutationLog::flush() {
     }
 }
 
+extern "C" {
+    static void* launch_mutation_log_writer(void *arg) {
+        static_cast<MutationLog*>(arg)->runWriter();
+        return NULL;
+    }
+}
+
+void MutationLog::startWriter() {
+    assert(!writerRunning);
+    batchBuffer = static_cast<uint8_t*>(calloc(writeBatch, blockSize));
+    writeBuffer = static_cast<uint8_t*>(calloc(writeBatch, blockSize));
+    batchPos = writeLen = 0;
+    syncPending = writerStop = false;
+    if (batchBuffer == NULL || writeBuffer == NULL ||
+        pthread_create(&writerThread, NULL, launch_mutation_log_writer,
+                       this) != 0) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to start the writer thread of "
+            "the mutation log %s, writing it directly", logPath.c_str());
+        free(batchBuffer);
+        free(writeBuffer);
+        batchBuffer = writeBuffer = NULL;
+        return;
+    }
+    writerRunning = true;
+}
+
+void MutationLog::stopWriter() {
+    if (!writerRunning) {
+        return;
+    }
+    handOff(true);
+    {
+        LockHolder lh(writerSync);
+        writerStop = true;
+        writerSync.notify();
+    }
+    pthread_join(writerThread, NULL);
+    writerRunning = false;
+    free(batchBuffer);
+    free(writeBuffer);
+    batchBuffer = writeBuffer = NULL;
+}
+
+void MutationLog::handOff(bool withSync) {
+    if (batchPos == 0 && !withSync) {
+        return;
+    }
+    LockHolder lh(writerSync);
+    // The writer's still on the previous batch.
+    while (writeLen > 0 || syncPending) {
+        writerSync.wait();
+    }
+    std::swap(batchBuffer, writeBuffer);
+    writeLen = batchPos;
+    batchPos = 0;
+    syncPending = withSync;
+    writerSync.notify();
+}
+
+void MutationLog::runWriter() {
+    LockHolder lh(writerSync);
+    for (;;) {
+        if (writeLen == 0 && !syncPending) {
+            if (writerStop) {
+                break;
+            }
+            writerSync.wait();
+            continue;
+        }
+        size_t len = writeLen;
+        bool doSync = syncPending;
+        lh.unlock();
+        if (len > 0) {
+            writeFully(file, writeBuffer, len);
+        }
+        if (doSync) {
+            BlockTimer timer(&syncTimeHisto);
+            int fsyncResult = doFsync(file);
+            assert(fsyncResult != -1);
+        }
+        lh.lock();
+        writeLen = 0;
+        syncPending = false;
+        writerSync.notify();
+    }
+}
+
 void MutationLog::writeEntry(MutationLogEntry *mle) {
     assert(isEnabled());
     assert(isOpen());
@@ -448,6 +600,7 @@ MutationLog::iterator::iterator(const MutationLog *l, bool e)
   : log(l),
     entryBuf(NULL),
     buf(NULL),
+    readBuf(NULL),
     p(buf),
     offset(l->header().blockSize() * l->header().blockCount()),
     items(0),
@@ -459,17 +612,19 @@ MutationLog::iterator::iterator(const MutationLog *l, bool e)
 MutationLog::iterator::iterator(const MutationLog::iterator& mit)
   : log(mit.log),
     entryBuf(NULL),
-    buf(NULL),
-    p(NULL),
+    buf(mit.buf),
+    readBuf(NULL),
+    p(mit.p),
     offset(mit.offset),
     items(mit.items),
     isEnd(mit.isEnd)
 {
     assert(log);
-    if (mit.buf != NULL) {
-        buf = static_cast<uint8_t*>(calloc(1, log->header().blockSize()));
-        assert(buf);
-        memcpy(buf, mit.buf, log->header().blockSize());
+    if (mit.buf != NULL && mit.buf == mit.readBuf) {
+        readBuf = static_cast<uint8_t*>(calloc(1, log->header().blockSize()));
+        assert(readBuf);
+        memcpy(readBuf, mit.readBuf, log->header().blockSize());
+        buf = readBuf;
         p = buf + (mit.p - mit.buf);
     }
 
@@ -482,7 +637,7 @@ MutationLog::iterator::iterator(const MutationLog::iterator& mit)
 
 MutationLog::iterator::~iterator() {
     free(entryBuf);
-    free(buf);
+    free(readBuf);
 }
 
 void MutationLog::iterator::prepItem() {
@@ -534,23 +689,29 @@ size_t MutationLog::iterator::bufferBytesRemaining() {
 
 void MutationLog::iterator::nextBlock() {
     assert(!log->isEnabled() || log->isOpen());
-    if (buf == NULL) {
-        buf = static_cast<uint8_t*>(calloc(1, log->header().blockSize()));
-        assert(buf);
-    }
-    p = buf;
+    size_t bsize = log->header().blockSize();
+    if (log->mapping != NULL && offset + bsize <= log->mappedLen) {
+        buf = log->mapping + offset;
+    } else {
+        if (readBuf == NULL) {
+            readBuf = static_cast<uint8_t*>(calloc(1, bsize));
+            assert(readBuf);
+        }
+        buf = readBuf;
 
-    ssize_t bytesread = pread(log->fd(), buf, log->header().blockSize(), offset);
-    if (bytesread < 1) {
-        isEnd = true;
-        return;
-    }
-    if (bytesread != (ssize_t)(log->header().blockSize())) {
-        throw ShortReadException();
+        ssize_t bytesread = pread(log->fd(), buf, bsize, offset);
+        if (bytesread < 1) {
+            isEnd = true;
+            return;
+        }
+        if (bytesread != (ssize_t)bsize) {
+            throw ShortReadException();
+        }
     }
-    offset += bytesread;
+    p = buf;
+    offset += bsize;
 
-    uint32_t crc32(crc32buf(buf + 2, log->header().blockSize() - 2));
+    uint32_t crc32(crc32buf(buf + 2, bsize - 2));
     uint16_t computed_crc16(crc32 & 0xffff);
     uint16_t retrieved_crc16;
     memcpy(&retrieved_crc16, buf, sizeof(retrieved_crc16));
@@ -590,7 +751,8 @@ bool MutationLogHarvester::load() {
             // FALLTHROUGH
         case ML_NEW:
             if (vbid_set.find(le->vbucket()) != vbid_set.end()) {
-                loading[le->vbucket()][le->key()] = std::make_pair(le->rowid(), le->type());
+                uint8_t type = static_cast<uint8_t>(le->type() | (le->nru() << 4));
+                loading[le->vbucket()][le->key()] = std::make_pair(le->rowid(), type);
             }
             break;
         case ML_COMMIT2: {
@@ -610,9 +772,10 @@ bool MutationLogHarvester::load() {
 
                     mutation_log_event_t t = copyit2->second;
 
-                    switch (t.second) {
+                    switch (t.second & ML_TYPE_MASK) {
                     case ML_NEW:
-                        committed[vb][copyit2->first] = t.first;
+                        committed[vb][copyit2->first] =
+                            std::make_pair(t.first, static_cast<uint8_t>(t.second >> 4));
                         break;
                     case ML_DEL:
                         committed[vb].erase(copyit2->first);
@@ -642,41 +805,100 @@ bool MutationLogHarvester::load() {
 }
 
 void MutationLogHarvester::apply(void *arg, mlCallback mlc) {
-    for (std::set<uint16_t>::const_iterator it = vbid_set.begin();
-         it != vbid_set.end(); ++it) {
-        uint16_t vb(*it);
+    std::vector<uint16_t> vbs(vbid_set.begin(), vbid_set.end());
+    apply(arg, mlc, vbs);
+}
 
-        for (unordered_map<std::string, uint64_t>::iterator it2 = committed[vb].begin();
-             it2 != committed[vb].end(); ++it2) {
-            const std::string key(it2->first);
-            uint64_t rowid(it2->second);
+void MutationLogHarvester::apply(void *arg, mlCallbackWithQueue mlc) {
+    std::vector<uint16_t> vbs(vbid_set.begin(), vbid_set.end());
+    apply(arg, mlc, vbs);
+}
+
+static bool committedLess(const mutation_log_committed_t &a,
+                          const mutation_log_committed_t &b) {
+    if (a.nru != b.nru) {
+        return a.nru < b.nru;
+    }
+    return a.rowid < b.rowid;
+}
 
-            mlc(arg, vb, key, rowid);
+void MutationLogHarvester::sortCommitted(const std::vector<uint16_t> &vbs,
+                                         std::vector<std::vector<mutation_log_committed_t> > &sorted) {
+    sorted.resize(vbs.size());
+    for (size_t i = 0; i < vbs.size(); ++i) {
+        // Look the vbucket up without adding it, as other threads may be
+        // applying the others.
+        unordered_map<uint16_t, unordered_map<std::string, mutation_log_item_t> >::iterator
+            cit = committed.find(vbs[i]);
+        if (cit == committed.end()) {
+            continue;
+        }
+
+        // Within each NRU value they're in rowid order, which is the
+        // order the docs were written to the file in, rather than by
+        // hash, so the reads move through it one way.
+        std::vector<mutation_log_committed_t> &entries = sorted[i];
+        entries.reserve(cit->second.size());
+        unordered_map<std::string, mutation_log_item_t>::iterator it2;
+        for (it2 = cit->second.begin(); it2 != cit->second.end(); ++it2) {
+            mutation_log_committed_t e;
+            e.nru = it2->second.second;
+            e.rowid = it2->second.first;
+            e.key = &it2->first;
+            entries.push_back(e);
+        }
+        std::sort(entries.begin(), entries.end(), committedLess);
+    }
+}
+
+void MutationLogHarvester::apply(void *arg, mlCallback mlc,
+                                 const std::vector<uint16_t> &vbs) {
+    std::vector<std::vector<mutation_log_committed_t> > sorted;
+    sortCommitted(vbs, sorted);
+    std::vector<size_t> pos(vbs.size(), 0);
+    for (int nru = 0; nru <= ML_MAX_NRU; ++nru) {
+        for (size_t i = 0; i < vbs.size(); ++i) {
+            std::vector<mutation_log_committed_t> &entries = sorted[i];
+            for (; pos[i] < entries.size() && entries[pos[i]].nru == nru;
+                 ++pos[i]) {
+                mutation_log_committed_t &e = entries[pos[i]];
+                mlc(arg, vbs[i], *e.key, e.rowid);
+            }
         }
     }
 }
 
-void MutationLogHarvester::apply(void *arg, mlCallbackWithQueue mlc) {
+void MutationLogHarvester::apply(void *arg, mlCallbackWithQueue mlc,
+                                 const std::vector<uint16_t> &vbs) {
     assert(engine);
+    std::vector<std::vector<mutation_log_committed_t> > sorted;
+    sortCommitted(vbs, sorted);
+    std::vector<size_t> pos(vbs.size(), 0);
     std::vector<std::pair<std::string, uint64_t> > fetches;
-    std::set<uint16_t>::const_iterator it = vbid_set.begin();
-    for (; it != vbid_set.end(); ++it) {
-        uint16_t vb(*it);
-        RCPtr<VBucket> vbucket = engine->getEpStore()->getVBucket(vb);
-        if (!vbucket) {
-            continue;
-        }
-        unordered_map<std::string, uint64_t>::iterator it2 = committed[vb].begin();
-        for (; it2 != committed[vb].end(); ++it2) {
-            // cannot use rowid from access log, so must read from hashtable
-            std::string key = it2->first;
-            StoredValue *v = NULL;
-            if ((v = vbucket->ht.find(key, false))) {
-                fetches.push_back(std::make_pair(it2->first, v->getBySeqno()));
+    for (int nru = 0; nru <= ML_MAX_NRU; ++nru) {
+        for (size_t i = 0; i < vbs.size(); ++i) {
+            std::vector<mutation_log_committed_t> &entries = sorted[i];
+            if (pos[i] == entries.size() || entries[pos[i]].nru != nru) {
+                continue;
+            }
+            RCPtr<VBucket> vbucket = engine->getEpStore()->getVBucket(vbs[i]);
+            for (; pos[i] < entries.size() && entries[pos[i]].nru == nru;
+                 ++pos[i]) {
+                if (!vbucket) {
+                    continue;
+                }
+                // cannot use rowid from access log, so must read from hashtable
+                std::string key = *entries[pos[i]].key;
+                StoredValue *v = NULL;
+                if ((v = vbucket->ht.find(key, false))) {
+                    fetches.push_back(std::make_pair(key, v->getBySeqno()));
+                }
+            }
+            if (!fetches.empty()) {
+                mlc(vbs[i], fetches, arg);
+                fetches.clear();
             }
         }
-        mlc(vb, fetches, arg);
-        fetches.clear();
     }
 }
 
@@ -695,7 +917,7 @@ void MutationLogHarvester::getUncommitted(std::vector<mutation_log_uncommitted_t
             mutation_log_event_t t = copyit2->second;
             leftover.key = copyit2->first;
             leftover.rowid = t.first;
-            leftover.type = static_cast<mutation_log_type_t>(t.second);
+            leftover.type = static_cast<mutation_log_type_t>(t.second & ML_TYPE_MASK);
 
             uitems.push_back(leftover);
         }
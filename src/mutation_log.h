@@ -37,6 +37,7 @@
 #include "atomic.h"
 #include "common.h"
 #include "histo.h"
+#include "syncobject.h"
 
 #define ML_BUFLEN (128 * 1024 * 1024)
 
@@ -179,6 +180,11 @@ typedef enum {
 
 #define MUTATION_LOG_TYPES 5
 
+//! The bits of an entry's type byte holding its type; the rest hold the
+//! NRU value of its item when it was logged, 0 in the older logs.
+const uint8_t ML_TYPE_MASK(0x0f);
+const uint8_t ML_MAX_NRU(0x0f);
+
 extern const char *mutation_log_type_names[];
 
 /**
@@ -194,11 +200,13 @@ public:
      * @param t the type of log entry
      * @param vb the vbucket
      * @param k the key
+     * @param nru the NRU value of the item
      */
     static MutationLogEntry* newEntry(uint8_t *buf,
                                       uint64_t r, mutation_log_type_t t,
-                                      uint16_t vb, const std::string &k) {
-        return new (buf) MutationLogEntry(r, t, vb, k);
+                                      uint16_t vb, const std::string &k,
+                                      uint8_t nru = 0) {
+        return new (buf) MutationLogEntry(r, t, vb, k, nru);
     }
 
     /**
@@ -260,7 +268,14 @@ public:
      * The type of this log entry.
      */
     uint8_t type() const {
-        return _type;
+        return _type & ML_TYPE_MASK;
+    }
+
+    /**
+     * The NRU value the item had when it was logged.
+     */
+    uint8_t nru() const {
+        return _type >> 4;
     }
 
 private:
@@ -269,9 +284,9 @@ private:
                                      const MutationLogEntry &e);
 
     MutationLogEntry(uint64_t r, mutation_log_type_t t,
-                     uint16_t vb, const std::string &k)
+                     uint16_t vb, const std::string &k, uint8_t nru)
         : _rowid(htonll(r)), _vbucket(htons(vb)), magic(MUTATION_LOG_MAGIC),
-          _type(static_cast<uint8_t>(t)),
+          _type(static_cast<uint8_t>(t | (std::min(nru, ML_MAX_NRU) << 4))),
           keylen(static_cast<uint8_t>(k.length())) {
         assert(k.length() <= std::numeric_limits<uint8_t>::max());
         memcpy(_key, k.data(), k.length());
@@ -301,7 +316,11 @@ public:
 
     ~MutationLog();
 
-    void newItem(uint16_t vbucket, const std::string &key, uint64_t rowid);
+    /**
+     * Log an item, and how recently it was used if that's to be kept.
+     */
+    void newItem(uint16_t vbucket, const std::string &key, uint64_t rowid,
+                 uint8_t nru = 0);
 
     void delItem(uint16_t vbucket, const std::string &key);
 
@@ -345,6 +364,22 @@ public:
         return blockSize;
     }
 
+    /**
+     * Hand the blocks to a thread of the log's own to write, that many at
+     * a time in one write, and to fsync, rather than writing each of them
+     * as it fills up.  It takes effect the next time the log is opened.
+     *
+     * @param blocks the blocks written at a time, 0 to write them directly
+     */
+    void setWriteBatch(size_t blocks) {
+        writeBatch = blocks;
+    }
+
+    /**
+     * Body of the thread writing the batches handed to it.
+     */
+    void runWriter();
+
     bool exists() const;
 
     const std::string &getLogFile() const { return logPath; }
@@ -453,7 +488,10 @@ public:
 
         const MutationLog *log;
         uint8_t           *entryBuf;
+        //! The block being read, in the log's mapping or in readBuf
         uint8_t           *buf;
+        //! The block read in when it's past the end of the log's mapping
+        uint8_t           *readBuf;
         uint8_t           *p;
         off_t              offset;
         uint16_t           items;
@@ -501,6 +539,16 @@ private:
 
     void prepareWrites();
 
+    //! Map a log opened read only, so it's iterated without a copy
+    void mapFile(size_t size);
+    void unmapFile();
+
+    void startWriter();
+    //! Write and fsync all of the blocks handed to the writer, and stop it
+    void stopWriter();
+    //! Hand the blocks batched so far to the writer, and an fsync if asked
+    void handOff(bool withSync);
+
     int fd() const { return file; }
 
     LogHeaderBlock     headerBlock;
@@ -514,6 +562,23 @@ private:
     uint8_t            syncConfig;
     bool               readOnly;
 
+    //! The read only log's blocks, NULL if it isn't mapped
+    uint8_t           *mapping;
+    size_t             mappedLen;
+
+    //! The blocks the writer thread writes at a time, 0 if there's none
+    size_t             writeBatch;
+    //! The batch being filled, and the one the writer thread writes
+    uint8_t           *batchBuffer;
+    uint8_t           *writeBuffer;
+    size_t             batchPos;
+    size_t             writeLen;
+    bool               syncPending;
+    bool               writerStop;
+    bool               writerRunning;
+    pthread_t          writerThread;
+    SyncObject         writerSync;
+
     DISALLOW_COPY_AND_ASSIGN(MutationLog);
 };
 
@@ -521,6 +586,8 @@ private:
 
 //! rowid, (uint8_t)mutation_log_type_t
 typedef std::pair<uint64_t, uint8_t> mutation_log_event_t;
+//! rowid, NRU value
+typedef std::pair<uint64_t, uint8_t> mutation_log_item_t;
 
 /// @endcond
 
@@ -542,6 +609,15 @@ struct mutation_log_uncommitted_t {
     uint16_t            vbucket;
 };
 
+/**
+ * A committed item of a vbucket, in the order the items are applied in.
+ */
+struct mutation_log_committed_t {
+    uint8_t            nru;
+    uint64_t           rowid;
+    const std::string *key;
+};
+
 class EventuallyPersistentEngine;
 
 /**
@@ -575,6 +651,19 @@ public:
     void apply(void *arg, mlCallback mlc);
     void apply(void *arg, mlCallbackWithQueue mlc);
 
+    /**
+     * Apply the processed log entries of some of the vbuckets.  The
+     * entries of different vbuckets may be applied on different threads
+     * at the same time.
+     *
+     * The items the log says were used most recently are applied first,
+     * those of all of the vbuckets before the next less recently used
+     * ones, so a load cut short has the working set of them all.
+     */
+    void apply(void *arg, mlCallback mlc, const std::vector<uint16_t> &vbs);
+    void apply(void *arg, mlCallbackWithQueue mlc,
+               const std::vector<uint16_t> &vbs);
+
     /**
      * Get the total number of entries found in the log.
      */
@@ -594,11 +683,20 @@ public:
 
 private:
 
+    /**
+     * Sort the committed items of each of the vbuckets by their NRU
+     * value, then by rowid.
+     */
+    void sortCommitted(const std::vector<uint16_t> &vbs,
+                       std::vector<std::vector<mutation_log_committed_t> > &sorted);
+
     MutationLog &mlog;
     EventuallyPersistentEngine *engine;
     std::set<uint16_t> vbid_set;
 
-    unordered_map<uint16_t, unordered_map<std::string, uint64_t> > committed;
+    unordered_map<uint16_t, unordered_map<std::string, mutation_log_item_t> > committed;
+    //! The entries since the last commit, with the NRU value in the
+    //! type's upper bits as it is in the log
     unordered_map<uint16_t, unordered_map<std::string, mutation_log_event_t> > loading;
     size_t itemsSeen[MUTATION_LOG_TYPES];
 };
@@ -19,10 +19,25 @@
 
 #include <string>
 
+#include "atomic.h"
 #include "common.h"
 #include "mutex.h"
 
-Mutex::Mutex() : held(false)
+/**
+ * Order updates of Mutex::version against the writes done under the
+ * lock.  x86 doesn't reorder stores, so the call boundaries around
+ * acquire() and release() are all that's needed there.
+ */
+static inline void versionBarrier() {
+#if !defined(__i386__) && !defined(__x86_64__)
+    ep_sync_synchronize();
+#endif
+}
+
+volatile bool LockProfile::enabled = false;
+
+Mutex::Mutex() : version(0), holdObserver(NULL), profile(NULL), heldSince(0),
+                 profiledHold(false), held(false)
 {
     pthread_mutexattr_t *attr = NULL;
     int e=0;
@@ -76,6 +91,10 @@ Mutex::~Mutex() {
 }
 
 void Mutex::acquire() {
+    if (profile != NULL && LockProfile::isEnabled()) {
+        profiledAcquire();
+        return;
+    }
     int e;
     if ((e = pthread_mutex_lock(&mutex)) != 0) {
         std::cerr << "MUTEX ERROR: Failed to acquire lock: ";
@@ -84,11 +103,51 @@ void Mutex::acquire() {
         abort();
     }
     setHolder(true);
+    ++version;
+    versionBarrier();
+}
+
+/**
+ * Acquire the lock, trying it first so that only the acquisitions that
+ * have to wait pay for timing the wait.
+ */
+void Mutex::profiledAcquire() {
+    bool contended = false;
+    hrtime_t start = 0;
+    int e = pthread_mutex_trylock(&mutex);
+    if (e == EBUSY) {
+        contended = true;
+        start = gethrtime();
+        e = pthread_mutex_lock(&mutex);
+    }
+    if (e != 0) {
+        std::cerr << "MUTEX ERROR: Failed to acquire lock: ";
+        std::cerr << std::strerror(e) << std::endl;
+        std::cerr.flush();
+        abort();
+    }
+    setHolder(true);
+    ++version;
+    versionBarrier();
+    heldSince = gethrtime();
+    profiledHold = true;
+    profile->acquired(contended, contended ? heldSince - start : 0);
 }
 
 void Mutex::release() {
     assert(held && pthread_equal(holder, pthread_self()));
+    if (holdObserver) {
+        MutexHoldObserver *o = holdObserver;
+        holdObserver = NULL;
+        o->holdReleased(*this);
+    }
+    if (profiledHold) {
+        profiledHold = false;
+        profile->released(gethrtime() - heldSince);
+    }
     setHolder(false);
+    versionBarrier();
+    ++version;
     int e;
     if ((e = pthread_mutex_unlock(&mutex)) != 0) {
         std::cerr << "MUTEX ERROR: Failed to release lock: ";
@@ -31,6 +31,61 @@
 
 #include "common.h"
 
+class Mutex;
+
+/**
+ * Something that wants to know when a particular hold on a Mutex ends.
+ */
+class MutexHoldObserver {
+public:
+    virtual ~MutexHoldObserver() {}
+
+    /**
+     * Called by the holder while releasing m, before anyone else can
+     * acquire it.
+     */
+    virtual void holdReleased(Mutex &m) = 0;
+};
+
+/**
+ * Where the acquisitions and holds of the locks given it are counted,
+ * while lock profiling is on (see LockProfiler).
+ */
+class LockProfile {
+public:
+    virtual ~LockProfile() {}
+
+    /**
+     * Turn the profiling of every lock with a profile on or off.  Holds
+     * that started while it was on are still counted when they end.
+     */
+    static void setEnabled(bool to) {
+        enabled = to;
+    }
+
+    static bool isEnabled() {
+        return enabled;
+    }
+
+    /**
+     * Called by the new holder of a lock.
+     *
+     * @param contended true if the lock was held by someone else
+     * @param waited how long it waited for it (ns)
+     */
+    virtual void acquired(bool contended, hrtime_t waited) = 0;
+
+    /**
+     * Called by the holder of a lock while releasing it.
+     *
+     * @param held how long it held it (ns)
+     */
+    virtual void released(hrtime_t held) = 0;
+
+private:
+    static volatile bool enabled;
+};
+
 /**
  * Abstraction built on top of pthread mutexes
  */
@@ -49,6 +104,36 @@ public:
         return held && pthread_equal(holder, pthread_self());
     }
 
+    /**
+     * The number of times this lock has been acquired and released.
+     *
+     * It's odd while the lock is held, so lock-free readers of data
+     * guarded by it can read it before and after looking at the data
+     * and know nobody changed anything in between if it's the same,
+     * even value both times (as with a seqlock).
+     */
+    size_t getVersion() const {
+        return version;
+    }
+
+    /**
+     * Have the given observer told when the current hold ends.
+     *
+     * Only the holder may call this, and only for its own hold.
+     */
+    void observeHold(MutexHoldObserver *o) {
+        assert(ownsLock());
+        holdObserver = o;
+    }
+
+    /**
+     * Count this lock's acquisitions and holds in the given profile
+     * while lock profiling is on.  Set it before the lock's first used.
+     */
+    void setProfile(LockProfile *p) {
+        profile = p;
+    }
+
 protected:
 
     // The holders of locks twiddle these flags.
@@ -63,11 +148,35 @@ protected:
         holder = pthread_self();
     }
 
+    /**
+     * End the profiled hold, if this one is, while the holder waits
+     * without the lock (see SyncObject).
+     */
+    void holdPaused() {
+        if (profiledHold) {
+            profile->released(gethrtime() - heldSince);
+        }
+    }
+
+    //! Start the profiled hold over once the lock's held again.
+    void holdResumed() {
+        if (profiledHold) {
+            heldSince = gethrtime();
+        }
+    }
+
     pthread_mutex_t mutex;
     pthread_t holder;
+    volatile size_t version;
+    MutexHoldObserver *holdObserver;
+    LockProfile *profile;
+    hrtime_t heldSince;
+    bool profiledHold;
     bool held;
 
 private:
+    void profiledAcquire();
+
     DISALLOW_COPY_AND_ASSIGN(Mutex);
 };
 
@@ -17,12 +17,45 @@
 
 #include "config.h"
 
+#include <algorithm>
+#include <vector>
+
 #include "ep_engine.h"
 #include "objectregistry.h"
 
 static ThreadLocal<EventuallyPersistentEngine*> *th;
 static ThreadLocal<Atomic<size_t>*> *initial_track;
 
+/**
+ * The value and overhead bytes one thread has freed but not yet taken
+ * off the engine's stats, along with the engine they were freed under.
+ *
+ * Only frees are held back, and what a thread allocates is paid for out
+ * of them first, so a thread making and dropping objects of about the
+ * same size in turn (like the Items of gets) leaves the shared stats
+ * alone.  The stats read at most a few KB a thread high, never low, so
+ * they can't wrap around zero while another thread's frees are held.
+ */
+struct PendingReleases {
+    PendingReleases() : engine(NULL), valueBytes(0), overheadBytes(0) { }
+
+    SpinLock lock;
+    EventuallyPersistentEngine *engine;
+    size_t valueBytes;
+    size_t overheadBytes;
+};
+
+//! The held back bytes a thread takes off the stats at once
+static const size_t PENDING_RELEASE_THRESHOLD = 16384;
+
+extern "C" {
+    static void releasePendingReleases(void *arg);
+}
+
+static ThreadLocal<PendingReleases*> *pendingReleases;
+static Mutex *pendingLock;
+static std::vector<PendingReleases*> *pendingRegistry;
+
 /**
  * Object registry link hook for getting the registry thread local
  * installed.
@@ -33,6 +66,9 @@ public:
       if (th == NULL) {
          th = new ThreadLocal<EventuallyPersistentEngine*>();
          initial_track = new ThreadLocal<Atomic<size_t>*>();
+         pendingReleases = new ThreadLocal<PendingReleases*>(releasePendingReleases);
+         pendingLock = new Mutex();
+         pendingRegistry = new std::vector<PendingReleases*>();
       }
    }
 } install;
@@ -49,15 +85,114 @@ static bool verifyEngine(EventuallyPersistentEngine *engine)
    return true;
 }
 
+/**
+ * Take the held back bytes off the stats of the engine they were freed
+ * under.
+ */
+static void applyPendingReleases(PendingReleases *p)
+{
+    if (p->valueBytes == 0 && p->overheadBytes == 0) {
+        return;
+    }
+    EPStats &stats = p->engine->getEpStats();
+    if (p->valueBytes > 0) {
+        stats.currentSize.decr(p->valueBytes);
+        stats.totalValueSize.decr(p->valueBytes);
+        assert(stats.currentSize.get() < GIGANTOR);
+    }
+    if (p->overheadBytes > 0) {
+        stats.memOverhead.decr(p->overheadBytes);
+        assert(stats.memOverhead.get() < GIGANTOR);
+    }
+    p->valueBytes = 0;
+    p->overheadBytes = 0;
+}
+
+static void releasePendingReleases(void *arg)
+{
+    PendingReleases *p = static_cast<PendingReleases*>(arg);
+    LockHolder lh(*pendingLock);
+    pendingRegistry->erase(std::remove(pendingRegistry->begin(),
+                                       pendingRegistry->end(), p),
+                           pendingRegistry->end());
+    applyPendingReleases(p);
+    delete p;
+}
+
+/**
+ * The calling thread's held back bytes, locked and made to belong to the
+ * given engine.
+ */
+static PendingReleases *lockPendingReleases(EventuallyPersistentEngine *engine)
+{
+    PendingReleases *p = pendingReleases->get();
+    if (p == NULL) {
+        p = new PendingReleases();
+        pendingReleases->set(p);
+        LockHolder lh(*pendingLock);
+        pendingRegistry->push_back(p);
+    }
+    p->lock.acquire();
+    if (p->engine != engine) {
+        applyPendingReleases(p);
+        p->engine = engine;
+    }
+    return p;
+}
+
+/**
+ * Account for an allocation, out of the bytes held back first.
+ *
+ * @return the bytes to add to the stats
+ */
+static size_t takePending(size_t &pending, size_t bytes)
+{
+    if (pending >= bytes) {
+        pending -= bytes;
+        return 0;
+    }
+    bytes -= pending;
+    pending = 0;
+    return bytes;
+}
+
+static void allocated(EventuallyPersistentEngine *engine,
+                      size_t valueBytes, size_t overheadBytes)
+{
+    PendingReleases *p = lockPendingReleases(engine);
+    valueBytes = takePending(p->valueBytes, valueBytes);
+    overheadBytes = takePending(p->overheadBytes, overheadBytes);
+    p->lock.release();
+
+    EPStats &stats = engine->getEpStats();
+    if (valueBytes > 0) {
+        stats.currentSize.incr(valueBytes);
+        stats.totalValueSize.incr(valueBytes);
+        assert(stats.currentSize.get() < GIGANTOR);
+    }
+    if (overheadBytes > 0) {
+        stats.memOverhead.incr(overheadBytes);
+        assert(stats.memOverhead.get() < GIGANTOR);
+    }
+}
+
+static void released(EventuallyPersistentEngine *engine,
+                     size_t valueBytes, size_t overheadBytes)
+{
+    PendingReleases *p = lockPendingReleases(engine);
+    p->valueBytes += valueBytes;
+    p->overheadBytes += overheadBytes;
+    if (p->valueBytes + p->overheadBytes >= PENDING_RELEASE_THRESHOLD) {
+        applyPendingReleases(p);
+    }
+    p->lock.release();
+}
 
 void ObjectRegistry::onCreateBlob(Blob *blob)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.currentSize.incr(blob->getSize());
-       stats.totalValueSize.incr(blob->getSize());
-       assert(stats.currentSize.get() < GIGANTOR);
+       allocated(engine, blob->getSize(), 0);
    }
 }
 
@@ -65,10 +200,7 @@ void ObjectRegistry::onDeleteBlob(Blob *blob)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.currentSize.decr(blob->getSize());
-       stats.totalValueSize.decr(blob->getSize());
-       assert(stats.currentSize.get() < GIGANTOR);
+       released(engine, blob->getSize(), 0);
    }
 }
 
@@ -76,9 +208,7 @@ void ObjectRegistry::onCreateQueuedItem(QueuedItem *qi)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.memOverhead.incr(qi->size());
-       assert(stats.memOverhead.get() < GIGANTOR);
+       allocated(engine, 0, qi->size());
    }
 }
 
@@ -86,9 +216,7 @@ void ObjectRegistry::onDeleteQueuedItem(QueuedItem *qi)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.memOverhead.decr(qi->size());
-       assert(stats.memOverhead.get() < GIGANTOR);
+       released(engine, 0, qi->size());
    }
 }
 
@@ -96,9 +224,7 @@ void ObjectRegistry::onCreateItem(Item *pItem)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.memOverhead.incr(pItem->size() - pItem->getValMemSize());
-       assert(stats.memOverhead.get() < GIGANTOR);
+       allocated(engine, 0, pItem->size() - pItem->getValMemSize());
    }
 }
 
@@ -106,12 +232,23 @@ void ObjectRegistry::onDeleteItem(Item *pItem)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.memOverhead.decr(pItem->size() - pItem->getValMemSize());
-       assert(stats.memOverhead.get() < GIGANTOR);
+       released(engine, 0, pItem->size() - pItem->getValMemSize());
    }
 }
 
+void ObjectRegistry::flushStats(EventuallyPersistentEngine *engine)
+{
+    LockHolder lh(*pendingLock);
+    std::vector<PendingReleases*>::iterator it;
+    for (it = pendingRegistry->begin(); it != pendingRegistry->end(); ++it) {
+        PendingReleases *p = *it;
+        SpinLockHolder sl(&p->lock);
+        if (p->engine == engine) {
+            applyPendingReleases(p);
+        }
+    }
+}
+
 EventuallyPersistentEngine *ObjectRegistry::getCurrentEngine() {
     return th->get();
 }
@@ -124,6 +261,7 @@ EventuallyPersistentEngine *ObjectRegistry::onSwitchThread(EventuallyPersistentE
         old_engine = th->get();
     }
     th->set(engine);
+    SlabAllocator::setCurrent(engine ? engine->getSlabAllocator() : NULL);
     return old_engine;
 }
 
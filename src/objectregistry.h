@@ -34,6 +34,12 @@ public:
     static void onCreateItem(Item *pItem);
     static void onDeleteItem(Item *pItem);
 
+    /**
+     * Take the bytes freed under the given engine that threads are still
+     * holding back off its stats, so they're exact.
+     */
+    static void flushStats(EventuallyPersistentEngine *engine);
+
     static EventuallyPersistentEngine *getCurrentEngine();
 
     static EventuallyPersistentEngine *onSwitchThread(EventuallyPersistentEngine *engine,
@@ -0,0 +1,158 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <algorithm>
+
+#include "locks.h"
+#include "optrace.h"
+
+Atomic<size_t> OpTracer::numEnabled;
+
+/*
+ * Made on first use, and never freed, so it's there for the threads that
+ * end after the static destructors ran.
+ */
+static ThreadLocalPtr<OpTrace> &currentTrace() {
+    static ThreadLocalPtr<OpTrace> *t = new ThreadLocalPtr<OpTrace>();
+    return *t;
+}
+
+const char *OpTracer::phaseName(trace_phase_t phase) {
+    switch (phase) {
+    case TRACE_VB_LOOKUP:
+        return "vb_lookup";
+    case TRACE_HT_LOCK:
+        return "ht_lock";
+    case TRACE_BG_QUEUE:
+        return "bg_queue";
+    case TRACE_DISK_READ:
+        return "disk_read";
+    case TRACE_NOTIFY:
+        return "notify";
+    case TRACE_EXECUTE:
+        return "execute";
+    default:
+        return "unknown";
+    }
+}
+
+void OpTracer::markCurrent(trace_phase_t phase) {
+    OpTrace *trace = currentTrace().get();
+    if (trace) {
+        hrtime_t now = gethrtime();
+        trace->phases[phase] += now - trace->last;
+        trace->last = now;
+    }
+}
+
+void OpTracer::setThreshold(size_t usecs) {
+    LockHolder lh(mutex);
+    size_t old = threshold.get();
+    threshold.set(usecs);
+    if (old == 0 && usecs != 0) {
+        ++numEnabled;
+    } else if (old != 0 && usecs == 0) {
+        --numEnabled;
+        pending.clear();
+    }
+}
+
+bool OpTracer::begin(OpTrace &trace, const char *op, const std::string &key,
+                     uint16_t vbucket, const void *cookie,
+                     rel_time_t when) {
+    if (currentTrace().get() != NULL) {
+        return false;
+    }
+
+    hrtime_t now = gethrtime();
+    bool resumed = false;
+    if (cookie) {
+        LockHolder lh(mutex);
+        std::map<const void*, OpTrace>::iterator it = pending.find(cookie);
+        if (it != pending.end()) {
+            trace = it->second;
+            pending.erase(it);
+            resumed = true;
+        }
+    }
+
+    if (resumed) {
+        trace.phases[TRACE_NOTIFY] += now - trace.last;
+    } else {
+        trace.op = op;
+        trace.key = key;
+        trace.vbucket = vbucket;
+        trace.when = when;
+        trace.start = now;
+    }
+    trace.last = now;
+    currentTrace().set(&trace);
+    return true;
+}
+
+void OpTracer::end(OpTrace &trace, const void *cookie,
+                   ENGINE_ERROR_CODE status) {
+    markCurrent(TRACE_EXECUTE);
+    currentTrace().set(NULL);
+
+    LockHolder lh(mutex);
+    size_t usecs = threshold.get();
+    if (usecs == 0) {
+        // Turned off while the op ran.
+        return;
+    }
+    if (status == ENGINE_EWOULDBLOCK && cookie) {
+        // The traces of cookies that went away never come back.
+        if (pending.size() >= MAX_PENDING) {
+            pending.clear();
+        }
+        pending[cookie] = trace;
+        return;
+    }
+
+    trace.total = trace.last - trace.start;
+    trace.status = status;
+    if (trace.total / 1000 >= usecs) {
+        slowOps.add(trace);
+    }
+}
+
+void OpTracer::bgFetched(const void *cookie, hrtime_t queued, hrtime_t start,
+                         hrtime_t stop) {
+    LockHolder lh(mutex);
+    std::map<const void*, OpTrace>::iterator it = pending.find(cookie);
+    if (it == pending.end()) {
+        return;
+    }
+    OpTrace &trace = it->second;
+    // The fetch was queued before the op returned.
+    hrtime_t from = std::max(queued, trace.last);
+    trace.phases[TRACE_BG_QUEUE] += start > from ? start - from : 0;
+    trace.phases[TRACE_DISK_READ] += stop > start ? stop - start : 0;
+    trace.last = stop;
+}
+
+std::vector<OpTrace> OpTracer::getSlowOps() {
+    LockHolder lh(mutex);
+    return slowOps.contents();
+}
+
+void OpTracer::reset() {
+    LockHolder lh(mutex);
+    slowOps.reset();
+}
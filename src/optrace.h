@@ -0,0 +1,204 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_OPTRACE_H_
+#define SRC_OPTRACE_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "ep_time.h"
+#include "mutex.h"
+#include "ringbuffer.h"
+
+/**
+ * The phases the time of a traced operation is split into.
+ */
+enum trace_phase_t {
+    TRACE_VB_LOOKUP,            //!< Up to finding the vbucket
+    TRACE_HT_LOCK,              //!< Waiting for hash table locks
+    TRACE_BG_QUEUE,             //!< Queued for a background fetch
+    TRACE_DISK_READ,            //!< The background fetch's disk read
+    TRACE_NOTIFY,               //!< From the fetch to the op coming back
+    TRACE_EXECUTE,              //!< All the rest
+    TRACE_NUM_PHASES
+};
+
+/**
+ * The times of one operation, in the phases it went through.
+ */
+struct OpTrace {
+    OpTrace() : op(""), vbucket(0), when(0), start(0), last(0), total(0),
+                status(ENGINE_SUCCESS) {
+        for (int i = 0; i < TRACE_NUM_PHASES; ++i) {
+            phases[i] = 0;
+        }
+    }
+
+    const char *op;
+    std::string key;
+    uint16_t vbucket;
+    //! When the op came in
+    rel_time_t when;
+    hrtime_t start;
+    //! The time of the last mark, the start of the phase it's in
+    hrtime_t last;
+    hrtime_t phases[TRACE_NUM_PHASES];
+    hrtime_t total;
+    ENGINE_ERROR_CODE status;
+};
+
+/**
+ * Keeps the traces of the ops of a bucket that took longer than a
+ * threshold, in a RingBuffer of the latest of them.
+ *
+ * A trace follows its op's thread through the store, which marks the
+ * phases it goes through with mark().  An op that has to wait for a
+ * background fetch is picked up again by its cookie when the client
+ * comes back, with the fetch's times added in between.
+ *
+ * With no tracer of any bucket enabled, a trace costs one load.
+ */
+class OpTracer {
+public:
+    //! The slowest ops kept
+    static const size_t LOG_SIZE = 20;
+    //! The most ops waiting to come back, with their traces kept
+    static const size_t MAX_PENDING = 1024;
+
+    static const char *phaseName(trace_phase_t phase);
+
+    /**
+     * Attribute the time since the last mark of the calling thread's
+     * trace to a phase, if it's tracing an op.
+     */
+    static void mark(trace_phase_t phase) {
+        if (numEnabled.get() != 0) {
+            markCurrent(phase);
+        }
+    }
+
+    OpTracer() : threshold(0), slowOps(LOG_SIZE) { }
+
+    ~OpTracer() {
+        setThreshold(0);
+    }
+
+    /**
+     * Keep the ops that take at least the given usecs, or trace none
+     * for 0.
+     */
+    void setThreshold(size_t usecs);
+
+    size_t getThreshold() {
+        return threshold.get();
+    }
+
+    bool isEnabled() {
+        return threshold.get() != 0;
+    }
+
+    /**
+     * Start tracing an op on the calling thread, or carry on with its
+     * trace if it's coming back from a wait.
+     *
+     * @param when the time the op came in at
+     * @return false if the thread's already tracing the op this one is
+     *         part of, in which case it's not traced on its own
+     */
+    bool begin(OpTrace &trace, const char *op, const std::string &key,
+               uint16_t vbucket, const void *cookie, rel_time_t when);
+
+    /**
+     * Stop tracing the calling thread's op, keeping its trace if it was
+     * slow or until it comes back if it would block.
+     */
+    void end(OpTrace &trace, const void *cookie, ENGINE_ERROR_CODE status);
+
+    /**
+     * Add the times of a background fetch to the trace of the op waiting
+     * for it.
+     *
+     * @param queued when the fetch was queued
+     * @param start when its read started
+     * @param stop when it was done
+     */
+    void bgFetched(const void *cookie, hrtime_t queued, hrtime_t start,
+                   hrtime_t stop);
+
+    //! The slow ops kept, the oldest first
+    std::vector<OpTrace> getSlowOps();
+
+    //! Forget the slow ops kept
+    void reset();
+
+private:
+    static void markCurrent(trace_phase_t phase);
+
+    //! The tracers of all the buckets that are enabled
+    static Atomic<size_t> numEnabled;
+
+    Atomic<size_t> threshold;
+
+    Mutex mutex;
+    std::map<const void*, OpTrace> pending;
+    RingBuffer<OpTrace> slowOps;
+
+    DISALLOW_COPY_AND_ASSIGN(OpTracer);
+};
+
+/**
+ * Traces an op for as long as it's in scope, if its tracer is enabled.
+ */
+class OpTraceScope {
+public:
+    OpTraceScope(OpTracer &t, const char *op, const std::string &key,
+                 uint16_t vbucket, const void *c)
+        : tracer(t), cookie(c), traced(false), status(ENGINE_SUCCESS) {
+        if (tracer.isEnabled()) {
+            traced = tracer.begin(trace, op, key, vbucket, cookie,
+                                  ep_current_time());
+        }
+    }
+
+    ~OpTraceScope() {
+        if (traced) {
+            tracer.end(trace, cookie, status);
+        }
+    }
+
+    //! Record the status the op ended with
+    void setStatus(ENGINE_ERROR_CODE s) {
+        status = s;
+    }
+
+private:
+    OpTracer &tracer;
+    const void *cookie;
+    bool traced;
+    ENGINE_ERROR_CODE status;
+    OpTrace trace;
+
+    DISALLOW_COPY_AND_ASSIGN(OpTraceScope);
+};
+
+#endif  // SRC_OPTRACE_H_
@@ -24,9 +24,11 @@ const Priority Priority::BgFetcherPriority("bg_fetcher_priority", 0);
 const Priority Priority::BgFetcherGetMetaPriority("bg_fetcher_meta_priority", 1);
 const Priority Priority::WarmupPriority("warmup_priority", 0);
 const Priority Priority::VKeyStatBgFetcherPriority("vkey_stat_bg_fetcher_priority", 3);
+const Priority Priority::RangeScanPriority("range_scan_priority", 4);
 
 // Priorities for Auxiliary IO dispatcher
 const Priority Priority::TapBgFetcherPriority("tap_bg_fetcher_priority", 1);
+const Priority Priority::TapApplyPriority("tap_apply_priority", 1);
 
 // Priorities for Read-Write IO dispatcher
 const Priority Priority::VBucketDeletionPriority("vbucket_deletion_priority", 1);
@@ -36,14 +38,22 @@ const Priority Priority::FlusherPriority("flusher_priority", 5);
 const Priority Priority::VBucketPersistLowPriority("vbucket_persist_low_priority", 9);
 const Priority Priority::StatSnapPriority("statsnap_priority", 9);
 const Priority Priority::MutationLogCompactorPriority("mutation_log_compactor_priority", 9);
+const Priority Priority::CompactorPriority("compactor_priority", 10);
 const Priority Priority::AccessScannerPriority("access_scanner_priority", 3);
 
 // Priorities for NON-IO dispatcher
 const Priority Priority::TapConnNotificationPriority("tapconn_notification_priority", 5);
 const Priority Priority::CheckpointRemoverPriority("checkpoint_remover_priority", 6);
 const Priority Priority::TapConnectionReaperPriority("tapconnection_reaper_priority", 6);
+const Priority Priority::BackfillControllerPriority("backfill_controller_priority", 6);
 const Priority Priority::VBMemoryDeletionPriority("vb_memory_deletion_priority", 6);
 const Priority Priority::ItemPagerPriority("item_pager_priority", 7);
 const Priority Priority::BackfillTaskPriority("backfill_task_priority", 8);
 const Priority Priority::HTResizePriority("hashtable_resize_priority", 211);
+const Priority Priority::DefragmenterPriority("defragmenter_priority", 212);
+const Priority Priority::WorkLoadMonitorPriority("workload_monitor_priority", 213);
+const Priority Priority::TimingWindowPriority("timing_window_priority", 7);
+const Priority Priority::GetlWaitPriority("getl_wait_priority", 5);
+const Priority Priority::EpochReclaimerPriority("epoch_reclaimer_priority", 7);
+const Priority Priority::VBucketOwnerPriority("vbucket_owner_priority", 0);
 const Priority Priority::TapResumePriority("tap_resume_priority", 316);
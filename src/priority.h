@@ -33,7 +33,9 @@ public:
     static const Priority BgFetcherPriority;
     static const Priority BgFetcherGetMetaPriority;
     static const Priority TapBgFetcherPriority;
+    static const Priority TapApplyPriority;
     static const Priority VKeyStatBgFetcherPriority;
+    static const Priority RangeScanPriority;
     static const Priority WarmupPriority;
 
     // Priorities for Read-Write dispatcher
@@ -44,6 +46,7 @@ public:
     static const Priority VBucketPersistLowPriority;
     static const Priority StatSnapPriority;
     static const Priority MutationLogCompactorPriority;
+    static const Priority CompactorPriority;
     static const Priority AccessScannerPriority;
 
     // Priorities for NON-IO dispatcher
@@ -52,9 +55,16 @@ public:
     static const Priority VBMemoryDeletionPriority;
     static const Priority ItemPagerPriority;
     static const Priority BackfillTaskPriority;
+    static const Priority BackfillControllerPriority;
     static const Priority TapResumePriority;
     static const Priority TapConnectionReaperPriority;
     static const Priority HTResizePriority;
+    static const Priority WorkLoadMonitorPriority;
+    static const Priority DefragmenterPriority;
+    static const Priority TimingWindowPriority;
+    static const Priority GetlWaitPriority;
+    static const Priority EpochReclaimerPriority;
+    static const Priority VBucketOwnerPriority;
 
     bool operator==(const Priority &other) const {
         return other.getPriorityValue() == this->priority;
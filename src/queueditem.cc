@@ -17,3 +17,165 @@
 
 #include "config.h"
 #include "queueditem.h"
+
+#include <vector>
+
+#include "locks.h"
+
+/**
+ * A freed QueuedItem, linking to the next one of its list.
+ */
+struct FreeQueuedItem {
+    FreeQueuedItem *next;
+};
+
+//! A list of freed QueuedItems
+struct FreeList {
+    FreeList() : head(NULL), count(0) { }
+
+    void push(void *p) {
+        FreeQueuedItem *f = static_cast<FreeQueuedItem*>(p);
+        f->next = head;
+        head = f;
+        ++count;
+    }
+
+    void *pop() {
+        FreeQueuedItem *f = head;
+        head = f->next;
+        --count;
+        return f;
+    }
+
+    //! Move the first n of the list to a list of their own.
+    FreeList split(size_t n) {
+        FreeList rv;
+        while (rv.count < n && count > 0) {
+            rv.push(pop());
+        }
+        return rv;
+    }
+
+    FreeQueuedItem *head;
+    size_t count;
+};
+
+extern "C" {
+    static void releaseQueuedItemCache(void *arg);
+}
+
+static ThreadLocal<FreeList*> *threadFreeLists;
+static Mutex *sharedLock;
+static std::vector<FreeList> *sharedBatches;
+static Atomic<size_t> pooledItems;
+
+/**
+ * Link hook for getting the free lists set up before anything can queue
+ * an item.
+ */
+class QueuedItemPoolInstaller {
+public:
+    QueuedItemPoolInstaller() {
+        if (threadFreeLists == NULL) {
+            threadFreeLists = new ThreadLocal<FreeList*>(releaseQueuedItemCache);
+            sharedLock = new Mutex();
+            sharedBatches = new std::vector<FreeList>();
+        }
+    }
+} queuedItemPoolInstaller;
+
+static void freeAll(FreeList &list) {
+    pooledItems.decr(list.count);
+    while (list.count > 0) {
+        ::operator delete(list.pop());
+    }
+}
+
+/**
+ * Give a batch to the shared pool, or back to the heap if it's full.
+ */
+static void shareBatch(FreeList &batch) {
+    if (batch.count == 0) {
+        return;
+    }
+    {
+        LockHolder lh(*sharedLock);
+        if (sharedBatches->size() < QueuedItemPool::MAX_SHARED_BATCHES) {
+            sharedBatches->push_back(batch);
+            return;
+        }
+    }
+    freeAll(batch);
+}
+
+static void releaseQueuedItemCache(void *arg) {
+    FreeList *list = static_cast<FreeList*>(arg);
+    while (list->count > 0) {
+        FreeList batch = list->split(QueuedItemPool::BATCH_SIZE);
+        shareBatch(batch);
+    }
+    delete list;
+}
+
+static FreeList *threadFreeList() {
+    if (threadFreeLists == NULL) {
+        return NULL;
+    }
+    FreeList *list = threadFreeLists->get();
+    if (list == NULL) {
+        list = new FreeList();
+        threadFreeLists->set(list);
+    }
+    return list;
+}
+
+void *QueuedItemPool::allocate(size_t len) {
+    FreeList *list = len == sizeof(QueuedItem) ? threadFreeList() : NULL;
+    if (list == NULL) {
+        return ::operator new(len);
+    }
+    if (list->count == 0) {
+        LockHolder lh(*sharedLock);
+        if (!sharedBatches->empty()) {
+            *list = sharedBatches->back();
+            sharedBatches->pop_back();
+        }
+    }
+    if (list->count == 0) {
+        return ::operator new(len);
+    }
+    pooledItems.decr(1);
+    return list->pop();
+}
+
+void QueuedItemPool::release(void *p, size_t len) {
+    if (p == NULL) {
+        return;
+    }
+    FreeList *list = len == sizeof(QueuedItem) ? threadFreeList() : NULL;
+    if (list == NULL) {
+        ::operator delete(p);
+        return;
+    }
+    list->push(p);
+    pooledItems.incr(1);
+    if (list->count >= 2 * BATCH_SIZE) {
+        FreeList batch = list->split(BATCH_SIZE);
+        shareBatch(batch);
+    }
+}
+
+void QueuedItemPool::releaseThreadCache() {
+    FreeList *list = threadFreeLists ? threadFreeLists->get() : NULL;
+    if (list == NULL) {
+        return;
+    }
+    while (list->count > 0) {
+        FreeList batch = list->split(BATCH_SIZE);
+        shareBatch(batch);
+    }
+}
+
+size_t QueuedItemPool::getPooledBytes() {
+    return pooledItems.get() * sizeof(QueuedItem);
+}
@@ -44,15 +44,54 @@ typedef enum {
     vbucket_del_invalid
 } vbucket_del_result;
 
+/**
+ * Free lists of QueuedItem memory.
+ *
+ * Every mutation queues a QueuedItem, and the checkpoint remover drops
+ * them a checkpoint at a time, so millions of them go through the heap.
+ * Each thread keeps the ones it frees to allocate from, without a lock;
+ * what it collects beyond that goes to a shared pool a batch at a time,
+ * for the threads queueing mutations to take back a batch at a time.
+ */
+class QueuedItemPool {
+public:
+    //! The QueuedItems moved between a thread and the shared pool at once
+    static const size_t BATCH_SIZE = 256;
+    //! The batches the shared pool keeps; any more go back to the heap
+    static const size_t MAX_SHARED_BATCHES = 256;
+
+    static void *allocate(size_t len);
+
+    static void release(void *p, size_t len);
+
+    /**
+     * Hand the QueuedItems the calling thread freed to the shared pool,
+     * for the threads that queue mutations to reuse.
+     */
+    static void releaseThreadCache();
+
+    //! Bytes of freed QueuedItems held for reuse, by all the threads
+    static size_t getPooledBytes();
+};
+
 /**
  * Representation of an item queued for persistence or tap.
  */
 class QueuedItem : public RCValue {
 public:
+    static void *operator new(size_t len) {
+        return QueuedItemPool::allocate(len);
+    }
+
+    static void operator delete(void *p, size_t len) {
+        QueuedItemPool::release(p, len);
+    }
+
     QueuedItem(const std::string &k, const uint16_t vb,
                enum queue_operation o, const uint64_t revSeq = 1)
-        : key(k), revSeqno(revSeq), queued(ep_current_time()),
-          op(static_cast<uint16_t>(o)), vbucket(vb)
+        : key(k), revSeqno(revSeq), mutationId(0),
+          queued(ep_current_time()), op(static_cast<uint16_t>(o)),
+          vbucket(vb)
     {
         ObjectRegistry::onCreateQueuedItem(this);
     }
@@ -70,6 +109,16 @@ public:
 
     uint64_t getRevSeqno() const { return revSeqno; }
 
+    /**
+     * The id the vbucket's checkpoint manager gave the mutation when it was
+     * last queued; 0 if it never was.
+     */
+    uint64_t getMutationId() const { return mutationId; }
+
+    void setMutationId(uint64_t id) {
+        mutationId = id;
+    }
+
     void setQueuedTime(uint32_t queued_time) {
         queued = queued_time;
     }
@@ -90,6 +139,7 @@ public:
 private:
     std::string key;
     uint64_t revSeqno;
+    uint64_t mutationId;
     uint32_t queued;
     uint16_t op;
     uint16_t vbucket;
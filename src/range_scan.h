@@ -0,0 +1,70 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_RANGE_SCAN_H_
+#define SRC_RANGE_SCAN_H_ 1
+
+#include "config.h"
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "item.h"
+
+/**
+ * A page of a scan of a vbucket's keys in key order, as asked for by
+ * CMD_RANGE_SCAN, and the items it found.
+ *
+ * Keys compare as their bytes do, as in the by-id trees of the vbucket
+ * files.
+ */
+class RangeScan {
+public:
+    RangeScan(uint16_t vb, const std::string &s, const std::string &e,
+              size_t l, bool k) :
+        vbucket(vb), start(s), end(e), limit(l), keysOnly(k),
+        status(ENGINE_SUCCESS) {}
+
+    ~RangeScan() {
+        std::vector<Item *>::iterator it;
+        for (it = items.begin(); it != items.end(); ++it) {
+            delete *it;
+        }
+    }
+
+    uint16_t vbucket;
+    //! The first key of the page
+    std::string start;
+    //! The key the range stops before, empty for no end
+    std::string end;
+    //! The most items the page returns
+    size_t limit;
+    //! True if only the keys and their metadata are wanted
+    bool keysOnly;
+
+    //! The items of the page in key order, owned by the scan
+    std::vector<Item *> items;
+    //! Where the next page starts, empty once the range is done
+    std::string next;
+    ENGINE_ERROR_CODE status;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RangeScan);
+};
+
+#endif  // SRC_RANGE_SCAN_H_
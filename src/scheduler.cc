@@ -17,7 +17,16 @@
 
 #include "config.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
 #include <queue>
+#include <sstream>
+
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 
 #include "common.h"
 #include "ep_engine.h"
@@ -27,6 +36,7 @@
 #include "workload.h"
 
 Atomic<size_t> GlobalTask::task_id_counter = 1;
+const double ExecutorThread::stealInterval = 0.1;
 
 extern "C" {
     static void* launch_executor_thread(void* arg);
@@ -46,48 +56,209 @@ static void* launch_executor_thread(void *arg) {
     return NULL;
 }
 
+/**
+ * Convert a time to due queue ticks, rounding up so a task never comes out
+ * of the queue before it's due.
+ */
+static uint64_t toTick(const struct timeval &tv) {
+    return static_cast<uint64_t>(tv.tv_sec) * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+uint64_t ExecutorThread::currentTick() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_usec / 1000;
+}
+
 void ExecutorThread::moveReadyTasks(const struct timeval &tv) {
     if (!readyQueue.empty()) {
         return;
     }
 
-    std::queue<ExTask> notReady;
-    while (!futureQueue.empty()) {
-        const ExTask &tid = futureQueue.top();
-        if (less_tv(tid->waketime, tv)) {
-            readyQueue.push(tid);
+    std::vector<FutureTask> due;
+    futureQueue.expire(static_cast<uint64_t>(tv.tv_sec) * 1000 +
+                       tv.tv_usec / 1000, due);
+    std::vector<FutureTask>::iterator it = due.begin();
+    for (; it != due.end(); ++it) {
+        ExTask &tid = it->first;
+        if (tid->dueSeq != it->second) {
+            // Woken or snoozed since; another copy is live.
+            continue;
+        }
+        LockHolder tlh(tid->mutex);
+        if (tid->state == TASK_DEAD) {
+            tid->dueSeq = 0;
+            --numFuture;
+            continue;
+        }
+        tlh.unlock();
+        if (less_tv(tv, tid->waketime)) {
+            // Snoozed without telling us; put it back where it's due now.
+            futureQueue.insert(*it, toTick(tid->waketime));
         } else {
-            // If we have woken a task recently the future queue might be out
-            // of order so we need to check each job.
-            if (hasWokenTask) {
-                notReady.push(tid);
-            } else {
-                return;
-            }
+            tid->dueSeq = 0;
+            --numFuture;
+            pushReady(tid);
         }
-        futureQueue.pop();
     }
-    hasWokenTask = false;
+}
 
-    while(!notReady.empty()) {
-        const ExTask &tid = notReady.front();
-        if (less_tv(tid->waketime, tv)) {
-            readyQueue.push(tid);
-        } else {
-            futureQueue.push(tid);
+void ExecutorThread::pushFuture(ExTask &task, const struct timeval &now) {
+    if (task->dueSeq != 0) {
+        --numFuture;
+    }
+    if (!less_tv(now, task->waketime)) {
+        task->dueSeq = 0;
+        pushReady(task);
+        return;
+    }
+    task->dueSeq = ++nextDueSeq;
+    ++numFuture;
+    futureQueue.insert(FutureTask(task, task->dueSeq),
+                       toTick(task->waketime));
+}
+
+ExTask ExecutorThread::popReady() {
+    ExTask task;
+    std::vector<ExTask> skipped;
+    while (!readyQueue.empty()) {
+        ExTask tid = readyQueue.top();
+        readyQueue.pop();
+        LockHolder tlh(tid->mutex);
+        if (tid->state == TASK_DEAD) {
+            continue;
+        }
+        tlh.unlock();
+        if (busyShards.find(tid->shard) == busyShards.end()) {
+            // Whoever waits from now on waits for its next run.
+            tid->clientWaitStart = 0;
+            task = tid;
+            break;
+        }
+        // Another task of its shard is running on a peer.
+        skipped.push_back(tid);
+    }
+
+    std::vector<ExTask>::iterator it = skipped.begin();
+    for (; it != skipped.end(); ++it) {
+        pushReady(*it);
+    }
+    if (task) {
+        busyShards.insert(task->shard);
+    }
+    return task;
+}
+
+void ExecutorThread::waitForTask(const struct timeval &now) {
+    // With ready tasks held back for their shard, we wait for the
+    // shard's task to be done before looking at the due queue again.
+    // A dead or stale task may wake us up for nothing.
+    bool timed = readyQueue.empty() && !futureQueue.empty();
+    struct timeval waketime;
+    if (timed) {
+        uint64_t tick = futureQueue.nextExpiry();
+        waketime.tv_sec = static_cast<time_t>(tick / 1000);
+        waketime.tv_usec = static_cast<suseconds_t>((tick % 1000) * 1000);
+    }
+    if (stealing) {
+        // Look again for a busy peer to help now and then.
+        struct timeval poll = now;
+        advance_tv(poll, stealInterval);
+        if (!timed || less_tv(poll, waketime)) {
+            waketime = poll;
+        }
+        timed = true;
+    }
+
+    if (!timed) {
+        state = EXECUTOR_WAITING;
+        mutex.wait();
+        if (state == EXECUTOR_WAITING) {
+            state = EXECUTOR_RUNNING;
+        }
+    } else if (less_tv(now, waketime)) {
+        state = EXECUTOR_SLEEPING;
+        mutex.wait(waketime);
+        if (state == EXECUTOR_SLEEPING) {
+            state = EXECUTOR_RUNNING;
+        }
+    }
+}
+
+ExTask ExecutorThread::giveTask(const struct timeval &now) {
+    LockHolder lh(mutex);
+    if (!parked && (state != EXECUTOR_RUNNING || !currentTask)) {
+        // We'll get to our ready tasks ourselves.
+        return ExTask();
+    }
+    moveReadyTasks(now);
+    return popReady();
+}
+
+ExTask ExecutorThread::stealTask(const struct timeval &now,
+                                 ExecutorThread *&home) {
+    for (size_t i = 1; i < peers.size(); ++i) {
+        ExecutorThread *peer = peers[(peerIdx + i) % peers.size()];
+        ExTask task = peer->giveTask(now);
+        if (task) {
+            LOG(EXTENSION_LOG_DEBUG, "%s: Steal a task \"%s\" from %s",
+                name.c_str(), task->getDescription().c_str(),
+                peer->getName().c_str());
+            stolen.incr(1);
+            home = peer;
+            return task;
+        }
+    }
+    return ExTask();
+}
+
+void ExecutorThread::doneTask(ExTask &task, bool again) {
+    LockHolder lh(mutex);
+    busyShards.erase(task->shard);
+    if (again) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        pushFuture(task, now);
+    }
+    // The task may have come from our queues while we wait for its shard.
+    notify();
+}
+
+void ExecutorThread::setPeers(const std::vector<ExecutorThread*> &threads) {
+    assert(state == EXECUTOR_CREATING);
+    peers = threads;
+    for (size_t i = 0; i < peers.size(); ++i) {
+        if (peers[i] == this) {
+            peerIdx = i;
         }
-        notReady.pop();
     }
 }
 
-ExTask ExecutorThread::nextTask() {
-    assert (!empty());
-    return readyQueue.empty() ? futureQueue.top() : readyQueue.top();
+void ExecutorThread::setParked(bool p) {
+    LockHolder lh(mutex);
+    if (parked != p) {
+        LOG(EXTENSION_LOG_INFO, "%s: %s", name.c_str(),
+            p ? "Parking" : "Unparking");
+        parked = p;
+        notify();
+    }
 }
 
-void ExecutorThread::popNext() {
-    assert (!empty());
-    readyQueue.empty() ? futureQueue.pop() : readyQueue.pop();
+bool ExecutorThread::notifyIfIdle() {
+    LockHolder lh(mutex);
+    if (parked || (state != EXECUTOR_WAITING && state != EXECUTOR_SLEEPING)) {
+        return false;
+    }
+    notify();
+    return true;
+}
+
+void ExecutorThread::wakeIdlePeer() {
+    for (size_t i = 1; i < peers.size(); ++i) {
+        if (peers[(peerIdx + i) % peers.size()]->notifyIfIdle()) {
+            return;
+        }
+    }
 }
 
 void ExecutorThread::start() {
@@ -115,72 +286,121 @@ void ExecutorThread::stop() {
 void ExecutorThread::run() {
     state = EXECUTOR_RUNNING;
     ObjectRegistry::onSwitchThread(engine);
+    if (!cpus.empty()) {
+#ifdef HAVE_SCHED_SETAFFINITY
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        size_t numCpus = 0;
+        std::vector<int>::iterator it = cpus.begin();
+        for (; it != cpus.end(); ++it) {
+            // A cpu_set_t only has room for CPU_SETSIZE of them.
+            if (*it >= 0 && *it < CPU_SETSIZE) {
+                CPU_SET(*it, &set);
+                ++numCpus;
+            }
+        }
+        if (numCpus == 0) {
+            LOG(EXTENSION_LOG_WARNING, "%s: No CPU of NUMA node %d fits in a "
+                "cpu set; not pinning", name.c_str(), numaNode);
+            numaNode = -1;
+        } else if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            LOG(EXTENSION_LOG_WARNING, "%s: Failed to pin to NUMA node %d: %s",
+                name.c_str(), numaNode, strerror(errno));
+            numaNode = -1;
+        }
+#else
+        numaNode = -1;
+#endif
+    }
     for (;;) {
         LockHolder lh(mutex);
         currentTask.reset();
         if (state != EXECUTOR_RUNNING) {
             break;
         }
-        if (empty()) {
-            state = EXECUTOR_WAITING;
-            mutex.wait();
-            if (state == EXECUTOR_WAITING) {
-                state = EXECUTOR_RUNNING;
-            }
-        } else {
-            struct timeval tv;
-            gettimeofday(&tv, NULL);
 
-            // Get any ready tasks out of the due queue.
-            moveReadyTasks(tv);
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
 
-            currentTask = nextTask();
-            assert(currentTask);
-            LockHolder tlh(currentTask->mutex);
-            if (currentTask->state == TASK_DEAD) {
-                popNext();
-                continue;
+        // Get any ready tasks out of the due queue.
+        moveReadyTasks(tv);
+
+        if (parked) {
+            // Our tasks are run by the peers; make sure one comes for them.
+            if (!readyQueue.empty()) {
+                lh.unlock();
+                wakeIdlePeer();
+                lh.lock();
+            }
+            if (state == EXECUTOR_RUNNING && parked) {
+                waitForTask(tv);
             }
-            tlh.unlock();
+            continue;
+        }
 
-            if (less_tv(tv, currentTask->waketime)) {
-                state = EXECUTOR_SLEEPING;
-                mutex.wait(currentTask->waketime);
-                if (state == EXECUTOR_SLEEPING) {
-                    state = EXECUTOR_RUNNING;
-                }
+        ExecutorThread *home = this;
+        ExTask task = popReady();
+        if (!task && stealing) {
+            size_t seen = wakeups;
+            lh.unlock();
+            task = stealTask(tv, home);
+            lh.lock();
+            if (!task && (wakeups != seen || state != EXECUTOR_RUNNING)) {
+                // Something came in while we were looking around.
                 continue;
-            } else {
-                popNext();
             }
-            lh.unlock();
+        }
+        if (!task) {
+            waitForTask(tv);
+            continue;
+        }
 
-            taskStart = gethrtime();
-            rel_time_t startReltime = ep_current_time();
-            try {
-                bool again = currentTask->run();
-                if(again) {
-                    reschedule(currentTask);
-                } else if (!currentTask->isDaemonTask) {
-                    manager->cancel(currentTask->taskId);
-                } else {
-                }
-            } catch (std::exception& e) {
-                LOG(EXTENSION_LOG_WARNING,
-                    "%s: Exception caught in task \"%s\": %s", name.c_str(),
-                    currentTask->getDescription().c_str(), e.what());
-            } catch(...) {
-                LOG(EXTENSION_LOG_WARNING,
-                    "%s: Fatal exception caught in task \"%s\"\n", name.c_str(),
-                    currentTask->getDescription().c_str());
-            }
+        currentTask = task;
+        bool busy = stealing && !readyQueue.empty();
+        lh.unlock();
+        if (busy) {
+            wakeIdlePeer();
+        }
 
-            hrtime_t runtime((gethrtime() - taskStart) / 1000);
-            TaskLogEntry tle(currentTask->getDescription(), runtime, startReltime);
-            tasklog.add(tle);
-            if (runtime > (hrtime_t)currentTask->maxExpectedDuration()) {
-                slowjobs.add(tle);
+        // Flushes and other background IO of all the buckets take turns
+        // on the disks, so none of them hogs the disks the others read.
+        bool slotted = (type == WRITER_TASK_IDX || type == AUXIO_TASK_IDX) &&
+                       manager->acquireIOSlot(engine);
+
+        EPStats &stats = engine->getEpStats();
+        task_kind_t kind = currentTask->getKind();
+        stats.taskWaitHisto[kind].add(usec_since_tv(currentTask->waketime, tv));
+        taskStart = gethrtime();
+        hrtime_t cpuStart = gethrcputime();
+        rel_time_t startReltime = ep_current_time();
+        bool again = false;
+        try {
+            again = currentTask->run();
+            if (!again && !currentTask->isDaemonTask) {
+                manager->cancel(currentTask->taskId);
             }
+        } catch (std::exception& e) {
+            LOG(EXTENSION_LOG_WARNING,
+                "%s: Exception caught in task \"%s\": %s", name.c_str(),
+                currentTask->getDescription().c_str(), e.what());
+        } catch(...) {
+            LOG(EXTENSION_LOG_WARNING,
+                "%s: Fatal exception caught in task \"%s\"\n", name.c_str(),
+                currentTask->getDescription().c_str());
+        }
+        hrtime_t runtime((gethrtime() - taskStart) / 1000);
+        if (slotted) {
+            manager->releaseIOSlot(engine, runtime);
+        }
+        home->doneTask(currentTask, again);
+
+        cpuTime.incr((gethrcputime() - cpuStart) / 1000);
+        busyTime.incr(runtime);
+        stats.taskRunHisto[kind].add(runtime);
+        TaskLogEntry tle(currentTask->getDescription(), runtime, startReltime);
+        tasklog.add(tle);
+        if (runtime > (hrtime_t)currentTask->maxExpectedDuration()) {
+            slowjobs.add(tle);
         }
     }
     state = EXECUTOR_DEAD;
@@ -192,25 +412,47 @@ void ExecutorThread::schedule(ExTask &task) {
     }
 
     LockHolder lh(mutex);
-    readyQueue.push(task);
+    pushReady(task);
     notify();
     LOG(EXTENSION_LOG_DEBUG, "%s: Schedule a task \"%s\"", name.c_str(),
         task->getDescription().c_str());
+    bool busy = stealing && (currentTask || parked);
+    lh.unlock();
+    if (busy) {
+        wakeIdlePeer();
+    }
 }
 
-void ExecutorThread::reschedule(ExTask &task) {
-    LOG(EXTENSION_LOG_DEBUG, "%s: Reschedule a task \"%s\"", name.c_str(),
-        task->getDescription().c_str());
-    LockHolder lh(mutex);
-    futureQueue.push(task);
-}
-
-void ExecutorThread::wake(ExTask &task) {
+void ExecutorThread::wake(ExTask &task, bool clientWaiting) {
     LockHolder lh(mutex);
     LOG(EXTENSION_LOG_DEBUG, "%s: Wake a task \"%s\"", name.c_str(),
         task->getDescription().c_str());
     task->snooze(0, false);
-    hasWokenTask = true;
+    if (clientWaiting) {
+        task->setClientWaiting();
+    }
+    if (task->dueSeq != 0) {
+        // Its copy in the due queue goes stale.
+        task->dueSeq = 0;
+        --numFuture;
+        pushReady(task);
+    }
+    notify();
+    bool busy = stealing && (currentTask || parked);
+    lh.unlock();
+    if (busy) {
+        wakeIdlePeer();
+    }
+}
+
+void ExecutorThread::snooze(ExTask &task, double secs) {
+    LockHolder lh(mutex);
+    task->snooze(secs, false);
+    if (task->dueSeq != 0) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        pushFuture(task, now);
+    }
     notify();
 }
 
@@ -243,11 +485,11 @@ bool ExecutorPool::cancel(size_t taskId) {
     return true;
 }
 
-bool ExecutorPool::wake(size_t taskId) {
+bool ExecutorPool::wake(size_t taskId, bool clientWaiting) {
     LockHolder lh(mutex);
     std::map<size_t, lookupId>::iterator itr = taskLocator.find(taskId);
     if (itr != taskLocator.end()) {
-        itr->second.second->wake(itr->second.first);
+        itr->second.second->wake(itr->second.first, clientWaiting);
         return true;
     }
     return false;
@@ -257,13 +499,81 @@ bool ExecutorPool::snooze(size_t taskId, double tosleep) {
     LockHolder lh(mutex);
     std::map<size_t, lookupId>::iterator itr = taskLocator.find(taskId);
     if (itr != taskLocator.end()) {
-        itr->second.first->snooze(tosleep, false);
+        itr->second.second->snooze(itr->second.first, tosleep);
         return true;
     }
     return false;
 }
 
-size_t ExecutorPool::schedule(ExTask task, int tidx) {
+void ExecutorPool::getGroupSizes(EventuallyPersistentEngine *engine,
+                                 size_t sizes[NUM_TASK_GROUPS]) {
+    WorkLoadPolicy &workload = engine->getWorkLoadPolicy();
+    sizes[WRITER_TASK_IDX] = workload.calculateNumWriters();
+    sizes[READER_TASK_IDX] = workload.calculateNumReaders();
+    sizes[AUXIO_TASK_IDX] = workload.calculateNumAuxIO();
+    sizes[NONIO_TASK_IDX] = workload.calculateNumNonIO();
+}
+
+task_type_t ExecutorPool::getGroupOf(const size_t sizes[NUM_TASK_GROUPS],
+                                     task_type_t type) {
+    if (sizes[type] == 0) {
+        return type == NONIO_TASK_IDX ? READER_TASK_IDX : WRITER_TASK_IDX;
+    }
+    return type;
+}
+
+/**
+ * Parse a list of CPU or node ids the way sysfs prints them ("0-3,8,10-11").
+ */
+static std::vector<int> parseIdList(const std::string &list) {
+    std::vector<int> ids;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        int first, last;
+        char dash;
+        std::stringstream rs(range);
+        if (!(rs >> first)) {
+            continue;
+        }
+        if (!(rs >> dash >> last) || dash != '-') {
+            last = first;
+        }
+        if (first < 0 || last < first) {
+            continue;
+        }
+        for (int id = first; id <= last; ++id) {
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+static std::string readSysFile(const std::string &path) {
+    std::ifstream file(path.c_str());
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+std::vector<std::vector<int> > ExecutorPool::getNumaNodes() {
+    std::vector<std::vector<int> > nodes;
+    const std::string base("/sys/devices/system/node/");
+    std::vector<int> online = parseIdList(readSysFile(base + "online"));
+    std::vector<int>::iterator it = online.begin();
+    for (; it != online.end(); ++it) {
+        std::stringstream ss;
+        ss << base << "node" << *it << "/cpulist";
+        std::vector<int> cpus = parseIdList(readSysFile(ss.str()));
+        if (!cpus.empty()) {
+            // Memory only nodes have no threads to run.
+            nodes.push_back(cpus);
+        }
+    }
+    return nodes;
+}
+
+size_t ExecutorPool::schedule(ExTask task, task_type_t type, int sid) {
     LockHolder lh(mutex);
     if (bucketRegistry.find(task->getEngine()) == bucketRegistry.end()) {
         LOG(EXTENSION_LOG_WARNING, "Trying to schedule task for unregistered "
@@ -271,7 +581,17 @@ size_t ExecutorPool::schedule(ExTask task, int tidx) {
         return task->getId();
     }
 
+    // The groups' threads follow each other in the order of task_type_t.
+    size_t sizes[NUM_TASK_GROUPS];
+    getGroupSizes(task->getEngine(), sizes);
+    type = getGroupOf(sizes, type);
+    size_t tidx = sid % sizes[type];
+    for (int group = 0; group < type; ++group) {
+        tidx += sizes[group];
+    }
+
     threadQ &threads = bucketRegistry[task->getEngine()];
+    task->shard = sid;
     threads[tidx]->schedule(task);
     lookupId loc(task, threads[tidx]);
     taskLocator[task->getId()] = loc;
@@ -300,29 +620,111 @@ void ExecutorPool::unregisterBucket(EventuallyPersistentEngine *engine) {
     bucketRegistry.erase(itr);
     lh.unlock();
 
+    // A thread may still be running a task stolen from another one, so
+    // none of them is deleted before they've all stopped.
     for (size_t tidx = 0; tidx < threads.size(); ++tidx) {
         LOG(EXTENSION_LOG_INFO,
             "Waiting for thread[%d] to finish in bucket: %s", tidx,
             engine->getName());
         threads[tidx]->stop();
+    }
+    for (size_t tidx = 0; tidx < threads.size(); ++tidx) {
         delete threads[tidx];
     }
+    ioShare.removeBucket(engine);
+}
+
+void ExecutorPool::setActiveThreads(EventuallyPersistentEngine *engine,
+                                    task_type_t group, size_t n) {
+    LockHolder lh(mutex);
+    std::map<EventuallyPersistentEngine*, threadQ>::iterator itr =
+        bucketRegistry.find(engine);
+    if (itr == bucketRegistry.end()) {
+        return;
+    }
+    threadQ &threads = itr->second;
+    size_t idx = 0;
+    for (size_t tidx = 0; tidx < threads.size(); ++tidx) {
+        if (threads[tidx]->getType() == group) {
+            threads[tidx]->setParked(idx++ >= n);
+        }
+    }
+}
+
+hrtime_t ExecutorPool::getBusyTime(EventuallyPersistentEngine *engine,
+                                   task_type_t group) {
+    LockHolder lh(mutex);
+    std::map<EventuallyPersistentEngine*, threadQ>::iterator itr =
+        bucketRegistry.find(engine);
+    if (itr == bucketRegistry.end()) {
+        return 0;
+    }
+    hrtime_t busy = 0;
+    threadQ &threads = itr->second;
+    for (size_t tidx = 0; tidx < threads.size(); ++tidx) {
+        if (threads[tidx]->getType() == group) {
+            busy += threads[tidx]->getBusyTime();
+        }
+    }
+    return busy;
 }
 
 bool ExecutorPool::startWorkers(EventuallyPersistentEngine *engine) {
     if (bucketRegistry.find(engine) == bucketRegistry.end()) {
+        // Parked threads need their peers to steal their tasks.
         WorkLoadPolicy &workload = engine->getWorkLoadPolicy();
-        int numThreads = workload.calculateNumReaders() +
-                         workload.calculateNumWriters();
+        bool stealing = engine->getConfiguration().isExecutorWorkStealing() ||
+                        workload.isAuto();
+        size_t sizes[NUM_TASK_GROUPS];
+        getGroupSizes(engine, sizes);
+        size_t active[NUM_TASK_GROUPS];
+        std::copy(sizes, sizes + NUM_TASK_GROUPS, active);
+        active[READER_TASK_IDX] = workload.getActiveReaders();
+        active[WRITER_TASK_IDX] = workload.getActiveWriters();
+        std::vector<std::vector<int> > nodes;
+        if (engine->getConfiguration().isExecutorNumaAffinity()) {
+            nodes = getNumaNodes();
+            if (nodes.size() < 2) {
+                LOG(EXTENSION_LOG_INFO, "No NUMA nodes to pin %s's worker "
+                    "threads to", engine->getName());
+                nodes.clear();
+            }
+        }
         threadQ threads;
-        threads.reserve(numThreads);
-        for (int tidx = 0; tidx < numThreads; ++tidx) {
-            std::stringstream ss;
-            ss << "iomanager_worker_" << tidx;
-            threads.push_back(new ExecutorThread(this, engine, ss.str()));
-            threads.back()->start();
+        std::vector<threadQ> groups(NUM_TASK_GROUPS);
+        for (int group = 0; group < NUM_TASK_GROUPS; ++group) {
+            for (size_t i = 0; i < sizes[group]; ++i) {
+                std::stringstream ss;
+                ss << "iomanager_worker_" << threads.size();
+                ExecutorThread *thread =
+                    new ExecutorThread(this, engine, ss.str(),
+                                       static_cast<task_type_t>(group),
+                                       stealing);
+                if (!nodes.empty()) {
+                    // Thread i of each group serves shards i, i + size...,
+                    // so a shard's flusher, bg fetcher and snapshots share
+                    // a node when the group sizes are multiples of the
+                    // node count.
+                    size_t node = i % nodes.size();
+                    thread->setNumaNode(node, nodes[node]);
+                }
+                if (i >= active[group]) {
+                    thread->setParked(true);
+                }
+                threads.push_back(thread);
+                groups[group].push_back(thread);
+            }
+        }
+        // Threads only steal from their own group, so a reader never gets
+        // stuck in a flush.
+        for (size_t tidx = 0; tidx < threads.size(); ++tidx) {
+            threads[tidx]->setPeers(groups[threads[tidx]->getType()]);
+            threads[tidx]->start();
         }
         bucketRegistry[engine] = threads;
+        ioShare.addBucket(engine,
+                          engine->getConfiguration().getExecutorIoWeight(),
+                          engine->getConfiguration().getExecutorIoSlots());
         return true;
     } else {
         LOG(EXTENSION_LOG_WARNING,
@@ -368,6 +770,15 @@ static void addWorkerStats(const char *prefix, threadQ threads, size_t t,
                 add_stat, cookie);
     }
 
+    snprintf(statname, sizeof(statname), "%s:stolen", prefix);
+    add_casted_stat(statname, threads[t]->getStolen(), add_stat, cookie);
+    snprintf(statname, sizeof(statname), "%s:cpu_time", prefix);
+    add_casted_stat(statname, threads[t]->getCPUTime(), add_stat, cookie);
+    if (threads[t]->getNumaNode() >= 0) {
+        snprintf(statname, sizeof(statname), "%s:numa_node", prefix);
+        add_casted_stat(statname, threads[t]->getNumaNode(), add_stat, cookie);
+    }
+
     showJobLog("log", prefix, threads[t]->getLog(), cookie, add_stat);
     showJobLog("slow", prefix, threads[t]->getSlowLog(), cookie,
                add_stat);
@@ -389,4 +800,81 @@ void ExecutorPool::doWorkerStat(EventuallyPersistentEngine *engine,
         addWorkerStats(threads[tidx]->getName().c_str(), threads, tidx,
                      cookie, add_stat);
     }
+
+    static const char *groupNames[NUM_TASK_GROUPS] = {
+        "iomanager_writer", "iomanager_reader",
+        "iomanager_auxio", "iomanager_nonio"
+    };
+    size_t numThreads[NUM_TASK_GROUPS] = {0};
+    size_t activeThreads[NUM_TASK_GROUPS] = {0};
+    size_t readyTasks[NUM_TASK_GROUPS] = {0};
+    size_t futureTasks[NUM_TASK_GROUPS] = {0};
+    hrtime_t cpuTime[NUM_TASK_GROUPS] = {0};
+    for (size_t tidx = 0; tidx < threads.size(); ++tidx) {
+        task_type_t type = threads[tidx]->getType();
+        size_t ready, future;
+        threads[tidx]->getQueueSizes(ready, future);
+        ++numThreads[type];
+        if (!threads[tidx]->isParked()) {
+            ++activeThreads[type];
+        }
+        readyTasks[type] += ready;
+        futureTasks[type] += future;
+        cpuTime[type] += threads[tidx]->getCPUTime();
+    }
+
+    EPStats &stats = engine->getEpStats();
+
+    char statname[80] = {0};
+    size_t slots = ioShare.getSlots();
+    if (slots > 0) {
+        IOShare::Bucket share = ioShare.getBucket(engine);
+        add_casted_stat("iomanager_share:slots", slots, add_stat, cookie);
+        add_casted_stat("iomanager_share:weight", share.weight, add_stat,
+                        cookie);
+        add_casted_stat("iomanager_share:waiting", share.waiting, add_stat,
+                        cookie);
+        add_casted_stat("iomanager_share:running", share.running, add_stat,
+                        cookie);
+        add_casted_stat("iomanager_share:granted", share.granted, add_stat,
+                        cookie);
+        add_casted_stat("iomanager_share:wait_time", share.waitTime,
+                        add_stat, cookie);
+        add_casted_stat("iomanager_share:io_time", share.ioTime, add_stat,
+                        cookie);
+        add_casted_stat("iomanager_share:deficit", share.deficit, add_stat,
+                        cookie);
+    }
+
+    for (int group = 0; group < NUM_TASK_GROUPS; ++group) {
+        if (numThreads[group] == 0) {
+            continue;
+        }
+        snprintf(statname, sizeof(statname), "%s:threads", groupNames[group]);
+        add_casted_stat(statname, numThreads[group], add_stat, cookie);
+        snprintf(statname, sizeof(statname), "%s:active_threads",
+                 groupNames[group]);
+        add_casted_stat(statname, activeThreads[group], add_stat, cookie);
+        snprintf(statname, sizeof(statname), "%s:ready_tasks",
+                 groupNames[group]);
+        add_casted_stat(statname, readyTasks[group], add_stat, cookie);
+        snprintf(statname, sizeof(statname), "%s:future_tasks",
+                 groupNames[group]);
+        add_casted_stat(statname, futureTasks[group], add_stat, cookie);
+        snprintf(statname, sizeof(statname), "%s:cpu_time", groupNames[group]);
+        add_casted_stat(statname, cpuTime[group], add_stat, cookie);
+    }
+
+    for (int kind = 0; kind < NUM_TASK_KINDS; ++kind) {
+        const char *kindName =
+            GlobalTask::getKindName(static_cast<task_kind_t>(kind));
+        snprintf(statname, sizeof(statname), "task_%s:schedule_delay",
+                 kindName);
+        add_casted_stat(statname, stats.taskWaitHisto[kind], add_stat,
+                        cookie);
+        snprintf(statname, sizeof(statname), "task_%s:task_runtime",
+                 kindName);
+        add_casted_stat(statname, stats.taskRunHisto[kind], add_stat,
+                        cookie);
+    }
 }
@@ -24,16 +24,19 @@
 #include <list>
 #include <map>
 #include <queue>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "atomic.h"
 #include "common.h"
+#include "io_share.h"
 #include "mutex.h"
 #include "objectregistry.h"
 #include "ringbuffer.h"
 #include "tasks.h"
+#include "timingwheel.h"
 
 #define TASK_LOG_SIZE 20
 
@@ -80,14 +83,30 @@ private:
     hrtime_t duration;
 };
 
+/**
+ * A worker thread of a bucket, running the tasks scheduled on it.
+ *
+ * In work stealing mode a thread that has nothing ready to run takes ready
+ * tasks from the queues of the other threads of its group while they're
+ * busy running something else.  A stolen task is put back on the queue of the
+ * thread it was scheduled on once it has run.  The tasks of one shard that
+ * were scheduled on the same thread (i.e. its flusher and vbucket
+ * snapshots) never run at the same time, wherever they run.
+ */
 class ExecutorThread {
 public:
+    //! Max time (s) an idle thread waits before looking for tasks to steal
+    static const double stealInterval;
 
     ExecutorThread(ExecutorPool *m, EventuallyPersistentEngine *e,
-                   const std::string nm)
-        : name(nm), state(EXECUTOR_CREATING), manager(m), engine(e),
-          hasWokenTask(false), tasklog(TASK_LOG_SIZE), slowjobs(TASK_LOG_SIZE),
-          currentTask(NULL), taskStart(NULL) {}
+                   const std::string nm, task_type_t t = WRITER_TASK_IDX,
+                   bool steal = false)
+        : name(nm), type(t), state(EXECUTOR_CREATING), manager(m), engine(e),
+          futureQueue(currentTick()), numFuture(0), nextDueSeq(0),
+          tasklog(TASK_LOG_SIZE), slowjobs(TASK_LOG_SIZE),
+          currentTask(NULL), taskStart(NULL), stealing(steal), parked(false),
+          peerIdx(0), stolen(0), wakeups(0), cpuTime(0), busyTime(0),
+          numaNode(-1) {}
 
     ~ExecutorThread() {
         LOG(EXTENSION_LOG_INFO, "Executor killing %s", name.c_str());
@@ -95,6 +114,20 @@ public:
 
     void start();
 
+    /**
+     * Keep the thread on the CPUs of a NUMA node once it's started, so
+     * what it allocates comes from that node's memory.  Only that: the
+     * hash tables and the values stored by the front-end threads stay
+     * wherever those threads first touched them.
+     */
+    void setNumaNode(int node, const std::vector<int> &nodeCpus) {
+        numaNode = node;
+        cpus = nodeCpus;
+    }
+
+    //! Get the NUMA node the thread is pinned to, -1 if none
+    int getNumaNode() const { return numaNode; }
+
     void run();
 
     void stop();
@@ -105,18 +138,54 @@ public:
 
     void schedule(ExTask &task);
 
-    void reschedule(ExTask &task);
+    /**
+     * Make a task due now.
+     *
+     * @param clientWaiting true if a client is waiting on it from now on
+     */
+    void wake(ExTask &task, bool clientWaiting = false);
 
-    void wake(ExTask &task);
+    void snooze(ExTask &task, double secs);
 
     void notify() {
+        ++wakeups;
         mutex.notify();
     }
 
+    /**
+     * Park or unpark the thread.  A parked thread runs none of its tasks
+     * itself but leaves them to its peers, which must be stealing.
+     */
+    void setParked(bool p);
+
+    bool isParked() {
+        LockHolder lh(mutex);
+        return parked;
+    }
+
+    /**
+     * Set the threads of the thread's group (this one included) to steal
+     * tasks from; must be called before the thread is started.
+     */
+    void setPeers(const std::vector<ExecutorThread*> &threads);
+
     const std::string& getName() const {
         return name;
     }
 
+    task_type_t getType() const {
+        return type;
+    }
+
+    /**
+     * Get the number of tasks ready to run and waiting to be due.
+     */
+    void getQueueSizes(size_t &ready, size_t &future) {
+        LockHolder lh(mutex);
+        ready = readyQueue.size();
+        future = numFuture;
+    }
+
     const std::string getTaskName() const {
         if (currentTask) {
             return currentTask->getDescription();
@@ -133,33 +202,115 @@ public:
 
     const std::vector<TaskLogEntry> getSlowLog() { return slowjobs.contents(); }
 
+    size_t getStolen() const { return stolen; }
+
+    /**
+     * Get the CPU time (usec) this thread spent running tasks.
+     */
+    hrtime_t getCPUTime() const { return cpuTime.get(); }
+
+    /**
+     * Get the wall clock time (usec) this thread spent running tasks.
+     */
+    hrtime_t getBusyTime() const { return busyTime.get(); }
+
 private:
 
-    ExTask nextTask();
+    //! A task in the due queue, with the dueSeq it went in with
+    typedef std::pair<ExTask, size_t> FutureTask;
 
-    bool empty() {
-        return readyQueue.empty() && futureQueue.empty();
-    }
+    //! Get the current time in due queue ticks (ms)
+    static uint64_t currentTick();
 
     void moveReadyTasks(const struct timeval &tv);
 
-    void popNext();
+    /**
+     * Put a task on the due queue, or on the ready queue if it's due
+     * already.  Any copy of it already on the due queue goes stale.  Must
+     * be called with the mutex held.
+     */
+    void pushFuture(ExTask &task, const struct timeval &now);
+
+    /**
+     * Put a task on the ready queue, ranked by how long clients have been
+     * waiting on it if they are.  Must be called with the mutex held.
+     */
+    void pushReady(ExTask &task) {
+        task->readyRank = task->clientWaitStart;
+        readyQueue.push(task);
+    }
+
+    /**
+     * Pop the most important ready task whose shard isn't busy and mark
+     * its shard busy.  Must be called with the mutex held.
+     */
+    ExTask popReady();
+
+    /**
+     * Wait for the next task to be due or for a notification.  Must be
+     * called with the mutex held.
+     */
+    void waitForTask(const struct timeval &now);
+
+    /**
+     * Hand a ready task over to an idle peer if this thread is busy.
+     */
+    ExTask giveTask(const struct timeval &now);
+
+    /**
+     * Take a ready task from a busy peer.
+     *
+     * @param home set to the peer the task was taken from
+     */
+    ExTask stealTask(const struct timeval &now, ExecutorThread *&home);
+
+    /**
+     * A task taken from this thread's queues has run; clear its shard and
+     * put it back on the due queue if it wants to run again.
+     */
+    void doneTask(ExTask &task, bool again);
+
+    /**
+     * Notify a waiting peer that this thread has ready tasks it's too busy
+     * to run.
+     */
+    void wakeIdlePeer();
+
+    bool notifyIfIdle();
 
     SyncObject mutex;
     pthread_t thread;
     const std::string name;
+    const task_type_t type;
     executor_state_t state;
     ExecutorPool *manager;
     EventuallyPersistentEngine *engine;
-    bool hasWokenTask;
     std::priority_queue<ExTask, std::deque<ExTask >,
                         CompareByPriority> readyQueue;
-    std::priority_queue<ExTask, std::deque<ExTask >,
-                        CompareByDueDate> futureQueue;
+    //! The tasks waiting to be due, stale copies included
+    TimingWheel<FutureTask> futureQueue;
+    //! The number of live tasks in futureQueue
+    size_t numFuture;
+    size_t nextDueSeq;
     RingBuffer<TaskLogEntry> tasklog;
     RingBuffer<TaskLogEntry> slowjobs;
     ExTask currentTask;
     hrtime_t taskStart;
+    bool stealing;
+    //! True if the thread leaves its tasks to its peers
+    bool parked;
+    std::vector<ExecutorThread*> peers;
+    size_t peerIdx;
+    //! Shards of the tasks taken from our queues that are running
+    std::set<int> busyShards;
+    //! Number of tasks this thread took from its peers
+    Atomic<size_t> stolen;
+    //! Bumped on every notification, so we don't wait for one we missed
+    size_t wakeups;
+    Atomic<hrtime_t> cpuTime;
+    Atomic<hrtime_t> busyTime;
+    int numaNode;
+    std::vector<int> cpus;
 };
 
 typedef std::pair<ExTask, ExecutorThread*> lookupId;
@@ -170,7 +321,14 @@ public:
 
     bool cancel(size_t taskId);
 
-    bool wake(size_t taskId);
+    /**
+     * Make a task due now.
+     *
+     * @param taskId the task
+     * @param clientWaiting true if a client is waiting on it from now on,
+     *                      putting it ahead of background work
+     */
+    bool wake(size_t taskId, bool clientWaiting = false);
 
     bool snooze(size_t taskId, double tosleep);
 
@@ -181,12 +339,64 @@ public:
     void doWorkerStat (EventuallyPersistentEngine *engine, const void *cookie,
                        ADD_STAT add_stat);
 
+    /**
+     * Let only the first n threads of a bucket's group run tasks, parking
+     * the others; their tasks are stolen by the active ones.
+     */
+    void setActiveThreads(EventuallyPersistentEngine *engine,
+                          task_type_t group, size_t n);
+
+    /**
+     * Get the wall clock time (usec) the threads of a bucket's group have
+     * spent running tasks.
+     */
+    hrtime_t getBusyTime(EventuallyPersistentEngine *engine,
+                         task_type_t group);
+
+    /**
+     * Wait for one of the process' background IO slots for a task of the
+     * bucket, shared between the buckets by their executor_io_weight.
+     *
+     * @return false if the slots aren't shared, so there's none to release
+     */
+    bool acquireIOSlot(EventuallyPersistentEngine *engine) {
+        return ioShare.acquire(engine);
+    }
+
+    /**
+     * Give back a background IO slot.
+     *
+     * @param usec the time the task holding it ran
+     */
+    void releaseIOSlot(EventuallyPersistentEngine *engine, hrtime_t usec) {
+        ioShare.release(engine, usec);
+    }
+
 protected:
 
     ExecutorPool(int r, int w) : workers(r+w) {}
 
     bool startWorkers(EventuallyPersistentEngine *engine);
-    size_t schedule(ExTask task, int tidx);
+    /**
+     * Schedule a task on the thread of the group serving the given shard.
+     */
+    size_t schedule(ExTask task, task_type_t type, int sid);
+
+    /**
+     * Number of threads of each group for a bucket.  A group without
+     * threads of its own uses those of another one.
+     */
+    static void getGroupSizes(EventuallyPersistentEngine *engine,
+                              size_t sizes[NUM_TASK_GROUPS]);
+
+    static task_type_t getGroupOf(const size_t sizes[NUM_TASK_GROUPS],
+                                  task_type_t type);
+
+    /**
+     * Get the CPUs of each NUMA node of the machine; there's no more than
+     * one node if it can't be told.
+     */
+    static std::vector<std::vector<int> > getNumaNodes();
 
     SyncObject mutex;
     //! Default number of worker ExecutorThreads
@@ -195,6 +405,8 @@ protected:
     std::map<size_t, lookupId> taskLocator;
     //! A registry of buckets using this pool and a list of their threads
     std::map<EventuallyPersistentEngine*, threadQ> bucketRegistry;
+    //! The buckets' shares of the background IO slots
+    IOShare ioShare;
 };
 
 #endif  // SRC_SCHEDULER_H_
@@ -84,12 +84,14 @@ int main(int, char **) {
     display("HistogramBin<size_t>", sizeof(HistogramBin<size_t>));
     display("HistogramBin<hrtime_t>", sizeof(HistogramBin<hrtime_t>));
     display("HistogramBin<int>", sizeof(HistogramBin<int>));
+    display("HdrHistogram<hrtime_t>", sizeof(HdrHistogram<hrtime_t>));
 
     std::cout << std::endl << "Histogram Ranges" << std::endl << std::endl;
 
     EPStats stats;
     HashTableDepthStatVisitor dv;
-    display("Default Histo", stats.diskInsertHisto);
+    Histogram<hrtime_t> defaultHisto;
+    display("Default Histo", defaultHisto);
     display("Commit Histo", stats.diskCommitHisto);
     display("Hash table depth histo", dv.depthHisto);
 
@@ -0,0 +1,407 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <new>
+#include <set>
+#include <sstream>
+
+#include "huge_pages.h"
+#include "locks.h"
+#include "slab_allocator.h"
+
+static ThreadLocal<SlabAllocator*> *currentSlabs;
+//! All the arenas of the process, for the memory tracker
+static Mutex *arenasLock;
+static std::set<SlabAllocator*> *arenas;
+
+/**
+ * Link hook for getting the thread's current arena set up before any
+ * thread can be switched to one.
+ */
+class SlabInstaller {
+public:
+    SlabInstaller() {
+        if (currentSlabs == NULL) {
+            currentSlabs = new ThreadLocal<SlabAllocator*>();
+            arenasLock = new Mutex();
+            arenas = new std::set<SlabAllocator*>();
+        }
+    }
+} slabInstaller;
+
+// Where a page's chunks start: after its header, pointer aligned.
+static const size_t PAGE_HEADER_SIZE = 64;
+
+void SlabAllocator::setCurrent(SlabAllocator *slabs) {
+    currentSlabs->set(slabs);
+}
+
+SlabAllocator *SlabAllocator::getCurrent() {
+    return currentSlabs->get();
+}
+
+SlabAllocator::SlabAllocator() : enabled(false), largeCacheSize(0),
+                                 regionCursor(NULL), regionEnd(NULL) {
+    assert(sizeof(SlabPage) <= PAGE_HEADER_SIZE);
+    size_t sz(SLAB_MIN_CHUNK_SIZE);
+    while (sz < SLAB_MAX_CHUNK_SIZE) {
+        classes.push_back(new SlabClass(sz, (SLAB_PAGE_SIZE - PAGE_HEADER_SIZE) / sz));
+        size_t next = static_cast<size_t>(sz * SLAB_GROWTH_FACTOR);
+        // Keep chunks pointer aligned.
+        next = (next + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+        sz = std::max(next, sz + sizeof(void*));
+    }
+    classes.push_back(new SlabClass(SLAB_MAX_CHUNK_SIZE,
+                                    (SLAB_PAGE_SIZE - PAGE_HEADER_SIZE) /
+                                    SLAB_MAX_CHUNK_SIZE));
+    assert(classes.size() < SLAB_LARGE_CLASS);
+
+    // Page aligned, so a value rounded up never spans an extra page.
+    const size_t page(4096);
+    sz = SLAB_LARGE_MIN_SIZE;
+    while (sz < SLAB_LARGE_MAX_SIZE) {
+        largeClasses.push_back(new LargeClass(sz));
+        size_t next = static_cast<size_t>(sz * SLAB_GROWTH_FACTOR);
+        sz = (next + page - 1) & ~(page - 1);
+    }
+    largeClasses.push_back(new LargeClass(SLAB_LARGE_MAX_SIZE));
+
+    LockHolder lh(*arenasLock);
+    arenas->insert(this);
+}
+
+SlabAllocator::~SlabAllocator() {
+    {
+        LockHolder lh(*arenasLock);
+        arenas->erase(this);
+    }
+
+    // Nothing's handed out, so every page is on its class's list.
+    std::vector<SlabClass*>::iterator it;
+    for (it = classes.begin(); it != classes.end(); ++it) {
+        SlabClass *sc = *it;
+        while (sc->partial != NULL) {
+            SlabPage *page = sc->partial;
+            unlinkPage(*sc, page);
+            if (!page->huge) {
+                free(page);
+            }
+        }
+        delete sc;
+    }
+
+    trimLarge(0);
+    std::vector<LargeClass*>::iterator lit;
+    for (lit = largeClasses.begin(); lit != largeClasses.end(); ++lit) {
+        delete *lit;
+    }
+
+    std::vector<char*>::iterator rit;
+    for (rit = regions.begin(); rit != regions.end(); ++rit) {
+        HugePages::release(*rit);
+    }
+}
+
+void SlabAllocator::destroy(SlabAllocator *slabs) {
+    if (slabs == NULL) {
+        return;
+    }
+    if (slabs->usedBytes.get() > 0 || slabs->largeUsedBytes.get() > 0) {
+        LOG(EXTENSION_LOG_WARNING, "Leaving the slab arena %p in place, as "
+            "%ld bytes of chunks and %ld bytes of large values are still "
+            "handed out", slabs, slabs->usedBytes.get(),
+            slabs->largeUsedBytes.get());
+        slabs->setEnabled(false);
+        slabs->setLargeCacheSize(0);
+        return;
+    }
+    delete slabs;
+}
+
+size_t SlabAllocator::getTotalFragmentation() {
+    LockHolder lh(*arenasLock);
+    size_t rv(0);
+    std::set<SlabAllocator*>::iterator it;
+    for (it = arenas->begin(); it != arenas->end(); ++it) {
+        rv += (*it)->getFragmentation();
+    }
+    return rv;
+}
+
+void SlabAllocator::setLargeCacheSize(size_t to) {
+    largeCacheSize = to;
+    trimLarge(to);
+}
+
+uint8_t SlabAllocator::getSlabClass(size_t len) const {
+    assert(len <= SLAB_MAX_CHUNK_SIZE);
+    size_t lo(0), hi(classes.size() - 1);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (classes[mid]->chunkSize < len) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return static_cast<uint8_t>(lo + 1);
+}
+
+size_t SlabAllocator::getLargeClassSize(size_t len) const {
+    return getLargeClass(len + LARGE_HEADER_SIZE).size;
+}
+
+SlabAllocator::LargeClass &SlabAllocator::getLargeClass(size_t len) const {
+    assert(len >= SLAB_LARGE_MIN_SIZE && len <= SLAB_LARGE_MAX_SIZE);
+    size_t lo(0), hi(largeClasses.size() - 1);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (largeClasses[mid]->size < len) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return *largeClasses[lo];
+}
+
+SlabAllocator::SlabPage *SlabAllocator::allocatePage() {
+    char *rv = NULL;
+    if (HugePages::getMode() != HugePages::OFF) {
+        LockHolder lh(regionMutex);
+        if (!sparePages.empty()) {
+            SlabPage *page = sparePages.back();
+            sparePages.pop_back();
+            return page;
+        }
+        if (regionCursor == regionEnd) {
+            regionCursor = static_cast<char*>(HugePages::allocate(HUGE_PAGE_SIZE));
+            if (regionCursor != NULL) {
+                regions.push_back(regionCursor);
+                regionEnd = regionCursor + HUGE_PAGE_SIZE;
+            } else {
+                regionEnd = NULL;
+            }
+        }
+        if (regionCursor != NULL) {
+            rv = regionCursor;
+            regionCursor += SLAB_PAGE_SIZE;
+            totalBytes.incr(SLAB_PAGE_SIZE);
+            SlabPage *page = reinterpret_cast<SlabPage*>(rv);
+            page->huge = true;
+            return page;
+        }
+    }
+
+    void *mem;
+    if (posix_memalign(&mem, SLAB_PAGE_SIZE, SLAB_PAGE_SIZE) != 0) {
+        throw std::bad_alloc();
+    }
+    totalBytes.incr(SLAB_PAGE_SIZE);
+    SlabPage *page = static_cast<SlabPage*>(mem);
+    page->huge = false;
+    return page;
+}
+
+void SlabAllocator::releasePage(SlabPage *page) {
+    if (page->huge) {
+        LockHolder lh(regionMutex);
+        sparePages.push_back(page);
+    } else {
+        totalBytes.decr(SLAB_PAGE_SIZE);
+        free(page);
+    }
+}
+
+void SlabAllocator::linkPage(SlabClass &sc, SlabPage *page) {
+    page->prev = NULL;
+    page->next = sc.partial;
+    if (sc.partial != NULL) {
+        sc.partial->prev = page;
+    }
+    sc.partial = page;
+}
+
+void SlabAllocator::unlinkPage(SlabClass &sc, SlabPage *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        sc.partial = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+    page->prev = page->next = NULL;
+}
+
+void SlabAllocator::growClass(SlabClass &sc, uint8_t slabClass) {
+    SlabPage *page = allocatePage();
+    page->owner = this;
+    page->usedChunks = 0;
+    page->slabClass = slabClass;
+    page->freeList = NULL;
+    char *chunks = reinterpret_cast<char*>(page) + PAGE_HEADER_SIZE;
+    // Thread the new chunks onto the free list back to front so
+    // they're handed out in address order.
+    for (size_t i = sc.chunksPerPage; i > 0; --i) {
+        void **chunk = reinterpret_cast<void**>(chunks + (i - 1) * sc.chunkSize);
+        *chunk = page->freeList;
+        page->freeList = chunk;
+    }
+    linkPage(sc, page);
+    sc.totalChunks.incr(sc.chunksPerPage);
+}
+
+void *SlabAllocator::allocateChunk(size_t len, uint8_t &slabClass) {
+    slabClass = getSlabClass(len);
+    SlabClass &sc = *classes[slabClass - 1];
+
+    void *rv;
+    {
+        LockHolder lh(sc.mutex);
+        if (sc.partial == NULL) {
+            growClass(sc, slabClass);
+        }
+        SlabPage *page = sc.partial;
+        rv = page->freeList;
+        page->freeList = *static_cast<void**>(rv);
+        if (++page->usedChunks == sc.chunksPerPage) {
+            unlinkPage(sc, page);
+        }
+    }
+
+    ++sc.usedChunks;
+    usedBytes.incr(sc.chunkSize);
+    requestedBytes.incr(len);
+    return rv;
+}
+
+void SlabAllocator::releaseChunk(void *p, SlabPage *page, size_t len) {
+    assert(page->owner == this);
+    assert(page->slabClass > 0 && page->slabClass <= classes.size());
+    SlabClass &sc = *classes[page->slabClass - 1];
+    assert(len <= sc.chunkSize);
+
+    bool emptied(false);
+    {
+        LockHolder lh(sc.mutex);
+        if (page->usedChunks == sc.chunksPerPage) {
+            linkPage(sc, page);
+        }
+        *static_cast<void**>(p) = page->freeList;
+        page->freeList = p;
+        // Keep the last page with room, so a class that keeps freeing
+        // and allocating one chunk doesn't go to the heap each time.
+        if (--page->usedChunks == 0 &&
+            (sc.partial != page || page->next != NULL)) {
+            unlinkPage(sc, page);
+            emptied = true;
+        }
+    }
+
+    --sc.usedChunks;
+    usedBytes.decr(sc.chunkSize);
+    requestedBytes.decr(len);
+    if (emptied) {
+        sc.totalChunks.decr(sc.chunksPerPage);
+        releasePage(page);
+    }
+}
+
+void *SlabAllocator::allocateLarge(size_t len, uint8_t &slabClass) {
+    LargeClass &lc = getLargeClass(len + LARGE_HEADER_SIZE);
+    slabClass = SLAB_LARGE_CLASS;
+
+    void *rv = NULL;
+    {
+        LockHolder lh(lc.mutex);
+        if (!lc.cached.empty()) {
+            rv = lc.cached.back();
+            lc.cached.pop_back();
+        }
+    }
+    if (rv != NULL) {
+        largeCachedBytes.decr(lc.size);
+        ++largeHits;
+    } else {
+        ++largeMisses;
+        rv = ::operator new(lc.size);
+    }
+    largeUsedBytes.incr(lc.size);
+    *static_cast<SlabAllocator**>(rv) = this;
+    return static_cast<char*>(rv) + LARGE_HEADER_SIZE;
+}
+
+void SlabAllocator::releaseLarge(void *start, size_t len) {
+    LargeClass &lc = getLargeClass(len + LARGE_HEADER_SIZE);
+    largeUsedBytes.decr(lc.size);
+    // Racy against other releases, which may take the cache a value
+    // over its size; the next trim takes care of that.
+    if (largeCachedBytes.get() + lc.size <= largeCacheSize) {
+        {
+            LockHolder lh(lc.mutex);
+            lc.cached.push_back(start);
+        }
+        largeCachedBytes.incr(lc.size);
+    } else {
+        ::operator delete(start);
+    }
+}
+
+void SlabAllocator::trimLarge(size_t limit) {
+    // Drop the biggest values first; they're the least likely to be
+    // asked for again.
+    std::vector<LargeClass*>::reverse_iterator it;
+    for (it = largeClasses.rbegin();
+         it != largeClasses.rend() && largeCachedBytes.get() > limit; ++it) {
+        LargeClass &lc = **it;
+        LockHolder lh(lc.mutex);
+        while (!lc.cached.empty() && largeCachedBytes.get() > limit) {
+            ::operator delete(lc.cached.back());
+            lc.cached.pop_back();
+            largeCachedBytes.decr(lc.size);
+        }
+    }
+}
+
+void SlabAllocator::getStats(std::map<std::string, size_t> &slab_stats) const {
+    slab_stats["total_bytes"] = totalBytes.get();
+    slab_stats["used_bytes"] = usedBytes.get();
+    slab_stats["requested_bytes"] = requestedBytes.get();
+    slab_stats["free_bytes"] = totalBytes.get() - usedBytes.get();
+    slab_stats["fragmentation_bytes"] = getFragmentation();
+    slab_stats["large_cached_bytes"] = largeCachedBytes.get();
+    slab_stats["large_used_bytes"] = largeUsedBytes.get();
+    slab_stats["large_hits"] = largeHits.get();
+    slab_stats["large_misses"] = largeMisses.get();
+
+    std::vector<SlabClass*>::const_iterator it;
+    for (it = classes.begin(); it != classes.end(); ++it) {
+        const SlabClass &sc = **it;
+        if (sc.totalChunks.get() == 0) {
+            continue;
+        }
+        std::stringstream ss;
+        ss << "class_" << sc.chunkSize << "_";
+        slab_stats[ss.str() + "total_chunks"] = sc.totalChunks.get();
+        slab_stats[ss.str() + "used_chunks"] = sc.usedChunks.get();
+    }
+}
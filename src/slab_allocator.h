@@ -0,0 +1,371 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_SLAB_ALLOCATOR_H_
+#define SRC_SLAB_ALLOCATOR_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "mutex.h"
+
+// Allocations are handed out in slabs of this many bytes.
+const size_t SLAB_PAGE_SIZE = 64 * 1024;
+// Smallest chunk handed out by the slab allocator.
+const size_t SLAB_MIN_CHUNK_SIZE = 16;
+// Anything bigger than this goes straight to the heap.
+const size_t SLAB_MAX_CHUNK_SIZE = 1024;
+// Chunk sizes grow by this factor from one size class to the next.
+const double SLAB_GROWTH_FACTOR = 1.25;
+// Heap allocations from this size up are large values, which may be
+// kept for reuse once freed.
+const size_t SLAB_LARGE_MIN_SIZE = 64 * 1024;
+// Largest large value size class; anything bigger isn't kept.
+const size_t SLAB_LARGE_MAX_SIZE = 64 * 1024 * 1024;
+// Class reported for memory from the large value classes.
+const uint8_t SLAB_LARGE_CLASS = 255;
+
+/**
+ * Size-class arena for the small, variable sized objects the hash
+ * tables are made of (StoredValue and Blob).
+ *
+ * Each engine has its own arena, so a bucket's memory is never handed
+ * to another bucket and goes away with it.  Allocations come from the
+ * arena of the engine the thread is working for (see setCurrent()), and
+ * go back to the arena that handed them out, whichever thread frees
+ * them.
+ *
+ * Each size class carves SLAB_PAGE_SIZE pages into equal chunks.  The
+ * pages are aligned on their size and start with a header naming their
+ * arena and class and holding their own free list, so a chunk finds its
+ * way home from its address alone.  A class keeps the pages that have
+ * free chunks on a list under its own lock, so allocations of different
+ * sizes don't contend.  A page whose last chunk is freed is handed back
+ * to the heap, unless it's the only one of its class with room left.
+ * The memory tracker sees the pages as ordinary allocations, and the
+ * free chunks in them are reported as fragmentation.
+ *
+ * Objects remember the class they were allocated from (0 means the
+ * heap) so they can be released without the arena having to look the
+ * address up.
+ *
+ * With huge pages enabled (see HugePages), the pages are carved out of
+ * huge page regions shared by all the classes, so the metadata and
+ * small values of the items are on as few TLB entries as they can be.
+ * Those pages are kept for the arena's other classes once empty, as a
+ * part of a region can't be given back; the regions go with the arena.
+ *
+ * Large values don't fit the arena.  Once a cache size is set they're
+ * rounded up to a size class of their own too, and freed ones are kept
+ * up to that many bytes for the next value of the class.  A worker
+ * that stores a multi-MB value then reuses memory that's already
+ * mapped in, instead of the heap mapping and faulting in fresh pages,
+ * and unmapping them again when it frees the old value, while the
+ * small ops behind it wait.  Each large value starts with a header
+ * naming its arena, counted in the class it's rounded up to.
+ */
+class SlabAllocator {
+public:
+
+    SlabAllocator();
+
+    /**
+     * Destroy an arena.  If any of its memory is still handed out, the
+     * arena is left in place (and the fact logged) so that memory can
+     * still be released into it.
+     */
+    static void destroy(SlabAllocator *slabs);
+
+    /**
+     * Have the calling thread allocate from the given arena, or from
+     * the heap if NULL.  Switching the thread to an engine switches it
+     * to the engine's arena.
+     */
+    static void setCurrent(SlabAllocator *slabs);
+
+    /**
+     * Get the arena the calling thread allocates from (NULL for the
+     * heap).
+     */
+    static SlabAllocator *getCurrent();
+
+    /**
+     * Route new allocations through the arena (or not).  Objects keep
+     * track of where they came from, so this may be changed at any
+     * time.
+     */
+    void setEnabled(bool to) {
+        enabled = to;
+    }
+
+    bool isEnabled() const {
+        return enabled;
+    }
+
+    /**
+     * Set the number of bytes of freed large values kept for reuse, 0
+     * to hand them straight back to the heap.  Values allocated before
+     * are still released the way they were allocated.
+     */
+    void setLargeCacheSize(size_t to);
+
+    size_t getLargeCacheSize() const {
+        return largeCacheSize;
+    }
+
+    /**
+     * Allocate len bytes from the calling thread's arena.
+     *
+     * @param len the number of bytes needed
+     * @param slabClass set to the class the memory came from, or 0 if
+     *                  it came from the heap
+     * @return the memory
+     */
+    static void *allocate(size_t len, uint8_t &slabClass) {
+        SlabAllocator *slabs = getCurrent();
+        if (slabs != NULL) {
+            if (slabs->enabled && len <= SLAB_MAX_CHUNK_SIZE) {
+                return slabs->allocateChunk(len, slabClass);
+            }
+            if (slabs->largeCacheSize > 0 && len >= SLAB_LARGE_MIN_SIZE &&
+                len + LARGE_HEADER_SIZE <= SLAB_LARGE_MAX_SIZE) {
+                return slabs->allocateLarge(len, slabClass);
+            }
+        }
+        slabClass = 0;
+        return ::operator new(len);
+    }
+
+    /**
+     * Release memory obtained through allocate(), to the arena it came
+     * from.
+     *
+     * @param p the memory
+     * @param slabClass the class allocate() reported
+     * @param len the number of bytes originally requested
+     */
+    static void release(void *p, uint8_t slabClass, size_t len) {
+        if (slabClass == 0) {
+            ::operator delete(p);
+        } else if (slabClass == SLAB_LARGE_CLASS) {
+            char *start = static_cast<char*>(p) - LARGE_HEADER_SIZE;
+            (*reinterpret_cast<SlabAllocator**>(start))->releaseLarge(start,
+                                                                      len);
+        } else {
+            SlabPage *page = SlabPage::of(p);
+            page->owner->releaseChunk(p, page, len);
+        }
+    }
+
+    /**
+     * Fragmentation of all the arenas of the process.
+     */
+    static size_t getTotalFragmentation();
+
+    /**
+     * Number of bytes held in slab pages.
+     */
+    size_t getTotalBytes() const {
+        return totalBytes.get();
+    }
+
+    /**
+     * Number of bytes in chunks currently handed out.
+     */
+    size_t getUsedBytes() const {
+        return usedBytes.get();
+    }
+
+    /**
+     * Number of bytes callers asked for in chunks currently handed
+     * out.
+     */
+    size_t getRequestedBytes() const {
+        return requestedBytes.get();
+    }
+
+    /**
+     * Bytes held in pages that aren't holding caller data: free chunks,
+     * page headers and the rounding slack in used chunks.
+     */
+    size_t getFragmentation() const {
+        size_t total = totalBytes.get();
+        size_t requested = requestedBytes.get();
+        return total > requested ? total - requested : 0;
+    }
+
+    /**
+     * Chunk size of the given class.
+     */
+    size_t getChunkSize(uint8_t slabClass) const {
+        assert(slabClass > 0 && slabClass <= classes.size());
+        return classes[slabClass - 1]->chunkSize;
+    }
+
+    /**
+     * Class a request of the given size would be served from.
+     */
+    uint8_t getSlabClass(size_t len) const;
+
+    /**
+     * Size of the large value class a request of the given size would
+     * be served from, including the header in front of the value.
+     */
+    size_t getLargeClassSize(size_t len) const;
+
+    /**
+     * Number of bytes of freed large values kept for reuse.
+     */
+    size_t getLargeCachedBytes() const {
+        return largeCachedBytes.get();
+    }
+
+    /**
+     * Number of bytes of large values currently handed out.
+     */
+    size_t getLargeUsedBytes() const {
+        return largeUsedBytes.get();
+    }
+
+    /**
+     * Add this arena's stats to the given map.
+     */
+    void getStats(std::map<std::string, size_t> &slab_stats) const;
+
+private:
+
+    /**
+     * Header at the start of each page.  The chunks follow it.
+     */
+    struct SlabPage {
+        static SlabPage *of(void *chunk) {
+            uintptr_t addr = reinterpret_cast<uintptr_t>(chunk);
+            return reinterpret_cast<SlabPage*>(addr & ~(SLAB_PAGE_SIZE - 1));
+        }
+
+        SlabAllocator *owner;
+        //! Neighbours on the class's list of pages with free chunks
+        SlabPage      *prev;
+        SlabPage      *next;
+        void          *freeList;
+        uint32_t       usedChunks;
+        uint8_t        slabClass;
+        //! Carved out of a huge page region, so it can't be freed alone
+        bool           huge;
+    };
+
+    struct SlabClass {
+        SlabClass(size_t sz, size_t per) :
+            chunkSize(sz), chunksPerPage(per), partial(NULL),
+            totalChunks(0), usedChunks(0) { }
+
+        Mutex              mutex;
+        const size_t       chunkSize;
+        const size_t       chunksPerPage;
+        //! The pages with free chunks
+        SlabPage          *partial;
+        Atomic<size_t>     totalChunks;
+        Atomic<size_t>     usedChunks;
+    };
+
+    struct LargeClass {
+        LargeClass(size_t sz) : size(sz) { }
+
+        Mutex              mutex;
+        const size_t       size;
+        //! Freed values of this class kept for reuse
+        std::vector<void*> cached;
+    };
+
+    //! Keeps large values aligned the way the heap would
+    static const size_t LARGE_HEADER_SIZE = 16;
+
+    ~SlabAllocator();
+
+    void *allocateChunk(size_t len, uint8_t &slabClass);
+    void releaseChunk(void *p, SlabPage *page, size_t len);
+    void growClass(SlabClass &sc, uint8_t slabClass);
+    void linkPage(SlabClass &sc, SlabPage *page);
+    void unlinkPage(SlabClass &sc, SlabPage *page);
+    SlabPage *allocatePage();
+    void releasePage(SlabPage *page);
+    LargeClass &getLargeClass(size_t len) const;
+    void *allocateLarge(size_t len, uint8_t &slabClass);
+    void releaseLarge(void *start, size_t len);
+    void trimLarge(size_t limit);
+
+    volatile bool enabled;
+    volatile size_t largeCacheSize;
+
+    std::vector<SlabClass*> classes;
+    std::vector<LargeClass*> largeClasses;
+    //! Guards the huge page regions and the pages spared from them
+    Mutex                   regionMutex;
+    std::vector<char*>      regions;
+    //! The unused rest of the last huge page region
+    char                   *regionCursor;
+    char                   *regionEnd;
+    //! Emptied pages of the huge page regions
+    std::vector<SlabPage*>  sparePages;
+    Atomic<size_t>          totalBytes;
+    Atomic<size_t>          usedBytes;
+    Atomic<size_t>          requestedBytes;
+    Atomic<size_t>          largeCachedBytes;
+    Atomic<size_t>          largeUsedBytes;
+    Atomic<size_t>          largeHits;
+    Atomic<size_t>          largeMisses;
+
+    DISALLOW_COPY_AND_ASSIGN(SlabAllocator);
+};
+
+/**
+ * Base for the fixed size objects each op makes and drops again, like
+ * Item, so they come from the arena too when it's enabled.
+ *
+ * They're made with plain new all over, so there's no factory to hand
+ * them their class the way StoredValue gets it; each allocation keeps
+ * its class in a header in front of the object instead.
+ */
+class SlabObject {
+public:
+    static void *operator new(size_t len) {
+        uint8_t slabClass;
+        char *p = static_cast<char*>(SlabAllocator::allocate(len + HEADER_SIZE,
+                                                             slabClass));
+        *reinterpret_cast<uint8_t*>(p) = slabClass;
+        return p + HEADER_SIZE;
+    }
+
+    static void operator delete(void *p, size_t len) {
+        if (p != NULL) {
+            char *start = static_cast<char*>(p) - HEADER_SIZE;
+            SlabAllocator::release(start, *reinterpret_cast<uint8_t*>(start),
+                                   len + HEADER_SIZE);
+        }
+    }
+
+private:
+    //! Keeps the objects pointer aligned, as the chunks are
+    static const size_t HEADER_SIZE = sizeof(void*);
+};
+
+#endif  // SRC_SLAB_ALLOCATOR_H_
@@ -29,6 +29,7 @@
 #include "histo.h"
 #include "memory_tracker.h"
 #include "mutex.h"
+#include "tasks.h"
 
 #ifndef DEFAULT_MAX_DATA_SIZE
 /* Something something something ought to be enough for anybody */
@@ -43,9 +44,10 @@ static const hrtime_t ONE_SECOND(1000000);
 class EPStats {
 public:
 
-    EPStats() : warmupComplete(false),
+    EPStats() : warmupComplete(false), warmupTraffic(false),
                 maxRemainingBgJobs(0),
                 dirtyAgeHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
+                persistLatencyHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
                 diskCommitHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
                 mlogCompactorHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
                 timingLog(NULL), maxDataSize(DEFAULT_MAX_DATA_SIZE) {}
@@ -87,6 +89,8 @@ public:
 
     //! Whether we're warming up.
     Atomic<bool> warmupComplete;
+    //! Whether traffic is let in while the values are still loading.
+    Atomic<bool> warmupTraffic;
     //! Number of keys warmed up during key-only loading. 
     Atomic<size_t> warmedUpKeys;
     //! Number of key-values warmed up during data loading.
@@ -124,7 +128,7 @@ public:
     //! Number of items persisted.
     Atomic<size_t> totalPersisted;
     //! Cumulative number of items added to the queue.
-    Atomic<size_t> totalEnqueued;
+    ShardedCounter<size_t> totalEnqueued;
     //! Number of new items created in the DB.
     Atomic<size_t> newItems;
     //! Number of items removed from the DB.
@@ -133,8 +137,12 @@ public:
     Atomic<size_t> flushFailed;
     //! Number of times an item is not flushed due to the item's expiry
     Atomic<size_t> flushExpired;
+    //! Number of ejected items flushed for new metadata, read back from disk
+    Atomic<size_t> flushMetaOnly;
+    //! Number of queued mutations a later one of the same flush superseded
+    Atomic<size_t> flushCoalesced;
     //! Number of times an object was expired on access.
-    Atomic<size_t> expired_access;
+    ShardedCounter<size_t> expired_access;
     //! Number of times an object was expired by pager.
     Atomic<size_t> expired_pager;
     //! Number of times we failed to start a transaction
@@ -151,6 +159,20 @@ public:
     Atomic<size_t> vbucketDeletions;
     //! Number of times we failed to delete a vbucket.
     Atomic<size_t> vbucketDeletionFail;
+    //! Number of deleted vbuckets whose items are still being freed.
+    Atomic<size_t> vbucketMemDeletionsPending;
+    //! Number of hash tables emptied by a flush still being freed.
+    Atomic<size_t> flushAllMemPending;
+    //! Number of vbucket files compacted.
+    Atomic<size_t> compactionRuns;
+    //! Number of compactions given up on an error.
+    Atomic<size_t> compactionFailed;
+    //! Number of deletions dropped by compactions.
+    Atomic<size_t> compactionPurged;
+    //! Bytes of docs copied by compactions.
+    Atomic<size_t> compactionBytesCopied;
+    //! Bytes the files compacted shrank by.
+    Atomic<size_t> compactionBytesReclaimed;
 
     //! Beyond this point are config items
     //! Pager low water mark.
@@ -164,20 +186,76 @@ public:
     Atomic<size_t> expiryPagerRuns;
     //! Number of items removed from closed unreferenced checkpoints.
     Atomic<size_t> itemsRemovedFromCheckpoints;
+    //! Number of TAP cursors dropped to backfill for lagging too far behind
+    Atomic<size_t> numCursorsDropped;
     //! Number of times a value is ejected
-    Atomic<size_t> numValueEjects;
+    ShardedCounter<size_t> numValueEjects;
     //! Number of times a value could not be ejected
     Atomic<size_t> numFailedEjects;
+    //! Number of ejected values fetched back before the next pager sweep
+    Atomic<size_t> numGhostHits;
+    //! Number of items removed from memory altogether (full eviction)
+    Atomic<size_t> numFullEvictions;
+    //! Number of steps the item pager took to shrink to a smaller quota
+    Atomic<size_t> quotaShrinkSteps;
+    //! Number of values ejected or items removed by those steps
+    Atomic<size_t> numQuotaShrinkEjects;
+    //! Number of ejected values fetched back after the quota grew
+    Atomic<size_t> numQuotaWarmFetches;
+    //! Number of pager runs for the vbuckets over their memory quota
+    Atomic<size_t> vbQuotaPagerRuns;
+    //! Number of values ejected or items removed by those runs
+    Atomic<size_t> numVBQuotaEjects;
+    //! Number of misses a bloom filter answered without a disk lookup
+    ShardedCounter<size_t> numBloomFilterSkips;
+    //! Number of misses a bloom filter sent to disk for nothing
+    Atomic<size_t> numBloomFilterFalsePositives;
+    //! Number of vbucket bloom filters rebuilt
+    Atomic<size_t> numBloomFilterRebuilds;
+    //! Number of temp items removed to keep the hash tables' quota
+    Atomic<size_t> tempItemsReclaimed;
+    //! Number of values stored compressed
+    Atomic<size_t> numValuesCompressed;
+    //! Number of compressed values uncompressed for clients
+    Atomic<size_t> numValuesDecompressed;
+    //! Number of replica values ejected once persisted
+    Atomic<size_t> replicaValuesEjected;
+    //! Number of replica values compressed once persisted
+    Atomic<size_t> replicaValuesCompressed;
+    //! Bytes of replica values freed by ejecting or compressing them
+    Atomic<size_t> replicaBytesReclaimed;
+    //! Number of ops handed to the owner of their vbucket
+    Atomic<size_t> vbOwnerOps;
+    //! Number of ops an owner left to block, to be handed over again
+    Atomic<size_t> vbOwnerBlockedOps;
     //! Number of times "Not my bucket" happened
-    Atomic<size_t> numNotMyVBuckets;
+    ShardedCounter<size_t> numNotMyVBuckets;
+    //! Number of replica reads failed for being staler than asked
+    Atomic<size_t> numStaleReplicaReads;
+    //! Number of lww conflicts lost for a cas too far ahead of our clock
+    Atomic<size_t> numCasDriftRejections;
     //! Total size of stored objects.
     Atomic<size_t> currentSize;
     //! Total memory overhead to store values for resident keys.
     Atomic<size_t> totalValueSize;
     //! Amount of memory used to track items and what-not.
     Atomic<size_t> memOverhead;
+    //! Set when a hash table at its idle size outgrew it (see ht_idle_size)
+    Atomic<bool> htGrowPending;
+    //! Memory held by checkpoints, including their queued items.
+    Atomic<size_t> checkpointMemory;
     //! The total amount of memory used by this bucket (From memory tracking)
     Atomic<size_t> totalMemory;
+    //! The allocator's heap, as the defragmenter last sampled it
+    Atomic<size_t> allocatorHeapSize;
+    //! The bytes the allocator had handed out when last sampled
+    Atomic<size_t> allocatorAllocatedSize;
+    //! The allocator's free space it can't hand out, when last sampled
+    Atomic<size_t> allocatorFragmentation;
+    //! Number of items the defragmenter moved to new allocations
+    Atomic<size_t> defragNumMoved;
+    //! Number of values the defragmenter moved to new allocations
+    Atomic<size_t> defragNumValuesMoved;
     //! True if the memory usage tracker is enabled.
     Atomic<bool> memoryTrackerEnabled;
     //! Whether or not to force engine shutdown.
@@ -189,13 +267,13 @@ public:
     Atomic<size_t> tmp_oom_errors;
 
     //! Number of read related io operations
-    Atomic<size_t> io_num_read;
+    ShardedCounter<size_t> io_num_read;
     //! Number of write related io operations
-    Atomic<size_t> io_num_write;
+    ShardedCounter<size_t> io_num_write;
     //! Number of bytes read
-    Atomic<size_t> io_read_bytes;
+    ShardedCounter<size_t> io_read_bytes;
     //! Number of bytes written
-    Atomic<size_t> io_write_bytes;
+    ShardedCounter<size_t> io_write_bytes;
 
     //! Number of ops blocked on all vbuckets in pending state
     Atomic<size_t> pendingOps;
@@ -207,12 +285,22 @@ public:
     Atomic<hrtime_t> pendingOpsMaxDuration;
 
     //! Histogram of pending operation wait times.
-    Histogram<hrtime_t> pendingOpsHisto;
+    HdrHistogram<hrtime_t> pendingOpsHisto;
+    //! Histogram of how long each op waited on a pending vbucket
+    HdrHistogram<hrtime_t> pendingOpWaitHisto;
+    //! Number of ops turned away for their pending vbucket having too many
+    Atomic<size_t> pendingOpsRejected;
+    //! Most ops allowed to wait on any one pending vbucket (0 for no limit)
+    Atomic<size_t> pendingOpsLimit;
+    //! Most ops of a vbucket woken at a time (0 to wake them all at once)
+    Atomic<size_t> pendingOpsWakeBatch;
 
     //! Number of times background fetches occurred.
-    Atomic<size_t> bg_fetched;
+    ShardedCounter<size_t> bg_fetched;
     //! Number of times meta background fetches occurred.
-    Atomic<size_t> bg_meta_fetched;
+    ShardedCounter<size_t> bg_meta_fetched;
+    //! Number of docs read ahead of background fetches into memory.
+    Atomic<size_t> bg_readahead_fetched;
     //! Number of remaining bg fetch jobs.
     Atomic<size_t> numRemainingBgJobs;
     //! The number of samples the bgWaitDelta and bgLoadDelta contains of
@@ -230,7 +318,7 @@ public:
     Atomic<hrtime_t> bgMaxWait;
 
     //! Histogram of background wait times.
-    Histogram<hrtime_t> bgWaitHisto;
+    HdrHistogram<hrtime_t> bgWaitHisto;
 
     /** The sum of the deltas (in usec) from the dispatcher started to load
      *  item until was done
@@ -242,7 +330,7 @@ public:
     Atomic<hrtime_t> bgMaxLoad;
 
     //! Histogram of background wait loads.
-    Histogram<hrtime_t> bgLoadHisto;
+    HdrHistogram<hrtime_t> bgLoadHisto;
 
     //! Max wall time of deleting a vbucket
     Atomic<hrtime_t> vbucketDelMaxWalltime;
@@ -266,6 +354,22 @@ public:
     Atomic<size_t> tapThrottled;
     //! Percentage of memory in use before we throttle tap input
     Atomic<double> tapThrottleThreshold;
+    //! Number of incoming tap mutations waiting in the TapApplier queues
+    Atomic<size_t> tapApplyQueueSize;
+    //! Number of times the TapApplier had to back off and retry a mutation
+    Atomic<size_t> tapApplyRetries;
+    //! Number of runs of tap mutations the TapApplier applied together
+    Atomic<size_t> tapApplyBatches;
+    //! Number of tap mutations in those runs
+    Atomic<size_t> tapApplyBatchedOps;
+    //! The sum of the times (in usec) tap consumers took to ack
+    Atomic<hrtime_t> tapAckWait;
+    //! The number of acks tapAckWait is the sum of
+    Atomic<size_t> tapAckNumSamples;
+    //! Number of times the BackfillController narrowed the tap backfills
+    Atomic<size_t> tapBackfillBackoffs;
+    //! Number of checkpoint items handed to a tap producer by a TapFanout walk
+    Atomic<size_t> tapFanoutItems;
 
     /** The sum of the deltas (in usec) from a tap item was put in queue until
      *  the dispatcher started the work for this item
@@ -277,7 +381,7 @@ public:
     Atomic<hrtime_t> tapBgMaxWait;
 
     //! Histogram of tap background wait loads.
-    Histogram<hrtime_t> tapBgWaitHisto;
+    HdrHistogram<hrtime_t> tapBgWaitHisto;
 
     /** The sum of the deltas (in usec) from the dispatcher started to load
      *  a tap item until was done
@@ -289,14 +393,14 @@ public:
     Atomic<hrtime_t> tapBgMaxLoad;
 
     //! Histogram of tap background wait loads.
-    Histogram<hrtime_t> tapBgLoadHisto;
+    HdrHistogram<hrtime_t> tapBgLoadHisto;
 
     //! The number of get with meta operations
-    Atomic<size_t>  numOpsGetMeta;
+    ShardedCounter<size_t> numOpsGetMeta;
     //! The number of set with meta operations
-    Atomic<size_t>  numOpsSetMeta;
+    ShardedCounter<size_t> numOpsSetMeta;
     //! The number of delete with meta operations
-    Atomic<size_t>  numOpsDelMeta;
+    ShardedCounter<size_t> numOpsDelMeta;
     //! The number of failed set meta ops due to conflict resoltion
     Atomic<size_t> numOpsSetMetaResolutionFailed;
     //! The number of failed del meta ops due to conflict resoltion
@@ -305,6 +409,14 @@ public:
     Atomic<size_t>  numOpsSetRetMeta;
     //! The number of delete returning meta operations
     Atomic<size_t>  numOpsDelRetMeta;
+    //! The number of getl requests parked on a locked key
+    Atomic<size_t> numGetlWaits;
+    //! The number of sub-document mutations applied
+    Atomic<size_t> numOpsSubdoc;
+    //! The number of pages of key range scans returned
+    Atomic<size_t> numRangeScans;
+    //! The number of keys key range scans returned
+    Atomic<size_t> numRangeScanItems;
 
     //! The number of tiems the mutation log compactor is exectued
     Atomic<size_t> mlogCompactorRuns;
@@ -320,6 +432,9 @@ public:
     //! Histogram of queue processing dirty age.
     Histogram<hrtime_t> dirtyAgeHisto;
 
+    //! Histogram of the time items took from being queued to being on disk.
+    Histogram<hrtime_t> persistLatencyHisto;
+
     //! Histogram of item allocation sizes.
     Histogram<size_t> itemAllocSizeHisto;
 
@@ -328,68 +443,96 @@ public:
     //
 
     //! Histogram of getvbucket timings
-    Histogram<hrtime_t> getVbucketCmdHisto;
+    HdrHistogram<hrtime_t> getVbucketCmdHisto;
 
     //! Histogram of setvbucket timings
-    Histogram<hrtime_t> setVbucketCmdHisto;
+    HdrHistogram<hrtime_t> setVbucketCmdHisto;
 
     //! Histogram of delvbucket timings
-    Histogram<hrtime_t> delVbucketCmdHisto;
+    HdrHistogram<hrtime_t> delVbucketCmdHisto;
 
     //! Histogram of get commands.
-    Histogram<hrtime_t> getCmdHisto;
+    HdrHistogram<hrtime_t> getCmdHisto;
 
     //! Histogram of store commands.
-    Histogram<hrtime_t> storeCmdHisto;
+    HdrHistogram<hrtime_t> storeCmdHisto;
 
     //! Histogram of arithmetic commands.
-    Histogram<hrtime_t> arithCmdHisto;
+    HdrHistogram<hrtime_t> arithCmdHisto;
 
     //! Histogram of tap VBucket reset timings
-    Histogram<hrtime_t> tapVbucketResetHisto;
+    HdrHistogram<hrtime_t> tapVbucketResetHisto;
 
     //! Histogram of tap mutation timings.
-    Histogram<hrtime_t> tapMutationHisto;
+    HdrHistogram<hrtime_t> tapMutationHisto;
 
     //! Histogram of tap vbucket set timings.
-    Histogram<hrtime_t> tapVbucketSetHisto;
+    HdrHistogram<hrtime_t> tapVbucketSetHisto;
 
     //! Time spent notifying completion of IO.
-    Histogram<hrtime_t> notifyIOHisto;
+    HdrHistogram<hrtime_t> notifyIOHisto;
 
     //! Histogram of get_stats commands.
-    Histogram<hrtime_t> getStatsCmdHisto;
+    HdrHistogram<hrtime_t> getStatsCmdHisto;
 
     //! Histogram of wait_for_checkpoint_persistence command
-    Histogram<hrtime_t> chkPersistenceHisto;
+    HdrHistogram<hrtime_t> chkPersistenceHisto;
+
+    //! Histogram of waits for a key's mutation to be durable
+    HdrHistogram<hrtime_t> keyDurabilityHisto;
 
     //
     // DB timers.
     //
 
     //! Histogram of insert disk writes
-    Histogram<hrtime_t> diskInsertHisto;
+    HdrHistogram<hrtime_t> diskInsertHisto;
 
     //! Histogram of update disk writes
-    Histogram<hrtime_t> diskUpdateHisto;
+    HdrHistogram<hrtime_t> diskUpdateHisto;
 
     //! Histogram of delete disk writes
-    Histogram<hrtime_t> diskDelHisto;
+    HdrHistogram<hrtime_t> diskDelHisto;
 
     //! Histogram of execution time of disk vbucket deletions
-    Histogram<hrtime_t> diskVBDelHisto;
+    HdrHistogram<hrtime_t> diskVBDelHisto;
+
+    //! Histogram of the time taken to free the items of deleted vbuckets
+    HdrHistogram<hrtime_t> memVBDelHisto;
 
     //! Histogram of disk commits
     Histogram<hrtime_t> diskCommitHisto;
 
     //! Histogram of setting vbucket state
-    Histogram<hrtime_t> snapshotVbucketHisto;
+    HdrHistogram<hrtime_t> snapshotVbucketHisto;
 
     //! Histogram of mutation log compactor
     Histogram<hrtime_t> mlogCompactorHisto;
 
     //! Historgram of batch reads
-    Histogram<hrtime_t> getMultiHisto;
+    HdrHistogram<hrtime_t> getMultiHisto;
+
+    //! Histogram of the time bg fetches wait for their batch to be read
+    HdrHistogram<hrtime_t> bgBatchWaitHisto;
+
+    //
+    // Hash table lock timers (sampled).
+    //
+
+    //! Histogram of time spent waiting for a hash table lock
+    HdrHistogram<hrtime_t> htLockWaitHisto;
+
+    //! Histogram of time hash table locks were held
+    HdrHistogram<hrtime_t> htLockHoldHisto;
+
+    //! Histogram of hash chain lengths walked by lookups
+    Histogram<size_t> htChainLengthHisto;
+
+    //! Histograms of how long (usec) due tasks waited for a worker thread,
+    //! by the kind of the task
+    Histogram<hrtime_t> taskWaitHisto[NUM_TASK_KINDS];
+    //! Histograms of task run times (usec), by the kind of the task
+    Histogram<hrtime_t> taskRunHisto[NUM_TASK_KINDS];
 
     //! Reset all stats to reasonable values.
     void reset() {
@@ -400,9 +543,32 @@ public:
         commit_time.set(0);
         pagerRuns.set(0);
         itemsRemovedFromCheckpoints.set(0);
+        numCursorsDropped.set(0);
         numValueEjects.set(0);
         numFailedEjects.set(0);
+        numGhostHits.set(0);
+        numFullEvictions.set(0);
+        quotaShrinkSteps.set(0);
+        numQuotaShrinkEjects.set(0);
+        numQuotaWarmFetches.set(0);
+        vbQuotaPagerRuns.set(0);
+        numVBQuotaEjects.set(0);
+        numBloomFilterSkips.set(0);
+        numBloomFilterFalsePositives.set(0);
+        numBloomFilterRebuilds.set(0);
+        tempItemsReclaimed.set(0);
+        numValuesCompressed.set(0);
+        numValuesDecompressed.set(0);
+        replicaValuesEjected.set(0);
+        replicaValuesCompressed.set(0);
+        replicaBytesReclaimed.set(0);
+        vbOwnerOps.set(0);
+        vbOwnerBlockedOps.set(0);
+        defragNumMoved.set(0);
+        defragNumValuesMoved.set(0);
         numNotMyVBuckets.set(0);
+        numStaleReplicaReads.set(0);
+        numCasDriftRejections.set(0);
         io_num_read.set(0);
         io_num_write.set(0);
         io_read_bytes.set(0);
@@ -422,10 +588,20 @@ public:
         tapBgMinLoad.set(999999999);
         tapBgMaxLoad.set(0);
         tapThrottled.set(0);
+        tapApplyRetries.set(0);
+        tapApplyBatches.set(0);
+        tapApplyBatchedOps.set(0);
+        tapBackfillBackoffs.set(0);
+        tapFanoutItems.set(0);
         pendingOps.set(0);
         pendingOpsTotal.set(0);
         pendingOpsMax.set(0);
         pendingOpsMaxDuration.set(0);
+        pendingOpsRejected.set(0);
+        numGetlWaits.set(0);
+        numOpsSubdoc.set(0);
+        numRangeScans.set(0);
+        numRangeScanItems.set(0);
         numTapFetched.set(0);
         vbucketDelMaxWalltime.set(0);
         vbucketDelTotWalltime.set(0);
@@ -434,6 +610,7 @@ public:
         alogRuns.set(0);
 
         pendingOpsHisto.reset();
+        pendingOpWaitHisto.reset();
         bgWaitHisto.reset();
         bgLoadHisto.reset();
         tapBgWaitHisto.reset();
@@ -450,16 +627,27 @@ public:
         notifyIOHisto.reset();
         getStatsCmdHisto.reset();
         chkPersistenceHisto.reset();
+        keyDurabilityHisto.reset();
         diskInsertHisto.reset();
         diskUpdateHisto.reset();
         diskDelHisto.reset();
         diskVBDelHisto.reset();
+        memVBDelHisto.reset();
         diskCommitHisto.reset();
 
         itemAllocSizeHisto.reset();
         dirtyAgeHisto.reset();
+        persistLatencyHisto.reset();
         mlogCompactorHisto.reset();
         getMultiHisto.reset();
+        bgBatchWaitHisto.reset();
+        htLockWaitHisto.reset();
+        htLockHoldHisto.reset();
+        htChainLengthHisto.reset();
+        for (int i = 0; i < NUM_TASK_KINDS; ++i) {
+            taskWaitHisto[i].reset();
+            taskRunHisto[i].reset();
+        }
     }
 
     // Used by stats logging infrastructure.
@@ -52,6 +52,12 @@ void add_casted_stat(const char *k, const Atomic<T> &v,
     add_casted_stat(k, v.get(), add_stat, cookie);
 }
 
+template <typename T>
+void add_casted_stat(const char *k, const ShardedCounter<T> &v,
+                            ADD_STAT add_stat, const void *cookie) {
+    add_casted_stat(k, v.get(), add_stat, cookie);
+}
+
 /// @cond DETAILS
 /**
  * Convert a histogram into a bunch of calls to add stats.
@@ -80,6 +86,32 @@ void add_casted_stat(const char *k, const Histogram<T> &v,
     std::for_each(v.begin(), v.end(), a);
 }
 
+/**
+ * Add the non-empty buckets of a log-linear histogram in the same form as
+ * a Histogram's bins, followed by its 99th and 99.9th percentiles as
+ * <k>_p99 and <k>_p999.
+ */
+template <typename T>
+void add_casted_stat(const char *k, const HdrHistogram<T> &v,
+                            ADD_STAT add_stat, const void *cookie) {
+    for (size_t i = 0; i < HdrHistogram<T>::NUM_BUCKETS; ++i) {
+        size_t count = v.count(i);
+        if (count) {
+            std::stringstream ss;
+            ss << k << "_" << HdrHistogram<T>::bucketStart(i) << ","
+               << HdrHistogram<T>::bucketEnd(i);
+            add_casted_stat(ss.str().c_str(), count, add_stat, cookie);
+        }
+    }
+    if (v.total() > 0) {
+        std::string prefix(k);
+        add_casted_stat((prefix + "_p99").c_str(), v.percentile(99.0),
+                        add_stat, cookie);
+        add_casted_stat((prefix + "_p999").c_str(), v.percentile(99.9),
+                        add_stat, cookie);
+    }
+}
+
 template <typename P, typename T>
 void add_prefixed_stat(P prefix, const char *nm, T val,
                   ADD_STAT add_stat, const void *cookie) {
@@ -29,6 +29,14 @@
 
 size_t HashTable::defaultNumBuckets = DEFAULT_HT_SIZE;
 size_t HashTable::defaultNumLocks = 193;
+bool HashTable::defaultRWLocks = false;
+size_t HashTable::defaultInlineValueSize = 0;
+size_t HashTable::defaultKeyPrefixMinLen = 0;
+bool HashTable::defaultPowerOfTwo = false;
+bool HashTable::defaultLockFreeReads = false;
+bool HashTable::defaultExpiryIndex = false;
+size_t HashTable::defaultIdleSize = 0;
+size_t HashTable::defaultMaxTempItems = 0;
 double StoredValue::mutation_mem_threshold = 0.9;
 const int64_t StoredValue::state_cleared = -1;
 const int64_t StoredValue::state_pending = -2;
@@ -43,11 +51,31 @@ static ssize_t prime_size_table[] = {
     1610612741, -1
 };
 
+extern "C" {
+    static void freeStoredValue(void *p) {
+        StoredValue::destroy(static_cast<StoredValue*>(p));
+    }
+
+    static void freeValueRef(void *p) {
+        delete static_cast<value_t*>(p);
+    }
+
+    static void freeBucketArray(void *p) {
+        HugePages::release(p);
+    }
+}
+
+void StoredValue::retireValue() {
+    if (value.get() && EpochManager::isEnabled()) {
+        EpochManager::retire(freeValueRef, new value_t(value));
+    }
+    value.reset();
+}
+
 bool StoredValue::ejectValue(EPStats &stats, HashTable &ht) {
     if (eligibleForEviction()) {
         reduceCacheSize(ht, value->length());
         markNotResident();
-        value = NULL;
 
         ++stats.numValueEjects;
         ++ht.numNonResidentItems;
@@ -58,6 +86,21 @@ bool StoredValue::ejectValue(EPStats &stats, HashTable &ht) {
     return false;
 }
 
+size_t StoredValue::compressValue(HashTable &ht) {
+    if (!isResident() || isDeleted() || inlined || value->isCompressed() ||
+        value->length() < MIN_COMPRESSIBLE_VALUE_SIZE) {
+        return 0;
+    }
+    Blob *compressed = Blob::NewCompressed(value->getData(), value->length());
+    if (compressed == NULL) {
+        return 0;
+    }
+    size_t saved = value->length() - compressed->length();
+    reduceCacheSize(ht, saved);
+    assignValue(value_t(compressed));
+    return saved;
+}
+
 void StoredValue::referenced() {
     if (nru > MIN_NRU_VALUE) {
         --nru;
@@ -83,6 +126,18 @@ uint8_t StoredValue::getNRUValue() {
 }
 
 bool StoredValue::unlocked_restoreValue(Item *itm, HashTable &ht) {
+    if (isTempItem()) {
+        // It was evicted altogether; it's a regular item again.
+        setValue(*itm, ht, true);
+        bySeqno = itm->getId();
+        nru = INITIAL_NRU_VALUE;
+        markClean();
+        --ht.numTempItems;
+        ++ht.numItems;
+        ht.unlocked_indexExpiry(this);
+        return true;
+    }
+
     // If cas == we loaded the object from our meta file, but
     // we didn't know the size of the object.. Don't report
     // this as an unexpected size change.
@@ -96,20 +151,30 @@ bool StoredValue::unlocked_restoreValue(Item *itm, HashTable &ht) {
             --ht.numNonResidentItems;
         }
         markClean();
+        ht.unlocked_indexExpiry(this);
         return true;
     }
 
     if (!isResident()) {
+        if (ghost) {
+            // Back before the pager even came around again; it was
+            // part of the working set after all.
+            ghost = false;
+            hot = true;
+            ++ht.getEPStats().numGhostHits;
+        }
+        size_t currSize = size();
         deleted = false;
-        value = itm->getValue();
-        increaseCacheSize(ht, value->length());
+        assignValue(itm->getValue());
+        increaseCacheSize(ht, size() - currSize);
         --ht.numNonResidentItems;
         return true;
     }
     return false;
 }
 
-mutation_type_t HashTable::insert(Item &itm, bool eject, bool partial) {
+mutation_type_t HashTable::insert(Item &itm, bool eject, bool partial,
+                                  bool mustExist) {
     assert(isActive());
     if (!StoredValue::hasAvailableSpace(stats, itm)) {
         return NOMEM;
@@ -119,15 +184,20 @@ mutation_type_t HashTable::insert(Item &itm, bool eject, bool partial) {
         if (partial) {
             itm.setCas(0);
         } else {
-            itm.setCas(Item::nextCas());
+            itm.setCas(clock.nextCas());
         }
+    } else {
+        // A cas from disk or the active; a later write here has to win.
+        clock.observe(itm.getCas());
     }
 
     int bucket_num(0);
     LockHolder lh = getLockedBucket(itm.getKey(), &bucket_num);
     StoredValue *v = unlocked_find(itm.getKey(), bucket_num, true, false);
 
-    if (v == NULL) {
+    if (v == NULL && mustExist) {
+        return INVALID_CAS;
+    } else if (v == NULL) {
         v = valFact(itm, values[bucket_num], *this);
         v->markClean();
         if (partial) {
@@ -136,6 +206,7 @@ mutation_type_t HashTable::insert(Item &itm, bool eject, bool partial) {
         }
         values[bucket_num] = v;
         ++numItems;
+        checkIdleOverflow();
     } else {
         if (partial) {
             // We don't have a better error code ;)
@@ -160,6 +231,7 @@ mutation_type_t HashTable::insert(Item &itm, bool eject, bool partial) {
     }
 
     v->markClean();
+    unlocked_indexExpiry(v);
 
     if (eject && !partial) {
         v->ejectValue(stats, *this);
@@ -223,6 +295,48 @@ void HashTable::setDefaultNumLocks(size_t to) {
     }
 }
 
+/**
+ * Set whether hashtables use reader/writer locks.
+ */
+void HashTable::setDefaultRWLocks(bool to) {
+    defaultRWLocks = to;
+}
+
+/**
+ * Set the largest value hashtables store inline.
+ */
+void HashTable::setDefaultInlineValueSize(size_t to) {
+    defaultInlineValueSize = to;
+}
+
+/**
+ * Set the shortest key prefix hashtables share between their items.
+ */
+void HashTable::setDefaultKeyPrefixMinLen(size_t to) {
+    defaultKeyPrefixMinLen = to;
+}
+
+/**
+ * Set whether hashtables use power-of-two sizes.
+ */
+void HashTable::setDefaultPowerOfTwo(bool to) {
+    defaultPowerOfTwo = to;
+}
+
+/**
+ * Set the size of the hashtables that hold next to nothing.
+ */
+void HashTable::setDefaultIdleSize(size_t to) {
+    defaultIdleSize = to;
+}
+
+/**
+ * Set the most temp items the hashtables keep.
+ */
+void HashTable::setDefaultMaxTempItems(size_t to) {
+    defaultMaxTempItems = to;
+}
+
 HashTableStatVisitor HashTable::clear(bool deactivate) {
     HashTableStatVisitor rv;
 
@@ -230,7 +344,9 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
         // If not deactivating, assert we're already active.
         assert(isActive());
     }
+    LockHolder rlh(resizeMutex);
     MultiLockHolder mlh(mutexes, n_locks);
+    waitForAllReaders();
     if (deactivate) {
         setActiveState(false);
     }
@@ -239,25 +355,96 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
             StoredValue *v = values[i];
             rv.visit(v);
             values[i] = v->next;
-            delete v;
+            retireStoredValue(v);
         }
     }
+    if (oldValues) {
+        // Nobody can reach the old table without one of the locks
+        // we're holding.
+        for (size_t i = 0; i < oldSize; i++) {
+            while (oldValues[i]) {
+                StoredValue *v = oldValues[i];
+                rv.visit(v);
+                oldValues[i] = v->next;
+                retireStoredValue(v);
+            }
+        }
+        resizeCursor = oldSize;
+        finishResize();
+    }
 
     stats.currentSize.decr(rv.memSize - rv.valSize);
     assert(stats.currentSize.get() < GIGANTOR);
 
+    if (expiryIndex) {
+        LockHolder lh(expiryIndexLock);
+        expiryIndex->clear();
+        stats.memOverhead.decr(expiryIndexEntries * EXPIRY_INDEX_ENTRY_SIZE);
+        expiryIndexEntries = 0;
+    }
+
     numItems.set(0);
     numTempItems.set(0);
     numNonResidentItems.set(0);
     memSize.set(0);
     cacheSize.set(0);
+    clearTempItemQueue();
 
     return rv;
 }
 
+void HashTable::clearTempItemQueue() {
+    LockHolder lh(tempItemLock);
+    tempItemQueue.clear();
+    tempItemMemory.set(0);
+}
+
+HashTable *HashTable::detach() {
+    assert(isActive());
+    HashTable *rv = new HashTable(stats, size, n_locks);
+    rv->detached = true;
+
+    LockHolder rlh(resizeMutex);
+    // Hand over a single table; a resize in flight is rare enough to
+    // finish here.
+    migrateBuckets(std::numeric_limits<size_t>::max());
+    MultiLockHolder mlh(mutexes, n_locks);
+    waitForAllReaders();
+
+    ++tableVersion;
+    ep_sync_synchronize();
+    std::swap(values, rv->values);
+    ep_sync_synchronize();
+    ++tableVersion;
+
+    rv->numItems.set(numItems.get());
+    rv->numTempItems.set(numTempItems.get());
+    rv->numNonResidentItems.set(numNonResidentItems.get());
+    rv->memSize.set(memSize.get());
+    rv->cacheSize.set(cacheSize.get());
+    numItems.set(0);
+    numTempItems.set(0);
+    numNonResidentItems.set(0);
+    memSize.set(0);
+    cacheSize.set(0);
+    clearTempItemQueue();
+
+    if (expiryIndex) {
+        LockHolder lh(expiryIndexLock);
+        expiryIndex->clear();
+        stats.memOverhead.decr(expiryIndexEntries * EXPIRY_INDEX_ENTRY_SIZE);
+        expiryIndexEntries = 0;
+    }
+    return rv;
+}
+
 void HashTable::resize(size_t newSize) {
     assert(isActive());
 
+    if (powerOfTwo) {
+        newSize = nextPowerOfTwo(newSize);
+    }
+
     // Due to the way hashing works, we can't fit anything larger than
     // an int.
     if (newSize > static_cast<size_t>(std::numeric_limits<int>::max())) {
@@ -269,46 +456,127 @@ void HashTable::resize(size_t newSize) {
         return;
     }
 
-    MultiLockHolder mlh(mutexes, n_locks);
-    if (visitors.get() > 0) {
-        // Do not allow a resize while any visitors are actually
-        // processing.  The next attempt will have to pick it up.  New
-        // visitors cannot start doing meaningful work (we own all
-        // locks at this point).
+    LockHolder rlh(resizeMutex);
+    // Only one old table at a time, so finish any earlier resize.
+    migrateBuckets(std::numeric_limits<size_t>::max());
+    if (newSize == size) {
         return;
     }
 
     // Get a place for the new items.
-    StoredValue **newValues = static_cast<StoredValue**>(calloc(newSize,
-                                                                sizeof(StoredValue*)));
+    StoredValue **newValues = static_cast<StoredValue**>(
+        HugePages::allocate(newSize * sizeof(StoredValue*)));
     // If we can't allocate memory, don't move stuff around.
     if (!newValues) {
         return;
     }
+    Mutex *newOldMutexes = new Mutex[n_locks];
+    setLockProfiles(newOldMutexes);
+
+    MultiLockHolder mlh(mutexes, n_locks);
+    waitForAllReaders();
+    if (visitors.get() > 0) {
+        // Do not allow a resize while any visitors are actually
+        // processing.  The next attempt will have to pick it up.  New
+        // visitors cannot start doing meaningful work (we own all
+        // locks at this point).
+        delete []newOldMutexes;
+        HugePages::release(newValues);
+        return;
+    }
 
     stats.memOverhead.decr(memorySize());
     ++numResizes;
 
-    // Set the new size so all the hashy stuff works.
-    size_t oldSize = size;
+    // Keep the existing records where they are; they're moved over
+    // one bucket at a time by getLockedBucket() and resizeStep().
+    // Lock-free readers look at size and values without any of our
+    // locks, so tell them the pair is changing.
+    ++tableVersion;
+    ep_sync_synchronize();
+    oldSize = size;
+    oldValues = values;
+    oldMutexes = newOldMutexes;
+    resizeCursor = 0;
     size = newSize;
+    values = newValues;
     ep_sync_synchronize();
+    ++tableVersion;
 
-    // Move existing records into the new space.
-    for (size_t i = 0; i < oldSize; i++) {
-        while (values[i]) {
-            StoredValue *v = values[i];
-            values[i] = v->next;
+    stats.memOverhead.incr(memorySize());
+    assert(stats.memOverhead.get() < GIGANTOR);
+}
+
+bool HashTable::resizeStep(size_t maxBuckets) {
+    LockHolder rlh(resizeMutex);
+    return migrateBuckets(maxBuckets);
+}
 
-            int newBucket = getBucketForHash(hash(v->getKeyBytes(), v->getKeyLen()));
-            v->next = newValues[newBucket];
-            newValues[newBucket] = v;
+void HashTable::completeResize() {
+    LockHolder rlh(resizeMutex);
+    migrateBuckets(std::numeric_limits<size_t>::max());
+}
+
+bool HashTable::migrateBuckets(size_t maxBuckets) {
+    if (!oldValues) {
+        return false;
+    }
+
+    for (size_t n = 0; n < maxBuckets && resizeCursor < oldSize;
+         ++n, ++resizeCursor) {
+        int old_bucket = static_cast<int>(resizeCursor);
+        while (true) {
+            // Find out which lock guards the destination of the head
+            // item, then move everything sharing that lock.
+            int lock_num(0);
+            {
+                LockHolder olh(oldMutexes[mutexForBucket(old_bucket)]);
+                StoredValue *v = oldValues[old_bucket];
+                if (!v) {
+                    break;
+                }
+                lock_num = mutexForBucket(getBucketForHash(hash(v)));
+            }
+            LockHolder lh(mutexes[lock_num]);
+            waitForReaders(lock_num);
+            unlocked_migrate(old_bucket, lock_num);
         }
     }
 
-    // values still points to the old (now empty) table.
-    free(values);
-    values = newValues;
+    if (resizeCursor == oldSize) {
+        MultiLockHolder mlh(mutexes, n_locks);
+        finishResize();
+    }
+    return oldValues != NULL;
+}
+
+void HashTable::unlocked_migrate(int old_bucket, int lock_num) {
+    LockHolder olh(oldMutexes[mutexForBucket(old_bucket)]);
+    StoredValue **p = &oldValues[old_bucket];
+    while (*p) {
+        StoredValue *v = *p;
+        int newBucket = getBucketForHash(hash(v));
+        if (mutexForBucket(newBucket) == lock_num) {
+            *p = v->next;
+            v->next = values[newBucket];
+            values[newBucket] = v;
+        } else {
+            p = &v->next;
+        }
+    }
+}
+
+void HashTable::finishResize() {
+    assert(resizeCursor == oldSize);
+    stats.memOverhead.decr(memorySize());
+
+    // A lock-free reader may still be walking the old buckets.
+    EpochManager::retire(freeBucketArray, oldValues);
+    delete []oldMutexes;
+    oldValues = NULL;
+    oldMutexes = NULL;
+    oldSize = 0;
+    resizeCursor = 0;
 
     stats.memOverhead.incr(memorySize());
     assert(stats.memOverhead.get() < GIGANTOR);
@@ -328,10 +596,42 @@ static bool isCurrently(size_t size, ssize_t a, ssize_t b) {
 }
 
 void HashTable::resize() {
-    size_t ni = getNumItems();
+    resize(sizeFor(getNumItems()));
+}
+
+void HashTable::reserve(size_t items) {
+    size_t to = sizeFor(items);
+    if (to > size) {
+        resize(to);
+    }
+}
+
+size_t HashTable::sizeFor(size_t ni) const {
     int i(0);
     size_t new_size(0);
 
+    // An idle table stays idle up to one item per bucket, and a bigger
+    // one goes idle at half that, so a count hovering around the idle
+    // size doesn't resize the table back and forth.
+    if (idleAllowed && idleSize > 0 && ni <= idleSize &&
+        (size == idleSize || ni <= idleSize / 2)) {
+        return idleSize;
+    }
+
+    if (powerOfTwo) {
+        // Same policy as below, with powers of two as the candidates.
+        size_t upper = nextPowerOfTwo(std::max(ni, static_cast<size_t>(1)));
+        size_t lower = std::max(upper / 2, static_cast<size_t>(1));
+        if (upper < nextPowerOfTwo(defaultNumBuckets)) {
+            new_size = nextPowerOfTwo(defaultNumBuckets);
+        } else if (size == lower || size == upper) {
+            new_size = size;
+        } else {
+            new_size = nearest(ni, lower, upper);
+        }
+        return new_size;
+    }
+
     // Figure out where in the prime table we are.
     ssize_t target(static_cast<ssize_t>(ni));
     for (i = 0; prime_size_table[i] > 0 && prime_size_table[i] < target; ++i) {
@@ -353,33 +653,332 @@ void HashTable::resize() {
         new_size = nearest(ni, prime_size_table[i-1], prime_size_table[i]);
     }
 
-    resize(new_size);
+    return new_size;
 }
 
-void HashTable::visit(HashTableVisitor &visitor) {
-    if ((numItems.get() + numTempItems.get()) == 0 || !isActive()) {
+void HashTable::setDefaultLockFreeReads(bool to) {
+    defaultLockFreeReads = to;
+}
+
+bool HashTable::unlocked_evict(const std::string &key, int bucket_num,
+                               bool ephemeral) {
+    StoredValue *v = unlocked_find(key, bucket_num, true, false);
+    if (!v || v->isTempItem() || v->isLocked(ep_current_time())) {
+        return false;
+    }
+    if (!ephemeral && (v->isDirty() || v->isDeleted())) {
+        return false;
+    }
+    if (!v->isResident()) {
+        --numNonResidentItems;
+    }
+    bool removed = unlocked_del(key, bucket_num);
+    assert(removed);
+    return removed;
+}
+
+void HashTable::setDefaultExpiryIndex(bool to) {
+    defaultExpiryIndex = to;
+}
+
+void HashTable::addToExpiryIndex(StoredValue *v) {
+    uint32_t when;
+    if (v->isTempItem()) {
+        when = 0;
+    } else if (v->isDeleted() || v->getExptime() == 0) {
         return;
+    } else {
+        when = v->getExptime();
     }
+    LockHolder lh(expiryIndexLock);
+    (*expiryIndex)[when].push_back(v->getKey());
+    ++expiryIndexEntries;
+    stats.memOverhead.incr(EXPIRY_INDEX_ENTRY_SIZE);
+    assert(stats.memOverhead.get() < GIGANTOR);
+    v->expiryIndexed = true;
+}
+
+size_t HashTable::getExpiryIndexSize() {
+    LockHolder lh(expiryIndexLock);
+    return expiryIndexEntries;
+}
+
+size_t HashTable::visitExpiring(HashTableVisitor &visitor, time_t asOf) {
+    if (expiryIndex == NULL) {
+        return 0;
+    }
+
+    std::vector<std::string> due;
+    {
+        LockHolder lh(expiryIndexLock);
+        ExpiryIndex::iterator end =
+            expiryIndex->lower_bound(static_cast<uint32_t>(asOf));
+        ExpiryIndex::iterator it;
+        for (it = expiryIndex->begin(); it != end; ++it) {
+            due.insert(due.end(), it->second.begin(), it->second.end());
+        }
+        expiryIndex->erase(expiryIndex->begin(), end);
+        expiryIndexEntries -= due.size();
+        stats.memOverhead.decr(due.size() * EXPIRY_INDEX_ENTRY_SIZE);
+    }
+
     VisitorTracker vt(&visitors);
-    bool aborted = !visitor.shouldContinue();
     size_t visited = 0;
-    for (int l = 0; isActive() && !aborted && l < static_cast<int>(n_locks); l++) {
+    std::vector<std::string>::iterator it;
+    for (it = due.begin(); it != due.end(); ++it) {
+        int bucket_num(0);
+        LockHolder lh = getLockedBucket(*it, &bucket_num);
+        StoredValue *v = unlocked_find(*it, bucket_num, true, false);
+        // Skip keys that went away, and extra entries for items we've
+        // already taken out of the index.
+        if (v == NULL || !v->expiryIndexed) {
+            continue;
+        }
+        v->expiryIndexed = false;
+        visitor.visit(v);
+        ++visited;
+        unlocked_indexExpiry(v);
+    }
+    return visited;
+}
+
+void HashTable::retireStoredValue(StoredValue *v) {
+    EpochManager::retire(freeStoredValue, v);
+}
+
+void HashTable::retireBucketArray(StoredValue **v) {
+    EpochManager::retire(freeBucketArray, v);
+}
+
+void HashTable::startHoldTimer(int lock_num, hrtime_t asked) {
+    hrtime_t now = gethrtime();
+    stats.htLockWaitHisto.add((now - asked) / 1000);
+    stripeTimings[lock_num].heldSince = now;
+    mutexes[lock_num].observeHold(this);
+}
+
+void HashTable::holdReleased(Mutex &m) {
+    hrtime_t held = gethrtime() - stripeTimings[&m - mutexes].heldSince;
+    stats.htLockHoldHisto.add(held / 1000);
+    maxLockHold.setIfBigger(held);
+    lockHoldTime.incr(held);
+    ++lockHoldSamples;
+}
+
+Item *HashTable::lockFreeFind(const std::string &key, uint16_t vbucket,
+                              bool trackReference, int64_t &bySeqno,
+                              uint8_t &nru) {
+    if (!lockFreeReads) {
+        return NULL;
+    }
+
+    // Nothing we can reach is freed while we're pinned.
+    EpochGuard eg;
+
+    size_t tv = tableVersion;
+    ep_sync_synchronize();
+    size_t sz = size;
+    StoredValue **vals = values;
+    bool resizing = oldValues != NULL;
+    ep_sync_synchronize();
+    if ((tv & 1) || tableVersion != tv || resizing) {
+        return NULL;
+    }
+
+    int bucket_num = bucketForHash(hash(key), sz);
+    Mutex &m = mutexes[mutexForBucket(bucket_num)];
+    size_t version = m.getVersion();
+    if (version & 1) {
+        return NULL;
+    }
+    ep_sync_synchronize();
+
+    // Everything read from here on may be torn by a writer; it's only
+    // used once the lock version says nobody wrote in the meantime.
+    StoredValue *v = vals[bucket_num];
+    uint8_t tag = StoredValue::keyTag(key);
+    for (size_t n = 0; v; ++n) {
+        if (n == LOCK_FREE_MAX_CHAIN) {
+            return NULL;
+        }
+        if (v->keytag == tag) {
+            // A torn item's key length and prefix may point anywhere, so
+            // its key bytes are only compared once the chain that led to
+            // it is known to be intact.  Its key doesn't change after
+            // that, and the epoch keeps it allocated.
+            ep_sync_synchronize();
+            if (m.getVersion() != version) {
+                return NULL;
+            }
+            if (v->hasKey(key)) {
+                break;
+            }
+        }
+        v = v->next;
+    }
+    if (!v || v->isDeleted() || v->isTempItem() || !v->isResident() ||
+        v->isExpired(ep_real_time())) {
+        return NULL;
+    }
+    // Bumping the NRU bits needs the lock.
+    if (trackReference && v->nru != MIN_NRU_VALUE) {
+        return NULL;
+    }
+
+    rel_time_t lockExpiry = v->lock_expiry;
+    bool locked = lockExpiry != 0 && ep_current_time() <= lockExpiry;
+    uint32_t flags = v->flags;
+    uint32_t exptime = v->exptime;
+    uint64_t cas = v->cas;
+    uint64_t revSeqno = v->revSeqno;
+    bySeqno = v->bySeqno;
+    nru = v->nru;
+    Blob *blob = NULL;
+    char inlineBytes[MAX_INLINE_VALUE_SIZE];
+    size_t inlineLen = 0;
+    bool inlined = v->inlined;
+    if (inlined) {
+        inlineLen = std::min(static_cast<size_t>(v->inlineLen),
+                             MAX_INLINE_VALUE_SIZE);
+        std::memcpy(inlineBytes, v->getInlineBytes(), inlineLen);
+    } else {
+        blob = v->value.get();
+    }
+
+    ep_sync_synchronize();
+    if (m.getVersion() != version || (!inlined && blob == NULL)) {
+        return NULL;
+    }
+
+    // The Blob was the value when nobody was writing; if it's been
+    // replaced since, the old reference is retired, so it's still safe
+    // to take one of our own.
+    value_t val(blob ? blob : Blob::New(inlineBytes, inlineLen));
+    return new Item(key, flags, exptime, val,
+                    locked ? static_cast<uint64_t>(-1) : cas,
+                    bySeqno, vbucket, revSeqno);
+}
+
+void HashTable::visit(HashTableVisitor &visitor) {
+    visitTable(visitor);
+}
+
+HashTable::Position HashTable::pauseResumeVisit(HashTableVisitor &visitor,
+                                               const Position &start) {
+    if ((numItems.get() + numTempItems.get()) == 0 || !isActive()) {
+        return endPosition();
+    }
+    VisitorTracker vt(&visitors);
+    completeResize();
+    int l = start.lock;
+    int bucket = start.hash_bucket;
+    if (start.ht_size != size) {
+        // The buckets moved around; redo the lock's whole stripe.
+        bucket = l;
+    }
+    bool paused = !visitor.shouldContinue();
+    for (; isActive() && !paused && l < static_cast<int>(n_locks); l++) {
         LockHolder lh(mutexes[l]);
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+        waitForReaders(l);
+        for (int i = bucket; i < static_cast<int>(size); i+= n_locks) {
             assert(l == mutexForBucket(i));
-            StoredValue *v = values[i];
-            assert(v == NULL || i == getBucketForHash(hash(v->getKeyBytes(),
-                                                           v->getKeyLen())));
-            while (v) {
-                visitor.visit(v);
-                v = v->next;
+            visitChain(visitor, i, static_cast<int>(n_locks));
+        }
+        lh.unlock();
+        bucket = l + 1;
+        paused = !visitor.shouldContinue();
+    }
+    return Position(size, l, bucket);
+}
+
+size_t HashTable::sweep(HashTableVisitor &visitor, size_t maxBuckets) {
+    return sweepTable(visitor, maxBuckets);
+}
+
+bool HashTable::defragment(size_t maxBuckets) {
+    if (numItems.get() == 0 || !isActive()) {
+        defragCursor = 0;
+        return false;
+    }
+    VisitorTracker vt(&visitors);
+    // No new resize can start while we're here, as in sweep().
+    completeResize();
+    size_t visited = 0;
+    while (isActive() && visited < maxBuckets && defragCursor < size) {
+        int lock_num = mutexForBucket(static_cast<int>(defragCursor));
+        LockHolder lh(mutexes[lock_num]);
+        waitForReaders(lock_num);
+        StoredValue **prev = &values[defragCursor];
+        while (*prev) {
+            StoredValue *v = *prev;
+            if (v->isDirty() || v->isDeleted() || v->isTempItem()) {
+                prev = &v->next;
+                continue;
             }
-            ++visited;
+            if (!v->defragAged) {
+                v->defragAged = true;
+                prev = &v->next;
+                continue;
+            }
+            bool moveValue = !v->inlined && v->isResident() && v->value.get();
+            StoredValue *t = valFact.copy(*v, v->next, moveValue);
+            *prev = t;
+            retireStoredValue(v);
+            ++stats.defragNumMoved;
+            if (moveValue) {
+                ++stats.defragNumValuesMoved;
+            }
+            prev = &t->next;
         }
         lh.unlock();
-        aborted = !visitor.shouldContinue();
+        ++defragCursor;
+        ++visited;
+    }
+    if (defragCursor < size) {
+        return true;
     }
-    assert(aborted || visited == size);
+    defragCursor = 0;
+    return false;
+}
+
+bool HashTable::clearSome(size_t maxItems) {
+    assert(isActive());
+    {
+        VisitorTracker vt(&visitors);
+        // No new resize can start while we're here, as in sweep().
+        completeResize();
+        HashTableStatVisitor rv;
+        size_t numTemp = 0;
+        while (clearCursor < size && rv.numTotal < maxItems) {
+            int lock_num = mutexForBucket(static_cast<int>(clearCursor));
+            LockHolder lh(mutexes[lock_num]);
+            waitForReaders(lock_num);
+            while (values[clearCursor]) {
+                StoredValue *v = values[clearCursor];
+                rv.visit(v);
+                if (v->isTempItem()) {
+                    ++numTemp;
+                }
+                values[clearCursor] = v->next;
+                retireStoredValue(v);
+            }
+            ++clearCursor;
+        }
+
+        stats.currentSize.decr(rv.memSize - rv.valSize);
+        assert(stats.currentSize.get() < GIGANTOR);
+        numItems.decr(rv.numTotal - numTemp);
+        numTempItems.decr(numTemp);
+        if (clearCursor < size) {
+            return false;
+        }
+    }
+
+    // Reset the rest of the counts, and the expiry index, along with
+    // anything that was added behind the cursor.
+    clear();
+    clearCursor = 0;
+    return true;
 }
 
 void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
@@ -388,14 +987,16 @@ void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
     }
     size_t visited = 0;
     VisitorTracker vt(&visitors);
+    completeResize();
 
     for (int l = 0; l < static_cast<int>(n_locks); l++) {
+        // Only looking, so other readers are welcome.
         LockHolder lh(mutexes[l]);
+        BucketReaderHolder rlh = shareLock(lh, l);
         for (int i = l; i < static_cast<int>(size); i+= n_locks) {
             size_t depth = 0;
             StoredValue *p = values[i];
-            assert(p == NULL || i == getBucketForHash(hash(p->getKeyBytes(),
-                                                           p->getKeyLen())));
+            assert(p == NULL || i == getBucketForHash(hash(p)));
             size_t mem(0);
             while (p) {
                 depth++;
@@ -421,12 +1022,19 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
         rv = ADD_EXISTS;
     } else {
         Item &itm = const_cast<Item&>(val);
-        itm.setCas();
+        itm.setCas(clock.nextCas());
         if (!StoredValue::hasAvailableSpace(stats, itm)) {
             return ADD_NOMEM;
         }
         if (v) {
             rv = (v->isDeleted() || v->isExpired(ep_real_time())) ? ADD_UNDEL : ADD_SUCCESS;
+            if (v->isTempItem() &&
+                itm.getId() != StoredValue::state_temp_init) {
+                // The key turned out not to exist; it's a regular item now.
+                v->clearBySeqno();
+                --numTempItems;
+                ++numItems;
+            }
             v->setValue(itm, *this, false);
             if (isDirty) {
                 v->markDirty();
@@ -441,6 +1049,7 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
                 ++numTempItems;
             } else {
                 ++numItems;
+                checkIdleOverflow();
             }
 
             /**
@@ -459,11 +1068,53 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
             v->resetValue();
             v->setNRUValue(MAX_NRU_VALUE);
         }
+        unlocked_indexExpiry(v);
     }
 
     return rv;
 }
 
+void HashTable::unlocked_queueTempItem(StoredValue *v) {
+    if (maxTempItems == 0) {
+        return;
+    }
+    size_t mem = v->size();
+    LockHolder lh(tempItemLock);
+    tempItemQueue.push_back(std::make_pair(v->getKey(), mem));
+    tempItemMemory.incr(mem);
+}
+
+size_t HashTable::reclaimTempItems() {
+    size_t reclaimed = 0;
+    while (true) {
+        std::string key;
+        {
+            LockHolder lh(tempItemLock);
+            if (tempItemQueue.size() <= maxTempItems) {
+                break;
+            }
+            key.swap(tempItemQueue.front().first);
+            tempItemMemory.decr(tempItemQueue.front().second);
+            tempItemQueue.pop_front();
+        }
+        if (!isActive()) {
+            continue;
+        }
+        int bucket_num(0);
+        LockHolder lh = getLockedBucket(key, &bucket_num);
+        StoredValue *v = unlocked_find(key, bucket_num, true, false);
+        // A fetch in flight still needs its temp item.
+        if (v && (v->isTempDeletedItem() || v->isTempNonExistentItem()) &&
+            unlocked_del(key, bucket_num)) {
+            ++reclaimed;
+        }
+    }
+    if (reclaimed > 0) {
+        stats.tempItemsReclaimed.incr(reclaimed);
+    }
+    return reclaimed;
+}
+
 add_type_t HashTable::unlocked_addTempDeletedItem(int &bucket_num,
                                                   const std::string &key) {
 
@@ -525,8 +1176,16 @@ bool StoredValue::hasAvailableSpace(EPStats &st, const Item &itm) {
 }
 
 Item* StoredValue::toItem(bool lck, uint16_t vbucket) const {
-    return new Item(getKey(), getFlags(), getExptime(),
-                    value,
-                    lck ? static_cast<uint64_t>(-1) : getCas(),
-                    bySeqno, vbucket, getRevSeqno());
+    // The key goes through the stack rather than a std::string.
+    char key[256];
+    size_t nkey = copyKey(key);
+    uint64_t itmCas = lck ? static_cast<uint64_t>(-1) : getCas();
+    if (inlined) {
+        // Straight into the item's own blob, not through getValue().
+        return new Item(key, static_cast<uint16_t>(nkey), getFlags(),
+                        getExptime(), getInlineBytes(), inlineLen, itmCas,
+                        bySeqno, vbucket, getRevSeqno());
+    }
+    return new Item(key, static_cast<uint16_t>(nkey), getFlags(), getExptime(),
+                    value, itmCas, bySeqno, vbucket, getRevSeqno());
 }
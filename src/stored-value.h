@@ -23,14 +23,23 @@
 #include <algorithm>
 #include <climits>
 #include <cstring>
+#include <deque>
+#include <map>
 #include <string>
+#include <vector>
 
 #include "common.h"
 #include "ep_time.h"
+#include "epoch.h"
 #include "histo.h"
+#include "huge_pages.h"
 #include "item.h"
+#include "key_prefix_table.h"
+#include "lock_profiler.h"
 #include "locks.h"
+#include "optrace.h"
 #include "queueditem.h"
+#include "slab_allocator.h"
 #include "stats.h"
 
 // Max value for NRU bits
@@ -39,6 +48,17 @@ const uint8_t MAX_NRU_VALUE = 3;
 const uint8_t INITIAL_NRU_VALUE = 2;
 // Min value for NRU bits
 const uint8_t MIN_NRU_VALUE = 0;
+// Inline value space is reserved in units of this many bytes
+const size_t INLINE_VALUE_ALIGN = 8;
+// Largest value that can be stored inline in a StoredValue
+const size_t MAX_INLINE_VALUE_SIZE = 7 * INLINE_VALUE_ALIGN;
+// Lock-free lookups give up on chains longer than this
+const size_t LOCK_FREE_MAX_CHAIN = 64;
+// Memory overhead counted for each entry of an expiry index
+const size_t EXPIRY_INDEX_ENTRY_SIZE = sizeof(std::string);
+
+// One in this many lock acquisitions and lookups is timed (power of two)
+const size_t HT_STATS_SAMPLE_RATE = 64;
 
 // Forward declaration for StoredValue
 class HashTable;
@@ -50,9 +70,24 @@ class StoredValueFactory;
 class StoredValue {
 public:
 
-    void operator delete(void* p) {
-        ::operator delete(p);
-     }
+    /**
+     * Free a StoredValue made by its factory.
+     *
+     * Its slab class and size are read before it's destroyed, as its
+     * members can't be read once it is.
+     */
+    static void destroy(StoredValue *v) {
+        uint8_t slab = v->slabClass;
+        size_t len = v->allocationSize();
+        v->~StoredValue();
+        SlabAllocator::release(v, slab, len);
+    }
+
+    ~StoredValue() {
+        if (keyPrefix != 0) {
+            KeyPrefixTable::release(keyPrefix);
+        }
+    }
 
     uint8_t getNRUValue();
 
@@ -62,6 +97,42 @@ public:
 
     void referenced();
 
+    /**
+     * True if the eviction policy considers this item part of the
+     * working set (see ClockProEvictionPolicy).
+     */
+    bool isHot() const {
+        return hot;
+    }
+
+    void setHot(bool to) {
+        hot = to;
+    }
+
+    /**
+     * True if the pager ejected this item's value recently enough that
+     * fetching it back means it was evicted too early.
+     */
+    bool isGhost() const {
+        return ghost;
+    }
+
+    void setGhost(bool to) {
+        ghost = to;
+    }
+
+    /**
+     * True if the access log has this item as resident, as far as the
+     * access scanner's runs since it last rewrote the log know.
+     */
+    bool isInAccessLog() const {
+        return inAccessLog;
+    }
+
+    void setInAccessLog(bool to) {
+        inAccessLog = to;
+    }
+
     /**
      * Mark this item as needing to be persisted.
      */
@@ -108,7 +179,9 @@ public:
     }
 
     bool eligibleForEviction() {
-        return isResident() && isClean() && !isDeleted();
+        // An inline value lives in our own allocation; ejecting it
+        // wouldn't free anything.
+        return isResident() && isClean() && !isDeleted() && !inlined;
     }
 
     /**
@@ -125,17 +198,30 @@ public:
     }
 
     /**
-     * Get the pointer to the beginning of the key.
-     */
-    const char* getKeyBytes() const {
-        return keybytes;
+     * Copy this item's key to the given buffer, which must have room for
+     * the longest key (255 bytes).
+     *
+     * @return the length of the key
+     */
+    size_t copyKey(char *buf) const {
+        size_t n = 0;
+        if (keyPrefix != 0) {
+            const std::string &prefix = KeyPrefixTable::get(keyPrefix);
+            n = prefix.length();
+            std::memcpy(buf, prefix.data(), n);
+        }
+        std::memcpy(buf + n, keybytes, keylen);
+        return n + keylen;
     }
 
     /**
      * Get the length of the key.
      */
     uint8_t getKeyLen() const {
-        return keylen;
+        if (keyPrefix == 0) {
+            return keylen;
+        }
+        return KeyPrefixTable::get(keyPrefix).length() + keylen;
     }
 
     /**
@@ -145,21 +231,63 @@ public:
      * @return true if this item's key is equal to k
      */
     bool hasKey(const std::string &k) const {
-        return k.length() == getKeyLen()
-            && (std::memcmp(k.data(), getKeyBytes(), getKeyLen()) == 0);
+        if (keyPrefix == 0) {
+            return k.length() == keylen
+                && (std::memcmp(k.data(), keybytes, keylen) == 0);
+        }
+        // Keys sharing the prefix differ after it, so look there first.
+        const std::string &prefix = KeyPrefixTable::get(keyPrefix);
+        size_t n = prefix.length();
+        return k.length() == n + keylen
+            && std::memcmp(k.data() + n, keybytes, keylen) == 0
+            && std::memcmp(k.data(), prefix.data(), n) == 0;
+    }
+
+    /**
+     * True of this item is for the given key, whose keyTag() is given.
+     * Most other keys are told apart by the tag alone, without reading
+     * this item's key bytes.
+     */
+    bool hasKey(const std::string &k, uint8_t tag) const {
+        return tag == keytag && hasKey(k);
+    }
+
+    /**
+     * A byte summing up a key for hasKey().  It mixes the length with
+     * the last (up to) eight bytes of the key, where keys that share a
+     * prefix, like counters and ids, differ, so it costs the same for
+     * a key of any length.
+     */
+    static uint8_t keyTag(const std::string &k) {
+        uint64_t tail = 0;
+        size_t n = std::min(k.length(), sizeof(tail));
+        std::memcpy(&tail, k.data() + k.length() - n, n);
+        tail ^= k.length();
+        return static_cast<uint8_t>((tail * 0x9E3779B97F4A7C15ULL) >> 56);
     }
 
     /**
      * Get this item's key.
      */
     const std::string getKey() const {
-        return std::string(getKeyBytes(), getKeyLen());
+        if (keyPrefix == 0) {
+            return std::string(keybytes, keylen);
+        }
+        std::string rv(KeyPrefixTable::get(keyPrefix));
+        rv.append(keybytes, keylen);
+        return rv;
     }
 
     /**
      * Get this item's value.
+     *
+     * Inline values are copied out into a new Blob, so the read path
+     * goes through toItem(), which copies them into the item directly.
      */
-    const value_t &getValue() const {
+    value_t getValue() const {
+        if (inlined) {
+            return value_t(Blob::New(getInlineBytes(), inlineLen));
+        }
         return value;
     }
 
@@ -203,7 +331,7 @@ public:
     void setValue(Item &itm, HashTable &ht, bool preserveSeqno) {
         size_t currSize = size();
         reduceCacheSize(ht, currSize);
-        value = itm.getValue();
+        assignValue(itm.getValue());
         deleted = false;
         flags = itm.getFlags();
 
@@ -239,7 +367,17 @@ public:
     bool ejectValue(EPStats &stats, HashTable &ht);
 
     /**
-     * Restore the value for this item.
+     * Replace a resident value with a compressed copy, if it's big
+     * enough for that to save anything.
+     *
+     * @param ht the hashtable that contains this StoredValue instance
+     * @return the bytes saved, 0 if it wasn't compressed
+     */
+    size_t compressValue(HashTable &ht);
+
+    /**
+     * Restore the value for this item.  A temp item (standing in for
+     * a key evicted in full eviction mode) becomes a regular item.
      * @param itm the item to be restored
      * @param ht the hashtable that contains this StoredValue instance
      */
@@ -289,6 +427,11 @@ public:
         lock_expiry = 0;
     }
 
+    //! The time this item's locked until, or 0 if it's not
+    rel_time_t getLockExpiry() const {
+        return lock_expiry;
+    }
+
     /**
      * True if this item has an ID.
      *
@@ -400,20 +543,26 @@ public:
         if (isDeleted() || !isResident()) {
             return 0;
         }
-        return value->length();
+        return inlined ? inlineLen : value->length();
     }
 
     /**
-     * Get the total size of this item.
+     * Get the total size of this item.  The space reserved for an inline
+     * value is counted whether or not the value fits in it.
      *
      * @return the amount of memory used by this item.
      */
     size_t size() {
-        return sizeof(StoredValue) + getKeyLen() + valuelen();
+        return sizeof(StoredValue) + keylen + inlineCapacity() +
+            (inlined ? 0 : valuelen());
     }
 
+    /**
+     * Get the size of this item without its value.  A prefix shared
+     * through the KeyPrefixTable isn't counted.
+     */
     size_t metaDataSize() {
-        return sizeof(StoredValue) + getKeyLen();
+        return sizeof(StoredValue) + keylen;
     }
 
     /**
@@ -434,11 +583,19 @@ public:
      * True if this value is resident in memory currently.
      */
     bool isResident() const {
-        return value.get() != NULL;
+        return inlined || value.get() != NULL;
     }
 
     void markNotResident() {
-        value.reset();
+        retireValue();
+        inlined = false;
+    }
+
+    /**
+     * True if the value is held inline rather than in a Blob.
+     */
+    bool isInlineValue() const {
+        return inlined;
     }
 
     /**
@@ -456,8 +613,9 @@ public:
             return;
         }
 
-        reduceCacheSize(ht, valuelen());
+        size_t currSize = size();
         resetValue();
+        reduceCacheSize(ht, currSize - size());
         markDirty();
         if (!isMetaDelete) {
             setCas(getCas() + 1);
@@ -506,15 +664,35 @@ public:
 
 private:
 
+    // StoredValues are variable-sized, so they're freed with destroy();
+    // this is never defined, so a plain delete of one doesn't build.
+    void operator delete(void*);
+
+    /**
+     * A new item.  The key is kept as a reference to the given prefix
+     * (0 for none) followed by the rest of the key, which is the caller's
+     * to copy.
+     */
     StoredValue(const Item &itm, StoredValue *n, EPStats &stats, HashTable &ht,
-                bool setDirty = true) :
+                bool setDirty, uint16_t prefix, size_t prefixLen) :
         value(itm.getValue()), next(n), bySeqno(itm.getId()), flags(itm.getFlags()) {
         cas = itm.getCas();
         exptime = itm.getExptime();
         deleted = false;
         nru = INITIAL_NRU_VALUE;
+        hot = false;
+        ghost = false;
+        expiryIndexed = false;
+        inAccessLog = false;
+        defragAged = false;
+        inlined = false;
+        inlineCap = 0;
+        inlineLen = 0;
+        slabClass = 0;
         lock_expiry = 0;
-        keylen = itm.getKey().length();
+        keylen = itm.getKey().length() - prefixLen;
+        keytag = keyTag(itm.getKey());
+        keyPrefix = prefix;
         revSeqno = itm.getSeqno();
 
         if (setDirty) {
@@ -527,10 +705,88 @@ private:
         increaseCacheSize(ht, size());
     }
 
+    /**
+     * A copy of an item to take its place, with the given value.  The
+     * key and any inline value are the caller's to copy, and the sizes
+     * aren't counted again, as the original is going away.
+     */
+    StoredValue(const StoredValue &o, StoredValue *n, const value_t &val) :
+        value(val), next(n), cas(o.cas), revSeqno(o.revSeqno),
+        bySeqno(o.bySeqno), lock_expiry(o.lock_expiry), exptime(o.exptime),
+        flags(o.flags) {
+        _isDirty = o._isDirty;
+        deleted = o.deleted;
+        nru = o.nru;
+        inlined = o.inlined;
+        inlineCap = o.inlineCap;
+        hot = o.hot;
+        ghost = o.ghost;
+        expiryIndexed = o.expiryIndexed;
+        inAccessLog = o.inAccessLog;
+        defragAged = false;
+        keylen = o.keylen;
+        keytag = o.keytag;
+        keyPrefix = o.keyPrefix;
+        if (keyPrefix != 0) {
+            KeyPrefixTable::addRef(keyPrefix);
+        }
+        inlineLen = o.inlineLen;
+        slabClass = 0;
+    }
+
     friend class HashTable;
     friend class StoredValueFactory;
 
-    value_t            value;          // 16 bytes
+    /**
+     * Number of bytes allocated for this object.
+     */
+    size_t allocationSize() const {
+        return sizeof(StoredValue) + keylen + inlineCapacity();
+    }
+
+    /**
+     * Inline values are kept right after the key.
+     */
+    const char *getInlineBytes() const {
+        return keybytes + keylen;
+    }
+
+    /**
+     * Number of bytes reserved for an inline value.
+     */
+    size_t inlineCapacity() const {
+        return inlineCap * INLINE_VALUE_ALIGN;
+    }
+
+    /**
+     * Point this item at the given value, copying it inline when it
+     * fits in the space reserved at allocation time.
+     */
+    void assignValue(const value_t &v) {
+        // Inline values lose their datatype, so only raw ones go inline.
+        if (inlineCap > 0 && v.get() && !v->isCompressed() &&
+            v->length() <= inlineCapacity()) {
+            std::memcpy(keybytes + keylen, v->getData(), v->length());
+            inlineLen = static_cast<uint8_t>(v->length());
+            inlined = true;
+            retireValue();
+        } else {
+            if (value.get() != v.get()) {
+                retireValue();
+            }
+            value = v;
+            inlined = false;
+        }
+    }
+
+    /**
+     * Drop our reference to the value's Blob.  With epoch reclamation
+     * on, the reference is retired rather than dropped so lock-free
+     * readers that just picked the Blob up can still take their own.
+     */
+    void retireValue();
+
+    value_t            value;          // 8 bytes
     StoredValue        *next;          // 8 bytes
     uint64_t           cas;            //!< CAS identifier.
     uint64_t           revSeqno;       //!< Revision id sequence number
@@ -541,8 +797,19 @@ private:
     bool               _isDirty  :  1; // 1 bit
     bool               deleted   :  1;
     uint8_t            nru       :  2; //!< True if referenced since last sweep
-    uint8_t            keylen;
-    char               keybytes[1];    //!< The key itself.
+    bool               inlined   :  1; //!< Value is stored after the key
+    uint8_t            inlineCap :  3; //!< Inline space, in INLINE_VALUE_ALIGN units
+    bool               hot       :  1; //!< Protected from eviction
+    bool               ghost     :  1; //!< Value ejected since the last sweep
+    bool               expiryIndexed : 1; //!< Has an entry in the expiry index
+    bool               inAccessLog : 1; //!< Logged as resident in the access log
+    bool               defragAged : 1; //!< Seen by the last defragment() pass
+    uint8_t            keylen;         //!< Length of the key after its prefix
+    uint8_t            inlineLen;      //!< Length of an inline value
+    uint8_t            slabClass;      //!< Where the memory came from (0 = heap)
+    uint8_t            keytag;         //!< keyTag() of the key
+    uint16_t           keyPrefix;      //!< Id of the key's prefix (0 = none)
+    char               keybytes[1];    //!< The key (and inline value) itself.
 
     static void increaseMetaDataSize(HashTable &ht, EPStats &st, size_t by);
     static void reduceMetaDataSize(HashTable &ht, EPStats &st, size_t by);
@@ -709,8 +976,16 @@ public:
 
     /**
      * Create a new StoredValueFactory of the given type.
+     *
+     * @param s the global stats
+     * @param inlineMax values up to this size are stored inline in the
+     *                  StoredValue allocation instead of in a Blob
+     * @param prefixMin key prefixes at least this long are shared through
+     *                  the KeyPrefixTable (0 to keep keys whole)
      */
-    StoredValueFactory(EPStats &s) : stats(&s) { }
+    StoredValueFactory(EPStats &s, size_t inlineMax = 0, size_t prefixMin = 0) :
+        stats(&s), maxInline(std::min(inlineMax, MAX_INLINE_VALUE_SIZE)),
+        minPrefix(prefixMin) { }
 
     /**
      * Create a new StoredValue with the given item.
@@ -725,6 +1000,31 @@ public:
         return newStoredValue(itm, n, ht, setDirty);
     }
 
+    /**
+     * Create a copy of an item in an allocation of its own, to replace
+     * it in its hash bucket.
+     *
+     * @param v the item to copy
+     * @param n the item to follow the copy in the bucket
+     * @param moveValue if true, the copy's value is a copy of the
+     *                  original's Blob rather than a reference to it
+     */
+    StoredValue *copy(const StoredValue &v, StoredValue *n, bool moveValue) {
+        value_t val(v.value);
+        if (moveValue && val.get()) {
+            val.reset(Blob::New(val->getData(), val->length(),
+                                val->getDataType()));
+        }
+
+        size_t len = v.allocationSize();
+        uint8_t slabClass;
+        void *mem = SlabAllocator::allocate(len, slabClass);
+        StoredValue *t = new (mem) StoredValue(v, n, val);
+        t->slabClass = slabClass;
+        std::memcpy(t->keybytes, v.keybytes, v.keylen + v.inlineCapacity());
+        return t;
+    }
+
 private:
 
     StoredValue* newStoredValue(const Item &itm, StoredValue *n, HashTable &ht,
@@ -733,39 +1033,174 @@ private:
 
         const std::string &key = itm.getKey();
         assert(key.length() < 256);
-        size_t len = key.length() + base;
+        uint16_t prefix = 0;
+        size_t prefixLen = 0;
+        if (minPrefix > 0) {
+            size_t n = KeyPrefixTable::prefixLength(key.data(), key.length());
+            if (n >= minPrefix &&
+                (prefix = KeyPrefixTable::acquire(key.data(), n)) != 0) {
+                prefixLen = n;
+            }
+        }
+        size_t len = key.length() - prefixLen + base;
+
+        // Reserve room for the value after the key if it's small.
+        const value_t &val = itm.getValue();
+        size_t cap(0);
+        if (val.get() && !val->isCompressed() && val->length() <= maxInline) {
+            cap = (val->length() + INLINE_VALUE_ALIGN - 1) / INLINE_VALUE_ALIGN;
+            len += cap * INLINE_VALUE_ALIGN;
+        }
 
-        StoredValue *t = new (::operator new(len))
-        StoredValue(itm, n, *stats, ht, setDirty);
-        std::memcpy(t->keybytes, key.data(), key.length());
+        uint8_t slabClass;
+        void *mem = SlabAllocator::allocate(len, slabClass);
+        StoredValue *t = new (mem) StoredValue(itm, n, *stats, ht, setDirty,
+                                               prefix, prefixLen);
+        t->slabClass = slabClass;
+        std::memcpy(t->keybytes, key.data() + prefixLen,
+                    key.length() - prefixLen);
+        if (cap > 0) {
+            t->inlineCap = static_cast<uint8_t>(cap);
+            t->assignValue(val);
+        }
         return t;
     }
 
     EPStats                *stats;
+    size_t                  maxInline;
+    size_t                  minPrefix;
+};
+
+/**
+ * RAII holder for a read hold on a HashTable bucket.
+ *
+ * When the table uses reader/writer locks this is a shared hold and
+ * other readers of the same lock stripe may run concurrently;
+ * otherwise it's an ordinary exclusive hold.  Either way, only
+ * lookups (unlocked_find and StoredValue getters) are allowed under
+ * it.
+ */
+class BucketReaderHolder {
+public:
+
+    BucketReaderHolder(LockHolder &l, Atomic<size_t> *r) : lh(l), readers(r) {}
+
+    /**
+     * Copy constructor hands the hold to the new copy, like LockHolder.
+     */
+    BucketReaderHolder(const BucketReaderHolder &from) : lh(from.lh),
+                                                         readers(from.readers) {
+        const_cast<BucketReaderHolder*>(&from)->readers = NULL;
+    }
+
+    ~BucketReaderHolder() {
+        unlock();
+    }
+
+    /**
+     * Manually release the hold.
+     */
+    void unlock() {
+        lh.unlock();
+        if (readers) {
+            --(*readers);
+            readers = NULL;
+        }
+    }
+
+private:
+    LockHolder      lh;
+    Atomic<size_t> *readers;
+
+    void operator=(const BucketReaderHolder&);
 };
 
 /**
  * A container of StoredValue instances.
  */
-class HashTable {
+class HashTable : private MutexHoldObserver {
 public:
 
+    /**
+     * Where a pauseResumeVisit() stopped, to carry on from there.
+     */
+    class Position {
+    public:
+        //! The start of the table
+        Position() : ht_size(0), lock(0), hash_bucket(0) { }
+
+        bool operator==(const Position &other) const {
+            return ht_size == other.ht_size && lock == other.lock &&
+                hash_bucket == other.hash_bucket;
+        }
+
+        bool operator!=(const Position &other) const {
+            return !(*this == other);
+        }
+
+    private:
+        Position(size_t s, int l, int b) :
+            ht_size(s), lock(l), hash_bucket(b) { }
+
+        //! The table size the position is for
+        size_t ht_size;
+        int    lock;
+        int    hash_bucket;
+
+        friend class HashTable;
+    };
+
     /**
      * Create a HashTable.
      *
      * @param st the global stats reference
      * @param s the number of hash table buckets
      * @param l the number of locks in the hash table
+     * @param idle true if the table may start out and shrink back to the
+     *             idle size while it holds next to nothing (for the
+     *             vbuckets that aren't active)
      */
-    HashTable(EPStats &st, size_t s = 0, size_t l = 0) : stats(st), valFact(st) {
+    HashTable(EPStats &st, size_t s = 0, size_t l = 0, bool idle = false) :
+        stats(st), valFact(st, defaultInlineValueSize, defaultKeyPrefixMinLen) {
+        powerOfTwo = defaultPowerOfTwo;
         size = HashTable::getNumBuckets(s);
         n_locks = HashTable::getNumLocks(l);
+        idleSize = defaultIdleSize;
+        if (powerOfTwo) {
+            size = nextPowerOfTwo(size);
+            n_locks = nextPowerOfTwo(n_locks);
+            idleSize = idleSize ? nextPowerOfTwo(idleSize) : 0;
+        }
+        if (idleSize >= getMinSize()) {
+            idleSize = 0;
+        }
+        idleAllowed = idle;
+        if (idleAllowed && idleSize > 0 && idleSize < size) {
+            size = idleSize;
+        }
         assert(size > 0);
         assert(n_locks > 0);
         assert(visitors == 0);
-        values = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
+        values = static_cast<StoredValue**>(
+            HugePages::allocate(size * sizeof(StoredValue*)));
         mutexes = new Mutex[n_locks];
+        setLockProfiles(mutexes);
+        stripeTimings = new StripeTimings[n_locks];
+        readers = defaultRWLocks ? new Atomic<size_t>[n_locks] : NULL;
+        oldSize = 0;
+        oldValues = NULL;
+        oldMutexes = NULL;
+        resizeCursor = 0;
+        tableVersion = 0;
+        sweepCursor = 0;
+        clearCursor = 0;
+        defragCursor = 0;
+        lockFreeReads = defaultLockFreeReads && EpochManager::isEnabled();
+        expiryIndex = defaultExpiryIndex ? new ExpiryIndex() : NULL;
+        expiryIndexEntries = 0;
+        maxTempItems = defaultMaxTempItems;
         activeState = true;
+        detached = false;
     }
 
     ~HashTable() {
@@ -775,14 +1210,42 @@ public:
             usleep(100);
         }
         delete []mutexes;
-        free(values);
+        delete []stripeTimings;
+        delete []readers;
+        delete expiryIndex;
+        if (detached) {
+            // Lock-free readers of the table it came from may still be
+            // walking the buckets.
+            retireBucketArray(values);
+        } else {
+            HugePages::release(values);
+        }
         values = NULL;
     }
 
+    /**
+     * Number of bytes of the table itself, counted in the memory
+     * overhead along with the vbucket and on each resize.  The expiry
+     * index isn't included; its entries are counted as they come and go.
+     */
     size_t memorySize() {
-        return sizeof(HashTable)
+        size_t rv = sizeof(HashTable)
             + (size * sizeof(StoredValue*))
-            + (n_locks * sizeof(Mutex));
+            + (n_locks * (sizeof(Mutex) + sizeof(StripeTimings)));
+        if (readers) {
+            rv += n_locks * sizeof(Atomic<size_t>);
+        }
+        if (oldValues) {
+            rv += (oldSize * sizeof(StoredValue*)) + (n_locks * sizeof(Mutex));
+        }
+        return rv;
+    }
+
+    /**
+     * Number of bytes of the expiry index's entries.
+     */
+    size_t getExpiryIndexMemory() {
+        return expiryIndex ? getExpiryIndexSize() * EXPIRY_INDEX_ENTRY_SIZE : 0;
     }
 
     /**
@@ -824,26 +1287,153 @@ public:
      */
     HashTableStatVisitor clear(bool deactivate = false);
 
+    /**
+     * Clear part of the hash table: the buckets from where the previous
+     * call stopped, until at least maxItems items are gone or the table
+     * is empty.
+     *
+     * This lets the table of a deleted vbucket, which nothing adds to
+     * anymore, be freed over many short runs of a task rather than in
+     * one long one.
+     *
+     * @param maxItems the number of items to free before returning
+     * @return true once the hash table is empty
+     */
+    bool clearSome(size_t maxItems);
+
+    /**
+     * Empty the table at once by handing everything in it over to a
+     * new table of the same shape, so that a flush doesn't wait for
+     * every item to be freed.  The caller frees the returned table,
+     * typically a chunk at a time with clearSome().
+     *
+     * @return the table now holding the items
+     */
+    HashTable *detach();
+
     /**
      * Get the number of times this hash table has been resized.
      */
     size_t getNumResizes() { return numResizes; }
 
+    /**
+     * Get the stats this hash table reports to.
+     */
+    EPStats &getEPStats() { return stats; }
+
+    /**
+     * Get a cas for a mutation of this hash table's vbucket.
+     */
+    uint64_t nextCas() {
+        return clock.nextCas();
+    }
+
+    /**
+     * Get the longest chain a lookup in this hash table has walked.
+     */
+    size_t getMaxChainWalked() const { return maxChainWalked.get(); }
+
+    /**
+     * Get the longest sampled bucket lock hold (in nanoseconds).
+     */
+    hrtime_t getMaxLockHold() const { return maxLockHold.get(); }
+
+    /**
+     * Get the average sampled bucket lock hold (in nanoseconds).
+     */
+    hrtime_t getAvgLockHold() const {
+        size_t n = lockHoldSamples.get();
+        return n == 0 ? 0 : lockHoldTime.get() / n;
+    }
+
     /**
      * Get the number of temp. items within this hash table.
      */
     size_t getNumTempItems(void) { return numTempItems; }
 
     /**
-     * Automatically resize to fit the current data.
+     * Get the memory of the temp items queued for reclaiming.
+     */
+    size_t getTempItemMemory(void) { return tempItemMemory; }
+
+    /**
+     * Queue a temp item whose metadata fetch completed (it's now a
+     * temp deleted or non-existent item) to be reclaimed once more than
+     * the most temp items the table keeps were queued after it.
+     *
+     * NOTE: This method should be called after acquiring the correct
+     *       bucket/partition lock.
+     */
+    void unlocked_queueTempItem(StoredValue *v);
+
+    /**
+     * Remove the oldest queued temp items until no more than the most
+     * the table keeps are left.  It takes the bucket locks, so none may
+     * be held.
+     *
+     * @return the number of temp items removed
+     */
+    size_t reclaimTempItems();
+
+    /**
+     * Automatically resize to fit the current data.  A table allowed to
+     * idle shrinks to the idle size once it holds no more than half as
+     * many items as that, and grows back as soon as it holds more.
      */
     void resize();
 
     /**
-     * Resize to the specified size.
+     * Let the table go down to the idle size while it holds next to
+     * nothing, or keep it at the configured size or larger.
+     */
+    void setIdleAllowed(bool to) {
+        idleAllowed = to;
+    }
+
+    /**
+     * True if the table is smaller than the configured size, to hold
+     * next to nothing.
+     */
+    bool isIdle() const {
+        return size < getMinSize();
+    }
+
+    /**
+     * Grow to the size that would fit the given number of items, so that
+     * loading them doesn't resize the table.  It never shrinks.
+     */
+    void reserve(size_t items);
+
+    /**
+     * Resize to the specified size (rounded up to a power of two in
+     * power-of-two mode).
+     *
+     * This only swaps in the new bucket array; items are moved over
+     * incrementally as their buckets are touched or by resizeStep().
+     * A resize already in progress is completed first.
      */
     void resize(size_t to);
 
+    /**
+     * Move up to the given number of buckets from the table being
+     * resized away from into the current one.
+     *
+     * @param maxBuckets the maximum number of old buckets to migrate
+     * @return true if a resize is still in progress after this step
+     */
+    bool resizeStep(size_t maxBuckets);
+
+    /**
+     * Finish any in-progress resize.
+     */
+    void completeResize();
+
+    /**
+     * True if a resize is in progress (i.e. old buckets still need to
+     * be migrated).
+     */
+    bool isResizing() { return oldValues != NULL; }
+
     /**
      * Find the item with the given key.
      *
@@ -875,6 +1465,7 @@ public:
         assert(v);
         values[bucket_num] = v;
         ++numItems;
+        checkIdleOverflow();
         if (op == queue_op_del) {
             unlocked_softDelete(v, itm.getCas());
         }
@@ -922,6 +1513,10 @@ public:
         if (!StoredValue::hasAvailableSpace(stats, itm)) {
             return NOMEM;
         }
+        if (hasMetaData) {
+            // A local write after this one has to win over it.
+            clock.observe(itm.getCas());
+        }
 
         mutation_type_t rv = NOT_FOUND;
 
@@ -946,6 +1541,10 @@ public:
             if (!allowExisting && !v->isTempItem()) {
                 return INVALID_CAS;
             }
+            if (v->isTempItem() && cas != 0) {
+                // There's nothing here to compare the cas with.
+                return NOT_FOUND;
+            }
             if (v->isLocked(ep_current_time())) {
                 /*
                  * item is locked, deny if there is cas value mismatch
@@ -967,7 +1566,7 @@ public:
             }
 
             if (!hasMetaData) {
-                itm.setCas();
+                itm.setCas(clock.nextCas());
             }
             rv = v->isClean() ? WAS_CLEAN : WAS_DIRTY;
             if (!v->isResident() && !v->isDeleted()) {
@@ -977,16 +1576,18 @@ public:
             if (nru <= MAX_NRU_VALUE) {
                 v->setNRUValue(nru);
             }
+            unlocked_indexExpiry(v);
         } else if (cas != 0) {
             rv = NOT_FOUND;
         } else {
             if (!hasMetaData) {
-                itm.setCas();
+                itm.setCas(clock.nextCas());
             }
             int bucket_num = getBucketForHash(hash(itm.getKey()));
             v = valFact(itm, values[bucket_num], *this);
             values[bucket_num] = v;
             ++numItems;
+            checkIdleOverflow();
             if (nru <= MAX_NRU_VALUE && !v->isTempItem()) {
                 v->setNRUValue(nru);
             }
@@ -999,6 +1600,7 @@ public:
             uint64_t seqno = getMaxDeletedRevSeqno() + 1;
             v->setRevSeqno(seqno);
             itm.setSeqno(seqno);
+            unlocked_indexExpiry(v);
             rv = WAS_CLEAN;
         }
         return rv;
@@ -1014,9 +1616,12 @@ public:
      * @param val the Item to insert
      * @param eject true if we should eject the value immediately
      * @param partial is this a complete item, or just the key and meta-data
+     * @param mustExist only store it over a key already in the table, as
+     *                  one that's gone was deleted since its key was loaded
      * @return a result indicating the status of the store
      */
-    mutation_type_t insert(Item &itm, bool eject, bool partial);
+    mutation_type_t insert(Item &itm, bool eject, bool partial,
+                           bool mustExist = false);
 
     /**
      * Add an item to the hash table iff it doesn't already exist.
@@ -1122,6 +1727,7 @@ public:
             rv = v->isClean() ? WAS_CLEAN : WAS_DIRTY;
             v->setRevSeqno(newRevSeqno);
             if (use_meta) {
+                clock.observe(newCas);
                 v->setCas(newCas);
                 v->setFlags(newFlags);
                 v->setExptime(newExptime);
@@ -1151,19 +1757,26 @@ public:
     StoredValue *unlocked_find(const std::string &key, int bucket_num,
                                bool wantsDeleted=false, bool trackReference=true) {
         StoredValue *v = values[bucket_num];
+        uint8_t tag = StoredValue::keyTag(key);
+        size_t walked = 0;
         while (v) {
-            if (v->hasKey(key)) {
-                if (trackReference && !v->isDeleted()) {
-                    v->referenced();
-                }
-                if (wantsDeleted || !v->isDeleted()) {
-                    return v;
-                } else {
-                    return NULL;
-                }
+            ++walked;
+            if (v->hasKey(key, tag)) {
+                break;
             }
             v = v->next;
         }
+        recordChainWalk(bucket_num, walked);
+
+        if (!v) {
+            return NULL;
+        }
+        if (trackReference && !v->isDeleted()) {
+            v->referenced();
+        }
+        if (wantsDeleted || !v->isDeleted()) {
+            return v;
+        }
         return NULL;
     }
 
@@ -1177,6 +1790,11 @@ public:
      */
     inline int hash(const char *str, const size_t len) {
         assert(isActive());
+        if (powerOfTwo) {
+            // Masking only looks at the low bits, so use a hash that
+            // mixes every input bit into them.
+            return static_cast<int>(murmurHash(str, len));
+        }
         int h=5381;
 
         for(size_t i=0; i < len; i++) {
@@ -1196,6 +1814,14 @@ public:
         return hash(s.data(), s.length());
     }
 
+    /**
+     * Compute a hash for the key of the given item.
+     */
+    inline int hash(const StoredValue *v) {
+        char key[256];
+        return hash(key, v->copyKey(key));
+    }
+
     /**
      * Get a lock holder holding a lock for the bucket for the given
      * hash.
@@ -1205,14 +1831,11 @@ public:
      * @return a locked LockHolder
      */
     inline LockHolder getLockedBucket(int h, int *bucket) {
-        while (true) {
-            assert(isActive());
-            *bucket = getBucketForHash(h);
-            LockHolder rv(mutexes[mutexForBucket(*bucket)]);
-            if (*bucket == getBucketForHash(h)) {
-                return rv;
-            }
-        }
+        OpTracer::mark(TRACE_EXECUTE);
+        LockHolder rv = lockBucket(h, bucket);
+        waitForReaders(mutexForBucket(*bucket));
+        OpTracer::mark(TRACE_HT_LOCK);
+        return rv;
     }
 
     /**
@@ -1240,6 +1863,102 @@ public:
         return getLockedBucket(hash(s.data(), s.size()), bucket);
     }
 
+    /**
+     * Get the lock the given key maps to right now.
+     *
+     * A resize may move the key to another lock until that lock is
+     * held, so this is only good for grouping keys before locking them
+     * with getLockedStripe().
+     */
+    int getLockForKey(const std::string &key) {
+        return mutexForBucket(getBucketForHash(hash(key)));
+    }
+
+    /**
+     * Lock the given lock stripe exclusively, for working on several
+     * of its keys with one acquisition (see unlocked_getBucketInStripe()).
+     *
+     * @param lock_num the lock to acquire
+     * @return a locked LockHolder
+     */
+    inline LockHolder getLockedStripe(int lock_num) {
+        assert(isActive());
+        assert(lock_num >= 0 && lock_num < static_cast<int>(n_locks));
+        LockHolder rv = acquireStripe(lock_num);
+        waitForReaders(lock_num);
+        return rv;
+    }
+
+    /**
+     * Find the bucket for the given key under a lock obtained from
+     * getLockedStripe(), pulling the key out of the old table if a
+     * resize is in progress.
+     *
+     * @param key the key
+     * @param lock_num the lock the caller holds
+     * @param bucket output parameter to receive the bucket
+     * @return false if the key doesn't belong to that lock (anymore)
+     */
+    bool unlocked_getBucketInStripe(const std::string &key, int lock_num,
+                                    int *bucket) {
+        int h = hash(key);
+        *bucket = getBucketForHash(h);
+        if (mutexForBucket(*bucket) != lock_num) {
+            return false;
+        }
+        if (oldValues) {
+            int old_bucket = bucketForHash(h, oldSize);
+            if (oldValues[old_bucket]) {
+                unlocked_migrate(old_bucket, lock_num);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Look up a resident, unexpired item without taking any locks.
+     *
+     * The bucket is read optimistically and the copy is only returned
+     * if its lock's version shows nobody modified the bucket while we
+     * were looking.  Anything else -- misses, items that need their
+     * NRU bits bumped, a resize in progress, a lookup that raced with
+     * a writer -- returns NULL and should go through the locked path.
+     *
+     * @param key the key to find
+     * @param vbucket the vbucket for the returned item
+     * @param trackReference true if the lookup counts as a reference
+     * @param bySeqno set to the item's by-sequence number
+     * @param nru set to the item's NRU value
+     * @return a copy of the item, or NULL
+     */
+    Item *lockFreeFind(const std::string &key, uint16_t vbucket,
+                       bool trackReference, int64_t &bySeqno, uint8_t &nru);
+
+    /**
+     * True if lookups may skip the bucket locks (see lockFreeFind()).
+     */
+    bool hasLockFreeReads() const { return lockFreeReads; }
+
+    /**
+     * Get a read hold on the bucket for the hash of the given key.
+     *
+     * Only lookups may be done under the returned holder; release it
+     * and use getLockedBucket() for anything that modifies the item
+     * or the bucket.
+     *
+     * @param s the key
+     * @param bucket output parameter to receive a bucket
+     * @return the holder of the read hold
+     */
+    inline BucketReaderHolder getReadLockedBucket(const std::string &s,
+                                                  int *bucket) {
+        OpTracer::mark(TRACE_EXECUTE);
+        LockHolder lh = lockBucket(hash(s.data(), s.size()), bucket);
+        BucketReaderHolder rv = shareLock(lh, mutexForBucket(*bucket));
+        OpTracer::mark(TRACE_HT_LOCK);
+        return rv;
+    }
+
     /**
      * Delete a key from the cache without trying to lock the cache first
      * (Please note that you <b>MUST</b> acquire the mutex before calling
@@ -1258,8 +1977,10 @@ public:
             return false;
         }
 
+        uint8_t tag = StoredValue::keyTag(key);
+
         // Special case the first one
-        if (v->hasKey(key)) {
+        if (v->hasKey(key, tag)) {
             if (!v->isDeleted() && v->isLocked(ep_current_time())) {
                 return false;
             }
@@ -1272,12 +1993,12 @@ public:
             } else {
                 --numItems;
             }
-            delete v;
+            retireStoredValue(v);
             return true;
         }
 
         while (v->next) {
-            if (v->next->hasKey(key)) {
+            if (v->next->hasKey(key, tag)) {
                 StoredValue *tmp = v->next;
                 if (!tmp->isDeleted() && tmp->isLocked(ep_current_time())) {
                     return false;
@@ -1291,7 +2012,7 @@ public:
                 } else {
                     --numItems;
                 }
-                delete tmp;
+                retireStoredValue(tmp);
                 return true;
             } else {
                 v = v->next;
@@ -1314,11 +2035,142 @@ public:
         return unlocked_del(key, bucket_num);
     }
 
+    /**
+     * Remove a clean item from memory altogether, leaving it only on
+     * disk (full eviction).  Dirty, deleted, temp and locked items
+     * stay.  In an ephemeral bucket nothing is ever clean, so dirty and
+     * deleted items are removed as well and the item is gone.
+     *
+     * @param key the key to evict
+     * @param bucket_num the locked partition where the key belongs
+     * @param ephemeral true if the item isn't on disk
+     * @return true if the item was removed
+     */
+    bool unlocked_evict(const std::string &key, int bucket_num,
+                        bool ephemeral = false);
+
     /**
      * Visit all items within this hashtable.
      */
     void visit(HashTableVisitor &visitor);
 
+    /**
+     * Visit all items within this hashtable like visit(), but call the
+     * visitor's visit() and shouldContinue() directly rather than
+     * through its vtable, so they're inlined into the walk of the table.
+     *
+     * V must be the visitor's own type, not a base of it, or the
+     * overrides of a subclass would be skipped.
+     */
+    template <typename V>
+    void visitInline(V &visitor) {
+        InlineVisitor<V> iv(visitor);
+        visitTable(iv);
+    }
+
+    /**
+     * Visit the items from the given position on, one lock's worth of
+     * buckets at a time, until the visitor's shouldContinue() says to
+     * stop or the whole table has been visited.
+     *
+     * If the table was resized since the position was taken, the
+     * visit starts over with the buckets of the lock it stopped at, so
+     * items that moved may be visited twice or not at all.
+     *
+     * @param visitor the visitor
+     * @param start where to start; Position() for the start of the table
+     * @return where to resume, endPosition() once everything was visited
+     */
+    Position pauseResumeVisit(HashTableVisitor &visitor,
+                              const Position &start);
+
+    /**
+     * Get the position pauseResumeVisit() returns once it's done.
+     */
+    Position endPosition() const {
+        return Position(size, static_cast<int>(n_locks),
+                        static_cast<int>(n_locks));
+    }
+
+    /**
+     * Visit buckets one at a time starting where the previous sweep
+     * stopped, until the visitor's shouldContinue() says it's seen
+     * enough or maxBuckets buckets have been visited.
+     *
+     * This lets a visitor that only needs part of the table (like the
+     * item pager, which stops once it freed what it came for) take
+     * time proportional to the work it does rather than to the size
+     * of the table, while still getting round to every bucket.
+     *
+     * @param visitor the visitor
+     * @param maxBuckets the most buckets to visit
+     * @return the number of buckets visited
+     */
+    size_t sweep(HashTableVisitor &visitor, size_t maxBuckets);
+
+    /**
+     * Sweep buckets like sweep(), calling the visitor directly as
+     * visitInline() does.
+     */
+    template <typename V>
+    size_t sweepInline(V &visitor, size_t maxBuckets) {
+        InlineVisitor<V> iv(visitor);
+        return sweepTable(iv, maxBuckets);
+    }
+
+    /**
+     * Move the long-lived items of up to maxBuckets buckets, and their
+     * values, to new allocations, starting where the last call stopped.
+     *
+     * Items the allocator kept in mostly empty spans since they were
+     * stored hold on to the whole span; a fresh allocation goes where
+     * the allocator has its fullest spans, so the emptied spans can be
+     * given back.  An item is only moved once a whole pass has gone by
+     * since it was stored or last moved, and dirty, deleted and temp
+     * items aren't moved at all, as they're soon replaced anyway.
+     *
+     * @param maxBuckets the most buckets to look at
+     * @return true if the pass over the table isn't done yet
+     */
+    bool defragment(size_t maxBuckets);
+
+    /**
+     * Remember when the expiry pager should look at the given item:
+     * when it expires, or on its next run for a temp item.
+     *
+     * An item already in the index isn't added again, even if its
+     * expiry time moved; visitExpiring() puts it back if it's not due
+     * yet when its entry comes up.
+     *
+     * The caller must hold the item's bucket lock.
+     */
+    void unlocked_indexExpiry(StoredValue *v) {
+        if (expiryIndex != NULL && !v->expiryIndexed) {
+            addToExpiryIndex(v);
+        }
+    }
+
+    /**
+     * Visit the items the expiry index has due before the given time,
+     * rather than every item in the table.  Items that turn out not to
+     * be due after all go back into the index.
+     *
+     * @param visitor the visitor
+     * @param asOf the time to find expired items by
+     * @return the number of items visited
+     */
+    size_t visitExpiring(HashTableVisitor &visitor, time_t asOf);
+
+    /**
+     * True if this hash table indexes items by expiry time.
+     */
+    bool hasExpiryIndex() const { return expiryIndex != NULL; }
+
+    /**
+     * Get the number of entries in the expiry index.
+     */
+    size_t getExpiryIndexSize();
+
     /**
      * Visit all items within this call with a depth visitor.
      */
@@ -1348,6 +2200,56 @@ public:
      */
     static void setDefaultNumLocks(size_t);
 
+    /**
+     * Set whether new hash tables use reader/writer bucket locks.
+     */
+    static void setDefaultRWLocks(bool);
+
+    /**
+     * Set the largest value new hash tables store inline.
+     */
+    static void setDefaultInlineValueSize(size_t);
+
+    /**
+     * Set the shortest key prefix new hash tables share between their
+     * items through the KeyPrefixTable, 0 for none.
+     */
+    static void setDefaultKeyPrefixMinLen(size_t);
+
+    /**
+     * Set whether new hash tables use power-of-two sizes (with a
+     * stronger hash) instead of prime sizes.
+     */
+    static void setDefaultPowerOfTwo(bool);
+
+    /**
+     * Set whether new hash tables allow lock-free lookups.  They only
+     * do if epoch reclamation is enabled, too.
+     */
+    static void setDefaultLockFreeReads(bool);
+
+    /**
+     * Set whether new hash tables index items by expiry time.
+     */
+    static void setDefaultExpiryIndex(bool);
+
+    /**
+     * Set the number of buckets of the tables that hold next to nothing,
+     * 0 to keep every table at the configured size or larger.
+     */
+    static void setDefaultIdleSize(size_t);
+
+    /**
+     * Set the most temp items of completed metadata fetches new tables
+     * keep, 0 to keep them until they expire or are paged out.
+     */
+    static void setDefaultMaxTempItems(size_t);
+
+    /**
+     * True if this hash table uses power-of-two sizes.
+     */
+    bool isPowerOfTwo() const { return powerOfTwo; }
+
     /**
      * Get the max deleted revision seqno seen so far.
      */
@@ -1381,12 +2283,352 @@ public:
 
 private:
     inline bool isActive() const { return activeState; }
+
+    /**
+     * Calls the visit() and shouldContinue() of a visitor of type V
+     * without going through its vtable.
+     */
+    template <typename V>
+    class InlineVisitor {
+    public:
+        InlineVisitor(V &v) : visitor(v) {}
+
+        void visit(StoredValue *v) {
+            visitor.V::visit(v);
+        }
+
+        bool shouldContinue() {
+            return visitor.V::shouldContinue();
+        }
+
+    private:
+        V &visitor;
+    };
+
+    //! Start loading the memory at the given address into the cache.
+    static inline void prefetch(const void *addr) {
+#ifdef __GNUC__
+        __builtin_prefetch(addr);
+#else
+        (void)addr;
+#endif
+    }
+
+    /**
+     * Pass the items of a bucket to a visitor.
+     *
+     * A chain is walked a pointer at a time, so each item would be a
+     * cache miss of its own; the item after the one being visited, the
+     * first item of the bucket visited next and the slot of the one
+     * after that are loaded into the cache while the visitor's busy.
+     * The next buckets may be under another lock, in which case a stale
+     * pointer only wastes the prefetch.
+     *
+     * @param visitor the visitor
+     * @param bucket the bucket to visit, whose lock is held
+     * @param stride how far on the next bucket to be visited is
+     */
+    template <typename V>
+    void visitChain(V &visitor, int bucket, int stride) {
+        int next = bucket + stride;
+        if (next < static_cast<int>(size)) {
+            prefetch(values[next]);
+            if (next + stride < static_cast<int>(size)) {
+                prefetch(&values[next + stride]);
+            }
+        }
+        for (StoredValue *v = values[bucket]; v; v = v->next) {
+            prefetch(v->next);
+            visitor.visit(v);
+        }
+    }
+
+    //! The walk of visit() and visitInline()
+    template <typename V>
+    void visitTable(V &visitor) {
+        if ((numItems.get() + numTempItems.get()) == 0 || !isActive()) {
+            return;
+        }
+        VisitorTracker vt(&visitors);
+        // Visit one table only; no new resize can start while we're here.
+        completeResize();
+        bool aborted = !visitor.shouldContinue();
+        size_t visited = 0;
+        for (int l = 0; isActive() && !aborted && l < static_cast<int>(n_locks); l++) {
+            LockHolder lh(mutexes[l]);
+            waitForReaders(l);
+            for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+                assert(l == mutexForBucket(i));
+                assert(values[i] == NULL ||
+                       i == getBucketForHash(hash(values[i])));
+                visitChain(visitor, i, static_cast<int>(n_locks));
+                ++visited;
+            }
+            lh.unlock();
+            aborted = !visitor.shouldContinue();
+        }
+        assert(aborted || visited == size);
+    }
+
+    //! The walk of sweep() and sweepInline()
+    template <typename V>
+    size_t sweepTable(V &visitor, size_t maxBuckets) {
+        if ((numItems.get() + numTempItems.get()) == 0 || !isActive()) {
+            return 0;
+        }
+        VisitorTracker vt(&visitors);
+        // As with visit(), no new resize can start while we're here, so
+        // the table (and the cursor into it) stays put.
+        completeResize();
+        size_t visited = 0;
+        size_t cursor = sweepCursor % size;
+        while (isActive() && visited < maxBuckets && visited < size &&
+               visitor.shouldContinue()) {
+            int lock_num = mutexForBucket(static_cast<int>(cursor));
+            LockHolder lh(mutexes[lock_num]);
+            waitForReaders(lock_num);
+            visitChain(visitor, static_cast<int>(cursor), 1);
+            lh.unlock();
+            cursor = (cursor + 1) % size;
+            ++visited;
+        }
+        sweepCursor = cursor;
+        return visited;
+    }
     inline void setActiveState(bool newv) { activeState = newv; }
 
+    /**
+     * Lock the bucket for the given hash exclusively, migrating it
+     * out of the old table if a resize is in progress.
+     *
+     * Readers of the stripe may still be active when this returns.
+     */
+    inline LockHolder lockBucket(int h, int *bucket) {
+        while (true) {
+            assert(isActive());
+            *bucket = getBucketForHash(h);
+            int lock_num = mutexForBucket(*bucket);
+            LockHolder rv = acquireStripe(lock_num);
+            if (*bucket == getBucketForHash(h)) {
+                if (oldValues) {
+                    // Pull this key (and its lock mates) out of the
+                    // table we're resizing away from.
+                    int old_bucket = bucketForHash(h, oldSize);
+                    if (oldValues[old_bucket]) {
+                        waitForReaders(lock_num);
+                        unlocked_migrate(old_bucket, lock_num);
+                    }
+                }
+                return rv;
+            }
+        }
+    }
+
+    /**
+     * Lock mutexes[lock_num], timing the wait and the hold every so
+     * often.
+     */
+    inline LockHolder acquireStripe(int lock_num) {
+        // Racy peek; it only decides whether this one gets timed.
+        bool sample = isSampled(stripeTimings[lock_num].acquisitions);
+        hrtime_t start = sample ? gethrtime() : 0;
+        LockHolder rv(mutexes[lock_num]);
+        ++stripeTimings[lock_num].acquisitions;
+        if (sample) {
+            startHoldTimer(lock_num, start);
+        }
+        return rv;
+    }
+
+    static inline bool isSampled(size_t count) {
+        return (count & (HT_STATS_SAMPLE_RATE - 1)) == 0;
+    }
+
+    /**
+     * Record the wait for mutexes[lock_num], which the caller just got
+     * after asking for it at the given time, and time how long it's
+     * held.
+     */
+    void startHoldTimer(int lock_num, hrtime_t asked);
+
+    void holdReleased(Mutex &m);
+
+    /**
+     * Note the length of a chain a lookup in the given (locked)
+     * bucket walked.
+     */
+    inline void recordChainWalk(int bucket_num, size_t walked) {
+        if (walked > maxChainWalked.get()) {
+            maxChainWalked.setIfBigger(walked);
+        }
+        // Shared readers bump this racily; it only picks samples.
+        StripeTimings &st = stripeTimings[mutexForBucket(bucket_num)];
+        if (isSampled(st.lookups++)) {
+            stats.htChainLengthHisto.add(walked);
+        }
+    }
+
+    /**
+     * Wait for all readers of the given stripe to go away.
+     *
+     * The caller must hold mutexes[lock_num], which keeps new ones out.
+     */
+    inline void waitForReaders(int lock_num) {
+        if (readers) {
+            while (readers[lock_num].get() > 0) {
+                sched_yield();
+            }
+        }
+    }
+
+    /**
+     * Wait for the readers of every stripe to go away.
+     *
+     * The caller must hold all the locks in mutexes.
+     */
+    void waitForAllReaders() {
+        for (int i = 0; readers && i < static_cast<int>(n_locks); ++i) {
+            waitForReaders(i);
+        }
+    }
+
+    /**
+     * Turn an exclusive hold on mutexes[lock_num] into a read hold.
+     */
+    inline BucketReaderHolder shareLock(LockHolder &lh, int lock_num) {
+        if (!readers) {
+            return BucketReaderHolder(lh, NULL);
+        }
+        ++readers[lock_num];
+        lh.unlock();
+        return BucketReaderHolder(lh, &readers[lock_num]);
+    }
+
+    /**
+     * Free an unlinked StoredValue once no lock-free reader can be
+     * looking at it.
+     */
+    static void retireStoredValue(StoredValue *v);
+
+    //! Free a bucket array once no lock-free reader can see it.
+    static void retireBucketArray(StoredValue **v);
+
+    //! Count the given n_locks locks as the hash table locks
+    void setLockProfiles(Mutex *locks) {
+        LockProfiler *profile = LockProfiler::get("ht_locks");
+        for (size_t i = 0; i < n_locks; ++i) {
+            locks[i].setProfile(profile);
+        }
+    }
+
+    /**
+     * Move every item in the given old bucket that maps to a bucket
+     * guarded by the given lock into the current table.
+     *
+     * The caller must hold mutexes[lock_num].
+     */
+    void unlocked_migrate(int old_bucket, int lock_num);
+
+    /**
+     * Migrate up to maxBuckets old buckets, releasing the old table
+     * once it's empty.
+     *
+     * The caller must hold resizeMutex.
+     *
+     * @return true if a resize is still in progress
+     */
+    bool migrateBuckets(size_t maxBuckets);
+
+    //! The size resize() picks for the given number of items
+    size_t sizeFor(size_t ni) const;
+
+    //! The smallest size of a table that isn't idle
+    size_t getMinSize() const {
+        return powerOfTwo ? nextPowerOfTwo(defaultNumBuckets)
+                          : defaultNumBuckets;
+    }
+
+    /**
+     * Ask the resizer to come soon when an item added to an idle table
+     * takes it past one item per bucket.
+     */
+    void checkIdleOverflow() {
+        if (numItems.get() > size && isIdle() && !stats.htGrowPending.get()) {
+            stats.htGrowPending.set(true);
+        }
+    }
+
+    /**
+     * Release the old table once all of its buckets are migrated.
+     *
+     * The caller must hold resizeMutex and every lock in mutexes.
+     */
+    void finishResize();
+
+    void clearTempItemQueue();
+
+    void addToExpiryIndex(StoredValue *v);
+
     size_t               size;
     size_t               n_locks;
     StoredValue        **values;
     Mutex               *mutexes;
+    //! Per-stripe count of shared holders (NULL without RW locks).
+    Atomic<size_t>      *readers;
+    //! Table we're incrementally resizing away from (NULL if none).
+    size_t               oldSize;
+    StoredValue        **oldValues;
+    Mutex               *oldMutexes;
+    //! Next old bucket for resizeStep() to migrate.
+    size_t               resizeCursor;
+    //! Serializes resize start, stepping and completion.
+    Mutex                resizeMutex;
+    //! Odd while size and values are being swapped by a resize.
+    volatile size_t      tableVersion;
+    //! Lookups may skip the bucket locks.
+    bool                 lockFreeReads;
+
+    //! Keys of items that may expire, by expiry time (in seconds).
+    typedef std::map<uint32_t, std::vector<std::string> > ExpiryIndex;
+
+    //! NULL unless the expiry index is enabled.
+    ExpiryIndex         *expiryIndex;
+    size_t               expiryIndexEntries;
+    //! Guards expiryIndex and expiryIndexEntries.
+    Mutex                expiryIndexLock;
+
+    //! The keys of the temp items of completed metadata fetches, oldest
+    //! first, with the memory they had when queued.  Keys of temp items
+    //! that went away or became regular items are skipped when reached.
+    std::deque<std::pair<std::string, size_t> > tempItemQueue;
+    //! The most entries tempItemQueue keeps, 0 for no queue.
+    size_t               maxTempItems;
+    Atomic<size_t>       tempItemMemory;
+    //! Guards tempItemQueue; taken under the bucket locks, never
+    //! the other way round.
+    Mutex                tempItemLock;
+
+    //! Per-stripe bookkeeping for the sampled lock and chain stats.
+    struct StripeTimings {
+        StripeTimings() : acquisitions(0), lookups(0), heldSince(0) { }
+        size_t   acquisitions;
+        size_t   lookups;
+        hrtime_t heldSince;
+    };
+
+    StripeTimings       *stripeTimings;
+    //! Where the next sweep() starts.
+    size_t               sweepCursor;
+    //! Where the next clearSome() starts.
+    size_t               clearCursor;
+    //! Where the next defragment() starts.
+    size_t               defragCursor;
+    Atomic<size_t>       maxChainWalked;
+    Atomic<hrtime_t>     maxLockHold;
+    Atomic<hrtime_t>     lockHoldTime;
+    Atomic<size_t>       lockHoldSamples;
+    //! The vbucket's clock
+    HybridLogicalClock   clock;
     EPStats&             stats;
     StoredValueFactory   valFact;
     Atomic<size_t>       visitors;
@@ -1394,23 +2636,109 @@ private:
     Atomic<size_t>       numResizes;
     Atomic<size_t>       numTempItems;
     bool                 activeState;
+    //! The buckets were taken over from another table by detach()
+    bool                 detached;
+    //! Mask (rather than mod) buckets and locks; sizes are powers of two.
+    bool                 powerOfTwo;
+    //! The size of the table while it's idle, 0 if it never idles
+    size_t               idleSize;
+    //! The table may shrink to idleSize
+    volatile bool        idleAllowed;
 
     static size_t                 defaultNumBuckets;
     static size_t                 defaultNumLocks;
+    static bool                   defaultRWLocks;
+    static size_t                 defaultInlineValueSize;
+    static size_t                 defaultKeyPrefixMinLen;
+    static bool                   defaultPowerOfTwo;
+    static bool                   defaultLockFreeReads;
+    static bool                   defaultExpiryIndex;
+    static size_t                 defaultIdleSize;
+    static size_t                 defaultMaxTempItems;
+
+    inline int bucketForHash(int h, size_t sz) {
+        if (powerOfTwo) {
+            return static_cast<int>(static_cast<unsigned int>(h) & (sz - 1));
+        }
+        return abs(h % static_cast<int>(sz));
+    }
 
     int getBucketForHash(int h) {
-        return abs(h % static_cast<int>(size));
+        return bucketForHash(h, size);
     }
 
     inline int mutexForBucket(int bucket_num) {
         assert(isActive());
         assert(bucket_num >= 0);
-        int lock_num = bucket_num % static_cast<int>(n_locks);
+        int lock_num = powerOfTwo
+            ? bucket_num & static_cast<int>(n_locks - 1)
+            : bucket_num % static_cast<int>(n_locks);
         assert(lock_num < static_cast<int>(n_locks));
         assert(lock_num >= 0);
         return lock_num;
     }
 
+    /**
+     * MurmurHash3 (x86, 32-bit) of the given bytes.
+     */
+    static inline uint32_t murmurHash(const char *str, const size_t len) {
+        const uint32_t c1 = 0xcc9e2d51;
+        const uint32_t c2 = 0x1b873593;
+        const unsigned char *data = reinterpret_cast<const unsigned char*>(str);
+        const size_t nblocks = len / 4;
+        uint32_t h = 0;
+
+        for (size_t i = 0; i < nblocks; ++i) {
+            uint32_t k;
+            std::memcpy(&k, data + (i * 4), sizeof(k));
+            k *= c1;
+            k = (k << 15) | (k >> 17);
+            k *= c2;
+            h ^= k;
+            h = (h << 13) | (h >> 19);
+            h = h * 5 + 0xe6546b64;
+        }
+
+        const unsigned char *tail = data + (nblocks * 4);
+        uint32_t k = 0;
+        switch (len & 3) {
+        case 3:
+            k ^= static_cast<uint32_t>(tail[2]) << 16;
+            // FALLTHROUGH
+        case 2:
+            k ^= static_cast<uint32_t>(tail[1]) << 8;
+            // FALLTHROUGH
+        case 1:
+            k ^= tail[0];
+            k *= c1;
+            k = (k << 15) | (k >> 17);
+            k *= c2;
+            h ^= k;
+        }
+
+        h ^= static_cast<uint32_t>(len);
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        h ^= h >> 16;
+        return h;
+    }
+
+    /**
+     * Round up to the next power of two.
+     */
+    static size_t nextPowerOfTwo(size_t n) {
+        size_t rv = 1;
+        while (rv < n) {
+            rv <<= 1;
+        }
+        return rv;
+    }
+
+    // Restoring an evicted item turns a temp item into a regular one.
+    friend class StoredValue;
+
     DISALLOW_COPY_AND_ASSIGN(HashTable);
 };
 
@@ -0,0 +1,472 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <limits>
+#include <sstream>
+#include <vector>
+
+#include "subdoc.h"
+
+/*
+ * A scanner of JSON text, which only finds where its values start and end.
+ * Nothing is decoded, so nothing's lost by writing the text back out.
+ */
+
+static bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static void skipWs(const char *d, size_t n, size_t &p) {
+    while (p < n && (d[p] == ' ' || d[p] == '\t' ||
+                     d[p] == '\n' || d[p] == '\r')) {
+        ++p;
+    }
+}
+
+static bool skipString(const char *d, size_t n, size_t &p) {
+    for (++p; p < n; ++p) {
+        unsigned char c = static_cast<unsigned char>(d[p]);
+        if (c == '"') {
+            ++p;
+            return true;
+        } else if (c < 0x20) {
+            return false;
+        } else if (c == '\\') {
+            if (++p == n) {
+                return false;
+            }
+            if (d[p] == 'u') {
+                for (int i = 0; i < 4; ++i) {
+                    if (++p == n || !isxdigit(static_cast<unsigned char>(d[p]))) {
+                        return false;
+                    }
+                }
+            } else if (strchr("\"\\/bfnrt", d[p]) == NULL || d[p] == '\0') {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+static bool skipDigits(const char *d, size_t n, size_t &p) {
+    if (p == n || !isDigit(d[p])) {
+        return false;
+    }
+    while (p < n && isDigit(d[p])) {
+        ++p;
+    }
+    return true;
+}
+
+static bool skipNumber(const char *d, size_t n, size_t &p, bool &isInteger) {
+    isInteger = true;
+    if (p < n && d[p] == '-') {
+        ++p;
+    }
+    if (p < n && d[p] == '0') {
+        ++p;
+    } else if (!skipDigits(d, n, p)) {
+        return false;
+    }
+    if (p < n && d[p] == '.') {
+        isInteger = false;
+        if (!skipDigits(d, n, ++p)) {
+            return false;
+        }
+    }
+    if (p < n && (d[p] == 'e' || d[p] == 'E')) {
+        isInteger = false;
+        if (++p < n && (d[p] == '+' || d[p] == '-')) {
+            ++p;
+        }
+        if (!skipDigits(d, n, p)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool skipLiteral(const char *d, size_t n, size_t &p, const char *lit) {
+    size_t len = strlen(lit);
+    if (n - p < len || memcmp(d + p, lit, len) != 0) {
+        return false;
+    }
+    p += len;
+    return true;
+}
+
+static subdoc_status_t skipValue(const char *d, size_t n, size_t &p,
+                                 int depth) {
+    if (depth > SubdocOp::MAX_DEPTH) {
+        return SUBDOC_DOC_ETOODEEP;
+    }
+    if (p == n) {
+        return SUBDOC_DOC_NOTJSON;
+    }
+
+    bool isInteger;
+    switch (d[p]) {
+    case '{':
+    case '[':
+        {
+            char close = d[p] == '{' ? '}' : ']';
+            bool object = close == '}';
+            ++p;
+            skipWs(d, n, p);
+            if (p < n && d[p] == close) {
+                ++p;
+                return SUBDOC_SUCCESS;
+            }
+            for (;;) {
+                if (object) {
+                    if (p == n || d[p] != '"' || !skipString(d, n, p)) {
+                        return SUBDOC_DOC_NOTJSON;
+                    }
+                    skipWs(d, n, p);
+                    if (p == n || d[p] != ':') {
+                        return SUBDOC_DOC_NOTJSON;
+                    }
+                    ++p;
+                    skipWs(d, n, p);
+                }
+                subdoc_status_t rv = skipValue(d, n, p, depth + 1);
+                if (rv != SUBDOC_SUCCESS) {
+                    return rv;
+                }
+                skipWs(d, n, p);
+                if (p < n && d[p] == ',') {
+                    ++p;
+                    skipWs(d, n, p);
+                } else if (p < n && d[p] == close) {
+                    ++p;
+                    return SUBDOC_SUCCESS;
+                } else {
+                    return SUBDOC_DOC_NOTJSON;
+                }
+            }
+        }
+    case '"':
+        return skipString(d, n, p) ? SUBDOC_SUCCESS : SUBDOC_DOC_NOTJSON;
+    case 't':
+        return skipLiteral(d, n, p, "true") ? SUBDOC_SUCCESS : SUBDOC_DOC_NOTJSON;
+    case 'f':
+        return skipLiteral(d, n, p, "false") ? SUBDOC_SUCCESS : SUBDOC_DOC_NOTJSON;
+    case 'n':
+        return skipLiteral(d, n, p, "null") ? SUBDOC_SUCCESS : SUBDOC_DOC_NOTJSON;
+    default:
+        return skipNumber(d, n, p, isInteger) ? SUBDOC_SUCCESS : SUBDOC_DOC_NOTJSON;
+    }
+}
+
+/*
+ * Check that a text is one JSON value, with nothing but whitespace around
+ * it, telling where the value is.
+ */
+static subdoc_status_t checkJSON(const char *d, size_t n, size_t &start,
+                                 size_t &end) {
+    size_t p = 0;
+    skipWs(d, n, p);
+    start = p;
+    subdoc_status_t rv = skipValue(d, n, p, 0);
+    if (rv != SUBDOC_SUCCESS) {
+        return rv;
+    }
+    end = p;
+    skipWs(d, n, p);
+    return p == n ? SUBDOC_SUCCESS : SUBDOC_DOC_NOTJSON;
+}
+
+static bool parseInt64(const std::string &s, int64_t &v) {
+    if (s.empty() || s.length() > 20 || (s[0] != '-' && !isDigit(s[0]))) {
+        return false;
+    }
+    for (size_t i = 1; i < s.length(); ++i) {
+        if (!isDigit(s[i])) {
+            return false;
+        }
+    }
+    errno = 0;
+    char *end;
+    long long l = strtoll(s.c_str(), &end, 10);
+    if (errno == ERANGE || *end != '\0' || end == s.c_str()) {
+        return false;
+    }
+    v = static_cast<int64_t>(l);
+    return true;
+}
+
+/**
+ * A member name or an array index of a path.
+ */
+struct PathComponent {
+    PathComponent() : index(0), isIndex(false) { }
+
+    std::string name;
+    int64_t index;
+    bool isIndex;
+};
+
+static bool parsePath(const std::string &path,
+                      std::vector<PathComponent> &components) {
+    size_t i = 0;
+    while (i < path.length()) {
+        PathComponent c;
+        if (path[i] == '[') {
+            size_t close = path.find(']', i);
+            if (close == std::string::npos) {
+                return false;
+            }
+            std::string index(path.substr(i + 1, close - i - 1));
+            if (!parseInt64(index, c.index) || c.index < -1) {
+                return false;
+            }
+            c.isIndex = true;
+            i = close + 1;
+        } else {
+            size_t stop = path.find_first_of(".[", i);
+            if (stop == std::string::npos) {
+                stop = path.length();
+            }
+            c.name = path.substr(i, stop - i);
+            if (c.name.empty()) {
+                return false;
+            }
+            i = stop;
+        }
+        components.push_back(c);
+
+        if (i < path.length() && path[i] == '.') {
+            if (++i == path.length() || path[i] == '.' || path[i] == '[') {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Find the value at a path of a valid document.  If only the path's last
+ * component is missing, lastMissing is set and [start, end) is its
+ * container.
+ */
+static subdoc_status_t locate(const char *d, size_t n,
+                              const std::vector<PathComponent> &components,
+                              size_t &start, size_t &end, bool &lastMissing) {
+    lastMissing = false;
+    for (size_t i = 0; i < components.size(); ++i) {
+        const PathComponent &c = components[i];
+        bool isIndex = c.isIndex;
+        if (d[start] != (isIndex ? '[' : '{')) {
+            return SUBDOC_PATH_MISMATCH;
+        }
+
+        bool found = false;
+        size_t p = start + 1;
+        size_t lastStart = 0, lastEnd = 0;
+        int64_t k = 0;
+        skipWs(d, n, p);
+        while (!found && d[p] != (isIndex ? ']' : '}')) {
+            bool match;
+            if (isIndex) {
+                match = k++ == c.index;
+            } else {
+                size_t keyStart = p;
+                skipString(d, n, p);
+                match = p - keyStart - 2 == c.name.length() &&
+                    memcmp(d + keyStart + 1, c.name.data(),
+                           c.name.length()) == 0;
+                skipWs(d, n, p);
+                ++p;
+                skipWs(d, n, p);
+            }
+            lastStart = p;
+            skipValue(d, n, p, 0);
+            lastEnd = p;
+            found = match;
+            skipWs(d, n, p);
+            if (d[p] == ',') {
+                ++p;
+                skipWs(d, n, p);
+            }
+        }
+        if (!found && isIndex && c.index == -1 && lastEnd != 0) {
+            found = true;
+        }
+        if (!found) {
+            lastMissing = i + 1 == components.size();
+            return SUBDOC_PATH_ENOENT;
+        }
+        start = lastStart;
+        end = lastEnd;
+    }
+    return SUBDOC_SUCCESS;
+}
+
+//! Tell if the container at [start, end) has nothing in it
+static bool isEmptyContainer(const char *d, size_t start, size_t end) {
+    size_t p = start + 1;
+    skipWs(d, end, p);
+    return p == end - 1;
+}
+
+subdoc_status_t SubdocOp::apply(const char *doc, size_t len,
+                                std::string &out) {
+    if (op == SUBDOC_PATCH) {
+        if (offset > len) {
+            return SUBDOC_EINVAL;
+        }
+        out.assign(doc, offset);
+        out.append(value);
+        if (offset + value.length() < len) {
+            out.append(doc + offset + value.length(),
+                       len - offset - value.length());
+        }
+        return SUBDOC_SUCCESS;
+    }
+
+    std::vector<PathComponent> components;
+    if ((op != SUBDOC_REPLACE && op != SUBDOC_COUNTER &&
+         op != SUBDOC_ARRAY_APPEND) || !parsePath(path, components)) {
+        return SUBDOC_EINVAL;
+    }
+
+    int64_t delta = 0;
+    size_t vstart = 0, vend = 0;
+    if (op == SUBDOC_COUNTER) {
+        if (!parseInt64(value, delta)) {
+            return SUBDOC_EINVAL;
+        }
+    } else if (checkJSON(value.data(), value.length(), vstart, vend) !=
+               SUBDOC_SUCCESS) {
+        return SUBDOC_VALUE_NOTJSON;
+    }
+
+    size_t start, end;
+    subdoc_status_t rv = checkJSON(doc, len, start, end);
+    if (rv != SUBDOC_SUCCESS) {
+        return rv;
+    }
+
+    bool lastMissing;
+    rv = locate(doc, len, components, start, end, lastMissing);
+
+    std::string insert;
+    switch (op) {
+    case SUBDOC_REPLACE:
+        if (rv != SUBDOC_SUCCESS) {
+            return rv;
+        }
+        insert.assign(value, vstart, vend - vstart);
+        break;
+    case SUBDOC_ARRAY_APPEND:
+        if (rv != SUBDOC_SUCCESS) {
+            return rv;
+        }
+        if (doc[start] != '[') {
+            return SUBDOC_PATH_MISMATCH;
+        }
+        if (!isEmptyContainer(doc, start, end)) {
+            insert.assign(",");
+        }
+        insert.append(value, vstart, vend - vstart);
+        // Into the array, before its ']'.
+        start = end = end - 1;
+        break;
+    case SUBDOC_COUNTER:
+        if (rv == SUBDOC_PATH_ENOENT && lastMissing &&
+            !components.back().isIndex) {
+            // A missing counter is created in its object, under a name
+            // that needs no escaping.
+            const std::string &name = components.back().name;
+            for (size_t i = 0; i < name.length(); ++i) {
+                if (name[i] == '"' || name[i] == '\\' ||
+                    static_cast<unsigned char>(name[i]) < 0x20) {
+                    return SUBDOC_EINVAL;
+                }
+            }
+            counter = delta;
+            std::stringstream ss;
+            if (!isEmptyContainer(doc, start, end)) {
+                ss << ",";
+            }
+            ss << "\"" << components.back().name << "\":" << counter;
+            insert = ss.str();
+            start = end = end - 1;
+            break;
+        }
+        if (rv != SUBDOC_SUCCESS) {
+            return rv;
+        }
+        {
+            size_t p = start;
+            bool isInteger = false;
+            int64_t current;
+            if (doc[start] == '"' || doc[start] == '{' || doc[start] == '[' ||
+                !skipNumber(doc, end, p, isInteger) || !isInteger) {
+                return SUBDOC_PATH_MISMATCH;
+            }
+            if (!parseInt64(std::string(doc + start, end - start), current)) {
+                return SUBDOC_DELTA_ERANGE;
+            }
+            if ((delta > 0 &&
+                 current > std::numeric_limits<int64_t>::max() - delta) ||
+                (delta < 0 &&
+                 current < std::numeric_limits<int64_t>::min() - delta)) {
+                return SUBDOC_DELTA_ERANGE;
+            }
+            counter = current + delta;
+            std::stringstream ss;
+            ss << counter;
+            insert = ss.str();
+        }
+        break;
+    }
+
+    out.reserve(len - (end - start) + insert.length());
+    out.assign(doc, start);
+    out.append(insert);
+    out.append(doc + end, len - end);
+    return SUBDOC_SUCCESS;
+}
+
+const char *SubdocOp::statusMessage(subdoc_status_t status) {
+    switch (status) {
+    case SUBDOC_SUCCESS:
+        return "SUCCESS";
+    case SUBDOC_EINVAL:
+        return "Invalid subdoc op, path or offset";
+    case SUBDOC_PATH_ENOENT:
+        return "PATH_ENOENT";
+    case SUBDOC_PATH_MISMATCH:
+        return "PATH_MISMATCH";
+    case SUBDOC_DOC_NOTJSON:
+        return "DOC_NOTJSON";
+    case SUBDOC_DOC_ETOODEEP:
+        return "DOC_ETOODEEP";
+    case SUBDOC_VALUE_NOTJSON:
+        return "VALUE_NOTJSON";
+    case SUBDOC_DELTA_ERANGE:
+        return "DELTA_ERANGE";
+    }
+    return "Unknown subdoc status";
+}
@@ -0,0 +1,99 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_SUBDOC_H_
+#define SRC_SUBDOC_H_ 1
+
+#include "config.h"
+
+#include <string>
+
+#include "common.h"
+#include "ep-engine/command_ids.h"
+
+enum subdoc_status_t {
+    SUBDOC_SUCCESS,
+    SUBDOC_EINVAL,              //!< The op, path or offset is no good
+    SUBDOC_PATH_ENOENT,         //!< Nothing's at the path
+    SUBDOC_PATH_MISMATCH,       //!< The path goes through the wrong type
+    SUBDOC_DOC_NOTJSON,         //!< The document isn't JSON
+    SUBDOC_DOC_ETOODEEP,        //!< The document nests too deep to walk
+    SUBDOC_VALUE_NOTJSON,       //!< The value to put in isn't JSON
+    SUBDOC_DELTA_ERANGE         //!< The counter would overflow
+};
+
+/**
+ * A mutation of a part of a document, applied to the bytes of its value.
+ *
+ * A path is the names of the object members and the [n] indexes of the
+ * array elements to go through from the document's root, as in
+ * "users[2].name"; [-1] is an array's last element, and an empty path is
+ * the root.  Member names are matched as they're written in the document.
+ *
+ * Only the bytes of the part mutated change: the new value is spliced
+ * into the old, so the rest of the document keeps its formatting and the
+ * exact text of its numbers.
+ */
+class SubdocOp {
+public:
+    //! The most levels of nesting walked
+    static const int MAX_DEPTH = 64;
+
+    /**
+     * @param o the op, one of the SUBDOC_* of CMD_SUBDOC
+     * @param p the path, ignored by SUBDOC_PATCH
+     * @param val the bytes to patch in, the JSON value to put in, or the
+     *            counter's delta as a decimal integer
+     * @param off where SUBDOC_PATCH puts them
+     */
+    SubdocOp(uint8_t o, const std::string &p, const std::string &val,
+             uint32_t off = 0) :
+        op(o), path(p), value(val), offset(off), counter(0) { }
+
+    /**
+     * Apply the op to a document.
+     *
+     * @param doc the document's bytes
+     * @param len its length
+     * @param out the mutated document
+     * @return SUBDOC_SUCCESS, or why the op couldn't be applied
+     */
+    subdoc_status_t apply(const char *doc, size_t len, std::string &out);
+
+    uint8_t getOp() const {
+        return op;
+    }
+
+    //! The value of a SUBDOC_COUNTER's integer once it's applied
+    int64_t getCounter() const {
+        return counter;
+    }
+
+    //! The error message sent for a status
+    static const char *statusMessage(subdoc_status_t status);
+
+private:
+    uint8_t op;
+    std::string path;
+    std::string value;
+    uint32_t offset;
+    int64_t counter;
+
+    DISALLOW_COPY_AND_ASSIGN(SubdocOp);
+};
+
+#endif  // SRC_SUBDOC_H_
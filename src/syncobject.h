@@ -63,10 +63,15 @@ public:
     }
 
     void wait() {
+        // The lock is given up while waiting; keep the version in step.
+        holdPaused();
+        ++version;
         if (pthread_cond_wait(&cond, &mutex) != 0) {
             throw std::runtime_error("Failed to wait for condition.");
         }
+        ++version;
         setHolder(true);
+        holdResumed();
     }
 
     bool wait(const struct timeval &tv) {
@@ -74,7 +79,12 @@ public:
         ts.tv_sec = tv.tv_sec + 0;
         ts.tv_nsec = tv.tv_usec * 1000;
 
-        switch (pthread_cond_timedwait(&cond, &mutex, &ts)) {
+        holdPaused();
+        ++version;
+        int rv = pthread_cond_timedwait(&cond, &mutex, &ts);
+        ++version;
+        holdResumed();
+        switch (rv) {
         case 0:
             setHolder(true);
             return true;
@@ -0,0 +1,336 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <set>
+
+#include "ep_engine.h"
+#include "iomanager/iomanager.h"
+#include "tapapplier.h"
+#include "tapconnection.h"
+
+const size_t TapApplier::opsPerRun = 1000;
+const double TapApplier::sleepInterval = 1.0;
+
+TapApplier::TapApplier(EventuallyPersistentEngine &e, size_t numShards) :
+    engine(e), stats(e.getEpStats()), stopped(false)
+{
+    assert(numShards > 0);
+    for (size_t i = 0; i < numShards; ++i) {
+        shards.push_back(new Shard());
+    }
+}
+
+TapApplier::~TapApplier() {
+    std::vector<Shard*>::iterator it = shards.begin();
+    for (; it != shards.end(); ++it) {
+        assert((*it)->ops.empty());
+        delete *it;
+    }
+}
+
+void TapApplier::start() {
+    for (size_t i = 0; i < shards.size(); ++i) {
+        IOManager::get()->scheduleTapApply(&engine, this,
+                                           Priority::TapApplyPriority, i);
+        assert(shards[i]->taskId > 0);
+    }
+}
+
+void TapApplier::stop() {
+    stopped.set(true);
+    std::vector<Shard*>::iterator it = shards.begin();
+    for (; it != shards.end(); ++it) {
+        IOManager::get()->cancel((*it)->taskId);
+    }
+
+    size_t dropped = 0;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        // Wait for a run already applying ops to be done with them.
+        LockHolder alh((*it)->applyLock);
+        LockHolder lh((*it)->queueLock);
+        std::deque<TapApplyOp*>::iterator op = (*it)->ops.begin();
+        for (; op != (*it)->ops.end(); ++op) {
+            drop(*op);
+            ++dropped;
+        }
+        (*it)->ops.clear();
+    }
+    if (dropped > 0) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Dropped %ld incoming tap mutations that were not applied yet\n",
+            dropped);
+    }
+}
+
+void TapApplier::queue(TapApplyOp *op) {
+    Shard &s = shardOf(op->itm->getVBucketId());
+    {
+        LockHolder lh(s.queueLock);
+        if (stopped.get()) {
+            drop(op);
+            return;
+        }
+        s.ops.push_back(op);
+    }
+    stats.tapApplyQueueSize.incr(1);
+    if (s.pending.cas(false, true)) {
+        IOManager::get()->wake(s.taskId);
+    }
+}
+
+bool TapApplier::drain(uint16_t vbucket) {
+    return drainShard(shardOf(vbucket));
+}
+
+bool TapApplier::drainAll() {
+    bool rv = true;
+    std::vector<Shard*>::iterator it = shards.begin();
+    for (; it != shards.end() && rv; ++it) {
+        rv = drainShard(**it);
+    }
+    return rv;
+}
+
+bool TapApplier::drainShard(Shard &s) {
+    size_t queued;
+    {
+        LockHolder lh(s.queueLock);
+        queued = s.ops.size();
+    }
+    if (queued == 0) {
+        return true;
+    }
+    // Only what's already there: other connections may keep adding.
+    LockHolder alh(s.applyLock);
+    return applyOps(s, queued);
+}
+
+bool TapApplier::run(size_t shardId, size_t tid) {
+    Shard &s = *shards[shardId];
+    // Held until we're done with the shard, so stop() can wait for us.
+    LockHolder alh(s.applyLock);
+    if (stopped.get()) {
+        return false;
+    }
+    s.pending.cas(true, false);
+
+    double sleep = sleepInterval;
+    if (!applyOps(s, opsPerRun)) {
+        // Give the pager and the flusher time to make room.
+        sleep = engine.getTapConfig().getRequeueSleepTime();
+    } else if (hasOps(s)) {
+        sleep = 0;
+    }
+    IOManager::get()->snooze(tid, sleep);
+
+    if (sleep == sleepInterval && s.pending.get()) {
+        // check again a new op could have been queued right before
+        // calling above snooze()
+        IOManager::get()->snooze(tid, 0);
+    }
+    return true;
+}
+
+static bool mustRetry(ENGINE_ERROR_CODE ret) {
+    return ret == ENGINE_ENOMEM || ret == ENGINE_TMPFAIL ||
+        ret == ENGINE_EWOULDBLOCK;
+}
+
+bool TapApplier::applyOps(Shard &s, size_t limit) {
+    size_t batchSize = std::max(engine.getTapConfig().getApplyBatchSize(),
+                                static_cast<size_t>(1));
+    size_t applied = 0;
+    while (applied < limit) {
+        std::vector<TapApplyOp*> run;
+        takeRun(s, std::min(batchSize, limit - applied), run);
+        if (run.empty()) {
+            break;
+        }
+        bool done = run.size() == 1 ? applyOne(s, run.front()) :
+            applyRun(s, run);
+        if (!done) {
+            return false;
+        }
+        applied += run.size();
+    }
+    return true;
+}
+
+void TapApplier::takeRun(Shard &s, size_t max,
+                         std::vector<TapApplyOp*> &run) {
+    {
+        LockHolder lh(s.queueLock);
+        std::deque<TapApplyOp*>::iterator it = s.ops.begin();
+        if (it == s.ops.end()) {
+            return;
+        }
+        TapApplyOp *first = *it;
+        run.push_back(first);
+        if (!first->meta) {
+            return;
+        }
+        uint16_t vbucket = first->itm->getVBucketId();
+        for (++it; it != s.ops.end() && run.size() < max; ++it) {
+            TapApplyOp *op = *it;
+            if (!op->meta || op->consumer.get() != first->consumer.get() ||
+                op->itm->getVBucketId() != vbucket) {
+                break;
+            }
+            run.push_back(op);
+        }
+    }
+    TapConsumer *tc = static_cast<TapConsumer*>(run.front()->consumer.get());
+    if (run.size() > 1 && tc->isBackfillPhase(run.front()->itm->getVBucketId())) {
+        // Backfilled items go to the backfill queue, one at a time.
+        run.resize(1);
+    }
+}
+
+bool TapApplier::applyOne(Shard &s, TapApplyOp *op) {
+    ENGINE_ERROR_CODE ret = apply(*op);
+    if (mustRetry(ret)) {
+        // Leave it at the front so nothing behind it overtakes it.
+        ++stats.tapApplyRetries;
+        return false;
+    }
+
+    TapConsumer *tc = static_cast<TapConsumer*>(op->consumer.get());
+    if (!tc->supportsCheckpointSync()) {
+        tc->checkVBOpenCheckpoint(op->itm->getVBucketId());
+    }
+    {
+        LockHolder lh(s.queueLock);
+        s.ops.pop_front();
+    }
+    finish(op, ret);
+    return true;
+}
+
+bool TapApplier::applyRun(Shard &s, std::vector<TapApplyOp*> &run) {
+    std::vector<WithMetaItem> items;
+    items.reserve(run.size());
+    std::vector<TapApplyOp*>::iterator it;
+    for (it = run.begin(); it != run.end(); ++it) {
+        items.push_back(WithMetaItem((*it)->itm, (*it)->event == TAP_DELETION,
+                                     true, (*it)->nru));
+    }
+    uint16_t vbucket = run.front()->itm->getVBucketId();
+    if (engine.applyTapBatch(vbucket, items) != ENGINE_SUCCESS) {
+        // The vbucket can't take the run as a whole; let each op find out
+        // what it makes of that on its own.
+        for (it = run.begin(); it != run.end(); ++it) {
+            if (!applyOne(s, *it)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    ++stats.tapApplyBatches;
+    stats.tapApplyBatchedOps.incr(run.size());
+
+    std::vector<bool> retry(run.size(), false);
+    bool retrying = false;
+    for (size_t i = 0; i < run.size(); ++i) {
+        retry[i] = mustRetry(items[i].status);
+        retrying = retrying || retry[i];
+    }
+    if (retrying) {
+        // A later op of the run that was applied to the same key makes
+        // the retry moot; it mustn't overwrite that op once retried.
+        std::set<std::string> applied;
+        for (size_t i = run.size(); i > 0; --i) {
+            const std::string &key = run[i - 1]->itm->getKey();
+            if (retry[i - 1]) {
+                if (applied.find(key) != applied.end()) {
+                    retry[i - 1] = false;
+                    items[i - 1].status = ENGINE_SUCCESS;
+                }
+            } else if (items[i - 1].status == ENGINE_SUCCESS) {
+                applied.insert(key);
+            }
+        }
+    }
+
+    std::vector<TapApplyOp*> retried;
+    {
+        LockHolder lh(s.queueLock);
+        for (size_t i = 0; i < run.size(); ++i) {
+            s.ops.pop_front();
+            if (retry[i]) {
+                retried.push_back(run[i]);
+            }
+        }
+        // Nothing behind them overtakes them from now on.
+        std::vector<TapApplyOp*>::reverse_iterator rit = retried.rbegin();
+        for (; rit != retried.rend(); ++rit) {
+            s.ops.push_front(*rit);
+        }
+    }
+
+    TapConsumer *tc = static_cast<TapConsumer*>(run.front()->consumer.get());
+    if (!tc->supportsCheckpointSync()) {
+        tc->checkVBOpenCheckpoint(vbucket);
+    }
+    for (size_t i = 0; i < run.size(); ++i) {
+        if (!retry[i]) {
+            finish(run[i], items[i].status);
+        }
+    }
+    if (!retried.empty()) {
+        ++stats.tapApplyRetries;
+        return false;
+    }
+    return true;
+}
+
+void TapApplier::finish(TapApplyOp *op, ENGINE_ERROR_CODE ret) {
+    TapConsumer *tc = static_cast<TapConsumer*>(op->consumer.get());
+    tc->processedEvent(op->event, ret);
+    if (ret != ENGINE_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "%s Failed to apply tap %s for "
+            "vbucket %d (error %d)\n", tc->logHeader(),
+            op->event == TAP_DELETION ? "deletion" : "mutation",
+            op->itm->getVBucketId(), ret);
+    }
+    tc->appliedEvent(ret);
+    stats.tapApplyQueueSize.decr(1);
+    delete op;
+}
+
+void TapApplier::drop(TapApplyOp *op) {
+    // The connection can't trust its stream anymore.
+    TapConsumer *tc = static_cast<TapConsumer*>(op->consumer.get());
+    tc->appliedEvent(ENGINE_DISCONNECT);
+    stats.tapApplyQueueSize.decr(1);
+    delete op;
+}
+
+ENGINE_ERROR_CODE TapApplier::apply(TapApplyOp &op) {
+    TapConsumer *tc = static_cast<TapConsumer*>(op.consumer.get());
+    Item &itm = *op.itm;
+    if (op.event == TAP_DELETION) {
+        ItemMetaData itemMeta(itm.getCas(), DEFAULT_REV_SEQ_NUM,
+                              itm.getFlags(), itm.getExptime());
+        itemMeta.seqno = itm.getSeqno();
+        return engine.applyTapDeletion(NULL, tc, itm.getKey(),
+                                       itm.getVBucketId(), itemMeta, op.meta);
+    }
+    BlockTimer timer(&stats.tapMutationHisto);
+    return engine.applyTapMutation(NULL, tc, itm, op.meta, op.nru);
+}
@@ -0,0 +1,199 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_TAPAPPLIER_H_
+#define SRC_TAPAPPLIER_H_ 1
+
+#include "config.h"
+
+#include <deque>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "item.h"
+#include "locks.h"
+#include "mutex.h"
+#include "stats.h"
+#include "tapconnmap.h"
+
+class EventuallyPersistentEngine;
+
+/**
+ * An incoming TAP mutation or deletion waiting to be applied.
+ */
+class TapApplyOp {
+public:
+    /**
+     * @param c the consumer the event came in on
+     * @param ev TAP_MUTATION or TAP_DELETION
+     * @param i the item to store; for a deletion it only carries the key,
+     *          vbucket and meta data.  The op takes ownership of it.
+     * @param m true if the item's cas and seqno are the source's meta data
+     * @param n the nru value to store the item with
+     */
+    TapApplyOp(const connection_t &c, tap_event_t ev, Item *i, bool m,
+               uint8_t n) :
+        consumer(c), event(ev), itm(i), meta(m), nru(n) { }
+
+    ~TapApplyOp() {
+        delete itm;
+    }
+
+    connection_t consumer;
+    tap_event_t  event;
+    Item        *itm;
+    bool         meta;
+    uint8_t      nru;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(TapApplyOp);
+};
+
+/**
+ * Applies the mutations TAP consumers receive on the reader threads
+ * instead of on the memcached worker thread owning the connection.
+ *
+ * There's one FIFO queue per shard, drained by one task at a time, so
+ * the events of a vbucket are always applied in the order they came in.
+ * A connection's other events (checkpoints, vbucket state changes...)
+ * are only processed once everything queued before them for their
+ * vbucket has been applied; see drain().
+ *
+ * So a run of queued ops of one vbucket and connection never spans a
+ * checkpoint, and those that carry their source's meta data are applied
+ * together (up to tap_apply_batch_size of them) through
+ * EventuallyPersistentEngine::applyTapBatch(), outside of backfills.
+ */
+class TapApplier {
+public:
+    static const size_t opsPerRun;
+    static const double sleepInterval;
+
+    TapApplier(EventuallyPersistentEngine &e, size_t numShards);
+
+    /**
+     * stop() must have been called first.
+     */
+    ~TapApplier();
+
+    void start();
+
+    /**
+     * Cancel the tasks, wait for those still applying ops, and drop what's
+     * left queued; the consumers it came from get disconnected.
+     */
+    void stop();
+
+    /**
+     * Queue an op for the shard of its item's vbucket.  The applier takes
+     * ownership of the op; its consumer must have counted it with
+     * TapConsumer::queuedApply(), and hears of its result through
+     * TapConsumer::appliedEvent().
+     */
+    void queue(TapApplyOp *op);
+
+    /**
+     * Apply, in the calling thread, everything queued for the shard of the
+     * given vbucket.
+     *
+     * @return false if an op couldn't be applied yet (i.e. we're out of
+     *         memory) and is still queued
+     */
+    bool drain(uint16_t vbucket);
+
+    /**
+     * Apply everything queued for all the shards.
+     */
+    bool drainAll();
+
+    /**
+     * Run the apply task of a shard.
+     */
+    bool run(size_t shardId, size_t tid);
+
+    void setTaskId(size_t shardId, size_t tid) {
+        shards[shardId]->taskId = tid;
+    }
+
+private:
+
+    struct Shard {
+        Shard() : taskId(0) { }
+
+        Mutex                   queueLock;
+        std::deque<TapApplyOp*> ops;
+        // Held while applying ops; the front op is only popped once done.
+        Mutex                   applyLock;
+        Atomic<bool>            pending;
+        size_t                  taskId;
+    };
+
+    Shard &shardOf(uint16_t vbucket) {
+        // The same mapping as VBucketMap::getShard().
+        return *shards[vbucket % shards.size()];
+    }
+
+    bool hasOps(Shard &s) {
+        LockHolder lh(s.queueLock);
+        return !s.ops.empty();
+    }
+
+    bool drainShard(Shard &s);
+
+    //! Apply up to limit ops of the shard; its applyLock must be held
+    bool applyOps(Shard &s, size_t limit);
+
+    /**
+     * Get the ops at the front of the queue that may be applied together,
+     * up to max of them; at least the front one if there's any.
+     */
+    void takeRun(Shard &s, size_t max, std::vector<TapApplyOp*> &run);
+
+    /**
+     * Apply the op at the front of the queue on its own.
+     *
+     * @return false if it couldn't be applied yet and is still queued
+     */
+    bool applyOne(Shard &s, TapApplyOp *op);
+
+    /**
+     * Apply a run of ops at the front of the queue together.  Those that
+     * couldn't be applied yet are left at the front, unless a later op of
+     * the run replaced them.
+     *
+     * @return false if any are still queued
+     */
+    bool applyRun(Shard &s, std::vector<TapApplyOp*> &run);
+
+    ENGINE_ERROR_CODE apply(TapApplyOp &op);
+
+    //! Count an op as processed by its consumer and drop it
+    void finish(TapApplyOp *op, ENGINE_ERROR_CODE ret);
+
+    //! Drop an op that won't be applied
+    void drop(TapApplyOp *op);
+
+    EventuallyPersistentEngine &engine;
+    EPStats &stats;
+    std::vector<Shard*> shards;
+    Atomic<bool> stopped;
+
+    DISALLOW_COPY_AND_ASSIGN(TapApplier);
+};
+
+#endif  // SRC_TAPAPPLIER_H_
@@ -17,14 +17,17 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <limits>
 
+#include "backfill.h"
 #include "dispatcher.h"
 #include "ep_engine.h"
 #define STATWRITER_NAMESPACE tap
 #include "statwriter.h"
 #undef STATWRITER_NAMESPACE
 #include "tapconnection.h"
+#include "tapfanout.h"
 #include "vbucket.h"
 
 const short int TapEngineSpecific::sizeRevSeqno(8);
@@ -69,6 +72,171 @@ uint16_t TapEngineSpecific::packSpecificData(tap_event_t ev, TapProducer *tp,
     return nengine;
 }
 
+const size_t TapMutationBatch::sizeHeader(6);
+const size_t TapMutationBatch::sizeRecordHeader(32);
+
+static void appendBytes(std::vector<uint8_t> &data, const void *p, size_t n) {
+    const uint8_t *bytes = static_cast<const uint8_t*>(p);
+    data.insert(data.end(), bytes, bytes + n);
+}
+
+void TapMutationBatch::reset() {
+    data.clear();
+    count = 0;
+    uint32_t code = htonl(TAP_OPAQUE_MUTATION_BATCH);
+    uint16_t n = 0;
+    appendBytes(data, &code, sizeof(code));
+    appendBytes(data, &n, sizeof(n));
+}
+
+bool TapMutationBatch::add(tap_event_t ev, const Item &itm, uint8_t nru) {
+    assert(ev == TAP_MUTATION || ev == TAP_DELETION);
+    uint32_t nvalue = ev == TAP_MUTATION ? itm.getNBytes() : 0;
+    size_t size = data.size() + sizeRecordHeader + itm.getNKey() + nvalue;
+    if (size > std::numeric_limits<uint16_t>::max() ||
+        count == std::numeric_limits<uint16_t>::max()) {
+        return false;
+    }
+
+    uint8_t event = static_cast<uint8_t>(ev);
+    uint16_t nkey = htons(static_cast<uint16_t>(itm.getNKey()));
+    uint32_t flags = htonl(itm.getFlags());
+    uint32_t exptime = htonl(static_cast<uint32_t>(itm.getExptime()));
+    uint64_t cas = htonll(itm.getCas());
+    uint64_t seqno = htonll(itm.getSeqno());
+    uint32_t nval = htonl(nvalue);
+    appendBytes(data, &event, sizeof(event));
+    appendBytes(data, &nru, sizeof(nru));
+    appendBytes(data, &nkey, sizeof(nkey));
+    appendBytes(data, &flags, sizeof(flags));
+    appendBytes(data, &exptime, sizeof(exptime));
+    appendBytes(data, &cas, sizeof(cas));
+    appendBytes(data, &seqno, sizeof(seqno));
+    appendBytes(data, &nval, sizeof(nval));
+    appendBytes(data, itm.getKey().data(), itm.getNKey());
+    if (nvalue > 0) {
+        appendBytes(data, itm.getData(), nvalue);
+    }
+
+    uint16_t n = htons(static_cast<uint16_t>(++count));
+    memcpy(&data[sizeof(uint32_t)], &n, sizeof(n));
+    return true;
+}
+
+bool TapMutationBatch::isMutationBatch(const void *es, uint16_t nes) {
+    uint32_t code;
+    if (nes < sizeHeader) {
+        return false;
+    }
+    memcpy(&code, es, sizeof(code));
+    return ntohl(code) == TAP_OPAQUE_MUTATION_BATCH;
+}
+
+bool TapMutationBatch::decode(const void *es, uint16_t nes,
+                              std::vector<Record> &records) {
+    const char *ptr = static_cast<const char*>(es);
+    const char *end = ptr + nes;
+    uint16_t n;
+    if (!isMutationBatch(es, nes)) {
+        return false;
+    }
+    memcpy(&n, ptr + sizeof(uint32_t), sizeof(n));
+    ptr += sizeHeader;
+
+    records.reserve(records.size() + ntohs(n));
+    for (uint16_t i = 0; i < ntohs(n); ++i) {
+        if (static_cast<size_t>(end - ptr) < sizeRecordHeader) {
+            return false;
+        }
+        Record r;
+        uint8_t event;
+        memcpy(&event, ptr, sizeof(event));
+        memcpy(&r.nru, ptr + 1, sizeof(r.nru));
+        memcpy(&r.nkey, ptr + 2, sizeof(r.nkey));
+        memcpy(&r.flags, ptr + 4, sizeof(r.flags));
+        memcpy(&r.exptime, ptr + 8, sizeof(r.exptime));
+        memcpy(&r.cas, ptr + 12, sizeof(r.cas));
+        memcpy(&r.seqno, ptr + 20, sizeof(r.seqno));
+        memcpy(&r.nvalue, ptr + 28, sizeof(r.nvalue));
+        r.event = static_cast<tap_event_t>(event);
+        r.nkey = ntohs(r.nkey);
+        r.flags = ntohl(r.flags);
+        r.exptime = ntohl(r.exptime);
+        r.cas = ntohll(r.cas);
+        r.seqno = ntohll(r.seqno);
+        r.nvalue = ntohl(r.nvalue);
+        ptr += sizeRecordHeader;
+
+        if ((r.event != TAP_MUTATION && r.event != TAP_DELETION) ||
+            static_cast<size_t>(end - ptr) < r.nkey + static_cast<size_t>(r.nvalue)) {
+            return false;
+        }
+        r.key = ptr;
+        r.value = ptr + r.nkey;
+        ptr += r.nkey + r.nvalue;
+        records.push_back(r);
+    }
+    return ptr == end;
+}
+
+bool TapKeyFilter::decode(const char *&ptr, size_t &len) {
+    uint16_t n;
+    if (len < sizeof(n)) {
+        return false;
+    }
+    memcpy(&n, ptr, sizeof(n));
+    ptr += sizeof(n);
+    len -= sizeof(n);
+
+    prefixes.clear();
+    for (uint16_t i = 0; i < ntohs(n); ++i) {
+        uint16_t plen;
+        if (len < sizeof(plen)) {
+            return false;
+        }
+        memcpy(&plen, ptr, sizeof(plen));
+        plen = ntohs(plen);
+        if (len - sizeof(plen) < plen) {
+            return false;
+        }
+        prefixes.push_back(std::string(ptr + sizeof(plen), plen));
+        ptr += sizeof(plen) + plen;
+        len -= sizeof(plen) + plen;
+    }
+    std::sort(prefixes.begin(), prefixes.end());
+
+    uint8_t options;
+    if (len < sizeof(flagsMask) + sizeof(flagsValue) + sizeof(options)) {
+        return false;
+    }
+    memcpy(&flagsMask, ptr, sizeof(flagsMask));
+    memcpy(&flagsValue, ptr + sizeof(flagsMask), sizeof(flagsValue));
+    memcpy(&options, ptr + sizeof(flagsMask) + sizeof(flagsValue),
+           sizeof(options));
+    flagsMask = ntohl(flagsMask);
+    flagsValue = ntohl(flagsValue) & flagsMask;
+    noExpiry = (options & TAP_KEY_FILTER_NO_EXPIRY) != 0;
+    ptr += sizeof(flagsMask) + sizeof(flagsValue) + sizeof(options);
+    len -= sizeof(flagsMask) + sizeof(flagsValue) + sizeof(options);
+    return true;
+}
+
+bool TapKeyFilter::acceptsKey(const std::string &key) const {
+    if (prefixes.empty()) {
+        return true;
+    }
+    // A prefix of the key sorts before it, or is it.
+    std::vector<std::string>::const_iterator it;
+    std::vector<std::string>::const_iterator end =
+        std::upper_bound(prefixes.begin(), prefixes.end(), key);
+    for (it = prefixes.begin(); it != end; ++it) {
+        if (key.compare(0, it->length(), *it) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 Atomic<uint64_t> TapConnection::tapCounter(1);
 
 
@@ -101,6 +269,14 @@ void TapConnection::addStat(const char *nm, T val, ADD_STAT add_stat, const void
     add_casted_stat(n.data(), value.str().data(), add_stat, c);
 }
 
+void TapConnection::addStat(const char *nm, const Histogram<hrtime_t> &val,
+                            ADD_STAT add_stat, const void *c) {
+    std::stringstream tap;
+    tap << name << ":" << nm;
+    std::string n = tap.str();
+    add_casted_stat(n.c_str(), val, add_stat, c);
+}
+
 const void *TapConnection::getCookie() const {
     return cookie;
 }
@@ -132,6 +308,8 @@ const char *TapConnection::opaqueCmdToString(uint32_t opaque_code) {
         return "close_backfill";
     case TAP_OPAQUE_COMPLETE_VB_FILTER_CHANGE:
         return "complete_vb_filter_change";
+    case TAP_OPAQUE_MUTATION_BATCH:
+        return "mutation_batch";
     }
     return "unknown";
 }
@@ -151,10 +329,30 @@ public:
             config.setAckInterval(value);
         } else if (key.compare("tap_ack_window_size") == 0) {
             config.setAckWindowSize(value);
+        } else if (key.compare("tap_ack_window_max") == 0) {
+            config.setAckWindowMax(value);
         } else if (key.compare("tap_bg_max_pending") == 0) {
             config.setBgMaxPending(value);
         } else if (key.compare("tap_backlog_limit") == 0) {
             config.setBackfillBacklogLimit(value);
+        } else if (key.compare("tap_backfill_bg_slo") == 0) {
+            config.setBackfillBgSlo(value);
+        } else if (key.compare("tap_backfill_ack_slo") == 0) {
+            config.setBackfillAckSlo(value);
+        } else if (key.compare("tap_backfill_max_disk_loads") == 0) {
+            config.setBackfillMaxDiskLoads(value);
+        } else if (key.compare("tap_mutation_batch_size") == 0) {
+            config.setMutationBatchSize(value);
+        } else if (key.compare("tap_mutation_batch_max_value") == 0) {
+            config.setMutationBatchMaxValue(value);
+        } else if (key.compare("tap_apply_batch_size") == 0) {
+            config.setApplyBatchSize(value);
+        } else if (key.compare("tap_fanout_max_inbox") == 0) {
+            config.setFanoutMaxInbox(value);
+        } else if (key.compare("tap_takeover_delta") == 0) {
+            config.setTakeoverDelta(value);
+        } else if (key.compare("tap_takeover_max_pause") == 0) {
+            config.setTakeoverMaxPause(value);
         }
     }
 
@@ -168,6 +366,14 @@ public:
         }
     }
 
+    virtual void booleanValueChanged(const std::string &key, bool value) {
+        if (key.compare("tap_apply_parallel") == 0) {
+            config.setApplyParallel(value);
+        } else if (key.compare("tap_fanout") == 0) {
+            config.setFanout(value);
+        }
+    }
+
 private:
     TapConfig &config;
 };
@@ -177,6 +383,7 @@ TapConfig::TapConfig(EventuallyPersistentEngine &e)
 {
     Configuration &config = engine.getConfiguration();
     ackWindowSize = config.getTapAckWindowSize();
+    ackWindowMax = config.getTapAckWindowMax();
     ackInterval = config.getTapAckInterval();
     ackGracePeriod = config.getTapAckGracePeriod();
     ackInitialSequenceNumber = config.getTapAckInitialSequenceNumber();
@@ -185,6 +392,17 @@ TapConfig::TapConfig(EventuallyPersistentEngine &e)
     requeueSleepTime = config.getTapRequeueSleepTime();
     backfillBacklogLimit = config.getTapBacklogLimit();
     backfillResidentThreshold = config.getTapBackfillResident();
+    backfillBgSlo = config.getTapBackfillBgSlo();
+    backfillAckSlo = config.getTapBackfillAckSlo();
+    backfillMaxDiskLoads = config.getTapBackfillMaxDiskLoads();
+    mutationBatchSize = config.getTapMutationBatchSize();
+    mutationBatchMaxValue = config.getTapMutationBatchMaxValue();
+    applyParallel = config.isTapApplyParallel();
+    applyBatchSize = config.getTapApplyBatchSize();
+    fanout = config.isTapFanout();
+    fanoutMaxInbox = config.getTapFanoutMaxInbox();
+    takeoverDelta = config.getTapTakeoverDelta();
+    takeoverMaxPause = config.getTapTakeoverMaxPause();
 }
 
 void TapConfig::addConfigChangeListener(EventuallyPersistentEngine &engine) {
@@ -197,6 +415,8 @@ void TapConfig::addConfigChangeListener(EventuallyPersistentEngine &engine) {
                               new TapConfigChangeListener(engine.getTapConfig()));
     configuration.addValueChangedListener("tap_ack_window_size",
                               new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_ack_window_max",
+                              new TapConfigChangeListener(engine.getTapConfig()));
     configuration.addValueChangedListener("tap_bg_max_pending",
                               new TapConfigChangeListener(engine.getTapConfig()));
     configuration.addValueChangedListener("tap_backoff_period",
@@ -207,6 +427,28 @@ void TapConfig::addConfigChangeListener(EventuallyPersistentEngine &engine) {
                               new TapConfigChangeListener(engine.getTapConfig()));
     configuration.addValueChangedListener("tap_backfill_resident",
                               new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_backfill_bg_slo",
+                              new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_backfill_ack_slo",
+                              new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_backfill_max_disk_loads",
+                              new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_mutation_batch_size",
+                              new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_mutation_batch_max_value",
+                              new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_apply_parallel",
+                              new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_apply_batch_size",
+                              new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_fanout",
+                              new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_fanout_max_inbox",
+                              new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_takeover_delta",
+                              new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_takeover_max_pause",
+                              new TapConfigChangeListener(engine.getTapConfig()));
 }
 
 TapProducer::TapProducer(EventuallyPersistentEngine &theEngine,
@@ -225,18 +467,33 @@ TapProducer::TapProducer(EventuallyPersistentEngine &theEngine,
     dumpQueue(false),
     doTakeOver(false),
     takeOverCompletionPhase(false),
+    takeoverVBucket(0),
+    takeoverPauseStart(0),
+    takeoverRetries(0),
     doRunBackfill(false),
     backfillCompleted(true),
     pendingBackfillCounter(0),
     diskBackfillCounter(0),
     totalBackfillBacklogs(0),
     vbucketFilter(),
+    keyFilterSkipped(0),
+    numResumedVBuckets(0),
     queueMemSize(0),
     queueFill(0),
     queueDrain(0),
     seqno(theEngine.getTapConfig().getAckInitialSequenceNumber()),
     seqnoReceived(theEngine.getTapConfig().getAckInitialSequenceNumber() - 1),
     seqnoAckRequested(theEngine.getTapConfig().getAckInitialSequenceNumber() - 1),
+    ackRequestedAt(0),
+    seqnoAckTimed(0),
+    ackWindow(theEngine.getTapConfig().getAckWindowSize()),
+    ackWindowFilled(false),
+    ackRtt(0),
+    minAckRtt(0),
+    bytesSent(0),
+    bytesInWindow(0),
+    bytesPerSec(0),
+    rateWindowStart(0),
     notifySent(false),
     suspended(false),
     lastMsgTime(ep_current_time()),
@@ -244,6 +501,11 @@ TapProducer::TapProducer(EventuallyPersistentEngine &theEngine,
     isSeqNumRotated(false),
     numNoops(0),
     tapFlagByteorderSupport(false),
+    supportMutationBatch(false),
+    stashedItem(NULL),
+    stashedEvent(TAP_PAUSE),
+    stashedVBucket(0),
+    stashedNru(INITIAL_NRU_VALUE),
     specificData(NULL),
     backfillTimestamp(0)
 {
@@ -299,6 +561,11 @@ void TapProducer::evaluateFlags()
         ss << ",checkpoints";
     }
 
+    if (flags & TAP_CONNECT_MUTATION_BATCH) {
+        supportMutationBatch = true;
+        ss << ",mutation_batch";
+    }
+
     if (ss.str().length() > 0) {
         std::stringstream m;
         m.setf(std::ios::hex);
@@ -352,7 +619,7 @@ void TapProducer::setVBucketFilter(const std::vector<uint16_t> &vbuckets,
             if (vbucketFilter(*it)) {
                 RCPtr<VBucket> vb = vbMap.getBucket(*it);
                 if (vb) {
-                    vb->checkpointManager.removeTAPCursor(name);
+                    engine.getTapConnMap().getTapFanout().removeCursor(vb, name);
                 }
                 backfillVBuckets.erase(*it);
                 backFillVBucketFilter.removeVBucket(*it);
@@ -435,6 +702,7 @@ void TapProducer::registerTAPCursor(const std::map<uint16_t, uint64_t> &lastChec
 
     uint64_t current_time = (uint64_t)ep_real_time();
     std::vector<uint16_t> backfill_vbuckets;
+    std::map<uint16_t, uint64_t> resume_vbuckets;
     const VBucketMap &vbuckets = engine.getEpStore()->getVBuckets();
     size_t numOfVBuckets = vbuckets.getSize();
     for (size_t i = 0; i < numOfVBuckets; ++i) {
@@ -489,17 +757,68 @@ void TapProducer::registerTAPCursor(const std::map<uint16_t, uint64_t> &lastChec
                 continue;
             }
 
+            // A client asking for the changes since a seqno gets what was
+            // persisted after it from disk, and the rest from checkpoints.
+            std::map<uint16_t, uint64_t>::iterator sit = sinceSeqnos.find(vbid);
+            if (sit != sinceSeqnos.end()) {
+                uint64_t since = sit->second;
+                sinceSeqnos.erase(sit);
+                if (vb->isPurgedSince(since)) {
+                    // The client has to start over with a backfill.
+                    LOG(EXTENSION_LOG_WARNING,
+                        "%s Deletions after seqno %llu of vbucket %d may have "
+                        "been purged; disconnecting", logHeader(), since, vbid);
+                    setDisconnect(true);
+                    continue;
+                }
+                if (canStreamFromDisk(vbid)) {
+                    cit = tapCheckpointState.find(vbid);
+                    assert(cit != tapCheckpointState.end());
+                    cit->second.fanout = engine.getTapConfig().isFanout();
+                    engine.getTapConnMap().getTapFanout().registerCursorAtOldest(vb, name,
+                                                                                 cit->second.fanout);
+                    cit->second.currentCheckpointId =
+                        vb->checkpointManager.getCheckpointIdForTAPCursor(name);
+                    cit->second.state = checkpoint_start;
+                    resume_vbuckets[vbid] = since;
+                    continue;
+                }
+                LOG(EXTENSION_LOG_WARNING,
+                    "%s Can't stream vbucket %d from seqno %llu", logHeader(),
+                    vbid, since);
+            }
+
             // Check if this TAP producer completed the replication before shutdown or crash.
             bool prev_session_completed =
                 engine.getTapConnMap().prevSessionReplicaCompleted(name);
             // Check if the unified queue contains the checkpoint to start with.
-            bool chk_exists = vb->checkpointManager.registerTAPCursor(name,
-                                                                      chk_id_to_start);
+            cit = tapCheckpointState.find(vbid);
+            assert(cit != tapCheckpointState.end());
+            cit->second.fanout = engine.getTapConfig().isFanout();
+            bool chk_exists =
+                engine.getTapConnMap().getTapFanout().registerCursor(vb, name,
+                                                                     chk_id_to_start,
+                                                                     false,
+                                                                     cit->second.fanout);
             if(!prev_session_completed || !chk_exists) {
                 uint64_t chk_id;
                 tap_checkpoint_state cstate;
 
-                if (backfillAge < current_time) {
+                uint64_t since = 0;
+                if (backfillAge < current_time && prev_session_completed &&
+                    it != lastCheckpointIds.end() && canStreamFromDisk(vbid) &&
+                    engine.getTapConnMap().getTapFanout().resumeCursor(vb, name,
+                                                                       chk_id_to_start,
+                                                                       since,
+                                                                       cit->second.fanout) &&
+                    !vb->isPurgedSince(since)) {
+                    // The client has everything before its checkpoint, so
+                    // stream what was persisted since from disk instead of
+                    // backfilling the whole vbucket.
+                    chk_id = vb->checkpointManager.getCheckpointIdForTAPCursor(name);
+                    cstate = checkpoint_start;
+                    resume_vbuckets[vbid] = since;
+                } else if (backfillAge < current_time) {
                     chk_id = 0;
                     cstate = backfill;
                     if (vb->checkpointManager.getOpenCheckpointId() > 0) {
@@ -537,6 +856,37 @@ void TapProducer::registerTAPCursor(const std::map<uint16_t, uint64_t> &lastChec
             scheduleBackfill_UNLOCKED(backfill_vbuckets);
         }
     }
+
+    std::map<uint16_t, uint64_t>::iterator rit = resume_vbuckets.begin();
+    for (; rit != resume_vbuckets.end(); ++rit) {
+        scheduleResume_UNLOCKED(rit->first, rit->second);
+    }
+}
+
+bool TapProducer::canStreamFromDisk(uint16_t vbid) {
+    EventuallyPersistentStore *epstore = engine.getEpStore();
+    return !epstore->isEphemeral() &&
+        epstore->getAuxUnderlying(vbid)->isSeqnoDumpSupported();
+}
+
+void TapProducer::scheduleResume_UNLOCKED(uint16_t vbid, uint64_t since) {
+    LOG(EXTENSION_LOG_WARNING,
+        "%s Stream vbucket %d from disk seqno %llu", logHeader(), vbid, since);
+    // Unlike a backfill, this doesn't reset the vbucket on the client, so
+    // it's neither in backfillVBuckets nor closed when it completes.
+    ++diskBackfillCounter;
+    backfillCompleted = false;
+    backfillTimestamp = ep_real_time();
+    ++numResumedVBuckets;
+
+    EventuallyPersistentStore *epstore = engine.getEpStore();
+    shared_ptr<DispatcherCallback> cb(new BackfillDiskLoad(name, &engine,
+                                                           engine.getTapConnMap(),
+                                                           epstore->getAuxUnderlying(vbid),
+                                                           vbid, SINCE_SEQNO,
+                                                           getConnectionToken(),
+                                                           since));
+    epstore->getAuxIODispatcher()->schedule(cb, NULL, Priority::TapBgFetcherPriority);
 }
 
 bool TapProducer::windowIsFull() {
@@ -545,7 +895,7 @@ bool TapProducer::windowIsFull() {
     }
 
     const TapConfig &config = engine.getTapConfig();
-    uint32_t limit = config.getAckWindowSize() * config.getAckInterval();
+    uint32_t limit = getAckWindow() * config.getAckInterval();
     if (seqno >= seqnoReceived) {
 
         if ((seqno - seqnoReceived) <= limit) {
@@ -561,6 +911,76 @@ bool TapProducer::windowIsFull() {
     return true;
 }
 
+uint32_t TapProducer::getAckWindow() const {
+    const TapConfig &config = engine.getTapConfig();
+    uint32_t min = config.getAckWindowSize();
+    uint32_t max = config.getAckWindowMax();
+    if (max <= min) {
+        return min;
+    }
+    return std::min(std::max(ackWindow, min), max);
+}
+
+uint32_t TapProducer::nextAckWindow(uint32_t current, uint32_t min, uint32_t max,
+                                    hrtime_t rtt, hrtime_t minRtt, bool filled) {
+    uint32_t next = current;
+    if (rtt > 2 * minRtt) {
+        uint32_t step = std::max(current / 4, static_cast<uint32_t>(1));
+        next = current > min + step ? current - step : min;
+    } else if (filled && current < max) {
+        ++next;
+    }
+    return std::max(std::min(next, max), min);
+}
+
+void TapProducer::timeAck_UNLOCKED(hrtime_t rtt) {
+    stats.tapAckWait += rtt;
+    ++stats.tapAckNumSamples;
+    ackWaitHisto.add(rtt);
+
+    ackRtt = rtt;
+    if (minAckRtt == 0 || rtt < minAckRtt) {
+        minAckRtt = rtt;
+    }
+
+    const TapConfig &config = engine.getTapConfig();
+    if (config.getAckWindowMax() > config.getAckWindowSize()) {
+        ackWindow = nextAckWindow(getAckWindow(), config.getAckWindowSize(),
+                                  config.getAckWindowMax(), rtt, minAckRtt,
+                                  ackWindowFilled);
+    }
+    ackWindowFilled = false;
+}
+
+void TapProducer::itemSent_UNLOCKED(const queued_item &qi, const Item *itm) {
+    rel_time_t now = ep_current_time();
+    rel_time_t queued = qi->getQueuedTime();
+    hrtime_t age = now > queued ? (now - queued) * 1000000 : 0;
+    // Checkpoint items are only walked once the backfill is completed.
+    if (isBackfillCompleted_UNLOCKED()) {
+        replicationAgeHisto.add(age);
+    } else {
+        backfillItemAgeHisto.add(age);
+    }
+
+    if (now != rateWindowStart) {
+        bytesPerSec = now == rateWindowStart + 1 ? bytesInWindow : 0;
+        bytesInWindow = 0;
+        rateWindowStart = now;
+    }
+    size_t bytes = itm->getNKey() + itm->getNBytes();
+    bytesInWindow += bytes;
+    bytesSent += bytes;
+}
+
+size_t TapProducer::getBytesPerSec_UNLOCKED() const {
+    rel_time_t now = ep_current_time();
+    if (now == rateWindowStart) {
+        return bytesPerSec;
+    }
+    return now == rateWindowStart + 1 ? bytesInWindow : 0;
+}
+
 bool TapProducer::requestAck(tap_event_t event, uint16_t vbucket) {
     LockHolder lh(queueLock);
 
@@ -616,13 +1036,14 @@ void TapProducer::clearQueues_UNLOCKED() {
 
     // Clear bg-fetched items.
     while (!backfilledItems.empty()) {
-        Item *i(backfilledItems.front());
+        Item *i(backfilledItems.front().first);
         assert(i);
         delete i;
         backfilledItems.pop();
     }
     mem_overhead += (bgResultSize * sizeof(Item *));
     bgResultSize = 0;
+    dropDeferredBGFetches_UNLOCKED(false);
 
     // Reset bg result size in a checkpoint state.
     std::map<uint16_t, TapCheckpointState>::iterator it = tapCheckpointState.begin();
@@ -630,6 +1051,8 @@ void TapProducer::clearQueues_UNLOCKED() {
         it->second.bgResultSize = 0;
     }
 
+    dropStashedItem_UNLOCKED();
+
     // Clear the checkpoint message queue as well
     while (!checkpointMsgs.empty()) {
         checkpointMsgs.pop();
@@ -658,10 +1081,13 @@ void TapProducer::rollback() {
         "%s Connection is re-established. Rollback unacked messages...",
         logHeader());
 
+    // Bg fetches deferred since the disconnect are sent live instead.
+    dropDeferredBGFetches_UNLOCKED(true);
+
     size_t checkpoint_msg_sent = 0;
     size_t tapLogSize = 0;
     size_t opaque_msg_sent = 0;
-    std::list<TapLogElement>::iterator i = tapLog.begin();
+    std::deque<TapLogElement>::iterator i = tapLog.begin();
     while (i != tapLog.end()) {
         switch (i->event) {
         case TAP_VBUCKET_SET:
@@ -730,7 +1156,7 @@ void TapProducer::rollback() {
                 " Tap opcode value %d not implemented", logHeader(), i->event);
             abort();
         }
-        tapLog.erase(i);
+        tapLog.pop_front();
         i = tapLog.begin();
         ++tapLogSize;
     }
@@ -740,6 +1166,7 @@ void TapProducer::rollback() {
 
     seqnoReceived = seqno - 1;
     seqnoAckRequested = seqno - 1;
+    ackRequestedAt = 0;
     checkpointMsgCounter -= checkpoint_msg_sent;
     opaqueMsgCounter -= opaque_msg_sent;
 }
@@ -809,13 +1236,13 @@ void TapProducer::setSuspended(bool value) {
     setSuspended_UNLOCKED(value);
 }
 
-void TapProducer::reschedule_UNLOCKED(const std::list<TapLogElement>::iterator &iter)
+void TapProducer::reschedule_UNLOCKED(const TapLogElement &log)
 {
-    switch (iter->event) {
+    switch (log.event) {
     case TAP_VBUCKET_SET:
         {
-            TapVBucketEvent e(iter->event, iter->vbucket, iter->state);
-            if (iter->state == vbucket_state_pending) {
+            TapVBucketEvent e(log.event, log.vbucket, log.state);
+            if (log.state == vbucket_state_pending) {
                 addVBucketHighPriority_UNLOCKED(e);
             } else {
                 addVBucketLowPriority_UNLOCKED(e);
@@ -825,22 +1252,22 @@ void TapProducer::reschedule_UNLOCKED(const std::list<TapLogElement>::iterator &
     case TAP_CHECKPOINT_START:
     case TAP_CHECKPOINT_END:
         --checkpointMsgCounter;
-        addCheckpointMessage_UNLOCKED(iter->item);
+        addCheckpointMessage_UNLOCKED(log.item);
         break;
     case TAP_FLUSH:
-        addEvent_UNLOCKED(iter->item);
+        addEvent_UNLOCKED(log.item);
         break;
     case TAP_DELETION:
     case TAP_MUTATION:
         {
             if (supportCheckpointSync) {
                 std::map<uint16_t, TapCheckpointState>::iterator map_it =
-                    tapCheckpointState.find(iter->vbucket);
+                    tapCheckpointState.find(log.vbucket);
                 if (map_it != tapCheckpointState.end()) {
                     map_it->second.lastSeqNum = std::numeric_limits<uint32_t>::max();
                 }
             }
-            addEvent_UNLOCKED(iter->item);
+            addEvent_UNLOCKED(log.item);
             if (!isBackfillCompleted_UNLOCKED()) {
                 ++totalBackfillBacklogs;
             }
@@ -849,14 +1276,14 @@ void TapProducer::reschedule_UNLOCKED(const std::list<TapLogElement>::iterator &
     case TAP_OPAQUE:
         {
             --opaqueMsgCounter;
-            TapVBucketEvent ev(iter->event, iter->vbucket,
-                                         (vbucket_state_t)iter->state);
+            TapVBucketEvent ev(log.event, log.vbucket,
+                                         (vbucket_state_t)log.state);
             addVBucketHighPriority_UNLOCKED(ev);
         }
         break;
     default:
         LOG(EXTENSION_LOG_WARNING, "%s Internal error in reschedule_UNLOCKED()."
-            " Tap opcode value %d not implemented", logHeader(), iter->event);
+            " Tap opcode value %d not implemented", logHeader(), log.event);
         abort();
     }
 }
@@ -866,7 +1293,6 @@ ENGINE_ERROR_CODE TapProducer::processAck(uint32_t s,
                                           const std::string &msg)
 {
     LockHolder lh(queueLock);
-    std::list<TapLogElement>::iterator iter = tapLog.begin();
     ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
 
     const TapConfig &config = engine.getTapConfig();
@@ -880,25 +1306,45 @@ ENGINE_ERROR_CODE TapProducer::processAck(uint32_t s,
             it->second.lastSeqNum = 0;
         }
         isSeqNumRotated = false;
+        ackRequestedAt = 0;
+    }
+    if (windowIsFull()) {
+        // We've been waiting for this ack to send anything more.
+        ackWindowFilled = true;
     }
     seqnoReceived = s;
     isLastAckSucceed = false;
 
-    size_t num_logs = 0;
+    if (ackRequestedAt != 0 && s >= seqnoAckTimed) {
+        timeAck_UNLOCKED((gethrtime() - ackRequestedAt) / 1000);
+        ackRequestedAt = 0;
+    }
+
     /* Implicit ack _every_ message up until this message */
-    while (iter != tapLog.end() && iter->seqno != s) {
-        LOG(EXTENSION_LOG_DEBUG, "%s Implicit ack (#%u)\n", logHeader(),
-            iter->seqno);
-        ++iter;
-        ++num_logs;
+    std::deque<TapLogElement>::iterator iter = findTapLog_UNLOCKED(s);
+    size_t num_logs = iter - tapLog.begin();
+    if (num_logs > 0) {
+        LOG(EXTENSION_LOG_DEBUG, "%s Implicit ack (#%u - #%u)\n", logHeader(),
+            tapLog.front().seqno, (iter - 1)->seqno);
     }
 
     bool notifyTapNotificationThread = false;
+    std::vector<queued_item> replicated;
 
     switch (status) {
     case PROTOCOL_BINARY_RESPONSE_SUCCESS:
         /* And explicit ack this message! */
         if (iter != tapLog.end()) {
+            if (!dumpQueue) {
+                // The mutations up to it are on the replica now.
+                std::deque<TapLogElement>::iterator ait = tapLog.begin();
+                for (; ait != iter + 1; ++ait) {
+                    if ((ait->event == TAP_MUTATION ||
+                         ait->event == TAP_DELETION) && ait->item.get()) {
+                        replicated.push_back(ait->item);
+                    }
+                }
+            }
             // If this ACK is for TAP_CHECKPOINT messages, indicate that the checkpoint
             // is synced between the master and slave nodes.
             if ((iter->event == TAP_CHECKPOINT_START || iter->event == TAP_CHECKPOINT_END)
@@ -935,6 +1381,9 @@ ENGINE_ERROR_CODE TapProducer::processAck(uint32_t s,
         if (notifyTapNotificationThread) {
             engine.notifyNotificationThread();
         }
+        if (!replicated.empty()) {
+            engine.getEpStore()->notifyItemsReplicated(replicated);
+        }
 
         lh.lock();
         if (mayCompleteDumpOrTakeover_UNLOCKED() && idle_UNLOCKED()) {
@@ -960,6 +1409,9 @@ ENGINE_ERROR_CODE TapProducer::processAck(uint32_t s,
         if (!takeOverCompletionPhase) {
             setSuspended_UNLOCKED(true);
         }
+        // The consumer can't keep up; halve the window we've tuned.
+        ackWindow = std::max(getAckWindow() / 2,
+                             engine.getTapConfig().getAckWindowSize());
         ++numTapNack;
         LOG(EXTENSION_LOG_DEBUG,
             "%s Received temporary TAP nack (#%u): Code: %u (%s)",
@@ -967,7 +1419,7 @@ ENGINE_ERROR_CODE TapProducer::processAck(uint32_t s,
 
         // Reschedule _this_ sequence number..
         if (iter != tapLog.end()) {
-            reschedule_UNLOCKED(iter);
+            reschedule_UNLOCKED(*iter);
             transmitted[iter->vbucket]--;
             ++num_logs;
             ++iter;
@@ -975,6 +1427,9 @@ ENGINE_ERROR_CODE TapProducer::processAck(uint32_t s,
         tapLog.erase(tapLog.begin(), iter);
         break;
     default:
+        if (iter != tapLog.end()) {
+            transmitted[iter->vbucket]--;
+        }
         tapLog.erase(tapLog.begin(), iter);
         ++numTapNack;
         LOG(EXTENSION_LOG_WARNING,
@@ -982,7 +1437,6 @@ ENGINE_ERROR_CODE TapProducer::processAck(uint32_t s,
             logHeader(), seqnoReceived, status, msg.c_str());
         setDisconnect(true);
         expiryTime = 0;
-        transmitted[iter->vbucket]--;
         ret = ENGINE_DISCONNECT;
     }
 
@@ -992,6 +1446,35 @@ ENGINE_ERROR_CODE TapProducer::processAck(uint32_t s,
     return ret;
 }
 
+std::deque<TapLogElement>::iterator TapProducer::findTapLog_UNLOCKED(uint32_t s) {
+    if (tapLog.empty()) {
+        return tapLog.end();
+    }
+
+    uint32_t first = tapLog.front().seqno;
+    uint32_t distance = s - first;
+    // Every element usually has a sequence number of its own.
+    if (distance < tapLog.size() && tapLog[distance].seqno == s &&
+        (distance == 0 || tapLog[distance - 1].seqno != s)) {
+        return tapLog.begin() + distance;
+    }
+
+    std::deque<TapLogElement>::iterator lo = tapLog.begin();
+    std::deque<TapLogElement>::iterator hi = tapLog.end();
+    while (lo < hi) {
+        std::deque<TapLogElement>::iterator mid = lo + (hi - lo) / 2;
+        if (static_cast<uint32_t>(mid->seqno - first) < distance) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo != tapLog.end() && lo->seqno == s) {
+        return lo;
+    }
+    return tapLog.end();
+}
+
 bool TapProducer::checkBackfillCompletion_UNLOCKED() {
     bool rv = false;
     if (!backfillCompleted && !isPendingBackfill_UNLOCKED() &&
@@ -1069,7 +1552,7 @@ public:
         EventuallyPersistentStore *epstore = epe->getEpStore();
         assert(epstore);
 
-        epstore->getAuxUnderlying()->get(key, rowid, vbucket, gcb);
+        epstore->getAuxUnderlying(vbucket)->get(key, rowid, vbucket, gcb);
         gcb.waitForValue();
         assert(gcb.fired);
 
@@ -1142,6 +1625,14 @@ public:
         return ss.str();
     }
 
+    const std::string &getKey() const {
+        return key;
+    }
+
+    uint16_t getVBucket() const {
+        return vbucket;
+    }
+
 private:
     const std::string name;
     const std::string key;
@@ -1156,7 +1647,13 @@ void TapProducer::queueBGFetch_UNLOCKED(const std::string &key, uint64_t id, uin
     shared_ptr<TapBGFetchCallback> dcb(new TapBGFetchCallback(&engine,
                                                               getName(), key,
                                                               vb, id, getConnectionToken()));
-    engine.getEpStore()->getAuxIODispatcher()->schedule(dcb, NULL, Priority::TapBgFetcherPriority);
+    size_t running = bgJobIssued - bgJobCompleted - deferredBGFetches.size();
+    if (running < engine.getTapConnMap().getBackfillController().getBgWindow()) {
+        engine.getEpStore()->getAuxIODispatcher()->schedule(dcb, NULL,
+                                                            Priority::TapBgFetcherPriority);
+    } else {
+        deferredBGFetches.push_back(dcb);
+    }
     ++bgJobIssued;
     std::map<uint16_t, TapCheckpointState>::iterator it = tapCheckpointState.find(vb);
     if (it != tapCheckpointState.end()) {
@@ -1165,6 +1662,35 @@ void TapProducer::queueBGFetch_UNLOCKED(const std::string &key, uint64_t id, uin
     assert(bgJobIssued > bgJobCompleted);
 }
 
+void TapProducer::scheduleDeferredBGFetches_UNLOCKED() {
+    size_t window = engine.getTapConnMap().getBackfillController().getBgWindow();
+    while (!deferredBGFetches.empty() &&
+           bgJobIssued - bgJobCompleted - deferredBGFetches.size() < window) {
+        engine.getEpStore()->getAuxIODispatcher()->schedule(deferredBGFetches.front(),
+                                                            NULL,
+                                                            Priority::TapBgFetcherPriority);
+        deferredBGFetches.pop_front();
+    }
+}
+
+void TapProducer::dropDeferredBGFetches_UNLOCKED(bool requeue) {
+    while (!deferredBGFetches.empty()) {
+        shared_ptr<TapBGFetchCallback> dcb = deferredBGFetches.front();
+        deferredBGFetches.pop_front();
+        --bgJobIssued;
+        std::map<uint16_t, TapCheckpointState>::iterator it =
+            tapCheckpointState.find(dcb->getVBucket());
+        if (it != tapCheckpointState.end() &&
+            it->second.bgJobIssued > it->second.bgJobCompleted) {
+            --(it->second.bgJobIssued);
+        }
+        if (requeue) {
+            addEvent_UNLOCKED(dcb->getKey(), dcb->getVBucket(), queue_op_set);
+        }
+    }
+    assert(bgJobIssued >= bgJobCompleted);
+}
+
 void TapProducer::completeBGFetchJob(Item *itm, uint16_t vbid, bool implicitEnqueue) {
     LockHolder lh(queueLock);
     std::map<uint16_t, TapCheckpointState>::iterator it = tapCheckpointState.find(vbid);
@@ -1183,9 +1709,16 @@ void TapProducer::completeBGFetchJob(Item *itm, uint16_t vbid, bool implicitEnqu
         ++(it->second.bgJobCompleted);
     }
     assert(bgJobIssued >= bgJobCompleted);
+    scheduleDeferredBGFetches_UNLOCKED();
 
+    if (itm && !keyFilter.accepts(itm->getKey(), itm->getFlags(),
+                                  itm->getExptime())) {
+        ++keyFilterSkipped;
+        delete itm;
+        itm = NULL;
+    }
     if (itm && vbucketFilter(itm->getVBucketId())) {
-        backfilledItems.push(itm);
+        backfilledItems.push(std::make_pair(itm, ep_current_time()));
         ++bgResultSize;
         if (it != tapCheckpointState.end()) {
             ++(it->second.bgResultSize);
@@ -1197,9 +1730,10 @@ void TapProducer::completeBGFetchJob(Item *itm, uint16_t vbid, bool implicitEnqu
     }
 }
 
-Item* TapProducer::nextBgFetchedItem_UNLOCKED() {
+Item* TapProducer::nextBgFetchedItem_UNLOCKED(rel_time_t &fetchedAt) {
     assert(!backfilledItems.empty());
-    Item *rv = backfilledItems.front();
+    Item *rv = backfilledItems.front().first;
+    fetchedAt = backfilledItems.front().second;
     assert(rv);
     backfilledItems.pop();
     --bgResultSize;
@@ -1234,6 +1768,7 @@ void TapProducer::addStats(ADD_STAT add_stat, const void *c) {
     addStat("bg_result_size", bgResultSize, add_stat, c);
     addStat("bg_jobs_issued", bgJobIssued, add_stat, c);
     addStat("bg_jobs_completed", bgJobCompleted, add_stat, c);
+    addStat("bg_jobs_deferred", deferredBGFetches.size(), add_stat, c);
     addStat("flags", flagsText, add_stat, c);
     addStat("suspended", isSuspended(), add_stat, c);
     addStat("paused", paused, add_stat, c);
@@ -1252,6 +1787,9 @@ void TapProducer::addStats(ADD_STAT add_stat, const void *c) {
             getBackfillRemaining_UNLOCKED() + getRemainingOnCheckpoints_UNLOCKED(),
             add_stat, c);
     addStat("total_noops", numNoops, add_stat, c);
+    if (doTakeOver) {
+        addStat("takeover_retries", takeoverRetries, add_stat, c);
+    }
 
     if (reconnects > 0) {
         addStat("reconnects", reconnects, add_stat, c);
@@ -1266,6 +1804,11 @@ void TapProducer::addStats(ADD_STAT add_stat, const void *c) {
         addStat("seqno_ack_requested", seqnoAckRequested, add_stat, c);
         addStat("ack_log_size", tapLog.size(), add_stat, c);
         addStat("ack_window_full", windowIsFull(), add_stat, c);
+        addStat("ack_window", getAckWindow(), add_stat, c);
+        if (minAckRtt != 0) {
+            addStat("ack_rtt", ackRtt, add_stat, c);
+            addStat("ack_rtt_min", minAckRtt, add_stat, c);
+        }
         if (windowIsFull()) {
             addStat("expires", expiryTime - ep_current_time(), add_stat, c);
         }
@@ -1275,6 +1818,24 @@ void TapProducer::addStats(ADD_STAT add_stat, const void *c) {
         addStat("flag_byteorder_support", true, add_stat, c);
     }
 
+    addStat("resumed_vbuckets", numResumedVBuckets, add_stat, c);
+    if (!keyFilter.empty()) {
+        addStat("key_filter_prefixes", keyFilter.getNumPrefixes(), add_stat, c);
+        addStat("key_filter_skipped", keyFilterSkipped, add_stat, c);
+    }
+
+    if (supportMutationBatch) {
+        addStat("mutation_batches", mutationBatchesSent, add_stat, c);
+        addStat("mutation_batch_items", mutationsBatched, add_stat, c);
+        addStat("mutation_batch_large_values", largeValuesUnbatched, add_stat, c);
+    }
+
+    addStat("bytes_sent", bytesSent, add_stat, c);
+    addStat("bytes_per_sec", getBytesPerSec_UNLOCKED(), add_stat, c);
+    addStat("replication_age", replicationAgeHisto, add_stat, c);
+    addStat("ack_wait", ackWaitHisto, add_stat, c);
+    addStat("backfill_item_age", backfillItemAgeHisto, add_stat, c);
+
     std::set<uint16_t> vbs = vbucketFilter.getVBSet();
     if (vbs.empty()) {
         std::vector<int> ids = engine.getEpStore()->getVBuckets().getBuckets();
@@ -1309,6 +1870,11 @@ void TapProducer::aggregateQueueStats(TapCounter* aggregator) {
     aggregator->tap_queueItemOnDisk += (bgJobIssued - bgJobCompleted);
     aggregator->tap_totalBacklogSize += getBackfillRemaining_UNLOCKED() +
                                         getRemainingOnCheckpoints_UNLOCKED();
+    aggregator->tap_bytesSent += bytesSent;
+    aggregator->tap_bytesPerSec += getBytesPerSec_UNLOCKED();
+    aggregator->tap_replicationAge.merge(replicationAgeHisto);
+    aggregator->tap_ackWait.merge(ackWaitHisto);
+    aggregator->tap_backfillItemAge.merge(backfillItemAgeHisto);
 }
 
 void TapProducer::processedEvent(tap_event_t event, ENGINE_ERROR_CODE)
@@ -1320,12 +1886,74 @@ void TapProducer::processedEvent(tap_event_t event, ENGINE_ERROR_CODE)
 TapConsumer::TapConsumer(EventuallyPersistentEngine &theEngine,
                          const void *c,
                          const std::string &n) :
-    TapConnection(theEngine, c, n)
+    TapConnection(theEngine, c, n), pendingApplies(0),
+    applyError(ENGINE_SUCCESS), ackCookie(NULL), ackSeqno(0)
 {
     setSupportAck(true);
     setLogHeader("TAP (Consumer) " + getName() + " -");
 }
 
+void TapConsumer::queuedApply() {
+    LockHolder lh(applyMutex);
+    ++pendingApplies;
+}
+
+void TapConsumer::appliedEvent(ENGINE_ERROR_CODE ret) {
+    LockHolder lh(applyMutex);
+    assert(pendingApplies > 0);
+    if (ret != ENGINE_SUCCESS && applyError == ENGINE_SUCCESS) {
+        applyError = ret;
+    }
+    if (--pendingApplies == 0 && ackCookie != NULL) {
+        // Still under the lock, so a disconnect can't pull the cookie
+        // from under us.
+        engine.notifyIOComplete(ackCookie, ENGINE_SUCCESS);
+    }
+}
+
+ENGINE_ERROR_CODE TapConsumer::checkApplyFailure() {
+    LockHolder lh(applyMutex);
+    return applyError == ENGINE_DISCONNECT ? ENGINE_DISCONNECT :
+        ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE TapConsumer::ackAfterApplies(const void *c, uint32_t seqno,
+                                               ENGINE_ERROR_CODE ret) {
+    LockHolder lh(applyMutex);
+    if (pendingApplies > 0) {
+        ackCookie = c;
+        ackSeqno = seqno;
+        applyError = (applyError == ENGINE_SUCCESS) ? ret : applyError;
+        return ENGINE_EWOULDBLOCK;
+    }
+    if (applyError != ENGINE_SUCCESS) {
+        // Nack the ack point with what failed since the last one.
+        ret = applyError;
+        applyError = ENGINE_SUCCESS;
+    }
+    return ret;
+}
+
+bool TapConsumer::takeAckResult(uint32_t seqno, ENGINE_ERROR_CODE &ret) {
+    LockHolder lh(applyMutex);
+    if (ackCookie == NULL || ackSeqno != seqno) {
+        return false;
+    }
+    if (pendingApplies > 0) {
+        ret = ENGINE_EWOULDBLOCK;
+        return true;
+    }
+    ackCookie = NULL;
+    ret = applyError;
+    applyError = ENGINE_SUCCESS;
+    return true;
+}
+
+void TapConsumer::dropAckWait() {
+    LockHolder lh(applyMutex);
+    ackCookie = NULL;
+}
+
 void TapConsumer::addStats(ADD_STAT add_stat, const void *c) {
     TapConnection::addStats(add_stat, c);
     addStat("num_delete", numDelete, add_stat, c);
@@ -1449,7 +2077,8 @@ void TapConsumer::processedEvent(tap_event_t event, ENGINE_ERROR_CODE ret)
 }
 
 bool TapConsumer::processCheckpointCommand(tap_event_t event, uint16_t vbucket,
-                                           uint64_t checkpointId) {
+                                           uint64_t checkpointId,
+                                           uint64_t activeTime) {
     const VBucketMap &vbuckets = engine.getEpStore()->getVBuckets();
     RCPtr<VBucket> vb = vbuckets.getBucket(vbucket);
     if (!vb) {
@@ -1492,6 +2121,10 @@ bool TapConsumer::processCheckpointCommand(tap_event_t event, uint16_t vbucket,
         ret = false;
         break;
     }
+    if (ret && checkpointId > 0 && vb->getState() == vbucket_state_replica) {
+        // Everything the active sent before the message has been applied.
+        vb->markReplicaSynced(checkpointId, activeTime);
+    }
     return ret;
 }
 
@@ -1544,7 +2177,14 @@ queued_item TapProducer::nextFgFetched_UNLOCKED(bool &shouldPause) {
             }
 
             bool isLastItem = false;
-            queued_item qi = vb->checkpointManager.nextItem(name, isLastItem);
+            queued_item qi;
+            if (it->second.fanout) {
+                qi = engine.getTapConnMap().getTapFanout().nextItem(vb, name,
+                                      isLastItem,
+                                      engine.getTapConfig().getFanoutMaxInbox());
+            } else {
+                qi = vb->checkpointManager.nextItem(name, isLastItem);
+            }
             switch(qi->getOperation()) {
             case queue_op_set:
             case queue_op_del:
@@ -1638,7 +2278,11 @@ size_t TapProducer::getRemainingOnCheckpoints_UNLOCKED() {
         if (!vb || (vb->getState() == vbucket_state_dead && !doTakeOver)) {
             continue;
         }
-        numItems += vb->checkpointManager.getNumItemsForTAPConnection(name);
+        if (it->second.fanout) {
+            numItems += engine.getTapConnMap().getTapFanout().getNumItems(vb, name);
+        } else {
+            numItems += vb->checkpointManager.getNumItemsForTAPConnection(name);
+        }
     }
     return numItems;
 }
@@ -1653,7 +2297,11 @@ bool TapProducer::hasNextFromCheckpoints_UNLOCKED() {
         if (!vb || (vb->getState() == vbucket_state_dead && !doTakeOver)) {
             continue;
         }
-        hasNext = vb->checkpointManager.hasNext(name);
+        if (it->second.fanout) {
+            hasNext = engine.getTapConnMap().getTapFanout().hasNext(vb, name);
+        } else {
+            hasNext = vb->checkpointManager.hasNext(name);
+        }
         if (hasNext) {
             break;
         }
@@ -1687,7 +2335,9 @@ bool TapProducer::SetCursorToOpenCheckpoint(uint16_t vbid) {
         return false;
     }
 
-    vb->checkpointManager.registerTAPCursor(name, checkpointId, true);
+    it->second.fanout = engine.getTapConfig().isFanout();
+    engine.getTapConnMap().getTapFanout().registerCursor(vb, name, checkpointId,
+                                                         true, it->second.fanout);
     it->second.currentCheckpointId = checkpointId;
     return true;
 }
@@ -1725,7 +2375,7 @@ void TapProducer::scheduleBackfill_UNLOCKED(const std::vector<uint16_t> &vblist)
         }
         // As we set the cursor to the beginning of the open checkpoint when backfill
         // is scheduled, we can simply remove the cursor now.
-        vb->checkpointManager.removeTAPCursor(name);
+        engine.getTapConnMap().getTapFanout().removeCursor(vb, name);
         // Send an initial_vbucket_stream message to the destination node so that it can
         // reset the corresponding vbucket before receiving the backfill stream.
         TapVBucketEvent hi(TAP_OPAQUE, *it,
@@ -1747,6 +2397,10 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
     LockHolder lh(queueLock);
     Item *itm = NULL;
 
+    if (stashedEvent != TAP_PAUSE) {
+        return unstashNextItem_UNLOCKED(vbucket, ret, nru);
+    }
+
     // Check if there are any checkpoint start / end messages to be sent to the TAP client.
     queued_item checkpoint_msg = nextCheckpointMessage_UNLOCKED();
     if (checkpoint_msg.get() != NULL) {
@@ -1765,8 +2419,18 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
             return NULL;
         }
         *vbucket = checkpoint_msg->getVBucketId();
-        uint64_t cid = htonll(checkpoint_msg->getRevSeqno());
-        value_t vblob(Blob::New((const char*)&cid, sizeof(cid)));
+        uint64_t cid[2];
+        size_t nvalue = sizeof(cid[0]);
+        cid[0] = htonll(checkpoint_msg->getRevSeqno());
+        if (ret == TAP_CHECKPOINT_END) {
+            // Tell a replica when the checkpoint was closed, so it knows how
+            // fresh it is once it has all of it.  The coarse clock's time of
+            // the close is never later than the real one.
+            uint64_t closed = ep_abs_time(checkpoint_msg->getQueuedTime());
+            cid[1] = htonll(closed * 1000000);
+            nvalue = sizeof(cid);
+        }
+        value_t vblob(Blob::New((const char*)cid, nvalue));
         itm = new Item(checkpoint_msg->getKey(), 0, 0, vblob,
                        0, -1, checkpoint_msg->getVBucketId());
         transmitted[checkpoint_msg->getVBucketId()]++;
@@ -1778,7 +2442,8 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
     // Check if there are any items fetched from disk for backfill operations.
     if (hasItemFromDisk_UNLOCKED()) {
         ret = TAP_MUTATION;
-        itm = nextBgFetchedItem_UNLOCKED();
+        rel_time_t fetchedAt;
+        itm = nextBgFetchedItem_UNLOCKED(fetchedAt);
         *vbucket = itm->getVBucketId();
         if (!vbucketFilter(*vbucket)) {
             LOG(EXTENSION_LOG_WARNING,
@@ -1809,6 +2474,7 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
         qi = queued_item(new QueuedItem(itm->getKey(), itm->getVBucketId(),
                                         ret == TAP_MUTATION ? queue_op_set : queue_op_del,
                                         itm->getSeqno()));
+        qi->setQueuedTime(fetchedAt);
     } else if (hasItemFromVBHashtable_UNLOCKED()) { // Item from memory backfill or checkpoints
         if (waitForCheckpointMsgAck()) {
             LOG(EXTENSION_LOG_INFO, "%s Waiting for an ack for "
@@ -1828,6 +2494,13 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
             ret = TAP_NOOP;
             return NULL;
         }
+        // Leave out what the consumer doesn't want before looking the
+        // item up, let alone fetching it from disk.
+        if (!keyFilter.acceptsKey(qi->getKey())) {
+            skipFilteredItem_UNLOCKED();
+            ret = TAP_NOOP;
+            return NULL;
+        }
 
         if (qi->getOperation() == queue_op_set) {
             GetValue gv(engine.getEpStore()->get(qi->getKey(), qi->getVBucketId(),
@@ -1836,6 +2509,13 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
             if (r == ENGINE_SUCCESS) {
                 itm = gv.getValue();
                 assert(itm);
+                if (!keyFilter.accepts(itm->getKey(), itm->getFlags(),
+                                       itm->getExptime())) {
+                    delete itm;
+                    skipFilteredItem_UNLOCKED();
+                    ret = TAP_NOOP;
+                    return NULL;
+                }
                 nru = gv.getNRUValue();
                 ret = TAP_MUTATION;
             } else if (r == ENGINE_KEY_ENOENT) {
@@ -1880,6 +2560,7 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
 
     if (ret == TAP_MUTATION || ret == TAP_DELETION) {
         ++queueDrain;
+        itemSent_UNLOCKED(qi, itm);
         addTapLogElement_UNLOCKED(qi);
         if (!isBackfillCompleted_UNLOCKED() && totalBackfillBacklogs > 0) {
             --totalBackfillBacklogs;
@@ -1890,6 +2571,66 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
     return itm;
 }
 
+void TapProducer::skipFilteredItem_UNLOCKED() {
+    ++keyFilterSkipped;
+    ++queueDrain;
+    if (!isBackfillCompleted_UNLOCKED() && totalBackfillBacklogs > 0) {
+        --totalBackfillBacklogs;
+    }
+}
+
+void TapProducer::stashNextItem(Item *itm, tap_event_t ev, uint16_t vbucket,
+                                uint8_t nru) {
+    LockHolder lh(queueLock);
+    assert(stashedEvent == TAP_PAUSE);
+    stashedItem = itm;
+    stashedEvent = ev;
+    stashedVBucket = vbucket;
+    stashedNru = nru;
+    // Every event that comes with an item was logged for an ack.
+    if (supportAck && itm != NULL) {
+        assert(!tapLog.empty());
+        stashedLog.push_back(tapLog.back());
+        tapLog.pop_back();
+    }
+}
+
+Item *TapProducer::unstashNextItem_UNLOCKED(uint16_t *vbucket, tap_event_t &ret,
+                                            uint8_t &nru) {
+    Item *itm = stashedItem;
+    ret = stashedEvent;
+    *vbucket = stashedVBucket;
+    nru = stashedNru;
+    stashedItem = NULL;
+    stashedEvent = TAP_PAUSE;
+
+    if ((ret == TAP_MUTATION || ret == TAP_DELETION) && !vbucketFilter(*vbucket)) {
+        delete itm;
+        if (!stashedLog.empty()) {
+            stashedLog.clear();
+            stats.memOverhead.decr(sizeof(TapLogElement));
+        }
+        ret = TAP_NOOP;
+        return NULL;
+    }
+    if (!stashedLog.empty()) {
+        stashedLog.front().seqno = seqno;
+        tapLog.push_back(stashedLog.front());
+        stashedLog.clear();
+    }
+    return itm;
+}
+
+void TapProducer::dropStashedItem_UNLOCKED() {
+    delete stashedItem;
+    stashedItem = NULL;
+    stashedEvent = TAP_PAUSE;
+    if (!stashedLog.empty()) {
+        stashedLog.clear();
+        stats.memOverhead.decr(sizeof(TapLogElement));
+    }
+}
+
 TapVBucketEvent TapProducer::checkDumpOrTakeOverCompletion() {
     LockHolder lh(queueLock);
     TapVBucketEvent ev(TAP_PAUSE, 0, vbucket_state_active);
@@ -1904,11 +2645,22 @@ TapVBucketEvent TapProducer::checkDumpOrTakeOverCompletion() {
             if (ev.state == vbucket_state_active && myState == vbucket_state_active &&
                 tapLog.size() < MAX_TAKEOVER_TAP_LOG_SIZE) {
                 // Set vbucket state to dead if the number of items waiting for
-                // implicit acks is less than the threshold.
-                LOG(EXTENSION_LOG_WARNING, "%s VBucket <%d> is going dead to "
-                    "complete vbucket takeover", logHeader(), ev.vbucket);
-                engine.getEpStore()->setVBucketState(ev.vbucket, vbucket_state_dead);
-                setTakeOverCompletionPhase(true);
+                // implicit acks is less than the threshold.  The state change
+                // itself is the last entry of the tap log.
+                size_t remaining = tapLog.empty() ? 0 : tapLog.size() - 1;
+                bool goDead = true;
+                if (takeoverRetries > 0 ||
+                    engine.getTapConfig().getTakeoverDelta() > 0) {
+                    // Stay within the delta, or a vbucket that was just set
+                    // active again for pausing too long goes dead right away
+                    // with as much left to send as the last time.
+                    remaining += getQueueSize_UNLOCKED() +
+                        getRemainingOnCheckpoints_UNLOCKED();
+                    goDead = remaining <= getTakeoverDelta_UNLOCKED();
+                }
+                if (goDead) {
+                    goDeadForTakeover_UNLOCKED(ev.vbucket, remaining);
+                }
             }
             if (tapLog.size() > 1) {
                 // We're still waiting for acks for regular items.
@@ -1917,6 +2669,11 @@ TapVBucketEvent TapProducer::checkDumpOrTakeOverCompletion() {
                 TapVBucketEvent lo(TAP_VBUCKET_SET, ev.vbucket, vbucket_state_active);
                 addVBucketLowPriority_UNLOCKED(lo);
                 ev.event = TAP_PAUSE;
+                checkTakeoverPause_UNLOCKED();
+            } else if (ev.state == vbucket_state_active) {
+                // The final state change goes out now, the pause can't be
+                // undone anymore.
+                takeoverPauseStart = 0;
             }
         } else if (!tapLog.empty()) {
             ev.event = TAP_PAUSE;
@@ -1931,6 +2688,80 @@ TapVBucketEvent TapProducer::checkDumpOrTakeOverCompletion() {
     return ev;
 }
 
+void TapProducer::checkTakeoverDelta() {
+    LockHolder lh(queueLock);
+    if (!doTakeOver || !isBackfillCompleted_UNLOCKED()) {
+        return;
+    }
+    if (takeoverPauseStart != 0) {
+        checkTakeoverPause_UNLOCKED();
+        return;
+    }
+    if (vBucketLowPriority.empty()) {
+        return;
+    }
+
+    const TapVBucketEvent &ev = vBucketLowPriority.front();
+    if (ev.event != TAP_VBUCKET_SET || ev.state != vbucket_state_active) {
+        return;
+    }
+    size_t delta = getTakeoverDelta_UNLOCKED();
+    if (delta == 0 || tapLog.size() > delta) {
+        return;
+    }
+    size_t remaining = tapLog.size() + getQueueSize_UNLOCKED();
+    if (remaining > delta) {
+        return;
+    }
+    remaining += getRemainingOnCheckpoints_UNLOCKED();
+    if (remaining > delta) {
+        return;
+    }
+
+    RCPtr<VBucket> vb = engine.getVBucket(ev.vbucket);
+    if (vb && vb->getState() == vbucket_state_active) {
+        goDeadForTakeover_UNLOCKED(ev.vbucket, remaining);
+    }
+}
+
+size_t TapProducer::getTakeoverDelta_UNLOCKED() {
+    // Each round that paused for too long halves the delta, so a hot
+    // vbucket ends with a pause as short as on a stream that drained.
+    size_t delta = engine.getTapConfig().getTakeoverDelta();
+    return takeoverRetries < 64 ? delta >> takeoverRetries : 0;
+}
+
+void TapProducer::goDeadForTakeover_UNLOCKED(uint16_t vbid, size_t remaining) {
+    LOG(EXTENSION_LOG_WARNING, "%s VBucket <%d> is going dead to "
+        "complete vbucket takeover with %llu items left to send",
+        logHeader(), vbid, static_cast<unsigned long long>(remaining));
+    engine.getEpStore()->setVBucketState(vbid, vbucket_state_dead);
+    setTakeOverCompletionPhase(true);
+    takeoverVBucket = vbid;
+    takeoverPauseStart = gethrtime();
+}
+
+void TapProducer::checkTakeoverPause_UNLOCKED() {
+    size_t maxPause = engine.getTapConfig().getTakeoverMaxPause();
+    if (maxPause == 0 || takeoverPauseStart == 0 ||
+        (gethrtime() - takeoverPauseStart) / 1000000 < maxPause) {
+        return;
+    }
+
+    takeoverPauseStart = 0;
+    ++takeoverRetries;
+    RCPtr<VBucket> vb = engine.getVBucket(takeoverVBucket);
+    if (!vb || vb->getState() != vbucket_state_dead) {
+        return;
+    }
+    LOG(EXTENSION_LOG_WARNING, "%s VBucket <%d> has been dead for more than "
+        "%llu ms; setting it active again to catch up (retry #%llu)",
+        logHeader(), takeoverVBucket, static_cast<unsigned long long>(maxPause),
+        static_cast<unsigned long long>(takeoverRetries));
+    engine.getEpStore()->setVBucketState(takeoverVBucket, vbucket_state_active);
+    setTakeOverCompletionPhase(false);
+}
+
 bool TapProducer::addEvent_UNLOCKED(const queued_item &it) {
     if (vbucketFilter(it->getVBucketId())) {
         bool wasEmpty = queue->empty();
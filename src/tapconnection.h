@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include <deque>
 #include <list>
 #include <map>
 #include <queue>
@@ -29,6 +30,7 @@
 
 #include "atomic.h"
 #include "common.h"
+#include "histo.h"
 #include "locks.h"
 #include "mutex.h"
 
@@ -40,6 +42,7 @@ class BackFillVisitor;
 class TapBGFetchCallback;
 class CompleteBackfillOperation;
 class Dispatcher;
+class DispatcherCallback;
 class Item;
 class TapProducer;
 class VBucketFilter;
@@ -137,7 +140,8 @@ struct TapCounter {
     TapCounter()
         : tap_queue(0), totalTaps(0),
           tap_queueFill(0), tap_queueDrain(0), tap_queueBackoff(0),
-          tap_queueBackfillRemaining(0), tap_queueItemOnDisk(0), tap_totalBacklogSize(0)
+          tap_queueBackfillRemaining(0), tap_queueItemOnDisk(0), tap_totalBacklogSize(0),
+          tap_bytesSent(0), tap_bytesPerSec(0)
     {}
 
     size_t      tap_queue;
@@ -149,6 +153,15 @@ struct TapCounter {
     size_t      tap_queueBackfillRemaining;
     size_t      tap_queueItemOnDisk;
     size_t      tap_totalBacklogSize;
+
+    size_t      tap_bytesSent;
+    size_t      tap_bytesPerSec;
+    Histogram<hrtime_t> tap_replicationAge;
+    Histogram<hrtime_t> tap_ackWait;
+    Histogram<hrtime_t> tap_backfillItemAge;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(TapCounter);
 };
 
 typedef enum {
@@ -165,12 +178,13 @@ class TapCheckpointState {
 public:
     TapCheckpointState() :
         currentCheckpointId(0), lastSeqNum(0), bgResultSize(0),
-        bgJobIssued(0), bgJobCompleted(0), lastItem(false), state(backfill) {}
+        bgJobIssued(0), bgJobCompleted(0), lastItem(false), fanout(false),
+        state(backfill) {}
 
     TapCheckpointState(uint16_t vb, uint64_t checkpointId, tap_checkpoint_state s) :
         vbucket(vb), currentCheckpointId(checkpointId), lastSeqNum(0),
         bgResultSize(0), bgJobIssued(0), bgJobCompleted(0),
-        lastItem(false), state(s) {}
+        lastItem(false), fanout(false), state(s) {}
 
     bool isBgFetchCompleted(void) const {
         return bgResultSize == 0 && (bgJobIssued - bgJobCompleted) == 0;
@@ -191,6 +205,8 @@ public:
 
     // True if the TAP cursor reaches to the last item at its current checkpoint.
     bool lastItem;
+    // True if the TAP cursor was registered as a member of the vbucket's TapFanout group.
+    bool fanout;
     tap_checkpoint_state state;
 };
 
@@ -204,6 +220,10 @@ public:
         return ackWindowSize;
     }
 
+    uint32_t getAckWindowMax() const {
+        return ackWindowMax;
+    }
+
     uint32_t getAckInterval() const {
         return ackInterval;
     }
@@ -236,6 +256,50 @@ public:
         return backfillResidentThreshold;
     }
 
+    size_t getBackfillBgSlo() const {
+        return backfillBgSlo;
+    }
+
+    size_t getBackfillAckSlo() const {
+        return backfillAckSlo;
+    }
+
+    size_t getBackfillMaxDiskLoads() const {
+        return backfillMaxDiskLoads;
+    }
+
+    size_t getMutationBatchSize() const {
+        return mutationBatchSize;
+    }
+
+    size_t getMutationBatchMaxValue() const {
+        return mutationBatchMaxValue;
+    }
+
+    bool isApplyParallel() const {
+        return applyParallel;
+    }
+
+    size_t getApplyBatchSize() const {
+        return applyBatchSize;
+    }
+
+    bool isFanout() const {
+        return fanout;
+    }
+
+    size_t getFanoutMaxInbox() const {
+        return fanoutMaxInbox;
+    }
+
+    size_t getTakeoverDelta() const {
+        return takeoverDelta;
+    }
+
+    size_t getTakeoverMaxPause() const {
+        return takeoverMaxPause;
+    }
+
 protected:
     friend class TapConfigChangeListener;
     friend class EventuallyPersistentEngine;
@@ -244,6 +308,10 @@ protected:
         ackWindowSize = static_cast<uint32_t>(value);
     }
 
+    void setAckWindowMax(size_t value) {
+        ackWindowMax = static_cast<uint32_t>(value);
+    }
+
     void setAckInterval(size_t value) {
         ackInterval = static_cast<uint32_t>(value);
     }
@@ -279,11 +347,56 @@ protected:
         backfillResidentThreshold = value;
     }
 
+    void setBackfillBgSlo(size_t value) {
+        backfillBgSlo = value;
+    }
+
+    void setBackfillAckSlo(size_t value) {
+        backfillAckSlo = value;
+    }
+
+    void setBackfillMaxDiskLoads(size_t value) {
+        backfillMaxDiskLoads = value;
+    }
+
+    void setMutationBatchSize(size_t value) {
+        mutationBatchSize = value;
+    }
+
+    void setMutationBatchMaxValue(size_t value) {
+        mutationBatchMaxValue = value;
+    }
+
+    void setApplyParallel(bool value) {
+        applyParallel = value;
+    }
+
+    void setApplyBatchSize(size_t value) {
+        applyBatchSize = value;
+    }
+
+    void setFanout(bool value) {
+        fanout = value;
+    }
+
+    void setFanoutMaxInbox(size_t value) {
+        fanoutMaxInbox = value;
+    }
+
+    void setTakeoverDelta(size_t value) {
+        takeoverDelta = value;
+    }
+
+    void setTakeoverMaxPause(size_t value) {
+        takeoverMaxPause = value;
+    }
+
     static void addConfigChangeListener(EventuallyPersistentEngine &engine);
 
 private:
     // Constants used to enforce the tap ack protocol
     uint32_t ackWindowSize;
+    uint32_t ackWindowMax;
     uint32_t ackInterval;
     rel_time_t ackGracePeriod;
 
@@ -302,6 +415,37 @@ private:
     size_t backfillBacklogLimit;
     double backfillResidentThreshold;
 
+    // Parameters of the BackfillController: the front-end bg fetch and
+    // consumer ack latencies (usec, msec) backfills are slowed down at,
+    // and how many vbucket disk backfills may start per second
+    size_t backfillBgSlo;
+    size_t backfillAckSlo;
+    size_t backfillMaxDiskLoads;
+
+    // Max number of mutations packed in one TAP_OPAQUE_MUTATION_BATCH message
+    size_t mutationBatchSize;
+    // Bigger values aren't copied into a batch but sent by reference
+    size_t mutationBatchMaxValue;
+
+    // Hand incoming mutations to the TapApplier instead of applying
+    // them on the connection's worker thread
+    bool applyParallel;
+
+    // Max number of mutations of a vbucket the TapApplier applies together
+    size_t applyBatchSize;
+
+    // Walk the checkpoints of a vbucket once for all the producers
+    // streaming it; see TapFanout
+    bool fanout;
+    // Max number of items a producer may have waiting in its TapFanout inbox
+    size_t fanoutMaxInbox;
+
+    // Items a takeover stream may have left to send when its vbucket goes
+    // dead, and how long (ms) the vbucket may stay dead before the stream
+    // sets it active again and pre-copies some more
+    size_t takeoverDelta;
+    size_t takeoverMaxPause;
+
     EventuallyPersistentEngine &engine;
 };
 
@@ -343,6 +487,141 @@ public:
                                      uint8_t nru = 0xff);
 };
 
+/**
+ * A run of mutations and deletions of one vbucket packed into the engine
+ * specific data of a single TAP_OPAQUE message, for consumers that asked
+ * for it with TAP_CONNECT_MUTATION_BATCH.
+ *
+ * The data is the TAP_OPAQUE_MUTATION_BATCH code (4 bytes) and the number
+ * of records (2 bytes), followed by the records.  Each record is the event
+ * (1), nru (1), key length (2), flags (4), expiry time (4), cas (8), rev
+ * seqno (8) and value length (4), followed by the key and the value.  All
+ * the numbers are in network byte order.
+ */
+class TapMutationBatch {
+public:
+
+    /**
+     * A decoded record.  The key and value point into the message.
+     */
+    struct Record {
+        tap_event_t event;
+        uint8_t nru;
+        const char *key;
+        uint16_t nkey;
+        uint32_t flags;
+        uint32_t exptime;
+        uint64_t cas;
+        uint64_t seqno;
+        const char *value;
+        uint32_t nvalue;
+    };
+
+    TapMutationBatch() {
+        reset();
+    }
+
+    /**
+     * Drop all the records.
+     */
+    void reset();
+
+    /**
+     * Append an item as a record.
+     *
+     * @param ev TAP_MUTATION or TAP_DELETION
+     * @param itm the item, with its value uncompressed
+     * @param nru the item's nru value
+     * @return false if the record doesn't fit in the message
+     */
+    bool add(tap_event_t ev, const Item &itm, uint8_t nru);
+
+    size_t getCount() const {
+        return count;
+    }
+
+    void *getData() {
+        return &data[0];
+    }
+
+    uint16_t getSize() const {
+        return static_cast<uint16_t>(data.size());
+    }
+
+    /**
+     * Is the engine specific data of a TAP_OPAQUE message a mutation batch?
+     */
+    static bool isMutationBatch(const void *es, uint16_t nes);
+
+    /**
+     * Decode the engine specific data of a TAP_OPAQUE_MUTATION_BATCH message.
+     *
+     * @return false if the message is malformed
+     */
+    static bool decode(const void *es, uint16_t nes, std::vector<Record> &records);
+
+    // size of the message header
+    static const size_t sizeHeader;
+    // size of a record without its key and value
+    static const size_t sizeRecordHeader;
+
+private:
+    std::vector<uint8_t> data;
+    size_t count;
+};
+
+/**
+ * The items a TAP producer sends to a consumer that asked for them with
+ * TAP_CONNECT_KEY_FILTER: their keys start with one of a set of
+ * prefixes, their flags match under a mask and, optionally, they don't
+ * expire.  Deletions are matched on their keys alone.  An empty filter
+ * lets everything through.
+ */
+class TapKeyFilter {
+public:
+
+    TapKeyFilter() : flagsMask(0), flagsValue(0), noExpiry(false) {}
+
+    /**
+     * Decode the filter from TAP connect userdata, moving past it.
+     *
+     * @param ptr where the filter starts
+     * @param len the bytes left in the userdata
+     * @return false if the filter is malformed
+     */
+    bool decode(const char *&ptr, size_t &len);
+
+    bool empty() const {
+        return prefixes.empty() && flagsMask == 0 && !noExpiry;
+    }
+
+    /**
+     * True if a deletion, or a mutation yet to be looked up, of the
+     * given key may be sent.
+     */
+    bool acceptsKey(const std::string &key) const;
+
+    /**
+     * True if a mutation with the given key, flags and expiry is sent.
+     */
+    bool accepts(const std::string &key, uint32_t flags,
+                 time_t exptime) const {
+        return (flags & flagsMask) == flagsValue &&
+            !(noExpiry && exptime != 0) && acceptsKey(key);
+    }
+
+    size_t getNumPrefixes() const {
+        return prefixes.size();
+    }
+
+private:
+    //! Sorted, so a key is only compared to the prefixes up to it
+    std::vector<std::string> prefixes;
+    uint32_t flagsMask;
+    uint32_t flagsValue;
+    bool noExpiry;
+};
+
 /**
  * An abstract class representing a TAP connection. There are two different
  * types of a TAP connection, a producer and a consumer. The producers needs
@@ -413,6 +692,9 @@ protected:
     template <typename T>
     void addStat(const char *nm, T val, ADD_STAT add_stat, const void *c);
 
+    void addStat(const char *nm, const Histogram<hrtime_t> &val,
+                 ADD_STAT add_stat, const void *c);
+
     void addStat(const char *nm, bool val, ADD_STAT add_stat, const void *c) {
         addStat(nm, val ? "true" : "false", add_stat, c);
     }
@@ -551,15 +833,82 @@ private:
     Atomic<size_t> numCheckpointEndFailed;
     Atomic<size_t> numUnknown;
 
+    //! Guards the state below
+    Mutex applyMutex;
+    //! Events handed to the TapApplier that it hasn't applied yet
+    size_t pendingApplies;
+    //! The first failure the TapApplier met since the last ack
+    ENGINE_ERROR_CODE applyError;
+    //! The connection waiting for the pending events before acking
+    const void *ackCookie;
+    //! The seqno of the event to ack once they're applied
+    uint32_t ackSeqno;
+
 public:
     TapConsumer(EventuallyPersistentEngine &theEngine,
                 const void *c,
                 const std::string &n);
     virtual void processedEvent(tap_event_t event, ENGINE_ERROR_CODE ret);
+
+    /**
+     * Count an event as handed to the TapApplier.
+     */
+    void queuedApply();
+
+    /**
+     * Count an event handed to the TapApplier as applied (or failed for
+     * good), and notify the connection waiting to ack once the last
+     * pending one is.
+     */
+    void appliedEvent(ENGINE_ERROR_CODE ret);
+
+    /**
+     * Check if the TapApplier failed to apply one of our events in a way
+     * the connection can't recover from.
+     *
+     * @return ENGINE_DISCONNECT if the connection must be closed
+     */
+    ENGINE_ERROR_CODE checkApplyFailure();
+
+    /**
+     * Ack an event only once the events queued before it were applied.
+     *
+     * @param cookie the connection the event came in on
+     * @param seqno the seqno of the event
+     * @param ret what the event itself returned
+     * @return ENGINE_EWOULDBLOCK if the connection is to wait, or what to
+     *         ack the event with: the first failure of the events applied
+     *         since the last ack, if any
+     */
+    ENGINE_ERROR_CODE ackAfterApplies(const void *cookie, uint32_t seqno,
+                                      ENGINE_ERROR_CODE ret);
+
+    /**
+     * Take the result of an ack that had to wait for the pending events.
+     *
+     * @return true if the event of the given seqno was waiting on them,
+     *         with ret set to what to ack it with, or to
+     *         ENGINE_EWOULDBLOCK if they're still pending
+     */
+    bool takeAckResult(uint32_t seqno, ENGINE_ERROR_CODE &ret);
+
+    /**
+     * Forget the connection waiting to ack; it's gone.
+     */
+    void dropAckWait();
+
     virtual void addStats(ADD_STAT add_stat, const void *c);
     virtual const char *getType() const { return "consumer"; };
+    /**
+     * Process a checkpoint message from the active.
+     *
+     * @param activeTime when (usec of the active's wall clock) the active
+     *        closed the checkpoint a checkpoint_end message ends, or 0 if
+     *        it didn't say
+     */
     virtual bool processCheckpointCommand(tap_event_t event, uint16_t vbucket,
-                                          uint64_t checkpointId);
+                                          uint64_t checkpointId,
+                                          uint64_t activeTime = 0);
     virtual void checkVBOpenCheckpoint(uint16_t);
     void setBackfillPhase(bool isBackfill, uint16_t vbucket);
     bool isBackfillPhase(uint16_t vbucket);
@@ -647,6 +996,10 @@ public:
         return tapFlagByteorderSupport;
     }
 
+    bool supportsMutationBatch() const {
+        return supportMutationBatch;
+    }
+
     bool isReconnected() const {
         return reconnects > 0;
     }
@@ -656,6 +1009,14 @@ public:
         clearQueues_UNLOCKED();
     }
 
+    /**
+     * The connection is gone; don't start any more of its bg fetches.
+     */
+    void disconnected() {
+        LockHolder lh(queueLock);
+        dropDeferredBGFetches_UNLOCKED(true);
+    }
+
     bool isPaused() {
         return paused;
     }
@@ -689,12 +1050,47 @@ private:
     Item *getNextItem(const void *c, uint16_t *vbucket, tap_event_t &ret,
                       uint8_t &nru);
 
+    /**
+     * Keep an event returned by getNextItem() that couldn't go in the
+     * mutation batch being built, so the next getNextItem() call returns
+     * it again.  Its ack log element is taken out of the log until then,
+     * so that it's acked with the sequence number it's sent with.
+     */
+    void stashNextItem(Item *itm, tap_event_t ev, uint16_t vbucket, uint8_t nru);
+
+    Item *unstashNextItem_UNLOCKED(uint16_t *vbucket, tap_event_t &ret, uint8_t &nru);
+
+    void dropStashedItem_UNLOCKED();
+
+    /**
+     * Account for a queued item that the key filter left out.
+     */
+    void skipFilteredItem_UNLOCKED();
+
+    /**
+     * Is this the engine specific data of the mutation batch being sent?
+     */
+    bool isMutationBatch(const void *es) {
+        return es == mutationBatch.getData();
+    }
+
     /**
      * Check if TAP_DUMP or TAP_TAKEOVER is completed and close the connection if
      * all messages including vbucket_state change commands are sent.
      */
     TapVBucketEvent checkDumpOrTakeOverCompletion();
 
+    /**
+     * Let a TAP_TAKEOVER stream that has nearly caught up set the vbucket
+     * of its next state change dead without waiting for the stream to
+     * drain: it goes dead once no more than tap_takeover_delta items are
+     * left to send and ack.  A vbucket that has been dead for longer than
+     * tap_takeover_max_pause without its final state change going out is
+     * set active again, and the stream goes on pre-copying with half the
+     * delta before trying again.
+     */
+    void checkTakeoverDelta();
+
     void completeBackfillCommon_UNLOCKED() {
         if (mayCompleteDumpOrTakeover_UNLOCKED() && idle_UNLOCKED()) {
             // There is no data for this connection..
@@ -847,7 +1243,7 @@ private:
 
     bool emptyQueue_UNLOCKED() {
         return !hasItemFromDisk_UNLOCKED() && (bgJobIssued - bgJobCompleted) == 0 &&
-               !hasItemFromVBHashtable_UNLOCKED();
+               !hasItemFromVBHashtable_UNLOCKED() && stashedEvent == TAP_PAUSE;
     }
 
     bool idle_UNLOCKED() {
@@ -920,7 +1316,7 @@ private:
     /**
      * Get the next item from the queue that has items fetched from disk.
      */
-    Item* nextBgFetchedItem_UNLOCKED();
+    Item* nextBgFetchedItem_UNLOCKED(rel_time_t &fetchedAt);
 
     void flush();
 
@@ -964,6 +1360,17 @@ private:
 
     void scheduleBackfill_UNLOCKED(const std::vector<uint16_t> &vblist);
 
+    /**
+     * Stream what was persisted for a vbucket after a given disk seqno,
+     * for a client resuming from a checkpoint that is no longer in memory.
+     */
+    void scheduleResume_UNLOCKED(uint16_t vbid, uint64_t since);
+
+    /**
+     * True if a vbucket can be streamed from a disk seqno on.
+     */
+    bool canStreamFromDisk(uint16_t vbid);
+
     void scheduleBackfill(const std::vector<uint16_t> &vblist) {
         LockHolder lh(queueLock);
         scheduleBackfill_UNLOCKED(vblist);
@@ -995,6 +1402,20 @@ private:
     void queueBGFetch_UNLOCKED(const std::string &key, uint64_t id,
                                uint16_t vb);
 
+    /**
+     * Schedule the deferred bg fetches the bg fetch window has room for.
+     */
+    void scheduleDeferredBGFetches_UNLOCKED();
+
+    /**
+     * Take back the bg fetches still waiting for room in the bg window,
+     * and the jobs they were counted as.
+     *
+     * @param requeue true to send their keys through the live queue
+     *                instead, as the stream goes on
+     */
+    void dropDeferredBGFetches_UNLOCKED(bool requeue);
+
     TapProducer(EventuallyPersistentEngine &theEngine,
                 const void *cookie,
                 const std::string &n,
@@ -1002,6 +1423,7 @@ private:
 
     ~TapProducer() {
         delete queue;
+        delete stashedItem;
         delete []specificData;
         delete []transmitted;
         assert(!isReserved());
@@ -1015,6 +1437,32 @@ private:
      */
     bool windowIsFull();
 
+    /**
+     * Get the number of ack requests that may be outstanding.
+     *
+     * This is tap_ack_window_size, unless tap_ack_window_max allows the
+     * window to be tuned to the round trip time of the acks.
+     */
+    uint32_t getAckWindow() const;
+
+    /**
+     * Compute the next ack window from the round trip time of an ack.
+     *
+     * The window grows by one while it fills up and the acks come back
+     * within twice the lowest round trip time seen, i.e. while the
+     * consumer keeps up and the window is what holds the stream back.
+     * It shrinks by a quarter once they take longer than that.
+     *
+     * @param current the current window
+     * @param min tap_ack_window_size
+     * @param max tap_ack_window_max
+     * @param rtt the round trip time of the ack
+     * @param minRtt the lowest round trip time seen
+     * @param filled true if the window filled up since the last ack timed
+     */
+    static uint32_t nextAckWindow(uint32_t current, uint32_t min, uint32_t max,
+                                  hrtime_t rtt, hrtime_t minRtt, bool filled);
+
     /**
      * Should we request a TAP ack for this message?
      * @param event the event type for this message
@@ -1051,6 +1499,16 @@ private:
         takeOverCompletionPhase = completionPhase;
     }
 
+    /**
+     * Max number of items left to send a vbucket being taken over may go
+     * dead with, as of the retries so far.
+     */
+    size_t getTakeoverDelta_UNLOCKED();
+
+    void goDeadForTakeover_UNLOCKED(uint16_t vbid, size_t remaining);
+
+    void checkTakeoverPause_UNLOCKED();
+
     bool checkBackfillCompletion_UNLOCKED();
     bool checkBackfillCompletion() {
         LockHolder lh(queueLock);
@@ -1072,6 +1530,25 @@ private:
         return vbucketFilter(vbucket);
     }
 
+    void setKeyFilter(const TapKeyFilter &filter) {
+        LockHolder lh(queueLock);
+        keyFilter = filter;
+    }
+
+    TapKeyFilter getKeyFilter() {
+        LockHolder lh(queueLock);
+        return keyFilter;
+    }
+
+    /**
+     * Set the disk seqnos the client asked to stream vbuckets from, used
+     * by the next registerTAPCursor().
+     */
+    void setSinceSeqnos(const std::map<uint16_t, uint64_t> &seqnos) {
+        LockHolder lh(queueLock);
+        sinceSeqnos = seqnos;
+    }
+
     /**
      * Register the unified queue cursor for this TAP producer.
      */
@@ -1082,7 +1559,30 @@ private:
         return tapLog.size();
     }
 
-    void reschedule_UNLOCKED(const std::list<TapLogElement>::iterator &iter);
+    void reschedule_UNLOCKED(const TapLogElement &log);
+
+    /**
+     * Find the first log element sent with the given sequence number.
+     *
+     * The log is ordered by sequence number, so this is a binary search on
+     * the distance from the oldest element; the sequence number may have
+     * wrapped around in between.
+     *
+     * @return tapLog.end() if there's no such element
+     */
+    std::deque<TapLogElement>::iterator findTapLog_UNLOCKED(uint32_t s);
+
+    void timeAck_UNLOCKED(hrtime_t rtt);
+
+    /**
+     * Account for a mutation or deletion being sent.
+     *
+     * @param qi the queued item it was sent for
+     * @param itm the item sent
+     */
+    void itemSent_UNLOCKED(const queued_item &qi, const Item *itm);
+
+    size_t getBytesPerSec_UNLOCKED() const;
 
     void clearQueues_UNLOCKED();
 
@@ -1093,10 +1593,12 @@ private:
     std::list<queued_item> *queue;
     //! Live stream queue size
     size_t queueSize;
-    //! Queue of items backfilled from disk
-    std::queue<Item*> backfilledItems;
-    //! List of items that are waiting for acks from the client
-    std::list<TapLogElement> tapLog;
+    //! Queue of items backfilled from disk, with the time they were read
+    std::queue<std::pair<Item*, rel_time_t> > backfilledItems;
+    //! Bg fetches waiting for room in the BackfillController's bg window
+    std::list<shared_ptr<TapBGFetchCallback> > deferredBGFetches;
+    //! Items that are waiting for acks from the client, oldest first
+    std::deque<TapLogElement> tapLog;
 
     //! Keeps track of items transmitted per VBucket
     Atomic<size_t> *transmitted;
@@ -1132,6 +1634,12 @@ private:
     bool doTakeOver;
     //! Take over completion phase?
     bool takeOverCompletionPhase;
+    //! Vbucket set dead for the takeover that's waiting for its final
+    //! state change to be sent, and since when (0 if there's none)
+    uint16_t takeoverVBucket;
+    hrtime_t takeoverPauseStart;
+    //! Number of times a takeover vbucket was set active again
+    size_t takeoverRetries;
 
     //! Should a new backfill task be scheduled now?
     bool doRunBackfill;
@@ -1146,6 +1654,14 @@ private:
 
     //! Filter for the vbuckets we want.
     VBucketFilter vbucketFilter;
+    //! Key prefix / flags / expiry filter requested by the consumer
+    TapKeyFilter keyFilter;
+    //! Number of items the key filter kept off the stream
+    Atomic<size_t> keyFilterSkipped;
+    //! Number of vbuckets streamed from a disk seqno rather than backfilled
+    size_t numResumedVBuckets;
+    //! Disk seqnos to stream vbuckets from, not yet taken up
+    std::map<uint16_t, uint64_t> sinceSeqnos;
     //! Filter for the vbuckets that require backfill by the next backfill task
     VBucketFilter backFillVBucketFilter;
     //! vbuckets that are being backfilled by the current backfill session
@@ -1167,6 +1683,31 @@ private:
     uint32_t seqnoReceived;
     //! The last tap sequence number for which an ack is requested
     uint32_t seqnoAckRequested;
+    //! When the ack being timed was requested (0 if none is)
+    hrtime_t ackRequestedAt;
+    //! The sequence number of the ack being timed
+    uint32_t seqnoAckTimed;
+    //! The current ack window when it's tuned to the acks' round trip time
+    uint32_t ackWindow;
+    //! Set when an ack came in on a full window since the last ack timed
+    bool ackWindowFilled;
+    //! The round trip time (usec) of the last ack timed
+    hrtime_t ackRtt;
+    //! The lowest round trip time (usec) of the acks timed
+    hrtime_t minAckRtt;
+
+    //! Time (usec) from queueDirty to send of the checkpoint items
+    Histogram<hrtime_t> replicationAgeHisto;
+    //! Time (usec) from send to ack of the acks timed
+    Histogram<hrtime_t> ackWaitHisto;
+    //! Time (usec) from being read to send of the backfilled items
+    Histogram<hrtime_t> backfillItemAgeHisto;
+    //! Key and value bytes of the mutations and deletions sent
+    size_t bytesSent;
+    //! Bytes sent in the current second, and in the one before
+    size_t bytesInWindow;
+    size_t bytesPerSec;
+    rel_time_t rateWindowStart;
     //! Flag indicating if the pending memcached connection is notified
     Atomic<bool> notifySent;
     //! Flag indicating if the notification event is scheduled
@@ -1195,6 +1736,22 @@ private:
     //! Does the Tap Consumer know about the byteorder bug for the flags
     bool tapFlagByteorderSupport;
 
+    //! Does the Tap Consumer take batched mutations?
+    bool supportMutationBatch;
+    //! The mutation batch last sent
+    TapMutationBatch mutationBatch;
+    Atomic<size_t> mutationBatchesSent;
+    Atomic<size_t> mutationsBatched;
+    //! Mutations sent on their own because their value is too big to copy
+    Atomic<size_t> largeValuesUnbatched;
+    //! The event held back from the last mutation batch
+    Item *stashedItem;
+    tap_event_t stashedEvent;
+    uint16_t stashedVBucket;
+    uint8_t stashedNru;
+    //! Its ack log element, if any
+    std::list<TapLogElement> stashedLog;
+
     //! EP-engine specific item info
     uint8_t *specificData;
     //! Timestamp of backfill start
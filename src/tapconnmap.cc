@@ -19,17 +19,18 @@
 
 #include <algorithm>
 #include <limits>
-#include <queue>
 #include <set>
 #include <string>
 #include <vector>
 
 #include "ep_engine.h"
+#include "lock_profiler.h"
 #include "tapconnection.h"
 #include "tapconnmap.h"
+#include "tapfanout.h"
 
 size_t TapConnMap::vbConnLockNum = 32;
-const double TapConnNotifier::DEFAULT_MIN_STIME = 0.001;
+const double TapConnNotifier::IDLE_SLEEP_TIME = 1.0;
 
 /**
  * Dispatcher task to free the resource of a tap connection.
@@ -92,24 +93,175 @@ void TapConnNotifier::stop() {
     dispatcher->cancel(task);
 }
 
+void TapConnNotifier::wake() {
+    dispatcher->wake(task);
+}
+
 bool TapConnNotifier::notify() {
     engine.getTapConnMap().notifyAllPausedConnections();
 
-    if (engine.getTapConnMap().notificationQueueEmpty()) {
-        dispatcher->snooze(task, minSleepTime);
-        if (minSleepTime == 1.0) {
-            minSleepTime = DEFAULT_MIN_STIME;
-        } else {
-            minSleepTime = std::min(minSleepTime * 2, 1.0);
-        }
+    dispatcher->snooze(task, IDLE_SLEEP_TIME);
+    // A vbucket queued after we looked but before the snooze would have
+    // its wakeup overridden by it.
+    if (!engine.getTapConnMap().notificationQueueEmpty()) {
+        dispatcher->snooze(task, 0);
+    }
+
+    return true;
+}
+
+/**
+ * A DispatcherCallback for the backfill controller
+ */
+class BackfillControllerCallback : public DispatcherCallback {
+public:
+    BackfillControllerCallback(BackfillController *c) : controller(c) { }
+
+    bool callback(Dispatcher &, TaskId &) {
+        return controller->adjust();
+    }
+
+    std::string description() {
+        return std::string("Adjusting the tap backfill limits");
+    }
+
+private:
+    BackfillController *controller;
+};
+
+BackfillController::BackfillController(EventuallyPersistentEngine &e) :
+    engine(e), dispatcher(NULL), lastBgTime(0), lastBgOps(0),
+    lastAckWait(0), lastAckSamples(0)
+{
+    const TapConfig &config = engine.getTapConfig();
+    bgWindow.set(std::max(config.getBgMaxPending(), static_cast<size_t>(1)));
+    backlogLimit.set(config.getBackfillBacklogLimit());
+    diskLoadRate.set(config.getBackfillMaxDiskLoads());
+    diskLoadSlots.set(diskLoadRate.get());
+}
+
+void BackfillController::start(Dispatcher *d) {
+    dispatcher = d;
+    shared_ptr<BackfillControllerCallback> cb(new BackfillControllerCallback(this));
+    dispatcher->schedule(cb, &task, Priority::BackfillControllerPriority, 1);
+    assert(task.get());
+}
+
+void BackfillController::stop() {
+    dispatcher->cancel(task);
+}
+
+bool BackfillController::adjust() {
+    const TapConfig &config = engine.getTapConfig();
+    size_t maxWindow = std::max(config.getBgMaxPending(), static_cast<size_t>(1));
+    size_t maxBacklog = config.getBackfillBacklogLimit();
+    size_t maxDiskLoads = config.getBackfillMaxDiskLoads();
+
+    // Always take the samples, so the first interval after enabling
+    // the controller doesn't see everything since startup.
+    bool backOff = isOverloaded();
+    if (!isEnabled()) {
+        bgWindow.set(maxWindow);
+        backlogLimit.set(maxBacklog);
+        diskLoadRate.set(maxDiskLoads);
     } else {
-        // We don't sleep, but instead reset the sleep time to the default value.
-        minSleepTime = DEFAULT_MIN_STIME;
+        if (backOff) {
+            ++engine.getEpStats().tapBackfillBackoffs;
+        }
+        bgWindow.set(nextLimit(bgWindow.get(), maxWindow, backOff));
+        backlogLimit.set(nextLimit(backlogLimit.get(), maxBacklog, backOff));
+        diskLoadRate.set(nextLimit(diskLoadRate.get(), maxDiskLoads, backOff));
+    }
+    diskLoadSlots.set(diskLoadRate.get());
+
+    dispatcher->snooze(task, 1);
+    return true;
+}
+
+size_t BackfillController::getBgWindow() const {
+    if (!isEnabled()) {
+        return std::max(engine.getTapConfig().getBgMaxPending(),
+                        static_cast<size_t>(1));
     }
+    return bgWindow.get();
+}
+
+size_t BackfillController::getBacklogLimit() const {
+    if (!isEnabled()) {
+        return engine.getTapConfig().getBackfillBacklogLimit();
+    }
+    return backlogLimit.get();
+}
+
+size_t BackfillController::getDiskLoadRate() const {
+    if (!isEnabled()) {
+        return engine.getTapConfig().getBackfillMaxDiskLoads();
+    }
+    return diskLoadRate.get();
+}
 
+bool BackfillController::startDiskLoad() {
+    if (!isEnabled()) {
+        return true;
+    }
+    size_t slots;
+    do {
+        slots = diskLoadSlots.get();
+        if (slots == 0) {
+            return false;
+        }
+    } while (!diskLoadSlots.cas(slots, slots - 1));
     return true;
 }
 
+bool BackfillController::isEnabled() const {
+    return engine.getTapConfig().getBackfillBgSlo() > 0;
+}
+
+bool BackfillController::isOverloaded() {
+    EPStats &stats = engine.getEpStats();
+    const TapConfig &config = engine.getTapConfig();
+    bool rv = false;
+
+    // The counters go back to zero on a stats reset; skip that interval.
+    hrtime_t bgTime = stats.bgWait.get() + stats.bgLoad.get();
+    size_t bgOps = stats.bgNumOperations.get();
+    if (bgOps > lastBgOps && bgTime >= lastBgTime) {
+        hrtime_t avg = (bgTime - lastBgTime) / (bgOps - lastBgOps);
+        rv = avg > config.getBackfillBgSlo();
+    }
+    lastBgTime = bgTime;
+    lastBgOps = bgOps;
+
+    hrtime_t ackWait = stats.tapAckWait.get();
+    size_t ackSamples = stats.tapAckNumSamples.get();
+    if (ackSamples > lastAckSamples && ackWait >= lastAckWait) {
+        hrtime_t avg = (ackWait - lastAckWait) / (ackSamples - lastAckSamples);
+        rv = rv || avg > config.getBackfillAckSlo() * 1000;
+    }
+    lastAckWait = ackWait;
+    lastAckSamples = ackSamples;
+
+    ssize_t queueCap = stats.tapThrottleWriteQueueCap.get();
+    if (queueCap != -1 &&
+        stats.diskQueueSize.get() >= static_cast<size_t>(queueCap)) {
+        rv = true;
+    }
+
+    return rv;
+}
+
+size_t BackfillController::nextLimit(size_t current, size_t max, bool backOff) {
+    size_t rv;
+    if (backOff) {
+        rv = std::max(current / 2, static_cast<size_t>(1));
+    } else {
+        // Get back to the configured limit in about 16 seconds.
+        rv = current + std::max(max / 16, static_cast<size_t>(1));
+    }
+    return std::min(rv, max);
+}
+
 class TapConnMapValueChangeListener : public ValueChangedListener {
 public:
     TapConnMapValueChangeListener(TapConnMap &tc) : tapconnmap(tc) {
@@ -126,27 +278,48 @@ private:
 };
 
 TapConnMap::TapConnMap(EventuallyPersistentEngine &theEngine) :
-    notifyCounter(0), engine(theEngine), nextTapNoop(0)
+    notifyCounter(0), engine(theEngine), nextTapNoop(0),
+    tapConnNotifier(NULL), backfillController(NULL)
 {
     Configuration &config = engine.getConfiguration();
     tapNoopInterval = config.getTapNoopInterval();
     config.addValueChangedListener("tap_noop_interval",
                                    new TapConnMapValueChangeListener(*this));
+    notifySync.setProfile(LockProfiler::get("tap_notify"));
+    releaseLock.setProfile(LockProfiler::get("tap_release"));
     vbConnLocks = new SpinLock[vbConnLockNum];
+    LockProfiler *vbConnProfile = LockProfiler::get("tap_vb_conns");
+    for (size_t i = 0; i < vbConnLockNum; ++i) {
+        vbConnLocks[i].setProfile(vbConnProfile);
+    }
     size_t max_vbs = config.getMaxVbuckets();
     for (size_t i = 0; i < max_vbs; ++i) {
         vbConns.push_back(std::list<connection_t>());
     }
+    vbNotifications = new VBNotification[max_vbs];
+    for (size_t i = 0; i < max_vbs; ++i) {
+        vbNotifications[i].vbid = static_cast<uint16_t>(i);
+    }
+    tapFanout = new TapFanout(engine.getEpStats(), max_vbs);
 }
 
 void TapConnMap::initialize() {
-    tapConnNotifier = new TapConnNotifier(engine, engine.getEpStore()->getNonIODispatcher());
-    tapConnNotifier->start();
+    // Only publish the notifier once its task exists; notifyVBConnections()
+    // may already be called from the mutation path.
+    TapConnNotifier *notifier =
+        new TapConnNotifier(engine, engine.getEpStore()->getNonIODispatcher());
+    notifier->start();
+    tapConnNotifier = notifier;
+    backfillController = new BackfillController(engine);
+    backfillController->start(engine.getEpStore()->getNonIODispatcher());
 }
 
 TapConnMap::~TapConnMap() {
     delete []vbConnLocks;
+    delete []vbNotifications;
     delete tapConnNotifier;
+    delete backfillController;
+    delete tapFanout;
 }
 
 void TapConnMap::disconnect(const void *cookie, int tapKeepAlive) {
@@ -156,6 +329,15 @@ void TapConnMap::disconnect(const void *cookie, int tapKeepAlive) {
         if (iter->second.get()) {
             rel_time_t now = ep_current_time();
             TapConsumer *tc = dynamic_cast<TapConsumer*>(iter->second.get());
+            if (tc) {
+                tc->dropAckWait();
+            } else {
+                TapProducer *tp =
+                    dynamic_cast<TapProducer*>(iter->second.get());
+                if (tp) {
+                    tp->disconnected();
+                }
+            }
             if (tc || iter->second->doDisconnect()) {
                 iter->second->setExpiryTime(now - 1);
                 LOG(EXTENSION_LOG_WARNING, "%s disconnected",
@@ -275,7 +457,7 @@ void TapConnMap::removeTapCursors_UNLOCKED(TapProducer *tp) {
                 LOG(EXTENSION_LOG_INFO,
                     "%s Remove the TAP cursor from vbucket %d",
                     tp->logHeader(), vbid);
-                vb->checkpointManager.removeTAPCursor(tp->name);
+                tapFanout->removeCursor(vb, tp->name);
             }
         }
     }
@@ -294,19 +476,14 @@ void TapConnMap::addFlushEvent() {
 
 void TapConnMap::notifyVBConnections(uint16_t vbid)
 {
-    size_t lock_num = vbid % vbConnLockNum;
-    SpinLockHolder lh(&vbConnLocks[lock_num]);
-
-    std::list<connection_t> &conns = vbConns[vbid];
-    std::list<connection_t>::iterator it = conns.begin();
-    for (; it != conns.end(); ++it) {
-        TapProducer *conn = dynamic_cast<TapProducer*>((*it).get());
-        if (conn && conn->paused && conn->isReserved() &&
-            conn->setNotificationScheduled(true)) {
-            pendingTapNotifications.push(*it);
-        }
+    VBNotification *n = &vbNotifications[vbid];
+    if (!n->pending.cas(false, true)) {
+        return;
+    }
+    pendingVBNotifications.push(n);
+    if (tapConnNotifier) {
+        tapConnNotifier->wake();
     }
-    lh.unlock();
 }
 
 TapConsumer *TapConnMap::newConsumer(const void* cookie)
@@ -326,7 +503,9 @@ TapProducer *TapConnMap::newProducer(const void* cookie,
                                      uint64_t backfillAge,
                                      int tapKeepAlive,
                                      const std::vector<uint16_t> &vbuckets,
-                                     const std::map<uint16_t, uint64_t> &lastCheckpointIds) {
+                                     const std::map<uint16_t, uint64_t> &lastCheckpointIds,
+                                     const TapKeyFilter &keyFilter,
+                                     const std::map<uint16_t, uint64_t> &sinceSeqnos) {
     LockHolder lh(notifySync);
     TapProducer *tap(NULL);
 
@@ -394,6 +573,8 @@ TapProducer *TapConnMap::newProducer(const void* cookie,
     tap->setTapFlagByteorderSupport((flags & TAP_CONNECT_TAP_FIX_FLAG_BYTEORDER) != 0);
     tap->setBackfillAge(backfillAge, reconnect);
     tap->setVBucketFilter(vbuckets);
+    tap->setKeyFilter(keyFilter);
+    tap->setSinceSeqnos(sinceSeqnos);
     tap->registerTAPCursor(lastCheckpointIds);
 
     if (reconnect) {
@@ -442,30 +623,50 @@ void TapConnMap::notifyPausedConnection(TapProducer *tp) {
 }
 
 void TapConnMap::notifyAllPausedConnections() {
-    std::queue<connection_t> queue;
-    pendingTapNotifications.getAll(queue);
+    std::vector<VBNotification*> vbs;
+    pendingVBNotifications.drain(vbs);
+
+    std::list<connection_t> toNotify;
+    std::vector<VBNotification*>::iterator vit;
+    for (vit = vbs.begin(); vit != vbs.end(); ++vit) {
+        uint16_t vbid = (*vit)->vbid;
+        // Clear the flag before looking at the connections, so that any
+        // mutation we may miss here queues the vbucket again.
+        (*vit)->pending.set(false);
+
+        SpinLockHolder lh(&vbConnLocks[vbid % vbConnLockNum]);
+        std::list<connection_t> &conns = vbConns[vbid];
+        std::list<connection_t>::iterator it = conns.begin();
+        for (; it != conns.end(); ++it) {
+            TapProducer *tp = dynamic_cast<TapProducer*>((*it).get());
+            if (tp && tp->paused && tp->isReserved() &&
+                tp->setNotificationScheduled(true)) {
+                toNotify.push_back(*it);
+            }
+        }
+    }
 
     LockHolder rlh(releaseLock);
-    while (!queue.empty()) {
-        connection_t &conn = queue.front();
-        TapProducer *tp = dynamic_cast<TapProducer*>(conn.get());
-        if (tp && tp->paused && tp->isReserved()) {
+    std::list<connection_t>::iterator it = toNotify.begin();
+    for (; it != toNotify.end(); ++it) {
+        TapProducer *tp = static_cast<TapProducer*>((*it).get());
+        if (tp->paused && tp->isReserved()) {
             engine.notifyIOComplete(tp->getCookie(), ENGINE_SUCCESS);
             tp->notifySent.set(true);
         }
         tp->setNotificationScheduled(false);
-        queue.pop();
     }
 }
 
 bool TapConnMap::notificationQueueEmpty() {
-    return pendingTapNotifications.empty();
+    return pendingVBNotifications.empty();
 }
 
 void TapConnMap::shutdownAllTapConnections() {
     LOG(EXTENSION_LOG_WARNING, "Shutting down tap connections!");
 
     tapConnNotifier->stop();
+    backfillController->stop();
 
     LockHolder lh(notifySync);
     // We should pause unless we purged some connections or
@@ -514,6 +715,20 @@ void TapConnMap::scheduleBackfill(const std::set<uint16_t> &backfillVBuckets) {
     }
 }
 
+void TapConnMap::backfillConnections(const std::list<std::string> &names,
+                                     uint16_t vbucket) {
+    LockHolder lh(notifySync);
+    std::vector<uint16_t> vblist(1, vbucket);
+    std::list<std::string>::const_iterator it = names.begin();
+    for (; it != names.end(); ++it) {
+        connection_t tc = findByName_UNLOCKED(*it);
+        TapProducer *tp = dynamic_cast<TapProducer*>(tc.get());
+        if (tp && tp->checkVBucketFilter(vbucket)) {
+            tp->scheduleBackfill(vblist);
+        }
+    }
+}
+
 bool TapConnMap::isBackfillCompleted(std::string &name) {
     LockHolder lh(notifySync);
     connection_t tc = findByName_UNLOCKED(name);
@@ -782,6 +997,10 @@ void ScheduleDiskBackfillTapOperation::perform(TapProducer *tc, void *) {
     tc->scheduleDiskBackfill();
 }
 
+void DisconnectTapOperation::perform(TapProducer *tc, void *) {
+    tc->setDisconnect(true);
+}
+
 void CompletedBGFetchTapOperation::perform(TapProducer *tc, Item *arg) {
     if (connToken != tc->getConnectionToken() && !tc->isReconnected()) {
         delete arg;
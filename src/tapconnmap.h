@@ -27,6 +27,7 @@
 #include <string>
 #include <vector>
 
+#include "atomic.h"
 #include "common.h"
 #include "locks.h"
 #include "queueditem.h"
@@ -39,6 +40,7 @@ class TapProducer;
 class TapConnection;
 class Item;
 class EventuallyPersistentEngine;
+class TapFanout;
 
 typedef SingleThreadedRCPtr<TapConnection> connection_t;
 
@@ -78,6 +80,15 @@ public:
     void perform(TapProducer *tc, void* arg);
 };
 
+/**
+ * Disconnect the tap connection, e.g. because what it streamed from disk
+ * may have missed purged deletions.
+ */
+class DisconnectTapOperation : public TapOperation<void*> {
+public:
+    void perform(TapProducer *tc, void* arg);
+};
+
 /**
  * Complete a bg fetch job and give the item to the given tap connection.
  */
@@ -107,25 +118,99 @@ public:
 
 /**
  * Tap connection notifier that wakes up paused connections.
+ *
+ * It's woken up whenever a vbucket gets new items for its paused
+ * producers, and otherwise only runs every IDLE_SLEEP_TIME seconds.
  */
 class TapConnNotifier {
 public:
     TapConnNotifier(EventuallyPersistentEngine &e, Dispatcher *d)
-        : engine(e), dispatcher(d), minSleepTime(DEFAULT_MIN_STIME)  { }
+        : engine(e), dispatcher(d) { }
 
     void start();
 
     void stop();
 
+    /**
+     * Run the notifier as soon as possible.
+     */
+    void wake();
+
     bool notify();
 
 private:
-    static const double DEFAULT_MIN_STIME;
+    static const double IDLE_SLEEP_TIME;
+
+    EventuallyPersistentEngine &engine;
+    Dispatcher *dispatcher;
+    TaskId task;
+};
+
+/**
+ * Adapts how hard the TAP backfills hit the disk to the latency the
+ * front-end reads see.
+ *
+ * Once a second it looks at how long the front-end bg fetches waited
+ * and took, the disk write queue and how long the consumers took to
+ * ack.  If any of them is over its limit, the bg fetch window of the
+ * producers, the backfill backlog limit and the number of vbucket disk
+ * backfills that may start per second are halved; otherwise they grow
+ * back a step at a time.  The configured limits apply as they are while
+ * tap_backfill_bg_slo is 0.
+ */
+class BackfillController {
+public:
+    BackfillController(EventuallyPersistentEngine &e);
+
+    void start(Dispatcher *d);
+
+    void stop();
+
+    bool adjust();
+
+    /**
+     * The max number of bg fetches a TAP producer may have running.
+     */
+    size_t getBgWindow() const;
+
+    /**
+     * The max number of backfilled items a TAP producer may have queued.
+     */
+    size_t getBacklogLimit() const;
+
+    /**
+     * The max number of vbucket disk backfills starting per second.
+     */
+    size_t getDiskLoadRate() const;
+
+    /**
+     * Take a slot to start a vbucket disk backfill.
+     *
+     * @return false if the backfill has to wait for the next second
+     */
+    bool startDiskLoad();
+
+private:
+    bool isEnabled() const;
+
+    bool isOverloaded();
+
+    static size_t nextLimit(size_t current, size_t max, bool backOff);
 
     EventuallyPersistentEngine &engine;
     Dispatcher *dispatcher;
     TaskId task;
-    double minSleepTime;
+
+    Atomic<size_t> bgWindow;
+    Atomic<size_t> backlogLimit;
+    Atomic<size_t> diskLoadRate;
+    Atomic<size_t> diskLoadSlots;
+
+    // The counters as of the previous adjust()
+    hrtime_t lastBgTime;
+    size_t lastBgOps;
+    hrtime_t lastAckWait;
+    size_t lastAckSamples;
 };
 
 /**
@@ -200,6 +285,12 @@ public:
     /**
      * Notify the paused connections that are responsible for replicating
      * a given vbucket.
+     *
+     * This is called for every mutation, so it doesn't look at the
+     * connections itself: only the first call since the notifier last
+     * handled the vbucket queues it and wakes the notifier up, the others
+     * are a single compare-and-swap.
+     *
      * @param vbid vbucket id
      */
     void notifyVBConnections(uint16_t vbid);
@@ -242,7 +333,9 @@ public:
                              uint64_t backfillAge,
                              int tapKeepAlive,
                              const std::vector<uint16_t> &vbuckets,
-                             const std::map<uint16_t, uint64_t> &lastCheckpointIds);
+                             const std::map<uint16_t, uint64_t> &lastCheckpointIds,
+                             const TapKeyFilter &keyFilter,
+                             const std::map<uint16_t, uint64_t> &sinceSeqnos);
 
     /**
      * Create a new consumer and add it in the list of TapConnections
@@ -306,6 +399,13 @@ public:
 
     void scheduleBackfill(const std::set<uint16_t> &backfillVBuckets);
 
+    /**
+     * Schedule the backfill of a vbucket for the given TAP producers.
+     * @param names the names of the TAP producers
+     * @param vbucket the vbucket to backfill
+     */
+    void backfillConnections(const std::list<std::string> &names, uint16_t vbucket);
+
     bool isBackfillCompleted(std::string &name);
 
     void resetReplicaChain();
@@ -349,6 +449,14 @@ public:
         return prevSessionStats.wasReplicationCompleted(name);
     }
 
+    BackfillController &getBackfillController() {
+        return *backfillController;
+    }
+
+    TapFanout &getTapFanout() {
+        return *tapFanout;
+    }
+
     void notifyPausedConnection(TapProducer *tc);
 
     void notifyAllPausedConnections();
@@ -395,8 +503,22 @@ private:
     size_t tapNoopInterval;
     size_t nextTapNoop;
 
-    AtomicQueue<connection_t> pendingTapNotifications;
+    /**
+     * The notification of the connections of a vbucket, queued from the
+     * first notifyVBConnections() for it until the notifier takes it.
+     */
+    struct VBNotification : public MPSCQueueNode<VBNotification> {
+        VBNotification() : vbid(0), pending(false) {}
+
+        uint16_t vbid;
+        Atomic<bool> pending;
+    };
+
+    VBNotification *vbNotifications;
+    MPSCQueue<VBNotification> pendingVBNotifications;
     TapConnNotifier *tapConnNotifier;
+    BackfillController *backfillController;
+    TapFanout *tapFanout;
 
     TAPSessionStats prevSessionStats;
 
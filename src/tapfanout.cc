@@ -0,0 +1,186 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "locks.h"
+#include "tapfanout.h"
+#include "vbucket.h"
+
+TapFanout::TapFanout(EPStats &st, size_t maxVBuckets) : stats(st) {
+    for (size_t i = 0; i < maxVBuckets; ++i) {
+        groups.push_back(new Group());
+    }
+}
+
+TapFanout::~TapFanout() {
+    std::vector<Group*>::iterator it = groups.begin();
+    for (; it != groups.end(); ++it) {
+        inbox_map_t::iterator mit = (*it)->members.begin();
+        for (; mit != (*it)->members.end(); ++mit) {
+            clearInbox(mit->second);
+        }
+        delete *it;
+    }
+}
+
+void TapFanout::setMember(Group &g, const std::string &name, bool join) {
+    inbox_map_t::iterator it = g.members.find(name);
+    if (it != g.members.end()) {
+        clearInbox(it->second);
+        if (!join) {
+            g.members.erase(it);
+        }
+    } else if (join) {
+        g.members[name];
+    }
+}
+
+void TapFanout::clearInbox(std::list<Pending> &inbox) {
+    stats.memOverhead.decr(inbox.size() * sizeof(Pending));
+    assert(stats.memOverhead.get() < GIGANTOR);
+    inbox.clear();
+}
+
+void TapFanout::checkEpoch(Group &g, uint64_t epoch) {
+    if (epoch == g.epoch) {
+        return;
+    }
+    inbox_map_t::iterator it = g.members.begin();
+    for (; it != g.members.end(); ++it) {
+        clearInbox(it->second);
+    }
+    g.epoch = epoch;
+}
+
+bool TapFanout::registerCursor(const RCPtr<VBucket> &vb,
+                               const std::string &name,
+                               uint64_t checkpointId,
+                               bool alwaysFromBeginning,
+                               bool join) {
+    Group &g = groupOf(vb->getId());
+    LockHolder lh(g.lock);
+    setMember(g, name, join);
+    return vb->checkpointManager.registerTAPCursor(name, checkpointId,
+                                                   alwaysFromBeginning);
+}
+
+bool TapFanout::resumeCursor(const RCPtr<VBucket> &vb,
+                             const std::string &name,
+                             uint64_t checkpointId,
+                             uint64_t &seqno,
+                             bool join) {
+    Group &g = groupOf(vb->getId());
+    LockHolder lh(g.lock);
+    setMember(g, name, join);
+    return vb->checkpointManager.registerTAPCursorForResume(name, checkpointId,
+                                                            seqno);
+}
+
+void TapFanout::registerCursorAtOldest(const RCPtr<VBucket> &vb,
+                                       const std::string &name,
+                                       bool join) {
+    Group &g = groupOf(vb->getId());
+    LockHolder lh(g.lock);
+    setMember(g, name, join);
+    vb->checkpointManager.registerTAPCursorAtOldest(name);
+}
+
+bool TapFanout::removeCursor(const RCPtr<VBucket> &vb, const std::string &name) {
+    Group &g = groupOf(vb->getId());
+    LockHolder lh(g.lock);
+    setMember(g, name, false);
+    return vb->checkpointManager.removeTAPCursor(name);
+}
+
+void TapFanout::resetCursors(const RCPtr<VBucket> &vb,
+                             const std::list<std::string> &cursors) {
+    Group &g = groupOf(vb->getId());
+    LockHolder lh(g.lock);
+    vb->checkpointManager.resetTAPCursors(cursors);
+    checkEpoch(g, vb->checkpointManager.getCursorEpoch());
+}
+
+queued_item TapFanout::nextItem(const RCPtr<VBucket> &vb,
+                                const std::string &name,
+                                bool &isLastMutationItem,
+                                size_t maxInbox) {
+    Group &g = groupOf(vb->getId());
+    LockHolder lh(g.lock);
+    inbox_map_t::iterator me = g.members.find(name);
+    if (me == g.members.end()) {
+        lh.unlock();
+        return vb->checkpointManager.nextItem(name, isLastMutationItem);
+    }
+
+    checkEpoch(g, vb->checkpointManager.getCursorEpoch());
+    if (!me->second.empty()) {
+        Pending &p = me->second.front();
+        queued_item qi = p.qi;
+        isLastMutationItem = p.isLastMutationItem;
+        me->second.pop_front();
+        stats.memOverhead.decr(sizeof(Pending));
+        assert(stats.memOverhead.get() < GIGANTOR);
+        return qi;
+    }
+
+    std::list<std::string> others;
+    inbox_map_t::iterator it = g.members.begin();
+    for (; it != g.members.end(); ++it) {
+        // A member that lags this far behind walks on its own for now.
+        if (it != me && it->second.size() < maxInbox) {
+            others.push_back(it->first);
+        }
+    }
+
+    std::list<std::string> moved;
+    uint64_t epoch;
+    queued_item qi = vb->checkpointManager.nextItem(name, isLastMutationItem,
+                                                    others, moved, epoch);
+    // The cursors may have been moved back since we looked.
+    checkEpoch(g, epoch);
+    std::list<std::string>::iterator mit = moved.begin();
+    for (; mit != moved.end(); ++mit) {
+        g.members[*mit].push_back(Pending(qi, isLastMutationItem));
+        stats.memOverhead.incr(sizeof(Pending));
+        ++stats.tapFanoutItems;
+    }
+    return qi;
+}
+
+bool TapFanout::hasNext(const RCPtr<VBucket> &vb, const std::string &name) {
+    Group &g = groupOf(vb->getId());
+    LockHolder lh(g.lock);
+    checkEpoch(g, vb->checkpointManager.getCursorEpoch());
+    inbox_map_t::iterator me = g.members.find(name);
+    if (me != g.members.end() && !me->second.empty()) {
+        return true;
+    }
+    return vb->checkpointManager.hasNext(name);
+}
+
+size_t TapFanout::getNumItems(const RCPtr<VBucket> &vb, const std::string &name) {
+    Group &g = groupOf(vb->getId());
+    LockHolder lh(g.lock);
+    checkEpoch(g, vb->checkpointManager.getCursorEpoch());
+    size_t pending = 0;
+    inbox_map_t::iterator me = g.members.find(name);
+    if (me != g.members.end()) {
+        pending = me->second.size();
+    }
+    return pending + vb->checkpointManager.getNumItemsForTAPConnection(name);
+}
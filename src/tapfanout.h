@@ -0,0 +1,163 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_TAPFANOUT_H_
+#define SRC_TAPFANOUT_H_ 1
+
+#include "config.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "mutex.h"
+#include "queueditem.h"
+#include "stats.h"
+
+class VBucket;
+
+/**
+ * Lets the TAP producers streaming the same vbucket walk its checkpoints
+ * once between them.
+ *
+ * Each vbucket has a group of member producers.  When a member asks for
+ * its next checkpoint item, the cursors of the other members that are at
+ * the same position are moved past it too, under the same checkpoint
+ * lock, and the item is handed to them through their inbox.  A member
+ * takes the items from its inbox, without touching the checkpoints, before
+ * it walks its own cursor again.  Members may drift apart, i.e. while one
+ * waits for its acks at a checkpoint end; they're taken along again as
+ * soon as their cursors meet.
+ *
+ * A member's cursor is only moved while holding the lock of its group, so
+ * the cursors of the members have to be registered, removed and reset
+ * through here.  The inboxes are also dropped whenever the checkpoint
+ * manager moves the cursors back on its own (see
+ * CheckpointManager::getCursorEpoch()), and a member whose inbox is full
+ * isn't taken along until it catches up.
+ */
+class TapFanout {
+public:
+    TapFanout(EPStats &st, size_t maxVBuckets);
+
+    ~TapFanout();
+
+    /**
+     * Register the cursor of a TAP producer, dropping what its inbox holds.
+     *
+     * @param join true if the producer is a member of the vbucket's group
+     *             from now on, false if it walks its cursor on its own
+     * @see CheckpointManager::registerTAPCursor
+     */
+    bool registerCursor(const RCPtr<VBucket> &vb, const std::string &name,
+                        uint64_t checkpointId, bool alwaysFromBeginning,
+                        bool join);
+
+    /**
+     * Register the cursor of a TAP producer resuming a stream whose
+     * checkpoint is gone, dropping what its inbox holds.
+     *
+     * @see CheckpointManager::registerTAPCursorForResume
+     */
+    bool resumeCursor(const RCPtr<VBucket> &vb, const std::string &name,
+                      uint64_t checkpointId, uint64_t &seqno, bool join);
+
+    /**
+     * Register the cursor of a TAP producer at the oldest checkpoint in
+     * memory, dropping what its inbox holds.
+     *
+     * @see CheckpointManager::registerTAPCursorAtOldest
+     */
+    void registerCursorAtOldest(const RCPtr<VBucket> &vb,
+                                const std::string &name, bool join);
+
+    /**
+     * Remove the cursor of a TAP producer and take it out of the group.
+     */
+    bool removeCursor(const RCPtr<VBucket> &vb, const std::string &name);
+
+    /**
+     * Re-register the given cursors at the open checkpoint, dropping what
+     * the inboxes of the group hold.
+     *
+     * @see CheckpointManager::resetTAPCursors
+     */
+    void resetCursors(const RCPtr<VBucket> &vb,
+                      const std::list<std::string> &cursors);
+
+    /**
+     * Return the next checkpoint item for a TAP producer.
+     *
+     * @param maxInbox the number of items a member's inbox may hold before
+     *                 it's no longer taken along
+     * @see CheckpointManager::nextItem
+     */
+    queued_item nextItem(const RCPtr<VBucket> &vb, const std::string &name,
+                         bool &isLastMutationItem, size_t maxInbox);
+
+    bool hasNext(const RCPtr<VBucket> &vb, const std::string &name);
+
+    size_t getNumItems(const RCPtr<VBucket> &vb, const std::string &name);
+
+private:
+
+    struct Pending {
+        Pending(const queued_item &q, bool l) : qi(q), isLastMutationItem(l) { }
+
+        queued_item qi;
+        bool        isLastMutationItem;
+    };
+
+    typedef std::map<std::string, std::list<Pending> > inbox_map_t;
+
+    struct Group {
+        Group() : epoch(0) { }
+
+        Mutex       lock;
+        inbox_map_t members;
+        //! The cursor epoch the inboxes were filled in
+        uint64_t    epoch;
+    };
+
+    Group &groupOf(uint16_t vbid) {
+        assert(vbid < groups.size());
+        return *groups[vbid];
+    }
+
+    /**
+     * Make a member of the group, or leave it, dropping its inbox.  The
+     * group's lock must be held.
+     */
+    void setMember(Group &g, const std::string &name, bool join);
+
+    void clearInbox(std::list<Pending> &inbox);
+
+    /**
+     * Drop what the inboxes hold if the cursors were moved back since they
+     * were filled.  The group's lock must be held.
+     */
+    void checkEpoch(Group &g, uint64_t epoch);
+
+    EPStats &stats;
+    std::vector<Group*> groups;
+
+    DISALLOW_COPY_AND_ASSIGN(TapFanout);
+};
+
+#endif  // SRC_TAPFANOUT_H_
@@ -17,13 +17,20 @@
 
 #include "config.h"
 
+#include <algorithm>
+
 #include "configuration.h"
 #include "tapthrottle.h"
 
+const hrtime_t TapThrottle::refillInterval = 100000000;
+
 TapThrottle::TapThrottle(Configuration &config, EPStats &s) :
     queueCap(config.getTapThrottleQueueCap()),
     capPercent(config.getTapThrottleCapPcnt()),
-    stats(s)
+    applyQueueCap(config.getTapApplyQueueCap()),
+    pacing(config.isTapThrottlePacing()),
+    stats(s), nextRefill(0), lastRefill(0), lastPersisted(0), tokens(0),
+    pacedRate(-1), drainRate(0)
 {}
 
 bool TapThrottle::persistenceQueueSmallEnough() const {
@@ -41,8 +48,92 @@ bool TapThrottle::hasSomeMemory() const {
     return memoryUsed < (maxSize * stats.tapThrottleThreshold);
 }
 
-bool TapThrottle::shouldProcess() const {
-    return persistenceQueueSmallEnough() && hasSomeMemory();
+bool TapThrottle::applyQueueSmallEnough() const {
+    return stats.tapApplyQueueSize.get() < applyQueueCap;
+}
+
+double TapThrottle::getPressure() const {
+    double rv = 0.0;
+    ssize_t cap = stats.tapThrottleWriteQueueCap.get();
+    if (cap > 0) {
+        rv = static_cast<double>(stats.diskQueueSize.get()) / cap;
+    }
+
+    // Memory is only paced between the high water mark and the threshold.
+    double memoryUsed = static_cast<double>(stats.getTotalMemoryUsed());
+    double highWat = static_cast<double>(stats.mem_high_wat.get());
+    double threshold = static_cast<double>(stats.getMaxDataSize()) *
+        stats.tapThrottleThreshold;
+    if (memoryUsed > highWat) {
+        double mem = 1.0;
+        if (threshold > highWat) {
+            mem = 0.5 + 0.5 * (memoryUsed - highWat) / (threshold - highWat);
+        }
+        rv = std::max(rv, mem);
+    }
+    return rv;
+}
+
+ssize_t TapThrottle::nextPacedRate(size_t drainRate, double pressure) {
+    if (pressure < 0.5) {
+        return -1;
+    } else if (pressure >= 1.0) {
+        return 0;
+    }
+    return static_cast<ssize_t>(2.0 * (1.0 - pressure) * drainRate);
+}
+
+void TapThrottle::refill(hrtime_t now) {
+    size_t persisted = stats.totalPersisted.get();
+    if (lastRefill != 0 && now > lastRefill) {
+        double secs = static_cast<double>(now - lastRefill) / 1000000000.0;
+        double sample = static_cast<double>(persisted - lastPersisted) / secs;
+        drainRate.set(static_cast<size_t>(0.75 * drainRate.get() + 0.25 * sample));
+    }
+    lastRefill = now;
+    lastPersisted = persisted;
+
+    ssize_t rate = nextPacedRate(drainRate.get(), getPressure());
+    pacedRate.set(rate);
+    if (rate < 0) {
+        return;
+    }
+
+    // Keep a trickle going so the consumers find out when it's over; the
+    // debt of a batch that overdrew the tokens is carried over.
+    ssize_t budget = std::max(rate * static_cast<ssize_t>(refillInterval / 1000000) / 1000,
+                              static_cast<ssize_t>(1));
+    ssize_t t;
+    do {
+        t = tokens.get();
+    } while (!tokens.cas(t, std::min(t + budget, budget)));
+}
+
+bool TapThrottle::takeTokens(size_t items) {
+    ssize_t n = static_cast<ssize_t>(items);
+    ssize_t left = tokens.decr(n);
+    if (left + n > 0) {
+        return true;
+    }
+    tokens.incr(n);
+    return false;
+}
+
+bool TapThrottle::shouldProcess(size_t items) {
+    if (!persistenceQueueSmallEnough() || !hasSomeMemory() ||
+        !applyQueueSmallEnough()) {
+        return false;
+    }
+    if (!pacing) {
+        return true;
+    }
+
+    hrtime_t now = gethrtime();
+    hrtime_t next = nextRefill.get();
+    if (now >= next && nextRefill.cas(next, now + refillInterval)) {
+        refill(now);
+    }
+    return pacedRate.get() < 0 || takeTokens(items);
 }
 
 void TapThrottle::adjustWriteQueueCap(size_t totalItems) {
@@ -29,29 +29,85 @@ class Configuration;
 /**
  * Monitors various internal state to report whether we should
  * throttle incoming tap.
+ *
+ * Past the write queue cap and the memory threshold everything is
+ * throttled.  With pacing enabled, incoming mutations are also paced
+ * before that: once the write queue is half way to its cap, or the
+ * memory in use is over the high water mark, they're let through at a
+ * rate proportional to how fast the flusher drains the write queue and
+ * to the headroom left.
  */
 class TapThrottle {
 public:
 
+    //! How often (ns) the pacing tokens are refilled.
+    static const hrtime_t refillInterval;
+
     TapThrottle(Configuration &config, EPStats &s);
 
     /**
      * If true, we should process incoming tap requests.
+     *
+     * @param items the number of mutations in the request
      */
-    bool shouldProcess() const;
+    bool shouldProcess(size_t items = 1);
 
     void setCapPercent(size_t perc) { capPercent = perc; }
     void setQueueCap(ssize_t cap) { queueCap = cap; }
+    void setApplyQueueCap(size_t cap) { applyQueueCap = cap; }
+    void setPacing(bool enabled) { pacing = enabled; }
+
+    bool isPacing() const { return pacing; }
+
+    /**
+     * The mutations per second let through while pacing, -1 if they
+     * aren't limited.
+     */
+    ssize_t getPacedRate() const { return pacedRate.get(); }
+
+    /**
+     * Items persisted per second, smoothed over the last refills.
+     */
+    size_t getDrainRate() const { return drainRate.get(); }
 
     void adjustWriteQueueCap(size_t totalItems);
 
+    /**
+     * Compute the paced rate.
+     *
+     * It's unlimited below half the pressure, twice the drain rate at
+     * half, the drain rate at 3/4, and 0 at the cap, so the write queue
+     * settles where the consumers get in what the flusher gets out.
+     *
+     * @param drainRate items persisted per second
+     * @param pressure how close to being throttled we are, from 0 to 1
+     * @return the mutations per second, -1 for unlimited
+     */
+    static ssize_t nextPacedRate(size_t drainRate, double pressure);
+
 private:
     bool persistenceQueueSmallEnough() const;
     bool hasSomeMemory() const;
+    bool applyQueueSmallEnough() const;
+
+    double getPressure() const;
+    void refill(hrtime_t now);
+    bool takeTokens(size_t items);
 
     ssize_t queueCap;
     size_t capPercent;
+    size_t applyQueueCap;
+    bool pacing;
     EPStats &stats;
+
+    Atomic<hrtime_t> nextRefill;
+    // Only touched by the thread refilling the tokens.
+    hrtime_t lastRefill;
+    size_t lastPersisted;
+
+    Atomic<ssize_t> tokens;
+    Atomic<ssize_t> pacedRate;
+    Atomic<size_t> drainRate;
 };
 
 #endif  // SRC_TAPTHROTTLE_H_
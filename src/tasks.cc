@@ -17,11 +17,17 @@
 
 #include "config.h"
 
+#include <climits>
+
 #include "bgfetcher.h"
+#include "compactor.h"
+#include "dispatcher.h"
 #include "ep_engine.h"
 #include "flusher.h"
 #include "iomanager/iomanager.h"
+#include "tapapplier.h"
 #include "tasks.h"
+#include "vbucket_owners.h"
 #include "warmup.h"
 
 /**
@@ -36,6 +42,17 @@ static time_t do_timegm(struct tm *tmv)
   return difftime(gmt, offset);
 }
 
+const char *GlobalTask::getKindName(task_kind_t kind) {
+    static const char *names[NUM_TASK_KINDS] = {
+        "flusher", "compactor", "vbucket_snapshot", "vbucket_delete",
+        "stat_snap", "bg_fetcher", "tap_apply", "vbucket_owner",
+        "shard_visit", "vkey_stat_bg_fetch", "bg_fetch", "range_scan",
+        "dispatcher"
+    };
+    assert(kind < NUM_TASK_KINDS);
+    return names[kind];
+}
+
 void GlobalTask::snooze(const double secs, bool first) {
     LockHolder lh(mutex);
     gettimeofday(&waketime, NULL);
@@ -74,6 +91,10 @@ bool FlusherTask::run() {
     return flusher->step(taskId);
 }
 
+bool CompactorTask::run() {
+    return compactor->run(taskId);
+}
+
 bool VBSnapshotTask::run() {
     engine->getEpStore()->snapshotVBuckets(priority, shardID);
     return false;
@@ -89,7 +110,10 @@ bool StatSnap::run() {
     if (runOnce) {
         return false;
     }
-    IOManager::get()->snooze(taskId, 60);
+    // Each snapshot gathers every stat and rewrites the file, while only
+    // the one at shutdown tells the next session it was a clean one.
+    size_t interval = engine->getConfiguration().getStatsSnapshotInterval();
+    IOManager::get()->snooze(taskId, static_cast<double>(interval));
     return true;
 }
 
@@ -97,6 +121,30 @@ bool BgFetcherTask::run() {
     return bgfetcher->run(taskId);
 }
 
+bool TapApplyTask::run() {
+    return applier->run(shardId, taskId);
+}
+
+bool VBucketOwnerTask::run() {
+    return owners->run(shardId, taskId);
+}
+
+
+bool VBCBShardTask::run() {
+    double snoozeTime = 0;
+    bool again = adaptor->visitNext(snoozeTime);
+    if (again) {
+        IOManager::get()->snooze(taskId, snoozeTime);
+    }
+    return again;
+}
+
+std::string VBCBShardTask::getDescription() {
+    std::stringstream ss;
+    ss << adaptor->description() << " (shard " << shardId << ")";
+    return ss.str();
+}
+
 
 bool VKeyStatBGFetchTask::run() {
     engine->getEpStore()->completeStatsVKey(cookie, key, vbucket, bySeqNum);
@@ -109,3 +157,38 @@ bool BGFetchTask::run() {
                                           metaFetch);
     return false;
 }
+
+bool RangeScanTask::run() {
+    engine->getEpStore()->rangeScan(*scan);
+    engine->notifyIOComplete(cookie, ENGINE_SUCCESS);
+    return false;
+}
+
+DispatcherTask::DispatcherTask(EventuallyPersistentEngine *e, Dispatcher &d,
+                               const TaskId &t, const Priority &p) :
+    GlobalTask(e, p, 0, 0, false, false), dispatcher(d), task(t)
+{
+    LockHolder tlh(task->mutex);
+    waketime = task->waketime;
+}
+
+DispatcherTask::~DispatcherTask() { }
+
+bool DispatcherTask::run() {
+    struct timeval next;
+    if (!dispatcher.runTask(task, next)) {
+        return false;
+    }
+    LockHolder lh(mutex);
+    waketime = next;
+    return true;
+}
+
+std::string DispatcherTask::getDescription() {
+    return task->getName();
+}
+
+int DispatcherTask::maxExpectedDuration() {
+    hrtime_t max = task->maxExpectedDuration();
+    return max > INT_MAX ? INT_MAX : static_cast<int>(max);
+}
@@ -30,16 +30,56 @@ typedef enum {
     TASK_DEAD
 } task_state_t;
 
+/**
+ * The groups of worker threads of a bucket.  Each group has its own threads,
+ * so the tasks of one never wait for those of another.
+ */
+typedef enum {
+    WRITER_TASK_IDX = 0, //!< flushes, vbucket snapshots and deletions
+    READER_TASK_IDX,     //!< front-end bg fetches
+    AUXIO_TASK_IDX,      //!< background maintenance IO (stat snapshots)
+    NONIO_TASK_IDX,      //!< tasks that don't do disk IO (tap apply, pager)
+    NUM_TASK_GROUPS
+} task_type_t;
+
+/**
+ * The kinds of tasks, which the pool keeps their schedule delays and run
+ * times by, whatever group of threads they ran on.
+ */
+typedef enum {
+    FLUSHER_TASK = 0,
+    COMPACTOR_TASK,
+    VBSNAPSHOT_TASK,
+    VBDELETE_TASK,
+    STATSNAP_TASK,
+    BGFETCHER_TASK,
+    TAPAPPLY_TASK,
+    VBOWNER_TASK,
+    VBCB_SHARD_TASK,
+    VKEY_BGFETCH_TASK,
+    BGFETCH_TASK,
+    RANGESCAN_TASK,
+    DISPATCHER_TASK,
+    NUM_TASK_KINDS
+} task_kind_t;
+
 class BgFetcher;
+class Compactor;
 class CompareTasksByDueDate;
 class CompareTasksByPriority;
+class Dispatcher;
 class EventuallyPersistentEngine;
 class Flusher;
+class RangeScan;
+class Task;
+class TapApplier;
+class VBucketOwners;
+class VBCBAdaptor;
 class Warmup;
 
 class GlobalTask : public RCValue {
-friend class CompareByDueDate;
 friend class CompareByPriority;
+friend class ExecutorPool;
 friend class ExecutorThread;
 public:
     GlobalTask(EventuallyPersistentEngine *e, const Priority &p,
@@ -47,7 +87,8 @@ public:
                bool completeBeforeShutdown = true) :
           RCValue(), priority(p), starttime(sttime),
           isDaemonTask(isDaemon), blockShutdown(completeBeforeShutdown),
-          state(TASK_RUNNING), taskId(nextTaskId()), engine(e) {
+          state(TASK_RUNNING), taskId(nextTaskId()), shard(-1), dueSeq(0),
+          clientWaitStart(0), readyRank(0), engine(e) {
         snooze(sleeptime, true);
     }
 
@@ -69,6 +110,16 @@ public:
      */
     virtual std::string getDescription() = 0;
 
+    /**
+     * Gives the kind of this task.
+     */
+    virtual task_kind_t getKind() const = 0;
+
+    /**
+     * Gives the name of a kind of tasks, as its stats are prefixed with.
+     */
+    static const char *getKindName(task_kind_t kind);
+
     virtual int maxExpectedDuration() {
         return 3600;
     }
@@ -101,12 +152,30 @@ public:
     EventuallyPersistentEngine* getEngine() { return engine; }
 
 protected:
+    /**
+     * Note that a client is waiting on the task, so it goes ahead of the
+     * background work the next time it's ready to run.
+     */
+    void setClientWaiting() {
+        if (clientWaitStart == 0) {
+            clientWaitStart = gethrtime();
+        }
+    }
+
     const Priority &priority;
     size_t starttime;
     bool isDaemonTask;
     bool blockShutdown;
     task_state_t state;
     const size_t taskId;
+    //! The shard the task was scheduled for
+    int shard;
+    //! Which of its copies in its thread's due queue is live, 0 if none is
+    size_t dueSeq;
+    //! When the longest waiting client it has started waiting, 0 if none
+    hrtime_t clientWaitStart;
+    //! The clientWaitStart it went on its thread's ready queue with
+    hrtime_t readyRank;
     struct timeval waketime;
     EventuallyPersistentEngine *engine;
     Mutex mutex;
@@ -133,10 +202,38 @@ public:
         return "Running a flusher loop";
     }
 
+    task_kind_t getKind() const {
+        return FLUSHER_TASK;
+    }
+
 private:
     Flusher* flusher;
 };
 
+/**
+ * A task that compacts the files of a shard's vbuckets.
+ */
+class CompactorTask : public GlobalTask {
+public:
+    CompactorTask(EventuallyPersistentEngine *e, Compactor *c,
+                  const Priority &p, bool isDaemon = false,
+                  bool shutdown = false) :
+        GlobalTask(e, p, 0, 0, isDaemon, shutdown), compactor(c) { }
+
+    bool run();
+
+    std::string getDescription() {
+        return std::string("Compacting vbucket files");
+    }
+
+    task_kind_t getKind() const {
+        return COMPACTOR_TASK;
+    }
+
+private:
+    Compactor *compactor;
+};
+
 /**
  * A task for persisting VBucket state changes to disk and creating a new
  * VBucket database files.
@@ -155,6 +252,10 @@ public:
         return "Snapshotting a VBucket";
     }
 
+    task_kind_t getKind() const {
+        return VBSNAPSHOT_TASK;
+    }
+
 private:
     uint16_t shardID;
 };
@@ -177,6 +278,10 @@ public:
         return "Deleting a VBucket";
     }
 
+    task_kind_t getKind() const {
+        return VBDELETE_TASK;
+    }
+
 private:
     uint16_t vbucket;
     bool recreate;
@@ -202,6 +307,10 @@ public:
         return rv;
     }
 
+    task_kind_t getKind() const {
+        return STATSNAP_TASK;
+    }
+
 private:
     bool runOnce;
 };
@@ -223,10 +332,93 @@ public:
         return std::string("Batching background fetch");
     }
 
+    task_kind_t getKind() const {
+        return BGFETCHER_TASK;
+    }
+
 private:
     BgFetcher *bgfetcher;
 };
 
+/**
+ * A task that applies the incoming TAP mutations queued for one shard.
+ */
+class TapApplyTask : public GlobalTask {
+public:
+    TapApplyTask(EventuallyPersistentEngine *e, TapApplier *a, size_t sid,
+                 const Priority &p, bool isDaemon = false,
+                 bool shutdown = false) :
+        GlobalTask(e, p, 0, 0, isDaemon, shutdown),
+        applier(a), shardId(sid) { }
+
+    bool run();
+
+    std::string getDescription() {
+        std::stringstream ss;
+        ss << "Applying incoming tap mutations for shard " << shardId;
+        return ss.str();
+    }
+
+    task_kind_t getKind() const {
+        return TAPAPPLY_TASK;
+    }
+
+private:
+    TapApplier *applier;
+    size_t      shardId;
+};
+
+/**
+ * A task that runs the gets, stores and deletes handed to one shard.
+ */
+class VBucketOwnerTask : public GlobalTask {
+public:
+    VBucketOwnerTask(EventuallyPersistentEngine *e, VBucketOwners *o,
+                     size_t sid, const Priority &p, bool isDaemon = false,
+                     bool shutdown = false) :
+        GlobalTask(e, p, 0, 0, isDaemon, shutdown),
+        owners(o), shardId(sid) { }
+
+    bool run();
+
+    std::string getDescription() {
+        std::stringstream ss;
+        ss << "Running the front-end ops of shard " << shardId;
+        return ss.str();
+    }
+
+    task_kind_t getKind() const {
+        return VBOWNER_TASK;
+    }
+
+private:
+    VBucketOwners *owners;
+    size_t         shardId;
+};
+
+/**
+ * A task visiting the vbuckets of one shard, so the visits of the
+ * different shards run on the non-IO threads at the same time.
+ */
+class VBCBShardTask : public GlobalTask {
+public:
+    VBCBShardTask(EventuallyPersistentEngine *e, shared_ptr<VBCBAdaptor> a,
+                  size_t sid, const Priority &p) :
+        GlobalTask(e, p, 0, 0, false, false), adaptor(a), shardId(sid) { }
+
+    bool run();
+
+    std::string getDescription();
+
+    task_kind_t getKind() const {
+        return VBCB_SHARD_TASK;
+    }
+
+private:
+    shared_ptr<VBCBAdaptor> adaptor;
+    size_t shardId;
+};
+
 /**
  * A task for performing disk fetches for "stats vkey".
  */
@@ -237,7 +429,9 @@ public:
                         const Priority &p, int sleeptime = 0, size_t delay = 0,
                         bool isDaemon = false, bool shutdown = false) :
         GlobalTask(e, p, sleeptime, delay, isDaemon, shutdown), key(k),
-        vbucket(vbid), bySeqNum(s), cookie(c) { }
+        vbucket(vbid), bySeqNum(s), cookie(c) {
+        setClientWaiting();
+    }
 
     bool run();
 
@@ -247,6 +441,10 @@ public:
         return ss.str();
     }
 
+    task_kind_t getKind() const {
+        return VKEY_BGFETCH_TASK;
+    }
+
 private:
     std::string                      key;
     uint16_t                         vbucket;
@@ -265,7 +463,9 @@ public:
             bool isDaemon = false, bool shutdown = false) :
         GlobalTask(e, p, sleeptime, delay, isDaemon, shutdown),
         key(k), vbucket(vbid), seqNum(s), cookie(c), metaFetch(isMeta),
-        init(gethrtime()) { }
+        init(gethrtime()) {
+        clientWaitStart = init;
+    }
 
     bool run();
 
@@ -275,6 +475,10 @@ public:
         return ss.str();
     }
 
+    task_kind_t getKind() const {
+        return BGFETCH_TASK;
+    }
+
 private:
     const std::string          key;
     uint16_t                   vbucket;
@@ -285,22 +489,75 @@ private:
 };
 
 /**
- * Order tasks by their priority.
+ * A task that reads a page of a key range scan for a connection waiting
+ * for it.
  */
-class CompareByPriority {
+class RangeScanTask : public GlobalTask {
 public:
-    bool operator()(ExTask &t1, ExTask &t2) {
-        return t1->priority < t2->priority;
+    RangeScanTask(EventuallyPersistentEngine *e, RangeScan *s, const void *c,
+                  const Priority &p, bool isDaemon = false,
+                  bool shutdown = false) :
+        GlobalTask(e, p, 0, 0, isDaemon, shutdown), scan(s), cookie(c) {
+        setClientWaiting();
+    }
+
+    bool run();
+
+    std::string getDescription() {
+        return std::string("Scanning a range of keys");
+    }
+
+    task_kind_t getKind() const {
+        return RANGESCAN_TASK;
+    }
+
+private:
+    RangeScan  *scan;
+    const void *cookie;
+};
+
+/**
+ * Runs a task of a Dispatcher that doesn't have a thread of its own.
+ */
+class DispatcherTask : public GlobalTask {
+public:
+    // The pool forgets the task once it's done; the dispatcher takes care of
+    // the daemon and shutdown flags of its own task.
+    DispatcherTask(EventuallyPersistentEngine *e, Dispatcher &d,
+                   const SingleThreadedRCPtr<Task> &t, const Priority &p);
+
+    ~DispatcherTask();
+
+    bool run();
+
+    std::string getDescription();
+
+    task_kind_t getKind() const {
+        return DISPATCHER_TASK;
     }
+
+    int maxExpectedDuration();
+
+private:
+    Dispatcher                &dispatcher;
+    SingleThreadedRCPtr<Task>  task;
 };
 
 /**
- * Order tasks by their ready date.
+ * Order tasks by their priority, with the ones clients are waiting on
+ * ahead of background work.
  */
-class CompareByDueDate {
+class CompareByPriority {
 public:
     bool operator()(ExTask &t1, ExTask &t2) {
-        return less_tv(t2->waketime, t1->waketime);
+        // Tasks clients wait on go first, those waited on longest first.
+        if (t1->readyRank != t2->readyRank) {
+            if (t1->readyRank == 0 || t2->readyRank == 0) {
+                return t1->readyRank == 0;
+            }
+            return t1->readyRank > t2->readyRank;
+        }
+        return t1->priority < t2->priority;
     }
 };
 
@@ -0,0 +1,236 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_TIMINGWHEEL_H_
+#define SRC_TIMINGWHEEL_H_ 1
+
+#include "config.h"
+
+#include <cassert>
+#include <vector>
+
+#include "common.h"
+
+/**
+ * A hierarchical timing wheel of elements of type T, each due at a given
+ * tick.
+ *
+ * The wheel has levels of 64 slots; a slot of the first level holds the
+ * elements due at one tick, a slot of each level above covers 64 slots of
+ * the level below.  An element goes to the lowest level whose span reaches
+ * its tick, so inserting is O(1) whatever the number of elements.  As the
+ * wheel advances, the slot of a level above is emptied into the levels
+ * below when the first level wraps (cascading), and the elements of the
+ * first level's slots are handed out in batches.  An element due further
+ * out than the top level spans is parked in its last slot and placed again
+ * when that comes up.
+ *
+ * Elements are never looked up or removed: to move one, the owner inserts
+ * it again and tells the stale copy apart when it comes out.
+ */
+template <typename T>
+class TimingWheel {
+public:
+
+    /**
+     * @param now the current tick
+     */
+    explicit TimingWheel(uint64_t now) : current(now + 1), count(0) {
+        for (int l = 0; l < LEVELS; ++l) {
+            levelCounts[l] = 0;
+        }
+    }
+
+    /**
+     * Add an element due at the given tick.  An element that's already
+     * due comes out of the next expire().
+     */
+    void insert(const T &item, uint64_t when) {
+        ++count;
+        place(Entry(item, when));
+    }
+
+    /**
+     * Take out all the elements due at or before the given tick, in tick
+     * order.
+     *
+     * @param now the current tick
+     * @param out gets the elements that are due
+     */
+    void expire(uint64_t now, std::vector<T> &out) {
+        takeDue(out);
+        while (current <= now && count > 0) {
+            int index = static_cast<int>(current & SLOT_MASK);
+            if (index == 0) {
+                cascade();
+            }
+            if (levelCounts[0] == 0) {
+                // Nothing is due before the next cascade.
+                skipToCascade(now);
+                continue;
+            }
+            std::vector<Entry> &slot = wheel[0][index];
+            if (!slot.empty()) {
+                levelCounts[0] -= slot.size();
+                count -= slot.size();
+                typename std::vector<Entry>::iterator it = slot.begin();
+                for (; it != slot.end(); ++it) {
+                    out.push_back(it->item);
+                }
+                slot.clear();
+            }
+            ++current;
+        }
+        if (current <= now) {
+            current = now + 1;
+        }
+        takeDue(out);
+    }
+
+    /**
+     * Get the earliest tick an element may be due at; an element may turn
+     * out to be due later once it's cascaded down.  Only for a non-empty
+     * wheel.
+     */
+    uint64_t nextExpiry() const {
+        assert(count > 0);
+        if (!due.empty()) {
+            return current - 1;
+        }
+        uint64_t next = 0;
+        bool found = false;
+        for (int l = 0; l < LEVELS; ++l) {
+            if (levelCounts[l] == 0) {
+                continue;
+            }
+            int shift = SLOT_BITS * l;
+            uint64_t base = current >> shift;
+            // The current slot of a level above the first has been
+            // cascaded down already, unless we're right at its start.
+            uint64_t mask = (static_cast<uint64_t>(1) << shift) - 1;
+            uint64_t k = (current & mask) == 0 ? 0 : 1;
+            for (; k <= SLOTS; ++k) {
+                if (!wheel[l][(base + k) & SLOT_MASK].empty()) {
+                    uint64_t start = (base + k) << shift;
+                    if (!found || start < next) {
+                        next = start;
+                        found = true;
+                    }
+                    break;
+                }
+            }
+        }
+        assert(found);
+        return next;
+    }
+
+    //! Get the number of elements in the wheel
+    size_t size() const { return count; }
+
+    bool empty() const { return count == 0; }
+
+private:
+
+    static const int      SLOT_BITS = 6;
+    static const uint64_t SLOTS = 1 << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+    //! 64^5 one ms ticks are a bit over 12 days
+    static const int      LEVELS = 5;
+
+    struct Entry {
+        Entry(const T &i, uint64_t w) : item(i), when(w) { }
+
+        T        item;
+        uint64_t when;
+    };
+
+    void place(const Entry &e) {
+        if (e.when < current) {
+            due.push_back(e);
+            return;
+        }
+        uint64_t delta = e.when - current;
+        for (int l = 0; l < LEVELS; ++l) {
+            if (delta < (static_cast<uint64_t>(1) << (SLOT_BITS * (l + 1)))) {
+                uint64_t index = (e.when >> (SLOT_BITS * l)) & SLOT_MASK;
+                wheel[l][index].push_back(e);
+                ++levelCounts[l];
+                return;
+            }
+        }
+        // Too far out; park it in the top level's slot furthest away.
+        int top = LEVELS - 1;
+        uint64_t index = ((current >> (SLOT_BITS * top)) - 1) & SLOT_MASK;
+        wheel[top][index].push_back(e);
+        ++levelCounts[top];
+    }
+
+    void takeDue(std::vector<T> &out) {
+        typename std::vector<Entry>::iterator it = due.begin();
+        for (; it != due.end(); ++it) {
+            out.push_back(it->item);
+        }
+        count -= due.size();
+        due.clear();
+    }
+
+    /**
+     * Move the elements of the levels above whose slots come up at the
+     * current tick down the wheel; called when the first level wraps.
+     */
+    void cascade() {
+        for (int l = 1; l < LEVELS; ++l) {
+            uint64_t index = (current >> (SLOT_BITS * l)) & SLOT_MASK;
+            std::vector<Entry> slot;
+            slot.swap(wheel[l][index]);
+            levelCounts[l] -= slot.size();
+            typename std::vector<Entry>::iterator it = slot.begin();
+            for (; it != slot.end(); ++it) {
+                place(*it);
+            }
+            if (index != 0) {
+                break;
+            }
+        }
+    }
+
+    /**
+     * With the first level empty, jump to the next tick the lowest level
+     * above that has elements cascades at, or to right after now if that's
+     * sooner.
+     */
+    void skipToCascade(uint64_t now) {
+        int l = 1;
+        while (l < LEVELS - 1 && levelCounts[l] == 0) {
+            ++l;
+        }
+        int shift = SLOT_BITS * l;
+        uint64_t next = ((current >> shift) + 1) << shift;
+        current = next > now ? now + 1 : next;
+    }
+
+    //! The next tick to expire
+    uint64_t current;
+    size_t count;
+    std::vector<Entry> due;
+    size_t levelCounts[LEVELS];
+    std::vector<Entry> wheel[LEVELS][SLOTS];
+
+    DISALLOW_COPY_AND_ASSIGN(TimingWheel);
+};
+
+#endif  // SRC_TIMINGWHEEL_H_
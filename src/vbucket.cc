@@ -17,7 +17,11 @@
 
 #include "config.h"
 
+#include <sys/time.h>
+
+#include <algorithm>
 #include <functional>
+#include <limits>
 #include <list>
 #include <set>
 #include <string>
@@ -28,25 +32,50 @@
 #undef STATWRITER_NAMESPACE
 #include "vbucket.h"
 
+VBucketFilter::VBucketFilter(const std::vector<uint64_t> &b) : bits(b) {
+    std::set<uint16_t>::iterator hint = acceptable.begin();
+    for (size_t w = 0; w < bits.size(); ++w) {
+        for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+            // Lowest set bit first, so the set is filled in order.
+            size_t bit = 0;
+            while ((word & (static_cast<uint64_t>(1) << bit)) == 0) {
+                ++bit;
+            }
+            hint = acceptable.insert(hint, static_cast<uint16_t>(
+                                         w * BITS_PER_WORD + bit));
+        }
+    }
+}
+
+void VBucketFilter::fillBits() {
+    bits.clear();
+    if (!acceptable.empty()) {
+        bits.resize(*acceptable.rbegin() / BITS_PER_WORD + 1, 0);
+    }
+    std::set<uint16_t>::const_iterator it;
+    for (it = acceptable.begin(); it != acceptable.end(); ++it) {
+        bits[*it / BITS_PER_WORD] |= bitFor(*it);
+    }
+}
+
 VBucketFilter VBucketFilter::filter_diff(const VBucketFilter &other) const {
-    std::vector<uint16_t> tmp(acceptable.size() + other.size());
-    std::vector<uint16_t>::iterator end;
-    end = std::set_symmetric_difference(acceptable.begin(),
-                                        acceptable.end(),
-                                        other.acceptable.begin(),
-                                        other.acceptable.end(),
-                                        tmp.begin());
-    return VBucketFilter(std::vector<uint16_t>(tmp.begin(), end));
+    const std::vector<uint64_t> &longer =
+        bits.size() >= other.bits.size() ? bits : other.bits;
+    const std::vector<uint64_t> &shorter =
+        bits.size() >= other.bits.size() ? other.bits : bits;
+    std::vector<uint64_t> tmp(longer);
+    for (size_t w = 0; w < shorter.size(); ++w) {
+        tmp[w] ^= shorter[w];
+    }
+    return VBucketFilter(tmp);
 }
 
 VBucketFilter VBucketFilter::filter_intersection(const VBucketFilter &other) const {
-    std::vector<uint16_t> tmp(acceptable.size() + other.size());
-    std::vector<uint16_t>::iterator end;
-
-    end = std::set_intersection(acceptable.begin(), acceptable.end(),
-                                other.acceptable.begin(), other.acceptable.end(),
-                                tmp.begin());
-    return VBucketFilter(std::vector<uint16_t>(tmp.begin(), end));
+    std::vector<uint64_t> tmp(std::min(bits.size(), other.bits.size()));
+    for (size_t w = 0; w < tmp.size(); ++w) {
+        tmp[w] = bits[w] & other.bits[w];
+    }
+    return VBucketFilter(tmp);
 }
 
 static bool isRange(std::set<uint16_t>::const_iterator it,
@@ -101,45 +130,104 @@ std::ostream& operator <<(std::ostream &out, const VBucketFilter &filter)
 }
 
 size_t VBucket::chkFlushTimeout = MIN_CHK_FLUSH_TIMEOUT;
+size_t VBucket::bloomFilterKeys = 0;
+size_t VBucket::memQuota = 0;
+double VBucket::bloomFilterFpProb = 0.01;
 
 const vbucket_state_t VBucket::ACTIVE = static_cast<vbucket_state_t>(htonl(vbucket_state_active));
 const vbucket_state_t VBucket::REPLICA = static_cast<vbucket_state_t>(htonl(vbucket_state_replica));
 const vbucket_state_t VBucket::PENDING = static_cast<vbucket_state_t>(htonl(vbucket_state_pending));
 const vbucket_state_t VBucket::DEAD = static_cast<vbucket_state_t>(htonl(vbucket_state_dead));
 
-void VBucket::fireAllOps(EventuallyPersistentEngine &engine, ENGINE_ERROR_CODE code) {
+ENGINE_ERROR_CODE VBucket::addPendingOp(const void *cookie, bool read) {
+    LockHolder lh(pendingOpLock);
+    if (state != vbucket_state_pending) {
+        // State transitioned while we were waiting.
+        return ENGINE_SUCCESS;
+    }
+    size_t limit = stats.pendingOpsLimit.get();
+    if (limit > 0 && numPendingOps.get() >= limit) {
+        ++stats.pendingOpsRejected;
+        return ENGINE_TMPFAIL;
+    }
+    hrtime_t now = gethrtime();
+    // Start a timer when enqueuing the first client.
+    if (pendingOpsStart == 0) {
+        pendingOpsStart = now;
+    }
+    if (read) {
+        pendingReads.push_back(PendingOp(cookie, now));
+    } else {
+        pendingWrites.push_back(PendingOp(cookie, now));
+    }
+    ++numPendingOps;
+    ++stats.pendingOps;
+    ++stats.pendingOpsTotal;
+    return ENGINE_EWOULDBLOCK;
+}
+
+void VBucket::takePendingOps(std::deque<PendingOp> &ops, size_t max,
+                             hrtime_t now, std::vector<const void*> &cookies) {
+    for (size_t i = 0; i < max && !ops.empty(); ++i) {
+        const PendingOp &op = ops.front();
+        if (now > op.start) {
+            stats.pendingOpWaitHisto.add((now - op.start) / 1000);
+        }
+        cookies.push_back(op.cookie);
+        ops.pop_front();
+    }
+}
+
+bool VBucket::fireAllOps(EventuallyPersistentEngine &engine, ENGINE_ERROR_CODE code) {
+    size_t waiting = pendingReads.size() + pendingWrites.size();
+    if (waiting == 0) {
+        return false;
+    }
+
+    hrtime_t now = gethrtime();
     if (pendingOpsStart > 0) {
-        hrtime_t now = gethrtime();
+        // The first batch woken ends the time the vbucket held them up.
         if (now > pendingOpsStart) {
             hrtime_t d = (now - pendingOpsStart) / 1000;
             stats.pendingOpsHisto.add(d);
             stats.pendingOpsMaxDuration.setIfBigger(d);
         }
-    } else {
-        return;
+        pendingOpsStart = 0;
+        stats.pendingOpsMax.setIfBigger(waiting);
     }
 
-    pendingOpsStart = 0;
-    stats.pendingOps.decr(pendingOps.size());
-    stats.pendingOpsMax.setIfBigger(pendingOps.size());
+    // Waking them a batch at a time spreads them over the front end
+    // threads instead of having them all come back at once.
+    size_t batch = stats.pendingOpsWakeBatch.get();
+    if (batch == 0 || batch > waiting) {
+        batch = waiting;
+    }
+    std::vector<const void*> cookies;
+    cookies.reserve(batch);
+    takePendingOps(pendingReads, batch, now, cookies);
+    takePendingOps(pendingWrites, batch - cookies.size(), now, cookies);
 
-    engine.notifyIOComplete(pendingOps, code);
-    pendingOps.clear();
+    numPendingOps.decr(cookies.size());
+    stats.pendingOps.decr(cookies.size());
+    engine.notifyIOComplete(cookies, code);
 
     LOG(EXTENSION_LOG_INFO,
-        "Fired pendings ops for vbucket %d in state %s\n",
-        id, VBucket::toString(state));
+        "Fired %ld pending ops for vbucket %d in state %s, %ld left\n",
+        static_cast<long>(cookies.size()), id, VBucket::toString(state),
+        static_cast<long>(waiting - cookies.size()));
+    return waiting > cookies.size();
 }
 
-void VBucket::fireAllOps(EventuallyPersistentEngine &engine) {
+bool VBucket::fireAllOps(EventuallyPersistentEngine &engine) {
     LockHolder lh(pendingOpLock);
 
     if (state == vbucket_state_active) {
-        fireAllOps(engine, ENGINE_SUCCESS);
+        return fireAllOps(engine, ENGINE_SUCCESS);
     } else if (state == vbucket_state_pending) {
         // Nothing
+        return false;
     } else {
-        fireAllOps(engine, ENGINE_NOT_MY_VBUCKET);
+        return fireAllOps(engine, ENGINE_NOT_MY_VBUCKET);
     }
 }
 
@@ -154,6 +242,13 @@ void VBucket::setState(vbucket_state_t to, SERVER_HANDLE_V1 *sapi) {
     LOG(EXTENSION_LOG_DEBUG, "transitioning vbucket %d from %s to %s",
         id, VBucket::toString(oldstate), VBucket::toString(to));
 
+    // Only the vbuckets clients don't use may sit in an idle table; an
+    // active one gets its full size before the traffic comes in.
+    ht.setIdleAllowed(to != vbucket_state_active);
+    if (to == vbucket_state_active) {
+        ht.reserve(ht.getNumItems());
+    }
+
     state = to;
 }
 
@@ -205,6 +300,8 @@ void VBucket::resetStats() {
     dirtyQueueAge.set(0);
     dirtyQueuePendingWrites.set(0);
     dirtyQueueDrain.set(0);
+    flushLatencyMax.set(0);
+    persistLatencyHisto.reset();
 }
 
 template <typename T>
@@ -231,22 +328,44 @@ void VBucket::queueBGFetchItem(VBucketBGFetchItem *fetch,
     }
 }
 
-bool VBucket::getBGFetchItems(vb_bgfetch_queue_t &fetches) {
+void VBucket::queueBGFetchItems(std::list<VBucketBGFetchItem *> &fetches,
+                                BgFetcher *bgFetcher) {
+    if (fetches.empty()) {
+        return;
+    }
+    size_t n = fetches.size();
+    LockHolder lh(pendingBGFetchesLock);
+    std::list<VBucketBGFetchItem *>::iterator it;
+    for (it = fetches.begin(); it != fetches.end(); ++it) {
+        pendingBGFetches.push(*it);
+    }
+    fetches.clear();
+    bgFetcher->addPendingVB(id);
+    lh.unlock();
+    bgFetcher->notifyBGEvent(n);
+}
+
+bool VBucket::getBGFetchItems(vb_bgfetch_queue_t &fetches,
+                              vb_bgmeta_queue_t &metaFetches) {
     LockHolder lh(pendingBGFetchesLock);
     int items;
     for (items = 0; !pendingBGFetches.empty(); items++) {
         VBucketBGFetchItem *it = pendingBGFetches.front();
         pendingBGFetches.pop();
-        fetches[it->value.getId()].push_back(it);
+        if (it->metaOnly) {
+            metaFetches[it->key].push_back(it);
+        } else {
+            fetches[it->value.getId()].push_back(it);
+        }
     }
     lh.unlock();
 
-    int dedups = items - fetches.size();
+    int dedups = items - fetches.size() - metaFetches.size();
     if (dedups) {
         stats.numRemainingBgJobs.decr(dedups);
     }
 
-    return fetches.size() > 0;
+    return fetches.size() > 0 || metaFetches.size() > 0;
 }
 
 void VBucket::addHighPriorityVBEntry(uint64_t chkid, const void *cookie) {
@@ -257,6 +376,29 @@ void VBucket::addHighPriorityVBEntry(uint64_t chkid, const void *cookie) {
     hpChks.push_back(HighPriorityVBEntry(cookie, chkid));
 }
 
+void VBucket::addHighPriorityVBEntry(const std::string &key, uint64_t revSeqno,
+                                     bool persist, bool replicate,
+                                     const void *cookie) {
+    LockHolder lh(hpChksMutex);
+    if (shard && persist) {
+        // Get the flusher to it first, as for a checkpoint.
+        ++shard->highPriorityCount;
+    }
+    ++keyWaiters;
+    hpChks.push_back(HighPriorityVBEntry(cookie, key, revSeqno,
+                                         persist, replicate));
+}
+
+void VBucket::eraseHighPriorityVBEntry(std::list<HighPriorityVBEntry>::iterator &entry) {
+    if (shard && !entry->persisted) {
+        --shard->highPriorityCount;
+    }
+    if (!entry->key.empty()) {
+        --keyWaiters;
+    }
+    entry = hpChks.erase(entry);
+}
+
 void VBucket::notifyCheckpointPersisted(EventuallyPersistentEngine &e,
                                         uint64_t chkid) {
     LockHolder lh(hpChksMutex);
@@ -264,31 +406,143 @@ void VBucket::notifyCheckpointPersisted(EventuallyPersistentEngine &e,
     while (entry != hpChks.end()) {
         hrtime_t wall_time(gethrtime() - entry->start);
         size_t spent = wall_time / 1000000000;
-        if (entry->checkpoint <= chkid) {
+        if (!entry->key.empty()) {
+            ++entry;
+        } else if (entry->checkpoint <= chkid) {
             e.notifyIOComplete(entry->cookie, ENGINE_SUCCESS);
             stats.chkPersistenceHisto.add(wall_time / 1000);
             adjustCheckpointFlushTimeout(wall_time / 1000000000);
             LOG(EXTENSION_LOG_WARNING, "Notified the completion of checkpoint "
                 "persistence for vbucket %d, cookie %p", id, entry->cookie);
-            entry = hpChks.erase(entry);
-            if (shard) {
-                --shard->highPriorityCount;
-            }
+            eraseHighPriorityVBEntry(entry);
         } else if (spent > getCheckpointFlushTimeout()) {
             adjustCheckpointFlushTimeout(spent);
             e.notifyIOComplete(entry->cookie, ENGINE_TMPFAIL);
             LOG(EXTENSION_LOG_WARNING, "Notified the timeout on checkpoint "
                 "persistence for vbucket %d, cookie %p", id, entry->cookie);
-            entry = hpChks.erase(entry);
-            if (shard) {
-                --shard->highPriorityCount;
+            eraseHighPriorityVBEntry(entry);
+        } else {
+            ++entry;
+        }
+    }
+    lh.unlock();
+    notifyKeyWaitTimeouts(e);
+}
+
+void VBucket::notifyKeyPersisted(EventuallyPersistentEngine &e,
+                                 const std::string &key, uint64_t revSeqno) {
+    notifyKeyEvent(e, key, revSeqno, true);
+}
+
+void VBucket::notifyKeyReplicated(EventuallyPersistentEngine &e,
+                                  const std::string &key, uint64_t revSeqno) {
+    notifyKeyEvent(e, key, revSeqno, false);
+}
+
+void VBucket::notifyKeyEvent(EventuallyPersistentEngine &e,
+                             const std::string &key, uint64_t revSeqno,
+                             bool persisted) {
+    if (!hasKeyWaiters()) {
+        return;
+    }
+    LockHolder lh(hpChksMutex);
+    std::list<HighPriorityVBEntry>::iterator entry = hpChks.begin();
+    while (entry != hpChks.end()) {
+        if (entry->key != key || revSeqno < entry->revSeqno) {
+            ++entry;
+        } else if (revSeqno > entry->revSeqno) {
+            // A later mutation of the key got there instead.
+            e.notifyKeyDurability(entry->cookie, ENGINE_KEY_EEXISTS);
+            eraseHighPriorityVBEntry(entry);
+        } else {
+            if (!persisted) {
+                entry->replicated = true;
+            } else if (!entry->persisted) {
+                entry->persisted = true;
+                if (shard) {
+                    --shard->highPriorityCount;
+                }
+            }
+            if (entry->persisted && entry->replicated) {
+                stats.keyDurabilityHisto.add((gethrtime() - entry->start) / 1000);
+                e.notifyKeyDurability(entry->cookie, ENGINE_SUCCESS);
+                eraseHighPriorityVBEntry(entry);
+            } else {
+                ++entry;
             }
+        }
+    }
+}
+
+void VBucket::notifyKeyWaitTimeouts(EventuallyPersistentEngine &e) {
+    if (!hasKeyWaiters()) {
+        return;
+    }
+    LockHolder lh(hpChksMutex);
+    std::list<HighPriorityVBEntry>::iterator entry = hpChks.begin();
+    while (entry != hpChks.end()) {
+        size_t spent = (gethrtime() - entry->start) / 1000000000;
+        if (!entry->key.empty() && spent > getCheckpointFlushTimeout()) {
+            e.notifyKeyDurability(entry->cookie, ENGINE_TMPFAIL);
+            LOG(EXTENSION_LOG_WARNING, "Notified the timeout on key "
+                "durability for vbucket %d, cookie %p", id, entry->cookie);
+            eraseHighPriorityVBEntry(entry);
         } else {
             ++entry;
         }
     }
 }
 
+bool VBucket::addPersistenceWaiter(const void *cookie, uint64_t commits) {
+    LockHolder lh(persistWaitersMutex);
+    if (commits != commitCount) {
+        return false;
+    }
+    persistWaiters.push_back(std::make_pair(cookie, gethrtime()));
+    return true;
+}
+
+void VBucket::notifyPersistenceWaiters(EventuallyPersistentEngine &e) {
+    LockHolder lh(persistWaitersMutex);
+    ++commitCount;
+    if (persistWaiters.empty()) {
+        return;
+    }
+    std::vector<const void*> waiters;
+    std::list<std::pair<const void*, hrtime_t> >::iterator it;
+    for (it = persistWaiters.begin(); it != persistWaiters.end(); ++it) {
+        waiters.push_back(it->first);
+    }
+    persistWaiters.clear();
+    lh.unlock();
+    e.notifyIOComplete(waiters, ENGINE_SUCCESS);
+}
+
+void VBucket::notifyPersistenceWaitTimeouts(EventuallyPersistentEngine &e) {
+    std::vector<const void*> waiters;
+    LockHolder lh(persistWaitersMutex);
+    hrtime_t now = gethrtime();
+    std::list<std::pair<const void*, hrtime_t> >::iterator it;
+    it = persistWaiters.begin();
+    while (it != persistWaiters.end()) {
+        size_t spent = (now - it->second) / 1000000000;
+        if (spent >= getCheckpointFlushTimeout()) {
+            waiters.push_back(it->first);
+            it = persistWaiters.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    lh.unlock();
+    if (!waiters.empty()) {
+        LOG(EXTENSION_LOG_WARNING, "Notified the timeout on observe "
+            "persistence waits of %ld connections for vbucket %d",
+            waiters.size(), id);
+        // The observe looks again and answers, as it's waited long enough.
+        e.notifyIOComplete(waiters, ENGINE_SUCCESS);
+    }
+}
+
 void VBucket::adjustCheckpointFlushTimeout(size_t wall_time) {
     size_t middle = (MIN_CHK_FLUSH_TIMEOUT + MAX_CHK_FLUSH_TIMEOUT) / 2;
 
@@ -309,6 +563,93 @@ size_t VBucket::getCheckpointFlushTimeout() {
     return chkFlushTimeout;
 }
 
+size_t VBucket::getMemoryUsage() {
+    size_t bfSize;
+    {
+        LockHolder lh(bfMutex);
+        bfSize = bloomFilterSize();
+    }
+    return ht.memorySize() + ht.getExpiryIndexMemory() + ht.getItemMemory() +
+        checkpointManager.getMemoryUsage() + getPendingMemory() + bfSize;
+}
+
+void VBucket::setBloomFilterDefaults(size_t keys, double fpProb) {
+    bloomFilterKeys = keys;
+    bloomFilterFpProb = fpProb;
+}
+
+void VBucket::growBloomFilterDefaults(size_t keys) {
+    if (bloomFilterKeys > 0) {
+        bloomFilterKeys = std::max(bloomFilterKeys, keys);
+    }
+}
+
+void VBucket::addToFilter(const std::string &key) {
+    LockHolder lh(bfMutex);
+    if (bFilter) {
+        bFilter->add(key);
+    }
+}
+
+bool VBucket::maybeKeyExists(const std::string &key) {
+    LockHolder lh(bfMutex);
+    return bFilter == NULL || bFilter->maybeContains(key);
+}
+
+bool VBucket::needsFilterRebuild() {
+    LockHolder lh(bfMutex);
+    // Deleted keys never leave the filter, so check it hasn't filled up
+    // with them (or with more keys than it was sized for).
+    return bFilter &&
+        bFilter->getFalsePositiveRate() > bloomFilterFpProb * 2;
+}
+
+BloomFilter *VBucket::createRebuildFilter() {
+    LockHolder lh(bfMutex);
+    if (!bFilter) {
+        return NULL;
+    }
+    // Leave room to grow, or the rebuilt filter would be full again
+    // straight away.
+    size_t keys = std::max(bloomFilterKeys,
+                           bFilter->estimateDistinctKeys() * 2);
+    return new BloomFilter(keys, bloomFilterFpProb);
+}
+
+void VBucket::swapFilter(BloomFilter *rebuilt) {
+    LockHolder lh(bfMutex);
+    stats.memOverhead.decr(bloomFilterSize());
+    delete bFilter;
+    bFilter = rebuilt;
+    stats.memOverhead.incr(bloomFilterSize());
+    assert(stats.memOverhead.get() < GIGANTOR);
+}
+
+static uint64_t wallClockTime() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+void VBucket::markReplicaSynced(uint64_t checkpointId, uint64_t activeTime) {
+    replicaCheckpointId = checkpointId;
+    // Our own clock would say when the message got here, not how much of
+    // the active's history it covers.
+    if (activeTime != 0) {
+        setReplicaSyncTime(activeTime);
+    }
+}
+
+uint64_t VBucket::getReplicaLag() {
+    uint64_t synced = replicaSyncTime.get();
+    if (synced == 0 || isBackfillPhase()) {
+        return std::numeric_limits<uint64_t>::max();
+    }
+    uint64_t now = wallClockTime();
+    // The active's clock may be a little ahead of ours.
+    return now > synced ? (now - synced) / 1000 : 0;
+}
+
 void VBucket::addStats(bool details, ADD_STAT add_stat, const void *c) {
     addStat(NULL, toString(state), add_stat, c);
     if (details) {
@@ -316,11 +657,23 @@ void VBucket::addStats(bool details, ADD_STAT add_stat, const void *c) {
         size_t tempItems = ht.getNumTempItems();
         addStat("num_items", numItems, add_stat, c);
         addStat("num_temp_items", tempItems, add_stat, c);
+        addStat("temp_item_memory", ht.getTempItemMemory(), add_stat, c);
         addStat("num_non_resident", ht.getNumNonResidentItems(), add_stat, c);
-        addStat("ht_memory", ht.memorySize(), add_stat, c);
+        addStat("ht_memory", ht.memorySize() + ht.getExpiryIndexMemory(),
+                add_stat, c);
         addStat("ht_item_memory", ht.getItemMemory(), add_stat, c);
         addStat("ht_cache_size", ht.cacheSize, add_stat, c);
+        addStat("checkpoint_memory", checkpointManager.getMemoryUsage(),
+                add_stat, c);
+        addStat("pending_memory", getPendingMemory(), add_stat, c);
+        addStat("mem_used", getMemoryUsage(), add_stat, c);
+        if (memQuota > 0) {
+            addStat("mem_quota", memQuota, add_stat, c);
+        }
         addStat("num_ejects", ht.getNumEjects(), add_stat, c);
+        addStat("ht_max_chain", ht.getMaxChainWalked(), add_stat, c);
+        addStat("ht_lock_hold_max", ht.getMaxLockHold() / 1000, add_stat, c);
+        addStat("ht_lock_hold_avg", ht.getAvgLockHold() / 1000, add_stat, c);
         addStat("ops_create", opsCreate, add_stat, c);
         addStat("ops_update", opsUpdate, add_stat, c);
         addStat("ops_delete", opsDelete, add_stat, c);
@@ -331,5 +684,34 @@ void VBucket::addStats(bool details, ADD_STAT add_stat, const void *c) {
         addStat("queue_drain", dirtyQueueDrain, add_stat, c);
         addStat("queue_age", getQueueAge(), add_stat, c);
         addStat("pending_writes", dirtyQueuePendingWrites, add_stat, c);
+        addStat("flush_latency", flushLatency, add_stat, c);
+        addStat("flush_latency_max", flushLatencyMax, add_stat, c);
+        addStat("flush_duration", flushDuration, add_stat, c);
+        addStat("purge_seqno", purgeSeqno, add_stat, c);
+        addStat("purged_by_seqno", purgedBySeqno, add_stat, c);
+        addStat("persisted_seqno", checkpointManager.getPersistedSeqno(),
+                add_stat, c);
+        addStat("unpersisted_mutations",
+                checkpointManager.getUnpersistedMutations(), add_stat, c);
+        addStat("unreplicated_mutations",
+                checkpointManager.getUnreplicatedMutations(), add_stat, c);
+        if (state == vbucket_state_replica) {
+            addStat("replica_checkpoint_id", replicaCheckpointId, add_stat, c);
+            uint64_t lag = getReplicaLag();
+            if (lag != std::numeric_limits<uint64_t>::max()) {
+                addStat("replica_lag", lag, add_stat, c);
+            }
+        }
+        std::stringstream histo;
+        histo << "vb_" << id << ":persistence_latency";
+        add_casted_stat(histo.str().c_str(), persistLatencyHisto, add_stat, c);
+        LockHolder lh(bfMutex);
+        if (bFilter) {
+            addStat("bfilter_size", bFilter->getSize(), add_stat, c);
+            addStat("bfilter_key_count", bFilter->estimateDistinctKeys(),
+                    add_stat, c);
+            addStat("bfilter_fp_rate", bFilter->getFalsePositiveRate(),
+                    add_stat, c);
+        }
     }
 }
@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include <deque>
 #include <list>
 #include <queue>
 #include <set>
@@ -29,6 +30,7 @@
 
 #include "atomic.h"
 #include "bgfetcher.h"
+#include "bloomfilter.h"
 #include "checkpoint.h"
 #include "common.h"
 #include "queueditem.h"
@@ -39,17 +41,32 @@ const size_t MAX_CHK_FLUSH_TIMEOUT = 30; // 30 sec.
 
 struct HighPriorityVBEntry {
     HighPriorityVBEntry() :
-        cookie(NULL), checkpoint(0), start(gethrtime()) { }
+        cookie(NULL), checkpoint(0), revSeqno(0), persisted(false),
+        replicated(true), start(gethrtime()) { }
     HighPriorityVBEntry(const void *c, uint64_t chk) :
-        cookie(c), checkpoint(chk), start(gethrtime()) { }
+        cookie(c), checkpoint(chk), revSeqno(0), persisted(false),
+        replicated(true), start(gethrtime()) { }
+    HighPriorityVBEntry(const void *c, const std::string &k, uint64_t rev,
+                        bool persist, bool replicate) :
+        cookie(c), checkpoint(0), key(k), revSeqno(rev), persisted(!persist),
+        replicated(!replicate), start(gethrtime()) { }
 
     const void *cookie;
     uint64_t checkpoint;
+    //! The key whose mutation is waited for, empty if it's a checkpoint
+    std::string key;
+    uint64_t revSeqno;
+    bool persisted;
+    bool replicated;
     hrtime_t start;
 };
 
 /**
  * Function object that returns true if the given vbucket is acceptable.
+ *
+ * Besides the set, which is what gets walked, the vbuckets are kept in
+ * a bitmap up to the highest one so that the check on every item is a
+ * single bit test.
  */
 class VBucketFilter {
 public:
@@ -64,16 +81,21 @@ public:
      * given vbucket IDs.
      */
     explicit VBucketFilter(const std::vector<uint16_t> &a) :
-        acceptable(a.begin(), a.end()) {}
+        acceptable(a.begin(), a.end()) {
+        fillBits();
+    }
 
-    explicit VBucketFilter(const std::set<uint16_t> &s) : acceptable(s) {}
+    explicit VBucketFilter(const std::set<uint16_t> &s) : acceptable(s) {
+        fillBits();
+    }
 
     void assign(const std::set<uint16_t> &a) {
         acceptable = a;
+        fillBits();
     }
 
     bool operator ()(uint16_t v) const {
-        return acceptable.empty() || acceptable.find(v) != acceptable.end();
+        return acceptable.empty() || hasBit(v);
     }
 
     size_t size() const { return acceptable.size(); }
@@ -82,6 +104,7 @@ public:
 
     void reset() {
         acceptable.clear();
+        bits.clear();
     }
 
     /**
@@ -108,11 +131,20 @@ public:
 
     bool addVBucket(uint16_t vbucket) {
         std::pair<std::set<uint16_t>::iterator, bool> rv = acceptable.insert(vbucket);
+        if (rv.second) {
+            size_t word = vbucket / BITS_PER_WORD;
+            if (word >= bits.size()) {
+                bits.resize(word + 1, 0);
+            }
+            bits[word] |= bitFor(vbucket);
+        }
         return rv.second;
     }
 
     void removeVBucket(uint16_t vbucket) {
-        acceptable.erase(vbucket);
+        if (acceptable.erase(vbucket) > 0) {
+            bits[vbucket / BITS_PER_WORD] &= ~bitFor(vbucket);
+        }
     }
 
     /**
@@ -124,7 +156,26 @@ public:
 
 private:
 
+    static const size_t BITS_PER_WORD = 64;
+
+    //! A filter of the vbuckets set in the given bitmap
+    explicit VBucketFilter(const std::vector<uint64_t> &b);
+
+    static uint64_t bitFor(uint16_t v) {
+        return static_cast<uint64_t>(1) << (v % BITS_PER_WORD);
+    }
+
+    bool hasBit(uint16_t v) const {
+        size_t word = v / BITS_PER_WORD;
+        return word < bits.size() && (bits[word] & bitFor(v)) != 0;
+    }
+
+    //! Build the bitmap from the set.
+    void fillBits();
+
     std::set<uint16_t> acceptable;
+    //! The same vbuckets as acceptable, one bit each
+    std::vector<uint64_t> bits;
 };
 
 class EventuallyPersistentEngine;
@@ -139,22 +190,29 @@ public:
     VBucket(int i, vbucket_state_t newState, EPStats &st,
             CheckpointConfig &checkpointConfig, KVShard *kvshard,
             vbucket_state_t initState = vbucket_state_dead, uint64_t checkpointId = 1) :
-        ht(st), checkpointManager(st, i, checkpointConfig, checkpointId), id(i), state(newState),
-        initialState(initState), stats(st), shard(kvshard) {
+        ht(st, 0, 0, newState != vbucket_state_active),
+        checkpointManager(st, i, checkpointConfig, checkpointId),
+        persistLatencyHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
+        id(i), state(newState), initialState(initState), stats(st), commitCount(0),
+        shard(kvshard) {
 
         backfill.isBackfillPhase = false;
         pendingOpsStart = 0;
-        stats.memOverhead.incr(sizeof(VBucket)
+        bFilter = NULL;
+        if (bloomFilterKeys > 0) {
+            bFilter = new BloomFilter(bloomFilterKeys, bloomFilterFpProb);
+        }
+        stats.memOverhead.incr(sizeof(VBucket) + bloomFilterSize()
                                + ht.memorySize() + sizeof(CheckpointManager));
         assert(stats.memOverhead.get() < GIGANTOR);
     }
 
     ~VBucket() {
-        if (!pendingOps.empty() || !pendingBGFetches.empty()) {
+        if (numPendingOps.get() > 0 || !pendingBGFetches.empty()) {
             LOG(EXTENSION_LOG_WARNING,
                 "Have %ld pending ops and %ld pending reads "
                 "while destroying vbucket\n",
-                pendingOps.size(), pendingBGFetches.size());
+                numPendingOps.get(), pendingBGFetches.size());
         }
 
         stats.decrDiskQueueSize(dirtyQueueSize.get());
@@ -163,7 +221,9 @@ public:
             delete pendingBGFetches.front();
             pendingBGFetches.pop();
         }
-        stats.memOverhead.decr(sizeof(VBucket) + ht.memorySize() + sizeof(CheckpointManager));
+        stats.memOverhead.decr(sizeof(VBucket) + bloomFilterSize()
+                               + ht.memorySize() + sizeof(CheckpointManager));
+        delete bFilter;
         assert(stats.memOverhead.get() < GIGANTOR);
         LOG(EXTENSION_LOG_INFO, "Destroying vbucket %d\n", id);
     }
@@ -177,20 +237,19 @@ public:
         initialState = initState;
     }
 
-    bool addPendingOp(const void *cookie) {
-        LockHolder lh(pendingOpLock);
-        if (state != vbucket_state_pending) {
-            // State transitioned while we were waiting.
-            return false;
-        }
-        // Start a timer when enqueuing the first client.
-        if (pendingOps.empty()) {
-            pendingOpsStart = gethrtime();
-        }
-        pendingOps.push_back(cookie);
-        ++stats.pendingOps;
-        ++stats.pendingOpsTotal;
-        return true;
+    /**
+     * Block an op until the vbucket is no longer pending.
+     *
+     * @param cookie the op's connection
+     * @param read true for a read, which is woken ahead of the mutations
+     * @return ENGINE_EWOULDBLOCK if it's blocked, ENGINE_TMPFAIL if too
+     *         many ops are blocked on the vbucket already, or
+     *         ENGINE_SUCCESS if the vbucket isn't pending anymore
+     */
+    ENGINE_ERROR_CODE addPendingOp(const void *cookie, bool read = false);
+
+    bool hasPendingOps() const {
+        return numPendingOps.get() > 0;
     }
 
     void doStatsForQueueing(QueuedItem& item, size_t itemBytes);
@@ -206,7 +265,13 @@ public:
         return (currentAge - dirtyQueueAge) * 1000;
     }
 
-    void fireAllOps(EventuallyPersistentEngine &engine);
+    /**
+     * Wake the ops blocked while the vbucket was pending, if it no longer
+     * is, up to a batch of pending_ops_wake_batch of them.
+     *
+     * @return true if there are more to wake
+     */
+    bool fireAllOps(EventuallyPersistentEngine &engine);
 
     size_t size(void) {
         HashTableDepthStatVisitor v;
@@ -242,9 +307,12 @@ public:
         backfill.isBackfillPhase = backfillPhase;
     }
 
-    bool getBGFetchItems(vb_bgfetch_queue_t &fetches);
+    bool getBGFetchItems(vb_bgfetch_queue_t &fetches,
+                         vb_bgmeta_queue_t &metaFetches);
     void queueBGFetchItem(VBucketBGFetchItem *fetch, BgFetcher *bgFetcher,
                           bool notify = true);
+    void queueBGFetchItems(std::list<VBucketBGFetchItem *> &fetches,
+                           BgFetcher *bgFetcher);
     size_t numPendingBGFetchItems(void) {
         // do a dirty read of number of fetch items
         return pendingBGFetches.size();
@@ -254,6 +322,49 @@ public:
         return !pendingBGFetches.empty();
     }
 
+    /**
+     * Remember that a key may be on disk.
+     */
+    void addToFilter(const std::string &key);
+
+    /**
+     * True unless the key is known never to have been written to disk,
+     * so a miss in the hash table needs a disk lookup.
+     */
+    bool maybeKeyExists(const std::string &key);
+
+    /**
+     * True if the bloom filter has filled up to where it's much more
+     * likely to give false positives than it was sized for.
+     */
+    bool needsFilterRebuild();
+
+    /**
+     * Create an empty filter to rebuild this vbucket's into, sized for
+     * the keys the current one holds (NULL if not filtering).
+     */
+    BloomFilter *createRebuildFilter();
+
+    /**
+     * Replace the bloom filter with a rebuilt one, which the vbucket
+     * takes ownership of.
+     */
+    void swapFilter(BloomFilter *rebuilt);
+
+    /**
+     * Size new vbuckets' bloom filters of keys on disk.
+     *
+     * @param keys the number of keys to size them for (0 for none)
+     * @param fpProb the false positive probability wanted
+     */
+    static void setBloomFilterDefaults(size_t keys, double fpProb);
+
+    /**
+     * Make sure new vbuckets' bloom filters are sized for at least the
+     * given number of keys, if filtering at all.
+     */
+    static void growBloomFilterDefaults(size_t keys);
+
     static const char* toString(vbucket_state_t s) {
         switch(s) {
         case vbucket_state_active: return "active"; break;
@@ -278,9 +389,106 @@ public:
 
     void addHighPriorityVBEntry(uint64_t chkid, const void *cookie);
     void notifyCheckpointPersisted(EventuallyPersistentEngine &e, uint64_t chkid);
+
+    /**
+     * Have a connection notified once a key's mutation is persisted and/or
+     * acked by a replica; if a later mutation of the key gets there first,
+     * it's notified with ENGINE_KEY_EEXISTS.
+     */
+    void addHighPriorityVBEntry(const std::string &key, uint64_t revSeqno,
+                                bool persist, bool replicate,
+                                const void *cookie);
+    void notifyKeyPersisted(EventuallyPersistentEngine &e,
+                            const std::string &key, uint64_t revSeqno);
+    void notifyKeyReplicated(EventuallyPersistentEngine &e,
+                             const std::string &key, uint64_t revSeqno);
+    //! Notify the connections that waited on a key for too long.
+    void notifyKeyWaitTimeouts(EventuallyPersistentEngine &e);
+
+    //! Tell whether any connection waits on a key
+    bool hasKeyWaiters() const { return keyWaiters.get() > 0; }
     size_t getHighPriorityChkSize() const;
     static size_t getCheckpointFlushTimeout();
 
+    //! Get the number of times this vbucket's items were committed
+    uint64_t getCommitCount() {
+        LockHolder lh(persistWaitersMutex);
+        return commitCount;
+    }
+
+    /**
+     * Have a connection notified the next time this vbucket's items are
+     * committed.
+     *
+     * @param cookie the connection to notify
+     * @param commits the getCommitCount() read before the connection
+     *                found its items dirty
+     * @return false if there's been a commit since, in which case the
+     *         connection is not added
+     */
+    bool addPersistenceWaiter(const void *cookie, uint64_t commits);
+
+    //! Notify the connections waiting on a commit of this vbucket.
+    void notifyPersistenceWaiters(EventuallyPersistentEngine &e);
+
+    /**
+     * Notify the connections that waited on a commit of this vbucket for
+     * longer than the checkpoint persistence timeout, so that they get
+     * answered with what's persisted so far.
+     */
+    void notifyPersistenceWaitTimeouts(EventuallyPersistentEngine &e);
+
+    /**
+     * Note that a replica has everything its active had as of a time, in
+     * microseconds of the wall clock.
+     */
+    void setReplicaSyncTime(uint64_t t) {
+        replicaSyncTime.setIfBigger(t);
+    }
+
+    /**
+     * Note that a replica got a checkpoint message from its active, and
+     * has everything the active had as of a time of the active's clock.
+     *
+     * @param checkpointId the checkpoint's id
+     * @param activeTime usec of the active's wall clock, or 0 if unknown
+     */
+    void markReplicaSynced(uint64_t checkpointId, uint64_t activeTime);
+
+    /**
+     * Get how far, in milliseconds, a replica may be behind its active:
+     * the time since it last had all the active had.
+     *
+     * @return the lag, or UINT64_MAX if it's backfilling or has never
+     *         heard from its active
+     */
+    uint64_t getReplicaLag();
+
+    //! Memory held by the ops waiting on the vbucket and its queued bg fetches
+    size_t getPendingMemory() {
+        return numPendingOps.get() * sizeof(PendingOp) +
+            numPendingBGFetchItems() * sizeof(VBucketBGFetchItem);
+    }
+
+    /**
+     * Get the memory the vbucket accounts for: its hash table and items,
+     * its checkpoints, its pending ops and its bloom filter.
+     */
+    size_t getMemoryUsage();
+
+    /**
+     * Set the memory each vbucket may account for before the item pager
+     * ejects from it ahead of the others (0 for no quota).  It's a soft
+     * quota: nothing is refused for going over it.
+     */
+    static void setMemQuota(size_t bytes) {
+        memQuota = bytes;
+    }
+
+    static size_t getMemQuota() {
+        return memQuota;
+    }
+
     void addStats(bool details, ADD_STAT add_stat, const void *c);
 
     static const vbucket_state_t ACTIVE;
@@ -309,33 +517,94 @@ public:
     Atomic<size_t>  dirtyQueueDrain;
     Atomic<uint64_t> dirtyQueueAge;
     Atomic<size_t>  dirtyQueuePendingWrites;
+    //! Time (ms) the oldest item of the last flush waited to be committed
+    Atomic<uint64_t> flushLatency;
+    Atomic<uint64_t> flushLatencyMax;
+    //! Time (usec) the last flush took from begin to commit
+    Atomic<hrtime_t> flushDuration;
+    //! Time items took from being queued to being on disk
+    Histogram<hrtime_t> persistLatencyHisto;
 
     Atomic<size_t>  numExpiredItems;
+    //! The highest rev seqno of the deletions purged from its file
+    Atomic<uint64_t> purgeSeqno;
+    //! The highest disk seqno of the deletions purged from its file, or
+    //! a seqno they're known to be at or below
+    Atomic<uint64_t> purgedBySeqno;
+
+    /**
+     * True if deletions persisted after a disk seqno may have been purged
+     * from the vbucket's file, so a stream of the changes since it would
+     * miss them.
+     */
+    bool isPurgedSince(uint64_t seqno) {
+        return seqno < purgedBySeqno.get();
+    }
+    //! The last checkpoint id a replica got from its active
+    Atomic<uint64_t> replicaCheckpointId;
 
 private:
     template <typename T>
     void addStat(const char *nm, T val, ADD_STAT add_stat, const void *c);
 
-    void fireAllOps(EventuallyPersistentEngine &engine, ENGINE_ERROR_CODE code);
+    //! When (usec of the wall clock) a replica last had all its active had
+    Atomic<uint64_t> replicaSyncTime;
+
+    /**
+     * An op blocked on the vbucket while it's pending, and since when.
+     */
+    struct PendingOp {
+        PendingOp(const void *c, hrtime_t t) : cookie(c), start(t) { }
+
+        const void *cookie;
+        hrtime_t start;
+    };
+
+    bool fireAllOps(EventuallyPersistentEngine &engine, ENGINE_ERROR_CODE code);
+    void takePendingOps(std::deque<PendingOp> &ops, size_t max, hrtime_t now,
+                        std::vector<const void*> &cookies);
 
     void adjustCheckpointFlushTimeout(size_t wall_time);
 
+    size_t bloomFilterSize() const {
+        return bFilter ? sizeof(BloomFilter) + bFilter->getSize() : 0;
+    }
+
     int                      id;
     Atomic<vbucket_state_t>  state;
     vbucket_state_t          initialState;
     Mutex                    pendingOpLock;
-    std::vector<const void*> pendingOps;
+    std::deque<PendingOp>    pendingReads;
+    std::deque<PendingOp>    pendingWrites;
+    Atomic<size_t>           numPendingOps;
     hrtime_t                 pendingOpsStart;
     EPStats                 &stats;
 
     Mutex pendingBGFetchesLock;
     std::queue<VBucketBGFetchItem *> pendingBGFetches;
 
+    void notifyKeyEvent(EventuallyPersistentEngine &e, const std::string &key,
+                        uint64_t revSeqno, bool persisted);
+    void eraseHighPriorityVBEntry(std::list<HighPriorityVBEntry>::iterator &entry);
+
     Mutex hpChksMutex;
     std::list<HighPriorityVBEntry> hpChks;
+    Atomic<size_t> keyWaiters;
+
+    Mutex persistWaitersMutex;
+    //! The connections waiting on a commit, with when they started to
+    std::list<std::pair<const void*, hrtime_t> > persistWaiters;
+    uint64_t commitCount;
     KVShard *shard;
 
+    //! Keys that may be on disk in full eviction mode (NULL if not filtering).
+    BloomFilter *bFilter;
+    Mutex bfMutex;
+
     static size_t chkFlushTimeout;
+    static size_t bloomFilterKeys;
+    static size_t memQuota;
+    static double bloomFilterFpProb;
 
     DISALLOW_COPY_AND_ASSIGN(VBucket);
 };
@@ -0,0 +1,213 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "ep_engine.h"
+#include "iomanager/iomanager.h"
+#include "vbucket_owners.h"
+
+const double VBucketOwners::sleepInterval = 1.0;
+
+VBucketOwners::VBucketOwners(EventuallyPersistentEngine &e,
+                             size_t numShards) :
+    engine(e), stats(e.getEpStats()), stopped(false)
+{
+    assert(numShards > 0);
+    for (size_t i = 0; i < numShards; ++i) {
+        shards.push_back(new Shard());
+    }
+}
+
+VBucketOwners::~VBucketOwners() {
+    std::vector<Shard*>::iterator it = shards.begin();
+    for (; it != shards.end(); ++it) {
+        // Only an op that raced with stop() can still be queued.
+        OwnedOp *op = (*it)->ops.takeAll();
+        while (op != NULL) {
+            OwnedOp *next = op->next;
+            releaseOp(op);
+            op = next;
+        }
+        std::map<const void*, OwnedOp*>::iterator rit;
+        for (rit = (*it)->results.begin(); rit != (*it)->results.end();
+             ++rit) {
+            releaseOp(rit->second);
+        }
+        delete *it;
+    }
+}
+
+void VBucketOwners::start() {
+    for (size_t i = 0; i < shards.size(); ++i) {
+        IOManager::get()->scheduleVBucketOwner(&engine, this,
+                                               Priority::VBucketOwnerPriority,
+                                               i);
+        assert(shards[i]->taskId > 0);
+    }
+}
+
+void VBucketOwners::stop() {
+    stopped.set(true);
+    std::vector<Shard*>::iterator it = shards.begin();
+    for (; it != shards.end(); ++it) {
+        IOManager::get()->cancel((*it)->taskId);
+    }
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        OwnedOp *op = (*it)->ops.takeAll();
+        while (op != NULL) {
+            OwnedOp *next = op->next;
+            op->status = ENGINE_TMPFAIL;
+            complete(**it, op);
+            op = next;
+        }
+    }
+}
+
+ENGINE_ERROR_CODE VBucketOwners::forward(OwnedOp *op) {
+    if (stopped.get()) {
+        delete op;
+        return ENGINE_TMPFAIL;
+    }
+    Shard &s = shardOf(op->vbucket);
+    s.ops.push(op);
+    ++stats.vbOwnerOps;
+    // Only the first op since the task last looked wakes it.
+    if (s.pending.cas(false, true)) {
+        IOManager::get()->wake(s.taskId);
+    }
+    return ENGINE_EWOULDBLOCK;
+}
+
+bool VBucketOwners::takeResult(const void *cookie, uint16_t vbucket,
+                               ENGINE_ERROR_CODE &status, item **itm,
+                               uint64_t *cas) {
+    Shard &s = shardOf(vbucket);
+    OwnedOp *op;
+    {
+        LockHolder lh(s.resultsMutex);
+        std::map<const void*, OwnedOp*>::iterator it = s.results.find(cookie);
+        if (it == s.results.end()) {
+            return false;
+        }
+        op = it->second;
+        s.results.erase(it);
+    }
+    status = op->status;
+    if (itm != NULL) {
+        *itm = op->itm;
+    }
+    if (cas != NULL) {
+        *cas = op->cas;
+    }
+    delete op;
+    return true;
+}
+
+void VBucketOwners::dropResult(const void *cookie) {
+    std::vector<Shard*>::iterator it = shards.begin();
+    for (; it != shards.end(); ++it) {
+        OwnedOp *op = NULL;
+        {
+            LockHolder lh((*it)->resultsMutex);
+            std::map<const void*, OwnedOp*>::iterator rit =
+                (*it)->results.find(cookie);
+            if (rit != (*it)->results.end()) {
+                op = rit->second;
+                (*it)->results.erase(rit);
+            }
+        }
+        if (op != NULL) {
+            releaseOp(op);
+            return;
+        }
+    }
+}
+
+bool VBucketOwners::run(size_t shardId, size_t tid) {
+    Shard &s = *shards[shardId];
+    runOps(s);
+
+    s.pending.set(false);
+    if (!s.ops.empty() && s.pending.cas(false, true)) {
+        // More came in while we ran; nobody's woken us for them.
+        IOManager::get()->snooze(tid, 0);
+        return true;
+    }
+    IOManager::get()->snooze(tid, sleepInterval);
+    if (s.pending.get()) {
+        // An op was queued, and we were woken, right before the snooze.
+        IOManager::get()->snooze(tid, 0);
+    }
+    return true;
+}
+
+void VBucketOwners::runOps(Shard &s) {
+    OwnedOp *op = s.ops.takeAll();
+    while (op != NULL) {
+        OwnedOp *next = op->next;
+        runOp(s, op);
+        op = next;
+    }
+}
+
+void VBucketOwners::runOp(Shard &s, OwnedOp *op) {
+    const void *cookie = op->cookie;
+    switch (op->type) {
+    case OwnedOp::GET:
+        op->status = engine.get(cookie, &op->itm, op->key.data(),
+                                static_cast<int>(op->key.length()),
+                                op->vbucket);
+        break;
+    case OwnedOp::STORE:
+        op->status = engine.store(cookie, op->itm, &op->cas, op->operation,
+                                  op->vbucket);
+        break;
+    case OwnedOp::DELETE:
+        op->status = engine.itemDelete(cookie, op->key.data(),
+                                       op->key.length(), &op->cas,
+                                       op->vbucket);
+        break;
+    }
+
+    if (op->status == ENGINE_EWOULDBLOCK) {
+        // Whatever it waits on wakes the connection, which then hands
+        // the op over again.
+        ++stats.vbOwnerBlockedOps;
+        delete op;
+        return;
+    }
+    complete(s, op);
+}
+
+void VBucketOwners::complete(Shard &s, OwnedOp *op) {
+    const void *cookie = op->cookie;
+    {
+        LockHolder lh(s.resultsMutex);
+        s.results[cookie] = op;
+    }
+    engine.notifyIOComplete(cookie, ENGINE_SUCCESS);
+}
+
+void VBucketOwners::releaseOp(OwnedOp *op) {
+    // The item of a store is the connection's; that of a get is ours
+    // until it's taken.
+    if (op->type == OwnedOp::GET && op->itm != NULL) {
+        engine.itemRelease(op->cookie, op->itm);
+    }
+    delete op;
+}
@@ -0,0 +1,215 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_VBUCKET_OWNERS_H_
+#define SRC_VBUCKET_OWNERS_H_ 1
+
+#include "config.h"
+
+#include <memcached/engine.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "locks.h"
+#include "stats.h"
+
+class EventuallyPersistentEngine;
+
+/**
+ * A get, store or delete a front-end thread handed to the owner of its
+ * vbucket.
+ */
+class OwnedOp {
+public:
+    enum Type {
+        GET,
+        STORE,
+        DELETE
+    };
+
+    OwnedOp(Type t, const void *c, const void *k, size_t nk, uint16_t vb) :
+        type(t), cookie(c), key(static_cast<const char*>(k), nk),
+        vbucket(vb), itm(NULL), cas(0), operation(OPERATION_SET),
+        status(ENGINE_SUCCESS), next(NULL) { }
+
+    Type               type;
+    const void        *cookie;
+    std::string        key;
+    uint16_t           vbucket;
+    //! The item to store, or the one a get found
+    item              *itm;
+    //! The cas to match, and the item's new one once done
+    uint64_t           cas;
+    ENGINE_STORE_OPERATION operation;
+    ENGINE_ERROR_CODE  status;
+    OwnedOp           *next;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(OwnedOp);
+};
+
+/**
+ * A queue any number of threads push to without a lock and a single
+ * one drains.  A push is a compare-and-swap onto a stack; the consumer
+ * swaps the whole stack out and reverses it into the order it came in.
+ */
+class OwnedOpQueue {
+public:
+    OwnedOpQueue() : head(NULL) { }
+
+    void push(OwnedOp *op) {
+        OwnedOp *old;
+        do {
+            old = head.get();
+            op->next = old;
+        } while (!head.cas(old, op));
+    }
+
+    /**
+     * Take everything queued so far.
+     *
+     * @return the ops, oldest first, linked through their next pointers
+     */
+    OwnedOp *takeAll() {
+        OwnedOp *op = head.swap(NULL);
+        OwnedOp *rv = NULL;
+        while (op != NULL) {
+            OwnedOp *next = op->next;
+            op->next = rv;
+            rv = op;
+            op = next;
+        }
+        return rv;
+    }
+
+    bool empty() const {
+        return head.get() == NULL;
+    }
+
+private:
+    Atomic<OwnedOp*> head;
+
+    DISALLOW_COPY_AND_ASSIGN(OwnedOpQueue);
+};
+
+/**
+ * Runs the gets, stores and deletes of each shard's vbuckets on one task
+ * of the shard, which the executor pool always runs on the same thread.
+ * A front-end thread only queues the op and parks its connection; the
+ * shard's task runs the op as the front-end thread would have, keeps the
+ * result with the connection and wakes it up to take it.  So the hash
+ * tables, checkpoints and vbucket references of a shard are only touched
+ * by front-end ops from the one thread, and stay in its core's caches.
+ *
+ * An op that would block (e.g. on a background fetch) is dropped once
+ * it's set that up, and its connection is woken by whatever it waits on;
+ * the op is then handed over again as if it were new.
+ *
+ * A done op is kept by its shard until its connection takes the result,
+ * or is dropped when the connection goes away without doing so.
+ */
+class VBucketOwners {
+public:
+    static const double sleepInterval;
+
+    VBucketOwners(EventuallyPersistentEngine &e, size_t numShards);
+
+    /**
+     * Frees the results nobody took; stop() must have been called.
+     */
+    ~VBucketOwners();
+
+    void start();
+
+    /**
+     * Stop the tasks and fail what's still queued, waking the connections
+     * to take that.  It's called while the engine is still whole, as the
+     * connections come back into it.
+     */
+    void stop();
+
+    /**
+     * Hand an op to the owner of its vbucket, which takes ownership of it.
+     *
+     * @return ENGINE_EWOULDBLOCK, to park the connection until it's done,
+     *         or ENGINE_TMPFAIL once stopped
+     */
+    ENGINE_ERROR_CODE forward(OwnedOp *op);
+
+    /**
+     * Take the result of the op an owner has done for a connection.
+     *
+     * @param vbucket the vbucket of the op
+     * @param itm where the item a get found goes, if not NULL
+     * @param cas where the item's new cas goes, if not NULL
+     * @return false if there's none
+     */
+    bool takeResult(const void *cookie, uint16_t vbucket,
+                    ENGINE_ERROR_CODE &status, item **itm = NULL,
+                    uint64_t *cas = NULL);
+
+    /**
+     * Drop the result of a connection that's gone, if it has one.
+     */
+    void dropResult(const void *cookie);
+
+    /**
+     * Run the task of a shard.
+     */
+    bool run(size_t shardId, size_t tid);
+
+    void setTaskId(size_t shardId, size_t tid) {
+        shards[shardId]->taskId = tid;
+    }
+
+private:
+
+    struct Shard {
+        Shard() : pending(false), taskId(0) { }
+
+        OwnedOpQueue  ops;
+        //! Whether the task has been woken for what's queued
+        Atomic<bool>  pending;
+        size_t        taskId;
+        //! Done ops, by the connection yet to take their results
+        Mutex         resultsMutex;
+        std::map<const void*, OwnedOp*> results;
+    };
+
+    Shard &shardOf(uint16_t vbucket) {
+        // The same mapping as VBucketMap::getShard().
+        return *shards[vbucket % shards.size()];
+    }
+
+    void runOps(Shard &s);
+    void runOp(Shard &s, OwnedOp *op);
+    void complete(Shard &s, OwnedOp *op);
+    void releaseOp(OwnedOp *op);
+
+    EventuallyPersistentEngine &engine;
+    EPStats &stats;
+    std::vector<Shard*> shards;
+    Atomic<bool> stopped;
+
+    DISALLOW_COPY_AND_ASSIGN(VBucketOwners);
+};
+
+#endif  // SRC_VBUCKET_OWNERS_H_
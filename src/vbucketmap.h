@@ -40,6 +40,19 @@ public:
     void removeBucket(uint16_t id);
     void addBuckets(const std::vector<VBucket*> &newBuckets);
     RCPtr<VBucket> getBucket(uint16_t id) const;
+
+    /**
+     * Get a vbucket without taking a reference to it, for the front end
+     * ops' lookups.  The caller has to hold an EpochGuard for as long as
+     * it uses the vbucket.
+     */
+    VBucket *peekBucket(uint16_t id) const {
+        if (static_cast<size_t>(id) < size) {
+            return getShard(id)->peekBucket(id);
+        }
+        return NULL;
+    }
+
     size_t getSize() const;
     std::vector<int> getBuckets(void) const;
     std::vector<int> getBucketsSortedByState(void) const;
@@ -50,6 +63,7 @@ public:
     uint64_t getPersistenceCheckpointId(uint16_t id) const;
     void setPersistenceCheckpointId(uint16_t id, uint64_t checkpointId);
     KVShard* getShard(uint16_t id) const;
+    size_t getNumShards() const { return numShards; }
 
 private:
 
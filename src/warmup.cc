@@ -17,6 +17,9 @@
 
 #include "config.h"
 
+#include <pthread.h>
+
+#include <algorithm>
 #include <limits>
 #include <list>
 #include <map>
@@ -25,6 +28,7 @@
 #include <vector>
 
 #include "ep_engine.h"
+#include "memory_snapshot.h"
 #define STATWRITER_NAMESPACE warmup
 #include "statwriter.h"
 #undef STATWRITER_NAMESPACE
@@ -32,10 +36,10 @@
 
 struct WarmupCookie {
     WarmupCookie(EventuallyPersistentStore *s, Callback<GetValue>&c) :
-        store(s->getAuxUnderlying()), cb(c), stats(&s->getEPEngine().getEpStats()),
+        epstore(s), cb(c), stats(&s->getEPEngine().getEpStats()),
         loaded(0), skipped(0), error(0)
     { /* EMPTY */ }
-    KVStore *store;
+    EventuallyPersistentStore *epstore;
     Callback<GetValue> &cb;
     EPStats *stats;
     size_t loaded;
@@ -63,7 +67,10 @@ static void batchWarmupCallback(uint16_t vbId,
             items2fetch[(*itm).second].push_back(fit);
         }
 
-        c->store->getMulti(vbId, items2fetch);
+        {
+            IOSlot slot(c->epstore->getIOScheduler(), IO_CLASS_BGFETCH);
+            c->epstore->getAuxUnderlying(vbId)->getMulti(vbId, items2fetch);
+        }
 
         vb_bgfetch_queue_t::iterator items = items2fetch.begin();
         for (; items != items2fetch.end(); items++) {
@@ -94,8 +101,11 @@ static void warmupCallback(void *arg, uint16_t vb,
 
     if (!stats->warmupComplete.get()) {
         RememberingCallback<GetValue> cb;
-        cookie->store->get(key, rowid, vb, cb);
-        cb.waitForValue();
+        {
+            IOSlot slot(cookie->epstore->getIOScheduler(), IO_CLASS_BGFETCH);
+            cookie->epstore->getAuxUnderlying(vb)->get(key, rowid, vb, cb);
+            cb.waitForValue();
+        }
 
         if (cb.val.getStatus() == ENGINE_SUCCESS) {
             cookie->cb.callback(cb.val);
@@ -193,7 +203,8 @@ std::ostream& operator <<(std::ostream &out, const WarmupState &state)
 
 
 void LoadStorageKVPairCallback::initVBucket(uint16_t vbid,
-                                            const vbucket_state &vbs) {
+                                            const vbucket_state &vbs,
+                                            size_t keys) {
     RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
     if (!vb) {
         vb.reset(new VBucket(vbid, vbs.state, stats,
@@ -201,19 +212,47 @@ void LoadStorageKVPairCallback::initVBucket(uint16_t vbid,
                              epstore->getVBuckets().getShard(vbid)));
         vbuckets.addBucket(vb);
     }
+    if (keys > 0 && vb->ht.getNumItems() == 0) {
+        // Grown before the keys go in, there's nothing to move.
+        vb->ht.reserve(keys);
+        vb->ht.completeResize();
+    }
     // Set the past initial state of each vbucket.
     vb->setInitialState(vbs.state);
+    epstore->getVBuckets().getShard(vbid)->vbStateChanged(vbid, vbs.state);
     // Pass the open checkpoint Id for each vbucket.
     vb->checkpointManager.setOpenCheckpointId(vbs.checkpointId);
-    // Pass the max deleted seqno for each vbucket.
-    vb->ht.setMaxDeletedRevSeqno(vbs.maxDeletedSeqno);
+    // Pass the max deleted seqno for each vbucket.  The keys whose
+    // deletions were purged must still be given higher seqnos.
+    vb->ht.setMaxDeletedRevSeqno(std::max(vbs.maxDeletedSeqno,
+                                          vbs.purgeSeqno));
+    vb->purgeSeqno.set(vbs.purgeSeqno);
+    if (vbs.purgeSeqno > 0) {
+        // Which deletions were purged isn't kept, only that some were, so
+        // a stream from any seqno persisted so far could miss them.
+        vbucket_file_info info;
+        if (epstore->getRWUnderlying(vbid)->getDbFileInfo(vbid, info)) {
+            vb->purgedBySeqno.setIfBigger(info.highSeqno);
+        }
+    }
     // For each vbucket, set its latest checkpoint Id that was
     // successfully persisted.
     vbuckets.setPersistenceCheckpointId(vbid, vbs.checkpointId - 1);
 }
 
+//! The most times a load waits for the bg fetches of the clients
+static const int MAX_BGFETCH_YIELDS = 10;
+//! How long it waits each time (us)
+static const useconds_t BGFETCH_YIELD_TIME = 100;
+
 void LoadStorageKVPairCallback::callback(GetValue &val) {
     Item *i = val.getValue();
+    // While traffic is let in, a client waiting on a value that's yet to
+    // be loaded has its bg fetch read the disk ahead of the warmup.
+    for (int y = 0; y < MAX_BGFETCH_YIELDS && stats.warmupTraffic.get() &&
+             stats.numRemainingBgJobs.get() > 0; ++y) {
+        usleep(BGFETCH_YIELD_TIME);
+    }
     if (i != NULL) {
         RCPtr<VBucket> vb = vbuckets.getBucket(i->getVBucketId());
         if (!vb) {
@@ -222,10 +261,13 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
                                  epstore->getVBuckets().getShard(i->getVBucketId())));
             vbuckets.addBucket(vb);
         }
+        vb->addToFilter(i->getKey());
         bool succeeded(false);
         int retry = 2;
         do {
-            switch (vb->ht.insert(*i, shouldEject(), val.isPartial())) {
+            // With traffic let in, a key that's gone was deleted by it.
+            switch (vb->ht.insert(*i, shouldEject(), val.isPartial(),
+                                  stats.warmupTraffic.get())) {
             case NOMEM:
                 if (retry == 2) {
                     if (hasPurged) {
@@ -245,7 +287,8 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
                 }
                 break;
             case INVALID_CAS:
-                if (epstore->getAuxUnderlying()->isKeyDumpSupported()) {
+                if (epstore->getAuxUnderlying(i->getVBucketId())->
+                    isKeyDumpSupported()) {
                     LOG(EXTENSION_LOG_DEBUG,
                         "Value changed in memory before restore from disk. "
                         "Ignored disk value for: %s.", i->getKey().c_str());
@@ -281,6 +324,19 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
                                 false, &itemMeta);
         }
 
+        if (progress) {
+            ++progress->items;
+            progress->bytes.incr(i->getNKey() + i->getNBytes());
+            int vbid = i->getVBucketId();
+            if (vbid != lastVBucket) {
+                if (vbsInOrder && lastVBucket >= 0) {
+                    (*vbProgress)[lastVBucket] = WARMUP_VB_LOADED;
+                }
+                (*vbProgress)[vbid] = WARMUP_VB_LOADING;
+                lastVBucket = vbid;
+            }
+        }
+
         delete i;
         val.setValue(NULL);
 
@@ -322,7 +378,7 @@ void LoadStorageKVPairCallback::purge() {
         int vbid = *it;
         RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
         if (vb && epv.visitBucket(vb)) {
-            vb->ht.visit(epv);
+            vb->ht.visitInline(epv);
         }
     }
     hasPurged = true;
@@ -363,7 +419,13 @@ Warmup::Warmup(EventuallyPersistentStore *st, Dispatcher *d) :
     state(), store(st), dispatcher(d), startTime(0), metadata(0), warmup(0),
     estimateTime(0), estimatedItemCount(std::numeric_limits<size_t>::max()),
     corruptAccessLog(false),
-    estimatedWarmupCount(std::numeric_limits<size_t>::max())
+    estimatedWarmupCount(std::numeric_limits<size_t>::max()),
+    shardProgress(st->getVBuckets().getNumShards()),
+    vbProgress(st->getVBuckets().getSize(), WARMUP_VB_PENDING),
+    phaseTimes(WarmupState::Done + 1, 0), phaseStart(0), phaseKeys(0),
+    phaseValues(0), phaseItems(WarmupState::Done + 1, 0),
+    phaseBytes(WarmupState::Done + 1, 0), phaseStartItems(0),
+    phaseStartBytes(0)
 {
 
 }
@@ -375,12 +437,15 @@ void Warmup::setEstimatedItemCount(size_t to)
 
 void Warmup::setEstimatedWarmupCount(size_t to)
 {
-    estimatedWarmupCount = to;
+    estimatedWarmupCount.set(to);
 }
 
 void Warmup::start(void)
 {
     store->stats.warmupComplete.set(false);
+    store->stats.warmupTraffic.set(false);
+    snapshotVBuckets.clear();
+    phaseStart = gethrtime();
     dispatcher->schedule(shared_ptr<WarmupStepper>(new WarmupStepper(this)),
                          &task, Priority::WarmupPriority);
 }
@@ -408,9 +473,19 @@ bool Warmup::initialize(Dispatcher&, TaskId &)
 bool Warmup::estimateDatabaseItemCount(Dispatcher&, TaskId &)
 {
     hrtime_t st = gethrtime();
-    store->getAuxUnderlying()->getEstimatedItemCount(estimatedItemCount);
+    KVStore *aux = store->getVBuckets().getShard(EP_PRIMARY_SHARD)->
+        getAuxUnderlying();
+    aux->getEstimatedItemCount(estimatedItemCount);
     estimateTime = gethrtime() - st;
 
+    // The vbuckets haven't been created yet, so their bloom filters can
+    // still be sized for the keys they're about to load.
+    if (estimatedItemCount != std::numeric_limits<size_t>::max() &&
+        !initialVbState.empty()) {
+        VBucket::growBloomFilterDefaults(estimatedItemCount /
+                                         initialVbState.size());
+    }
+
     transition(WarmupState::KeyDump);
     return true;
 }
@@ -418,27 +493,20 @@ bool Warmup::estimateDatabaseItemCount(Dispatcher&, TaskId &)
 bool Warmup::keyDump(Dispatcher&, TaskId &)
 {
     bool success = false;
-    if (store->getAuxUnderlying()->isKeyDumpSupported()) {
-        shared_ptr<Callback<GetValue> > cb(createLKVPCB(initialVbState, false,
-                                                        state.getState()));
-        std::map<uint16_t, vbucket_state>::const_iterator it;
-        std::vector<uint16_t> vbids;
-        for (it = initialVbState.begin(); it != initialVbState.end(); ++it) {
-            uint16_t vbid = it->first;
-            vbucket_state vbs = it->second;
-            if (vbs.state == vbucket_state_active || vbs.state == vbucket_state_replica) {
-                vbids.push_back(vbid);
-            }
-        }
-
-        store->getAuxUnderlying()->dumpKeys(vbids, cb);
+    if (isKeyDumpSupported()) {
+        loadShards(true, false);
         success = true;
     }
 
     if (success) {
+        if (store->getEPEngine().getConfiguration().isWarmupTrafficAfterKeys()) {
+            LOG(EXTENSION_LOG_WARNING, "Keys loaded, enabling traffic while "
+                "the values load");
+            store->stats.warmupTraffic.set(true);
+        }
         transition(WarmupState::CheckForAccessLog);
     } else {
-        if (store->getAuxUnderlying()->isKeyDumpSupported()) {
+        if (isKeyDumpSupported()) {
             LOG(EXTENSION_LOG_WARNING,
                 "Failed to dump keys, falling back to full dump");
         }
@@ -454,10 +522,7 @@ bool Warmup::checkForAccessLog(Dispatcher&, TaskId &)
     LOG(EXTENSION_LOG_WARNING, "metadata loaded in %s",
         hrtime2text(metadata).c_str());
 
-    std::string curr = store->accessLog.getLogFile();
-    std::string old = store->accessLog.getLogFile();
-    old.append(".old");
-    if (access(curr.c_str(), F_OK) == 0 || access(old.c_str(), F_OK) == 0) {
+    if (hasShardAccessLogs() || hasUnshardedAccessLog()) {
         transition(WarmupState::LoadingAccessLog);
     } else {
         transition(WarmupState::LoadingData);
@@ -466,38 +531,69 @@ bool Warmup::checkForAccessLog(Dispatcher&, TaskId &)
     return true;
 }
 
-bool Warmup::loadingAccessLog(Dispatcher&, TaskId &)
+/**
+ * Whether there's a log, or the one before it, at a path.
+ */
+static bool accessLogExists(const std::string &path) {
+    std::string old = path + ".old";
+    return access(path.c_str(), F_OK) == 0 || access(old.c_str(), F_OK) == 0;
+}
+
+bool Warmup::hasShardAccessLogs()
 {
-    LoadStorageKVPairCallback *load_cb = createLKVPCB(initialVbState, true,
-                                                      state.getState());
-    bool success = false;
-    hrtime_t stTime = gethrtime();
-    if (store->accessLog.exists()) {
-        try {
-            store->accessLog.open();
-            if (doWarmup(store->accessLog, initialVbState, *load_cb) != (size_t)-1) {
-                success = true;
-            }
-        } catch (MutationLog::ReadException &e) {
-            corruptAccessLog = true;
+    for (size_t i = 0; i < store->getVBuckets().getNumShards(); ++i) {
+        if (accessLogExists(store->getAccessLogPath(static_cast<uint16_t>(i)))) {
+            return true;
         }
     }
+    return false;
+}
 
-    if (!success) {
-        // Do we have the previous file?
-        std::string nm = store->accessLog.getLogFile();
-        nm.append(".old");
-        MutationLog old(nm);
-        if (old.exists()) {
+bool Warmup::hasUnshardedAccessLog()
+{
+    return accessLogExists(store->getEPEngine().getConfiguration().getAlogPath());
+}
+
+bool Warmup::loadingAccessLog(Dispatcher&, TaskId &)
+{
+    bool success = false;
+    hrtime_t stTime = gethrtime();
+    if (hasShardAccessLogs()) {
+        // Each shard reads its own log as it loads it.
+        setEstimatedWarmupCount(0);
+        success = loadShards(false, true, NULL, true) != (size_t)-1;
+    } else {
+        // The single log of all of the vbuckets earlier versions wrote,
+        // until the access scanner replaces it with the shards' logs.
+        Configuration &config = store->getEPEngine().getConfiguration();
+        MutationLog curr(config.getAlogPath(), config.getAlogBlockSize());
+        if (curr.exists()) {
             try {
-                old.open();
-                if (doWarmup(old, initialVbState, *load_cb) != (size_t)-1) {
+                curr.open();
+                if (doWarmup(curr, initialVbState) != (size_t)-1) {
                     success = true;
                 }
             } catch (MutationLog::ReadException &e) {
                 corruptAccessLog = true;
             }
         }
+
+        if (!success) {
+            // Do we have the previous file?
+            std::string nm = config.getAlogPath();
+            nm.append(".old");
+            MutationLog old(nm);
+            if (old.exists()) {
+                try {
+                    old.open();
+                    if (doWarmup(old, initialVbState) != (size_t)-1) {
+                        success = true;
+                    }
+                } catch (MutationLog::ReadException &e) {
+                    corruptAccessLog = true;
+                }
+            }
+        }
     }
 
     size_t numItems = store->getEPEngine().getEpStats().warmedUpValues;
@@ -518,12 +614,11 @@ bool Warmup::loadingAccessLog(Dispatcher&, TaskId &)
         transition(WarmupState::Done);
     }
 
-    delete load_cb;
     return true;
 }
 
 size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
-                        vbucket_state> &vbmap, Callback<GetValue> &cb)
+                        vbucket_state> &vbmap)
 {
     MutationLogHarvester harvester(lf, &store->getEPEngine());
     std::map<uint16_t, vbucket_state>::const_iterator it;
@@ -543,24 +638,16 @@ size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
         hrtime2text(end - st).c_str(), total);
 
     st = gethrtime();
-    WarmupCookie cookie(store, cb);
-    if (store->multiBGFetchEnabled()) {
-        harvester.apply(&cookie, &batchWarmupCallback);
-    } else {
-        harvester.apply(&cookie, &warmupCallback);
-    }
+    size_t loaded = loadShards(false, true, &harvester);
     end = gethrtime();
-    LOG(EXTENSION_LOG_DEBUG, "Populated log in %s with(l: %ld, s: %ld, e: %ld)",
-        hrtime2text(end - st).c_str(), cookie.loaded, cookie.skipped,
-        cookie.error);
-    return cookie.loaded;
+    LOG(EXTENSION_LOG_DEBUG, "Populated log in %s with %ld items",
+        hrtime2text(end - st).c_str(), loaded);
+    return loaded;
 }
 
 bool Warmup::loadingKVPairs(Dispatcher&, TaskId &)
 {
-    shared_ptr<Callback<GetValue> > cb(createLKVPCB(initialVbState, false,
-                                                    state.getState()));
-    store->getAuxUnderlying()->dump(cb);
+    loadShards(false, false);
     transition(WarmupState::Done);
     return true;
 }
@@ -570,13 +657,270 @@ bool Warmup::loadingData(Dispatcher&, TaskId &)
     size_t estimatedCount = store->getEPEngine().getEpStats().warmedUpKeys;
     setEstimatedWarmupCount(estimatedCount);
 
-    shared_ptr<Callback<GetValue> > cb(createLKVPCB(initialVbState, true,
-                                       state.getState()));
-    store->getAuxUnderlying()->dump(cb);
+    loadShards(false, true);
     transition(WarmupState::Done);
     return true;
 }
 
+/**
+ * The load of one shard's vbuckets from the shard's aux store, either
+ * all of their items or those of an access log.
+ */
+class ShardLoad {
+public:
+    ShardLoad(EventuallyPersistentEngine &e, KVStore *s, bool k,
+              MutationLogHarvester *h, const std::string &lp,
+              Atomic<size_t> &le) :
+        engine(e), store(s), keysOnly(k), harvester(h), logPath(lp),
+        logEntries(le), started(false), time(0), loaded(0), logLoaded(false),
+        corruptLog(false)
+    { /* EMPTY */ }
+
+    void run() {
+        ObjectRegistry::onSwitchThread(&engine);
+        hrtime_t start = gethrtime();
+        if (!logPath.empty()) {
+            // The log before the current one stands in for it if it
+            // can't be trusted.
+            logLoaded = loadAccessLog(logPath) ||
+                loadAccessLog(logPath + ".old");
+        } else if (harvester) {
+            apply(*harvester);
+        } else if (keysOnly) {
+            std::vector<uint16_t> keyVBuckets;
+            if (snapshotCb) {
+                loadSnapshots(keyVBuckets);
+            } else {
+                keyVBuckets = vbids;
+            }
+            if (!keyVBuckets.empty()) {
+                store->dumpKeys(keyVBuckets, cb);
+            }
+        } else {
+            store->dump(vbids, cb);
+        }
+        time = gethrtime() - start;
+    }
+
+    /**
+     * Read the shard's access log at a path, and load its items.
+     *
+     * @return false if there's no log there or it can't be trusted
+     */
+    bool loadAccessLog(const std::string &path) {
+        MutationLog log(path, engine.getConfiguration().getAlogBlockSize());
+        if (!log.exists()) {
+            return false;
+        }
+        try {
+            log.open();
+            MutationLogHarvester h(log, &engine);
+            std::map<uint16_t, vbucket_state>::iterator it;
+            for (it = vbStates.begin(); it != vbStates.end(); ++it) {
+                h.setVBucket(it->first);
+            }
+            if (!h.load()) {
+                return false;
+            }
+            logEntries.incr(h.total());
+            apply(h);
+        } catch (MutationLog::ReadException &e) {
+            LOG(EXTENSION_LOG_WARNING, "Failed to read access log %s: %s",
+                path.c_str(), e.what());
+            corruptLog = true;
+            return false;
+        }
+        return true;
+    }
+
+    //! Load the items of the shard's vbuckets in an access log
+    void apply(MutationLogHarvester &h) {
+        WarmupCookie cookie(engine.getEpStore(), *cb);
+        if (engine.getEpStore()->multiBGFetchEnabled()) {
+            h.apply(&cookie, &batchWarmupCallback, vbids);
+        } else {
+            h.apply(&cookie, &warmupCallback, vbids);
+        }
+        LOG(EXTENSION_LOG_DEBUG, "Populated log of a shard with "
+            "(l: %ld, s: %ld, e: %ld)", cookie.loaded, cookie.skipped,
+            cookie.error);
+        loaded += cookie.loaded;
+    }
+
+    /**
+     * Load the vbuckets that have a snapshot of the header their file is
+     * at from it, leaving the rest to have their keys loaded.
+     */
+    void loadSnapshots(std::vector<uint16_t> &rest) {
+        std::string dir = MemorySnapshot::getDir(engine.getConfiguration());
+        std::vector<uint16_t>::iterator it;
+        for (it = vbids.begin(); it != vbids.end(); ++it) {
+            std::string path = MemorySnapshot::getPath(dir, *it);
+            vbucket_file_info info;
+            if (store->getDbFileInfo(*it, info) &&
+                MemorySnapshot::load(path, *it, info, *snapshotCb)) {
+                snapshotted.push_back(*it);
+            } else {
+                rest.push_back(*it);
+            }
+            // It's stale as soon as anything is persisted to the vbucket.
+            remove(path.c_str());
+        }
+    }
+
+    EventuallyPersistentEngine &engine;
+    KVStore *store;
+    bool keysOnly;
+    //! The access log to load the items of, NULL to load them all
+    MutationLogHarvester *harvester;
+    //! The path of the shard's own access log to load, if it has one
+    std::string logPath;
+    //! The entries found in the access logs of all of the shards
+    Atomic<size_t> &logEntries;
+    //! The states of all of the shard's vbuckets
+    std::map<uint16_t, vbucket_state> vbStates;
+    //! The vbuckets to load, in the order to load them
+    std::vector<uint16_t> vbids;
+    shared_ptr<Callback<GetValue> > cb;
+    //! Loads the items of the memory snapshots, NULL if they're not used
+    shared_ptr<Callback<GetValue> > snapshotCb;
+    //! The vbuckets loaded from their memory snapshots
+    std::vector<uint16_t> snapshotted;
+    pthread_t thread;
+    bool started;
+    hrtime_t time;
+    //! The items loaded from the access log
+    size_t loaded;
+    //! Whether the shard's own access log, or the one before it, was read
+    bool logLoaded;
+    //! Whether a log of the shard couldn't be read
+    bool corruptLog;
+};
+
+extern "C" {
+    static void* launch_shard_load(void *arg) {
+        static_cast<ShardLoad*>(arg)->run();
+        return NULL;
+    }
+}
+
+size_t Warmup::loadShards(bool keysOnly, bool maybeEnable,
+                          MutationLogHarvester *harvester, bool shardLogs)
+{
+    const VBucketMap &vbMap = store->getVBuckets();
+    std::vector<ShardLoad*> loads;
+    for (size_t i = 0; i < vbMap.getNumShards(); ++i) {
+        KVShard *shard = vbMap.getShard(static_cast<uint16_t>(i));
+        std::string logPath;
+        if (shardLogs) {
+            logPath = store->getAccessLogPath(shard->getId());
+        }
+        loads.push_back(new ShardLoad(store->getEPEngine(),
+                                      shard->getAuxUnderlying(), keysOnly,
+                                      harvester, logPath,
+                                      estimatedWarmupCount));
+    }
+    bool fromLog = harvester != NULL || shardLogs;
+
+    // Each shard loads its active vbuckets first, then its replicas;
+    // the others are only loaded from an access log.
+    std::map<uint16_t, vbucket_state>::const_iterator it;
+    for (it = initialVbState.begin(); it != initialVbState.end(); ++it) {
+        ShardLoad *load = loads[vbMap.getShard(it->first)->getId()];
+        load->vbStates.insert(*it);
+        if (snapshotVBuckets.count(it->first)) {
+            // All of its items are in memory already.
+            continue;
+        }
+        if (it->second.state == vbucket_state_active) {
+            load->vbids.push_back(it->first);
+        }
+    }
+    for (it = initialVbState.begin(); it != initialVbState.end(); ++it) {
+        if (snapshotVBuckets.count(it->first)) {
+            continue;
+        }
+        if (it->second.state == vbucket_state_replica ||
+            (fromLog && it->second.state != vbucket_state_active)) {
+            loads[vbMap.getShard(it->first)->getId()]->vbids.push_back(it->first);
+        }
+    }
+
+    // Set up all of the vbuckets before any of them is loaded into.
+    // The snapshots hold the values as well as the keys.
+    bool snapshots = keysOnly &&
+        store->getEPEngine().getConfiguration().isWarmupSnapshot();
+    // The access log's items are loaded across all of its vbuckets at once.
+    bool inOrder = !fromLog;
+    for (size_t i = 0; i < loads.size(); ++i) {
+        ShardLoad *load = loads[i];
+        LoadStorageKVPairCallback *cb = createLKVPCB(load->vbStates,
+                                                     maybeEnable,
+                                                     state.getState());
+        cb->setProgress(&shardProgress[i], &vbProgress, inOrder);
+        load->cb.reset(cb);
+        if (snapshots) {
+            cb = new LoadStorageKVPairCallback(store, maybeEnable,
+                                               WarmupState::LoadingKVPairs);
+            cb->setProgress(&shardProgress[i], &vbProgress, inOrder);
+            load->snapshotCb.reset(cb);
+        }
+        std::vector<uint16_t>::iterator vit;
+        for (vit = load->vbids.begin(); vit != load->vbids.end(); ++vit) {
+            vbProgress[*vit] = WARMUP_VB_PENDING;
+        }
+    }
+
+    for (size_t i = 0; i < loads.size(); ++i) {
+        ShardLoad *load = loads[i];
+        if (load->vbids.empty()) {
+            continue;
+        }
+        shardProgress[i].start = gethrtime();
+        if (pthread_create(&load->thread, NULL, launch_shard_load,
+                           load) == 0) {
+            load->started = true;
+        } else {
+            LOG(EXTENSION_LOG_WARNING, "Failed to start the warmup thread "
+                "of shard %d, loading it on this one", (int)i);
+            load->run();
+        }
+    }
+
+    size_t loaded = 0;
+    bool logLoaded = false;
+    for (size_t i = 0; i < loads.size(); ++i) {
+        ShardLoad *load = loads[i];
+        if (load->started) {
+            pthread_join(load->thread, NULL);
+        }
+        shardProgress[i].time.incr(load->time);
+        shardProgress[i].start = 0;
+        std::vector<uint16_t>::iterator vit;
+        for (vit = load->vbids.begin(); vit != load->vbids.end(); ++vit) {
+            vbProgress[*vit] = WARMUP_VB_LOADED;
+        }
+        loaded += load->loaded;
+        logLoaded = logLoaded || load->logLoaded;
+        if (load->corruptLog) {
+            corruptAccessLog = true;
+        }
+        snapshotVBuckets.insert(load->snapshotted.begin(),
+                                load->snapshotted.end());
+        delete load;
+    }
+    if (shardLogs && !logLoaded) {
+        return -1;
+    }
+    return loaded;
+}
+
+bool Warmup::isKeyDumpSupported()
+{
+    return store->getVBuckets().getShard(EP_PRIMARY_SHARD)->
+        getAuxUnderlying()->isKeyDumpSupported();
+}
+
 bool Warmup::done(Dispatcher&, TaskId &)
 {
     warmup = gethrtime() - startTime;
@@ -619,9 +963,32 @@ bool Warmup::step(Dispatcher &d, TaskId &t) {
     }
 }
 
+void Warmup::loadedTotals(size_t &items, size_t &bytes) const {
+    items = bytes = 0;
+    std::vector<WarmupShardProgress>::const_iterator it;
+    for (it = shardProgress.begin(); it != shardProgress.end(); ++it) {
+        items += it->items.get();
+        bytes += it->bytes.get();
+    }
+}
+
 void Warmup::transition(int to, bool force) {
     int old = state.getState();
     if (old != WarmupState::Done) {
+        hrtime_t now = gethrtime();
+        if (phaseStart != 0) {
+            phaseTimes[old] += now - phaseStart;
+        }
+        phaseStart = now;
+        EPStats &stats = store->getEPEngine().getEpStats();
+        phaseKeys = stats.warmedUpKeys;
+        phaseValues = stats.warmedUpValues;
+        size_t items, bytes;
+        loadedTotals(items, bytes);
+        phaseItems[old] += items - phaseStartItems;
+        phaseBytes[old] += bytes - phaseStartBytes;
+        phaseStartItems = items;
+        phaseStartBytes = bytes;
         state.transition(to, force);
         fireStateChange(old, to);
     }
@@ -662,6 +1029,28 @@ void Warmup::addStat(const char *nm, T val, ADD_STAT add_stat,
     add_casted_stat(name.data(), value.str().data(), add_stat, c);
 }
 
+//! The name a state's time is reported under in the warmup stats
+static const char *phaseStatName(int st) {
+    switch (st) {
+    case WarmupState::Initialize:
+        return "initialize";
+    case WarmupState::EstimateDatabaseItemCount:
+        return "estimate";
+    case WarmupState::KeyDump:
+        return "key_dump";
+    case WarmupState::CheckForAccessLog:
+        return "check_access_log";
+    case WarmupState::LoadingAccessLog:
+        return "access_log";
+    case WarmupState::LoadingKVPairs:
+        return "kv_pairs";
+    case WarmupState::LoadingData:
+        return "data";
+    default:
+        return NULL;
+    }
+}
+
 void Warmup::addStats(ADD_STAT add_stat, const void *c) const
 {
     if (store->getEPEngine().getConfiguration().isWarmup()) {
@@ -674,6 +1063,9 @@ void Warmup::addStats(ADD_STAT add_stat, const void *c) const
         } else {
             addStat("thread", "running", add_stat, c);
         }
+        addStat("early_traffic",
+                stats.warmupTraffic ? "true" : "false", add_stat, c);
+        addStat("snapshot_vbuckets", snapshotVBuckets.size(), add_stat, c);
         addStat("key_count", stats.warmedUpKeys, add_stat, c);
         addStat("value_count", stats.warmedUpValues, add_stat, c);
         addStat("dups", stats.warmDups, add_stat, c);
@@ -692,6 +1084,97 @@ void Warmup::addStats(ADD_STAT add_stat, const void *c) const
             addStat("time", warmup / 1000, add_stat, c);
         }
 
+        hrtime_t now = gethrtime();
+        int current = state.getState();
+        size_t loadedItems, loadedBytes;
+        loadedTotals(loadedItems, loadedBytes);
+        for (int st = 0; st < WarmupState::Done; ++st) {
+            hrtime_t t = phaseTimes[st];
+            size_t items = phaseItems[st];
+            size_t bytes = phaseBytes[st];
+            if (st == current && phaseStart != 0) {
+                t += now - phaseStart;
+                items += loadedItems - phaseStartItems;
+                bytes += loadedBytes - phaseStartBytes;
+            }
+            const char *phase = phaseStatName(st);
+            if (phase == NULL || t == 0) {
+                continue;
+            }
+            std::string p = std::string("phase_") + phase + "_";
+            addStat((p + "time").c_str(), t / 1000, add_stat, c);
+            if (items > 0) {
+                addStat((p + "items").c_str(), items, add_stat, c);
+                addStat((p + "bytes").c_str(), bytes, add_stat, c);
+                addStat((p + "item_rate").c_str(),
+                        (uint64_t)(items * 1e9 / t), add_stat, c);
+                addStat((p + "byte_rate").c_str(),
+                        (uint64_t)(bytes * 1e9 / t), add_stat, c);
+            }
+        }
+
+        for (size_t i = 0; i < shardProgress.size(); ++i) {
+            const WarmupShardProgress &shard = shardProgress[i];
+            hrtime_t t = shard.time;
+            hrtime_t start = shard.start;
+            if (start != 0 && now > start) {
+                t += now - start;
+            }
+            if (t == 0) {
+                continue;
+            }
+            std::stringstream prefix;
+            prefix << "shard_" << i << "_";
+            const std::string p(prefix.str());
+            addStat((p + "time").c_str(), t / 1000, add_stat, c);
+            addStat((p + "items").c_str(), shard.items.get(), add_stat, c);
+            addStat((p + "bytes").c_str(), shard.bytes.get(), add_stat, c);
+            addStat((p + "item_rate").c_str(),
+                    (uint64_t)(shard.items.get() * 1e9 / t), add_stat, c);
+            addStat((p + "byte_rate").c_str(),
+                    (uint64_t)(shard.bytes.get() * 1e9 / t), add_stat, c);
+        }
+
+        std::map<uint16_t, vbucket_state>::const_iterator vit;
+        for (vit = initialVbState.begin(); vit != initialVbState.end(); ++vit) {
+            const char *status = "pending";
+            if (stats.warmupComplete) {
+                status = "loaded";
+            } else if (vbProgress[vit->first] == WARMUP_VB_LOADING) {
+                status = "loading";
+            } else if (vbProgress[vit->first] == WARMUP_VB_LOADED) {
+                status = "loaded";
+            }
+            std::stringstream name;
+            name << "vb_" << vit->first;
+            addStat(name.str().c_str(), status, add_stat, c);
+        }
+
+        // How long the current phase has left, at the rate it's going.
+        size_t estimate = std::numeric_limits<size_t>::max();
+        size_t base = 0, count = 0;
+        if (current == WarmupState::KeyDump) {
+            estimate = estimatedItemCount;
+            base = phaseKeys;
+            count = stats.warmedUpKeys;
+        } else if (current == WarmupState::LoadingKVPairs) {
+            estimate = estimatedItemCount;
+            base = phaseValues;
+            count = stats.warmedUpValues;
+        } else if (current == WarmupState::LoadingAccessLog ||
+                   current == WarmupState::LoadingData) {
+            estimate = estimatedWarmupCount.get();
+            base = phaseValues;
+            count = stats.warmedUpValues;
+        }
+        if (!stats.warmupComplete && phaseStart != 0 &&
+            estimate != std::numeric_limits<size_t>::max() &&
+            count > base && estimate > count) {
+            double perItem = (double)(now - phaseStart) / (count - base);
+            addStat("eta", (uint64_t)(perItem * (estimate - count) / 1000),
+                    add_stat, c);
+        }
+
         if (estimatedItemCount == std::numeric_limits<size_t>::max()) {
             addStat("estimated_key_count", "unknown", add_stat, c);
         } else {
@@ -705,10 +1188,11 @@ void Warmup::addStats(ADD_STAT add_stat, const void *c) const
             addStat("access_log", "corrupt", add_stat, c);
         }
 
-        if (estimatedWarmupCount ==  std::numeric_limits<size_t>::max()) {
+        if (estimatedWarmupCount.get() == std::numeric_limits<size_t>::max()) {
             addStat("estimated_value_count", "unknown", add_stat, c);
         } else {
-            addStat("estimated_value_count", estimatedWarmupCount, add_stat, c);
+            addStat("estimated_value_count", estimatedWarmupCount.get(),
+                    add_stat, c);
         }
    } else {
         addStat(NULL, "disabled", add_stat, c);
@@ -720,12 +1204,18 @@ LoadStorageKVPairCallback *Warmup::createLKVPCB(const std::map<uint16_t, vbucket
 {
     LoadStorageKVPairCallback *load_cb;
     load_cb = new LoadStorageKVPairCallback(store, maybeEnable, warmupState);
+    // The keys hash evenly over the vbuckets.
+    size_t keys = 0;
+    if (estimatedItemCount != std::numeric_limits<size_t>::max() &&
+        !initialVbState.empty()) {
+        keys = estimatedItemCount / initialVbState.size();
+    }
     std::map<uint16_t, vbucket_state>::const_iterator it;
     for (it = st.begin(); it != st.end(); ++it) {
         uint16_t vbid = it->first;
         vbucket_state vbs = it->second;
         vbs.checkpointId++;
-        load_cb->initVBucket(vbid, vbs);
+        load_cb->initVBucket(vbid, vbs, keys);
     }
 
     return load_cb;
@@ -22,7 +22,9 @@
 #include <list>
 #include <map>
 #include <ostream>
+#include <set>
 #include <string>
+#include <vector>
 
 #include "ep_engine.h"
 
@@ -60,6 +62,32 @@ public:
 };
 
 
+/**
+ * How far a shard has got loading its vbuckets, updated by its loads and
+ * read by the warmup stats while they run.
+ */
+struct WarmupShardProgress {
+    WarmupShardProgress() : items(0), bytes(0), time(0), start(0) { }
+
+    //! The items passed to the shard's loads
+    Atomic<size_t> items;
+    //! The bytes of those items' keys and values
+    Atomic<size_t> bytes;
+    //! The time spent by the shard's finished loads
+    Atomic<hrtime_t> time;
+    //! When the shard's running load started, 0 if there isn't one
+    Atomic<hrtime_t> start;
+};
+
+//! Where each vbucket's load of the current warmup phase is
+enum warmup_vb_status_t {
+    WARMUP_VB_PENDING = 0,
+    WARMUP_VB_LOADING,
+    WARMUP_VB_LOADED
+};
+
+typedef std::vector<Atomic<int> > warmup_vb_progress_t;
+
 //////////////////////////////////////////////////////////////////////////////
 //                                                                          //
 //    Helper class used to insert data into the epstore                     //
@@ -77,13 +105,34 @@ public:
         : vbuckets(ep->vbMap), stats(ep->getEPEngine().getEpStats()),
           epstore(ep), startTime(ep_real_time()),
           hasPurged(false), maybeEnableTraffic(_maybeEnableTraffic),
-          warmupState(_warmupState)
+          warmupState(_warmupState), progress(NULL), vbProgress(NULL),
+          vbsInOrder(false), lastVBucket(-1)
     {
         assert(epstore);
     }
 
+    /**
+     * Count the items loaded to a shard's progress, and mark the vbuckets
+     * they're of as loading.
+     *
+     * @param inOrder true if the vbuckets are loaded one after the other,
+     *                so each is loaded once the next one's items start
+     */
+    void setProgress(WarmupShardProgress *shard, warmup_vb_progress_t *vbs,
+                     bool inOrder) {
+        progress = shard;
+        vbProgress = vbs;
+        vbsInOrder = inOrder;
+    }
+
+    /**
+     * Set up a vbucket to be loaded into.
+     *
+     * @param keys the keys it's expected to load, which its hash table is
+     *             sized for up front, or 0 if that isn't known
+     */
     void initVBucket(uint16_t vbid,
-                     const vbucket_state &vbstate);
+                     const vbucket_state &vbstate, size_t keys = 0);
 
     void callback(GetValue &val);
     bool isLoaded(const char* buf, size_t size, uint16_t vbid);
@@ -103,6 +152,10 @@ private:
     bool        hasPurged;
     bool        maybeEnableTraffic;
     int         warmupState;
+    WarmupShardProgress  *progress;
+    warmup_vb_progress_t *vbProgress;
+    bool        vbsInOrder;
+    int         lastVBucket;
 };
 
 
@@ -127,8 +180,14 @@ public:
 
     hrtime_t getTime(void) { return warmup; }
 
+    /**
+     * Load the items of an access log, each shard's from its own aux store
+     * at the same time.
+     *
+     * @return the number of items loaded, or -1 if the log is corrupt
+     */
     size_t doWarmup(MutationLog &lf, const std::map<uint16_t,
-                    vbucket_state> &vbmap, Callback<GetValue> &cb);
+                    vbucket_state> &vbmap);
 
 private:
     template <typename T>
@@ -146,6 +205,29 @@ private:
     bool done(Dispatcher&, TaskId &);
 
     void transition(int to, bool force=false);
+    //! The items and bytes all of the shards have loaded so far
+    void loadedTotals(size_t &items, size_t &bytes) const;
+
+    /**
+     * Load the vbuckets of every shard from the shard's own aux store,
+     * the shards at the same time on threads of their own.  With a
+     * harvester only the items of its access log are loaded, and with
+     * shardLogs only those of each shard's own access log, which the
+     * shard reads on its thread.
+     *
+     * @return the number of items loaded from the access logs, or -1 if
+     *         none of the shards' logs could be read
+     */
+    size_t loadShards(bool keysOnly, bool maybeEnable,
+                      MutationLogHarvester *harvester = NULL,
+                      bool shardLogs = false);
+
+    //! Whether any shard has an access log of its own
+    bool hasShardAccessLogs();
+    //! Whether there's the single access log earlier versions wrote
+    bool hasUnshardedAccessLog();
+
+    bool isKeyDumpSupported();
 
 
     LoadStorageKVPairCallback *createLKVPCB(const std::map<uint16_t, vbucket_state> &st,
@@ -164,7 +246,25 @@ private:
     hrtime_t estimateTime;
     size_t estimatedItemCount;
     bool corruptAccessLog;
-    size_t estimatedWarmupCount;
+    Atomic<size_t> estimatedWarmupCount;
+    //! How far each shard has got loading its vbuckets
+    std::vector<WarmupShardProgress> shardProgress;
+    //! The warmup_vb_status_t of each vbucket in the current phase
+    warmup_vb_progress_t vbProgress;
+    //! The time spent in each state, and when the current one began
+    std::vector<hrtime_t> phaseTimes;
+    hrtime_t phaseStart;
+    //! The keys and values warmed up when the current state began
+    size_t phaseKeys;
+    size_t phaseValues;
+    //! The items and bytes the shards loaded in each state, and by when
+    //! the current one began
+    std::vector<size_t> phaseItems;
+    std::vector<size_t> phaseBytes;
+    size_t phaseStartItems;
+    size_t phaseStartBytes;
+    //! The vbuckets loaded whole from their memory snapshots
+    std::set<uint16_t> snapshotVBuckets;
 
     struct {
         Mutex mutex;
@@ -24,6 +24,8 @@ workload_pattern_t WorkLoadPolicy::calculatePattern(const std::string &p) {
         return MIX;
     } else if (p.compare("write") == 0) {
         return WRITE_HEAVY;
+    } else if (p.compare("auto") == 0) {
+        return AUTO;
     } else {
         return READ_HEAVY;
     }
@@ -38,6 +40,10 @@ size_t WorkLoadPolicy::calculateNumReaders() {
         case WRITE_HEAVY:
             readers = maxNumWorkers - getNumShards();
             break;
+        case AUTO:
+            // One per shard; how many of them are active varies.
+            readers = getNumShards();
+            break;
         default: // READ_HEAVY
             readers = getNumShards();
     }
@@ -53,6 +59,9 @@ size_t WorkLoadPolicy::calculateNumWriters() {
         case READ_HEAVY:
             writers = maxNumWorkers - getNumShards();
             break;
+        case AUTO:
+            writers = getNumShards();
+            break;
         default: // WRITE_HEAVY
             writers = getNumShards();
     }
@@ -69,3 +78,56 @@ size_t WorkLoadPolicy::getNumShards(void) {
         return ((maxNumWorkers * workload_high_priority) + 0.5);
     }
 }
+
+void WorkLoadPolicy::clampActiveReaders() {
+    // Each group keeps at least one thread, and no more than it has.
+    size_t shards = getNumShards();
+    size_t maxWorkers = static_cast<size_t>(maxNumWorkers);
+    size_t low = maxWorkers > shards ? maxWorkers - shards : 1;
+    size_t readers = activeReaders.get();
+    if (readers < low) {
+        readers = low;
+    }
+    if (readers > shards) {
+        readers = shards;
+    }
+    activeReaders.set(readers);
+}
+
+bool WorkLoadPolicy::adapt(double readerUtil, size_t bgBacklog,
+                           double writerUtil, size_t flushBacklog) {
+    if (pattern != AUTO) {
+        return false;
+    }
+
+    // The gap between the busy and idle marks keeps a load sitting near
+    // one of them from moving threads back and forth.
+    int vote = 0;
+    if (readerUtil >= workload_auto_busy && bgBacklog > 0 &&
+        writerUtil <= workload_auto_idle) {
+        vote = 1;
+    } else if (writerUtil >= workload_auto_busy && flushBacklog > 0 &&
+               readerUtil <= workload_auto_idle) {
+        vote = -1;
+    }
+
+    if (vote == 0 || vote != lastVote) {
+        lastVote = vote;
+        votes = vote == 0 ? 0 : 1;
+    } else {
+        ++votes;
+    }
+    if (vote == 0 || votes < workload_auto_samples) {
+        return false;
+    }
+    votes = 0;
+
+    size_t before = activeReaders.get();
+    if (vote > 0) {
+        activeReaders.set(before + 1);
+    } else if (before > 0) {
+        activeReaders.set(before - 1);
+    }
+    clampActiveReaders();
+    return activeReaders.get() != before;
+}
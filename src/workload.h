@@ -19,25 +19,43 @@
 #define SRC_WORKLOAD_H_ 1
 
 #include "config.h"
+#include <algorithm>
 #include <string>
+#include "atomic.h"
 #include "common.h"
 
 typedef enum {
     READ_HEAVY,
     WRITE_HEAVY,
-    MIX
+    MIX,
+    AUTO
 } workload_pattern_t;
 
 const double workload_high_priority=0.6;
 const double workload_low_priority=0.4;
 
+//! Utilisation past which a group of threads asks for another thread
+const double workload_auto_busy=0.75;
+//! Utilisation under which a group of threads may give one up
+const double workload_auto_idle=0.5;
+//! Samples in a row that must agree before a thread changes groups
+const int workload_auto_samples=3;
+
 /**
  * Workload optimization policy
  */
 class WorkLoadPolicy {
 public:
-    WorkLoadPolicy(int m, const std::string p)
-        : pattern(calculatePattern(p)), maxNumWorkers(m) { }
+    WorkLoadPolicy(int m, const std::string p, int aux = 0, int nonio = 0)
+        : pattern(calculatePattern(p)), maxNumWorkers(m), numAuxIO(aux),
+          numNonIO(nonio), activeReaders(0), lastVote(0), votes(0) {
+        activeReaders.set(calculateNumReaders());
+        if (pattern == AUTO) {
+            // Start out evenly split, as for a mixed workload.
+            activeReaders.set(maxNumWorkers - maxNumWorkers / 2);
+            clampActiveReaders();
+        }
+    }
 
     /**
      * Caculate workload pattern based on configuraton
@@ -57,6 +75,70 @@ public:
      */
     size_t calculateNumWriters();
 
+    /**
+     * Number of threads running background maintenance IO (stat
+     * snapshots); their tasks run on the writers if there are none.
+     */
+    size_t calculateNumAuxIO() {
+        return numAuxIO;
+    }
+
+    /**
+     * Number of threads running tasks that don't do disk IO (applying
+     * incoming TAP mutations); their tasks run on the readers if there
+     * are none.  Those tasks come one per shard, so there's at least a
+     * thread for each shard or they'd take turns on fewer.
+     */
+    size_t calculateNumNonIO() {
+        if (numNonIO == 0) {
+            return 0;
+        }
+        return std::max(static_cast<size_t>(numNonIO), getNumShards());
+    }
+
+    /**
+     * True if the readers and writers are resized to the workload as it
+     * goes, in which case there are getNumShards() threads of each and
+     * only some of them are active at a time.
+     */
+    bool isAuto() const {
+        return pattern == AUTO;
+    }
+
+    /**
+     * Number of reader threads running tasks; the others leave their
+     * tasks to be stolen by these.
+     */
+    size_t getActiveReaders() {
+        return activeReaders.get();
+    }
+
+    /**
+     * Number of writer threads running tasks.
+     */
+    size_t getActiveWriters() {
+        if (pattern != AUTO) {
+            return calculateNumWriters();
+        }
+        size_t readers = activeReaders.get();
+        size_t maxWorkers = static_cast<size_t>(maxNumWorkers);
+        return readers < maxWorkers ? maxWorkers - readers : 1;
+    }
+
+    /**
+     * Take a sample of the load of the readers and writers in auto mode,
+     * moving a thread from one group to the other once enough samples in
+     * a row have found one group busy with a backlog while the other idles.
+     *
+     * @param readerUtil share of the active readers' time spent on tasks
+     * @param bgBacklog number of bg fetches waiting
+     * @param writerUtil share of the active writers' time spent on tasks
+     * @param flushBacklog number of items waiting to be persisted
+     * @return true if the number of active readers changed
+     */
+    bool adapt(double readerUtil, size_t bgBacklog,
+               double writerUtil, size_t flushBacklog);
+
     /**
      * reset workload pattern
      */
@@ -86,6 +168,8 @@ public:
             return "Optimized for read data access";
         case WRITE_HEAVY:
             return "Optimized for write data access";
+        case AUTO:
+            return "Adapting to the data access";
         default:
             return "Undefined workload pattern";
         }
@@ -93,8 +177,18 @@ public:
 
 private:
 
+    //! Keep the active readers and writers within the threads of each
+    void clampActiveReaders();
+
     workload_pattern_t pattern;
     int maxNumWorkers;
+    int numAuxIO;
+    int numNonIO;
+    Atomic<size_t> activeReaders;
+    //! Direction the last sample asked to move a thread in (1 to readers)
+    int lastVote;
+    //! Number of samples in a row that asked for it
+    int votes;
 };
 
 #endif  // SRC_WORKLOAD_H_
@@ -0,0 +1,57 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "ep_engine.h"
+#include "iomanager/iomanager.h"
+#include "workload.h"
+#include "workload_monitor.h"
+
+bool WorkLoadMonitor::callback(Dispatcher &d, TaskId &t) {
+    IOManager *iom = IOManager::get();
+    hrtime_t now = gethrtime();
+    hrtime_t readerBusy = iom->getBusyTime(&engine, READER_TASK_IDX);
+    hrtime_t writerBusy = iom->getBusyTime(&engine, WRITER_TASK_IDX);
+
+    if (lastSample != 0 && now > lastSample) {
+        WorkLoadPolicy &workload = engine.getWorkLoadPolicy();
+        double elapsed = static_cast<double>(now - lastSample) / 1000;
+        double readerUtil = (readerBusy - lastReaderBusy) /
+            (elapsed * workload.getActiveReaders());
+        double writerUtil = (writerBusy - lastWriterBusy) /
+            (elapsed * workload.getActiveWriters());
+
+        EPStats &stats = engine.getEpStats();
+        if (workload.adapt(readerUtil, stats.numRemainingBgJobs.get(),
+                           writerUtil, stats.diskQueueSize.get())) {
+            LOG(EXTENSION_LOG_INFO, "Workload shifted; running %d readers "
+                "and %d writers", (int)workload.getActiveReaders(),
+                (int)workload.getActiveWriters());
+            iom->setActiveThreads(&engine, READER_TASK_IDX,
+                                  workload.getActiveReaders());
+            iom->setActiveThreads(&engine, WRITER_TASK_IDX,
+                                  workload.getActiveWriters());
+        }
+    }
+
+    lastSample = now;
+    lastReaderBusy = readerBusy;
+    lastWriterBusy = writerBusy;
+    d.snooze(t, interval);
+    return true;
+}
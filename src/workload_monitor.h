@@ -0,0 +1,54 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_WORKLOAD_MONITOR_H_
+#define SRC_WORKLOAD_MONITOR_H_ 1
+
+#include "config.h"
+
+#include <string>
+
+#include "dispatcher.h"
+
+class EventuallyPersistentEngine;
+
+/**
+ * Samples the load of a bucket's readers and writers when its workload
+ * policy is auto, and moves threads between the two as the workload shifts.
+ */
+class WorkLoadMonitor : public DispatcherCallback {
+public:
+
+    WorkLoadMonitor(EventuallyPersistentEngine &e, double i)
+        : engine(e), interval(i), lastSample(0), lastReaderBusy(0),
+          lastWriterBusy(0) {}
+
+    bool callback(Dispatcher &d, TaskId &t);
+
+    std::string description() {
+        return std::string("Adapting the IO threads to the workload");
+    }
+
+private:
+    EventuallyPersistentEngine &engine;
+    double interval;
+    hrtime_t lastSample;
+    hrtime_t lastReaderBusy;
+    hrtime_t lastWriterBusy;
+};
+
+#endif  // SRC_WORKLOAD_MONITOR_H_
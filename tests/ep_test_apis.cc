@@ -416,7 +416,8 @@ bool get_meta(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char* key) {
 }
 
 void observe(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
-             std::map<std::string, uint16_t> obskeys) {
+             std::map<std::string, uint16_t> obskeys,
+             bool waitForPersistence) {
     std::stringstream value;
     std::map<std::string, uint16_t>::iterator it;
     for (it = obskeys.begin(); it != obskeys.end(); ++it) {
@@ -428,7 +429,10 @@ void observe(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
     }
 
     protocol_binary_request_header *request;
-    request = createPacket(CMD_OBSERVE, 0, 0, NULL, 0, NULL, 0,
+    char ext = OBS_WAIT_PERSISTED;
+    request = createPacket(CMD_OBSERVE, 0, 0,
+                           waitForPersistence ? &ext : NULL,
+                           waitForPersistence ? 1 : 0, NULL, 0,
                            value.str().data(), value.str().length());
     check(h1->unknown_command(h, NULL, request, add_response) == ENGINE_SUCCESS,
           "Observe call failed");
@@ -787,7 +791,8 @@ bool wait_for_warmup_complete(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     while (h1->get_stats(h, NULL, "warmup", 6, add_stats) == ENGINE_SUCCESS) {
         useconds_t sleepTime = 128;
         std::string s = vals["ep_warmup_thread"];
-        if (strcmp(s.c_str(), "complete") == 0) {
+        if (strcmp(s.c_str(), "complete") == 0 ||
+            vals["ep_warmup"] == "disabled") {
             break;
         }
         decayingSleep(&sleepTime);
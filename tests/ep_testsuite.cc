@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 
 #include <cstdlib>
@@ -411,6 +412,77 @@ static enum test_result test_unl(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+struct getl_wait_data {
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *h1;
+    uint64_t cas;
+};
+
+extern "C" {
+    static void* getl_cas_update_thread(void *arg) {
+        getl_wait_data *wd = static_cast<getl_wait_data*>(arg);
+
+        // Update the key once the other getl is parked on its lock.
+        wait_for_stat_to_be(wd->h, wd->h1, "ep_getl_waiters", 1);
+        item *i = NULL;
+        check(storeCasVb11(wd->h, wd->h1, NULL, OPERATION_SET, "k1",
+                           "newdata", 7, 0, &i, wd->cas, 0) == ENGINE_SUCCESS,
+              "Failed to update the locked key with its cas");
+        wd->h1->release(wd->h, NULL, i);
+        return NULL;
+    }
+}
+
+static enum test_result test_getl_wait(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "k1", "lockdata", &i)
+          == ENGINE_SUCCESS, "Failed to store an item.");
+    h1->release(h, NULL, i);
+
+    getl(h, h1, "k1", 0, 15);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected to be able to getl on first try");
+
+    // Blocks until the update with the lock's cas releases it.
+    getl_wait_data wd = { h, h1, last_cas };
+    pthread_t tid;
+    check(pthread_create(&tid, NULL, getl_cas_update_thread, &wd) == 0,
+          "Failed to create a thread");
+    getl(h, h1, "k1", 0, 15);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the parked getl to get the lock");
+    check(strcmp("newdata", last_body) == 0, "Expected the updated value");
+    assert(pthread_join(tid, NULL) == 0);
+    check(get_int_stat(h, h1, "ep_num_getl_waits") == 1,
+          "Expected one getl to have been parked");
+    check(get_int_stat(h, h1, "ep_getl_waiters") == 0,
+          "Expected no getl parked");
+
+    unl(h, h1, "k1", 0, last_cas);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected to succeed unl with correct cas");
+
+    // Blocks until the lock expires.
+    getl(h, h1, "k1", 0, 1);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected to be able to getl");
+    getl(h, h1, "k1", 0, 15);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the getl to get the expired lock");
+    check(get_int_stat(h, h1, "ep_num_getl_waits") == 2,
+          "Expected two getls to have been parked");
+
+    // None are parked once the queue's turned off.
+    set_param(h, h1, engine_param_flush, "getl_max_waiters", "0");
+    getl(h, h1, "k1", 0, 15);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_ETMPFAIL,
+          "Expected to fail getl on a locked key");
+    check(get_int_stat(h, h1, "ep_num_getl_waits") == 2,
+          "Expected no more getls to have been parked");
+
+    return SUCCESS;
+}
+
 static enum test_result test_wrong_vb_mutation(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
                                                ENGINE_STORE_OPERATION op) {
     item *i = NULL;
@@ -967,6 +1039,8 @@ static enum test_result test_flush_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1)
     check(ENGINE_KEY_ENOENT == verify_key(h, h1, "key2"), "Expected missing key");
 
     wait_for_flusher_to_settle(h, h1);
+    // The flushed items are freed in the background.
+    wait_for_stat_to_be(h, h1, "ep_flush_all_mem_pending", 0);
 
     mem_used2 = get_int_stat(h, h1, "mem_used");
     overhead2 = get_int_stat(h, h1, "ep_overhead");
@@ -1374,6 +1448,47 @@ static enum test_result test_restart(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_ephemeral_bucket(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    check(get_str_stat(h, h1, "ep_bucket_type") == "ephemeral",
+          "Expected an ephemeral bucket");
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "k1", "v1", &i) == ENGINE_SUCCESS,
+          "Failed set.");
+    h1->release(h, NULL, i);
+    check(store(h, h1, NULL, OPERATION_SET, "k2", "v2", &i) == ENGINE_SUCCESS,
+          "Failed set.");
+    h1->release(h, NULL, i);
+    check_key_value(h, h1, "k1", "v1", 2);
+
+    // Nothing is queued for a flusher.
+    checkeq(0, get_int_stat(h, h1, "ep_queue_size"), "Expected no disk queue");
+    checkeq(0, get_int_stat(h, h1, "ep_total_enqueued"),
+            "Expected nothing enqueued for persistence");
+
+    // Evicting a key deletes it.
+    protocol_binary_request_header *pkt = createPacket(CMD_EVICT_KEY, 0, 0,
+                                                       NULL, 0, "k1", 2);
+    pkt->request.vbucket = htons(0);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Failed to evict key.");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected success evicting key.");
+    check(strcmp(last_body, "Deleted.") == 0, "Expected the key to be deleted");
+    free(pkt);
+    check(verify_key(h, h1, "k1") == ENGINE_KEY_ENOENT, "Expected missing key");
+    checkeq(0, get_int_stat(h, h1, "ep_num_non_resident"),
+            "Expected every item to be resident");
+
+    // And nothing survives a restart.
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    check(verify_key(h, h1, "k2") == ENGINE_KEY_ENOENT, "Expected missing key");
+    return SUCCESS;
+}
+
 static enum test_result test_restart_session_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     createTapConn(h, h1, "tap_client_thread");
 
@@ -1506,6 +1621,70 @@ static enum test_result test_binKeys(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_group_commit(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    wait_for_warmup_complete(h, h1);
+    int commits = get_int_stat(h, h1, "ep_commit_num");
+
+    // Trickle the items in well within the group commit window.
+    for (int j = 0; j < 10; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "value",
+                    &i) == ENGINE_SUCCESS, "Failed to store an item.");
+        h1->release(h, NULL, i);
+        usleep(10000);
+    }
+    wait_for_stat_change(h, h1, "ep_commit_num", commits);
+    wait_for_flusher_to_settle(h, h1);
+    check(get_int_stat(h, h1, "ep_commit_num") == commits + 1,
+          "Expected the items to be committed together");
+    check(get_int_stat(h, h1, "ep_total_persisted") == 10,
+          "Expected all the items persisted");
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    check_key_value(h, h1, "key9", "value", 5);
+
+    set_param(h, h1, engine_param_flush, "group_commit_window", "10001");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_EINVAL,
+          "Expected the group commit window to be capped");
+    return SUCCESS;
+}
+
+static enum test_result test_vb_flush_stats(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+    // A vbucket with nothing dirty is never flushed.
+    check(get_int_stat(h, h1, "vb_1:flush_duration", "vbucket-details") == 0,
+          "Expected no flush of an empty vbucket");
+
+    for (int j = 0; j < 100; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "value",
+                    &i, 0, j % 2) == ENGINE_SUCCESS, "Failed to store an item.");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+    check(get_int_stat(h, h1, "ep_total_persisted") == 100,
+          "Expected all the items persisted");
+    check(get_int_stat(h, h1, "vb_0:flush_duration", "vbucket-details") > 0,
+          "Expected vbucket 0's flush time");
+    check(get_int_stat(h, h1, "vb_1:flush_duration", "vbucket-details") > 0,
+          "Expected vbucket 1's flush time");
+    check(get_int_stat(h, h1, "vb_1:flush_latency_max", "vbucket-details") >=
+          get_int_stat(h, h1, "vb_1:flush_latency", "vbucket-details"),
+          "Expected the max flush latency to be the largest");
+    return SUCCESS;
+}
+
 static enum test_result test_restart_bin_val(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
 
 
@@ -1905,6 +2084,91 @@ static enum test_result test_get_replica(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static void get_replica_max_staleness(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                      const char *key, uint32_t maxStaleness,
+                                      uint32_t extlen = sizeof(uint32_t)) {
+    maxStaleness = htonl(maxStaleness);
+    protocol_binary_request_header *pkt;
+    pkt = createPacket(CMD_GET_REPLICA, 0, 0,
+                       reinterpret_cast<char*>(&maxStaleness), extlen,
+                       key, strlen(key));
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Get Replica Failed");
+    free(pkt);
+}
+
+static enum test_result test_get_replica_max_staleness(ENGINE_HANDLE *h,
+                                                       ENGINE_HANDLE_V1 *h1) {
+    free(prepare_get_replica(h, h1, vbucket_state_replica));
+
+    // It's never heard from an active.
+    get_replica_max_staleness(h, h1, "k0", 60000);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_ETMPFAIL,
+          "Expected the replica to be too stale");
+    check(strcmp("Replica is too stale", last_body) == 0,
+          "Expected why the read failed");
+    check(get_int_stat(h, h1, "ep_num_stale_replica_reads") == 1,
+          "Expected a stale replica read");
+
+    get_replica_max_staleness(h, h1, "k0", 60000, 2);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_EINVAL,
+          "Expected the extras to be rejected");
+
+    char eng_specific[64];
+    memset(eng_specific, 0, sizeof(eng_specific));
+    uint64_t checkpointId = htonll(2);
+    check(h1->tap_notify(h, NULL, eng_specific, sizeof(eng_specific),
+                         1, 0, TAP_CHECKPOINT_START, 1, "", 0, 828, 0, 0,
+                         &checkpointId, sizeof(checkpointId), 0) ==
+          ENGINE_SUCCESS, "Failed tap notify.");
+    check(get_int_stat(h, h1, "vb_0:replica_checkpoint_id",
+                       "vbucket-details") == 2,
+          "Expected the active's checkpoint id");
+
+    // The message didn't say how recent the active's checkpoint is.
+    get_replica_max_staleness(h, h1, "k0", 60000);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_ETMPFAIL,
+          "Expected the replica to still be too stale");
+
+    // The active closed the checkpoint two minutes ago.
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t now = static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+    uint64_t checkpointEnd[2];
+    checkpointEnd[0] = htonll(2);
+    checkpointEnd[1] = htonll(now - 120000000);
+    check(h1->tap_notify(h, NULL, eng_specific, sizeof(eng_specific),
+                         1, 0, TAP_CHECKPOINT_END, 2, "", 0, 828, 0, 0,
+                         checkpointEnd, sizeof(checkpointEnd), 0) ==
+          ENGINE_SUCCESS, "Failed tap notify.");
+    get_replica_max_staleness(h, h1, "k0", 60000);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_ETMPFAIL,
+          "Expected the replica to be as stale as the active's checkpoint");
+    check(get_int_stat(h, h1, "ep_num_stale_replica_reads") == 3,
+          "Expected three stale replica reads");
+
+    checkpointEnd[1] = htonll(now);
+    check(h1->tap_notify(h, NULL, eng_specific, sizeof(eng_specific),
+                         1, 0, TAP_CHECKPOINT_END, 3, "", 0, 828, 0, 0,
+                         checkpointEnd, sizeof(checkpointEnd), 0) ==
+          ENGINE_SUCCESS, "Failed tap notify.");
+
+    get_replica_max_staleness(h, h1, "k0", 60000);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the replica to be fresh enough");
+    check(strcmp("replicadata", last_body) == 0,
+          "Should have returned identical value");
+    check(get_int_stat(h, h1, "ep_num_stale_replica_reads") == 3,
+          "Expected no more stale replica reads");
+
+    // Without a max staleness any replica value will do.
+    get_replica(h, h1, "k0", 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected PROTOCOL_BINARY_RESPONSE_SUCCESS response.");
+
+    return SUCCESS;
+}
+
 static enum test_result test_get_replica_non_resident(ENGINE_HANDLE *h,
                                                       ENGINE_HANDLE_V1 *h1) {
 
@@ -2025,6 +2289,33 @@ static enum test_result test_touch_mb7342(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static enum test_result test_touch_ejected(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    item *itm = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", "somevalue", &itm)
+          == ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, itm);
+    wait_for_flusher_to_settle(h, h1);
+    evict_key(h, h1, "key", 0, "Ejected.");
+
+    // Touching an ejected item doesn't fetch its value...
+    int bgFetched = get_int_stat(h, h1, "ep_bg_fetched");
+    int expTime = time(NULL) + 100;
+    touch(h, h1, "key", 0, expTime);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "touch key");
+    check(get_int_stat(h, h1, "ep_bg_fetched") == bgFetched,
+          "Expected no bg fetch for a touch");
+
+    // ...the flusher reads it back to write the new exptime with it.
+    wait_for_flusher_to_settle(h, h1);
+    check(get_int_stat(h, h1, "ep_item_flush_meta_only") == 1,
+          "Expected a metadata only flush");
+    check_key_value(h, h1, "key", "somevalue", 9);
+    check(get_int_stat(h, h1, "key_exptime", "key key 0") == expTime,
+          "Failed to persist new exptime");
+    return SUCCESS;
+}
+
 static enum test_result test_gat(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     // key is a mandatory field!
     gat(h, h1, NULL, 0, 10);
@@ -2344,6 +2635,8 @@ static enum test_result test_vbucket_destroy_stats(ENGINE_HANDLE *h,
 
     wait_for_stat_change(h, h1, "ep_vbucket_del", vbucketDel);
 
+    // The vbucket itself is only freed once the epoch has moved on.
+    wait_for_stat_to_be(h, h1, "ep_epoch_pending", 0);
     wait_for_stat_to_be(h, h1, "mem_used", mem_used);
     wait_for_stat_to_be(h, h1, "ep_total_cache_size", cacheSize);
     wait_for_stat_to_be(h, h1, "ep_overhead", overhead);
@@ -2437,6 +2730,43 @@ static enum test_result test_vb_prepend_pending(ENGINE_HANDLE *h, ENGINE_HANDLE_
     return test_pending_vb_mutation(h, h1, OPERATION_PREPEND);
 }
 
+static enum test_result test_vb_pending_ops_limit(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1) {
+    check(set_vbucket_state(h, h1, 1, vbucket_state_pending),
+          "Failed to set vbucket state.");
+    const void *cookies[3];
+    for (int j = 0; j < 3; ++j) {
+        cookies[j] = testHarness.create_cookie();
+        testHarness.set_ewouldblock_handling(cookies[j], false);
+    }
+
+    item *i = NULL;
+    check(store(h, h1, cookies[0], OPERATION_SET, "key", "somevalue", &i,
+                0, 1) == ENGINE_EWOULDBLOCK, "Expected the set to block");
+    h1->release(h, NULL, i);
+    i = NULL;
+    check(h1->get(h, cookies[1], &i, "key", 3, 1) == ENGINE_EWOULDBLOCK,
+          "Expected the get to block");
+    check(store(h, h1, cookies[2], OPERATION_SET, "key", "somevalue", &i,
+                0, 1) == ENGINE_TMPFAIL, "Expected a full pending queue");
+    h1->release(h, NULL, i);
+    check(get_int_stat(h, h1, "ep_pending_ops") == 2, "Expected 2 blocked");
+    check(get_int_stat(h, h1, "ep_pending_ops_rejected") == 1,
+          "Expected 1 rejected");
+
+    // They're woken one at a time once the vbucket's active.
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+    wait_for_stat_to_be(h, h1, "ep_pending_ops", 0);
+    check(get_int_stat(h, h1, "ep_pending_ops_max") == 2,
+          "Expected 2 blocked at most");
+
+    for (int j = 0; j < 3; ++j) {
+        testHarness.destroy_cookie(cookies[j]);
+    }
+    return SUCCESS;
+}
+
 static enum test_result test_vb_set_replica(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return test_replica_vb_mutation(h, h1, OPERATION_SET);
 }
@@ -2610,6 +2940,10 @@ static enum test_result test_tap_agg_stats(ENGINE_HANDLE *h,
           "Incorrect rebalance count on tap agg");
     check(get_int_stat(h, h1, "_total:count", "tapagg _") == 5,
           "Incorrect total count on tap agg");
+    check(get_int_stat(h, h1, "_total:bytes_sent", "tapagg _") == 0,
+          "Expected nothing sent on tap agg");
+    check(get_int_stat(h, h1, "ep_tap_bytes_per_sec", "tap") == 0,
+          "Expected nothing sent on the tap connections");
 
     std::for_each(cookies.begin(), cookies.end(),
                   std::ptr_fun((UNLOCK_COOKIE_T)testHarness.unlock_cookie));
@@ -2784,9 +3118,8 @@ static enum test_result test_tap_sends_deleted(ENGINE_HANDLE *h, ENGINE_HANDLE_V
     return SUCCESS;
 }
 
-static enum test_result test_sent_from_vb(ENGINE_HANDLE *h,
-                                          ENGINE_HANDLE_V1 *h1) {
-    const int num_keys = 5;
+static enum test_result test_tap_mutation_batch(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 20;
     for (int ii = 0; ii < num_keys; ++ii) {
         std::stringstream ss;
         ss << "key" << ii;
@@ -2796,15 +3129,25 @@ static enum test_result test_sent_from_vb(ENGINE_HANDLE *h,
     }
     wait_for_flusher_to_settle(h, h1);
 
+    for (int ii = 0; ii < 5; ++ii) {
+        std::stringstream ss;
+        ss << "key" << ii;
+        checkeq(ENGINE_SUCCESS, del(h, h1, ss.str().c_str(), 0, 0), "Delete failed");
+    }
+    wait_for_flusher_to_settle(h, h1);
+    wait_for_stat_to_be(h, h1, "curr_items", num_keys - 5);
+
     const void *cookie = testHarness.create_cookie();
     testHarness.lock_cookie(cookie);
     std::string name = "tap_client_thread";
     TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
                                              name.length(),
-                                             TAP_CONNECT_FLAG_DUMP, NULL,
+                                             TAP_CONNECT_FLAG_DUMP |
+                                             TAP_CONNECT_MUTATION_BATCH, NULL,
                                              0);
     check(iter != NULL, "Failed to create a tap iterator");
 
+    std::vector<std::string> batches;
     item *it;
     void *engine_specific;
     uint16_t nengine_specific;
@@ -2824,12 +3167,18 @@ static enum test_result test_sent_from_vb(ENGINE_HANDLE *h,
             testHarness.waitfor_cookie(cookie);
             break;
         case TAP_OPAQUE:
+            if (nengine_specific > sizeof(uint32_t)) {
+                check(vbucket == 0, "Mutation batch for the wrong vbucket");
+                batches.push_back(std::string(static_cast<char*>(engine_specific),
+                                              nengine_specific));
+            }
+            break;
         case TAP_NOOP:
         case TAP_DISCONNECT:
             break;
         case TAP_MUTATION:
-            break;
         case TAP_DELETION:
+            h1->release(h, cookie, it);
             break;
         default:
             std::cerr << "Unexpected event:  " << event << std::endl;
@@ -2837,67 +3186,85 @@ static enum test_result test_sent_from_vb(ENGINE_HANDLE *h,
         }
 
     } while (event != TAP_DISCONNECT);
+    testHarness.unlock_cookie(cookie);
 
-    check(get_int_stat(h, h1, "eq_tapq:tap_client_thread:sent_from_vb_0",
-                       "tap") == 5, "Incorrect number of items sent");
-
+    check(!batches.empty(), "Expected the items to be sent in batches");
 
-    std::map<uint16_t, uint64_t> vbmap;
-    vbmap[0] = 0;
-    changeVBFilter(h, h1, "tap_client_thread", vbmap);
-    check(get_int_stat(h, h1, "eq_tapq:tap_client_thread:sent_from_vb_0",
-                       "tap") == 0, "Incorrect number of items sent");
+    // Replay the batches into a replica vbucket.
+    check(set_vbucket_state(h, h1, 1, vbucket_state_replica),
+          "Failed to set vbucket state.");
+    std::vector<std::string>::iterator bit = batches.begin();
+    for (; bit != batches.end(); ++bit) {
+        check(h1->tap_notify(h, NULL, const_cast<char*>(bit->data()),
+                             static_cast<uint16_t>(bit->length()),
+                             1, 0, TAP_OPAQUE, 1, "", 0, 0, 0, 0,
+                             NULL, 0, 1) == ENGINE_SUCCESS,
+              "Failed to apply a mutation batch");
+    }
+    check(get_int_stat(h, h1, "vb_replica_curr_items") == num_keys - 5,
+          "Expected the batched items in the replica vbucket");
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+    for (int ii = 0; ii < num_keys; ++ii) {
+        std::stringstream ss;
+        ss << "key" << ii;
+        if (ii < 5) {
+            check(verify_key(h, h1, ss.str().c_str(), 1) == ENGINE_KEY_ENOENT,
+                  "Expected a deleted key to be missing");
+        } else {
+            check_key_value(h, h1, ss.str().c_str(), "value", 5, 1);
+        }
+    }
+    check(set_vbucket_state(h, h1, 1, vbucket_state_replica),
+          "Failed to set vbucket state.");
 
-    testHarness.unlock_cookie(cookie);
+    // A malformed batch drops the connection.
+    std::string bad = batches.front().substr(0, batches.front().length() - 1);
+    check(h1->tap_notify(h, NULL, const_cast<char*>(bad.data()),
+                         static_cast<uint16_t>(bad.length()),
+                         1, 0, TAP_OPAQUE, 1, "", 0, 0, 0, 0,
+                         NULL, 0, 1) == ENGINE_DISCONNECT,
+          "Expected a malformed batch to disconnect");
 
     return SUCCESS;
 }
 
-static enum test_result test_tap_takeover(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    const int num_keys = 30;
-    bool keys[num_keys];
-    int initialPersisted = get_int_stat(h, h1, "ep_total_persisted");
-
-    int initializedKeys = 0;
-
-    memset(keys, 0, sizeof(keys));
-
-    for (; initializedKeys < num_keys / 2; ++initializedKeys) {
-        keys[initializedKeys] = false;
+static enum test_result test_tap_disk_backfill_from_memory(ENGINE_HANDLE *h,
+                                                            ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 10;
+    const int num_new_keys = 3;
+    for (int ii = 0; ii < num_keys; ++ii) {
         std::stringstream ss;
-        ss << initializedKeys;
+        ss << "key" << ii;
         check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
                     "value", NULL, 0, 0) == ENGINE_SUCCESS,
               "Failed to store an item.");
     }
+    wait_for_flusher_to_settle(h, h1);
 
-    useconds_t sleepTime = 128;
-    while (get_int_stat(h, h1, "ep_total_persisted")
-           < initialPersisted + initializedKeys) {
-        decayingSleep(&sleepTime);
-    }
-
-    for (int ii = 0; ii < initializedKeys; ++ii) {
+    // Leave an update and a few new keys in memory only.
+    stop_persistence(h, h1);
+    check(store(h, h1, NULL, OPERATION_SET, "key0", "new", NULL, 0, 0)
+          == ENGINE_SUCCESS, "Failed to store an item.");
+    for (int ii = num_keys; ii < num_keys + num_new_keys; ++ii) {
         std::stringstream ss;
-        ss << ii;
-        evict_key(h, h1, ss.str().c_str(), 0, "Ejected.");
+        ss << "key" << ii;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    "new", NULL, 0, 0) == ENGINE_SUCCESS,
+              "Failed to store an item.");
     }
 
-    uint16_t vbucketfilter[2];
-    vbucketfilter[0] = ntohs(1);
-    vbucketfilter[1] = ntohs(0);
-
     const void *cookie = testHarness.create_cookie();
     testHarness.lock_cookie(cookie);
     std::string name = "tap_client_thread";
     TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
                                              name.length(),
-                                             TAP_CONNECT_FLAG_TAKEOVER_VBUCKETS |
-                                             TAP_CONNECT_FLAG_LIST_VBUCKETS,
-                                             static_cast<void*>(vbucketfilter),
-                                             4);
+                                             TAP_CONNECT_FLAG_DUMP, NULL,
+                                             0);
     check(iter != NULL, "Failed to create a tap iterator");
 
+    std::map<std::string, int> received;
+    int mutations = 0;
     item *it;
     void *engine_specific;
     uint16_t nengine_specific;
@@ -2908,25 +3275,11 @@ static enum test_result test_tap_takeover(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
     tap_event_t event;
     std::string key;
 
-    uint16_t unlikely_vbucket_identifier = 17293;
-    bool allows_more_mutations(true);
-
     do {
-        vbucket = unlikely_vbucket_identifier;
         event = iter(h, cookie, &it, &engine_specific,
                      &nengine_specific, &ttl, &flags,
                      &seqno, &vbucket);
 
-        if (initializedKeys < num_keys) {
-            keys[initializedKeys] = false;
-            std::stringstream ss;
-            ss << initializedKeys;
-            check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
-                        "value", NULL, 0, 0) == ENGINE_SUCCESS,
-                  "Failed to store an item.");
-            ++initializedKeys;
-        }
-
         switch (event) {
         case TAP_PAUSE:
             testHarness.waitfor_cookie(cookie);
@@ -2935,45 +3288,532 @@ static enum test_result test_tap_takeover(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
         case TAP_NOOP:
             break;
         case TAP_MUTATION:
-            // This will be false if we've seen a vbucket set state.
-            assert(allows_more_mutations);
-
+            testHarness.unlock_cookie(cookie);
             check(get_key(h, h1, it, key), "Failed to read out the key");
-            keys[atoi(key.c_str())] = true;
-            assert(vbucket != unlikely_vbucket_identifier);
-            check(verify_item(h, h1, it, NULL, 0, "value", 5) == SUCCESS,
-                  "Unexpected item arrived on tap stream");
+            ++received[key];
+            ++mutations;
+            if (key == "key0" || atoi(key.c_str() + 3) >= num_keys) {
+                check(verify_item(h, h1, it, NULL, 0, "new", 3) == SUCCESS,
+                      "Expected the in-memory version of the item");
+            } else {
+                check(verify_item(h, h1, it, NULL, 0, "value", 5) == SUCCESS,
+                      "Unexpected item arrived on tap stream");
+            }
             h1->release(h, cookie, it);
-
+            testHarness.lock_cookie(cookie);
             break;
         case TAP_DISCONNECT:
             break;
-        case TAP_VBUCKET_SET:
-            assert(nengine_specific == 4);
-            vbucket_state_t state;
-            memcpy(&state, engine_specific, nengine_specific);
-            state = static_cast<vbucket_state_t>(ntohl(state));
-            if (state == vbucket_state_active) {
-                allows_more_mutations = false;
+        default:
+            std::cerr << "Unexpected event:  " << event << std::endl;
+            return FAIL;
+        }
+
+    } while (event != TAP_DISCONNECT);
+    testHarness.unlock_cookie(cookie);
+    start_persistence(h, h1);
+
+    check(received.size() == static_cast<size_t>(num_keys + num_new_keys),
+          "Failed to receive all the keys");
+    // Only key0 is both on disk and dirty in memory.
+    check(mutations == num_keys + num_new_keys + 1,
+          "Expected the persisted items to be sent only from disk");
+    return SUCCESS;
+}
+
+static enum test_result test_tap_mutation_batch_large_values(ENGINE_HANDLE *h,
+                                                              ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 20;
+    std::string large(1000, 'x');
+    for (int ii = 0; ii < num_keys; ++ii) {
+        std::stringstream ss;
+        ss << "key" << ii;
+        const char *value = (ii % 4 == 0) ? large.c_str() : "value";
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    value, NULL, 0, 0) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    const void *cookie = testHarness.create_cookie();
+    testHarness.lock_cookie(cookie);
+    std::string name = "tap_client_thread";
+    TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
+                                             name.length(),
+                                             TAP_CONNECT_FLAG_DUMP |
+                                             TAP_CONNECT_MUTATION_BATCH, NULL,
+                                             0);
+    check(iter != NULL, "Failed to create a tap iterator");
+
+    int largeMutations = 0;
+    int smallMutations = 0;
+    item *it;
+    void *engine_specific;
+    uint16_t nengine_specific;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+    tap_event_t event;
+
+    do {
+        event = iter(h, cookie, &it, &engine_specific,
+                     &nengine_specific, &ttl, &flags,
+                     &seqno, &vbucket);
+
+        switch (event) {
+        case TAP_PAUSE:
+            testHarness.waitfor_cookie(cookie);
+            break;
+        case TAP_OPAQUE:
+            if (nengine_specific > sizeof(uint32_t)) {
+                uint16_t count;
+                memcpy(&count, static_cast<char*>(engine_specific) +
+                       sizeof(uint32_t), sizeof(count));
+                smallMutations += ntohs(count);
+            }
+            break;
+        case TAP_NOOP:
+        case TAP_DISCONNECT:
+            break;
+        case TAP_MUTATION:
+            {
+                item_info info;
+                info.nvalue = 1;
+                check(h1->get_item_info(h, cookie, it, &info),
+                      "Failed to get item info");
+                if (info.value[0].iov_len == large.length()) {
+                    ++largeMutations;
+                } else {
+                    ++smallMutations;
+                }
+                h1->release(h, cookie, it);
+            }
+            break;
+        default:
+            std::cerr << "Unexpected event:  " << event << std::endl;
+            return FAIL;
+        }
+
+    } while (event != TAP_DISCONNECT);
+    testHarness.unlock_cookie(cookie);
+
+    check(largeMutations == num_keys / 4,
+          "Expected the large values to be sent on their own");
+    check(smallMutations == num_keys - num_keys / 4,
+          "Expected every small value to be sent");
+    return SUCCESS;
+}
+
+static enum test_result test_tap_rcvr_apply_parallel(ENGINE_HANDLE *h,
+                                                      ENGINE_HANDLE_V1 *h1) {
+    check(set_vbucket_state(h, h1, 1, vbucket_state_replica),
+          "Failed to set vbucket state.");
+    char eng_specific[1];
+    const int num_keys = 10;
+    for (int ii = 0; ii < 10 * num_keys; ++ii) {
+        std::stringstream key, value;
+        key << "key" << ii % num_keys;
+        value << "value" << ii;
+        check(h1->tap_notify(h, NULL, eng_specific, 1,
+                             1, 0, TAP_MUTATION, 1,
+                             key.str().c_str(), key.str().length(), 0, 0, 0,
+                             value.str().data(), value.str().length(),
+                             1) == ENGINE_SUCCESS,
+              "Failed tap notify.");
+    }
+    check(h1->tap_notify(h, NULL, NULL, 0, 1, 0, TAP_DELETION, 1,
+                         "key0", 4, 0, 0, 0, NULL, 0, 1) == ENGINE_SUCCESS,
+          "Failed tap notify.");
+
+    wait_for_stat_to_be(h, h1, "ep_tap_apply_queue_size", 0);
+    check(get_int_stat(h, h1, "vb_replica_curr_items") == num_keys - 1,
+          "Expected the applied items in the replica vbucket");
+
+    // The last event for each key wins.
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+    check(verify_key(h, h1, "key0", 1) == ENGINE_KEY_ENOENT,
+          "Expected the deleted key to be missing");
+    for (int ii = 1; ii < num_keys; ++ii) {
+        std::stringstream key, value;
+        key << "key" << ii;
+        value << "value" << 9 * num_keys + ii;
+        check_key_value(h, h1, key.str().c_str(), value.str().data(),
+                        value.str().length(), 1);
+    }
+    return SUCCESS;
+}
+
+static enum test_result test_tap_rcvr_throttle_pacing(ENGINE_HANDLE *h,
+                                                      ENGINE_HANDLE_V1 *h1) {
+    check(set_vbucket_state(h, h1, 1, vbucket_state_replica),
+          "Failed to set vbucket state.");
+    // Fill the write queue 3/4 of the way to its cap 20, with nothing
+    // being drained.
+    stop_persistence(h, h1);
+    for (int ii = 0; ii < 15; ++ii) {
+        std::stringstream ss;
+        ss << "key" << ii;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    "value", NULL, 0, 0) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+    check(get_int_stat(h, h1, "ep_queue_size") < 20,
+          "Expected the write queue under its cap");
+
+    char eng_specific[1];
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    for (int ii = 0; ii < 10 && ret == ENGINE_SUCCESS; ++ii) {
+        std::stringstream key;
+        key << "tap" << ii;
+        ret = h1->tap_notify(h, NULL, eng_specific, 1, 1, 0, TAP_MUTATION, 1,
+                             key.str().c_str(), key.str().length(), 0, 0, 0,
+                             "value", 5, 1);
+    }
+    check(ret != ENGINE_SUCCESS, "Expected the tap input to be paced");
+    check(get_int_stat(h, h1, "ep_tap_throttled") > 0,
+          "Expected the throttled tap input to be counted");
+    check(get_int_stat(h, h1, "ep_queue_size") < 20,
+          "Expected the tap input paced before the write queue cap");
+    check(get_int_stat(h, h1, "ep_tap_throttle_paced_rate") == 0,
+          "Expected no rate with nothing drained");
+
+    // Once the queue drains the input isn't limited anymore.
+    start_persistence(h, h1);
+    wait_for_flusher_to_settle(h, h1);
+    usleep(200000);
+    check(h1->tap_notify(h, NULL, eng_specific, 1, 1, 0, TAP_MUTATION, 1,
+                         "drained", 7, 0, 0, 0, "value", 5,
+                         1) == ENGINE_SUCCESS,
+          "Failed tap notify.");
+    check(get_int_stat(h, h1, "ep_tap_throttle_paced_rate") == -1,
+          "Expected the tap input unlimited");
+    return SUCCESS;
+}
+
+static enum test_result test_tap_backfill_controller(ENGINE_HANDLE *h,
+                                                     ENGINE_HANDLE_V1 *h1) {
+    check(get_int_stat(h, h1, "ep_tap_backfill_bg_window", "tap") == 500,
+          "Expected the configured bg fetch window");
+    check(get_int_stat(h, h1, "ep_tap_backfill_backlog_limit", "tap") == 5000,
+          "Expected the configured backlog limit");
+
+    // A disk write queue over tap_throttle_queue_cap is an overload.
+    stop_persistence(h, h1);
+    for (int ii = 0; ii < 10; ++ii) {
+        std::stringstream ss;
+        ss << "key" << ii;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    "value", NULL, 0, 0) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+    // The engine stats refresh the write queue cap.
+    check(get_int_stat(h, h1, "ep_queue_size") >= 10,
+          "Expected the items in the disk write queue");
+
+    useconds_t sleepTime = 128;
+    while (get_int_stat(h, h1, "ep_tap_backfill_backoffs", "tap") == 0) {
+        decayingSleep(&sleepTime);
+    }
+    int window = get_int_stat(h, h1, "ep_tap_backfill_bg_window", "tap");
+    check(window < 500, "Expected a narrower bg fetch window");
+    check(get_int_stat(h, h1, "ep_tap_backfill_backlog_limit", "tap") < 5000,
+          "Expected a lower backlog limit");
+
+    // Once the queue drains the limits grow back.
+    start_persistence(h, h1);
+    wait_for_flusher_to_settle(h, h1);
+    sleepTime = 128;
+    while (get_int_stat(h, h1, "ep_tap_backfill_bg_window", "tap") <= window) {
+        decayingSleep(&sleepTime);
+    }
+
+    // Without an SLO the configured limits apply as they are.
+    set_param(h, h1, engine_param_tap, "tap_backfill_bg_slo", "0");
+    check(get_int_stat(h, h1, "ep_tap_backfill_bg_window", "tap") == 500,
+          "Expected the configured bg fetch window");
+    check(get_int_stat(h, h1, "ep_tap_backfill_backlog_limit", "tap") == 5000,
+          "Expected the configured backlog limit");
+    return SUCCESS;
+}
+
+static enum test_result test_sent_from_vb(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 5;
+    for (int ii = 0; ii < num_keys; ++ii) {
+        std::stringstream ss;
+        ss << "key" << ii;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    "value", NULL, 0, 0) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    const void *cookie = testHarness.create_cookie();
+    testHarness.lock_cookie(cookie);
+    std::string name = "tap_client_thread";
+    TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
+                                             name.length(),
+                                             TAP_CONNECT_FLAG_DUMP, NULL,
+                                             0);
+    check(iter != NULL, "Failed to create a tap iterator");
+
+    item *it;
+    void *engine_specific;
+    uint16_t nengine_specific;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+    tap_event_t event;
+
+    do {
+        event = iter(h, cookie, &it, &engine_specific,
+                     &nengine_specific, &ttl, &flags,
+                     &seqno, &vbucket);
+
+        switch (event) {
+        case TAP_PAUSE:
+            testHarness.waitfor_cookie(cookie);
+            break;
+        case TAP_OPAQUE:
+        case TAP_NOOP:
+        case TAP_DISCONNECT:
+            break;
+        case TAP_MUTATION:
+            break;
+        case TAP_DELETION:
+            break;
+        default:
+            std::cerr << "Unexpected event:  " << event << std::endl;
+            return FAIL;
+        }
+
+    } while (event != TAP_DISCONNECT);
+
+    check(get_int_stat(h, h1, "eq_tapq:tap_client_thread:sent_from_vb_0",
+                       "tap") == 5, "Incorrect number of items sent");
+
+
+    std::map<uint16_t, uint64_t> vbmap;
+    vbmap[0] = 0;
+    changeVBFilter(h, h1, "tap_client_thread", vbmap);
+    check(get_int_stat(h, h1, "eq_tapq:tap_client_thread:sent_from_vb_0",
+                       "tap") == 0, "Incorrect number of items sent");
+
+    testHarness.unlock_cookie(cookie);
+
+    return SUCCESS;
+}
+
+static enum test_result test_tap_takeover(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 30;
+    bool keys[num_keys];
+    int initialPersisted = get_int_stat(h, h1, "ep_total_persisted");
+
+    int initializedKeys = 0;
+
+    memset(keys, 0, sizeof(keys));
+
+    for (; initializedKeys < num_keys / 2; ++initializedKeys) {
+        keys[initializedKeys] = false;
+        std::stringstream ss;
+        ss << initializedKeys;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    "value", NULL, 0, 0) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+
+    useconds_t sleepTime = 128;
+    while (get_int_stat(h, h1, "ep_total_persisted")
+           < initialPersisted + initializedKeys) {
+        decayingSleep(&sleepTime);
+    }
+
+    for (int ii = 0; ii < initializedKeys; ++ii) {
+        std::stringstream ss;
+        ss << ii;
+        evict_key(h, h1, ss.str().c_str(), 0, "Ejected.");
+    }
+
+    uint16_t vbucketfilter[2];
+    vbucketfilter[0] = ntohs(1);
+    vbucketfilter[1] = ntohs(0);
+
+    const void *cookie = testHarness.create_cookie();
+    testHarness.lock_cookie(cookie);
+    std::string name = "tap_client_thread";
+    TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
+                                             name.length(),
+                                             TAP_CONNECT_FLAG_TAKEOVER_VBUCKETS |
+                                             TAP_CONNECT_FLAG_LIST_VBUCKETS,
+                                             static_cast<void*>(vbucketfilter),
+                                             4);
+    check(iter != NULL, "Failed to create a tap iterator");
+
+    item *it;
+    void *engine_specific;
+    uint16_t nengine_specific;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+    tap_event_t event;
+    std::string key;
+
+    uint16_t unlikely_vbucket_identifier = 17293;
+    bool allows_more_mutations(true);
+
+    do {
+        vbucket = unlikely_vbucket_identifier;
+        event = iter(h, cookie, &it, &engine_specific,
+                     &nengine_specific, &ttl, &flags,
+                     &seqno, &vbucket);
+
+        if (initializedKeys < num_keys) {
+            keys[initializedKeys] = false;
+            std::stringstream ss;
+            ss << initializedKeys;
+            check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                        "value", NULL, 0, 0) == ENGINE_SUCCESS,
+                  "Failed to store an item.");
+            ++initializedKeys;
+        }
+
+        switch (event) {
+        case TAP_PAUSE:
+            testHarness.waitfor_cookie(cookie);
+            break;
+        case TAP_OPAQUE:
+        case TAP_NOOP:
+            break;
+        case TAP_MUTATION:
+            // This will be false if we've seen a vbucket set state.
+            assert(allows_more_mutations);
+
+            check(get_key(h, h1, it, key), "Failed to read out the key");
+            keys[atoi(key.c_str())] = true;
+            assert(vbucket != unlikely_vbucket_identifier);
+            check(verify_item(h, h1, it, NULL, 0, "value", 5) == SUCCESS,
+                  "Unexpected item arrived on tap stream");
+            h1->release(h, cookie, it);
+
+            break;
+        case TAP_DISCONNECT:
+            break;
+        case TAP_VBUCKET_SET:
+            assert(nengine_specific == 4);
+            vbucket_state_t state;
+            memcpy(&state, engine_specific, nengine_specific);
+            state = static_cast<vbucket_state_t>(ntohl(state));
+            if (state == vbucket_state_active) {
+                allows_more_mutations = false;
+            }
+            break;
+        default:
+            std::cerr << "Unexpected event:  " << event << std::endl;
+            return FAIL;
+        }
+
+    } while (event != TAP_DISCONNECT);
+
+    for (int ii = 0; ii < num_keys; ++ii) {
+        check(keys[ii], "Failed to receive key");
+    }
+
+    testHarness.unlock_cookie(cookie);
+    check(get_int_stat(h, h1, "ep_tap_total_fetched", "tap") != 0,
+          "http://bugs.northscale.com/show_bug.cgi?id=1695");
+    h1->reset_stats(h, NULL);
+    check(get_int_stat(h, h1, "ep_tap_total_fetched", "tap") == 0,
+          "Expected reset stats to clear ep_tap_total_fetched");
+
+    return SUCCESS;
+}
+
+static enum test_result test_tap_takeover_delta(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 30;
+    bool keys[num_keys];
+    for (int ii = 0; ii < num_keys; ++ii) {
+        keys[ii] = false;
+        std::stringstream ss;
+        ss << ii;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    "value", NULL, 0, 0) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+
+    uint16_t vbucketfilter[2];
+    vbucketfilter[0] = ntohs(1);
+    vbucketfilter[1] = ntohs(0);
+
+    const void *cookie = testHarness.create_cookie();
+    testHarness.lock_cookie(cookie);
+    std::string name = "tap_client_thread";
+    TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
+                                             name.length(),
+                                             TAP_CONNECT_FLAG_TAKEOVER_VBUCKETS |
+                                             TAP_CONNECT_FLAG_LIST_VBUCKETS,
+                                             static_cast<void*>(vbucketfilter),
+                                             4);
+    check(iter != NULL, "Failed to create a tap iterator");
+
+    item *it;
+    void *engine_specific;
+    uint16_t nengine_specific;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+    tap_event_t event;
+    std::string key;
+    bool allows_more_mutations(true);
+
+    do {
+        event = iter(h, cookie, &it, &engine_specific,
+                     &nengine_specific, &ttl, &flags,
+                     &seqno, &vbucket);
+
+        switch (event) {
+        case TAP_PAUSE:
+            testHarness.waitfor_cookie(cookie);
+            break;
+        case TAP_OPAQUE:
+        case TAP_NOOP:
+            break;
+        case TAP_MUTATION:
+            check(allows_more_mutations,
+                  "Got a mutation after the vbucket was set active");
+            check(get_key(h, h1, it, key), "Failed to read out the key");
+            keys[atoi(key.c_str())] = true;
+            h1->release(h, cookie, it);
+            break;
+        case TAP_DISCONNECT:
+            break;
+        case TAP_VBUCKET_SET:
+            assert(nengine_specific == 4);
+            vbucket_state_t state;
+            memcpy(&state, engine_specific, nengine_specific);
+            state = static_cast<vbucket_state_t>(ntohl(state));
+            if (state == vbucket_state_active) {
+                allows_more_mutations = false;
             }
             break;
         default:
             std::cerr << "Unexpected event:  " << event << std::endl;
             return FAIL;
         }
-
     } while (event != TAP_DISCONNECT);
 
+    testHarness.unlock_cookie(cookie);
+
     for (int ii = 0; ii < num_keys; ++ii) {
         check(keys[ii], "Failed to receive key");
     }
-
-    testHarness.unlock_cookie(cookie);
-    check(get_int_stat(h, h1, "ep_tap_total_fetched", "tap") != 0,
-          "http://bugs.northscale.com/show_bug.cgi?id=1695");
-    h1->reset_stats(h, NULL);
-    check(get_int_stat(h, h1, "ep_tap_total_fetched", "tap") == 0,
-          "Expected reset stats to clear ep_tap_total_fetched");
+    check(!allows_more_mutations, "Expected the vbucket to be set active");
+    check(verify_vbucket_state(h, h1, 0, vbucket_state_dead),
+          "Expected the vbucket to be dead after the takeover");
 
     return SUCCESS;
 }
@@ -3544,6 +4384,45 @@ static enum test_result test_checkpoint_deduplication(ENGINE_HANDLE *h, ENGINE_H
     return SUCCESS;
 }
 
+static enum test_result test_batched_checkpoint_queueing(ENGINE_HANDLE *h,
+                                                         ENGINE_HANDLE_V1 *h1)
+{
+    check(test_checkpoint_deduplication(h, h1) == SUCCESS,
+          "Staged items weren't de-duplicated.");
+    // The duplicates found when the staged items were queued are no longer
+    // counted as waiting to be persisted.
+    wait_for_flusher_to_settle(h, h1);
+    check(get_int_stat(h, h1, "vb_0:queue_size", "vbucket-details") == 0,
+          "Expected an empty disk queue.");
+    return SUCCESS;
+}
+
+static enum test_result test_adaptive_checkpoint_bounds(ENGINE_HANDLE *h,
+                                                        ENGINE_HANDLE_V1 *h1)
+{
+    check(get_int_stat(h, h1, "vb_0:adaptive_max_items", "checkpoint") == 5000,
+          "Expected the configured max items before any pressure.");
+
+    // Fill the open checkpoint well past its memory budget (1% of the quota).
+    std::string value(512, 'x');
+    item *itm;
+    for (size_t j = 0; j < 200; ++j) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%ld", j);
+        check(store(h, h1, NULL, OPERATION_SET, key, value.c_str(), &itm, 0, 0)
+              == ENGINE_SUCCESS, "Failed to store an item.");
+        h1->release(h, NULL, itm);
+    }
+    check(get_int_stat(h, h1, "ep_checkpoint_memory") > 10485,
+          "Expected checkpoints to be over their memory budget.");
+
+    // The remover shrinks the bounds to a tenth of the configured ones.
+    wait_for_stat_to_be(h, h1, "vb_0:adaptive_max_items", 500, "checkpoint");
+    check(get_int_stat(h, h1, "vb_0:adaptive_period", "checkpoint") == 60,
+          "Expected the checkpoint period to shrink as well.");
+    return SUCCESS;
+}
+
 static enum test_result test_collapse_checkpoints(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1)
 {
     item *itm;
@@ -3579,6 +4458,142 @@ static enum test_result test_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_agg_stats_max_age(ENGINE_HANDLE *h,
+                                               ENGINE_HANDLE_V1 *h1) {
+    checkeq(0, get_int_stat(h, h1, "curr_items"), "Expected no items");
+
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", "value", &i, 0, 0)
+          == ENGINE_SUCCESS, "Failed to store a value");
+    h1->release(h, NULL, i);
+
+    // The counts taken by the first stats are reused for an hour.
+    checkeq(0, get_int_stat(h, h1, "curr_items"),
+            "Expected the vbucket counts to be reused");
+
+    check(set_param(h, h1, engine_param_flush, "agg_stats_max_age", "0"),
+          "Failed to set agg_stats_max_age");
+    checkeq(1, get_int_stat(h, h1, "curr_items"),
+            "Expected the vbuckets to be counted again");
+
+    return SUCCESS;
+}
+
+static enum test_result test_delta_stats(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1) {
+    vals.clear();
+    check(h1->get_stats(h, NULL, "delta", 5, add_stats) == ENGINE_SUCCESS,
+          "Failed to get delta stats");
+    check(vals.find("ep_version") != vals.end(),
+          "Expected all the stats without a cursor");
+    std::string cursor = vals["delta_cursor"];
+    check(!cursor.empty(), "Expected a cursor");
+
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", "value", &i, 0, 0)
+          == ENGINE_SUCCESS, "Failed to store a value");
+    h1->release(h, NULL, i);
+
+    std::string key("delta " + cursor);
+    vals.clear();
+    check(h1->get_stats(h, NULL, key.c_str(), key.length(),
+                        add_stats) == ENGINE_SUCCESS,
+          "Failed to get delta stats");
+    check(vals["curr_items"] == "1", "Expected the changed item count");
+    check(vals.find("ep_version") == vals.end(),
+          "Expected no unchanged stats");
+    check(vals["delta_cursor"] != cursor, "Expected a new cursor");
+
+    key = "delta " + vals["delta_cursor"] + " timings";
+    vals.clear();
+    check(h1->get_stats(h, NULL, key.c_str(), key.length(),
+                        add_stats) == ENGINE_SUCCESS,
+          "Failed to get delta timings");
+    check(vals.find("ep_version") == vals.end() &&
+          vals.find("delta_cursor") != vals.end(),
+          "Expected the timings of another group");
+
+    check(h1->get_stats(h, NULL, "delta x", 7, add_stats) == ENGINE_EINVAL,
+          "Expected a bad cursor to be refused");
+    check(h1->get_stats(h, NULL, "delta 0 delta", 13,
+                        add_stats) == ENGINE_EINVAL,
+          "Expected delta stats of delta stats to be refused");
+
+    return SUCCESS;
+}
+
+static enum test_result test_optrace_stats(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    vals.clear();
+    check(h1->get_stats(h, NULL, "optrace", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get optrace stats");
+    check(vals["threshold"] == "0", "Expected tracing to be off");
+
+    // Nothing takes a minute, so nothing is kept.
+    set_param(h, h1, engine_param_flush, "op_trace_threshold", "60000000");
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", "value", &i, 0, 0)
+          == ENGINE_SUCCESS, "Failed to store a value");
+    h1->release(h, NULL, i);
+    check_key_value(h, h1, "key", "value", 5);
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "optrace", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get optrace stats");
+    check(vals["threshold"] == "60000000", "Expected the new threshold");
+    check(vals.find("op_0:op") == vals.end(), "Expected no slow ops");
+    check(get_int_stat(h, h1, "ep_op_trace_threshold") == 60000000,
+          "Expected the threshold in the engine stats");
+
+    set_param(h, h1, engine_param_flush, "op_trace_threshold", "0");
+    vals.clear();
+    check(h1->get_stats(h, NULL, "optrace", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get optrace stats");
+    check(vals["threshold"] == "0", "Expected tracing to be off again");
+    return SUCCESS;
+}
+
+static enum test_result test_hotkeys_stats(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    for (int j = 0; j < 10; ++j) {
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, "hot", "value", &i, 0, 0)
+              == ENGINE_SUCCESS, "Failed to store a value");
+        h1->release(h, NULL, i);
+    }
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "cold", "v", &i, 0, 0)
+          == ENGINE_SUCCESS, "Failed to store a value");
+    h1->release(h, NULL, i);
+    check_key_value(h, h1, "hot", "value", 5);
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "hotkeys", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get hotkeys stats");
+    check(vals["sample_rate"] == "1", "Expected every op sampled");
+    check(vals["key_ops_0:key"] == "hot", "Expected hot to be the hottest");
+    check(vals["key_ops_0:ops"] == "11", "Expected hot's gets and sets");
+    check(vals["key_ops_0:gets"] == "1", "Expected hot's get");
+    check(vals["key_ops_0:sets"] == "10", "Expected hot's sets");
+    check(vals["key_ops_1:key"] == "cold", "Expected cold to be next");
+    check(vals["key_bytes_0:key"] == "hot", "Expected hot's bytes");
+    check(vals["key_bytes_0:bytes"] == "55", "Expected 11 values of hot");
+    check(vals["vb_ops_0:vbucket"] == "0", "Expected vbucket 0's ops");
+    check(vals["vb_ops_0:ops"] == "12", "Expected all the ops of vbucket 0");
+
+    h1->reset_stats(h, NULL);
+    set_param(h, h1, engine_param_flush, "hotkeys_sample_rate", "0");
+    check_key_value(h, h1, "hot", "value", 5);
+    vals.clear();
+    check(h1->get_stats(h, NULL, "hotkeys", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get hotkeys stats");
+    check(vals["sample_rate"] == "0", "Expected sampling to be off");
+    check(vals.find("key_ops_0:key") == vals.end(),
+          "Expected nothing to have been sampled");
+
+    return SUCCESS;
+}
+
 static enum test_result test_mem_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     char value[2048];
     memset(value, 'b', sizeof(value));
@@ -3678,6 +4693,98 @@ static enum test_result test_bg_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_timings_summary(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    h1->reset_stats(h, NULL);
+    for (int i = 0; i < 10; ++i) {
+        std::stringstream ss;
+        ss << "key" << i;
+        item *itm = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "value",
+                    &itm, 0, 0) == ENGINE_SUCCESS, "Failed to store a value");
+        h1->release(h, NULL, itm);
+        check_key_value(h, h1, ss.str().c_str(), "value", 5, 0);
+    }
+
+    checkeq(10, get_int_stat(h, h1, "get_cmd:count", "timings_summary"),
+            "Expected ten gets");
+    check(atoi(vals["get_cmd:p50"].c_str()) <=
+          atoi(vals["get_cmd:p99"].c_str()), "Expected p50 <= p99");
+    check(atoi(vals["get_cmd:p999"].c_str()) <=
+          atoi(vals["get_cmd:max"].c_str()), "Expected p99.9 <= max");
+    check(vals.find("get_cmd:10s:count") != vals.end(),
+          "Expected the 10s window of the gets");
+    check(vals.find("get_cmd:60s:p99") != vals.end(),
+          "Expected the 60s window of the gets");
+    check(vals.find("item_alloc_sizes:count") != vals.end(),
+          "Expected the item allocation sizes");
+    check(vals.find("get_cmd_p99") == vals.end(),
+          "Expected no raw timings");
+
+    return SUCCESS;
+}
+
+static enum test_result test_bg_fetch_readahead(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    const char *keys[] = { "r::1", "r::2", "r::3", "r::4", "r::5", "s::1" };
+    const int nkeys = sizeof(keys) / sizeof(keys[0]);
+    for (int i = 0; i < nkeys; ++i) {
+        wait_for_persisted_value(h, h1, keys[i], "val");
+    }
+    for (int i = 0; i < nkeys; ++i) {
+        evict_key(h, h1, keys[i], 0, "Ejected.");
+    }
+    h1->reset_stats(h, NULL);
+
+    // The second key of the range reads the next ones ahead of it.
+    check_key_value(h, h1, "r::1", "val", 3, 0);
+    checkeq(0, get_int_stat(h, h1, "ep_bg_readahead_fetched"),
+            "Expected no readahead after one key of a range");
+    check_key_value(h, h1, "r::2", "val", 3, 0);
+    checkeq(2, get_int_stat(h, h1, "ep_bg_readahead_fetched"),
+            "Expected the next two keys of the range read ahead");
+
+    check_key_value(h, h1, "r::3", "val", 3, 0);
+    check_key_value(h, h1, "r::4", "val", 3, 0);
+    checkeq(2, get_int_stat(h, h1, "ep_bg_fetched"),
+            "Expected the keys read ahead to be in memory");
+    check_key_value(h, h1, "s::1", "val", 3, 0);
+    checkeq(3, get_int_stat(h, h1, "ep_bg_fetched"),
+            "Expected another range not to be read ahead");
+
+    return SUCCESS;
+}
+
+static enum test_result test_bg_fetch_batched(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    h1->reset_stats(h, NULL);
+    wait_for_persisted_value(h, h1, "k1", "v1");
+    wait_for_persisted_value(h, h1, "k2", "v2");
+    wait_for_persisted_value(h, h1, "k3", "v3");
+    evict_key(h, h1, "k1", 0, "Ejected.");
+    evict_key(h, h1, "k2", 0, "Ejected.");
+    evict_key(h, h1, "k3", 0, "Ejected.");
+
+    // Each fetch waits out the latency budget or the batch filling up.
+    check_key_value(h, h1, "k1", "v1", 2, 0);
+    check_key_value(h, h1, "k2", "v2", 2, 0);
+    check_key_value(h, h1, "k3", "v3", 2, 0);
+    checkeq(3, get_int_stat(h, h1, "ep_bg_fetched"),
+            "Expected three bg fetches");
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "timings", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get timing stats");
+    bool found = false;
+    std::map<std::string, std::string>::iterator vit = vals.begin();
+    for (; vit != vals.end(); ++vit) {
+        found = found || vit->first.find("bg_batch_wait_") == 0;
+    }
+    check(found, "Expected the bg batch wait histogram");
+
+    return SUCCESS;
+}
+
 static enum test_result test_bg_meta_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *itm = NULL;
     h1->reset_stats(h, NULL);
@@ -3889,6 +4996,18 @@ static enum test_result test_warmup_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
     check(vals.find("ep_warmup_time") != vals.end(), "Found no ep_warmup_time");
     std::string warmup_time = vals["ep_warmup_time"];
     assert(atoi(warmup_time.c_str()) > 0);
+    // VB0's shard loaded it itself
+    check(vals.find("ep_warmup_shard_0_time") != vals.end(),
+          "Found no ep_warmup_shard_0_time");
+    check(vals.find("ep_warmup_shard_0_items") != vals.end(),
+          "Found no ep_warmup_shard_0_items");
+    check(vals.find("ep_warmup_shard_0_item_rate") != vals.end(),
+          "Found no ep_warmup_shard_0_item_rate");
+    check(vals.find("ep_warmup_phase_key_dump_time") != vals.end(),
+          "Found no ep_warmup_phase_key_dump_time");
+    check(vals["ep_warmup_vb_0"] == "loaded", "VB0 wasn't loaded");
+    check(vals.find("ep_warmup_eta") == vals.end(),
+          "Found an ep_warmup_eta after warmup completed");
 
     vals.clear();
     check(h1->get_stats(h, NULL, "prev-vbucket", 12, add_stats) == ENGINE_SUCCESS,
@@ -3903,6 +5022,48 @@ static enum test_result test_warmup_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
     return SUCCESS;
 }
 
+static enum test_result test_warmup_snapshot(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    for (int i = 0; i < 100; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        check(ENGINE_SUCCESS ==
+              store(h, h1, NULL, OPERATION_SET, key.str().c_str(), "somevalue", &it),
+              "Error setting.");
+        h1->release(h, NULL, it);
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    // A clean shutdown writes the snapshot the next warmup loads.
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    check(get_int_stat(h, h1, "ep_warmup_snapshot_vbuckets", "warmup") == 1,
+          "Expected VB0 to be loaded from its snapshot");
+    check(get_int_stat(h, h1, "ep_warmup_value_count", "warmup") == 100,
+          "Expected all of the values loaded");
+    check_key_value(h, h1, "key-42", "somevalue", 9);
+
+    // A snapshot older than the vbucket's file isn't loaded.
+    check(ENGINE_SUCCESS ==
+          store(h, h1, NULL, OPERATION_SET, "key-42", "othervalue", &it),
+          "Error setting.");
+    h1->release(h, NULL, it);
+    wait_for_flusher_to_settle(h, h1);
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, true);
+    wait_for_warmup_complete(h, h1);
+    check(get_int_stat(h, h1, "ep_warmup_snapshot_vbuckets", "warmup") == 0,
+          "Expected no snapshot after a forced shutdown");
+    check_key_value(h, h1, "key-42", "othervalue", 10);
+
+    return SUCCESS;
+}
+
 
 static enum test_result test_warmup_accesslog(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *it = NULL;
@@ -4033,8 +5194,235 @@ static enum test_result test_notifier_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *
     int sent = get_int_stat(h, h1, "rw_0:notify_vbucket_update:sent", "kvstore");
     check(close == sent, "expected notify_vbucket_update equals to close");
 
-    int success = get_int_stat(h, h1, "rw_0:notify_vbucket_update:success", "kvstore");
-    check(sent == success, "expected notify_vbucket_update success");
+    int success = get_int_stat(h, h1, "rw_0:notify_vbucket_update:success", "kvstore");
+    check(sent == success, "expected notify_vbucket_update success");
+    return SUCCESS;
+}
+
+static enum test_result test_async_commit_notify(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    const int num_vbs = 16;
+    for (int vb = 1; vb < num_vbs; ++vb) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed to set vbucket state.");
+    }
+    wait_for_flusher_to_settle(h, h1);
+    int waits = get_int_stat(h, h1, "rw_0:numCommitWaits", "kvstore");
+
+    // The flusher takes all the vbuckets in one pass once it's started.
+    stop_persistence(h, h1);
+    for (int vb = 0; vb < num_vbs; ++vb) {
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, "key", "value", &i, 0, vb) ==
+              ENGINE_SUCCESS, "Failed to store an item.");
+        h1->release(h, NULL, i);
+    }
+    start_persistence(h, h1);
+    wait_for_flusher_to_settle(h, h1);
+    checkeq(num_vbs, get_int_stat(h, h1, "ep_total_persisted"),
+            "Expected all the items persisted");
+    checkeq(0, get_int_stat(h, h1, "rw_0:notify_vbucket_update:error",
+                            "kvstore"),
+            "Expected no notify_vbucket_update error");
+
+    int shards = get_int_stat(h, h1, "ep_workload:num_shards", "workload");
+    int shardVbs = (num_vbs + shards - 1) / shards;
+    int shardWaits = get_int_stat(h, h1, "rw_0:numCommitWaits", "kvstore") -
+                     waits;
+    check(shardWaits > 0, "Expected the commits to be completed");
+    if (shardVbs > 1) {
+        check(shardWaits < shardVbs,
+              "Expected the commits of the vbuckets to wait together");
+    }
+
+    for (int vb = 0; vb < num_vbs; ++vb) {
+        evict_key(h, h1, "key", vb, "Ejected.");
+        check_key_value(h, h1, "key", "value", 5, vb);
+    }
+    return SUCCESS;
+}
+
+static enum test_result test_db_handle_cache_stats(ENGINE_HANDLE *h,
+                                                   ENGINE_HANDLE_V1 *h1) {
+    wait_for_persisted_value(h, h1, "k1", "v1");
+    evict_key(h, h1, "k1", 0, "Ejected.");
+    check_key_value(h, h1, "k1", "v1", 2, 0);
+    evict_key(h, h1, "k1", 0, "Ejected.");
+    check_key_value(h, h1, "k1", "v1", 2, 0);
+
+    int hits = get_int_stat(h, h1, "ro_0:db_cache_hits", "kvstore");
+    int misses = get_int_stat(h, h1, "ro_0:db_cache_misses", "kvstore");
+    check(misses > 0, "Expected the first read to open the file");
+    check(hits + misses >= 2, "Expected both reads to be counted");
+    return SUCCESS;
+}
+
+static enum test_result test_kvtimings_fs_stats(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    wait_for_persisted_value(h, h1, "k1", "v1");
+    h1->reset_stats(h, NULL);
+    evict_key(h, h1, "k1", 0, "Ejected.");
+    check_key_value(h, h1, "k1", "v1", 2, 0);
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "kvtimings", 9, add_stats) == ENGINE_SUCCESS,
+          "Failed to get kvtimings stats");
+    bool active = false;
+    bool replica = false;
+    std::map<std::string, std::string>::iterator vit = vals.begin();
+    for (; vit != vals.end(); ++vit) {
+        active = active || vit->first.find("ro_0:fsActiveReadTime_") == 0;
+        replica = replica || vit->first.find("ro_0:fsReplicaReadTime_") == 0;
+    }
+    check(active, "Expected the read of vbucket 0 as an active read");
+    check(!replica, "Expected no replica reads");
+    return SUCCESS;
+}
+
+static enum test_result test_compaction(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    for (int j = 0; j < 5; ++j) {
+        for (int k = 0; k < 100; ++k) {
+            std::stringstream ss;
+            ss << "key" << k;
+            item *i = NULL;
+            check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "value",
+                        &i) == ENGINE_SUCCESS, "Failed to store an item.");
+            h1->release(h, NULL, i);
+        }
+        wait_for_flusher_to_settle(h, h1);
+    }
+    check(del(h, h1, "key0", 0, 0) == ENGINE_SUCCESS, "Failed to delete key0");
+    wait_for_flusher_to_settle(h, h1);
+    int seqno = get_int_stat(h, h1, "vb_0:persisted_seqno", "vbucket-details");
+
+    wait_for_stat_change(h, h1, "ep_compaction_runs", 0);
+    check(get_int_stat(h, h1, "ep_compaction_failed") == 0,
+          "Expected no failed compaction");
+    check(get_int_stat(h, h1, "ep_compaction_bytes_reclaimed") > 0,
+          "Expected the file to shrink");
+
+    // The docs keep their seqnos, so the next one is still above them.
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key100", "value", &i) ==
+          ENGINE_SUCCESS, "Failed to store an item.");
+    h1->release(h, NULL, i);
+    wait_for_flusher_to_settle(h, h1);
+    check(get_int_stat(h, h1, "vb_0:persisted_seqno", "vbucket-details") ==
+          seqno + 1, "Expected the seqnos to be kept by the compaction");
+
+    // The items must be read from the new file.
+    for (int k = 1; k < 100; ++k) {
+        std::stringstream ss;
+        ss << "key" << k;
+        evict_key(h, h1, ss.str().c_str(), 0, "Ejected.");
+        check_key_value(h, h1, ss.str().c_str(), "value", 5, 0);
+    }
+    check(verify_key(h, h1, "key0") == ENGINE_KEY_ENOENT,
+          "Expected key0 to stay deleted");
+    return SUCCESS;
+}
+
+static enum test_result test_compaction_purge(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    for (int k = 0; k < 10; ++k) {
+        std::stringstream ss;
+        ss << "key" << k;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "value",
+                    &i) == ENGINE_SUCCESS, "Failed to store an item.");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+    for (int k = 1; k < 10; ++k) {
+        std::stringstream ss;
+        ss << "key" << k;
+        check(del(h, h1, ss.str().c_str(), 0, 0) == ENGINE_SUCCESS,
+              "Failed to delete an item.");
+    }
+    wait_for_flusher_to_settle(h, h1);
+    // All the deletions have the same seqno.
+    check(get_meta(h, h1, "key2"), "Expected to get meta of a deletion");
+    uint64_t deletedSeqno = last_meta.seqno;
+
+    // Make the deletions older than the purge age.
+    testHarness.time_travel(5);
+    wait_for_stat_change(h, h1, "ep_compaction_purged", 0);
+    check(get_int_stat(h, h1, "vb_0:purge_seqno", "vbucket-details") > 0,
+          "Expected a purge seqno");
+    checkeq(0, get_int_stat(h, h1, "ep_compaction_failed"),
+            "Expected no failed compaction");
+
+    // A key created again must still get a higher seqno.
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key1", "value", &i) ==
+          ENGINE_SUCCESS, "Failed to store an item.");
+    h1->release(h, NULL, i);
+    check(get_meta(h, h1, "key1"), "Expected to get meta");
+    check(last_meta.seqno > deletedSeqno,
+          "Expected the seqno to be above the purged deletions");
+    check_key_value(h, h1, "key0", "value", 5, 0);
+    return SUCCESS;
+}
+
+static enum test_result test_seqno_stream_after_purge(ENGINE_HANDLE *h,
+                                                      ENGINE_HANDLE_V1 *h1) {
+    for (int k = 0; k < 10; ++k) {
+        std::stringstream ss;
+        ss << "key" << k;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "value",
+                    &i) == ENGINE_SUCCESS, "Failed to store an item.");
+        h1->release(h, NULL, i);
+        wait_for_flusher_to_settle(h, h1);
+    }
+    for (int k = 1; k < 10; ++k) {
+        std::stringstream ss;
+        ss << "key" << k;
+        check(del(h, h1, ss.str().c_str(), 0, 0) == ENGINE_SUCCESS,
+              "Failed to delete an item.");
+        wait_for_flusher_to_settle(h, h1);
+    }
+    int persisted = get_int_stat(h, h1, "vb_0:persisted_seqno",
+                                 "vbucket-details");
+
+    testHarness.time_travel(5);
+    wait_for_stat_change(h, h1, "ep_compaction_purged", 0);
+    int purged = get_int_stat(h, h1, "vb_0:purged_by_seqno",
+                              "vbucket-details");
+    check(purged > 0 && purged <= persisted,
+          "Expected the seqno of the last deletion purged");
+
+    // Streaming from before it would miss purged deletions.
+    char userdata[sizeof(uint16_t) * 2 + sizeof(uint64_t)];
+    uint16_t nSeqnos = htons(1);
+    uint16_t vbid = htons(0);
+    uint64_t since = htonll(1);
+    memcpy(userdata, &nSeqnos, sizeof(nSeqnos));
+    memcpy(userdata + sizeof(nSeqnos), &vbid, sizeof(vbid));
+    memcpy(userdata + sizeof(nSeqnos) + sizeof(vbid), &since, sizeof(since));
+
+    const void *cookie = testHarness.create_cookie();
+    testHarness.lock_cookie(cookie);
+    std::string name = "tap_client_thread";
+    TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
+                                             name.length(),
+                                             TAP_CONNECT_SEQNO_STREAM,
+                                             userdata, sizeof(userdata));
+    check(iter != NULL, "Failed to create a tap iterator");
+
+    item *it;
+    void *engine_specific;
+    uint16_t nengine_specific;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+    tap_event_t event = iter(h, cookie, &it, &engine_specific,
+                             &nengine_specific, &ttl, &flags,
+                             &seqno, &vbucket);
+    testHarness.unlock_cookie(cookie);
+    check(event == TAP_DISCONNECT, "Expected the stream to be refused");
     return SUCCESS;
 }
 
@@ -4087,6 +5475,69 @@ static enum test_result test_worker_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
           "worker_1's Current task incorrect");
     check(statelist.find(worker_1_state)!=statelist.end(),
           "worker_1's state incorrect");
+    check(vals.find("iomanager_worker_0:stolen") != vals.end(),
+          "worker_0's stolen task count missing");
+
+    return SUCCESS;
+}
+
+static bool has_stat_prefix(const std::string &prefix) {
+    std::map<std::string, std::string>::iterator it = vals.lower_bound(prefix);
+    return it != vals.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+}
+
+static enum test_result test_task_timings(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", "somevalue", &i) ==
+          ENGINE_SUCCESS, "Failed to store an item.");
+    h1->release(h, NULL, i);
+    wait_for_flusher_to_settle(h, h1);
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "dispatcher",
+                        strlen("dispatcher"), add_stats) == ENGINE_SUCCESS,
+                        "Failed to get worker stats");
+
+    check(vals.find("iomanager_worker_0:cpu_time") != vals.end(),
+          "worker_0's cpu time missing");
+    check(vals.find("iomanager_writer:cpu_time") != vals.end(),
+          "writer group's cpu time missing");
+    check(has_stat_prefix("task_flusher:schedule_delay_"),
+          "flusher's schedule delay histogram is empty");
+    check(has_stat_prefix("task_flusher:task_runtime_"),
+          "flusher's task runtime histogram is empty");
+    check(vals.find("nio_dispatcher:cpu_time") != vals.end(),
+          "non IO dispatcher's cpu time missing");
+
+    return SUCCESS;
+}
+
+static enum test_result test_worker_groups(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    check(get_int_stat(h, h1, "ep_workload:num_auxio", "workload") == 2,
+          "Incorrect number of aux IO threads");
+    check(get_int_stat(h, h1, "ep_workload:num_nonio", "workload") == 0,
+          "Incorrect number of non IO threads");
+    int writers = get_int_stat(h, h1, "ep_workload:num_writers", "workload");
+    int readers = get_int_stat(h, h1, "ep_workload:num_readers", "workload");
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "dispatcher",
+                        strlen("dispatcher"), add_stats) == ENGINE_SUCCESS,
+                        "Failed to get worker stats");
+    check(atoi(vals["iomanager_writer:threads"].c_str()) == writers,
+          "Incorrect number of writer threads");
+    check(atoi(vals["iomanager_reader:threads"].c_str()) == readers,
+          "Incorrect number of reader threads");
+    check(atoi(vals["iomanager_auxio:threads"].c_str()) == 2,
+          "Incorrect number of aux IO threads");
+    check(vals.find("iomanager_nonio:threads") == vals.end(),
+          "Didn't expect any non IO threads");
+    check(vals.find("iomanager_auxio:ready_tasks") != vals.end(),
+          "Missing the aux IO ready tasks stat");
+    std::stringstream ss;
+    ss << "iomanager_worker_" << (writers + readers + 1) << ":state";
+    check(vals.find(ss.str()) != vals.end(), "Missing the last aux IO thread");
 
     return SUCCESS;
 }
@@ -4123,6 +5574,46 @@ static enum test_result test_workload_stats_mix(ENGINE_HANDLE *h, ENGINE_HANDLE_
     return SUCCESS;
 }
 
+static enum test_result test_workload_stats_auto(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    check(h1->get_stats(h, testHarness.create_cookie(), "workload",
+                        strlen("workload"), add_stats) == ENGINE_SUCCESS,
+                        "Falied to get workload stats");
+    int num_read_threads = get_int_stat(h, h1, "ep_workload:num_readers", "workload");
+    int num_write_threads = get_int_stat(h, h1, "ep_workload:num_writers", "workload");
+    int num_shards = get_int_stat(h, h1, "ep_workload:num_shards", "workload");
+    int active_readers = get_int_stat(h, h1, "ep_workload:active_readers", "workload");
+    int active_writers = get_int_stat(h, h1, "ep_workload:active_writers", "workload");
+    check(num_read_threads == num_shards, "Incorrect number of readers");
+    check(num_write_threads == num_shards, "Incorrect number of writers");
+    check(active_readers + active_writers == 8,
+          "Active readers and writers must add up to max_num_workers");
+    check(active_readers > 0 && active_readers <= num_read_threads,
+          "Incorrect number of active readers");
+    check(active_writers > 0 && active_writers <= num_write_threads,
+          "Incorrect number of active writers");
+
+    std::string policy = vals["ep_workload:policy"];
+    check(policy.compare("Adapting to the data access") == 0,
+          "Incorrect workload policy based configuration parameter");
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "dispatcher",
+                        strlen("dispatcher"), add_stats) == ENGINE_SUCCESS,
+                        "Failed to get worker stats");
+    check(atoi(vals["iomanager_reader:active_threads"].c_str()) ==
+          active_readers, "Incorrect number of running reader threads");
+    check(atoi(vals["iomanager_writer:active_threads"].c_str()) ==
+          active_writers, "Incorrect number of running writer threads");
+
+    // The parked writers' flushers are run by the others.
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", "somevalue", &i) ==
+          ENGINE_SUCCESS, "Failed to store an item.");
+    h1->release(h, NULL, i);
+    wait_for_flusher_to_settle(h, h1);
+    return SUCCESS;
+}
+
 static enum test_result test_curr_items(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *i = NULL;
 
@@ -4782,6 +6273,35 @@ static enum test_result test_create_new_checkpoint(ENGINE_HANDLE *h, ENGINE_HAND
     return SUCCESS;
 }
 
+static enum test_result test_cursor_checkpoint_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    stop_persistence(h, h1);
+    for (int j = 0; j < 10; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        item *i;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), ss.str().c_str(), &i, 0, 0)
+              == ENGINE_SUCCESS, "Failed to store a value");
+        h1->release(h, NULL, i);
+    }
+    createCheckpoint(h, h1);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected success response from creating a new checkpoint");
+
+    // The persistence cursor holds on to the closed checkpoint until it's flushed.
+    check(get_int_stat(h, h1, "vb_0:persistence:cursor_chks_pinned", "checkpoint 0") == 1,
+          "Expected the persistence cursor to pin the closed checkpoint");
+    check(get_int_stat(h, h1, "vb_0:persistence:cursor_mem_pinned", "checkpoint 0") > 0,
+          "Expected the persistence cursor to pin checkpoint memory");
+
+    start_persistence(h, h1);
+    wait_for_flusher_to_settle(h, h1);
+    // The cursor moves once the flushed items are committed.
+    wait_for_stat_to_be(h, h1, "vb_0:persistence:cursor_chks_pinned", 0, "checkpoint 0");
+    check(get_int_stat(h, h1, "vb_0:persistence:cursor_mem_pinned", "checkpoint 0") == 0,
+          "Expected no checkpoint memory pinned by the persistence cursor");
+    return SUCCESS;
+}
+
 static enum test_result test_extend_open_checkpoint(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     extendCheckpoint(h, h1, 1);
     check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
@@ -5987,52 +7507,619 @@ static enum test_result test_set_meta_conflict_resolution(ENGINE_HANDLE *h,
     check(get_int_stat(h, h1, "ep_bg_meta_fetched") == 1,
           "Expected one bg meta fetch");
 
-    // Check all meta data is the same
-    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
-    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected exists");
-    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 1,
-          "Expected set meta conflict resolution failure");
+    // Check all meta data is the same
+    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected exists");
+    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 1,
+          "Expected set meta conflict resolution failure");
+
+    // Check has older flags fails
+    itemMeta.flags = 0xdeadbeee;
+    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected exists");
+    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 2,
+          "Expected set meta conflict resolution failure");
+
+    // Check has newer flags passes
+    itemMeta.flags = 0xdeadbeff;
+    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
+
+    // Check that newer exptime wins
+    itemMeta.exptime = 10;
+    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
+
+    // Check that smaller exptime loses
+    itemMeta.exptime = 0;
+    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected exists");
+    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 3,
+          "Expected set meta conflict resolution failure");
+
+    // Check testing with old seqno
+    itemMeta.seqno--;
+    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected exists");
+    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 4,
+          "Expected set meta conflict resolution failure");
+
+    itemMeta.seqno += 10;
+    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
+    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 4,
+          "Expected set meta conflict resolution failure");
+
+    check(get_int_stat(h, h1, "ep_bg_meta_fetched") == 1,
+          "Expect one bg meta fetch");
+
+    return SUCCESS;
+}
+
+static enum test_result test_lww_conflict_resolution(ENGINE_HANDLE *h,
+                                                     ENGINE_HANDLE_V1 *h1) {
+    ItemMetaData itemMeta;
+    itemMeta.seqno = 10;
+    itemMeta.cas = 1000;
+    itemMeta.exptime = 0;
+    itemMeta.flags = 0xdeadbeef;
+
+    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
+
+    // An earlier write loses, however many revisions it's been through.
+    itemMeta.seqno = 20;
+    itemMeta.cas = 999;
+    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected exists");
+    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 1,
+          "Expected set meta conflict resolution failure");
+
+    itemMeta.seqno = 1;
+    itemMeta.cas = 1001;
+    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
+
+    itemMeta.cas = 1000;
+    del_with_meta(h, h1, "key", 3, 0, &itemMeta);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected exists");
+    check(get_int_stat(h, h1, "ep_num_ops_del_meta_res_fail") == 1,
+          "Expected delete meta conflict resolution failure");
+
+    // A remote write from a clock too far ahead of ours always loses.
+    itemMeta.cas = 1ULL << 62;
+    set_with_meta(h, h1, "ahead", 5, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected exists");
+    check(get_int_stat(h, h1, "ep_num_cas_drift_rejections") == 1,
+          "Expected a cas drift rejection");
+
+    // A local write after a remote one from a clock a little ahead of ours
+    // wins.
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    itemMeta.cas = (static_cast<uint64_t>(tv.tv_sec) + 2) * 1000000000ULL;
+    set_with_meta(h, h1, "ahead", 5, NULL, 0, 0, &itemMeta, 0);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "ahead", "local", &i) ==
+          ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    item_info info;
+    check(get_item_info(h, h1, &info, "ahead"), "Failed to get value.");
+    check(info.cas > itemMeta.cas, "Expected the local write to be later");
+
+    return SUCCESS;
+}
+
+static void addWithMetaRecord(std::string &body, uint8_t op, bool force,
+                              const char *key, const char *val,
+                              uint64_t seqno, uint64_t cas) {
+    uint8_t rec[32];
+    memset(rec, 0, sizeof(rec));
+    uint16_t keylen = htons(static_cast<uint16_t>(strlen(key)));
+    uint32_t vallen = htonl(static_cast<uint32_t>(val ? strlen(val) : 0));
+    seqno = htonll(seqno);
+    cas = htonll(cas);
+    rec[0] = op;
+    rec[1] = force ? SKIP_CONFLICT_RESOLUTION_FLAG : 0;
+    memcpy(rec + 2, &keylen, sizeof(keylen));
+    memcpy(rec + 12, &seqno, sizeof(seqno));
+    memcpy(rec + 20, &cas, sizeof(cas));
+    memcpy(rec + 28, &vallen, sizeof(vallen));
+    body.append(reinterpret_cast<char*>(rec), sizeof(rec));
+    body.append(key);
+    if (val) {
+        body.append(val);
+    }
+}
+
+static enum test_result test_with_meta_batch(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "existing", "value", &i) ==
+          ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+
+    std::string body;
+    addWithMetaRecord(body, WITH_META_BATCH_SET, true, "new", "newvalue",
+                      5, 0xdeadbeef);
+    // Its metadata has to be fetched first.
+    addWithMetaRecord(body, WITH_META_BATCH_SET, false, "missing", "value",
+                      1, 0xdeadbeef);
+    // Older than the key's own seqno
+    addWithMetaRecord(body, WITH_META_BATCH_SET, false, "existing", "old",
+                      0, 0xdeadbeef);
+    addWithMetaRecord(body, WITH_META_BATCH_DEL, false, "existing", NULL,
+                      2, 0xdeadbeef);
+
+    protocol_binary_request_header *pkt;
+    pkt = createPacket(CMD_WITH_META_BATCH, 0, 0, NULL, 0, NULL, 0,
+                       body.data(), body.size());
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "With meta batch call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the batch to be taken");
+    check(last_bodylen == 2, "Expected two bitmaps of one byte");
+    check(last_body[0] == 0x09, "Expected the first and last to be applied");
+    check(last_body[1] == 0x02, "Expected the second to be sent again");
+
+    check(get_int_stat(h, h1, "ep_num_ops_set_meta") == 1, "Expect one set");
+    check(get_int_stat(h, h1, "ep_num_ops_del_meta") == 1, "Expect one del");
+    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 1,
+          "Expect one set to lose the conflict resolution");
+
+    check(get_meta(h, h1, "new"), "Expected to get meta");
+    check(last_meta.seqno == 5, "Expected seqno to match");
+    check(last_meta.cas == 0xdeadbeef, "Expected cas to match");
+    check_key_value(h, h1, "new", "newvalue", 8);
+    check(verify_key(h, h1, "existing") == ENGINE_KEY_ENOENT,
+          "Expected the key to be deleted");
+
+    // A record cut short
+    body.resize(body.size() - 1);
+    pkt = createPacket(CMD_WITH_META_BATCH, 0, 0, NULL, 0, NULL, 0,
+                       body.data(), body.size());
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "With meta batch call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_EINVAL,
+          "Expected a truncated batch to be rejected");
+
+    body.clear();
+    addWithMetaRecord(body, WITH_META_BATCH_SET, true, "k", "v", 1, 1);
+    pkt = createPacket(CMD_WITH_META_BATCH, 1, 0, NULL, 0, NULL, 0,
+                       body.data(), body.size());
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "With meta batch call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET,
+          "Expected not my vbucket");
+
+    return SUCCESS;
+}
+
+static enum test_result test_admission_control(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "k1", "v", &i) == ENGINE_SUCCESS,
+          "Expected the first store to be admitted");
+    h1->release(h, NULL, i);
+    check(store(h, h1, NULL, OPERATION_SET, "k2", "v", &i) == ENGINE_TMPFAIL,
+          "Expected the second store to be over the rate");
+    check(h1->get(h, NULL, &i, "k1", 2, 0) == ENGINE_SUCCESS,
+          "Expected gets not to be limited");
+    h1->release(h, NULL, i);
+
+    check(get_int_stat(h, h1, "ep_admission_set_admitted") == 1,
+          "Expected one store admitted");
+    check(get_int_stat(h, h1, "ep_admission_set_rejected") == 1,
+          "Expected one store rejected");
+    check(get_int_stat(h, h1, "ep_admission_get_rejected") == 0,
+          "Expected no get rejected");
+
+    set_param(h, h1, engine_param_flush, "admission_set_rate", "0");
+    check(store(h, h1, NULL, OPERATION_SET, "k2", "v", &i) == ENGINE_SUCCESS,
+          "Expected stores to be unlimited again");
+    h1->release(h, NULL, i);
+    check(get_int_stat(h, h1, "ep_admission_set_rejected") == 1,
+          "Expected no more stores rejected");
+
+    // One op a second to each vbucket.
+    set_param(h, h1, engine_param_flush, "admission_vb_rate", "1");
+    check(del(h, h1, "k1", 0, 0) == ENGINE_SUCCESS,
+          "Expected the vbucket's first op to be admitted");
+    check(del(h, h1, "k2", 0, 0) == ENGINE_TMPFAIL,
+          "Expected the vbucket's second op to be over its rate");
+    check(get_int_stat(h, h1, "ep_admission_vb_rejected") == 1,
+          "Expected an op rejected for its vbucket");
+
+    return SUCCESS;
+}
+
+static enum test_result test_get_meta_batch(ENGINE_HANDLE *h,
+                                            ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "existing", "value", &i) ==
+          ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    check(get_meta(h, h1, "existing"), "Expected to get meta");
+    uint64_t cas = last_meta.cas;
+
+    std::string body;
+    addWithMetaRecord(body, WITH_META_BATCH_SET, false, "existing", NULL,
+                      5, cas);
+    addWithMetaRecord(body, WITH_META_BATCH_SET, false, "existing", NULL,
+                      0, cas);
+    addWithMetaRecord(body, WITH_META_BATCH_SET, false, "missing", NULL,
+                      1, 0xdeadbeef);
+
+    protocol_binary_request_header *pkt;
+    pkt = createPacket(CMD_GET_META_BATCH, 0, 0, NULL, 0, NULL, 0,
+                       body.data(), body.size());
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Get meta batch call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the batch to be taken");
+    check(last_bodylen == 2, "Expected two bitmaps of one byte");
+    check(last_body[0] == 0x01, "Expected only the newer revision to win");
+    check(last_body[1] == 0x04, "Expected the missing key to be asked again");
+
+    // Once its metadata is in, a key that isn't anywhere loses to anything.
+    wait_for_stat_to_be(h, h1, "ep_bg_meta_fetched", 1);
+    body.clear();
+    addWithMetaRecord(body, WITH_META_BATCH_SET, false, "missing", NULL,
+                      1, 0xdeadbeef);
+    pkt = createPacket(CMD_GET_META_BATCH, 0, 0, NULL, 0, NULL, 0,
+                       body.data(), body.size());
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Get meta batch call failed");
+    free(pkt);
+    check(last_bodylen == 2, "Expected two bitmaps of one byte");
+    check(last_body[0] == 0x01, "Expected the remote revision to win");
+    check(last_body[1] == 0x00, "Expected nothing to be asked again");
+    check(get_int_stat(h, h1, "ep_num_ops_get_meta") == 4,
+          "Expected a get_meta per key resolved");
+
+    pkt = createPacket(CMD_GET_META_BATCH, 1, 0, NULL, 0, NULL, 0,
+                       body.data(), body.size());
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Get meta batch call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET,
+          "Expected not my vbucket");
+
+    return SUCCESS;
+}
+
+static void addGetBatchRecord(std::string &body, uint16_t vbucket,
+                              const char *key) {
+    uint16_t vb = htons(vbucket);
+    uint16_t keylen = htons(static_cast<uint16_t>(strlen(key)));
+    body.append(reinterpret_cast<const char*>(&vb), sizeof(vb));
+    body.append(reinterpret_cast<const char*>(&keylen), sizeof(keylen));
+    body.append(key);
+}
+
+/**
+ * Send a CMD_GET_BATCH and split its response into the status and the
+ * value of each key.
+ */
+static void get_batch(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                      const std::string &body,
+                      std::vector<std::pair<uint16_t, std::string> > &got) {
+    protocol_binary_request_header *pkt;
+    pkt = createPacket(CMD_GET_BATCH, 0, 0, NULL, 0, NULL, 0,
+                       body.data(), body.size());
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Get batch call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the batch to be taken");
+
+    got.clear();
+    const char *p = last_body;
+    const char *end = last_body + last_bodylen;
+    while (p < end) {
+        check(end - p >= 18, "Expected a whole record");
+        uint16_t status;
+        uint32_t vallen;
+        memcpy(&status, p, sizeof(status));
+        memcpy(&vallen, p + 14, sizeof(vallen));
+        vallen = ntohl(vallen);
+        check(static_cast<size_t>(end - p - 18) >= vallen,
+              "Expected the whole value");
+        got.push_back(std::make_pair(ntohs(status),
+                                     std::string(p + 18, vallen)));
+        p += 18 + vallen;
+    }
+}
+
+static enum test_result test_get_batch(ENGINE_HANDLE *h,
+                                       ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "k1", "v1", &i) ==
+          ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    check(store(h, h1, NULL, OPERATION_SET, "evicted", "v2", &i) ==
+          ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    wait_for_flusher_to_settle(h, h1);
+    evict_key(h, h1, "evicted", 0, "Ejected.");
+
+    std::string body;
+    addGetBatchRecord(body, 0, "k1");
+    addGetBatchRecord(body, 0, "missing");
+    addGetBatchRecord(body, 0, "evicted");
+    addGetBatchRecord(body, 1, "k1");
+    std::vector<std::pair<uint16_t, std::string> > got;
+    get_batch(h, h1, body, got);
+    check(got.size() == 4, "Expected a record per key");
+    check(got[0].first == PROTOCOL_BINARY_RESPONSE_SUCCESS &&
+          got[0].second == "v1", "Expected the resident value");
+    check(got[1].first == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT,
+          "Expected the missing key not to be found");
+    check(got[2].first == PROTOCOL_BINARY_RESPONSE_ETMPFAIL,
+          "Expected the ejected key to be asked for again");
+    check(got[3].first == PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET,
+          "Expected not my vbucket");
+
+    // Once it's read back, the ejected value is returned too.
+    wait_for_stat_to_be(h, h1, "ep_bg_fetched", 1);
+    body.clear();
+    addGetBatchRecord(body, 0, "evicted");
+    get_batch(h, h1, body, got);
+    check(got.size() == 1 && got[0].first == PROTOCOL_BINARY_RESPONSE_SUCCESS &&
+          got[0].second == "v2", "Expected the value read from disk");
+
+    protocol_binary_request_header *pkt;
+    pkt = createPacket(CMD_GET_BATCH, 0, 0, NULL, 0, NULL, 0, "abc", 3);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Get batch call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_EINVAL,
+          "Expected a cut short record to be invalid");
+
+    return SUCCESS;
+}
+
+static void subdoc(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, uint8_t op,
+                   const char *key, const char *path, const char *value,
+                   uint64_t cas = 0, uint32_t offset = 0) {
+    char ext[8];
+    uint16_t npath = static_cast<uint16_t>(strlen(path));
+    ext[0] = op;
+    ext[1] = 0;
+    uint16_t npathNet = htons(npath);
+    memcpy(ext + 2, &npathNet, sizeof(npathNet));
+    offset = htonl(offset);
+    memcpy(ext + 4, &offset, sizeof(offset));
+
+    std::string val(path);
+    val.append(value);
+    protocol_binary_request_header *pkt;
+    pkt = createPacket(CMD_SUBDOC, 0, cas, ext, sizeof(ext), key, strlen(key),
+                       val.data(), val.size());
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Subdoc call failed");
+    free(pkt);
+}
+
+static enum test_result test_subdoc(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *doc = "{\"n\": 1, \"tags\": [\"a\"], \"x\": 1.50}";
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "doc", doc, &i) == ENGINE_SUCCESS,
+          "Failed set.");
+    h1->release(h, NULL, i);
+
+    subdoc(h, h1, SUBDOC_COUNTER, "doc", "n", "41");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the counter to be incremented");
+    check(last_bodylen == 2 && memcmp(last_body, "42", 2) == 0,
+          "Expected the counter's new value");
+    uint64_t cas = last_cas;
+
+    subdoc(h, h1, SUBDOC_ARRAY_APPEND, "doc", "tags", "\"b\"", cas);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the array to be appended to");
+    check(last_cas != cas, "Expected a new cas");
+
+    subdoc(h, h1, SUBDOC_REPLACE, "doc", "tags[0]", "{\"z\": null}");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the element to be replaced");
+    const char *expected = "{\"n\": 42, \"tags\": [{\"z\": null},\"b\"], "
+                           "\"x\": 1.50}";
+    check_key_value(h, h1, "doc", expected, strlen(expected));
+
+    subdoc(h, h1, SUBDOC_PATCH, "doc", "", "43", 0, 6);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the bytes to be patched");
+    expected = "{\"n\": 43, \"tags\": [{\"z\": null},\"b\"], \"x\": 1.50}";
+    check_key_value(h, h1, "doc", expected, strlen(expected));
+    check(get_int_stat(h, h1, "ep_num_ops_subdoc") == 4,
+          "Expected four sub-document mutations");
+
+    subdoc(h, h1, SUBDOC_REPLACE, "doc", "n", "1", cas);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS,
+          "Expected a cas mismatch");
+    subdoc(h, h1, SUBDOC_REPLACE, "missing", "n", "1");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT,
+          "Expected no such key");
+    subdoc(h, h1, SUBDOC_REPLACE, "doc", "nope", "1");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_EINVAL,
+          "Expected the path to be missing");
+    check(last_bodylen == strlen("PATH_ENOENT") &&
+          memcmp(last_body, "PATH_ENOENT", last_bodylen) == 0,
+          "Expected why the path was rejected");
+    subdoc(h, h1, SUBDOC_COUNTER, "doc", "x", "1");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_EINVAL,
+          "Expected a counter that isn't an integer to be rejected");
+    check(get_int_stat(h, h1, "ep_num_ops_subdoc") == 4,
+          "Expected the failed mutations not to be counted");
+    check_key_value(h, h1, "doc", expected, strlen(expected));
+
+    return SUCCESS;
+}
 
-    // Check has older flags fails
-    itemMeta.flags = 0xdeadbeee;
-    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
-    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected exists");
-    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 2,
-          "Expected set meta conflict resolution failure");
+static void range_scan(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                       const std::string &start, const std::string &end,
+                       uint32_t limit, uint32_t flags,
+                       std::map<std::string, std::string> &found) {
+    char ext[8];
+    limit = htonl(limit);
+    flags = htonl(flags);
+    memcpy(ext, &limit, sizeof(limit));
+    memcpy(ext + 4, &flags, sizeof(flags));
+    protocol_binary_request_header *pkt;
+    pkt = createPacket(CMD_RANGE_SCAN, 0, 0, ext, sizeof(ext), start.data(),
+                       start.length(), end.data(), end.length());
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Range scan call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the page to be read");
+
+    const char *p = last_body;
+    const char *stop = last_body + last_bodylen;
+    while (p < stop) {
+        check(stop - p >= 22, "Expected a whole record");
+        uint16_t keylen;
+        uint32_t vallen;
+        memcpy(&keylen, p, sizeof(keylen));
+        memcpy(&vallen, p + 18, sizeof(vallen));
+        keylen = ntohs(keylen);
+        vallen = ntohl(vallen);
+        p += 22;
+        check(stop - p >= keylen + vallen, "Expected the record's key and value");
+        std::string key(p, keylen);
+        check(found.empty() || found.rbegin()->first < key,
+              "Expected the keys in order");
+        found[key] = std::string(p + keylen, vallen);
+        p += keylen + vallen;
+    }
+}
 
-    // Check has newer flags passes
-    itemMeta.flags = 0xdeadbeff;
-    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
-    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
+static enum test_result test_range_scan(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    for (int j = 0; j < 10; ++j) {
+        std::stringstream key, value;
+        key << "key" << j;
+        value << "value" << j;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                    value.str().c_str(), &i) == ENGINE_SUCCESS,
+              "Failed set.");
+        h1->release(h, NULL, i);
+    }
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "other", "value", &i)
+          == ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    wait_for_flusher_to_settle(h, h1);
 
-    // Check that newer exptime wins
-    itemMeta.exptime = 10;
-    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
-    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
+    // What's in memory but not yet in the file wins over the file.
+    evict_key(h, h1, "key2", 0, "Ejected.");
+    check(store(h, h1, NULL, OPERATION_SET, "key5", "newer", &i)
+          == ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    check(store(h, h1, NULL, OPERATION_SET, "key35", "added", &i)
+          == ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    check(del(h, h1, "key7", 0, 0) == ENGINE_SUCCESS, "Failed remove.");
 
-    // Check that smaller exptime loses
-    itemMeta.exptime = 0;
-    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
-    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected exists");
-    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 3,
-          "Expected set meta conflict resolution failure");
+    std::map<std::string, std::string> found;
+    std::string start("key");
+    int pages = 0;
+    do {
+        range_scan(h, h1, start, "kez", 4, 0, found);
+        start = last_key ? last_key : "";
+        ++pages;
+    } while (!start.empty() && pages < 10);
+    check(pages == 3, "Expected three pages of four keys at most");
+    check(found.size() == 10, "Expected the keys of the range");
+    check(found.find("other") == found.end(), "Expected a key past the end");
+    check(found.find("key7") == found.end(), "Expected no deleted key");
+    check(found["key2"] == "value2", "Expected the ejected value read back");
+    check(found["key5"] == "newer", "Expected the newer value");
+    check(found["key35"] == "added", "Expected the added key");
+    check(get_int_stat(h, h1, "ep_num_range_scans") == 3,
+          "Expected a scan per page");
+    check(get_int_stat(h, h1, "ep_num_range_scan_items") == 10,
+          "Expected the items of the range");
+
+    found.clear();
+    range_scan(h, h1, "", "", 0, RANGE_SCAN_KEYS_ONLY, found);
+    check(last_key == NULL, "Expected the whole vbucket in one page");
+    check(found.size() == 11, "Expected every key of the vbucket");
+    check(found["key5"].empty(), "Expected no values");
+
+    return SUCCESS;
+}
+
+static protocol_binary_request_header *
+createSetVBucketsPacket(const std::vector<uint16_t> &vbuckets,
+                        vbucket_state_t state) {
+    std::string body;
+    std::vector<uint16_t>::const_iterator it;
+    for (it = vbuckets.begin(); it != vbuckets.end(); ++it) {
+        uint16_t vb = htons(*it);
+        uint32_t st = htonl(state);
+        body.append(reinterpret_cast<char*>(&vb), sizeof(vb));
+        body.append(reinterpret_cast<char*>(&st), sizeof(st));
+    }
+    return createPacket(CMD_SET_VBUCKETS, 0, 0, NULL, 0, NULL, 0,
+                        body.data(), body.length());
+}
 
-    // Check testing with old seqno
-    itemMeta.seqno--;
-    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
-    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected exists");
-    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 4,
-          "Expected set meta conflict resolution failure");
+static enum test_result test_set_vbuckets(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    std::vector<uint16_t> vbuckets;
+    for (uint16_t vb = 1; vb < 8; ++vb) {
+        vbuckets.push_back(vb);
+    }
+    protocol_binary_request_header *pkt;
+    pkt = createSetVBucketsPacket(vbuckets, vbucket_state_replica);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Set vbuckets call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the vbuckets to be set");
+    for (uint16_t vb = 1; vb < 8; ++vb) {
+        check(verify_vbucket_state(h, h1, vb, vbucket_state_replica),
+              "Expected a replica vbucket");
+    }
 
-    itemMeta.seqno += 10;
-    set_with_meta(h, h1, "key", 3, NULL, 0, 0, &itemMeta, 0);
-    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
-    check(get_int_stat(h, h1, "ep_num_ops_set_meta_res_fail") == 4,
-          "Expected set meta conflict resolution failure");
+    // One vbucket out of range and none of them change.
+    vbuckets.push_back(65535);
+    pkt = createSetVBucketsPacket(vbuckets, vbucket_state_active);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Set vbuckets call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_ERANGE,
+          "Expected the vbucket to be out of range");
+    check(verify_vbucket_state(h, h1, 3, vbucket_state_replica),
+          "Expected the vbucket to be left alone");
 
-    check(get_int_stat(h, h1, "ep_bg_meta_fetched") == 1,
-          "Expect one bg meta fetch");
+    vbuckets.pop_back();
+    pkt = createSetVBucketsPacket(vbuckets, vbucket_state_active);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Set vbuckets call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the vbuckets to be set");
+    for (uint16_t vb = 1; vb < 8; ++vb) {
+        check(verify_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Expected an active vbucket");
+    }
 
+    // A record cut short is refused.
+    pkt = createPacket(CMD_SET_VBUCKETS, 0, 0, NULL, 0, NULL, 0, "abc", 3);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Set vbuckets call failed");
+    free(pkt);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_EINVAL,
+          "Expected the packet to be refused");
     return SUCCESS;
 }
 
@@ -6141,6 +8228,111 @@ static enum test_result test_observe_single_key(ENGINE_HANDLE *h, ENGINE_HANDLE_
     return SUCCESS;
 }
 
+static enum test_result test_observe_wait_persisted(ENGINE_HANDLE *h,
+                                                   ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    uint64_t cas1;
+    check(h1->allocate(h, NULL, &it, "key", 3, 100, 0, 0)== ENGINE_SUCCESS,
+          "Allocation failed.");
+    check(h1->store(h, NULL, it, &cas1, OPERATION_SET, 0)== ENGINE_SUCCESS,
+          "Set should work.");
+    h1->release(h, NULL, it);
+
+    // The observe only answers once the key is on disk.
+    std::map<std::string, uint16_t> obskeys;
+    obskeys["key"] = 0;
+    observe(h, h1, obskeys, true);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
+
+    uint8_t persisted;
+    uint64_t cas;
+    memcpy(&persisted, last_body + 7, sizeof(uint8_t));
+    check(persisted == OBS_STATE_PERSISTED, "Expected persisted in result");
+    memcpy(&cas, last_body + 8, sizeof(uint64_t));
+    check(ntohll(cas) == cas1, "Wrong cas in result");
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "timings", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get timing stats");
+    bool found = false;
+    std::map<std::string, std::string>::iterator vit = vals.begin();
+    for (; vit != vals.end(); ++vit) {
+        found = found || vit->first.find("persistence_latency_") == 0;
+    }
+    check(found, "Expected the persistence latency histogram");
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "vbucket-details", 15,
+                        add_stats) == ENGINE_SUCCESS,
+          "Failed to get vbucket stats");
+    found = false;
+    for (vit = vals.begin(); vit != vals.end(); ++vit) {
+        found = found || vit->first.find("vb_0:persistence_latency_") == 0;
+    }
+    check(found, "Expected the vbucket's persistence latency histogram");
+
+    return SUCCESS;
+}
+
+static enum test_result test_key_durability(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    uint64_t cas1;
+    check(h1->allocate(h, NULL, &it, "key", 3, 100, 0, 0)== ENGINE_SUCCESS,
+          "Allocation failed.");
+    check(h1->store(h, NULL, it, &cas1, OPERATION_SET, 0)== ENGINE_SUCCESS,
+          "Set should work.");
+    h1->release(h, NULL, it);
+
+    // Blocks until the flusher persisted the mutation.
+    protocol_binary_request_header *pkt;
+    pkt = createPacket(CMD_KEY_DURABILITY, 0, cas1, NULL, 0, "key", 3);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Key durability call failed");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected the mutation to be persisted");
+    free(pkt);
+
+    std::map<std::string, uint16_t> obskeys;
+    obskeys["key"] = 0;
+    observe(h, h1, obskeys);
+    uint8_t persisted;
+    memcpy(&persisted, last_body + 7, sizeof(uint8_t));
+    check(persisted == OBS_STATE_PERSISTED, "Expected persisted in result");
+
+    // Nothing to wait for once it's on disk.
+    char flags = KEY_DURABILITY_PERSIST;
+    pkt = createPacket(CMD_KEY_DURABILITY, 0, cas1, &flags, 1, "key", 3);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Key durability call failed");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected success for a persisted mutation");
+    free(pkt);
+
+    pkt = createPacket(CMD_KEY_DURABILITY, 0, cas1 + 1, NULL, 0, "key", 3);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Key durability call failed");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS,
+          "Expected a cas mismatch");
+    free(pkt);
+
+    pkt = createPacket(CMD_KEY_DURABILITY, 0, 0, NULL, 0, "nokey", 5);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Key durability call failed");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT,
+          "Expected a missing key");
+    free(pkt);
+
+    pkt = createPacket(CMD_KEY_DURABILITY, 1, 0, NULL, 0, "key", 3);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Key durability call failed");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET,
+          "Expected not my vbucket");
+    free(pkt);
+
+    return SUCCESS;
+}
+
 static enum test_result test_observe_multi_key(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     // Create some vbuckets
     check(set_vbucket_state(h, h1, 1, vbucket_state_active), "Failed to set vbucket state.");
@@ -6504,6 +8696,98 @@ static enum test_result test_item_pager(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1)
     return SUCCESS;
 }
 
+static enum test_result test_quota_shrink_and_grow(ENGINE_HANDLE *h,
+                                                   ENGINE_HANDLE_V1 *h1) {
+    char data[1024];
+    memset(&data, 'x', sizeof(data)-1);
+    data[1023] = '\0';
+
+    for (int j = 0; j < 200; ++j) {
+        std::stringstream ss;
+        ss << "key-" << j;
+        item *i;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), data, &i)
+              == ENGINE_SUCCESS, "Failed to store a value");
+        h1->release(h, NULL, i);
+        check(h1->get(h, NULL, &i, ss.str().c_str(), ss.str().length(), 0)
+              == ENGINE_SUCCESS, "Failed to get a value");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    // Let go of the checkpoint holding the values, so ejecting them frees
+    // their memory.
+    createCheckpoint(h, h1);
+    useconds_t sleepTime = 128;
+    while (get_int_stat(h, h1, "ep_items_rm_from_checkpoints") < 200) {
+        decayingSleep(&sleepTime);
+    }
+
+    // A quota that puts memory use between the new watermarks, where the
+    // regular pager runs wouldn't free anything.
+    int memUsed = get_int_stat(h, h1, "mem_used");
+    std::stringstream smaller;
+    smaller << memUsed / 4 * 5;
+    set_param(h, h1, engine_param_flush, "max_size", smaller.str().c_str());
+    check(get_int_stat(h, h1, "ep_mem_high_wat") > memUsed,
+          "Expected memory use to be below the new high watermark");
+
+    wait_for_memory_usage_below(h, h1, get_int_stat(h, h1, "ep_mem_low_wat"));
+    check(get_int_stat(h, h1, "ep_quota_shrink_steps") > 0,
+          "Expected the pager to shrink to the new quota");
+    check(get_int_stat(h, h1, "ep_quota_shrink_ejects") > 0,
+          "Expected values to be ejected for the new quota");
+    check(get_int_stat(h, h1, "ep_num_non_resident") > 0,
+          "Expected some non-resident items");
+
+    int bgFetched = get_int_stat(h, h1, "ep_bg_fetched");
+    std::stringstream bigger;
+    bigger << memUsed * 4;
+    set_param(h, h1, engine_param_flush, "max_size", bigger.str().c_str());
+    wait_for_stat_change(h, h1, "ep_quota_warm_fetches", 0);
+    wait_for_stat_change(h, h1, "ep_bg_fetched", bgFetched);
+
+    return SUCCESS;
+}
+
+static enum test_result test_vb_mem_quota(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    char data[1024];
+    memset(&data, 'x', sizeof(data)-1);
+    data[1023] = '\0';
+
+    for (int j = 0; j < 100; ++j) {
+        std::stringstream ss;
+        ss << "key-" << j;
+        item *i;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), data, &i)
+              == ENGINE_SUCCESS, "Failed to store a value");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    int used = get_int_stat(h, h1, "vb_0:mem_used", "vbucket-details");
+    check(used >= get_int_stat(h, h1, "vb_0:ht_item_memory", "vbucket-details") +
+          get_int_stat(h, h1, "vb_0:checkpoint_memory", "vbucket-details"),
+          "Expected the vbucket's memory to cover its items and checkpoints");
+    check(get_int_stat(h, h1, "ep_vb_quota_pager_runs") == 0,
+          "Expected no vbucket quota runs without a quota");
+
+    std::stringstream quota;
+    quota << used / 2;
+    set_param(h, h1, engine_param_flush, "vb_mem_quota", quota.str().c_str());
+    check(get_int_stat(h, h1, "vb_0:mem_quota", "vbucket-details") == used / 2,
+          "Expected the vbucket to report its quota");
+
+    wait_for_stat_change(h, h1, "ep_vb_quota_ejects", 0);
+    check(get_int_stat(h, h1, "ep_vb_quota_pager_runs") > 0,
+          "Expected the pager to run for the vbucket over its quota");
+    check(get_int_stat(h, h1, "ep_num_non_resident") > 0,
+          "Expected some non-resident items");
+
+    return SUCCESS;
+}
+
 static enum test_result test_set_vbucket_out_of_range(ENGINE_HANDLE *h,
                                                        ENGINE_HANDLE_V1 *h1) {
     check(!set_vbucket_state(h, h1, 10000, vbucket_state_active),
@@ -7098,7 +9382,11 @@ static enum test_result prepare(engine_test_t *test) {
         return ret;
     }
 
-    if (strstr(test->cfg, "backend=couchdb") != NULL) {
+    if (strstr(test->cfg, "backend=leveldb") != NULL) {
+#ifndef HAVE_LEVELDB
+        return SKIPPED;
+#endif
+    } else if (strstr(test->cfg, "backend=couchdb") != NULL) {
 #ifndef HAVE_LIBCOUCHSTORE
         (void)mccouchMock;
         return SKIPPED;
@@ -7190,14 +9478,20 @@ public:
             ss << "flushall_enabled=true;";
         }
 
+        // A test may name the backend it runs on; couchstore otherwise.
+        bool leveldb = cfg != 0 && strstr(cfg, "backend=leveldb") != NULL;
         if (skip) {
             nm.append(" (skipped)");
             ret->tfun = skipped_test_function;
+        } else if (leveldb) {
+            nm.append(" (leveldb)");
         } else {
             nm.append(" (couchstore)");
         }
 
-        ss << "backend=couchdb;couch_response_timeout=3000";
+        if (!leveldb) {
+            ss << "backend=couchdb;couch_response_timeout=3000";
+        }
         ret->name = strdup(nm.c_str());
         std::string config = ss.str();
         if (config.length() == 0) {
@@ -7254,6 +9548,8 @@ engine_test_t* get_tests(void) {
                  NULL, prepare, cleanup),
         TestCase("unl",  test_unl, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("getl wait", test_getl_wait, test_setup, teardown,
+                 "getl_max_waiters=10", prepare, cleanup),
         TestCase("set+get hit (bin)", test_set_get_hit_bin,
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("set with cas non-existent", test_set_with_cas_non_existent,
@@ -7284,6 +9580,8 @@ engine_test_t* get_tests(void) {
                  NULL, prepare, cleanup),
         TestCase("test touch (MB-7342)", test_touch_mb7342, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("test touch ejected", test_touch_ejected, test_setup,
+                 teardown, NULL, prepare, cleanup),
         TestCase("test gat", test_gat, test_setup, teardown,
                  NULL, prepare, cleanup),
         TestCase("test gatq", test_gatq, test_setup, teardown,
@@ -7339,8 +9637,14 @@ engine_test_t* get_tests(void) {
                  teardown, NULL, prepare, cleanup),
         TestCase("expiry_no_items_warmup", test_bug3522, test_setup,
                  teardown, "exp_pager_stime=3", prepare, cleanup),
+        TestCase("expiry pager on the executor", test_bug3522, test_setup,
+                 teardown, "exp_pager_stime=3;dispatchers_on_executor=true",
+                 prepare, cleanup),
         TestCase("replica read", test_get_replica, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("replica read with max staleness",
+                 test_get_replica_max_staleness, test_setup, teardown, NULL,
+                 prepare, cleanup),
         TestCase("replica read: invalid state - active",
                  test_get_replica_active_state,
                  test_setup, teardown, NULL, prepare, cleanup),
@@ -7358,6 +9662,11 @@ engine_test_t* get_tests(void) {
                  NULL, prepare, cleanup),
         TestCase("test observe single key", test_observe_single_key, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("test observe waiting for persistence",
+                 test_observe_wait_persisted, test_setup, teardown,
+                 NULL, prepare, cleanup),
+        TestCase("test key durability", test_key_durability, test_setup,
+                 teardown, NULL, prepare, cleanup),
         TestCase("test observe multi key", test_observe_multi_key, test_setup, teardown,
                  NULL, prepare, cleanup),
         TestCase("test multiple observes", test_multiple_observes, test_setup, teardown,
@@ -7368,18 +9677,64 @@ engine_test_t* get_tests(void) {
                  teardown, NULL, prepare, cleanup),
         TestCase("test item pager", test_item_pager, test_setup,
                  teardown, "max_size=204800", prepare, cleanup),
+        TestCase("test item pager with time slices", test_item_pager,
+                 test_setup, teardown, "max_size=204800;visitor_time_slice=1",
+                 prepare, cleanup),
+        TestCase("test quota shrink and grow", test_quota_shrink_and_grow,
+                 test_setup, teardown, "max_size=10485760", prepare, cleanup),
+        TestCase("test vbucket memory quota", test_vb_mem_quota, test_setup,
+                 teardown, "max_size=10485760", prepare, cleanup),
         TestCase("warmup conf", test_warmup_conf, test_setup,
                  teardown, NULL, prepare, cleanup),
 
         // Stats tests
         TestCase("stats", test_stats, test_setup, teardown, NULL,
                  prepare, cleanup),
+        TestCase("stats max age", test_agg_stats_max_age, test_setup,
+                 teardown, "agg_stats_max_age=3600000", prepare, cleanup),
+        TestCase("delta stats", test_delta_stats, test_setup, teardown,
+                 NULL, prepare, cleanup),
+        TestCase("hotkeys stats", test_hotkeys_stats, test_setup, teardown,
+                 "hotkeys_sample_rate=1", prepare, cleanup),
+        TestCase("optrace stats", test_optrace_stats, test_setup, teardown,
+                 NULL, prepare, cleanup),
         TestCase("io stats", test_io_stats, test_setup, teardown,
                  NULL, prepare, cleanup),
         TestCase("bg stats", test_bg_stats, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("bg stats parallel fetchers", test_bg_stats, test_setup,
+                 teardown, "bg_fetchers_per_shard=4", prepare, cleanup),
+        TestCase("bg stats offloaded notify", test_bg_stats, test_setup,
+                 teardown, "bg_fetch_notify_offload=true", prepare, cleanup),
+        TestCase("timings summary", test_timings_summary, test_setup,
+                 teardown, NULL, prepare, cleanup),
+        TestCase("bg fetch batched", test_bg_fetch_batched, test_setup,
+                 teardown, "bg_fetch_latency_budget=20;bg_fetch_batch_size=2",
+                 prepare, cleanup),
+        TestCase("bg fetch readahead", test_bg_fetch_readahead, test_setup,
+                 teardown, "bg_fetch_readahead=2", prepare, cleanup),
         TestCase("bg meta stats", test_bg_meta_stats, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("db handle cache stats", test_db_handle_cache_stats,
+                 test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("kvtimings fs stats", test_kvtimings_fs_stats,
+                 test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("vbucket file compaction", test_compaction, test_setup,
+                 teardown,
+                 "compaction_threshold=10;compaction_min_file_size=0;"
+                 "compaction_check_interval=1", prepare, cleanup),
+        TestCase("vbucket file compaction purge", test_compaction_purge,
+                 test_setup, teardown,
+                 "compaction_threshold=50;compaction_min_file_size=0;"
+                 "compaction_check_interval=1;compaction_purge_age=1",
+                 prepare, cleanup),
+        TestCase("seqno stream after compaction purge",
+                 test_seqno_stream_after_purge, test_setup, teardown,
+                 "compaction_threshold=50;compaction_min_file_size=0;"
+                 "compaction_check_interval=1;compaction_purge_age=1",
+                 prepare, cleanup),
+        TestCase("bg stats direct reads", test_bg_stats, test_setup,
+                 teardown, "couch_direct_reads=true", prepare, cleanup),
         TestCase("mem stats", test_mem_stats, test_setup, teardown,
                  "chk_remover_stime=1;chk_period=60", prepare, cleanup),
         TestCase("stats key", test_key_stats, test_setup, teardown,
@@ -7390,10 +9745,14 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("warmup stats", test_warmup_stats, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("warmup from snapshot", test_warmup_snapshot, test_setup,
+                 teardown, "warmup_snapshot=true", prepare, cleanup),
         TestCase("stats curr_items", test_curr_items, test_setup,
                  teardown, NULL, prepare, cleanup),
         TestCase("startup token stat", test_cbd_225, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("async commit notifications", test_async_commit_notify,
+                 test_setup, teardown, NULL, prepare, cleanup),
         TestCase("mccouch notifier stat", test_notifier_stats, test_setup,
                  teardown, "max_num_workers=4", prepare, cleanup),
         TestCase("ep workload stat - read heavy", test_workload_stats_read_heavy,
@@ -7406,9 +9765,27 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown,
                  "max_num_workers=5; workload_optimization=mix",
                  prepare, cleanup),
+        TestCase("ep workload stat - auto", test_workload_stats_auto,
+                 test_setup, teardown,
+                 "max_num_workers=8; workload_optimization=auto",
+                 prepare, cleanup),
         TestCase("ep worker stats", test_worker_stats,
                  test_setup, teardown,
                  "max_num_workers=4", prepare, cleanup),
+        TestCase("ep task timings", test_task_timings,
+                 test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("ep worker groups", test_worker_groups,
+                 test_setup, teardown,
+                 "max_num_workers=4;max_num_auxio=2;max_num_nonio=0",
+                 prepare, cleanup),
+        TestCase("ep worker stats with work stealing", test_worker_stats,
+                 test_setup, teardown,
+                 "max_num_workers=4;executor_work_stealing=true",
+                 prepare, cleanup),
+        TestCase("ep worker stats with numa affinity", test_worker_stats,
+                 test_setup, teardown,
+                 "max_num_workers=4;executor_numa_affinity=true",
+                 prepare, cleanup),
 
         // eviction
         TestCase("value eviction", test_value_eviction, test_setup,
@@ -7454,12 +9831,35 @@ engine_test_t* get_tests(void) {
                  teardown, NULL, prepare, cleanup),
         TestCase("tap stream send deletes", test_tap_sends_deleted, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("tap stream mutation batches", test_tap_mutation_batch, test_setup,
+                 teardown, NULL, prepare, cleanup),
+        TestCase("tap disk backfill sends unpersisted items from memory",
+                 test_tap_disk_backfill_from_memory, test_setup, teardown,
+                 "tap_backfill_resident=1.5", prepare, cleanup),
+        TestCase("tap stream mutation batches skip large values",
+                 test_tap_mutation_batch_large_values, test_setup, teardown,
+                 "tap_mutation_batch_max_value=100", prepare, cleanup),
+        TestCase("tap receiver parallel apply", test_tap_rcvr_apply_parallel,
+                 test_setup, teardown, "tap_apply_parallel=true", prepare,
+                 cleanup),
+        TestCase("tap receiver throttle pacing", test_tap_rcvr_throttle_pacing,
+                 test_setup, teardown,
+                 "tap_throttle_pacing=true;tap_throttle_queue_cap=20;"
+                 "tap_throttle_cap_pcnt=0", prepare, cleanup),
+        TestCase("tap backfill controller", test_tap_backfill_controller,
+                 test_setup, teardown,
+                 "tap_backfill_bg_slo=1000000;tap_throttle_queue_cap=1;"
+                 "tap_throttle_cap_pcnt=0", prepare, cleanup),
         TestCase("tap tap sent from vb", test_sent_from_vb, test_setup,
                  teardown, NULL, prepare, cleanup),
         TestCase("tap agg stats", test_tap_agg_stats, test_setup,
                  teardown, NULL, prepare, cleanup),
         TestCase("tap takeover (with concurrent mutations)", test_tap_takeover,
                  test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("tap takeover with a final delta", test_tap_takeover_delta,
+                 test_setup, teardown,
+                 "tap_takeover_delta=100;tap_takeover_max_pause=60000",
+                 prepare, cleanup),
         TestCase("tap filter stream", test_tap_filter_stream,
                  test_setup, teardown,
                  "tap_keepalive=100;ht_size=129;ht_locks=3", prepare, cleanup),
@@ -7473,6 +9873,11 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown,
                  "tap_keepalive=100;ht_size=129;ht_locks=3;tap_backoff_period=0.05;chk_max_items=500",
                  prepare, cleanup),
+        TestCase("tap acks stream with a tuned window", test_tap_ack_stream,
+                 test_setup, teardown,
+                 "tap_keepalive=100;ht_size=129;ht_locks=3;tap_backoff_period=0.05;chk_max_items=500;"
+                 "tap_ack_interval=2;tap_ack_window_size=1;tap_ack_window_max=8",
+                 prepare, cleanup),
         TestCase("tap implicit acks stream", test_tap_implicit_ack_stream,
                  test_setup, teardown,
                  "tap_keepalive=100;ht_size=129;ht_locks=3;tap_backoff_period=0.05;tap_ack_initial_sequence_number=4294967290;chk_max_items=500",
@@ -7483,6 +9888,8 @@ engine_test_t* get_tests(void) {
         // restart tests
         TestCase("test restart", test_restart, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("ephemeral bucket", test_ephemeral_bucket, test_setup,
+                 teardown, "bucket_type=ephemeral", prepare, cleanup),
         TestCase("test restart with session stats", test_restart_session_stats, test_setup,
                  teardown, NULL, prepare, cleanup),
         TestCase("set+get+restart+hit (bin)", test_restart_bin_val,
@@ -7491,6 +9898,14 @@ engine_test_t* get_tests(void) {
                  teardown, NULL, prepare, cleanup),
         TestCase("flush multiv+restart", test_flush_multiv_restart,
                  test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("pipelined flush multiv+restart", test_flush_multiv_restart,
+                 test_setup, teardown, "flusher_pipeline=true",
+                 prepare, cleanup),
+        TestCase("group commit+restart", test_group_commit,
+                 test_setup, teardown, "group_commit_window=2000",
+                 prepare, cleanup),
+        TestCase("vbucket flush stats", test_vb_flush_stats,
+                 test_setup, teardown, NULL, prepare, cleanup),
         TestCase("test kill -9 bucket", test_kill9_bucket,
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("test shutdown with force", test_flush_shutdown_force,
@@ -7582,6 +9997,10 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("vbucket add (pending)", test_vb_add_pending,
                  test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("vbucket pending ops limit", test_vb_pending_ops_limit,
+                 test_setup, teardown,
+                 "pending_ops_limit=2;pending_ops_wake_batch=1",
+                 prepare, cleanup),
         TestCase("vbucket add (replica)", test_vb_add_replica,
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("vbucket cas (dead)", test_wrong_vb_cas,
@@ -7651,6 +10070,11 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown,
                  "chk_max_items=500;item_num_based_new_chk=true",
                  prepare, cleanup),
+        TestCase("checkpoint: cursor stats",
+                 test_cursor_checkpoint_stats,
+                 test_setup, teardown,
+                 "chk_max_items=500;item_num_based_new_chk=true",
+                 prepare, cleanup),
         TestCase("checkpoint: extend the open checkpoint",
                  test_extend_open_checkpoint,
                  test_setup, teardown,
@@ -7671,6 +10095,17 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown,
                  "chk_max_items=5000;chk_period=600",
                  prepare, cleanup),
+        TestCase("test batched checkpoint queueing",
+                 test_batched_checkpoint_queueing,
+                 test_setup, teardown,
+                 "chk_max_items=5000;chk_period=600;chk_queue_batch_size=64",
+                 prepare, cleanup),
+        TestCase("checkpoint: adaptive bounds",
+                 test_adaptive_checkpoint_bounds,
+                 test_setup, teardown,
+                 "adaptive_chk=true;chk_max_items=5000;chk_period=600;"
+                 "max_chk_mem_percent=1;max_size=1048576;chk_remover_stime=1",
+                 prepare, cleanup),
         TestCase("checkpoint: collapse checkpoints",
                  test_collapse_checkpoints,
                  test_setup, teardown,
@@ -7741,6 +10176,25 @@ engine_test_t* get_tests(void) {
         TestCase("test set meta conflict resolution",
                  test_set_meta_conflict_resolution, test_setup, teardown, NULL,
                  prepare, cleanup),
+        TestCase("test lww conflict resolution",
+                 test_lww_conflict_resolution, test_setup, teardown,
+                 "conflict_resolution_type=lww", prepare, cleanup),
+        TestCase("test with meta batch", test_with_meta_batch, test_setup,
+                 teardown, NULL, prepare, cleanup),
+        TestCase("test get meta batch", test_get_meta_batch, test_setup,
+                 teardown, NULL, prepare, cleanup),
+        TestCase("test get batch", test_get_batch, test_setup, teardown,
+                 NULL, prepare, cleanup),
+        TestCase("test admission control", test_admission_control,
+                 test_setup, teardown,
+                 "admission_set_rate=1;admission_burst_ms=1000", prepare,
+                 cleanup),
+        TestCase("test subdoc", test_subdoc, test_setup, teardown, NULL,
+                 prepare, cleanup),
+        TestCase("test range scan", test_range_scan, test_setup, teardown,
+                 NULL, prepare, cleanup),
+        TestCase("test set vbuckets", test_set_vbuckets, test_setup, teardown,
+                 NULL, prepare, cleanup),
         TestCase("temp item deletion", test_temp_item_deletion,
                  test_setup, teardown,
                  "exp_pager_stime=3", prepare, cleanup),
@@ -7769,6 +10223,23 @@ engine_test_t* get_tests(void) {
         TestCase("test del ret meta error", test_del_ret_meta_error,
                  test_setup, teardown, NULL, prepare, cleanup),
 
+        // leveldb backend tests
+        TestCase("test restart", test_restart, test_setup, teardown,
+                 "backend=leveldb", prepare, cleanup),
+        TestCase("flush+restart", test_flush_restart, test_setup, teardown,
+                 "flushall_enabled=true;backend=leveldb", prepare, cleanup),
+        TestCase("delete", test_delete, test_setup, teardown,
+                 "backend=leveldb", prepare, cleanup),
+        TestCase("get meta deleted", test_get_meta_deleted, test_setup,
+                 teardown, "backend=leveldb", prepare, cleanup),
+        TestCase("vbucket deletion doesn't affect new data", test_bug7023,
+                 test_setup, teardown, "backend=leveldb", prepare, cleanup),
+        TestCase("vbucket file compaction purge", test_compaction_purge,
+                 test_setup, teardown,
+                 "compaction_threshold=50;compaction_min_file_size=0;"
+                 "compaction_check_interval=1;compaction_purge_age=1;"
+                 "backend=leveldb", prepare, cleanup),
+
         TestCase(NULL, NULL, NULL, NULL, NULL, prepare, cleanup)
     };
 
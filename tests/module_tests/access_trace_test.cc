@@ -0,0 +1,117 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <sstream>
+#include <string>
+
+#include "access_trace.h"
+
+#define TRACE_FILE "/tmp/access_trace_test.trace"
+
+static void testEncoding() {
+    AccessTraceRecord rec;
+    rec.keyHash = 0x0102030405060708ULL;
+    rec.nbytes = 0xa0b0c0d0;
+    rec.vbucket = 1023;
+    rec.op = ACCESS_TRACE_SET;
+    rec.nkey = 250;
+
+    uint8_t buf[AccessTrace::RECORD_SIZE];
+    AccessTrace::encode(rec, buf);
+    assert(buf[0] == 0x01 && buf[7] == 0x08);
+
+    AccessTraceRecord out;
+    AccessTrace::decode(buf, out);
+    assert(out.keyHash == rec.keyHash);
+    assert(out.nbytes == rec.nbytes);
+    assert(out.vbucket == rec.vbucket);
+    assert(out.op == rec.op);
+    assert(out.nkey == rec.nkey);
+
+    assert(AccessTrace::hashKey("a") != AccessTrace::hashKey("b"));
+    assert(AccessTrace::hashKey("key") == AccessTrace::hashKey("key"));
+}
+
+static void testDisabled() {
+    AccessTrace trace;
+    assert(!trace.isEnabled());
+    trace.record(ACCESS_TRACE_GET, "k", 0, 10);
+    assert(trace.getRecorded() == 0);
+}
+
+static void testRecordAndRead() {
+    // More ops than fit in the buffer, so it's written out on the way.
+    const size_t ops = AccessTrace::BUFFER_RECORDS * 2 + 10;
+    {
+        AccessTrace trace;
+        assert(trace.start(TRACE_FILE));
+        assert(trace.isEnabled());
+        for (size_t i = 0; i < ops; ++i) {
+            std::stringstream ss;
+            ss << "key" << i;
+            access_trace_op_t op = static_cast<access_trace_op_t>(i % 3 + 1);
+            trace.record(op, ss.str(), static_cast<uint16_t>(i % 16), i);
+        }
+        assert(trace.getRecorded() == ops);
+        trace.stop();
+        assert(!trace.isEnabled());
+        trace.record(ACCESS_TRACE_GET, "after", 0, 0);
+        assert(trace.getRecorded() == ops);
+    }
+
+    AccessTraceReader reader;
+    assert(reader.open(TRACE_FILE));
+    AccessTraceRecord rec;
+    size_t n = 0;
+    while (reader.next(rec)) {
+        std::stringstream ss;
+        ss << "key" << n;
+        assert(rec.keyHash == AccessTrace::hashKey(ss.str()));
+        assert(rec.nkey == ss.str().size());
+        assert(rec.op == n % 3 + 1);
+        assert(rec.vbucket == n % 16);
+        assert(rec.nbytes == n);
+        ++n;
+    }
+    assert(n == ops);
+}
+
+static void testNotATrace() {
+    FILE *f = fopen(TRACE_FILE, "w");
+    assert(f);
+    fputs("this is not an access trace at all", f);
+    fclose(f);
+
+    AccessTraceReader reader;
+    assert(!reader.open(TRACE_FILE));
+    assert(!reader.open("/tmp/access_trace_test.missing"));
+}
+
+int main() {
+    testEncoding();
+    testDisabled();
+    testRecordAndRead();
+    testNotATrace();
+    unlink(TRACE_FILE);
+    return 0;
+}
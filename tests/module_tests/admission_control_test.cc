@@ -0,0 +1,121 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+
+#include "admission_control.h"
+
+static const hrtime_t MS = 1000000;
+
+static void testUnlimited() {
+    TokenBucket b;
+    for (int i = 0; i < 1000; ++i) {
+        assert(b.take(0));
+    }
+}
+
+static void testRefill() {
+    TokenBucket b;
+    // 1000 a second, 10 at once.
+    b.setRate(1000, 10, 0);
+    for (int i = 0; i < 10; ++i) {
+        assert(b.take(0));
+    }
+    assert(!b.take(0));
+
+    // One more every millisecond.
+    assert(b.take(MS));
+    assert(!b.take(MS));
+    assert(b.take(MS * 5 / 2));
+    assert(!b.take(MS * 5 / 2));
+    assert(b.take(MS * 3));
+
+    // It never holds more than its burst.
+    for (int i = 0; i < 10; ++i) {
+        assert(b.take(MS * 1000));
+    }
+    assert(!b.take(MS * 1000));
+
+    b.giveBack();
+    assert(b.take(MS * 1000));
+}
+
+static void testMinimumBurst() {
+    TokenBucket b;
+    // A burst shorter than a token's worth still lets one op through.
+    b.setRate(1, 10, 0);
+    assert(b.take(0));
+    assert(!b.take(0));
+    assert(!b.take(MS * 999));
+    assert(b.take(MS * 1000));
+}
+
+static void testAdmission() {
+    AdmissionControl ac;
+    ac.initialize(4);
+    for (int i = 0; i < 100; ++i) {
+        assert(ac.admit(ADMISSION_GET, 0));
+    }
+    // Nothing's counted while nothing's limited.
+    assert(ac.getAdmitted(ADMISSION_GET) == 0);
+
+    ac.setBurst(1000);
+    ac.setOpRate(ADMISSION_SET, 2);
+    assert(ac.admit(ADMISSION_SET, 0));
+    assert(ac.admit(ADMISSION_SET, 1));
+    assert(!ac.admit(ADMISSION_SET, 2));
+    assert(ac.admit(ADMISSION_GET, 2));
+    assert(ac.getAdmitted(ADMISSION_SET) == 2);
+    assert(ac.getRejected(ADMISSION_SET) == 1);
+    assert(ac.getRejected(ADMISSION_GET) == 0);
+
+    ac.setOpRate(ADMISSION_SET, 0);
+    ac.setVBucketRate(1);
+    assert(ac.admit(ADMISSION_GET, 3));
+    assert(!ac.admit(ADMISSION_DEL, 3));
+    assert(ac.admit(ADMISSION_DEL, 2));
+    assert(ac.getRejected(ADMISSION_DEL) == 1);
+    assert(ac.getVBucketRejected() == 1);
+
+    ac.reset();
+    assert(ac.getAdmitted(ADMISSION_GET) == 0);
+    assert(ac.getRejected(ADMISSION_SET) == 0);
+    assert(ac.getVBucketRejected() == 0);
+}
+
+static void testVBucketRejectGivesBack() {
+    AdmissionControl ac;
+    ac.initialize(2);
+    ac.setBurst(1000);
+    ac.setOpRate(ADMISSION_SET, 2);
+    ac.setVBucketRate(1);
+    assert(ac.admit(ADMISSION_SET, 0));
+    // Turned away by its vbucket, it doesn't use up the bucket's rate.
+    assert(!ac.admit(ADMISSION_SET, 0));
+    assert(ac.admit(ADMISSION_SET, 1));
+}
+
+int main() {
+    testUnlimited();
+    testRefill();
+    testMinimumBurst();
+    testAdmission();
+    testVBucketRejectGivesBack();
+    return 0;
+}
@@ -20,6 +20,8 @@
 #include <assert.h>
 #include <pthread.h>
 
+#include <vector>
+
 #include "atomic.h"
 #include "locks.h"
 #include "threadtests.h"
@@ -140,8 +142,48 @@ static void testOperators() {
     assert(Doodad::getNumInstances() == 0);
 }
 
+class QueuedDoodad : public Doodad, public MPSCQueueNode<QueuedDoodad> {
+public:
+    QueuedDoodad(int n) : num(n) {}
+
+    int num;
+};
+
+static void testMPSCQueueRCPtr() {
+    int before = Doodad::getNumInstances();
+    {
+        MPSCQueue<QueuedDoodad> queue;
+        {
+            RCPtr<QueuedDoodad> a(new QueuedDoodad(1));
+            RCPtr<QueuedDoodad> b(new QueuedDoodad(2));
+            queue.push(a);
+            queue.push(b);
+        }
+        // The queue kept them alive.
+        assert(Doodad::getNumInstances() == before + 2);
+        assert(queue.size() == 2);
+
+        std::vector<RCPtr<QueuedDoodad> > out;
+        assert(queue.drain(out) == 2);
+        assert(queue.empty());
+        assert(out.size() == 2);
+        assert(out[0]->num == 1);
+        assert(out[1]->num == 2);
+
+        // Once drained they can be queued again.
+        queue.push(out[1]);
+        out.clear();
+        assert(Doodad::getNumInstances() == before + 1);
+        assert(queue.drain(out) == 1);
+        assert(out[0]->num == 2);
+        assert(queue.drain(out) == 0);
+    }
+    assert(Doodad::getNumInstances() == before);
+}
+
 int main() {
     alarm(60);
     testOperators();
     testAtomicPtr();
+    testMPSCQueueRCPtr();
 }
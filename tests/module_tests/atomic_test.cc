@@ -59,6 +59,43 @@ static void testAtomicInt() {
     assert(intgen.latest() == (numThreads * numIterations));
 }
 
+class ShardedCounterTest : public Generator<size_t> {
+public:
+
+    size_t operator()() {
+        for (size_t j = 0; j < numIterations; j++) {
+            ++count;
+            count += 2;
+        }
+        return getCounterSlot();
+    }
+
+    size_t latest(void) { return count.get(); }
+
+private:
+    ShardedCounter<size_t> count;
+};
+
+static void testShardedCounter() {
+    ShardedCounterTest gen;
+    std::vector<size_t> r(getCompletedThreads<size_t>(numThreads, &gen));
+
+    // No increment was lost, whichever slots the threads shared.
+    assert(gen.latest() == numThreads * numIterations * 3);
+
+    // The threads were spread over all of the slots.
+    std::sort(r.begin(), r.end());
+    r.erase(std::unique(r.begin(), r.end()), r.end());
+    assert(r.size() == COUNTER_SLOTS);
+
+    ShardedCounter<size_t> c(5);
+    c++;
+    c.incr(4);
+    assert(c == 10);
+    c.set(0);
+    assert(c.get() == 0);
+}
+
 static void testSetIfLess() {
     Atomic<int> x;
 
@@ -79,9 +116,71 @@ static void testSetIfBigger() {
     assert(x.get() == 924);
 }
 
+struct QueuedItem : public MPSCQueueNode<QueuedItem> {
+    QueuedItem(size_t p = 0, size_t s = 0) : producer(p), seq(s) {}
+
+    size_t producer;
+    size_t seq;
+};
+
+/*
+ * All but one thread push their own items, which the one left drains
+ * while they're being pushed.
+ */
+class MPSCQueueTest : public Generator<size_t> {
+public:
+
+    MPSCQueueTest() : items(numThreads * numIterations) {
+        for (size_t i = 0; i < items.size(); ++i) {
+            items[i].producer = i / numIterations;
+            items[i].seq = i % numIterations;
+        }
+    }
+
+    size_t operator()() {
+        size_t me = nextThread++;
+        if (me != 0) {
+            for (size_t j = 0; j < numIterations; ++j) {
+                queue.push(&items[me * numIterations + j]);
+            }
+            return numIterations;
+        }
+
+        size_t expected = (numThreads - 1) * numIterations;
+        while (drained.size() < expected) {
+            queue.drain(drained);
+        }
+        return drained.size();
+    }
+
+    std::vector<QueuedItem> items;
+    std::vector<QueuedItem*> drained;
+    MPSCQueue<QueuedItem> queue;
+    Atomic<size_t> nextThread;
+};
+
+static void testMPSCQueue() {
+    MPSCQueueTest gen;
+    getCompletedThreads<size_t>(numThreads, &gen);
+
+    assert(gen.queue.empty());
+    assert(gen.queue.size() == 0);
+    assert(gen.drained.size() == (numThreads - 1) * numIterations);
+
+    // Each producer's items came out in the order it pushed them.
+    std::vector<size_t> next(numThreads, 0);
+    std::vector<QueuedItem*>::iterator it;
+    for (it = gen.drained.begin(); it != gen.drained.end(); ++it) {
+        assert((*it)->seq == next[(*it)->producer]);
+        ++next[(*it)->producer];
+    }
+}
+
 int main() {
     alarm(60);
     testAtomicInt();
+    testShardedCounter();
     testSetIfLess();
     testSetIfBigger();
+    testMPSCQueue();
 }
@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "bloomfilter.h"
+
+static std::string key(const char *prefix, int i) {
+    std::stringstream ss;
+    ss << prefix << i;
+    return ss.str();
+}
+
+static void testEmpty() {
+    BloomFilter bf(100, 0.01);
+    assert(bf.getNumKeys() == 0);
+    assert(!bf.maybeContains("a"));
+    assert(!bf.maybeContains(""));
+}
+
+static void testNoFalseNegatives() {
+    BloomFilter bf(1000, 0.01);
+    for (int i = 0; i < 1000; ++i) {
+        bf.add(key("key", i));
+    }
+    assert(bf.getNumKeys() == 1000);
+    for (int i = 0; i < 1000; ++i) {
+        assert(bf.maybeContains(key("key", i)));
+    }
+}
+
+static void testFalsePositiveRate() {
+    BloomFilter bf(1000, 0.01);
+    for (int i = 0; i < 1000; ++i) {
+        bf.add(key("key", i));
+    }
+    int falsePositives = 0;
+    for (int i = 0; i < 10000; ++i) {
+        if (bf.maybeContains(key("other", i))) {
+            ++falsePositives;
+        }
+    }
+    // 1% expected; allow for a poor hash distribution.
+    assert(falsePositives < 300);
+}
+
+static void testEstimates() {
+    BloomFilter bf(1000, 0.01);
+    assert(bf.getFalsePositiveRate() == 0.0);
+    assert(bf.estimateDistinctKeys() == 0);
+    for (int i = 0; i < 1000; ++i) {
+        bf.add(key("key", i));
+        // Adding a key again sets no new bits.
+        bf.add(key("key", i));
+    }
+    assert(bf.getNumKeys() == 2000);
+    size_t distinct = bf.estimateDistinctKeys();
+    assert(distinct > 900 && distinct < 1100);
+    double rate = bf.getFalsePositiveRate();
+    assert(rate > 0.005 && rate < 0.02);
+}
+
+int main() {
+    testEmpty();
+    testNoFalseNegatives();
+    testFalsePositiveRate();
+    testEstimates();
+
+    return 0;
+}
@@ -0,0 +1,210 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cassert>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "checkpoint_queue.h"
+
+extern "C" {
+static rel_time_t basic_current_time(void) {
+    return 0;
+}
+
+rel_time_t (*ep_current_time)() = basic_current_time;
+
+time_t ep_real_time() {
+    return time(NULL);
+}
+}
+
+static std::string keyOf(int i) {
+    std::stringstream ss;
+    ss << "key-" << i;
+    return ss.str();
+}
+
+static queued_item makeItem(int i) {
+    return queued_item(new QueuedItem(keyOf(i), 0, queue_op_set));
+}
+
+static std::vector<std::string> contents(CheckpointQueue &q) {
+    std::vector<std::string> keys;
+    CheckpointQueue::iterator it = q.begin();
+    for (; it != q.end(); ++it) {
+        keys.push_back((*it)->getKey());
+    }
+    return keys;
+}
+
+static void testQueueOrder() {
+    CheckpointQueue q;
+    assert(q.empty());
+    assert(q.begin() == q.end());
+
+    std::vector<std::string> expected;
+    for (int i = 0; i < 100; ++i) {
+        q.push_back(makeItem(i));
+        expected.push_back(keyOf(i));
+    }
+    assert(q.size() == 100);
+    assert(contents(q) == expected);
+    assert(q.back()->getKey() == keyOf(99));
+
+    std::vector<std::string> reversed;
+    CheckpointQueue::reverse_iterator rit = q.rbegin();
+    for (; rit != q.rend(); ++rit) {
+        reversed.push_back((*rit)->getKey());
+    }
+    assert(std::equal(reversed.rbegin(), reversed.rend(), expected.begin()));
+}
+
+static void testQueueEraseAndInsert() {
+    CheckpointQueue q;
+    std::vector<CheckpointQueue::iterator> positions;
+    for (int i = 0; i < 5; ++i) {
+        q.push_back(makeItem(i));
+        positions.push_back(--q.end());
+    }
+
+    // Moving an item to the back, as de-duplication does, leaves the
+    // other positions alone.
+    queued_item moved = *positions[1];
+    q.erase(positions[1]);
+    q.push_back(moved);
+    CheckpointQueue::iterator it = positions[0];
+    assert(*(++it) == *positions[2]);
+    assert(q.back()->getKey() == keyOf(1));
+
+    it = positions[0];
+    ++it;
+    CheckpointQueue::iterator added = q.insert(it, makeItem(9));
+    assert((*added)->getKey() == keyOf(9));
+    assert(*(--it) == *added);
+
+    q.pop_back();
+    std::vector<std::string> expected;
+    expected.push_back(keyOf(0));
+    expected.push_back(keyOf(9));
+    expected.push_back(keyOf(2));
+    expected.push_back(keyOf(3));
+    expected.push_back(keyOf(4));
+    assert(contents(q) == expected);
+}
+
+static void testQueueReusesNodes() {
+    CheckpointQueue q;
+    q.push_back(makeItem(0));
+    size_t memSize = q.getMemorySize();
+    assert(memSize > 0);
+
+    // Moving the one item around never needs another node.
+    for (int i = 0; i < 10000; ++i) {
+        queued_item qi = q.back();
+        q.erase(--q.end());
+        q.push_back(qi);
+    }
+    assert(q.size() == 1);
+    assert(q.getMemorySize() == memSize);
+}
+
+static void testIndex() {
+    const int numKeys = 5000;
+    CheckpointQueue q;
+    CheckpointIndex index;
+    for (int i = 0; i < numKeys; ++i) {
+        q.push_back(makeItem(i));
+        index_entry entry = {--q.end(), static_cast<uint64_t>(i)};
+        index.set(keyOf(i), entry);
+    }
+    assert(index.size() == static_cast<size_t>(numKeys));
+    assert(index.find("missing") == NULL);
+
+    // Drop every third key; the rest must still be found past the holes.
+    for (int i = 0; i < numKeys; i += 3) {
+        index.erase(keyOf(i));
+    }
+    for (int i = 0; i < numKeys; ++i) {
+        index_entry *entry = index.find(keyOf(i));
+        if (i % 3 == 0) {
+            assert(entry == NULL);
+        } else {
+            assert(entry != NULL);
+            assert(entry->mutation_id == static_cast<uint64_t>(i));
+            assert((*entry->position)->getKey() == keyOf(i));
+        }
+    }
+
+    // Setting an existing key updates it in place.
+    index_entry *entry = index.find(keyOf(1));
+    index_entry updated = {entry->position, 12345};
+    size_t size = index.size();
+    index.set(keyOf(1), updated);
+    assert(index.size() == size);
+    assert(index.find(keyOf(1))->mutation_id == 12345);
+}
+
+static void testQueuedItemPool() {
+    const size_t numItems = QueuedItemPool::BATCH_SIZE * 3;
+    size_t pooled = QueuedItemPool::getPooledBytes();
+
+    std::vector<QueuedItem*> items;
+    for (size_t i = 0; i < numItems; ++i) {
+        items.push_back(new QueuedItem(keyOf(i), 0, queue_op_set));
+    }
+    assert(QueuedItemPool::getPooledBytes() <= pooled);
+    pooled = QueuedItemPool::getPooledBytes();
+
+    // Every freed item is held for reuse, whether by this thread or, a
+    // batch at a time, by the shared pool.
+    for (size_t i = 0; i < numItems; ++i) {
+        delete items[i];
+    }
+    assert(QueuedItemPool::getPooledBytes() ==
+           pooled + numItems * sizeof(QueuedItem));
+    QueuedItemPool::releaseThreadCache();
+    assert(QueuedItemPool::getPooledBytes() ==
+           pooled + numItems * sizeof(QueuedItem));
+
+    // And the next items are made from them.
+    items.clear();
+    for (size_t i = 0; i < numItems; ++i) {
+        items.push_back(new QueuedItem(keyOf(i), 0, queue_op_set));
+        assert(items.back()->getKey() == keyOf(i));
+        assert(QueuedItemPool::getPooledBytes() ==
+               pooled + (numItems - i - 1) * sizeof(QueuedItem));
+    }
+    assert(QueuedItemPool::getPooledBytes() == pooled);
+    for (size_t i = 0; i < numItems; ++i) {
+        delete items[i];
+    }
+}
+
+int main() {
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    testQueueOrder();
+    testQueueEraseAndInsert();
+    testQueueReusesNodes();
+    testIndex();
+    testQueuedItemPool();
+    return 0;
+}
@@ -301,9 +301,204 @@ void test_reset_checkpoint_id() {
     assert(items.size() == 0);
 }
 
+void test_persistence_range() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats,
+                                       checkpoint_config, NULL));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1);
+
+    for (int i = 0; i < 10; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        queued_item qi(new QueuedItem (key.str(), 0, queue_op_set));
+        manager->queueDirty(qi, vbucket);
+    }
+    manager->createNewCheckpoint();
+
+    // The closed checkpoint comes back as a range, not as a copy.
+    PersistenceRange range;
+    std::vector<queued_item> items;
+    manager->getItemsForPersistence(range, items);
+    assert(items.empty());
+    assert(!range.empty());
+    range.getItems(items);
+    assert(items.size() == 12);
+    assert(items.front()->getOperation() == queue_op_checkpoint_start);
+    assert(items.back()->getOperation() == queue_op_checkpoint_end);
+
+    // Until the range is committed, the cursor keeps the closed checkpoint around.
+    assert(manager->getNumItemsForPersistence() == 10);
+    bool newCheckpointCreated;
+    assert(manager->removeClosedUnrefCheckpoints(vbucket, newCheckpointCreated) == 0);
+    assert(manager->getNumCheckpoints() == 2);
+
+    manager->commitPersistenceRange(range);
+    assert(manager->getNumItemsForPersistence() == 0);
+    assert(manager->getPersistenceCursorPreChkId() == 1);
+
+    // The items of the open checkpoint are copied as before.
+    items.clear();
+    manager->getItemsForPersistence(range, items);
+    assert(range.empty());
+    assert(items.size() == 1);
+    assert(items.front()->getOperation() == queue_op_checkpoint_start);
+    manager->commitPersistenceRange(range);
+
+    // Now the closed checkpoint and its 12 items can go.
+    assert(manager->removeClosedUnrefCheckpoints(vbucket, newCheckpointCreated) >= 12);
+    delete manager;
+}
+
+void test_shared_tap_walk() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats,
+                                       checkpoint_config, NULL));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1);
+    manager->registerTAPCursor("a");
+    manager->registerTAPCursor("b");
+    manager->registerTAPCursor("c");
+
+    for (int i = 0; i < 5; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        queued_item qi(new QueuedItem (key.str(), 0, queue_op_set));
+        manager->queueDirty(qi, vbucket);
+    }
+    manager->createNewCheckpoint();
+
+    // "c" gets ahead, so only "b" is taken along.
+    bool isLastItem;
+    queued_item qi = manager->nextItem("c", isLastItem);
+    assert(qi->getOperation() == queue_op_checkpoint_start);
+    std::list<std::string> others;
+    others.push_back("b");
+    others.push_back("c");
+    std::list<std::string> moved;
+    uint64_t epoch;
+    qi = manager->nextItem("a", isLastItem, others, moved, epoch);
+    assert(qi->getOperation() == queue_op_checkpoint_start);
+    assert(moved.size() == 1 && moved.front() == "b");
+
+    // Now they all meet and walk the mutations once.
+    for (int i = 0; i < 5; ++i) {
+        moved.clear();
+        qi = manager->nextItem("a", isLastItem, others, moved, epoch);
+        assert(qi->getOperation() == queue_op_set);
+        assert(moved.size() == 2);
+    }
+    assert(isLastItem);
+    assert(manager->getNumItemsForTAPConnection("b") ==
+           manager->getNumItemsForTAPConnection("a"));
+    assert(manager->getNumItemsForTAPConnection("c") ==
+           manager->getNumItemsForTAPConnection("a"));
+
+    // But each one goes past the checkpoint end on its own.
+    moved.clear();
+    qi = manager->nextItem("a", isLastItem, others, moved, epoch);
+    assert(qi->getOperation() == queue_op_checkpoint_end);
+    assert(moved.empty());
+    qi = manager->nextItem("a", isLastItem, others, moved, epoch);
+    assert(qi->getOperation() == queue_op_checkpoint_start);
+    assert(moved.empty());
+    qi = manager->nextItem("b", isLastItem);
+    assert(qi->getOperation() == queue_op_checkpoint_end);
+
+    // Moving the cursors back makes what they read so far stale.
+    uint64_t readEpoch = epoch;
+    assert(manager->getCursorEpoch() == readEpoch);
+    std::list<std::string> cursors;
+    cursors.push_back("b");
+    manager->resetTAPCursors(cursors);
+    assert(manager->getCursorEpoch() != readEpoch);
+    readEpoch = manager->getCursorEpoch();
+    manager->clear(vbucket_state_active);
+    assert(manager->getCursorEpoch() != readEpoch);
+    delete manager;
+}
+
+void test_resume_seqno() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats,
+                                       checkpoint_config, NULL));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1);
+    queued_item qi(new QueuedItem("key-1", 0, queue_op_set));
+    manager->queueDirty(qi, vbucket);
+    manager->notePersistedSeqno(10);
+    manager->createNewCheckpoint();
+    qi = queued_item(new QueuedItem("key-2", 0, queue_op_set));
+    manager->queueDirty(qi, vbucket);
+    manager->notePersistedSeqno(25);
+    manager->notePersistedSeqno(20);
+    manager->createNewCheckpoint();
+    assert(manager->getOpenCheckpointId() == 3);
+
+    // A stream lacking checkpoint 3 on wants what was persisted after 25,
+    // and its cursor starts at the oldest checkpoint.
+    uint64_t seqno = 0;
+    assert(manager->registerTAPCursorForResume("r", 3, seqno));
+    assert(seqno == 25);
+    assert(manager->getCheckpointIdForTAPCursor("r") == 1);
+    assert(manager->registerTAPCursorForResume("r", 2, seqno));
+    assert(seqno == 10);
+
+    // Nothing is known of checkpoints that are yet to come.
+    assert(!manager->registerTAPCursorForResume("s", 4, seqno));
+    assert(!manager->tapCursorExists("s"));
+
+    manager->clear(vbucket_state_active);
+    assert(!manager->registerTAPCursorForResume("s", 3, seqno));
+    delete manager;
+}
+
+void test_mutation_watermarks() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats,
+                                       checkpoint_config, NULL));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1);
+    std::vector<queued_item> queued;
+    for (int i = 0; i < 3; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        queued_item qi(new QueuedItem(key.str(), 0, queue_op_set));
+        manager->queueDirty(qi, vbucket);
+        queued.push_back(qi);
+    }
+    manager->createNewCheckpoint();
+    uint64_t first = queued[0]->getMutationId();
+    assert(first > 0);
+    assert(queued[1]->getMutationId() > first);
+    assert(queued[2]->getMutationId() > queued[1]->getMutationId());
+    uint64_t unpersisted = manager->getUnpersistedMutations();
+    assert(unpersisted >= 3);
+    assert(manager->getUnreplicatedMutations() == unpersisted);
+
+    // Each watermark only moves forward.
+    manager->notePersistedMutation(queued[2]->getMutationId());
+    manager->notePersistedMutation(first);
+    assert(manager->getUnpersistedMutations() == unpersisted -
+           queued[2]->getMutationId());
+    manager->noteReplicatedMutation(first);
+    assert(manager->getUnreplicatedMutations() == unpersisted - first);
+
+    // A mutation of a key already queued gets a new id.
+    queued_item qi(new QueuedItem("key-0", 0, queue_op_set));
+    manager->queueDirty(qi, vbucket);
+    manager->createNewCheckpoint();
+    assert(manager->getUnpersistedMutations() > 0);
+
+    manager->clear(vbucket_state_active);
+    assert(manager->getUnpersistedMutations() == 0);
+    assert(manager->getUnreplicatedMutations() == 0);
+    delete manager;
+}
+
 int main(int argc, char **argv) {
     (void)argc; (void)argv;
     putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
     basic_chk_test();
     test_reset_checkpoint_id();
+    test_persistence_range();
+    test_shared_tap_walk();
+    test_resume_seqno();
+    test_mutation_watermarks();
 }
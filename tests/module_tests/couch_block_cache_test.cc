@@ -0,0 +1,95 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <cassert>
+
+#include "couch-kvstore/couch-block-cache.h"
+
+static const size_t BS = CouchBlockCache::BLOCK_SIZE;
+
+static void fill(char *buf, char c) {
+    memset(buf, c, BS);
+}
+
+static void testGetPut() {
+    CouchBlockCache cache(1024 * BS);
+    char buf[BS];
+    char out[BS];
+    uint32_t id = cache.getFileId("/data/0.couch.1", 42);
+    assert(!cache.get(id, 0, out));
+
+    fill(buf, 'a');
+    cache.put(id, 0, buf);
+    fill(buf, 'b');
+    cache.put(id, 1, buf);
+    assert(cache.get(id, 0, out) && out[0] == 'a' && out[BS - 1] == 'a');
+    assert(cache.get(id, 1, out) && out[0] == 'b');
+    assert(!cache.get(id, 2, out));
+    assert(cache.getFileId("/data/0.couch.1", 42) == id);
+}
+
+static void testFiles() {
+    CouchBlockCache cache(1024 * BS);
+    char buf[BS];
+    char out[BS];
+    uint32_t id1 = cache.getFileId("/data/0.couch.1", 42);
+    uint32_t id2 = cache.getFileId("/data/1.couch.1", 43);
+    assert(id1 != id2);
+    fill(buf, 'a');
+    cache.put(id1, 0, buf);
+    assert(!cache.get(id2, 0, out));
+
+    // The same inode at the same path again after the file is created.
+    cache.invalidate("/data/0.couch.1");
+    uint32_t id3 = cache.getFileId("/data/0.couch.1", 42);
+    assert(id3 != id1);
+    assert(!cache.get(id3, 0, out));
+    assert(cache.getFileId("/data/1.couch.1", 43) == id2);
+}
+
+static void testEviction() {
+    // A block per partition
+    CouchBlockCache cache(1);
+    char buf[BS];
+    char out[BS];
+    uint32_t id = cache.getFileId("/data/0.couch.1", 42);
+    for (uint64_t b = 0; b < 1000; ++b) {
+        fill(buf, static_cast<char>(b));
+        cache.put(id, b, buf);
+    }
+    assert(cache.numEvictions > 0);
+    assert(cache.getMemUsed() <= 16 * (BS + sizeof(uint64_t)));
+    size_t found = 0;
+    for (uint64_t b = 0; b < 1000; ++b) {
+        if (cache.get(id, b, out)) {
+            assert(out[0] == static_cast<char>(b));
+            ++found;
+        }
+    }
+    assert(found > 0 && found <= 16);
+}
+
+int main() {
+    testGetPut();
+    testFiles();
+    testEviction();
+    return 0;
+}
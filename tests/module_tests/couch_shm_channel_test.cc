@@ -0,0 +1,244 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "couch-kvstore/couch-shm-channel.h"
+
+#define TMP_SOCK_PATH "/tmp/couch_shm_channel_test.sock"
+
+static int listenSock = -1;
+
+static void startListening() {
+    unlink(TMP_SOCK_PATH);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, TMP_SOCK_PATH, sizeof(addr.sun_path) - 1);
+    listenSock = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(listenSock != -1);
+    assert(bind(listenSock, reinterpret_cast<struct sockaddr*>(&addr),
+                sizeof(addr)) == 0);
+    assert(listen(listenSock, 4) == 0);
+}
+
+static void stopListening() {
+    close(listenSock);
+    unlink(TMP_SOCK_PATH);
+}
+
+/**
+ * Connect a channel and take its other side, as couchdb would.
+ */
+static CouchShmChannel *connectPeer(CouchShmChannel &channel) {
+    assert(channel.connect());
+    int sock = accept(listenSock, NULL, NULL);
+    assert(sock != -1);
+    CouchShmChannel *peer = CouchShmChannel::accept(sock);
+    assert(peer != NULL);
+    return peer;
+}
+
+/**
+ * Take the other side of a channel without a CouchShmChannel, as a peer
+ * that doesn't play by the rules would, and map its segment.
+ */
+static ShmSegmentHeader *connectRawPeer(CouchShmChannel &channel, int *sock) {
+    assert(channel.connect());
+    *sock = accept(listenSock, NULL, NULL);
+    assert(*sock != -1);
+    char data[sizeof(SHM_CHANNEL_MAGIC) - 1 + sizeof(uint64_t)];
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    assert(recvmsg(*sock, &msg, MSG_WAITALL) ==
+           static_cast<ssize_t>(sizeof(data)));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    assert(cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    void *p = mmap(NULL, sizeof(ShmSegmentHeader) + 2 * CouchShmChannel::RING_SIZE,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    assert(p != MAP_FAILED);
+    for (int ii = 0; ii < 3; ++ii) {
+        close(fds[ii]);
+    }
+    return static_cast<ShmSegmentHeader*>(p);
+}
+
+static bool rung(int fd) {
+    struct pollfd fds;
+    fds.fd = fd;
+    fds.events = POLLIN;
+    fds.revents = 0;
+    return poll(&fds, 1, 0) == 1;
+}
+
+static ssize_t sendString(CouchShmChannel &channel, const std::string &data) {
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(data.data());
+    iov.iov_len = data.length();
+    return channel.sendmsg(&iov, 1);
+}
+
+static std::string recvAll(CouchShmChannel &channel) {
+    std::string rv;
+    char buf[8192];
+    ssize_t nr;
+    while ((nr = channel.recv(buf, sizeof(buf))) > 0) {
+        rv.append(buf, nr);
+    }
+    assert(nr == -1 && errno == EWOULDBLOCK);
+    return rv;
+}
+
+static void testNoPeer() {
+    CouchShmChannel channel("/tmp/couch_shm_channel_test.nobody");
+    assert(!channel.connect());
+    assert(!channel.isOpen());
+    char c;
+    assert(channel.recv(&c, 1) == 0);
+    assert(channel.sendmsg(NULL, 0) == -1 && errno == EPIPE);
+}
+
+static void testRoundTrip() {
+    CouchShmChannel channel(TMP_SOCK_PATH);
+    CouchShmChannel *peer = connectPeer(channel);
+
+    char buf[16];
+    assert(peer->recv(buf, sizeof(buf)) == -1 && errno == EWOULDBLOCK);
+    assert(!rung(peer->getDoorbellFd()));
+
+    // A packet from iovecs, as the notifier sends it.
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<char*>("hel");
+    iov[0].iov_len = 3;
+    iov[1].iov_base = const_cast<char*>("lo");
+    iov[1].iov_len = 2;
+    assert(channel.sendmsg(iov, 2) == 5);
+    assert(rung(peer->getDoorbellFd()));
+    assert(recvAll(*peer) == "hello");
+    assert(!rung(peer->getDoorbellFd()));
+
+    assert(sendString(*peer, "world") == 5);
+    assert(rung(channel.getDoorbellFd()));
+    assert(recvAll(channel) == "world");
+    delete peer;
+}
+
+static void testFullAndWrapped() {
+    CouchShmChannel channel(TMP_SOCK_PATH);
+    CouchShmChannel *peer = connectPeer(channel);
+    size_t size = CouchShmChannel::RING_SIZE;
+
+    // Reading more than half of the ring rings for the room.
+    std::string big(size - 10, 'a');
+    assert(sendString(channel, big) == static_cast<ssize_t>(big.length()));
+    assert(recvAll(*peer) == big);
+    assert(rung(channel.getDoorbellFd()));
+
+    // The next write goes around the end of the ring.
+    std::string wrapped;
+    for (int i = 0; i < 100; ++i) {
+        wrapped.push_back(static_cast<char>('0' + i % 10));
+    }
+    assert(sendString(channel, wrapped) == 100);
+    assert(recvAll(*peer) == wrapped);
+
+    // Only what fits goes in.
+    assert(sendString(channel, std::string(size + 10, 'b')) ==
+           static_cast<ssize_t>(size));
+    assert(sendString(channel, "c") == -1 && errno == EWOULDBLOCK);
+    assert(recvAll(*peer) == std::string(size, 'b'));
+    delete peer;
+}
+
+static void testPeerGone() {
+    CouchShmChannel channel(TMP_SOCK_PATH);
+    CouchShmChannel *peer = connectPeer(channel);
+    assert(sendString(*peer, "last") == 4);
+    delete peer;
+
+    // What it wrote is still read, and then it's gone.
+    char buf[16];
+    assert(channel.recv(buf, sizeof(buf)) == 4);
+    assert(memcmp(buf, "last", 4) == 0);
+    assert(channel.recv(buf, sizeof(buf)) == 0);
+
+    struct pollfd fds;
+    fds.fd = channel.getControlFd();
+    fds.events = POLLIN;
+    fds.revents = 0;
+    assert(poll(&fds, 1, 0) == 1);
+}
+
+static void testBrokenPeer() {
+    CouchShmChannel channel(TMP_SOCK_PATH);
+    int sock;
+    ShmSegmentHeader *segment = connectRawPeer(channel, &sock);
+    size_t size = CouchShmChannel::RING_SIZE;
+
+    // The ring size in the segment isn't the one we go by.
+    segment->ringSize = ~0ULL;
+    assert(sendString(channel, "hello") == 5);
+    assert(segment->toPeer.head == 5);
+
+    // A peer that read what was never written breaks the channel...
+    segment->toPeer.tail = 6;
+    assert(sendString(channel, "world") == -1 && errno == EPIPE);
+
+    // ... and so does one that wrote more than the ring holds.
+    char buf[16];
+    segment->fromPeer.head = size + 1;
+    assert(channel.recv(buf, sizeof(buf)) == -1 && errno == EPROTO);
+    segment->fromPeer.head = size;
+    assert(channel.recv(buf, sizeof(buf)) == sizeof(buf));
+
+    munmap(segment, sizeof(ShmSegmentHeader) + 2 * size);
+    close(sock);
+}
+
+int main() {
+    testNoPeer();
+    startListening();
+    testRoundTrip();
+    testFullAndWrapped();
+    testPeerGone();
+    testBrokenPeer();
+    stopListening();
+    return 0;
+}
@@ -0,0 +1,149 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <string>
+
+#include "couch-kvstore/couch-value-log.h"
+
+#define TMP_LOG_DIR "/tmp/value_log_test"
+
+static bool exists(const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+static void cleanup() {
+    for (uint32_t gen = 1; gen < 10; ++gen) {
+        remove(CouchValueLog::getPath(TMP_LOG_DIR, 3, gen).c_str());
+    }
+    rmdir(TMP_LOG_DIR);
+}
+
+static void testPointer() {
+    ValueLogPointer ptr;
+    ptr.generation = 7;
+    ptr.offset = 1ULL << 40;
+    ptr.length = 123456;
+    ptr.crc = 0xdeadbeef;
+    ptr.compressed = true;
+    char buf[ValueLogPointer::SIZE];
+    ptr.encode(buf);
+
+    ValueLogPointer out;
+    assert(out.decode(buf, sizeof(buf)));
+    assert(out.generation == 7);
+    assert(out.offset == 1ULL << 40);
+    assert(out.length == 123456);
+    assert(out.crc == 0xdeadbeef);
+    assert(out.compressed);
+
+    assert(!out.decode(buf, sizeof(buf) - 1));
+    buf[0] = 'x';
+    assert(!out.decode(buf, sizeof(buf)));
+}
+
+static void testAppendAndRead() {
+    cleanup();
+    mkdir(TMP_LOG_DIR, 0777);
+    ValueLogPointer a, b;
+    std::string big(10000, 'a');
+    {
+        CouchValueLog log(TMP_LOG_DIR);
+        assert(log.append(3, big.data(), big.size(), false, a));
+        assert(log.append(3, "bbb", 3, true, b));
+        assert(log.sync(3));
+        assert(a.generation == 1 && a.offset == 0);
+        assert(b.generation == 1 && b.offset == big.size());
+        assert(b.compressed);
+        assert(log.getSize() == big.size() + 3);
+
+        std::string value;
+        assert(log.read(3, b, value) && value == "bbb");
+        assert(log.read(3, a, value) && value == big);
+
+        // A pointer whose crc doesn't match the bytes is refused.
+        ValueLogPointer bad(b);
+        ++bad.crc;
+        assert(!log.read(3, bad, value));
+    }
+
+    // The log is taken over, and appended to after what it has.
+    CouchValueLog log(TMP_LOG_DIR);
+    assert(log.getSize() == big.size() + 3);
+    std::string value;
+    assert(log.read(3, a, value) && value == big);
+    ValueLogPointer c;
+    assert(log.append(3, "ccc", 3, false, c));
+    assert(c.generation == 1 && c.offset == big.size() + 3);
+    cleanup();
+}
+
+static void testCompaction() {
+    cleanup();
+    mkdir(TMP_LOG_DIR, 0777);
+    CouchValueLog log(TMP_LOG_DIR);
+    std::string big(CouchValueLog::REWRITE_MIN_SIZE, 'a');
+    ValueLogPointer a, b;
+    assert(log.append(3, big.data(), big.size(), false, a));
+    assert(log.append(3, big.data(), big.size(), false, b));
+
+    // Nothing is known of the garbage before a compaction measures it.
+    assert(log.startCompaction(3) == 0);
+    log.finishCompaction(3, 0, big.size());
+    assert(log.getSize() == 2 * big.size());
+
+    // Half of it is garbage, which isn't enough yet.
+    assert(log.startCompaction(3) == 0);
+    log.finishCompaction(3, 0, big.size() / 2);
+
+    uint32_t gen = log.startCompaction(3);
+    assert(gen == 2);
+    ValueLogPointer moved;
+    std::string value;
+    assert(log.read(3, b, value));
+    assert(log.append(3, value.data(), value.size() / 2, false, moved));
+    assert(moved.generation == 2);
+    log.finishCompaction(3, gen, moved.length);
+    assert(!exists(CouchValueLog::getPath(TMP_LOG_DIR, 3, 1)));
+    assert(exists(CouchValueLog::getPath(TMP_LOG_DIR, 3, 2)));
+    assert(log.getSize() == moved.length);
+    assert(log.read(3, moved, value) && value.size() == moved.length);
+
+    log.remove(3);
+    assert(!exists(CouchValueLog::getPath(TMP_LOG_DIR, 3, 2)));
+    assert(log.getSize() == 0);
+    ValueLogPointer next;
+    assert(log.append(3, "x", 1, false, next));
+    assert(next.generation == 3 && next.offset == 0);
+    cleanup();
+}
+
+int main() {
+    testPointer();
+    testAppendAndRead();
+    testCompaction();
+    return 0;
+}
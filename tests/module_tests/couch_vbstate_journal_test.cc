@@ -0,0 +1,177 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+
+#include "couch-kvstore/couch-vbstate-journal.h"
+
+#define TMP_JOURNAL_FILE "/tmp/vbstate_journal_test.journal"
+
+static off_t fileSize(const char *path) {
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return st.st_size;
+}
+
+static void testAppendAndRead() {
+    remove(TMP_JOURNAL_FILE);
+    vbucket_map_t m;
+    assert(!CouchVBStateJournal::read(TMP_JOURNAL_FILE, m));
+    {
+        CouchVBStateJournal journal(TMP_JOURNAL_FILE);
+        vbucket_map_t states;
+        states[0] = vbucket_state(vbucket_state_active, 2, 10, 5);
+        states[1] = vbucket_state(vbucket_state_replica, 3, 0);
+        assert(journal.append(states));
+
+        states.clear();
+        states[0] = vbucket_state(vbucket_state_dead, 4, 11, 5);
+        assert(journal.append(states));
+        assert(journal.getNumRecords() == 3);
+    }
+
+    assert(CouchVBStateJournal::read(TMP_JOURNAL_FILE, m));
+    assert(m.size() == 2);
+    assert(m[0].state == vbucket_state_dead);
+    assert(m[0].checkpointId == 4);
+    assert(m[0].maxDeletedSeqno == 11);
+    assert(m[0].purgeSeqno == 5);
+    assert(m[1].state == vbucket_state_replica);
+    assert(m[1].checkpointId == 3);
+    remove(TMP_JOURNAL_FILE);
+}
+
+static void testRemove() {
+    remove(TMP_JOURNAL_FILE);
+    {
+        CouchVBStateJournal journal(TMP_JOURNAL_FILE);
+        vbucket_map_t states;
+        states[5] = vbucket_state(vbucket_state_active, 1, 0);
+        states[6] = vbucket_state(vbucket_state_active, 1, 0);
+        assert(journal.append(states));
+        assert(journal.remove(5));
+        // Nothing is written for a vbucket it has no state of
+        assert(journal.remove(7));
+        assert(journal.getNumRecords() == 3);
+    }
+
+    vbucket_map_t m;
+    assert(CouchVBStateJournal::read(TMP_JOURNAL_FILE, m));
+    assert(m.size() == 1);
+    assert(m.find(6) != m.end());
+    remove(TMP_JOURNAL_FILE);
+}
+
+static void testReopenRewrites() {
+    remove(TMP_JOURNAL_FILE);
+    {
+        CouchVBStateJournal journal(TMP_JOURNAL_FILE);
+        vbucket_map_t states;
+        for (uint64_t i = 0; i < 10; ++i) {
+            states[0] = vbucket_state(vbucket_state_active, i, 0);
+            assert(journal.append(states));
+        }
+    }
+    assert(fileSize(TMP_JOURNAL_FILE) ==
+           static_cast<off_t>(10 * CouchVBStateJournal::RECORD_SIZE));
+
+    CouchVBStateJournal journal(TMP_JOURNAL_FILE);
+    assert(journal.getNumRecords() == 1);
+    assert(fileSize(TMP_JOURNAL_FILE) ==
+           static_cast<off_t>(CouchVBStateJournal::RECORD_SIZE));
+    vbucket_map_t m;
+    assert(CouchVBStateJournal::read(TMP_JOURNAL_FILE, m));
+    assert(m[0].checkpointId == 9);
+    remove(TMP_JOURNAL_FILE);
+}
+
+static void testRewriteWhenGrown() {
+    remove(TMP_JOURNAL_FILE);
+    CouchVBStateJournal journal(TMP_JOURNAL_FILE);
+    vbucket_map_t states;
+    states[0] = vbucket_state(vbucket_state_active, 0, 0);
+    states[1] = vbucket_state(vbucket_state_replica, 0, 0);
+    size_t most = 0;
+    for (uint64_t i = 0; i < 2000; ++i) {
+        states[0].checkpointId = i;
+        assert(journal.append(states));
+        most = std::max(most, journal.getNumRecords());
+    }
+    assert(most < 2000);
+    assert(journal.getNumRecords() < most);
+
+    vbucket_map_t m;
+    assert(CouchVBStateJournal::read(TMP_JOURNAL_FILE, m));
+    assert(m.size() == 2);
+    assert(m[0].checkpointId == 1999);
+    remove(TMP_JOURNAL_FILE);
+}
+
+static void testTornTail() {
+    remove(TMP_JOURNAL_FILE);
+    {
+        CouchVBStateJournal journal(TMP_JOURNAL_FILE);
+        vbucket_map_t states;
+        states[0] = vbucket_state(vbucket_state_active, 1, 0);
+        assert(journal.append(states));
+        states[0] = vbucket_state(vbucket_state_replica, 2, 0);
+        assert(journal.append(states));
+    }
+    // Cut the last record short, as a crash in the middle of it would.
+    off_t size = fileSize(TMP_JOURNAL_FILE);
+    assert(truncate(TMP_JOURNAL_FILE, size - 3) == 0);
+
+    vbucket_map_t m;
+    assert(CouchVBStateJournal::read(TMP_JOURNAL_FILE, m));
+    assert(m[0].state == vbucket_state_active);
+    assert(m[0].checkpointId == 1);
+
+    // A record that doesn't match its crc ends the journal too.
+    {
+        CouchVBStateJournal journal(TMP_JOURNAL_FILE);
+        vbucket_map_t states;
+        states[1] = vbucket_state(vbucket_state_pending, 3, 0);
+        assert(journal.append(states));
+    }
+    int fd = open(TMP_JOURNAL_FILE, O_WRONLY);
+    assert(fd != -1);
+    char c = 'x';
+    assert(pwrite(fd, &c, 1, CouchVBStateJournal::RECORD_SIZE + 20) == 1);
+    close(fd);
+    m.clear();
+    assert(CouchVBStateJournal::read(TMP_JOURNAL_FILE, m));
+    assert(m.size() == 1);
+    assert(m.find(0) != m.end());
+    remove(TMP_JOURNAL_FILE);
+}
+
+int main() {
+    testAppendAndRead();
+    testRemove();
+    testReopenRewrites();
+    testRewriteWhenGrown();
+    testTornTail();
+    return 0;
+}
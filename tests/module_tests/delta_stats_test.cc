@@ -0,0 +1,99 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+#include <cstring>
+
+#include "delta_stats.h"
+
+static void add(stat_map_t &stats, const char *key, const char *val) {
+    DeltaStats::collect(key, static_cast<uint16_t>(strlen(key)),
+                        val, static_cast<uint32_t>(strlen(val)), &stats);
+}
+
+static void testDeltas() {
+    DeltaStats deltas;
+    stat_map_t stats;
+    stat_list_t changed;
+
+    add(stats, "a", "1");
+    add(stats, "b", "2");
+    add(stats, "c", "3");
+    uint64_t cursor = deltas.update(0, "", stats, changed);
+    assert(cursor != 0);
+    assert(changed.size() == 3);
+    assert(stats.empty());
+
+    // b changed, c went away and d's new.
+    add(stats, "a", "1");
+    add(stats, "b", "20");
+    add(stats, "d", "4");
+    changed.clear();
+    uint64_t next = deltas.update(cursor, "", stats, changed);
+    assert(next != cursor);
+    assert(changed.size() == 3);
+    assert(changed[0] == std::make_pair(std::string("b"), std::string("20")));
+    assert(changed[1] == std::make_pair(std::string("c"), std::string()));
+    assert(changed[2] == std::make_pair(std::string("d"), std::string("4")));
+
+    // Nothing changed.
+    add(stats, "a", "1");
+    add(stats, "b", "20");
+    add(stats, "d", "4");
+    changed.clear();
+    cursor = deltas.update(next, "", stats, changed);
+    assert(changed.empty());
+
+    // Another group starts over.
+    add(stats, "x", "1");
+    changed.clear();
+    deltas.update(cursor, "timings", stats, changed);
+    assert(changed.size() == 1);
+}
+
+static void testDroppedCursors() {
+    DeltaStats deltas;
+    stat_map_t stats;
+    stat_list_t changed;
+
+    add(stats, "a", "1");
+    uint64_t first = deltas.update(0, "", stats, changed);
+    for (size_t i = 0; i < DeltaStats::MAX_CURSORS; ++i) {
+        add(stats, "a", "1");
+        deltas.update(0, "", stats, changed);
+    }
+
+    // The first cursor's gone, so all the stats are sent again.
+    add(stats, "a", "1");
+    changed.clear();
+    deltas.update(first, "", stats, changed);
+    assert(changed.size() == 1);
+
+    // An unknown cursor is treated the same way.
+    add(stats, "a", "1");
+    changed.clear();
+    deltas.update(12345678, "", stats, changed);
+    assert(changed.size() == 1);
+}
+
+int main() {
+    testDeltas();
+    testDroppedCursors();
+    return 0;
+}
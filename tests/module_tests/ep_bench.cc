@@ -0,0 +1,500 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Microbenchmarks of the data structures on the hot paths.
+ *
+ * Each benchmark is run with 1, 2, 4... threads up to the most asked
+ * for, each thread doing the same number of ops, and prints a line of
+ *
+ *   <benchmark> <threads> <ops per thread> <ns per op> <ops per second>
+ *
+ * where the ns per op is the mean of what each thread took, and the ops
+ * per second are those of all the threads together.  Lines starting with
+ * a # are comments.
+ *
+ * usage: ep_bench [-n ops per thread] [-t most threads] [benchmark...]
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "checkpoint.h"
+#include "ep_time.h"
+#include "histo.h"
+#include "item.h"
+#include "mutation_log.h"
+#include "queueditem.h"
+#include "stats.h"
+#include "stored-value.h"
+#include "vbucket.h"
+
+#include "threadtests.h"
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    static time_t basic_abs_time(rel_time_t) {
+        return time(NULL);
+    }
+}
+
+EPStats global_stats;
+CheckpointConfig checkpoint_config;
+
+#define BENCH_MUTATION_LOG "/tmp/ep_bench_mutation.log"
+
+/**
+ * A benchmark.  setup() and teardown() run around each run of it, and
+ * run() is what's timed, called by every thread at once.
+ */
+class Bench {
+public:
+    Bench(const char *n, size_t mt = 0) : name(n), maxThreads(mt) {}
+    virtual ~Bench() {}
+
+    virtual void setup(size_t nthreads, size_t ops) {
+        (void)nthreads; (void)ops;
+    }
+
+    virtual void run(size_t thread, size_t ops) = 0;
+
+    virtual void teardown() {}
+
+    const char *getName() const {
+        return name;
+    }
+
+    //! The most threads the structure can be used from, or 0 for any
+    size_t getMaxThreads() const {
+        return maxThreads;
+    }
+
+protected:
+    //! The key of an op of a thread, the same on every run
+    static std::string keyOf(size_t thread, size_t i) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "key-%lu-%lu",
+                 static_cast<unsigned long>(thread),
+                 static_cast<unsigned long>(i));
+        return std::string(buf);
+    }
+
+private:
+    const char *name;
+    size_t maxThreads;
+
+    DISALLOW_COPY_AND_ASSIGN(Bench);
+};
+
+//! Times a bench's run() on one of the threads, returning its ns
+class BenchGenerator : public Generator<hrtime_t> {
+public:
+    BenchGenerator(Bench &b, size_t o) : bench(b), ops(o), nextThread(0) {}
+
+    hrtime_t operator()() {
+        size_t thread = nextThread++;
+        hrtime_t start = gethrtime();
+        bench.run(thread, ops);
+        return gethrtime() - start;
+    }
+
+private:
+    Bench &bench;
+    size_t ops;
+    Atomic<size_t> nextThread;
+};
+
+class HashTableSetBench : public Bench {
+public:
+    HashTableSetBench() : Bench("hashtable_set"), ht(NULL) {}
+
+    void setup(size_t, size_t) {
+        ht = new HashTable(global_stats);
+    }
+
+    void run(size_t thread, size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            std::string key(keyOf(thread, i));
+            Item itm(key, 0, 0, key.data(), key.length());
+            ht->set(itm);
+        }
+    }
+
+    void teardown() {
+        delete ht;
+    }
+
+protected:
+    HashTableSetBench(const char *n) : Bench(n), ht(NULL) {}
+
+    HashTable *ht;
+};
+
+//! Fills the table before the run, for the benchmarks of what's in it
+class HashTableFilledBench : public HashTableSetBench {
+public:
+    HashTableFilledBench(const char *n) : HashTableSetBench(n) {}
+
+    void setup(size_t nthreads, size_t ops) {
+        HashTableSetBench::setup(nthreads, ops);
+        for (size_t t = 0; t < nthreads; ++t) {
+            HashTableSetBench::run(t, ops);
+        }
+    }
+};
+
+class HashTableFindBench : public HashTableFilledBench {
+public:
+    HashTableFindBench() : HashTableFilledBench("hashtable_find") {}
+
+    void run(size_t thread, size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            std::string key(keyOf(thread, i));
+            StoredValue *v = ht->find(key);
+            assert(v);
+        }
+    }
+
+protected:
+    HashTableFindBench(const char *n) : HashTableFilledBench(n) {}
+};
+
+//! The same finds in a power-of-two table, which hashes with murmur3
+class HashTablePowerOfTwoFindBench : public HashTableFindBench {
+public:
+    HashTablePowerOfTwoFindBench()
+        : HashTableFindBench("hashtable_find_pow2") {}
+
+    void setup(size_t nthreads, size_t ops) {
+        HashTable::setDefaultPowerOfTwo(true);
+        HashTableFindBench::setup(nthreads, ops);
+        HashTable::setDefaultPowerOfTwo(false);
+    }
+};
+
+class HashTableDelBench : public HashTableFilledBench {
+public:
+    HashTableDelBench() : HashTableFilledBench("hashtable_del") {}
+
+    void run(size_t thread, size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            bool deleted = ht->del(keyOf(thread, i));
+            assert(deleted);
+        }
+    }
+};
+
+class CheckpointQueueDirtyBench : public Bench {
+public:
+    CheckpointQueueDirtyBench() : Bench("checkpoint_queue_dirty"),
+                                  manager(NULL) {}
+
+    void setup(size_t, size_t) {
+        vbucket.reset(new VBucket(0, vbucket_state_active, global_stats,
+                                  checkpoint_config, NULL));
+        manager = new CheckpointManager(global_stats, 0, checkpoint_config, 1);
+    }
+
+    void run(size_t thread, size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            queued_item qi(new QueuedItem(keyOf(thread, i), 0, queue_op_set));
+            manager->queueDirty(qi, vbucket);
+        }
+    }
+
+    void teardown() {
+        delete manager;
+        vbucket.reset();
+    }
+
+protected:
+    CheckpointQueueDirtyBench(const char *n) : Bench(n), manager(NULL) {}
+
+    RCPtr<VBucket> vbucket;
+    CheckpointManager *manager;
+};
+
+//! Every thread walks its own TAP cursor over the items all of them queued
+class CheckpointNextItemBench : public CheckpointQueueDirtyBench {
+public:
+    CheckpointNextItemBench() :
+        CheckpointQueueDirtyBench("checkpoint_next_item") {}
+
+    void setup(size_t nthreads, size_t ops) {
+        CheckpointQueueDirtyBench::setup(nthreads, ops);
+        for (size_t t = 0; t < nthreads; ++t) {
+            manager->registerTAPCursor(keyOf(t, 0));
+        }
+        // One thread's worth of items, so each thread takes ops of them
+        CheckpointQueueDirtyBench::run(0, ops);
+    }
+
+    void run(size_t thread, size_t ops) {
+        std::string name(keyOf(thread, 0));
+        size_t taken(0);
+        while (taken < ops) {
+            bool isLastItem = false;
+            queued_item qi = manager->nextItem(name, isLastItem);
+            if (qi->getOperation() == queue_op_set) {
+                ++taken;
+            } else if (qi->getOperation() == queue_op_empty) {
+                break;
+            }
+        }
+        assert(taken == ops);
+    }
+};
+
+class HistogramAddBench : public Bench {
+public:
+    HistogramAddBench() : Bench("histogram_add") {}
+
+    void setup(size_t, size_t) {
+        histo.reset();
+    }
+
+    void run(size_t thread, size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            histo.add(static_cast<hrtime_t>((i + thread) & 0xffff));
+        }
+    }
+
+private:
+    Histogram<hrtime_t> histo;
+};
+
+class HdrHistogramAddBench : public Bench {
+public:
+    HdrHistogramAddBench() : Bench("hdr_histogram_add") {}
+
+    void setup(size_t, size_t) {
+        histo.reset();
+    }
+
+    void run(size_t thread, size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            histo.add(static_cast<hrtime_t>((i + thread) & 0xffff));
+        }
+    }
+
+private:
+    HdrHistogram<hrtime_t> histo;
+};
+
+class BenchQueueItem : public MPSCQueueNode<BenchQueueItem> {
+};
+
+//! Every thread pushes, and each drains the queue every so often
+class MPSCQueueBench : public Bench {
+public:
+    MPSCQueueBench() : Bench("mpsc_queue_push") {}
+
+    static const size_t DRAIN_EVERY = 1024;
+
+    void setup(size_t nthreads, size_t ops) {
+        items.resize(nthreads * ops);
+    }
+
+    void run(size_t thread, size_t ops) {
+        std::vector<BenchQueueItem*> out;
+        for (size_t i = 0; i < ops; ++i) {
+            queue.push(&items[thread * ops + i]);
+            if (i % DRAIN_EVERY == DRAIN_EVERY - 1) {
+                LockHolder lh(drainLock);
+                out.clear();
+                queue.drain(out);
+            }
+        }
+    }
+
+    void teardown() {
+        std::vector<BenchQueueItem*> out;
+        queue.drain(out);
+        assert(queue.empty());
+        items.clear();
+    }
+
+private:
+    MPSCQueue<BenchQueueItem> queue;
+    std::vector<BenchQueueItem> items;
+    Mutex drainLock;
+};
+
+class BenchValue : public RCValue {
+};
+
+//! Every thread copies the one pointer, as readers of a shared value do
+class RCPtrCopyBench : public Bench {
+public:
+    RCPtrCopyBench() : Bench("rcptr_copy"), value(new BenchValue()) {}
+
+    void run(size_t, size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            RCPtr<BenchValue> copy(value);
+            assert(copy.get());
+        }
+    }
+
+private:
+    RCPtr<BenchValue> value;
+};
+
+//! The log, like its writer, is used from one thread
+class MutationLogBench : public Bench {
+public:
+    MutationLogBench() : Bench("mutation_log_write", 1), log(NULL) {}
+
+    static const size_t COMMIT_EVERY = 1000;
+
+    void setup(size_t, size_t) {
+        remove(BENCH_MUTATION_LOG);
+        log = new MutationLog(BENCH_MUTATION_LOG);
+        log->open();
+        assert(log->isEnabled());
+    }
+
+    void run(size_t thread, size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            log->newItem(i % 1024, keyOf(thread, i), i);
+            if (i % COMMIT_EVERY == COMMIT_EVERY - 1) {
+                log->commit1();
+                log->commit2();
+            }
+        }
+        log->commit1();
+        log->commit2();
+    }
+
+    void teardown() {
+        delete log;
+        remove(BENCH_MUTATION_LOG);
+    }
+
+private:
+    MutationLog *log;
+};
+
+static void runBench(Bench &bench, size_t nthreads, size_t ops) {
+    bench.setup(nthreads, ops);
+    BenchGenerator gen(bench, ops);
+    std::vector<hrtime_t> times(getCompletedThreads<hrtime_t>(nthreads, &gen));
+    bench.teardown();
+
+    hrtime_t total(0), slowest(0);
+    std::vector<hrtime_t>::iterator it;
+    for (it = times.begin(); it != times.end(); ++it) {
+        total += *it;
+        slowest = std::max(slowest, *it);
+    }
+    double nsPerOp = static_cast<double>(total) / (nthreads * ops);
+    double opsPerSec = slowest == 0 ? 0 :
+        (nthreads * ops) * 1000000000.0 / slowest;
+    printf("%s %lu %lu %.1f %.0f\n", bench.getName(),
+           static_cast<unsigned long>(nthreads),
+           static_cast<unsigned long>(ops), nsPerOp, opsPerSec);
+    fflush(stdout);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-n ops per thread] [-t most threads] "
+            "[benchmark...]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    size_t ops(100000);
+    size_t maxThreads(4);
+    int c;
+    while ((c = getopt(argc, argv, "n:t:")) != -1) {
+        switch (c) {
+        case 'n':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            maxThreads = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (ops == 0 || maxThreads == 0) {
+        usage(argv[0]);
+    }
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    ep_current_time = basic_current_time;
+    ep_abs_time = basic_abs_time;
+
+    HashTableSetBench htSet;
+    HashTableFindBench htFind;
+    HashTablePowerOfTwoFindBench htFindPow2;
+    HashTableDelBench htDel;
+    CheckpointQueueDirtyBench chkQueueDirty;
+    CheckpointNextItemBench chkNextItem;
+    HistogramAddBench histoAdd;
+    HdrHistogramAddBench hdrHistoAdd;
+    MPSCQueueBench mpscQueue;
+    RCPtrCopyBench rcptrCopy;
+    MutationLogBench mutationLog;
+    Bench *benches[] = { &htSet, &htFind, &htFindPow2, &htDel,
+                         &chkQueueDirty, &chkNextItem, &histoAdd,
+                         &hdrHistoAdd, &mpscQueue, &rcptrCopy, &mutationLog };
+    size_t numBenches = sizeof(benches) / sizeof(benches[0]);
+
+    for (int i = optind; i < argc; ++i) {
+        bool known(false);
+        for (size_t b = 0; b < numBenches; ++b) {
+            known = known || strcmp(argv[i], benches[b]->getName()) == 0;
+        }
+        if (!known) {
+            fprintf(stderr, "Unknown benchmark: %s\n", argv[i]);
+            usage(argv[0]);
+        }
+    }
+
+    printf("# benchmark threads ops ns_per_op ops_per_sec\n");
+    for (size_t b = 0; b < numBenches; ++b) {
+        Bench &bench(*benches[b]);
+        bool wanted(optind == argc);
+        for (int i = optind; i < argc; ++i) {
+            wanted = wanted || strcmp(argv[i], bench.getName()) == 0;
+        }
+        if (!wanted) {
+            continue;
+        }
+        size_t most = maxThreads;
+        if (bench.getMaxThreads() != 0) {
+            most = std::min(most, bench.getMaxThreads());
+        }
+        for (size_t n = 1; n <= most; n *= 2) {
+            runBench(bench, n, ops);
+        }
+    }
+    return 0;
+}
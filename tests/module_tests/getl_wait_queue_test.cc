@@ -0,0 +1,105 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "getl_wait_queue.h"
+
+static const void *cookie(int n) {
+    return reinterpret_cast<const void*>(0x1000 + n);
+}
+
+static void testDisabled() {
+    GetlWaitQueue q;
+    assert(!q.add(0, "k", cookie(1), 10));
+    assert(q.empty());
+}
+
+static void testRelease() {
+    GetlWaitQueue q;
+    q.setMaxWaiters(10);
+    assert(q.add(0, "k", cookie(1), 10));
+    assert(q.add(0, "k", cookie(2), 10));
+    assert(q.add(1, "k", cookie(3), 10));
+    assert(q.add(0, "other", cookie(4), 10));
+    assert(q.size() == 4);
+
+    std::vector<const void*> cookies;
+    q.release(0, "k", cookies);
+    assert(cookies.size() == 2);
+    assert(cookies[0] == cookie(1));
+    assert(cookies[1] == cookie(2));
+    assert(q.size() == 2);
+
+    // Nobody's left on it.
+    cookies.clear();
+    q.release(0, "k", cookies);
+    assert(cookies.empty());
+
+    q.release(1, "k", cookies);
+    assert(cookies.size() == 1);
+    assert(cookies[0] == cookie(3));
+    assert(q.size() == 1);
+}
+
+static void testExpire() {
+    GetlWaitQueue q;
+    q.setMaxWaiters(10);
+    assert(q.add(0, "a", cookie(1), 10));
+    assert(q.add(0, "a", cookie(2), 20));
+    assert(q.add(0, "b", cookie(3), 10));
+
+    std::vector<const void*> cookies;
+    // Still locked through its expiry.
+    q.expire(10, cookies);
+    assert(cookies.empty());
+
+    q.expire(11, cookies);
+    assert(cookies.size() == 2);
+    assert(q.size() == 1);
+
+    cookies.clear();
+    q.release(0, "a", cookies);
+    assert(cookies.size() == 1);
+    assert(cookies[0] == cookie(2));
+    assert(q.empty());
+}
+
+static void testFull() {
+    GetlWaitQueue q;
+    q.setMaxWaiters(2);
+    assert(q.add(0, "k", cookie(1), 10));
+    assert(q.add(0, "k", cookie(2), 10));
+    assert(!q.add(0, "k", cookie(3), 10));
+    assert(q.size() == 2);
+
+    std::vector<const void*> cookies;
+    q.release(0, "k", cookies);
+    assert(q.add(0, "k", cookie(3), 10));
+}
+
+int main() {
+    testDisabled();
+    testRelease();
+    testExpire();
+    testFull();
+    return 0;
+}
@@ -18,6 +18,7 @@
 #include "config.h"
 
 #include <ep.h>
+#include <eviction_policy.h>
 #include <item.h>
 #include <signal.h>
 #include <stats.h>
@@ -25,6 +26,8 @@
 #include <algorithm>
 #include <cassert>
 #include <limits>
+#include <set>
+#include <sstream>
 
 #include "threadtests.h"
 
@@ -282,6 +285,1256 @@ static void testResize() {
     verifyFound(h, keys);
 }
 
+static void testReserve() {
+    HashTable h(global_stats, 5, 3);
+
+    // Sized for the keys before they're stored, as at warmup.
+    h.reserve(5000);
+    h.completeResize();
+    assert(h.getSize() == 6143);
+    assert(!h.isResizing());
+
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+    verifyFound(h, keys);
+
+    // It only ever grows.
+    h.reserve(10);
+    assert(h.getSize() == 6143);
+    h.resize();
+    assert(h.getSize() == 6143);
+    verifyFound(h, keys);
+}
+
+static void testIdleSize() {
+    HashTable::setDefaultIdleSize(47);
+    HashTable active(global_stats);
+    HashTable h(global_stats, 0, 0, true);
+    HashTable::setDefaultIdleSize(0);
+    assert(active.getSize() == HashTable::getNumBuckets());
+    assert(!active.isIdle());
+    assert(h.getSize() == 47);
+    assert(h.isIdle());
+
+    // It stays idle up to one item per bucket.
+    global_stats.htGrowPending.set(false);
+    std::vector<std::string> keys = generateKeys(47);
+    storeMany(h, keys);
+    h.resize();
+    assert(h.getSize() == 47);
+    assert(!global_stats.htGrowPending.get());
+
+    // One more asks the resizer to grow it to the full size.
+    std::string k("one_more");
+    store(h, k);
+    assert(global_stats.htGrowPending.get());
+    h.resize();
+    h.completeResize();
+    assert(h.getSize() == HashTable::getNumBuckets());
+    keys.push_back(k);
+    verifyFound(h, keys);
+
+    // Down to half as many items as its idle size, it idles again.
+    for (int i = 0; i < 24; ++i) {
+        assert(h.del(keys[i]));
+    }
+    h.resize();
+    assert(h.getSize() == HashTable::getNumBuckets());
+    assert(h.del(keys[24]));
+    h.resize();
+    h.completeResize();
+    assert(h.getSize() == 47);
+    verifyFound(h, std::vector<std::string>(keys.begin() + 25, keys.end()));
+
+    // Unless it's not allowed to.
+    h.setIdleAllowed(false);
+    h.reserve(h.getNumItems());
+    h.completeResize();
+    assert(h.getSize() == HashTable::getNumBuckets());
+    h.clear();
+    h.resize();
+    assert(!h.isIdle());
+    h.setIdleAllowed(true);
+    h.resize();
+    assert(h.isIdle());
+}
+
+static void testIncrementalResize() {
+    HashTable h(global_stats, 5, 3);
+
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+
+    h.resize(6143);
+    assert(h.getSize() == 6143);
+    assert(h.isResizing());
+
+    // Lookups and mutations work while items are split across tables.
+    std::vector<std::string> half(keys.begin(), keys.begin() + 2500);
+    verifyFound(h, half);
+    std::string k(keys[4000]);
+    assert(h.del(k));
+    store(h, k);
+
+    assert(h.resizeStep(2));
+    while (h.resizeStep(1)) {
+        // Keep stepping until the old table is drained.
+    }
+    assert(!h.isResizing());
+    verifyFound(h, keys);
+
+    // A visitor finishes any pending resize before walking.
+    h.resize(769);
+    assert(h.isResizing());
+    assert(count(h) == 5000);
+    assert(!h.isResizing());
+}
+
+class IncrementalResizeGenerator : public Generator<bool> {
+public:
+
+    IncrementalResizeGenerator(const std::vector<std::string> &k,
+                               HashTable &h) : keys(k), ht(h) {}
+
+    bool operator()() {
+        if (++started == 1) {
+            // The first thread resizes back and forth in small steps
+            // while the others keep looking things up.
+            for (int i = 0; i < 50; ++i) {
+                ht.resize(i % 2 == 0 ? 30011 : 6143);
+                while (ht.resizeStep(7)) {
+                    // Drain.
+                }
+            }
+        } else {
+            for (int i = 0; i < 10; ++i) {
+                verifyFound(ht, keys);
+            }
+        }
+        return true;
+    }
+
+private:
+    std::vector<std::string>  keys;
+    HashTable                &ht;
+    Atomic<int>               started;
+};
+
+static void testConcurrentIncrementalResize() {
+    HashTable h(global_stats, 5, 3);
+
+    std::vector<std::string> keys = generateKeys(20000);
+    storeMany(h, keys);
+
+    IncrementalResizeGenerator gen(keys, h);
+    getCompletedThreads(8, &gen);
+
+    assert(count(h) == 20000);
+}
+
+class SharedReadGenerator : public Generator<bool> {
+public:
+
+    SharedReadGenerator(const std::vector<std::string> &k,
+                        HashTable &h) : keys(k), ht(h) {}
+
+    bool operator()() {
+        if (++started == 1) {
+            // One writer keeps replacing values and resizing under
+            // the readers' feet.
+            for (int i = 0; i < 5; ++i) {
+                std::vector<std::string>::iterator it;
+                for (it = keys.begin(); it != keys.end(); ++it) {
+                    Item itm(*it, 0, 0, it->c_str(), it->length());
+                    assert(ht.set(itm) == WAS_DIRTY);
+                }
+                ht.resize(i % 2 == 0 ? 12289 : 769);
+            }
+            return true;
+        }
+
+        for (int i = 0; i < 10; ++i) {
+            std::vector<std::string>::iterator it;
+            for (it = keys.begin(); it != keys.end(); ++it) {
+                int bucket_num(0);
+                BucketReaderHolder rlh = ht.getReadLockedBucket(*it, &bucket_num);
+                StoredValue *v = ht.unlocked_find(*it, bucket_num);
+                assert(v);
+                assert(v->getValue()->to_s() == *it);
+            }
+        }
+        return true;
+    }
+
+private:
+    std::vector<std::string>  keys;
+    HashTable                &ht;
+    Atomic<int>               started;
+};
+
+static void testSharedReads() {
+    HashTable::setDefaultRWLocks(true);
+    HashTable h(global_stats, 5, 3);
+    HashTable::setDefaultRWLocks(false);
+
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+
+    SharedReadGenerator gen(keys, h);
+    getCompletedThreads(8, &gen);
+
+    assert(count(h) == 5000);
+    verifyFound(h, keys);
+}
+
+static void testInlineValues() {
+    global_stats.reset();
+    HashTable::setDefaultInlineValueSize(32);
+    HashTable h(global_stats, 5, 1);
+    HashTable::setDefaultInlineValueSize(0);
+
+    std::string k("counter");
+    std::string small("12");
+    Item i(k, 0, 0, small.c_str(), small.length());
+    assert(h.set(i) == WAS_CLEAN);
+
+    StoredValue *v = h.find(k);
+    assert(v && v->isInlineValue());
+    assert(v->getValue()->to_s() == small);
+    assert(v->valuelen() == small.length());
+    assert(h.cacheSize.get() == v->size());
+    size_t inlineSize = v->size();
+
+    // Growing within the reserved space stays inline...
+    std::string bigger("12345678");
+    Item i2(k, 0, 0, bigger.c_str(), bigger.length());
+    h.set(i2);
+    v = h.find(k);
+    assert(v->isInlineValue());
+    assert(v->getValue()->to_s() == bigger);
+
+    // ...but a larger value goes out to a Blob.
+    std::string large(100, 'x');
+    Item i3(k, 0, 0, large.c_str(), large.length());
+    h.set(i3);
+    v = h.find(k);
+    assert(!v->isInlineValue());
+    assert(v->getValue()->to_s() == large);
+    // The space reserved inline is still allocated, so still counted.
+    assert(v->size() == inlineSize + large.length());
+    assert(h.cacheSize.get() == v->size());
+
+    // Inline values aren't ejected since that wouldn't free anything.
+    std::string k2("flag");
+    Item i4(k2, 0, 0, "1", 1);
+    h.set(i4);
+    v = h.find(k2);
+    v->markClean();
+    assert(!v->ejectValue(global_stats, h));
+    assert(v->isResident());
+
+    std::vector<std::string> keys = generateKeys(500);
+    storeMany(h, keys);
+    assert(count(h, false) == 502);
+    h.clear();
+    assert(h.memSize.get() == 0);
+    assert(h.cacheSize.get() == 0);
+}
+
+static void testCompressedValues() {
+    global_stats.reset();
+    HashTable::setDefaultInlineValueSize(32);
+    HashTable h(global_stats, 5, 1);
+    HashTable::setDefaultInlineValueSize(0);
+
+    // Small values aren't worth it.
+    std::string small("12");
+    Item i("small", 0, 0, small.c_str(), small.length());
+    assert(!i.compressValue());
+
+    // A compressed value never goes inline, or it would lose its datatype.
+    std::string k("key");
+    value_t packed(Blob::New("abcd", 4, BLOB_DATATYPE_SNAPPY));
+    Item i2(k, 0, 0, packed);
+    h.set(i2);
+    StoredValue *v = h.find(k);
+    assert(!v->isInlineValue());
+    assert(v->getValue()->isCompressed());
+
+    if (!Blob::isCompressionAvailable()) {
+        return;
+    }
+
+    std::string doc;
+    for (int j = 0; j < 50; ++j) {
+        doc.append("{\"name\": \"value\"}");
+    }
+    Item i3(k, 0, 0, doc.c_str(), doc.length());
+    assert(i3.compressValue());
+    assert(i3.getValue()->isCompressed());
+    assert(i3.getNBytes() < doc.length());
+    h.set(i3);
+    v = h.find(k);
+    assert(v->getValue()->isCompressed());
+    assert(h.cacheSize.get() == v->size());
+
+    Item *out = v->toItem(false, 0);
+    assert(out->decompressValue());
+    assert(!out->getValue()->isCompressed());
+    assert(out->getValue()->to_s() == doc);
+    delete out;
+
+    // A resident value is compressed in place, as replicas' are.
+    std::string k2("replica");
+    Item i4(k2, 0, 0, doc.c_str(), doc.length());
+    h.set(i4);
+    v = h.find(k2);
+    size_t before = h.cacheSize.get();
+    size_t saved = v->compressValue(h);
+    assert(saved > 0);
+    assert(v->getValue()->isCompressed());
+    assert(h.cacheSize.get() == before - saved);
+    assert(v->compressValue(h) == 0);
+    out = v->toItem(false, 0);
+    assert(out->decompressValue());
+    assert(out->getValue()->to_s() == doc);
+    delete out;
+
+    h.clear();
+    assert(h.cacheSize.get() == 0);
+}
+
+static void testPowerOfTwo() {
+    HashTable::setDefaultPowerOfTwo(true);
+    HashTable h(global_stats, 5, 3);
+    HashTable::setDefaultPowerOfTwo(false);
+    assert(h.isPowerOfTwo());
+    assert(h.getSize() == 8);
+    assert(h.getNumLocks() == 4);
+
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+    verifyFound(h, keys);
+
+    h.resize(6000);
+    assert(h.getSize() == 8192);
+    verifyFound(h, keys);
+
+    h.resize();
+    assert(h.getSize() == 8192 || h.getSize() == 4096);
+    assert(count(h) == 5000);
+}
+
+static void testSlabAllocator() {
+    SlabAllocator *arena = new SlabAllocator();
+    SlabAllocator &slabs = *arena;
+
+    // Size classes cover every request and round up.
+    for (size_t len = 1; len <= SLAB_MAX_CHUNK_SIZE; ++len) {
+        uint8_t cls = slabs.getSlabClass(len);
+        assert(slabs.getChunkSize(cls) >= len);
+        if (cls > 1) {
+            assert(slabs.getChunkSize(cls - 1) < len);
+        }
+    }
+
+    // Anything allocated off the arena is still released to the heap.
+    global_stats.reset();
+    Blob *heapBlob = Blob::New("heap", 4);
+    SlabAllocator::setCurrent(arena);
+    slabs.setEnabled(true);
+    HashTable h(global_stats, 5, 1);
+
+    std::vector<std::string> keys = generateKeys(2000);
+    storeMany(h, keys);
+    std::string large(2 * SLAB_MAX_CHUNK_SIZE, 'x');
+    Item big("big", 0, 0, large.c_str(), large.length());
+    h.set(big);
+    assert(count(h, false) == 2001);
+
+    StoredValue *v = h.find(keys[0]);
+    assert(v && v->getValue()->to_s() == keys[0]);
+    assert(slabs.getUsedBytes() > 0);
+    assert(slabs.getRequestedBytes() > 0);
+    assert(slabs.getTotalBytes() >= slabs.getUsedBytes());
+    assert(slabs.getFragmentation() ==
+           slabs.getTotalBytes() - slabs.getRequestedBytes());
+    assert(SlabAllocator::getTotalFragmentation() >= slabs.getFragmentation());
+
+    std::map<std::string, size_t> stats;
+    slabs.getStats(stats);
+    assert(stats["used_bytes"] == slabs.getUsedBytes());
+    assert(stats["free_bytes"] ==
+           slabs.getTotalBytes() - slabs.getUsedBytes());
+
+    // So do the items ops pass around, wherever they were allocated.
+    Item *slabItem = new Item("slab", 0, 0, "value", 5);
+    slabs.setEnabled(false);
+    Item *heapItem = new Item("heap", 0, 0, "value", 5);
+    slabs.setEnabled(true);
+
+    // Chunks go back to the arena they came from, not the thread's.
+    SlabAllocator *other = new SlabAllocator();
+    other->setEnabled(true);
+    SlabAllocator::setCurrent(other);
+    size_t used = slabs.getUsedBytes();
+    delete heapItem;
+    delete slabItem;
+    assert(slabs.getUsedBytes() < used);
+    assert(other->getUsedBytes() == 0);
+    SlabAllocator::setCurrent(arena);
+    SlabAllocator::destroy(other);
+
+    // Emptied pages are handed back, but for one per class...
+    size_t full = slabs.getTotalBytes();
+    h.clear();
+    Blob::destroy(heapBlob);
+    assert(slabs.getUsedBytes() == 0);
+    assert(slabs.getRequestedBytes() == 0);
+    assert(slabs.getTotalBytes() < full);
+    slabs.getStats(stats);
+    std::map<std::string, size_t>::iterator it;
+    for (it = stats.begin(); it != stats.end(); ++it) {
+        size_t end = it->first.find("_total_chunks");
+        if (end != std::string::npos) {
+            size_t chunkSize = atoi(it->first.substr(6, end - 6).c_str());
+            assert(it->second * chunkSize <= SLAB_PAGE_SIZE);
+        }
+    }
+
+    // ...which the next allocations take first.
+    storeMany(h, keys);
+    assert(slabs.getTotalBytes() == full);
+    h.clear();
+
+    // An arena with memory still handed out stays for it to come back.
+    Blob *left = Blob::New("left", 4);
+    SlabAllocator::setCurrent(NULL);
+    SlabAllocator::destroy(arena);
+    assert(slabs.getUsedBytes() > 0);
+    Blob::destroy(left);
+    assert(slabs.getUsedBytes() == 0);
+}
+
+extern "C" {
+    static void *dropValueThread(void *arg) {
+        value_t *shared = static_cast<value_t*>(arg);
+        for (int i = 0; i < 100; ++i) {
+            value_t copy(*shared);
+            assert(copy->to_s() == "shared");
+        }
+        value_t mine(Blob::New("mine", 4));
+        return NULL;
+    }
+}
+
+static void testLargeValueCache() {
+    SlabAllocator *arena = new SlabAllocator();
+    SlabAllocator &slabs = *arena;
+    SlabAllocator::setCurrent(arena);
+
+    // Large classes cover every large request and round up.
+    for (size_t len = SLAB_LARGE_MIN_SIZE; len < SLAB_LARGE_MAX_SIZE - 4096;
+         len += 4093) {
+        assert(slabs.getLargeClassSize(len) >= len);
+    }
+
+    std::string large(1024 * 1024, 'x');
+    size_t classSize = slabs.getLargeClassSize(large.length() + sizeof(Blob));
+
+    // Off, large values come from the heap.
+    Blob *b = Blob::New(large.data(), large.length());
+    assert(slabs.getLargeUsedBytes() == 0);
+    Blob::destroy(b);
+    assert(slabs.getLargeCachedBytes() == 0);
+
+    // On, a freed value is kept and given to the next one of its class.
+    slabs.setLargeCacheSize(classSize);
+    b = Blob::New(large.data(), large.length());
+    assert(slabs.getLargeUsedBytes() == classSize);
+    const char *mem = b->getData();
+    Blob::destroy(b);
+    assert(slabs.getLargeUsedBytes() == 0);
+    assert(slabs.getLargeCachedBytes() == classSize);
+    b = Blob::New(large.data(), large.length() - 100);
+    assert(b->getData() == mem);
+    assert(b->to_s() == large.substr(0, large.length() - 100));
+    assert(slabs.getLargeCachedBytes() == 0);
+
+    // Nothing is kept past the cache size.
+    Blob *other = Blob::New(large.data(), large.length());
+    Blob::destroy(b);
+    Blob::destroy(other);
+    assert(slabs.getLargeCachedBytes() == classSize);
+
+    // Shrinking the cache gives the kept values back.
+    slabs.setLargeCacheSize(0);
+    assert(slabs.getLargeCachedBytes() == 0);
+
+    // A value goes back to its own arena's cache.
+    slabs.setLargeCacheSize(classSize);
+    SlabAllocator *second = new SlabAllocator();
+    second->setLargeCacheSize(classSize);
+    b = Blob::New(large.data(), large.length());
+    SlabAllocator::setCurrent(second);
+    Blob::destroy(b);
+    assert(slabs.getLargeCachedBytes() == classSize);
+    assert(second->getLargeCachedBytes() == 0);
+
+    SlabAllocator::setCurrent(NULL);
+    SlabAllocator::destroy(second);
+    SlabAllocator::destroy(arena);
+}
+
+static void testDeferredValueRefs() {
+    SlabAllocator *arena = new SlabAllocator();
+    SlabAllocator &slabs = *arena;
+    SlabAllocator::setCurrent(arena);
+    slabs.setEnabled(true);
+    DeferredBlobRefs::setEnabled(true);
+    size_t base = slabs.getUsedBytes();
+
+    // Copies of a value the thread just dropped reuse that reference.
+    value_t v(Blob::New("hot", 3));
+    for (int i = 0; i < 1000; ++i) {
+        value_t copy(v);
+        assert(copy->to_s() == "hot");
+    }
+
+    // Dropping the last reference only parks it...
+    v.reset();
+    assert(slabs.getUsedBytes() > base);
+    // ...until it's flushed.
+    DeferredBlobRefs::flush(NULL);
+    assert(slabs.getUsedBytes() == base);
+
+    // Only so many references are held on to per thread.
+    for (size_t i = 0; i < 4 * DEFERRED_BLOB_REFS; ++i) {
+        value_t tmp(Blob::New("tmp", 3));
+    }
+    size_t blobSize = slabs.getChunkSize(slabs.getSlabClass(sizeof(Blob) + 3));
+    assert(slabs.getUsedBytes() == base + DEFERRED_BLOB_REFS * blobSize);
+    DeferredBlobRefs::flush(NULL);
+    assert(slabs.getUsedBytes() == base);
+
+    // Whatever a thread still holds is given back when it exits.
+    value_t shared(Blob::New("shared", 6));
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, dropValueThread, &shared) == 0);
+    assert(pthread_join(tid, NULL) == 0);
+    shared.reset();
+    DeferredBlobRefs::flush(NULL);
+    assert(slabs.getUsedBytes() == base);
+
+    DeferredBlobRefs::setEnabled(false);
+    SlabAllocator::setCurrent(NULL);
+    SlabAllocator::destroy(arena);
+}
+
+struct LockFreeReadArgs {
+    HashTable *h;
+    std::vector<std::string> *keys;
+    volatile bool done;
+};
+
+extern "C" {
+    static void *lockFreeReaderThread(void *arg) {
+        LockFreeReadArgs *args = static_cast<LockFreeReadArgs*>(arg);
+        while (!args->done) {
+            std::vector<std::string>::iterator it;
+            for (it = args->keys->begin(); it != args->keys->end(); ++it) {
+                int64_t bySeqno;
+                uint8_t nru;
+                Item *itm = args->h->lockFreeFind(*it, 0, false, bySeqno, nru);
+                if (itm) {
+                    // Whatever we get has to be a value the key really had.
+                    std::string val(itm->getData(), itm->getNBytes());
+                    assert(val.compare(0, it->length(), *it) == 0);
+                    delete itm;
+                }
+            }
+        }
+        return NULL;
+    }
+}
+
+static void testLockFreeReads() {
+    EpochManager::enable();
+    HashTable::setDefaultLockFreeReads(true);
+    HashTable h(global_stats, 5, 1);
+    HashTable::setDefaultLockFreeReads(false);
+    assert(h.hasLockFreeReads());
+
+    int64_t bySeqno;
+    uint8_t nru;
+    assert(h.lockFreeFind("missing", 0, false, bySeqno, nru) == NULL);
+
+    // Both inline and out of line values are served.
+    std::string small("k"), large(2 * MAX_INLINE_VALUE_SIZE, 'x');
+    Item si(small, 0, 0, small.c_str(), small.length());
+    assert(h.set(si) == WAS_CLEAN);
+    Item li("large", 0, 0, large.c_str(), large.length());
+    assert(h.set(li) == WAS_CLEAN);
+
+    Item *itm = h.lockFreeFind(small, 3, false, bySeqno, nru);
+    assert(itm);
+    assert(itm->getValue()->to_s() == small);
+    assert(itm->getVBucketId() == 3);
+    assert(nru == INITIAL_NRU_VALUE);
+    delete itm;
+    itm = h.lockFreeFind("large", 0, false, bySeqno, nru);
+    assert(itm);
+    assert(itm->getValue()->to_s() == large);
+    delete itm;
+
+    // Counting a reference has to go through the locked path.
+    assert(h.lockFreeFind(small, 0, true, bySeqno, nru) == NULL);
+
+    // Deleted items and replaced values linger until nobody can see them.
+    EpochManager::reclaim();
+    size_t pending = EpochManager::getNumPending();
+    Item li2("large", 0, 0, small.c_str(), small.length());
+    assert(h.set(li2) == WAS_DIRTY);
+    assert(h.del("large"));
+    assert(h.lockFreeFind("large", 0, false, bySeqno, nru) == NULL);
+    assert(h.del(small));
+    assert(h.lockFreeFind(small, 0, false, bySeqno, nru) == NULL);
+    assert(EpochManager::getNumPending() > pending);
+    EpochManager::flush(NULL);
+    assert(EpochManager::getNumPending() == 0);
+
+    // Readers never see anything but the key's own values while it's
+    // being rewritten and resized under them.
+    std::vector<std::string> keys = generateKeys(1000);
+    storeMany(h, keys);
+    LockFreeReadArgs args;
+    args.h = &h;
+    args.keys = &keys;
+    args.done = false;
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, lockFreeReaderThread, &args) == 0);
+    for (int r = 0; r < 10; ++r) {
+        std::vector<std::string>::iterator it;
+        for (it = keys.begin(); it != keys.end(); ++it) {
+            std::string val(*it + std::string(r * 4, 'v'));
+            Item i(*it, 0, 0, val.c_str(), val.length());
+            h.set(i);
+        }
+        h.resize(r % 2 ? 5 : 1543);
+    }
+    args.done = true;
+    assert(pthread_join(tid, NULL) == 0);
+
+    h.clear();
+    EpochManager::flush(NULL);
+    assert(EpochManager::getNumPending() == 0);
+}
+
+static void testLockAndChainStats() {
+    global_stats.htLockWaitHisto.reset();
+    global_stats.htLockHoldHisto.reset();
+    global_stats.htChainLengthHisto.reset();
+
+    HashTable h(global_stats, 5, 1);
+    assert(h.getMaxChainWalked() == 0);
+    assert(h.getMaxLockHold() == 0);
+    assert(h.getAvgLockHold() == 0);
+
+    const int nkeys = 100;
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(h, keys);
+    for (int r = 0; r < 10; ++r) {
+        std::vector<std::string>::iterator it;
+        for (it = keys.begin(); it != keys.end(); ++it) {
+            assert(h.find(*it));
+        }
+    }
+
+    // Every key landed in one of five buckets, so somebody walked far.
+    assert(h.getMaxChainWalked() >= nkeys / 5);
+    assert(h.getMaxChainWalked() <= nkeys);
+
+    // One stripe, so every HT_STATS_SAMPLE_RATE'th lock was timed.
+    size_t locks = nkeys * 11;
+    size_t samples = locks / HT_STATS_SAMPLE_RATE;
+    assert(global_stats.htLockWaitHisto.total() >= samples);
+    assert(global_stats.htLockWaitHisto.total() <= samples + 1);
+    assert(global_stats.htLockHoldHisto.total() ==
+           global_stats.htLockWaitHisto.total());
+    assert(global_stats.htChainLengthHisto.total() > 0);
+    assert(h.getAvgLockHold() <= h.getMaxLockHold());
+}
+
+static void testStripeLookups() {
+    HashTable h(global_stats, 5, 3);
+    std::vector<std::string> keys = generateKeys(100);
+    storeMany(h, keys);
+
+    // Every key is found through the stripe it was grouped under.
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        int lock_num = h.getLockForKey(*it);
+        LockHolder lh = h.getLockedStripe(lock_num);
+        int bucket_num(0);
+        assert(h.unlocked_getBucketInStripe(*it, lock_num, &bucket_num));
+        assert(h.unlocked_find(*it, bucket_num, false, false));
+        int other = (lock_num + 1) % static_cast<int>(h.getNumLocks());
+        assert(!h.unlocked_getBucketInStripe(*it, other, &bucket_num));
+    }
+
+    // Groupings made before a resize are caught, and keys are pulled
+    // out of the old table while it's in progress.
+    std::vector<int> locks;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        locks.push_back(h.getLockForKey(*it));
+    }
+    h.resize(1543);
+    size_t found(0);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        LockHolder lh = h.getLockedStripe(locks[i]);
+        int bucket_num(0);
+        if (h.unlocked_getBucketInStripe(keys[i], locks[i], &bucket_num)) {
+            assert(h.unlocked_find(keys[i], bucket_num, false, false));
+            ++found;
+        }
+    }
+    assert(found > 0);
+    assert(found < keys.size());
+}
+
+/**
+ * Run the policy over every item of the table like one pager sweep,
+ * ejecting what it picks.
+ */
+static size_t sweep(HashTable &h, EvictionPolicy &policy,
+                    std::vector<std::string> &keys) {
+    size_t ejected(0);
+    unsigned int seed(0);
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        int bucket_num(0);
+        LockHolder lh = h.getLockedBucket(*it, &bucket_num);
+        StoredValue *v = h.unlocked_find(*it, bucket_num, false, false);
+        assert(v);
+        if (policy.shouldEvict(v, 1.0, seed) &&
+            v->ejectValue(global_stats, h)) {
+            policy.evicted(v);
+            ++ejected;
+        }
+    }
+    policy.runComplete(false);
+    return ejected;
+}
+
+static void touch(HashTable &h, std::vector<std::string> &keys) {
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        assert(h.find(*it, true));
+    }
+}
+
+static void storeClean(HashTable &h, std::vector<std::string> &keys) {
+    // Too big to be inlined, so it can be ejected.
+    std::string val(4 * MAX_INLINE_VALUE_SIZE, 'x');
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        Item i(*it, 0, 0, val.c_str(), val.length());
+        assert(h.set(i) == WAS_CLEAN);
+        h.find(*it, false)->markClean();
+    }
+}
+
+static void testNRUEvictionPolicy() {
+    HashTable h(global_stats, 5, 1);
+    std::vector<std::string> keys = generateKeys(10);
+    storeClean(h, keys);
+
+    shared_ptr<EvictionPolicy> policy(EvictionPolicy::create("nru"));
+    assert(std::string(policy->getName()) == "nru");
+    NRUEvictionPolicy &nru = static_cast<NRUEvictionPolicy&>(*policy);
+    assert(nru.getPhase() == PAGING_UNREFERENCED);
+
+    // Nothing is old enough yet; a run that didn't get memory down
+    // moves on to aging items.
+    assert(sweep(h, *policy, keys) == 0);
+    policy->runComplete(true);
+    assert(nru.getPhase() == PAGING_RANDOM);
+    assert(sweep(h, *policy, keys) == keys.size());
+    policy->runComplete(true);
+    assert(nru.getPhase() == PAGING_UNREFERENCED);
+}
+
+static void testClockProEvictionPolicy() {
+    HashTable h(global_stats, 5, 1);
+    std::vector<std::string> working = generateKeys(10);
+    std::vector<std::string> scanned = generateKeys(110, 10);
+    std::vector<std::string> all = generateKeys(110);
+    storeClean(h, all);
+
+    shared_ptr<EvictionPolicy> policy(EvictionPolicy::create("clock_pro"));
+    assert(std::string(policy->getName()) == "clock_pro");
+
+    // The working set is used over and over, the scan touches
+    // everything else once.
+    touch(h, working);
+    touch(h, working);
+    touch(h, scanned);
+    assert(sweep(h, *policy, all) == 0);
+    for (size_t i = 0; i < working.size(); ++i) {
+        assert(h.find(working[i], false)->isHot());
+    }
+
+    // A sweep later the scanned items are gone but the working set,
+    // still in use, is untouched.
+    touch(h, working);
+    assert(sweep(h, *policy, all) == scanned.size());
+    for (size_t i = 0; i < scanned.size(); ++i) {
+        StoredValue *v = h.find(scanned[i], false);
+        assert(!v->isResident());
+        assert(v->isGhost());
+    }
+    for (size_t i = 0; i < working.size(); ++i) {
+        StoredValue *v = h.find(working[i], false);
+        assert(v->isResident());
+        assert(v->isHot());
+    }
+
+    // Fetching a value back while it's a ghost makes it hot...
+    size_t ghostHits = global_stats.numGhostHits.get();
+    Item *itm = new Item(scanned[0], 0, 0, scanned[0].c_str(),
+                         scanned[0].length());
+    StoredValue *v = h.find(scanned[0], false);
+    assert(v->unlocked_restoreValue(itm, h));
+    delete itm;
+    assert(v->isHot());
+    assert(!v->isGhost());
+    assert(global_stats.numGhostHits.get() == ghostHits + 1);
+
+    // ...but not once a sweep has gone by.
+    sweep(h, *policy, all);
+    itm = new Item(scanned[1], 0, 0, scanned[1].c_str(), scanned[1].length());
+    v = h.find(scanned[1], false);
+    assert(!v->isGhost());
+    assert(v->unlocked_restoreValue(itm, h));
+    delete itm;
+    assert(!v->isHot());
+    assert(global_stats.numGhostHits.get() == ghostHits + 1);
+
+    // If sweeps don't free enough, unreferenced hot items cool off.
+    policy->runComplete(true);
+    sweep(h, *policy, working);
+    for (size_t i = 0; i < working.size(); ++i) {
+        assert(!h.find(working[i], false)->isHot());
+    }
+}
+
+class LimitedVisitor : public HashTableVisitor {
+public:
+    LimitedVisitor(size_t l) : limit(l) { }
+
+    void visit(StoredValue *v) {
+        seen.insert(v->getKey());
+    }
+
+    bool shouldContinue() {
+        return seen.size() < limit;
+    }
+
+    std::set<std::string> seen;
+    size_t limit;
+};
+
+static void testSweep() {
+    HashTable h(global_stats, 47, 3);
+    LimitedVisitor empty(1);
+    assert(h.sweep(empty, 47) == 0);
+
+    std::vector<std::string> keys = generateKeys(200);
+    storeMany(h, keys);
+
+    // Sweeps stop when the visitor has seen enough...
+    LimitedVisitor first(20);
+    size_t visited = h.sweep(first, h.getSize());
+    assert(visited < h.getSize());
+    assert(first.seen.size() >= 20);
+
+    // ...or after the given number of buckets, and pick up where the
+    // last one stopped.
+    LimitedVisitor second(keys.size());
+    visited += h.sweep(second, 5);
+    assert(visited < h.getSize());
+    LimitedVisitor rest(keys.size());
+    assert(h.sweep(rest, h.getSize()) == h.getSize());
+    assert(rest.seen.size() == keys.size());
+
+    std::set<std::string> both(first.seen);
+    both.insert(second.seen.begin(), second.seen.end());
+    size_t overlap = first.seen.size() + second.seen.size() - both.size();
+    assert(overlap == 0);
+}
+
+static void testInlineVisits() {
+    HashTable h(global_stats, 47, 3);
+    std::vector<std::string> keys = generateKeys(200);
+    storeMany(h, keys);
+
+    // The inlined walks see just what the virtual ones do.
+    Counter c(true);
+    h.visitInline(c);
+    assert(c.count == keys.size());
+    assert(count(h) == static_cast<int>(keys.size()));
+
+    LimitedVisitor first(20);
+    size_t visited = h.sweepInline(first, h.getSize());
+    assert(visited < h.getSize());
+    assert(first.seen.size() >= 20);
+    LimitedVisitor rest(keys.size());
+    assert(h.sweepInline(rest, h.getSize()) == h.getSize());
+    assert(rest.seen.size() == keys.size());
+}
+
+static void testClearSome() {
+    global_stats.reset();
+    size_t initialSize = global_stats.currentSize.get();
+    HashTable h(global_stats, 47, 3);
+    std::vector<std::string> keys = generateKeys(200);
+    storeMany(h, keys);
+
+    // Each call frees at least the items asked for, a bucket at a time.
+    assert(!h.clearSome(50));
+    size_t left = h.getNumItems();
+    assert(left <= 150);
+    assert(count(h) == static_cast<int>(left));
+    assert(!h.clearSome(50));
+    assert(h.getNumItems() < left);
+
+    while (!h.clearSome(50)) {
+        continue;
+    }
+    assert(h.getNumItems() == 0);
+    assert(count(h) == 0);
+    assert(h.memSize.get() == 0);
+    assert(initialSize == global_stats.currentSize.get());
+
+    // The table can be cleared over again.
+    storeMany(h, keys);
+    assert(h.clearSome(keys.size() + 1));
+    assert(h.getNumItems() == 0);
+}
+
+static void testDetach() {
+    global_stats.reset();
+    size_t initialSize = global_stats.currentSize.get();
+    HashTable h(global_stats, 47, 3);
+    std::vector<std::string> keys = generateKeys(200);
+    storeMany(h, keys);
+    size_t mem = h.memSize.get();
+
+    // The items move over at once, still using their memory.
+    HashTable *old = h.detach();
+    assert(h.getNumItems() == 0);
+    assert(count(h) == 0);
+    assert(h.memSize.get() == 0);
+    assert(old->getNumItems() == keys.size());
+    assert(old->memSize.get() == mem);
+    assert(initialSize < global_stats.currentSize.get());
+
+    // The emptied table is usable right away.
+    storeMany(h, keys);
+    assert(count(h) == static_cast<int>(keys.size()));
+
+    while (!old->clearSome(50)) {
+        continue;
+    }
+    delete old;
+    h.clear();
+    assert(initialSize == global_stats.currentSize.get());
+}
+
+static void testDefragment() {
+    global_stats.reset();
+    HashTable::setDefaultInlineValueSize(32);
+    HashTable h(global_stats, 47, 3);
+    HashTable::setDefaultInlineValueSize(0);
+    std::vector<std::string> keys = generateKeys(200);
+    storeMany(h, keys);
+    std::string bigKey("big");
+    std::string large(100, 'x');
+    Item big(bigKey, 0, 0, large.c_str(), large.length());
+    h.set(big);
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        h.find(*it)->markClean();
+    }
+    h.find(bigKey)->markClean();
+    std::string dirty("dirty");
+    store(h, dirty);
+
+    size_t memSize = h.memSize.get();
+    size_t cacheSize = h.cacheSize.get();
+
+    // The first pass only notes which items are there.
+    assert(!h.defragment(h.getSize()));
+    assert(global_stats.defragNumMoved.get() == 0);
+
+    // The next moves them, a few buckets at a time.
+    size_t calls = 1;
+    while (h.defragment(10)) {
+        ++calls;
+    }
+    assert(calls == 5);
+    assert(global_stats.defragNumMoved.get() == keys.size() + 1);
+    assert(global_stats.defragNumValuesMoved.get() == 1);
+
+    assert(count(h, false) == static_cast<int>(keys.size() + 2));
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        StoredValue *v = h.find(*it);
+        assert(v && v->isInlineValue() && !v->isDirty());
+        assert(v->getValue()->to_s() == *it);
+    }
+    assert(h.find(bigKey)->getValue()->to_s() == large);
+    assert(h.find(dirty)->isDirty());
+    assert(h.memSize.get() == memSize);
+    assert(h.cacheSize.get() == cacheSize);
+
+    // Moved items are left alone by the pass right after.
+    assert(!h.defragment(h.getSize()));
+    assert(global_stats.defragNumMoved.get() == keys.size() + 1);
+
+    h.clear();
+    assert(h.memSize.get() == 0);
+    assert(h.cacheSize.get() == 0);
+}
+
+static void testPauseResumeVisit() {
+    HashTable h(global_stats, 47, 5);
+    LimitedVisitor empty(1);
+    assert(h.pauseResumeVisit(empty, HashTable::Position()) ==
+           h.endPosition());
+
+    std::vector<std::string> keys = generateKeys(200);
+    storeMany(h, keys);
+
+    // Each visit stops after the lock it saw its limit in, and the next
+    // one carries on from there without seeing anything twice.
+    std::set<std::string> seen;
+    size_t visits = 0;
+    HashTable::Position pos;
+    while (pos != h.endPosition()) {
+        LimitedVisitor part(10);
+        pos = h.pauseResumeVisit(part, pos);
+        std::set<std::string>::iterator it = part.seen.begin();
+        for (; it != part.seen.end(); ++it) {
+            assert(seen.insert(*it).second);
+        }
+        ++visits;
+        assert(visits <= h.getNumLocks());
+    }
+    assert(visits > 1);
+    assert(seen.size() == keys.size());
+
+    // A resize in between starts the stopped lock's buckets over.
+    LimitedVisitor first(10);
+    pos = h.pauseResumeVisit(first, HashTable::Position());
+    assert(pos != h.endPosition());
+    h.resize(97);
+    LimitedVisitor rest(keys.size());
+    assert(h.pauseResumeVisit(rest, pos) == h.endPosition());
+}
+
+static void testExpiryIndex() {
+    HashTable::setDefaultExpiryIndex(true);
+    HashTable h(global_stats, 5, 1);
+    HashTable::setDefaultExpiryIndex(false);
+    assert(h.hasExpiryIndex());
+    size_t tableSize = h.memorySize();
+
+    time_t now = ep_real_time();
+    std::string soon("soon"), later("later"), never("never");
+    add(h, soon, ADD_SUCCESS, now + 5);
+    add(h, later, ADD_SUCCESS, now + 100);
+    add(h, never, ADD_SUCCESS);
+    assert(h.getExpiryIndexSize() == 2);
+    // The entries are counted by themselves, so what a resize takes off
+    // the overhead is what it put on.
+    assert(h.getExpiryIndexMemory() == 2 * EXPIRY_INDEX_ENTRY_SIZE);
+    assert(h.memorySize() == tableSize);
+
+    // Updating an indexed item doesn't add another entry.
+    Item again(soon, 0, now + 5, soon.c_str(), soon.length());
+    assert(h.set(again) == WAS_DIRTY);
+    assert(h.getExpiryIndexSize() == 2);
+
+    LimitedVisitor none(100);
+    assert(h.visitExpiring(none, now) == 0);
+
+    // Only what's due is visited; it stays indexed until it's gone.
+    LimitedVisitor due(100);
+    assert(h.visitExpiring(due, now + 6) == 1);
+    assert(due.seen.count(soon) == 1);
+    assert(h.getExpiryIndexSize() == 2);
+
+    // An item whose expiry moved out goes back in for the new time.
+    Item extended(later, 0, now + 200, later.c_str(), later.length());
+    assert(h.set(extended) == WAS_DIRTY);
+    assert(h.getExpiryIndexSize() == 2);
+    LimitedVisitor moved(100);
+    assert(h.visitExpiring(moved, now + 101) == 2);
+    assert(moved.seen.count(later) == 1);
+
+    // Deleted items drop out.
+    assert(h.del(soon));
+    assert(h.visitExpiring(none, now + 150) == 0);
+    LimitedVisitor rest(100);
+    assert(h.visitExpiring(rest, now + 201) == 1);
+    assert(rest.seen.count(later) == 1);
+    assert(rest.seen.count(never) == 0);
+
+    // Temp items are due right away.
+    int bucket_num(0);
+    std::string temp("temp");
+    LockHolder lh = h.getLockedBucket(temp, &bucket_num);
+    assert(h.unlocked_addTempDeletedItem(bucket_num, temp) == ADD_SUCCESS);
+    lh.unlock();
+    LimitedVisitor temps(100);
+    assert(h.visitExpiring(temps, now) == 1);
+    assert(temps.seen.count(temp) == 1);
+
+    h.clear();
+    assert(h.getExpiryIndexSize() == 0);
+    assert(h.getExpiryIndexMemory() == 0);
+}
+
+static void addSettledTemp(HashTable &h, const std::string &key) {
+    int bucket_num(0);
+    LockHolder lh = h.getLockedBucket(key, &bucket_num);
+    assert(h.unlocked_addTempDeletedItem(bucket_num, key) == ADD_SUCCESS);
+    StoredValue *v = h.unlocked_find(key, bucket_num, true, false);
+    assert(v && v->isTempInitialItem());
+    v->setStoredValueState(StoredValue::state_non_existent_key);
+    h.unlocked_queueTempItem(v);
+}
+
+static StoredValue *findAny(HashTable &h, const std::string &key) {
+    int bucket_num(0);
+    LockHolder lh = h.getLockedBucket(key, &bucket_num);
+    return h.unlocked_find(key, bucket_num, true, false);
+}
+
+static void testTempItemQueue() {
+    global_stats.reset();
+    HashTable::setDefaultMaxTempItems(2);
+    HashTable h(global_stats, 5, 1);
+    HashTable::setDefaultMaxTempItems(0);
+    std::vector<std::string> keys = generateKeys(4);
+    addSettledTemp(h, keys[0]);
+    addSettledTemp(h, keys[1]);
+    addSettledTemp(h, keys[2]);
+    assert(h.getTempItemMemory() > 0);
+
+    // A fetch in flight isn't queued, and keeps its temp item.
+    int bucket_num(0);
+    LockHolder lh = h.getLockedBucket(keys[3], &bucket_num);
+    assert(h.unlocked_addTempDeletedItem(bucket_num, keys[3]) == ADD_SUCCESS);
+    lh.unlock();
+    assert(h.getNumTempItems() == 4);
+
+    // The oldest goes.
+    assert(h.reclaimTempItems() == 1);
+    assert(global_stats.tempItemsReclaimed.get() == 1);
+    assert(h.getNumTempItems() == 3);
+    assert(!findAny(h, keys[0]));
+    assert(findAny(h, keys[1]));
+    assert(findAny(h, keys[3])->isTempInitialItem());
+
+    // A temp item that became a regular item stays.
+    Item real(keys[1], 0, 0, keys[1].c_str(), keys[1].length());
+    h.set(real);
+    assert(h.getNumItems() == 1);
+    std::string more("more");
+    addSettledTemp(h, more);
+    assert(h.reclaimTempItems() == 0);
+    assert(!findAny(h, keys[1])->isTempItem());
+    assert(h.getNumTempItems() == 3);
+
+    h.clear();
+    assert(h.getTempItemMemory() == 0);
+    assert(h.reclaimTempItems() == 0);
+}
+
+static void testFullEviction() {
+    HashTable h(global_stats, 5, 1);
+    std::vector<std::string> keys = generateKeys(3);
+    storeClean(h, keys);
+    assert(h.getNumItems() == 3);
+    h.find(keys[1], false)->markDirty();
+    assert(h.find(keys[2], false)->ejectValue(global_stats, h));
+    assert(h.getNumNonResidentItems() == 1);
+
+    // Only clean items go, resident or not.
+    for (size_t i = 0; i < keys.size(); ++i) {
+        int bucket_num(0);
+        LockHolder lh = h.getLockedBucket(keys[i], &bucket_num);
+        assert(h.unlocked_evict(keys[i], bucket_num) == (i != 1));
+    }
+    assert(!h.find(keys[0]));
+    assert(h.getNumItems() == 1);
+    assert(h.getNumNonResidentItems() == 0);
+
+    // A miss leaves a temp item that the fetched item replaces.
+    StoredValue *v;
+    {
+        int bucket_num(0);
+        LockHolder lh = h.getLockedBucket(keys[0], &bucket_num);
+        assert(h.unlocked_addTempDeletedItem(bucket_num, keys[0]) ==
+               ADD_SUCCESS);
+        v = h.unlocked_find(keys[0], bucket_num, true, false);
+        assert(v && v->isTempInitialItem());
+        assert(h.getNumTempItems() == 1);
+        std::string val("fetched");
+        Item fetched(keys[0], 0, 0, val.c_str(), val.length());
+        assert(v->unlocked_restoreValue(&fetched, h));
+    }
+    assert(!v->isTempItem());
+    assert(v->isResident() && v->isClean());
+    assert(h.getNumTempItems() == 0);
+    assert(h.getNumItems() == 2);
+    assert(h.find(keys[0]) == v);
+
+    // So does a new item added over it.
+    {
+        int bucket_num(0);
+        LockHolder lh = h.getLockedBucket(keys[2], &bucket_num);
+        assert(h.unlocked_addTempDeletedItem(bucket_num, keys[2]) ==
+               ADD_SUCCESS);
+    }
+    add(h, keys[2], ADD_UNDEL);
+    v = h.find(keys[2]);
+    assert(v && !v->isTempItem());
+    assert(h.getNumTempItems() == 0);
+    assert(h.getNumItems() == 3);
+}
+
+static void testEphemeralEviction() {
+    HashTable h(global_stats, 5, 1);
+    std::vector<std::string> keys = generateKeys(3);
+    storeMany(h, keys);
+    assert(h.softDelete(keys[1], 0) == WAS_DIRTY);
+    StoredValue *locked = h.find(keys[2], false);
+    locked->lock(ep_current_time() + 60);
+
+    // Nothing is clean, so only full eviction leaves them all.  Without
+    // a disk copy, dirty and deleted items go too; locked ones stay.
+    for (size_t i = 0; i < keys.size(); ++i) {
+        int bucket_num(0);
+        LockHolder lh = h.getLockedBucket(keys[i], &bucket_num);
+        assert(!h.unlocked_evict(keys[i], bucket_num));
+        assert(h.unlocked_evict(keys[i], bucket_num, true) == (i != 2));
+    }
+    assert(h.getNumItems() == 1);
+    assert(h.find(keys[2]) == locked);
+}
+
 class AccessGenerator : public Generator<bool> {
 public:
 
@@ -373,6 +1626,29 @@ static void testAdd() {
     assert(count(h, false) == nkeys);
 }
 
+static void testInsertMustExist() {
+    HashTable h(global_stats, 5, 1);
+    std::string goneKey("gone");
+    std::string loadedKey("key");
+
+    // A key that isn't in the table isn't loaded back.
+    Item gone(goneKey, 0, 0, "value", 5);
+    gone.setCas(1);
+    assert(h.insert(gone, false, false, true) == INVALID_CAS);
+    assert(h.find(goneKey) == NULL);
+
+    // One whose key was loaded gets its value.
+    Item key(loadedKey, 0, 0, NULL, 0);
+    key.setCas(2);
+    assert(h.insert(key, false, true) == NOT_FOUND);
+    Item full(loadedKey, 0, 0, "value", 5);
+    full.setCas(2);
+    assert(h.insert(full, false, false, true) == NOT_FOUND);
+    StoredValue *v = h.find(loadedKey);
+    assert(v && v->isResident());
+    assert(h.getNumItems() == 1);
+}
+
 static void testDepthCounting() {
     HashTable h(global_stats, 5, 1);
     const int nkeys = 5000;
@@ -395,6 +1671,139 @@ static void testPoisonKey() {
     assert(count(h) == 1);
 }
 
+static void testKeyTags() {
+    // Keys that only differ before their last eight bytes share a tag,
+    // and still have to be told apart by their bytes.
+    std::string a("a:12345678"), b("b:12345678"), c("c:12345678");
+    assert(StoredValue::keyTag(a) == StoredValue::keyTag(b));
+
+    HashTable h(global_stats, 1, 1);
+    store(h, a);
+    store(h, b);
+    store(h, c);
+    assert(count(h) == 3);
+    int bucket_num(0);
+    LockHolder lh = h.getLockedBucket(b, &bucket_num);
+    StoredValue *v = h.unlocked_find(b, bucket_num);
+    assert(v && v->hasKey(b));
+    assert(h.unlocked_del(a, bucket_num));
+    assert(!h.unlocked_find(a, bucket_num));
+    v = h.unlocked_find(b, bucket_num);
+    assert(v && v->hasKey(b));
+    lh.unlock();
+    assert(count(h) == 2);
+}
+
+static void testKeyPrefixes() {
+    global_stats.reset();
+    HashTable::setDefaultInlineValueSize(32);
+    HashTable::setDefaultKeyPrefixMinLen(5);
+    HashTable h(global_stats, 47, 3);
+    HashTable::setDefaultKeyPrefixMinLen(0);
+    HashTable::setDefaultInlineValueSize(0);
+    HashTable plain(global_stats, 47, 3);
+
+    std::string prefix("user::");
+    std::vector<std::string> keys;
+    for (int i = 0; i < 100; ++i) {
+        std::stringstream ss;
+        ss << prefix << i;
+        keys.push_back(ss.str());
+    }
+    // Too short a prefix, or none at all, and the key is kept whole.
+    keys.push_back("ab:1");
+    keys.push_back("nopfx");
+    storeMany(h, keys);
+    storeMany(plain, keys);
+    assert(KeyPrefixTable::getNumPrefixes() == 1);
+    assert(KeyPrefixTable::getBytesSaved() == 100 * prefix.length());
+    assert(h.metaDataMemory.get() + 100 * prefix.length() ==
+           plain.metaDataMemory.get());
+
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        StoredValue *v = h.find(*it);
+        assert(v && v->hasKey(*it));
+        assert(v->getKey() == *it);
+        assert(v->getKeyLen() == it->length());
+        assert(v->getValue()->to_s() == *it);
+        Item *itm = v->toItem(false, 0);
+        assert(itm->getKey() == *it);
+        delete itm;
+    }
+    std::string missing("user::1000");
+    assert(!h.find(missing));
+    missing.assign("users:1");
+    assert(!h.find(missing));
+    assert(count(h) == static_cast<int>(keys.size()));
+
+    // Moved items share the prefix too.
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        h.find(*it)->markClean();
+    }
+    assert(!h.defragment(h.getSize()));
+    while (h.defragment(h.getSize())) {
+    }
+    assert(global_stats.defragNumMoved.get() == keys.size());
+    assert(KeyPrefixTable::getBytesSaved() == 100 * prefix.length());
+    assert(h.find(keys[0])->getKey() == keys[0]);
+
+    // The prefix goes with the last item holding it.
+    assert(h.del(keys[0]));
+    assert(KeyPrefixTable::getBytesSaved() == 99 * prefix.length());
+    h.clear();
+    assert(KeyPrefixTable::getNumPrefixes() == 0);
+    assert(KeyPrefixTable::getBytesSaved() == 0);
+    assert(h.memSize.get() == 0);
+    assert(h.metaDataMemory.get() == 0);
+    plain.clear();
+}
+
+static void testCasClock() {
+    HashTable h(global_stats, 5, 1);
+    uint64_t now = HybridLogicalClock::wallClock();
+
+    // The casses of local writes only grow, and stay about the wall clock.
+    uint64_t last = 0;
+    for (int i = 0; i < 1000; ++i) {
+        Item itm("key", 0, 0, "value", 5);
+        assert(h.set(itm, 0, true, false) != NOMEM);
+        assert(itm.getCas() > last);
+        assert(itm.getCas() >= now);
+        last = itm.getCas();
+    }
+    assert(Item::casTime(last) < Item::casTime(now) + 60 * 1000000);
+
+    // A cas stored from elsewhere, from a clock way ahead, moves ours on.
+    uint64_t ahead = 1ULL << 62;
+    Item remote("remote", 0, 0, "value", 5, ahead);
+    assert(h.set(remote, 0, true, true) != NOMEM);
+    Item local("remote", 0, 0, "local", 5);
+    assert(h.set(local, 0, true, false) == WAS_DIRTY);
+    assert(local.getCas() > ahead);
+    assert(h.nextCas() > local.getCas());
+
+    // So does one loaded from disk or backfilled from the active.
+    HashTable loaded(global_stats, 5, 1);
+    uint64_t soon = HybridLogicalClock::wallClock() + 1000000000ULL;
+    Item fromDisk("loaded", 0, 0, "value", 5, soon);
+    assert(loaded.insert(fromDisk, false, false) == NOT_FOUND);
+    assert(loaded.nextCas() > soon);
+
+    // But never further ahead of the wall clock than the max drift.
+    HybridLogicalClock::setMaxDrift(2000);
+    HashTable capped(global_stats, 5, 1);
+    Item farAhead("capped", 0, 0, "value", 5, ahead);
+    assert(capped.insert(farAhead, false, false) == NOT_FOUND);
+    uint64_t next = capped.nextCas();
+    assert(next < ahead);
+    assert(next <= HybridLogicalClock::wallClock() + 2000000000ULL + 1);
+    assert(HybridLogicalClock::isTooFarAhead(ahead));
+    assert(!HybridLogicalClock::isTooFarAhead(soon));
+    HybridLogicalClock::setMaxDrift(0);
+    assert(!HybridLogicalClock::isTooFarAhead(ahead));
+}
+
 static void testSizeStats() {
     global_stats.reset();
     HashTable ht(global_stats, 5, 1);
@@ -570,12 +1979,42 @@ int main() {
     testForwardDeletions();
     testFind();
     testAdd();
+    testInsertMustExist();
     testAddExpiry();
     testDepthCounting();
     testPoisonKey();
+    testKeyTags();
+    testKeyPrefixes();
+    testCasClock();
     testResize();
+    testReserve();
+    testIdleSize();
     testConcurrentAccessResize();
     testAutoResize();
+    testIncrementalResize();
+    testConcurrentIncrementalResize();
+    testSharedReads();
+    testInlineValues();
+    testCompressedValues();
+    testPowerOfTwo();
+    testSlabAllocator();
+    testLargeValueCache();
+    testDeferredValueRefs();
+    testLockFreeReads();
+    testLockAndChainStats();
+    testStripeLookups();
+    testNRUEvictionPolicy();
+    testClockProEvictionPolicy();
+    testSweep();
+    testInlineVisits();
+    testClearSome();
+    testDetach();
+    testDefragment();
+    testPauseResumeVisit();
+    testExpiryIndex();
+    testTempItemQueue();
+    testFullEviction();
+    testEphemeralEviction();
     testSizeStats();
     testSizeStatsFlush();
     testSizeStatsSoftDel();
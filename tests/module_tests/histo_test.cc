@@ -107,10 +107,114 @@ static void test_complete_range() {
     } while (i != 0);
 }
 
+static void test_merge() {
+    Histogram<int> histo;
+    Histogram<int> other;
+    histo.add(3, 2);
+    other.add(3, 1);
+    other.add(1000, 4);
+
+    histo.merge(other);
+    assert(3 == histo.getBin(3)->count());
+    assert(4 == histo.getBin(1000)->count());
+    assert(7 == histo.total());
+    assert(5 == other.total());
+}
+
+static void test_hdr() {
+    typedef HdrHistogram<uint64_t> Hdr;
+    // Each value's in a bucket of its own up to 16, then 16 to a power of 2.
+    for (uint64_t v = 0; v < 100000; ++v) {
+        size_t b = Hdr::indexOf(v);
+        assert(Hdr::bucketStart(b) <= v && v < Hdr::bucketEnd(b));
+        uint64_t width = Hdr::bucketEnd(b) - Hdr::bucketStart(b);
+        assert(width == 1 || width <= v / 16);
+    }
+    assert(Hdr::indexOf(15) == 15);
+    assert(Hdr::indexOf(16) == 16);
+    assert(Hdr::indexOf(17) == 17);
+    assert(Hdr::indexOf(32) == 32);
+    assert(Hdr::indexOf(34) == 33);
+    assert(Hdr::indexOf(1ULL << 40) == Hdr::NUM_BUCKETS - 1);
+    assert(Hdr::indexOf(std::numeric_limits<uint64_t>::max()) ==
+           Hdr::NUM_BUCKETS - 1);
+
+    Hdr *histo = new Hdr;
+    assert(histo->percentile(99) == 0);
+    for (uint64_t v = 1; v <= 10000; ++v) {
+        histo->add(v);
+    }
+    assert(histo->total() == 10000);
+    assert(histo->getMax() == 10000);
+    uint64_t p50 = histo->percentile(50);
+    uint64_t p99 = histo->percentile(99);
+    uint64_t p999 = histo->percentile(99.9);
+    assert(p50 >= 5000 && p50 <= 5000 + 5000 / 16);
+    assert(p99 >= 9900 && p99 <= 10000);
+    assert(p999 >= 9990 && p999 <= 10000);
+    assert(histo->percentile(100) == 10000);
+
+    Hdr *other = new Hdr;
+    other->add(1ULL << 50, 10);
+    histo->merge(*other);
+    assert(histo->total() == 10010);
+    assert(histo->getMax() == 1ULL << 50);
+    assert(histo->percentile(100) == 1ULL << 50);
+
+    histo->reset();
+    assert(histo->total() == 0);
+    assert(histo->getMax() == 0);
+    delete histo;
+    delete other;
+}
+
+static void test_percentile() {
+    Histogram<int> histo;
+    assert(histo.percentile(99) == 0);
+    histo.add(3, 90);
+    histo.add(100, 10);
+    assert(histo.percentile(50) == 3);
+    assert(histo.percentile(90) == 3);
+    assert(histo.percentile(99) == 127);
+}
+
+static void test_hdr_windows() {
+    typedef HdrHistogram<uint64_t> Hdr;
+    Hdr *histo = new Hdr;
+    HdrHistogramWindows<uint64_t> *windows =
+        new HdrHistogramWindows<uint64_t>(*histo);
+    std::vector<size_t> counts(Hdr::NUM_BUCKETS);
+
+    windows->rotate();
+    assert(windows->getWindow(1, &counts[0]) == 0);
+    // Ten intervals of 1..10 samples of the interval's number.
+    for (uint64_t i = 1; i <= 10; ++i) {
+        histo->add(i, i);
+        windows->rotate();
+    }
+    assert(windows->getWindow(1, &counts[0]) == 10);
+    assert(counts[Hdr::indexOf(10)] == 10);
+    assert(windows->getWindow(6, &counts[0]) == 5 + 6 + 7 + 8 + 9 + 10);
+    assert(Hdr::percentileOf(&counts[0], histo->getMax(), 0) == 5);
+
+    // A reset leaves the samples since it.
+    histo->reset();
+    histo->add(3, 2);
+    windows->rotate();
+    assert(windows->getWindow(1, &counts[0]) == 2);
+
+    delete windows;
+    delete histo;
+}
+
 int main() {
     test_basic();
     test_fixed_input();
     test_exponential();
     test_complete_range();
+    test_merge();
+    test_hdr();
+    test_percentile();
+    test_hdr_windows();
     return 0;
 }
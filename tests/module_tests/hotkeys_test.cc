@@ -0,0 +1,112 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+#include <cassert>
+#include <sstream>
+#include <vector>
+
+#include "hotkeys.h"
+
+static void testDisabled() {
+    HotKeys hot(0);
+    for (int i = 0; i < 100; ++i) {
+        assert(!hot.shouldSample());
+    }
+    hot.record("k", 0, 10, false);
+    std::vector<HotKeys::Entry> top;
+    hot.getTopByOps(top);
+    assert(top.empty());
+}
+
+static void testSampling() {
+    HotKeys hot(4);
+    size_t sampled = 0;
+    for (int i = 0; i < 100; ++i) {
+        if (hot.shouldSample()) {
+            ++sampled;
+        }
+    }
+    assert(sampled == 25);
+}
+
+static void testTopKeys() {
+    HotKeys hot(1);
+    // A hot key among many more keys than are counted.
+    for (int i = 0; i < 1000; ++i) {
+        std::stringstream ss;
+        ss << "key" << i;
+        hot.record(ss.str(), i % 8, 10, true);
+        hot.record("hot", 3, 100, false);
+        if (i % 2 == 0) {
+            hot.record("warm", 5, 1000, true);
+        }
+    }
+
+    std::vector<HotKeys::Entry> top;
+    hot.getTopByOps(top);
+    assert(top.size() == HotKeys::TOP);
+    assert(top[0].key == "hot");
+    assert(top[0].count >= 1000);
+    assert(top[0].count - top[0].error >= 1000);
+    assert(top[0].gets + top[0].sets <= top[0].count);
+    assert(top[1].key == "warm");
+
+    hot.getTopByBytes(top);
+    assert(top[0].key == "warm");
+    assert(top[0].count >= 500 * 1000);
+    assert(top[1].key == "hot");
+
+    hot.getTopVBucketsByOps(top);
+    assert(top.size() == 8);
+    assert(top[0].key == "3");
+    assert(top[0].count == 1125);
+    assert(top[0].gets == 1000);
+    assert(top[0].sets == 125);
+
+    hot.getTopVBucketsByBytes(top);
+    assert(top[0].key == "5");
+    assert(top[0].count == 500 * 1000 + 125 * 10);
+
+    hot.reset();
+    hot.getTopByOps(top);
+    assert(top.empty());
+    hot.getTopVBucketsByOps(top);
+    assert(top.empty());
+}
+
+static void testScaled() {
+    HotKeys hot(100);
+    hot.record("k", 0, 10, false);
+    std::vector<HotKeys::Entry> top;
+    hot.getTopByOps(top);
+    assert(top.size() == 1);
+    assert(top[0].count == 100);
+    assert(top[0].gets == 100);
+    hot.getTopByBytes(top);
+    assert(top[0].count == 1000);
+}
+
+int main() {
+    testDisabled();
+    testSampling();
+    testTopKeys();
+    testScaled();
+    return 0;
+}
@@ -63,5 +63,23 @@ int main(void)
    hrtime_t later = gethrtime();
    assert(now + 200 < later);
 
+   // Whichever clock it's read from, it never goes back and keeps time
+   // with the wall clock.
+   hrtime_t prev = gethrtime();
+   for (int i = 0; i < 100000; ++i) {
+       hrtime_t t = gethrtime();
+       assert(t >= prev);
+       prev = t;
+   }
+   struct timeval start, stop;
+   gettimeofday(&start, NULL);
+   now = gethrtime();
+   usleep(50000);
+   later = gethrtime();
+   gettimeofday(&stop, NULL);
+   hrtime_t wall = usec_since_tv(start, stop) * 1000;
+   assert(later - now > wall * 9 / 10);
+   assert(later - now < wall * 11 / 10);
+
    return 0;
 }
@@ -0,0 +1,111 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <cassert>
+#include <map>
+#include <string>
+
+#include "huge_pages.h"
+
+static size_t getStat(const char *name) {
+    std::map<std::string, size_t> stats;
+    HugePages::getStats(stats);
+    assert(stats.find(name) != stats.end());
+    return stats[name];
+}
+
+static bool isZeroed(const char *p, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (p[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void testOff() {
+    HugePages::setMode("off");
+    assert(HugePages::getMode() == HugePages::OFF);
+    char *p = static_cast<char*>(HugePages::allocate(HUGE_PAGE_SIZE * 2));
+    assert(p != NULL);
+    assert(isZeroed(p, HUGE_PAGE_SIZE * 2));
+    assert(getStat("mapped_bytes") == 0);
+    HugePages::release(p);
+    HugePages::release(NULL);
+}
+
+static void testTransparent() {
+    HugePages::setMode("transparent");
+    assert(HugePages::getMode() == HugePages::TRANSPARENT);
+
+    // Smaller than a huge page, it comes from the heap.
+    char *small = static_cast<char*>(HugePages::allocate(4096));
+    assert(small != NULL && isZeroed(small, 4096));
+    assert(getStat("mapped_bytes") == 0);
+
+    // Bigger ones are rounded up to huge pages, aligned to one.
+    size_t len = HUGE_PAGE_SIZE + 100;
+    char *big = static_cast<char*>(HugePages::allocate(len));
+    assert(big != NULL && isZeroed(big, len));
+    size_t mapped = getStat("mapped_bytes");
+    if (mapped > 0) {
+        assert(mapped == 2 * HUGE_PAGE_SIZE);
+        assert(reinterpret_cast<uintptr_t>(big) % HUGE_PAGE_SIZE == 0);
+        assert(getStat("explicit_bytes") == 0);
+    } else {
+        // No madvise here; it fell back to the heap.
+        assert(getStat("fallbacks") == 1);
+    }
+    memset(big, 'x', len);
+
+    HugePages::release(small);
+    HugePages::release(big);
+    assert(getStat("mapped_bytes") == 0);
+    HugePages::setMode("off");
+}
+
+static void testExplicit() {
+    HugePages::setMode("explicit");
+    assert(HugePages::getMode() == HugePages::EXPLICIT);
+    size_t fallbacks = getStat("fallbacks");
+
+    // Whether or not there's a reserved pool, the memory is good.
+    char *p = static_cast<char*>(HugePages::allocate(HUGE_PAGE_SIZE));
+    assert(p != NULL && isZeroed(p, HUGE_PAGE_SIZE));
+    if (getStat("explicit_bytes") == 0) {
+        assert(getStat("fallbacks") == fallbacks + 1);
+    } else {
+        assert(getStat("explicit_bytes") == HUGE_PAGE_SIZE);
+    }
+    memset(p, 'x', HUGE_PAGE_SIZE);
+    HugePages::release(p);
+    assert(getStat("explicit_bytes") == 0);
+    assert(getStat("mapped_bytes") == 0);
+    HugePages::setMode("off");
+}
+
+int main() {
+    testOff();
+    testTransparent();
+    testExplicit();
+    return 0;
+}
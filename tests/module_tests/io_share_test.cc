@@ -0,0 +1,120 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+
+#include "io_share.h"
+
+static const hrtime_t QUANTUM = 1000;
+
+static int a, b, c;
+
+static void testUnshared() {
+    IOShare share(QUANTUM);
+    share.addBucket(&a, 1, 0);
+    assert(!share.request(&a));
+    assert(!share.acquire(&a));
+    // A bucket that never registered isn't held back either.
+    share.addBucket(&b, 1, 2);
+    assert(!share.acquire(&c));
+}
+
+static void testSlots() {
+    IOShare share(QUANTUM);
+    share.addBucket(&a, 1, 1);
+    share.addBucket(&b, 1, 2);
+    assert(share.getSlots() == 2);
+
+    assert(share.acquire(&a));
+    assert(share.acquire(&a));
+    assert(share.request(&b));
+    assert(!share.claim(&b));
+    share.release(&a, 1);
+    assert(share.claim(&b));
+    assert(share.getBucket(&b).running == 1);
+
+    // Whatever a bucket holds goes back with it.
+    share.removeBucket(&a);
+    assert(share.getSlots() == 2);
+    assert(share.acquire(&b));
+    assert(share.getBucket(&b).running == 2);
+}
+
+/**
+ * Keep a number of tasks of every bucket waiting on one slot, and count
+ * who gets it.
+ */
+static void runShares(IOShare &share, const void **buckets, size_t n,
+                      hrtime_t cost, size_t rounds, size_t *counts) {
+    for (size_t i = 0; i < n; ++i) {
+        counts[i] = 0;
+        for (int t = 0; t < 4; ++t) {
+            assert(share.request(buckets[i]));
+        }
+    }
+    for (size_t r = 0; r < rounds; ++r) {
+        size_t holder = n;
+        for (size_t i = 0; i < n; ++i) {
+            if (share.claim(buckets[i])) {
+                assert(holder == n);
+                holder = i;
+            }
+        }
+        assert(holder < n);
+        ++counts[holder];
+        share.release(buckets[holder], cost);
+        assert(share.request(buckets[holder]));
+    }
+}
+
+static void testWeights() {
+    IOShare share(QUANTUM);
+    share.addBucket(&a, 1, 1);
+    share.addBucket(&b, 3, 1);
+    const void *buckets[] = { &a, &b };
+    size_t counts[2];
+    runShares(share, buckets, 2, QUANTUM / 4, 4000, counts);
+    // b gets three times the IO time a gets.
+    assert(counts[1] > counts[0] * 29 / 10);
+    assert(counts[1] < counts[0] * 31 / 10);
+}
+
+static void testLongTasks() {
+    IOShare share(QUANTUM);
+    share.addBucket(&a, 1, 1);
+    share.addBucket(&b, 1, 1);
+    share.addBucket(&c, 1, 1);
+    const void *buckets[] = { &a, &b, &c };
+    size_t counts[3];
+    // Tasks ten turns long are paid for over the next turns, so each
+    // bucket still gets a third of the slot.
+    runShares(share, buckets, 3, QUANTUM * 10, 300, counts);
+    for (size_t i = 0; i < 3; ++i) {
+        assert(counts[i] >= 99 && counts[i] <= 101);
+    }
+    assert(share.getBucket(&a).ioTime == counts[0] * QUANTUM * 10);
+}
+
+int main() {
+    testUnshared();
+    testSlots();
+    testWeights();
+    testLongTasks();
+    return 0;
+}
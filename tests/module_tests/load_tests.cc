@@ -0,0 +1,778 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * A load generator driving the engine through engine_testapp, to
+ * reproduce the load of a production bucket offline.
+ *
+ * A number of threads run a mix of gets, sets, deletes and getMetas at
+ * a target rate, with the keys and value sizes drawn from a distribution,
+ * while TAP streams take the mutations.  The engine's config, and so its
+ * backend (couchdb, or the dummy one of a build without couchstore), is
+ * the one the suite is run with.  The load is set by the environment:
+ *
+ *   LOAD_THREADS      the threads sending ops (4)
+ *   LOAD_OPS          the ops sent by all of them (100000)
+ *   LOAD_RATE         the ops per second of all of them, 0 for flat out (0)
+ *   LOAD_MIX          the weights of the ops
+ *                     ("get:60,set:30,delete:5,getmeta:5")
+ *   LOAD_KEYS         the keys the ops are on (10000)
+ *   LOAD_KEY_DIST     uniform, zipfian or latest (uniform)
+ *   LOAD_ZIPF_THETA   the skew of the zipfian distributions (0.99)
+ *   LOAD_VALUE_MIN    the smallest value set (100)
+ *   LOAD_VALUE_MAX    the biggest value set (LOAD_VALUE_MIN)
+ *   LOAD_VALUE_DIST   uniform or zipfian, from the smallest up (uniform)
+ *   LOAD_VBUCKETS     the vbuckets the keys are spread over (1)
+ *   LOAD_TAP_STREAMS  the TAP streams taking the mutations (0)
+ *   LOAD_PRELOAD      set every key before the load, 0 not to (1)
+ *
+ * With latest the sets go through the keys in turn, and the other ops
+ * favour the keys set most recently.
+ *
+ * It reports a line per kind of op of
+ *
+ *   op <op> <count> <misses> <errors> <p50> <p90> <p99> <p99.9> <max>
+ *
+ * with the latencies in microseconds, measured from when the op was due
+ * at the target rate so a stall counts against every op it held up, and
+ * lines of the throughput, the TAP streams and the resources used.
+ */
+
+#include "config.h"
+
+#ifdef HAS_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+#include <assert.h>
+#include <math.h>
+#include <memcached/engine.h>
+#include <memcached/engine_testapp.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "ep-engine/command_ids.h"
+
+#ifdef linux
+/* /usr/include/netinet/in.h defines macros from ntohs() to _bswap_nn to
+ * optimize the conversion functions, but the prototypes generate warnings
+ * from gcc. The conversion methods isn't the bottleneck for my app, so
+ * just remove the warnings by undef'ing the optimization ..
+ */
+#undef ntohs
+#undef ntohl
+#undef htons
+#undef htonl
+#endif
+
+bool abort_msg(const char *expr, const char *msg, int line);
+
+#define check(expr, msg) \
+    static_cast<void>((expr) ? 0 : abort_msg(#expr, msg, __LINE__))
+
+std::map<std::string, std::string> vals;
+protocol_binary_response_status last_status(
+    static_cast<protocol_binary_response_status>(0));
+
+struct test_harness testHarness;
+
+bool abort_msg(const char *expr, const char *msg, int line) {
+    fprintf(stderr, "%s:%d Test failed: `%s' (%s)\n",
+            __FILE__, line, msg, expr);
+    abort();
+    // UNREACHABLE
+    return false;
+}
+
+extern "C" {
+    static void rmdb(void) {
+        unlink("/tmp/test");
+    }
+
+    static bool teardown(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+        (void)h; (void)h1;
+        atexit(rmdb);
+        vals.clear();
+        return true;
+    }
+
+    static void add_stats(const char *key, const uint16_t klen,
+                          const char *val, const uint32_t vlen,
+                          const void *cookie) {
+        (void)cookie;
+        std::string k(key, klen);
+        std::string v(val, vlen);
+        vals[k] = v;
+    }
+
+    //! Only used by the main thread, before the load starts
+    static bool add_response(const void *key, uint16_t keylen,
+                             const void *ext, uint8_t extlen,
+                             const void *body, uint32_t bodylen,
+                             uint8_t datatype, uint16_t status,
+                             uint64_t cas, const void *cookie) {
+        (void)key; (void)keylen; (void)ext; (void)extlen; (void)body;
+        (void)bodylen; (void)datatype; (void)cas; (void)cookie;
+        last_status = static_cast<protocol_binary_response_status>(status);
+        return true;
+    }
+
+    //! The load threads only care what the engine returned
+    static bool ignore_response(const void *key, uint16_t keylen,
+                                const void *ext, uint8_t extlen,
+                                const void *body, uint32_t bodylen,
+                                uint8_t datatype, uint16_t status,
+                                uint64_t cas, const void *cookie) {
+        (void)key; (void)keylen; (void)ext; (void)extlen; (void)body;
+        (void)bodylen; (void)datatype; (void)status; (void)cas;
+        (void)cookie;
+        return true;
+    }
+}
+
+static inline void decayingSleep(useconds_t *sleepTime) {
+    static const useconds_t maxSleepTime = 500000;
+    usleep(*sleepTime);
+    *sleepTime = std::min(*sleepTime << 1, maxSleepTime);
+}
+
+static size_t env_int(const char *k, size_t rv) {
+    char *x = getenv(k);
+    if (x) {
+        rv = static_cast<size_t>(atol(x));
+    }
+    return rv;
+}
+
+static double env_double(const char *k, double rv) {
+    char *x = getenv(k);
+    if (x) {
+        rv = atof(x);
+    }
+    return rv;
+}
+
+static std::string env_string(const char *k, const char *rv) {
+    char *x = getenv(k);
+    return std::string(x ? x : rv);
+}
+
+static std::string get_stat(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                            const char *statname, const char *statkey = NULL) {
+    vals.clear();
+    check(h1->get_stats(h, NULL, statkey, statkey == NULL ? 0 : strlen(statkey),
+                        add_stats) == ENGINE_SUCCESS,
+          "Failed to get stats.");
+    return vals[statname];
+}
+
+static size_t get_int_stat(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                           const char *statname, const char *statkey = NULL) {
+    return static_cast<size_t>(atol(get_stat(h, h1, statname,
+                                             statkey).c_str()));
+}
+
+static protocol_binary_request_header *createPacket(uint8_t opcode,
+                                                    uint16_t vbid,
+                                                    const char *ext,
+                                                    uint8_t extlen,
+                                                    const char *key,
+                                                    uint16_t keylen) {
+    uint32_t headerlen = sizeof(protocol_binary_request_header);
+    char *pkt_raw = static_cast<char*>(calloc(1, headerlen + extlen + keylen));
+    assert(pkt_raw);
+    protocol_binary_request_header *req =
+        reinterpret_cast<protocol_binary_request_header*>(pkt_raw);
+    req->request.magic = PROTOCOL_BINARY_REQ;
+    req->request.opcode = opcode;
+    req->request.keylen = htons(keylen);
+    req->request.extlen = extlen;
+    req->request.vbucket = htons(vbid);
+    req->request.bodylen = htonl(keylen + extlen);
+    if (extlen > 0) {
+        memcpy(pkt_raw + headerlen, ext, extlen);
+    }
+    if (keylen > 0) {
+        memcpy(pkt_raw + headerlen + extlen, key, keylen);
+    }
+    return req;
+}
+
+static void set_vbucket_active(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                               uint16_t vb) {
+    uint32_t state = htonl(static_cast<uint32_t>(vbucket_state_active));
+    protocol_binary_request_header *pkt =
+        createPacket(PROTOCOL_BINARY_CMD_SET_VBUCKET, vb,
+                     reinterpret_cast<char*>(&state), sizeof(state), NULL, 0);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Failed to set a vbucket's state.");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Failed to make a vbucket active.");
+    free(pkt);
+}
+
+enum load_op_t {
+    LOAD_GET,
+    LOAD_SET,
+    LOAD_DELETE,
+    LOAD_GETMETA,
+    LOAD_NUM_OPS
+};
+
+static const char *load_op_names[LOAD_NUM_OPS] = {
+    "get", "set", "delete", "getmeta"
+};
+
+/**
+ * A xorshift64* generator, so each load thread has its own numbers with
+ * no locking.
+ */
+class LoadRandom {
+public:
+    LoadRandom(uint64_t seed) : state(seed * 2654435761ULL + 1) {}
+
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    }
+
+    //! A double in [0, 1)
+    double nextDouble() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    uint64_t state;
+};
+
+/**
+ * Draws numbers from 0 up to n uniformly, or with the zipfian
+ * distribution of Gray et al.'s "Quickly generating billion-record
+ * synthetic databases", where 0 is the most likely.
+ */
+class Distribution {
+public:
+    Distribution(size_t num, bool zipf, double th) :
+        n(std::max(num, static_cast<size_t>(1))), zipfian(zipf), theta(th),
+        zetan(0), alpha(0), eta(0) {
+        if (zipfian) {
+            for (size_t i = 1; i <= n; ++i) {
+                zetan += 1.0 / pow(static_cast<double>(i), theta);
+            }
+            double zeta2 = 1.0 + pow(0.5, theta);
+            alpha = 1.0 / (1.0 - theta);
+            eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+        }
+    }
+
+    size_t next(LoadRandom &rnd) const {
+        double u = rnd.nextDouble();
+        if (!zipfian) {
+            return static_cast<size_t>(u * n);
+        }
+        double uz = u * zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + pow(0.5, theta)) {
+            return std::min(static_cast<size_t>(1), n - 1);
+        }
+        size_t rv = static_cast<size_t>(n * pow(eta * u - eta + 1, alpha));
+        return std::min(rv, n - 1);
+    }
+
+private:
+    size_t n;
+    bool zipfian;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+};
+
+//! The load, as the environment sets it
+struct LoadConfig {
+    LoadConfig() :
+        threads(std::max(env_int("LOAD_THREADS", 4), static_cast<size_t>(1))),
+        ops(env_int("LOAD_OPS", 100000)),
+        rate(env_int("LOAD_RATE", 0)),
+        keys(std::max(env_int("LOAD_KEYS", 10000), static_cast<size_t>(1))),
+        keyDist(env_string("LOAD_KEY_DIST", "uniform")),
+        theta(env_double("LOAD_ZIPF_THETA", 0.99)),
+        valueMin(env_int("LOAD_VALUE_MIN", 100)),
+        valueMax(std::max(env_int("LOAD_VALUE_MAX", valueMin), valueMin)),
+        valueDist(env_string("LOAD_VALUE_DIST", "uniform")),
+        vbuckets(std::max(env_int("LOAD_VBUCKETS", 1), static_cast<size_t>(1))),
+        tapStreams(env_int("LOAD_TAP_STREAMS", 0)),
+        preload(env_int("LOAD_PRELOAD", 1) != 0),
+        totalWeight(0) {
+        parseMix(env_string("LOAD_MIX", "get:60,set:30,delete:5,getmeta:5"));
+    }
+
+    bool valid() const {
+        return totalWeight > 0 && theta > 0 && theta < 1 &&
+            (keyDist == "uniform" || keyDist == "zipfian" ||
+             keyDist == "latest") &&
+            (valueDist == "uniform" || valueDist == "zipfian");
+    }
+
+    load_op_t pickOp(LoadRandom &rnd) const {
+        size_t w = static_cast<size_t>(rnd.next() % totalWeight);
+        for (int i = 0; i < LOAD_NUM_OPS; ++i) {
+            if (w < weights[i]) {
+                return static_cast<load_op_t>(i);
+            }
+            w -= weights[i];
+        }
+        return LOAD_GET;
+    }
+
+    size_t threads;
+    size_t ops;
+    size_t rate;
+    size_t keys;
+    std::string keyDist;
+    double theta;
+    size_t valueMin;
+    size_t valueMax;
+    std::string valueDist;
+    size_t vbuckets;
+    size_t tapStreams;
+    bool preload;
+    size_t weights[LOAD_NUM_OPS];
+    size_t totalWeight;
+
+private:
+    void parseMix(const std::string &mix) {
+        std::fill(weights, weights + LOAD_NUM_OPS, 0);
+        size_t pos = 0;
+        while (pos < mix.length()) {
+            size_t end = mix.find(',', pos);
+            if (end == std::string::npos) {
+                end = mix.length();
+            }
+            std::string entry(mix.substr(pos, end - pos));
+            size_t colon = entry.find(':');
+            std::string name(entry.substr(0, colon));
+            size_t weight = colon == std::string::npos ? 1 :
+                static_cast<size_t>(atol(entry.c_str() + colon + 1));
+            bool known(false);
+            for (int i = 0; i < LOAD_NUM_OPS; ++i) {
+                if (name == load_op_names[i]) {
+                    weights[i] = weight;
+                    known = true;
+                }
+            }
+            if (!known) {
+                fprintf(stderr, "Unknown op in LOAD_MIX: %s\n", name.c_str());
+                totalWeight = 0;
+                return;
+            }
+            pos = end + 1;
+        }
+        for (int i = 0; i < LOAD_NUM_OPS; ++i) {
+            totalWeight += weights[i];
+        }
+    }
+};
+
+/**
+ * What the load threads share, and what each of them measured.
+ */
+struct LoadState {
+    LoadState(ENGINE_HANDLE *_h, ENGINE_HANDLE_V1 *_h1, const LoadConfig &c) :
+        h(_h), h1(_h1), config(c),
+        keyDist(c.keys, c.keyDist != "uniform", c.theta),
+        valueDist(c.valueMax - c.valueMin + 1, c.valueDist == "zipfian",
+                  c.theta),
+        latest(0), value(std::max(c.valueMax, static_cast<size_t>(1)), 'x'),
+        start(0), done(false) {}
+
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *h1;
+    const LoadConfig &config;
+    Distribution keyDist;
+    Distribution valueDist;
+    //! The key set last, which latest favours
+    Atomic<size_t> latest;
+    std::string value;
+    hrtime_t start;
+    Atomic<bool> done;
+};
+
+struct LoadThread {
+    LoadThread() : state(NULL), id(0), ops(0), rnd(0) {
+        std::fill(misses, misses + LOAD_NUM_OPS, 0);
+        std::fill(errors, errors + LOAD_NUM_OPS, 0);
+    }
+
+    pthread_t thread;
+    LoadState *state;
+    size_t id;
+    size_t ops;
+    LoadRandom rnd;
+    std::vector<hrtime_t> latencies[LOAD_NUM_OPS];
+    size_t misses[LOAD_NUM_OPS];
+    size_t errors[LOAD_NUM_OPS];
+};
+
+struct TapStream {
+    TapStream() : state(NULL), id(0), mutations(0), deletions(0) {}
+
+    pthread_t thread;
+    LoadState *state;
+    size_t id;
+    size_t mutations;
+    size_t deletions;
+};
+
+static std::string keyName(size_t k) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "load_key_%lu", static_cast<unsigned long>(k));
+    return std::string(buf);
+}
+
+static ENGINE_ERROR_CODE doSet(LoadState &s, const void *cookie,
+                               const std::string &key, uint16_t vb,
+                               size_t vlen) {
+    item *it = NULL;
+    ENGINE_ERROR_CODE rv = s.h1->allocate(s.h, cookie, &it, key.data(),
+                                          key.length(), vlen, 0, 0);
+    if (rv != ENGINE_SUCCESS) {
+        return rv;
+    }
+    item_info info;
+    info.nvalue = 1;
+    check(s.h1->get_item_info(s.h, cookie, it, &info),
+          "Failed to get an item's info.");
+    memcpy(info.value[0].iov_base, s.value.data(), vlen);
+    uint64_t cas(0);
+    rv = s.h1->store(s.h, cookie, it, &cas, OPERATION_SET, vb);
+    s.h1->release(s.h, cookie, it);
+    return rv;
+}
+
+static ENGINE_ERROR_CODE doOp(LoadState &s, LoadThread &t,
+                              const void *cookie, load_op_t op) {
+    const LoadConfig &c(s.config);
+    size_t k;
+    if (c.keyDist == "latest") {
+        if (op == LOAD_SET) {
+            k = ++s.latest % c.keys;
+        } else {
+            k = (s.latest.get() + c.keys - s.keyDist.next(t.rnd)) % c.keys;
+        }
+    } else {
+        k = s.keyDist.next(t.rnd);
+    }
+    std::string key(keyName(k));
+    uint16_t vb = static_cast<uint16_t>(k % c.vbuckets);
+
+    switch (op) {
+    case LOAD_GET:
+        {
+            item *it = NULL;
+            ENGINE_ERROR_CODE rv = s.h1->get(s.h, cookie, &it, key.data(),
+                                             key.length(), vb);
+            if (rv == ENGINE_SUCCESS) {
+                s.h1->release(s.h, cookie, it);
+            }
+            return rv;
+        }
+    case LOAD_SET:
+        return doSet(s, cookie, key, vb, c.valueMin + s.valueDist.next(t.rnd));
+    case LOAD_DELETE:
+        {
+            uint64_t cas(0);
+            return s.h1->remove(s.h, cookie, key.data(), key.length(), &cas,
+                                vb);
+        }
+    case LOAD_GETMETA:
+        {
+            protocol_binary_request_header *pkt =
+                createPacket(CMD_GET_META, vb, NULL, 0, key.data(),
+                             key.length());
+            ENGINE_ERROR_CODE rv = s.h1->unknown_command(s.h, cookie, pkt,
+                                                         ignore_response);
+            free(pkt);
+            return rv;
+        }
+    default:
+        abort();
+    }
+    return ENGINE_FAILED;
+}
+
+extern "C" {
+static void *launch_load_thread(void *arg) {
+    LoadThread &t(*static_cast<LoadThread*>(arg));
+    LoadState &s(*t.state);
+    const void *cookie = testHarness.create_cookie();
+
+    // Each thread's ops are due at its share of the rate.
+    hrtime_t interval(0);
+    if (s.config.rate > 0) {
+        interval = static_cast<hrtime_t>(1000000000.0 * s.config.threads /
+                                         s.config.rate);
+    }
+    hrtime_t due = s.start + interval * t.id / s.config.threads;
+    for (size_t i = 0; i < t.ops; ++i) {
+        hrtime_t now = gethrtime();
+        if (interval > 0) {
+            if (now < due) {
+                usleep(static_cast<useconds_t>((due - now) / 1000));
+            }
+        } else {
+            due = now;
+        }
+        load_op_t op = s.config.pickOp(t.rnd);
+        ENGINE_ERROR_CODE rv = doOp(s, t, cookie, op);
+        t.latencies[op].push_back(gethrtime() - due);
+        if (rv == ENGINE_KEY_ENOENT) {
+            ++t.misses[op];
+        } else if (rv != ENGINE_SUCCESS) {
+            ++t.errors[op];
+        }
+        due += interval;
+    }
+
+    testHarness.destroy_cookie(cookie);
+    return NULL;
+}
+
+static void *launch_tap_stream(void *arg) {
+    TapStream &t(*static_cast<TapStream*>(arg));
+    LoadState &s(*t.state);
+    const void *cookie = testHarness.create_cookie();
+    testHarness.lock_cookie(cookie);
+    char name[32];
+    snprintf(name, sizeof(name), "load_tap_%lu",
+             static_cast<unsigned long>(t.id));
+    TAP_ITERATOR iter = s.h1->get_tap_iterator(s.h, cookie, name,
+                                               strlen(name), 0, NULL, 0);
+    check(iter != NULL, "Failed to create a tap iterator");
+
+    item *it;
+    void *engine_specific;
+    uint16_t nengine_specific;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+    tap_event_t event;
+    do {
+        event = iter(s.h, cookie, &it, &engine_specific, &nengine_specific,
+                     &ttl, &flags, &seqno, &vbucket);
+        switch (event) {
+        case TAP_PAUSE:
+            if (!s.done.get()) {
+                testHarness.waitfor_cookie(cookie);
+            }
+            break;
+        case TAP_MUTATION:
+            ++t.mutations;
+            s.h1->release(s.h, cookie, it);
+            break;
+        case TAP_DELETION:
+            ++t.deletions;
+            s.h1->release(s.h, cookie, it);
+            break;
+        case TAP_CHECKPOINT_START:
+        case TAP_CHECKPOINT_END:
+            s.h1->release(s.h, cookie, it);
+            break;
+        default:
+            break;
+        }
+    } while (event != TAP_DISCONNECT && !(event == TAP_PAUSE && s.done.get()));
+
+    testHarness.unlock_cookie(cookie);
+    testHarness.destroy_cookie(cookie);
+    return NULL;
+}
+}
+
+static double toMicros(hrtime_t t) {
+    return t / 1000.0;
+}
+
+//! The latency no more than pct percent of the sorted ones are above
+static hrtime_t percentile(const std::vector<hrtime_t> &sorted, double pct) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = static_cast<size_t>(ceil(sorted.size() * pct / 100.0));
+    return sorted[std::min(std::max(i, static_cast<size_t>(1)),
+                           sorted.size()) - 1];
+}
+
+static double cpuSeconds(const struct timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+extern "C" {
+static test_result test_load(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    LoadConfig config;
+    check(config.valid(), "Invalid LOAD_* settings.");
+    for (size_t vb = 1; vb < config.vbuckets; ++vb) {
+        set_vbucket_active(h, h1, static_cast<uint16_t>(vb));
+    }
+
+    LoadState state(h, h1, config);
+    if (config.preload) {
+        LoadRandom rnd(0);
+        for (size_t k = 0; k < config.keys; ++k) {
+            check(doSet(state, NULL, keyName(k),
+                        static_cast<uint16_t>(k % config.vbuckets),
+                        config.valueMin + state.valueDist.next(rnd))
+                  == ENGINE_SUCCESS, "Failed to preload a key.");
+        }
+        state.latest.set(config.keys - 1);
+        useconds_t sleepTime = 128;
+        while (get_int_stat(h, h1, "ep_queue_size") > 0) {
+            decayingSleep(&sleepTime);
+        }
+    }
+
+    std::vector<TapStream> streams(config.tapStreams);
+    for (size_t i = 0; i < streams.size(); ++i) {
+        streams[i].state = &state;
+        streams[i].id = i;
+        check(pthread_create(&streams[i].thread, NULL, launch_tap_stream,
+                             &streams[i]) == 0,
+              "Failed to start a tap stream.");
+    }
+
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+    std::vector<LoadThread> threads(config.threads);
+    state.start = gethrtime();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].state = &state;
+        threads[i].id = i;
+        threads[i].ops = config.ops / config.threads +
+            (i < config.ops % config.threads ? 1 : 0);
+        threads[i].rnd = LoadRandom(i + 1);
+        check(pthread_create(&threads[i].thread, NULL, launch_load_thread,
+                             &threads[i]) == 0,
+              "Failed to start a load thread.");
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        check(pthread_join(threads[i].thread, NULL) == 0,
+              "Failed to join a load thread.");
+    }
+    hrtime_t elapsed = gethrtime() - state.start;
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    size_t queueSize = get_int_stat(h, h1, "ep_queue_size");
+
+    // Wake the streams with a last mutation, and stop them there.
+    state.done.set(true);
+    check(doSet(state, NULL, "load_tap_stop", 0, 1) == ENGINE_SUCCESS,
+          "Failed to stop the tap streams.");
+    for (size_t i = 0; i < streams.size(); ++i) {
+        check(pthread_join(streams[i].thread, NULL) == 0,
+              "Failed to join a tap stream.");
+    }
+
+    printf("# op count misses errors p50_us p90_us p99_us p99.9_us max_us\n");
+    size_t total(0);
+    for (int op = 0; op < LOAD_NUM_OPS; ++op) {
+        std::vector<hrtime_t> all;
+        size_t misses(0), errors(0);
+        for (size_t i = 0; i < threads.size(); ++i) {
+            all.insert(all.end(), threads[i].latencies[op].begin(),
+                       threads[i].latencies[op].end());
+            misses += threads[i].misses[op];
+            errors += threads[i].errors[op];
+        }
+        std::sort(all.begin(), all.end());
+        total += all.size();
+        printf("op %s %lu %lu %lu %.1f %.1f %.1f %.1f %.1f\n",
+               load_op_names[op], static_cast<unsigned long>(all.size()),
+               static_cast<unsigned long>(misses),
+               static_cast<unsigned long>(errors),
+               toMicros(percentile(all, 50)), toMicros(percentile(all, 90)),
+               toMicros(percentile(all, 99)), toMicros(percentile(all, 99.9)),
+               toMicros(all.empty() ? 0 : all.back()));
+    }
+    double seconds = elapsed / 1000000000.0;
+    printf("throughput ops=%lu seconds=%.3f ops_per_sec=%.0f\n",
+           static_cast<unsigned long>(total), seconds,
+           seconds > 0 ? total / seconds : 0);
+    for (size_t i = 0; i < streams.size(); ++i) {
+        printf("tap %lu mutations=%lu deletions=%lu\n",
+               static_cast<unsigned long>(i),
+               static_cast<unsigned long>(streams[i].mutations),
+               static_cast<unsigned long>(streams[i].deletions));
+    }
+    printf("resources user_cpu_s=%.3f sys_cpu_s=%.3f max_rss_kb=%ld\n",
+           cpuSeconds(after.ru_utime) - cpuSeconds(before.ru_utime),
+           cpuSeconds(after.ru_stime) - cpuSeconds(before.ru_stime),
+           after.ru_maxrss);
+    printf("engine mem_used=%s curr_items=%s ep_queue_size=%lu "
+           "ep_bg_fetched=%s ep_tmp_oom_errors=%s\n",
+           get_stat(h, h1, "mem_used").c_str(),
+           get_stat(h, h1, "curr_items").c_str(),
+           static_cast<unsigned long>(queueSize),
+           get_stat(h, h1, "ep_bg_fetched").c_str(),
+           get_stat(h, h1, "ep_tmp_oom_errors").c_str());
+
+    // How long the backlog the load left took to write out
+    hrtime_t drainStart = gethrtime();
+    useconds_t sleepTime = 128;
+    while (get_int_stat(h, h1, "ep_queue_size") > 0) {
+        decayingSleep(&sleepTime);
+    }
+    printf("drain seconds=%.3f ep_total_persisted=%s\n",
+           (gethrtime() - drainStart) / 1000000000.0,
+           get_stat(h, h1, "ep_total_persisted").c_str());
+    fflush(stdout);
+
+    return SUCCESS;
+}
+}
+
+extern "C" MEMCACHED_PUBLIC_API
+bool setup_suite(struct test_harness *th) {
+    testHarness = *th;
+    return true;
+}
+
+extern "C" MEMCACHED_PUBLIC_API
+engine_test_t* get_tests(void) {
+
+    static engine_test_t tests[]  = {
+        {"test load", test_load, NULL, teardown, NULL, NULL, NULL},
+        {NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+    };
+    return tests;
+}
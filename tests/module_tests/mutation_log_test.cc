@@ -23,6 +23,7 @@
 #include <algorithm>
 #include <map>
 #include <set>
+#include <sstream>
 #include <stdexcept>
 #include <vector>
 
@@ -177,6 +178,166 @@ static void testLogging() {
 
         assert(maps[2].find("key1") != maps[2].end());
         assert(maps[3].find("key2") != maps[3].end());
+
+        // Only the vbuckets asked for, as each shard applies its own.
+        std::map<std::string, uint64_t> some[4];
+        std::vector<uint16_t> vbs;
+        vbs.push_back(3);
+        vbs.push_back(1);
+        h.apply(&some, loaderFun, vbs);
+
+        assert(some[2].size() == 0);
+        assert(some[3].size() == 1);
+        assert(some[3].find("key2") != some[3].end());
+    }
+
+    remove(TMP_LOG_FILE);
+}
+
+static void orderFun(void *arg, uint16_t, const std::string &,
+                     uint64_t rowid) {
+    std::vector<uint64_t> *rowids = reinterpret_cast<std::vector<uint64_t> *>(arg);
+    rowids->push_back(rowid);
+}
+
+static void testBatchedWrites() {
+    remove(TMP_LOG_FILE);
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        // Batches of two blocks, and a few left to be written at close.
+        ml.setWriteBatch(2);
+        ml.open();
+        for (int i = 0; i < 1000; ++i) {
+            std::stringstream key;
+            key << "key" << i;
+            ml.newItem(i % 4, key.str(), i + 1);
+        }
+        ml.commit1();
+        ml.commit2();
+        assert(ml.itemsLogged[ML_NEW] == 1000);
+    }
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        MutationLogHarvester h(ml);
+        for (uint16_t vb = 0; vb < 4; ++vb) {
+            h.setVBucket(vb);
+        }
+
+        assert(h.load());
+        assert(h.getItemsSeen()[ML_NEW] == 1000);
+
+        std::map<std::string, uint64_t> maps[4];
+        h.apply(&maps, loaderFun);
+        for (int vb = 0; vb < 4; ++vb) {
+            assert(maps[vb].size() == 250);
+        }
+        assert(maps[2].find("key42") != maps[2].end());
+
+        // They're applied in the order they were written to the file in.
+        std::vector<uint64_t> rowids;
+        h.apply(&rowids, orderFun);
+        assert(rowids.size() == 1000);
+        for (size_t i = 1; i < rowids.size(); ++i) {
+            // Each vbucket's are applied after the one before.
+            assert(i % 250 == 0 || rowids[i - 1] < rowids[i]);
+        }
+    }
+
+    remove(TMP_LOG_FILE);
+}
+
+struct AppliedEntry {
+    uint16_t vb;
+    std::string key;
+};
+
+static void appliedFun(void *arg, uint16_t vb, const std::string &k,
+                       uint64_t) {
+    std::vector<AppliedEntry> *applied = reinterpret_cast<std::vector<AppliedEntry> *>(arg);
+    AppliedEntry e;
+    e.vb = vb;
+    e.key = k;
+    applied->push_back(e);
+}
+
+static void testHotFirst() {
+    remove(TMP_LOG_FILE);
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        ml.newItem(0, "cold0", 1, 3);
+        ml.newItem(0, "hot0", 2, 0);
+        ml.newItem(1, "warm1", 3, 2);
+        ml.newItem(1, "hot1", 4, 0);
+        ml.newItem(0, "warm0", 5, 2);
+        ml.commit1();
+        ml.commit2();
+        // The NRU value doesn't make it another type.
+        assert(ml.itemsLogged[ML_NEW] == 5);
+    }
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        MutationLogHarvester h(ml);
+        h.setVBucket(0);
+        h.setVBucket(1);
+        assert(h.load());
+        assert(h.getItemsSeen()[ML_NEW] == 5);
+
+        // The hot ones of both vbuckets, then the warm ones, then the cold.
+        std::vector<AppliedEntry> applied;
+        h.apply(&applied, appliedFun);
+        assert(applied.size() == 5);
+        assert(applied[0].vb == 0 && applied[0].key == "hot0");
+        assert(applied[1].vb == 1 && applied[1].key == "hot1");
+        assert(applied[2].vb == 0 && applied[2].key == "warm0");
+        assert(applied[3].vb == 1 && applied[3].key == "warm1");
+        assert(applied[4].vb == 0 && applied[4].key == "cold0");
+    }
+
+    remove(TMP_LOG_FILE);
+}
+
+static void testAppendedChanges() {
+    remove(TMP_LOG_FILE);
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        ml.newItem(0, "key1", 1);
+        ml.newItem(0, "key2", 2);
+        ml.commit1();
+        ml.commit2();
+    }
+
+    // What changed since goes on the end of the same log.
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        ml.delItem(0, "key1");
+        ml.newItem(0, "key3", 3);
+        ml.commit1();
+        ml.commit2();
+    }
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        MutationLogHarvester h(ml);
+        h.setVBucket(0);
+        assert(h.load());
+
+        std::map<std::string, uint64_t> maps[1];
+        h.apply(&maps, loaderFun);
+        assert(maps[0].size() == 2);
+        assert(maps[0].find("key1") == maps[0].end());
+        assert(maps[0].find("key2") != maps[0].end());
+        assert(maps[0].find("key3") != maps[0].end());
     }
 
     remove(TMP_LOG_FILE);
@@ -413,6 +574,78 @@ static void testLoggingBadCRC() {
     remove(TMP_LOG_FILE);
 }
 
+static void testMappedRead() {
+    remove(TMP_LOG_FILE);
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        for (int i = 0; i < 2000; ++i) {
+            std::stringstream ss;
+            ss << "key" << i;
+            ml.newItem(i % 4, ss.str(), i + 1);
+        }
+        ml.commit1();
+        ml.commit2();
+    }
+
+    {
+        // A log opened read only is read through its mapping.
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open(true);
+        MutationLogHarvester h(ml);
+        for (uint16_t vb = 0; vb < 4; ++vb) {
+            h.setVBucket(vb);
+        }
+        assert(h.load());
+        assert(h.getItemsSeen()[ML_NEW] == 2000);
+
+        std::map<std::string, uint64_t> maps[4];
+        h.apply(&maps, loaderFun);
+        for (int i = 0; i < 4; ++i) {
+            assert(maps[i].size() == 500);
+        }
+        assert(maps[1]["key1"] == 2);
+        assert(maps[3]["key1999"] == 2000);
+
+        // Copies of an iterator read on from where it was.
+        MutationLog::iterator it(ml.begin());
+        ++it;
+        MutationLog::iterator copy(it);
+        assert((*copy)->key() == (*it)->key());
+        ++it;
+        ++copy;
+        assert((*copy)->key() == "key2");
+        assert((*it)->key() == "key2");
+    }
+
+    // Break the log
+    int file = open(TMP_LOG_FILE, O_RDWR, 0666);
+    assert(lseek(file, 20000, SEEK_SET) == 20000);
+    uint8_t b;
+    assert(read(file, &b, sizeof(b)) == 1);
+    assert(lseek(file, 20000, SEEK_SET) == 20000);
+    b = ~b;
+    assert(write(file, &b, sizeof(b)) == 1);
+    close(file);
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open(true);
+        MutationLogHarvester h(ml);
+        h.setVBucket(1);
+
+        try {
+            h.load();
+            abort();
+        } catch(MutationLog::CRCReadException &e) {
+            // expected
+        }
+    }
+
+    remove(TMP_LOG_FILE);
+}
+
 static void testLoggingShortRead() {
     remove(TMP_LOG_FILE);
 
@@ -524,9 +757,13 @@ int main(int, char **) {
     testUnconfigured();
     testSyncSet();
     testLogging();
+    testBatchedWrites();
+    testHotFirst();
+    testAppendedChanges();
     testDelAll();
     testLoggingDirty();
     testLoggingBadCRC();
+    testMappedRead();
     testLoggingShortRead();
     testYUNOOPEN();
 
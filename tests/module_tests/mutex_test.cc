@@ -17,11 +17,101 @@
 
 #include "config.h"
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include <cassert>
 #include <iostream>
 
 #include "common.h"
 #include "locks.h"
+#include "syncobject.h"
+
+class CountingProfile : public LockProfile {
+public:
+    CountingProfile() : acquisitions(0), contentions(0), waited(0),
+                        holds(0), maxHold(0) { }
+
+    void acquired(bool contended, hrtime_t w) {
+        ++acquisitions;
+        if (contended) {
+            ++contentions;
+            waited += w;
+        }
+    }
+
+    void released(hrtime_t held) {
+        ++holds;
+        if (held > maxHold) {
+            maxHold = held;
+        }
+    }
+
+    size_t acquisitions;
+    size_t contentions;
+    hrtime_t waited;
+    size_t holds;
+    hrtime_t maxHold;
+};
+
+extern "C" {
+    static void *lockIt(void *arg) {
+        LockHolder lh(*static_cast<Mutex*>(arg));
+        return NULL;
+    }
+}
+
+static void testProfile() {
+    CountingProfile profile;
+    Mutex m;
+    m.setProfile(&profile);
+
+    // Nothing is counted while profiling is off.
+    {
+        LockHolder lh(m);
+    }
+    assert(profile.acquisitions == 0);
+
+    LockProfile::setEnabled(true);
+    {
+        LockHolder lh(m);
+        assert(m.ownsLock());
+    }
+    assert(profile.acquisitions == 1);
+    assert(profile.contentions == 0);
+    assert(profile.holds == 1);
+
+    // Another thread has to wait for this hold.
+    pthread_t tid;
+    {
+        LockHolder lh(m);
+        assert(pthread_create(&tid, NULL, lockIt, &m) == 0);
+        usleep(20000);
+    }
+    assert(pthread_join(tid, NULL) == 0);
+    assert(profile.acquisitions == 3);
+    assert(profile.contentions == 1);
+    assert(profile.waited > 0);
+    assert(profile.maxHold >= 10000000);
+
+    // A wait on a SyncObject ends the hold for the time waited.
+    CountingProfile syncProfile;
+    SyncObject so;
+    so.setProfile(&syncProfile);
+    {
+        LockHolder lh(so);
+        so.wait(0.05);
+    }
+    assert(syncProfile.acquisitions == 1);
+    assert(syncProfile.holds == 2);
+    assert(syncProfile.maxHold < 50000000);
+
+    LockProfile::setEnabled(false);
+    {
+        LockHolder lh(m);
+    }
+    assert(profile.acquisitions == 3);
+}
 
 int main(int argc, char **argv) {
     (void)argc; (void)argv;
@@ -34,5 +124,7 @@ int main(int argc, char **argv) {
     }
     assert(!m.ownsLock());
 
+    testProfile();
+
     return 0;
 }
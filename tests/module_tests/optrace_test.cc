@@ -0,0 +1,163 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "optrace.h"
+
+extern "C" {
+static rel_time_t basic_current_time(void) {
+    return 42;
+}
+
+rel_time_t (*ep_current_time)() = basic_current_time;
+}
+
+static const void *cookie = reinterpret_cast<const void*>(0x1234);
+
+static void testDisabled() {
+    OpTracer tracer;
+    assert(!tracer.isEnabled());
+    {
+        OpTraceScope trace(tracer, "get", "k", 0, cookie);
+        OpTracer::mark(TRACE_VB_LOOKUP);
+        usleep(2000);
+    }
+    assert(tracer.getSlowOps().empty());
+}
+
+static void testPhases() {
+    OpTracer tracer;
+    tracer.setThreshold(1000);
+    {
+        OpTraceScope trace(tracer, "get", "slow", 3, cookie);
+        usleep(2000);
+        OpTracer::mark(TRACE_VB_LOOKUP);
+        OpTracer::mark(TRACE_EXECUTE);
+        usleep(2000);
+        OpTracer::mark(TRACE_HT_LOCK);
+        trace.setStatus(ENGINE_KEY_ENOENT);
+    }
+    {
+        // Too quick to be kept.
+        OpTraceScope trace(tracer, "set", "quick", 3, cookie);
+    }
+
+    std::vector<OpTrace> slow(tracer.getSlowOps());
+    assert(slow.size() == 1);
+    const OpTrace &t = slow[0];
+    assert(t.key == "slow");
+    assert(t.vbucket == 3);
+    assert(t.when == 42);
+    assert(t.status == ENGINE_KEY_ENOENT);
+    assert(t.phases[TRACE_VB_LOOKUP] >= 2000000);
+    assert(t.phases[TRACE_HT_LOCK] >= 2000000);
+    assert(t.total >= 4000000);
+
+    hrtime_t sum = 0;
+    for (int i = 0; i < TRACE_NUM_PHASES; ++i) {
+        sum += t.phases[i];
+    }
+    assert(sum == t.total);
+
+    tracer.reset();
+    assert(tracer.getSlowOps().empty());
+}
+
+static void testNested() {
+    OpTracer tracer;
+    tracer.setThreshold(1);
+    {
+        OpTraceScope outer(tracer, "replace", "k", 0, cookie);
+        {
+            // The get of a replace is part of it.
+            OpTraceScope inner(tracer, "get", "k", 0, cookie);
+            usleep(1000);
+        }
+        OpTracer::mark(TRACE_VB_LOOKUP);
+    }
+    std::vector<OpTrace> slow(tracer.getSlowOps());
+    assert(slow.size() == 1);
+    assert(std::string(slow[0].op) == "replace");
+    assert(slow[0].phases[TRACE_VB_LOOKUP] >= 1000000);
+}
+
+static void testBackgroundFetch() {
+    OpTracer tracer;
+    tracer.setThreshold(1);
+    {
+        OpTraceScope trace(tracer, "get", "evicted", 1, cookie);
+        trace.setStatus(ENGINE_EWOULDBLOCK);
+    }
+    // Not done until it comes back.
+    assert(tracer.getSlowOps().empty());
+
+    hrtime_t queued = gethrtime();
+    usleep(1000);
+    hrtime_t start = gethrtime();
+    usleep(2000);
+    hrtime_t stop = gethrtime();
+    tracer.bgFetched(cookie, queued, start, stop);
+    usleep(1000);
+    {
+        OpTraceScope trace(tracer, "get", "evicted", 1, cookie);
+    }
+
+    std::vector<OpTrace> slow(tracer.getSlowOps());
+    assert(slow.size() == 1);
+    const OpTrace &t = slow[0];
+    assert(t.key == "evicted");
+    assert(t.status == ENGINE_SUCCESS);
+    assert(t.phases[TRACE_BG_QUEUE] >= 1000000);
+    assert(t.phases[TRACE_DISK_READ] >= 2000000);
+    assert(t.phases[TRACE_NOTIFY] >= 1000000);
+    assert(t.total >= 4000000);
+}
+
+static void testDisabledWhilePending() {
+    OpTracer tracer;
+    tracer.setThreshold(1);
+    {
+        OpTraceScope trace(tracer, "get", "k", 0, cookie);
+        trace.setStatus(ENGINE_EWOULDBLOCK);
+    }
+    tracer.setThreshold(0);
+    tracer.setThreshold(1);
+    {
+        // Its earlier trace was dropped, so it's traced from here.
+        OpTraceScope trace(tracer, "get", "k", 0, cookie);
+        usleep(100);
+    }
+    std::vector<OpTrace> slow(tracer.getSlowOps());
+    assert(slow.size() == 1);
+    assert(slow[0].phases[TRACE_NOTIFY] == 0);
+}
+
+int main() {
+    testDisabled();
+    testPhases();
+    testNested();
+    testBackgroundFetch();
+    testDisabledWhilePending();
+    return 0;
+}
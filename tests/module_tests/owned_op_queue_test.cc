@@ -0,0 +1,100 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+#include <vector>
+
+#include "threadtests.h"
+#include "vbucket_owners.h"
+
+const size_t numThreads = 16;
+const size_t numOps     = 1000;
+
+static OwnedOp *newOp(size_t producer, uint16_t seq) {
+    return new OwnedOp(OwnedOp::GET, reinterpret_cast<const void*>(producer),
+                       "k", 1, seq);
+}
+
+static void testOrder() {
+    OwnedOpQueue q;
+    assert(q.empty());
+    assert(q.takeAll() == NULL);
+
+    for (uint16_t i = 0; i < 10; ++i) {
+        q.push(newOp(0, i));
+    }
+    assert(!q.empty());
+
+    // Oldest first.
+    OwnedOp *op = q.takeAll();
+    assert(q.empty());
+    for (uint16_t i = 0; i < 10; ++i) {
+        assert(op != NULL && op->vbucket == i);
+        OwnedOp *next = op->next;
+        delete op;
+        op = next;
+    }
+    assert(op == NULL);
+}
+
+class Producer : public Generator<bool> {
+public:
+    Producer(OwnedOpQueue &queue) : q(queue), ids(0) { }
+
+    bool operator()() {
+        size_t id = ++ids;
+        for (uint16_t i = 0; i < numOps; ++i) {
+            q.push(newOp(id, i));
+        }
+        return true;
+    }
+
+private:
+    OwnedOpQueue &q;
+    Atomic<size_t> ids;
+};
+
+static void testProducers() {
+    OwnedOpQueue q;
+    Producer producer(q);
+    getCompletedThreads<bool>(numThreads, &producer);
+
+    // Each producer's ops come out in the order it pushed them.
+    std::vector<uint16_t> nextSeq(numThreads + 1, 0);
+    size_t total = 0;
+    OwnedOp *op = q.takeAll();
+    while (op != NULL) {
+        size_t id = reinterpret_cast<size_t>(op->cookie);
+        assert(id >= 1 && id <= numThreads);
+        assert(op->vbucket == nextSeq[id]);
+        ++nextSeq[id];
+        ++total;
+        OwnedOp *next = op->next;
+        delete op;
+        op = next;
+    }
+    assert(total == numThreads * numOps);
+    assert(q.empty());
+}
+
+int main() {
+    testOrder();
+    testProducers();
+    return 0;
+}
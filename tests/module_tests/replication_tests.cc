@@ -0,0 +1,467 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * A replication benchmark: the engine engine_testapp runs is the
+ * producer, and a mock consumer in a thread of its own takes a TAP
+ * stream from it, acking when it's asked to after a set delay, as a
+ * replica across a network would.
+ *
+ * The consumer first backfills the items loaded before it connected,
+ * some of them evicted so the backfill reads them from disk, and then
+ * takes the mutations a writer thread makes at a target rate.  The
+ * engine's settings, like tap_ack_window_size, tap_backfill_resident
+ * and chk_max_items, are the config the suite is run with, and the load
+ * is set by the environment:
+ *
+ *   REPL_BACKFILL_ITEMS  the items loaded before the consumer connects
+ *                        (10000)
+ *   REPL_EVICT_PCT       the percentage of them evicted (0)
+ *   REPL_OPS             the mutations made once it's backfilled (100000)
+ *   REPL_KEYS            the keys they're spread over (REPL_OPS)
+ *   REPL_RATE            the mutations per second, 0 for flat out (0)
+ *   REPL_VALUE_SIZE      the size of the values (100)
+ *   REPL_ACK_DELAY_US    how long the consumer takes to ack (0)
+ *   REPL_SAMPLE_MS       how often the stats are sampled (10)
+ *
+ * The items and keys are the same on every run.  It reports lines of
+ *
+ *   backfill items=<n> evicted=<n> seconds=<s> items_per_sec=<n>
+ *   replication mutations=<n> received=<n> p50_us=... max_us=<n>
+ *   ack_window full_pct=<n> max_window=<n> max_ack_log=<n> acks=<n>
+ *   checkpoint_memory mean=<bytes> max=<bytes>
+ *   writer seconds=<s> tmpfails=<n>
+ *
+ * where the replication latency of a mutation is from when it was
+ * stored to when the consumer got it.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <math.h>
+#include <memcached/engine.h>
+#include <memcached/engine_testapp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "tests/ep_test_apis.h"
+#include "tests/ep_testsuite.h"
+
+#define check(expr, msg) \
+    static_cast<void>((expr) ? 0 : abort_msg(#expr, msg, __LINE__))
+
+#define CONSUMER_NAME "repl_consumer"
+#define BACKFILL_PREFIX "backfill_"
+#define LIVE_PREFIX "repl_"
+#define STOP_KEY "repl_stop"
+
+extern std::map<std::string, std::string> vals;
+
+struct test_harness testHarness;
+
+extern "C" bool abort_msg(const char *expr, const char *msg, int line) {
+    fprintf(stderr, "%s:%d Test failed: `%s' (%s)\n",
+            __FILE__, line, msg, expr);
+    abort();
+    // UNREACHABLE
+    return false;
+}
+
+extern "C" {
+    static void rmdb(void) {
+        unlink("/tmp/test");
+    }
+
+    static bool teardown(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+        (void)h; (void)h1;
+        atexit(rmdb);
+        vals.clear();
+        return true;
+    }
+}
+
+static size_t env_int(const char *k, size_t rv) {
+    char *x = getenv(k);
+    if (x) {
+        rv = static_cast<size_t>(atol(x));
+    }
+    return rv;
+}
+
+static size_t get_size_stat(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                            const char *statname, const char *statkey = NULL) {
+    return static_cast<size_t>(strtoull(get_str_stat(h, h1, statname,
+                                                     statkey).c_str(),
+                                        NULL, 10));
+}
+
+static std::string keyName(const char *prefix, size_t k) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%s%lu", prefix, static_cast<unsigned long>(k));
+    return std::string(buf);
+}
+
+//! The load, as the environment sets it
+struct ReplConfig {
+    ReplConfig() :
+        backfillItems(env_int("REPL_BACKFILL_ITEMS", 10000)),
+        evictPct(std::min(env_int("REPL_EVICT_PCT", 0),
+                          static_cast<size_t>(100))),
+        ops(env_int("REPL_OPS", 100000)),
+        keys(std::max(env_int("REPL_KEYS", ops), static_cast<size_t>(1))),
+        rate(env_int("REPL_RATE", 0)),
+        valueSize(std::max(env_int("REPL_VALUE_SIZE", 100),
+                           static_cast<size_t>(1))),
+        ackDelay(env_int("REPL_ACK_DELAY_US", 0) * 1000),
+        sampleMs(std::max(env_int("REPL_SAMPLE_MS", 10),
+                          static_cast<size_t>(1))) {}
+
+    size_t backfillItems;
+    size_t evictPct;
+    size_t ops;
+    size_t keys;
+    size_t rate;
+    size_t valueSize;
+    hrtime_t ackDelay;
+    size_t sampleMs;
+};
+
+/**
+ * What the writer and the consumer share.
+ */
+struct ReplState {
+    ReplState(ENGINE_HANDLE *_h, ENGINE_HANDLE_V1 *_h1, const ReplConfig &c) :
+        h(_h), h1(_h1), config(c), value(c.valueSize, 'x'),
+        storedAt(c.keys, 0), backfillSeen(c.backfillItems, false),
+        backfillLeft(c.backfillItems), backfillDone(0), consumerDone(false),
+        received(0), acks(0), tmpfails(0) {}
+
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *h1;
+    const ReplConfig &config;
+    std::string value;
+
+    //! When each key was last stored by the writer
+    std::vector<hrtime_t> storedAt;
+    std::vector<bool> backfillSeen;
+    size_t backfillLeft;
+    Atomic<hrtime_t> backfillDone;
+    Atomic<bool> consumerDone;
+
+    //! The consumer's replication latencies
+    std::vector<hrtime_t> latencies;
+    size_t received;
+    size_t acks;
+    size_t tmpfails;
+};
+
+static ENGINE_ERROR_CODE storeValue(ReplState &s, const void *cookie,
+                                    const std::string &key) {
+    item *it = NULL;
+    ENGINE_ERROR_CODE rv = s.h1->allocate(s.h, cookie, &it, key.data(),
+                                          key.length(), s.value.length(),
+                                          0, 0);
+    if (rv != ENGINE_SUCCESS) {
+        return rv;
+    }
+    item_info info;
+    info.nvalue = 1;
+    check(s.h1->get_item_info(s.h, cookie, it, &info),
+          "Failed to get an item's info.");
+    memcpy(info.value[0].iov_base, s.value.data(), s.value.length());
+    uint64_t cas(0);
+    rv = s.h1->store(s.h, cookie, it, &cas, OPERATION_SET, 0);
+    s.h1->release(s.h, cookie, it);
+    return rv;
+}
+
+//! Store a key, waiting out a full engine the way a client would
+static void storeRetrying(ReplState &s, const void *cookie,
+                          const std::string &key) {
+    ENGINE_ERROR_CODE rv;
+    while ((rv = storeValue(s, cookie, key)) == ENGINE_TMPFAIL ||
+           rv == ENGINE_ENOMEM) {
+        ++s.tmpfails;
+        usleep(1000);
+    }
+    check(rv == ENGINE_SUCCESS, "Failed to store an item.");
+}
+
+extern "C" {
+static void *launch_writer(void *arg) {
+    ReplState &s(*static_cast<ReplState*>(arg));
+    const ReplConfig &c(s.config);
+    const void *cookie = testHarness.create_cookie();
+
+    hrtime_t interval(0);
+    if (c.rate > 0) {
+        interval = static_cast<hrtime_t>(1000000000.0 / c.rate);
+    }
+    hrtime_t due = gethrtime();
+    for (size_t i = 0; i < c.ops; ++i) {
+        hrtime_t now = gethrtime();
+        if (now < due) {
+            usleep(static_cast<useconds_t>((due - now) / 1000));
+        }
+        size_t k = i % c.keys;
+        s.storedAt[k] = gethrtime();
+        storeRetrying(s, cookie, keyName(LIVE_PREFIX, k));
+        due += interval;
+    }
+    // The consumer stops when this comes, after all the others.
+    storeRetrying(s, cookie, STOP_KEY);
+
+    testHarness.destroy_cookie(cookie);
+    return NULL;
+}
+
+static void *launch_consumer(void *arg) {
+    ReplState &s(*static_cast<ReplState*>(arg));
+    const ReplConfig &c(s.config);
+    ENGINE_HANDLE *h(s.h);
+    ENGINE_HANDLE_V1 *h1(s.h1);
+    const void *cookie = testHarness.create_cookie();
+    testHarness.lock_cookie(cookie);
+
+    uint64_t backfillAge = 0;
+    std::string name(CONSUMER_NAME);
+    TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
+                                             name.length(),
+                                             TAP_CONNECT_FLAG_BACKFILL |
+                                             TAP_CONNECT_CHECKPOINT |
+                                             TAP_CONNECT_SUPPORT_ACK,
+                                             static_cast<void*>(&backfillAge),
+                                             8);
+    check(iter != NULL, "Failed to create a tap iterator");
+    if (s.backfillLeft == 0) {
+        s.backfillDone.set(gethrtime());
+    }
+
+    // The acks asked for, and when each is sent
+    std::deque<std::pair<hrtime_t, uint32_t> > pendingAcks;
+    item *it;
+    void *engine_specific;
+    uint16_t nengine_specific;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+    tap_event_t event;
+    std::string key;
+    bool stopped(false);
+    while (!stopped) {
+        hrtime_t now = gethrtime();
+        while (!pendingAcks.empty() && pendingAcks.front().first <= now) {
+            testHarness.unlock_cookie(cookie);
+            h1->tap_notify(h, cookie, NULL, 0, 0,
+                           PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                           TAP_ACK, pendingAcks.front().second, NULL, 0,
+                           0, 0, 0, NULL, 0, 0);
+            testHarness.lock_cookie(cookie);
+            pendingAcks.pop_front();
+            ++s.acks;
+        }
+
+        flags = 0;
+        event = iter(h, cookie, &it, &engine_specific,
+                     &nengine_specific, &ttl, &flags,
+                     &seqno, &vbucket);
+        now = gethrtime();
+        switch (event) {
+        case TAP_PAUSE:
+            if (pendingAcks.empty()) {
+                testHarness.waitfor_cookie(cookie);
+            } else if (pendingAcks.front().first > now) {
+                // The producer may be waiting on these acks.
+                testHarness.unlock_cookie(cookie);
+                usleep(static_cast<useconds_t>(
+                           (pendingAcks.front().first - now) / 1000));
+                testHarness.lock_cookie(cookie);
+            }
+            continue;
+        case TAP_MUTATION:
+            check(get_key(h, h1, it, key), "Failed to read out the key");
+            h1->release(h, cookie, it);
+            if (key.compare(0, strlen(BACKFILL_PREFIX), BACKFILL_PREFIX) == 0) {
+                size_t k = strtoul(key.c_str() + strlen(BACKFILL_PREFIX),
+                                   NULL, 10);
+                if (k < c.backfillItems && !s.backfillSeen[k]) {
+                    s.backfillSeen[k] = true;
+                    if (--s.backfillLeft == 0) {
+                        s.backfillDone.set(now);
+                    }
+                }
+            } else if (key == STOP_KEY) {
+                stopped = true;
+            } else if (key.compare(0, strlen(LIVE_PREFIX), LIVE_PREFIX) == 0) {
+                size_t k = strtoul(key.c_str() + strlen(LIVE_PREFIX), NULL, 10);
+                if (k < c.keys && s.storedAt[k] != 0) {
+                    s.latencies.push_back(now - s.storedAt[k]);
+                }
+                ++s.received;
+            }
+            break;
+        case TAP_DELETION:
+        case TAP_CHECKPOINT_START:
+        case TAP_CHECKPOINT_END:
+            h1->release(h, cookie, it);
+            break;
+        case TAP_DISCONNECT:
+            check(false, "The producer hung up on the consumer.");
+            break;
+        default:
+            break;
+        }
+        if (flags & TAP_FLAG_ACK) {
+            pendingAcks.push_back(std::make_pair(now + c.ackDelay, seqno));
+        }
+    }
+
+    testHarness.unlock_cookie(cookie);
+    testHarness.destroy_cookie(cookie);
+    s.consumerDone.set(true);
+    return NULL;
+}
+}
+
+static double toMicros(hrtime_t t) {
+    return t / 1000.0;
+}
+
+//! The latency no more than pct percent of the sorted ones are above
+static hrtime_t percentile(const std::vector<hrtime_t> &sorted, double pct) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = static_cast<size_t>(ceil(sorted.size() * pct / 100.0));
+    return sorted[std::min(std::max(i, static_cast<size_t>(1)),
+                           sorted.size()) - 1];
+}
+
+extern "C" {
+static test_result test_replication(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    ReplConfig config;
+    ReplState state(h, h1, config);
+
+    for (size_t k = 0; k < config.backfillItems; ++k) {
+        storeRetrying(state, NULL, keyName(BACKFILL_PREFIX, k));
+    }
+    wait_for_flusher_to_settle(h, h1);
+    size_t evicted = config.backfillItems * config.evictPct / 100;
+    for (size_t k = 0; k < evicted; ++k) {
+        evict_key(h, h1, keyName(BACKFILL_PREFIX, k).c_str(), 0, "Ejected.");
+    }
+
+    pthread_t consumer, writer;
+    hrtime_t backfillStart = gethrtime();
+    check(pthread_create(&consumer, NULL, launch_consumer, &state) == 0,
+          "Failed to start the consumer.");
+    useconds_t sleepTime = 128;
+    while (state.backfillDone.get() == 0) {
+        decayingSleep(&sleepTime);
+    }
+    double backfillSecs = (state.backfillDone.get() - backfillStart) /
+        1000000000.0;
+
+    std::string statPrefix("eq_tapq:" CONSUMER_NAME ":");
+    std::string windowFullStat(statPrefix + "ack_window_full");
+    std::string windowStat(statPrefix + "ack_window");
+    std::string ackLogStat(statPrefix + "ack_log_size");
+
+    hrtime_t writerStart = gethrtime();
+    check(pthread_create(&writer, NULL, launch_writer, &state) == 0,
+          "Failed to start the writer.");
+    size_t samples(0), fullSamples(0), maxWindow(0), maxAckLog(0);
+    size_t maxChkMem(0);
+    double totalChkMem(0);
+    while (!state.consumerDone.get()) {
+        usleep(config.sampleMs * 1000);
+        size_t chkMem = get_size_stat(h, h1, "ep_checkpoint_memory");
+        maxChkMem = std::max(maxChkMem, chkMem);
+        totalChkMem += chkMem;
+        if (get_str_stat(h, h1, windowFullStat.c_str(), "tap") == "true") {
+            ++fullSamples;
+        }
+        maxWindow = std::max(maxWindow,
+                             get_size_stat(h, h1, windowStat.c_str(), "tap"));
+        maxAckLog = std::max(maxAckLog,
+                             get_size_stat(h, h1, ackLogStat.c_str(), "tap"));
+        ++samples;
+    }
+    check(pthread_join(writer, NULL) == 0, "Failed to join the writer.");
+    check(pthread_join(consumer, NULL) == 0, "Failed to join the consumer.");
+    double writerSecs = (gethrtime() - writerStart) / 1000000000.0;
+
+    std::vector<hrtime_t> &lat(state.latencies);
+    std::sort(lat.begin(), lat.end());
+    printf("backfill items=%lu evicted=%lu seconds=%.3f items_per_sec=%.0f\n",
+           static_cast<unsigned long>(config.backfillItems),
+           static_cast<unsigned long>(evicted), backfillSecs,
+           backfillSecs > 0 ? config.backfillItems / backfillSecs : 0);
+    printf("replication mutations=%lu received=%lu p50_us=%.1f p90_us=%.1f "
+           "p99_us=%.1f p99.9_us=%.1f max_us=%.1f\n",
+           static_cast<unsigned long>(config.ops),
+           static_cast<unsigned long>(state.received),
+           toMicros(percentile(lat, 50)), toMicros(percentile(lat, 90)),
+           toMicros(percentile(lat, 99)), toMicros(percentile(lat, 99.9)),
+           toMicros(lat.empty() ? 0 : lat.back()));
+    printf("ack_window full_pct=%.1f max_window=%lu max_ack_log=%lu "
+           "acks=%lu\n",
+           samples > 0 ? 100.0 * fullSamples / samples : 0,
+           static_cast<unsigned long>(maxWindow),
+           static_cast<unsigned long>(maxAckLog),
+           static_cast<unsigned long>(state.acks));
+    printf("checkpoint_memory mean=%.0f max=%lu\n",
+           samples > 0 ? totalChkMem / samples : 0,
+           static_cast<unsigned long>(maxChkMem));
+    printf("writer seconds=%.3f tmpfails=%lu\n", writerSecs,
+           static_cast<unsigned long>(state.tmpfails));
+    fflush(stdout);
+
+    return SUCCESS;
+}
+}
+
+extern "C" MEMCACHED_PUBLIC_API
+bool setup_suite(struct test_harness *th) {
+    testHarness = *th;
+    return true;
+}
+
+extern "C" MEMCACHED_PUBLIC_API
+engine_test_t* get_tests(void) {
+
+    static engine_test_t tests[]  = {
+        {"test replication", test_replication, NULL, teardown, NULL,
+         NULL, NULL},
+        {NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+    };
+    return tests;
+}
@@ -0,0 +1,155 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+#include <string>
+
+#include "subdoc.h"
+
+static const std::string doc("{\"name\": \"k\", \"big\": 12345678901234567890,"
+                             " \"n\": 41, \"tags\": [\"a\", \"b\"],"
+                             " \"sub\": {\"list\": [], \"x\": 1.50}}");
+
+static subdoc_status_t apply(uint8_t op, const std::string &path,
+                             const std::string &value, std::string &out,
+                             const std::string &d = doc) {
+    SubdocOp sop(op, path, value);
+    out.clear();
+    return sop.apply(d.data(), d.length(), out);
+}
+
+static void testPatch() {
+    std::string out;
+    SubdocOp patch(SUBDOC_PATCH, "", "XY", 1);
+    assert(patch.apply("abcd", 4, out) == SUBDOC_SUCCESS);
+    assert(out == "aXYd");
+
+    // It may run past the end of the value.
+    SubdocOp tail(SUBDOC_PATCH, "", "XYZ", 3);
+    assert(tail.apply("abcd", 4, out) == SUBDOC_SUCCESS);
+    assert(out == "abcXYZ");
+
+    SubdocOp beyond(SUBDOC_PATCH, "", "X", 5);
+    assert(beyond.apply("abcd", 4, out) == SUBDOC_EINVAL);
+}
+
+static void testReplace() {
+    std::string out;
+    assert(apply(SUBDOC_REPLACE, "name", "\"new\"", out) == SUBDOC_SUCCESS);
+    // Nothing else is rewritten, down to the numbers.
+    std::string expected(doc);
+    expected.replace(expected.find("\"k\""), 3, "\"new\"");
+    assert(out == expected);
+
+    assert(apply(SUBDOC_REPLACE, "tags[1]", " {\"z\": null} ", out) ==
+           SUBDOC_SUCCESS);
+    assert(out.find("[\"a\", {\"z\": null}]") != std::string::npos);
+
+    assert(apply(SUBDOC_REPLACE, "tags[-1]", "3", out) == SUBDOC_SUCCESS);
+    assert(out.find("[\"a\", 3]") != std::string::npos);
+
+    assert(apply(SUBDOC_REPLACE, "sub.x", "true", out) == SUBDOC_SUCCESS);
+    assert(out.find("\"x\": true}") != std::string::npos);
+
+    assert(apply(SUBDOC_REPLACE, "", "[]", out) == SUBDOC_SUCCESS);
+    assert(out == "[]");
+
+    assert(apply(SUBDOC_REPLACE, "nope", "1", out) == SUBDOC_PATH_ENOENT);
+    assert(apply(SUBDOC_REPLACE, "tags[2]", "1", out) == SUBDOC_PATH_ENOENT);
+    assert(apply(SUBDOC_REPLACE, "name.x", "1", out) == SUBDOC_PATH_MISMATCH);
+    assert(apply(SUBDOC_REPLACE, "tags.x", "1", out) == SUBDOC_PATH_MISMATCH);
+    assert(apply(SUBDOC_REPLACE, "name", "{", out) == SUBDOC_VALUE_NOTJSON);
+    assert(apply(SUBDOC_REPLACE, "name", "1 2", out) == SUBDOC_VALUE_NOTJSON);
+    assert(apply(SUBDOC_REPLACE, "a..b", "1", out) == SUBDOC_EINVAL);
+    assert(apply(SUBDOC_REPLACE, "a[x]", "1", out) == SUBDOC_EINVAL);
+    assert(apply(SUBDOC_REPLACE, "a[-2]", "1", out) == SUBDOC_EINVAL);
+    assert(apply(SUBDOC_REPLACE, "a", "1", out, "{\"a\": 1") ==
+           SUBDOC_DOC_NOTJSON);
+    assert(apply(SUBDOC_REPLACE, "a", "1", out, "{\"a\": 1} x") ==
+           SUBDOC_DOC_NOTJSON);
+    assert(apply(SUBDOC_REPLACE, "a", "1", out, "not json") ==
+           SUBDOC_DOC_NOTJSON);
+
+    std::string deep(SubdocOp::MAX_DEPTH + 2, '[');
+    deep.append(SubdocOp::MAX_DEPTH + 2, ']');
+    assert(apply(SUBDOC_REPLACE, "", "1", out, deep) == SUBDOC_DOC_ETOODEEP);
+}
+
+static void testCounter() {
+    std::string out;
+    SubdocOp incr(SUBDOC_COUNTER, "n", "1");
+    assert(incr.apply(doc.data(), doc.length(), out) == SUBDOC_SUCCESS);
+    assert(incr.getCounter() == 42);
+    assert(out.find("\"n\": 42,") != std::string::npos);
+
+    SubdocOp decr(SUBDOC_COUNTER, "n", "-50");
+    assert(decr.apply(doc.data(), doc.length(), out) == SUBDOC_SUCCESS);
+    assert(decr.getCounter() == -9);
+
+    // A missing counter is created.
+    SubdocOp create(SUBDOC_COUNTER, "sub.count", "5");
+    assert(create.apply(doc.data(), doc.length(), out) == SUBDOC_SUCCESS);
+    assert(create.getCounter() == 5);
+    assert(out.find("\"x\": 1.50,\"count\":5}}") != std::string::npos);
+
+    SubdocOp first(SUBDOC_COUNTER, "c", "2");
+    assert(first.apply("{ }", 3, out) == SUBDOC_SUCCESS);
+    assert(out == "{ \"c\":2}");
+
+    std::string big("{\"c\": 9223372036854775807}");
+    assert(apply(SUBDOC_COUNTER, "c", "1", out, big) == SUBDOC_DELTA_ERANGE);
+    assert(apply(SUBDOC_COUNTER, "c", "-1", out, big) == SUBDOC_SUCCESS);
+    assert(apply(SUBDOC_COUNTER, "big", "1", out) == SUBDOC_DELTA_ERANGE);
+    assert(apply(SUBDOC_COUNTER, "sub.x", "1", out) == SUBDOC_PATH_MISMATCH);
+    assert(apply(SUBDOC_COUNTER, "name", "1", out) == SUBDOC_PATH_MISMATCH);
+    assert(apply(SUBDOC_COUNTER, "tags[5]", "1", out) == SUBDOC_PATH_ENOENT);
+    assert(apply(SUBDOC_COUNTER, "no.such", "1", out) == SUBDOC_PATH_ENOENT);
+    assert(apply(SUBDOC_COUNTER, "n", "1.5", out) == SUBDOC_EINVAL);
+    assert(apply(SUBDOC_COUNTER, "a\"b", "1", out) == SUBDOC_EINVAL);
+}
+
+static void testArrayAppend() {
+    std::string out;
+    assert(apply(SUBDOC_ARRAY_APPEND, "tags", "\"c\"", out) ==
+           SUBDOC_SUCCESS);
+    assert(out.find("[\"a\", \"b\",\"c\"]") != std::string::npos);
+
+    assert(apply(SUBDOC_ARRAY_APPEND, "sub.list", "{\"a\": [1]}", out) ==
+           SUBDOC_SUCCESS);
+    assert(out.find("\"list\": [{\"a\": [1]}]") != std::string::npos);
+
+    assert(apply(SUBDOC_ARRAY_APPEND, "name", "1", out) ==
+           SUBDOC_PATH_MISMATCH);
+    assert(apply(SUBDOC_ARRAY_APPEND, "none", "1", out) == SUBDOC_PATH_ENOENT);
+}
+
+static void testUnknownOp() {
+    std::string out;
+    assert(apply(0, "n", "1", out) == SUBDOC_EINVAL);
+    assert(apply(99, "n", "1", out) == SUBDOC_EINVAL);
+}
+
+int main() {
+    testPatch();
+    testReplace();
+    testCounter();
+    testArrayAppend();
+    testUnknownOp();
+    return 0;
+}
@@ -0,0 +1,128 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+#include "timingwheel.h"
+
+static void testEmpty() {
+    TimingWheel<int> tw(1000);
+    assert(tw.empty());
+    std::vector<int> out;
+    tw.expire(100000, out);
+    assert(out.empty());
+}
+
+static void testDue() {
+    TimingWheel<int> tw(1000);
+    tw.insert(1, 999);
+    tw.insert(2, 1000);
+    assert(tw.size() == 2);
+    assert(tw.nextExpiry() <= 1000);
+    std::vector<int> out;
+    tw.expire(1000, out);
+    assert(out.size() == 2);
+    assert(tw.empty());
+}
+
+static void testOrder() {
+    TimingWheel<int> tw(0);
+    tw.insert(3, 5000);
+    tw.insert(1, 10);
+    tw.insert(2, 100);
+    tw.insert(4, 300000);
+    assert(tw.nextExpiry() <= 10);
+
+    std::vector<int> out;
+    tw.expire(9, out);
+    assert(out.empty());
+    tw.expire(10, out);
+    assert(out.size() == 1 && out[0] == 1);
+
+    out.clear();
+    tw.expire(299999, out);
+    assert(out.size() == 2 && out[0] == 2 && out[1] == 3);
+    assert(tw.size() == 1);
+    assert(tw.nextExpiry() <= 300000);
+
+    out.clear();
+    tw.expire(300000, out);
+    assert(out.size() == 1 && out[0] == 4);
+    assert(tw.empty());
+}
+
+static void testFarOut() {
+    uint64_t now = 1380000000000ULL;
+    TimingWheel<int> tw(now);
+    // A bit over the twelve days the wheel spans.
+    uint64_t when = now + 20ULL * 24 * 3600 * 1000;
+    tw.insert(1, when);
+    std::vector<int> out;
+    tw.expire(when - 1, out);
+    assert(out.empty());
+    assert(tw.size() == 1);
+    tw.expire(when, out);
+    assert(out.size() == 1);
+}
+
+static void testRandom() {
+    uint64_t now = 1380000000000ULL;
+    TimingWheel<int> tw(now);
+    std::multimap<uint64_t, int> expected;
+    for (int i = 0; i < 10000; ++i) {
+        uint64_t when = now + (random() % 4000000);
+        tw.insert(i, when);
+        expected.insert(std::make_pair(when, i));
+    }
+
+    size_t seen = 0;
+    while (!expected.empty()) {
+        uint64_t next = tw.nextExpiry();
+        assert(next <= expected.begin()->first);
+        // Jump ahead by differing amounts, sometimes past several ticks.
+        now += 1 + (random() % 5000);
+        std::vector<int> out;
+        tw.expire(now, out);
+        std::multimap<uint64_t, int>::iterator it = expected.begin();
+        size_t due = 0;
+        while (it != expected.end() && it->first <= now) {
+            ++due;
+            expected.erase(it++);
+        }
+        assert(out.size() == due);
+        seen += out.size();
+        assert(tw.size() == expected.size());
+        if (tw.empty()) {
+            break;
+        }
+    }
+    assert(seen == 10000);
+}
+
+int main() {
+    testEmpty();
+    testDue();
+    testOrder();
+    testFarOut();
+    testRandom();
+    return 0;
+}
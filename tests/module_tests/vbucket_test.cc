@@ -156,6 +156,40 @@ static void testVBucketFilter() {
     assert(!hasThree(3));
 }
 
+static void testVBucketFilterSetOps() {
+    std::vector<uint16_t> v;
+    v.push_back(1);
+    v.push_back(2);
+    v.push_back(3);
+    v.push_back(4);
+    v.push_back(200);
+    VBucketFilter a(v);
+    v.clear();
+    v.push_back(3);
+    v.push_back(4);
+    v.push_back(5);
+    v.push_back(6);
+    VBucketFilter b(v);
+
+    VBucketFilter diff = a.filter_diff(b);
+    assert(diff.size() == 5);
+    assert(diff(1) && diff(2) && diff(5) && diff(6) && diff(200));
+    assert(!diff(3) && !diff(4));
+    assert(b.filter_diff(a).getVBSet() == diff.getVBSet());
+
+    VBucketFilter both = a.filter_intersection(b);
+    assert(both.size() == 2);
+    assert(both(3) && both(4));
+    assert(!both(1) && !both(200));
+
+    a.removeVBucket(200);
+    assert(!a(200));
+    assert(a.addVBucket(65535));
+    assert(!a.addVBucket(65535));
+    assert(a(65535));
+    assert(!a(65534));
+}
+
 static void assertFilterTxt(const VBucketFilter &filter, const std::string &res)
 {
     std::stringstream ss;
@@ -222,6 +256,7 @@ int main(int argc, char **argv) {
     testVBucketLookup();
     testConcurrentUpdate();
     testVBucketFilter();
+    testVBucketFilterSetOps();
     testVBucketFilterFormatter();
     testGetVBucketsByState();
 }
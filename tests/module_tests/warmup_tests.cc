@@ -0,0 +1,128 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * A warmup benchmark: the engine engine_testapp runs warms up from the
+ * data set in its dbname, like the one gen_dataset writes, and once
+ * it's done this reports a line for each phase of the warmup that
+ * loaded anything,
+ *
+ *   <phase> items=<n> bytes=<n> seconds=<s> items_per_sec=<n>
+ *           bytes_per_sec=<n>
+ *
+ * and then one for the whole of it,
+ *
+ *   warmup keys=<n> values=<n> seconds=<s>
+ *
+ * The phases are key_dump, access_log, kv_pairs and data; which of
+ * them run depends on the config the suite is run with, like
+ * item_eviction_policy and alog_path.  The data set is left in place
+ * for the next run.
+ */
+
+#include "config.h"
+
+#include <memcached/engine.h>
+#include <memcached/engine_testapp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+#include <string>
+
+#include "tests/ep_test_apis.h"
+#include "tests/ep_testsuite.h"
+
+#define check(expr, msg) \
+    static_cast<void>((expr) ? 0 : abort_msg(#expr, msg, __LINE__))
+
+extern std::map<std::string, std::string> vals;
+
+struct test_harness testHarness;
+
+extern "C" bool abort_msg(const char *expr, const char *msg, int line) {
+    fprintf(stderr, "%s:%d Test failed: `%s' (%s)\n",
+            __FILE__, line, msg, expr);
+    abort();
+    // UNREACHABLE
+    return false;
+}
+
+extern "C" {
+    static bool teardown(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+        (void)h; (void)h1;
+        vals.clear();
+        return true;
+    }
+}
+
+//! A warmup stat, 0 if it isn't there
+static uint64_t warmupStat(const std::string &name) {
+    std::map<std::string, std::string>::iterator it =
+        vals.find("ep_warmup_" + name);
+    if (it == vals.end()) {
+        return 0;
+    }
+    return strtoull(it->second.c_str(), NULL, 10);
+}
+
+static enum test_result test_warmup(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    check(wait_for_warmup_complete(h, h1), "Warmup didn't complete");
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "warmup", 6, add_stats) == ENGINE_SUCCESS,
+          "Failed to get the warmup stats");
+
+    static const char *phases[] = { "key_dump", "access_log", "kv_pairs",
+                                    "data" };
+    for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); ++i) {
+        std::string p = std::string("phase_") + phases[i] + "_";
+        uint64_t items = warmupStat(p + "items");
+        uint64_t us = warmupStat(p + "time");
+        if (items == 0 || us == 0) {
+            continue;
+        }
+        uint64_t bytes = warmupStat(p + "bytes");
+        printf("%s items=%llu bytes=%llu seconds=%.3f items_per_sec=%llu "
+               "bytes_per_sec=%llu\n", phases[i],
+               (unsigned long long)items, (unsigned long long)bytes,
+               us / 1e6, (unsigned long long)(items * 1e6 / us),
+               (unsigned long long)(bytes * 1e6 / us));
+    }
+    printf("warmup keys=%llu values=%llu seconds=%.3f\n",
+           (unsigned long long)warmupStat("key_count"),
+           (unsigned long long)warmupStat("value_count"),
+           warmupStat("time") / 1e6);
+    return SUCCESS;
+}
+
+extern "C" MEMCACHED_PUBLIC_API
+bool setup_suite(struct test_harness *th) {
+    testHarness = *th;
+    return true;
+}
+
+extern "C" MEMCACHED_PUBLIC_API
+engine_test_t* get_tests(void) {
+
+    static engine_test_t tests[]  = {
+        {"test warmup", test_warmup, NULL, teardown, NULL,
+         NULL, NULL},
+        {NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+    };
+    return tests;
+}
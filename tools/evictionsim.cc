@@ -0,0 +1,480 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Replay an access trace (see AccessTrace, recorded with the
+ * access_trace flush param) against the engine's hash tables and
+ * eviction policies, for each combination of the memory sizes and
+ * policies given, and report how many of the gets would have found
+ * their values in memory.
+ *
+ * The item pager runs every so many ops of the trace instead of every
+ * few seconds, the way ItemPager does: once memory is above the high
+ * watermark, it visits the vbuckets with the policy until it's back
+ * under the low one.  Every item is taken to be persisted as soon as
+ * it's stored, and the checkpoints' memory isn't counted, so the
+ * results are the best the policy could do with that much memory.
+ *
+ * Each run prints a line of
+ *
+ *   policy=<name> max_size=<bytes> gets=<n> hits=<n> bg_fetches=<n>
+ *   misses=<n> hit_ratio=<r> sets=<n> oom=<n> pager_runs=<n>
+ *   ejected=<n> peak_mem=<bytes>
+ *
+ * where hits are the gets found resident, bg_fetches the ones that had
+ * to be read from disk and misses those of keys that didn't exist.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "access_trace.h"
+#include "ep_time.h"
+#include "eviction_policy.h"
+#include "item.h"
+#include "stats.h"
+#include "stored-value.h"
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    static time_t basic_abs_time(rel_time_t) {
+        return time(NULL);
+    }
+}
+
+//! The settings of one run
+struct SimConfig {
+    SimConfig() : maxSize(0), lowWatPct(75), highWatPct(85),
+                  activeVbPcnt(40), mutationMemPct(95),
+                  pagerInterval(10000), fullEviction(false) { }
+
+    size_t maxSize;
+    size_t lowWatPct;
+    size_t highWatPct;
+    size_t activeVbPcnt;
+    size_t mutationMemPct;
+    size_t pagerInterval;
+    bool fullEviction;
+    std::string policy;
+};
+
+//! What a run found
+struct SimResult {
+    SimResult() : gets(0), hits(0), bgFetches(0), misses(0), sets(0),
+                  dels(0), oom(0), pagerRuns(0), ejected(0), peakMem(0) { }
+
+    size_t gets;
+    size_t hits;
+    size_t bgFetches;
+    size_t misses;
+    size_t sets;
+    size_t dels;
+    size_t oom;
+    size_t pagerRuns;
+    size_t ejected;
+    size_t peakMem;
+};
+
+/**
+ * One vbucket's sweep of a pager run, as PagingVisitor does it for the
+ * items of a real vbucket.
+ */
+class SimPagingVisitor : public HashTableVisitor {
+public:
+    SimPagingVisitor(EPStats &st, HashTable &h, EvictionPolicy &pol,
+                     double pcnt, size_t target, bool full)
+        : stats(st), ht(h), policy(pol), percent(pcnt), bucketTarget(target),
+          freed(0), ejected(0), fullEviction(full) { }
+
+    void visit(StoredValue *v) {
+        if (v->isDeleted() || v->isTempItem() ||
+            !policy.shouldEvict(v, percent)) {
+            return;
+        }
+        if (fullEviction) {
+            if (!v->isDirty()) {
+                toEvict.push_back(v->getKey());
+                freed += v->size();
+            }
+            return;
+        }
+        size_t len = v->valuelen();
+        if (v->ejectValue(stats, ht)) {
+            ++ejected;
+            freed += len;
+            policy.evicted(v);
+        }
+    }
+
+    bool shouldContinue() {
+        return freed < bucketTarget;
+    }
+
+    //! Remove the items picked in full eviction mode, once the sweep's done.
+    void evictItems() {
+        std::list<std::string>::iterator it;
+        for (it = toEvict.begin(); it != toEvict.end(); ++it) {
+            int bucket_num(0);
+            LockHolder lh = ht.getLockedBucket(*it, &bucket_num);
+            if (ht.unlocked_evict(*it, bucket_num)) {
+                ++ejected;
+            }
+        }
+        toEvict.clear();
+    }
+
+    size_t getEjected() const {
+        return ejected;
+    }
+
+private:
+    EPStats &stats;
+    HashTable &ht;
+    EvictionPolicy &policy;
+    double percent;
+    size_t bucketTarget;
+    size_t freed;
+    size_t ejected;
+    bool fullEviction;
+    std::list<std::string> toEvict;
+};
+
+/**
+ * A bucket's hash tables, with the items of a trace replayed into them.
+ */
+class Simulation {
+public:
+    Simulation(const SimConfig &c) : config(c),
+        policy(EvictionPolicy::create(c.policy)), memUsed(0), ops(0) { }
+
+    ~Simulation() {
+        std::map<uint16_t, HashTable*>::iterator it;
+        for (it = tables.begin(); it != tables.end(); ++it) {
+            delete it->second;
+        }
+        delete policy;
+    }
+
+    void replay(const AccessTraceRecord &rec) {
+        HashTable &ht = getTable(rec.vbucket);
+        size_t before = ht.getItemMemory();
+        std::string key = keyOf(rec);
+
+        switch (rec.op) {
+        case ACCESS_TRACE_GET:
+            get(ht, key, rec);
+            break;
+        case ACCESS_TRACE_SET:
+            set(ht, key, rec);
+            break;
+        case ACCESS_TRACE_DEL:
+            ++result.dels;
+            ht.del(key);
+            onDisk.erase(rec.keyHash);
+            break;
+        }
+        account(ht, before);
+
+        if (++ops % config.pagerInterval == 0 &&
+            memUsed > config.maxSize * config.highWatPct / 100) {
+            runPager();
+        }
+    }
+
+    const SimResult &getResult() const {
+        return result;
+    }
+
+private:
+    //! A key of the recorded length, unique to the recorded hash
+    static std::string keyOf(const AccessTraceRecord &rec) {
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx",
+                 static_cast<unsigned long long>(rec.keyHash));
+        std::string key(buf);
+        if (rec.nkey > key.size()) {
+            key.append(rec.nkey - key.size(), '_');
+        }
+        return key;
+    }
+
+    HashTable &getTable(uint16_t vbucket) {
+        HashTable *&ht = tables[vbucket];
+        if (ht == NULL) {
+            ht = new HashTable(stats);
+        }
+        return *ht;
+    }
+
+    //! Count the memory a table's gained or lost since it had before.
+    void account(HashTable &ht, size_t before) {
+        memUsed += ht.getItemMemory();
+        memUsed -= before;
+        if (ht.getNumItems() > ht.getSize() * 2) {
+            ht.resize();
+        }
+        result.peakMem = std::max(result.peakMem, memUsed);
+    }
+
+    /**
+     * A value of the given size.  The items share their values, which
+     * they're still charged for in full, so a run needs memory for the
+     * keys but not for the values.
+     */
+    value_t valueOf(size_t nbytes) {
+        std::map<size_t, value_t>::iterator it = values.find(nbytes);
+        if (it == values.end()) {
+            std::string data(nbytes, 'x');
+            it = values.insert(std::make_pair(nbytes,
+                                              value_t(Blob::New(data.data(),
+                                                                nbytes)))).first;
+        }
+        return it->second;
+    }
+
+    //! Store an item, clean, as if it was persisted right away.
+    void store(HashTable &ht, const std::string &key, size_t nbytes) {
+        Item itm(key, 0, 0, valueOf(nbytes), 0);
+        int bucket_num(0);
+        LockHolder lh = ht.getLockedBucket(key, &bucket_num);
+        StoredValue *v = ht.unlocked_find(key, bucket_num, true, false);
+        ht.unlocked_set(v, itm, 0, true, false);
+        v = ht.unlocked_find(key, bucket_num, false, false);
+        if (v) {
+            v->markClean();
+        }
+    }
+
+    void get(HashTable &ht, const std::string &key,
+             const AccessTraceRecord &rec) {
+        ++result.gets;
+        int bucket_num(0);
+        LockHolder lh = ht.getLockedBucket(key, &bucket_num);
+        StoredValue *v = ht.unlocked_find(key, bucket_num);
+        if (v && v->isResident()) {
+            ++result.hits;
+        } else if (v) {
+            ++result.bgFetches;
+            Item itm(key, 0, 0, valueOf(rec.nbytes), v->getCas());
+            v->unlocked_restoreValue(&itm, ht);
+        } else if (config.fullEviction && onDisk.count(rec.keyHash)) {
+            ++result.bgFetches;
+            lh.unlock();
+            store(ht, key, rec.nbytes);
+        } else {
+            ++result.misses;
+        }
+    }
+
+    void set(HashTable &ht, const std::string &key,
+             const AccessTraceRecord &rec) {
+        ++result.sets;
+        if (memUsed + key.size() + rec.nbytes >
+            config.maxSize * config.mutationMemPct / 100) {
+            ++result.oom;
+            return;
+        }
+        store(ht, key, rec.nbytes);
+        if (config.fullEviction) {
+            onDisk.insert(rec.keyHash);
+        }
+    }
+
+    //! The item pager's run, over the vbuckets in order.
+    void runPager() {
+        ++result.pagerRuns;
+        double lower = static_cast<double>(config.maxSize) *
+            config.lowWatPct / 100;
+        double bias = static_cast<double>(config.activeVbPcnt) / 50;
+        bool completePhase = true;
+        std::map<uint16_t, HashTable*>::iterator it;
+        for (it = tables.begin(); it != tables.end(); ++it) {
+            double current = static_cast<double>(memUsed);
+            if (current <= lower) {
+                completePhase = false;
+                break;
+            }
+            HashTable &ht = *it->second;
+            double percent = std::min((current - lower) / current, 1.0) * bias;
+            size_t target = static_cast<size_t>(ht.cacheSize.get() * percent);
+            size_t before = ht.getItemMemory();
+            SimPagingVisitor pv(stats, ht, *policy, percent, target,
+                                config.fullEviction);
+            ht.sweep(pv, ht.getSize());
+            pv.evictItems();
+            result.ejected += pv.getEjected();
+            memUsed += ht.getItemMemory();
+            memUsed -= before;
+        }
+        policy->runComplete(completePhase);
+    }
+
+    const SimConfig &config;
+    EvictionPolicy *policy;
+    EPStats stats;
+    std::map<uint16_t, HashTable*> tables;
+    std::map<size_t, value_t> values;
+    //! The keys persisted, in full eviction mode
+    std::set<uint64_t> onDisk;
+    size_t memUsed;
+    size_t ops;
+    SimResult result;
+};
+
+static void usage(void)
+{
+    std::cerr << "Usage: eviction_sim -f trace -m size[,size...]"
+              << " [-p policy[,policy...]] [-l low %] [-h high %]"
+              << " [-a active vb %] [-t mutation mem %] [-i pager interval]"
+              << " [-e]" << std::endl
+              << "\tReplays the trace for each memory size (in bytes) and"
+              << " eviction policy" << std::endl
+              << "\t(nru or clock_pro); -e evicts whole items, as"
+              << " full_eviction does." << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+static size_t parseSize(const char *arg)
+{
+    char *end = NULL;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0') {
+        usage();
+    }
+    return static_cast<size_t>(v);
+}
+
+static std::vector<std::string> splitList(const char *arg)
+{
+    std::vector<std::string> rv;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            rv.push_back(item);
+        }
+    }
+    return rv;
+}
+
+int main(int argc, char **argv)
+{
+    const char *traceFile = NULL;
+    std::vector<std::string> sizes;
+    std::vector<std::string> policies;
+    policies.push_back("nru");
+    SimConfig base;
+
+    int cmd;
+    while ((cmd = getopt(argc, argv, "f:m:p:l:h:a:t:i:e")) != -1) {
+        switch (cmd) {
+        case 'f':
+            traceFile = optarg;
+            break;
+        case 'm':
+            sizes = splitList(optarg);
+            break;
+        case 'p':
+            policies = splitList(optarg);
+            break;
+        case 'l':
+            base.lowWatPct = parseSize(optarg);
+            break;
+        case 'h':
+            base.highWatPct = parseSize(optarg);
+            break;
+        case 'a':
+            base.activeVbPcnt = parseSize(optarg);
+            break;
+        case 't':
+            base.mutationMemPct = parseSize(optarg);
+            break;
+        case 'i':
+            base.pagerInterval = parseSize(optarg);
+            break;
+        case 'e':
+            base.fullEviction = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (traceFile == NULL || sizes.empty() || policies.empty() ||
+        base.lowWatPct > base.highWatPct || base.highWatPct > 100 ||
+        base.activeVbPcnt > 100 || base.pagerInterval == 0) {
+        usage();
+    }
+
+    // There's no engine, so nothing for the memory tracking to go to.
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    ep_current_time = basic_current_time;
+    ep_abs_time = basic_abs_time;
+
+    for (size_t s = 0; s < sizes.size(); ++s) {
+        for (size_t p = 0; p < policies.size(); ++p) {
+            SimConfig config(base);
+            config.maxSize = parseSize(sizes[s].c_str());
+            config.policy = policies[p];
+
+            AccessTraceReader reader;
+            if (!reader.open(traceFile)) {
+                std::cerr << "Failed to read the access trace " << traceFile
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+            Simulation sim(config);
+            AccessTraceRecord rec;
+            while (reader.next(rec)) {
+                sim.replay(rec);
+            }
+
+            const SimResult &r = sim.getResult();
+            size_t found = r.hits + r.bgFetches;
+            printf("policy=%s max_size=%llu gets=%llu hits=%llu "
+                   "bg_fetches=%llu misses=%llu hit_ratio=%.4f sets=%llu "
+                   "oom=%llu pager_runs=%llu ejected=%llu peak_mem=%llu\n",
+                   config.policy.c_str(),
+                   (unsigned long long)config.maxSize,
+                   (unsigned long long)r.gets, (unsigned long long)r.hits,
+                   (unsigned long long)r.bgFetches,
+                   (unsigned long long)r.misses,
+                   found ? (double)r.hits / found : 0.0,
+                   (unsigned long long)r.sets, (unsigned long long)r.oom,
+                   (unsigned long long)r.pagerRuns,
+                   (unsigned long long)r.ejected,
+                   (unsigned long long)r.peakMem);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -34,6 +34,7 @@
 using namespace std;
 
 stringstream prototypes;
+stringstream cachedValues;
 stringstream initialization;
 stringstream implementation;
 
@@ -293,10 +294,23 @@ static void generate(cJSON *o) {
     string validator = getValidator(config_name,
                                     cJSON_GetObjectItem(o, "validator"));
 
+    // Strings can't be read atomically, so only they go through the map;
+    // the getters of the rest read a copy their listener keeps up to date.
+    bool cached = type.compare("std::string") != 0;
+
     // Generate prototypes
     prototypes << "    " << type
                << " " << getGetterPrefix(type)
-               << cppname << "() const;" << endl;
+               << cppname << "() const";
+    if (cached) {
+        prototypes << " {" << endl
+                   << "        return cached" << cppname << ";" << endl
+                   << "    }" << endl;
+        cachedValues << "    volatile " << type << " cached" << cppname
+                     << ";" << endl;
+    } else {
+        prototypes << ";" << endl;
+    }
     if  (!isReadOnly(o)) {
         prototypes << "    void set" << cppname << "(const " << type
                    << " &nval);" << endl;
@@ -313,13 +327,19 @@ static void generate(cJSON *o) {
         initialization << "    setValueValidator(\"" << config_name
                        << "\", " << validator << ");" << endl;
     }
-
-
-    // Generate the getter
-    implementation << type << " Configuration::" << getGetterPrefix(type)
-                   << cppname << "() const {" << endl
-                   << "    return " << getters[type] << "(\""
-                   << config_name << "\");" << endl << "}" << endl;
+    if (cached) {
+        initialization << "    cached" << cppname << " = " << getters[type]
+                       << "(\"" << config_name << "\");" << endl
+                       << "    addValueChangedListener(\"" << config_name
+                       << "\", new CachedValueListener<" << type
+                       << ">(cached" << cppname << "));" << endl;
+    } else {
+        // Generate the getter
+        implementation << type << " Configuration::" << getGetterPrefix(type)
+                       << cppname << "() const {" << endl
+                       << "    return " << getters[type] << "(\""
+                       << config_name << "\");" << endl << "}" << endl;
+    }
 
     if  (!isReadOnly(o)) {
         // generate the setter
@@ -370,7 +390,12 @@ int main(int argc, char **argv) {
     for (int ii = 0; ii < num; ++ii) {
         generate(cJSON_GetArrayItem(params, ii));
     }
-    prototypes << "#endif  // SRC_GENERATED_CONFIGURATION_H_" << endl;
+    prototypes << endl
+               << "private:" << endl
+               << cachedValues.str()
+               << endl
+               << "public:" << endl
+               << "#endif  // SRC_GENERATED_CONFIGURATION_H_" << endl;
 
     ofstream headerfile("src/generated_configuration.h");
     headerfile << prototypes.str();
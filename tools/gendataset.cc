@@ -0,0 +1,383 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Write a synthetic data set for warmup to load: a couchstore file of
+ * active items for each vbucket, as the engine would have flushed them,
+ * and an access log of some of their keys.
+ *
+ * The same options always write the same items.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "libcouchstore/couch_db.h"
+
+#include "common.h"
+#include "mutation_log.h"
+
+static void usage(void)
+{
+    std::cerr << "Usage: gen_dataset -d dir [-n items] [-v vbuckets]"
+              << " [-s value size] [-t tombstone %] [-a access log %]"
+              << " [-l access log] [-b batch size]" << std::endl
+              << "\tWrites dir/<vb>.couch.1 for each vbucket, and an access"
+              << " log (dir/access.log" << std::endl
+              << "\tby default) of the given percentage of the live items."
+              << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+static size_t parseSize(const char *arg)
+{
+    char *end = NULL;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0') {
+        usage();
+    }
+    return static_cast<size_t>(v);
+}
+
+//! Whether the i'th item is a tombstone, for tombstones spread evenly
+static bool isTombstone(size_t i, size_t pct)
+{
+    return (i * 37) % 100 < pct;
+}
+
+//! Whether the i'th item's key goes in the access log
+static bool isLogged(size_t i, size_t pct)
+{
+    return (i * 61 + 17) % 100 < pct;
+}
+
+/**
+ * The items of one vbucket's file, saved in batches.
+ */
+class VBucketFile {
+public:
+    VBucketFile(const std::string &dir, uint16_t id) : vbid(id), db(NULL),
+                                                       maxDeletedSeqno(0)
+    {
+        std::stringstream ss;
+        ss << dir << "/" << vbid << ".couch.1";
+        fileName = ss.str();
+    }
+
+    ~VBucketFile() {
+        clear();
+    }
+
+    bool open() {
+        couchstore_error_t err = couchstore_open_db(fileName.c_str(),
+                                                    COUCHSTORE_OPEN_FLAG_CREATE,
+                                                    &db);
+        if (err != COUCHSTORE_SUCCESS) {
+            std::cerr << "Failed to create " << fileName << ": "
+                      << couchstore_strerror(err) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void add(const std::string &key, const std::string &value, bool deleted,
+             uint64_t cas, uint32_t deletedAt) {
+        Doc *doc = new Doc;
+        DocInfo *info = new DocInfo;
+        memset(doc, 0, sizeof(Doc));
+        memset(info, 0, sizeof(DocInfo));
+
+        char *k = new char[key.size()];
+        memcpy(k, key.data(), key.size());
+        doc->id.buf = info->id.buf = k;
+        doc->id.size = info->id.size = key.size();
+
+        if (!deleted && !value.empty()) {
+            char *v = new char[value.size()];
+            memcpy(v, value.data(), value.size());
+            doc->data.buf = v;
+            doc->data.size = value.size();
+        }
+
+        // cas, exptime (the time of deletion of a tombstone) and flags,
+        // as CouchRequest writes them.
+        char *meta = new char[16];
+        uint64_t ncas = htonll(cas);
+        uint32_t exptime = htonl(deleted ? deletedAt : 0);
+        uint32_t flags = 0;
+        memcpy(meta, &ncas, 8);
+        memcpy(meta + 8, &exptime, 4);
+        memcpy(meta + 12, &flags, 4);
+        info->rev_meta.buf = meta;
+        info->rev_meta.size = 16;
+        info->rev_seq = 1;
+        info->deleted = deleted ? 1 : 0;
+        info->size = doc->data.size;
+        info->content_meta = COUCH_DOC_NON_JSON_MODE;
+        if (doc->data.size > 0) {
+            info->content_meta |= COUCH_DOC_IS_COMPRESSED;
+        }
+
+        docs.push_back(doc);
+        infos.push_back(info);
+    }
+
+    size_t pending() const {
+        return docs.size();
+    }
+
+    /**
+     * Save the items added since the last save, and commit them.
+     *
+     * @param seqnos set to the seqnos they were given
+     */
+    bool save(std::vector<uint64_t> &seqnos) {
+        seqnos.clear();
+        if (docs.empty()) {
+            return true;
+        }
+        couchstore_error_t err = couchstore_save_documents(db, &docs[0],
+                                                           &infos[0],
+                                                           docs.size(),
+                                                           COMPRESS_DOC_BODIES);
+        if (err == COUCHSTORE_SUCCESS) {
+            err = couchstore_commit(db);
+        }
+        if (err != COUCHSTORE_SUCCESS) {
+            std::cerr << "Failed to save the items of " << fileName << ": "
+                      << couchstore_strerror(err) << std::endl;
+            return false;
+        }
+        for (size_t i = 0; i < infos.size(); ++i) {
+            seqnos.push_back(infos[i]->db_seq);
+            if (infos[i]->deleted && infos[i]->db_seq > maxDeletedSeqno) {
+                maxDeletedSeqno = infos[i]->db_seq;
+            }
+        }
+        clear();
+        return true;
+    }
+
+    //! Write the vbucket's state, as CouchKVStore::saveVBState does, and close.
+    bool close() {
+        std::stringstream jsonState;
+        jsonState << "{\"state\": \"active\", \"checkpoint_id\": \"1\""
+                  << ", \"max_deleted_seqno\": \"" << maxDeletedSeqno
+                  << "\", \"purge_seqno\": \"0\"}";
+        std::string state = jsonState.str();
+
+        LocalDoc lDoc;
+        lDoc.id.buf = (char *)"_local/vbstate";
+        lDoc.id.size = sizeof("_local/vbstate") - 1;
+        lDoc.json.buf = const_cast<char *>(state.c_str());
+        lDoc.json.size = state.size();
+        lDoc.deleted = 0;
+
+        couchstore_error_t err = couchstore_save_local_document(db, &lDoc);
+        if (err == COUCHSTORE_SUCCESS) {
+            err = couchstore_commit(db);
+        }
+        couchstore_close_db(db);
+        db = NULL;
+        if (err != COUCHSTORE_SUCCESS) {
+            std::cerr << "Failed to save the state of " << fileName << ": "
+                      << couchstore_strerror(err) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    void clear() {
+        for (size_t i = 0; i < docs.size(); ++i) {
+            delete []docs[i]->id.buf;
+            delete []docs[i]->data.buf;
+            delete []infos[i]->rev_meta.buf;
+            delete docs[i];
+            delete infos[i];
+        }
+        docs.clear();
+        infos.clear();
+    }
+
+    uint16_t vbid;
+    std::string fileName;
+    Db *db;
+    std::vector<Doc*> docs;
+    std::vector<DocInfo*> infos;
+    uint64_t maxDeletedSeqno;
+};
+
+int main(int argc, char **argv)
+{
+    const char *dir = NULL;
+    const char *alogPath = NULL;
+    size_t items = 100000;
+    size_t numVBuckets = 16;
+    size_t valueSize = 256;
+    size_t tombstonePct = 0;
+    size_t loggedPct = 50;
+    size_t batchSize = 1000;
+
+    int cmd;
+    while ((cmd = getopt(argc, argv, "d:n:v:s:t:a:l:b:")) != -1) {
+        switch (cmd) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'n':
+            items = parseSize(optarg);
+            break;
+        case 'v':
+            numVBuckets = parseSize(optarg);
+            break;
+        case 's':
+            valueSize = parseSize(optarg);
+            break;
+        case 't':
+            tombstonePct = parseSize(optarg);
+            break;
+        case 'a':
+            loggedPct = parseSize(optarg);
+            break;
+        case 'l':
+            alogPath = optarg;
+            break;
+        case 'b':
+            batchSize = parseSize(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (dir == NULL || numVBuckets == 0 || numVBuckets > UINT16_MAX ||
+        tombstonePct > 100 || loggedPct > 100 || batchSize == 0) {
+        usage();
+    }
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        std::cerr << "Failed to create " << dir << ": " << strerror(errno)
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::string alog = alogPath ? alogPath : std::string(dir) + "/access.log";
+    remove(alog.c_str());
+    MutationLog accessLog(alog);
+    accessLog.open();
+    if (!accessLog.isEnabled()) {
+        std::cerr << "Failed to create " << alog << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<VBucketFile*> files;
+    for (size_t i = 0; i < numVBuckets; ++i) {
+        std::stringstream ss;
+        ss << dir << "/" << i << ".couch.1";
+        remove(ss.str().c_str());
+        files.push_back(new VBucketFile(dir, static_cast<uint16_t>(i)));
+        if (!files.back()->open()) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The values are the same printable bytes turned at each key, which
+    // snappy shrinks about as much as it does typical documents.
+    std::string pattern;
+    for (size_t i = 0; i < valueSize + 64; ++i) {
+        pattern.push_back(static_cast<char>('a' + (i * 7 + i / 13) % 26));
+    }
+    uint32_t deletedAt = static_cast<uint32_t>(time(NULL));
+
+    // The keys and whether they're logged of each vbucket's unsaved items
+    std::vector<std::vector<std::pair<std::string, bool> > > batches(numVBuckets);
+    std::vector<uint64_t> seqnos;
+    size_t live = 0, tombstones = 0, logged = 0;
+    uint64_t bytes = 0;
+
+    for (size_t i = 0; i <= items; ++i) {
+        if (i < items) {
+            uint16_t vb = static_cast<uint16_t>(i % numVBuckets);
+            std::stringstream ss;
+            ss << "key_" << i;
+            std::string key = ss.str();
+            bool deleted = isTombstone(i, tombstonePct);
+            std::string value = pattern.substr(i % 64, valueSize);
+            files[vb]->add(key, value, deleted, i + 1, deletedAt);
+            batches[vb].push_back(std::make_pair(key,
+                                                 !deleted &&
+                                                 isLogged(i, loggedPct)));
+            if (deleted) {
+                ++tombstones;
+            } else {
+                ++live;
+                bytes += key.size() + valueSize;
+            }
+            if (files[vb]->pending() < batchSize) {
+                continue;
+            }
+        }
+
+        // Save the full batch, or all of them once every item is added.
+        for (size_t vb = 0; vb < numVBuckets; ++vb) {
+            if (i < items && files[vb]->pending() < batchSize) {
+                continue;
+            }
+            if (!files[vb]->save(seqnos)) {
+                return EXIT_FAILURE;
+            }
+            for (size_t j = 0; j < seqnos.size(); ++j) {
+                if (batches[vb][j].second) {
+                    accessLog.newItem(static_cast<uint16_t>(vb),
+                                      batches[vb][j].first, seqnos[j]);
+                    ++logged;
+                }
+            }
+            batches[vb].clear();
+        }
+    }
+
+    accessLog.commit1();
+    accessLog.commit2();
+    accessLog.flush();
+    accessLog.close();
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!files[i]->close()) {
+            return EXIT_FAILURE;
+        }
+        delete files[i];
+    }
+
+    std::cout << "items=" << live << " tombstones=" << tombstones
+              << " vbuckets=" << numVBuckets << " bytes=" << bytes
+              << " logged=" << logged << std::endl;
+    return EXIT_SUCCESS;
+}